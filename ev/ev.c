@@ -2789,6 +2789,12 @@ ev_backend (EV_P) EV_THROW
   return backend;
 }
 
+int
+ev_backend_fd (EV_P) EV_THROW
+{
+  return backend_fd;
+}
+
 #if EV_FEATURE_API
 unsigned int
 ev_iteration (EV_P) EV_THROW
@@ -612,6 +612,10 @@ EV_API_DECL void ev_loop_fork (EV_P) EV_NOEXCEPT;
 
 EV_API_DECL unsigned int ev_backend (EV_P) EV_NOEXCEPT; /* backend in use by loop */
 
+/* qtnetworkng: the epoll or kqueue fd of loop, -1 for the select and poll backends. */
+/* it is readable when ev_run (EVRUN_NOWAIT) has something to do, for embedding the loop into qt */
+EV_API_DECL int ev_backend_fd (EV_P) EV_NOEXCEPT;
+
 EV_API_DECL void ev_now_update (EV_P) EV_NOEXCEPT; /* update event loop time */
 
 #if EV_WALK_ENABLE
@@ -66,7 +66,10 @@ public:
     bool operator!=(const Certificate &other) const { return !(*this == other); }
     bool operator==(const Certificate &other) const;
 public:
+    // the certificates loaded from the same bytes share one parsed object.
     static Certificate load(const QByteArray& data, Ssl::EncodingFormat format = Ssl::Pem);
+    // loads every certificate of a bundle, such as the ca file of system.
+    static QList<Certificate> loadAll(const QByteArray &data, Ssl::EncodingFormat format = Ssl::Pem);
     static Certificate generate(const PrivateKey &key, MessageDigest::Algorithm signAlgo,
                                 long serialNumber,
                                 const QDateTime &effectiveDate,
@@ -2,6 +2,7 @@
 #define QTNG_CIPHER_H
 
 #include <QtCore/qpair.h>
+#include <QtCore/qsharedpointer.h>
 #include "md.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
@@ -33,6 +34,7 @@ public:
         OFB = 5,
         CTR = 6,
         OPENPGP = 7,
+        GCM = 8,        // AES only. see setAad(), tag() and setTag(), or AeadCipher for one message at a time.
     };
     enum Operation
     {
@@ -48,6 +50,9 @@ public:
     bool setKey(const QByteArray &key);
     QByteArray key() const;
     bool setInitialVector(const QByteArray &iv);
+    // sets the iv of next message, the expanded key is kept. it is much cheaper than setKey() for per packet nonces.
+    bool reset(const char *iv, int len);
+    bool reset(const QByteArray &iv) { return reset(iv.constData(), iv.size()); }
     QByteArray initialVector() const;
     inline QByteArray iv() const { return initialVector(); }
     bool setPassword(const QByteArray &password, const QByteArray &salt,
@@ -67,6 +72,16 @@ public:
     QByteArray addData(const QByteArray &data) { return addData(data.constData(), data.size()); }
     QByteArray addData(const char *data, int len);
     QByteArray finalData();
+    // writes to the buffer of caller, returns the bytes written or -1. out holds len + blockSize() bytes,
+    // or equals data for the stream modes such as CTR and GCM.
+    int addData(const char *data, int len, char *out);
+    int finalData(char *out);
+    // the additional data authenticated by GCM, before addData(). the tag of encryption is got after finalData(),
+    // and the tag of decryption is set before finalData(), which fails if the data is forged.
+    bool setAad(const char *aad, int len);
+    bool setAad(const QByteArray &aad) { return setAad(aad.constData(), aad.size()); }
+    QByteArray tag() const;
+    bool setTag(const QByteArray &tag);
 public:
     QByteArray update(const QByteArray &data) { return addData(data.constData(), data.size()); }
     QByteArray update(const char *data, int len) { return addData(data, len); }
@@ -76,6 +91,56 @@ public:
 private:
     CipherPrivate * const d_ptr;
     Q_DECLARE_PRIVATE(Cipher)
+    friend class CipherKey;
+};
+
+
+// a key expanded once and never changed, so it is shared by threads. the ciphers made by newCipher() copy the
+// expanded key instead of running the key schedule again.
+class CipherKeyPrivate;
+class CipherKey
+{
+public:
+    CipherKey(Cipher::Algorithm algo, Cipher::Mode mode, Cipher::Operation operation, const QByteArray &key);
+public:
+    bool isValid() const;
+    Cipher *newCipher(const QByteArray &iv) const;
+private:
+    QSharedPointer<CipherKeyPrivate> d;
+};
+
+
+// authenticated encryption of one message at a time, every message has its own nonce. unlike Cipher, one object
+// seals and opens any number of messages with the key expanded once, and may be shared by threads.
+class AeadCipherPrivate;
+class AeadCipher
+{
+public:
+    enum Algorithm
+    {
+        AES128GCM = 1,
+        AES256GCM = 2,
+        ChaCha20Poly1305 = 3,
+    };
+public:
+    AeadCipher(Algorithm algo, const QByteArray &key);
+    ~AeadCipher();
+public:
+    bool isValid() const;
+    int nonceSize() const;
+    int tagSize() const;
+    static int keySize(Algorithm algo);
+    // encrypts data in place, the buffer must hold size + tagSize() bytes. returns the size sealed, or -1.
+    int seal(const char *nonce, char *data, int size, const char *ad = nullptr, int adSize = 0);
+    // decrypts data in place, returns the size of plain data, or -1 if it is forged.
+    int open(const char *nonce, char *data, int size, const char *ad = nullptr, int adSize = 0);
+    // returns the sealed data with the tag, or the plain data. a null QByteArray if it failed or is forged.
+    QByteArray seal(const QByteArray &nonce, const QByteArray &ad, const QByteArray &plain);
+    QByteArray open(const QByteArray &nonce, const QByteArray &ad, const QByteArray &sealed);
+private:
+    AeadCipherPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(AeadCipher)
+    Q_DISABLE_COPY(AeadCipher)
 };
 
 QTNETWORKNG_NAMESPACE_END
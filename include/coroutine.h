@@ -9,7 +9,10 @@
 
 
 #ifndef DEFAULT_COROUTINE_STACK_SIZE
-    #ifdef Q_OS_ANDROID
+    #if defined(QTNG_COROUTINE_STACK_GUARD)
+        // an overflow hits the guard page instead of other mappings, so a small stack is safe.
+        #define DEFAULT_COROUTINE_STACK_SIZE 1024 * 128
+    #elif defined(Q_OS_ANDROID)
         #define DEFAULT_COROUTINE_STACK_SIZE 1024 * 256
     #else
         #define DEFAULT_COROUTINE_STACK_SIZE 1024 * 1024 * 8
@@ -62,6 +65,13 @@ public:
         Stopped,
         Joined,
     };
+    // the woken coroutines of higher priority are resumed first, and go before the lower ones waiting for the same lock.
+    enum Priority
+    {
+        HighPriority = 0,
+        NormalPriority = 1,
+        IdlePriority = 2,
+    };
     explicit BaseCoroutine(BaseCoroutine *previous, size_t stackSize = DEFAULT_COROUTINE_STACK_SIZE);
     virtual ~BaseCoroutine();
 
@@ -71,11 +81,34 @@ public:
     bool raise(CoroutineException *exception = nullptr);
     bool yield();
     quintptr id() const;
+    Priority priority() const;
+    void setPriority(Priority priority);
 
     BaseCoroutine *previous() const;
     void setPrevious(BaseCoroutine *previous);
 
+    size_t stackSize() const;
+    size_t stackUsage() const;  // the high-water mark of stack usage, measured after run() returned.
+    // runs on the stack shared by the coroutines of current thread instead of a stack of its own. the used part is
+    // copied out when another one takes the stack, so a suspended coroutine keeps only the bytes it used, at the
+    // cost of memcpy() while switching. the objects on its stack must not be touched by others while it is switched
+    // out, the locks and CancelScope take care of it. call it before the coroutine runs, it returns false if the
+    // coroutine is started or the backend is not fcontext.
+    bool setSharedStack(bool shared);
+    bool isSharedStack() const;
+
     static BaseCoroutine *current();
+    // paint the stacks of new coroutines so stackUsage() can be measured. it costs a memset() of the whole stack.
+    static void setStackUsageTracking(bool enabled);
+    static bool isStackUsageTracking();
+
+    // the slots of CoroutineLocal<T>, a slot is allocated for every CoroutineLocal<T> and reused after it is freed.
+    // the values set before the slot is freed are not seen by the next owner, they are destroyed lazily.
+    static int allocateLocalSlot(void (*destructor)(void *), void *(*copier)(const void *));
+    static void freeLocalSlot(int slot);
+    void *localData(int slot) const;
+    void setLocalData(int slot, void *data);  // the old value is destroyed.
+    void inheritLocalData(const BaseCoroutine *parent);  // copies the inheritable values of parent.
 public:
     Deferred<BaseCoroutine*> started;
     Deferred<BaseCoroutine*> finished;
@@ -90,6 +123,89 @@ private:
 
 QDebug &operator <<(QDebug &out, const BaseCoroutine& coroutine);
 
+
+// the live coroutines of all threads, with their names, states, creation sites, the primitives they wait for,
+// and the stacks where they are suspended. it needs building with QTNG_COROUTINE_INTROSPECTION, which costs
+// a lock and a backtrace() for every wait, so nothing is recorded by the release builds.
+class CoroutineIntrospection
+{
+public:
+    static bool isAvailable();
+    static int count();
+    static QByteArray dump();
+#ifdef Q_OS_UNIX
+    // writes dump() to stderr when the signal comes, such as SIGUSR1. the dump is made by a thread of its own.
+    static bool dumpOnSignal(int signo);
+#endif
+};
+
+
+// like QThreadStorage, but every coroutine has its own value. the values are destroyed when the coroutine
+// finished, or copied to the coroutines spawned by Coroutine::spawn() if inheritable.
+template<typename T>
+class CoroutineLocal
+{
+public:
+    explicit CoroutineLocal(bool inheritable = false)
+        :slot(BaseCoroutine::allocateLocalSlot(destroy, inheritable ? copy : nullptr)) {}
+    ~CoroutineLocal() { BaseCoroutine::freeLocalSlot(slot); }
+public:
+    bool hasLocalData() const { return BaseCoroutine::current()->localData(slot) != nullptr; }
+    T &localData();
+    T localData() const;
+    void setLocalData(const T &value) { BaseCoroutine::current()->setLocalData(slot, new T(value)); }
+    void removeLocalData() { BaseCoroutine::current()->setLocalData(slot, nullptr); }
+private:
+    static void destroy(void *p) { delete static_cast<T *>(p); }
+    static void *copy(const void *p) { return new T(*static_cast<const T *>(p)); }
+    const int slot;
+    Q_DISABLE_COPY(CoroutineLocal)
+};
+
+
+template<typename T>
+T &CoroutineLocal<T>::localData()
+{
+    BaseCoroutine *current = BaseCoroutine::current();
+    void *p = current->localData(slot);
+    if (!p) {
+        p = new T();
+        current->setLocalData(slot, p);
+    }
+    return *static_cast<T *>(p);
+}
+
+
+template<typename T>
+T CoroutineLocal<T>::localData() const
+{
+    void *p = BaseCoroutine::current()->localData(slot);
+    if (!p) {
+        return T();
+    }
+    return *static_cast<T *>(p);
+}
+
+
+
+// every thread keeps the stacks of finished coroutines, grouped by size, and hands them to
+// new coroutines so spawning one coroutine do not call mmap()/munmap().
+class CoroutineStackPool
+{
+public:
+    static void setHighWaterMark(quint32 count);  // the max number of idle stacks kept for each size.
+    static quint32 highWaterMark();
+    static quint32 prewarm(quint32 count, size_t stackSize = DEFAULT_COROUTINE_STACK_SIZE);  // returns the number of stacks pooled.
+    static quint32 size(size_t stackSize = DEFAULT_COROUTINE_STACK_SIZE);
+    static void clear();
+    // the new stacks are carved out of 2 MiB chunks of huge pages, the reserved ones by MAP_HUGETLB or the
+    // transparent ones by madvise(), preferring the numa node of the thread mapping them. it falls back to the
+    // normal pages. the chunks are never unmapped, and the stacks have no guard between them. call it at
+    // startup, it is ignored out of Linux or with QTNG_COROUTINE_STACK_GUARD.
+    static void setHugePages(bool enabled);
+    static bool isHugePages();
+};
+
 QTNETWORKNG_NAMESPACE_END
 
 #endif // QTNG_COROUTINE_H
@@ -5,6 +5,10 @@
 #include <QtCore/qvariant.h>
 #include <QtCore/qthread.h>
 #include <QtCore/qsharedpointer.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qqueue.h>
+#include <QtCore/qmap.h>
+#include <QtCore/qhash.h>
 #include "locks.h"
 #include "private/eventloop_p.h"
 
@@ -20,6 +24,27 @@ struct LambdaFunctor: public Functor
 };
 
 
+// keeps the callable inline instead of in a std::function, which may allocate again.
+template<typename F>
+struct CallableFunctor: public Functor
+{
+    explicit CallableFunctor(const F &f)
+        :f(f) {}
+    virtual void operator ()() override
+    {
+        f();
+    }
+    F f;
+};
+
+
+template<typename F>
+inline Functor *makeFunctor(const F &f)
+{
+    return new CallableFunctor<F>(f);
+}
+
+
 template<typename T>
 T callInEventLoop(std::function<T ()> func)
 {
@@ -34,7 +59,7 @@ T callInEventLoop(std::function<T ()> func)
         done->set();
     };
 
-    int callbackId = EventLoopCoroutine::get()->callLater(0, new LambdaFunctor(wrapper));
+    qint64 callbackId = EventLoopCoroutine::get()->callLater(0, makeFunctor(wrapper));
     try {
         done->wait();
         EventLoopCoroutine::get()->cancelCall(callbackId);
@@ -57,7 +82,7 @@ inline void callInEventLoop(std::function<void ()> func, int msecs = 0)
         done->set();
     };
 
-    int callbackId = EventLoopCoroutine::get()->callLater(msecs, new LambdaFunctor(wrapper));
+    qint64 callbackId = EventLoopCoroutine::get()->callLater(msecs, makeFunctor(wrapper));
     try {
         done->wait();
         EventLoopCoroutine::get()->cancelCall(callbackId);
@@ -113,36 +138,43 @@ private:
 };
 
 
+// runs func in a pool of threads for the blocking calls, such as dns lookups and file io, while the current
+// coroutine waits. the pool has 64 threads by default, and starts the calls of higher priority first if they are
+// all busy. every eventloop queues blockingQueueLimit() calls at most, the others wait for them to finish. the
+// limit is read when an eventloop calls it first.
+void callInThread(const std::function<void ()> &func, int priority = 0);
+void setBlockingThreadPoolSize(int count);
+int blockingThreadPoolSize();
+void setBlockingQueueLimit(int limit);
+int blockingQueueLimit();
+// starts func in the pool of callInThread() without waiting, the returned event is set when it finishes. the
+// queue limit does not apply, so the callers should bound the calls themselves, such as one read-ahead per file.
+QSharedPointer<Event> callInThreadAsync(const std::function<void ()> &func, int priority = 0);
+
+
 template<typename T>
-T callInThread(std::function<T()> func)
+T callInThread(std::function<T()> func, int priority = 0)
 {
     QSharedPointer<T> result(new T());
-    QSharedPointer<Event> done(new Event);
-
-    LambdaFunctor *yieldCoroutine = new LambdaFunctor([done] { done->set(); });
-    QPointer<EventLoopCoroutine> eventloop = EventLoopCoroutine::get();
-
-    std::function<void()> makeResult = [result, func]() mutable
-    {
-        *result = func();
-    };
-
-    DeferCallThread *thread = new DeferCallThread(makeResult, yieldCoroutine, eventloop);
-    thread->start();
-    done->wait();
+    callInThread([result, func] { *result = func(); }, priority);
     return *result;
 }
 
 
-inline void callInThread(const std::function<void ()> &func)
+// runs func in a pool of worker threads shared by all eventloops, while the current coroutine waits. unlike
+// callInThread(), no thread is made for every call, so the cpu bound jobs are bounded by the size of pool, which is
+// QThread::idealThreadCount() by default. func is kept by the worker if the waiting coroutine is killed.
+void callInThreadPool(const std::function<void ()> &func);
+void setThreadPoolSize(int count);
+int threadPoolSize();
+
+
+template<typename T>
+T callInThreadPool(std::function<T()> func)
 {
-    QSharedPointer<Event> done(new Event);
-    LambdaFunctor *yieldCoroutine = new LambdaFunctor([done] { done->set(); });
-    QPointer<EventLoopCoroutine> eventloop = EventLoopCoroutine::get();
-    DeferCallThread *thread = new DeferCallThread(func, yieldCoroutine, eventloop);
-    thread->start();
-    done->wait();
-    //thread.wait();
+    QSharedPointer<T> result(new T());
+    callInThreadPool([result, func] { *result = func(); });
+    return *result;
 }
 
 
@@ -222,8 +254,11 @@ public:
 
 private:
     void deleteCoroutine(BaseCoroutine *coroutine);
+    void remove(BaseCoroutine *coroutine);
 private:
-    QList<QSharedPointer<Coroutine>> coroutines;
+    // indexed by pointer and name, so adding, finishing and finding one do not scan the others.
+    QHash<BaseCoroutine *, QSharedPointer<Coroutine>> coroutines;
+    QHash<QString, BaseCoroutine *> names;
 };
 
 
@@ -233,7 +268,7 @@ QSharedPointer<Coroutine> CoroutineGroup::spawnWithName(const QString &name, con
     if (!old.isNull()) {
         if (replace) {
             old->kill();
-            coroutines.removeOne(old);
+            remove(old.data());
             old->join();
         } else {
             return old;
@@ -267,7 +302,7 @@ QSharedPointer<Coroutine> CoroutineGroup::spawnInThreadWithName(const QString &n
     if (!old.isNull()) {
         if (replace) {
             old->kill();
-            coroutines.removeOne(old);
+            remove(old.data());
             old->join();
         } else {
             return old;
@@ -279,6 +314,285 @@ QSharedPointer<Coroutine> CoroutineGroup::spawnInThreadWithName(const QString &n
 }
 
 
+// runs a fixed number of event-loop threads. tasks are queued to the least loaded thread and started
+// as coroutines there. a thread with nothing to do steals the tasks which are queued but not yet started
+// from the busiest thread, while the started coroutines keep running in the thread they were started.
+class CoroutineSchedulerPrivate;
+class CoroutineScheduler
+{
+public:
+    explicit CoroutineScheduler(int threads = 0);  // zero means QThread::idealThreadCount()
+    virtual ~CoroutineScheduler();
+public:
+    void spawn(const std::function<void()> &func);  // thread safe.
+    // blocks current coroutine until func finished, threw, or was dropped by stop() without running.
+    void call(const std::function<void()> &func);
+    void stop();                                     // kill all tasks and wait for all threads.
+    int threadCount() const;
+    quint32 pending() const;   // the number of tasks not yet started.
+    quint32 running() const;   // the number of tasks started but not finished.
+    quint64 stolen() const;    // the number of tasks moved to another thread by stealing.
+private:
+    CoroutineSchedulerPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(CoroutineScheduler)
+    Q_DISABLE_COPY(CoroutineScheduler)
+};
+
+
+// runs one eventloop thread for every selected cpu core. every thread is pinned to its core, and prefers the memory of
+// the numa node of the core on Linux. unlike CoroutineScheduler, a task never moves to another thread, so the
+// sharded states, such as the SO_REUSEPORT sockets and kcp sessions, stay in the cache of one core.
+class CoroutineRuntimePrivate;
+class CoroutineRuntime
+{
+public:
+    enum Placement {
+        RoundRobin,
+        LeastLoaded,    // the core with the least tasks queued and running.
+    };
+    // the indexes of cpu, empty means all the cpus this process is allowed to run on.
+    explicit CoroutineRuntime(const QList<int> &cpus = QList<int>(), Placement placement = RoundRobin);
+    virtual ~CoroutineRuntime();
+public:
+    void spawn(const std::function<void()> &func);                   // thread safe.
+    void runOn(int coreIndex, const std::function<void()> &func);    // thread safe, coreIndex is of cpus().
+    void call(int coreIndex, const std::function<void()> &func);     // blocks current coroutine until func finished.
+    void stop();                                                     // kill all tasks and wait for all threads.
+    int coreCount() const;
+    QList<int> cpus() const;
+    int numaNode(int coreIndex) const;  // -1 if unknown.
+    bool isPinned(int coreIndex) const; // false if the affinity is not supported or not allowed.
+    quint32 load(int coreIndex) const;  // the tasks queued and running in the core.
+    Placement placement() const;
+    // the coreIndex of current thread if it is a thread of runtime, -1 otherwise.
+    static int currentCoreIndex();
+private:
+    CoroutineRuntimePrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(CoroutineRuntime)
+    Q_DISABLE_COPY(CoroutineRuntime)
+};
+
+
+// a stackless task for short-lived work. the step function runs in the eventloop coroutine, so a task needs no
+// stack and resuming it costs no context switch. the step function must not block: it arms one wait by the
+// wait functions and returns true to be called again after that, or returns false to finish.
+class TaskPrivate;
+class Task
+{
+public:
+    typedef std::function<bool(Task *task)> Step;
+    static QSharedPointer<Task> spawn(const Step &step);
+    ~Task();
+public:
+    void waitReadable(qintptr fd);
+    void waitWritable(qintptr fd);
+    void msleep(quint32 msecs);
+    void waitEvent(Event *event);  // the step is called soon if the event is set already.
+    template<typename T> void waitQueue(Queue<T> *queue) { waitEvent(&queue->notEmpty); }
+    void kill();
+    bool isFinished() const;
+    bool join();  // called from a stackful coroutine.
+private:
+    explicit Task(const Step &step);
+    TaskPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(Task)
+    Q_DISABLE_COPY(Task)
+};
+
+
+// the waiters of ThreadChannel in one eventloop. the counters are guarded by the mutex of channel, the
+// conditions are used in the thread of eventloop only.
+struct ThreadChannelWaiters
+{
+    explicit ThreadChannelWaiters(EventLoopCoroutine *eventLoop)
+        :eventLoop(eventLoop), getting(0), putting(0) {}
+    EventLoopCoroutine * const eventLoop;
+    Condition notEmpty;
+    Condition notFull;
+    int getting;
+    int putting;
+    QAtomicInt notEmptyPending;   // a wakeup is queued to eventLoop, others are coalesced into it.
+    QAtomicInt notFullPending;
+    // called with the mutex of channel held, wakes the coroutines of eventLoop by callLaterThreadSafe().
+    static void wakeUp(QSharedPointer<ThreadChannelWaiters> waiters, bool notEmpty);
+};
+
+
+// a bounded queue between coroutines of many threads. put() and get() block the current coroutine only,
+// never the thread. the waiters in other eventloops are woken through callLaterThreadSafe(), at most
+// one wakeup is queued to an eventloop at a time.
+template<typename T>
+class ThreadChannel
+{
+public:
+    explicit ThreadChannel(quint32 capacity = 1024)
+        :mCapacity(capacity), closed(false) {}
+public:
+    bool put(const T &e);      // returns false if the channel is closed.
+    T get(bool *ok = nullptr); // *ok is false if the channel is closed and empty.
+    bool tryPut(const T &e);
+    bool tryGet(T *e);
+    void close();              // wakes all waiters, get() still takes the items left.
+    bool isClosed() const { QMutexLocker locker(&mutex); return closed; }
+    quint32 size() const { QMutexLocker locker(&mutex); return static_cast<quint32>(queue.size()); }
+    quint32 capacity() const { return mCapacity; }
+private:
+    QSharedPointer<ThreadChannelWaiters> currentWaiters();
+    void releaseWaiters(const QSharedPointer<ThreadChannelWaiters> &w);
+    void wakeUp(bool notEmpty);
+    bool isFull() const { return mCapacity > 0 && static_cast<quint32>(queue.size()) >= mCapacity; }
+private:
+    mutable QMutex mutex;
+    QQueue<T> queue;
+    QMap<EventLoopCoroutine*, QSharedPointer<ThreadChannelWaiters>> waiters;
+    const quint32 mCapacity;
+    bool closed;
+    Q_DISABLE_COPY(ThreadChannel)
+};
+
+
+template<typename T>
+QSharedPointer<ThreadChannelWaiters> ThreadChannel<T>::currentWaiters()
+{
+    EventLoopCoroutine *eventLoop = EventLoopCoroutine::get();
+    QSharedPointer<ThreadChannelWaiters> &w = waiters[eventLoop];
+    if (w.isNull()) {
+        w.reset(new ThreadChannelWaiters(eventLoop));
+    }
+    return w;
+}
+
+
+// the entry lives while some coroutines of its eventloop wait, so the finished eventloops leave nothing behind.
+template<typename T>
+void ThreadChannel<T>::releaseWaiters(const QSharedPointer<ThreadChannelWaiters> &w)
+{
+    if (w->getting == 0 && w->putting == 0 && waiters.value(w->eventLoop) == w) {
+        waiters.remove(w->eventLoop);
+    }
+}
+
+
+template<typename T>
+void ThreadChannel<T>::wakeUp(bool notEmpty)
+{
+    for (const QSharedPointer<ThreadChannelWaiters> &w: waiters) {
+        if ((notEmpty ? w->getting : w->putting) > 0) {
+            ThreadChannelWaiters::wakeUp(w, notEmpty);
+        }
+    }
+}
+
+
+template<typename T>
+bool ThreadChannel<T>::put(const T &e)
+{
+    QMutexLocker locker(&mutex);
+    while (!closed && isFull()) {
+        QSharedPointer<ThreadChannelWaiters> w = currentWaiters();
+        ++w->putting;
+        locker.unlock();
+        // the wakeup is delivered by this eventloop after we wait, so it can not be lost.
+        bool ok;
+        try {
+            ok = w->notFull.wait();
+        } catch (...) {
+            locker.relock();
+            --w->putting;
+            releaseWaiters(w);
+            throw;
+        }
+        locker.relock();
+        --w->putting;
+        releaseWaiters(w);
+        if (!ok) {
+            return false;
+        }
+    }
+    if (closed) {
+        return false;
+    }
+    queue.enqueue(e);
+    wakeUp(true);
+    return true;
+}
+
+
+template<typename T>
+T ThreadChannel<T>::get(bool *ok)
+{
+    QMutexLocker locker(&mutex);
+    while (!closed && queue.isEmpty()) {
+        QSharedPointer<ThreadChannelWaiters> w = currentWaiters();
+        ++w->getting;
+        locker.unlock();
+        bool woken;
+        try {
+            woken = w->notEmpty.wait();
+        } catch (...) {
+            locker.relock();
+            --w->getting;
+            releaseWaiters(w);
+            throw;
+        }
+        locker.relock();
+        --w->getting;
+        releaseWaiters(w);
+        if (!woken) {
+            break;
+        }
+    }
+    if (queue.isEmpty()) {
+        if (ok) {
+            *ok = false;
+        }
+        return T();
+    }
+    T e = queue.dequeue();
+    wakeUp(false);
+    if (ok) {
+        *ok = true;
+    }
+    return e;
+}
+
+
+template<typename T>
+bool ThreadChannel<T>::tryPut(const T &e)
+{
+    QMutexLocker locker(&mutex);
+    if (closed || isFull()) {
+        return false;
+    }
+    queue.enqueue(e);
+    wakeUp(true);
+    return true;
+}
+
+
+template<typename T>
+bool ThreadChannel<T>::tryGet(T *e)
+{
+    QMutexLocker locker(&mutex);
+    if (queue.isEmpty()) {
+        return false;
+    }
+    *e = queue.dequeue();
+    wakeUp(false);
+    return true;
+}
+
+
+template<typename T>
+void ThreadChannel<T>::close()
+{
+    QMutexLocker locker(&mutex);
+    closed = true;
+    wakeUp(true);
+    wakeUp(false);
+}
+
+
 QTNETWORKNG_NAMESPACE_END
 
 #endif // QTNG_COROUTINE_UTILS_H
@@ -30,6 +30,12 @@ public:
     DataChannel(DataChannelPrivate *d);
     virtual ~DataChannel();
 public:
+    enum CompressionCodec {
+        NoCompression,
+        ZlibCompression,
+        Lz4Compression,    // needs QTNG_HAVE_LZ4.
+        ZstdCompression,   // needs QTNG_HAVE_ZSTD.
+    };
     QString toString() const;
     void setMaxPacketSize(quint32 size);
     quint32 maxPacketSize() const;                      // packet size > maxPacketSize is an error.
@@ -37,6 +43,14 @@ public:
     quint32 payloadSizeHint() const;                    // should be <= maxPacketSize - headerSize
     void setCapacity(quint32 packets);                        // should block if there are n packet not read.
     quint32 capacity() const;                           // so, a data channel may consume `maxPacketSize * capacity` bytes of receiving buffer memory.
+    void setReceivingWindow(quint32 bytes);             // the bytes peer may send before recvPacket() takes them.
+    quint32 receivingWindow() const;                    // bounds the receiving buffer memory of every channel.
+    // returns false if the codec is not built in. the packets are sent uncompressed if the peer can not decode it,
+    // or the packets are small or incompressible. every virtual channel is compressed apart.
+    bool setCompressionCodec(CompressionCodec codec);
+    CompressionCodec compressionCodec() const;
+    // a zstd dictionary trained from typical packets, both peers must use the same one.
+    void setCompressionDictionary(const QByteArray &dictionary);
     DataChannelPole pole() const;
     void setName(const QString &name);
     QString name() const;
@@ -68,16 +82,43 @@ public:
 public:
     void setKeepaliveTimeout(float timeout);
     float keepaliveTimeout() const;
+    // waits so many msecs for more packets before sending a small batch, zero sends at once.
+    void setCoalescingDelay(quint32 msecs);
+    quint32 coalescingDelay() const;
+    // cuts the bigger packets into fragments of so many bytes, so the packets of other channels are not
+    // delayed by them. zero does not cut, the peer must support fragments if it is set.
+    void setFragmentSize(quint32 bytes);
+    quint32 fragmentSize() const;
+    // over a KcpSocket only: the datagrams bypass the packets and the retransmission of kcp, for the real-time data
+    // which is useless if late. see KcpSocket::sendDatagram(), the policies are set by the KcpSocket of receiver.
+    // returns false or an empty datagram for other sockets.
+    bool sendDatagram(const QByteArray &datagram, quint8 channel = 0);
+    QByteArray recvDatagram(quint8 *channel = nullptr);
 private:
     Q_DECLARE_PRIVATE(SocketChannel)
 };
 
+#ifdef Q_OS_UNIX
+// a socket channel between the processes of the same host, passing the packets by two rings of a shared memory
+// segment instead of loopback tcp. the positive pole creates the segment file at path, such as /dev/shm/name,
+// and removes it when closed. the negative pole attaches to it, so it must be made after the positive one.
+class SharedMemoryChannel: public SocketChannel
+{
+    Q_DISABLE_COPY(SharedMemoryChannel)
+public:
+    SharedMemoryChannel(const QString &path, DataChannelPole pole);
+};
+#endif
+
 class VirtualChannelPrivate;
 class VirtualChannel: public DataChannel
 {
     Q_DISABLE_COPY(VirtualChannel)
 public:
     quint32 channelNumber() const;
+    // the higher priority sends first, the same priority shares the bandwidth by weight. only the channels
+    // made by SocketChannel are scheduled, returns false for the nested channels.
+    bool setScheduling(int priority, quint32 weight = 1);
 protected:
     VirtualChannel(DataChannel* parentChannel, DataChannelPole pole, quint32 channelNumber);
 private:
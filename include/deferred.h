@@ -19,21 +19,26 @@ public:
     void addBoth(Callback callback) { addCallbacks(callback, callback); }
     void addCallback(Callback callback);
     void addErrback(Callback errback);
-    void clear() { stack.clear(); }
+    void clear() { first = QPair<Callback, Callback>(); rest.clear(); count = 0; }
     void callback(const ARG &arg) { run(arg, true); }
     void erroback(const ARG &arg) { run(arg, false); }
 private:
     void run(const ARG &arg, bool ok);
+    const QPair<Callback, Callback> &at(int i) const { return i == 0 ? first : rest.at(i - 1); }
 private:
-    QList<QPair<Callback, Callback>> stack;
+    // most coroutines have one callback at most, which is kept inline. addCallback() and addErrback() leave the
+    // other one empty instead of allocating a placeholder.
+    QPair<Callback, Callback> first;
+    QList<QPair<Callback, Callback>> rest;     // the nodes do not move if a callback adds more.
     QPair<ARG, bool> originalResult;
+    int count;
     bool ran;
 };
 
 
 template<typename ARG>
 Deferred<ARG>::Deferred()
-    :ran(false)
+    :originalResult(ARG(), false), count(0), ran(false)
 {
 
 }
@@ -41,29 +46,34 @@ Deferred<ARG>::Deferred()
 template<typename ARG>
 void Deferred<ARG>::addCallbacks(Callback callback, Callback errback)
 {
-     stack.append(qMakePair(callback, errback));
-     if(ran) {
-         if(originalResult.second) {
-             callback(originalResult.first);
-         } else {
-             errback(originalResult.first);
-         }
-     }
+    if (count == 0) {
+        first = qMakePair(callback, errback);
+    } else {
+        rest.append(qMakePair(callback, errback));
+    }
+    ++count;
+    if (ran) {
+        if (originalResult.second) {
+            if (callback) {
+                callback(originalResult.first);
+            }
+        } else if (errback) {
+            errback(originalResult.first);
+        }
+    }
 }
 
 template<typename ARG>
 void Deferred<ARG>::addCallback(Callback callback)
 {
-    Callback errorback = [] (const ARG &) {};
-    addCallbacks(callback, errorback);
+    addCallbacks(callback, Callback());
 }
 
 
 template<typename ARG>
 void Deferred<ARG>::addErrback(Callback errback)
 {
-    Callback callback = [] (const ARG &) {};
-    addCallbacks(callback, errback);
+    addCallbacks(Callback(), errback);
 }
 
 
@@ -73,13 +83,16 @@ void Deferred<ARG>::run(const ARG &arg, bool ok)
     originalResult = qMakePair(arg, ok);
     ran = true;
     bool _ok = ok;
-    for (const QPair<Callback, Callback> &item: stack) {
+    // by index, the callbacks may add more callbacks.
+    for (int i = 0; i < count; ++i) {
+        const Callback &f = _ok ? at(i).first : at(i).second;
+        if (!f) {
+            // an empty one succeeds, as the no-op placeholder did.
+            _ok = true;
+            continue;
+        }
         try {
-            if(_ok) {
-                item.first(arg);
-            } else {
-                item.second(arg);
-            }
+            f(arg);
             _ok = true;
         } catch (...) {
             _ok = false;
@@ -57,13 +57,53 @@ public:
     void restart();
 private:
     quint32 msecs;
-    int timeoutId;
+    qint64 timeoutId;
+};
+
+
+// a deadline for the blocking operations of current coroutine. the scopes are nested and a timer is armed
+// only if the deadline is earlier than the outer ones, it raises TimeoutException like Timeout. the blocking
+// primitives call check() first, so they fail at once after the deadline instead of blocking again.
+class CancelScope
+{
+public:
+    explicit CancelScope(float secs);   // zero means no deadline but cancel().
+    CancelScope(quint32 msecs, int);    // the second parameter is not used.
+    ~CancelScope();
+public:
+    void cancel();                      // can be called from other coroutines.
+    bool isCancelled() const;           // cancelled or expired, this or the outer scopes.
+    qint64 remainingMsecs() const;      // -1 if there is no deadline.
+    static CancelScope *current();
+    static void check();                // throws TimeoutException if the current scope is cancelled.
+private:
+    void init(qint64 msecs);
+    void arm(qint64 msecs);
+private:
+    CancelScope *parent;
+    BaseCoroutine *coroutine;
+    qint64 deadline;                    // the earliest of this and outer scopes, by QElapsedTimer::msecsSinceReference().
+    qint64 timeoutId;
+    bool cancelled;
+    friend struct CancelScopeFunctor;
+    Q_DISABLE_COPY(CancelScope)
 };
 
 
 // useful for qt application.
 int startQtLoop();
 
+// the coroutines of Qt main thread watch every socket by a QSocketNotifier, and run the timers by Qt timers. with the
+// hybrid mode, libev watches the sockets by epoll or kqueue, and Qt watches libev by one QSocketNotifier and one timer,
+// so the applications with many sockets make no Qt objects for them. call it before any coroutine is used in the main
+// thread. it is ignored on Windows, or if libev has no epoll or kqueue.
+void setQtEventLoopHybrid(bool hybrid);
+
+// the main thread runs libev as the other threads do, instead of the Qt eventloop. for the servers without
+// QObject timers, signals or widgets in the main thread. call it before any coroutine is used in the main thread,
+// it is ignored without libev.
+void setHeadlessMainThread(bool headless);
+
 
 QTNETWORKNG_NAMESPACE_END
 
@@ -1,6 +1,7 @@
 #ifndef QTNG_HTTP_H
 #define QTNG_HTTP_H
 
+#include <functional>
 #include <QtCore/qstring.h>
 #include <QtCore/qmap.h>
 #include <QtCore/qjsondocument.h>
@@ -10,6 +11,11 @@
 
 #include "coroutine.h"
 #include "http_utils.h"
+#include "http_cookie.h"
+#include "json_view.h"
+#ifndef QTNG_NO_CRYPTO
+#include "ssl.h"
+#endif
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
@@ -18,9 +24,12 @@ struct FormDataFile
 {
     FormDataFile(const QString &filename, const QByteArray &data, const QString &contentType)
         :filename(filename), data(data), contentType(contentType) {}
+    FormDataFile(const QString &filename, QSharedPointer<FileLike> file, const QString &contentType)
+        :filename(filename), file(file), contentType(contentType) {}
 
     QString filename;
     QByteArray data;
+    QSharedPointer<FileLike> file;  // read while sending if it is not null.
     QString contentType;
 };
 
@@ -29,6 +38,8 @@ class FormData
 public:
     FormData();
     QByteArray toByteArray() const;
+    // the multipart body streaming the files. its size is known if the sizes of all files are known.
+    QSharedPointer<FileLike> toFileLike() const;
 
     void addFile(const QString &name, const QString &filename, const QByteArray &data, const QString &contentType = QString())
     {
@@ -47,6 +58,23 @@ public:
         files.insert(name, FormDataFile(filename, data, newContentType));
     }
 
+    // the file is read while sending the request, not kept in memory.
+    void addFile(const QString &name, const QString &filename, QSharedPointer<FileLike> file,
+                 const QString &contentType = QString())
+    {
+        QString newContentType = contentType;
+#ifndef Q_OS_ANDROID
+        if(newContentType.isEmpty()) {
+            QMimeDatabase db;
+            newContentType = db.mimeTypeForFile(filename, QMimeDatabase::MatchExtension).name();
+        }
+#endif
+        if (newContentType.isEmpty()) {
+            newContentType = "application/octet-stream";
+        }
+        files.insert(name, FormDataFile(filename, file, newContentType));
+    }
+
     void addQuery(const QString &key, const QString &value)
     {
         query.insert(key, value);
@@ -95,16 +123,27 @@ public:
     void setCookies(const QList<QNetworkCookie> &cookies);
     QByteArray body() const;
     void setBody(const QByteArray &body);
+    // the body is read while sending. it is sent with Content-Length if the size is known, or chunked
+    // by http/1.1 otherwise. such a request is sent once, not again after a redirect or a broken connection.
+    QSharedPointer<FileLike> bodyFile() const;
+    void setBody(QSharedPointer<FileLike> body);
+    // the generator returns the next piece of body, or an empty QByteArray at the end.
+    void setBody(const std::function<QByteArray()> &generator);
     int maxBodySize() const;
     void setMaxBodySize(int maxBodySize);
     int maxRedirects() const;
     void setMaxRedirects(int maxRedirects);
+    // the sending coroutine takes it as BaseCoroutine::Priority while the request is sent, the low priority is idle.
     Priority priority() const;
     void setPriority(Priority priority);
     HttpVersion version() const;
     void setVersion(HttpVersion version);
     void setStreamResponse(bool streamResponse);
     bool streamResponse() const;
+    // how the cache of session is used, PreferNetwork by default. it follows RFC 7234 only with PreferNetwork,
+    // PreferCache takes a stale response too, and AlwaysCache returns 504 if nothing is cached.
+    CacheLoadControl cacheLoadControl() const;
+    void setCacheLoadControl(CacheLoadControl cacheLoadControl);
 public:
     void setFormData(const FormData &formData, const QString &method = QStringLiteral("post"));
     static HttpRequest fromFormData(const FormData &formData);
@@ -113,6 +152,8 @@ public:
     static HttpRequest fromJson(const QJsonDocument &json);
     static HttpRequest fromJson(const QJsonArray &json) { return fromJson(QJsonDocument(json)); }
     static HttpRequest fromJson(const QJsonObject &json) { return fromJson(QJsonDocument(json)); }
+    // the body is transcoded from msgpack to json, without QJsonDocument.
+    static HttpRequest fromMsgPackAsJson(const QByteArray &msgpack);
 private:
     QSharedDataPointer<HttpRequestPrivate> d;
     friend class HttpSessionPrivate;
@@ -127,6 +168,29 @@ public:
 };
 
 
+// the phases of one request by the monotonic clock, in nsecs since the request started. a phase not run is -1,
+// such as connecting for a reused connection. the pipelined and http/2 requests only count the total.
+struct HttpTimings
+{
+    enum Phase {
+        DnsPhase,
+        ConnectPhase,
+        TlsPhase,
+        RequestWritePhase,
+        WaitingPhase,       // from the request written to the response headers read, the time to first byte.
+        BodyPhase,          // not run for streamResponse().
+        PhaseCount,
+    };
+    HttpTimings();
+    qint64 duration(Phase phase) const { return durations[phase]; }
+    qint64 start(Phase phase) const { return starts[phase]; }
+    qint64 starts[PhaseCount];
+    qint64 durations[PhaseCount];
+    qint64 totalNsecs;
+    bool reusedConnection;
+};
+
+
 class HttpResponsePrivate;
 class HttpResponse: public HeaderOperationMixin
 {
@@ -147,23 +211,33 @@ public:
     void setCookies(const QList<QNetworkCookie> &cookies);
     HttpRequest request() const;
     void setRequest(const HttpRequest &request);
-    qint64 elapsed() const;
+    qint64 elapsed() const;     // msecs.
     void setElapsed(qint64 elapsed);
+    HttpTimings timings() const;
     QList<HttpResponse> history() const;
     void setHistory(const QList<HttpResponse> &history);
     HttpVersion version() const;
     void setVersion(HttpVersion version);
 
+    // the body is not decoded, feed it to a ContentDecoder of the Content-Encoding header.
     QSharedPointer<SocketLike> takeStream(QByteArray *readBytes);
+    // the decoded body for the request of streamResponse(), read piece by piece. the connection is
+    // recycled after the whole body is read. read() returns -1 if the body is broken.
+    QSharedPointer<FileLike> bodyReader();
     QByteArray body();
     void setBody(const QByteArray &body);
     QString text();
     QJsonDocument json();
+    QByteArray jsonAsMsgPack();     // transcodes the json body to msgpack, without QJsonDocument.
+    // the json body parsed on demand, cheaper than json() if a few fields are read. a streamed body is read by
+    // JsonView::read(bodyReader()).
+    JsonView jsonView();
     QString html();
 
     bool isOk() const;
     bool hasNetworkError() const;
     bool hasHttpError() const;
+    bool isFromCache() const;   // including the ones revalidated by 304.
 public:
     QSharedPointer<RequestError> error() const;
     void setError(QSharedPointer<RequestError> error);
@@ -181,6 +255,67 @@ private:
     bool verify = false
 #define COMMON_PARAMETERS_FORWARD query, headers, allowRedirects, verify
 
+struct HttpConnectionPoolStats
+{
+    HttpConnectionPoolStats()
+        :hosts(0), idleConnections(0), createdConnections(0), reusedConnections(0), expiredConnections(0) {}
+    int hosts;
+    int idleConnections;
+    quint64 createdConnections;
+    quint64 reusedConnections;   // the idle connections taken again.
+    quint64 expiredConnections;  // the idle connections closed after the time to live.
+};
+
+
+// an alternative service advertised by the Alt-Svc header of RFC 7838, such as h3 for http/3 over quic.
+struct HttpAlternativeService
+{
+    HttpAlternativeService()
+        :port(0), expires(0) {}
+    QByteArray protocol;    // the alpn id, such as "h3" and "h2".
+    QString host;           // the host of origin if it is not given.
+    quint16 port;
+    qint64 expires;         // QElapsedTimer::msecsSinceReference() when it expires.
+    // the services of a header value, or an empty list for "clear". the max age is 24 hours by default.
+    static QList<HttpAlternativeService> parse(const QByteArray &value, const QString &originHost, qint64 now);
+};
+
+
+// applies to the idempotent requests without a streamed body. the failed attempts by ConnectionError (except
+// SSLError), RequestTimeout or status 502/503/504 are sent again after a backoff doubling from backoffMsecs.
+// every request earns retryBudget tokens and every retry or hedge spends one, so they can not multiply the
+// load of a failing server. with hedging, a duplicate goes out if the first attempt is still running after
+// the hedgePercentile latency of recent responses, and the first response wins.
+struct HttpRetryPolicy
+{
+    HttpRetryPolicy()
+        :maxRetries(0), backoffMsecs(100), maxBackoffMsecs(5000), retryBudget(0.1f), hedging(false)
+        , hedgePercentile(95), minHedgeDelayMsecs(10) {}
+    int maxRetries;         // 0 disables retrying.
+    int backoffMsecs;
+    int maxBackoffMsecs;
+    float retryBudget;
+    bool hedging;
+    int hedgePercentile;
+    int minHedgeDelayMsecs;
+};
+
+
+// the hooks of HttpSession, such as to make the spans of opentelemetry. they are called in the coroutine
+// sending the request, so TraceContext::current() is of the caller. a tracer can start a span and set its
+// traceparent header in requestStarted(), and make the child spans of phases from HttpResponse::timings(),
+// which are relative to the time of requestStarted(). the redirects and retries are traced one by one.
+class HttpTracer
+{
+public:
+    virtual ~HttpTracer();
+    virtual void requestStarted(HttpRequest &request);
+    virtual void requestFinished(const HttpRequest &request, const HttpResponse &response);
+};
+
+
+class HttpBatch;
+class HttpCacheStore;
 class Socks5Proxy;
 class HttpProxy;
 class HttpSessionPrivate;
@@ -228,11 +363,41 @@ public:
 
 
     HttpResponse send(HttpRequest &request);
-    QNetworkCookieJar &cookieJar();
+    // sends the requests by up to concurrency coroutines, and up to concurrencyPerHost of them to one server
+    // (0 for no limit). the responses are taken from the batch as they complete. the session must outlive it.
+    QSharedPointer<HttpBatch> sendMany(const QList<HttpRequest> &requests, int concurrency = 16,
+                                       int concurrencyPerHost = 0);
+    HttpCookieJar &cookieJar();
     QNetworkCookie cookie(const QUrl &url, const QString &name);
 
     void setMaxConnectionsPerServer(int maxConnectionsPerServer);
     int maxConnectionsPerServer();
+    // up to depth idempotent http/1.1 requests to one server are written back-to-back on one connection,
+    // and sent again on a new connection if it drops. 1 disables pipelining, the default. the responses are
+    // read as a whole, so the requests with streamResponse() are not pipelined. enable it only for the
+    // servers known to handle pipelining correctly.
+    void setPipeliningDepth(int depth);
+    int pipeliningDepth() const;
+    HttpConnectionPoolStats connectionPoolStats() const;
+    // opens up to count connections to origin ahead of the requests, with the tls handshakes, and opens them again
+    // when they are taken or closed. zero stops keeping them. returns the idle connections opened, 1 if the origin
+    // speaks h2 and defaultVersion() is Http2_0.
+    int prewarm(const QUrl &origin, int count);
+    // the services advertised by the responses from origin and not expired, the http/3 ones are not used yet.
+    QList<HttpAlternativeService> alternativeServices(const QUrl &origin) const;
+    // resolves the hosts at the same time into dnsCache(), which is made if there is none. returns the resolved ones.
+    int prefetchDns(const QStringList &hosts);
+    // the connections resolve by it, null by default, which resolves every connection.
+    void setDnsCache(QSharedPointer<SocketDnsCache> dnsCache);
+    QSharedPointer<SocketDnsCache> dnsCache() const;
+    void setRetryPolicy(const HttpRetryPolicy &policy);
+    HttpRetryPolicy retryPolicy() const;
+    void setTracer(QSharedPointer<HttpTracer> tracer);
+    QSharedPointer<HttpTracer> tracer() const;
+    // the GET responses are kept and revalidated as RFC 7234 by a private cache, see HttpCacheStore. the misses of
+    // the same url at the same time are fetched once. null disables caching, the default.
+    void setCache(QSharedPointer<HttpCacheStore> cache);
+    QSharedPointer<HttpCacheStore> cache() const;
 
     void setDebugLevel(int level);
     void disableDebug();
@@ -240,18 +405,91 @@ public:
     QString defaultUserAgent() const;
     void setDefaultUserAgent(const QString &userAgent);
     HttpVersion defaultVersion() const;
+    // with Http2_0 the requests to a https server selecting h2 by alpn share one connection, the others use
+    // http/1.1. the responses of h2 are read as a whole, streamResponse() is not supported yet.
     void setDefaultVersion(HttpVersion defaultVersion);
 
     QSharedPointer<Socks5Proxy> socks5Proxy() const;
     void setSocks5Proxy(QSharedPointer<Socks5Proxy> proxy);
     QSharedPointer<HttpProxy> httpProxy() const;
     void setHttpProxy(QSharedPointer<HttpProxy> proxy);
+#ifndef QTNG_NO_CRYPTO
+    // every https connection of the session uses it, so the reconnections share one context and resume the tls
+    // sessions. the allowed next protocols are replaced by h2 for the http/2 connections.
+    SslConfiguration sslConfiguration() const;
+    void setSslConfiguration(const SslConfiguration &config);
+#endif
 private:
     HttpSessionPrivate *d_ptr;
     Q_DECLARE_PRIVATE(HttpSession)
 };
 
 
+class SharedHttpSessionPrivate;
+// the connections, cookies and dns cache shared by the sessions of many threads. every thread makes its own session
+// by newSession() and uses it in its coroutines only. the direct http/1.x connections to a server opened by all of
+// them are no more than maxConnectionsPerServer(), and an idle one recycled by a thread is taken by any other. the
+// http/2 connections, the pipelines, the prewarmed and proxied connections are kept by their own sessions. on windows
+// the idle connections are not shared, the sockets are bound to the iocp of their threads.
+class SharedHttpSession
+{
+public:
+    SharedHttpSession();
+    ~SharedHttpSession();
+public:
+    // the settings are copied into the new session, the later changes apply to the sessions made after them.
+    QSharedPointer<HttpSession> newSession();
+    void setMaxConnectionsPerServer(int maxConnectionsPerServer);
+    int maxConnectionsPerServer() const;
+    void setPipeliningDepth(int depth);
+    int pipeliningDepth() const;
+    QString defaultUserAgent() const;
+    void setDefaultUserAgent(const QString &userAgent);
+    HttpVersion defaultVersion() const;
+    void setDefaultVersion(HttpVersion defaultVersion);
+    HttpRetryPolicy retryPolicy() const;
+    void setRetryPolicy(const HttpRetryPolicy &policy);
+    // the cookies received by all sessions. the sessions see the changes before their next requests.
+    QList<QNetworkCookie> cookiesForUrl(const QUrl &url) const;
+    void setCookiesFromUrl(const QList<QNetworkCookie> &cookies, const QUrl &url);
+    QSharedPointer<SocketDnsCache> dnsCache() const;
+    int idleConnections() const;
+#ifndef QTNG_NO_CRYPTO
+    // shared by all sessions, so the tls sessions got by a thread are resumed by the others.
+    SslConfiguration sslConfiguration() const;
+    void setSslConfiguration(const SslConfiguration &config);
+#endif
+private:
+    QSharedPointer<SharedHttpSessionPrivate> d_ptr;
+    Q_DECLARE_PRIVATE(SharedHttpSession)
+    Q_DISABLE_COPY(SharedHttpSession)
+};
+
+
+class HttpBatchPrivate;
+class HttpBatch
+{
+public:
+    ~HttpBatch();
+public:
+    // blocks until a request completes, and returns its index in the list and response. returns false if
+    // all responses are taken, or the batch is cancelled.
+    bool next(int *index, HttpResponse *response);
+    // waits for all requests, the responses are in the order of requests.
+    QList<HttpResponse> all();
+    // kills the requests not completed. next() still returns the responses completed before.
+    void cancel();
+    int size() const;
+    int remaining() const;  // the responses not taken yet.
+private:
+    HttpBatch(HttpSession *session, const QList<HttpRequest> &requests, int concurrency, int concurrencyPerHost);
+    HttpBatchPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(HttpBatch)
+    Q_DISABLE_COPY(HttpBatch)
+    friend class HttpSession;
+};
+
+
 class HTTPError: public RequestError {
 public:
     HTTPError(int statusCode): statusCode(statusCode) {}
@@ -375,7 +613,13 @@ public:
 class RetryError: public RequestError
 {
 public:
+    RetryError() :tries(0) {}
+    RetryError(int tries, QSharedPointer<RequestError> lastError)
+        :tries(tries), lastError(lastError) {}
     virtual QString what() const;
+public:
+    int tries;
+    QSharedPointer<RequestError> lastError;  // the error of the last attempt.
 };
 
 
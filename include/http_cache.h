@@ -0,0 +1,51 @@
+#ifndef QTNG_HTTP_CACHE_H
+#define QTNG_HTTP_CACHE_H
+
+#include <QtCore/qsharedpointer.h>
+#include <QtCore/qurl.h>
+#include "http_utils.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+
+// a response kept by the cache of HttpSession, with the decoded body.
+struct HttpCacheEntry
+{
+    HttpCacheEntry()
+        :statusCode(0), requestTime(0), responseTime(0) {}
+    qint64 cost() const;        // the bytes it takes, roughly.
+    QUrl url;
+    int statusCode;
+    QString statusText;
+    QList<HttpHeader> headers;
+    QList<HttpHeader> varyHeaders;  // the request headers named by Vary, a request must have the same ones to hit.
+    QByteArray body;
+    qint64 requestTime;             // msecs since epoch, to calculate the age as RFC 7234 4.2.3
+    qint64 responseTime;
+};
+
+
+// the storage of HttpSession::setCache(), the entries are keyed by the method and url. the freshness and the
+// revalidation are decided by the session, a store only keeps the entries. the stores are thread-safe, so the
+// sessions of many threads may share one.
+class HttpCacheStore
+{
+public:
+    virtual ~HttpCacheStore();
+public:
+    virtual bool load(const QString &key, HttpCacheEntry *entry) = 0;
+    virtual void store(const QString &key, const HttpCacheEntry &entry) = 0;
+    virtual void remove(const QString &key) = 0;
+    virtual void clear() = 0;
+public:
+    // the least recently used entries are dropped if they cost more than maxBytes.
+    static QSharedPointer<HttpCacheStore> memory(qint64 maxBytes = 1024 * 1024 * 16);
+    // a file for every entry in directory, which is read and written by callInThread(). the oldest files are
+    // removed if they take more than maxBytes.
+    static QSharedPointer<HttpCacheStore> disk(const QString &directory, qint64 maxBytes = 1024 * 1024 * 256);
+};
+
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // QTNG_HTTP_CACHE_H
@@ -0,0 +1,61 @@
+#ifndef QTNG_HTTP_COOKIE_H
+#define QTNG_HTTP_COOKIE_H
+
+#include <QtCore/qhash.h>
+#include <QtCore/qvector.h>
+#include <QtNetwork/qnetworkcookie.h>
+#include <QtNetwork/qnetworkcookiejar.h>
+#include "config.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+
+// the cookie jar of HttpSession. the cookies are indexed by the domain, a lookup checks the suffixes of the host
+// instead of every cookie, and the longer paths go first as RFC 6265 5.4. the expiring cookies are kept in a heap,
+// and the serialized Cookie header of every origin is cached until the cookies are changed. the cookies are not
+// kept by allCookies() of QNetworkCookieJar.
+class HttpCookieJar: public QNetworkCookieJar
+{
+public:
+    explicit HttpCookieJar(QObject *parent = nullptr);
+public:
+    virtual QList<QNetworkCookie> cookiesForUrl(const QUrl &url) const override;
+    virtual bool setCookiesFromUrl(const QList<QNetworkCookie> &cookieList, const QUrl &url) override;
+    virtual bool insertCookie(const QNetworkCookie &cookie) override;
+    virtual bool updateCookie(const QNetworkCookie &cookie) override;
+    virtual bool deleteCookie(const QNetworkCookie &cookie) override;
+public:
+    // the value of Cookie header for url, "name=value; name=value", empty if there is none.
+    QByteArray cookieHeader(const QUrl &url) const;
+    QList<QNetworkCookie> cookies() const;
+    int size() const { return count; }
+    void clear();
+private:
+    struct Expiry
+    {
+        qint64 time;        // msecs since epoch.
+        QString domain;
+        bool operator<(const Expiry &other) const { return time > other.time; }     // the earliest on the top.
+    };
+    struct OriginCookies
+    {
+        QVector<QNetworkCookie> cookies;    // matched by the host and the scheme, not the path.
+        QByteArray header;                  // of all cookies, valid if every path is "/".
+        bool pathDependent;
+    };
+    void removeExpired() const;
+    const OriginCookies &originCookies(const QUrl &url) const;
+    QVector<QNetworkCookie> matchPath(const OriginCookies &origin, const QUrl &url) const;
+private:
+    // by the domain without the leading dot, the host-only cookies of a.com and the domain cookies of .a.com are in
+    // the same bucket.
+    mutable QHash<QString, QVector<QNetworkCookie>> buckets;
+    mutable QVector<Expiry> expiries;
+    mutable QHash<QString, OriginCookies> origins;    // by the scheme and host.
+    mutable int count;
+};
+
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // QTNG_HTTP_COOKIE_H
@@ -65,6 +65,33 @@ public:
 };
 
 
+class RoutingProxySwitcherPrivate;
+// selects the socks5 proxies by the rules of domain suffixes and networks, the longest match wins. the domains
+// are a trie of labels and the networks are a radix tree of bits, so the cost does not grow with the rules, and
+// the routes are cached by host. every rule has a list of proxies for failover, an empty list connects directly.
+// the healthy one of the lowest latency is selected, the hosts without rule use socks5Proxies.
+class RoutingProxySwitcher: public BaseProxySwitcher
+{
+public:
+    RoutingProxySwitcher();
+    virtual ~RoutingProxySwitcher() override;
+public:
+    void addDomainRule(const QString &suffix, const QList<QSharedPointer<Socks5Proxy>> &proxies);
+    void addNetworkRule(const QHostAddress &network, int prefixLength, const QList<QSharedPointer<Socks5Proxy>> &proxies);
+    void clearRules();
+    // a failed proxy is not selected for 30 seconds, or until checkProxies() connects it.
+    void reportFailure(QSharedPointer<Socks5Proxy> proxy);
+    void reportLatency(QSharedPointer<Socks5Proxy> proxy, qint64 msecs);
+    // connects every proxy to measure the latency, should be called periodically.
+    void checkProxies(float timeout = 5.0);
+    virtual QSharedPointer<Socks5Proxy> selectSocks5Proxy(const QUrl &url) override;
+    virtual QSharedPointer<HttpProxy> selectHttpProxy(const QUrl &url) override;
+private:
+    RoutingProxySwitcherPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(RoutingProxySwitcher)
+};
+
+
 void setProxySwitcher(class HttpSession *session, QSharedPointer<BaseProxySwitcher> switcher);
 
 
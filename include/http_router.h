@@ -0,0 +1,126 @@
+#ifndef QTNG_HTTP_ROUTER_H
+#define QTNG_HTTP_ROUTER_H
+
+#include <functional>
+#include <QtCore/qstring.h>
+#include <QtCore/qvector.h>
+#include <QtCore/qvarlengtharray.h>
+#include "config.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+
+// the parameters captured by HttpRouteTable::match(), as views of the path matched. the path must outlive it.
+class HttpRouteMatch
+{
+public:
+    HttpRouteMatch()
+        :path(nullptr), routeIndex(-1), methodNotAllowed(false) {}
+public:
+    int route() const { return routeIndex; }        // -1 if no route matches.
+    // the path is matched by a route of other methods, so the handler may send 405.
+    bool isMethodNotAllowed() const { return methodNotAllowed; }
+    int size() const { return captures.size(); }
+    const QString &name(int i) const { return *captures.at(i).name; }
+    QStringRef value(int i) const { return QStringRef(path, captures.at(i).position, captures.at(i).size); }
+    // a null reference if the parameter is not captured.
+    QStringRef param(const QString &name) const;
+    QStringRef param(QLatin1String name) const;
+private:
+    struct Capture
+    {
+        const QString *name;    // owned by the node of HttpRouteTable.
+        int position;
+        int size;
+    };
+    QVarLengthArray<Capture, 8> captures;
+    const QString *path;
+    int routeIndex;
+    bool methodNotAllowed;
+    friend class HttpRouteTable;
+};
+
+
+// a radix tree of the path patterns, built once before serving and shared by all handlers. a pattern is like
+// "/users/:id/posts/*rest", a ":name" matches one non-empty segment and a "*name" matches the rest of path. the
+// static parts go before the parameters, and the parameters before the wildcards. matching walks the path once
+// and allocates nothing, the query string is not matched. it is not changed by matching, so many threads may match
+// at once after all routes are added.
+class HttpRouteTable
+{
+public:
+    HttpRouteTable();
+public:
+    // the method is like "GET", empty or "*" matches any method. returns false if the pattern is malformed, or the
+    // method and pattern are added already.
+    bool addRoute(const QString &method, const QString &pattern, int route);
+    bool match(const QString &method, const QString &path, HttpRouteMatch *match) const;
+    int size() const { return count; }
+private:
+    enum NodeKind {
+        StaticNode,
+        ParamNode,
+        WildcardNode,
+    };
+    struct Node
+    {
+        Node()
+            :kind(StaticNode), paramChild(-1), wildcardChild(-1) {}
+        NodeKind kind;
+        QString text;                           // the prefix of static node, or the name of parameter.
+        QVector<ushort> firstChars;             // of the static children, sorted.
+        QVector<int> staticChildren;            // in the order of firstChars.
+        int paramChild;
+        int wildcardChild;
+        QVector<QPair<QString, int>> routes;    // by method, "*" for any method.
+    };
+    int insertStatic(int node, const QString &text);
+    int insertChild(int node, NodeKind kind, const QString &name);
+    bool matchNode(int node, const QString &method, const QChar *path, int position, int end,
+                   HttpRouteMatch *match) const;
+private:
+    QVector<Node> nodes;        // the root is the first.
+    int count;
+};
+
+
+// dispatches the requests to the methods of Handler, such as a BaseHttpRequestHandler.
+//
+//     router.add("GET", "/users/:id", &MyHandler::getUser);
+//     void MyHandler::doMethod() { if (!router.dispatch(this, method, path)) sendError(HttpStatus::NotFound); }
+//     void MyHandler::getUser(const HttpRouteMatch &match) { const QStringRef &id = match.param("id"); ... }
+template<typename Handler>
+class HttpRouter
+{
+public:
+    typedef std::function<void(Handler *, const HttpRouteMatch &)> Callback;
+public:
+    bool add(const QString &method, const QString &pattern, const Callback &callback)
+    {
+        if (!table.addRoute(method, pattern, callbacks.size())) {
+            return false;
+        }
+        callbacks.append(callback);
+        return true;
+    }
+    // returns false if no route matches, the handler sends 404, or 405 if match->isMethodNotAllowed().
+    bool dispatch(Handler *handler, const QString &method, const QString &path, HttpRouteMatch *match = nullptr) const
+    {
+        HttpRouteMatch local;
+        HttpRouteMatch *m = match ? match : &local;
+        if (!table.match(method, path, m)) {
+            return false;
+        }
+        callbacks.at(m->route())(handler, *m);
+        return true;
+    }
+    const HttpRouteTable &routeTable() const { return table; }
+private:
+    HttpRouteTable table;
+    QVector<Callback> callbacks;
+};
+
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // QTNG_HTTP_ROUTER_H
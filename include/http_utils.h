@@ -1,10 +1,15 @@
 #ifndef QTNG_HTTP_UTILS_H
 #define QTNG_HTTP_UTILS_H
 
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
 #include <QtCore/qstring.h>
 #include <QtCore/qbytearray.h>
 #include <QtCore/qdatetime.h>
 #include <QtCore/qlist.h>
+#include <QtCore/qvector.h>
 #include <QtCore/qurl.h>
 #include <QtCore/qmap.h>
 #include "socket_utils.h"
@@ -147,17 +152,24 @@ public:
     QByteArrayList multiHeader(const QString &name) const;
     QList<HttpHeader> allHeaders() const { return headers; }
     void setHeaders(const QMap<QString, QByteArray> headers);
-    void setHeaders(const QList<HttpHeader> &headers) { this->headers = headers; }
+    void setHeaders(const QList<HttpHeader> &headers) { this->headers = headers; keys.clear(); }
 
     static QDateTime fromHttpDate(const QByteArray &value);
     static QByteArray toHttpDate(const QDateTime &dt);
 protected:
     QList<HttpHeader> headers;
+private:
+    int indexOf(quint32 key, const QString &name, int from = 0) const;
+    void syncKeys() const;
+    // one key for every header of the same position. the known headers are keyed by their ids, and the
+    // others by the hash of lower-cased name. it is rebuilt if `headers` is changed by subclass directly.
+    mutable QVector<quint32> keys;
 };
 
 QList<QByteArray> splitBytes(const QByteArray &bs, char sep, int maxSplit = -1);
 
-class HeaderSplitter
+// the lines and headers of http/1.x, parsed from buf. the bytes are received by BasicHeaderSplitter.
+class HeaderSplitterBase
 {
 public:
     enum Error {
@@ -167,20 +179,174 @@ public:
         ConnectionError,
         LineTooLong,
     };
+protected:
+    explicit HeaderSplitterBase(const QByteArray &buf)
+        :buf(buf), pos(0) {}
+    // returns false with NoError if buf has no whole line yet. searched starts from zero for a line, and keeps
+    // the bytes having no '\n' between the calls.
+    bool findLine(int *start, int *size, int *searched, Error *error);
+    HttpHeader parseHeader(int start, int size, Error *error);
+    void compact();
 public:
-    HeaderSplitter(QSharedPointer<SocketLike> connection, const QByteArray &buf)
-        :connection(connection), buf(buf) {}
-    HeaderSplitter(QSharedPointer<SocketLike> connection)
-        :connection(connection) {}
+    QByteArray buf;  // the bytes after the lines returned.
+private:
+    int pos;
+};
+
+
+// reads the header lines from connection, which is any type having QByteArray recv(qint32). the SocketLike one is
+// HeaderSplitter, the concrete types such as Socket and SslSocket are bound at compile time, without the wrapper
+// of SocketLike and its virtual calls.
+template<typename Connection>
+class BasicHeaderSplitter: public HeaderSplitterBase
+{
+public:
+    BasicHeaderSplitter(QSharedPointer<Connection> connection, const QByteArray &buf)
+        :HeaderSplitterBase(buf), connection(connection) {}
+    BasicHeaderSplitter(QSharedPointer<Connection> connection)
+        :HeaderSplitterBase(QByteArray()), connection(connection) {}
     QByteArray nextLine(Error *error);
     HttpHeader nextHeader(Error *error);
     QList<HttpHeader> headers(int maxHeaders, Error *error);
+private:
+    bool scanLine(int *start, int *size, Error *error);
 public:
-    QSharedPointer<SocketLike> connection;
-    QByteArray buf;
+    QSharedPointer<Connection> connection;
 };
 
-class ChunkedBlockReader
+
+template<typename Connection>
+bool BasicHeaderSplitter<Connection>::scanLine(int *start, int *size, Error *error)
+{
+    int searched = 0;
+    while (!findLine(start, size, &searched, error)) {
+        if (*error != NoError) {
+            return false;
+        }
+        const QByteArray &data = recvSized(connection.data(), 1024 * 8);
+        if (data.isEmpty()) {
+            *error = ConnectionError;
+            return false;
+        }
+        buf.append(data);
+    }
+    return true;
+}
+
+
+template<typename Connection>
+QByteArray BasicHeaderSplitter<Connection>::nextLine(Error *error)
+{
+    int start, size;
+    if (!scanLine(&start, &size, error)) {
+        return QByteArray();
+    }
+    const QByteArray line(buf.constData() + start, size);
+    compact();
+    return line;
+}
+
+
+template<typename Connection>
+HttpHeader BasicHeaderSplitter<Connection>::nextHeader(Error *error)
+{
+    int start, size;
+    if (!scanLine(&start, &size, error)) {
+        return HttpHeader();
+    }
+    if (size == 0) {
+        compact();
+        return HttpHeader();
+    }
+    const HttpHeader &header = parseHeader(start, size, error);
+    compact();
+    return header;
+}
+
+
+template<typename Connection>
+QList<HttpHeader> BasicHeaderSplitter<Connection>::headers(int maxHeaders, Error *error)
+{
+    QList<HttpHeader> headers;
+    for (int i = 0; i < maxHeaders; ++i) {
+        int start, size;
+        if (!scanLine(&start, &size, error)) {
+            return QList<HttpHeader>();
+        }
+        if (size == 0) {
+            compact();
+            return headers;
+        }
+        const HttpHeader &header = parseHeader(start, size, error);
+        if (*error != NoError) {
+            return QList<HttpHeader>();
+        }
+        headers.append(header);
+    }
+    *error = ExhausedMaxLine;
+    return QList<HttpHeader>();
+}
+
+
+typedef BasicHeaderSplitter<SocketLike> HeaderSplitter;
+extern template class BasicHeaderSplitter<SocketLike>;
+
+
+// a monotonic allocator of the scratch data of one request. the memory is carved from blocks by bumping a pointer,
+// and freed all at once by reset(), which keeps the first block for the next request. the destructors of the
+// objects made by create() run in reset() too, in the reverse order.
+class MonotonicArena
+{
+public:
+    explicit MonotonicArena(qint32 blockSize = 1024 * 4)
+        :blockSize(blockSize), current(0), offset(0), used(0), cleanups(nullptr) {}
+    ~MonotonicArena();
+public:
+    void *allocate(qint32 size, qint32 alignment = static_cast<qint32>(alignof(std::max_align_t)));
+    template<typename T, typename... Args>
+    T *create(Args&&... args);
+    // a copy of the bytes ending with '\0', valid until reset().
+    char *copy(const char *data, qint32 size);
+    // a QByteArray over a copy in the arena, it must not be kept after reset().
+    QByteArray bytes(const QByteArray &data);
+    void reset();
+    qint64 bytesUsed() const { return used; }
+    qint64 capacity() const;
+private:
+    struct Cleanup
+    {
+        void (*destroy)(void *);
+        void *object;
+        Cleanup *next;
+    };
+    template<typename T>
+    static void destroyObject(void *object) { static_cast<T *>(object)->~T(); }
+    void addCleanup(void (*destroy)(void *), void *object);
+private:
+    QVector<QByteArray> blocks;     // the first is kept by reset().
+    const qint32 blockSize;
+    int current;
+    qint32 offset;                  // in the current block.
+    qint64 used;
+    Cleanup *cleanups;              // allocated in the arena too.
+    Q_DISABLE_COPY(MonotonicArena)
+};
+
+
+template<typename T, typename... Args>
+T *MonotonicArena::create(Args&&... args)
+{
+    void *p = allocate(static_cast<qint32>(sizeof(T)), static_cast<qint32>(alignof(T)));
+    T *object = new (p) T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value) {
+        addCleanup(&MonotonicArena::destroyObject<T>, object);
+    }
+    return object;
+}
+
+
+// the chunks of "Transfer-Encoding: chunked", parsed from buf. the bytes are received by BasicChunkedBlockReader.
+class ChunkedBlockReaderBase
 {
 public:
     enum Error {
@@ -189,15 +355,144 @@ public:
         UnrewindableBodyError,
         ConnectionError,
     };
+protected:
+    explicit ChunkedBlockReaderBase(const QByteArray &buf)
+        :debugLevel(0), buf(buf) {}
+    // takes the size line from buf, which is received until it has a '\n' or enough bytes for the longest line.
+    bool takeSize(qint64 leftBytes, qint32 *bytesToRead, Error *error);
+    bool hasSizeLine() const { return buf.size() >= MaxLineLength || buf.contains('\n'); }
+    QByteArray takeBlock(qint32 bytesToRead);
+    enum {
+        MaxLineLength = 6, // ffff\r\n
+    };
+public:
+    int debugLevel;
+    QByteArray buf;
+};
+
+
+// reads the chunks from connection, which is any type having QByteArray recv(qint32), like BasicHeaderSplitter.
+template<typename Connection>
+class BasicChunkedBlockReader: public ChunkedBlockReaderBase
+{
 public:
-    ChunkedBlockReader(QSharedPointer<SocketLike> connection, const QByteArray &buf)
-        :connection(connection), buf(buf) {}
+    BasicChunkedBlockReader(QSharedPointer<Connection> connection, const QByteArray &buf)
+        :ChunkedBlockReaderBase(buf), connection(connection) {}
 public:
     QByteArray nextBlock(qint64 leftBytes, Error *error);
 public:
-    int debugLevel;
-    QSharedPointer<SocketLike> connection;
-    QByteArray buf;
+    QSharedPointer<Connection> connection;
+};
+
+
+template<typename Connection>
+QByteArray BasicChunkedBlockReader<Connection>::nextBlock(qint64 leftBytes, Error *error)
+{
+    while (!hasSizeLine()) {
+        const QByteArray &t = recvSized(connection.data(), 1024 * 8); // most server send the header at one tcp block.
+        if (t.isEmpty()) {
+            break;
+        }
+        buf.append(t);
+    }
+    qint32 bytesToRead;
+    if (!takeSize(leftBytes, &bytesToRead, error)) {
+        return QByteArray();
+    }
+    while (buf.size() < bytesToRead + 2) {
+        const QByteArray &t = recvSized(connection.data(), 1024 * 8);
+        if (t.isEmpty()) {
+            *error = ConnectionError;
+            return QByteArray();
+        }
+        buf.append(t);
+    }
+    *error = NoError;
+    return takeBlock(bytesToRead);
+}
+
+
+typedef BasicChunkedBlockReader<SocketLike> ChunkedBlockReader;
+extern template class BasicChunkedBlockReader<SocketLike>;
+
+// decodes the body of Content-Encoding piece by piece, so it works on the streamed responses too.
+// the supported encodings are gzip, deflate, and br if built with brotli.
+class ContentDecoderPrivate;
+class ContentDecoder
+{
+public:
+    explicit ContentDecoder(const QByteArray &contentEncoding);
+    ~ContentDecoder();
+public:
+    // false if one of the encodings is unknown.
+    bool isSupported() const;
+    // the decoded bytes are appended to out, returns false if the data is corrupted.
+    bool decode(const QByteArray &data, QByteArray *out);
+    // called after the last piece, returns false if the body is truncated.
+    bool finish(QByteArray *out);
+    // the value of Accept-Encoding header.
+    static QByteArray acceptEncoding();
+private:
+    ContentDecoderPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(ContentDecoder)
+    Q_DISABLE_COPY(ContentDecoder)
+};
+
+
+// reads a multipart/form-data body part by part, with the memory of one buffer. the headers of every part are
+// parsed, and its content is read or copied to a FileLike as the boundary is found, so a large upload is never
+// held in memory.
+class MultipartReaderPrivate;
+class MultipartReader
+{
+public:
+    // body is the reader of the whole body, such as BaseHttpRequestHandler::bodyReader().
+    MultipartReader(QSharedPointer<FileLike> body, const QByteArray &boundary, qint32 bufferSize = 1024 * 64);
+    ~MultipartReader();
+public:
+    // skips the rest of current part, and reads the headers of next one. returns false at the end of body, or if
+    // the body is malformed.
+    bool nextPart();
+    QList<HttpHeader> headers() const;
+    QByteArray header(const QString &name) const;
+    QString name() const;       // of Content-Disposition.
+    QString fileName() const;   // empty if the part is not a file.
+    QByteArray contentType() const;
+    // reads the content of current part, returns 0 at the end of part, and -1 if the body is malformed.
+    qint32 read(char *data, qint32 size);
+    // the content of a small field, ok is false if it exceeds maxSize.
+    QByteArray readAll(qint32 maxSize, bool *ok = nullptr);
+    // the rest of current part to sink, returns the bytes copied, or -1 if it exceeds maxSize or fails.
+    qint64 copyTo(QSharedPointer<FileLike> sink, qint64 maxSize = -1);
+    bool hasError() const;
+    // the boundary parameter of Content-Type, empty if it is not multipart.
+    static QByteArray boundaryOf(const QByteArray &contentType);
+private:
+    MultipartReaderPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(MultipartReader)
+    Q_DISABLE_COPY(MultipartReader)
+};
+
+
+// the w3c trace context of the current coroutine, inherited by the coroutines spawned from it. HttpSession
+// sends it as the traceparent header, unless the request has one.
+struct TraceContext
+{
+    TraceContext()
+        :flags(0) {}
+    TraceContext(const QByteArray &traceId, const QByteArray &spanId, quint8 flags = 1)
+        :traceId(traceId), spanId(spanId), flags(flags) {}
+    bool isValid() const;
+    bool isSampled() const { return flags & 1; }
+    QByteArray toTraceParent() const;
+    // an invalid context if the header is malformed.
+    static TraceContext fromTraceParent(const QByteArray &header);
+    static TraceContext current();
+    static void setCurrent(const TraceContext &context);
+
+    QByteArray traceId;     // 16 bytes.
+    QByteArray spanId;      // 8 bytes.
+    quint8 flags;
 };
 
 QTNETWORKNG_NAMESPACE_END
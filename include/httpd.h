@@ -3,17 +3,94 @@
 #include <QFile>
 #include <QDir>
 #include <QFileInfo>
+#include <QElapsedTimer>
 #include "socket_server.h"
 #include "http_utils.h"
+#include "websocket.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
+class HttpAccessLogPrivate;
+// the access log formatted and written by a background thread, so a slow stderr or disk never blocks the
+// eventloops. every thread logs to its own ring of fixed-size records, the records are dropped if the ring
+// is full. the lines go to stderr by default.
+class HttpAccessLog
+{
+public:
+    explicit HttpAccessLog(int capacityPerThread = 4096);
+    // the records left are written before returning.
+    virtual ~HttpAccessLog();
+public:
+    bool openFile(const QString &filePath);
+    void useSyslog(const QByteArray &ident);
+    // the background thread writes the records in batches, one batch every msecs at most.
+    void setFlushInterval(int msecs);
+    // logs one of every n requests, all errors are logged.
+    void setSampling(int n);
+    // return false if the record is dropped.
+    bool logRequest(const QString &method, const QString &path, const QHostAddress &peer, int status, qint64 bodySize);
+    bool logError(const QString &method, const QString &path, const QHostAddress &peer, int status,
+                  const QString &message);
+    quint64 dropped() const;
+    // BaseHttpRequestHandler logs to the installed log, or by qDebug() if there is none. the log must
+    // outlive the servers using it.
+    static void install(HttpAccessLog *log);
+    static HttpAccessLog *installed();
+private:
+    HttpAccessLogPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(HttpAccessLog)
+    Q_DISABLE_COPY(HttpAccessLog)
+};
+
+
+class HttpResponseWriterPrivate;
+// the response body of unknown size, made by BaseHttpRequestHandler::bodyWriter(). the body is chunked with
+// http/1.1, and the connection is closed after it with http/1.0. the small writes are coalesced into chunks, and
+// compressed by br or gzip as Accept-Encoding allows. it must not outlive the handler.
+class HttpResponseWriter
+{
+public:
+    ~HttpResponseWriter();
+public:
+    bool write(const QByteArray &data);
+    // sends the data written so far at once, such as an event of server-sent stream. the headers go with the first
+    // flush or chunk.
+    bool flush();
+    // sends the rest and ends the body, it is called after doMethod() if the handler does not. a body ended before
+    // any chunk is sent as a whole with Content-Length, uncompressed if it is smaller than the threshold.
+    bool close();
+    bool isClosed() const;
+    QByteArray contentEncoding() const;     // empty if the body is not compressed.
+    qint64 bodySize() const;                // the bytes written, before compression.
+private:
+    explicit HttpResponseWriter(HttpResponseWriterPrivate *d);
+    HttpResponseWriterPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(HttpResponseWriter)
+    Q_DISABLE_COPY(HttpResponseWriter)
+    friend class BaseHttpRequestHandler;
+};
+
+
+class Http2StreamSocket;
+class HttpRequestBodyReader;
 class BaseHttpRequestHandler: public BaseRequestHandler, public HeaderOperationMixin
 {
 public:
+    typedef std::function<void(QSharedPointer<SocketLike>)> StreamHandler;
     BaseHttpRequestHandler(QSharedPointer<SocketLike> request, BaseStreamServer *server);
+public:
+    // enables http/2 by alpn, prior knowledge and h2c upgrade. the streams of one connection run concurrently,
+    // each in a new handler made by the StreamHandler. see serveHttpRequest().
+    void setHttp2StreamHandler(const StreamHandler &streamHandler) { http2StreamHandler = streamHandler; }
+    // park the keep-alive connection between requests instead of waiting in this coroutine, see
+    // BaseStreamServer::parkRequest(). the next request runs in a new handler. zero disables it.
+    void setIdleParking(quint32 idleMsecs) { idleParkingMsecs = idleMsecs; }
+    // the bodies of bodyWriter() smaller than minSize are not compressed, -1 disables the compression. the level
+    // is of zlib, and the quality of brotli.
+    void setCompression(qint32 minSize, int level = 6) { compressionMinSize = minSize; compressionLevel = level; }
 protected:
     virtual void handle();
+    virtual void finish() override;
     virtual void handleOneRequest();
     virtual bool parseRequest();
     virtual void doMethod();
@@ -25,10 +102,46 @@ protected:
     virtual void logRequest(HttpStatus status, int bodySize);
     virtual void logError(HttpStatus status, const QString &shortMessage, const QString &longMessage);
     virtual QString serverName();
+    // the Date header of now, formatted once a second.
     virtual QString dateTimeString();
+    // the prebuilt status line with the standard message.
+    void sendCommandLine(HttpStatus status);
     void sendCommandLine(HttpStatus status, const QString &shortMessage);
     void sendHeader(const QByteArray &name, const QByteArray &value);
     bool endHeader();
+    // send the headers and the body together with one sendallv().
+    bool endHeader(const QByteArray &body);
+    // the headers and the whole body of response, nothing else is sent for it. the response is held back if the
+    // next pipelined request is read already, and sent with the response of that one. endHeader() and the
+    // end of connection send the responses held back.
+    bool endResponse(const QByteArray &body);
+    bool flushResponses();
+    // the request body read from the connection as the handler reads it. Content-Length and chunked bodies
+    // are decoded, "100 Continue" is sent before the first read if the client expects it. returns null after
+    // sending 413 if Content-Length exceeds maxBodySize (-1 for no limit), a chunked body exceeding it fails
+    // the read. the body not read by the handler is drained after doMethod() to keep the connection alive.
+    QSharedPointer<FileLike> bodyReader(qint64 maxBodySize = -1);
+    // the parts of a multipart/form-data body, read over bodyReader(). returns null after sending 400 if the
+    // request is not multipart or has no boundary.
+    QSharedPointer<MultipartReader> multipartReader(qint64 maxBodySize = -1);
+    // the writer of response body, called after sendResponse() and sendHeader(). the headers are sent with the
+    // first chunk of chunkSize bytes, or by flush() and close(). Content-Length must not be sent.
+    QSharedPointer<HttpResponseWriter> bodyWriter(const QByteArray &contentType, qint32 chunkSize = 1024 * 16);
+    // the bodies of text, json, javascript, xml and svg are compressed by bodyWriter().
+    virtual bool isCompressible(const QByteArray &contentType);
+    // the scratch memory of this request, freed after it is handled.
+    MonotonicArena &requestArena() { return arena; }
+    // the response of Metrics::render(), such as for GET /metrics in doGET().
+    bool sendMetrics();
+    // the response of CoroutineIntrospection::dump(), keep it away from the public.
+    bool sendCoroutineDump();
+    // answers the websocket handshake of this request with 101, or sends 400 and returns null. the websocket
+    // is served in doGET(), the connection is closed after it returns.
+    QSharedPointer<WebSocket> upgradeToWebSocket(const WebSocketConfiguration &config = WebSocketConfiguration());
+private:
+    void finishBody();
+    void countRequest();
+    void serveHttp2(const QByteArray &buf, bool prefaceReceived, const QByteArray *upgradeSettings);
 protected:
     virtual void doGET();
     virtual void doPOST();
@@ -40,7 +153,24 @@ protected:
     virtual void doTRACE();
     virtual void doCONNECT();
 private:
-    QByteArrayList headerCache;
+    QByteArray headerBuffer;    // the status line and headers, cleared but not freed after sending.
+    QByteArray serverNameLine;
+    QSharedPointer<HttpRequestBodyReader> requestBodyReader;
+    QSharedPointer<HttpResponseWriter> responseBodyWriter;
+    QByteArray pendingBytes;    // read after the current request, the next pipelined requests.
+    QByteArrayList deferredResponses;
+    qint32 deferredSize;
+    StreamHandler http2StreamHandler;
+    Http2StreamSocket * const http2Stream;  // the request is a stream of http/2 connection.
+    QList<HttpHeader> http2Headers;
+    int http2Status;
+    quint32 idleParkingMsecs;
+    qint32 compressionMinSize;
+    int compressionLevel;
+    MonotonicArena arena;
+    QElapsedTimer requestTimer; // started if Metrics::isEnabled().
+    int responseStatus;
+    bool parked;                // the connection is handed back to server, it is not closed by finish().
 protected:
     QString method;
     QString path;
@@ -48,6 +178,63 @@ protected:
     HttpVersion version;
     HttpVersion serverVersion;
     bool closeConnection;
+    friend class HttpResponseWriterPrivate;
+    friend class HttpRequestBodyReader;
+};
+
+
+// runs the RequestHandler for the connection, and a new one for every http/2 stream of it.
+template<typename RequestHandler>
+void serveHttpRequest(QSharedPointer<SocketLike> request, BaseStreamServer *server)
+{
+    RequestHandler handler(request, server);
+    handler.setHttp2StreamHandler([server] (QSharedPointer<SocketLike> stream) {
+        RequestHandler streamHandler(stream, server);
+        streamHandler.run();
+    });
+    handler.run();
+}
+
+
+// a file of StaticFileCache with the headers formatted. the contents are mapped, and shared by all requests.
+struct StaticFile
+{
+    StaticFile()
+        :checked(0), size(0) {}
+    QByteArray content;
+    QByteArray gzipContent;     // the .gz file next to it, may be empty.
+    QByteArray brotliContent;   // the .br file next to it, may be empty.
+    QByteArray contentType;
+    QByteArray lastModified;
+    QByteArray etag;
+    QList<QSharedPointer<QFile>> files;  // keep the mappings.
+    QDateTime modified;
+    qint64 checked;             // the msecs since epoch when the file is checked last time.
+    qint64 size;
+};
+
+
+class StaticFileCachePrivate;
+// the small files served by SimpleHttpRequestHandler are kept in memory, the least recently used ones are
+// dropped if the contents exceed maxBytes. a file is checked by its size and mtime again if it is not
+// checked in checkInterval msecs, the changed file is loaded again.
+class StaticFileCache
+{
+public:
+    explicit StaticFileCache(qint64 maxBytes = 64 * 1024 * 1024, qint64 maxFileSize = 1024 * 1024);
+    virtual ~StaticFileCache();
+public:
+    void setCheckInterval(int msecs);
+    // returns null if the file is not a regular file, or too large to cache.
+    QSharedPointer<StaticFile> get(const QString &filePath);
+    void clear();
+    // used by SimpleHttpRequestHandler::fileCache(), the cache must outlive the servers using it.
+    static void install(StaticFileCache *cache);
+    static StaticFileCache *installed();
+private:
+    StaticFileCachePrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(StaticFileCache)
+    Q_DISABLE_COPY(StaticFileCache)
 };
 
 
@@ -64,19 +251,119 @@ protected:
     virtual void doHEAD() override;
     virtual QSharedPointer<FileLike> serveStaticFiles();
     virtual QSharedPointer<FileLike> listDirectory(const QDir &dir, const QString &displayDir);
-    void sendFile(QSharedPointer<FileLike> f);
+    // the installed StaticFileCache by default, nullptr disables caching.
+    virtual StaticFileCache *fileCache();
+    // FileLike::rawFile() by default, which sends by sendfile(). returns FileLike::asyncFile() if the files are on a
+    // slow disk, so a cold read blocks the serving coroutine only.
+    virtual QSharedPointer<FileLike> openFile(QSharedPointer<QFile> f);
+    // returns false if the file is not cached, nothing is sent then.
+    bool serveCachedFile(StaticFileCache *cache, const QString &filePath);
+    // returns false if the file is not sent completely, the connection is closed after the response then.
+    bool sendFile(QSharedPointer<FileLike> f);
+    // sends size bytes from offset (-1 to the end), by sendfile() if the connection allows.
+    bool sendFileRange(QSharedPointer<FileLike> f, qint64 offset, qint64 size);
+    // If-None-Match, or If-Modified-Since if there is no If-None-Match.
+    bool isNotModified(const QByteArray &etag, const QDateTime &lastModified);
+    // the ranges of the Range header, sorted and merged. empty if the whole content is sent because there is no
+    // Range, its If-Range does not match or it is malformed. returns false if no range is satisfiable.
+    bool parseRanges(qint64 size, const QByteArray &etag, const QDateTime &lastModified,
+                     QList<QPair<qint64, qint64>> *ranges);
+    // the 206 response, the ranges are inclusive.
+    bool sendRanges(QSharedPointer<FileLike> f, qint64 size, const QList<QPair<qint64, qint64>> &ranges,
+                    const QByteArray &contentType, const QByteArray &etag, const QByteArray &lastModified);
     QFileInfo translatePath(const QString &path);
 protected:
     QDir rootDir;
 };
 
 
+struct ReverseProxyUpstream
+{
+    ReverseProxyUpstream()
+        :port(0), active(0), healthy(true) {}
+    ReverseProxyUpstream(const QString &host, quint16 port)
+        :host(host), port(port), active(0), healthy(true) {}
+    QString host;
+    quint16 port;
+    int active;     // the requests being forwarded to it.
+    bool healthy;   // false if the last health check or connection fails.
+};
+
+
+class ReverseProxyPrivate;
+// the upstreams of ReverseProxyRequestHandler, and the idle keep-alive connections to them. the connections
+// belong to the thread made them, so the proxy can be shared by the acceptor threads of servers.
+class ReverseProxy
+{
+public:
+    enum Balancing {
+        RoundRobin,
+        LeastConnections,
+    };
+public:
+    ReverseProxy();
+    virtual ~ReverseProxy();
+public:
+    void addUpstream(const QString &host, quint16 port);
+    QList<ReverseProxyUpstream> upstreams() const;
+    void setBalancing(Balancing balancing);
+    Balancing balancing() const;
+    // the idle connections kept for every upstream, and how long they are kept.
+    void setMaxIdleConnections(int maxIdleConnections);
+    void setIdleTimeout(float secs);
+    // for connecting and reading the response headers.
+    void setTimeout(float secs);
+    float timeout() const;
+    // connects to every upstream in the current thread every intervalSecs, the failed upstreams are not used
+    // until they accept a connection again. used as the default of ReverseProxyRequestHandler::reverseProxy().
+    void startHealthChecks(float intervalSecs);
+    void stopHealthChecks();
+    static void install(ReverseProxy *proxy);
+    static ReverseProxy *installed();
+private:
+    // returns -1 if there is no upstream.
+    int pick();
+    QSharedPointer<SocketLike> take(int index, bool *reused);
+    void release(int index, QSharedPointer<SocketLike> connection, bool reusable);
+private:
+    ReverseProxyPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(ReverseProxy)
+    Q_DISABLE_COPY(ReverseProxy)
+    friend class ReverseProxyRequestHandler;
+};
+
+
+// forwards every request to an upstream of ReverseProxy by http/1.1. the request and response bodies are
+// streamed through, only the hop-by-hop headers are changed.
+class ReverseProxyRequestHandler: public BaseHttpRequestHandler
+{
+public:
+    ReverseProxyRequestHandler(QSharedPointer<SocketLike> request, BaseStreamServer *server)
+        :BaseHttpRequestHandler(request, server) {}
+protected:
+    virtual void doMethod() override;
+    // the installed ReverseProxy by default.
+    virtual ReverseProxy *reverseProxy();
+    // the headers of request without the hop-by-hop ones, and with X-Forwarded-For and X-Forwarded-Proto.
+    virtual QList<HttpHeader> upstreamHeaders();
+private:
+    // sets retriable if the upstream closes the reused connection before responding.
+    bool forward(ReverseProxy *proxy, QSharedPointer<SocketLike> upstream, bool reused, bool *retriable,
+                 bool *reusable);
+    bool forwardResponseBody(HeaderSplitter &splitter, qint64 contentLength, bool chunked, bool *reusable);
+};
+
+
 class SimpleHttpServer: public BaseStreamServer
 {
 public:
     SimpleHttpServer(const QHostAddress &serverAddress, quint16 serverPort)
         :BaseStreamServer(serverAddress, serverPort) {}
+    explicit SimpleHttpServer(const QString &serverPath)
+        :BaseStreamServer(serverPath) {}
 protected:
+    // a canned 503 response, so the client knows that it may retry later.
+    virtual void rejectRequest(QSharedPointer<SocketLike> request) override;
     virtual void processRequest(QSharedPointer<SocketLike> request) override;
 };
 
@@ -85,12 +372,15 @@ protected:
 class SimpleHttpsServer: public BaseSslStreamServer
 {
 public:
+    // "h2" and "http/1.1" are offered by alpn if the configuration allows no protocol.
     SimpleHttpsServer(const QHostAddress &serverAddress, quint16 serverPort)
-        :BaseSslStreamServer(serverAddress, serverPort) {}
+        :BaseSslStreamServer(serverAddress, serverPort) { offerHttp2(); }
     SimpleHttpsServer(const QHostAddress &serverAddress, quint16 serverPort, const SslConfiguration &configuration)
-        :BaseSslStreamServer(serverAddress, serverPort, configuration) {}
+        :BaseSslStreamServer(serverAddress, serverPort, configuration) { offerHttp2(); }
 protected:
     virtual void processRequest(QSharedPointer<SocketLike> request) override;
+private:
+    void offerHttp2();
 };
 
 #endif
@@ -0,0 +1,69 @@
+#ifndef QTNG_IMPAIRMENT_H
+#define QTNG_IMPAIRMENT_H
+
+#include <QtCore/qsharedpointer.h>
+#include "socket_utils.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+
+// the faults of a simulated network path, like netem but in the process. the same seed makes the same decisions
+// for the same sequence of packets, so the benchmarks of kcp modes and data channels are repeatable.
+struct NetworkImpairment
+{
+    NetworkImpairment()
+        :lossRate(0.0f), duplicateRate(0.0f), reorderRate(0.0f), latencyMsecs(0), jitterMsecs(0)
+        , bytesPerSecond(0), queueMsecs(100), seed(1) {}
+    float lossRate;             // 0 to 1, the datagrams only.
+    float duplicateRate;        // 0 to 1, the datagrams only.
+    float reorderRate;          // 0 to 1, the datagrams sent at once, before the delayed ones. as netem does.
+    quint32 latencyMsecs;
+    quint32 jitterMsecs;        // uniform in [-jitter, +jitter]. the datagrams may be reordered by it, the streams not.
+    qint64 bytesPerSecond;      // the bandwidth, zero for unlimited.
+    quint32 queueMsecs;         // the datagrams waiting for the bandwidth longer than it are dropped.
+    quint32 seed;
+};
+
+
+struct NetworkImpairmentStats
+{
+    NetworkImpairmentStats()
+        :sent(0), dropped(0), duplicated(0), reordered(0), delayed(0) {}
+    quint64 sent;               // datagrams or stream writes.
+    quint64 dropped;            // by lossRate and the bandwidth queue.
+    quint64 duplicated;
+    quint64 reordered;
+    quint64 delayed;
+};
+
+
+class NetworkImpairerPrivate;
+// the state of one impaired path: the random sequence, the bandwidth and the packets in flight. the sockets sharing
+// an impairer share the path. it delays the packets by a coroutine, so use it in one thread. only the sending
+// direction is impaired, impair the peer too for both directions.
+class NetworkImpairer
+{
+public:
+    explicit NetworkImpairer(const NetworkImpairment &impairment);
+    ~NetworkImpairer();
+public:
+    NetworkImpairment impairment() const;
+    NetworkImpairmentStats stats() const;
+    // returns size if the datagram is sent, dropped or queued, the delayed ones are sent later by sendto() of socket.
+    qint32 sendto(QSharedPointer<Socket> socket, const char *data, qint32 size, const QHostAddress &addr, quint16 port);
+private:
+    NetworkImpairerPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(NetworkImpairer)
+    Q_DISABLE_COPY(NetworkImpairer)
+    friend class ImpairedSocketLike;
+};
+
+
+// the data sent by the returned socket waits for the bandwidth, then reaches the socket after the latency in order.
+// send() returns at once unless 1MiB is delayed, close() sends the delayed data first.
+QSharedPointer<SocketLike> impaired(QSharedPointer<NetworkImpairer> impairer, QSharedPointer<SocketLike> socket);
+
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // QTNG_IMPAIRMENT_H
@@ -0,0 +1,74 @@
+#ifndef QTNG_IOBUF_H
+#define QTNG_IOBUF_H
+
+#include <QtCore/qbytearray.h>
+#include <QtCore/qvector.h>
+#include <QtCore/qlist.h>
+#include "config.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+
+// a chain of slices of refcounted blocks, passed between the layers without copying. the blocks are QByteArray,
+// so it converts from QByteArray without copying, and to QByteArray without copying if it is one whole block.
+//
+//     IOBuf buf = IOBuf::withCapacity(1024, 16);   // leaves 16 bytes before the data for a header.
+//     stream->recv(&buf, 1024);
+//     memcpy(buf.prepend(4), &length, 4);          // in the headroom, nothing is moved.
+//     IOBuf header = buf.split(4);                 // shares the block with buf.
+//
+// the copies of IOBuf share the blocks, a shared block is never written again, the writes go to a new block. so
+// the headroom and tailroom of a block are writable only by the IOBuf holding it alone.
+class IOBuf
+{
+public:
+    IOBuf() {}
+    IOBuf(const QByteArray &data);
+    static IOBuf withCapacity(qint32 capacity, qint32 headroom = 0);
+public:
+    qint32 size() const;
+    bool isEmpty() const { return size() == 0; }
+    void clear() { slices.clear(); }
+    int sliceCount() const { return slices.size(); }
+    const char *sliceData(int i) const;
+    qint32 sliceSize(int i) const { return slices.at(i).length; }
+    // the free bytes before the first slice and after the last one, zero if the block is shared.
+    qint32 headroom() const;
+    qint32 tailroom() const;
+public:
+    // returns the room for size bytes before the data, the headroom is used if it is enough.
+    char *prepend(qint32 size);
+    // returns the room for at least size bytes after the data, call commit() with the bytes written to it.
+    char *reserve(qint32 size);
+    void commit(qint32 size);
+    void append(const char *data, qint32 size);
+    void append(const QByteArray &data);        // shares data.
+    void append(const IOBuf &other);            // shares the blocks of other.
+    // drops the bytes at the start or the end.
+    void trimStart(qint32 size);
+    void trimEnd(qint32 size);
+    // moves the first size bytes to the returned IOBuf, the block in the middle is shared by both.
+    IOBuf split(qint32 size);
+    qint32 copyTo(char *data, qint32 size, qint32 offset = 0) const;
+    // makes one block of the chain, later toByteArray() returns it without copying.
+    void coalesce();
+    QByteArray toByteArray() const;
+    // the slices for sendv(), a partial block is wrapped by QByteArray::fromRawData(), valid while this lives.
+    QList<QByteArray> toList() const;
+private:
+    struct Slice
+    {
+        Slice()
+            :offset(0), length(0) {}
+        QByteArray block;
+        qint32 offset;
+        qint32 length;
+        bool isWritable() const { return block.isDetached(); }
+    };
+    QVector<Slice> slices;
+};
+
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // QTNG_IOBUF_H
@@ -0,0 +1,78 @@
+#ifndef QTNG_JSON_VIEW_H
+#define QTNG_JSON_VIEW_H
+
+#include <QtCore/qbytearray.h>
+#include <QtCore/qstring.h>
+#include <QtCore/qlist.h>
+#include <QtCore/qjsonvalue.h>
+#include <QtCore/qsharedpointer.h>
+#include "socket_utils.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+struct JsonIndex;
+// a value of json text, parsed on demand. the text is scanned once for the brackets, colons, commas and strings,
+// then the values are found by jumping over the nested ones, and converted only when they are read. nothing like
+// QJsonDocument is built, and the strings stay in utf8. a view keeps the text, so it may outlive the response.
+// the grammar is checked only for the values visited, a malformed one reads as Invalid.
+class JsonView
+{
+public:
+    enum Type {
+        Invalid,
+        Null,
+        Bool,
+        Number,
+        String,
+        Array,
+        Object,
+    };
+    JsonView()
+        :position(-1), structural(-1) {}
+public:
+    // returns an invalid view if the brackets or the strings are not closed.
+    static JsonView parse(const QByteArray &json);
+    // reads the rest of body, such as HttpResponse::bodyReader(). returns an invalid view if it exceeds maxSize.
+    static JsonView read(QSharedPointer<FileLike> reader, qint32 maxSize = 1024 * 1024 * 64);
+public:
+    Type type() const;
+    bool isValid() const { return type() != Invalid; }
+    bool isNull() const { return type() == Null; }
+    bool isObject() const { return type() == Object; }
+    bool isArray() const { return type() == Array; }
+
+    // the member of object by the utf8 key, invalid if there is none.
+    JsonView value(const QByteArray &key) const;
+    JsonView value(const QString &key) const { return value(key.toUtf8()); }
+    JsonView value(const char *key) const { return value(QByteArray::fromRawData(key, static_cast<int>(qstrlen(key)))); }
+    JsonView operator[](const char *key) const { return value(key); }
+    JsonView at(int i) const;                   // the item of array.
+    // the members and items separated by dots, such as "data.items.0.name".
+    JsonView path(const QByteArray &path) const;
+    int count() const;                          // the items of array, or the members of object.
+    QList<QByteArray> keys() const;
+
+    bool toBool(bool defaultValue = false) const;
+    qint64 toInteger(qint64 defaultValue = 0) const;
+    double toDouble(double defaultValue = 0.0) const;
+    QString toString(const QString &defaultValue = QString()) const;
+    QByteArray toUtf8() const;                  // the unescaped string.
+    QByteArray raw() const;                     // a copy of the json text of value.
+    QJsonValue toJsonValue() const;             // parses the value by QJsonDocument.
+private:
+    JsonView(QSharedPointer<const JsonIndex> index, int position, int structural)
+        :index(index), position(position), structural(structural) {}
+    JsonView valueAfter(int separator) const;
+    int structuralAfter() const;
+    // steps to the next item or member, the cursor starts at the bracket. key is the string of member name.
+    bool next(int *cursor, int *key, JsonView *item) const;
+private:
+    QSharedPointer<const JsonIndex> index;
+    int position;       // of the first byte of value.
+    int structural;     // of the value if it is a string, array or object, or the first one after a scalar.
+};
+
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // QTNG_JSON_VIEW_H
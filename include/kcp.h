@@ -1,11 +1,63 @@
 #ifndef QTNG_KCP_H
 #define QTNG_KCP_H
 
+#include <functional>
 #include "socket.h"
+#ifndef QTNG_NO_CRYPTO
+#include "cipher.h"
+#endif
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
 
+struct KcpFecStats
+{
+    KcpFecStats()
+        :dataShards(0), parityShards(0), recovered(0), unrecoverable(0) {}
+    quint64 dataShards;      // received.
+    quint64 parityShards;    // received.
+    quint64 recovered;       // the lost packets rebuilt from parity shards, no retransmission is needed for them.
+    quint64 unrecoverable;   // the groups dropped with too few shards to rebuild the lost packets.
+};
+
+
+// the counters are cumulative, the others are read from kcp when stats() is called.
+struct KcpStats
+{
+    KcpStats()
+        :smoothedRtt(0), rttVariance(0), rto(0), congestionWindow(0), sendWindow(0), remoteWindow(0)
+        , sendQueue(0), sendBuffer(0), receiveQueue(0), receiveBuffer(0), segmentsSent(0), retransmissions(0)
+        , fastRetransmissions(0), packetsSent(0), packetsReceived(0), bytesSent(0), bytesReceived(0)
+        , uncompressedBytes(0), compressedBytes(0), fecRecovered(0), datagramsSent(0), datagramsReceived(0)
+        , datagramsDropped(0), lossRate(0.0) {}
+    quint32 smoothedRtt;        // msecs.
+    quint32 rttVariance;
+    quint32 rto;
+    quint32 congestionWindow;   // in packets, zero if the congestion window of kcp is off.
+    quint32 sendWindow;
+    quint32 remoteWindow;       // the receive window told by peer.
+    quint32 sendQueue;          // the packets waiting for the send window.
+    quint32 sendBuffer;         // the packets sent but not acked.
+    quint32 receiveQueue;       // the packets not read by recv().
+    quint32 receiveBuffer;      // the packets received out of order.
+    quint64 segmentsSent;       // including retransmissions.
+    quint64 retransmissions;    // by timeout.
+    quint64 fastRetransmissions;
+    quint64 packetsSent;        // udp datagrams, including acks, keepalives and fec shards.
+    quint64 packetsReceived;
+    quint64 bytesSent;
+    quint64 bytesReceived;
+    quint64 uncompressedBytes;  // the data packets before and after compression, both zero if it is off.
+    quint64 compressedBytes;
+    quint64 fecRecovered;
+    quint64 datagramsSent;      // by sendDatagram(), not by kcp.
+    quint64 datagramsReceived;
+    quint64 datagramsDropped;   // replaced by newer ones, too old, or too many not read.
+    double lossRate;            // the retransmitted share of segments, smoothed every second.
+};
+
+
+class NetworkImpairer;
 class KcpSocketPrivate;
 class KcpSocket
 {
@@ -17,6 +69,22 @@ public:
         Ethernet,
         Loopback,
     };
+    enum CompressionCodec {
+        NoCompression,
+        ZlibCompression,   // qCompress(), the only codec before, works with the old peers.
+        Lz4Compression,    // needs QTNG_HAVE_LZ4.
+        ZstdCompression,   // needs QTNG_HAVE_ZSTD.
+    };
+    enum CongestionControl {
+        DefaultCongestionControl,    // as the mode sets, most modes send the whole window at once.
+        KcpCongestionControl,        // the loss-based congestion window of kcp.
+        FixedRateCongestionControl,  // the packets are paced at setPacingRate().
+        BbrCongestionControl,        // paced at the estimated bottleneck bandwidth, the window follows the bdp.
+    };
+    enum DatagramPolicy {
+        KeepAllDatagrams,            // kept until read, up to 256 of all channels.
+        LatestDatagramOnly,          // a newer one replaces the one not read, and an older one is dropped.
+    };
 public:
     KcpSocket(Socket::NetworkLayerProtocol protocol = Socket::AnyIPProtocol);
     KcpSocket(qintptr socketDescriptor);
@@ -25,13 +93,62 @@ public:
 public:
     void setMode(Mode mode);
     Mode mode() const;
+    // zlib is used for true. the packets are sent uncompressed for a while if they do not get smaller.
     void setCompression(bool compress);
     bool compression() const;
+    // returns false if the codec is not built in. the peer decodes every codec built in, whatever it sends.
+    bool setCompressionCodec(CompressionCodec codec);
+    CompressionCodec compressionCodec() const;
+    // a zstd dictionary trained from typical packets, both peers must use the same one. small packets compress
+    // much better with it.
+    void setCompressionDictionary(const QByteArray &dictionary);
+#ifndef QTNG_NO_CRYPTO
+    // seals every datagram by a pre-shared key, the datagrams not sealed by it are dropped before kcp sees them.
+    // both peers must use the same algorithm and key. the accepted sockets use the key of listening socket.
+    bool setEncryption(AeadCipher::Algorithm algo, const QByteArray &key);
+#endif
+    // reed-solomon parity shards are sent after every dataShards packets, a lost packet is rebuilt from them instead
+    // of waiting for retransmission. zero parityShards disables it. the shards from peer are decoded anyway.
+    void setForwardErrorCorrection(int dataShards, int parityShards);
+    // the ratio suggested for the mode: 10:3 for LargeDelayInternet, 10:2 for Internet and FastInternet, and none
+    // for Ethernet and Loopback.
+    void setForwardErrorCorrection(bool enabled);
+    KcpFecStats fecStats() const;
+    // cheap enough to be polled every second for many sockets.
+    KcpStats stats() const;
+    // the udp datagrams of stats() as calls and bytes, the sessions of a listening socket share its udp socket, so
+    // there are no waits of their own.
+    SocketIoStats ioStats() const;
+    // setMode() resets the tunables below to the presets of mode, the congestion control and pacing rate are kept.
+    void setCongestionControl(CongestionControl congestionControl);
+    CongestionControl congestionControl() const;
+    // bytes per second, zero for no pacing. it is the upper limit for bbr.
+    void setPacingRate(quint64 bytesPerSecond);
+    // the current rate, may be estimated by bbr.
+    quint64 pacingRate() const;
+    // in packets. the congestion controllers may use a smaller send window.
+    void setWindowSize(quint32 sendWindow, quint32 receiveWindow);
+    void setUpdateInterval(quint32 msecs);
+    // resends a packet if so many later packets are acked, zero disables fast resend.
+    void setFastResend(quint32 acks);
+    void setMinRto(quint32 msecs);
     void setSendQueueSize(quint32 sendQueueSize);
     quint32 sendQueueSize() const;
+    // the udp datagrams go through the impairer, for benchmarking on a simulated path. a listening socket impairs
+    // all of its sessions, set it on the master sockets only. null by default.
+    void setImpairer(QSharedPointer<NetworkImpairer> impairer);
     quint32 payloadSizeHint() const;
     void setUdpPacketSize(quint32 udpPacketSize);
     quint32 udpPacketSize() const;
+    // the datagrams bypass kcp, they are neither retransmitted nor ordered, like udp. they share the udp socket, the
+    // session and the encryption of this socket. the channel is chosen by sender, the policy by receiver, and maxAge
+    // drops the ones not read in so many msecs, zero keeps them. the old peers drop them silently.
+    void setDatagramPolicy(quint8 channel, DatagramPolicy policy, quint32 maxAge = 0);
+    // returns -1 if the data is empty, bigger than payloadSizeHint(), or the socket is not connected.
+    qint32 sendDatagram(const char *data, qint32 size, quint8 channel = 0);
+    qint32 sendDatagram(const QByteArray &data, quint8 channel = 0);
+    // waits for the next datagram of any channel, returns an empty one if the socket is closed.
+    QByteArray recvDatagram(quint8 *channel = nullptr);
     Event busy;
     Event notBusy;
 public:
@@ -72,6 +189,34 @@ private:
     Q_DECLARE_PRIVATE(KcpSocket)
 };
 
+// serves kcp sessions by n threads, each has its own eventloop and SO_REUSEPORT udp socket bound to the same port.
+// the kernel picks the socket by the hash of peer endpoint, so all packets of a session go to the thread accepted it.
+// the handler runs in a new coroutine of that thread, and the session must not leave it.
+class KcpShardedServerPrivate;
+class KcpShardedServer
+{
+public:
+    typedef std::function<void(QSharedPointer<KcpSocket>)> Handler;
+    KcpShardedServer(const QHostAddress &serverAddress, quint16 serverPort, int shards);
+    ~KcpShardedServer();
+public:
+    void setMode(KcpSocket::Mode mode);
+    // called in the thread of every shard before listening, such as setting the encryption of the socket.
+    void setSetup(const std::function<void(KcpSocket *)> &setup);
+    void setBacklog(int backlog);
+    int shards() const;
+    // the port chosen by system if the server port is zero.
+    quint16 serverPort() const;
+    // returns false if any shard can not listen. the sessions are killed by stop().
+    bool start(const Handler &handler);
+    void stop();
+private:
+    KcpShardedServerPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(KcpShardedServer)
+    Q_DISABLE_COPY(KcpShardedServer)
+};
+
+
 QSharedPointer<KcpSocket> convertSocketLikeToKcpSocket(QSharedPointer<class SocketLike> socket);
 
 QTNETWORKNG_NAMESPACE_END
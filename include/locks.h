@@ -2,11 +2,15 @@
 #define QTNG_LOCKS_H
 
 #include <QtCore/qqueue.h>
+#include <QtCore/qvector.h>
 #include <QtCore/qdebug.h>
 #include "coroutine.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
+class LockWaiterQueue;
+class Task;
+
 class SemaphorePrivate;
 class Semaphore
 {
@@ -63,9 +67,11 @@ public:
     void notifyAll();
     quint32 getting() const;
 private:
+    LockWaiterQueue *waiters();
     ConditionPrivate * const d_ptr;
     Q_DECLARE_PRIVATE(Condition)
     Q_DISABLE_COPY(Condition)
+    friend class Event;
 };
 
 
@@ -82,9 +88,11 @@ public:
     bool isSet() const;
     quint32 getting() const;
 private:
+    LockWaiterQueue *waiters();  // for the stackless Task.
     EventPrivate * const d_ptr;
     Q_DECLARE_PRIVATE(Event)
     Q_DISABLE_COPY(Event)
+    friend class Task;
 };
 
 template<typename Value>
@@ -137,6 +145,50 @@ private:
     Q_DISABLE_COPY(Gate)
 };
 
+// a shared/exclusive lock. a waiting writer stops new readers, and the writers waiting for a writer go
+// before the readers, so writers never starve.
+class RWLockPrivate;
+class RWLock
+{
+public:
+    RWLock();
+    virtual ~RWLock();
+public:
+    bool acquireRead(bool blocking = true);
+    void releaseRead();
+    bool acquireWrite(bool blocking = true);
+    void releaseWrite();
+    int readers() const;
+    bool isWriting() const;
+private:
+    RWLockPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(RWLock)
+    Q_DISABLE_COPY(RWLock)
+};
+
+// limits the units used concurrently, such as the requests to a backend. the waiters are served in order.
+class LimiterPrivate;
+class Limiter
+{
+public:
+    explicit Limiter(quint32 capacity);
+    virtual ~Limiter();
+public:
+    // waits at most secs for weight units, zero means forever and negative means not waiting.
+    bool acquire(quint32 weight = 1, float secs = 0.0f);
+    void release(quint32 weight = 1);
+    quint32 capacity() const;
+    quint32 available() const;
+    int waiting() const;             // the length of waiting queue.
+    quint64 acquired() const;        // the number of successful acquire().
+    qint64 totalWaitMsecs() const;   // the time spent in waiting by successful acquire().
+    qint64 longestWaitMsecs() const;
+private:
+    LimiterPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(Limiter)
+    Q_DISABLE_COPY(Limiter)
+};
+
 template <typename LockType>
 class ScopedLock
 {
@@ -159,6 +211,7 @@ private:
 };
 
 
+// a fifo queue of coroutines stored in a ring buffer, it grows by doubling and never shrinks until clear().
 template <typename T>
 class Queue
 {
@@ -168,29 +221,40 @@ public:
     ~Queue();
     void setCapacity(quint32 capacity);
     bool put(const T &e);          // insert e to the tail of queue.
+    bool put(T &&e);
     bool putForcedly(const T& e);  // insert e to the tail of queue ignoring capacity.
+    bool putMany(const QList<T> &l);  // insert all items of l, waits if the queue is full.
     bool returns(const T &e);      // like put() but insert e to the head of queue.
     T get();
+    QList<T> getMany(quint32 maxItems);  // waits for one item at least, and takes all available up to maxItems.
     bool isEmpty() const;
     bool isFull() const;
     quint32 capacity() const { return mCapacity; }
-    quint32 size() const { return queue.size(); }
+    quint32 size() const { return count; }
     quint32 getting() const { return notEmpty.getting();}
 
     void clear();
-    bool contains(const T &e) const { return queue.contains(e); }
+    bool contains(const T &e) const;
     bool remove(const T &e);
 private:
-    QQueue<T> queue;
+    void reserve(quint32 n);
+    T &at(quint32 i) { return buffer[static_cast<int>((head + i) & (buffer.size() - 1))]; }
+    const T &at(quint32 i) const { return buffer[static_cast<int>((head + i) & (buffer.size() - 1))]; }
+    void updateEvents();
+private:
+    QVector<T> buffer;  // the size is zero or a power of two.
+    quint32 head;
+    quint32 count;
     Event notEmpty;
     Event notFull;
     quint32 mCapacity;
     Q_DISABLE_COPY(Queue)
+    friend class Task;
 };
 
 template<typename T>
 Queue<T>::Queue(quint32 capacity)
-    :mCapacity(capacity)
+    :head(0), count(0), mCapacity(capacity)
 {
     notEmpty.clear();
     notFull.set();
@@ -199,7 +263,7 @@ Queue<T>::Queue(quint32 capacity)
 template<typename T>
 Queue<T>::~Queue()
 {
-//    if (queue.size() > 0) {
+//    if (count > 0) {
 //        qDebug() << "queue is free with element left.";
 //    }
 }
@@ -208,8 +272,46 @@ template<typename T>
 void Queue<T>::setCapacity(quint32 capacity)
 {
     this->mCapacity = capacity;
+    updateEvents();
+}
+
+
+template<typename T>
+void Queue<T>::reserve(quint32 n)
+{
+    if (n <= static_cast<quint32>(buffer.size())) {
+        return;
+    }
+    int newSize = qMax(buffer.size(), 8);
+    while (static_cast<quint32>(newSize) < n) {
+        newSize *= 2;
+    }
+    QVector<T> newBuffer(newSize);
+    for (quint32 i = 0; i < count; ++i) {
+        newBuffer[static_cast<int>(i)] = std::move(at(i));
+    }
+    buffer.swap(newBuffer);
+    head = 0;
+}
+
+
+// the events are changed only if the state is changed, so pushing to a busy queue wakes nobody.
+template<typename T>
+void Queue<T>::updateEvents()
+{
+    if (count > 0) {
+        if (!notEmpty.isSet()) {
+            notEmpty.set();
+        }
+    } else if (notEmpty.isSet()) {
+        notEmpty.clear();
+    }
     if (isFull()) {
-        notFull.clear();
+        if (notFull.isSet()) {
+            notFull.clear();
+        }
+    } else if (!notFull.isSet()) {
+        notFull.set();
     }
 }
 
@@ -217,45 +319,75 @@ void Queue<T>::setCapacity(quint32 capacity)
 template<typename T>
 void Queue<T>::clear()
 {
-    this->queue.clear();
-    notFull.set();
-    notEmpty.clear();
+    buffer.clear();
+    head = 0;
+    count = 0;
+    updateEvents();
+}
+
+
+template<typename T>
+bool Queue<T>::contains(const T &e) const
+{
+    for (quint32 i = 0; i < count; ++i) {
+        if (at(i) == e) {
+            return true;
+        }
+    }
+    return false;
 }
 
 
 template<typename T>
 bool Queue<T>::remove(const T &e)
 {
-    int n = this->queue.removeAll(e);
-    if (n > 0) {
-        if (isEmpty()) {
-            notEmpty.clear();
-        } else {
-            notEmpty.set();
+    quint32 kept = 0;
+    for (quint32 i = 0; i < count; ++i) {
+        if (at(i) == e) {
+            continue;
         }
-        if (isFull()) {
-            notFull.clear();
-        } else {
-            notFull.set();
+        if (kept != i) {
+            at(kept) = std::move(at(i));
         }
-        return true;
-    } else {
+        ++kept;
+    }
+    if (kept == count) {
         return false;
     }
+    for (quint32 i = kept; i < count; ++i) {
+        at(i) = T();
+    }
+    count = kept;
+    updateEvents();
+    return true;
 }
 
 
 template<typename T>
 bool Queue<T>::put(const T &e)
 {
-    if (!notFull.wait()) {
-        return false;
+    // another coroutine woken by the same event may fill the queue first.
+    while (isFull()) {
+        if (!notFull.wait()) {
+            return false;
+        }
     }
-    queue.enqueue(e);
-    notEmpty.set();
-    if (isFull()) {
-        notFull.clear();
+    return putForcedly(e);
+}
+
+
+template<typename T>
+bool Queue<T>::put(T &&e)
+{
+    while (isFull()) {
+        if (!notFull.wait()) {
+            return false;
+        }
     }
+    reserve(count + 1);
+    at(count) = std::move(e);
+    ++count;
+    updateEvents();
     return true;
 }
 
@@ -263,10 +395,34 @@ bool Queue<T>::put(const T &e)
 template<typename T>
 bool Queue<T>::putForcedly(const T& e)
 {
-    queue.enqueue(e);
-    notEmpty.set();
-    if (isFull()) {
-        notFull.clear();
+    reserve(count + 1);
+    at(count) = e;
+    ++count;
+    updateEvents();
+    return true;
+}
+
+
+template<typename T>
+bool Queue<T>::putMany(const QList<T> &l)
+{
+    int i = 0;
+    while (i < l.size()) {
+        while (isFull()) {
+            if (!notFull.wait()) {
+                return false;
+            }
+        }
+        quint32 n = static_cast<quint32>(l.size() - i);
+        if (mCapacity > 0) {
+            n = qMin(n, mCapacity - count);
+        }
+        reserve(count + n);
+        for (quint32 j = 0; j < n; ++j, ++i) {
+            at(count) = l.at(i);
+            ++count;
+        }
+        updateEvents();
     }
     return true;
 }
@@ -275,42 +431,68 @@ bool Queue<T>::putForcedly(const T& e)
 template<typename T>
 bool Queue<T>::returns(const T &e)
 {
-    if (!notFull.wait()) {
-        return false;
-    }
-    queue.prepend(e);
-    notEmpty.set();
-    if (isFull()) {
-        notFull.clear();
+    while (isFull()) {
+        if (!notFull.wait()) {
+            return false;
+        }
     }
+    reserve(count + 1);
+    head = (head - 1) & static_cast<quint32>(buffer.size() - 1);
+    at(0) = e;
+    ++count;
+    updateEvents();
     return true;
 }
 
 template<typename T>
 T Queue<T>::get()
 {
-    if (!notEmpty.wait())
-        return T();
-    const T &e = queue.dequeue();
-    if (isEmpty()) {
-        notEmpty.clear();
-    }
-    if (!isFull()) {
-        notFull.set();
+    while (count == 0) {
+        if (!notEmpty.wait())
+            return T();
     }
+    T e = std::move(at(0));
+    at(0) = T();
+    head = (head + 1) & static_cast<quint32>(buffer.size() - 1);
+    --count;
+    updateEvents();
     return e;
 }
 
+template<typename T>
+QList<T> Queue<T>::getMany(quint32 maxItems)
+{
+    QList<T> result;
+    if (maxItems == 0) {
+        return result;
+    }
+    while (count == 0) {
+        if (!notEmpty.wait()) {
+            return result;
+        }
+    }
+    const quint32 n = qMin(maxItems, count);
+    result.reserve(static_cast<int>(n));
+    for (quint32 i = 0; i < n; ++i) {
+        result.append(std::move(at(i)));
+        at(i) = T();
+    }
+    head = (head + n) & static_cast<quint32>(buffer.size() - 1);
+    count -= n;
+    updateEvents();
+    return result;
+}
+
 template<typename T>
 inline bool Queue<T>::isEmpty() const
 {
-    return queue.isEmpty();
+    return count == 0;
 }
 
 template<typename T>
 inline bool Queue<T>::isFull() const
 {
-    return mCapacity > 0 && static_cast<quint32>(queue.size()) >= mCapacity;
+    return mCapacity > 0 && count >= mCapacity;
 }
 
 QTNETWORKNG_NAMESPACE_END
@@ -2,6 +2,7 @@
 #define QTNG_MD_H
 
 #include <QtCore/qbytearray.h>
+#include <QtCore/qlist.h>
 #include "crypto.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
@@ -37,6 +38,12 @@ public:
 public:
     static QByteArray hash(const QByteArray &data, Algorithm algo);
     static QByteArray digest(const QByteArray &data, Algorithm algo);
+    // the digest of many small blobs, reusing one context of the current thread instead of making one per blob.
+    static QList<QByteArray> hashMany(const QList<QByteArray> &data, Algorithm algo);
+    static QList<QByteArray> digestMany(const QList<QByteArray> &data, Algorithm algo);
+    // writes the digest to out which has digestSize(algo) bytes at least, returns the size or -1.
+    static int digest(const char *data, int len, Algorithm algo, char *out);
+    static int digestSize(Algorithm algo);
 private:
     MessageDigestPrivate * const d_ptr;
     Q_DECLARE_PRIVATE(MessageDigest)
@@ -58,6 +65,64 @@ inline QByteArray MessageDigest::digest(const QByteArray &data, Algorithm algo)
     return m.result();
 }
 
+
+// hmac with the inner and outer pads computed once, reset() starts the next message with the same key.
+class HmacPrivate;
+class Hmac
+{
+public:
+    Hmac(MessageDigest::Algorithm algo, const QByteArray &key);
+    virtual ~Hmac();
+public:
+    inline void addData(const QByteArray &data) { addData(data.constData(), data.size()); }
+    void addData(const char *data, int len);
+    QByteArray result();
+    void reset();
+    // compares the result with mac in constant time.
+    bool verify(const QByteArray &mac);
+public:
+    static QByteArray hmac(const QByteArray &key, const QByteArray &data, MessageDigest::Algorithm algo);
+private:
+    HmacPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(Hmac)
+};
+
+
+// BLAKE2b gives 1 to 64 bytes, and BLAKE2s gives 1 to 32 bytes. the key is optional, no longer than the maximum
+// output size. zero outputSize means the maximum.
+class Blake2Private;
+class Blake2
+{
+public:
+    enum Variant
+    {
+        Blake2b = 0,
+        Blake2s = 1,
+    };
+public:
+    explicit Blake2(Variant variant, int outputSize = 0, const QByteArray &key = QByteArray());
+    virtual ~Blake2();
+public:
+    inline void addData(const QByteArray &data) { addData(data.constData(), data.size()); }
+    void addData(const char *data, int len);
+    QByteArray result();
+    bool isValid() const;
+public:
+    static QByteArray hash(const QByteArray &data, Variant variant, int outputSize = 0,
+                           const QByteArray &key = QByteArray());
+private:
+    Blake2Private * const d_ptr;
+    Q_DECLARE_PRIVATE(Blake2)
+};
+
+
+// the keyed SipHash-2-4 for hash tables fed by the peers, and the unkeyed xxHash64 for checksums. neither is a
+// cryptographic digest.
+quint64 sipHash24(const char *data, qint64 len, quint64 k0, quint64 k1);
+inline quint64 sipHash24(const QByteArray &data, quint64 k0, quint64 k1) { return sipHash24(data.constData(), data.size(), k0, k1); }
+quint64 xxHash64(const char *data, qint64 len, quint64 seed = 0);
+inline quint64 xxHash64(const QByteArray &data, quint64 seed = 0) { return xxHash64(data.constData(), data.size(), seed); }
+
 QByteArray PBKDF2_HMAC(int keylen, const QByteArray &password, const QByteArray &salt,
                        const MessageDigest::Algorithm hashAlgo = MessageDigest::Sha256,
                        int i = 10000);
@@ -65,6 +130,15 @@ QByteArray PBKDF2_HMAC(int keylen, const QByteArray &password, const QByteArray
 QByteArray scrypt(int keylen, const QByteArray &password, const QByteArray &salt,
                   int n = 1048576, int r = 8, int p = 1);
 
+// the same as above, but run by callInThreadPool(), so the eventloop goes on serving other coroutines while the
+// password is hashed.
+QByteArray offloadPBKDF2_HMAC(int keylen, const QByteArray &password, const QByteArray &salt,
+                              const MessageDigest::Algorithm hashAlgo = MessageDigest::Sha256,
+                              int i = 10000);
+
+QByteArray offloadScrypt(int keylen, const QByteArray &password, const QByteArray &salt,
+                         int n = 1048576, int r = 8, int p = 1);
+
 QTNETWORKNG_NAMESPACE_END
 
 #endif // QTNG_MD_H
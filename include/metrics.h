@@ -0,0 +1,37 @@
+#ifndef QTNG_METRICS_H
+#define QTNG_METRICS_H
+
+#include <QtCore/qbytearray.h>
+#include <QtCore/qstring.h>
+#include "config.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+// an opt-in registry of the library internals in the prometheus text format: the event loop, coroutines,
+// connection pools, dns cache, tls handshakes, httpd requests and the queues of kcp and data channels. nothing
+// is counted until it is enabled, so enable it before the work starts, the gauges count the changes since then.
+// every thread counts into its own shard, render() merges the shards.
+class Metrics
+{
+public:
+    enum Buckets {
+        LatencyBuckets,     // seconds, from 1ms to 10s.
+        DepthBuckets,       // the items of a queue, from 0 to 4096.
+    };
+    static void setEnabled(bool enabled);
+    static bool isEnabled();
+    // the name must be a string literal. the labels are joined by commas, such as label("host", h) + ',' + label("status", "200").
+    static void increase(const char *name, const QByteArray &labels = QByteArray(), qint64 value = 1);
+    // a gauge made of the deltas, so it is merged the same way as counters.
+    static void adjust(const char *name, const QByteArray &labels, qint64 delta);
+    static void observe(const char *name, const QByteArray &labels, double value, Buckets buckets = LatencyBuckets);
+    // the value is escaped.
+    static QByteArray label(const char *name, const QString &value);
+    // the text exposition format 0.0.4. the event loop metrics are of the calling thread.
+    static QByteArray render();
+    static void clear();
+};
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // QTNG_METRICS_H
@@ -2,10 +2,12 @@
 #define QTNG_MSGPACK_H
 
 #include <limits>
+#include <cstring>
 #include <QtCore/qvariant.h>
 #include <QtCore/qiodevice.h>
 #include <QtCore/qdatetime.h>
 #include <QtCore/qendian.h>
+#include <QtCore/quuid.h>
 #include "config.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
@@ -16,12 +18,23 @@ struct MsgPackExtData
     QByteArray payload;
 };
 
+class MsgPackStream;
+// the codec of an extension type, the value points to an instance of the registered metatype. the encoder writes
+// the header and payload, and the decoder gets the payload in place.
+typedef bool (*MsgPackExtEncoder)(MsgPackStream &s, quint8 extType, const void *value);
+typedef bool (*MsgPackExtDecoder)(const char *payload, quint32 len, void *value);
+
+// specialize it with encode() and decode() for QTNG_MSGPACK_EXT() and MsgPackStream::registerExtType<T>().
+template<typename T> struct MsgPackExtCodec;
+
 class MsgPackStreamPrivate;
 class MsgPackStream
 {
 public:
     MsgPackStream();
     MsgPackStream(QIODevice *d);
+    // the byte arrays are parsed and written in place, device() is null unless it is opened ReadWrite.
+    // a null array opened WriteOnly counts the bytes of values instead of writing them, see msgPackEncode().
     MsgPackStream(QByteArray *a, QIODevice::OpenMode mode);
     MsgPackStream(const QByteArray &a);
     virtual ~MsgPackStream();
@@ -76,6 +89,34 @@ public:
     MsgPackStream &operator<<(const QVariant &v);
     bool writeBytes(const char *data, qint64 len);
     bool writeExtHeader(quint32 len, quint8 msgpackType);
+    // reads an extension, the payload refers to the byte array of stream, or the buffer copied from device.
+    bool readExt(quint8 &extType, const char *&payload, quint32 &len, QByteArray &buffer);
+    // the QVariant of metaTypeId is encoded by the codec instead of MsgPackExtData, and the extension is decoded
+    // to it. register the types before using streams, the registry is not locked.
+    static void registerExtType(quint8 extType, int metaTypeId, MsgPackExtEncoder encoder, MsgPackExtDecoder decoder);
+    template<typename T> static void registerExtType(quint8 extType);
+
+    // the items of array and the entries of map follow their headers.
+    bool readArrayHeader(quint32 &len);
+    bool readMapHeader(quint32 &len);
+    bool writeArrayHeader(quint32 len);
+    bool writeMapHeader(quint32 len);
+    // writes a header of array32 or map32 patched by endArray() or endMap(), so the items are streamed without
+    // knowing the count beforehand. only for byte arrays opened WriteOnly.
+    bool beginArray();
+    bool endArray(quint32 len);
+    bool beginMap();
+    bool endMap(quint32 len);       // len is the number of entries, not keys and values.
+    qint64 position() const;        // of the byte array, or the bytes counted.
+    // reads a string key into data, returns its length. the keys of other types or longer than size are skipped,
+    // and -1 is returned.
+    qint32 readKey(char *data, qint32 size);
+    bool skipValue();     // skips one value and its children without decoding.
+    // the strings kept as utf8 without converting to QString. readUtf8() validates the bytes, and sets
+    // ReadCorruptData if they are not utf8. writeUtf8() trusts the bytes.
+    bool readUtf8(QByteArray &utf8);
+    bool writeUtf8(const char *data, qint32 size);
+    static bool isValidUtf8(const char *data, qint64 size);
 
 private:
     MsgPackStreamPrivate * const d_ptr;
@@ -83,8 +124,201 @@ private:
 };
 
 
-/**
- * @brief The FirstByte enum
+template<typename T>
+void MsgPackStream::registerExtType(quint8 extType)
+{
+    registerExtType(extType, qMetaTypeId<T>(), [] (MsgPackStream &s, quint8 extType, const void *value) {
+        return MsgPackExtCodec<T>::encode(s, extType, *static_cast<const T*>(value));
+    }, [] (const char *payload, quint32 len, void *value) {
+        return MsgPackExtCodec<T>::decode(payload, len, *static_cast<T*>(value));
+    });
+}
+
+
+// the timestamp extension of type -1, used by operator<<(const QDateTime &) always. decodes the 32, 64 and 96 bits
+// forms, the 64 bits form keeps the layout of old versions.
+template<>
+struct MsgPackExtCodec<QDateTime>
+{
+    static bool encode(MsgPackStream &s, quint8 extType, const QDateTime &v);
+    static bool decode(const char *payload, quint32 len, QDateTime &v);
+};
+
+
+// the 16 bytes of rfc4122, not registered by default. MsgPackStream::registerExtType<QUuid>(type) to use it.
+template<>
+struct MsgPackExtCodec<QUuid>
+{
+    static bool encode(MsgPackStream &s, quint8 extType, const QUuid &v);
+    static bool decode(const char *payload, quint32 len, QUuid &v);
+};
+
+
+// one value of msgpack data, decoded only if asked. the views keep a reference to the source, the strings and
+// bytes are not copied, and the other values are skipped by their encoded size, so a proxy can inspect a few
+// fields and forward the rest without allocating.
+class MsgPackView
+{
+public:
+    enum Type {
+        Invalid,    // truncated or corrupt.
+        Nil,
+        Boolean,
+        Integer,
+        Float,
+        String,
+        Binary,
+        Array,
+        Map,
+        Extension,
+    };
+    MsgPackView();
+    explicit MsgPackView(const QByteArray &source, int offset = 0);
+public:
+    Type type() const { return _type; }
+    bool isValid() const { return _type != Invalid; }
+    bool isNil() const { return _type == Nil; }
+    int offset() const { return _offset; }
+    int size() const;                       // the encoded bytes of value and its children, -1 if corrupt.
+    MsgPackView next() const;               // the value following this one, such as the next item of array.
+
+    bool toBool() const;
+    qint64 toInteger(bool *ok = nullptr) const;
+    quint64 toUnsignedInteger(bool *ok = nullptr) const;
+    double toDouble(bool *ok = nullptr) const;
+    QString toString() const;               // decodes the utf8 of string.
+    QByteArray toByteArray() const;         // copies the payload of string, binary and extension.
+    QVariant toVariant() const;
+    quint8 extensionType() const;
+
+    // the payload of string, binary and extension in the source.
+    const char *data() const;
+    int length() const;                     // zero for the other types.
+    bool equals(const QByteArray &bytes) const;
+    // refer to the memory of source by QByteArray::fromRawData(), they must not outlive the source.
+    QByteArray bytes() const;               // the payload.
+    QByteArray encoded() const;             // the whole value, to be forwarded as it is.
+
+    int count() const;                      // the items of array, or the entries of map.
+    MsgPackView at(int i) const;            // the item of array, or the key of entry i of map.
+    QList<MsgPackView> items() const;       // the items of array, or the keys and values of map one after another.
+    // finds the entry of map by the utf8 bytes of key, the values of other entries are skipped without decoding.
+    MsgPackView value(const QByteArray &key) const;
+    MsgPackView value(const QString &key) const { return value(key.toUtf8()); }
+    MsgPackView value(const char *key) const { return value(QByteArray::fromRawData(key, static_cast<int>(qstrlen(key)))); }
+private:
+    QByteArray source;
+    int _offset;
+    int headerSize;
+    quint32 _length;        // the payload bytes, or the items of array and map.
+    mutable int _size;
+    Type _type;
+};
+
+
+// a value of MsgPackDocument, valid until the document is parsed again or deleted.
+struct MsgPackNode;
+class MsgPackValue
+{
+public:
+    MsgPackValue() :node(nullptr) {}
+public:
+    MsgPackView::Type type() const;
+    bool isValid() const { return node != nullptr; }
+    bool isNil() const { return type() == MsgPackView::Nil; }
+
+    bool toBool() const;
+    qint64 toInteger(bool *ok = nullptr) const;
+    quint64 toUnsignedInteger(bool *ok = nullptr) const;
+    double toDouble(bool *ok = nullptr) const;
+    QString toString() const;
+    QByteArray toByteArray() const;         // copies the payload of string, binary and extension.
+    QVariant toVariant() const;             // converts the children too, like MsgPackStream.
+    quint8 extensionType() const;
+
+    // the payload of string, binary and extension in the source of document.
+    const char *data() const;
+    int length() const;
+    bool equals(const QByteArray &bytes) const;
+    QByteArray bytes() const;               // refers to the source by QByteArray::fromRawData().
+
+    int count() const;                      // the items of array, or the entries of map.
+    MsgPackValue at(int i) const;           // the item of array, or the value of entry i of map.
+    MsgPackValue keyAt(int i) const;        // the key of entry i of map. the entries are sorted by key.
+    // finds the entry of map by binary search over the utf8 bytes of key.
+    MsgPackValue value(const QByteArray &key) const;
+    MsgPackValue value(const QString &key) const { return value(key.toUtf8()); }
+    MsgPackValue value(const char *key) const { return value(QByteArray::fromRawData(key, static_cast<int>(qstrlen(key)))); }
+private:
+    explicit MsgPackValue(const MsgPackNode *node) :node(node) {}
+    const MsgPackNode *node;
+    friend class MsgPackDocument;
+};
+
+
+// a tree of msgpack data for large documents. the nodes are allocated from an arena freed at once, the strings
+// and bytes refer to the source, and the entries of maps are sorted arrays instead of QMap. it is much cheaper
+// than decoding to QVariantMap and QVariantList, which allocate every node.
+class MsgPackDocumentPrivate;
+class MsgPackDocument
+{
+public:
+    MsgPackDocument();
+    ~MsgPackDocument();
+public:
+    // returns false if the data is corrupt, or nested deeper than 512 levels. the data is kept by the document.
+    bool parse(const QByteArray &data);
+    MsgPackValue root() const;
+    qint64 memoryUsage() const;             // the bytes of arena.
+    void clear();
+private:
+    MsgPackDocumentPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(MsgPackDocument)
+    Q_DISABLE_COPY(MsgPackDocument)
+};
+
+
+// transcodes json text to msgpack and back in one pass, without QJsonDocument or QVariant. the json numbers
+// without fraction and exponent become integers. the arrays and maps of json are written with 32 bits headers.
+// returns a null QByteArray if the input is invalid.
+QByteArray jsonToMsgPack(const char *json, qint64 size);
+inline QByteArray jsonToMsgPack(const QByteArray &json) { return jsonToMsgPack(json.constData(), json.size()); }
+QByteArray msgPackToJson(const char *msgpack, qint64 size);
+inline QByteArray msgPackToJson(const QByteArray &msgpack) { return msgPackToJson(msgpack.constData(), msgpack.size()); }
+
+// splits a stream of msgpack values into messages as the chunks arrive, such as the data of Socket::recv().
+// the parse state is kept between chunks, so every byte is scanned once. the messages are decoded by
+// MsgPackStream or MsgPackView.
+//
+//     MsgPackDecoder decoder;
+//     while (decoder.feed(socket->recv(1024 * 64))) {
+//         while (decoder.hasMessage()) { handle(decoder.takeMessage()); }
+//     }
+class MsgPackDecoderPrivate;
+class MsgPackDecoder
+{
+public:
+    MsgPackDecoder();
+    ~MsgPackDecoder();
+public:
+    void setMaxDepth(int depth);            // the nested arrays and maps, 64 by default.
+    int maxDepth() const;
+    void setMaxSize(quint32 bytes);         // the encoded bytes of one message, 16MB by default.
+    quint32 maxSize() const;
+    // returns false if data is empty, or the stream is corrupt or over the limits. it is broken then.
+    bool feed(const QByteArray &data);
+    bool feed(const char *data, qint32 size);
+    bool hasMessage() const;
+    QByteArray takeMessage();               // the encoded bytes of the next complete value.
+    QVariant takeVariant();
+    bool isBroken() const;
+    qint32 pendingBytes() const;            // the bytes of incomplete message.
+    void reset();
+private:
+    MsgPackDecoderPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(MsgPackDecoder)
+    Q_DISABLE_COPY(MsgPackDecoder)
+};
  * From Message Pack spec
  */
 namespace FirstByte {
@@ -284,8 +518,174 @@ MsgPackStream& operator>>(MsgPackStream& s, QMap<K, V> &map)
     return s;
 }
 
+// encodes a value into a byte array allocated once, by counting its size before writing.
+template<typename T>
+QByteArray msgPackEncode(const T &value)
+{
+    MsgPackStream counter(nullptr, QIODevice::WriteOnly);
+    counter << value;
+    QByteArray bs;
+    if (counter.status() != MsgPackStream::Ok || counter.position() > std::numeric_limits<int>::max()) {
+        return bs;
+    }
+    bs.reserve(static_cast<int>(counter.position()));
+    MsgPackStream s(&bs, QIODevice::WriteOnly);
+    s << value;
+    return bs;
+}
+
+namespace MsgPackFields {
+const qint32 MaxKeySize = 32;
+
+template<int N>
+inline void writeKey(MsgPackStream &s, const char (&name)[N])
+{
+    static_assert(N - 1 < MaxKeySize, "the name of field is too long for fixstr.");
+    char buf[N];
+    buf[0] = static_cast<char>(FirstByte::FIXSTR | (N - 1));
+    memcpy(buf + 1, name, N - 1);
+    s.writeBytes(buf, N);
+}
+
+template<int N>
+inline bool matches(const char *key, qint32 len, const char (&name)[N])
+{
+    return len == N - 1 && memcmp(key, name, N - 1) == 0;
+}
+}
+
 QTNETWORKNG_NAMESPACE_END
 
 Q_DECLARE_METATYPE(QTNETWORKNG_NAMESPACE::MsgPackExtData)
 
+
+// defines operator<< and operator>> of Type by MsgPackExtCodec<Type>, so the typed values are encoded without
+// MsgPackExtData and QVariant.
+#define QTNG_MSGPACK_EXT(Type, extType) \
+    inline QTNETWORKNG_NAMESPACE::MsgPackStream &operator<<(QTNETWORKNG_NAMESPACE::MsgPackStream &s, const Type &v) \
+    { \
+        if (!QTNETWORKNG_NAMESPACE::MsgPackExtCodec<Type>::encode(s, (extType), v) \
+                && s.status() == QTNETWORKNG_NAMESPACE::MsgPackStream::Ok) { \
+            s.setStatus(QTNETWORKNG_NAMESPACE::MsgPackStream::WriteFailed); \
+        } \
+        return s; \
+    } \
+    inline QTNETWORKNG_NAMESPACE::MsgPackStream &operator>>(QTNETWORKNG_NAMESPACE::MsgPackStream &s, Type &v) \
+    { \
+        quint8 t; \
+        const char *payload; \
+        quint32 len; \
+        QByteArray buffer; \
+        if (s.readExt(t, payload, len, buffer) && (t != static_cast<quint8>(extType) \
+                || !QTNETWORKNG_NAMESPACE::MsgPackExtCodec<Type>::decode(payload, len, v))) { \
+            s.setStatus(QTNETWORKNG_NAMESPACE::MsgPackStream::ReadCorruptData); \
+        } \
+        return s; \
+    }
+
+
+// the fields of struct are encoded as a map keyed by the names of fields, or an array in the order of fields.
+// the keys are encoded at compile time, and decoded without allocation. a map ignores the unknown keys and
+// keeps the fields missing from it, so the both sides may add fields. up to 32 fields are supported, every
+// field must have its own operator<< and operator>>, such as the nested struct, QList and QMap.
+//
+//     struct Point { qint32 x; qint32 y; QString label; };
+//     QTNG_MSGPACK_FIELDS(Point, x, y, label)
+//
+// the macro defines the operators, so it must be used in the namespace of struct.
+#define QTNG_MSGPACK_FIELDS(Type, ...) \
+    inline QTNETWORKNG_NAMESPACE::MsgPackStream &operator<<(QTNETWORKNG_NAMESPACE::MsgPackStream &s, const Type &v) \
+    { \
+        s.writeMapHeader(QTNG_MSGPACK_COUNT(__VA_ARGS__)); \
+        QTNG_MSGPACK_FOR_EACH(QTNG_MSGPACK_ENCODE_ENTRY, __VA_ARGS__) \
+        return s; \
+    } \
+    inline QTNETWORKNG_NAMESPACE::MsgPackStream &operator>>(QTNETWORKNG_NAMESPACE::MsgPackStream &s, Type &v) \
+    { \
+        quint32 n; \
+        if (!s.readMapHeader(n)) { \
+            return s; \
+        } \
+        char key[QTNETWORKNG_NAMESPACE::MsgPackFields::MaxKeySize]; \
+        for (quint32 i = 0; i < n && s.status() == QTNETWORKNG_NAMESPACE::MsgPackStream::Ok; ++i) { \
+            const qint32 len = s.readKey(key, QTNETWORKNG_NAMESPACE::MsgPackFields::MaxKeySize); \
+            if (s.status() != QTNETWORKNG_NAMESPACE::MsgPackStream::Ok) { \
+                break; \
+            } else if (len < 0) { \
+                s.skipValue(); \
+            } \
+            QTNG_MSGPACK_FOR_EACH(QTNG_MSGPACK_DECODE_ENTRY, __VA_ARGS__) \
+            else { \
+                s.skipValue(); \
+            } \
+        } \
+        return s; \
+    }
+
+#define QTNG_MSGPACK_FIELDS_AS_ARRAY(Type, ...) \
+    inline QTNETWORKNG_NAMESPACE::MsgPackStream &operator<<(QTNETWORKNG_NAMESPACE::MsgPackStream &s, const Type &v) \
+    { \
+        s.writeArrayHeader(QTNG_MSGPACK_COUNT(__VA_ARGS__)); \
+        QTNG_MSGPACK_FOR_EACH(QTNG_MSGPACK_ENCODE_ITEM, __VA_ARGS__) \
+        return s; \
+    } \
+    inline QTNETWORKNG_NAMESPACE::MsgPackStream &operator>>(QTNETWORKNG_NAMESPACE::MsgPackStream &s, Type &v) \
+    { \
+        quint32 n; \
+        if (!s.readArrayHeader(n)) { \
+            return s; \
+        } \
+        quint32 i = 0; \
+        QTNG_MSGPACK_FOR_EACH(QTNG_MSGPACK_DECODE_ITEM, __VA_ARGS__) \
+        for (; i < n && s.status() == QTNETWORKNG_NAMESPACE::MsgPackStream::Ok; ++i) { \
+            s.skipValue(); \
+        } \
+        return s; \
+    }
+
+#define QTNG_MSGPACK_ENCODE_ENTRY(f) QTNETWORKNG_NAMESPACE::MsgPackFields::writeKey(s, #f); s << v.f;
+#define QTNG_MSGPACK_DECODE_ENTRY(f) else if (QTNETWORKNG_NAMESPACE::MsgPackFields::matches(key, len, #f)) { s >> v.f; }
+#define QTNG_MSGPACK_ENCODE_ITEM(f) s << v.f;
+#define QTNG_MSGPACK_DECODE_ITEM(f) if (i < n && s.status() == QTNETWORKNG_NAMESPACE::MsgPackStream::Ok) { s >> v.f; ++i; }
+
+#define QTNG_MSGPACK_EXPAND(x) x
+#define QTNG_MSGPACK_CONCAT_(a, b) a##b
+#define QTNG_MSGPACK_CONCAT(a, b) QTNG_MSGPACK_CONCAT_(a, b)
+#define QTNG_MSGPACK_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, N, ...) N
+#define QTNG_MSGPACK_COUNT(...) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_COUNT_(__VA_ARGS__, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define QTNG_MSGPACK_FOR_EACH(M, ...) \
+    QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_CONCAT(QTNG_MSGPACK_FOR_EACH_, QTNG_MSGPACK_COUNT(__VA_ARGS__))(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_1(M, f) M(f)
+#define QTNG_MSGPACK_FOR_EACH_2(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_1(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_3(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_2(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_4(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_3(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_5(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_4(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_6(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_5(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_7(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_6(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_8(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_7(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_9(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_8(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_10(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_9(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_11(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_10(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_12(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_11(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_13(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_12(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_14(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_13(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_15(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_14(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_16(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_15(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_17(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_16(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_18(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_17(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_19(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_18(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_20(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_19(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_21(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_20(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_22(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_21(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_23(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_22(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_24(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_23(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_25(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_24(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_26(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_25(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_27(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_26(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_28(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_27(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_29(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_28(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_30(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_29(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_31(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_30(M, __VA_ARGS__))
+#define QTNG_MSGPACK_FOR_EACH_32(M, f, ...) M(f) QTNG_MSGPACK_EXPAND(QTNG_MSGPACK_FOR_EACH_31(M, __VA_ARGS__))
+
 #endif // STREAM_H
@@ -1,6 +1,7 @@
 #ifndef QTNG_PKEY_H
 #define QTNG_PKEY_H
 
+#include <QtCore/qlist.h>
 #include <QtCore/qsharedpointer.h>
 #include "cipher.h"
 
@@ -94,6 +95,50 @@ private:
 };
 
 
+// a signer bound to one key and digest. the key context is prepared once, update() hashes the message by a reused
+// digest context, and sign() signs the digest then starts the next message.
+class SignerPrivate;
+class Signer
+{
+public:
+    Signer(const PrivateKey &key, MessageDigest::Algorithm hashAlgo);
+    ~Signer();
+public:
+    bool isValid() const;
+    inline void update(const QByteArray &data) { update(data.constData(), data.size()); }
+    void update(const char *data, int len);
+    QByteArray sign();
+    // writes the signature to out which has signatureSize() bytes at least, returns the size or -1.
+    int sign(char *out);
+    int signatureSize() const;
+private:
+    SignerPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(Signer)
+    Q_DISABLE_COPY(Signer)
+};
+
+
+class VerifierPrivate;
+class Verifier
+{
+public:
+    Verifier(const PublicKey &key, MessageDigest::Algorithm hashAlgo);
+    ~Verifier();
+public:
+    bool isValid() const;
+    inline void update(const QByteArray &data) { update(data.constData(), data.size()); }
+    void update(const char *data, int len);
+    inline bool verify(const QByteArray &signature) { return verify(signature.constData(), signature.size()); }
+    bool verify(const char *signature, int len);
+    // checks every message with the signature of the same index.
+    QList<bool> verifyMany(const QList<QByteArray> &data, const QList<QByteArray> &signatures);
+private:
+    VerifierPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(Verifier)
+    Q_DISABLE_COPY(Verifier)
+};
+
+
 class PasswordCallback
 {
 public:
@@ -2,6 +2,7 @@
 #define QTNG_COROUTINE_P_H
 
 #include <QtCore/qthreadstorage.h>
+#include <QtCore/qvector.h>
 #include "../coroutine.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
@@ -27,7 +28,70 @@ protected:
 };
 
 
+// the values of CoroutineLocal<T> in one coroutine, indexed by slot. every BaseCoroutinePrivate has one.
+class CoroutineLocalSlots
+{
+public:
+    ~CoroutineLocalSlots() { clear(); }
+    void *get(int slot) const;
+    void set(int slot, void *value);
+    void inherit(const CoroutineLocalSlots &parent);
+    void clear();
+private:
+    // a value is stale if its slot is freed after it is set, so it keeps the destructor of the old owner.
+    struct Entry
+    {
+        void *value;
+        void (*destructor)(void *);
+        int generation;
+    };
+    bool isStale(int slot, const Entry &entry) const;
+    QVector<Entry> values;
+};
+
+
 BaseCoroutine* createMainCoroutine();
+// copies the frames of a suspended shared-stack coroutine back to the shared stack, so the objects on its stack
+// can be touched. returns false if the caller runs on the same shared stack.
+bool makeCoroutineStackResident(BaseCoroutine *coroutine);
+
+// take a stack from the CoroutineStackPool of current thread, or map a new one.
+void *allocateCoroutineStack(size_t stackSize);
+// give the stack back to the CoroutineStackPool of current thread, unmap it if the pool is full.
+void freeCoroutineStack(void *stack, size_t stackSize);
+// the stacks taken by the living coroutines of all threads, and their bytes. the pooled stacks are not counted.
+quint64 coroutineStacksInUse(quint64 *bytes);
+// the bytes mapped by the huge page arena of stacks, and the part of them by MAP_HUGETLB.
+quint64 coroutineStackArenaBytes(quint64 *hugetlbBytes);
+// fill the stack with a magic pattern if BaseCoroutine::isStackUsageTracking().
+void paintCoroutineStack(void *stack, size_t stackSize);
+// returns the bytes of stack touched since paintCoroutineStack(), the stack grows down.
+size_t measureCoroutineStack(const void *stack, size_t stackSize);
+
+#ifdef QTNG_COROUTINE_INTROSPECTION
+// called by the constructor and destructor of BaseCoroutine of every backend.
+void registerCoroutine(BaseCoroutine *coroutine);
+void unregisterCoroutine(BaseCoroutine *coroutine);
+
+// marks the current coroutine waiting for a primitive while it lives, for CoroutineIntrospection::dump(). the
+// outermost scope wins, so an Event waiting by Condition is shown as Event. the primitive is a string literal.
+class CoroutineWaitScope
+{
+public:
+    CoroutineWaitScope(const char *primitive, const void *object, qintptr fd = -1);
+    ~CoroutineWaitScope();
+private:
+    BaseCoroutine *coroutine;
+    bool outermost;
+    Q_DISABLE_COPY(CoroutineWaitScope)
+};
+#else
+class CoroutineWaitScope
+{
+public:
+    CoroutineWaitScope(const char *, const void *, qintptr = -1) {}
+};
+#endif
 
 // 开始声明 CurrentCoroutineStorage
 
@@ -37,12 +101,7 @@ public:
     BaseCoroutine *get();
     void set(BaseCoroutine *coroutine);
     void clean();
-private:
-    struct CurrentCoroutine
-    {
-        BaseCoroutine *value;
-    };
-    QThreadStorage<CurrentCoroutine> storage;
+    quint64 switchCount();  // the number of coroutine switches in current thread.
 };
 
 CurrentCoroutineStorage &currentCoroutine();
@@ -0,0 +1,48 @@
+#ifndef QTNG_DNS_P_H
+#define QTNG_DNS_P_H
+
+#include <QtCore/qstringlist.h>
+#include <QtCore/qhash.h>
+#include <QtNetwork/qhostaddress.h>
+#include "../config.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+// the nameservers and options of /etc/resolv.conf, and the static names of /etc/hosts.
+struct DnsConfiguration
+{
+    DnsConfiguration()
+        :timeout(5000), attempts(2), ndots(1) {}
+    QList<QHostAddress> nameServers;
+    QStringList searchDomains;
+    QMultiHash<QString, QHostAddress> hosts;  // the key is in lower case.
+    int timeout;    // msecs to wait for one nameserver.
+    int attempts;   // times to try every nameserver.
+    int ndots;
+    bool isValid() const { return !nameServers.isEmpty(); }
+    static DnsConfiguration load(const QString &resolvConfPath, const QString &hostsPath);
+};
+
+
+// a stub resolver sending queries by the udp Socket of this library, so resolving blocks the current
+// coroutine only. the A and AAAA queries are sent together, the nameservers are tried in turn.
+class DnsResolver
+{
+public:
+    explicit DnsResolver(const DnsConfiguration &config);
+public:
+    // returns false if there is no nameserver, the caller should use the system resolver instead.
+    // ttl is set to the smallest ttl of the records, or UINT_MAX if it is unknown (/etc/hosts).
+    bool resolve(const QString &hostName, QList<QHostAddress> *addresses, quint32 *ttl = nullptr);
+    // loaded from /etc/resolv.conf and /etc/hosts at the first call.
+    static DnsConfiguration systemConfiguration();
+private:
+    // returns the rcode of answer, or -1 if the nameserver does not answer in time.
+    int query(const QByteArray &name, const QHostAddress &server, QList<QHostAddress> *addresses, quint32 *ttl);
+private:
+    DnsConfiguration config;
+};
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // QTNG_DNS_P_H
@@ -1,6 +1,9 @@
 #ifndef QTNG_EVENTLOOP_P_H
 #define QTNG_EVENTLOOP_P_H
 
+#include <QtCore/qatomic.h>
+#include <QtCore/qlist.h>
+#include <QtCore/qelapsedtimer.h>
 #include "../eventloop.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
@@ -10,6 +13,9 @@ struct Functor
 {
     virtual ~Functor();
     virtual void operator()() = 0;
+    // functors are small and short-lived, they are taken from a free list of current thread.
+    static void *operator new(size_t size);
+    static void operator delete(void *p, size_t size);
 };
 
 
@@ -39,12 +45,83 @@ struct DeleteLaterFunctor: public Functor
     T* const p;
 };
 
+// the queue of callLaterThreadSafe(), lock-free for many producers and one consumer. producers push to
+// an atomic stack, the eventloop takes the whole stack at once and reverses it to the calling order.
+class ThreadSafeCallQueue
+{
+public:
+    struct Node
+    {
+        Node *next;
+        quint32 msecs;
+        Functor *callback;
+    };
+    ThreadSafeCallQueue();
+    ~ThreadSafeCallQueue();  // the callbacks not taken are deleted.
+public:
+    // returns true if the queue was empty, then the consumer should be woken up. the ownership of callbacks is taken.
+    bool push(quint32 msecs, Functor *callback);
+    bool push(quint32 msecs, const QList<Functor*> &callbacks);
+    // returns the nodes in the order of pushing, the caller deletes them.
+    Node *takeAll();
+    int size() const { return count.load(); }
+private:
+    bool pushChain(Node *first, Node *last, int n);
+    QAtomicPointer<Node> top;
+    QAtomicInt count;
+    Q_DISABLE_COPY(ThreadSafeCallQueue)
+};
+
+// the functors called soon by the eventloop, in the classes of BaseCoroutine::Priority. the higher class goes first,
+// but a lower class waiting for StarvationLimit turns of the higher ones takes the next turn.
+class RunQueue
+{
+public:
+    enum {
+        Classes = 3,
+        StarvationLimit = 16,
+    };
+    RunQueue();
+    ~RunQueue();  // the callbacks not taken are deleted.
+public:
+    void push(Functor *callback, BaseCoroutine::Priority priority);  // the ownership of callback is taken.
+    Functor *take();  // the caller deletes it.
+    bool isEmpty() const { return count == 0; }
+    int size() const { return count; }
+private:
+    QList<Functor*> queues[Classes];
+    int skipped[Classes];
+    int count;
+    Q_DISABLE_COPY(RunQueue)
+};
+
 /*
 #if QT_VERSION < 0x050000
 typedef qptrdiff qintptr;
 #endif
 */
 
+// a snapshot of EventLoopCoroutine::metrics(). the times are counted since the last resetMetrics().
+struct EventLoopMetrics
+{
+    enum {
+        HistogramBuckets = 16,
+    };
+    EventLoopMetrics();
+    quint64 iterations;
+    qint64 busyNsecs;           // running callbacks and coroutines.
+    qint64 pollNsecs;           // waiting for events.
+    qint64 longestTickNsecs;    // the longest busy time of one iteration, no callback blocks the loop longer than it.
+    // bucket 0 counts the iterations busy for less than 1us, bucket i counts [2^(i-1), 2^i)us, the last one counts the rest.
+    quint64 tickHistogram[HistogramBuckets];
+    quint32 ioWatchers;
+    quint32 timers;
+    quint32 pendingThreadSafeCalls;
+    quint64 coroutineSwitches;
+    double coroutineSwitchesPerSecond;
+};
+
+
 class EventLoopCoroutinePrivate;
 class EventLoopCoroutine: public BaseCoroutine
 {
@@ -56,22 +133,53 @@ public:
         Write = 2,
         ReadWrite = 3,
     };
+    enum IoOperation
+    {
+        Recv = 1,
+        Send = 2,
+        Accept = 3,   // address and addressSize are the peer returned.
+        Connect = 4,  // address and addressSize are the peer to connect.
+    };
 public:
     virtual ~EventLoopCoroutine() override;
     virtual void run() override;
 public:
-    int createWatcher(EventType event, qintptr fd, Functor *callback);  // the ownership of callback is taken
-    void startWatcher(int watcherId);
-    void stopWatcher(int watcherId);
-    void removeWatcher(int watcherId);
+    qint64 createWatcher(EventType event, qintptr fd, Functor *callback);  // the ownership of callback is taken
+    void startWatcher(qint64 watcherId);
+    void stopWatcher(qint64 watcherId);
+    void removeWatcher(qint64 watcherId);
     void triggerIoWatchers(qintptr fd);
-    int callLater(quint32 msecs, Functor *callback);  // the ownership of callback is taken
+    qint64 callLater(quint32 msecs, Functor *callback);  // the ownership of callback is taken
+    qint64 callLaterCoarse(quint32 msecs, Functor *callback);  // same as callLater(), but may fire up to 64ms later.
     void callLaterThreadSafe(quint32 msecs, Functor *callback);  // the ownership of callback is taken
-    int callRepeat(quint32 msecs, Functor *callback);  // the ownership of callback is taken
-    void cancelCall(int callbackId);
+    void callLaterThreadSafe(quint32 msecs, const QList<Functor*> &callbacks);  // wakes up the eventloop only once.
+    qint64 callRepeat(quint32 msecs, Functor *callback);  // the ownership of callback is taken
+    void cancelCall(qint64 callbackId);
+    // runs one socket operation in the eventloop and blocks the current coroutine until it completes, *result is what
+    // the syscall returns or -errno. returns false if the eventloop does not submit socket operations, only io_uring
+    // does, then the caller waits for readiness and calls the syscall itself.
+    bool submitIo(IoOperation operation, qintptr fd, void *data, quint32 size, void *address, quint32 *addressSize, qint64 *result);
+    // like callLater(0, callback), but the callbacks of higher priority are called first. it can not be cancelled.
+    void callSoon(Functor *callback, BaseCoroutine::Priority priority);
     int exitCode();
     bool runUntil(BaseCoroutine *coroutine);
     void yield();
+public:
+    // the metrics are recorded by the thread of eventloop, and should be read from it.
+    EventLoopMetrics metrics();
+    void resetMetrics();
+    // called in the eventloop if one iteration is busy for thresholdMsecs or more. pass null callback to disable.
+    void setSlowTickCallback(quint32 thresholdMsecs, const std::function<void(qint64 busyNsecs)> &callback);
+public:
+    // the low-latency mode, for the eventloop owning a dedicated core. the libev eventloop polls without sleeping
+    // until it is idle for spinUsecs, and the sockets made in this thread afterwards set SO_BUSY_POLL to
+    // busyPollUsecs and SO_PREFER_BUSY_POLL, so recv() polls the queue of device instead of waiting for the
+    // interrupt. zero disables either of them. the spinning starts with the next run of eventloop, so call it
+    // before the first blocking call of thread. busyPollUsecs above the net.core.busy_read sysctl needs
+    // CAP_NET_ADMIN, the sockets ignore it silently without.
+    void setLowLatencyMode(quint32 spinUsecs, quint32 busyPollUsecs = 50);
+    quint32 spinUsecs() const;
+    quint32 busyPollUsecs() const;
 public:
     static EventLoopCoroutine *get();
 protected:
@@ -93,10 +201,38 @@ public:
     ScopedIoWatcher(EventLoopCoroutine::EventType event, qintptr fd);
     ~ScopedIoWatcher();
     void start();
+    EventLoopCoroutine::EventType eventType() const { return event; }
 private:
-    int watcherId;
+    qintptr fd;
+    qint64 watcherId;
+    EventLoopCoroutine::EventType event;
 };
 
+// the eventloop calls beforePoll() and afterPoll() around waiting for events, it costs two clock reads per iteration.
+class EventLoopMetricsRecorder
+{
+public:
+    EventLoopMetricsRecorder();
+    void beforePoll();
+    void afterPoll();
+    void fill(EventLoopMetrics *metrics) const;
+    void reset();
+public:
+    std::function<void(qint64)> slowTickCallback;
+    qint64 slowTickThreshold;
+private:
+    QElapsedTimer clock;
+    qint64 lastMark;
+    qint64 resetMark;
+    quint64 switchesAtReset;
+    quint64 iterations;
+    qint64 busyNsecs;
+    qint64 pollNsecs;
+    qint64 longestTickNsecs;
+    quint64 tickHistogram[EventLoopMetrics::HistogramBuckets];
+};
+
+
 class EventLoopCoroutinePrivate
 {
 public:
@@ -104,18 +240,30 @@ public:
     virtual ~EventLoopCoroutinePrivate();
 public:
     virtual void run() = 0;
-    virtual int createWatcher(EventLoopCoroutine::EventType event, qintptr fd, Functor *callback) = 0;
-    virtual void startWatcher(int watcherId) = 0;
-    virtual void stopWatcher(int watcherId) = 0;
-    virtual void removeWatcher(int watcherId) = 0;
+    virtual qint64 createWatcher(EventLoopCoroutine::EventType event, qintptr fd, Functor *callback) = 0;
+    virtual void startWatcher(qint64 watcherId) = 0;
+    virtual void stopWatcher(qint64 watcherId) = 0;
+    virtual void removeWatcher(qint64 watcherId) = 0;
     virtual void triggerIoWatchers(qintptr fd) = 0;
-    virtual int callLater(quint32 msecs, Functor * callback) = 0;
+    virtual qint64 callLater(quint32 msecs, Functor * callback) = 0;
+    virtual qint64 callLaterCoarse(quint32 msecs, Functor *callback);
     virtual void callLaterThreadSafe(quint32 msecs, Functor *callback) = 0;
-    virtual int callRepeat(quint32 msecs, Functor * callback) = 0;
-    virtual void cancelCall(int callbackId) = 0;
+    virtual void callLaterThreadSafe(quint32 msecs, const QList<Functor*> &callbacks);
+    virtual qint64 callRepeat(quint32 msecs, Functor * callback) = 0;
+    virtual void cancelCall(qint64 callbackId) = 0;
+    virtual bool submitIo(EventLoopCoroutine::IoOperation operation, qintptr fd, void *data, quint32 size,
+                          void *address, quint32 *addressSize, qint64 *result);
     virtual int exitCode() = 0;
     virtual bool runUntil(BaseCoroutine *coroutine) = 0;
     virtual void yield() = 0;
+    // fill the number of watchers and pending calls.
+    virtual void fillMetrics(EventLoopMetrics *metrics);
+public:
+    EventLoopMetricsRecorder recorder;
+    RunQueue runQueue;
+    quint32 spinUsecs;
+    quint32 busyPollUsecs;
+    bool runQueueScheduled;
 protected:
     EventLoopCoroutine * const q_ptr;
     static EventLoopCoroutinePrivate *getPrivateHelper(EventLoopCoroutine *coroutine)
@@ -147,6 +295,36 @@ public:
     EvEventLoopCoroutine();
 };
 
+// libev driven by Qt eventloop, see setQtEventLoopHybrid().
+class QtEvEventLoopCoroutine: public EventLoopCoroutine
+{
+public:
+    QtEvEventLoopCoroutine();
+    bool isValid() const;  // false if libev has no epoll or kqueue here.
+};
+
+int startQtEvLoop(QtEvEventLoopCoroutine *eventLoop);
+
+#endif
+
+#ifdef QTNETWOKRNG_USE_IO_URING
+class UringEventLoopCoroutine: public EventLoopCoroutine
+{
+public:
+    UringEventLoopCoroutine();
+    bool isValid() const;  // false if the kernel do not support io_uring.
+};
+
+#endif
+
+#ifdef QTNETWOKRNG_USE_IOCP
+class IocpEventLoopCoroutine: public EventLoopCoroutine
+{
+public:
+    IocpEventLoopCoroutine();
+    bool isValid() const;  // false if the afd driver can not be opened.
+};
+
 #endif
 
 class QtEventLoopCoroutine: public EventLoopCoroutine
@@ -0,0 +1,287 @@
+#ifndef QTNG_HTTP2_P_H
+#define QTNG_HTTP2_P_H
+
+#include <functional>
+#include <QtCore/qmap.h>
+#include "../http_utils.h"
+#include "../locks.h"
+#include "../socket_utils.h"
+#include "../coroutine_utils.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+struct HpackField
+{
+    HpackField() {}
+    HpackField(const QByteArray &name, const QByteArray &value)
+        :name(name), value(value) {}
+    quint32 size() const { return static_cast<quint32>(name.size() + value.size()) + 32; }
+    QByteArray name;
+    QByteArray value;
+};
+
+
+// the header compression of http/2 (rfc 7541). the encoder keeps a dynamic table of the fields sent before,
+// so the blocks must be encoded in the order they are sent.
+class HpackEncoder
+{
+public:
+    HpackEncoder();
+public:
+    QByteArray encode(const QList<HttpHeader> &headers);
+    // SETTINGS_HEADER_TABLE_SIZE of peer, we use 4096 bytes at most. the size update goes with the next block.
+    void setMaxTableSize(quint32 size);
+private:
+    quint32 find(const QByteArray &name, const QByteArray &value, quint32 *nameIndex) const;
+    void insert(const HpackField &field);
+    void evict();
+private:
+    QList<HpackField> table;   // the dynamic table, the newest first.
+    quint32 tableSize;
+    quint32 maxTableSize;
+    quint32 smallestTableSize; // the smallest size since last block, the decoder must see it to evict.
+    bool sizeUpdatePending;
+};
+
+
+class HpackDecoder
+{
+public:
+    HpackDecoder();
+public:
+    // the headers of one block are appended, returns false if the block is malformed (COMPRESSION_ERROR). the
+    // indexed fields may expand a small block a lot, so it fails with *tooLarge set if the headers decoded exceed
+    // MaxHeaderListSize or MaxHeaderCount.
+    bool decode(const QByteArray &block, QList<HttpHeader> *headers, bool *tooLarge = nullptr);
+public:
+    enum {
+        MaxHeaderListSize = 1024 * 64,  // as SETTINGS_MAX_HEADER_LIST_SIZE, also the biggest block accepted.
+        MaxHeaderCount = 512,
+    };
+private:
+    bool decodeLiteral(const uchar **p, const uchar *end, int prefix, HpackField *field) const;
+    bool lookup(quint32 index, HpackField *field) const;
+    void insert(const HpackField &field);
+    void evict();
+private:
+    QList<HpackField> table;   // the dynamic table, the newest first.
+    quint32 tableSize;
+    quint32 maxTableSize;      // changed by the size updates of encoder.
+    const quint32 settingsMaxTableSize;  // SETTINGS_HEADER_TABLE_SIZE, the default 4096.
+};
+
+
+struct Http2Response
+{
+    Http2Response()
+        :statusCode(0) {}
+    int statusCode;
+    QList<HttpHeader> headers;
+    QByteArray body;
+};
+
+
+class Http2Stream
+{
+public:
+    Http2Stream(quint32 id, qint64 sendWindow)
+        :id(id), sendWindow(sendWindow), consumed(0), finished(false) {}
+    virtual ~Http2Stream();
+public:
+    const quint32 id;
+    qint64 sendWindow;
+    quint32 consumed;   // the received bytes not yet given back by WINDOW_UPDATE.
+    bool finished;      // reset, or closed in both directions. no more frames of it are handled.
+};
+
+
+// the frames, settings and flow control shared by both sides of a http/2 connection. a coroutine reads the
+// frames and calls the handlers of subclass, the streams send their frames with the write lock held.
+class Http2Endpoint
+{
+public:
+    explicit Http2Endpoint(QSharedPointer<SocketLike> connection);
+    virtual ~Http2Endpoint();
+public:
+    // false after GOAWAY or the connection is broken.
+    bool isValid() const;
+protected:
+    // reads the pending bytes first.
+    QByteArray recvExactly(qint32 size);
+    // the first frames after the connection preface, also the preface itself for client.
+    bool sendSettings(bool withPreface, quint32 maxConcurrentStreams);
+    void readFrames();
+    // the payload of SETTINGS frame, or HTTP2-Settings header of h2c upgrade.
+    bool applySettings(const QByteArray &payload);
+    // the caller holds the write lock, the header block is encoded in the order of sending.
+    QByteArrayList headerFrames(quint32 streamId, const QList<HttpHeader> &headers, bool endStream);
+    bool sendHeaders(quint32 streamId, const QList<HttpHeader> &headers, bool endStream);
+    // blocks until the windows allow to send all the data. returns false if the stream is finished.
+    bool sendData(QSharedPointer<Http2Stream> stream, const QByteArray &data, bool endStream);
+    bool sendFrames(const QByteArrayList &frames);
+    bool sendWindowUpdate(quint32 streamId, quint32 increment);
+    // gives back the bytes of a stream read by user.
+    bool consume(QSharedPointer<Http2Stream> stream, quint32 size);
+    void resetStream(quint32 streamId, quint32 errorCode);
+    void goAway(quint32 errorCode);
+    virtual void abort();
+protected:
+    // called for the whole header block after CONTINUATION frames.
+    virtual bool handleHeaders(quint8 flags, quint32 streamId, const QList<HttpHeader> &headers) = 0;
+    // the padding is removed, and the stream is not finished.
+    virtual bool handleData(quint8 flags, QSharedPointer<Http2Stream> stream, const QByteArray &data) = 0;
+    virtual void handleReset(QSharedPointer<Http2Stream> stream) = 0;
+    virtual void handleGoAway(quint32 lastStreamId) = 0;
+    virtual void handleSettingsChanged() {}
+private:
+    bool handleFrame(quint8 type, quint8 flags, quint32 streamId, const QByteArray &payload);
+    bool handleDataFrame(quint8 flags, quint32 streamId, const QByteArray &payload);
+    bool handleHeaderBlock(quint8 flags, quint32 streamId, const QByteArray &block);
+    bool handleSettingsFrame(quint8 flags, quint32 streamId, const QByteArray &payload);
+    bool handleGoAwayFrame(const QByteArray &payload);
+    bool handleWindowUpdate(quint32 streamId, const QByteArray &payload);
+protected:
+    QSharedPointer<SocketLike> connection;
+    QByteArray pending;               // read before the connection is handed over, such as the h2c upgrade.
+    QSharedPointer<Lock> writeLock;   // the frames of one header block must not be interleaved.
+    CoroutineGroup *operations;
+    QMap<quint32, QSharedPointer<Http2Stream>> streams;
+    HpackEncoder encoder;
+    HpackDecoder decoder;
+    Condition windowChanged;          // the send windows grow, or a stream is finished.
+    QByteArray headerBlock;           // the block waiting for CONTINUATION frames, no more than MaxHeaderListSize.
+    quint32 headerBlockStreamId;
+    quint8 headerBlockFlags;
+    quint32 lastPeerStreamId;         // the biggest stream id opened by peer, as GOAWAY reports.
+    quint32 peerMaxConcurrentStreams;
+    qint64 peerInitialWindowSize;
+    quint32 peerMaxFrameSize;
+    qint64 connectionSendWindow;
+    quint32 connectionConsumed;
+    bool valid;
+    bool goingAway;
+};
+
+
+// the client side of one http/2 connection, shared by the coroutines sending requests to the same origin.
+class Http2Connection: public Http2Endpoint
+{
+public:
+    enum Error {
+        NoError = 0,
+        ConnectionError = 1,   // the connection is closed or goes away, the request may be sent again.
+        StreamReset = 2,
+        BodyTooLarge = 3,
+    };
+public:
+    explicit Http2Connection(QSharedPointer<SocketLike> connection);
+    virtual ~Http2Connection() override;
+public:
+    // sends the connection preface and settings, and starts reading.
+    bool start();
+    // the headers include the pseudo headers of the request. blocks until the whole response is read.
+    Error request(const QList<HttpHeader> &headers, const QByteArray &body, qint32 maxBodySize, Http2Response *response);
+    bool isValid() const;
+protected:
+    virtual bool handleHeaders(quint8 flags, quint32 streamId, const QList<HttpHeader> &headers) override;
+    virtual bool handleData(quint8 flags, QSharedPointer<Http2Stream> stream, const QByteArray &data) override;
+    virtual void handleReset(QSharedPointer<Http2Stream> stream) override;
+    virtual void handleGoAway(quint32 lastStreamId) override;
+    virtual void handleSettingsChanged() override;
+    virtual void abort() override;
+private:
+    void finish(QSharedPointer<Http2Stream> stream, Error error);
+    void releaseStream(QSharedPointer<Http2Stream> stream);
+    friend class Http2StreamGuard;
+private:
+    Condition streamAvailable;        // the number of streams drops below peerMaxConcurrentStreams.
+    quint32 nextStreamId;
+};
+
+
+class Http2ServerStream;
+// the server side of one http/2 connection. every stream runs the handler in a new coroutine, the handler
+// reads the request body from and writes the response to a Http2StreamSocket.
+class Http2ServerConnection: public Http2Endpoint
+{
+public:
+    Http2ServerConnection(QSharedPointer<SocketLike> connection,
+                          const std::function<void(QSharedPointer<SocketLike>)> &handler);
+    virtual ~Http2ServerConnection() override;
+public:
+    // the request of h2c upgrade becomes the stream 1, its response is sent by http/2.
+    bool setUpgradeRequest(const QByteArray &method, const QByteArray &path, const QList<HttpHeader> &headers,
+                           const QByteArray &settings);
+    // returns when the connection is closed and all streams finish. buf is read from the connection already.
+    void serve(const QByteArray &buf, bool prefaceReceived);
+protected:
+    virtual bool handleHeaders(quint8 flags, quint32 streamId, const QList<HttpHeader> &headers) override;
+    virtual bool handleData(quint8 flags, QSharedPointer<Http2Stream> stream, const QByteArray &data) override;
+    virtual void handleReset(QSharedPointer<Http2Stream> stream) override;
+    virtual void handleGoAway(quint32 lastStreamId) override;
+    virtual void abort() override;
+private:
+    void spawnStream(QSharedPointer<Http2ServerStream> stream);
+    QByteArray recv(QSharedPointer<Http2ServerStream> stream, qint32 size, bool all);
+    bool sendResponseHeaders(QSharedPointer<Http2ServerStream> stream, int statusCode, const QList<HttpHeader> &headers);
+    qint32 send(QSharedPointer<Http2ServerStream> stream, const QByteArray &data);
+    void closeStream(QSharedPointer<Http2ServerStream> stream);
+    friend class Http2StreamSocket;
+private:
+    std::function<void(QSharedPointer<SocketLike>)> handler;
+    QSharedPointer<Http2ServerStream> upgradeStream;
+};
+
+
+// one stream of Http2ServerConnection seen as a socket, so BaseHttpRequestHandler works on it.
+class Http2StreamSocket: public SocketLike
+{
+public:
+    Http2StreamSocket(Http2ServerConnection *connection, QSharedPointer<Http2ServerStream> stream);
+public:
+    QByteArray method() const;
+    QByteArray path() const;
+    QList<HttpHeader> headers() const;
+    // the pseudo header :status is added, and the connection-specific headers are removed.
+    bool sendHeaders(int statusCode, const QList<HttpHeader> &headers);
+public:
+    virtual Socket::SocketError error() const override;
+    virtual QString errorString() const override;
+    virtual bool isValid() const override;
+    virtual QHostAddress localAddress() const override;
+    virtual quint16 localPort() const override;
+    virtual QHostAddress peerAddress() const override;
+    virtual QString peerName() const override;
+    virtual quint16 peerPort() const override;
+    virtual qintptr	fileno() const override;
+    virtual Socket::SocketType type() const override;
+    virtual Socket::SocketState state() const override;
+    virtual Socket::NetworkLayerProtocol protocol() const override;
+
+    virtual Socket *acceptRaw() override;
+    virtual QSharedPointer<SocketLike> accept() override;
+    virtual bool bind(QHostAddress &address, quint16 port, Socket::BindMode mode) override;
+    virtual bool bind(quint16 port, Socket::BindMode mode) override;
+    virtual bool connect(const QHostAddress &addr, quint16 port) override;
+    virtual bool connect(const QString &hostName, quint16 port, Socket::NetworkLayerProtocol protocol) override;
+    virtual bool close() override;
+    virtual bool listen(int backlog) override;
+    virtual bool setOption(Socket::SocketOption option, const QVariant &value) override;
+    virtual QVariant option(Socket::SocketOption option) const override;
+
+    virtual qint32 recv(char *data, qint32 size) override;
+    virtual qint32 recvall(char *data, qint32 size) override;
+    virtual qint32 send(const char *data, qint32 size) override;
+    virtual qint32 sendall(const char *data, qint32 size) override;
+    virtual QByteArray recv(qint32 size) override;
+    virtual QByteArray recvall(qint32 size) override;
+    virtual qint32 send(const QByteArray &data) override;
+    virtual qint32 sendall(const QByteArray &data) override;
+private:
+    Http2ServerConnection *connection;
+    QSharedPointer<Http2ServerStream> stream;
+};
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // QTNG_HTTP2_P_H
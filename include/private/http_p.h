@@ -1,22 +1,164 @@
 #ifndef QTNG_HTTP_P_H
 #define QTNG_HTTP_P_H
 
+#include <QtCore/qhash.h>
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qmutex.h>
 #include "../http.h"
 #include "../locks.h"
 #include "../socket.h"
 #include "../socket_utils.h"
 #include "../coroutine_utils.h"
 #include "../http_proxy.h"
+#include "../http_cache.h"
+#include "http2_p.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
 class HttpProxy;
 class Socks5Proxy;
+// the origin of a request url, parsed once by HttpSessionPrivate::send() and cached by the request, so the retries
+// and hedges parse it no more. the pool and the Host header use it instead of asking QUrl again, which makes a new
+// string every time.
+struct HttpOrigin
+{
+    enum Scheme {
+        InvalidScheme,
+        HttpScheme,
+        HttpsScheme,
+    };
+    HttpOrigin()
+        :scheme(InvalidScheme), port(0), explicitPort(false) {}
+    explicit HttpOrigin(const QUrl &url);
+    bool isValid() const { return scheme != InvalidScheme; }
+    bool isSecure() const { return scheme == HttpsScheme; }
+    // the path and query of url, "/" if it is empty.
+    static QByteArray targetOf(const QUrl &url);
+    QUrl url;               // for the proxy switcher and the cookies.
+    QString host;
+    QString key;            // the same as ConnectionPool::keyOf().
+    QByteArray hostHeader;  // "host" or "host:port".
+    Scheme scheme;
+    quint16 port;           // the default port of scheme if the url has none.
+    bool explicitPort;
+};
+
+
+// the requests written back-to-back on one connection. the responses come in order, so every coroutine
+// waits for its turn and reads its own response, then passes the turn to the next one.
+class HttpPipeline
+{
+public:
+    explicit HttpPipeline(QSharedPointer<SocketLike> connection);
+public:
+    // returns the turn to read the response, or null if the connection is broken.
+    QSharedPointer<Event> send(const QByteArrayList &lines);
+    // the connection is closed if keepAlive is false, the waiting requests should be sent again.
+    void done(QSharedPointer<Event> turn, bool keepAlive);
+public:
+    QSharedPointer<SocketLike> connection;
+    QSharedPointer<Lock> writeLock;
+    QList<QSharedPointer<Event>> turns;  // the requests waiting for responses, the first one is reading.
+    QByteArray buf;                      // the bytes of next responses, read with the previous one.
+    bool valid;
+};
+
+
+struct IdleConnection
+{
+    IdleConnection()
+        :idleSince(0) {}
+    IdleConnection(QSharedPointer<SocketLike> connection, qint64 idleSince)
+        :connection(connection), idleSince(idleSince) {}
+    QSharedPointer<SocketLike> connection;
+    qint64 idleSince;   // QElapsedTimer::msecsSinceReference()
+};
+
+
+struct SharedHostConnections
+{
+    SharedHostConnections()
+        :live(0) {}
+    QList<IdleConnection> idle;     // the most recently used one is the last.
+    // the coroutines waiting for a connection, by their eventloops.
+    QMap<EventLoopCoroutine *, QSharedPointer<ThreadChannelWaiters>> waiters;
+    int live;                       // the direct connections opened by the sessions and not deleted yet.
+};
+
+
+// the state of SharedHttpSession, guarded by the mutex. a connection counted in live releases its count when
+// its socket is deleted, so no QSharedPointer<SocketLike> may be dropped with the mutex held.
+class SharedHttpSessionPrivate
+{
+public:
+    SharedHttpSessionPrivate();
+public:
+    // an idle connection of any thread, or null with *reserved set if a new one may be opened. waits for a
+    // connection to be recycled or deleted if there are maxConnectionsPerServer already.
+    QSharedPointer<SocketLike> takeConnection(const QString &key, bool *reserved);
+    // makes a socket counted in live of key, the count is released when it is deleted.
+    static QSharedPointer<Socket> countedSocket(QSharedPointer<SharedHttpSessionPrivate> shared, const QString &key);
+    void release(const QString &key);
+    // returns false if the connection must be kept by its own thread.
+    bool recycle(const QString &key, QSharedPointer<SocketLike> connection);
+    // returns the idle connections removed.
+    int removeExpiredConnections(qint64 ttl);
+    // rebuilds jar from the shared cookies if they are changed since *version.
+    void syncCookies(HttpCookieJar *jar, int *version);
+    // returns the new version of cookies.
+    int mergeCookies(const QList<QNetworkCookie> &cookies, const QUrl &url);
+private:
+    void wakeUp(SharedHostConnections &host);
+public:
+    mutable QMutex mutex;
+    QHash<QString, SharedHostConnections> hosts;
+    HttpCookieJar cookieJar;
+    QAtomicInt cookieVersion;   // read without the mutex, to skip syncing the unchanged cookies.
+    QSharedPointer<SocketDnsCache> dnsCache;
+    QString defaultUserAgent;
+    HttpVersion defaultVersion;
+    HttpRetryPolicy retryPolicy;
+    int maxConnectionsPerServer;
+    int pipeliningDepth;
+#ifndef QTNG_NO_CRYPTO
+    SslConfiguration sslConfiguration;
+    SslConfiguration http2SslConfiguration;
+#endif
+};
+
+
+// records the phases of a request into its HttpTimings, only the monotonic clock is read.
+class HttpPhaseTimer
+{
+public:
+    explicit HttpPhaseTimer(HttpTimings *timings)
+        :timings(timings) { started.start(); }
+    qint64 now() const { return started.nsecsElapsed(); }
+    // the phase runs from since to now.
+    void record(HttpTimings::Phase phase, qint64 since)
+    {
+        timings->starts[phase] = since;
+        timings->durations[phase] = now() - since;
+    }
+public:
+    HttpTimings *timings;
+    QElapsedTimer started;
+};
+
+
 struct ConnectionPoolItem
 {
-    QDateTime lastUsed;
+    ConnectionPoolItem()
+        :lastUsed(0), minIdle(0), http2Unsupported(false) {}
+    qint64 lastUsed;                        // QElapsedTimer::msecsSinceReference()
+    int minIdle;                            // the idle connections kept open by prewarm().
+    HttpOrigin origin;                      // to open them again.
     QSharedPointer<Semaphore> semaphore;
-    QList<QSharedPointer<SocketLike>> connections;
+    QList<IdleConnection> connections;      // the most recently used one is the last, and taken first.
+    QSharedPointer<Http2Connection> http2;  // shared by all requests to the origin.
+    QSharedPointer<Lock> http2Lock;         // only one coroutine makes the http2 connection.
+    QList<QSharedPointer<HttpPipeline>> pipelines;
+    bool http2Unsupported;                  // alpn does not select h2.
 };
 
 
@@ -25,20 +167,59 @@ class ConnectionPool
 public:
     ConnectionPool();
     virtual ~ConnectionPool();
-    void recycle(const QUrl &url, QSharedPointer<SocketLike> connection);
-    QSharedPointer<SocketLike> connectionForUrl(const QUrl &url, RequestError **error);
-    void removeUnusedConnections();
+    void recycle(const HttpOrigin &origin, QSharedPointer<SocketLike> connection);
+    // a new connection sends the first bytes with the SYN if fastOpen is true (TCP_FASTOPEN_CONNECT).
+    // the dns, connect and tls phases of a new direct connection are recorded by phases.
+    QSharedPointer<SocketLike> connectionForUrl(const HttpOrigin &origin, RequestError **error, bool fastOpen = false,
+                                                HttpPhaseTimer *phases = nullptr);
+    // returns null without error if the server does not speak h2, the tls connection is kept for http/1.1.
+    QSharedPointer<Http2Connection> http2ConnectionForUrl(const HttpOrigin &origin, RequestError **error);
+    // opens up to count idle connections to the origin and keeps them, returns the idle connections.
+    int prewarm(const HttpOrigin &origin, int count);
+    // a pipeline with less than depth requests waiting, or a new one.
+    QSharedPointer<HttpPipeline> pipelineForUrl(const HttpOrigin &origin, int depth, RequestError **error);
+    // called by the cleaner when the first deadline passes, returns the msecs to sleep.
+    qint64 removeUnusedConnections();
+    HttpConnectionPoolStats stats() const;
     QSharedPointer<Socks5Proxy> socks5Proxy() const;
     QSharedPointer<HttpProxy> httpProxy() const;
     void setSocks5Proxy(QSharedPointer<Socks5Proxy> proxy);
     void setHttpProxy(QSharedPointer<HttpProxy> proxy);
+#ifndef QTNG_NO_CRYPTO
+    void setSslConfiguration(const SslConfiguration &config);
+#endif
+    // "scheme://host:port", the host of QUrl is in lower case already.
+    static QString keyOf(const QUrl &url);
+private:
+    ConnectionPoolItem &itemOf(const QString &key);
+    // a direct connection is counted by shared if counted is true.
+    QSharedPointer<SocketLike> newConnection(const HttpOrigin &origin, RequestError **error, bool fastOpen,
+                                             HttpPhaseTimer *phases, bool counted = false);
+    void openIdleConnections(const HttpOrigin &origin);
+    // by a coroutine of prewarmers, the cleaner and the requests can not wait for connecting.
+    void refillLater(const HttpOrigin &origin);
+    QSharedPointer<SocketLike> timedConnect(const HttpOrigin &origin, QSharedPointer<Socket> rawSocket,
+                                            HttpPhaseTimer *phases, RequestError **error);
 public:
-    QMap<QUrl, ConnectionPoolItem> items;
+    QHash<QString, ConnectionPoolItem> items;
+    QMultiMap<qint64, QString> deadlines;   // the hosts to check when their time to live passes.
     int maxConnectionsPerServer;
     int timeToLive;
     QSharedPointer<SocketDnsCache> dnsCache;
-    CoroutineGroup *operations;
+    QSharedPointer<Task> cleaner;
+    CoroutineGroup *prewarmers;
     QSharedPointer<BaseProxySwitcher> proxySwitcher;
+    // set to null when the pool is deleted, so the body readers outliving the session give up recycling.
+    QSharedPointer<ConnectionPool *> self;
+    quint64 createdConnections;
+    quint64 reusedConnections;
+    quint64 expiredConnections;
+    QSharedPointer<SharedHttpSessionPrivate> shared;    // null unless the session is made by SharedHttpSession.
+#ifndef QTNG_NO_CRYPTO
+    // one for all connections, so they share the SSL_CTX and the tls session cache.
+    SslConfiguration sslConfiguration;
+    SslConfiguration http2SslConfiguration;     // the same but offers h2 by alpn.
+#endif
 };
 
 
@@ -47,15 +228,56 @@ class HttpSessionPrivate: public ConnectionPool
 public:
     HttpSessionPrivate(HttpSession *q_ptr);
     virtual ~HttpSessionPrivate();
-    QList<HttpHeader> makeHeaders(HttpRequest &request, const QUrl &url);
-    void mergeCookies(HttpRequest &request, const QUrl &url);
+    // for http/2, the http/1.x requests are written by writeRequestHead().
+    QList<HttpHeader> makeHeaders(HttpRequest &request, const HttpOrigin &origin);
+    // the request line and headers in requestBuffer, with room for extra bytes of body.
+    void writeRequestHead(HttpRequest &request, const HttpOrigin &origin, const QByteArray &target,
+                          const char *version, int extra);
+    // the cookies of jar and request, for the Cookie header.
+    QByteArray cookieHeader(HttpRequest &request, const QUrl &url);
     HttpResponse send(HttpRequest &req);
+    // send() with the total time, the trace context and the hooks of tracer.
+    HttpResponse sendTraced(HttpRequest &request);
+    // follows the redirects of request.
+    HttpResponse sendFollowing(HttpRequest &request);
+    // retries and hedges the request by retryPolicy.
+    HttpResponse sendWithRetries(HttpRequest &request);
+    HttpResponse sendHedged(HttpRequest &request);
+    HttpResponse sendMeasured(HttpRequest &request);
+    // serves the request by the cache, or sends it and keeps the response.
+    HttpResponse sendCached(HttpRequest &request);
+    HttpResponse responseFromCache(const HttpCacheEntry &entry, HttpRequest &request, qint64 age);
+    void storeResponse(const QString &key, HttpRequest &request, HttpResponse &response, qint64 requestTime);
+    // -1 if there are too few latencies recorded.
+    qint64 hedgeDelay() const;
+    bool spendRetryToken();
+    HttpResponse sendHttp2(QSharedPointer<Http2Connection> connection, HttpRequest &request, HttpResponse &response);
+    HttpResponse sendPipelined(HttpRequest &request, HttpResponse &response, const QByteArrayList &lines);
+    // returns false if the connection can not be used by the next response.
+    bool readPipelinedResponse(QSharedPointer<HttpPipeline> pipeline, HttpRequest &request, HttpResponse &response);
+    bool readResponseHeaders(HeaderSplitter &headerSplitter, HttpResponse &response);
+    bool sendBody(QSharedPointer<SocketLike> connection, QSharedPointer<FileLike> body, bool chunked);
+    void mergeResponseCookies(HttpResponse &response);
+    // keeps the Alt-Svc of the response for the origin.
+    void mergeAlternativeServices(const HttpOrigin &origin, const HttpResponse &response);
 public:
-    QNetworkCookieJar cookieJar;
+    HttpCookieJar cookieJar;
     QString defaultUserAgent;
+    QByteArray userAgentLine;   // "User-Agent: ...\r\n" of defaultUserAgent.
+    QByteArray requestBuffer;   // reused by the requests, unless it is still being sent.
     HttpVersion defaultVersion;
     HttpSession *q_ptr;
     int debugLevel;
+    int pipeliningDepth;
+    HttpRetryPolicy retryPolicy;
+    QSharedPointer<HttpTracer> tracer;
+    QSharedPointer<HttpCacheStore> cache;
+    QHash<QString, QSharedPointer<Event>> cacheFetches;    // the misses being fetched, by the keys of cache.
+    QHash<QString, QList<HttpAlternativeService>> alternativeServices;     // by the keys of origins.
+    QVector<qint64> latencies;  // a ring of the recent latencies of successful attempts.
+    int latencyIndex;
+    float retryTokens;
+    int cookieVersion;          // of the shared cookies synced into cookieJar.
     friend void setProxySwitcher(HttpSession *session, QSharedPointer<BaseProxySwitcher> switcher);
     static inline HttpSessionPrivate *getPrivateHelper(HttpSession *session) {return session->d_ptr; }
     Q_DECLARE_PUBLIC(HttpSession)
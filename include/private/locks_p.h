@@ -0,0 +1,140 @@
+#ifndef QTNG_LOCKS_P_H
+#define QTNG_LOCKS_P_H
+
+#include "eventloop_p.h"
+#include "../locks.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+class LockWaiterList;
+class LockWaiterQueue;
+
+
+// a coroutine waiting for Semaphore or Condition. it lives on the stack of the waiting coroutine, so
+// waiting allocates nothing. the node is in the waiting list of lock, or in the list of a functor which
+// resumes it after it is woken up. a stackless Task waits by a node with callback instead of coroutine.
+struct LockWaiter
+{
+    LockWaiter(BaseCoroutine *coroutine, LockWaiterQueue *queue, quint32 weight)
+        :coroutine(coroutine), callback(nullptr), queue(queue), list(nullptr), prev(nullptr), next(nullptr), weight(weight),
+          priority(coroutine ? coroutine->priority() : BaseCoroutine::NormalPriority), bypassed(0), granted(false) {}
+    BaseCoroutine *coroutine;
+    Functor *callback;  // not owned.
+    LockWaiterQueue *queue;  // cleared if the lock is deleted.
+    LockWaiterList *list;
+    LockWaiter *prev;
+    LockWaiter *next;
+    quint32 weight;  // the units wanted by Limiter, one for others.
+    BaseCoroutine::Priority priority;
+    quint32 bypassed;  // the waiters of higher priority queued before this one.
+    bool granted;  // woken by release() or notify(), not by deleting the lock.
+};
+
+
+// ordered by the priority of waiters, and in order of appending for the same priority. a waiter passes the ones of
+// lower priority, unless one of them is passed MaxBypassed times already, so the low priority waiters are not starved.
+class LockWaiterList
+{
+public:
+    enum {
+        MaxBypassed = 16,
+    };
+    LockWaiterList()
+        :head(nullptr), tail(nullptr), count(0) {}
+    bool isEmpty() const { return !head; }
+    int size() const { return count; }
+    LockWaiter *first() const { return head; }
+    void append(LockWaiter *waiter)
+    {
+        LockWaiter *after = tail;
+        while (after && after->priority > waiter->priority && after->bypassed < MaxBypassed) {
+            after = after->prev;
+        }
+        LockWaiter *before = after ? after->next : head;
+        for (LockWaiter *passed = before; passed; passed = passed->next) {
+            ++passed->bypassed;
+        }
+        waiter->prev = after;
+        waiter->next = before;
+        if (after) {
+            after->next = waiter;
+        } else {
+            head = waiter;
+        }
+        if (before) {
+            before->prev = waiter;
+        } else {
+            tail = waiter;
+        }
+        waiter->list = this;
+        ++count;
+    }
+    void remove(LockWaiter *waiter)
+    {
+        Q_ASSERT(waiter->list == this);
+        if (waiter->prev) {
+            waiter->prev->next = waiter->next;
+        } else {
+            head = waiter->next;
+        }
+        if (waiter->next) {
+            waiter->next->prev = waiter->prev;
+        } else {
+            tail = waiter->prev;
+        }
+        waiter->prev = waiter->next = nullptr;
+        waiter->list = nullptr;
+        --count;
+    }
+    LockWaiter *takeFirst()
+    {
+        LockWaiter *waiter = head;
+        remove(waiter);
+        return waiter;
+    }
+private:
+    LockWaiter *head;
+    LockWaiter *tail;
+    int count;
+};
+
+
+struct LockWaiterResumeFunctor;
+
+// the waiters are woken by release() and notify() in order, and resumed later by the eventloop, so the
+// releasing coroutine is never switched out. the woken waiters belong to the functor, not the lock, and
+// the lock can be deleted by any of them.
+class LockWaiterQueue
+{
+public:
+    LockWaiterQueue()
+        :pending(nullptr), running(nullptr), giveBack(nullptr), dequeued(nullptr), giveBackData(nullptr) {}
+    ~LockWaiterQueue();
+public:
+    // returns true if this waiter is woken up, false if the lock is deleted.
+    bool wait(quint32 weight = 1);
+    // the callback of waiter is called in the eventloop coroutine after it is woken up.
+    void waitAsync(LockWaiter *waiter);
+    // removes a waiter which is killed before it is resumed, and passes the wakeup to the next one.
+    static void cancel(LockWaiter *waiter);
+    // wakes the first waiter, returns false if there is none.
+    bool wakeOne();
+    int waiting() const { return waiters.size(); }
+    quint32 firstWeight() const { return waiters.isEmpty() ? 0 : waiters.first()->weight; }
+public:
+    LockWaiterList waiters;
+    LockWaiterResumeFunctor *pending;
+    LockWaiterResumeFunctor *running;  // resuming the waiters, any of them may delete the lock.
+    // called if a woken waiter is killed before it runs, to pass the wakeup to another one.
+    void (*giveBack)(void *data, quint32 weight);
+    // called if a waiting waiter is killed, the waiters behind it may go now.
+    void (*dequeued)(void *data);
+    void *giveBackData;
+private:
+    // resumes the woken waiters by the run queue of eventloop, at the priority of the first one.
+    LockWaiterResumeFunctor *pendingFunctor(BaseCoroutine::Priority priority);
+};
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // QTNG_LOCKS_P_H
@@ -4,12 +4,16 @@
 #include <QtCore/qsharedpointer.h>
 #include <QtCore/qstring.h>
 #include <QtCore/qbytearray.h>
+#include <QtCore/qmap.h>
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qscopedpointer.h>
 #include <QtNetwork/qhostaddress.h>
 #include "../socket.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
 union qt_sockaddr;
+class ScopedIoWatcher;
 
 class EventLoopCoroutine;
 
@@ -50,6 +54,7 @@ class SocketPrivate
 public:
     SocketPrivate(Socket::NetworkLayerProtocol protocol, Socket::SocketType type, Socket *parent);
     SocketPrivate(qintptr socketDescriptor, Socket *parent);
+    SocketPrivate(qintptr acceptedDescriptor, Socket::NetworkLayerProtocol protocol, Socket *parent);
     virtual ~SocketPrivate();
 public:
     QString getErrorString() const;
@@ -58,12 +63,23 @@ public:
     bool isValid() const {return fd > 0 && (error == Socket::NoError || type != Socket::TcpSocket);}
 
     Socket *accept();
+    QList<Socket*> acceptmany(int maxCount);
+#ifndef Q_OS_WIN
+    // blocking submits the accept to the io_uring eventloop if there is one, it waits for the connection there.
+    Socket *tryAccept(bool *again, bool blocking = false);
+#endif
     bool bind(const QHostAddress &address, quint16 port = 0, Socket::BindMode mode = Socket::DefaultForPlatform);
     bool bind(quint16 port = 0, Socket::BindMode mode = Socket::DefaultForPlatform);
     bool connect(const QHostAddress &host, quint16 port);
     bool connect(const QString &hostName, quint16 port, Socket::NetworkLayerProtocol protocol = Socket::AnyIPProtocol);
+    bool connect(const QHostAddress &host, quint16 port, const QByteArray &initialData);
     bool close();
+    bool shutdownWrite();
     bool listen(int backlog);
+    bool bindPath(const QString &path);
+    bool connectPath(const QString &path);
+    qint32 sendDescriptors(const char *data, qint32 size, const QList<qintptr> &fds);
+    qint32 recvDescriptors(char *data, qint32 size, QList<qintptr> *fds);
     bool setOption(Socket::SocketOption option, const QVariant &value);
     bool setNonblocking();
     QVariant option(Socket::SocketOption option) const;
@@ -71,9 +87,52 @@ public:
     qint32 send(const char *data, qint32 size, bool all = true);
     qint32 recvfrom(char *data, qint32 size, QHostAddress *addr, quint16 *port);
     qint32 sendto(const char *data, qint32 size, const QHostAddress &addr, quint16 port);
+    qint32 recvfrom(char *data, qint32 size, Endpoint *endpoint);
+    qint32 sendto(const char *data, qint32 size, const Endpoint &endpoint);
+    qint32 recvmany(SocketDatagram *datagrams, qint32 count);
+    qint32 sendmany(SocketDatagram *datagrams, qint32 count);
+    qint32 sendv(const QList<QByteArray> &buffers, bool all);
+    qint32 recvv(SocketBuffer *buffers, qint32 count);
+    qint64 sendfile(QFile *file, qint64 offset, qint64 length);
+    qint64 sendfileByCopy(QFile *file, qint64 offset, qint64 length);
+    // splice() is done in two steps, so the gate of target is taken after the data arrives.
+    qint32 spliceIn(SocketPrivate *target, qint32 size);
+    qint32 spliceOut(SocketPrivate *target);
+    bool setZeroCopyThreshold(qint32 bytes);
+#ifdef Q_OS_LINUX
+    qint32 sendZeroCopy(const QByteArray &data);
+    void reapZeroCopy();
+    void startZeroCopyReaper();
+    // called before closing, the buffers still used by the kernel are kept until their completions arrive.
+    void keepZeroCopyBuffers();
+#endif
     bool fetchConnectionParameters();
+    bool happyEyeballsConnect(const QList<QHostAddress> &addresses, quint16 port);
+    // move the connected descriptor of other socket to this one.
+    void takeDescriptor(SocketPrivate *other);
+    // the counters of ioStats, a socket not counting io costs a branch.
+    template<typename T> T countSent(T result) { if (ioStats) addIo(true, result); return result; }
+    template<typename T> T countReceived(T result) { if (ioStats) addIo(false, result); return result; }
+    bool countConnect(bool ok, const QElapsedTimer &timer);
+    // waits the watcher, and counts the time blocked.
+    void waitWatcher(ScopedIoWatcher &watcher);
+    void addIo(bool sending, qint64 result);
+    // the local address of accepted socket is fetched by the first call of localAddress().
+    void fetchLocalAddressIfNeeded() const
+    {
+        if (localAddressPending) {
+            const_cast<SocketPrivate*>(this)->fetchConnectionParameters();
+        }
+    }
 private:
     void setPortAndAddress(quint16 port, const QHostAddress &address, qt_sockaddr *aa, int *sockAddrSize);
+    void setEndpoint(const Endpoint &endpoint, qt_sockaddr *aa, int *sockAddrSize);
+    // the cores of recvfrom() and sendto(), the public ones only convert the addresses.
+    qint32 recvfrom(char *data, qint32 size, qt_sockaddr *aa);
+    qint32 sendto(const char *data, qint32 size, const qt_sockaddr *aa, int sockAddrSize);
+#ifndef Q_OS_WIN
+    bool connect(const qt_sockaddr *aa, int sockAddrSize);
+#endif
     bool createSocket();
 protected:
     Socket *q_ptr;
@@ -87,6 +146,8 @@ private:
     quint16 localPort;
     QHostAddress peerAddress;
     quint16 peerPort;
+    QString localPath;      // of unix sockets.
+    QString peerPath;
 #ifdef Q_OS_WIN
     qintptr fd;
 #else
@@ -95,6 +156,16 @@ private:
     QSharedPointer<SocketDnsCache> dnsCache;
     QSharedPointer<Gate> readGate;
     QSharedPointer<Gate> writeGate;
+    QScopedPointer<SocketIoStats> ioStats;  // null if the socket does not count io.
+    bool localAddressPending;
+#ifdef Q_OS_LINUX
+    int splicePipe[2];  // created by the first splice(), and closed with the socket.
+    qint32 splicePending;  // the bytes in splicePipe, dropped by the next spliceIn() if spliceOut() did not finish.
+    qint32 zeroCopyThreshold;
+    quint32 zeroCopyNext;   // the kernel numbers the MSG_ZEROCOPY sends from zero.
+    QMap<quint32, QByteArray> zeroCopyPending;
+    qint64 zeroCopyReaper;  // the timer reaping the completions while some are pending, zero if none.
+#endif
 
     Q_DECLARE_PUBLIC(Socket)
 };
@@ -104,6 +175,9 @@ void initWinSock();
 void freeWinSock();
 #endif
 
+// adds a tls handshake to Socket::totalIoStats().
+void countSslHandshake(qint64 nsecs);
+
 QTNETWORKNG_NAMESPACE_END
 
 #endif // QTNG_SOCKET_P_H
@@ -0,0 +1,63 @@
+#ifndef QTNG_TIMERWHEEL_P_H
+#define QTNG_TIMERWHEEL_P_H
+
+#include <QtCore/qglobal.h>
+#include "../config.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+// the node is embedded in the timer watcher, so arming and cancelling a timer never allocates.
+struct TimerWheelNode
+{
+    TimerWheelNode *prev;
+    TimerWheelNode *next;
+    quint64 expiry;
+    bool isLinked() const { return next != nullptr; }
+};
+
+
+// a hierarchical timer wheel of 4 levels * 64 slots, the tick is decided by the eventloop (1ms for libev).
+// insert() and remove() are O(1), advance() cascades the slots of higher levels when the lower level wraps, and
+// jumps from one occupied slot to the next.
+class TimerWheel
+{
+public:
+    enum {
+        SlotBits = 6,
+        Slots = 1 << SlotBits,
+        SlotMask = Slots - 1,
+        Levels = 4,
+        CoarseTicks = Slots,  // coarse timers expire at the boundary of level 1 slots.
+    };
+    explicit TimerWheel(quint64 now = 0);
+    ~TimerWheel();
+public:
+    void insert(TimerWheelNode *node, quint64 expiry);
+    void remove(TimerWheelNode *node);
+    // move the timers expired before or at `now` to the expired list.
+    void advance(quint64 now);
+    TimerWheelNode *takeExpired();
+    // returns the tick when advance() should be called next time, or -1 if no timer is armed.
+    qint64 nextExpiry() const;
+    quint64 currentTick() const { return current; }
+    quint32 size() const { return count; }
+    static quint64 coarse(quint64 expiry) { return (expiry + CoarseTicks - 1) & ~static_cast<quint64>(CoarseTicks - 1); }
+private:
+    void place(TimerWheelNode *node);
+    void cascade(int level, int index);
+    qint64 nextOccupied() const;
+    static void initList(TimerWheelNode *head);
+    static bool isEmptyList(const TimerWheelNode *head) { return head->next == head; }
+    static void append(TimerWheelNode *head, TimerWheelNode *node);
+    static void unlink(TimerWheelNode *node);
+private:
+    TimerWheelNode slots[Levels][Slots];
+    TimerWheelNode expired;
+    quint64 current;
+    quint32 count;
+    Q_DISABLE_COPY(TimerWheel)
+};
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // QTNG_TIMERWHEEL_P_H
@@ -0,0 +1,50 @@
+#ifndef QTNG_TRACING_P_H
+#define QTNG_TRACING_P_H
+
+#include "../config.h"
+
+// the systemtap usdt probes of provider qtng, built with QTNG_USE_USDT. a disabled probe is a nop instruction,
+// but the arguments are still computed, so pass cheap ones. list them by `perf list sdt_qtng:*` after
+// `perf buildid-cache --add libqtnetworkng.so`, or by `bpftrace -l 'usdt:/path/to/binary:qtng:*'`.
+//
+//   coroutine_spawn(id, stack size)             BaseCoroutine is created.
+//   coroutine_start(id, stack, stack size)      it runs for the first time, in itself.
+//   coroutine_exit(id)                          it returns from run(), in itself.
+//   coroutine_switch(from id, to id)            before switching, in the old coroutine.
+//   loop_poll(busy nsecs)                       the eventloop begins waiting for events.
+//   loop_wake(poll nsecs)                       the eventloop is waked up.
+//   socket_wait(fd, event)                      a coroutine waits for the fd, the event is 1 for read and 2 for write.
+//   socket_wake(fd, event)                      the coroutine is resumed.
+//   tls_handshake_start(fd, is server)
+//   tls_handshake_done(fd, is server, ok)
+//   http_request_start(method, url)             HttpSession begins a request.
+//   http_request_done(method, url, status)      status is 0 if the request failed.
+//   httpd_request_start(method, path)           BaseHttpRequestHandler parsed a request.
+//   httpd_request_done(method, path, status)
+#ifdef QTNG_HAVE_USDT
+#include <sys/sdt.h>
+#define QTNG_PROBE0(name) DTRACE_PROBE(qtng, name)
+#define QTNG_PROBE1(name, a1) DTRACE_PROBE1(qtng, name, a1)
+#define QTNG_PROBE2(name, a1, a2) DTRACE_PROBE2(qtng, name, a1, a2)
+#define QTNG_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(qtng, name, a1, a2, a3)
+#else
+#define QTNG_PROBE0(name) do {} while (0)
+#define QTNG_PROBE1(name, a1) do {} while (0)
+#define QTNG_PROBE2(name, a1, a2) do {} while (0)
+#define QTNG_PROBE3(name, a1, a2, a3) do {} while (0)
+#endif
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+class BaseCoroutine;
+
+#ifdef QTNG_HAVE_USDT
+// fires coroutine_start, and appends the stack to the coroutine map if the QTNG_COROUTINE_MAP environment variable
+// is set. the map is /tmp/qtng-<pid>.map in the format of perf maps, "<start> <size> coroutine-<id>:<name>" in
+// hex, so a sampled stack pointer tells the coroutine. the stacks are reused, a later line wins.
+void traceCoroutineStarted(BaseCoroutine *coroutine, const void *stack, size_t stackSize);
+#endif
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // QTNG_TRACING_P_H
@@ -5,15 +5,23 @@
 #include "locks.h"
 #include "eventloop.h"
 #include "socket.h"
+#include "iobuf.h"
 #include "socket_utils.h"
 #include "coroutine_utils.h"
 #include "http.h"
+#include "http_cache.h"
+#include "http_cookie.h"
 #include "http_proxy.h"
 #include "http_utils.h"
 #include "socks5_proxy.h"
 #include "msgpack.h"
 #include "httpd.h"
+#include "websocket.h"
+#include "http_router.h"
+#include "json_view.h"
 #include "kcp.h"
+#include "metrics.h"
+#include "impairment.h"
 
 #ifndef QTNG_NO_CRYPTO
 #include "ssl.h"
@@ -25,5 +33,6 @@
 #endif
 
 #include "data_channel.h"
+#include "rpc.h"
 
 #endif // QTNG_QTNETWORKNG_H
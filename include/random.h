@@ -8,6 +8,12 @@
 QTNETWORKNG_NAMESPACE_BEGIN
 
 QByteArray randomBytes(int i);
+// fills the buffer of caller without allocation, returns false if the generator fails.
+bool randomBytes(char *buf, int len);
+quint32 randomUInt32();
+quint64 randomUInt64();
+// uniform in [0, upperBound), without the modulo bias.
+quint32 randomBounded(quint32 upperBound);
 
 QTNETWORKNG_NAMESPACE_END
 
@@ -0,0 +1,67 @@
+#ifndef QTNG_RPC_H
+#define QTNG_RPC_H
+
+#include <functional>
+#include <QtCore/qsharedpointer.h>
+#include <QtCore/qvariant.h>
+#include "data_channel.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+class RpcPeerPrivate;
+
+// a request seen by the handler. the arguments, result and items are encoded by msgpack, so they are passed as
+// they are without converting to QVariant.
+class RpcCall
+{
+public:
+    QString method() const { return _method; }
+    QByteArray arguments() const { return _arguments; }
+    bool sendItem(const QByteArray &item);      // a part of streaming response, sent before the result.
+    void setError(const QString &error) { _error = error; }
+    bool isCancelled() const;                   // the caller is gone, the blocking operations raise TimeoutException.
+private:
+    RpcCall(RpcPeerPrivate *peer, quint32 id, const QString &method, const QByteArray &arguments)
+        :_method(method), _arguments(arguments), peer(peer), id(id), cancelled(false) {}
+    QString _method;
+    QByteArray _arguments;
+    QString _error;
+    RpcPeerPrivate *peer;
+    quint32 id;
+    bool cancelled;
+    friend class RpcPeerPrivate;
+    Q_DISABLE_COPY(RpcCall)
+};
+
+typedef std::function<QByteArray(RpcCall &call)> RpcHandler;
+
+// both peers of a data channel call the methods of each other. the calls are multiplexed by id, so many
+// coroutines may call at the same time, and the requests are handled by a pool of coroutines.
+class RpcPeer
+{
+public:
+    explicit RpcPeer(QSharedPointer<DataChannel> channel);
+    ~RpcPeer();
+public:
+    void registerMethod(const QString &method, const RpcHandler &handler);
+    void setMaxConcurrency(quint32 handlers);   // the requests wait if so many handlers are running.
+    quint32 maxConcurrency() const;
+    // returns a null QByteArray if the call failed, timed out or the peer is gone. zero timeout waits forever.
+    QByteArray call(const QString &method, const QByteArray &arguments, float timeout = 0.0f, QString *error = nullptr);
+    // the streaming items are passed to onItem by the calling coroutine, before the result returns.
+    QByteArray call(const QString &method, const QByteArray &arguments, const std::function<void(const QByteArray &)> &onItem,
+                    float timeout = 0.0f, QString *error = nullptr);
+    // encodes the arguments and decodes the result by QVariant, for convenience.
+    QVariant callVariant(const QString &method, const QVariantList &arguments, float timeout = 0.0f, QString *error = nullptr);
+    QSharedPointer<DataChannel> channel() const;
+    bool isBroken() const;
+    void close();
+private:
+    RpcPeerPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(RpcPeer)
+    Q_DISABLE_COPY(RpcPeer)
+};
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // QTNG_RPC_H
@@ -4,8 +4,11 @@
 #include <QtCore/qstring.h>
 #include <QtCore/qbytearray.h>
 #include <QtCore/qobject.h>
+#include <QtCore/qfile.h>
+#include <QtCore/qvector.h>
 #include <QtNetwork/qhostaddress.h>
 #include <QtNetwork/qhostinfo.h>
+#include <string.h>
 
 #include "private/eventloop_p.h"
 #include "locks.h"
@@ -19,6 +22,91 @@ QTNETWORKNG_NAMESPACE_BEGIN
 class SocketPrivate;
 class SocketDnsCache;
 
+
+// the address and port of a datagram without QHostAddress, which is allocated in heap. the ipv4 addresses are
+// mapped to ipv6 so the same peer compares and hashes equal whatever family the socket is. convert it to
+// QHostAddress only to show or to log.
+struct Endpoint
+{
+    enum Family { Null = 0, IPv4 = 4, IPv6 = 6 };
+    Endpoint()
+        :port(0), family(Null) { memset(address, 0, sizeof(address)); }
+    Endpoint(const QHostAddress &addr, quint16 port);
+    static Endpoint fromIPv4(quint32 ipv4, quint16 port);
+    bool isNull() const { return family == Null; }
+    quint32 toIPv4Address() const;
+    QHostAddress hostAddress() const;
+    QString toString() const;
+    bool operator==(const Endpoint &other) const
+    {
+        return port == other.port && memcmp(address, other.address, sizeof(address)) == 0;
+    }
+    bool operator!=(const Endpoint &other) const { return !(*this == other); }
+    bool operator<(const Endpoint &other) const
+    {
+        int r = memcmp(address, other.address, sizeof(address));
+        return r < 0 || (r == 0 && port < other.port);
+    }
+    quint8 address[16];     // in network order.
+    quint16 port;
+    quint16 family;
+};
+
+uint qHash(const Endpoint &endpoint, uint seed = 0);
+
+
+// one entry of Socket::recvmany() and Socket::sendmany(), the buffer is owned by the caller.
+struct SocketDatagram
+{
+    SocketDatagram()
+        :data(nullptr), size(0), length(0), segmentSize(0), port(0) {}
+    char *data;
+    qint32 size;        // the capacity of data for recvmany(), the bytes to send for sendmany().
+    qint32 length;      // the bytes received or sent.
+    // sendmany() lets the kernel split data into datagrams of segmentSize bytes if it is not zero (UDP_SEGMENT).
+    // recvmany() sets it if the socket enables UdpGroOption and the kernel coalesced many datagrams into data.
+    qint32 segmentSize;
+    QHostAddress address;
+    quint16 port;
+    Endpoint endpoint;  // set by recvmany() along with address and port.
+};
+
+
+// one buffer of Socket::recvv(), the memory is owned by the caller.
+struct SocketBuffer
+{
+    SocketBuffer()
+        :data(nullptr), size(0) {}
+    SocketBuffer(char *data, qint32 size)
+        :data(data), size(size) {}
+    char *data;
+    qint32 size;
+};
+
+
+// the io counters of Socket::ioStats(), the durations are in nanoseconds. a socket counts one connect or handshake
+// at most, the totals of Socket::totalIoStats() count all of them.
+struct SocketIoStats
+{
+    SocketIoStats()
+        :bytesSent(0), bytesReceived(0), sendCalls(0), recvCalls(0), readWaits(0), writeWaits(0)
+        , readWaitNsecs(0), writeWaitNsecs(0), connects(0), connectNsecs(0), handshakes(0), handshakeNsecs(0) {}
+    SocketIoStats &operator+=(const SocketIoStats &other);
+    quint64 bytesSent;
+    quint64 bytesReceived;
+    quint64 sendCalls;
+    quint64 recvCalls;
+    quint64 readWaits;          // the calls would block (EAGAIN), and waited for the socket to be readable.
+    quint64 writeWaits;
+    qint64 readWaitNsecs;       // the time blocked by the waits.
+    qint64 writeWaitNsecs;
+    quint64 connects;           // including the dns lookup of host name.
+    qint64 connectNsecs;
+    quint64 handshakes;         // tls handshakes of SslSocket.
+    qint64 handshakeNsecs;
+};
+
+
 class Socket: public QObject
 {
 public:
@@ -33,6 +121,7 @@ public:
         IPv4Protocol,
         IPv6Protocol,
         AnyIPProtocol,
+        UnixProtocol,   // AF_UNIX, the TcpSocket is SOCK_STREAM and the UdpSocket is SOCK_DGRAM.
         UnknownNetworkLayerProtocol = -1
     };
     Q_ENUMS(NetworkLayerProtocol)
@@ -90,14 +179,24 @@ public:
         ReceiveBufferSizeSocketOption,  //SO_RCVBUF
         MaxStreamsSocketOption, // for sctp
         NonBlockingSocketOption,
-        BindExclusively
+        BindExclusively,
+        UdpSegmentOption, // UDP_SEGMENT, the default segment size of sending, linux 4.18+
+        UdpGroOption, // UDP_GRO, receive coalesced datagrams, linux 5.0+
+        ReusePortOption, // SO_REUSEPORT, many sockets bound to the same port share the incoming connections.
+        TcpFastOpenOption, // TCP_FASTOPEN, the queue length of fast open requests, set before listen().
+        TcpFastOpenConnectOption, // TCP_FASTOPEN_CONNECT, the first send() goes with the SYN, linux 4.11+
+        BusyPollOption, // SO_BUSY_POLL, microseconds to poll the device queue in blocking receives, linux 3.11+
+        PreferBusyPollOption, // SO_PREFER_BUSY_POLL, defers the interrupts while the queue is busy polled, linux 5.11+
+        CorkOption, // TCP_CORK on linux or TCP_NOPUSH on bsd, holds the partial segments until it is cleared, see cork().
+        NotSentLowWatermarkOption, // TCP_NOTSENT_LOWAT, the unsent bytes in kernel before the socket is writable again.
     };
     Q_ENUMS(SocketOption)
     enum BindFlag {
         DefaultForPlatform = 0x0,
         ShareAddress = 0x1,
         DontShareAddress = 0x2,
-        ReuseAddressHint = 0x4
+        ReuseAddressHint = 0x4,
+        ReusePortHint = 0x8
     };
     Q_DECLARE_FLAGS(BindMode, BindFlag)
 public:
@@ -114,19 +213,44 @@ public:
     QString peerName() const;
     quint16 peerPort() const;
     qintptr fileno() const;
+    // a new socket owns the descriptor, and this one is left closed without closing it. an accepted socket is
+    // moved to the eventloop of another thread by it, before any coroutine waits for it.
+    Socket *detach();
     SocketType type() const;
     SocketState state() const;
     NetworkLayerProtocol protocol() const;
 
     Socket *accept();
+    // block until one connection is accepted, then take the other pending connections without waiting.
+    QList<Socket*> acceptmany(int maxCount);
     bool bind(const QHostAddress &address, quint16 port = 0, BindMode mode = DefaultForPlatform);
     bool bind(quint16 port = 0, BindMode mode = DefaultForPlatform);
     bool connect(const QHostAddress &host, quint16 port);
     bool connect(const QString &hostName, quint16 port, NetworkLayerProtocol protocol = AnyIPProtocol);
+    // send initialData with the SYN if the kernel has a fast open cookie of host (MSG_FASTOPEN), or
+    // after the connection is established otherwise. the data may be delivered twice if the SYN is
+    // replayed, so it should be an idempotent request.
+    bool connect(const QHostAddress &host, quint16 port, const QByteArray &initialData);
     bool close();
+    // half-close a tcp connection, the peer reads eof while this socket still receives.
+    bool shutdownWrite();
     bool listen(int backlog);
     bool setOption(SocketOption option, const QVariant &value);
     QVariant option(SocketOption option) const;
+    // the writes after cork() are sent in full segments, uncork() sends the rest at once. the kernel sends the
+    // partial segment anyway after 200ms. returns false if the platform has neither TCP_CORK nor TCP_NOPUSH.
+    bool cork() { return setOption(CorkOption, 1); }
+    bool uncork() { return setOption(CorkOption, 0); }
+    // the unix sockets are bound and connected by path. a path starting with '@' is in the abstract namespace of
+    // linux, which has no file and is gone with the socket. unix sockets are not supported by windows.
+    bool bindPath(const QString &path);
+    bool connectPath(const QString &path);
+    QString localPath() const;
+    QString peerPath() const;      // empty if the peer is not bound.
+    // pass the descriptors with data over a unix socket (SCM_RIGHTS), size must not be zero. the received
+    // descriptors are close-on-exec and owned by the caller, recvDescriptors() closes them if fds is null.
+    qint32 sendDescriptors(const char *data, qint32 size, const QList<qintptr> &fds);
+    qint32 recvDescriptors(char *data, qint32 size, QList<qintptr> *fds);
 
     qint32 recv(char *data, qint32 size);
     qint32 recvall(char *data, qint32 size);
@@ -134,6 +258,31 @@ public:
     qint32 sendall(const char *data, qint32 size);
     qint32 recvfrom(char *data, qint32 size, QHostAddress *addr, quint16 *port);
     qint32 sendto(const char *data, qint32 size, const QHostAddress &addr, quint16 port);
+    qint32 recvfrom(char *data, qint32 size, Endpoint *endpoint);
+    qint32 sendto(const char *data, qint32 size, const Endpoint &endpoint);
+    // move many datagrams in one syscall (recvmmsg/sendmmsg on linux). recvmany() blocks until one datagram at
+    // least is received, sendmany() returns the number of datagrams sent, or -1 if none is sent.
+    qint32 recvmany(SocketDatagram *datagrams, qint32 count);
+    qint32 sendmany(SocketDatagram *datagrams, qint32 count);
+    // scatter/gather io (sendmsg/recvmsg on unix, WSASend/WSARecv on windows), the buffers are not copied.
+    // sendv() returns after some bytes are sent, sendallv() blocks until all buffers are sent.
+    // recvv() fills the buffers in order and returns the total bytes received by one read.
+    qint32 sendv(const QList<QByteArray> &buffers);
+    qint32 sendallv(const QList<QByteArray> &buffers);
+    qint32 recvv(SocketBuffer *buffers, qint32 count);
+    // send the content of file from offset in kernel (sendfile(2) on linux and bsd) without copying it to
+    // userspace. length < 0 means to the end of file. returns the bytes sent, or -1 if none is sent.
+    qint64 sendfile(QFile *file, qint64 offset = 0, qint64 length = -1);
+    // move at most size bytes of this socket to target through a pipe by splice(2), the data never enters
+    // userspace. writeTimeout limits the time waiting for target to be writable, 0 means forever.
+    // returns the bytes moved, 0 if this socket is closed, or -1 on error. only supported by linux.
+    qint32 splice(Socket *target, qint32 size, float writeTimeout = 0.0f);
+    static bool isSpliceSupported();
+    // sendall(QByteArray) of at least bytes sends without copying the data to kernel (MSG_ZEROCOPY). the
+    // QByteArray is referenced until the kernel reports the completion. it only pays for large payloads,
+    // zero disables it. returns false if the platform does not support it, only linux 4.14+ does.
+    bool setZeroCopyThreshold(qint32 bytes);
+    qint32 zeroCopyThreshold() const;
 
     QByteArray recvall(qint32 size);
     QByteArray recv(qint32 size);
@@ -144,15 +293,40 @@ public:
 
     static QList<QHostAddress> resolve(const QString &hostName);
     void setDnsCache(QSharedPointer<SocketDnsCache> dnsCache);
+
+    // the sockets made after enabling count their io, which costs a branch per call otherwise. the counters are
+    // compiled out by defining QTNG_NO_SOCKET_IO_STATS, then ioStats() is always empty.
+    static void setIoStatsEnabled(bool enabled);
+    static bool isIoStatsEnabled();
+    // the sum of all sockets counting io, such as for a metrics exporter.
+    static SocketIoStats totalIoStats();
+    SocketIoStats ioStats() const;
 protected:
     SocketPrivate * const dd_ptr;
 private:
+    // used by accept(), the descriptor is a connected nonblocking tcp socket.
+    Socket(qintptr acceptedDescriptor, NetworkLayerProtocol protocol);
     Q_DECLARE_PRIVATE_D(dd_ptr, Socket)
     Q_DISABLE_COPY(Socket)
 };
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(Socket::BindMode)
 
+class SocketLike;
+
+// one ready socket of Poll::waitmany().
+struct PollEvent
+{
+    PollEvent()
+        :socket(nullptr), events(0) {}
+    Socket *socket;                         // null if socketLike is registered.
+    QSharedPointer<SocketLike> socketLike;
+    int events;                             // the ready EventLoopCoroutine::EventType flags.
+};
+
+
+// the watchers are level-triggered, a socket is reported again by the next wait until it is consumed.
+// SocketLike is accepted if it has a descriptor, the data buffered by a SslSocket is reported as readable.
 class PollPrivate;
 class Poll
 {
@@ -160,14 +334,22 @@ public:
     Poll();
     virtual ~Poll();
 public:
-    void add(Socket *socket, EventLoopCoroutine::EventType event);
+    bool add(Socket *socket, EventLoopCoroutine::EventType event);
+    bool add(QSharedPointer<SocketLike> socket, EventLoopCoroutine::EventType event);
     void remove(Socket *socket);
-    Socket *wait(float msecs = 0.0);
+    void remove(QSharedPointer<SocketLike> socket);
+    int size() const;
+    // returns all ready sockets, or an empty list if timeout.
+    QVector<PollEvent> waitmany(float secs = 0.0);
+    Socket *wait(float secs = 0.0);
 private:
     PollPrivate * const d_ptr;
     Q_DECLARE_PRIVATE(Poll)
 };
 
+// a lru cache of resolved names. the entries expire by the ttl of dns records, but never live longer than
+// maxAge(). failed lookups are cached for negativeTtl(). the coroutines resolving the same name share one query.
+// it may be shared by the sockets of many threads, the threads resolving the same name query by themselves.
 class SocketDnsCachePrivate;
 class SocketDnsCache
 {
@@ -176,6 +358,13 @@ public:
     virtual ~SocketDnsCache();
 public:
     QList<QHostAddress> resolve(const QString &hostName);
+    void setMaxAge(float secs);             // 300 seconds by default.
+    float maxAge() const;
+    void setNegativeTtl(float secs);        // 5 seconds by default, zero disables negative caching.
+    float negativeTtl() const;
+    void setCapacity(int capacity);         // 1024 names by default.
+    int capacity() const;
+    void clear();
 private:
     SocketDnsCachePrivate * const d_ptr;
     Q_DECLARE_PRIVATE(SocketDnsCache)
@@ -184,6 +373,7 @@ private:
 
 QTNETWORKNG_NAMESPACE_END
 
+Q_DECLARE_TYPEINFO(QTNETWORKNG_NAMESPACE::Endpoint, Q_PRIMITIVE_TYPE);
 Q_DECLARE_METATYPE(QTNETWORKNG_NAMESPACE::Socket::SocketState)
 Q_DECLARE_METATYPE(QTNETWORKNG_NAMESPACE::Socket::SocketError)
 
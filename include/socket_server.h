@@ -9,24 +9,90 @@
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
+struct StreamServerStats
+{
+    StreamServerStats()
+        :activeConnections(0), pendingHandshakes(0), acceptedConnections(0), rejectedConnections(0) {}
+    int activeConnections;
+    int pendingHandshakes;
+    quint64 acceptedConnections;
+    quint64 rejectedConnections;   // by the limits below.
+};
+
+
 class BaseStreamServerPrivate;
 class BaseStreamServer
 {
+public:
+    enum OverloadAction {
+        PauseAccepting,     // the new connections wait in the listen queue of kernel.
+        RejectConnections,  // the new connections are accepted and given to rejectRequest().
+    };
+    enum DispatchPolicy {
+        RoundRobinDispatch,
+        LeastLoadedDispatch,    // the thread serving the least requests.
+    };
 public:
     BaseStreamServer(const QHostAddress &serverAddress, quint16 serverPort);
+    // listens to a unix socket, such as the upstream of nginx. a path starting with '@' is in the abstract
+    // namespace of linux. the socket file is removed when the server stops.
+    explicit BaseStreamServer(const QString &serverPath);
     virtual ~BaseStreamServer();
 public:
     bool allowReuseAddress() const;
     void setAllowReuseAddress(bool b);
     int requestQueueSize() const;
     void setRequestQueueSize(int requestQueueSize);
+    // run n threads, each accepts requests by its own SO_REUSEPORT socket in its own eventloop,
+    // so one process can use more than one cpu. zero or one means accepting in the current thread.
+    int acceptorThreads() const;
+    void setAcceptorThreads(int threads);
+    // one loop accepts the connections, and hands every one to one of n threads, which does the ssl handshake and
+    // serves the request in its own eventloop. it uses many cpus without SO_REUSEPORT, such as on macOS and Windows.
+    // zero or one serves the requests in the accepting thread, it is ignored with acceptor threads.
+    int dispatchThreads() const;
+    void setDispatchThreads(int threads);
+    DispatchPolicy dispatchPolicy() const;
+    void setDispatchPolicy(DispatchPolicy policy);
+    // the queue length of TCP_FASTOPEN, zero disables it. the data of SYN may be replayed, so enable it
+    // only if the first request of protocol is idempotent.
+    int fastOpenQueueSize() const;
+    void setFastOpenQueueSize(int fastOpenQueueSize);
+    // up to n connections are served at once, zero for no limit. every acceptor thread serves its share of them.
+    int maxConnections() const;
+    void setMaxConnections(int maxConnections);
+    OverloadAction overloadAction() const;
+    void setOverloadAction(OverloadAction action);
+    // the connections of one peer address, the connections exceeding it are always rejected. zero for no limit.
+    int maxConnectionsPerClient() const;
+    void setMaxConnectionsPerClient(int maxConnectionsPerClient);
+    // the ssl handshakes running at once, the connections exceeding it are rejected. zero for no limit.
+    int maxPendingHandshakes() const;
+    void setMaxPendingHandshakes(int maxPendingHandshakes);
+    StreamServerStats stats() const;
+    // hands an idle keep-alive connection back to the acceptor loop, so the coroutine of request can return. an io
+    // watcher waits for the next request, and processRequest() runs again in a new coroutine. the connection is closed
+    // if nothing comes in idleMsecs. only the plain sockets can be parked. the parked ones are still active, and keep
+    // their slots of maxConnections() and maxConnectionsPerClient().
+    bool parkRequest(QSharedPointer<SocketLike> request, quint32 idleMsecs);
+    // serve the listening socket inherited from the old process instead of binding a new one. it is taken from
+    // QTNG_LISTEN_FD, or LISTEN_FDS of systemd socket activation. returns false if there is none.
+    bool useInheritedSocket();
+    void setInheritedSocket(qintptr fd);
+    // clears close-on-exec of the listening socket, so a new process started with QTNG_LISTEN_FD=<fd> serves it.
+    // returns -1 if the socket can not be shared. with acceptor threads, the new process binds with SO_REUSEPORT.
+    qintptr shareListeningSocket();
     bool serveForever();
     bool start();
     void stop();
+    // stops accepting, then waits up to drainMsecs for the requests to finish before killing them. call it from
+    // a coroutine other than the requests of this server.
+    void stop(quint32 drainMsecs);
     virtual bool isSecure() const;
 public:
     quint16 serverPort() const;
     QHostAddress serverAddress() const;
+    QString serverPath() const;     // empty if the server listens to tcp.
 public:
     QSharedPointer<Event> started;
     QSharedPointer<Event> stopped;
@@ -36,7 +102,13 @@ protected:
     virtual void serverClose();
     virtual bool serviceActions();
     virtual QSharedPointer<SocketLike> getRequest();
+    // wraps the accepted socket as the request, such as a SslSocket. it runs in the thread serving the request.
+    virtual QSharedPointer<SocketLike> wrapRequest(QSharedPointer<Socket> request);
     virtual bool verifyRequest(QSharedPointer<SocketLike> request);
+    // runs in the coroutine of request before processRequest(), such as the ssl handshake. false closes it.
+    virtual bool prepareRequest(QSharedPointer<SocketLike> request);
+    // closes the request over the limits by default. it runs in the accepting coroutine, so it must be quick.
+    virtual void rejectRequest(QSharedPointer<SocketLike> request);
     virtual void processRequest(QSharedPointer<SocketLike> request);
     virtual void handleError(QSharedPointer<SocketLike> request);
     virtual void shutdownRequest(QSharedPointer<SocketLike> request);
@@ -55,6 +127,8 @@ class TcpServer: public BaseStreamServer
 public:
     TcpServer(const QHostAddress &serverAddress, quint16 serverPort)
         :BaseStreamServer(serverAddress, serverPort) {}
+    explicit TcpServer(const QString &serverPath)
+        :BaseStreamServer(serverPath) {}
 protected:
     virtual void processRequest(QSharedPointer<SocketLike> request) override;
 };
@@ -78,9 +152,22 @@ public:
 public:
     void setSslConfiguration(const SslConfiguration &configuration);
     SslConfiguration sslConfiguratino() const;
+    // the resumed handshakes skip the key exchange. tickets are on by default, the keys rotate every hour.
+    void setSessionTicketKeyLifetime(quint32 secs);
+    void setSessionCacheSize(quint32 size);
+    // the handshakes run in the thread pool of SslConfiguration, a burst of new clients do not block the eventloop.
+    void setHandshakeOffloaded(bool offloaded);
+    // serves many host names by one port, the certificate is picked by the server name (sni) of client.
+    void setServerNames(const SslServerNames &names);
+    // fetches the ocsp response of local certificate in background, refreshes it before expiry, and staples it to
+    // the handshakes, so the clients checking revocation do not ask the responder.
+    void setOcspStapling(bool enabled);
     virtual bool isSecure() const override;
 protected:
+    // the handshake runs in the coroutine of request by prepareRequest(), so a slow client does not stop accepting.
     virtual QSharedPointer<SocketLike> getRequest() override;
+    virtual QSharedPointer<SocketLike> wrapRequest(QSharedPointer<Socket> request) override;
+    virtual bool prepareRequest(QSharedPointer<SocketLike> request) override;
 private:
     Q_DECLARE_PRIVATE(BaseSslStreamServer)
 };
@@ -106,6 +193,49 @@ void SslServer<RequestHandler>::processRequest(QSharedPointer<SocketLike> reques
     handler.run();
 }
 
+
+// picks the request handler by the protocol negotiated by alpn, such as "h2" or "http/1.1". the protocols
+// are offered in the order of addHandler(), the default handler serves the clients without alpn.
+class AlpnSslServer: public BaseSslStreamServer
+{
+public:
+    typedef std::function<void(QSharedPointer<SocketLike>, BaseStreamServer *)> HandlerFactory;
+    AlpnSslServer(const QHostAddress &serverAddress, quint16 serverPort)
+        :BaseSslStreamServer(serverAddress, serverPort) {}
+    AlpnSslServer(const QHostAddress &serverAddress, quint16 serverPort, const SslConfiguration &configuration)
+        :BaseSslStreamServer(serverAddress, serverPort, configuration) {}
+public:
+    template<typename RequestHandler> void addHandler(const QByteArray &protocol);
+    template<typename RequestHandler> void setDefaultHandler();
+    void addHandler(const QByteArray &protocol, const HandlerFactory &factory);
+    void setDefaultHandler(const HandlerFactory &factory);
+protected:
+    virtual void processRequest(QSharedPointer<SocketLike> request) override;
+private:
+    QMap<QByteArray, HandlerFactory> handlers;
+    HandlerFactory defaultHandler;
+};
+
+
+template<typename RequestHandler>
+void AlpnSslServer::addHandler(const QByteArray &protocol)
+{
+    addHandler(protocol, [] (QSharedPointer<SocketLike> request, BaseStreamServer *server) {
+        RequestHandler handler(request, server);
+        handler.run();
+    });
+}
+
+
+template<typename RequestHandler>
+void AlpnSslServer::setDefaultHandler()
+{
+    setDefaultHandler([] (QSharedPointer<SocketLike> request, BaseStreamServer *server) {
+        RequestHandler handler(request, server);
+        handler.run();
+    });
+}
+
 #endif
 
 class BaseRequestHandler
@@ -136,6 +266,14 @@ protected:
     bool sendConnectReply(const QHostAddress &hostAddress, quint16 port);
     virtual void doFailed();
     bool sendFailedReply();
+    // relays the datagrams of the client until the control connection is closed, or no datagram passes for
+    // udpAssociationTimeout() seconds. the fragmented datagrams are dropped.
+    virtual void doUdpAssociate(const QHostAddress &hostAddress, quint16 port);
+    virtual float udpAssociationTimeout() const;
+    // called around the relay of a connect command, to set the bandwidth limits or keep the exchanger for
+    // reading its accounting. the exchanger is deleted after exchangeFinished().
+    virtual void exchangeStarted(Exchanger *exchanger, const QString &hostName, const QHostAddress &hostAddress, quint16 port);
+    virtual void exchangeFinished(Exchanger *exchanger);
 protected:
     virtual void handle() override;
 //    virtual void logMessage(const QString &hostName, const QHostAddress &hostAddress, const quint16 port);
@@ -2,11 +2,49 @@
 #define QTNG_SOCKET_UTILS_H
 
 #include <QtCore/qsharedpointer.h>
+#include <limits.h>
 #include <QtCore/qfile.h>
 #include "socket.h"
+#include "iobuf.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
+// the size of next read, learned from the previous ones as the AdaptiveRecvByteBufAllocator of netty. it grows four
+// times when a read fills it, and halves after two reads in a row fill less than half of it. so a bulk transfer
+// takes few large reads, and a quiet connection allocates small buffers.
+class RecvSizer
+{
+public:
+    explicit RecvSizer(qint32 initial = 1024 * 8, qint32 minimum = 1024, qint32 maximum = 1024 * 64)
+        :size(initial), minimum(minimum), maximum(maximum), shrinking(false) {}
+public:
+    qint32 next() const { return size; }
+    // the bytes returned by a read of next() bytes, the eof and errors are ignored.
+    void record(qint32 received)
+    {
+        if (received <= 0) {
+            return;
+        }
+        if (received >= size) {
+            size = size > maximum / 4 ? maximum : size * 4;
+            shrinking = false;
+        } else if (received <= size / 2) {
+            if (shrinking) {
+                size = qMax(size / 2, minimum);
+            }
+            shrinking = !shrinking;
+        } else {
+            shrinking = false;
+        }
+    }
+private:
+    qint32 size;
+    qint32 minimum;
+    qint32 maximum;
+    bool shrinking;
+};
+
+
 class StreamLike
 {
     Q_DISABLE_COPY(StreamLike)
@@ -22,6 +60,15 @@ public:
     virtual QByteArray recvall(qint32 size) = 0;
     virtual qint32 send(const QByteArray &data) = 0;
     virtual qint32 sendall(const QByteArray &data) = 0;
+    // scatter/gather io, the default implementations pass the buffers one by one.
+    virtual qint32 sendv(const QList<QByteArray> &buffers);
+    virtual qint32 sendallv(const QList<QByteArray> &buffers);
+    virtual qint32 recvv(SocketBuffer *buffers, qint32 count);
+    // read into the tailroom of buf and write the slices of buf, the blocks are not copied.
+    qint32 recv(IOBuf *buf, qint32 size);
+    qint32 recvall(IOBuf *buf, qint32 size);
+    qint32 send(const IOBuf &buf);
+    qint32 sendall(const IOBuf &buf);
 };
 
 
@@ -58,6 +105,15 @@ public:
     virtual bool listen(int backlog) = 0;
     virtual bool setOption(Socket::SocketOption option, const QVariant &value) = 0;
     virtual QVariant option(Socket::SocketOption option) const = 0;
+    // the unix sockets, only the raw socket supports them.
+    virtual bool bindPath(const QString &path);
+    virtual bool connectPath(const QString &path);
+    virtual QString localPath() const;
+    virtual QString peerPath() const;
+    // the counters of underlying socket, empty if it does not count io. see Socket::setIoStatsEnabled().
+    virtual SocketIoStats ioStats() const;
+    // the bytes received and buffered by the socket itself, readable without waiting for the descriptor.
+    virtual qint32 bufferedBytes() const;
 public:
     static QSharedPointer<SocketLike> rawSocket(QSharedPointer<Socket> s);
     static QSharedPointer<SocketLike> rawSocket(Socket *s) { return rawSocket(QSharedPointer<Socket>(s)); }
@@ -67,8 +123,32 @@ public:
 #endif
     static QSharedPointer<SocketLike> kcpSocket(QSharedPointer<KcpSocket> s);
     static QSharedPointer<SocketLike> kcpSocket(KcpSocket *s);
+public:
+    // used by the readers of http, kept with the connection so it is learned across the requests.
+    RecvSizer recvSizer;
 };
 
+// the sizer of connection, null if it is not a SocketLike.
+inline RecvSizer *recvSizerOf(SocketLike *connection) { return &connection->recvSizer; }
+inline RecvSizer *recvSizerOf(const void *) { return nullptr; }
+
+// reads up to the size learned by the sizer of connection and maxSize, defaultSize if it has no sizer.
+template<typename Connection>
+QByteArray recvSized(Connection *connection, qint32 defaultSize, qint32 maxSize = INT_MAX)
+{
+    RecvSizer *sizer = recvSizerOf(connection);
+    if (!sizer) {
+        return connection->recv(qMin(defaultSize, maxSize));
+    }
+    const qint32 size = sizer->next();
+    const QByteArray &data = connection->recv(qMin(size, maxSize));
+    // a read cut by maxSize tells nothing about the size.
+    if (size <= maxSize) {
+        sizer->record(data.size());
+    }
+    return data;
+}
+
 inline QSharedPointer<StreamLike> asStream(QSharedPointer<Socket> s) { return SocketLike::rawSocket(s).dynamicCast<StreamLike>(); }
 inline QSharedPointer<StreamLike> asStream(Socket *s) { return SocketLike::rawSocket(s).dynamicCast<StreamLike>(); }
 #ifndef QTNG_NO_CRYPTO
@@ -81,6 +161,13 @@ QSharedPointer<Socket> convertSocketLikeToSocket(QSharedPointer<SocketLike> sock
 
 class FileLike
 {
+public:
+    enum MappingHint {
+        NormalAccess,
+        SequentialAccess,
+        RandomAccess,
+        WillNeedAccess,     // starts reading the whole file into the page cache.
+    };
 public:
     virtual ~FileLike();
     virtual qint32 read(char *data, qint32 size) = 0;
@@ -90,15 +177,49 @@ public:
     virtual bool atEnd() = 0;
     virtual void close() = 0;
     virtual qint64 size() = 0;
-    QByteArray readall(bool *ok);
+    // returns the underlying file if there is one, Socket::sendfile() can send it without copying.
+    virtual QSharedPointer<QFile> file();
+    // returns false if it can not seek.
+    virtual bool seek(qint64 pos);
+    // the mapped file returns the rest without copying.
+    virtual QByteArray readall(bool *ok);
 public:
     static QSharedPointer<FileLike> rawFile(QSharedPointer<QFile> f);
     static QSharedPointer<FileLike> rawFile(QFile *f) { return rawFile(QSharedPointer<QFile>(f)); }
+    // reads and writes the opened file by callInThread(), so a slow disk blocks the calling coroutine only. the
+    // next chunk is read ahead while the caller consumes the current one. file() returns null, so the callers
+    // copy it by read() instead of a blocking sendfile().
+    static QSharedPointer<FileLike> asyncFile(QSharedPointer<QFile> f, qint32 chunkSize = 1024 * 64);
+    // maps the whole file read-only, readall() returns a view of the mapping instead of a copy, which is valid
+    // until it is closed or deleted. falls back to rawFile() if it can not be mapped, returns null if it can not
+    // be opened.
+    static QSharedPointer<FileLike> mapped(const QString &path, MappingHint hint = SequentialAccess);
     static QSharedPointer<FileLike> bytes(const QByteArray &data);
 };
 
 
+class TokenBucketPrivate;
+// a bandwidth limit shared by the copies, such as all connections of a user or an address. a null bucket does
+// not limit. burst is the bytes may be sent at once after idle, one second of rate by default.
+class TokenBucket
+{
+public:
+    TokenBucket();
+    explicit TokenBucket(qint64 bytesPerSecond, qint64 burst = 0);
+public:
+    bool isNull() const { return d.isNull(); }
+    qint64 rate() const;
+    // takes bytes from the bucket, blocks the current coroutine until they are refilled.
+    void take(qint64 bytes);
+private:
+    QSharedPointer<TokenBucketPrivate> d;
+};
+
+
 class ExchangerPrivate;
+// relays two streams in both directions by two coroutines, until both are closed. the eof of one side is passed
+// to the other by half-closing it if it is a raw tcp socket. timeout limits a blocked sending, maxBufferSize is
+// not used any more, every direction buffers one packet only.
 class Exchanger
 {
 public:
@@ -106,6 +227,13 @@ public:
     ~Exchanger();
 public:
     void exchange();
+    // the accounting is readable by other coroutines while exchange() runs. outgoing is from request to forward.
+    qint64 outgoingBytes() const;
+    qint64 incomingBytes() const;
+    qint64 firstByteMsecs() const;  // from the start of exchange() to the first incoming byte, -1 if none.
+    qint64 stalledMsecs() const;    // the longest sending blocked by now, zero if none is blocked.
+    void setOutgoingLimit(const TokenBucket &bucket);
+    void setIncomingLimit(const TokenBucket &bucket);
 public:
     ExchangerPrivate * const d_ptr;
     Q_DECLARE_PRIVATE(Exchanger)
@@ -38,6 +38,31 @@ private:
     Error err;
 };
 
+class Socks5UdpSocketPrivate;
+// the datagrams relayed by a socks5 proxy (UDP ASSOCIATE), made by Socks5Proxy::udpAssociate(). the association
+// ends when it is closed or deleted.
+class Socks5UdpSocket
+{
+    Q_DISABLE_COPY(Socks5UdpSocket)
+public:
+    ~Socks5UdpSocket();
+public:
+    qint32 sendto(const char *data, qint32 size, const QHostAddress &addr, quint16 port);
+    qint32 sendto(const char *data, qint32 size, const QString &hostName, quint16 port);
+    qint32 recvfrom(char *data, qint32 size, QHostAddress *addr, quint16 *port);
+    // batched by one syscall. the headers are added in a buffer kept for the next sendmany(), and removed in place
+    // by recvmany(), so the buffers of recvmany() need 22 bytes more room than the datagrams.
+    qint32 sendmany(SocketDatagram *datagrams, qint32 count);
+    qint32 recvmany(SocketDatagram *datagrams, qint32 count);
+    void close();
+private:
+    explicit Socks5UdpSocket(Socks5UdpSocketPrivate *d);
+    Socks5UdpSocketPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(Socks5UdpSocket)
+    friend class Socks5ProxyPrivate;
+};
+
+
 class Socks5ProxyPrivate;
 class Socks5Proxy
 {
@@ -61,6 +86,10 @@ public:
     QSharedPointer<Socket> connect(const QString &remoteHost, quint16 port);
     QSharedPointer<Socket> connect(const QHostAddress &remoteHost, quint16 port);
     QSharedPointer<SocketLike> listen(quint16 port);
+    QSharedPointer<Socks5UdpSocket> udpAssociate();
+    // opens so many authenticated connections to the proxy in advance, the connect() of this thread takes them
+    // instead of a handshake. the copies of a proxy share them, and the ones idle for 10 seconds are dropped.
+    void warmUp(int count = 1);
 
     bool isNull() const;
     Capabilities capabilities() const;
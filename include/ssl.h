@@ -37,6 +37,7 @@ private:
 };
 
 
+class SslServerNames;
 class SslConfigurationPrivate;
 class SslConfiguration
 {
@@ -57,9 +58,19 @@ public:
     PrivateKey privateKey() const;
     bool onlySecureProtocol() const;
     bool supportCompression() const;
+    quint32 sessionTicketKeyLifetime() const;
+    quint32 sessionCacheSize() const;
+    bool kernelTlsEnabled() const;
+    bool handshakeOffloaded() const;
+    bool bufferReleaseEnabled() const;
+    quint32 verificationCacheLifetime() const;
+    SslServerNames serverNames() const;
+    QByteArray ocspResponse() const;
 
     void addCaCertificate(const Certificate &certificate);
     void addCaCertificates(const QList<Certificate> &certificates);
+    // loads a bundle of ca certificates, returns false if the file can not be read or has no certificate.
+    bool addCaCertificates(const QString &path, Ssl::EncodingFormat format = Ssl::Pem);
     void setLocalCertificate(const Certificate &certificate);
     bool setLocalCertificate(const QString &path, Ssl::EncodingFormat format = Ssl::Pem);
     void setPeerVerifyDepth(int depth);
@@ -72,8 +83,34 @@ public:
     void setAllowedNextProtocols(const QList<QByteArray> &protocols);
     void setOnlySecureProtocol(bool onlySecureProtocol);
     void setSupportCompression(bool supportCompression);
+    // for servers: the session ticket keys rotate every secs, zero disables tickets. the default is one hour.
+    void setSessionTicketKeyLifetime(quint32 secs);
+    // for servers: the size of session id cache shared by all connections, zero disables it.
+    void setSessionCacheSize(quint32 size);
+    // linux only: hands the keys to the kernel after handshake (TCP_ULP "tls"), needs openssl 3.0 built with ktls.
+    void setKernelTlsEnabled(bool enabled);
+    // the cpu heavy handshake runs in a thread pool while the coroutine waits, so the eventloop is not blocked.
+    void setHandshakeOffloaded(bool offloaded);
+    static void setHandshakeThreads(int count);
+    static int handshakeThreads();
+    // for many idle connections: the buffers of a connection are freed while it waits for the peer, and got again
+    // when the data comes. it saves about 50k of each idle connection, and costs some allocations of busy ones.
+    void setBufferReleaseEnabled(bool enabled);
+    // with VerifyPeer: the verified chains are trusted again for secs without building them, zero disables the cache.
+    void setVerificationCacheLifetime(quint32 secs);
+    // for servers: picks the configuration of the server name (sni) sent by client, this configuration serves the
+    // unknown names and the clients without sni.
+    void setServerNames(const SslServerNames &names);
+    // for servers: the der encoded ocsp response stapled to the handshakes of clients asking for it. unlike other
+    // setters, it is shared by the copies and replaced while serving. setLocalCertificate() drops it.
+    void setOcspResponse(const QByteArray &response);
+    // fetches the ocsp response of local certificate from the responder named in it, the issuer must be one of the
+    // ca certificates. returns the seconds to fetch it again before it expires, or -1 if failed.
+    qint64 refreshOcspResponse();
 public:
     static QList<SslCipher> supportedCiphers();
+    // the ca bundle of the operating system, empty if it is not found.
+    static QList<Certificate> systemCaCertificates();
     static SslConfiguration testPurpose(const QString &commonName, const QString &countryCode, const QString &organization);
 public:
     inline bool operator!=(const SslConfiguration &other) const { return !operator==(other); }
@@ -86,6 +123,29 @@ private:
     friend class SslConfigurationPrivate;
 };
 
+
+// the configurations of many host names served by one port. a name is exact, or a wildcard such as *.example.com
+// which matches one label. the table is shared by copies and may be changed while serving, the handshakes going on
+// keep the configuration they picked. the contexts of every configuration are made once and cached.
+class SslServerNamesPrivate;
+class SslServerNames
+{
+public:
+    SslServerNames();
+public:
+    void insert(const QString &name, const SslConfiguration &configuration);
+    bool remove(const QString &name);
+    // returns false if neither the exact name nor a wildcard matches.
+    bool find(const QString &serverName, SslConfiguration *configuration) const;
+    int size() const;
+    bool operator==(const SslServerNames &other) const { return d == other.d; }
+    bool operator!=(const SslServerNames &other) const { return d != other.d; }
+private:
+    QSharedPointer<SslServerNamesPrivate> d;
+    friend class SslConfiguration;
+    friend class SslConfigurationPrivate;
+};
+
 class SslErrorPrivate;
 class SslError
 {
@@ -172,6 +232,8 @@ public:
     bool handshake(bool asServer, const QString &verificationPeerName = QString());
     Certificate localCertificate() const;
     QList<Certificate> localCertificateChain() const;
+    // the protocol selected by alpn, or empty if the peer does not support it.
+    QByteArray negotiatedProtocol() const;
     QByteArray nextNegotiatedProtocol() const;
     NextProtocolNegotiationStatus nextProtocolNegotiationStatus() const;
     SslMode mode() const;
@@ -219,6 +281,18 @@ public:
     QByteArray recvall(qint32 size);
     qint32 send(const QByteArray &data);
     qint32 sendall(const QByteArray &data);
+    // small buffers are joined before encrypting, so they do not become many tiny tls records.
+    qint32 sendv(const QList<QByteArray> &buffers);
+    qint32 sendallv(const QList<QByteArray> &buffers);
+    qint32 recvv(SocketBuffer *buffers, qint32 count);
+    // sent by the kernel without copying if kernel tls is active, or by copying otherwise.
+    qint64 sendfile(QFile *file, qint64 offset = 0, qint64 length = -1);
+    bool isKernelTlsActive() const;  // the kernel encrypts the sending data.
+    bool isResumed() const;          // the handshake resumed a session.
+    // the counters of raw socket, so the bytes are encrypted ones, and the handshake.
+    SocketIoStats ioStats() const;
+    // the bytes taken from the raw socket but not read yet, the decrypted ones and the records in the bio.
+    qint32 bufferedBytes() const;
 private:
     SslSocketPrivate * const d_ptr;
     Q_DECLARE_PRIVATE(SslSocket)
@@ -231,6 +305,44 @@ QSharedPointer<SslSocket> convertSocketLikeToSslSocket(QSharedPointer<SocketLike
 QSharedPointer<SocketLike> encrypted(QSharedPointer<Cipher> cipher, QSharedPointer<SocketLike> socket);
 
 
+// datagram tls over a udp socket. the records are sent as datagrams of at most mtu() bytes, the lost handshake
+// messages are sent again by the timer of dtls, while the lost data is not, like udp. a client connects the raw
+// socket first, and resumes the sessions like SslSocket. a server binds it, and handshake() answers the hellos of
+// every address with a cookie until a client proves its address by sending it back, so the forged addresses cost
+// no key exchange. then the socket serves that client only.
+class DtlsSocketPrivate;
+class DtlsSocket
+{
+public:
+    DtlsSocket(QSharedPointer<Socket> rawSocket, const SslConfiguration &config = SslConfiguration());
+    ~DtlsSocket();
+public:
+    bool handshake(bool asServer, const QString &verificationPeerName = QString());
+    // the biggest datagram, 1200 bytes by default. set it before handshake.
+    void setMtu(quint16 mtu);
+    quint16 mtu() const;
+    // sends one datagram of at most 16k bytes, returns -1 if it is bigger or the socket is broken.
+    qint32 send(const char *data, qint32 size);
+    qint32 send(const QByteArray &data);
+    // receives one datagram, the rest of a bigger one is returned by the next calls. returns 0 if the peer closes.
+    qint32 recv(char *data, qint32 size);
+    QByteArray recv(qint32 size = 16 * 1024);
+    bool close();
+    bool isValid() const;
+    bool isResumed() const;     // the handshake resumed a session.
+    QHostAddress peerAddress() const;
+    quint16 peerPort() const;
+    Certificate peerCertificate() const;
+    SslCipher cipher() const;
+    QList<SslError> sslErrors() const;
+    QSharedPointer<Socket> rawSocket() const;
+private:
+    DtlsSocketPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(DtlsSocket)
+    Q_DISABLE_COPY(DtlsSocket)
+};
+
+
 QTNETWORKNG_NAMESPACE_END
 
 Q_DECLARE_METATYPE(QList<QTNETWORKNG_NAMESPACE::SslError>)
@@ -0,0 +1,88 @@
+#ifndef QTNG_WEBSOCKET_H
+#define QTNG_WEBSOCKET_H
+
+#include <QtCore/qurl.h>
+#include "socket_utils.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+class HttpSession;
+class HttpResponse;
+
+
+struct WebSocketConfiguration
+{
+    WebSocketConfiguration()
+        :maxMessageSize(1024 * 1024 * 16), maxPendingBytes(1024 * 1024), receivingQueueSize(64),
+          deflateThreshold(256), deflate(true) {}
+    qint32 maxMessageSize;          // a larger message closes the connection with MessageTooBig.
+    qint32 maxPendingBytes;         // send() waits while so many bytes are queued but not sent.
+    quint32 receivingQueueSize;     // the connection is not read while so many messages are not received.
+    qint32 deflateThreshold;        // the smaller messages are sent uncompressed.
+    bool deflate;                   // permessage-deflate of RFC 7692, ignored without zlib.
+};
+
+
+class WebSocketPrivate;
+// a websocket of RFC 6455 over the connection upgraded by HttpSession or BaseHttpRequestHandler. one coroutine
+// reads the frames and answers the pings, and another one writes the queued frames in batches.
+class WebSocket
+{
+public:
+    enum MessageType {
+        TextMessage = 1,
+        BinaryMessage = 2,
+    };
+    enum CloseCode {
+        NormalClosure = 1000,
+        GoingAway = 1001,
+        ProtocolError = 1002,
+        UnsupportedData = 1003,
+        NoStatusReceived = 1005,
+        AbnormalClosure = 1006,
+        InvalidPayload = 1007,
+        PolicyViolation = 1008,
+        MessageTooBig = 1009,
+        InternalError = 1011,
+    };
+    // readBytes is read from the connection after the handshake. extensions is the negotiated
+    // Sec-WebSocket-Extensions, permessage-deflate is enabled by it.
+    WebSocket(QSharedPointer<SocketLike> connection, bool isServer, const QByteArray &extensions = QByteArray(),
+              const WebSocketConfiguration &config = WebSocketConfiguration(),
+              const QByteArray &readBytes = QByteArray());
+    virtual ~WebSocket();
+public:
+    // returns false if the websocket is closed and no message is left.
+    bool receive(QByteArray *message, MessageType *type = nullptr);
+    // the message is queued, it waits only if maxPendingBytes are queued already.
+    bool send(const QByteArray &message, MessageType type = BinaryMessage);
+    bool sendText(const QString &text) { return send(text.toUtf8(), TextMessage); }
+    bool ping(const QByteArray &payload = QByteArray());
+    // sends the close frame, and waits for the one of peer at most timeout msecs.
+    void close(CloseCode code = NormalClosure, const QString &reason = QString(), quint32 timeout = 5000);
+    bool isOpen() const;
+    int closeCode() const;      // of the close frame received, AbnormalClosure if the connection is broken.
+    QString closeReason() const;
+    qint32 pendingBytes() const;
+    bool isCompressed() const;  // permessage-deflate is negotiated.
+    QSharedPointer<SocketLike> connection() const;
+public:
+    // the Sec-WebSocket-Accept for the Sec-WebSocket-Key.
+    static QByteArray acceptKey(const QByteArray &key);
+    // the Sec-WebSocket-Extensions replied to the offers of client, empty if none is accepted.
+    static QByteArray acceptExtensions(const QByteArray &offers, const WebSocketConfiguration &config);
+    // ws and wss urls, and http and https ones too. returns null if the handshake fails, the response is kept
+    // for the reason.
+    static QSharedPointer<WebSocket> connect(HttpSession *session, const QUrl &url,
+                                             const WebSocketConfiguration &config = WebSocketConfiguration(),
+                                             HttpResponse *response = nullptr);
+private:
+    WebSocketPrivate * const d_ptr;
+    Q_DECLARE_PRIVATE(WebSocket)
+    Q_DISABLE_COPY(WebSocket)
+};
+
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // QTNG_WEBSOCKET_H
@@ -8,11 +8,14 @@ INCLUDEPATH += $$PWD
 
 SOURCES += \
     $$PWD/src/socket.cpp \
+    $$PWD/src/dns.cpp \
     $$PWD/src/eventloop.cpp \
     $$PWD/src/coroutine.cpp \
     $$PWD/src/locks.cpp \
+    $$PWD/src/timerwheel.cpp \
     $$PWD/src/coroutine_utils.cpp \
     $$PWD/src/http.cpp \
+    $$PWD/src/http2.cpp \
     $$PWD/src/socket_utils.cpp \
     $$PWD/src/http_utils.cpp \
     $$PWD/src/http_proxy.cpp \
@@ -23,13 +26,26 @@ SOURCES += \
     $$PWD/src/kcp/ikcp.c \
     $$PWD/src/socket_server.cpp \
     $$PWD/src/httpd.cpp \
-    $$PWD/src/socks5_server.cpp
+    $$PWD/src/socks5_server.cpp \
+    $$PWD/src/metrics.cpp \
+    $$PWD/src/impairment.cpp \
+    $$PWD/src/iobuf.cpp \
+    $$PWD/src/http_cache.cpp \
+    $$PWD/src/http_cookie.cpp \
+    $$PWD/src/websocket.cpp \
+    $$PWD/src/http_router.cpp \
+    $$PWD/src/json_view.cpp
 
     
 PRIVATE_HEADERS += \
     $$PWD/include/private/coroutine_p.h \
+    $$PWD/include/private/locks_p.h \
     $$PWD/include/private/http_p.h \
-    $$PWD/include/private/socket_p.h
+    $$PWD/include/private/http2_p.h \
+    $$PWD/include/private/socket_p.h \
+    $$PWD/include/private/dns_p.h \
+    $$PWD/include/private/timerwheel_p.h \
+    $$PWD/include/private/tracing_p.h
     $$PWD/src/kcp/ikcp.h
 
     
@@ -49,7 +65,15 @@ HEADERS += \
     $$PWD/include/msgpack.h \
     $$PWD/include/kcp.h \
     $$PWD/include/socket_server.h \
-    $$PWD/include/httpd.h
+    $$PWD/include/httpd.h \
+    $$PWD/include/metrics.h \
+    $$PWD/include/impairment.h \
+    $$PWD/include/iobuf.h \
+    $$PWD/include/http_cache.h \
+    $$PWD/include/http_cookie.h \
+    $$PWD/include/websocket.h \
+    $$PWD/include/http_router.h \
+    $$PWD/include/json_view.h
 
     
 windows {
@@ -61,12 +85,54 @@ unix | macos {
     SOURCES += $$PWD/src/socket_unix.cpp
 }
 
+qtng_stack_guard {
+    DEFINES += QTNG_COROUTINE_STACK_GUARD
+}
+
+qtng_coroutine_introspection {
+    DEFINES += QTNG_COROUTINE_INTROSPECTION
+}
+
+qtng_usdt {
+    DEFINES += QTNG_HAVE_USDT
+}
+
 networkng_ev {
     LIBS += -lev
     SOURCES += $$PWD/src/eventloop_ev.cpp
     DEFINES += QTNETWOKRNG_USE_EV
 }
 
+!qtng_no_zlib {
+    LIBS += -lz
+    DEFINES += QTNG_HAVE_ZLIB
+}
+
+qtng_brotli {
+    LIBS += -lbrotlidec -lbrotlienc
+    DEFINES += QTNG_HAVE_BROTLI QTNG_HAVE_BROTLI_ENCODER
+}
+
+qtng_lz4 {
+    LIBS += -llz4
+    DEFINES += QTNG_HAVE_LZ4
+}
+
+qtng_zstd {
+    LIBS += -lzstd
+    DEFINES += QTNG_HAVE_ZSTD
+}
+
+linux:qtng_io_uring {
+    SOURCES += $$PWD/src/eventloop_uring.cpp
+    DEFINES += QTNETWOKRNG_USE_IO_URING
+}
+
+win32:qtng_iocp {
+    SOURCES += $$PWD/src/eventloop_iocp.cpp
+    DEFINES += QTNETWOKRNG_USE_IOCP
+}
+
 qtng_crypto {
     PRIVATE_HEADERS += \
         $$PWD/include/private/crypto_p.h \
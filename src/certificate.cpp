@@ -1,6 +1,9 @@
 #include <QtCore/qdebug.h>
 #include <QtCore/qdatetime.h>
 #include <QtCore/qdatastream.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qcache.h>
+#include <openssl/err.h>
 #include <openssl/x509v3.h>
 #include <openssl/pem.h>
 #include <openssl/asn1.h>
@@ -934,9 +937,77 @@ QByteArray Certificate::save(Ssl::EncodingFormat format) const
     return d->save(format);
 }
 
+// keyed by the loaded bytes, so the configurations of many hosts and every reload share the parsed chains.
+// the certificates are never changed after loaded.
+struct ParsedCertificates
+{
+    ParsedCertificates()
+        :certificates(4096), bundles(16384) {}
+    QMutex lock;
+    QCache<QPair<QByteArray, int>, Certificate> certificates;
+    QCache<QPair<QByteArray, int>, QList<Certificate>> bundles;  // costs the number of certificates.
+};
+
+
+Q_GLOBAL_STATIC(ParsedCertificates, parsedCertificates)
+
+
 Certificate Certificate::load(const QByteArray& data, Ssl::EncodingFormat format)
 {
-    return CertificatePrivate::load(data, format);
+    ParsedCertificates *cache = parsedCertificates();
+    const QPair<QByteArray, int> key(data, static_cast<int>(format));
+    if (cache) {
+        QMutexLocker locker(&cache->lock);
+        Certificate *cached = cache->certificates.object(key);
+        if (cached) {
+            return *cached;
+        }
+    }
+    const Certificate &cert = CertificatePrivate::load(data, format);
+    if (cache && !cert.isNull()) {
+        QMutexLocker locker(&cache->lock);
+        cache->certificates.insert(key, new Certificate(cert));
+    }
+    return cert;
+}
+
+
+QList<Certificate> Certificate::loadAll(const QByteArray &data, Ssl::EncodingFormat format)
+{
+    ParsedCertificates *cache = parsedCertificates();
+    const QPair<QByteArray, int> key(data, static_cast<int>(format));
+    if (cache) {
+        QMutexLocker locker(&cache->lock);
+        QList<Certificate> *cached = cache->bundles.object(key);
+        if (cached) {
+            return *cached;
+        }
+    }
+    QList<Certificate> certs;
+    if (format == Ssl::Der) {
+        const Certificate &cert = CertificatePrivate::load(data, format);
+        if (!cert.isNull()) {
+            certs.append(cert);
+        }
+    } else {
+        QSharedPointer<BIO> bio(BIO_new_mem_buf(data.data(), data.size()), BIO_free);
+        if (bio.isNull()) {
+            return certs;
+        }
+        X509 *x;
+        while ((x = PEM_read_bio_X509(bio.data(), nullptr, nullptr, nullptr))) {
+            Certificate cert;
+            cert.d->init(x);
+            certs.append(cert);
+        }
+        // the end of bundle leaves a PEM_R_NO_START_LINE error.
+        ERR_clear_error();
+    }
+    if (cache && !certs.isEmpty()) {
+        QMutexLocker locker(&cache->lock);
+        cache->bundles.insert(key, new QList<Certificate>(certs), certs.size());
+    }
+    return certs;
 }
 
 Certificate Certificate::generate(const PrivateKey &key, MessageDigest::Algorithm signAlgo,
@@ -30,6 +30,9 @@ const EVP_CIPHER *getOpenSSL_CIPHER(Cipher::Algorithm algo, Cipher::Mode mode)
         case Cipher::CTR:
             cipher = EVP_aes_128_ctr();
             break;
+        case Cipher::GCM:
+            cipher = EVP_aes_128_gcm();
+            break;
         default:
             Q_UNREACHABLE();
         }
@@ -51,6 +54,9 @@ const EVP_CIPHER *getOpenSSL_CIPHER(Cipher::Algorithm algo, Cipher::Mode mode)
         case Cipher::CTR:
             cipher = EVP_aes_192_ctr();
             break;
+        case Cipher::GCM:
+            cipher = EVP_aes_192_gcm();
+            break;
         default:
             Q_UNREACHABLE();
         }
@@ -72,6 +78,9 @@ const EVP_CIPHER *getOpenSSL_CIPHER(Cipher::Algorithm algo, Cipher::Mode mode)
         case Cipher::CTR:
             cipher = EVP_aes_256_ctr();
             break;
+        case Cipher::GCM:
+            cipher = EVP_aes_256_gcm();
+            break;
         default:
             Q_UNREACHABLE();
         }
@@ -189,7 +198,10 @@ public:
     CipherPrivate(Cipher::Algorithm algo, Cipher::Mode mode, Cipher::Operation operation);
     ~CipherPrivate();
     QByteArray addData(const char *data, int len);
+    int addData(const char *data, int len, char *out);
     QByteArray finalData();
+    int finalData(char *out);
+    bool isAead() const { return mode == Cipher::GCM; }
     QPair<QByteArray, QByteArray> bytesToKey(const QByteArray &password,MessageDigest::Algorithm hashAlgo,
                                              const QByteArray &salt, int i);
     QPair<QByteArray, QByteArray> PBKDF2_HMAC(const QByteArray &password, const QByteArray &salt,
@@ -198,6 +210,7 @@ public:
     bool setOpensslPassword(const QByteArray &password, const QByteArray &salt,
                             const MessageDigest::Algorithm hashAlgo, int i);
     bool init();
+    bool reset(const char *iv, int len);
     bool setPadding(bool padding);
 
     EVP_CIPHER_CTX *context;
@@ -256,6 +269,29 @@ bool CipherPrivate::init()
     }
 }
 
+// sets the iv and keeps the expanded key, so the key schedule does not run again.
+bool CipherPrivate::reset(const char *iv, int len)
+{
+    if(!context || !cipher || key.isEmpty() || len != EVP_CIPHER_iv_length(cipher)) {
+        return false;
+    }
+    if(this->iv.size() == len) {
+        memcpy(this->iv.data(), iv, static_cast<size_t>(len));
+    } else {
+        this->iv = QByteArray(iv, len);
+    }
+    if(!inited) {
+        hasError = false;
+        return init();
+    }
+    if(!EVP_CipherInit_ex(context, nullptr, nullptr, nullptr, reinterpret_cast<const unsigned char*>(iv), -1)) {
+        hasError = true;
+        return false;
+    }
+    hasError = false;
+    return true;
+}
+
 QPair<QByteArray, QByteArray> CipherPrivate::bytesToKey(const QByteArray &password,
                                                         MessageDigest::Algorithm hashAlgo,
                                                         const QByteArray &salt, int i)
@@ -318,36 +354,62 @@ QByteArray CipherPrivate::addData(const char *data, int len)
     }
     QByteArray out;
     out.resize(len + EVP_MAX_BLOCK_LENGTH);
-    int outl = 0;
-    int rvalue = EVP_CipherUpdate(context, reinterpret_cast<unsigned char *>(out.data()), &outl,
-                                             reinterpret_cast<const unsigned char *>(data), len);
-    if(rvalue) {
+    int outl = addData(data, len, out.data());
+    if(outl >= 0) {
         out.resize(outl);
         return out;
     } else {
-        hasError = true;
         return QByteArray();
     }
 }
 
+int CipherPrivate::addData(const char *data, int len, char *out)
+{
+    if(!context || !inited || hasError || len < 0) {
+        return -1;
+    }
+    int outl = 0;
+    int rvalue = EVP_CipherUpdate(context, reinterpret_cast<unsigned char *>(out), &outl,
+                                  reinterpret_cast<const unsigned char *>(data), len);
+    if(rvalue) {
+        return outl;
+    } else {
+        hasError = true;
+        return -1;
+    }
+}
+
 QByteArray CipherPrivate::finalData()
 {
     if(!context || !inited || hasError) {
         return QByteArray();
     }
     QByteArray out;
-    out.resize(1024 + EVP_MAX_BLOCK_LENGTH);
-    int outl = 0;
-    int rvalue = EVP_CipherFinal_ex(context, reinterpret_cast<unsigned char *>(out.data()), &outl);
-    if(rvalue) {
+    out.resize(EVP_MAX_BLOCK_LENGTH);
+    int outl = finalData(out.data());
+    if(outl >= 0) {
         out.resize(outl);
         return out;
     } else {
-        hasError = true;
         return QByteArray();
     }
 }
 
+int CipherPrivate::finalData(char *out)
+{
+    if(!context || !inited || hasError) {
+        return -1;
+    }
+    int outl = 0;
+    int rvalue = EVP_CipherFinal_ex(context, reinterpret_cast<unsigned char *>(out), &outl);
+    if(rvalue) {
+        return outl;
+    } else {
+        hasError = true;
+        return -1;
+    }
+}
+
 bool CipherPrivate::setPassword(const QByteArray &password, const QByteArray &salt, const MessageDigest::Algorithm hashAlgo, int i)
 {
     QByteArray s;
@@ -450,6 +512,62 @@ QByteArray Cipher::finalData()
 }
 
 
+int Cipher::addData(const char *data, int len, char *out)
+{
+    Q_D(Cipher);
+    return d->addData(data, len, out);
+}
+
+
+int Cipher::finalData(char *out)
+{
+    Q_D(Cipher);
+    return d->finalData(out);
+}
+
+
+bool Cipher::setAad(const char *aad, int len)
+{
+    Q_D(Cipher);
+    if (!d->isAead() || !d->context || !d->inited || d->hasError || len < 0) {
+        return false;
+    }
+    int outl = 0;
+    if (!EVP_CipherUpdate(d->context, nullptr, &outl, reinterpret_cast<const unsigned char *>(aad), len)) {
+        d->hasError = true;
+        return false;
+    }
+    return true;
+}
+
+
+QByteArray Cipher::tag() const
+{
+    Q_D(const Cipher);
+    if (!d->isAead() || !d->context || !d->inited || d->hasError || d->operation != Encrypt) {
+        return QByteArray();
+    }
+    QByteArray tag;
+    tag.resize(16);
+    if (!EVP_CIPHER_CTX_ctrl(d->context, EVP_CTRL_GCM_GET_TAG, tag.size(), tag.data())) {
+        return QByteArray();
+    }
+    return tag;
+}
+
+
+bool Cipher::setTag(const QByteArray &tag)
+{
+    Q_D(Cipher);
+    if (!d->isAead() || !d->context || !d->inited || d->hasError || d->operation != Decrypt
+            || tag.size() < 4 || tag.size() > 16) {
+        return false;
+    }
+    QByteArray copy = tag;
+    return EVP_CIPHER_CTX_ctrl(d->context, EVP_CTRL_GCM_SET_TAG, copy.size(), copy.data()) == 1;
+}
+
+
 bool Cipher::setInitialVector(const QByteArray &iv)
 {
     Q_D(Cipher);
@@ -458,6 +576,13 @@ bool Cipher::setInitialVector(const QByteArray &iv)
 }
 
 
+bool Cipher::reset(const char *iv, int len)
+{
+    Q_D(Cipher);
+    return d->reset(iv, len);
+}
+
+
 bool Cipher::setKey(const QByteArray &key)
 {
     Q_D(Cipher);
@@ -558,4 +683,233 @@ int Cipher::blockSize() const
     return blockSize;
 }
 
+
+class CipherKeyPrivate
+{
+public:
+    CipherKeyPrivate(Cipher::Algorithm algo, Cipher::Mode mode, Cipher::Operation operation, const QByteArray &key);
+    ~CipherKeyPrivate();
+    EVP_CIPHER_CTX *context;   // initialized with the key but no iv, only copied after then.
+    QByteArray key;
+    Cipher::Algorithm algo;
+    Cipher::Mode mode;
+    Cipher::Operation operation;
+};
+
+
+CipherKeyPrivate::CipherKeyPrivate(Cipher::Algorithm algo, Cipher::Mode mode, Cipher::Operation operation,
+                                   const QByteArray &key)
+    :context(nullptr), key(key), algo(algo), mode(mode), operation(operation)
+{
+    initOpenSSL();
+    const EVP_CIPHER *cipher = getOpenSSL_CIPHER(algo, mode);
+    if (!cipher || key.size() != EVP_CIPHER_key_length(cipher)) {
+        qWarning("cipher is not supported, or the key size is wrong.");
+        return;
+    }
+    context = EVP_CIPHER_CTX_new();
+    if (!context) {
+        return;
+    }
+    if (!EVP_CipherInit_ex(context, cipher, nullptr, reinterpret_cast<const unsigned char*>(key.constData()), nullptr,
+                           operation == Cipher::Decrypt ? 0 : 1)) {
+        EVP_CIPHER_CTX_free(context);
+        context = nullptr;
+    }
+}
+
+
+CipherKeyPrivate::~CipherKeyPrivate()
+{
+    if (context) {
+        EVP_CIPHER_CTX_free(context);
+    }
+}
+
+
+CipherKey::CipherKey(Cipher::Algorithm algo, Cipher::Mode mode, Cipher::Operation operation, const QByteArray &key)
+    :d(new CipherKeyPrivate(algo, mode, operation, key))
+{
+}
+
+
+bool CipherKey::isValid() const
+{
+    return d->context != nullptr;
+}
+
+
+Cipher *CipherKey::newCipher(const QByteArray &iv) const
+{
+    if (!d->context) {
+        return nullptr;
+    }
+    Cipher *cipher = new Cipher(d->algo, d->mode, d->operation);
+    CipherPrivate *cd = cipher->d_func();
+    if (!cd->context || !EVP_CIPHER_CTX_copy(cd->context, d->context)) {
+        delete cipher;
+        return nullptr;
+    }
+    cd->key = d->key;
+    cd->inited = true;  // the key is copied, reset() sets the iv only.
+    if (!cd->reset(iv.constData(), iv.size())) {
+        delete cipher;
+        return nullptr;
+    }
+    return cipher;
+}
+
+
+static const EVP_AEAD *getOpenSSL_AEAD(AeadCipher::Algorithm algo)
+{
+    switch (algo) {
+    case AeadCipher::AES128GCM:
+        return EVP_aead_aes_128_gcm();
+    case AeadCipher::AES256GCM:
+        return EVP_aead_aes_256_gcm();
+    case AeadCipher::ChaCha20Poly1305:
+        return EVP_aead_chacha20_poly1305();
+    }
+    return nullptr;
+}
+
+
+class AeadCipherPrivate
+{
+public:
+    AeadCipherPrivate(AeadCipher::Algorithm algo, const QByteArray &key);
+    ~AeadCipherPrivate();
+    EVP_AEAD_CTX context;
+    const EVP_AEAD *aead;
+    bool inited;
+};
+
+
+AeadCipherPrivate::AeadCipherPrivate(AeadCipher::Algorithm algo, const QByteArray &key)
+    :aead(nullptr), inited(false)
+{
+    initOpenSSL();
+    aead = getOpenSSL_AEAD(algo);
+    if (!aead || static_cast<size_t>(key.size()) != EVP_AEAD_key_length(aead)) {
+        qWarning("aead cipher is not supported, or the key size is wrong.");
+        return;
+    }
+    inited = EVP_AEAD_CTX_init(&context, aead, reinterpret_cast<const unsigned char *>(key.constData()),
+                               static_cast<size_t>(key.size()), EVP_AEAD_DEFAULT_TAG_LENGTH, nullptr) == 1;
+}
+
+
+AeadCipherPrivate::~AeadCipherPrivate()
+{
+    if (inited) {
+        EVP_AEAD_CTX_cleanup(&context);
+    }
+}
+
+
+AeadCipher::AeadCipher(Algorithm algo, const QByteArray &key)
+    :d_ptr(new AeadCipherPrivate(algo, key))
+{
+}
+
+
+AeadCipher::~AeadCipher()
+{
+    delete d_ptr;
+}
+
+
+bool AeadCipher::isValid() const
+{
+    Q_D(const AeadCipher);
+    return d->inited;
+}
+
+
+int AeadCipher::nonceSize() const
+{
+    Q_D(const AeadCipher);
+    return d->aead ? static_cast<int>(EVP_AEAD_nonce_length(d->aead)) : 0;
+}
+
+
+int AeadCipher::tagSize() const
+{
+    Q_D(const AeadCipher);
+    return d->aead ? static_cast<int>(EVP_AEAD_max_overhead(d->aead)) : 0;
+}
+
+
+int AeadCipher::keySize(Algorithm algo)
+{
+    initOpenSSL();
+    const EVP_AEAD *aead = getOpenSSL_AEAD(algo);
+    return aead ? static_cast<int>(EVP_AEAD_key_length(aead)) : 0;
+}
+
+
+int AeadCipher::seal(const char *nonce, char *data, int size, const char *ad, int adSize)
+{
+    Q_D(AeadCipher);
+    if (!d->inited || size < 0) {
+        return -1;
+    }
+    size_t outSize = 0;
+    unsigned char *p = reinterpret_cast<unsigned char *>(data);
+    int ok = EVP_AEAD_CTX_seal(&d->context, p, &outSize, static_cast<size_t>(size) + EVP_AEAD_max_overhead(d->aead),
+                               reinterpret_cast<const unsigned char *>(nonce), EVP_AEAD_nonce_length(d->aead),
+                               p, static_cast<size_t>(size), reinterpret_cast<const unsigned char *>(ad),
+                               static_cast<size_t>(adSize));
+    return ok == 1 ? static_cast<int>(outSize) : -1;
+}
+
+
+QByteArray AeadCipher::seal(const QByteArray &nonce, const QByteArray &ad, const QByteArray &plain)
+{
+    if (nonce.size() != nonceSize()) {
+        return QByteArray();
+    }
+    QByteArray data;
+    data.reserve(plain.size() + tagSize());
+    data.append(plain);
+    data.resize(plain.size() + tagSize());
+    const int size = seal(nonce.constData(), data.data(), plain.size(), ad.constData(), ad.size());
+    if (size < 0) {
+        return QByteArray();
+    }
+    data.resize(size);
+    return data;
+}
+
+
+QByteArray AeadCipher::open(const QByteArray &nonce, const QByteArray &ad, const QByteArray &sealed)
+{
+    if (nonce.size() != nonceSize()) {
+        return QByteArray();
+    }
+    QByteArray data = sealed;
+    const int size = open(nonce.constData(), data.data(), data.size(), ad.constData(), ad.size());
+    if (size < 0) {
+        return QByteArray();
+    }
+    data.resize(size);
+    return data;
+}
+
+
+int AeadCipher::open(const char *nonce, char *data, int size, const char *ad, int adSize)
+{
+    Q_D(AeadCipher);
+    if (!d->inited || size < 0) {
+        return -1;
+    }
+    size_t outSize = 0;
+    unsigned char *p = reinterpret_cast<unsigned char *>(data);
+    int ok = EVP_AEAD_CTX_open(&d->context, p, &outSize, static_cast<size_t>(size),
+                               reinterpret_cast<const unsigned char *>(nonce), EVP_AEAD_nonce_length(d->aead),
+                               p, static_cast<size_t>(size), reinterpret_cast<const unsigned char *>(ad),
+                               static_cast<size_t>(adSize));
+    return ok == 1 ? static_cast<int>(outSize) : -1;
+}
+
 QTNETWORKNG_NAMESPACE_END
@@ -1,4 +1,32 @@
+#include <QtCore/qmutex.h>
 #include "../include/private/coroutine_p.h"
+#include "../include/private/tracing_p.h"
+#ifdef QTNG_HAVE_USDT
+#include <QtCore/qmutex.h>
+#include <stdio.h>
+#endif
+#ifdef QTNG_COROUTINE_INTROSPECTION
+#include <QtCore/qhash.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qthread.h>
+#if defined(__GLIBC__) || defined(Q_OS_MACOS)
+#include <execinfo.h>
+#define QTNG_HAVE_BACKTRACE
+#endif
+#endif
+#include <string.h>
+#include <stdlib.h>
+#ifdef Q_OS_UNIX
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/syscall.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qmap.h>
+#endif
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
@@ -100,31 +128,52 @@ CurrentCoroutineStorage &currentCoroutine()
 }
 
 
+// a plain thread_local, every switch and every BaseCoroutine::current() read it without the lookup of QThreadStorage.
+// the main coroutine is made once for every thread.
+struct CurrentCoroutine
+{
+    BaseCoroutine *value;
+    quint64 switches;
+    bool initialized;
+};
+static thread_local CurrentCoroutine currentCoroutineOfThread = { nullptr, 0, false };
+
+
 // 开始实现 QBaseCoroutine::current()
 BaseCoroutine *CurrentCoroutineStorage::get()
 {
-    if(storage.hasLocalData())
-    {
-        return storage.localData().value;
+    CurrentCoroutine &current = currentCoroutineOfThread;
+    if (Q_LIKELY(current.initialized)) {
+        return current.value;
     }
     BaseCoroutine *main = createMainCoroutine();
     main->setObjectName("main_coroutine");
-    storage.localData().value = main;
+    current.value = main;
+    current.initialized = true;
     return main;
 }
 
 
 void CurrentCoroutineStorage::set(BaseCoroutine *coroutine)
 {
-    storage.localData().value = coroutine;
+    CurrentCoroutine &current = currentCoroutineOfThread;
+    QTNG_PROBE2(coroutine_switch, current.value ? current.value->id() : 0, coroutine ? coroutine->id() : 0);
+    current.value = coroutine;
+    current.initialized = true;
+    ++current.switches;
+}
+
+
+quint64 CurrentCoroutineStorage::switchCount()
+{
+    return currentCoroutineOfThread.switches;
 }
 
 
 void CurrentCoroutineStorage::clean()
 {
-    if(storage.hasLocalData())
-    {
-        storage.localData().value = nullptr;
+    if (currentCoroutineOfThread.initialized) {
+        currentCoroutineOfThread.value = nullptr;
     }
 }
 
@@ -135,6 +184,583 @@ BaseCoroutine *BaseCoroutine::current()
 }
 
 
+// 开始实现 CoroutineLocal
+
+// the slots are kept in a fixed array, so the coroutines of other threads can read them without lock. the lock
+// is taken by allocating and freeing only.
+#define QTNG_MAX_COROUTINE_LOCAL_SLOTS 256
+
+struct CoroutineLocalSlotInfo
+{
+    void (*destructor)(void *);
+    void *(*copier)(const void *);
+    QBasicAtomicInt generation;  // bumped when the slot is freed, the values set before are stale then.
+    bool used;
+};
+static CoroutineLocalSlotInfo coroutineLocalSlotInfos[QTNG_MAX_COROUTINE_LOCAL_SLOTS];
+Q_GLOBAL_STATIC(QMutex, coroutineLocalSlotLock)
+
+
+int BaseCoroutine::allocateLocalSlot(void (*destructor)(void *), void *(*copier)(const void *))
+{
+    QMutexLocker locker(coroutineLocalSlotLock());
+    for (int slot = 0; slot < QTNG_MAX_COROUTINE_LOCAL_SLOTS; ++slot) {
+        CoroutineLocalSlotInfo &info = coroutineLocalSlotInfos[slot];
+        if (!info.used) {
+            info.used = true;
+            info.destructor = destructor;
+            info.copier = copier;
+            return slot;
+        }
+    }
+    qFatal("too many CoroutineLocal alive, the max is %d.", QTNG_MAX_COROUTINE_LOCAL_SLOTS);
+    return -1;
+}
+
+
+void BaseCoroutine::freeLocalSlot(int slot)
+{
+    if (slot < 0 || slot >= QTNG_MAX_COROUTINE_LOCAL_SLOTS) {
+        return;
+    }
+    QMutexLocker locker(coroutineLocalSlotLock());
+    CoroutineLocalSlotInfo &info = coroutineLocalSlotInfos[slot];
+    info.generation.fetchAndAddOrdered(1);
+    info.used = false;
+}
+
+
+bool CoroutineLocalSlots::isStale(int slot, const Entry &entry) const
+{
+    return entry.generation != coroutineLocalSlotInfos[slot].generation.loadAcquire();
+}
+
+
+void *CoroutineLocalSlots::get(int slot) const
+{
+    if (slot >= values.size()) {
+        return nullptr;
+    }
+    const Entry &entry = values.at(slot);
+    if (!entry.value || isStale(slot, entry)) {
+        return nullptr;
+    }
+    return entry.value;
+}
+
+
+void CoroutineLocalSlots::set(int slot, void *value)
+{
+    if (slot >= values.size()) {
+        if (!value) {
+            return;
+        }
+        values.resize(slot + 1);  // the new entries are zeroed.
+    }
+    const Entry old = values.at(slot);
+    const CoroutineLocalSlotInfo &info = coroutineLocalSlotInfos[slot];
+    Entry &entry = values[slot];
+    entry.value = value;
+    entry.destructor = info.destructor;
+    entry.generation = info.generation.loadAcquire();
+    // a stale value is destroyed by the destructor of its own owner.
+    if (old.value && old.value != value) {
+        old.destructor(old.value);
+    }
+}
+
+
+void CoroutineLocalSlots::inherit(const CoroutineLocalSlots &parent)
+{
+    for (int slot = 0; slot < parent.values.size(); ++slot) {
+        const Entry &entry = parent.values.at(slot);
+        void *(*copier)(const void *) = coroutineLocalSlotInfos[slot].copier;
+        if (entry.value && copier && !parent.isStale(slot, entry)) {
+            set(slot, copier(entry.value));
+        }
+    }
+}
+
+
+void CoroutineLocalSlots::clear()
+{
+    // the destructors may set other values.
+    while (!values.isEmpty()) {
+        QVector<Entry> old;
+        old.swap(values);
+        for (int slot = old.size() - 1; slot >= 0; --slot) {
+            if (old.at(slot).value) {
+                old.at(slot).destructor(old.at(slot).value);
+            }
+        }
+    }
+}
+
+
+// 开始实现 CoroutineStackPool
+
+static QBasicAtomicInt stackPoolHighWaterMark = Q_BASIC_ATOMIC_INITIALIZER(16);
+
+
+static size_t roundStackSize(size_t stackSize)
+{
+#ifdef Q_OS_UNIX
+    static const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+    static const size_t pageSize = 1024 * 4;
+#endif
+    return (stackSize + pageSize - 1) / pageSize * pageSize;
+}
+
+
+static inline size_t guardSize()
+{
+#if defined(Q_OS_UNIX) && defined(QTNG_COROUTINE_STACK_GUARD)
+    return roundStackSize(1);
+#else
+    return 0;
+#endif
+}
+
+
+#ifdef Q_OS_LINUX
+static QBasicAtomicInt hugePagesEnabled = Q_BASIC_ATOMIC_INITIALIZER(0);
+static const size_t HugePageSize = 1024 * 1024 * 2;
+
+
+// the stacks carved out of 2 MiB chunks of huge pages, see CoroutineStackPool::setHugePages(). the chunks are never
+// unmapped, the stacks given back are reused by any thread.
+class StackArena
+{
+public:
+    StackArena()
+        :mappedBytes(0), hugetlbBytes(0) {}
+    void *take(size_t roundedSize);
+    bool give(void *stack, size_t roundedSize);
+public:
+    struct Chunk
+    {
+        Chunk()
+            :base(nullptr), used(0), size(0) {}
+        char *base;
+        size_t used;
+        size_t size;
+    };
+    QMutex mutex;
+    QMap<quintptr, size_t> chunks;              // by the base address, to tell the stacks of arena.
+    QMap<int, Chunk> carving;                   // the chunk being carved for every numa node.
+    QMap<size_t, QList<void*>> freeStacks;
+    quint64 mappedBytes;
+    quint64 hugetlbBytes;
+};
+Q_GLOBAL_STATIC(StackArena, stackArena)
+
+
+static int currentNumaNode()
+{
+#ifdef SYS_getcpu
+    unsigned int cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+        return static_cast<int>(node);
+    }
+#endif
+    return 0;
+}
+
+
+// MAP_HUGETLB takes the reserved huge pages, or the transparent ones are asked by madvise(). the pages are
+// preferred from the numa node of the calling thread, which is usually the thread of eventloop using them.
+static char *mapHugeChunk(size_t size, int node, bool *hugetlb)
+{
+    char *chunk = nullptr;
+    *hugetlb = false;
+#ifdef MAP_HUGETLB
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        chunk = static_cast<char*>(p);
+        *hugetlb = true;
+    }
+#endif
+    if (!chunk) {
+        // aligned to 2 MiB, so the transparent huge pages can back the whole chunk.
+        const size_t length = size + HugePageSize;
+        void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            return nullptr;
+        }
+        char *raw = static_cast<char*>(p);
+        chunk = reinterpret_cast<char*>((reinterpret_cast<quintptr>(raw) + HugePageSize - 1) & ~(HugePageSize - 1));
+        if (chunk > raw) {
+            munmap(raw, static_cast<size_t>(chunk - raw));
+        }
+        const size_t tail = static_cast<size_t>(raw + length - (chunk + size));
+        if (tail > 0) {
+            munmap(chunk + size, tail);
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(chunk, size, MADV_HUGEPAGE);
+#endif
+    }
+#ifdef SYS_mbind
+    if (node >= 0 && node < static_cast<int>(sizeof(unsigned long) * 8)) {
+        const unsigned long mask = 1UL << node;
+        const int MPolPreferred = 1;
+        syscall(SYS_mbind, chunk, size, MPolPreferred, &mask, sizeof(mask) * 8, 0);
+    }
+#endif
+    return chunk;
+}
+
+
+void *StackArena::take(size_t roundedSize)
+{
+    QMutexLocker locker(&mutex);
+    QMap<size_t, QList<void*>>::iterator itor = freeStacks.find(roundedSize);
+    if (itor != freeStacks.end() && !itor->isEmpty()) {
+        return itor->takeLast();
+    }
+    const int node = currentNumaNode();
+    Chunk &chunk = carving[node];
+    if (!chunk.base || chunk.size - chunk.used < roundedSize) {
+        // the rest of old chunk is left, it is less than the stack.
+        const size_t size = (roundedSize + HugePageSize - 1) / HugePageSize * HugePageSize;
+        bool hugetlb;
+        char *base = mapHugeChunk(size, node, &hugetlb);
+        if (!base) {
+            return nullptr;
+        }
+        chunks.insert(reinterpret_cast<quintptr>(base), size);
+        mappedBytes += size;
+        if (hugetlb) {
+            hugetlbBytes += size;
+        }
+        chunk.base = base;
+        chunk.size = size;
+        chunk.used = 0;
+    }
+    void *stack = chunk.base + chunk.used;
+    chunk.used += roundedSize;
+    return stack;
+}
+
+
+bool StackArena::give(void *stack, size_t roundedSize)
+{
+    const quintptr address = reinterpret_cast<quintptr>(stack);
+    QMutexLocker locker(&mutex);
+    QMap<quintptr, size_t>::const_iterator itor = chunks.upperBound(address);
+    if (itor == chunks.constBegin()) {
+        return false;
+    }
+    --itor;
+    if (address >= itor.key() + itor.value()) {
+        return false;
+    }
+    freeStacks[roundedSize].append(stack);
+    return true;
+}
+#endif
+
+
+static void *mapStack(size_t roundedSize)
+{
+#if defined(Q_OS_LINUX) && !defined(QTNG_COROUTINE_STACK_GUARD)
+    if (hugePagesEnabled.load()) {
+        StackArena *arena = stackArena();
+        void *stack = arena ? arena->take(roundedSize) : nullptr;
+        if (stack) {
+            return stack;
+        }
+        // no huge pages at all, fall back to the normal pages.
+    }
+#endif
+#ifdef Q_OS_UNIX
+#if defined(QTNG_COROUTINE_STACK_GUARD)
+    // the lowest page is not accessible, so stack overflow raises SIGSEGV.
+    char *base = static_cast<char*>(mmap(nullptr, roundedSize + guardSize(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (static_cast<void*>(base) == MAP_FAILED) {
+        return nullptr;
+    }
+    if (mprotect(base, guardSize(), PROT_NONE) != 0) {
+        munmap(base, roundedSize + guardSize());
+        return nullptr;
+    }
+    return base + guardSize();
+#elif defined(MAP_GROWSDOWN)
+    void *stack = mmap(nullptr, roundedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_GROWSDOWN, -1, 0);
+#else
+    void *stack = mmap(nullptr, roundedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
+    if (stack == MAP_FAILED) {
+        return nullptr;
+    }
+    return stack;
+#else
+    return operator new(roundedSize);
+#endif
+}
+
+
+static void unmapStack(void *stack, size_t roundedSize)
+{
+#if defined(Q_OS_LINUX) && !defined(QTNG_COROUTINE_STACK_GUARD)
+    StackArena *arena = stackArena();
+    if (arena && arena->give(stack, roundedSize)) {
+        return;
+    }
+#endif
+#ifdef Q_OS_UNIX
+    munmap(static_cast<char*>(stack) - guardSize(), roundedSize + guardSize());
+#else
+    Q_UNUSED(roundedSize);
+    operator delete(stack);
+#endif
+}
+
+
+class CoroutineStackPoolPrivate
+{
+public:
+    ~CoroutineStackPoolPrivate();
+    void *take(size_t roundedSize);
+    bool put(void *stack, size_t roundedSize);
+    void clear();
+public:
+    QMap<size_t, QList<void*>> stacks;
+};
+
+
+CoroutineStackPoolPrivate::~CoroutineStackPoolPrivate()
+{
+    clear();
+}
+
+
+void *CoroutineStackPoolPrivate::take(size_t roundedSize)
+{
+    QMap<size_t, QList<void*>>::iterator itor = stacks.find(roundedSize);
+    if (itor == stacks.end() || itor->isEmpty()) {
+        return nullptr;
+    }
+    return itor->takeLast();
+}
+
+
+bool CoroutineStackPoolPrivate::put(void *stack, size_t roundedSize)
+{
+    QList<void*> &l = stacks[roundedSize];
+    if (l.size() >= stackPoolHighWaterMark.load()) {
+        return false;
+    }
+    l.append(stack);
+    return true;
+}
+
+
+void CoroutineStackPoolPrivate::clear()
+{
+    for (QMap<size_t, QList<void*>>::const_iterator itor = stacks.constBegin(); itor != stacks.constEnd(); ++itor) {
+        for (void *stack: itor.value()) {
+            unmapStack(stack, itor.key());
+        }
+    }
+    stacks.clear();
+}
+
+
+// QThreadStorage deletes the pool, and unmaps all idle stacks, while the thread exits.
+Q_GLOBAL_STATIC(QThreadStorage<CoroutineStackPoolPrivate*>, stackPoolStorage)
+
+
+static CoroutineStackPoolPrivate *currentStackPool()
+{
+    QThreadStorage<CoroutineStackPoolPrivate*> *storage = stackPoolStorage();
+    if (!storage) {  // the process is exiting.
+        return nullptr;
+    }
+    if (!storage->hasLocalData()) {
+        storage->setLocalData(new CoroutineStackPoolPrivate());
+    }
+    return storage->localData();
+}
+
+
+static QBasicAtomicInteger<quint64> stacksInUse = Q_BASIC_ATOMIC_INITIALIZER(0);
+static QBasicAtomicInteger<quint64> stackBytesInUse = Q_BASIC_ATOMIC_INITIALIZER(0);
+
+
+void *allocateCoroutineStack(size_t stackSize)
+{
+    size_t roundedSize = roundStackSize(stackSize);
+    CoroutineStackPoolPrivate *pool = currentStackPool();
+    void *stack = pool ? pool->take(roundedSize) : nullptr;
+    if (!stack) {
+        stack = mapStack(roundedSize);
+    }
+    if (stack) {
+        stacksInUse.fetchAndAddRelaxed(1);
+        stackBytesInUse.fetchAndAddRelaxed(roundedSize);
+    }
+    return stack;
+}
+
+
+void freeCoroutineStack(void *stack, size_t stackSize)
+{
+    if (!stack) {
+        return;
+    }
+    size_t roundedSize = roundStackSize(stackSize);
+    stacksInUse.fetchAndSubRelaxed(1);
+    stackBytesInUse.fetchAndSubRelaxed(roundedSize);
+    CoroutineStackPoolPrivate *pool = currentStackPool();
+    if (!pool || !pool->put(stack, roundedSize)) {
+        unmapStack(stack, roundedSize);
+    }
+}
+
+
+quint64 coroutineStacksInUse(quint64 *bytes)
+{
+    if (bytes) {
+        *bytes = stackBytesInUse.load();
+    }
+    return stacksInUse.load();
+}
+
+
+static QBasicAtomicInt stackUsageTracking = Q_BASIC_ATOMIC_INITIALIZER(0);
+static const quint32 StackPaintPattern = 0xcdcdcdcd;
+
+
+void paintCoroutineStack(void *stack, size_t stackSize)
+{
+    if (!stack || !stackUsageTracking.load()) {
+        return;
+    }
+    quint32 *p = static_cast<quint32*>(stack);
+    quint32 *end = p + stackSize / sizeof(quint32);
+    while (p < end) {
+        *p++ = StackPaintPattern;
+    }
+}
+
+
+size_t measureCoroutineStack(const void *stack, size_t stackSize)
+{
+    if (!stack || !stackUsageTracking.load()) {
+        return 0;
+    }
+    const quint32 *begin = static_cast<const quint32*>(stack);
+    const quint32 *end = begin + stackSize / sizeof(quint32);
+    const quint32 *p = begin;
+    while (p < end && *p == StackPaintPattern) {
+        ++p;
+    }
+    return static_cast<size_t>(end - p) * sizeof(quint32);
+}
+
+
+void BaseCoroutine::setStackUsageTracking(bool enabled)
+{
+    stackUsageTracking.store(enabled ? 1 : 0);
+}
+
+
+bool BaseCoroutine::isStackUsageTracking()
+{
+    return stackUsageTracking.load() != 0;
+}
+
+
+void CoroutineStackPool::setHighWaterMark(quint32 count)
+{
+    stackPoolHighWaterMark.store(static_cast<int>(qMin<quint32>(count, INT_MAX)));
+}
+
+
+quint32 CoroutineStackPool::highWaterMark()
+{
+    return static_cast<quint32>(stackPoolHighWaterMark.load());
+}
+
+
+void CoroutineStackPool::setHugePages(bool enabled)
+{
+#if defined(Q_OS_LINUX) && !defined(QTNG_COROUTINE_STACK_GUARD)
+    hugePagesEnabled.store(enabled ? 1 : 0);
+#else
+    Q_UNUSED(enabled);
+#endif
+}
+
+
+bool CoroutineStackPool::isHugePages()
+{
+#if defined(Q_OS_LINUX) && !defined(QTNG_COROUTINE_STACK_GUARD)
+    return hugePagesEnabled.load() != 0;
+#else
+    return false;
+#endif
+}
+
+
+quint64 coroutineStackArenaBytes(quint64 *hugetlbBytes)
+{
+    quint64 mapped = 0, hugetlb = 0;
+#if defined(Q_OS_LINUX) && !defined(QTNG_COROUTINE_STACK_GUARD)
+    StackArena *arena = stackArena();
+    if (arena) {
+        QMutexLocker locker(&arena->mutex);
+        mapped = arena->mappedBytes;
+        hugetlb = arena->hugetlbBytes;
+    }
+#endif
+    if (hugetlbBytes) {
+        *hugetlbBytes = hugetlb;
+    }
+    return mapped;
+}
+
+
+quint32 CoroutineStackPool::prewarm(quint32 count, size_t stackSize)
+{
+    CoroutineStackPoolPrivate *pool = currentStackPool();
+    if (!pool || !stackSize) {
+        return 0;
+    }
+    size_t roundedSize = roundStackSize(stackSize);
+    QList<void*> &l = pool->stacks[roundedSize];
+    while (static_cast<quint32>(l.size()) < count && l.size() < stackPoolHighWaterMark.load()) {
+        void *stack = mapStack(roundedSize);
+        if (!stack) {
+            break;
+        }
+        l.append(stack);
+    }
+    return static_cast<quint32>(l.size());
+}
+
+
+quint32 CoroutineStackPool::size(size_t stackSize)
+{
+    CoroutineStackPoolPrivate *pool = currentStackPool();
+    if (!pool) {
+        return 0;
+    }
+    return static_cast<quint32>(pool->stacks.value(roundStackSize(stackSize)).size());
+}
+
+
+void CoroutineStackPool::clear()
+{
+    CoroutineStackPoolPrivate *pool = currentStackPool();
+    if (pool) {
+        pool->clear();
+    }
+}
+
+
 QDebug &operator <<(QDebug &out, const BaseCoroutine& coroutine)
 {
     if(coroutine.objectName().isEmpty()) {
@@ -145,4 +771,367 @@ QDebug &operator <<(QDebug &out, const BaseCoroutine& coroutine)
 }
 
 
+
+// 开始实现 usdt 探针的 coroutine map
+
+#ifdef QTNG_HAVE_USDT
+
+struct CoroutineMapFile
+{
+    CoroutineMapFile();
+    ~CoroutineMapFile();
+    QMutex mutex;
+    FILE *file;
+};
+
+
+CoroutineMapFile::CoroutineMapFile()
+    :file(nullptr)
+{
+    if (!qEnvironmentVariableIsEmpty("QTNG_COROUTINE_MAP")) {
+        const QByteArray &path = "/tmp/qtng-" + QByteArray::number(static_cast<qint64>(getpid())) + ".map";
+        file = fopen(path.constData(), "a");
+        if (!file) {
+            qWarning("can not open the coroutine map %s.", path.constData());
+        }
+    }
+}
+
+
+CoroutineMapFile::~CoroutineMapFile()
+{
+    if (file) {
+        fclose(file);
+    }
+}
+
+
+Q_GLOBAL_STATIC(CoroutineMapFile, coroutineMapFile)
+
+
+void traceCoroutineStarted(BaseCoroutine *coroutine, const void *stack, size_t stackSize)
+{
+    QTNG_PROBE3(coroutine_start, coroutine->id(), stack, stackSize);
+    CoroutineMapFile *map = coroutineMapFile();
+    if (!map || !map->file || !stack) {
+        return;
+    }
+    const QByteArray &name = coroutine->objectName().toUtf8();
+    QMutexLocker locker(&map->mutex);
+    // flushed at once, the profiler reads it while the process is running.
+    fprintf(map->file, "%llx %llx coroutine-%llx:%s\n", static_cast<unsigned long long>(reinterpret_cast<quintptr>(stack)),
+            static_cast<unsigned long long>(stackSize), static_cast<unsigned long long>(coroutine->id()), name.constData());
+    fflush(map->file);
+}
+
+#endif
+
+
+// 开始实现 CoroutineIntrospection
+
+#ifdef QTNG_COROUTINE_INTROSPECTION
+
+static const int MaxFrames = 32;
+
+
+struct CoroutineDebugInfo
+{
+    CoroutineDebugInfo()
+        :thread(nullptr), state(BaseCoroutine::Initialized), stackSize(0), stackTop(0), stackUsed(0)
+        , primitive(nullptr), object(nullptr), fd(-1), waitSince(0), createdFrames(0), waitFrames(0) {}
+    Qt::HANDLE thread;
+    QString name;
+    BaseCoroutine::State state;
+    size_t stackSize;
+    quintptr stackTop;      // the address of a local variable when the coroutine started.
+    size_t stackUsed;       // the depth of stack when it began waiting.
+    const char *primitive;
+    const void *object;
+    qintptr fd;
+    qint64 waitSince;       // QElapsedTimer::msecsSinceReference()
+    int createdFrames;
+    int waitFrames;
+    void *created[MaxFrames];
+    void *waiting[MaxFrames];
+};
+
+
+struct CoroutineRegistry
+{
+    QMutex mutex;
+    QHash<BaseCoroutine *, CoroutineDebugInfo *> coroutines;
+};
+
+
+Q_GLOBAL_STATIC(CoroutineRegistry, coroutineRegistry)
+
+
+static inline int captureFrames(void **frames)
+{
+#ifdef QTNG_HAVE_BACKTRACE
+    return backtrace(frames, MaxFrames);
+#else
+    Q_UNUSED(frames);
+    return 0;
+#endif
+}
+
+
+void registerCoroutine(BaseCoroutine *coroutine)
+{
+    CoroutineRegistry *registry = coroutineRegistry();
+    if (!registry) {
+        return;
+    }
+    CoroutineDebugInfo *info = new CoroutineDebugInfo();
+    info->thread = QThread::currentThreadId();
+    info->createdFrames = captureFrames(info->created);
+    {
+        QMutexLocker locker(&registry->mutex);
+        registry->coroutines.insert(coroutine, info);
+    }
+    // the callbacks run in the coroutine, so the name is read by its own thread.
+    coroutine->started.addCallback([] (BaseCoroutine *c) {
+        char top;
+        CoroutineRegistry *registry = coroutineRegistry();
+        if (!registry) {
+            return;
+        }
+        const QString &name = c->objectName();
+        QMutexLocker locker(&registry->mutex);
+        CoroutineDebugInfo *info = registry->coroutines.value(c);
+        if (info) {
+            info->name = name;
+            info->state = BaseCoroutine::Started;
+            info->stackSize = c->stackSize();
+            info->stackTop = reinterpret_cast<quintptr>(&top);
+        }
+    });
+    coroutine->finished.addCallback([] (BaseCoroutine *c) {
+        CoroutineRegistry *registry = coroutineRegistry();
+        if (!registry) {
+            return;
+        }
+        QMutexLocker locker(&registry->mutex);
+        CoroutineDebugInfo *info = registry->coroutines.value(c);
+        if (info) {
+            info->state = BaseCoroutine::Stopped;
+        }
+    });
+}
+
+
+void unregisterCoroutine(BaseCoroutine *coroutine)
+{
+    CoroutineRegistry *registry = coroutineRegistry();
+    if (!registry) {
+        return;
+    }
+    QMutexLocker locker(&registry->mutex);
+    delete registry->coroutines.take(coroutine);
+}
+
+
+CoroutineWaitScope::CoroutineWaitScope(const char *primitive, const void *object, qintptr fd)
+    :coroutine(BaseCoroutine::current()), outermost(false)
+{
+    char here;
+    CoroutineRegistry *registry = coroutineRegistry();
+    if (!registry) {
+        return;
+    }
+    void *frames[MaxFrames];
+    const int depth = captureFrames(frames);
+    QMutexLocker locker(&registry->mutex);
+    CoroutineDebugInfo *info = registry->coroutines.value(coroutine);
+    if (!info || info->primitive) {
+        return;
+    }
+    outermost = true;
+    info->primitive = primitive;
+    info->object = object;
+    info->fd = fd;
+    info->waitSince = QElapsedTimer::msecsSinceReference();
+    if (info->stackTop) {
+        info->stackUsed = static_cast<size_t>(info->stackTop - reinterpret_cast<quintptr>(&here));
+    }
+    info->waitFrames = depth;
+    memcpy(info->waiting, frames, sizeof(void *) * static_cast<size_t>(depth));
+}
+
+
+CoroutineWaitScope::~CoroutineWaitScope()
+{
+    CoroutineRegistry *registry = coroutineRegistry();
+    if (!outermost || !registry) {
+        return;
+    }
+    QMutexLocker locker(&registry->mutex);
+    CoroutineDebugInfo *info = registry->coroutines.value(coroutine);
+    if (info) {
+        info->primitive = nullptr;
+        info->object = nullptr;
+        info->fd = -1;
+        info->waitFrames = 0;
+    }
+}
+
+
+static void dumpFrames(QByteArray &out, const char *title, void * const *frames, int depth)
+{
+    if (depth <= 0) {
+        return;
+    }
+    out += "  ";
+    out += title;
+    out += ":\n";
+#ifdef QTNG_HAVE_BACKTRACE
+    // the first frames are the introspection itself.
+    char **symbols = backtrace_symbols(frames, depth);
+    for (int i = 1; i < depth; ++i) {
+        out += "    #" + QByteArray::number(i - 1) + ' ' + (symbols ? QByteArray(symbols[i]) : QByteArray::number(reinterpret_cast<quintptr>(frames[i]), 16)) + '\n';
+    }
+    free(symbols);
+#else
+    Q_UNUSED(frames);
+#endif
+}
+
+
+static const char *stateName(BaseCoroutine::State state)
+{
+    switch (state) {
+    case BaseCoroutine::Initialized:
+        return "initialized";
+    case BaseCoroutine::Started:
+        return "started";
+    case BaseCoroutine::Stopped:
+        return "stopped";
+    case BaseCoroutine::Joined:
+        return "joined";
+    }
+    return "unknown";
+}
+
+#endif
+
+
+bool CoroutineIntrospection::isAvailable()
+{
+#ifdef QTNG_COROUTINE_INTROSPECTION
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+int CoroutineIntrospection::count()
+{
+#ifdef QTNG_COROUTINE_INTROSPECTION
+    CoroutineRegistry *registry = coroutineRegistry();
+    if (!registry) {
+        return 0;
+    }
+    QMutexLocker locker(&registry->mutex);
+    return registry->coroutines.size();
+#else
+    return 0;
+#endif
+}
+
+
+QByteArray CoroutineIntrospection::dump()
+{
+#ifdef QTNG_COROUTINE_INTROSPECTION
+    CoroutineRegistry *registry = coroutineRegistry();
+    if (!registry) {
+        return QByteArray();
+    }
+    const qint64 now = QElapsedTimer::msecsSinceReference();
+    QByteArray out;
+    QMutexLocker locker(&registry->mutex);
+    out += QByteArray::number(registry->coroutines.size()) + " coroutines\n";
+    for (QHash<BaseCoroutine *, CoroutineDebugInfo *>::const_iterator itor = registry->coroutines.constBegin();
+            itor != registry->coroutines.constEnd(); ++itor) {
+        const CoroutineDebugInfo *info = itor.value();
+        out += "coroutine " + QByteArray::number(reinterpret_cast<quintptr>(itor.key()), 16);
+        if (!info->name.isEmpty()) {
+            out += " \"" + info->name.toUtf8() + '"';
+        }
+        out += " thread " + QByteArray::number(reinterpret_cast<quintptr>(info->thread), 16);
+        out += QByteArray(" ") + stateName(info->state);
+        if (info->primitive) {
+            out += QByteArray(", waiting for ") + info->primitive;
+            if (info->fd >= 0) {
+                out += " fd " + QByteArray::number(info->fd);
+            } else if (info->object) {
+                out += ' ' + QByteArray::number(reinterpret_cast<quintptr>(info->object), 16);
+            }
+            out += " for " + QByteArray::number(now - info->waitSince) + "ms";
+            if (info->stackUsed) {
+                out += ", stack " + QByteArray::number(static_cast<quint64>(info->stackUsed)) + " of "
+                        + QByteArray::number(static_cast<quint64>(info->stackSize)) + " bytes";
+            }
+        }
+        out += '\n';
+        dumpFrames(out, "created at", info->created, info->createdFrames);
+        dumpFrames(out, "suspended at", info->waiting, info->waitFrames);
+    }
+    return out;
+#else
+    return QByteArray("coroutine introspection is disabled, build with QTNG_COROUTINE_INTROSPECTION.\n");
+#endif
+}
+
+
+#ifdef Q_OS_UNIX
+
+static int dumpSignalPipe[2] = { -1, -1 };
+
+
+static void dumpSignalHandler(int)
+{
+    const char c = 0;
+    // the handler only wakes up the thread, write() is async-signal-safe.
+    ssize_t n = ::write(dumpSignalPipe[1], &c, 1);
+    Q_UNUSED(n);
+}
+
+
+class CoroutineDumpThread: public QThread
+{
+public:
+    virtual void run() override
+    {
+        char c;
+        while (::read(dumpSignalPipe[0], &c, 1) == 1) {
+            const QByteArray &text = CoroutineIntrospection::dump();
+            ssize_t n = ::write(STDERR_FILENO, text.constData(), static_cast<size_t>(text.size()));
+            Q_UNUSED(n);
+        }
+    }
+};
+
+
+bool CoroutineIntrospection::dumpOnSignal(int signo)
+{
+    if (dumpSignalPipe[0] < 0) {
+        if (::pipe(dumpSignalPipe) != 0) {
+            return false;
+        }
+        CoroutineDumpThread *thread = new CoroutineDumpThread();
+        thread->start();
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = dumpSignalHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    return sigaction(signo, &action, nullptr) == 0;
+}
+
+#endif
+
+
 QTNETWORKNG_NAMESPACE_END
@@ -1,12 +1,11 @@
 #include <stdlib.h>
+#include <string.h>
 #include <setjmp.h>
 #include <QtCore/qdebug.h>
 #include <QtCore/qlist.h>
+#include <QtCore/qthreadstorage.h>
 #include "../include/private/coroutine_p.h"
-
-#ifdef Q_OS_UNIX
-# include <sys/mman.h>
-#endif
+#include "../include/private/tracing_p.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
@@ -25,8 +24,34 @@ extern "C" intptr_t BOOST_CONTEXT_CALLDECL jump_fcontext(fcontext_t *ofc, fconte
 extern "C" fcontext_t BOOST_CONTEXT_CALLDECL make_fcontext(void *sp, std::size_t size, void (* fn)(intptr_t));
 
 
+#ifndef QTNG_SHARED_STACK_SIZE
+#define QTNG_SHARED_STACK_SIZE DEFAULT_COROUTINE_STACK_SIZE
+#endif
+
+class BaseCoroutinePrivate;
+
+// the stack shared by the coroutines of one thread, see BaseCoroutine::setSharedStack(). the frames of a coroutine
+// are copied in before it runs, and copied out of the stack when another one takes it.
+struct SharedStack
+{
+    SharedStack();
+    ~SharedStack();
+    char *top() const { return static_cast<char*>(stack) + size; }
+    fcontext_t switcherContext();
+    void *stack;
+    size_t size;
+    BaseCoroutinePrivate *owner;    // the coroutine whose frames are on the stack now.
+    // a coroutine on the shared stack can not copy frames over its own, so it switches by the switcher running
+    // on a small stack of its own.
+    void *switcherStack;
+    size_t switcherStackSize;
+    fcontext_t switcher;
+};
+
+
 // 开始定义 CoroutinePrivate
 extern "C" void run_stub(intptr_t tr);
+extern "C" void shared_stack_switcher(intptr_t data);
 class BaseCoroutinePrivate
 {
 public:
@@ -35,24 +60,95 @@ public:
     bool initContext();
     bool raise(CoroutineException *exception = nullptr);
     bool yield();
+    bool setSharedStack(bool shared);
+    bool makeStackResident();
+private:
+    void swapInSharedStack();
 private:
     BaseCoroutine * const q_ptr;
     BaseCoroutine * previous;
     CoroutineException *exception;
     fcontext_t context;
     size_t stackSize;
+    size_t stackHighWaterMark;
     void *stack;
+    SharedStack *sharedStack;   // not owned, null if the coroutine has a stack of its own.
+    QByteArray savedStack;      // the frames copied out of the shared stack.
     enum BaseCoroutine::State state;
+    BaseCoroutine::Priority priority;
     bool bad;
+    CoroutineLocalSlots locals;
     Q_DECLARE_PUBLIC(BaseCoroutine)
 private:
     static BaseCoroutinePrivate *getPrivateHelper(BaseCoroutine *coroutine) { return coroutine->dd_ptr; }
-    void cleanup() { q_ptr->cleanup(); }
+    // the values are destroyed in this coroutine, before switching out forever.
+    void cleanup() { locals.clear(); q_ptr->cleanup(); }
     friend void run_stub(intptr_t tr);
+    friend void shared_stack_switcher(intptr_t data);
+    friend struct SharedStack;
+    friend bool makeCoroutineStackResident(BaseCoroutine *coroutine);
     friend BaseCoroutine* createMainCoroutine();
 };
 
 
+SharedStack::SharedStack()
+    :stack(allocateCoroutineStack(QTNG_SHARED_STACK_SIZE)), size(QTNG_SHARED_STACK_SIZE), owner(nullptr),
+      switcherStack(allocateCoroutineStack(1024 * 64)), switcherStackSize(1024 * 64), switcher(nullptr)
+{
+}
+
+
+SharedStack::~SharedStack()
+{
+    freeCoroutineStack(stack, size);
+    freeCoroutineStack(switcherStack, switcherStackSize);
+}
+
+
+fcontext_t SharedStack::switcherContext()
+{
+    if (!switcher) {
+        switcher = make_fcontext(static_cast<char*>(switcherStack) + switcherStackSize, switcherStackSize,
+                                 shared_stack_switcher);
+    }
+    return switcher;
+}
+
+
+// QThreadStorage deletes the shared stack while the thread exits.
+Q_GLOBAL_STATIC(QThreadStorage<SharedStack*>, sharedStackStorage)
+
+
+static SharedStack *currentSharedStack()
+{
+    QThreadStorage<SharedStack*> *storage = sharedStackStorage();
+    if (!storage) {
+        return nullptr;
+    }
+    if (!storage->hasLocalData()) {
+        SharedStack *shared = new SharedStack();
+        if (!shared->stack || !shared->switcherStack) {
+            delete shared;
+            return nullptr;
+        }
+        storage->setLocalData(shared);
+    }
+    return storage->localData();
+}
+
+
+// runs the swapping for the coroutines on the shared stack, and waits for the next one.
+extern "C" void shared_stack_switcher(intptr_t data)
+{
+    while (true) {
+        BaseCoroutinePrivate *target = reinterpret_cast<BaseCoroutinePrivate*>(data);
+        SharedStack *shared = target->sharedStack;
+        target->swapInSharedStack();
+        data = jump_fcontext(&shared->switcher, target->context, data, false);
+    }
+}
+
+
 // 开始实现 CoroutinePrivate
 extern "C" void run_stub(intptr_t data)
 {
@@ -62,6 +158,9 @@ extern "C" void run_stub(intptr_t data)
         return;
     }
     coroutine->state = BaseCoroutine::Started;
+#ifdef QTNG_HAVE_USDT
+    traceCoroutineStarted(coroutine->q_ptr, coroutine->stack, coroutine->stackSize);
+#endif
     coroutine->q_ptr->started.callback(coroutine->q_ptr);
     try {
         coroutine->q_ptr->run();
@@ -80,24 +179,20 @@ extern "C" void run_stub(intptr_t data)
         coroutine->q_ptr->finished.callback(coroutine->q_ptr);
 //        throw; // cause undefined behaviors
     }
+    if (!coroutine->sharedStack) {
+        coroutine->stackHighWaterMark = measureCoroutineStack(coroutine->stack, coroutine->stackSize);
+    }
+    QTNG_PROBE1(coroutine_exit, coroutine->q_ptr->id());
     coroutine->cleanup();
 }
 
 
 BaseCoroutinePrivate::BaseCoroutinePrivate(BaseCoroutine *q, BaseCoroutine *previous, size_t stackSize)
-    :q_ptr(q), previous(previous), exception(nullptr), context(nullptr), stackSize(stackSize), stack(nullptr),
-      state(BaseCoroutine::Initialized), bad(false)
+    :q_ptr(q), previous(previous), exception(nullptr), context(nullptr), stackSize(stackSize), stackHighWaterMark(0), stack(nullptr),
+      sharedStack(nullptr), state(BaseCoroutine::Initialized), priority(BaseCoroutine::NormalPriority), bad(false)
 {
     if(stackSize) {
-#ifdef Q_OS_UNIX
-#ifdef MAP_GROWSDOWN
-        stack = mmap(nullptr, this->stackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_GROWSDOWN, -1, 0);
-#else
-        stack = mmap(nullptr, this->stackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-#endif
-#else
-        stack = operator new(stackSize);
-#endif
+        stack = allocateCoroutineStack(stackSize);
         if(!stack) {
             qWarning("Coroutine can not malloc new memroy.");
             bad = true;
@@ -125,11 +220,10 @@ BaseCoroutinePrivate::~BaseCoroutinePrivate()
     }
 
     if(stack) {
-#ifdef Q_OS_UNIX
-        munmap(stack, stackSize);
-#else
-        operator delete(stack);
-#endif
+        freeCoroutineStack(stack, stackSize);
+    }
+    if (sharedStack && sharedStack->owner == this) {
+        sharedStack->owner = nullptr;
     }
 }
 
@@ -150,7 +244,16 @@ bool BaseCoroutinePrivate::yield()
 
     currentCoroutine().set(q);
 
-    intptr_t result = jump_fcontext(&old->d_func()->context, context, reinterpret_cast<intptr_t>(this), false);
+    intptr_t result;
+    if (sharedStack && sharedStack->owner != this && old->d_func()->sharedStack == sharedStack) {
+        // the old one runs on the stack to be swapped.
+        result = jump_fcontext(&old->d_func()->context, sharedStack->switcherContext(), reinterpret_cast<intptr_t>(this), false);
+    } else {
+        if (sharedStack) {
+            swapInSharedStack();
+        }
+        result = jump_fcontext(&old->d_func()->context, context, reinterpret_cast<intptr_t>(this), false);
+    }
     if(!result && state != BaseCoroutine::Stopped) {  // last coroutine private.
         qDebug() << "jump_fcontext() return error.";
         return false;
@@ -174,11 +277,16 @@ bool BaseCoroutinePrivate::initContext()
 {
     if(context)
         return true;
+    // made on the shared stack by swapInSharedStack().
+    if (sharedStack) {
+        return true;
+    }
     if(!stackSize) {
         qDebug() << "is the main fiber forgot to create context?";
         return true;
     }
 
+    paintCoroutineStack(stack, stackSize);
     void * stackTop = static_cast<char*>(stack) + stackSize;
     context = make_fcontext(stackTop, stackSize, run_stub);
     if(!context) {
@@ -190,6 +298,82 @@ bool BaseCoroutinePrivate::initContext()
 }
 
 
+// the caller does not run on the shared stack, or it is the owner.
+void BaseCoroutinePrivate::swapInSharedStack()
+{
+    BaseCoroutinePrivate *owner = sharedStack->owner;
+    if (owner == this) {
+        return;
+    }
+    // the frames of owner are from its saved stack pointer to the top.
+    if (owner && owner->state != BaseCoroutine::Stopped && owner->state != BaseCoroutine::Joined && owner->context) {
+        const int used = static_cast<int>(sharedStack->top() - static_cast<char*>(owner->context));
+        owner->savedStack.resize(used);
+        if (owner->savedStack.capacity() > used * 2) {
+            owner->savedStack.squeeze();
+        }
+        memcpy(owner->savedStack.data(), owner->context, static_cast<size_t>(used));
+        owner->stackHighWaterMark = qMax(owner->stackHighWaterMark, static_cast<size_t>(used));
+    }
+    sharedStack->owner = this;
+    if (!context) {
+        context = make_fcontext(sharedStack->top(), sharedStack->size, run_stub);
+    } else if (!savedStack.isEmpty()) {
+        memcpy(sharedStack->top() - savedStack.size(), savedStack.constData(), static_cast<size_t>(savedStack.size()));
+    }
+}
+
+
+bool BaseCoroutinePrivate::setSharedStack(bool shared)
+{
+    if (state != BaseCoroutine::Initialized || context || !stackSize) {
+        return false;
+    }
+    if (shared == (sharedStack != nullptr)) {
+        return true;
+    }
+    if (shared) {
+        SharedStack *s = currentSharedStack();
+        if (!s) {
+            return false;
+        }
+        if (stack) {
+            freeCoroutineStack(stack, stackSize);
+            stack = nullptr;
+        }
+        sharedStack = s;
+        bad = false;
+    } else {
+        sharedStack = nullptr;
+        stack = allocateCoroutineStack(stackSize);
+        bad = !stack;
+    }
+    return true;
+}
+
+
+bool BaseCoroutinePrivate::makeStackResident()
+{
+    if (!sharedStack || sharedStack->owner == this) {
+        return true;
+    }
+    BaseCoroutine *current = currentCoroutine().get();
+    if (current && current->d_func()->sharedStack == sharedStack) {
+        return false;
+    }
+    if (context) {
+        swapInSharedStack();
+    }
+    return true;
+}
+
+
+bool makeCoroutineStackResident(BaseCoroutine *coroutine)
+{
+    return BaseCoroutinePrivate::getPrivateHelper(coroutine)->makeStackResident();
+}
+
+
 bool BaseCoroutinePrivate::raise(CoroutineException *exception)
 {
     Q_Q(BaseCoroutine);
@@ -230,7 +414,7 @@ BaseCoroutine* createMainCoroutine()
     if(!main)
         return nullptr;
     BaseCoroutinePrivate *mainPrivate = main->d_func();
-    mainPrivate->stack = new char[1024];
+    mainPrivate->stack = allocateCoroutineStack(1024);
     mainPrivate->stackSize = 1024;
     void *stackTop = static_cast<char*>(mainPrivate->stack) + mainPrivate->stackSize;
     mainPrivate->context = make_fcontext(stackTop, mainPrivate->stackSize, nullptr);
@@ -243,11 +427,17 @@ BaseCoroutine* createMainCoroutine()
 BaseCoroutine::BaseCoroutine(BaseCoroutine * previous, size_t stackSize)
     :dd_ptr(new BaseCoroutinePrivate(this, previous, stackSize))
 {
-
+#ifdef QTNG_COROUTINE_INTROSPECTION
+    registerCoroutine(this);
+#endif
+    QTNG_PROBE2(coroutine_spawn, id(), stackSize);
 }
 
 BaseCoroutine::~BaseCoroutine()
 {
+#ifdef QTNG_COROUTINE_INTROSPECTION
+    unregisterCoroutine(this);
+#endif
     delete dd_ptr;
 }
 
@@ -259,6 +449,34 @@ BaseCoroutine::State BaseCoroutine::state() const
 }
 
 
+bool BaseCoroutine::setSharedStack(bool shared)
+{
+    Q_D(BaseCoroutine);
+    return d->setSharedStack(shared);
+}
+
+
+bool BaseCoroutine::isSharedStack() const
+{
+    Q_D(const BaseCoroutine);
+    return d->sharedStack != nullptr;
+}
+
+
+BaseCoroutine::Priority BaseCoroutine::priority() const
+{
+    Q_D(const BaseCoroutine);
+    return d->priority;
+}
+
+
+void BaseCoroutine::setPriority(BaseCoroutine::Priority priority)
+{
+    Q_D(BaseCoroutine);
+    d->priority = priority;
+}
+
+
 void BaseCoroutine::setState(BaseCoroutine::State state)
 {
     Q_D(BaseCoroutine);
@@ -301,4 +519,41 @@ void BaseCoroutine::setPrevious(BaseCoroutine *previous)
     d->previous = previous;
 }
 
+
+size_t BaseCoroutine::stackSize() const
+{
+    Q_D(const BaseCoroutine);
+    return d->stackSize;
+}
+
+
+size_t BaseCoroutine::stackUsage() const
+{
+    Q_D(const BaseCoroutine);
+    return d->stackHighWaterMark;
+}
+
+
+void *BaseCoroutine::localData(int slot) const
+{
+    Q_D(const BaseCoroutine);
+    return d->locals.get(slot);
+}
+
+
+void BaseCoroutine::setLocalData(int slot, void *data)
+{
+    Q_D(BaseCoroutine);
+    d->locals.set(slot, data);
+}
+
+
+void BaseCoroutine::inheritLocalData(const BaseCoroutine *parent)
+{
+    Q_D(BaseCoroutine);
+    if (parent && parent != this) {
+        d->locals.inherit(parent->dd_ptr->locals);
+    }
+}
+
 QTNETWORKNG_NAMESPACE_END
@@ -1,10 +1,10 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <ucontext.h>
-#include <sys/mman.h>
 #include <QtCore/qdebug.h>
 #include <QtCore/qlist.h>
-#include "../include/coroutine_p.h"
+#include "../include/private/coroutine_p.h"
+#include "../include/private/tracing_p.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
@@ -22,15 +22,19 @@ private:
     BaseCoroutine * const q_ptr;
     BaseCoroutine * previous;
     size_t stackSize;
+    size_t stackHighWaterMark;
     void *stack;
     enum BaseCoroutine::State state;
+    BaseCoroutine::Priority priority;
     bool bad;
     CoroutineException *exception;
     ucontext_t *context;
+    CoroutineLocalSlots locals;
     Q_DECLARE_PUBLIC(BaseCoroutine)
 private:
     static void run_stub(BaseCoroutinePrivate *coroutine);
-    void cleanup() { q_ptr->cleanup(); }
+    // the values are destroyed in this coroutine, before switching out forever.
+    void cleanup() { locals.clear(); q_ptr->cleanup(); }
     friend BaseCoroutine* createMainCoroutine();
 };
 
@@ -39,6 +43,9 @@ private:
 void BaseCoroutinePrivate::run_stub(BaseCoroutinePrivate *coroutine)
 {
     coroutine->state = BaseCoroutine::Started;
+#ifdef QTNG_HAVE_USDT
+    traceCoroutineStarted(coroutine->q_ptr, coroutine->stack, coroutine->stackSize);
+#endif
     coroutine->q_ptr->started.callback(coroutine->q_ptr);
     try
     {
@@ -64,17 +71,18 @@ void BaseCoroutinePrivate::run_stub(BaseCoroutinePrivate *coroutine)
         coroutine->q_ptr->finished.callback(coroutine->q_ptr);
 //        throw; // cause undefined behaviors
     }
+    coroutine->stackHighWaterMark = measureCoroutineStack(coroutine->stack, coroutine->stackSize);
+    QTNG_PROBE1(coroutine_exit, coroutine->q_ptr->id());
     coroutine->cleanup();
 }
 
 
 BaseCoroutinePrivate::BaseCoroutinePrivate(BaseCoroutine *q, BaseCoroutine *previous, size_t stackSize)
-    :q_ptr(q), previous(previous), stackSize(stackSize), stack(0), state(BaseCoroutine::Initialized),
+    :q_ptr(q), previous(previous), stackSize(stackSize), stackHighWaterMark(0), stack(0), state(BaseCoroutine::Initialized), priority(BaseCoroutine::NormalPriority),
       bad(false), exception(0), context(0)
 {
     if(stackSize) {
-//        stack = operator new(stackSize);
-        stack = mmap(NULL, this->stackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_GROWSDOWN, -1, 0);
+        stack = allocateCoroutineStack(stackSize);
         if(!stack) {
             qFatal("Coroutine can not malloc new memroy.");
             bad = true;
@@ -93,8 +101,7 @@ BaseCoroutinePrivate::~BaseCoroutinePrivate()
         qWarning() << "deleting running BaseCoroutine" << this;
     }
     if(stack) {
-//        operator delete(stack);
-        munmap(stack, stackSize);
+        freeCoroutineStack(stack, stackSize);
     }
 
     if(currentCoroutine().get() == q)
@@ -159,6 +166,7 @@ bool BaseCoroutinePrivate::initContext()
         bad = true;
         return false;
     }
+    paintCoroutineStack(stack, stackSize);
     context->uc_stack.ss_sp = stack;
     context->uc_stack.ss_size = stackSize;
     if(previous) {
@@ -228,11 +236,17 @@ BaseCoroutine* createMainCoroutine()
 BaseCoroutine::BaseCoroutine(BaseCoroutine * previous, size_t stackSize)
     :d_ptr(new BaseCoroutinePrivate(this, previous, stackSize))
 {
-
+#ifdef QTNG_COROUTINE_INTROSPECTION
+    registerCoroutine(this);
+#endif
+    QTNG_PROBE2(coroutine_spawn, id(), stackSize);
 }
 
 BaseCoroutine::~BaseCoroutine()
 {
+#ifdef QTNG_COROUTINE_INTROSPECTION
+    unregisterCoroutine(this);
+#endif
     delete d_ptr;
 }
 
@@ -243,6 +257,38 @@ BaseCoroutine::State BaseCoroutine::state() const
     return d->state;
 }
 
+
+bool BaseCoroutine::setSharedStack(bool shared)
+{
+    return !shared;
+}
+
+
+bool BaseCoroutine::isSharedStack() const
+{
+    return false;
+}
+
+
+bool makeCoroutineStackResident(BaseCoroutine *)
+{
+    return true;
+}
+
+
+BaseCoroutine::Priority BaseCoroutine::priority() const
+{
+    Q_D(const BaseCoroutine);
+    return d->priority;
+}
+
+
+void BaseCoroutine::setPriority(BaseCoroutine::Priority priority)
+{
+    Q_D(BaseCoroutine);
+    d->priority = priority;
+}
+
 void BaseCoroutine::setState(BaseCoroutine::State state)
 {
     Q_D(BaseCoroutine);
@@ -283,4 +329,41 @@ void BaseCoroutine::setPrevious(BaseCoroutine *previous)
     d->previous = previous;
 }
 
+
+size_t BaseCoroutine::stackSize() const
+{
+    Q_D(const BaseCoroutine);
+    return d->stackSize;
+}
+
+
+size_t BaseCoroutine::stackUsage() const
+{
+    Q_D(const BaseCoroutine);
+    return d->stackHighWaterMark;
+}
+
+
+void *BaseCoroutine::localData(int slot) const
+{
+    Q_D(const BaseCoroutine);
+    return d->locals.get(slot);
+}
+
+
+void BaseCoroutine::setLocalData(int slot, void *data)
+{
+    Q_D(BaseCoroutine);
+    d->locals.set(slot, data);
+}
+
+
+void BaseCoroutine::inheritLocalData(const BaseCoroutine *parent)
+{
+    Q_D(BaseCoroutine);
+    if (parent && parent != this) {
+        d->locals.inherit(parent->dd_ptr->locals);
+    }
+}
+
 QTNETWORKNG_NAMESPACE_END
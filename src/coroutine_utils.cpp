@@ -1,5 +1,16 @@
+#include <QtCore/qmutex.h>
+#include <QtCore/qsemaphore.h>
+#include <QtCore/qthreadpool.h>
+#include <QtCore/qthreadstorage.h>
+#include <QtCore/qdir.h>
+#ifdef Q_OS_LINUX
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
 #include "../include/coroutine_utils.h"
 #include "../include/eventloop.h"
+#include "../include/private/locks_p.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
@@ -30,6 +41,122 @@ void DeferCallThread::run()
 NewThreadCoroutine::~NewThreadCoroutine() {}
 
 
+Q_GLOBAL_STATIC(QThreadPool, workerThreadPool)
+
+
+class WorkerRunnable: public QRunnable
+{
+public:
+    WorkerRunnable(const std::function<void()> &func, const QPointer<EventLoopCoroutine> &eventLoop,
+                   const QSharedPointer<Event> &done)
+        :func(func), eventLoop(eventLoop), done(done) {}
+    virtual void run() override;
+private:
+    std::function<void()> func;
+    QPointer<EventLoopCoroutine> eventLoop;
+    QSharedPointer<Event> done;
+};
+
+
+void WorkerRunnable::run()
+{
+    func();
+    QSharedPointer<Event> done = this->done;
+    if (!eventLoop.isNull()) {
+        eventLoop->callLaterThreadSafe(0, makeFunctor([done] { done->set(); }));
+    }
+}
+
+
+void callInThreadPool(const std::function<void ()> &func)
+{
+    QSharedPointer<Event> done(new Event());
+    workerThreadPool()->start(new WorkerRunnable(func, EventLoopCoroutine::get(), done));
+    done->wait();
+}
+
+
+// threads are kept for a minute after the burst of calls.
+class BlockingThreadPool: public QThreadPool
+{
+public:
+    BlockingThreadPool()
+    {
+        setMaxThreadCount(64);
+        setExpiryTimeout(60 * 1000);
+    }
+};
+Q_GLOBAL_STATIC(BlockingThreadPool, blockingThreadPool)
+Q_GLOBAL_STATIC(QThreadStorage<Semaphore *>, blockingQueues)
+static QAtomicInt blockingLimit(1024);
+
+
+void callInThread(const std::function<void ()> &func, int priority)
+{
+    QThreadStorage<Semaphore *> *queues = blockingQueues();
+    if (!queues->hasLocalData()) {
+        queues->setLocalData(new Semaphore(blockingLimit.load()));
+    }
+    Semaphore *queue = queues->localData();
+    if (!queue->acquire()) {
+        return;
+    }
+    QSharedPointer<Event> done(new Event());
+    blockingThreadPool()->start(new WorkerRunnable(func, EventLoopCoroutine::get(), done), priority);
+    try {
+        done->wait();
+    } catch (...) {
+        queue->release();
+        throw;
+    }
+    queue->release();
+}
+
+
+QSharedPointer<Event> callInThreadAsync(const std::function<void ()> &func, int priority)
+{
+    QSharedPointer<Event> done(new Event());
+    blockingThreadPool()->start(new WorkerRunnable(func, EventLoopCoroutine::get(), done), priority);
+    return done;
+}
+
+
+void setBlockingThreadPoolSize(int count)
+{
+    blockingThreadPool()->setMaxThreadCount(qMax(1, count));
+}
+
+
+int blockingThreadPoolSize()
+{
+    return blockingThreadPool()->maxThreadCount();
+}
+
+
+void setBlockingQueueLimit(int limit)
+{
+    blockingLimit.store(qMax(1, limit));
+}
+
+
+int blockingQueueLimit()
+{
+    return blockingLimit.load();
+}
+
+
+void setThreadPoolSize(int count)
+{
+    workerThreadPool()->setMaxThreadCount(qMax(1, count));
+}
+
+
+int threadPoolSize()
+{
+    return workerThreadPool()->maxThreadCount();
+}
+
+
 CoroutineGroup::CoroutineGroup()
     :QObject()
 {
@@ -46,10 +173,11 @@ CoroutineGroup::~CoroutineGroup()
 bool CoroutineGroup::add(QSharedPointer<Coroutine> coroutine, const QString &name)
 {
     if (!name.isEmpty()) {
-        if (!get(name).isNull()) {
+        if (names.contains(name)) {
             return false;
         }
         coroutine->setObjectName(name);
+        names.insert(name, coroutine.data());
     }
     QPointer<CoroutineGroup> self(this);
     coroutine->finished.addCallback([self] (BaseCoroutine *coroutine) {
@@ -58,33 +186,37 @@ bool CoroutineGroup::add(QSharedPointer<Coroutine> coroutine, const QString &nam
         }
         self->deleteCoroutine(coroutine);
     });
-    coroutines.append(coroutine);
+    coroutines.insert(coroutine.data(), coroutine);
     return true;
 }
 
 
+void CoroutineGroup::remove(BaseCoroutine *coroutine)
+{
+    QSharedPointer<Coroutine> found = coroutines.take(coroutine);
+    if (found.isNull() || found->objectName().isEmpty()) {
+        return;
+    }
+    QHash<QString, BaseCoroutine *>::iterator itor = names.find(found->objectName());
+    if (itor != names.end() && itor.value() == coroutine) {
+        names.erase(itor);
+    }
+}
+
+
 QSharedPointer<Coroutine> CoroutineGroup::get(const QString &name)
 {
-    QListIterator<QSharedPointer<Coroutine>> itor(coroutines);
-    while (itor.hasNext()) {
-        QSharedPointer<Coroutine> coroutine = itor.next();
-        if (coroutine->objectName() == name)
-            return coroutine;
+    BaseCoroutine *coroutine = names.value(name);
+    if (!coroutine) {
+        return QSharedPointer<Coroutine>();
     }
-    return QSharedPointer<Coroutine>();
+    return coroutines.value(coroutine);
 }
 
 
 bool CoroutineGroup::has(const QString &name)
 {
-    QListIterator<QSharedPointer<Coroutine>> itor(coroutines);
-    while (itor.hasNext()) {
-        QSharedPointer<Coroutine> coroutine = itor.next();
-        if (coroutine->objectName() == name) {
-            return true;
-        }
-    }
-    return false;
+    return names.contains(name);
 }
 
 
@@ -98,7 +230,7 @@ bool CoroutineGroup::kill(const QString &name, bool join)
             found->kill();
             if(join) {
                 bool success = found->join();
-                coroutines.removeOne(found);
+                remove(found.data());
                 return success;
             }
             return true;
@@ -111,8 +243,8 @@ bool CoroutineGroup::kill(const QString &name, bool join)
 bool CoroutineGroup::killall(bool join)
 {
     bool done = false;
-    QList<QSharedPointer<Coroutine>> copy = coroutines;
-    for (QSharedPointer<Coroutine> coroutine: copy) {
+    const QList<QSharedPointer<Coroutine>> &copy = coroutines.values();
+    for (const QSharedPointer<Coroutine> &coroutine: copy) {
         if (coroutine.data() == Coroutine::current()) {
 //            qWarning() << "will not kill current coroutine while killall() is called:" << BaseCoroutine::current();
             continue;
@@ -122,13 +254,13 @@ bool CoroutineGroup::killall(bool join)
     }
 
     if (join) {
-        copy = coroutines;
-        for (QSharedPointer<Coroutine> coroutine: copy) {
+        const QList<QSharedPointer<Coroutine>> &copy = coroutines.values();
+        for (const QSharedPointer<Coroutine> &coroutine: copy) {
             if (coroutine.data() == Coroutine::current()) {
 //                qWarning("will not join current coroutine while killall() is called.");
                 continue;
             }
-            coroutines.removeOne(coroutine);
+            remove(coroutine.data());
             coroutine->join();
         }
     }
@@ -139,13 +271,13 @@ bool CoroutineGroup::killall(bool join)
 bool CoroutineGroup::joinall()
 {
     bool hasCoroutines = !coroutines.isEmpty();
-    QList<QSharedPointer<Coroutine>> copy = coroutines;
-    for (QSharedPointer<Coroutine> coroutine: copy) {
+    const QList<QSharedPointer<Coroutine>> &copy = coroutines.values();
+    for (const QSharedPointer<Coroutine> &coroutine: copy) {
         if (coroutine == Coroutine::current()) {
 //            qDebug("will not kill current coroutine while joinall() is called.");
             continue;
         }
-        coroutines.removeOne(coroutine);
+        remove(coroutine.data());
         coroutine->join();
     }
     return hasCoroutines;
@@ -165,17 +297,908 @@ void DeleteCoroutineFunctor::operator()() {}
 
 void CoroutineGroup::deleteCoroutine(BaseCoroutine *baseCoroutine)
 {
-    Coroutine *coroutine = dynamic_cast<Coroutine*>(baseCoroutine);
-    Q_ASSERT(coroutine != nullptr);
-    for (QList<QSharedPointer<Coroutine>>::iterator itor = coroutines.begin(); itor != coroutines.end(); ++itor) {
-        if (itor->data() == coroutine) {
-            DeleteCoroutineFunctor *callback = new DeleteCoroutineFunctor();
-            callback->coroutine = *itor;
-            EventLoopCoroutine::get()->callLater(0, callback);
-            coroutines.erase(itor);
+    QHash<BaseCoroutine *, QSharedPointer<Coroutine>>::const_iterator itor = coroutines.constFind(baseCoroutine);
+    if (itor == coroutines.constEnd()) {
+        return;
+    }
+    // the coroutine is finishing, it is deleted by the eventloop later.
+    DeleteCoroutineFunctor *callback = new DeleteCoroutineFunctor();
+    callback->coroutine = itor.value();
+    EventLoopCoroutine::get()->callLater(0, callback);
+    remove(baseCoroutine);
+}
+
+
+static thread_local int currentRuntimeCore = -1;
+
+
+// the threads of CoroutineScheduler and CoroutineRuntime. every thread runs its tasks as coroutines of its eventloop.
+class WorkerPool;
+class PoolWorker: public QThread
+{
+public:
+    PoolWorker(WorkerPool *pool, int index, int cpu)
+        :pool(pool), index(index), cpu(cpu), node(-1), pinned(false), eventloop(nullptr), running(0), idle(0) {}
+    virtual void run() override;
+    void pin();
+    void wakeup();
+    void dispatch();
+    bool takeTask(std::function<void()> *task);
+    void startTask(CoroutineGroup *operations, const std::function<void()> &task);
+public:
+    WorkerPool * const pool;
+    const int index;
+    const int cpu;                      // -1 if the thread is not pinned.
+    int node;
+    bool pinned;
+    QMutex mutex;
+    QList<std::function<void()>> tasks;
+    QSemaphore ready;
+    EventLoopCoroutine *eventloop;      // guarded by mutex, cleared before the eventloop is deleted.
+    QSharedPointer<Event> hasTasks;
+    QAtomicInt running;
+    QAtomicInt idle;
+};
+
+
+// the scheduler lets an idle thread steal the tasks queued to the others, the runtime pins every thread to a core
+// and keeps the tasks where they are queued.
+class WorkerPool
+{
+public:
+    enum Option {
+        NoOption = 0,
+        Stealing = 1,
+        Pinning = 2,
+    };
+    WorkerPool(const QList<int> &cpus, int options);
+    ~WorkerPool();
+    void runOn(PoolWorker *worker, const std::function<void()> &func);
+    PoolWorker *leastLoaded();
+    bool steal(PoolWorker *thief, std::function<void()> *task);
+    void stop();
+public:
+    QList<PoolWorker*> workers;
+    const int options;
+    QAtomicInteger<quint64> stolen;
+    QAtomicInt stopping;
+};
+
+
+static QList<int> allowedCpus()
+{
+    QList<int> cpus;
+#ifdef Q_OS_LINUX
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.append(cpu);
+            }
+        }
+    }
+#endif
+    if (cpus.isEmpty()) {
+        const int count = qMax(1, QThread::idealThreadCount());
+        for (int cpu = 0; cpu < count; ++cpu) {
+            cpus.append(cpu);
+        }
+    }
+    return cpus;
+}
+
+
+// the numa node of cpu is named as /sys/devices/system/cpu/cpuN/nodeM
+static int numaNodeOfCpu(int cpu)
+{
+#ifdef Q_OS_LINUX
+    const QDir dir(QStringLiteral("/sys/devices/system/cpu/cpu%1").arg(cpu));
+    const QStringList &entries = dir.entryList(QStringList() << QStringLiteral("node*"), QDir::Dirs);
+    for (const QString &entry: entries) {
+        bool ok;
+        const int node = entry.mid(4).toInt(&ok);
+        if (ok) {
+            return node;
+        }
+    }
+#else
+    Q_UNUSED(cpu);
+#endif
+    return -1;
+}
+
+
+void PoolWorker::pin()
+{
+#ifdef Q_OS_LINUX
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        // the pid zero is the calling thread.
+        pinned = sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+#ifdef SYS_set_mempolicy
+    // the pages touched by this thread are taken from its node first, and from the others if it is full.
+    if (node >= 0 && node < static_cast<int>(sizeof(unsigned long) * 8)) {
+        const unsigned long mask = 1UL << node;
+        const int MPolPreferred = 1;
+        syscall(SYS_set_mempolicy, MPolPreferred, &mask, sizeof(mask) * 8);
+    }
+#endif
+#endif
+}
+
+
+void PoolWorker::run()
+{
+    const bool pinning = pool->options & WorkerPool::Pinning;
+    if (pinning) {
+        node = numaNodeOfCpu(cpu);
+        pin();
+        currentRuntimeCore = index;
+    }
+    {
+        QMutexLocker locker(&mutex);
+        eventloop = EventLoopCoroutine::get();
+        hasTasks.reset(new Event());
+    }
+    ready.release();
+    QSharedPointer<Coroutine> dispatcher(Coroutine::spawn([this] { dispatch(); }));
+    dispatcher->join();
+    QMutexLocker locker(&mutex);
+    eventloop = nullptr;
+    tasks.clear();
+    if (pinning) {
+        currentRuntimeCore = -1;
+    }
+}
+
+
+bool PoolWorker::takeTask(std::function<void()> *task)
+{
+    QMutexLocker locker(&mutex);
+    if (tasks.isEmpty()) {
+        return false;
+    }
+    *task = tasks.takeFirst();
+    return true;
+}
+
+
+// decrease the running counter while the task returns or throws.
+struct SchedulerRunningGuard
+{
+    SchedulerRunningGuard(QAtomicInt *counter)
+        :counter(counter) {}
+    ~SchedulerRunningGuard() { counter->deref(); }
+    QAtomicInt *counter;
+};
+
+
+void PoolWorker::startTask(CoroutineGroup *operations, const std::function<void()> &task)
+{
+    QAtomicInt *counter = &running;
+    counter->ref();
+    operations->spawn([counter, task] {
+        SchedulerRunningGuard guard(counter); Q_UNUSED(guard);
+        task();
+    });
+}
+
+
+void PoolWorker::dispatch()
+{
+    const bool stealing = pool->options & WorkerPool::Stealing;
+    CoroutineGroup operations;
+    while (!pool->stopping.load()) {
+        std::function<void()> task;
+        if (takeTask(&task) || (stealing && pool->steal(this, &task))) {
+            startTask(&operations, task);
+            if (stealing) {
+                // let the new coroutine run before taking the next task, so the queue of a busy thread keeps stealable.
+                Coroutine::msleep(0);
+            }
+            continue;
+        }
+        idle.store(1);
+        hasTasks->clear();
+        // check again, the wakeup may be consumed before clear().
+        if (takeTask(&task) || (stealing && pool->steal(this, &task))) {
+            idle.store(0);
+            startTask(&operations, task);
+            continue;
+        }
+        hasTasks->wait();
+        idle.store(0);
+    }
+    operations.killall();
+}
+
+
+void PoolWorker::wakeup()
+{
+    QMutexLocker locker(&mutex);
+    if (!eventloop) {
+        return;
+    }
+    QSharedPointer<Event> hasTasks = this->hasTasks;
+    eventloop->callLaterThreadSafe(0, makeFunctor([hasTasks] {
+        hasTasks->set();
+    }));
+}
+
+
+WorkerPool::WorkerPool(const QList<int> &cpus, int options)
+    :options(options), stolen(0), stopping(0)
+{
+    for (int i = 0; i < cpus.size(); ++i) {
+        PoolWorker *worker = new PoolWorker(this, i, cpus.at(i));
+        workers.append(worker);
+        worker->start();
+    }
+    for (PoolWorker *worker: workers) {
+        worker->ready.acquire();
+    }
+}
+
+
+WorkerPool::~WorkerPool()
+{
+    stop();
+    qDeleteAll(workers);
+}
+
+
+void WorkerPool::runOn(PoolWorker *worker, const std::function<void()> &func)
+{
+    if (stopping.load()) {
+        return;
+    }
+    {
+        QMutexLocker locker(&worker->mutex);
+        worker->tasks.append(func);
+    }
+    worker->wakeup();
+    if (!(options & Stealing)) {
+        return;
+    }
+    // the worker may be stuck in a cpu-bound coroutine, give one idle thread the chance to steal it.
+    for (PoolWorker *other: workers) {
+        if (other != worker && other->idle.load()) {
+            other->wakeup();
             break;
         }
     }
 }
 
+
+PoolWorker *WorkerPool::leastLoaded()
+{
+    PoolWorker *target = nullptr;
+    int minLoad = INT_MAX;
+    for (PoolWorker *worker: workers) {
+        int load = worker->running.load();
+        {
+            QMutexLocker locker(&worker->mutex);
+            load += worker->tasks.size();
+        }
+        if (load < minLoad) {
+            minLoad = load;
+            target = worker;
+        }
+    }
+    return target;
+}
+
+
+bool WorkerPool::steal(PoolWorker *thief, std::function<void()> *task)
+{
+    PoolWorker *victim = nullptr;
+    int maxPending = 0;
+    for (PoolWorker *worker: workers) {
+        if (worker == thief) {
+            continue;
+        }
+        QMutexLocker locker(&worker->mutex);
+        if (worker->tasks.size() > maxPending) {
+            maxPending = worker->tasks.size();
+            victim = worker;
+        }
+    }
+    if (!victim) {
+        return false;
+    }
+    QMutexLocker locker(&victim->mutex);
+    if (victim->tasks.isEmpty()) {
+        return false;
+    }
+    *task = victim->tasks.takeLast();
+    stolen.ref();
+    return true;
+}
+
+
+void WorkerPool::stop()
+{
+    if (stopping.testAndSetOrdered(0, 1)) {
+        for (PoolWorker *worker: workers) {
+            worker->wakeup();
+        }
+    }
+    for (PoolWorker *worker: workers) {
+        if (worker->isRunning()) {
+            worker->wait();
+        }
+    }
+}
+
+
+static QList<int> unpinnedThreads(int threads)
+{
+    if (threads <= 0) {
+        threads = qMax(1, QThread::idealThreadCount());
+    }
+    QList<int> cpus;
+    for (int i = 0; i < threads; ++i) {
+        cpus.append(-1);
+    }
+    return cpus;
+}
+
+
+class CoroutineSchedulerPrivate: public WorkerPool
+{
+public:
+    explicit CoroutineSchedulerPrivate(int threads)
+        :WorkerPool(unpinnedThreads(threads), Stealing) {}
+    void spawn(const std::function<void()> &func)
+    {
+        if (!workers.isEmpty()) {
+            runOn(leastLoaded(), func);
+        }
+    }
+};
+
+
+CoroutineScheduler::CoroutineScheduler(int threads)
+    :d_ptr(new CoroutineSchedulerPrivate(threads))
+{
+}
+
+
+CoroutineScheduler::~CoroutineScheduler()
+{
+    delete d_ptr;
+}
+
+
+void CoroutineScheduler::spawn(const std::function<void()> &func)
+{
+    Q_D(CoroutineScheduler);
+    d->spawn(func);
+}
+
+
+// wakes up the caller of CoroutineScheduler::call() once, when the task finishes, or when the task is dropped
+// without running, by stop() or a stopping scheduler.
+struct SchedulerCallDone
+{
+    SchedulerCallDone(QSharedPointer<Event> done)
+        :done(done), eventloop(EventLoopCoroutine::get()), notified(0) {}
+    ~SchedulerCallDone() { notify(); }
+    void notify();
+    QSharedPointer<Event> done;
+    QPointer<EventLoopCoroutine> eventloop;
+    QAtomicInt notified;
+};
+
+
+void SchedulerCallDone::notify()
+{
+    if (!notified.testAndSetOrdered(0, 1) || eventloop.isNull()) {
+        return;
+    }
+    QSharedPointer<Event> done = this->done;
+    eventloop->callLaterThreadSafe(0, makeFunctor([done] { done->set(); }));
+}
+
+
+void CoroutineScheduler::call(const std::function<void ()> &func)
+{
+    Q_D(CoroutineScheduler);
+    QSharedPointer<Event> done(new Event);
+    {
+        // the copies of task are kept by the queue of workers, the last one dropped notifies the caller.
+        QSharedPointer<SchedulerCallDone> guard(new SchedulerCallDone(done));
+        d->spawn([func, guard] {
+            try {
+                func();
+            } catch (...) {
+                // stopped by CoroutineScheduler::stop(), or failed. the caller is woken up anyway.
+            }
+            guard->notify();
+        });
+    }
+    done->wait();
+}
+
+
+void CoroutineScheduler::stop()
+{
+    Q_D(CoroutineScheduler);
+    d->stop();
+}
+
+
+int CoroutineScheduler::threadCount() const
+{
+    Q_D(const CoroutineScheduler);
+    return d->workers.size();
+}
+
+
+quint32 CoroutineScheduler::pending() const
+{
+    Q_D(const CoroutineScheduler);
+    quint32 total = 0;
+    for (PoolWorker *worker: d->workers) {
+        QMutexLocker locker(&worker->mutex);
+        total += static_cast<quint32>(worker->tasks.size());
+    }
+    return total;
+}
+
+
+quint32 CoroutineScheduler::running() const
+{
+    Q_D(const CoroutineScheduler);
+    quint32 total = 0;
+    for (PoolWorker *worker: d->workers) {
+        total += static_cast<quint32>(worker->running.load());
+    }
+    return total;
+}
+
+
+quint64 CoroutineScheduler::stolen() const
+{
+    Q_D(const CoroutineScheduler);
+    return d->stolen.load();
+}
+
+
+// 开始实现 CoroutineRuntime
+
+class CoroutineRuntimePrivate: public WorkerPool
+{
+public:
+    CoroutineRuntimePrivate(const QList<int> &cpus, CoroutineRuntime::Placement placement)
+        :WorkerPool(cpus.isEmpty() ? allowedCpus() : cpus, Pinning), placement(placement), next(0) {}
+    PoolWorker *choose();
+public:
+    const CoroutineRuntime::Placement placement;
+    QAtomicInt next;
+};
+
+
+PoolWorker *CoroutineRuntimePrivate::choose()
+{
+    if (placement == CoroutineRuntime::RoundRobin) {
+        const quint32 n = static_cast<quint32>(next.fetchAndAddRelaxed(1));
+        return workers.at(static_cast<int>(n % static_cast<quint32>(workers.size())));
+    }
+    return leastLoaded();
+}
+
+
+CoroutineRuntime::CoroutineRuntime(const QList<int> &cpus, Placement placement)
+    :d_ptr(new CoroutineRuntimePrivate(cpus, placement))
+{
+}
+
+
+CoroutineRuntime::~CoroutineRuntime()
+{
+    delete d_ptr;
+}
+
+
+void CoroutineRuntime::spawn(const std::function<void()> &func)
+{
+    Q_D(CoroutineRuntime);
+    if (d->workers.isEmpty()) {
+        return;
+    }
+    d->runOn(d->choose(), func);
+}
+
+
+void CoroutineRuntime::runOn(int coreIndex, const std::function<void()> &func)
+{
+    Q_D(CoroutineRuntime);
+    if (coreIndex < 0 || coreIndex >= d->workers.size()) {
+        return;
+    }
+    d->runOn(d->workers.at(coreIndex), func);
+}
+
+
+void CoroutineRuntime::call(int coreIndex, const std::function<void()> &func)
+{
+    Q_D(CoroutineRuntime);
+    if (coreIndex < 0 || coreIndex >= d->workers.size()) {
+        return;
+    }
+    QSharedPointer<Event> done(new Event);
+    {
+        QSharedPointer<SchedulerCallDone> guard(new SchedulerCallDone(done));
+        d->runOn(d->workers.at(coreIndex), [func, guard] {
+            try {
+                func();
+            } catch (...) {
+                // stopped by CoroutineRuntime::stop(), or failed.
+            }
+            guard->notify();
+        });
+    }
+    done->wait();
+}
+
+
+void CoroutineRuntime::stop()
+{
+    Q_D(CoroutineRuntime);
+    d->stop();
+}
+
+
+int CoroutineRuntime::coreCount() const
+{
+    Q_D(const CoroutineRuntime);
+    return d->workers.size();
+}
+
+
+QList<int> CoroutineRuntime::cpus() const
+{
+    Q_D(const CoroutineRuntime);
+    QList<int> cpus;
+    for (PoolWorker *worker: d->workers) {
+        cpus.append(worker->cpu);
+    }
+    return cpus;
+}
+
+
+int CoroutineRuntime::numaNode(int coreIndex) const
+{
+    Q_D(const CoroutineRuntime);
+    if (coreIndex < 0 || coreIndex >= d->workers.size()) {
+        return -1;
+    }
+    return d->workers.at(coreIndex)->node;
+}
+
+
+bool CoroutineRuntime::isPinned(int coreIndex) const
+{
+    Q_D(const CoroutineRuntime);
+    if (coreIndex < 0 || coreIndex >= d->workers.size()) {
+        return false;
+    }
+    return d->workers.at(coreIndex)->pinned;
+}
+
+
+quint32 CoroutineRuntime::load(int coreIndex) const
+{
+    Q_D(const CoroutineRuntime);
+    if (coreIndex < 0 || coreIndex >= d->workers.size()) {
+        return 0;
+    }
+    PoolWorker *worker = d->workers.at(coreIndex);
+    QMutexLocker locker(&worker->mutex);
+    return static_cast<quint32>(worker->tasks.size() + worker->running.load());
+}
+
+
+CoroutineRuntime::Placement CoroutineRuntime::placement() const
+{
+    Q_D(const CoroutineRuntime);
+    return d->placement;
+}
+
+
+int CoroutineRuntime::currentCoreIndex()
+{
+    return currentRuntimeCore;
+}
+
+
+void ThreadChannelWaiters::wakeUp(QSharedPointer<ThreadChannelWaiters> waiters, bool notEmpty)
+{
+    QAtomicInt &pending = notEmpty ? waiters->notEmptyPending : waiters->notFullPending;
+    if (!pending.testAndSetOrdered(0, 1)) {
+        return;
+    }
+    // the waiters recheck the channel, so one notifyAll() serves all items put before it runs.
+    waiters->eventLoop->callLaterThreadSafe(0, makeFunctor([waiters, notEmpty] {
+        if (notEmpty) {
+            waiters->notEmptyPending.storeRelease(0);
+            waiters->notEmpty.notifyAll();
+        } else {
+            waiters->notFullPending.storeRelease(0);
+            waiters->notFull.notifyAll();
+        }
+    }));
+}
+
+
+// 开始实现 Task
+
+struct TaskCallFunctor: public Functor
+{
+    explicit TaskCallFunctor(TaskPrivate *d)
+        :d(d) {}
+    virtual void operator()() override;
+    TaskPrivate * const d;  // the call is cancelled before the task is deleted.
+};
+
+
+struct TaskWatchFunctor: public Functor
+{
+    explicit TaskWatchFunctor(TaskPrivate *d)
+        :d(d) {}
+    virtual void operator()() override;
+    TaskPrivate * const d;  // the watcher is removed before the task is deleted.
+};
+
+
+struct TaskWaiterFunctor: public Functor
+{
+    explicit TaskWaiterFunctor(TaskPrivate *d)
+        :d(d) {}
+    virtual void operator()() override;
+    TaskPrivate * const d;
+};
+
+
+// keeps the finished task alive until the callbacks of current iteration returned.
+struct TaskReleaseFunctor: public Functor
+{
+    explicit TaskReleaseFunctor(const QSharedPointer<Task> &task)
+        :task(task) {}
+    virtual void operator()() override {}
+    QSharedPointer<Task> task;
+};
+
+
+class TaskPrivate
+{
+public:
+    TaskPrivate(Task *q, const Task::Step &step);
+    ~TaskPrivate();
+public:
+    void resume();
+    void schedule(quint32 msecs);
+    void watch(EventLoopCoroutine::EventType event, qintptr fd);
+    void disarm();
+    void finish();
+public:
+    Task * const q_ptr;
+    Task::Step step;
+    QSharedPointer<Task> self;
+    EventLoopCoroutine *eventLoop;
+    Event done;
+    TaskWaiterFunctor waiterCallback;
+    LockWaiter waiter;
+    qintptr watchingFd;
+    EventLoopCoroutine::EventType watchingEvent;
+    qint64 watcherId;
+    qint64 callId;
+    bool watching;
+    bool finished;
+    Q_DECLARE_PUBLIC(Task)
+};
+
+
+void TaskCallFunctor::operator()()
+{
+    d->callId = 0;
+    d->resume();
+}
+
+
+// the watcher is removed only out of its callback, so the step is called by another call.
+void TaskWatchFunctor::operator()()
+{
+    d->eventLoop->stopWatcher(d->watcherId);
+    d->watching = false;
+    d->schedule(0);
+}
+
+
+void TaskWaiterFunctor::operator()()
+{
+    d->resume();
+}
+
+
+TaskPrivate::TaskPrivate(Task *q, const Task::Step &step)
+    :q_ptr(q), step(step), eventLoop(EventLoopCoroutine::get()), waiterCallback(this), waiter(nullptr, nullptr, 1)
+    , watchingFd(-1), watchingEvent(EventLoopCoroutine::Read), watcherId(0), callId(0), watching(false), finished(false)
+{
+    waiter.callback = &waiterCallback;
+}
+
+
+TaskPrivate::~TaskPrivate()
+{
+    disarm();
+    if (watcherId) {
+        eventLoop->removeWatcher(watcherId);
+    }
+}
+
+
+void TaskPrivate::resume()
+{
+    if (finished) {
+        return;
+    }
+    bool again;
+    try {
+        again = step(q_ptr);
+    } catch (...) {
+        qWarning("Task throw a unhandled exception.");
+        again = false;
+    }
+    if (finished) {
+        return;
+    }
+    if (!again) {
+        finish();
+    } else if (!callId && !watching && !waiter.list) {
+        // nothing to wait, just runs again later.
+        schedule(0);
+    }
+}
+
+
+void TaskPrivate::schedule(quint32 msecs)
+{
+    if (callId) {
+        eventLoop->cancelCall(callId);
+    }
+    callId = eventLoop->callLater(msecs, new TaskCallFunctor(this));
+}
+
+
+void TaskPrivate::watch(EventLoopCoroutine::EventType event, qintptr fd)
+{
+    if (!watcherId || watchingFd != fd || watchingEvent != event) {
+        if (watcherId) {
+            eventLoop->removeWatcher(watcherId);
+        }
+        watcherId = eventLoop->createWatcher(event, fd, new TaskWatchFunctor(this));
+        watchingFd = fd;
+        watchingEvent = event;
+    }
+    eventLoop->startWatcher(watcherId);
+    watching = true;
+}
+
+
+void TaskPrivate::disarm()
+{
+    if (callId) {
+        eventLoop->cancelCall(callId);
+        callId = 0;
+    }
+    if (watching) {
+        eventLoop->stopWatcher(watcherId);
+        watching = false;
+    }
+    if (waiter.list) {
+        LockWaiterQueue::cancel(&waiter);
+    }
+}
+
+
+void TaskPrivate::finish()
+{
+    finished = true;
+    disarm();
+    done.set();
+    if (!self.isNull()) {
+        eventLoop->callLater(0, new TaskReleaseFunctor(self));
+        self.clear();
+    }
+}
+
+
+Task::Task(const Step &step)
+    :d_ptr(new TaskPrivate(this, step))
+{
+}
+
+
+Task::~Task()
+{
+    delete d_ptr;
+}
+
+
+QSharedPointer<Task> Task::spawn(const Step &step)
+{
+    QSharedPointer<Task> task(new Task(step));
+    task->d_ptr->self = task;
+    task->d_ptr->schedule(0);
+    return task;
+}
+
+
+void Task::waitReadable(qintptr fd)
+{
+    Q_D(Task);
+    d->disarm();
+    d->watch(EventLoopCoroutine::Read, fd);
+}
+
+
+void Task::waitWritable(qintptr fd)
+{
+    Q_D(Task);
+    d->disarm();
+    d->watch(EventLoopCoroutine::Write, fd);
+}
+
+
+void Task::msleep(quint32 msecs)
+{
+    Q_D(Task);
+    d->disarm();
+    d->schedule(msecs);
+}
+
+
+void Task::waitEvent(Event *event)
+{
+    Q_D(Task);
+    d->disarm();
+    if (event->isSet()) {
+        d->schedule(0);
+    } else {
+        event->waiters()->waitAsync(&d->waiter);
+    }
+}
+
+
+void Task::kill()
+{
+    Q_D(Task);
+    if (!d->finished) {
+        d->finish();
+    }
+}
+
+
+bool Task::isFinished() const
+{
+    Q_D(const Task);
+    return d->finished;
+}
+
+
+bool Task::join()
+{
+    Q_D(Task);
+    if (d->finished) {
+        return true;
+    }
+    return d->done.wait();
+}
+
 QTNETWORKNG_NAMESPACE_END
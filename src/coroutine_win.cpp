@@ -1,9 +1,87 @@
+#include <QtCore/qmap.h>
+#include <QtCore/qthreadstorage.h>
 #include "../include/private/coroutine_p.h"
 #include <windows.h>
 #include <winbase.h>
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
+class BaseCoroutinePrivate;
+
+// a fiber runs the coroutines one by one. the finished coroutine switches out of it for the last time, and the next
+// coroutine given the fiber resumes it there, so spawning a coroutine does not create a fiber, which costs a
+// VirtualAlloc() and the guard pages of stack.
+struct CoroutineFiber
+{
+    LPVOID fiber;
+    size_t stackSize;
+    BaseCoroutinePrivate *coroutine;
+    bool parked;    // the fiber is not started yet, or it is finished and switched out for the last time.
+};
+
+
+// the idle fibers of current thread, grouped by stack size, at most CoroutineStackPool::highWaterMark() for each.
+class CoroutineFiberPool
+{
+public:
+    ~CoroutineFiberPool();
+    CoroutineFiber *take(size_t stackSize);
+    bool put(CoroutineFiber *fiber);
+public:
+    QMap<size_t, QList<CoroutineFiber*>> fibers;
+};
+
+
+CoroutineFiberPool::~CoroutineFiberPool()
+{
+    for (const QList<CoroutineFiber*> &l: fibers) {
+        for (CoroutineFiber *fiber: l) {
+            DeleteFiber(fiber->fiber);
+            delete fiber;
+        }
+    }
+}
+
+
+CoroutineFiber *CoroutineFiberPool::take(size_t stackSize)
+{
+    QMap<size_t, QList<CoroutineFiber*>>::iterator itor = fibers.find(stackSize);
+    if (itor == fibers.end() || itor->isEmpty()) {
+        return nullptr;
+    }
+    return itor->takeLast();
+}
+
+
+bool CoroutineFiberPool::put(CoroutineFiber *fiber)
+{
+    QList<CoroutineFiber*> &l = fibers[fiber->stackSize];
+    if (static_cast<quint32>(l.size()) >= CoroutineStackPool::highWaterMark()) {
+        return false;
+    }
+    fiber->coroutine = nullptr;
+    l.append(fiber);
+    return true;
+}
+
+
+// QThreadStorage deletes the pool, and all idle fibers, while the thread exits.
+Q_GLOBAL_STATIC(QThreadStorage<CoroutineFiberPool*>, fiberPoolStorage)
+
+
+static CoroutineFiberPool *currentFiberPool()
+{
+    QThreadStorage<CoroutineFiberPool*> *storage = fiberPoolStorage();
+    if (!storage) {  // the process is exiting.
+        return nullptr;
+    }
+    if (!storage->hasLocalData()) {
+        storage->setLocalData(new CoroutineFiberPool());
+    }
+    return storage->localData();
+}
+
+
 class BaseCoroutinePrivate
 {
 public:
@@ -17,17 +95,38 @@ private:
     BaseCoroutine * const previous;
     size_t stackSize;
     enum BaseCoroutine::State state;
+    BaseCoroutine::Priority priority;
     CoroutineException *exception;
     LPVOID context;
+    CoroutineFiber *fiber;
     bool bad;
+    CoroutineLocalSlots locals;
     Q_DECLARE_PUBLIC(BaseCoroutine)
 private:
-    static void CALLBACK run_stub(BaseCoroutinePrivate *coroutine);
-    void cleanup() { q_ptr->cleanup(); }
+    static void CALLBACK fiber_main(CoroutineFiber *fiber);
+    static void run_stub(BaseCoroutinePrivate *coroutine);
+    // the values are destroyed in this coroutine, before switching out forever.
+    void cleanup() { locals.clear(); fiber->parked = true; q_ptr->cleanup(); }
     friend BaseCoroutine* createMainCoroutine();
 };
 
-void CALLBACK BaseCoroutinePrivate::run_stub(BaseCoroutinePrivate *coroutine)
+
+void CALLBACK BaseCoroutinePrivate::fiber_main(CoroutineFiber *fiber)
+{
+    while (true) {
+        BaseCoroutinePrivate *coroutine = fiber->coroutine;
+        fiber->parked = false;
+        run_stub(coroutine);
+        // run_stub() returns after the next coroutine resumes this fiber, the finished one may be deleted already.
+        if (fiber->coroutine == coroutine) {
+            // cleanup() did not switch out, returning from the fiber exits the thread as before.
+            return;
+        }
+    }
+}
+
+
+void BaseCoroutinePrivate::run_stub(BaseCoroutinePrivate *coroutine)
 {
     coroutine->state = BaseCoroutine::Started;
     coroutine->q_ptr->started.callback(coroutine->q_ptr);
@@ -53,7 +152,8 @@ void CALLBACK BaseCoroutinePrivate::run_stub(BaseCoroutinePrivate *coroutine)
 
 
 BaseCoroutinePrivate::BaseCoroutinePrivate(BaseCoroutine *q, BaseCoroutine *previous, size_t stackSize)
-    :q_ptr(q), previous(previous), stackSize(stackSize), state(BaseCoroutine::Initialized), exception(nullptr), context(nullptr),  bad(false)
+    :q_ptr(q), previous(previous), stackSize(stackSize), state(BaseCoroutine::Initialized), priority(BaseCoroutine::NormalPriority), exception(nullptr), context(nullptr)
+    , fiber(nullptr), bad(false)
 {
 
 }
@@ -70,7 +170,12 @@ BaseCoroutinePrivate::~BaseCoroutinePrivate()
         if(Q_UNLIKELY(stackSize == 0)) {
             ConvertFiberToThread();
         } else {
-            DeleteFiber(context);
+            // a fiber stopped in the middle of a coroutine can not be reused.
+            CoroutineFiberPool *pool = currentFiberPool();
+            if (!fiber->parked || !pool || !pool->put(fiber)) {
+                DeleteFiber(context);
+                delete fiber;
+            }
         }
     }
     if(exception)
@@ -82,8 +187,22 @@ bool BaseCoroutinePrivate::initContext()
     if(context)
         return true;
 
-    context = CreateFiberEx(1024*4, stackSize, 0, (PFIBER_START_ROUTINE)BaseCoroutinePrivate::run_stub, this);
+    CoroutineFiberPool *pool = currentFiberPool();
+    fiber = pool ? pool->take(stackSize) : nullptr;
+    if (fiber) {
+        fiber->coroutine = this;
+        context = fiber->fiber;
+        return true;
+    }
+    fiber = new CoroutineFiber;
+    fiber->stackSize = stackSize;
+    fiber->coroutine = this;
+    fiber->parked = true;
+    context = CreateFiberEx(1024*4, stackSize, 0, (PFIBER_START_ROUTINE)BaseCoroutinePrivate::fiber_main, fiber);
+    fiber->fiber = context;
     if(!context) {
+        delete fiber;
+        fiber = nullptr;
         DWORD error = GetLastError();
         qDebug() << QStringLiteral("can not create fiber: error is %1").arg(error);
         bad = true;
@@ -143,8 +262,14 @@ bool BaseCoroutinePrivate::yield()
         return false;
 
     currentCoroutine().set(q);
+    // the last switch of a finished coroutine. if it returns, the fiber is resumed by the next coroutine of it, and
+    // old is deleted. go back to fiber_main() without touching it.
+    const bool finishing = old->d_func()->fiber && old->d_func()->fiber->parked;
     //qDebug() << "yield from " << old << "to" << q;
     SwitchToFiber(context);
+    if (finishing) {
+        return true;
+    }
     if(currentCoroutine().get() != old) { // when coroutine finished, swapcontext auto yield to the previous.
         currentCoroutine().set(old);
     }
@@ -198,11 +323,17 @@ BaseCoroutine* createMainCoroutine()
 BaseCoroutine::BaseCoroutine(BaseCoroutine *previous, size_t stackSize)
     :dd_ptr(new BaseCoroutinePrivate(this, previous, stackSize))
 {
+#ifdef QTNG_COROUTINE_INTROSPECTION
+    registerCoroutine(this);
+#endif
 }
 
 
 BaseCoroutine::~BaseCoroutine()
 {
+#ifdef QTNG_COROUTINE_INTROSPECTION
+    unregisterCoroutine(this);
+#endif
     delete dd_ptr;
 }
 
@@ -214,6 +345,38 @@ BaseCoroutine::State BaseCoroutine::state() const
 }
 
 
+bool BaseCoroutine::setSharedStack(bool shared)
+{
+    return !shared;
+}
+
+
+bool BaseCoroutine::isSharedStack() const
+{
+    return false;
+}
+
+
+bool makeCoroutineStackResident(BaseCoroutine *)
+{
+    return true;
+}
+
+
+BaseCoroutine::Priority BaseCoroutine::priority() const
+{
+    Q_D(const BaseCoroutine);
+    return d->priority;
+}
+
+
+void BaseCoroutine::setPriority(BaseCoroutine::Priority priority)
+{
+    Q_D(BaseCoroutine);
+    d->priority = priority;
+}
+
+
 bool BaseCoroutine::raise(CoroutineException *exception)
 {
     Q_D(BaseCoroutine);
@@ -250,4 +413,41 @@ BaseCoroutine *BaseCoroutine::previous() const
     return d->previous;
 }
 
+
+size_t BaseCoroutine::stackSize() const
+{
+    Q_D(const BaseCoroutine);
+    return d->stackSize;
+}
+
+
+// the stacks of fibers are managed by windows, they are not painted.
+size_t BaseCoroutine::stackUsage() const
+{
+    return 0;
+}
+
+
+void *BaseCoroutine::localData(int slot) const
+{
+    Q_D(const BaseCoroutine);
+    return d->locals.get(slot);
+}
+
+
+void BaseCoroutine::setLocalData(int slot, void *data)
+{
+    Q_D(BaseCoroutine);
+    d->locals.set(slot, data);
+}
+
+
+void BaseCoroutine::inheritLocalData(const BaseCoroutine *parent)
+{
+    Q_D(BaseCoroutine);
+    if (parent && parent != this) {
+        d->locals.inherit(parent->dd_ptr->locals);
+    }
+}
+
 QTNETWORKNG_NAMESPACE_END
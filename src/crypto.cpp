@@ -1,5 +1,6 @@
 #include <QtCore/qdebug.h>
 #include <QtCore/qatomic.h>
+#include <QtCore/qmutex.h>
 #include <QtCore/qfile.h>
 #include <QtCore/qsharedpointer.h>
 #include <openssl/ssl.h>
@@ -10,20 +11,35 @@ QTNETWORKNG_NAMESPACE_BEGIN
 struct OpenSSLLib {
     OpenSSLLib() :version(0) {}
     QAtomicInt inited;
+    QMutex lock;
     int version;
 };
 
 Q_GLOBAL_STATIC(struct OpenSSLLib, lib)
 
 
+// every entry point of crypto and ssl calls it, so a process never using them, such as the plain http clients,
+// never loads the tables of libressl. the other threads wait until the first one finishes, instead of going on
+// with the half-initialized library.
 void initOpenSSL()
 {
-    if(lib()->inited.fetchAndAddAcquire(1) > 0) {
+    OpenSSLLib *l = lib();
+    if (l->inited.loadAcquire()) {
         return;
     }
+    QMutexLocker locker(&l->lock);
+    if (l->inited.load()) {
+        return;
+    }
+#if (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER >= 0x2070000fL) \
+        || (!defined(LIBRESSL_VERSION_NUMBER) && OPENSSL_VERSION_NUMBER >= 0x10100000L)
+    OPENSSL_init_ssl(0, nullptr);
+#else
     OPENSSL_add_all_algorithms_noconf();
     SSL_library_init();
     SSL_load_error_strings();
+#endif
+    l->inited.storeRelease(1);
 }
 
 void cleanupOpenSSL()
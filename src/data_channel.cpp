@@ -1,4 +1,5 @@
 #include <QtCore/qmap.h>
+#include <QtCore/qhash.h>
 #include <QtCore/qpointer.h>
 #include <QtCore/qsharedpointer.h>
 #include <QtCore/qendian.h>
@@ -6,6 +7,14 @@
 #include "../include/locks.h"
 #include "../include/coroutine_utils.h"
 #include "../include/data_channel.h"
+#include "../include/kcp.h"
+#include "../include/metrics.h"
+#ifdef QTNG_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef QTNG_HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 //#define DEBUG_PROTOCOL
 
@@ -14,9 +23,31 @@ QTNETWORKNG_NAMESPACE_BEGIN
 const quint8 MAKE_CHANNEL_REQUEST = 1;
 const quint8 CHANNEL_MADE_REQUEST = 2;
 const quint8 DESTROY_CHANNEL_REQUEST = 3;
+// the slow down and go through requests are replaced by window update, but still obeyed.
 const quint8 SLOW_DOWN_REQUEST = 4;
 const quint8 GO_THROUGH_REQUEST = 5;
 const quint8 KEEPALIVE_REQUEST = 6;
+const quint8 WINDOW_UPDATE_REQUEST = 7;
+// the data packets of sender carry a codec byte after the compression request, which is sent in order with them.
+const quint8 COMPRESSION_REQUEST = 8;
+const quint8 COMPRESSION_ACCEPTED_REQUEST = 9;
+// the packets sent by one sendallv(), up to SENDING_BATCH_BYTES.
+const quint32 SENDING_BATCH_SIZE = 256;
+const int SENDING_BATCH_BYTES = 1024 * 64;
+// the unsent bytes left in kernel, so the packets of higher priority are not queued behind a full send buffer.
+const int SENDING_NOTSENT_LOWAT = SENDING_BATCH_BYTES * 2;
+// the smaller packets are copied into one buffer with their headers, the bigger ones are sent as they are.
+const int COALESCING_PACKET_SIZE = 1024;
+// the frames read by one recv() are parsed from this buffer, only the payloads are copied out.
+const int RECEIVING_BUFFER_SIZE = 1024 * 64;
+// the bytes one channel of weight 1 sends in a round of deficit round robin.
+const qint64 SCHEDULING_QUANTUM = 1024 * 4;
+// the high bit of packet size tells more fragments of the packet follow.
+const quint32 FRAGMENTED_FLAG = 0x80000000;
+// both poles assume the peer may send so many bytes before the first window update.
+const quint32 INITIAL_WINDOW_SIZE = 1024 * 1024;
+// the smaller packets are not worth compressing.
+const int COMPRESSION_THRESHOLD = 256;
 
 
 static QByteArray packMakeChannelRequest(quint32 channelNumber)
@@ -43,25 +74,28 @@ static QByteArray packDestoryChannelRequest(quint32 channelNumber)
     return QByteArray(reinterpret_cast<char*>(buf), sizeof(buf));
 }
 
-static QByteArray packSlowDownRequest()
+static QByteArray packKeepaliveRequest()
 {
     uchar buf[sizeof(quint8)];
-    qToBigEndian(SLOW_DOWN_REQUEST, buf);
+    qToBigEndian(KEEPALIVE_REQUEST, buf);
     return QByteArray(reinterpret_cast<char*>(buf), sizeof(buf));
 }
 
-static QByteArray packGoThroughRequest()
+
+static QByteArray packWindowUpdateRequest(quint32 increment)
 {
-    uchar buf[sizeof(quint8)];
-    qToBigEndian(GO_THROUGH_REQUEST, buf);
+    uchar buf[sizeof(quint8) + sizeof(quint32)];
+    qToBigEndian(WINDOW_UPDATE_REQUEST, buf);
+    qToBigEndian(increment, buf + sizeof(quint8));
     return QByteArray(reinterpret_cast<char*>(buf), sizeof(buf));
 }
 
 
-static QByteArray packKeepaliveRequest()
+static QByteArray packCompressionRequest(quint8 command, DataChannel::CompressionCodec codec)
 {
-    uchar buf[sizeof(quint8)];
-    qToBigEndian(KEEPALIVE_REQUEST, buf);
+    uchar buf[sizeof(quint8) + sizeof(quint32)];
+    qToBigEndian(command, buf);
+    qToBigEndian(static_cast<quint32>(codec), buf + sizeof(quint8));
     return QByteArray(reinterpret_cast<char*>(buf), sizeof(buf));
 }
 
@@ -74,7 +108,9 @@ static bool unpackCommand(QByteArray data, quint8 *command, quint32 *channelNumb
 #else
         *command = qFromBigEndian<quint8>(reinterpret_cast<const uchar*>(data.constData()));
 #endif
-        if (*command != MAKE_CHANNEL_REQUEST && *command != CHANNEL_MADE_REQUEST && *command != DESTROY_CHANNEL_REQUEST) {
+        if (*command != MAKE_CHANNEL_REQUEST && *command != CHANNEL_MADE_REQUEST && *command != DESTROY_CHANNEL_REQUEST
+                && *command != WINDOW_UPDATE_REQUEST && *command != COMPRESSION_REQUEST
+                && *command != COMPRESSION_ACCEPTED_REQUEST) {
             return false;
         }
 #if QT_VERSION >= QT_VERSION_CHECK(5, 7, 0)
@@ -98,6 +134,91 @@ static bool unpackCommand(QByteArray data, quint8 *command, quint32 *channelNumb
     }
 }
 
+// a packet seen from one level of channels. the headers of outer channels are written into the headroom in front
+// of it, reserved once by the innermost channel, so the payload is not copied by every level. the received packets
+// are sliced by offset, sharing the buffer read from socket.
+class ChannelPacket
+{
+public:
+    ChannelPacket()
+        :offset(0) {}
+    ChannelPacket(const QByteArray &buffer, int offset = 0)
+        :buffer(buffer), offset(offset) {}
+    static ChannelPacket withHeadroom(const QByteArray &payload, int headroom);
+public:
+    int size() const { return buffer.size() - offset; }
+    const char *constData() const { return buffer.constData() + offset; }
+    bool isNull() const { return buffer.isNull(); }
+    ChannelPacket mid(int pos) const { return ChannelPacket(buffer, offset + pos); }
+    // the payload is copied only if there is no headroom left.
+    void prepend(const char *header, int size);
+    QByteArray toByteArray() const { return offset == 0 ? buffer : buffer.mid(offset); }
+public:
+    QByteArray buffer;
+    int offset;
+};
+
+
+ChannelPacket ChannelPacket::withHeadroom(const QByteArray &payload, int headroom)
+{
+    if (headroom <= 0) {
+        return ChannelPacket(payload);
+    }
+    QByteArray buffer(headroom + payload.size(), Qt::Uninitialized);
+    memcpy(buffer.data() + headroom, payload.constData(), static_cast<size_t>(payload.size()));
+    return ChannelPacket(buffer, headroom);
+}
+
+
+void ChannelPacket::prepend(const char *header, int size)
+{
+    if (offset >= size) {
+        offset -= size;
+        memcpy(buffer.data() + offset, header, static_cast<size_t>(size));
+    } else {
+        QByteArray data;
+        data.reserve(size + this->size());
+        data.append(header, size);
+        data.append(constData(), this->size());
+        buffer = data;
+        offset = 0;
+    }
+}
+
+
+// the compression state of one channel. a compressed packet is the codec, the size of uncompressed data
+// and the compressed data, built in the headroom of outer channels.
+class ChannelCompressor
+{
+public:
+    ChannelCompressor();
+    ~ChannelCompressor();
+public:
+    static bool isSupported(DataChannel::CompressionCodec codec);
+    void setDictionary(const QByteArray &dictionary);
+    // returns false if the packet should be sent uncompressed.
+    bool compress(const QByteArray &packet, int headroom, QByteArray *buffer);
+    bool decompress(char codec, const char *data, int size, int maxSize, QByteArray *packet);
+public:
+    DataChannel::CompressionCodec codec;            // asked by user.
+    DataChannel::CompressionCodec acceptedCodec;    // accepted by peer, the packets are not compressed until then.
+    bool sendingPrefixed;
+    bool receivingPrefixed;
+    QByteArray dictionary;
+private:
+    void record(bool saved);
+    int skipping;     // the packets left to send uncompressed.
+    int backoff;      // the packets to skip after next failure, doubled every time.
+#ifdef QTNG_HAVE_ZSTD
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+#endif
+    Q_DISABLE_COPY(ChannelCompressor)
+};
+
+
 class DataChannelPrivate
 {
 public:
@@ -117,17 +238,31 @@ public:
     // must be implemented by subclasses
     virtual void close();
     virtual bool isBroken() const = 0;
-    virtual bool sendPacketRaw(quint32 channelNumber, const QByteArray &packet) = 0;
-    virtual bool sendPacketRawAsync(quint32 channelNumber, const QByteArray &packet) = 0;
+    virtual bool sendPacketRaw(quint32 channelNumber, ChannelPacket packet) = 0;
+    virtual bool sendPacketRawAsync(quint32 channelNumber, ChannelPacket packet) = 0;
     virtual void cleanChannel(quint32 channelNumber) = 0;
-    virtual void cleanSendingPacket(quint32 subChannelNumber, std::function<bool(const QByteArray&)> subCheckPacket) = 0;
+    virtual void cleanSendingPacket(quint32 subChannelNumber, std::function<bool(const ChannelPacket&)> subCheckPacket) = 0;
     virtual quint32 headerSize() const = 0;
+    // the bytes of headers prepended to packets of this channel before they reach the socket channel.
+    virtual quint32 headroom() const = 0;
+    // only the socket channel schedules its first-level channels.
+    virtual bool setScheduling(quint32 channelNumber, int priority, quint32 weight) { Q_UNUSED(channelNumber); Q_UNUSED(priority); Q_UNUSED(weight); return false; }
+    // the commands of a virtual channel are dropped by peer until it is taken.
+    virtual bool isPending() const { return false; }
+    // the command is sent after the data packets sent before.
+    virtual bool sendCommandInOrder(const QByteArray &command) { return sendPacketRawAsync(CommandChannelNumber, command); }
 
     // called by the subclasses.
     bool handleCommand(const QByteArray &packet);
     bool handleRawPacket(const QByteArray &packet);
     void notifyChannelClose(quint32 channelNumber);
     QByteArray packPacket(quint32 channelNumber, const QByteArray &packet);
+    void putReceivingPacket(const ChannelPacket &packet);
+    // grants the peer more credits if half of receiving window is free.
+    void updateReceivingWindow();
+    ChannelPacket makeDataPacket(const QByteArray &packet);
+    bool setCompressionCodec(DataChannel::CompressionCodec codec);
+    void requestCompression();
 
     QString name;
     DataChannelPole pole;
@@ -135,9 +270,18 @@ public:
     quint32 maxPacketSize;
     quint32 payloadSizeHint;
     Queue<quint32> pendingChannels;
-    QMap<quint32, QWeakPointer<VirtualChannel>> subChannels;
+    // looked up once for every packet dispatched to sub channels.
+    QHash<quint32, QWeakPointer<VirtualChannel>> subChannels;
     Queue<QByteArray> receivingQueue;
     Gate goThrough;
+    // credit-based flow control as HTTP/2 does. the sender waits for credits before sendPacket(), and the
+    // receiver grants them after recvPacket() takes packets, so receivingQueue is bounded by bytes.
+    qint64 sendingWindow;
+    Gate sendingWindowOpened;
+    quint32 receivingWindow;
+    qint64 receivingCredit;     // the bytes peer may send yet.
+    qint64 receivingBytes;      // the bytes in receivingQueue.
+    ChannelCompressor compressor;
 
     Q_DECLARE_PUBLIC(DataChannel)
     DataChannel * const q_ptr;
@@ -150,19 +294,202 @@ class WritingPacket
 {
 public:
     WritingPacket()
-        :channelNumber(0) {}
-    WritingPacket(quint32 channelNumber, const QByteArray &packet, QSharedPointer<ValueEvent<bool>> done)
-        :packet(packet), done(done), channelNumber(channelNumber) {}
+        :channelNumber(0), fragmented(false), continued(false) {}
+    WritingPacket(quint32 channelNumber, const ChannelPacket &packet, QSharedPointer<ValueEvent<bool>> done)
+        :packet(packet), done(done), channelNumber(channelNumber), fragmented(false), continued(false) {}
 
-    QByteArray packet;
+    ChannelPacket packet;
     QSharedPointer<ValueEvent<bool>> done;
     quint32 channelNumber;
+    bool fragmented;    // more fragments of the same packet follow.
+    bool continued;     // not the first fragment, it has no header of sub channel.
     bool isValid()
     {
         return !(channelNumber == 0 && packet.isNull() && done.isNull());
     }
 };
 
+
+// the sending queues of the first-level channels. the channels of higher priority go first, and the
+// channels of the same priority share the bandwidth by their weights, as deficit round robin does.
+class SendingScheduler
+{
+public:
+    SendingScheduler();
+public:
+    void put(const WritingPacket &writingPacket) { put(writingPacket, writingPacket.channelNumber); }
+    // the packet goes after those in the queue of another channel.
+    void put(const WritingPacket &writingPacket, quint32 queueNumber);
+    // blocks until there is a packet, returns an empty list if the coroutine is killed.
+    QList<WritingPacket> getMany(quint32 maxPackets, int maxBytes);
+    // do not block. the other packets of the channel are kept in order.
+    QList<WritingPacket> takeIf(quint32 channelNumber, std::function<bool(const WritingPacket&)> check);
+    QList<WritingPacket> takeAll();
+    // drops the queue of a closed channel, including the fragments of a packet partly sent.
+    QList<WritingPacket> remove(quint32 channelNumber);
+    void setScheduling(quint32 channelNumber, int priority, quint32 weight);
+    bool isEmpty() const { return count == 0; }
+    quint32 size() const { return count; }
+private:
+    struct ChannelQueue
+    {
+        ChannelQueue()
+            :deficit(0), weight(1), priority(0) {}
+        QList<WritingPacket> packets;
+        qint64 deficit;
+        quint32 weight;
+        int priority;
+    };
+    ChannelQueue &queue(quint32 channelNumber);
+private:
+    QMap<quint32, ChannelQueue> queues;
+    QList<quint32> actives;     // the channels having packets, in the order of round robin.
+    Event notEmpty;
+    quint32 count;
+};
+
+
+SendingScheduler::SendingScheduler()
+    :count(0)
+{
+    notEmpty.clear();
+    // the commands, such as keepalive and slow down, are not blocked by the bulk data.
+    setScheduling(CommandChannelNumber, 1, 1);
+}
+
+
+SendingScheduler::ChannelQueue &SendingScheduler::queue(quint32 channelNumber)
+{
+    return queues[channelNumber];
+}
+
+
+void SendingScheduler::put(const WritingPacket &writingPacket, quint32 queueNumber)
+{
+    ChannelQueue &q = queue(queueNumber);
+    if (q.packets.isEmpty()) {
+        actives.append(queueNumber);
+    }
+    q.packets.append(writingPacket);
+    ++count;
+    notEmpty.set();
+}
+
+
+QList<WritingPacket> SendingScheduler::getMany(quint32 maxPackets, int maxBytes)
+{
+    QList<WritingPacket> result;
+    while (count == 0) {
+        if (!notEmpty.wait()) {
+            return result;
+        }
+    }
+    int bytes = 0;
+    while (count > 0 && static_cast<quint32>(result.size()) < maxPackets && bytes < maxBytes) {
+        int top = queue(actives.first()).priority;
+        for (quint32 channelNumber: actives) {
+            top = qMax(top, queue(channelNumber).priority);
+        }
+        // one round among the channels of top priority.
+        const int n = actives.size();
+        for (int i = 0; i < n && static_cast<quint32>(result.size()) < maxPackets && bytes < maxBytes; ++i) {
+            quint32 channelNumber = actives.takeFirst();
+            ChannelQueue &q = queue(channelNumber);
+            if (q.priority != top) {
+                actives.append(channelNumber);
+                continue;
+            }
+            q.deficit += SCHEDULING_QUANTUM * q.weight;
+            while (!q.packets.isEmpty() && q.packets.first().packet.size() <= q.deficit
+                   && static_cast<quint32>(result.size()) < maxPackets && bytes < maxBytes) {
+                const WritingPacket &writingPacket = q.packets.takeFirst();
+                q.deficit -= writingPacket.packet.size();
+                bytes += writingPacket.packet.size();
+                result.append(writingPacket);
+                --count;
+            }
+            if (q.packets.isEmpty()) {
+                q.deficit = 0;
+            } else {
+                actives.append(channelNumber);
+            }
+        }
+    }
+    if (count == 0) {
+        notEmpty.clear();
+    }
+    return result;
+}
+
+
+QList<WritingPacket> SendingScheduler::takeIf(quint32 channelNumber, std::function<bool(const WritingPacket&)> check)
+{
+    QList<WritingPacket> result;
+    if (!queues.contains(channelNumber)) {
+        return result;
+    }
+    ChannelQueue &q = queue(channelNumber);
+    QList<WritingPacket> reserved;
+    // the fragments go with the first one, those of a packet partly sent must be kept.
+    bool taking = false;
+    for (const WritingPacket &writingPacket: q.packets) {
+        if (!writingPacket.continued) {
+            taking = check(writingPacket);
+        }
+        if (taking) {
+            result.append(writingPacket);
+        } else {
+            reserved.append(writingPacket);
+        }
+    }
+    q.packets = reserved;
+    count -= static_cast<quint32>(result.size());
+    if (q.packets.isEmpty()) {
+        q.deficit = 0;
+        actives.removeAll(channelNumber);
+    }
+    if (count == 0) {
+        notEmpty.clear();
+    }
+    return result;
+}
+
+
+QList<WritingPacket> SendingScheduler::takeAll()
+{
+    QList<WritingPacket> result;
+    for (quint32 channelNumber: actives) {
+        ChannelQueue &q = queue(channelNumber);
+        result.append(q.packets);
+        q.packets.clear();
+        q.deficit = 0;
+    }
+    actives.clear();
+    count = 0;
+    notEmpty.clear();
+    return result;
+}
+
+
+QList<WritingPacket> SendingScheduler::remove(quint32 channelNumber)
+{
+    const QList<WritingPacket> result = queues.take(channelNumber).packets;
+    actives.removeAll(channelNumber);
+    count -= static_cast<quint32>(result.size());
+    if (count == 0) {
+        notEmpty.clear();
+    }
+    return result;
+}
+
+
+void SendingScheduler::setScheduling(quint32 channelNumber, int priority, quint32 weight)
+{
+    ChannelQueue &q = queue(channelNumber);
+    q.priority = priority;
+    q.weight = qMax<quint32>(weight, 1);
+}
+
 class SocketChannelPrivate: public DataChannelPrivate
 {
 public:
@@ -170,22 +497,34 @@ public:
     virtual ~SocketChannelPrivate() override;
     virtual bool isBroken() const override;
     virtual void close() override;
-    virtual bool sendPacketRaw(quint32 channelNumber, const QByteArray &packet) override;
-    virtual bool sendPacketRawAsync(quint32 channelNumber, const QByteArray &packet) override;
+    virtual bool sendPacketRaw(quint32 channelNumber, ChannelPacket packet) override;
+    virtual bool sendPacketRawAsync(quint32 channelNumber, ChannelPacket packet) override;
     virtual void cleanChannel(quint32 channelNumber) override;
-    virtual void cleanSendingPacket(quint32 subChannelNumber, std::function<bool(const QByteArray&)> subCheckPacket) override;
+    virtual void cleanSendingPacket(quint32 subChannelNumber, std::function<bool(const ChannelPacket&)> subCheckPacket) override;
     virtual quint32 headerSize() const override;
+    virtual quint32 headroom() const override;
+    virtual bool setScheduling(quint32 channelNumber, int priority, quint32 weight) override;
+    virtual bool sendCommandInOrder(const QByteArray &command) override;
+    bool sendFragments(quint32 channelNumber, ChannelPacket packet, QSharedPointer<ValueEvent<bool>> done);
     void doSend();
     void doReceive();
+    // makes sure so many bytes are buffered, reading as many as the buffer can take.
+    bool fillReceivingBuffer(int size);
     void doKeepalive();
     QHostAddress getPeerAddress();
 
     const QSharedPointer<SocketLike> connection;
-    Queue<WritingPacket> sendingQueue;
+    SendingScheduler sendingQueue;
+    QMap<quint32, QByteArray> receivingFragments;
+    QByteArray receivingBuffer;
+    int receivingBegin;
+    int receivingEnd;
     CoroutineGroup *operations;
     qint64 lastActiveTimestamp;
     qint64 lastKeepaliveTimestamp;
     qint64 keepaliveTimeout;
+    quint32 coalescingDelay;
+    quint32 fragmentSize;
 
     Q_DECLARE_PUBLIC(SocketChannel)
 };
@@ -197,13 +536,15 @@ public:
     virtual ~VirtualChannelPrivate() override;
     virtual bool isBroken() const override;
     virtual void close() override;
-    virtual bool sendPacketRaw(quint32 channelNumber, const QByteArray &packet) override;
-    virtual bool sendPacketRawAsync(quint32 channelNumber, const QByteArray &packet) override;
+    virtual bool sendPacketRaw(quint32 channelNumber, ChannelPacket packet) override;
+    virtual bool sendPacketRawAsync(quint32 channelNumber, ChannelPacket packet) override;
     virtual void cleanChannel(quint32 channelNumber) override;
-    virtual void cleanSendingPacket(quint32 subChannelNumber, std::function<bool(const QByteArray&)> subCheckPacket) override;
+    virtual void cleanSendingPacket(quint32 subChannelNumber, std::function<bool(const ChannelPacket&)> subCheckPacket) override;
     virtual quint32 headerSize() const override;
+    virtual quint32 headroom() const override;
+    virtual bool isPending() const override;
 
-    bool handleIncomingPacket(const QByteArray &packet);
+    bool handleIncomingPacket(const ChannelPacket &packet);
 
     QPointer<DataChannel> parentChannel;
     Gate notPending;
@@ -213,10 +554,205 @@ public:
 };
 
 
+ChannelCompressor::ChannelCompressor()
+    :codec(DataChannel::NoCompression), acceptedCodec(DataChannel::NoCompression), sendingPrefixed(false),
+      receivingPrefixed(false), skipping(0), backoff(1)
+#ifdef QTNG_HAVE_ZSTD
+    , cctx(nullptr), dctx(nullptr), cdict(nullptr), ddict(nullptr)
+#endif
+{
+}
+
+
+ChannelCompressor::~ChannelCompressor()
+{
+#ifdef QTNG_HAVE_ZSTD
+    ZSTD_freeCCtx(cctx);
+    ZSTD_freeDCtx(dctx);
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeDDict(ddict);
+#endif
+}
+
+
+bool ChannelCompressor::isSupported(DataChannel::CompressionCodec codec)
+{
+    switch (codec) {
+    case DataChannel::NoCompression:
+    case DataChannel::ZlibCompression:
+        return true;
+    case DataChannel::Lz4Compression:
+#ifdef QTNG_HAVE_LZ4
+        return true;
+#else
+        return false;
+#endif
+    case DataChannel::ZstdCompression:
+#ifdef QTNG_HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+
+void ChannelCompressor::setDictionary(const QByteArray &dictionary)
+{
+    this->dictionary = dictionary;
+#ifdef QTNG_HAVE_ZSTD
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeDDict(ddict);
+    cdict = nullptr;
+    ddict = nullptr;
+    if (!dictionary.isEmpty()) {
+        cdict = ZSTD_createCDict(dictionary.constData(), static_cast<size_t>(dictionary.size()), 1);
+        ddict = ZSTD_createDDict(dictionary.constData(), static_cast<size_t>(dictionary.size()));
+    }
+#endif
+}
+
+
+// the incompressible channels, such as carrying encrypted data, do not try every packet.
+void ChannelCompressor::record(bool saved)
+{
+    if (saved) {
+        backoff = 1;
+    } else {
+        skipping = backoff;
+        backoff = qMin(backoff * 2, 256);
+    }
+}
+
+
+bool ChannelCompressor::compress(const QByteArray &packet, int headroom, QByteArray *buffer)
+{
+    const int size = packet.size();
+    if (acceptedCodec == DataChannel::NoCompression || size < COMPRESSION_THRESHOLD) {
+        return false;
+    }
+    if (skipping > 0) {
+        --skipping;
+        return false;
+    }
+    const int headerSize = sizeof(quint8) + sizeof(quint32);
+    // it is worth only if an eighth is saved.
+    const int limit = size - size / 8;
+    int compressedSize = -1;
+    switch (acceptedCodec) {
+    case DataChannel::NoCompression:
+        return false;
+    case DataChannel::ZlibCompression: {
+        // qCompress() prepends the size of uncompressed data as the header does.
+        const QByteArray &compressed = qCompress(packet);
+        compressedSize = compressed.size() - static_cast<int>(sizeof(quint32));
+        if (compressedSize < limit) {
+            buffer->resize(headroom + static_cast<int>(sizeof(quint8)) + compressed.size());
+            memcpy(buffer->data() + headroom + sizeof(quint8), compressed.constData(), static_cast<size_t>(compressed.size()));
+        }
+        break;
+    }
+    case DataChannel::Lz4Compression:
+#ifdef QTNG_HAVE_LZ4
+        buffer->resize(headroom + headerSize + limit);
+        compressedSize = LZ4_compress_default(packet.constData(), buffer->data() + headroom + headerSize, size, limit);
+        if (compressedSize <= 0) {
+            compressedSize = -1;
+        }
+#endif
+        break;
+    case DataChannel::ZstdCompression:
+#ifdef QTNG_HAVE_ZSTD
+        if (!cctx) {
+            cctx = ZSTD_createCCtx();
+        }
+        buffer->resize(headroom + headerSize + limit);
+        size_t result;
+        if (cdict) {
+            result = ZSTD_compress_usingCDict(cctx, buffer->data() + headroom + headerSize, static_cast<size_t>(limit),
+                                              packet.constData(), static_cast<size_t>(size), cdict);
+        } else {
+            result = ZSTD_compressCCtx(cctx, buffer->data() + headroom + headerSize, static_cast<size_t>(limit),
+                                       packet.constData(), static_cast<size_t>(size), 1);
+        }
+        compressedSize = ZSTD_isError(result) ? -1 : static_cast<int>(result);
+#endif
+        break;
+    }
+    if (compressedSize < 0 || compressedSize >= limit) {
+        record(false);
+        return false;
+    }
+    record(true);
+    uchar *header = reinterpret_cast<uchar *>(buffer->data() + headroom);
+    header[0] = static_cast<uchar>(acceptedCodec);
+    qToBigEndian<quint32>(static_cast<quint32>(size), header + sizeof(quint8));
+    buffer->resize(headroom + headerSize + compressedSize);
+    return true;
+}
+
+
+bool ChannelCompressor::decompress(char codec, const char *data, int size, int maxSize, QByteArray *packet)
+{
+    if (size < static_cast<int>(sizeof(quint32))) {
+        return false;
+    }
+#if QT_VERSION >= QT_VERSION_CHECK(5, 7, 0)
+    const quint32 expected = qFromBigEndian<quint32>(data);
+#else
+    const quint32 expected = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(data));
+#endif
+    if (expected > static_cast<quint32>(maxSize)) {
+        return false;
+    }
+    switch (static_cast<DataChannel::CompressionCodec>(codec)) {
+    case DataChannel::ZlibCompression:
+        *packet = qUncompress(reinterpret_cast<const uchar*>(data), size);
+        return static_cast<quint32>(packet->size()) == expected;
+    case DataChannel::Lz4Compression:
+#ifdef QTNG_HAVE_LZ4
+        *packet = QByteArray(static_cast<int>(expected), Qt::Uninitialized);
+        return LZ4_decompress_safe(data + sizeof(quint32), packet->data(), size - static_cast<int>(sizeof(quint32)),
+                                   static_cast<int>(expected)) == static_cast<int>(expected);
+#else
+        qDebug() << "lz4 is not built in, packet is dropped.";
+        return false;
+#endif
+    case DataChannel::ZstdCompression: {
+#ifdef QTNG_HAVE_ZSTD
+        if (!dctx) {
+            dctx = ZSTD_createDCtx();
+        }
+        *packet = QByteArray(static_cast<int>(expected), Qt::Uninitialized);
+        size_t result;
+        if (ddict) {
+            result = ZSTD_decompress_usingDDict(dctx, packet->data(), expected, data + sizeof(quint32),
+                                                static_cast<size_t>(size) - sizeof(quint32), ddict);
+        } else {
+            result = ZSTD_decompressDCtx(dctx, packet->data(), expected, data + sizeof(quint32),
+                                         static_cast<size_t>(size) - sizeof(quint32));
+        }
+        return !ZSTD_isError(result) && result == expected;
+#else
+        qDebug() << "zstd is not built in, packet is dropped.";
+        return false;
+#endif
+    }
+    default:
+        return false;
+    }
+}
+
+
 DataChannelPrivate::DataChannelPrivate(DataChannelPole pole, DataChannel *parent)
     : pole(pole)
     , maxPacketSize(1024 * 64), payloadSizeHint(maxPacketSize - 8)
     , receivingQueue(1024)  // may consume 1024 * 1024 * 64 bytes.
+    , sendingWindow(INITIAL_WINDOW_SIZE)
+    , receivingWindow(INITIAL_WINDOW_SIZE)
+    , receivingCredit(INITIAL_WINDOW_SIZE)
+    , receivingBytes(0)
     , q_ptr(parent)
     , broken(false)
 {
@@ -260,7 +796,8 @@ void DataChannelPrivate::close()
         receivingQueue.put(QByteArray());
     }
     goThrough.open();
-    for (QMapIterator<quint32, QWeakPointer<VirtualChannel>> itor(subChannels); itor.hasNext();) {
+    sendingWindowOpened.open();
+    for (QHashIterator<quint32, QWeakPointer<VirtualChannel>> itor(subChannels); itor.hasNext();) {
         const QWeakPointer<VirtualChannel> &subChannel = itor.next().value();
         if(!subChannel.isNull()) {
             subChannel.data()->close();
@@ -337,20 +874,108 @@ QByteArray DataChannelPrivate::recvPacket()
     if (packet.isNull()) {
         return QByteArray();
     }
-    if (receivingQueue.size() == (receivingQueue.capacity() / 2)){
-        sendPacketRawAsync(CommandChannelNumber, packGoThroughRequest());
-    }
+    receivingBytes -= packet.size();
+    updateReceivingWindow();
     return packet;
 }
 
 
+ChannelPacket DataChannelPrivate::makeDataPacket(const QByteArray &packet)
+{
+    const int room = static_cast<int>(headroom());
+    if (!compressor.sendingPrefixed) {
+        return ChannelPacket::withHeadroom(packet, room);
+    }
+    QByteArray buffer;
+    if (compressor.compress(packet, room, &buffer)) {
+        return ChannelPacket(buffer, room);
+    }
+    buffer.resize(room + static_cast<int>(sizeof(quint8)) + packet.size());
+    buffer[room] = static_cast<char>(DataChannel::NoCompression);
+    memcpy(buffer.data() + room + sizeof(quint8), packet.constData(), static_cast<size_t>(packet.size()));
+    return ChannelPacket(buffer, room);
+}
+
+
+bool DataChannelPrivate::setCompressionCodec(DataChannel::CompressionCodec codec)
+{
+    if (!ChannelCompressor::isSupported(codec)) {
+        return false;
+    }
+    compressor.codec = codec;
+    compressor.acceptedCodec = DataChannel::NoCompression;
+    requestCompression();
+    return true;
+}
+
+
+// the packets are sent uncompressed until peer accepts the codec.
+void DataChannelPrivate::requestCompression()
+{
+    if (broken || isPending() || compressor.codec == DataChannel::NoCompression) {
+        return;
+    }
+    compressor.sendingPrefixed = true;
+    sendCommandInOrder(packCompressionRequest(COMPRESSION_REQUEST, compressor.codec));
+}
+
+
+void DataChannelPrivate::putReceivingPacket(const ChannelPacket &channelPacket)
+{
+    QByteArray packet;
+    if (!compressor.receivingPrefixed) {
+        packet = channelPacket.toByteArray();
+    } else if (channelPacket.size() < static_cast<int>(sizeof(quint8))) {
+        return;
+    } else if (channelPacket.constData()[0] == static_cast<char>(DataChannel::NoCompression)) {
+        packet = channelPacket.mid(sizeof(quint8)).toByteArray();
+    } else if (!compressor.decompress(channelPacket.constData()[0], channelPacket.constData() + sizeof(quint8),
+                                      channelPacket.size() - static_cast<int>(sizeof(quint8)),
+                                      static_cast<int>(maxPacketSize), &packet)) {
+#ifdef DEBUG_PROTOCOL
+        qDebug() << "invalid compressed packet is dropped.";
+#endif
+        return;
+    }
+    // the peer may overdraw the credits by sendPacketAsync(), so the packet is taken anyway.
+    receivingCredit -= packet.size();
+    receivingBytes += packet.size();
+    receivingQueue.putForcedly(packet);
+    Metrics::observe("qtng_data_channel_receiving_queue_packets", QByteArray(), receivingQueue.size(), Metrics::DepthBuckets);
+}
+
+
+void DataChannelPrivate::updateReceivingWindow()
+{
+    if (broken || isPending()) {
+        return;
+    }
+    const qint64 increment = static_cast<qint64>(receivingWindow) - receivingCredit - receivingBytes;
+    if (increment <= 0 || increment < receivingWindow / 2) {
+        return;
+    }
+    receivingCredit += increment;
+    sendPacketRawAsync(CommandChannelNumber, packWindowUpdateRequest(static_cast<quint32>(increment)));
+}
+
+
 bool DataChannelPrivate::sendPacket(const QByteArray &packet)
 {
     if (static_cast<quint32>(packet.size()) > maxPacketSize) {
         return false;
     }
     goThrough.wait();
-    return sendPacketRaw(DataChannelNumber, packet);
+    // waits for credits, a packet bigger than the rest of window is allowed to overdraw.
+    while (sendingWindow <= 0) {
+        if (!sendingWindowOpened.wait() || broken) {
+            return false;
+        }
+    }
+    sendingWindow -= packet.size();
+    if (sendingWindow <= 0) {
+        sendingWindowOpened.close();
+    }
+    return sendPacketRaw(DataChannelNumber, makeDataPacket(packet));
 }
 
 
@@ -359,7 +984,11 @@ bool DataChannelPrivate::sendPacketAsync(const QByteArray &packet)
     if (static_cast<quint32>(packet.size()) > maxPacketSize) {
         return false;
     }
-    return sendPacketRawAsync(DataChannelNumber, packet);
+    sendingWindow -= packet.size();
+    if (sendingWindow <= 0) {
+        sendingWindowOpened.close();
+    }
+    return sendPacketRawAsync(DataChannelNumber, makeDataPacket(packet));
 }
 
 
@@ -380,6 +1009,8 @@ bool DataChannelPrivate::handleCommand(const QByteArray &packet)
             QWeakPointer<VirtualChannel> channel = subChannels.value(channelNumber);
             if (!channel.isNull()) {
                 channel.data()->d_func()->notPending.open();
+                channel.data()->d_func()->updateReceivingWindow();
+                channel.data()->d_func()->requestCompression();
                 return true;
             } else {
 #ifdef DEBUG_PROTOCOL
@@ -409,6 +1040,28 @@ bool DataChannelPrivate::handleCommand(const QByteArray &packet)
         return true;
     } else if (command == KEEPALIVE_REQUEST) {
         return true;
+    } else if (command == COMPRESSION_REQUEST) {
+        // the command carries the codec in place of channel number.
+        DataChannel::CompressionCodec codec = static_cast<DataChannel::CompressionCodec>(channelNumber);
+        if (!ChannelCompressor::isSupported(codec)) {
+            codec = DataChannel::NoCompression;
+        }
+        compressor.receivingPrefixed = true;
+        sendPacketRawAsync(CommandChannelNumber, packCompressionRequest(COMPRESSION_ACCEPTED_REQUEST, codec));
+        return true;
+    } else if (command == COMPRESSION_ACCEPTED_REQUEST) {
+        const DataChannel::CompressionCodec codec = static_cast<DataChannel::CompressionCodec>(channelNumber);
+        if (codec == compressor.codec) {
+            compressor.acceptedCodec = codec;
+        }
+        return true;
+    } else if (command == WINDOW_UPDATE_REQUEST) {
+        const quint32 increment = channelNumber;
+        sendingWindow += increment;
+        if (sendingWindow > 0) {
+            sendingWindowOpened.open();
+        }
+        return true;
     } else {
         qWarning() << "unknown command.";
         return false;
@@ -426,12 +1079,13 @@ void DataChannelPrivate::notifyChannelClose(quint32 channelNumber)
 
 
 SocketChannelPrivate::SocketChannelPrivate(QSharedPointer<SocketLike> connection, DataChannelPole pole, SocketChannel *parent)
-    :DataChannelPrivate(pole, parent), connection(connection), sendingQueue(256), operations(new CoroutineGroup()),
+    :DataChannelPrivate(pole, parent), connection(connection), operations(new CoroutineGroup()),
       lastActiveTimestamp(QDateTime::currentMSecsSinceEpoch()), lastKeepaliveTimestamp(lastActiveTimestamp),
-      keepaliveTimeout(1000 * 10)
-
+      keepaliveTimeout(1000 * 10), coalescingDelay(0), fragmentSize(0),
+      receivingBuffer(RECEIVING_BUFFER_SIZE, Qt::Uninitialized), receivingBegin(0), receivingEnd(0)
 {
     connection->setOption(Socket::LowDelayOption, true);
+    connection->setOption(Socket::NotSentLowWatermarkOption, SENDING_NOTSENT_LOWAT);
     operations->spawnWithName(QStringLiteral("receiving"), [this] {
         this->doReceive();
     });
@@ -451,25 +1105,45 @@ SocketChannelPrivate::~SocketChannelPrivate()
 }
 
 
-bool SocketChannelPrivate::sendPacketRaw(quint32 channelNumber, const QByteArray &packet)
+bool SocketChannelPrivate::sendPacketRaw(quint32 channelNumber, ChannelPacket packet)
 {
     if (broken) {
         return false;
     }
     QSharedPointer<ValueEvent<bool>> done(new ValueEvent<bool>());
-    sendingQueue.put(WritingPacket(channelNumber, packet, done));
+    sendFragments(channelNumber, std::move(packet), done);
     bool success = done->wait();
     return success;
 }
 
 
-bool SocketChannelPrivate::sendPacketRawAsync(quint32 channelNumber, const QByteArray &packet)
+bool SocketChannelPrivate::sendPacketRawAsync(quint32 channelNumber, ChannelPacket packet)
 {
     if (broken) {
         return false;
     }
     QSharedPointer<ValueEvent<bool>> done;
-    sendingQueue.putForcedly(WritingPacket(channelNumber, packet, done));
+    return sendFragments(channelNumber, std::move(packet), done);
+}
+
+
+// the big packets are cut into fragments, so the packets of other channels may be sent between them.
+bool SocketChannelPrivate::sendFragments(quint32 channelNumber, ChannelPacket packet, QSharedPointer<ValueEvent<bool>> done)
+{
+    const int size = packet.size();
+    if (fragmentSize == 0 || size <= static_cast<int>(fragmentSize)) {
+        sendingQueue.put(WritingPacket(channelNumber, packet, done));
+        return true;
+    }
+    for (int pos = 0; pos < size; pos += static_cast<int>(fragmentSize)) {
+        const int len = qMin(static_cast<int>(fragmentSize), size - pos);
+        const bool last = pos + len >= size;
+        WritingPacket fragment(channelNumber, ChannelPacket(QByteArray(packet.constData() + pos, len)),
+                               last ? done : QSharedPointer<ValueEvent<bool>>());
+        fragment.fragmented = !last;
+        fragment.continued = pos > 0;
+        sendingQueue.put(fragment);
+    }
     return true;
 }
 
@@ -477,38 +1151,89 @@ bool SocketChannelPrivate::sendPacketRawAsync(quint32 channelNumber, const QByte
 void SocketChannelPrivate::doSend()
 {
     while (true) {
-        WritingPacket writingPacket;
+        QList<WritingPacket> writingPackets;
         try {
-            writingPacket = sendingQueue.get();
+            writingPackets = sendingQueue.getMany(SENDING_BATCH_SIZE, SENDING_BATCH_BYTES);
         } catch (CoroutineExitException) {
             return close();
         } catch (...) {
             return close();
         }
-        if (!writingPacket.isValid()) {
+        if (writingPackets.isEmpty()) {
             return close();
         }
-        if (broken) {
+        Metrics::observe("qtng_data_channel_sending_queue_packets", QByteArray(), writingPackets.size() + sendingQueue.size(),
+                         Metrics::DepthBuckets);
+        // like nagle, waits a moment for more packets if the batch is small.
+        if (coalescingDelay > 0 && static_cast<quint32>(writingPackets.size()) < SENDING_BATCH_SIZE) {
+            try {
+                Coroutine::msleep(coalescingDelay);
+            } catch (CoroutineExitException) {
+                return close();
+            }
+            if (!sendingQueue.isEmpty()) {
+                int bytes = 0;
+                for (const WritingPacket &writingPacket: writingPackets) {
+                    bytes += writingPacket.packet.size();
+                }
+                if (bytes < SENDING_BATCH_BYTES) {
+                    writingPackets.append(sendingQueue.getMany(SENDING_BATCH_SIZE - static_cast<quint32>(writingPackets.size()),
+                                                               SENDING_BATCH_BYTES - bytes));
+                }
+            }
+        }
+
+        // an invalid packet closes the channel after the packets before it are sent.
+        bool closing = false;
+        QList<QSharedPointer<ValueEvent<bool>>> dones;
+        QList<QByteArray> data;
+        QByteArray coalesced;
+        int dataSize = 0;
+        for (WritingPacket &writingPacket: writingPackets) {
+            if (!writingPacket.isValid()) {
+                closing = true;
+                break;
+            }
             if (!writingPacket.done.isNull()) {
-                writingPacket.done->send(false);
+                dones.append(writingPacket.done);
+            }
+            uchar header[sizeof(quint32) + sizeof(quint32)];
+            quint32 packetSize = static_cast<quint32>(writingPacket.packet.size());
+            if (writingPacket.fragmented) {
+                packetSize |= FRAGMENTED_FLAG;
+            }
+            qToBigEndian<quint32>(packetSize, header);
+            qToBigEndian<quint32>(writingPacket.channelNumber, header + sizeof(quint32));
+            coalesced.append(reinterpret_cast<char*>(header), sizeof(header));
+            // send the framed packets by one sendallv(), only the big packets are not copied.
+            if (writingPacket.packet.size() <= COALESCING_PACKET_SIZE) {
+                coalesced.append(writingPacket.packet.constData(), writingPacket.packet.size());
+            } else {
+                data.append(coalesced);
+                data.append(writingPacket.packet.toByteArray());
+                coalesced.clear();
+            }
+            dataSize += static_cast<int>(sizeof(header)) + writingPacket.packet.size();
+        }
+        if (!coalesced.isEmpty()) {
+            data.append(coalesced);
+        }
+        if (broken) {
+            for (QSharedPointer<ValueEvent<bool>> done: dones) {
+                done->send(false);
             }
             return close();
         }
-
-        uchar header[sizeof(quint32) + sizeof(quint32)];
-        qToBigEndian<quint32>(static_cast<quint32>(writingPacket.packet.size()), header);
-        qToBigEndian<quint32>(writingPacket.channelNumber, header + sizeof(quint32));
-        QByteArray data;
-        data.reserve(static_cast<int>(sizeof(header)) + writingPacket.packet.size());
-        data.append(reinterpret_cast<char*>(header), sizeof(header));
-        data.append(writingPacket.packet);
+        if (data.isEmpty()) {
+            return close();
+        }
 
         int sentBytes;
         try {
-            sentBytes = connection->sendall(data);
+            sentBytes = connection->sendallv(data);
         } catch (CoroutineExitException) {
-            if (!writingPacket.done.isNull()) {
-                writingPacket.done->send(false);
+            for (QSharedPointer<ValueEvent<bool>> done: dones) {
+                done->send(false);
             }
 #ifdef DEBUG_PROTOCOL
             qDebug() << "coroutine is killed while sending packet.";
@@ -521,17 +1246,15 @@ void SocketChannelPrivate::doSend()
             return close();
         }
 
-        if (sentBytes == data.size()) {
-            if (!writingPacket.done.isNull()) {
-                writingPacket.done->send(true);
-            }
-            lastKeepaliveTimestamp = QDateTime::currentMSecsSinceEpoch();
-        } else {
-            if (writingPacket.done.isNull()) {
-//                continue; // why do this?
-            } else {
-                writingPacket.done->send(false);
-            }
+        bool ok = sentBytes == dataSize;
+        for (QSharedPointer<ValueEvent<bool>> done: dones) {
+            done->send(ok);
+        }
+        if (!ok) {
+            return close();
+        }
+        lastKeepaliveTimestamp = QDateTime::currentMSecsSinceEpoch();
+        if (closing) {
             return close();
         }
     }
@@ -540,36 +1263,69 @@ void SocketChannelPrivate::doSend()
 
 void SocketChannelPrivate::doReceive()
 {
-    const size_t headerSize = sizeof(quint32) + sizeof(quint32);
+    const int headerSize = sizeof(quint32) + sizeof(quint32);
     quint32 packetSize;
     quint32 channelNumber;
+    bool fragmented;
     QByteArray packet;
     while (true) {
         try {
-            QByteArray header = connection->recvall(headerSize);
-            if (header.size() != headerSize) {
+            if (!fillReceivingBuffer(headerSize)) {
 #ifdef DEBUG_PROTOCOL
-                qDebug() << "data channel is disconnected:" << header.size();
+                qDebug() << "data channel is disconnected:" << (receivingEnd - receivingBegin);
 #endif
                 return close();
             }
+            const char *header = receivingBuffer.constData() + receivingBegin;
+            receivingBegin += headerSize;
 #if QT_VERSION >= QT_VERSION_CHECK(5, 7, 0)
-            packetSize = qFromBigEndian<quint32>(header.data());
-            channelNumber = qFromBigEndian<quint32>(header.data() + sizeof(quint32));
+            packetSize = qFromBigEndian<quint32>(header);
+            channelNumber = qFromBigEndian<quint32>(header + sizeof(quint32));
 #else
-            packetSize = qFromBigEndian<quint32>(reinterpret_cast<uchar*>(header.data()));
-            channelNumber = qFromBigEndian<quint32>(reinterpret_cast<uchar*>(header.data() + sizeof(quint32)));
+            packetSize = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(header));
+            channelNumber = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(header + sizeof(quint32)));
 #endif
+            fragmented = (packetSize & FRAGMENTED_FLAG) != 0;
+            packetSize &= ~FRAGMENTED_FLAG;
             if (packetSize > maxPacketSize) {
 #ifdef DEBUG_PROTOCOL
                 qDebug() << QStringLiteral("packetSize %1 is larger than %2").arg(packetSize).arg(maxPacketSize);
 #endif
                 return close();
             }
-            packet = connection->recvall(static_cast<qint32>(packetSize));
-            if (packet.size() != static_cast<int>(packetSize)) {
-                qDebug() << "invalid packet does not fit packet size = " << packetSize;
-                return close();
+            const int size = static_cast<int>(packetSize);
+            if (size <= receivingBuffer.size()) {
+                if (!fillReceivingBuffer(size)) {
+                    qDebug() << "invalid packet does not fit packet size = " << packetSize;
+                    return close();
+                }
+                packet = QByteArray(receivingBuffer.constData() + receivingBegin, size);
+                receivingBegin += size;
+            } else {
+                // the big packet is read into its own buffer after the buffered bytes.
+                const int buffered = receivingEnd - receivingBegin;
+                packet = QByteArray(size, Qt::Uninitialized);
+                memcpy(packet.data(), receivingBuffer.constData() + receivingBegin, static_cast<size_t>(buffered));
+                receivingBegin = receivingEnd = 0;
+                if (connection->recvall(packet.data() + buffered, size - buffered) != size - buffered) {
+                    qDebug() << "invalid packet does not fit packet size = " << packetSize;
+                    return close();
+                }
+            }
+            if (fragmented || receivingFragments.contains(channelNumber)) {
+                QByteArray &fragments = receivingFragments[channelNumber];
+                if (static_cast<quint32>(fragments.size()) + packetSize > maxPacketSize) {
+#ifdef DEBUG_PROTOCOL
+                    qDebug() << QStringLiteral("fragmented packet is larger than %1").arg(maxPacketSize);
+#endif
+                    return close();
+                }
+                fragments.append(packet);
+                if (fragmented) {
+                    lastActiveTimestamp = QDateTime::currentMSecsSinceEpoch();
+                    continue;
+                }
+                packet = receivingFragments.take(channelNumber);
             }
         } catch (CoroutineExitException) {
             return close();
@@ -577,34 +1333,55 @@ void SocketChannelPrivate::doReceive()
             return close();
         }
         if (channelNumber == DataChannelNumber) {
-            if (receivingQueue.size() == (receivingQueue.capacity() * 3 / 4)) {
-                sendPacketRawAsync(CommandChannelNumber, packSlowDownRequest());
-            }
-            receivingQueue.putForcedly(packet);
+            putReceivingPacket(ChannelPacket(packet));
         } else if (channelNumber == CommandChannelNumber) {
             if (!handleCommand(packet)) {
                 return close();
             }
-        } else if (subChannels.contains(channelNumber)) {
-            QWeakPointer<VirtualChannel> channel = subChannels.value(channelNumber);
-            if (channel.isNull()) {
+        } else {
+            QHash<quint32, QWeakPointer<VirtualChannel>>::iterator itor = subChannels.find(channelNumber);
+            if (itor == subChannels.end()) {
 #ifdef DEBUG_PROTOCOL
                 qDebug() << "channel is destroyed and data is abondoned: " << channelNumber;
 #endif
-                subChannels.remove(channelNumber);
-            } else {
-                channel.data()->d_func()->handleIncomingPacket(packet);
-            }
-        } else {
+            } else if (itor->isNull()) {
 #ifdef DEBUG_PROTOCOL
-            qDebug() << "channel is destroyed and data is abondoned: " << channelNumber;
+                qDebug() << "channel is destroyed and data is abondoned: " << channelNumber;
 #endif
+                subChannels.erase(itor);
+            } else {
+                itor->data()->d_func()->handleIncomingPacket(ChannelPacket(packet));
+            }
         }
         lastActiveTimestamp = QDateTime::currentMSecsSinceEpoch();
     }
 }
 
 
+bool SocketChannelPrivate::fillReceivingBuffer(int size)
+{
+    if (receivingEnd - receivingBegin >= size) {
+        return true;
+    }
+    if (receivingBegin == receivingEnd) {
+        receivingBegin = receivingEnd = 0;
+    } else if (receivingBuffer.size() - receivingBegin < size) {
+        memmove(receivingBuffer.data(), receivingBuffer.constData() + receivingBegin,
+                static_cast<size_t>(receivingEnd - receivingBegin));
+        receivingEnd -= receivingBegin;
+        receivingBegin = 0;
+    }
+    while (receivingEnd - receivingBegin < size) {
+        qint32 received = connection->recv(receivingBuffer.data() + receivingEnd, receivingBuffer.size() - receivingEnd);
+        if (received <= 0) {
+            return false;
+        }
+        receivingEnd += received;
+    }
+    return true;
+}
+
+
 void SocketChannelPrivate::doKeepalive()
 {
     while (true) {
@@ -628,8 +1405,7 @@ void SocketChannelPrivate::close()
     }
     broken = true;
     connection->close();
-    while (!sendingQueue.isEmpty()) {
-        const WritingPacket &writingPacket = sendingQueue.get();
+    for (const WritingPacket &writingPacket: sendingQueue.takeAll()) {
         if (!writingPacket.done.isNull()) {
             writingPacket.done->send(false);
         }
@@ -653,12 +1429,6 @@ bool SocketChannelPrivate::isBroken() const
 }
 
 
-bool alwayTrue(const QByteArray &packet) {
-    Q_UNUSED(packet);
-    return true;
-}
-
-
 void SocketChannelPrivate::cleanChannel(quint32 channelNumber)
 {
     int found = subChannels.remove(channelNumber);
@@ -667,26 +1437,44 @@ void SocketChannelPrivate::cleanChannel(quint32 channelNumber)
     }
 
     notifyChannelClose(channelNumber);
-    cleanSendingPacket(channelNumber, alwayTrue);
+    for (const WritingPacket &writingPacket: sendingQueue.remove(channelNumber)) {
+        if (!writingPacket.done.isNull()) {
+            writingPacket.done->send(false);
+        }
+    }
+    receivingFragments.remove(channelNumber);
 }
 
 
-void SocketChannelPrivate::cleanSendingPacket(quint32 subChannelNumber, std::function<bool (const QByteArray &)> subCheckPacket)
+void SocketChannelPrivate::cleanSendingPacket(quint32 subChannelNumber, std::function<bool (const ChannelPacket &)> subCheckPacket)
 {
-    QList<WritingPacket> reserved;
-    while (!sendingQueue.isEmpty()) {
-        const WritingPacket &writingPacket = sendingQueue.get();
-        if (writingPacket.channelNumber == subChannelNumber && subCheckPacket(writingPacket.packet)) {
-            if (!writingPacket.done.isNull()) {
-                writingPacket.done.data()->send(false);
-            }
-        } else {
-            reserved.append(writingPacket);
+    const QList<WritingPacket> &removed = sendingQueue.takeIf(subChannelNumber, [subCheckPacket] (const WritingPacket &writingPacket) {
+        return subCheckPacket(writingPacket.packet);
+    });
+    for (const WritingPacket &writingPacket: removed) {
+        if (!writingPacket.done.isNull()) {
+            writingPacket.done.data()->send(false);
         }
     }
-    for (const WritingPacket &writingPacket: reserved) {
-        sendingQueue.putForcedly(writingPacket);
+}
+
+
+// the commands are scheduled before the data packets, unless they are put into the same queue.
+bool SocketChannelPrivate::sendCommandInOrder(const QByteArray &command)
+{
+    if (isBroken()) {
+        return false;
     }
+    sendingQueue.put(WritingPacket(CommandChannelNumber, ChannelPacket(command), QSharedPointer<ValueEvent<bool>>()),
+                     DataChannelNumber);
+    return true;
+}
+
+
+bool SocketChannelPrivate::setScheduling(quint32 channelNumber, int priority, quint32 weight)
+{
+    sendingQueue.setScheduling(channelNumber, priority, weight);
+    return true;
 }
 
 
@@ -696,6 +1484,13 @@ quint32 SocketChannelPrivate::headerSize() const
 }
 
 
+// the header of socket channel is sent by sendallv() apart from the packet.
+quint32 SocketChannelPrivate::headroom() const
+{
+    return 0;
+}
+
+
 VirtualChannelPrivate::VirtualChannelPrivate(DataChannel *parentChannel, DataChannelPole pole, quint32 channelNumber, VirtualChannel *parent)
     :DataChannelPrivate(pole, parent), parentChannel(parentChannel), channelNumber(channelNumber)
 {
@@ -713,7 +1508,7 @@ VirtualChannelPrivate::~VirtualChannelPrivate()
 }
 
 
-bool VirtualChannelPrivate::sendPacketRaw(quint32 channelNumber, const QByteArray &packet)
+bool VirtualChannelPrivate::sendPacketRaw(quint32 channelNumber, ChannelPacket packet)
 {
     if (broken || parentChannel.isNull()) {
         return false;
@@ -726,15 +1521,13 @@ bool VirtualChannelPrivate::sendPacketRaw(quint32 channelNumber, const QByteArra
     }
     uchar header[sizeof(quint32)];
     qToBigEndian(channelNumber, header);
-    QByteArray data;
-    data.reserve(packet.size() + static_cast<int>(sizeof(quint32)));
-    data.append(reinterpret_cast<char*>(header), sizeof(quint32));
-    data.append(packet);
-    return getPrivateHelper(parentChannel)->sendPacketRaw(this->channelNumber, data);
+    // the packet is not shared, so the header is written into its headroom.
+    packet.prepend(reinterpret_cast<char*>(header), sizeof(quint32));
+    return getPrivateHelper(parentChannel)->sendPacketRaw(this->channelNumber, std::move(packet));
 }
 
 
-bool VirtualChannelPrivate::handleIncomingPacket(const QByteArray &packet)
+bool VirtualChannelPrivate::handleIncomingPacket(const ChannelPacket &packet)
 {
     const int headerSize = sizeof(quint32);
     if (packet.size() < headerSize) {
@@ -745,32 +1538,28 @@ bool VirtualChannelPrivate::handleIncomingPacket(const QByteArray &packet)
 #else
     quint32 channelNumber = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(packet.constData()));
 #endif
-    const QByteArray &payload = packet.mid(headerSize);
+    const ChannelPacket &payload = packet.mid(headerSize);
     if (channelNumber == DataChannelNumber) {
-        receivingQueue.putForcedly(payload);
-        if(receivingQueue.size() == (receivingQueue.capacity() * 3 / 4)) {
-            sendPacketRawAsync(CommandChannelNumber, packSlowDownRequest());
-        }
+        putReceivingPacket(payload);
         return true;
     } else if (channelNumber == CommandChannelNumber) {
-        return handleCommand(payload);
-    } else if (subChannels.contains(channelNumber)) {
-        QWeakPointer<VirtualChannel> channel = subChannels.value(channelNumber);
-        if (channel.isNull()) {
+        return handleCommand(payload.toByteArray());
+    }
+    QHash<quint32, QWeakPointer<VirtualChannel>>::iterator itor = subChannels.find(channelNumber);
+    if (itor == subChannels.end()) {
 #ifdef DEBUG_PROTOCOL
-            qDebug() << QStringLiteral("found invalid channel number %1 while handle incoming packet.").arg(channelNumber);
+        qDebug() << QStringLiteral("found unknown channel number %1 while handle incoming packet.").arg(channelNumber);
 #endif
-            subChannels.remove(channelNumber);
-            return false;
-        }
-        channel.data()->d_func()->handleIncomingPacket(payload);
-        return true;
-    } else {
+        return false;
+    } else if (itor->isNull()) {
 #ifdef DEBUG_PROTOCOL
-        qDebug() << QStringLiteral("found unknown channel number %1 while handle incoming packet.").arg(channelNumber);
+        qDebug() << QStringLiteral("found invalid channel number %1 while handle incoming packet.").arg(channelNumber);
 #endif
+        subChannels.erase(itor);
         return false;
     }
+    itor->data()->d_func()->handleIncomingPacket(payload);
+    return true;
 }
 
 
@@ -799,7 +1588,7 @@ void VirtualChannelPrivate::cleanChannel(quint32 channelNumber)
     if (found > 0) {
         notifyChannelClose(channelNumber);
     }
-    getPrivateHelper(parentChannel)->cleanSendingPacket(this->channelNumber, [channelNumber](const QByteArray &packet) -> bool{
+    getPrivateHelper(parentChannel)->cleanSendingPacket(this->channelNumber, [channelNumber](const ChannelPacket &packet) -> bool{
         const int headerSize = sizeof(quint32);
         if (packet.size() < headerSize) {
             return false;
@@ -814,11 +1603,11 @@ void VirtualChannelPrivate::cleanChannel(quint32 channelNumber)
 }
 
 
-void VirtualChannelPrivate::cleanSendingPacket(quint32 subChannelNumber, std::function<bool(const QByteArray &packet)> subCheckPacket)
+void VirtualChannelPrivate::cleanSendingPacket(quint32 subChannelNumber, std::function<bool(const ChannelPacket &packet)> subCheckPacket)
 {
     if (broken || parentChannel.isNull())
         return;
-    getPrivateHelper(parentChannel)->cleanSendingPacket(this->channelNumber, [subChannelNumber, subCheckPacket](const QByteArray &packet) {
+    getPrivateHelper(parentChannel)->cleanSendingPacket(this->channelNumber, [subChannelNumber, subCheckPacket](const ChannelPacket &packet) {
         const int headerSize = sizeof(quint32);
         if (packet.size() < headerSize) {
             return false;
@@ -842,18 +1631,20 @@ bool VirtualChannelPrivate::isBroken() const
 }
 
 
-bool VirtualChannelPrivate::sendPacketRawAsync(quint32 channelNumber, const QByteArray &packet)
+bool VirtualChannelPrivate::sendPacketRawAsync(quint32 channelNumber, ChannelPacket packet)
 {
     if (broken || parentChannel.isNull())
         return false;
     uchar header[sizeof(quint32)];
     qToBigEndian(channelNumber, header);
+    packet.prepend(reinterpret_cast<char*>(header), sizeof(header));
+    return getPrivateHelper(parentChannel)->sendPacketRawAsync(this->channelNumber, std::move(packet));
+}
+
 
-    QByteArray data;
-    data.reserve(packet.size() + static_cast<int>(sizeof(quint32)));
-    data.append(reinterpret_cast<char*>(header), sizeof(header));
-    data.append(packet);
-    return getPrivateHelper(parentChannel)->sendPacketRawAsync(this->channelNumber, data);
+bool VirtualChannelPrivate::isPending() const
+{
+    return !notPending.isOpen();
 }
 
 
@@ -863,6 +1654,15 @@ quint32 VirtualChannelPrivate::headerSize() const
 }
 
 
+quint32 VirtualChannelPrivate::headroom() const
+{
+    if (parentChannel.isNull()) {
+        return headerSize();
+    }
+    return headerSize() + const_cast<VirtualChannelPrivate*>(this)->getPrivateHelper(parentChannel)->headroom();
+}
+
+
 SocketChannel::SocketChannel(QSharedPointer<Socket> connection, DataChannelPole pole)
     :DataChannel(new SocketChannelPrivate(SocketLike::rawSocket(connection), pole, this))
 {
@@ -889,6 +1689,56 @@ SocketChannel::SocketChannel(QSharedPointer<SocketLike> connection, DataChannelP
 }
 
 
+void SocketChannel::setCoalescingDelay(quint32 msecs)
+{
+    Q_D(SocketChannel);
+    d->coalescingDelay = msecs;
+}
+
+
+quint32 SocketChannel::coalescingDelay() const
+{
+    Q_D(const SocketChannel);
+    return d->coalescingDelay;
+}
+
+
+void SocketChannel::setFragmentSize(quint32 bytes)
+{
+    Q_D(SocketChannel);
+    d->fragmentSize = bytes;
+}
+
+
+quint32 SocketChannel::fragmentSize() const
+{
+    Q_D(const SocketChannel);
+    return d->fragmentSize;
+}
+
+
+bool SocketChannel::sendDatagram(const QByteArray &datagram, quint8 channel)
+{
+    Q_D(SocketChannel);
+    const QSharedPointer<KcpSocket> kcp = convertSocketLikeToKcpSocket(d->connection);
+    if (kcp.isNull() || d->isBroken()) {
+        return false;
+    }
+    return kcp->sendDatagram(datagram, channel) == datagram.size();
+}
+
+
+QByteArray SocketChannel::recvDatagram(quint8 *channel)
+{
+    Q_D(SocketChannel);
+    const QSharedPointer<KcpSocket> kcp = convertSocketLikeToKcpSocket(d->connection);
+    if (kcp.isNull()) {
+        return QByteArray();
+    }
+    return kcp->recvDatagram(channel);
+}
+
+
 void SocketChannel::setKeepaliveTimeout(float timeout)
 {
     Q_D(SocketChannel);
@@ -1028,6 +1878,43 @@ quint32 DataChannel::capacity() const
 }
 
 
+bool DataChannel::setCompressionCodec(CompressionCodec codec)
+{
+    Q_D(DataChannel);
+    return d->setCompressionCodec(codec);
+}
+
+
+DataChannel::CompressionCodec DataChannel::compressionCodec() const
+{
+    Q_D(const DataChannel);
+    return d->compressor.codec;
+}
+
+
+void DataChannel::setCompressionDictionary(const QByteArray &dictionary)
+{
+    Q_D(DataChannel);
+    d->compressor.setDictionary(dictionary);
+}
+
+
+void DataChannel::setReceivingWindow(quint32 bytes)
+{
+    Q_D(DataChannel);
+    // a smaller window takes effect by granting less credits later.
+    d->receivingWindow = bytes;
+    d->updateReceivingWindow();
+}
+
+
+quint32 DataChannel::receivingWindow() const
+{
+    Q_D(const DataChannel);
+    return d->receivingWindow;
+}
+
+
 DataChannelPole DataChannel::pole() const
 {
     Q_D(const DataChannel);
@@ -1056,6 +1943,16 @@ quint32 VirtualChannel::channelNumber() const
 }
 
 
+bool VirtualChannel::setScheduling(int priority, quint32 weight)
+{
+    Q_D(VirtualChannel);
+    if (d->parentChannel.isNull()) {
+        return false;
+    }
+    return d->getPrivateHelper(d->parentChannel)->setScheduling(d->channelNumber, priority, weight);
+}
+
+
 namespace {
 class StreamLikeImpl: public StreamLike
 {
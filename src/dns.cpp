@@ -0,0 +1,381 @@
+#include <string.h>
+#include <limits.h>
+#include <QtCore/qfile.h>
+#include <QtCore/qurl.h>
+#include <QtCore/qtextstream.h>
+#include <QtCore/qendian.h>
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+#include <QtCore/qrandom.h>
+#endif
+#include "../include/private/dns_p.h"
+#include "../include/socket.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+// resolv.h defines MAXNS as 3, glibc ignores the others.
+const int MaxNameServers = 3;
+const quint16 DnsPort = 53;
+const quint16 DnsTypeA = 1;
+const quint16 DnsTypeAAAA = 28;
+const quint16 DnsClassIN = 1;
+const int DnsRcodeNoError = 0;
+const int DnsRcodeNameError = 3;
+
+
+static QStringList splitLine(const QString &line)
+{
+    QString data = line;
+    int comment = data.indexOf(QLatin1Char('#'));
+    if (comment >= 0) {
+        data.truncate(comment);
+    }
+    comment = data.indexOf(QLatin1Char(';'));
+    if (comment >= 0) {
+        data.truncate(comment);
+    }
+    return data.simplified().split(QLatin1Char(' '), QString::SkipEmptyParts);
+}
+
+
+DnsConfiguration DnsConfiguration::load(const QString &resolvConfPath, const QString &hostsPath)
+{
+    DnsConfiguration config;
+    QFile resolvConf(resolvConfPath);
+    if (resolvConf.open(QIODevice::ReadOnly)) {
+        QTextStream stream(&resolvConf);
+        while (!stream.atEnd()) {
+            const QStringList &parts = splitLine(stream.readLine());
+            if (parts.size() < 2) {
+                continue;
+            }
+            const QString &keyword = parts.at(0);
+            if (keyword == QLatin1String("nameserver")) {
+                QHostAddress server;
+                if (server.setAddress(parts.at(1)) && config.nameServers.size() < MaxNameServers) {
+                    config.nameServers.append(server);
+                }
+            } else if (keyword == QLatin1String("search")) {
+                config.searchDomains = parts.mid(1);
+            } else if (keyword == QLatin1String("domain")) {
+                config.searchDomains = QStringList() << parts.at(1);
+            } else if (keyword == QLatin1String("options")) {
+                for (int i = 1; i < parts.size(); ++i) {
+                    const QString &option = parts.at(i);
+                    bool ok;
+                    if (option.startsWith(QLatin1String("timeout:"))) {
+                        int secs = option.mid(8).toInt(&ok);
+                        if (ok && secs > 0) {
+                            config.timeout = qMin(secs, 30) * 1000;
+                        }
+                    } else if (option.startsWith(QLatin1String("attempts:"))) {
+                        int attempts = option.mid(9).toInt(&ok);
+                        if (ok && attempts > 0) {
+                            config.attempts = qMin(attempts, 5);
+                        }
+                    } else if (option.startsWith(QLatin1String("ndots:"))) {
+                        int ndots = option.mid(6).toInt(&ok);
+                        if (ok && ndots >= 0) {
+                            config.ndots = qMin(ndots, 15);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    QFile hosts(hostsPath);
+    if (hosts.open(QIODevice::ReadOnly)) {
+        QTextStream stream(&hosts);
+        while (!stream.atEnd()) {
+            const QStringList &parts = splitLine(stream.readLine());
+            if (parts.size() < 2) {
+                continue;
+            }
+            QHostAddress addr;
+            if (!addr.setAddress(parts.at(0))) {
+                continue;
+            }
+            for (int i = 1; i < parts.size(); ++i) {
+                const QString &name = parts.at(i).toLower();
+                if (!config.hosts.contains(name, addr)) {
+                    config.hosts.insert(name, addr);
+                }
+            }
+        }
+    }
+    return config;
+}
+
+
+DnsResolver::DnsResolver(const DnsConfiguration &config)
+    :config(config)
+{
+}
+
+
+DnsConfiguration DnsResolver::systemConfiguration()
+{
+#ifdef Q_OS_UNIX
+    static const DnsConfiguration config = DnsConfiguration::load(QStringLiteral("/etc/resolv.conf"),
+                                                                  QStringLiteral("/etc/hosts"));
+    return config;
+#else
+    return DnsConfiguration();
+#endif
+}
+
+
+static quint16 randomQueryId()
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+    return static_cast<quint16>(QRandomGenerator::system()->generate());
+#else
+    return static_cast<quint16>(qrand());
+#endif
+}
+
+
+static QByteArray makeQuery(quint16 id, const QByteArray &name, quint16 type)
+{
+    QByteArray packet;
+    packet.reserve(12 + name.size() + 2 + 4);
+    uchar header[12];
+    memset(header, 0, sizeof(header));
+    qToBigEndian<quint16>(id, header);
+    qToBigEndian<quint16>(0x0100, header + 2);  // recursion desired.
+    qToBigEndian<quint16>(1, header + 4);       // one question.
+    packet.append(reinterpret_cast<char*>(header), sizeof(header));
+    for (const QByteArray &label: name.split('.')) {
+        if (label.isEmpty()) {
+            continue;
+        }
+        if (label.size() > 63) {
+            return QByteArray();
+        }
+        packet.append(static_cast<char>(label.size()));
+        packet.append(label);
+    }
+    packet.append('\0');
+    if (packet.size() - 12 > 255) {
+        return QByteArray();
+    }
+    uchar question[4];
+    qToBigEndian<quint16>(type, question);
+    qToBigEndian<quint16>(DnsClassIN, question + 2);
+    packet.append(reinterpret_cast<char*>(question), sizeof(question));
+    return packet;
+}
+
+
+// returns the offset after the name, or -1 if the name is broken.
+static int skipName(const uchar *data, int size, int offset)
+{
+    while (offset < size) {
+        const uchar len = data[offset];
+        if (len == 0) {
+            return offset + 1;
+        } else if ((len & 0xc0) == 0xc0) {
+            return offset + 2 <= size ? offset + 2 : -1;
+        } else if (len & 0xc0) {
+            return -1;
+        }
+        offset += 1 + len;
+    }
+    return -1;
+}
+
+
+// returns the rcode of answer, or -1 if it is not the answer we are waiting for.
+static int parseAnswer(const uchar *data, int size, quint16 id, QList<QHostAddress> *addresses, quint32 *ttl)
+{
+    if (size < 12 || qFromBigEndian<quint16>(data) != id) {
+        return -1;
+    }
+    const quint16 flags = qFromBigEndian<quint16>(data + 2);
+    if (!(flags & 0x8000)) {
+        return -1;
+    }
+    const int rcode = flags & 0x000f;
+    const quint16 questions = qFromBigEndian<quint16>(data + 4);
+    const quint16 answers = qFromBigEndian<quint16>(data + 6);
+    int offset = 12;
+    for (quint16 i = 0; i < questions; ++i) {
+        offset = skipName(data, size, offset);
+        if (offset < 0 || offset + 4 > size) {
+            return -1;
+        }
+        offset += 4;
+    }
+    // the A/AAAA records following CNAME records are taken without checking their names.
+    for (quint16 i = 0; i < answers; ++i) {
+        offset = skipName(data, size, offset);
+        if (offset < 0 || offset + 10 > size) {
+            break;
+        }
+        const quint16 type = qFromBigEndian<quint16>(data + offset);
+        const quint16 klass = qFromBigEndian<quint16>(data + offset + 2);
+        const quint32 recordTtl = qFromBigEndian<quint32>(data + offset + 4);
+        const quint16 rdlength = qFromBigEndian<quint16>(data + offset + 8);
+        offset += 10;
+        if (offset + rdlength > size) {
+            break;
+        }
+        if (klass == DnsClassIN) {
+            if (type == DnsTypeA && rdlength == 4) {
+                addresses->append(QHostAddress(qFromBigEndian<quint32>(data + offset)));
+                *ttl = qMin(*ttl, recordTtl);
+            } else if (type == DnsTypeAAAA && rdlength == 16) {
+                addresses->append(QHostAddress(data + offset));
+                *ttl = qMin(*ttl, recordTtl);
+            }
+        }
+        offset += rdlength;
+    }
+    return rcode;
+}
+
+
+int DnsResolver::query(const QByteArray &name, const QHostAddress &server, QList<QHostAddress> *addresses, quint32 *ttl)
+{
+    Socket::NetworkLayerProtocol protocol;
+    if (server.protocol() == QAbstractSocket::IPv6Protocol) {
+        protocol = Socket::IPv6Protocol;
+    } else {
+        protocol = Socket::IPv4Protocol;
+    }
+    Socket socket(protocol, Socket::UdpSocket);
+    if (!socket.isValid()) {
+        return -1;
+    }
+
+    // the A and AAAA queries are sent together, like glibc does.
+    quint16 ids[2];
+    ids[0] = randomQueryId();
+    do {
+        ids[1] = randomQueryId();
+    } while (ids[1] == ids[0]);
+    const quint16 types[2] = {DnsTypeA, DnsTypeAAAA};
+    for (int i = 0; i < 2; ++i) {
+        const QByteArray &packet = makeQuery(ids[i], name, types[i]);
+        if (packet.isEmpty()) {
+            return DnsRcodeNameError;
+        }
+        if (socket.sendto(packet, server, DnsPort) != packet.size()) {
+            return -1;
+        }
+    }
+
+    bool answered[2] = {false, false};
+    int rcodes[2] = {-1, -1};
+    QList<QHostAddress> found[2];
+    try {
+        Timeout timeout(static_cast<quint32>(config.timeout), 0); Q_UNUSED(timeout);
+        QByteArray buf(1024 * 4, Qt::Uninitialized);
+        while (!answered[0] || !answered[1]) {
+            QHostAddress from;
+            quint16 port = 0;
+            qint32 len = socket.recvfrom(buf.data(), buf.size(), &from, &port);
+            if (len < 0) {
+                break;
+            }
+            if (port != DnsPort || from != server) {
+                continue;
+            }
+            const uchar *data = reinterpret_cast<const uchar*>(buf.constData());
+            for (int i = 0; i < 2; ++i) {
+                if (answered[i]) {
+                    continue;
+                }
+                QList<QHostAddress> result;
+                int rcode = parseAnswer(data, len, ids[i], &result, ttl);
+                if (rcode >= 0) {
+                    answered[i] = true;
+                    rcodes[i] = rcode;
+                    found[i] = result;
+                    break;
+                }
+            }
+        }
+    } catch (TimeoutException &) {
+        // some nameservers drop AAAA queries, take the answer of A.
+    }
+
+    if (rcodes[0] == DnsRcodeNoError || rcodes[1] == DnsRcodeNoError) {
+        addresses->append(found[0]);
+        addresses->append(found[1]);
+        return DnsRcodeNoError;
+    } else if (rcodes[0] == DnsRcodeNameError || rcodes[1] == DnsRcodeNameError) {
+        return DnsRcodeNameError;
+    } else {
+        return rcodes[0] >= 0 ? rcodes[0] : rcodes[1];
+    }
+}
+
+
+bool DnsResolver::resolve(const QString &hostName, QList<QHostAddress> *addresses, quint32 *ttl)
+{
+    quint32 minTtl = UINT_MAX;
+    if (!ttl) {
+        ttl = &minTtl;
+    }
+    *ttl = UINT_MAX;
+    QString name = hostName.toLower();
+    const bool absolute = name.endsWith(QLatin1Char('.'));
+    if (absolute) {
+        name.chop(1);
+    }
+    if (config.hosts.contains(name)) {
+        // QMultiHash returns the values inserted later first.
+        const QList<QHostAddress> &values = config.hosts.values(name);
+        for (int i = values.size() - 1; i >= 0; --i) {
+            addresses->append(values.at(i));
+        }
+        return true;
+    }
+    if (!config.isValid()) {
+        return false;
+    }
+    const QByteArray &ace = QUrl::toAce(name);
+    if (ace.isEmpty()) {
+        return true;
+    }
+
+    QList<QByteArray> candidates;
+    if (absolute || config.searchDomains.isEmpty()) {
+        candidates.append(ace);
+    } else {
+        QList<QByteArray> searched;
+        for (const QString &domain: config.searchDomains) {
+            searched.append(ace + "." + QUrl::toAce(domain));
+        }
+        if (ace.count('.') >= config.ndots) {
+            candidates.append(ace);
+            candidates.append(searched);
+        } else {
+            candidates.append(searched);
+            candidates.append(ace);
+        }
+    }
+
+    for (const QByteArray &candidate: candidates) {
+        bool nextCandidate = false;
+        for (int attempt = 0; attempt < config.attempts && !nextCandidate; ++attempt) {
+            for (const QHostAddress &server: config.nameServers) {
+                QList<QHostAddress> found;
+                int rcode = query(candidate, server, &found, ttl);
+                if (rcode == DnsRcodeNoError && !found.isEmpty()) {
+                    addresses->append(found);
+                    return true;
+                } else if (rcode == DnsRcodeNoError || rcode == DnsRcodeNameError) {
+                    // the name does not exist, or has no address.
+                    nextCandidate = true;
+                    break;
+                }
+                // SERVFAIL, REFUSED or no answer, try the next nameserver.
+            }
+        }
+    }
+    return true;
+}
+
+QTNETWORKNG_NAMESPACE_END
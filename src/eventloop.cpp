@@ -2,7 +2,11 @@
 #include <QtCore/qpointer.h>
 #include <QtCore/qcoreapplication.h>
 #include <QtCore/qthread.h>
+#include <QtCore/qalgorithms.h>
+#include <QtCore/qelapsedtimer.h>
 #include "../include/private/eventloop_p.h"
+#include "../include/private/coroutine_p.h"
+#include "../include/private/tracing_p.h"
 #include "../include/locks.h"
 #ifdef Q_OS_UNIX
 #include <signal.h>
@@ -12,6 +16,10 @@ QTNETWORKNG_NAMESPACE_BEGIN
 
 Q_GLOBAL_STATIC(CurrentLoopStorage, currentLoopStorage)
 
+// the loop of current thread without the lookup of QThreadStorage and the reference counting of QSharedPointer.
+// it is owned by the storage, and cleared by the destructor of loop.
+static thread_local EventLoopCoroutine *currentLoopCache = nullptr;
+
 CurrentLoopStorage *currentLoop()
 {
     return currentLoopStorage();
@@ -36,11 +44,119 @@ void CoroutineSpawnHelper::run() {
 Coroutine *Coroutine::spawn(std::function<void()> f)
 {
     Coroutine *c =  new CoroutineSpawnHelper(f);
+    c->inheritLocalData(BaseCoroutine::current());
+    c->setPriority(BaseCoroutine::current()->priority());
     c->start();
     return c;
 }
 
 
+// 开始写 Functor 的内存池
+
+class FunctorPool
+{
+public:
+    enum {
+        Granularity = 16,
+        Classes = 8,            // pool the blocks up to 128 bytes.
+        MaxFreeBlocks = 256,    // for each size class.
+    };
+    FunctorPool();
+    ~FunctorPool();
+    void *take(int sizeClass);
+    bool put(void *p, int sizeClass);
+    static int sizeClassOf(size_t size) { return static_cast<int>((size + Granularity - 1) / Granularity) - 1; }
+private:
+    struct Block
+    {
+        Block *next;
+    };
+    Block *freeLists[Classes];
+    quint32 counts[Classes];
+};
+
+
+FunctorPool::FunctorPool()
+{
+    for (int i = 0; i < Classes; ++i) {
+        freeLists[i] = nullptr;
+        counts[i] = 0;
+    }
+}
+
+
+FunctorPool::~FunctorPool()
+{
+    for (int i = 0; i < Classes; ++i) {
+        while (freeLists[i]) {
+            Block *next = freeLists[i]->next;
+            ::operator delete(freeLists[i]);
+            freeLists[i] = next;
+        }
+    }
+}
+
+
+void *FunctorPool::take(int sizeClass)
+{
+    Block *block = freeLists[sizeClass];
+    if (!block) {
+        return ::operator new(static_cast<size_t>(sizeClass + 1) * Granularity);
+    }
+    freeLists[sizeClass] = block->next;
+    --counts[sizeClass];
+    return block;
+}
+
+
+bool FunctorPool::put(void *p, int sizeClass)
+{
+    if (counts[sizeClass] >= MaxFreeBlocks) {
+        return false;
+    }
+    Block *block = static_cast<Block*>(p);
+    block->next = freeLists[sizeClass];
+    freeLists[sizeClass] = block;
+    ++counts[sizeClass];
+    return true;
+}
+
+
+Q_GLOBAL_STATIC(QThreadStorage<FunctorPool*>, functorPoolStorage)
+
+
+void *Functor::operator new(size_t size)
+{
+    int sizeClass = FunctorPool::sizeClassOf(size);
+    QThreadStorage<FunctorPool*> *storage = functorPoolStorage();
+    if (sizeClass >= FunctorPool::Classes || !storage) {
+        return ::operator new(size);
+    }
+    if (!storage->hasLocalData()) {
+        storage->setLocalData(new FunctorPool());
+    }
+    return storage->localData()->take(sizeClass);
+}
+
+
+void Functor::operator delete(void *p, size_t size)
+{
+    if (!p) {
+        return;
+    }
+    // functor may be deleted in another thread, or while the thread is exiting. all blocks come from
+    // ::operator new(), so just give it to the pool of current thread if there is one.
+    int sizeClass = FunctorPool::sizeClassOf(size);
+    QThreadStorage<FunctorPool*> *storage = functorPoolStorage();
+    if (sizeClass < FunctorPool::Classes && storage && storage->hasLocalData()) {
+        if (storage->localData()->put(p, sizeClass)) {
+            return;
+        }
+    }
+    ::operator delete(p);
+}
+
+
 Functor::~Functor()
 {}
 
@@ -68,14 +184,276 @@ void YieldCurrentFunctor::operator ()()
     }
 }
 
+// 开始写 EventLoopMetricsRecorder 的实现代码。
+
+EventLoopMetrics::EventLoopMetrics()
+    :iterations(0), busyNsecs(0), pollNsecs(0), longestTickNsecs(0), ioWatchers(0), timers(0),
+      pendingThreadSafeCalls(0), coroutineSwitches(0), coroutineSwitchesPerSecond(0.0)
+{
+    for (int i = 0; i < HistogramBuckets; ++i) {
+        tickHistogram[i] = 0;
+    }
+}
+
+
+EventLoopMetricsRecorder::EventLoopMetricsRecorder()
+    :slowTickThreshold(0)
+{
+    clock.start();
+    reset();
+}
+
+
+void EventLoopMetricsRecorder::reset()
+{
+    lastMark = resetMark = clock.nsecsElapsed();
+    switchesAtReset = currentCoroutine().switchCount();
+    iterations = 0;
+    busyNsecs = 0;
+    pollNsecs = 0;
+    longestTickNsecs = 0;
+    for (int i = 0; i < EventLoopMetrics::HistogramBuckets; ++i) {
+        tickHistogram[i] = 0;
+    }
+}
+
+
+void EventLoopMetricsRecorder::beforePoll()
+{
+    qint64 now = clock.nsecsElapsed();
+    qint64 tick = now - lastMark;
+    lastMark = now;
+    QTNG_PROBE1(loop_poll, tick);
+    ++iterations;
+    busyNsecs += tick;
+    if (tick > longestTickNsecs) {
+        longestTickNsecs = tick;
+    }
+    quint64 usecs = static_cast<quint64>(tick / 1000);
+    int bucket = usecs ? 64 - static_cast<int>(qCountLeadingZeroBits(usecs)) : 0;
+    ++tickHistogram[qMin<int>(bucket, EventLoopMetrics::HistogramBuckets - 1)];
+    if (slowTickThreshold > 0 && tick >= slowTickThreshold && slowTickCallback) {
+        slowTickCallback(tick);
+        // do not count the callback itself as busy time of next iteration.
+        lastMark = clock.nsecsElapsed();
+    }
+}
+
+
+void EventLoopMetricsRecorder::afterPoll()
+{
+    qint64 now = clock.nsecsElapsed();
+    QTNG_PROBE1(loop_wake, now - lastMark);
+    pollNsecs += now - lastMark;
+    lastMark = now;
+}
+
+
+void EventLoopMetricsRecorder::fill(EventLoopMetrics *metrics) const
+{
+    metrics->iterations = iterations;
+    metrics->busyNsecs = busyNsecs;
+    metrics->pollNsecs = pollNsecs;
+    metrics->longestTickNsecs = longestTickNsecs;
+    for (int i = 0; i < EventLoopMetrics::HistogramBuckets; ++i) {
+        metrics->tickHistogram[i] = tickHistogram[i];
+    }
+    metrics->coroutineSwitches = currentCoroutine().switchCount() - switchesAtReset;
+    qint64 elapsed = clock.nsecsElapsed() - resetMark;
+    if (elapsed > 0) {
+        metrics->coroutineSwitchesPerSecond = static_cast<double>(metrics->coroutineSwitches) * 1e9 / static_cast<double>(elapsed);
+    }
+}
+
 // 开始写 EventLoopCoroutinePrivate 的实现代码。
 
 EventLoopCoroutinePrivate::EventLoopCoroutinePrivate(EventLoopCoroutine *q)
-    :q_ptr(q){}
+    :spinUsecs(0), busyPollUsecs(0), runQueueScheduled(false), q_ptr(q){}
 
 EventLoopCoroutinePrivate::~EventLoopCoroutinePrivate(){}
 
 
+void EventLoopCoroutinePrivate::fillMetrics(EventLoopMetrics *)
+{
+}
+
+
+qint64 EventLoopCoroutinePrivate::callLaterCoarse(quint32 msecs, Functor *callback)
+{
+    return callLater(msecs, callback);
+}
+
+
+bool EventLoopCoroutinePrivate::submitIo(EventLoopCoroutine::IoOperation, qintptr, void *, quint32, void *, quint32 *, qint64 *)
+{
+    return false;
+}
+
+
+void EventLoopCoroutinePrivate::callLaterThreadSafe(quint32 msecs, const QList<Functor*> &callbacks)
+{
+    for (Functor *callback: callbacks) {
+        callLaterThreadSafe(msecs, callback);
+    }
+}
+
+
+ThreadSafeCallQueue::ThreadSafeCallQueue()
+    :top(nullptr), count(0)
+{
+}
+
+
+ThreadSafeCallQueue::~ThreadSafeCallQueue()
+{
+    Node *node = takeAll();
+    while (node) {
+        Node *next = node->next;
+        delete node->callback;
+        delete node;
+        node = next;
+    }
+}
+
+
+bool ThreadSafeCallQueue::pushChain(Node *first, Node *last, int n)
+{
+    count.fetchAndAddRelaxed(n);
+    Node *head = top.loadAcquire();
+    do {
+        last->next = head;
+    } while (!top.testAndSetRelease(head, first, head));
+    return head == nullptr;
+}
+
+
+bool ThreadSafeCallQueue::push(quint32 msecs, Functor *callback)
+{
+    Node *node = new Node;
+    node->next = nullptr;
+    node->msecs = msecs;
+    node->callback = callback;
+    return pushChain(node, node, 1);
+}
+
+
+bool ThreadSafeCallQueue::push(quint32 msecs, const QList<Functor*> &callbacks)
+{
+    if (callbacks.isEmpty()) {
+        return false;
+    }
+    // the stack is reversed by takeAll(), so link the batch backward.
+    Node *first = nullptr;
+    Node *last = nullptr;
+    int n = 0;
+    for (Functor *callback: callbacks) {
+        ++n;
+        Node *node = new Node;
+        node->next = first;
+        node->msecs = msecs;
+        node->callback = callback;
+        if (!last) {
+            last = node;
+        }
+        first = node;
+    }
+    return pushChain(first, last, n);
+}
+
+
+ThreadSafeCallQueue::Node *ThreadSafeCallQueue::takeAll()
+{
+    Node *node = top.fetchAndStoreAcquire(nullptr);
+    Node *reversed = nullptr;
+    int n = 0;
+    while (node) {
+        Node *next = node->next;
+        node->next = reversed;
+        reversed = node;
+        node = next;
+        ++n;
+    }
+    count.fetchAndAddRelaxed(-n);
+    return reversed;
+}
+
+
+RunQueue::RunQueue()
+    :count(0)
+{
+    for (int i = 0; i < Classes; ++i) {
+        skipped[i] = 0;
+    }
+}
+
+
+RunQueue::~RunQueue()
+{
+    for (int i = 0; i < Classes; ++i) {
+        qDeleteAll(queues[i]);
+    }
+}
+
+
+void RunQueue::push(Functor *callback, BaseCoroutine::Priority priority)
+{
+    queues[qBound(0, static_cast<int>(priority), Classes - 1)].append(callback);
+    ++count;
+}
+
+
+Functor *RunQueue::take()
+{
+    if (count == 0) {
+        return nullptr;
+    }
+    int chosen = 0;
+    while (queues[chosen].isEmpty()) {
+        ++chosen;
+    }
+    for (int i = Classes - 1; i > chosen; --i) {
+        if (!queues[i].isEmpty() && skipped[i] >= StarvationLimit) {
+            chosen = i;
+            break;
+        }
+    }
+    for (int i = chosen + 1; i < Classes; ++i) {
+        if (!queues[i].isEmpty()) {
+            ++skipped[i];
+        }
+    }
+    skipped[chosen] = 0;
+    --count;
+    return queues[chosen].takeFirst();
+}
+
+
+struct RunQueueFunctor: public Functor
+{
+    explicit RunQueueFunctor(EventLoopCoroutinePrivate *d)
+        :d(d) {}
+    virtual void operator()() override;
+    EventLoopCoroutinePrivate * const d;
+};
+
+
+void RunQueueFunctor::operator()()
+{
+    d->runQueueScheduled = false;
+    // the callbacks pushed by these ones wait for the next iteration, so the io events are not starved.
+    int n = d->runQueue.size();
+    while (n-- > 0 && !d->runQueue.isEmpty()) {
+        Functor *callback = d->runQueue.take();
+        (*callback)();
+        delete callback;
+    }
+    if (!d->runQueue.isEmpty() && !d->runQueueScheduled) {
+        d->runQueueScheduled = true;
+        d->callLater(0, new RunQueueFunctor(d));
+    }
+}
+
+
 // 开始写 EventLoopCoroutine 的实现代码。
 
 EventLoopCoroutine::EventLoopCoroutine(EventLoopCoroutinePrivate *d, size_t stackSize)
@@ -85,11 +463,18 @@ EventLoopCoroutine::EventLoopCoroutine(EventLoopCoroutinePrivate *d, size_t stac
 
 EventLoopCoroutine::~EventLoopCoroutine()
 {
+    if (currentLoopCache == this) {
+        currentLoopCache = nullptr;
+    }
     delete dd_ptr;
 }
 
 EventLoopCoroutine *EventLoopCoroutine::get()
 {
+    EventLoopCoroutine *eventLoop = currentLoopCache;
+    if (Q_LIKELY(eventLoop)) {
+        return eventLoop;
+    }
     return currentLoopStorage->getOrCreate().data();
 }
 
@@ -99,25 +484,25 @@ void EventLoopCoroutine::run()
     d->run();
 }
 
-int EventLoopCoroutine::createWatcher(EventType event, qintptr fd, Functor *callback)
+qint64 EventLoopCoroutine::createWatcher(EventType event, qintptr fd, Functor *callback)
 {
     Q_D(EventLoopCoroutine);
     return d->createWatcher(event, fd, callback);
 }
 
-void EventLoopCoroutine::startWatcher(int watcherId)
+void EventLoopCoroutine::startWatcher(qint64 watcherId)
 {
     Q_D(EventLoopCoroutine);
     return d->startWatcher(watcherId);
 }
 
-void EventLoopCoroutine::stopWatcher(int watcherId)
+void EventLoopCoroutine::stopWatcher(qint64 watcherId)
 {
     Q_D(EventLoopCoroutine);
     return d->stopWatcher(watcherId);
 }
 
-void EventLoopCoroutine::removeWatcher(int watcherId)
+void EventLoopCoroutine::removeWatcher(qint64 watcherId)
 {
     Q_D(EventLoopCoroutine);
     return d->removeWatcher(watcherId);
@@ -129,13 +514,67 @@ void EventLoopCoroutine::triggerIoWatchers(qintptr fd)
     return d->triggerIoWatchers(fd);
 }
 
-int EventLoopCoroutine::callLater(quint32 msecs, Functor *callback)
+qint64 EventLoopCoroutine::callLater(quint32 msecs, Functor *callback)
 {
     Q_D(EventLoopCoroutine);
     return d->callLater(msecs, callback);
 }
 
 
+EventLoopMetrics EventLoopCoroutine::metrics()
+{
+    Q_D(EventLoopCoroutine);
+    EventLoopMetrics metrics;
+    d->recorder.fill(&metrics);
+    d->fillMetrics(&metrics);
+    return metrics;
+}
+
+
+void EventLoopCoroutine::resetMetrics()
+{
+    Q_D(EventLoopCoroutine);
+    d->recorder.reset();
+}
+
+
+void EventLoopCoroutine::setSlowTickCallback(quint32 thresholdMsecs, const std::function<void(qint64)> &callback)
+{
+    Q_D(EventLoopCoroutine);
+    d->recorder.slowTickCallback = callback;
+    d->recorder.slowTickThreshold = callback ? static_cast<qint64>(thresholdMsecs) * 1000 * 1000 : 0;
+}
+
+
+void EventLoopCoroutine::setLowLatencyMode(quint32 spinUsecs, quint32 busyPollUsecs)
+{
+    Q_D(EventLoopCoroutine);
+    d->spinUsecs = spinUsecs;
+    d->busyPollUsecs = busyPollUsecs;
+}
+
+
+quint32 EventLoopCoroutine::spinUsecs() const
+{
+    Q_D(const EventLoopCoroutine);
+    return d->spinUsecs;
+}
+
+
+quint32 EventLoopCoroutine::busyPollUsecs() const
+{
+    Q_D(const EventLoopCoroutine);
+    return d->busyPollUsecs;
+}
+
+
+qint64 EventLoopCoroutine::callLaterCoarse(quint32 msecs, Functor *callback)
+{
+    Q_D(EventLoopCoroutine);
+    return d->callLaterCoarse(msecs, callback);
+}
+
+
 void EventLoopCoroutine::callLaterThreadSafe(quint32 msecs, Functor *callback)
 {
     Q_D(EventLoopCoroutine);
@@ -143,18 +582,42 @@ void EventLoopCoroutine::callLaterThreadSafe(quint32 msecs, Functor *callback)
 }
 
 
-int EventLoopCoroutine::callRepeat(quint32 msecs, Functor *callback)
+void EventLoopCoroutine::callLaterThreadSafe(quint32 msecs, const QList<Functor*> &callbacks)
+{
+    Q_D(EventLoopCoroutine);
+    d->callLaterThreadSafe(msecs, callbacks);
+}
+
+
+qint64 EventLoopCoroutine::callRepeat(quint32 msecs, Functor *callback)
 {
     Q_D(EventLoopCoroutine);
     return d->callRepeat(msecs, callback);
 }
 
-void EventLoopCoroutine::cancelCall(int callbackId)
+void EventLoopCoroutine::cancelCall(qint64 callbackId)
 {
     Q_D(EventLoopCoroutine);
     return d->cancelCall(callbackId);
 }
 
+bool EventLoopCoroutine::submitIo(IoOperation operation, qintptr fd, void *data, quint32 size, void *address,
+                                  quint32 *addressSize, qint64 *result)
+{
+    Q_D(EventLoopCoroutine);
+    return d->submitIo(operation, fd, data, size, address, addressSize, result);
+}
+
+void EventLoopCoroutine::callSoon(Functor *callback, BaseCoroutine::Priority priority)
+{
+    Q_D(EventLoopCoroutine);
+    d->runQueue.push(callback, priority);
+    if (!d->runQueueScheduled) {
+        d->runQueueScheduled = true;
+        d->callLater(0, new RunQueueFunctor(d));
+    }
+}
+
 int EventLoopCoroutine::exitCode()
 {
     Q_D(EventLoopCoroutine);
@@ -175,27 +638,88 @@ void EventLoopCoroutine::yield()
 
 // 开始写 CurrentLoopStorage 的实现
 
+static QBasicAtomicInt qtEventLoopHybrid = Q_BASIC_ATOMIC_INITIALIZER(0);
+
+
+void setQtEventLoopHybrid(bool hybrid)
+{
+    qtEventLoopHybrid.storeRelease(hybrid ? 1 : 0);
+}
+
+
+static QBasicAtomicInt headlessMainThread = Q_BASIC_ATOMIC_INITIALIZER(0);
+
+
+void setHeadlessMainThread(bool headless)
+{
+    headlessMainThread.storeRelease(headless ? 1 : 0);
+}
+
+
+static inline bool usesQtEventLoop()
+{
+    return QCoreApplication::instance() && QCoreApplication::instance()->thread() == QThread::currentThread()
+            && !headlessMainThread.loadAcquire();
+}
+
+
 QSharedPointer<EventLoopCoroutine> CurrentLoopStorage::getOrCreate()
 {
     QSharedPointer<EventLoopCoroutine> eventLoop;
     if(storage.hasLocalData()) {
         eventLoop = storage.localData();
     }
-    if (eventLoop.isNull()) {
+    if (!eventLoop.isNull()) {
+        currentLoopCache = eventLoop.data();
+    } else {
+#ifdef QTNETWOKRNG_USE_IO_URING
+        if (!usesQtEventLoop()) {
+            QSharedPointer<UringEventLoopCoroutine> uringLoop(new UringEventLoopCoroutine());
+            if (uringLoop->isValid()) {
+                uringLoop->setObjectName("io_uring_eventloop_coroutine");
+                eventLoop = uringLoop;
+                set(eventLoop);
+                return eventLoop;
+            }
+            // io_uring is disabled or the kernel is too old, fall back to libev.
+        }
+#endif
+#ifdef QTNETWOKRNG_USE_IOCP
+        if (!usesQtEventLoop()) {
+            QSharedPointer<IocpEventLoopCoroutine> iocpLoop(new IocpEventLoopCoroutine());
+            if (iocpLoop->isValid()) {
+                iocpLoop->setObjectName("iocp_eventloop_coroutine");
+                eventLoop = iocpLoop;
+                set(eventLoop);
+                return eventLoop;
+            }
+            // the afd driver is hidden by wine or some sandboxes, fall back to the Qt eventloop.
+        }
+#endif
 #ifdef QTNETWOKRNG_USE_EV
-        if (QCoreApplication::instance() && QCoreApplication::instance()->thread() == QThread::currentThread()) {
+        if (usesQtEventLoop()) {
+            if (qtEventLoopHybrid.loadAcquire()) {
+                QSharedPointer<QtEvEventLoopCoroutine> hybridLoop(new QtEvEventLoopCoroutine());
+                if (hybridLoop->isValid()) {
+                    hybridLoop->setObjectName("qt_libev_eventloop_coroutine");
+                    eventLoop = hybridLoop;
+                    set(eventLoop);
+                    return eventLoop;
+                }
+                // libev has only select or poll here, fall back to one QSocketNotifier per socket.
+            }
             eventLoop.reset(new QtEventLoopCoroutine());
             eventLoop->setObjectName("qt_eventloop_coroutine");
-            storage.setLocalData(eventLoop);
+            set(eventLoop);
         } else {
             eventLoop.reset(new EvEventLoopCoroutine());
             eventLoop->setObjectName("libev_eventloop_coroutine");
-            storage.setLocalData(eventLoop);
+            set(eventLoop);
         }
 #else
         eventLoop.reset(new QtEventLoopCoroutine());
         eventLoop->setObjectName("qt_eventloop_coroutine");
-        storage.setLocalData(eventLoop);
+        set(eventLoop);
 #endif
     }
     return eventLoop;
@@ -215,11 +739,13 @@ QSharedPointer<EventLoopCoroutine> CurrentLoopStorage::get()
 void CurrentLoopStorage::set(QSharedPointer<EventLoopCoroutine> eventLoop)
 {
     storage.setLocalData(eventLoop);
+    currentLoopCache = eventLoop.data();
 }
 
 
 void CurrentLoopStorage::clean()
 {
+    currentLoopCache = nullptr;
     if(storage.hasLocalData()) {
         storage.localData().reset();
     }
@@ -229,22 +755,31 @@ void CurrentLoopStorage::clean()
 // 开始写 ScopedWatcher 的实现
 
 ScopedIoWatcher::ScopedIoWatcher(EventLoopCoroutine::EventType event, qintptr fd)
+    :fd(fd), watcherId(0), event(event)
 {
-    QSharedPointer<EventLoopCoroutine> eventLoop = currentLoopStorage->getOrCreate();
-    watcherId = eventLoop->createWatcher(event, fd, new YieldCurrentFunctor());
 }
 
 void ScopedIoWatcher::start()
 {
-    QSharedPointer<EventLoopCoroutine> eventLoop = currentLoopStorage->getOrCreate();
+    // every blocking socket waits here, the scope may have fired while the coroutine was not waiting.
+    CancelScope::check();
+    EventLoopCoroutine *eventLoop = EventLoopCoroutine::get();
+    // the watcher is created when the socket would block for the first time, the syscall usually succeeds at once.
+    if(!watcherId) {
+        watcherId = eventLoop->createWatcher(event, fd, new YieldCurrentFunctor());
+    }
     eventLoop->startWatcher(watcherId);
+    CoroutineWaitScope scope(event == EventLoopCoroutine::Read ? "Socket read" : "Socket write", nullptr, fd);
+    QTNG_PROBE2(socket_wait, fd, static_cast<int>(event));
     eventLoop->yield();
+    QTNG_PROBE2(socket_wake, fd, static_cast<int>(event));
 }
 
 ScopedIoWatcher::~ScopedIoWatcher()
 {
-    QSharedPointer<EventLoopCoroutine> eventLoop = currentLoopStorage->getOrCreate();
-    eventLoop->removeWatcher(watcherId);
+    if(watcherId) {
+        EventLoopCoroutine::get()->removeWatcher(watcherId);
+    }
 }
 
 // 开始写 CoroutinePrivate 的定义
@@ -265,7 +800,7 @@ private:
     Event finishedEvent;
     QObject * const obj;
     const char * const slot;
-    int callbackId;
+    qint64 callbackId;
 
     Q_DECLARE_PUBLIC(Coroutine)
     friend struct StartCoroutineFunctor;
@@ -401,6 +936,7 @@ bool CoroutinePrivate::join()
         if(!dynamic_cast<Coroutine*>(BaseCoroutine::current())) {
             return EventLoopCoroutine::get()->runUntil(q);
         }
+        CoroutineWaitScope scope("join", q);
         return finishedEvent.wait();
     } else {
         return true;
@@ -493,16 +1029,17 @@ Coroutine *Coroutine::current()
 
 struct QScopedCallLater
 {
-    QScopedCallLater(int callbackId):callbackId(callbackId){}
+    QScopedCallLater(qint64 callbackId):callbackId(callbackId){}
     ~QScopedCallLater(){EventLoopCoroutine::get()->cancelCall(callbackId);}
-    int callbackId;
+    qint64 callbackId;
 };
 
 void Coroutine::msleep(quint32 msecs)
 {
-    int callbackId = EventLoopCoroutine::get()->callLater(msecs, new YieldCurrentFunctor());
+    qint64 callbackId = EventLoopCoroutine::get()->callLater(msecs, new YieldCurrentFunctor());
     QScopedCallLater scl(callbackId);
     Q_UNUSED(scl);
+    CoroutineWaitScope scope("sleep", nullptr);
     EventLoopCoroutine::get()->yield();
 }
 
@@ -566,7 +1103,165 @@ void Timeout::restart()
 {
     if(timeoutId)
         EventLoopCoroutine::get()->cancelCall(timeoutId);
-    timeoutId = EventLoopCoroutine::get()->callLater(msecs, new TimeoutFunctor(this, BaseCoroutine::current()));
+    timeoutId = 0;
+    // the outer CancelScope raises the same exception before this one. if it fired already, its exception may be
+    // swallowed by an inner catch, so it is raised again instead of waiting for nothing.
+    CancelScope *scope = CancelScope::current();
+    if (scope) {
+        CancelScope::check();
+        qint64 remaining = scope->remainingMsecs();
+        if (remaining > 0 && remaining <= static_cast<qint64>(msecs)) {
+            return;
+        }
+    }
+    // long timeouts rarely fire, a few milliseconds later is fine.
+    if (msecs >= 1000) {
+        timeoutId = EventLoopCoroutine::get()->callLaterCoarse(msecs, new TimeoutFunctor(this, BaseCoroutine::current()));
+    } else {
+        timeoutId = EventLoopCoroutine::get()->callLater(msecs, new TimeoutFunctor(this, BaseCoroutine::current()));
+    }
+}
+
+
+// 开始实现 CancelScope
+
+Q_GLOBAL_STATIC(CoroutineLocal<CancelScope *>, currentCancelScope)
+
+
+struct CancelScopeFunctor: public Functor
+{
+    CancelScopeFunctor(CancelScope *scope, BaseCoroutine *coroutine)
+        :scope(scope), coroutine(coroutine) {}
+    virtual void operator()() override;
+    CancelScope *scope;  // the call is cancelled by the scope's destructor.
+    QPointer<BaseCoroutine> coroutine;
+};
+
+
+void CancelScopeFunctor::operator()()
+{
+    // the eventloop does not run on the shared stack, so the scope on it is always reachable.
+    if (!coroutine.isNull()) {
+        makeCoroutineStackResident(coroutine.data());
+    }
+    scope->timeoutId = 0;
+    if (coroutine.isNull()) {
+        return;
+    }
+    coroutine->raise(new TimeoutException());
+}
+
+
+CancelScope::CancelScope(float secs)
+{
+    init(static_cast<qint64>(secs * 1000));
+}
+
+
+CancelScope::CancelScope(quint32 msecs, int)
+{
+    init(msecs);
+}
+
+
+void CancelScope::init(qint64 msecs)
+{
+    coroutine = BaseCoroutine::current();
+    parent = current();
+    deadline = parent ? parent->deadline : -1;
+    timeoutId = 0;
+    cancelled = false;
+    if (msecs > 0) {
+        qint64 mine = QElapsedTimer::msecsSinceReference() + msecs;
+        if (deadline < 0 || mine < deadline) {
+            deadline = mine;
+            arm(msecs);
+        }
+    }
+    currentCancelScope()->localData() = this;
+}
+
+
+CancelScope::~CancelScope()
+{
+    if (timeoutId) {
+        EventLoopCoroutine::get()->cancelCall(timeoutId);
+    }
+    if (coroutine != BaseCoroutine::current()) {
+        qWarning("CancelScope is deleted in another coroutine.");
+        return;
+    }
+    currentCancelScope()->localData() = parent;
+}
+
+
+void CancelScope::arm(qint64 msecs)
+{
+    if (timeoutId) {
+        EventLoopCoroutine::get()->cancelCall(timeoutId);
+    }
+    quint32 m = static_cast<quint32>(qMin<qint64>(msecs, 0x7fffffff));
+    if (m >= 1000) {
+        timeoutId = EventLoopCoroutine::get()->callLaterCoarse(m, new CancelScopeFunctor(this, coroutine));
+    } else {
+        timeoutId = EventLoopCoroutine::get()->callLater(m, new CancelScopeFunctor(this, coroutine));
+    }
+}
+
+
+void CancelScope::cancel()
+{
+    if (coroutine != BaseCoroutine::current() && !makeCoroutineStackResident(coroutine)) {
+        qWarning("CancelScope can not be cancelled by a coroutine on the same shared stack.");
+        return;
+    }
+    if (cancelled) {
+        return;
+    }
+    cancelled = true;
+    // the current coroutine is not blocked, it fails at the next check().
+    if (coroutine != BaseCoroutine::current()) {
+        arm(0);
+    }
+}
+
+
+bool CancelScope::isCancelled() const
+{
+    for (const CancelScope *scope = this; scope; scope = scope->parent) {
+        if (scope->cancelled) {
+            return true;
+        }
+    }
+    return deadline >= 0 && QElapsedTimer::msecsSinceReference() >= deadline;
+}
+
+
+qint64 CancelScope::remainingMsecs() const
+{
+    if (deadline < 0) {
+        return -1;
+    }
+    return qMax<qint64>(0, deadline - QElapsedTimer::msecsSinceReference());
+}
+
+
+CancelScope *CancelScope::current()
+{
+    const CoroutineLocal<CancelScope *> *local = currentCancelScope();
+    if (!local) {
+        return nullptr;
+    }
+    return local->localData();
+}
+
+
+void CancelScope::check()
+{
+    CancelScope *scope = current();
+    if (scope && scope->isCancelled()) {
+        throw TimeoutException();
+    }
 }
 
 QTNETWORKNG_NAMESPACE_END
@@ -1,11 +1,16 @@
-#include <QtCore/qmap.h>
-#include <QtCore/qmutex.h>
-#include <QtCore/qqueue.h>
+#include <QtCore/qvector.h>
 #include <QtCore/qpointer.h>
 #include <QtCore/qdebug.h>
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qeventloop.h>
+#include <QtCore/qcoreapplication.h>
+#include <QtCore/qsocketnotifier.h>
+#include <QtCore/qcoreevent.h>
+#include <QtCore/qabstracteventdispatcher.h>
 #include <stddef.h>
 #include "ev/ev.h"
 #include "../include/private/eventloop_p.h"
+#include "../include/private/timerwheel_p.h"
 
 
 QTNETWORKNG_NAMESPACE_BEGIN
@@ -13,142 +18,247 @@ QTNETWORKNG_NAMESPACE_BEGIN
 
 class EventLoopCoroutinePrivateEv;
 
+
+// one slot of the watcher table. the slot is reused after the watcher is removed, so watcher ids carry
+// a 31-bit generation counter in the high half, a stale id never matches the new watcher in the same slot. the
+// freed slots are reused first in first out, so a slot waits for all other free ones before its next generation.
 struct EvWatcher
 {
-    virtual ~EvWatcher();
-};
-
-
-struct IoWatcher: public EvWatcher{
-    IoWatcher(EventLoopCoroutine::EventType event, qintptr fd);
-    virtual ~IoWatcher();
-
-    struct ev_io w;
+    enum Type {
+        Free = 0,
+        Io = 1,
+        Timer = 2,
+    };
+    union {
+        struct ev_io io;
+        TimerWheelNode timer;
+    } w;
     Functor *callback;
+    EventLoopCoroutinePrivateEv *parent;
+    qint64 watcherId;
+    int nextFree;
+    quint32 generation;
+    quint8 type;
+    bool repeat;
+    quint32 interval;
 };
 
 
-struct TimerWatcher: public EvWatcher
+class EvWatcherTable
 {
-    TimerWatcher(quint32 msecs, bool repeat);
-    virtual ~TimerWatcher();
-
-    ev_timer w;
-    Functor *callback;
-    EventLoopCoroutinePrivateEv *parent;
-    int watcherId;
+public:
+    EvWatcherTable();
+    ~EvWatcherTable();
+public:
+    EvWatcher *allocate(EvWatcher::Type type);
+    EvWatcher *lookup(qint64 watcherId, EvWatcher::Type type) const;
+    void release(EvWatcher *watcher);
+    int capacity() const { return chunks.size() * ChunkSize; }
+    quint32 count(EvWatcher::Type type) const { return counts[type]; }
+    EvWatcher *at(int index) const { return &chunks.at(index / ChunkSize)[index % ChunkSize]; }
+private:
+    enum {
+        ChunkSize = 256,        // the address of slots must be stable, libev keeps pointers to them.
+        MaxWatchers = 1 << 22,
+        GenerationMask = 0x7fffffff,
+    };
+    QVector<EvWatcher*> chunks;
+    int firstFree;
+    int lastFree;
+    quint32 counts[3];
 };
 
 
-EvWatcher::~EvWatcher() {}
+EvWatcherTable::EvWatcherTable()
+    :firstFree(-1), lastFree(-1)
+{
+    counts[EvWatcher::Free] = counts[EvWatcher::Io] = counts[EvWatcher::Timer] = 0;
+}
 
 
-static void ev_io_callback(struct ev_loop *, ev_io *w, int)
+EvWatcherTable::~EvWatcherTable()
 {
-    IoWatcher *watcher = static_cast<IoWatcher*>(w->data);
-    (*watcher->callback)();
+    for (EvWatcher *chunk: chunks) {
+        for (int i = 0; i < ChunkSize; ++i) {
+            if (chunk[i].type != EvWatcher::Free) {
+                delete chunk[i].callback;
+            }
+        }
+        delete [] chunk;
+    }
 }
 
 
-IoWatcher::IoWatcher(EventLoopCoroutine::EventType event, qintptr fd)
+EvWatcher *EvWatcherTable::allocate(EvWatcher::Type type)
 {
-    int flags = 0;
-    if(event & EventLoopCoroutine::EventType::Read)
-        flags |= EV_READ;
-    if(event & EventLoopCoroutine::EventType::Write)
-        flags |= EV_WRITE;
-    ev_io_init(&w, ev_io_callback, fd, flags);
-    w.data = this;
+    if (firstFree < 0) {
+        int base = capacity();
+        if (base + ChunkSize > MaxWatchers) {
+            qWarning("too many watchers in libev eventloop.");
+            return nullptr;
+        }
+        EvWatcher *chunk = new EvWatcher[ChunkSize];
+        for (int i = 0; i < ChunkSize; ++i) {
+            chunk[i].callback = nullptr;
+            chunk[i].parent = nullptr;
+            chunk[i].watcherId = 0;
+            chunk[i].generation = 0;
+            chunk[i].type = EvWatcher::Free;
+            chunk[i].repeat = false;
+            chunk[i].interval = 0;
+            chunk[i].nextFree = (i + 1 < ChunkSize) ? base + i + 1 : -1;
+        }
+        chunks.append(chunk);
+        firstFree = base;
+        lastFree = base + ChunkSize - 1;
+    }
+    int index = firstFree;
+    EvWatcher *watcher = at(index);
+    firstFree = watcher->nextFree;
+    if (firstFree < 0) {
+        lastFree = -1;
+    }
+    // generation starts from 1, so watcher id is never zero.
+    watcher->generation = (watcher->generation % GenerationMask) + 1;
+    watcher->type = static_cast<quint8>(type);
+    ++counts[type];
+    watcher->nextFree = -1;
+    watcher->callback = nullptr;
+    watcher->parent = nullptr;
+    watcher->repeat = false;
+    watcher->interval = 0;
+    watcher->watcherId = (static_cast<qint64>(watcher->generation) << 32) | index;
+    return watcher;
 }
 
 
-IoWatcher::~IoWatcher()
+EvWatcher *EvWatcherTable::lookup(qint64 watcherId, EvWatcher::Type type) const
 {
-    delete callback;
+    if (watcherId <= 0) {
+        return nullptr;
+    }
+    int index = static_cast<int>(watcherId & 0xffffffff);
+    if (index >= capacity()) {
+        return nullptr;
+    }
+    EvWatcher *watcher = at(index);
+    if (watcher->type != type || watcher->watcherId != watcherId) {
+        return nullptr;
+    }
+    return watcher;
 }
 
-static void ev_timer_callback(struct ev_loop *, ev_timer *w, int);
 
-
-TimerWatcher::TimerWatcher(quint32 msecs, bool repeat)
-//    :parent(nullptr), watcherId(0) // value set by caller.
+void EvWatcherTable::release(EvWatcher *watcher)
 {
-    float secs = static_cast<float>(msecs) / 1000.0f;
-    if(repeat) {
-        ev_timer_init(&w, ev_timer_callback, 0, secs);
+    Functor *callback = watcher->callback;
+    int index = static_cast<int>(watcher->watcherId & 0xffffffff);
+    --counts[watcher->type];
+    watcher->type = EvWatcher::Free;
+    watcher->callback = nullptr;
+    watcher->watcherId = 0;
+    watcher->nextFree = -1;
+    if (lastFree < 0) {
+        firstFree = index;
     } else {
-        ev_timer_init(&w, ev_timer_callback, secs, 0);
+        at(lastFree)->nextFree = index;
     }
-    w.data = this;
+    lastFree = index;
+    // the callback may remove other watchers in its destructor.
+    delete callback;
 }
 
 
-TimerWatcher::~TimerWatcher()
+static void ev_io_callback(struct ev_loop *, ev_io *w, int)
 {
-    delete callback;
+    EvWatcher *watcher = static_cast<EvWatcher*>(w->data);
+    ++watcher->parent->dispatched;
+    (*watcher->callback)();
 }
 
+
 class EventLoopCoroutinePrivateEv: public EventLoopCoroutinePrivate
 {
 public:
-    EventLoopCoroutinePrivateEv(EventLoopCoroutine* parent);
+    // backends is zero for the recommended ones of libev.
+    EventLoopCoroutinePrivateEv(EventLoopCoroutine* parent, unsigned int backends = 0);
     virtual ~EventLoopCoroutinePrivateEv() override;
 public:
     virtual void run() override;
-    virtual int createWatcher(EventLoopCoroutine::EventType event, qintptr fd, Functor *callback) override;
-    virtual void startWatcher(int watcherId) override;
-    virtual void stopWatcher(int watcherId) override;
-    virtual void removeWatcher(int watcherId) override;
+    virtual qint64 createWatcher(EventLoopCoroutine::EventType event, qintptr fd, Functor *callback) override;
+    virtual void startWatcher(qint64 watcherId) override;
+    virtual void stopWatcher(qint64 watcherId) override;
+    virtual void removeWatcher(qint64 watcherId) override;
     virtual void triggerIoWatchers(qintptr fd) override;
-    virtual int callLater(quint32 msecs, Functor *callback) override;
-    virtual int callRepeat(quint32 msecs, Functor *callback) override;
+    virtual qint64 callLater(quint32 msecs, Functor *callback) override;
+    virtual qint64 callLaterCoarse(quint32 msecs, Functor *callback) override;
+    virtual qint64 callRepeat(quint32 msecs, Functor *callback) override;
     virtual void callLaterThreadSafe(quint32 msecs, Functor *callback) override;
-    virtual void cancelCall(int callbackId) override;
+    virtual void callLaterThreadSafe(quint32 msecs, const QList<Functor*> &callbacks) override;
+    virtual void cancelCall(qint64 callbackId) override;
     virtual int exitCode() override;
     virtual bool runUntil(BaseCoroutine *coroutine) override;
     virtual void yield() override;
+    virtual void fillMetrics(EventLoopMetrics *metrics) override;
     void doCallLater();
+public:
+    quint64 dispatched;     // the io, timer and async callbacks, the spinning goes on while they come.
+protected:
+    // runs libev until *done is set or ev_break() is called, polling without sleeping in the low-latency mode.
+    void runLoop(const QSharedPointer<bool> &done);
+    // called after the timer of wheel is armed, which may be outside of ev_run().
+    virtual void wheelTimerArmed() {}
 private:
     static void ev_async_callback(struct ev_loop *loop, ev_async *w, int revents);
-private:
+    static void ev_wheel_callback(struct ev_loop *loop, ev_timer *w, int revents);
+    static void ev_prepare_callback(struct ev_loop *loop, ev_prepare *w, int revents);
+    static void ev_check_callback(struct ev_loop *loop, ev_check *w, int revents);
+    qint64 addTimer(quint64 expiry, quint32 interval, bool repeat, Functor *callback);
+    void armWheelTimer(quint64 expiry);
+    void runTimers();
+protected:
     struct ev_loop *loop;
-    QMap<int, EvWatcher*> watchers;
-    QMutex mqMutex;
-    QQueue<QPair<quint32, Functor*>> callLaterQueue;
+    EvWatcherTable watchers;
+    // all timers share one ev_timer, which is armed at the nearest expiry of the wheel.
+    // the wheel must be destroyed before the watcher table, it keeps pointers to the slots.
+    TimerWheel wheel;
+    QElapsedTimer clock;
+    ev_timer wheelTimer;
+    quint64 armedTick;
+    ThreadSafeCallQueue callLaterQueue;
     ev_async asyncContext;
+    ev_prepare prepareContext;
+    ev_check checkContext;
     QPointer<BaseCoroutine> loopCoroutine;
-    int nextWatcherId;
     QAtomicInteger<bool> exitingFlag;
     Q_DECLARE_PUBLIC(EventLoopCoroutine)
     friend struct TriggerIoWatchersFunctor;
 };
 
 
-static void ev_timer_callback(struct ev_loop *loop, ev_timer *w, int)
-{
-    // TimerWatcher *watcher = reinterpret_cast<TimerWatcher*>(reinterpret_cast<char*>(w) - offsetof(TimerWatcher, e));
-    TimerWatcher *watcher = static_cast<TimerWatcher*>(w->data);
-    if(qFuzzyIsNull(w->repeat)) { // ev_timer_again?
-        ev_timer_stop(loop, w);
-    }
-    Functor * f = watcher->callback;
-    EventLoopCoroutinePrivateEv *parent = watcher->parent;
-    int watcherId = watcher->watcherId;
-    (*watcher->callback)();
-    if (parent && watcherId) {
-        parent->cancelCall(watcherId);
-    }
-}
-
-
-EventLoopCoroutinePrivateEv::EventLoopCoroutinePrivateEv(EventLoopCoroutine *parent)
-    :EventLoopCoroutinePrivate(parent), loop(nullptr), nextWatcherId(1)
+EventLoopCoroutinePrivateEv::EventLoopCoroutinePrivateEv(EventLoopCoroutine *parent, unsigned int backends)
+    :EventLoopCoroutinePrivate(parent), dispatched(0), loop(nullptr), wheel(0), armedTick(0)
 {
     unsigned int flags = EVFLAG_NOENV | EVFLAG_FORKCHECK;
-    loop = ev_loop_new(flags);
+    loop = ev_loop_new(flags | backends);
+    if (!loop && backends) {
+        loop = ev_loop_new(flags);
+    }
     ev_async_init(&asyncContext, ev_async_callback);
     asyncContext.data = this;
     ev_async_start(loop, &asyncContext);
+    // the prepare and check watchers measure the time spent outside of polling, they do not keep the loop alive.
+    ev_prepare_init(&prepareContext, ev_prepare_callback);
+    prepareContext.data = this;
+    ev_prepare_start(loop, &prepareContext);
+    ev_unref(loop);
+    ev_check_init(&checkContext, ev_check_callback);
+    checkContext.data = this;
+    ev_check_start(loop, &checkContext);
+    ev_unref(loop);
+    ev_timer_init(&wheelTimer, ev_wheel_callback, 0, 0);
+    wheelTimer.data = this;
+    clock.start();
 }
 
 
@@ -156,68 +266,105 @@ EventLoopCoroutinePrivateEv::~EventLoopCoroutinePrivateEv()
 {
     ev_break(loop);
     ev_loop_destroy(loop); // FIXME run() function may not exit, but this situation is rare.
-    QMapIterator<int, EvWatcher*> itor(watchers);
-    while(itor.hasNext()) {
-        itor.next();
-        delete itor.value();
-    }
+    // the watcher table deletes all callbacks.
 }
 
 void EventLoopCoroutinePrivateEv::run()
 {
     try{
-        ev_run(loop, 0);
+        runLoop(QSharedPointer<bool>());
     } catch(...) {
         qWarning("libev eventloop got exception.");
     }
 }
 
 
-int EventLoopCoroutinePrivateEv::createWatcher(EventLoopCoroutine::EventType event, qintptr fd, Functor *callback)
+void EventLoopCoroutinePrivateEv::runLoop(const QSharedPointer<bool> &done)
 {
-    IoWatcher *watcher = new IoWatcher(event, fd);
+    if (!spinUsecs) {
+        ev_run(loop, 0);
+        return;
+    }
+    // the nonblocking iterations spin on epoll_wait() with zero timeout, it sleeps only after spinUsecs without
+    // any callback. ev_break() is forgotten after each ev_run(), so runUntil() sets *done as well.
+    const qint64 budget = static_cast<qint64>(spinUsecs) * 1000;
+    QElapsedTimer idle;
+    idle.start();
+    while (!done || !*done) {
+        const quint64 before = dispatched;
+        if (!ev_run(loop, EVRUN_NOWAIT)) {
+            return;
+        }
+        if (dispatched != before) {
+            idle.restart();
+        } else if (idle.nsecsElapsed() >= budget) {
+            if (!done || !*done) {
+                if (!ev_run(loop, EVRUN_ONCE)) {
+                    return;
+                }
+            }
+            idle.restart();
+        }
+    }
+}
+
+
+qint64 EventLoopCoroutinePrivateEv::createWatcher(EventLoopCoroutine::EventType event, qintptr fd, Functor *callback)
+{
+    EvWatcher *watcher = watchers.allocate(EvWatcher::Io);
+    if (!watcher) {
+        delete callback;
+        return 0;
+    }
+    int flags = 0;
+    if(event & EventLoopCoroutine::EventType::Read)
+        flags |= EV_READ;
+    if(event & EventLoopCoroutine::EventType::Write)
+        flags |= EV_WRITE;
+    ev_io_init(&watcher->w.io, ev_io_callback, fd, flags);
+    watcher->w.io.data = watcher;
     watcher->callback = callback;
-    watchers.insert(nextWatcherId, watcher);
-    return nextWatcherId++;
+    watcher->parent = this;
+    return watcher->watcherId;
 }
 
 
-void EventLoopCoroutinePrivateEv::startWatcher(int watcherId)
+void EventLoopCoroutinePrivateEv::startWatcher(qint64 watcherId)
 {
-    IoWatcher *watcher = dynamic_cast<IoWatcher*>(watchers.value(watcherId));
+    EvWatcher *watcher = watchers.lookup(watcherId, EvWatcher::Io);
     if(watcher) {
-        ev_io_start(loop, &watcher->w);
+        ev_io_start(loop, &watcher->w.io);
     }
 }
 
 
-void EventLoopCoroutinePrivateEv::stopWatcher(int watcherId)
+void EventLoopCoroutinePrivateEv::stopWatcher(qint64 watcherId)
 {
-    IoWatcher *watcher = dynamic_cast<IoWatcher*>(watchers.value(watcherId));
+    EvWatcher *watcher = watchers.lookup(watcherId, EvWatcher::Io);
     if(watcher) {
-        ev_io_stop(loop, &watcher->w);
+        ev_io_stop(loop, &watcher->w.io);
     }
 }
 
 
-void EventLoopCoroutinePrivateEv::removeWatcher(int watcherId)
+void EventLoopCoroutinePrivateEv::removeWatcher(qint64 watcherId)
 {
-    IoWatcher *watcher = dynamic_cast<IoWatcher*>(watchers.take(watcherId));
+    EvWatcher *watcher = watchers.lookup(watcherId, EvWatcher::Io);
     if(watcher) {
-        ev_io_stop(loop, &watcher->w);
-        delete watcher;
+        ev_io_stop(loop, &watcher->w.io);
+        watchers.release(watcher);
     }
 }
 
 struct TriggerIoWatchersFunctor: public Functor
 {
-    TriggerIoWatchersFunctor(int watcherId, EventLoopCoroutinePrivateEv *eventloop)
+    TriggerIoWatchersFunctor(qint64 watcherId, EventLoopCoroutinePrivateEv *eventloop)
         :eventloop(eventloop), watcherId(watcherId) {}
     EventLoopCoroutinePrivateEv *eventloop;
-    int watcherId;
+    qint64 watcherId;
     virtual void operator()() override
     {
-        IoWatcher *watcher = dynamic_cast<IoWatcher*>(eventloop->watchers.value(watcherId));
+        EvWatcher *watcher = eventloop->watchers.lookup(watcherId, EvWatcher::Io);
         if(watcher) {
             (*watcher->callback)();
         }
@@ -227,25 +374,100 @@ struct TriggerIoWatchersFunctor: public Functor
 
 void EventLoopCoroutinePrivateEv::triggerIoWatchers(qintptr fd)
 {
-    for (QMap<int, EvWatcher*>::const_iterator itor = watchers.constBegin(); itor != watchers.constEnd(); ++itor) {
-        IoWatcher *watcher = dynamic_cast<IoWatcher*>(itor.value());
-        if(watcher && watcher->w.fd == fd) {
-            ev_io_stop(loop, &watcher->w);
-            callLater(0, new TriggerIoWatchersFunctor(itor.key(), this));
+    const int capacity = watchers.capacity();
+    for (int i = 0; i < capacity; ++i) {
+        EvWatcher *watcher = watchers.at(i);
+        if(watcher->type == EvWatcher::Io && watcher->w.io.fd == fd) {
+            ev_io_stop(loop, &watcher->w.io);
+            callLater(0, new TriggerIoWatchersFunctor(watcher->watcherId, this));
         }
     }
 }
 
 
-int EventLoopCoroutinePrivateEv::callLater(quint32 msecs, Functor *callback)
+static inline EvWatcher *timerWatcherOf(TimerWheelNode *node)
 {
-    TimerWatcher *watcher = new TimerWatcher(msecs, false);
+    return reinterpret_cast<EvWatcher*>(reinterpret_cast<char*>(node) - offsetof(EvWatcher, w.timer));
+}
+
+
+qint64 EventLoopCoroutinePrivateEv::addTimer(quint64 expiry, quint32 interval, bool repeat, Functor *callback)
+{
+    EvWatcher *watcher = watchers.allocate(EvWatcher::Timer);
+    if (!watcher) {
+        delete callback;
+        return 0;
+    }
+    watcher->w.timer.prev = nullptr;
+    watcher->w.timer.next = nullptr;
     watcher->callback = callback;
     watcher->parent = this;
-    watcher->watcherId = nextWatcherId;
-    ev_timer_start(loop, &watcher->w);
-    watchers.insert(nextWatcherId, watcher);
-    return nextWatcherId++;
+    watcher->repeat = repeat;
+    watcher->interval = interval;
+    wheel.insert(&watcher->w.timer, expiry);
+    armWheelTimer(expiry);
+    return watcher->watcherId;
+}
+
+
+void EventLoopCoroutinePrivateEv::armWheelTimer(quint64 expiry)
+{
+    if (ev_is_active(&wheelTimer)) {
+        if (armedTick <= expiry) {
+            return;
+        }
+        ev_timer_stop(loop, &wheelTimer);
+    }
+    quint64 now = static_cast<quint64>(clock.elapsed());
+    double delay = expiry > now ? static_cast<double>(expiry - now) / 1000.0 : 0.0;
+    ev_timer_set(&wheelTimer, delay, 0);
+    ev_timer_start(loop, &wheelTimer);
+    armedTick = expiry;
+    wheelTimerArmed();
+}
+
+
+void EventLoopCoroutinePrivateEv::ev_wheel_callback(struct ev_loop *, ev_timer *w, int)
+{
+    EventLoopCoroutinePrivateEv *p = static_cast<EventLoopCoroutinePrivateEv*>(w->data);
+    ++p->dispatched;
+    p->runTimers();
+}
+
+
+void EventLoopCoroutinePrivateEv::runTimers()
+{
+    wheel.advance(static_cast<quint64>(clock.elapsed()));
+    // the callbacks may switch to other coroutines, which add or cancel timers. take one node each time.
+    while (TimerWheelNode *node = wheel.takeExpired()) {
+        EvWatcher *watcher = timerWatcherOf(node);
+        qint64 watcherId = watcher->watcherId;
+        if (watcher->repeat) {
+            wheel.insert(node, wheel.currentTick() + watcher->interval);
+            (*watcher->callback)();
+        } else {
+            (*watcher->callback)();
+            cancelCall(watcherId);
+        }
+    }
+    qint64 next = wheel.nextExpiry();
+    if (next >= 0) {
+        armWheelTimer(static_cast<quint64>(next));
+    }
+}
+
+
+qint64 EventLoopCoroutinePrivateEv::callLater(quint32 msecs, Functor *callback)
+{
+    quint64 now = qMax<quint64>(static_cast<quint64>(clock.elapsed()), wheel.currentTick());
+    return addTimer(now + msecs, 0, false, callback);
+}
+
+
+qint64 EventLoopCoroutinePrivateEv::callLaterCoarse(quint32 msecs, Functor *callback)
+{
+    quint64 now = qMax<quint64>(static_cast<quint64>(clock.elapsed()), wheel.currentTick());
+    return addTimer(TimerWheel::coarse(now + msecs), 0, false, callback);
 }
 
 
@@ -254,51 +476,79 @@ void EventLoopCoroutinePrivateEv::ev_async_callback(struct ev_loop *, ev_async *
     //char *baseaddr = reinterpret_cast<char*>(w) - offsetof(EventLoopCoroutinePrivateEv, asyncContext);
     //EventLoopCoroutinePrivateEv *p = reinterpret_cast<EventLoopCoroutinePrivateEv*>(baseaddr); // TODO is p still alive?
     EventLoopCoroutinePrivateEv *p = static_cast<EventLoopCoroutinePrivateEv*>(w->data);
+    ++p->dispatched;
     p->doCallLater();
 }
 
 
+void EventLoopCoroutinePrivateEv::ev_prepare_callback(struct ev_loop *, ev_prepare *w, int)
+{
+    EventLoopCoroutinePrivateEv *p = static_cast<EventLoopCoroutinePrivateEv*>(w->data);
+    p->recorder.beforePoll();
+}
+
+
+void EventLoopCoroutinePrivateEv::ev_check_callback(struct ev_loop *, ev_check *w, int)
+{
+    EventLoopCoroutinePrivateEv *p = static_cast<EventLoopCoroutinePrivateEv*>(w->data);
+    p->recorder.afterPoll();
+}
+
+
 void EventLoopCoroutinePrivateEv::doCallLater()
 {
-    QMutexLocker locker(&mqMutex);
-    while(!callLaterQueue.isEmpty()) {
-        QPair<quint32, Functor*> item = callLaterQueue.dequeue();
-        callLater(item.first, item.second);
+    ThreadSafeCallQueue::Node *node = callLaterQueue.takeAll();
+    while(node) {
+        ThreadSafeCallQueue::Node *next = node->next;
+        callLater(node->msecs, node->callback);
+        delete node;
+        node = next;
     }
 }
 
 
 void EventLoopCoroutinePrivateEv::callLaterThreadSafe(quint32 msecs, Functor *callback)
 {
-    QMutexLocker locker(&mqMutex);
-    callLaterQueue.enqueue(qMakePair(msecs, callback));
-    if(!ev_async_pending(&asyncContext)) {
+    // only the producer who finds the queue empty wakes up the eventloop, the others are drained together.
+    if(callLaterQueue.push(msecs, callback)) {
         ev_async_send(loop, &asyncContext);
     }
 }
 
 
-int EventLoopCoroutinePrivateEv::callRepeat(quint32 msecs, Functor *callback)
+void EventLoopCoroutinePrivateEv::callLaterThreadSafe(quint32 msecs, const QList<Functor*> &callbacks)
 {
-    TimerWatcher *watcher = new TimerWatcher(msecs, true);
-    watcher->callback = callback;
-    watcher->parent = nullptr;
-    watcher->watcherId = 0;
-    ev_timer_start(loop, &watcher->w);
-    watchers.insert(nextWatcherId, watcher);
-    return nextWatcherId++;
+    if(callLaterQueue.push(msecs, callbacks)) {
+        ev_async_send(loop, &asyncContext);
+    }
+}
+
+
+qint64 EventLoopCoroutinePrivateEv::callRepeat(quint32 msecs, Functor *callback)
+{
+    quint64 now = qMax<quint64>(static_cast<quint64>(clock.elapsed()), wheel.currentTick());
+    // the first call is fired immediately, like the ev_timer used before.
+    return addTimer(now, qMax<quint32>(msecs, 1), true, callback);
 }
 
 
-void EventLoopCoroutinePrivateEv::cancelCall(int callbackId)
+void EventLoopCoroutinePrivateEv::cancelCall(qint64 callbackId)
 {
-    TimerWatcher *watcher = dynamic_cast<TimerWatcher*>(watchers.take(callbackId));
+    EvWatcher *watcher = watchers.lookup(callbackId, EvWatcher::Timer);
     if(watcher) {
-        ev_timer_stop(loop, &watcher->w);
-        delete watcher;
+        wheel.remove(&watcher->w.timer);
+        watchers.release(watcher);
     }
 }
 
+void EventLoopCoroutinePrivateEv::fillMetrics(EventLoopMetrics *metrics)
+{
+    metrics->ioWatchers = watchers.count(EvWatcher::Io);
+    metrics->timers = watchers.count(EvWatcher::Timer);
+    metrics->pendingThreadSafeCalls = static_cast<quint32>(callLaterQueue.size());
+}
+
+
 int EventLoopCoroutinePrivateEv::exitCode()
 {
     return 0;
@@ -319,14 +569,16 @@ bool EventLoopCoroutinePrivateEv::runUntil(BaseCoroutine *coroutine)
     } else {
         QPointer<BaseCoroutine> old = loopCoroutine;
         loopCoroutine = current;
-        Deferred<BaseCoroutine*>::Callback exitOneDepth = [this] (BaseCoroutine *) {
+        QSharedPointer<bool> done(new bool(false));
+        Deferred<BaseCoroutine*>::Callback exitOneDepth = [this, done] (BaseCoroutine *) {
+            *done = true;
             ev_break(loop, EVBREAK_ONE);
             if(!loopCoroutine.isNull()) {
                 loopCoroutine->yield();
             }
         };
         coroutine->finished.addCallback(exitOneDepth);
-        ev_run(loop);
+        runLoop(done);
         loopCoroutine = old;
     }
     return true;
@@ -348,4 +600,250 @@ EvEventLoopCoroutine::EvEventLoopCoroutine()
 
 }
 
+
+class EventLoopCoroutinePrivateQtEv;
+
+
+class QtEvNotifier: public QSocketNotifier
+{
+public:
+    QtEvNotifier(qintptr fd, EventLoopCoroutinePrivateQtEv *parent)
+        :QSocketNotifier(fd, QSocketNotifier::Read), parent(parent) {}
+protected:
+    virtual bool event(QEvent *e) override;
+private:
+    EventLoopCoroutinePrivateQtEv * const parent;
+};
+
+
+class QtEvTimer: public QObject
+{
+public:
+    QtEvTimer(EventLoopCoroutinePrivateQtEv *parent)
+        :parent(parent), timerId(0) {}
+    void start(qint64 msecs);
+    void stop();
+protected:
+    virtual void timerEvent(QTimerEvent *event) override;
+private:
+    EventLoopCoroutinePrivateQtEv * const parent;
+    int timerId;
+};
+
+
+// libev runs in Qt eventloop: the epoll or kqueue fd of libev is watched by one QSocketNotifier, and the wheel
+// timer by one Qt timer, whatever the number of sockets is. either of them runs one nonblocking iteration of libev.
+class EventLoopCoroutinePrivateQtEv: public EventLoopCoroutinePrivateEv
+{
+public:
+    EventLoopCoroutinePrivateQtEv(EventLoopCoroutine *parent);
+    virtual ~EventLoopCoroutinePrivateQtEv() override;
+public:
+    virtual void run() override;
+    virtual void startWatcher(qint64 watcherId) override;
+    virtual int exitCode() override;
+    virtual bool runUntil(BaseCoroutine *coroutine) override;
+public:
+    bool isValid() const { return notifier != nullptr; }
+    void dispatch();
+protected:
+    virtual void wheelTimerArmed() override;
+private:
+    void rearm();
+private:
+    QtEvNotifier *notifier;
+    QtEvTimer *timer;
+    int qtExitCode;
+    bool dispatching;
+    bool dirty;             // libev applies the started io watchers in its next iteration.
+    friend int startQtEvLoop(QtEvEventLoopCoroutine *eventLoop);
+};
+
+
+bool QtEvNotifier::event(QEvent *e)
+{
+    if (e->type() == QEvent::SockAct) {
+        parent->dispatch();
+        return true;
+    }
+    return QSocketNotifier::event(e);
+}
+
+
+void QtEvTimer::start(qint64 msecs)
+{
+    stop();
+    timerId = startTimer(static_cast<int>(qMin<qint64>(msecs, 0x7fffffff)), Qt::PreciseTimer);
+}
+
+
+void QtEvTimer::stop()
+{
+    if (timerId) {
+        killTimer(timerId);
+        timerId = 0;
+    }
+}
+
+
+void QtEvTimer::timerEvent(QTimerEvent *)
+{
+    stop();
+    parent->dispatch();
+}
+
+
+EventLoopCoroutinePrivateQtEv::EventLoopCoroutinePrivateQtEv(EventLoopCoroutine *parent)
+    :EventLoopCoroutinePrivateEv(parent, EVBACKEND_EPOLL | EVBACKEND_KQUEUE), notifier(nullptr), timer(nullptr)
+    , qtExitCode(0), dispatching(false), dirty(false)
+{
+    // the nonblocking iterations are not polls, the dispatcher of Qt records them instead.
+    ev_ref(loop);
+    ev_prepare_stop(loop, &prepareContext);
+    ev_ref(loop);
+    ev_check_stop(loop, &checkContext);
+    const int fd = ev_backend_fd(loop);
+    if (fd < 0) {
+        return;
+    }
+    notifier = new QtEvNotifier(fd, this);
+    timer = new QtEvTimer(this);
+    QAbstractEventDispatcher *dispatcher = QAbstractEventDispatcher::instance();
+    if (dispatcher) {
+        QObject::connect(dispatcher, &QAbstractEventDispatcher::aboutToBlock, timer, [this] { recorder.beforePoll(); },
+                         Qt::DirectConnection);
+        QObject::connect(dispatcher, &QAbstractEventDispatcher::awake, timer, [this] { recorder.afterPoll(); },
+                         Qt::DirectConnection);
+    }
+    // the watchers of ev_async and so on are not applied to the fd before the first iteration.
+    dirty = true;
+    timer->start(0);
+}
+
+
+EventLoopCoroutinePrivateQtEv::~EventLoopCoroutinePrivateQtEv()
+{
+    delete notifier;
+    delete timer;
+}
+
+
+void EventLoopCoroutinePrivateQtEv::dispatch()
+{
+    if (dispatching) {
+        return;
+    }
+    dispatching = true;
+    dirty = false;
+    ev_run(loop, EVRUN_NOWAIT);
+    dispatching = false;
+    rearm();
+}
+
+
+void EventLoopCoroutinePrivateQtEv::rearm()
+{
+    if (!timer) {
+        return;
+    }
+    if (dirty) {
+        timer->start(0);
+    } else if (ev_is_active(&wheelTimer)) {
+        const quint64 now = static_cast<quint64>(clock.elapsed());
+        timer->start(armedTick > now ? static_cast<qint64>(armedTick - now) : 0);
+    } else {
+        timer->stop();
+    }
+}
+
+
+void EventLoopCoroutinePrivateQtEv::wheelTimerArmed()
+{
+    // the wheel timer of libev is relative to the time of its last iteration, update it for the calls from Qt.
+    if (!dispatching) {
+        ev_now_update(loop);
+        rearm();
+    }
+}
+
+
+void EventLoopCoroutinePrivateQtEv::startWatcher(qint64 watcherId)
+{
+    EventLoopCoroutinePrivateEv::startWatcher(watcherId);
+    dirty = true;
+    if (!dispatching && timer) {
+        timer->start(0);
+    }
+}
+
+
+void EventLoopCoroutinePrivateQtEv::run()
+{
+    QEventLoop localLoop;
+    qtExitCode = localLoop.exec();
+}
+
+
+int EventLoopCoroutinePrivateQtEv::exitCode()
+{
+    return qtExitCode;
+}
+
+
+bool EventLoopCoroutinePrivateQtEv::runUntil(BaseCoroutine *coroutine)
+{
+    QPointer<BaseCoroutine> current = BaseCoroutine::current();
+    if (!loopCoroutine.isNull() && loopCoroutine != current) {
+        Deferred<BaseCoroutine*>::Callback here = [current] (BaseCoroutine *) {
+            if (!current.isNull()) {
+                current->yield();
+            }
+        };
+        coroutine->finished.addCallback(here);
+        loopCoroutine->yield();
+    } else {
+        QPointer<BaseCoroutine> old = loopCoroutine;
+        loopCoroutine = current;
+        QSharedPointer<QEventLoop> sub(new QEventLoop());
+        Deferred<BaseCoroutine*>::Callback shutdown = [this, sub] (BaseCoroutine *) {
+            sub->exit();
+            if (!loopCoroutine.isNull()) {
+                loopCoroutine->yield();
+            }
+        };
+        coroutine->finished.addCallback(shutdown);
+        // the nested loop may be entered from a callback of libev.
+        const bool wasDispatching = dispatching;
+        dispatching = false;
+        sub->exec();
+        dispatching = wasDispatching;
+        loopCoroutine = old;
+    }
+    return true;
+}
+
+
+QtEvEventLoopCoroutine::QtEvEventLoopCoroutine()
+    :EventLoopCoroutine(new EventLoopCoroutinePrivateQtEv(this))
+{
+}
+
+
+bool QtEvEventLoopCoroutine::isValid() const
+{
+    const EventLoopCoroutinePrivateQtEv *d = static_cast<const EventLoopCoroutinePrivateQtEv*>(d_func());
+    return d->isValid();
+}
+
+
+int startQtEvLoop(QtEvEventLoopCoroutine *eventLoop)
+{
+    EventLoopCoroutinePrivateQtEv *d = static_cast<EventLoopCoroutinePrivateQtEv*>(
+                EventLoopCoroutinePrivateQtEv::getPrivateHelper(eventLoop));
+    d->loopCoroutine = BaseCoroutine::current();
+    int result = QCoreApplication::instance()->exec();
+    d->loopCoroutine.clear();
+    return result;
+}
+
 QTNETWORKNG_NAMESPACE_END
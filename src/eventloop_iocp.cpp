@@ -0,0 +1,745 @@
+#include <QtCore/qvector.h>
+#include <QtCore/qmap.h>
+#include <QtCore/qpointer.h>
+#include <QtCore/qdebug.h>
+#include <QtCore/qelapsedtimer.h>
+#include <winsock2.h>
+#include <windows.h>
+#include <winternl.h>
+#include "../include/private/eventloop_p.h"
+
+// the iocp eventloop polls the sockets by IOCTL_AFD_POLL, the readiness request of the afd driver behind winsock, which
+// completes to an io completion port like any overlapped operation. so one GetQueuedCompletionStatusEx() call waits
+// for any number of sockets, while select() of the Qt eventloop is limited to FD_SETSIZE and scans them all. the
+// watchers keep their readiness semantics, so the sockets work as before, without the overlapped buffers.
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+#ifndef STATUS_PENDING
+#define STATUS_PENDING ((NTSTATUS) 0x00000103L)
+#endif
+#ifndef STATUS_CANCELLED
+#define STATUS_CANCELLED ((NTSTATUS) 0xC0000120L)
+#endif
+#ifndef SIO_BASE_HANDLE
+#define SIO_BASE_HANDLE _WSAIOR(IOC_WS2, 34)
+#endif
+
+#define IOCTL_AFD_POLL 0x00012024
+
+enum AfdPollEvent {
+    AfdPollReceive = 0x0001,
+    AfdPollReceiveExpedited = 0x0002,
+    AfdPollSend = 0x0004,
+    AfdPollDisconnect = 0x0008,
+    AfdPollAbort = 0x0010,
+    AfdPollLocalClose = 0x0020,
+    AfdPollAccept = 0x0080,
+    AfdPollConnectFail = 0x0100,
+};
+
+struct AfdPollHandleInfo
+{
+    HANDLE handle;
+    ULONG events;
+    NTSTATUS status;
+};
+
+struct AfdPollInfo
+{
+    LARGE_INTEGER timeout;
+    ULONG numberOfHandles;
+    ULONG exclusive;
+    AfdPollHandleInfo handles[1];
+};
+
+typedef NTSTATUS (NTAPI *NtCreateFileFunction)(PHANDLE, ACCESS_MASK, POBJECT_ATTRIBUTES, PIO_STATUS_BLOCK,
+                                               PLARGE_INTEGER, ULONG, ULONG, ULONG, ULONG, PVOID, ULONG);
+typedef NTSTATUS (NTAPI *NtDeviceIoControlFileFunction)(HANDLE, HANDLE, PVOID, PVOID, PIO_STATUS_BLOCK, ULONG,
+                                                        PVOID, ULONG, PVOID, ULONG);
+typedef NTSTATUS (NTAPI *NtCancelIoFileExFunction)(HANDLE, PIO_STATUS_BLOCK, PIO_STATUS_BLOCK);
+
+
+struct NtFunctions
+{
+    NtFunctions();
+    bool isValid() const { return createFile && deviceIoControlFile && cancelIoFileEx; }
+    NtCreateFileFunction createFile;
+    NtDeviceIoControlFileFunction deviceIoControlFile;
+    NtCancelIoFileExFunction cancelIoFileEx;
+};
+
+
+NtFunctions::NtFunctions()
+    :createFile(nullptr), deviceIoControlFile(nullptr), cancelIoFileEx(nullptr)
+{
+    // the functions are not in the import library of ntdll shipped by mingw, so look them up.
+    HMODULE ntdll = GetModuleHandleW(L"ntdll.dll");
+    if (!ntdll) {
+        return;
+    }
+    createFile = reinterpret_cast<NtCreateFileFunction>(
+                reinterpret_cast<void *>(GetProcAddress(ntdll, "NtCreateFile")));
+    deviceIoControlFile = reinterpret_cast<NtDeviceIoControlFileFunction>(
+                reinterpret_cast<void *>(GetProcAddress(ntdll, "NtDeviceIoControlFile")));
+    cancelIoFileEx = reinterpret_cast<NtCancelIoFileExFunction>(
+                reinterpret_cast<void *>(GetProcAddress(ntdll, "NtCancelIoFileEx")));
+}
+
+
+Q_GLOBAL_STATIC(NtFunctions, ntFunctions)
+
+
+// the memory of poll request is owned by the kernel until it completes, so it is not in the vector of watchers,
+// which may move. a request of removed watcher is orphaned, and freed by its completion.
+struct IocpPollRequest
+{
+    IO_STATUS_BLOCK iosb;   // the first member, its address is the OVERLAPPED of completion.
+    AfdPollInfo info;
+    qint64 watcherId;
+    bool orphaned;
+};
+
+
+struct IocpWatcher
+{
+    enum Type {
+        Free = 0,
+        Io = 1,
+        Timer = 2,
+    };
+    Functor *callback;
+    QMultiMap<qint64, qint64>::iterator timerPos;
+    qint64 interval;    // nanoseconds, zero for single shot timers.
+    IocpPollRequest *request;
+    HANDLE baseSocket;
+    qint64 watcherId;   // the generation in the high half, the index in the low half.
+    int nextFree;
+    qintptr fd;
+    ULONG pollEvents;
+    quint32 generation;
+    quint8 type;
+    bool active;        // io watcher is started.
+    bool pending;       // poll is submitted but not completed.
+};
+
+
+// the completion key of the wakeups posted by callLaterThreadSafe(), the afd handle completes with zero.
+static const ULONG_PTR WakeupKey = 1;
+
+
+class EventLoopCoroutinePrivateIocp: public EventLoopCoroutinePrivate
+{
+public:
+    EventLoopCoroutinePrivateIocp(EventLoopCoroutine* parent);
+    virtual ~EventLoopCoroutinePrivateIocp() override;
+public:
+    virtual void run() override;
+    virtual qint64 createWatcher(EventLoopCoroutine::EventType event, qintptr fd, Functor *callback) override;
+    virtual void startWatcher(qint64 watcherId) override;
+    virtual void stopWatcher(qint64 watcherId) override;
+    virtual void removeWatcher(qint64 watcherId) override;
+    virtual void triggerIoWatchers(qintptr fd) override;
+    virtual qint64 callLater(quint32 msecs, Functor *callback) override;
+    virtual qint64 callRepeat(quint32 msecs, Functor *callback) override;
+    virtual void callLaterThreadSafe(quint32 msecs, Functor *callback) override;
+    virtual void callLaterThreadSafe(quint32 msecs, const QList<Functor*> &callbacks) override;
+    virtual void cancelCall(qint64 callbackId) override;
+    virtual int exitCode() override;
+    virtual bool runUntil(BaseCoroutine *coroutine) override;
+    virtual void yield() override;
+    virtual void fillMetrics(EventLoopMetrics *metrics) override;
+public:
+    bool isValid() const { return iocp != nullptr && afd != INVALID_HANDLE_VALUE; }
+private:
+    IocpWatcher *allocate(IocpWatcher::Type type);
+    IocpWatcher *lookup(qint64 watcherId, IocpWatcher::Type type);
+    void release(IocpWatcher *watcher);
+    void submitPoll(IocpWatcher *watcher);
+    void cancelPoll(IocpWatcher *watcher);
+    void handleCompletion(const OVERLAPPED_ENTRY &entry);
+    void runTimers();
+    void doCallLater();
+    void wakeup();
+    void loop(const int *breakFlag);
+    qint64 addTimer(qint64 delayNs, qint64 interval, Functor *callback);
+    qint64 now() const { return clock.nsecsElapsed(); }
+private:
+    enum {
+        MaxWatchers = 1 << 22,
+        GenerationMask = 0x7fffffff,
+    };
+    HANDLE iocp;
+    HANDLE afd;
+    QElapsedTimer clock;
+    QVector<IocpWatcher> watchers;
+    QMultiMap<qint64, qint64> timers;
+    int firstFree;      // the freed slots are reused first in first out.
+    int lastFree;
+    int pendingPolls;   // including the orphaned ones, the eventloop waits for them before closing the port.
+    QAtomicInt wakeupPosted;
+    ThreadSafeCallQueue callLaterQueue;
+    QPointer<BaseCoroutine> loopCoroutine;
+    int breakLoop;
+    Q_DECLARE_PUBLIC(EventLoopCoroutine)
+    friend struct IocpTriggerIoWatchersFunctor;
+};
+
+
+EventLoopCoroutinePrivateIocp::EventLoopCoroutinePrivateIocp(EventLoopCoroutine *parent)
+    :EventLoopCoroutinePrivate(parent), iocp(nullptr), afd(INVALID_HANDLE_VALUE), firstFree(-1), lastFree(-1), pendingPolls(0)
+    , breakLoop(0)
+{
+    clock.start();
+    NtFunctions *nt = ntFunctions();
+    if (!nt->isValid()) {
+        return;
+    }
+    iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+    if (!iocp) {
+        return;
+    }
+    // every eventloop opens its own afd handle, the name after \Device\Afd is ignored by the driver.
+    static const wchar_t afdName[] = L"\\Device\\Afd\\QtNetworkNg";
+    UNICODE_STRING name;
+    name.Length = sizeof(afdName) - sizeof(wchar_t);
+    name.MaximumLength = sizeof(afdName);
+    name.Buffer = const_cast<PWSTR>(afdName);
+    OBJECT_ATTRIBUTES attributes;
+    InitializeObjectAttributes(&attributes, &name, 0, nullptr, nullptr);
+    IO_STATUS_BLOCK iosb;
+    HANDLE h;
+    NTSTATUS status = nt->createFile(&h, SYNCHRONIZE, &attributes, &iosb, nullptr, 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                     FILE_OPEN, 0, nullptr, 0);
+    if (status != 0) {
+        return;
+    }
+    if (!CreateIoCompletionPort(h, iocp, 0, 0) || !SetFileCompletionNotificationModes(h, FILE_SKIP_SET_EVENT_ON_HANDLE)) {
+        CloseHandle(h);
+        return;
+    }
+    afd = h;
+}
+
+
+EventLoopCoroutinePrivateIocp::~EventLoopCoroutinePrivateIocp()
+{
+    for (IocpWatcher &watcher: watchers) {
+        if (watcher.type == IocpWatcher::Free) {
+            continue;
+        }
+        if (watcher.pending) {
+            watcher.request->orphaned = true;
+            cancelPoll(&watcher);
+        } else {
+            delete watcher.request;
+        }
+        delete watcher.callback;
+    }
+    // the kernel writes to the requests until they complete.
+    while (pendingPolls > 0 && iocp) {
+        OVERLAPPED_ENTRY entries[64];
+        ULONG count = 0;
+        if (!GetQueuedCompletionStatusEx(iocp, entries, 64, &count, 1000, FALSE)) {
+            qWarning("the iocp eventloop leaks %d poll requests.", pendingPolls);
+            break;
+        }
+        for (ULONG i = 0; i < count; ++i) {
+            if (entries[i].lpCompletionKey != WakeupKey) {
+                delete reinterpret_cast<IocpPollRequest *>(entries[i].lpOverlapped);
+                --pendingPolls;
+            }
+        }
+    }
+    if (afd != INVALID_HANDLE_VALUE) {
+        CloseHandle(afd);
+    }
+    if (iocp) {
+        CloseHandle(iocp);
+    }
+}
+
+
+IocpWatcher *EventLoopCoroutinePrivateIocp::allocate(IocpWatcher::Type type)
+{
+    if (firstFree < 0) {
+        if (watchers.size() >= MaxWatchers) {
+            qWarning("too many watchers in iocp eventloop.");
+            return nullptr;
+        }
+        IocpWatcher empty;
+        empty.callback = nullptr;
+        empty.timerPos = timers.end();
+        empty.interval = 0;
+        empty.request = nullptr;
+        empty.baseSocket = INVALID_HANDLE_VALUE;
+        empty.watcherId = 0;
+        empty.nextFree = -1;
+        empty.fd = -1;
+        empty.pollEvents = 0;
+        empty.generation = 0;
+        empty.type = IocpWatcher::Free;
+        empty.active = false;
+        empty.pending = false;
+        watchers.append(empty);
+        firstFree = lastFree = watchers.size() - 1;
+    }
+    int index = firstFree;
+    IocpWatcher *watcher = &watchers[index];
+    firstFree = watcher->nextFree;
+    if (firstFree < 0) {
+        lastFree = -1;
+    }
+    watcher->generation = (watcher->generation % GenerationMask) + 1;
+    watcher->type = static_cast<quint8>(type);
+    watcher->nextFree = -1;
+    watcher->callback = nullptr;
+    watcher->interval = 0;
+    watcher->request = nullptr;
+    watcher->baseSocket = INVALID_HANDLE_VALUE;
+    watcher->fd = -1;
+    watcher->pollEvents = 0;
+    watcher->active = false;
+    watcher->pending = false;
+    watcher->timerPos = timers.end();
+    watcher->watcherId = (static_cast<qint64>(watcher->generation) << 32) | index;
+    return watcher;
+}
+
+
+IocpWatcher *EventLoopCoroutinePrivateIocp::lookup(qint64 watcherId, IocpWatcher::Type type)
+{
+    if (watcherId <= 0) {
+        return nullptr;
+    }
+    int index = static_cast<int>(watcherId & 0xffffffff);
+    if (index >= watchers.size()) {
+        return nullptr;
+    }
+    IocpWatcher *watcher = &watchers[index];
+    if (watcher->type != type || watcher->watcherId != watcherId) {
+        return nullptr;
+    }
+    return watcher;
+}
+
+
+void EventLoopCoroutinePrivateIocp::release(IocpWatcher *watcher)
+{
+    Functor *callback = watcher->callback;
+    int index = static_cast<int>(watcher->watcherId & 0xffffffff);
+    if (watcher->type == IocpWatcher::Timer && watcher->timerPos != timers.end()) {
+        timers.erase(watcher->timerPos);
+    }
+    if (watcher->request) {
+        if (watcher->pending) {
+            watcher->request->orphaned = true;
+        } else {
+            delete watcher->request;
+        }
+    }
+    watcher->request = nullptr;
+    watcher->timerPos = timers.end();
+    watcher->type = IocpWatcher::Free;
+    watcher->callback = nullptr;
+    watcher->watcherId = 0;
+    watcher->nextFree = -1;
+    if (lastFree < 0) {
+        firstFree = index;
+    } else {
+        watchers[lastFree].nextFree = index;
+    }
+    lastFree = index;
+    // the destructor of callback may create or remove watchers, do not touch `watcher` after this line.
+    delete callback;
+}
+
+
+void EventLoopCoroutinePrivateIocp::submitPoll(IocpWatcher *watcher)
+{
+    if (!watcher->request) {
+        watcher->request = new IocpPollRequest;
+        watcher->request->watcherId = watcher->watcherId;
+        watcher->request->orphaned = false;
+    }
+    IocpPollRequest *request = watcher->request;
+    memset(&request->iosb, 0, sizeof(request->iosb));
+    request->iosb.Status = STATUS_PENDING;
+    request->info.timeout.QuadPart = Q_INT64_C(0x7fffffffffffffff);
+    request->info.numberOfHandles = 1;
+    request->info.exclusive = FALSE;
+    request->info.handles[0].handle = watcher->baseSocket;
+    request->info.handles[0].events = watcher->pollEvents;
+    request->info.handles[0].status = 0;
+    NTSTATUS status = ntFunctions()->deviceIoControlFile(afd, nullptr, nullptr, request, &request->iosb, IOCTL_AFD_POLL,
+                                                         &request->info, sizeof(request->info),
+                                                         &request->info, sizeof(request->info));
+    if (status != 0 && status != STATUS_PENDING) {
+        qWarning("IOCTL_AFD_POLL returns error: 0x%lx", static_cast<unsigned long>(status));
+        return;
+    }
+    // the completion is queued to the port even if it succeeds at once.
+    watcher->pending = true;
+    ++pendingPolls;
+}
+
+
+void EventLoopCoroutinePrivateIocp::cancelPoll(IocpWatcher *watcher)
+{
+    IO_STATUS_BLOCK cancelIosb;
+    // completes with STATUS_CANCELLED, or with the events if it was done already. both are queued.
+    ntFunctions()->cancelIoFileEx(afd, &watcher->request->iosb, &cancelIosb);
+}
+
+
+qint64 EventLoopCoroutinePrivateIocp::createWatcher(EventLoopCoroutine::EventType event, qintptr fd, Functor *callback)
+{
+    // the layered service providers wrap the socket, but afd polls the base one.
+    SOCKET baseSocket = INVALID_SOCKET;
+    DWORD bytes = 0;
+    if (WSAIoctl(static_cast<SOCKET>(fd), SIO_BASE_HANDLE, nullptr, 0, &baseSocket, sizeof(baseSocket), &bytes,
+                 nullptr, nullptr) == SOCKET_ERROR) {
+        baseSocket = static_cast<SOCKET>(fd);
+    }
+    IocpWatcher *watcher = allocate(IocpWatcher::Io);
+    if (!watcher) {
+        delete callback;
+        return 0;
+    }
+    // the errors and hangups wake up both directions, as poll() does.
+    ULONG events = AfdPollDisconnect | AfdPollAbort | AfdPollLocalClose | AfdPollConnectFail;
+    if (event & EventLoopCoroutine::Read) {
+        events |= AfdPollReceive | AfdPollReceiveExpedited | AfdPollAccept;
+    }
+    if (event & EventLoopCoroutine::Write) {
+        events |= AfdPollSend;
+    }
+    watcher->fd = fd;
+    watcher->baseSocket = reinterpret_cast<HANDLE>(baseSocket);
+    watcher->pollEvents = events;
+    watcher->callback = callback;
+    return watcher->watcherId;
+}
+
+
+void EventLoopCoroutinePrivateIocp::startWatcher(qint64 watcherId)
+{
+    IocpWatcher *watcher = lookup(watcherId, IocpWatcher::Io);
+    if (!watcher) {
+        return;
+    }
+    watcher->active = true;
+    if (!watcher->pending) {
+        submitPoll(watcher);
+    }
+}
+
+
+void EventLoopCoroutinePrivateIocp::stopWatcher(qint64 watcherId)
+{
+    IocpWatcher *watcher = lookup(watcherId, IocpWatcher::Io);
+    if (!watcher) {
+        return;
+    }
+    watcher->active = false;
+    if (watcher->pending) {
+        cancelPoll(watcher);
+    }
+}
+
+
+void EventLoopCoroutinePrivateIocp::removeWatcher(qint64 watcherId)
+{
+    IocpWatcher *watcher = lookup(watcherId, IocpWatcher::Io);
+    if (!watcher) {
+        return;
+    }
+    if (watcher->pending) {
+        cancelPoll(watcher);
+    }
+    release(watcher);
+}
+
+
+struct IocpTriggerIoWatchersFunctor: public Functor
+{
+    IocpTriggerIoWatchersFunctor(qint64 watcherId, EventLoopCoroutinePrivateIocp *eventloop)
+        :eventloop(eventloop), watcherId(watcherId) {}
+    EventLoopCoroutinePrivateIocp *eventloop;
+    qint64 watcherId;
+    virtual void operator()() override
+    {
+        IocpWatcher *watcher = eventloop->lookup(watcherId, IocpWatcher::Io);
+        if (watcher) {
+            (*watcher->callback)();
+        }
+    }
+};
+
+
+void EventLoopCoroutinePrivateIocp::triggerIoWatchers(qintptr fd)
+{
+    for (int i = 0; i < watchers.size(); ++i) {
+        IocpWatcher *watcher = &watchers[i];
+        if (watcher->type == IocpWatcher::Io && watcher->fd == fd) {
+            qint64 watcherId = watcher->watcherId;
+            stopWatcher(watcherId);
+            callLater(0, new IocpTriggerIoWatchersFunctor(watcherId, this));
+        }
+    }
+}
+
+
+qint64 EventLoopCoroutinePrivateIocp::addTimer(qint64 delayNs, qint64 interval, Functor *callback)
+{
+    IocpWatcher *watcher = allocate(IocpWatcher::Timer);
+    if (!watcher) {
+        delete callback;
+        return 0;
+    }
+    watcher->callback = callback;
+    watcher->interval = interval;
+    watcher->timerPos = timers.insert(now() + delayNs, watcher->watcherId);
+    return watcher->watcherId;
+}
+
+
+qint64 EventLoopCoroutinePrivateIocp::callLater(quint32 msecs, Functor *callback)
+{
+    return addTimer(static_cast<qint64>(msecs) * 1000 * 1000, 0, callback);
+}
+
+
+qint64 EventLoopCoroutinePrivateIocp::callRepeat(quint32 msecs, Functor *callback)
+{
+    qint64 interval = qMax<qint64>(static_cast<qint64>(msecs) * 1000 * 1000, 1);
+    return addTimer(0, interval, callback);
+}
+
+
+void EventLoopCoroutinePrivateIocp::cancelCall(qint64 callbackId)
+{
+    IocpWatcher *watcher = lookup(callbackId, IocpWatcher::Timer);
+    if (watcher) {
+        release(watcher);
+    }
+}
+
+
+void EventLoopCoroutinePrivateIocp::callLaterThreadSafe(quint32 msecs, Functor *callback)
+{
+    if (callLaterQueue.push(msecs, callback)) {
+        wakeup();
+    }
+}
+
+
+void EventLoopCoroutinePrivateIocp::callLaterThreadSafe(quint32 msecs, const QList<Functor*> &callbacks)
+{
+    if (callLaterQueue.push(msecs, callbacks)) {
+        wakeup();
+    }
+}
+
+
+void EventLoopCoroutinePrivateIocp::wakeup()
+{
+    // one wakeup in the port is enough, doCallLater() takes all calls.
+    if (wakeupPosted.testAndSetOrdered(0, 1)) {
+        PostQueuedCompletionStatus(iocp, 0, WakeupKey, nullptr);
+    }
+}
+
+
+void EventLoopCoroutinePrivateIocp::doCallLater()
+{
+    wakeupPosted.storeRelease(0);
+    ThreadSafeCallQueue::Node *node = callLaterQueue.takeAll();
+    while (node) {
+        ThreadSafeCallQueue::Node *next = node->next;
+        callLater(node->msecs, node->callback);
+        delete node;
+        node = next;
+    }
+}
+
+
+void EventLoopCoroutinePrivateIocp::handleCompletion(const OVERLAPPED_ENTRY &entry)
+{
+    if (entry.lpCompletionKey == WakeupKey) {
+        doCallLater();
+        return;
+    }
+    IocpPollRequest *request = reinterpret_cast<IocpPollRequest *>(entry.lpOverlapped);
+    if (!request) {
+        return;
+    }
+    --pendingPolls;
+    if (request->orphaned) {
+        delete request;
+        return;
+    }
+    const qint64 watcherId = request->watcherId;
+    IocpWatcher *watcher = lookup(watcherId, IocpWatcher::Io);
+    if (!watcher) {
+        return;
+    }
+    watcher->pending = false;
+    if (!watcher->active) {
+        return;
+    }
+    if (request->iosb.Status == STATUS_CANCELLED || request->info.numberOfHandles < 1
+            || request->info.handles[0].events == 0) {
+        // stopped and restarted before the cancellation is completed.
+        submitPoll(watcher);
+        return;
+    }
+    (*watcher->callback)();
+    // keep the same semantics as libev, an io watcher keeps active until it is stopped.
+    watcher = lookup(watcherId, IocpWatcher::Io);
+    if (watcher && watcher->active && !watcher->pending) {
+        submitPoll(watcher);
+    }
+}
+
+
+void EventLoopCoroutinePrivateIocp::runTimers()
+{
+    const qint64 t = now();
+    // take the expired timers first, the callbacks may add timers which should not run in this iteration.
+    QVector<qint64> expired;
+    for (QMultiMap<qint64, qint64>::const_iterator itor = timers.constBegin(); itor != timers.constEnd() && itor.key() <= t; ++itor) {
+        expired.append(itor.value());
+    }
+    for (qint64 watcherId: expired) {
+        IocpWatcher *watcher = lookup(watcherId, IocpWatcher::Timer);
+        if (!watcher) {
+            continue;
+        }
+        timers.erase(watcher->timerPos);
+        watcher->timerPos = timers.end();
+        if (watcher->interval > 0) {
+            watcher->timerPos = timers.insert(t + watcher->interval, watcherId);
+            (*watcher->callback)();
+        } else {
+            (*watcher->callback)();
+            cancelCall(watcherId);
+        }
+    }
+}
+
+
+void EventLoopCoroutinePrivateIocp::loop(const int *breakFlag)
+{
+    OVERLAPPED_ENTRY entries[256];
+    while (!*breakFlag) {
+        runTimers();
+        if (*breakFlag) {
+            break;
+        }
+        DWORD timeout = INFINITE;
+        if (!timers.isEmpty()) {
+            // rounds up, or the timer of less than 1ms spins.
+            const qint64 ns = qMax<qint64>(timers.constBegin().key() - now(), 0);
+            timeout = static_cast<DWORD>(qMin<qint64>((ns + 999999) / 1000000, INFINITE - 1));
+        }
+        ULONG count = 0;
+        recorder.beforePoll();
+        BOOL ok = GetQueuedCompletionStatusEx(iocp, entries, sizeof(entries) / sizeof(entries[0]), &count, timeout, FALSE);
+        recorder.afterPoll();
+        if (!ok) {
+            if (GetLastError() != WAIT_TIMEOUT) {
+                qWarning("GetQueuedCompletionStatusEx() returns error: %lu", GetLastError());
+            }
+            continue;
+        }
+        for (ULONG i = 0; i < count; ++i) {
+            handleCompletion(entries[i]);
+        }
+    }
+}
+
+
+void EventLoopCoroutinePrivateIocp::run()
+{
+    int neverBreak = 0;
+    try {
+        loop(&neverBreak);
+    } catch (...) {
+        qWarning("iocp eventloop got exception.");
+    }
+}
+
+
+void EventLoopCoroutinePrivateIocp::fillMetrics(EventLoopMetrics *metrics)
+{
+    for (const IocpWatcher &watcher: watchers) {
+        if (watcher.type == IocpWatcher::Io) {
+            ++metrics->ioWatchers;
+        } else if (watcher.type == IocpWatcher::Timer) {
+            ++metrics->timers;
+        }
+    }
+    metrics->pendingThreadSafeCalls = static_cast<quint32>(callLaterQueue.size());
+}
+
+
+int EventLoopCoroutinePrivateIocp::exitCode()
+{
+    return 0;
+}
+
+
+bool EventLoopCoroutinePrivateIocp::runUntil(BaseCoroutine *coroutine)
+{
+    QPointer<BaseCoroutine> current = BaseCoroutine::current();
+    if (!loopCoroutine.isNull() && loopCoroutine != current) {
+        Deferred<BaseCoroutine*>::Callback here = [current] (BaseCoroutine *) {
+            if (!current.isNull()) {
+                current->yield();
+            }
+        };
+        coroutine->finished.addCallback(here);
+        loopCoroutine->yield();
+    } else {
+        QPointer<BaseCoroutine> old = loopCoroutine;
+        loopCoroutine = current;
+        QSharedPointer<int> breakFlag(new int(0));
+        Deferred<BaseCoroutine*>::Callback exitOneDepth = [this, breakFlag] (BaseCoroutine *) {
+            *breakFlag = 1;
+            if (!loopCoroutine.isNull()) {
+                loopCoroutine->yield();
+            }
+        };
+        coroutine->finished.addCallback(exitOneDepth);
+        loop(breakFlag.data());
+        loopCoroutine = old;
+    }
+    return true;
+}
+
+
+void EventLoopCoroutinePrivateIocp::yield()
+{
+    Q_Q(EventLoopCoroutine);
+    if (!loopCoroutine.isNull()) {
+        loopCoroutine->yield();
+    } else {
+        q->BaseCoroutine::yield();
+    }
+}
+
+
+IocpEventLoopCoroutine::IocpEventLoopCoroutine()
+    :EventLoopCoroutine(new EventLoopCoroutinePrivateIocp(this))
+{
+}
+
+
+bool IocpEventLoopCoroutine::isValid() const
+{
+    const EventLoopCoroutinePrivateIocp *d = static_cast<const EventLoopCoroutinePrivateIocp*>(d_func());
+    return d->isValid();
+}
+
+QTNETWORKNG_NAMESPACE_END
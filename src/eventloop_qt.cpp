@@ -7,6 +7,7 @@
 #include <QtCore/qtimer.h>
 #include <QtCore/qpointer.h>
 #include <QtCore/qcoreevent.h>
+#include <QtCore/qabstracteventdispatcher.h>
 
 #include "../include/private/eventloop_p.h"
 
@@ -75,25 +76,26 @@ public:
     virtual ~EventLoopCoroutinePrivateQt() override;
 public:
     virtual void run() override;
-    virtual int createWatcher(EventLoopCoroutine::EventType event, qintptr fd, Functor *callback) override;
-    virtual void startWatcher(int watcherId) override;
-    virtual void stopWatcher(int watcherId) override;
-    virtual void removeWatcher(int watcherId) override;
+    virtual qint64 createWatcher(EventLoopCoroutine::EventType event, qintptr fd, Functor *callback) override;
+    virtual void startWatcher(qint64 watcherId) override;
+    virtual void stopWatcher(qint64 watcherId) override;
+    virtual void removeWatcher(qint64 watcherId) override;
     virtual void triggerIoWatchers(qintptr fd) override;
-    virtual int callLater(quint32 msecs, Functor *callback) override;
+    virtual qint64 callLater(quint32 msecs, Functor *callback) override;
     virtual void callLaterThreadSafe(quint32 msecs, Functor *callback) override;
-    virtual int callRepeat(quint32 msecs, Functor *callback) override;
-    virtual void cancelCall(int callbackId) override;
+    virtual qint64 callRepeat(quint32 msecs, Functor *callback) override;
+    virtual void cancelCall(qint64 callbackId) override;
     virtual int exitCode() override;
     virtual bool runUntil(BaseCoroutine *coroutine) override;
     virtual void yield() override;
+    virtual void fillMetrics(EventLoopMetrics *metrics) override;
 public:
     void timerEvent(QTimerEvent *event);
     void handleIoEvent(int socket, QSocketNotifier *n);
 private:
-    QMap<int, QtWatcher*> watchers;
-    QMap<int, int> timers;
-    int nextWatcherId;
+    QMap<qint64, QtWatcher*> watchers;
+    QMap<int, qint64> timers;
+    qint64 nextWatcherId;   // never reused.
     int qtExitCode;
     QPointer<BaseCoroutine> loopCoroutine;
     EventLoopCoroutinePrivateQtHelper *helper;
@@ -133,6 +135,16 @@ public slots:
         QSocketNotifier *n = dynamic_cast<QSocketNotifier*>(sender());
         parent->handleIoEvent(socket, n);
     }
+
+    void aboutToBlock()
+    {
+        parent->recorder.beforePoll();
+    }
+
+    void awake()
+    {
+        parent->recorder.afterPoll();
+    }
 private:
     EventLoopCoroutinePrivateQt * const parent;
 };
@@ -141,6 +153,11 @@ private:
 EventLoopCoroutinePrivateQt::EventLoopCoroutinePrivateQt(EventLoopCoroutine *q)
     :EventLoopCoroutinePrivate(q), nextWatcherId(1), helper(new EventLoopCoroutinePrivateQtHelper(this))
 {
+    QAbstractEventDispatcher *dispatcher = QAbstractEventDispatcher::instance();
+    if(dispatcher) {
+        QObject::connect(dispatcher, SIGNAL(aboutToBlock()), helper, SLOT(aboutToBlock()), Qt::DirectConnection);
+        QObject::connect(dispatcher, SIGNAL(awake()), helper, SLOT(awake()), Qt::DirectConnection);
+    }
 }
 
 EventLoopCoroutinePrivateQt::~EventLoopCoroutinePrivateQt()
@@ -171,14 +188,14 @@ void EventLoopCoroutinePrivateQt::handleIoEvent(int socket, QSocketNotifier *n)
     (*w->callback)();
 }
 
-int EventLoopCoroutinePrivateQt::createWatcher(EventLoopCoroutine::EventType event, qintptr fd, Functor *callback)
+qint64 EventLoopCoroutinePrivateQt::createWatcher(EventLoopCoroutine::EventType event, qintptr fd, Functor *callback)
 {
     IoWatcher *w = new IoWatcher(fd, event, callback);
     watchers.insert(nextWatcherId, w);
     return nextWatcherId++;
 }
 
-void EventLoopCoroutinePrivateQt::startWatcher(int watcherId)
+void EventLoopCoroutinePrivateQt::startWatcher(qint64 watcherId)
 {
     IoWatcher *w = dynamic_cast<IoWatcher*>(watchers.value(watcherId));
     if(w) {
@@ -200,7 +217,7 @@ void EventLoopCoroutinePrivateQt::startWatcher(int watcherId)
     }
 }
 
-void EventLoopCoroutinePrivateQt::stopWatcher(int watcherId)
+void EventLoopCoroutinePrivateQt::stopWatcher(qint64 watcherId)
 {
     IoWatcher *w = dynamic_cast<IoWatcher*>(watchers.value(watcherId));
     if(w && !w->notifier.isNull()) {
@@ -208,7 +225,7 @@ void EventLoopCoroutinePrivateQt::stopWatcher(int watcherId)
     }
 }
 
-void EventLoopCoroutinePrivateQt::removeWatcher(int watcherId)
+void EventLoopCoroutinePrivateQt::removeWatcher(qint64 watcherId)
 {
     IoWatcher *w = dynamic_cast<IoWatcher*>(watchers.take(watcherId));
     if(w) {
@@ -218,11 +235,11 @@ void EventLoopCoroutinePrivateQt::removeWatcher(int watcherId)
 
 struct TriggerIoWatchersArgumentsFunctor: public Functor
 {
-    TriggerIoWatchersArgumentsFunctor(int watcherId, EventLoopCoroutine *eventloop)
+    TriggerIoWatchersArgumentsFunctor(qint64 watcherId, EventLoopCoroutine *eventloop)
         :eventloop(eventloop), watcherId(watcherId) {}
     virtual ~TriggerIoWatchersArgumentsFunctor() override;
     QPointer<EventLoopCoroutine> eventloop;
-    int watcherId;
+    qint64 watcherId;
     virtual void operator() () override;
 };
 
@@ -245,7 +262,7 @@ void TriggerIoWatchersArgumentsFunctor::operator()()
 void EventLoopCoroutinePrivateQt::triggerIoWatchers(qintptr fd)
 {
     Q_Q(EventLoopCoroutine);
-    for (QMap<int, QtWatcher*>::const_iterator itor = watchers.constBegin(); itor != watchers.constEnd(); ++itor) {
+    for (QMap<qint64, QtWatcher*>::const_iterator itor = watchers.constBegin(); itor != watchers.constEnd(); ++itor) {
         IoWatcher *w = dynamic_cast<IoWatcher*>(itor.value());
         if(w && w->fd == fd) {
             if (!w->notifier.isNull()) {
@@ -262,7 +279,7 @@ void EventLoopCoroutinePrivateQt::timerEvent(QTimerEvent *event)
         return;
     }
 
-    int watcherId = timers.value(event->timerId());
+    qint64 watcherId = timers.value(event->timerId());
     TimerWatcher *watcher = dynamic_cast<TimerWatcher*>(watchers.value(watcherId));
 
     if(!watcher) {
@@ -285,7 +302,7 @@ void EventLoopCoroutinePrivateQt::timerEvent(QTimerEvent *event)
 }
 
 
-int EventLoopCoroutinePrivateQt::callLater(quint32 msecs, Functor *callback)
+qint64 EventLoopCoroutinePrivateQt::callLater(quint32 msecs, Functor *callback)
 {
     TimerWatcher *w = new TimerWatcher(msecs, true, callback);
     w->timerId = helper->startTimer(static_cast<int>(msecs), Qt::PreciseTimer);
@@ -299,7 +316,7 @@ void EventLoopCoroutinePrivateQt::callLaterThreadSafe(quint32 msecs, Functor *ca
     QMetaObject::invokeMethod(this->helper, "callLaterThreadSafeStub", Qt::QueuedConnection, Q_ARG(quint32, msecs), Q_ARG(void*, callback));
 }
 
-int EventLoopCoroutinePrivateQt::callRepeat(quint32 msecs, Functor *callback)
+qint64 EventLoopCoroutinePrivateQt::callRepeat(quint32 msecs, Functor *callback)
 {
     TimerWatcher *w = new TimerWatcher(msecs, false, callback);
     w->timerId = helper->startTimer(static_cast<int>(msecs));
@@ -308,7 +325,7 @@ int EventLoopCoroutinePrivateQt::callRepeat(quint32 msecs, Functor *callback)
     return nextWatcherId++;
 }
 
-void EventLoopCoroutinePrivateQt::cancelCall(int callbackId)
+void EventLoopCoroutinePrivateQt::cancelCall(qint64 callbackId)
 {
     TimerWatcher *w = dynamic_cast<TimerWatcher*>(watchers.take(callbackId));
     if(w) {
@@ -324,6 +341,14 @@ int EventLoopCoroutinePrivateQt::exitCode()
 }
 
 
+void EventLoopCoroutinePrivateQt::fillMetrics(EventLoopMetrics *metrics)
+{
+    metrics->timers = static_cast<quint32>(timers.size());
+    metrics->ioWatchers = static_cast<quint32>(watchers.size() - timers.size());
+    // the calls from other threads are queued in qt event queue, which can not be counted.
+}
+
+
 bool EventLoopCoroutinePrivateQt::runUntil(BaseCoroutine *coroutine)
 {
     QPointer<BaseCoroutine> current = BaseCoroutine::current();
@@ -376,6 +401,16 @@ int startQtLoop()
     }
 
     QSharedPointer<EventLoopCoroutine> eventLoop = currentLoop()->get();
+#ifdef QTNETWOKRNG_USE_EV
+    if (eventLoop.isNull() && QCoreApplication::instance()->thread() == QThread::currentThread()) {
+        // it is the Qt eventloop, or the hybrid one if setQtEventLoopHybrid() is called.
+        eventLoop = currentLoop()->getOrCreate();
+    }
+    QtEvEventLoopCoroutine *hybridLoop = dynamic_cast<QtEvEventLoopCoroutine*>(eventLoop.data());
+    if (hybridLoop) {
+        return startQtEvLoop(hybridLoop);
+    }
+#endif
     QtEventLoopCoroutine *qtEventLoop = nullptr;
     if (!eventLoop.isNull()) {
         qtEventLoop = dynamic_cast<QtEventLoopCoroutine*>(eventLoop.data());
@@ -0,0 +1,918 @@
+#include <QtCore/qvector.h>
+#include <QtCore/qmap.h>
+#include <QtCore/qpointer.h>
+#include <QtCore/qdebug.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "../include/private/eventloop_p.h"
+
+// the io_uring eventloop submits socket recv(), send(), accept() and connect() from submitIo() as sqes, the
+// coroutine is resumed with the result, so there is no readiness to wait and no syscall of its own. the io
+// watchers left, such as udp sockets and sendfile(), are armed as IORING_OP_POLL_ADD. one io_uring_enter() call
+// submits all sqes queued since last iteration and waits for the completions, with the timeout of the nearest
+// timer passed by IORING_ENTER_EXT_ARG.
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+static inline int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+
+static inline int sys_io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, const void *arg, size_t argSize)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize));
+}
+
+
+static inline qint64 monotonicNanoseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<qint64>(ts.tv_sec) * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+
+class UringQueue
+{
+public:
+    UringQueue();
+    ~UringQueue();
+    bool setup(unsigned entries);
+    bool isValid() const { return fd >= 0; }
+    struct io_uring_sqe *getSqe();
+    // submit all queued sqes, and wait for at least one cqe if wait is true.
+    int submitAndWait(bool wait, qint64 timeoutNs);
+    unsigned reap(struct io_uring_cqe *buf, unsigned size);
+private:
+    void unmap();
+private:
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned sqEntries;
+    unsigned sqeTail;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqPtr;
+    size_t sqSize;
+    void *cqPtr;
+    size_t cqSize;
+    size_t sqesSize;
+};
+
+
+UringQueue::UringQueue()
+    :fd(-1), sqHead(nullptr), sqTail(nullptr), sqMask(nullptr), sqArray(nullptr), sqEntries(0), sqeTail(0),
+      sqes(nullptr), cqHead(nullptr), cqTail(nullptr), cqMask(nullptr), cqes(nullptr),
+      sqPtr(MAP_FAILED), sqSize(0), cqPtr(MAP_FAILED), cqSize(0), sqesSize(0)
+{
+}
+
+
+UringQueue::~UringQueue()
+{
+    unmap();
+}
+
+
+void UringQueue::unmap()
+{
+    if (sqes) {
+        munmap(sqes, sqesSize);
+        sqes = nullptr;
+    }
+    if (cqPtr != MAP_FAILED && cqPtr != sqPtr) {
+        munmap(cqPtr, cqSize);
+    }
+    if (sqPtr != MAP_FAILED) {
+        munmap(sqPtr, sqSize);
+    }
+    sqPtr = cqPtr = MAP_FAILED;
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+
+bool UringQueue::setup(unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = sys_io_uring_setup(entries, &p);
+    if (fd < 0) {
+        return false;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        // wait with timeout requires linux 5.11
+        unmap();
+        return false;
+    }
+    sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) {
+        sqSize = cqSize = qMax(sqSize, cqSize);
+    }
+    sqPtr = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqPtr == MAP_FAILED) {
+        unmap();
+        return false;
+    }
+    if (singleMmap) {
+        cqPtr = sqPtr;
+    } else {
+        cqPtr = mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqPtr == MAP_FAILED) {
+            unmap();
+            return false;
+        }
+    }
+    sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *t = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (t == MAP_FAILED) {
+        unmap();
+        return false;
+    }
+    sqes = static_cast<struct io_uring_sqe*>(t);
+    char *sq = static_cast<char*>(sqPtr);
+    char *cq = static_cast<char*>(cqPtr);
+    sqHead = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    sqEntries = p.sq_entries;
+    sqeTail = *sqTail;
+    cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+    return true;
+}
+
+
+struct io_uring_sqe *UringQueue::getSqe()
+{
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (sqeTail - head >= sqEntries) {
+        // the submission queue is full, flush it without waiting.
+        submitAndWait(false, 0);
+        head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (sqeTail - head >= sqEntries) {
+            return nullptr;
+        }
+    }
+    unsigned index = sqeTail & *sqMask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    ++sqeTail;
+    return sqe;
+}
+
+
+int UringQueue::submitAndWait(bool wait, qint64 timeoutNs)
+{
+    __atomic_store_n(sqTail, sqeTail, __ATOMIC_RELEASE);
+    unsigned toSubmit = sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (!toSubmit && !wait) {
+        return 0;
+    }
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    unsigned flags = 0;
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeoutNs >= 0) {
+            ts.tv_sec = timeoutNs / (1000 * 1000 * 1000);
+            ts.tv_nsec = timeoutNs % (1000 * 1000 * 1000);
+            arg.ts = reinterpret_cast<quint64>(&ts);
+        }
+    }
+    int r;
+    do {
+        r = sys_io_uring_enter(fd, toSubmit, wait ? 1 : 0, flags, wait ? &arg : nullptr, wait ? sizeof(arg) : 0);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0 && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+        qWarning() << "io_uring_enter() returns error:" << strerror(errno);
+    }
+    return r;
+}
+
+
+unsigned UringQueue::reap(struct io_uring_cqe *buf, unsigned size)
+{
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    unsigned count = 0;
+    while (head != tail && count < size) {
+        buf[count++] = cqes[head & *cqMask];
+        ++head;
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+
+struct UringWatcher
+{
+    enum Type {
+        Free = 0,
+        Io = 1,
+        Timer = 2,
+        Operation = 3,  // a socket operation of submitIo().
+    };
+    Functor *callback;
+    QMultiMap<qint64, qint64>::iterator timerPos;
+    qint64 interval;    // nanoseconds, zero for single shot timers.
+    qint64 watcherId;   // the generation in the high half, the index in the low half.
+    int nextFree;
+    int fd;
+    int result;         // the result of socket operation.
+    quint32 pollMask;
+    quint32 generation;
+    quint8 type;
+    bool active;        // io watcher is started.
+    bool pending;       // poll or socket operation is submitted but not completed.
+};
+
+
+// the kind of sqe is saved in the high 4 bits of user_data, and the watcher id in the others.
+enum UringRequestKind {
+    PollRequest = 1,
+    PollRemoveRequest = 2,
+    WakeupRequest = 3,
+    IoRequest = 4,
+    CancelRequest = 5,
+};
+
+
+class EventLoopCoroutinePrivateUring: public EventLoopCoroutinePrivate
+{
+public:
+    EventLoopCoroutinePrivateUring(EventLoopCoroutine* parent);
+    virtual ~EventLoopCoroutinePrivateUring() override;
+public:
+    virtual void run() override;
+    virtual qint64 createWatcher(EventLoopCoroutine::EventType event, qintptr fd, Functor *callback) override;
+    virtual void startWatcher(qint64 watcherId) override;
+    virtual void stopWatcher(qint64 watcherId) override;
+    virtual void removeWatcher(qint64 watcherId) override;
+    virtual void triggerIoWatchers(qintptr fd) override;
+    virtual qint64 callLater(quint32 msecs, Functor *callback) override;
+    virtual qint64 callRepeat(quint32 msecs, Functor *callback) override;
+    virtual void callLaterThreadSafe(quint32 msecs, Functor *callback) override;
+    virtual void callLaterThreadSafe(quint32 msecs, const QList<Functor*> &callbacks) override;
+    virtual void cancelCall(qint64 callbackId) override;
+    virtual bool submitIo(EventLoopCoroutine::IoOperation operation, qintptr fd, void *data, quint32 size,
+                          void *address, quint32 *addressSize, qint64 *result) override;
+    virtual int exitCode() override;
+    virtual bool runUntil(BaseCoroutine *coroutine) override;
+    virtual void yield() override;
+    virtual void fillMetrics(EventLoopMetrics *metrics) override;
+public:
+    bool isValid() const { return queue.isValid() && wakeupFd >= 0; }
+private:
+    UringWatcher *allocate(UringWatcher::Type type);
+    UringWatcher *lookup(qint64 watcherId, UringWatcher::Type type);
+    void release(UringWatcher *watcher);
+    void submitPoll(UringWatcher *watcher);
+    void submitPollRemove(UringWatcher *watcher);
+    void submitCancel(qint64 watcherId);
+    bool isPending(qint64 watcherId);
+    void armWakeup();
+    void handleCompletion(const struct io_uring_cqe &cqe);
+    void runTimers();
+    void doCallLater();
+    void wakeup();
+    void loop(const int *breakFlag);
+    qint64 addTimer(qint64 delayNs, qint64 interval, Functor *callback);
+private:
+    enum {
+        MaxWatchers = 1 << 22,
+        GenerationMask = 0x0fffffff,    // the kind of request takes the top bits of user_data.
+        KindShift = 60,
+    };
+    UringQueue queue;
+    QVector<UringWatcher> watchers;   // user_data refers to the watcher id, so the slots may move.
+    QMultiMap<qint64, qint64> timers;
+    int firstFree;                    // the freed slots are reused first in first out.
+    int lastFree;
+    int wakeupFd;
+    quint64 wakeupBuffer;
+    bool wakeupArmed;
+    ThreadSafeCallQueue callLaterQueue;
+    QPointer<BaseCoroutine> loopCoroutine;
+    int breakLoop;
+    Q_DECLARE_PUBLIC(EventLoopCoroutine)
+    friend struct UringTriggerIoWatchersFunctor;
+};
+
+
+EventLoopCoroutinePrivateUring::EventLoopCoroutinePrivateUring(EventLoopCoroutine *parent)
+    :EventLoopCoroutinePrivate(parent), firstFree(-1), lastFree(-1), wakeupFd(-1), wakeupBuffer(0), wakeupArmed(false), breakLoop(0)
+{
+    if (!queue.setup(1024)) {
+        return;
+    }
+    wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+
+EventLoopCoroutinePrivateUring::~EventLoopCoroutinePrivateUring()
+{
+    for (UringWatcher &watcher: watchers) {
+        if (watcher.type != UringWatcher::Free) {
+            delete watcher.callback;
+        }
+    }
+    if (wakeupFd >= 0) {
+        ::close(wakeupFd);
+    }
+}
+
+
+UringWatcher *EventLoopCoroutinePrivateUring::allocate(UringWatcher::Type type)
+{
+    if (firstFree < 0) {
+        if (watchers.size() >= MaxWatchers) {
+            qWarning("too many watchers in io_uring eventloop.");
+            return nullptr;
+        }
+        UringWatcher empty;
+        empty.callback = nullptr;
+        empty.timerPos = timers.end();
+        empty.interval = 0;
+        empty.watcherId = 0;
+        empty.nextFree = -1;
+        empty.fd = -1;
+        empty.result = 0;
+        empty.pollMask = 0;
+        empty.generation = 0;
+        empty.type = UringWatcher::Free;
+        empty.active = false;
+        empty.pending = false;
+        watchers.append(empty);
+        firstFree = lastFree = watchers.size() - 1;
+    }
+    int index = firstFree;
+    UringWatcher *watcher = &watchers[index];
+    firstFree = watcher->nextFree;
+    if (firstFree < 0) {
+        lastFree = -1;
+    }
+    watcher->generation = (watcher->generation % GenerationMask) + 1;
+    watcher->type = static_cast<quint8>(type);
+    watcher->nextFree = -1;
+    watcher->callback = nullptr;
+    watcher->interval = 0;
+    watcher->fd = -1;
+    watcher->result = 0;
+    watcher->pollMask = 0;
+    watcher->active = false;
+    watcher->pending = false;
+    watcher->timerPos = timers.end();
+    watcher->watcherId = (static_cast<qint64>(watcher->generation) << 32) | index;
+    return watcher;
+}
+
+
+UringWatcher *EventLoopCoroutinePrivateUring::lookup(qint64 watcherId, UringWatcher::Type type)
+{
+    if (watcherId <= 0) {
+        return nullptr;
+    }
+    int index = static_cast<int>(watcherId & 0xffffffff);
+    if (index >= watchers.size()) {
+        return nullptr;
+    }
+    UringWatcher *watcher = &watchers[index];
+    if (watcher->type != type || watcher->watcherId != watcherId) {
+        return nullptr;
+    }
+    return watcher;
+}
+
+
+void EventLoopCoroutinePrivateUring::release(UringWatcher *watcher)
+{
+    Functor *callback = watcher->callback;
+    int index = static_cast<int>(watcher->watcherId & 0xffffffff);
+    if (watcher->type == UringWatcher::Timer && watcher->timerPos != timers.end()) {
+        timers.erase(watcher->timerPos);
+    }
+    watcher->timerPos = timers.end();
+    watcher->type = UringWatcher::Free;
+    watcher->callback = nullptr;
+    watcher->watcherId = 0;
+    watcher->nextFree = -1;
+    if (lastFree < 0) {
+        firstFree = index;
+    } else {
+        watchers[lastFree].nextFree = index;
+    }
+    lastFree = index;
+    // the destructor of callback may create or remove watchers, do not touch `watcher` after this line.
+    delete callback;
+}
+
+
+void EventLoopCoroutinePrivateUring::submitPoll(UringWatcher *watcher)
+{
+    struct io_uring_sqe *sqe = queue.getSqe();
+    if (!sqe) {
+        qWarning("io_uring submission queue is full.");
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = watcher->fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    sqe->poll32_events = (watcher->pollMask << 16) | (watcher->pollMask >> 16);
+#else
+    sqe->poll32_events = watcher->pollMask;
+#endif
+    sqe->user_data = (static_cast<quint64>(PollRequest) << KindShift) | static_cast<quint64>(watcher->watcherId);
+    watcher->pending = true;
+}
+
+
+void EventLoopCoroutinePrivateUring::submitPollRemove(UringWatcher *watcher)
+{
+    struct io_uring_sqe *sqe = queue.getSqe();
+    if (!sqe) {
+        qWarning("io_uring submission queue is full.");
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (static_cast<quint64>(PollRequest) << KindShift) | static_cast<quint64>(watcher->watcherId);
+    sqe->user_data = static_cast<quint64>(PollRemoveRequest) << KindShift;
+}
+
+
+void EventLoopCoroutinePrivateUring::submitCancel(qint64 watcherId)
+{
+    struct io_uring_sqe *sqe = queue.getSqe();
+    if (!sqe) {
+        qWarning("io_uring submission queue is full.");
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (static_cast<quint64>(IoRequest) << KindShift) | static_cast<quint64>(watcherId);
+    sqe->user_data = static_cast<quint64>(CancelRequest) << KindShift;
+}
+
+
+void EventLoopCoroutinePrivateUring::armWakeup()
+{
+    if (wakeupArmed) {
+        return;
+    }
+    struct io_uring_sqe *sqe = queue.getSqe();
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakeupFd;
+    sqe->addr = reinterpret_cast<quint64>(&wakeupBuffer);
+    sqe->len = sizeof(wakeupBuffer);
+    sqe->user_data = static_cast<quint64>(WakeupRequest) << KindShift;
+    wakeupArmed = true;
+}
+
+
+qint64 EventLoopCoroutinePrivateUring::createWatcher(EventLoopCoroutine::EventType event, qintptr fd, Functor *callback)
+{
+    UringWatcher *watcher = allocate(UringWatcher::Io);
+    if (!watcher) {
+        delete callback;
+        return 0;
+    }
+    quint32 mask = 0;
+    if (event & EventLoopCoroutine::Read) {
+        mask |= POLLIN | POLLRDHUP;
+    }
+    if (event & EventLoopCoroutine::Write) {
+        mask |= POLLOUT;
+    }
+    watcher->fd = static_cast<int>(fd);
+    watcher->pollMask = mask;
+    watcher->callback = callback;
+    return watcher->watcherId;
+}
+
+
+void EventLoopCoroutinePrivateUring::startWatcher(qint64 watcherId)
+{
+    UringWatcher *watcher = lookup(watcherId, UringWatcher::Io);
+    if (!watcher) {
+        return;
+    }
+    watcher->active = true;
+    if (!watcher->pending) {
+        submitPoll(watcher);
+    }
+}
+
+
+void EventLoopCoroutinePrivateUring::stopWatcher(qint64 watcherId)
+{
+    UringWatcher *watcher = lookup(watcherId, UringWatcher::Io);
+    if (!watcher) {
+        return;
+    }
+    watcher->active = false;
+    if (watcher->pending) {
+        submitPollRemove(watcher);
+    }
+}
+
+
+void EventLoopCoroutinePrivateUring::removeWatcher(qint64 watcherId)
+{
+    UringWatcher *watcher = lookup(watcherId, UringWatcher::Io);
+    if (!watcher) {
+        return;
+    }
+    if (watcher->pending) {
+        // the completion of removed poll carries an old generation, and is ignored.
+        submitPollRemove(watcher);
+    }
+    release(watcher);
+}
+
+
+struct UringTriggerIoWatchersFunctor: public Functor
+{
+    UringTriggerIoWatchersFunctor(qint64 watcherId, EventLoopCoroutinePrivateUring *eventloop)
+        :eventloop(eventloop), watcherId(watcherId) {}
+    EventLoopCoroutinePrivateUring *eventloop;
+    qint64 watcherId;
+    virtual void operator()() override
+    {
+        UringWatcher *watcher = eventloop->lookup(watcherId, UringWatcher::Io);
+        if (watcher) {
+            (*watcher->callback)();
+        }
+    }
+};
+
+
+void EventLoopCoroutinePrivateUring::triggerIoWatchers(qintptr fd)
+{
+    for (int i = 0; i < watchers.size(); ++i) {
+        UringWatcher *watcher = &watchers[i];
+        if (watcher->type == UringWatcher::Io && watcher->fd == fd) {
+            qint64 watcherId = watcher->watcherId;
+            stopWatcher(watcherId);
+            callLater(0, new UringTriggerIoWatchersFunctor(watcherId, this));
+        } else if (watcher->type == UringWatcher::Operation && watcher->fd == fd && watcher->pending) {
+            // the ring holds the file, closing the fd does not finish the operations on it.
+            submitCancel(watcher->watcherId);
+        }
+    }
+}
+
+
+bool EventLoopCoroutinePrivateUring::isPending(qint64 watcherId)
+{
+    UringWatcher *watcher = lookup(watcherId, UringWatcher::Operation);
+    return watcher && watcher->pending;
+}
+
+
+bool EventLoopCoroutinePrivateUring::submitIo(EventLoopCoroutine::IoOperation operation, qintptr fd, void *data,
+                                              quint32 size, void *address, quint32 *addressSize, qint64 *result)
+{
+    UringWatcher *watcher = allocate(UringWatcher::Operation);
+    if (!watcher) {
+        return false;
+    }
+    struct io_uring_sqe *sqe = queue.getSqe();
+    if (!sqe) {
+        release(watcher);
+        return false;
+    }
+    sqe->fd = static_cast<int>(fd);
+    switch (operation) {
+    case EventLoopCoroutine::Recv:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->addr = reinterpret_cast<quint64>(data);
+        sqe->len = size;
+        break;
+    case EventLoopCoroutine::Send:
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = reinterpret_cast<quint64>(data);
+        sqe->len = size;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        break;
+    case EventLoopCoroutine::Accept:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->addr = reinterpret_cast<quint64>(address);
+        sqe->addr2 = reinterpret_cast<quint64>(addressSize);
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        break;
+    case EventLoopCoroutine::Connect:
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->addr = reinterpret_cast<quint64>(address);
+        sqe->off = *addressSize;
+        break;
+    }
+    const qint64 watcherId = watcher->watcherId;
+    sqe->user_data = (static_cast<quint64>(IoRequest) << KindShift) | static_cast<quint64>(watcherId);
+    watcher->fd = static_cast<int>(fd);
+    watcher->pending = true;
+    watcher->callback = new YieldCurrentFunctor();
+    try {
+        while (isPending(watcherId)) {
+            yield();
+        }
+    } catch (...) {
+        // the kernel may still write to the buffers of caller, they are gone after unwinding.
+        submitCancel(watcherId);
+        while (isPending(watcherId)) {
+            try {
+                yield();
+            } catch (...) {
+                // killed again, the first exception is thrown after the operation is finished.
+            }
+        }
+        release(lookup(watcherId, UringWatcher::Operation));
+        throw;
+    }
+    watcher = lookup(watcherId, UringWatcher::Operation);
+    *result = watcher->result;
+    release(watcher);
+    return true;
+}
+
+
+qint64 EventLoopCoroutinePrivateUring::addTimer(qint64 delayNs, qint64 interval, Functor *callback)
+{
+    UringWatcher *watcher = allocate(UringWatcher::Timer);
+    if (!watcher) {
+        delete callback;
+        return 0;
+    }
+    watcher->callback = callback;
+    watcher->interval = interval;
+    watcher->timerPos = timers.insert(monotonicNanoseconds() + delayNs, watcher->watcherId);
+    return watcher->watcherId;
+}
+
+
+qint64 EventLoopCoroutinePrivateUring::callLater(quint32 msecs, Functor *callback)
+{
+    return addTimer(static_cast<qint64>(msecs) * 1000 * 1000, 0, callback);
+}
+
+
+qint64 EventLoopCoroutinePrivateUring::callRepeat(quint32 msecs, Functor *callback)
+{
+    qint64 interval = qMax<qint64>(static_cast<qint64>(msecs) * 1000 * 1000, 1);
+    return addTimer(0, interval, callback);
+}
+
+
+void EventLoopCoroutinePrivateUring::cancelCall(qint64 callbackId)
+{
+    UringWatcher *watcher = lookup(callbackId, UringWatcher::Timer);
+    if (watcher) {
+        release(watcher);
+    }
+}
+
+
+void EventLoopCoroutinePrivateUring::callLaterThreadSafe(quint32 msecs, Functor *callback)
+{
+    if (callLaterQueue.push(msecs, callback)) {
+        wakeup();
+    }
+}
+
+
+void EventLoopCoroutinePrivateUring::callLaterThreadSafe(quint32 msecs, const QList<Functor*> &callbacks)
+{
+    if (callLaterQueue.push(msecs, callbacks)) {
+        wakeup();
+    }
+}
+
+
+void EventLoopCoroutinePrivateUring::wakeup()
+{
+    quint64 one = 1;
+    ssize_t r;
+    do {
+        r = ::write(wakeupFd, &one, sizeof(one));
+    } while (r < 0 && errno == EINTR);
+}
+
+
+void EventLoopCoroutinePrivateUring::doCallLater()
+{
+    ThreadSafeCallQueue::Node *node = callLaterQueue.takeAll();
+    while (node) {
+        ThreadSafeCallQueue::Node *next = node->next;
+        callLater(node->msecs, node->callback);
+        delete node;
+        node = next;
+    }
+}
+
+
+void EventLoopCoroutinePrivateUring::handleCompletion(const struct io_uring_cqe &cqe)
+{
+    quint32 kind = static_cast<quint32>(cqe.user_data >> KindShift);
+    if (kind == WakeupRequest) {
+        wakeupArmed = false;
+        doCallLater();
+        return;
+    }
+    qint64 watcherId = static_cast<qint64>(cqe.user_data & ((Q_UINT64_C(1) << KindShift) - 1));
+    if (kind == IoRequest) {
+        UringWatcher *watcher = lookup(watcherId, UringWatcher::Operation);
+        if (watcher) {
+            watcher->pending = false;
+            watcher->result = cqe.res;
+            (*watcher->callback)();
+        }
+        return;
+    }
+    if (kind != PollRequest) {
+        return;
+    }
+    UringWatcher *watcher = lookup(watcherId, UringWatcher::Io);
+    if (!watcher) {
+        return;
+    }
+    watcher->pending = false;
+    if (!watcher->active) {
+        return;
+    }
+    if (cqe.res == -ECANCELED) {
+        // stopped and restarted before the removal is completed.
+        submitPoll(watcher);
+        return;
+    }
+    (*watcher->callback)();
+    // keep the same semantics as libev, an io watcher keeps active until it is stopped.
+    watcher = lookup(watcherId, UringWatcher::Io);
+    if (watcher && watcher->active && !watcher->pending) {
+        submitPoll(watcher);
+    }
+}
+
+
+void EventLoopCoroutinePrivateUring::runTimers()
+{
+    const qint64 now = monotonicNanoseconds();
+    // take the expired timers first, the callbacks may add timers which should not run in this iteration.
+    QVector<qint64> expired;
+    for (QMultiMap<qint64, qint64>::const_iterator itor = timers.constBegin(); itor != timers.constEnd() && itor.key() <= now; ++itor) {
+        expired.append(itor.value());
+    }
+    for (qint64 watcherId: expired) {
+        UringWatcher *watcher = lookup(watcherId, UringWatcher::Timer);
+        if (!watcher) {
+            continue;
+        }
+        timers.erase(watcher->timerPos);
+        watcher->timerPos = timers.end();
+        if (watcher->interval > 0) {
+            watcher->timerPos = timers.insert(now + watcher->interval, watcherId);
+            (*watcher->callback)();
+        } else {
+            (*watcher->callback)();
+            cancelCall(watcherId);
+        }
+    }
+}
+
+
+void EventLoopCoroutinePrivateUring::loop(const int *breakFlag)
+{
+    struct io_uring_cqe cqes[256];
+    while (!*breakFlag) {
+        armWakeup();
+        runTimers();
+        if (*breakFlag) {
+            break;
+        }
+        qint64 timeout = -1;
+        if (!timers.isEmpty()) {
+            timeout = qMax<qint64>(timers.constBegin().key() - monotonicNanoseconds(), 0);
+        }
+        recorder.beforePoll();
+        queue.submitAndWait(true, timeout);
+        recorder.afterPoll();
+        unsigned count;
+        while ((count = queue.reap(cqes, sizeof(cqes) / sizeof(cqes[0]))) > 0) {
+            for (unsigned i = 0; i < count; ++i) {
+                handleCompletion(cqes[i]);
+            }
+        }
+    }
+}
+
+
+void EventLoopCoroutinePrivateUring::run()
+{
+    int neverBreak = 0;
+    try {
+        loop(&neverBreak);
+    } catch (...) {
+        qWarning("io_uring eventloop got exception.");
+    }
+}
+
+
+void EventLoopCoroutinePrivateUring::fillMetrics(EventLoopMetrics *metrics)
+{
+    for (const UringWatcher &watcher: watchers) {
+        if (watcher.type == UringWatcher::Io || watcher.type == UringWatcher::Operation) {
+            ++metrics->ioWatchers;
+        } else if (watcher.type == UringWatcher::Timer) {
+            ++metrics->timers;
+        }
+    }
+    metrics->pendingThreadSafeCalls = static_cast<quint32>(callLaterQueue.size());
+}
+
+
+int EventLoopCoroutinePrivateUring::exitCode()
+{
+    return 0;
+}
+
+
+bool EventLoopCoroutinePrivateUring::runUntil(BaseCoroutine *coroutine)
+{
+    QPointer<BaseCoroutine> current = BaseCoroutine::current();
+    if (!loopCoroutine.isNull() && loopCoroutine != current) {
+        Deferred<BaseCoroutine*>::Callback here = [current] (BaseCoroutine *) {
+            if (!current.isNull()) {
+                current->yield();
+            }
+        };
+        coroutine->finished.addCallback(here);
+        loopCoroutine->yield();
+    } else {
+        QPointer<BaseCoroutine> old = loopCoroutine;
+        loopCoroutine = current;
+        QSharedPointer<int> breakFlag(new int(0));
+        Deferred<BaseCoroutine*>::Callback exitOneDepth = [this, breakFlag] (BaseCoroutine *) {
+            *breakFlag = 1;
+            if (!loopCoroutine.isNull()) {
+                loopCoroutine->yield();
+            }
+        };
+        coroutine->finished.addCallback(exitOneDepth);
+        loop(breakFlag.data());
+        loopCoroutine = old;
+    }
+    return true;
+}
+
+
+void EventLoopCoroutinePrivateUring::yield()
+{
+    Q_Q(EventLoopCoroutine);
+    if (!loopCoroutine.isNull()) {
+        loopCoroutine->yield();
+    } else {
+        q->BaseCoroutine::yield();
+    }
+}
+
+
+UringEventLoopCoroutine::UringEventLoopCoroutine()
+    :EventLoopCoroutine(new EventLoopCoroutinePrivateUring(this))
+{
+}
+
+
+bool UringEventLoopCoroutine::isValid() const
+{
+    const EventLoopCoroutinePrivateUring *d = static_cast<const EventLoopCoroutinePrivateUring*>(d_func());
+    return d->isValid();
+}
+
+QTNETWORKNG_NAMESPACE_END
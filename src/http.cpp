@@ -1,11 +1,16 @@
+#include <algorithm>
+#include <limits>
 #include <QtCore/qurl.h>
 #include <QtCore/qurlquery.h>
 #include <QtCore/qjsondocument.h>
 #include <QtCore/qdatetime.h>
+#include <QtCore/qelapsedtimer.h>
 #include <QtCore/qtextcodec.h>
-#include <QtCore/qendian.h>
 #include "../include/private/http_p.h"
 #include "../include/socks5_proxy.h"
+#include "../include/msgpack.h"
+#include "../include/metrics.h"
+#include "../include/private/tracing_p.h"
 #ifndef QTNG_NO_CRYPTO
 #include "../include/ssl.h"
 #endif
@@ -49,39 +54,209 @@ QByteArray formatHeaderParam(const QString &name, const QString &value)
     return data;
 }
 
+static QByteArray queryPartHeader(const QByteArray &boundary, const QString &name)
+{
+    QByteArray header;
+    header.append("--");
+    header.append(boundary);
+    header.append("\r\n");
+    header.append("Content-Disposition: form-data;");
+    header.append(formatHeaderParam(QStringLiteral("name"), name));
+    header.append("\r\n\r\n");
+    return header;
+}
+
+static QByteArray filePartHeader(const QByteArray &boundary, const QString &name, const FormDataFile &file)
+{
+    QByteArray header;
+    header.append("--");
+    header.append(boundary);
+    header.append("\r\n");
+    header.append("Content-Disposition: form-data;");
+    header.append(formatHeaderParam(QStringLiteral("name"), name));
+    header.append("; ");
+    header.append(formatHeaderParam(QStringLiteral("filename"), file.filename));
+    header.append("\r\n");
+    header.append("Content-Type: ");
+    header.append(file.contentType.toUtf8());
+    header.append("\r\n\r\n");
+    return header;
+}
+
 QByteArray FormData::toByteArray() const
 {
     QByteArray body;
     for (QMap<QString, QString>::const_iterator itor = query.constBegin(); itor != query.constEnd(); ++itor) {
-        body.append("--");
-        body.append(boundary);
-        body.append("\r\n");
-        body.append("Content-Disposition: form-data;");
-        body.append(formatHeaderParam(QStringLiteral("name"), itor.key()));
-        body.append("\r\n\r\n");
+        body.append(queryPartHeader(boundary, itor.key()));
         body.append(itor.value().toUtf8());
         body.append("\r\n");
     }
     for (QMap<QString, FormDataFile>::const_iterator itor = files.constBegin(); itor != files.constEnd(); ++itor) {
-        body.append("--");
-        body.append(boundary);
-        body.append("\r\n");
-        body.append("Content-Disposition: form-data;");
-        body.append(formatHeaderParam(QStringLiteral("name"), itor.key()));
-        body.append("; ");
-        body.append(formatHeaderParam(QStringLiteral("filename"), itor.value().filename));
+        body.append(filePartHeader(boundary, itor.key(), itor.value()));
+        if (itor.value().file.isNull()) {
+            body.append(itor.value().data);
+        } else {
+            bool ok = true;
+            body.append(itor.value().file->readall(&ok));
+        }
         body.append("\r\n");
-        body.append("Content-Type: ");
-        body.append(itor.value().contentType);
-        body.append("\r\n\r\n");
-        body.append(itor.value().data);
     }
     body.append("--");
     body.append(boundary);
-    body.append("--");
+    body.append("--\r\n");
     return body;
 }
 
+
+// the parts are read one by one.
+class ChainedFile: public FileLike
+{
+public:
+    explicit ChainedFile(const QList<QSharedPointer<FileLike>> &parts)
+        :parts(parts), current(0) {}
+    virtual qint32 read(char *data, qint32 size) override;
+    virtual qint32 readall(char *data, qint32 size) override;
+    virtual qint32 write(char *, qint32) override { return -1; }
+    virtual qint32 writeall(char *, qint32) override { return -1; }
+    virtual bool atEnd() override { return current >= parts.size(); }
+    virtual void close() override;
+    virtual qint64 size() override;
+private:
+    QList<QSharedPointer<FileLike>> parts;
+    int current;
+};
+
+
+qint32 ChainedFile::read(char *data, qint32 size)
+{
+    while (current < parts.size()) {
+        qint32 readBytes = parts.at(current)->read(data, size);
+        if (readBytes > 0) {
+            return readBytes;
+        } else if (readBytes < 0) {
+            return -1;
+        }
+        ++current;
+    }
+    return 0;
+}
+
+
+qint32 ChainedFile::readall(char *data, qint32 size)
+{
+    qint32 total = 0;
+    while (total < size) {
+        qint32 readBytes = read(data + total, size - total);
+        if (readBytes < 0) {
+            return total > 0 ? total : -1;
+        } else if (readBytes == 0) {
+            break;
+        }
+        total += readBytes;
+    }
+    return total;
+}
+
+
+void ChainedFile::close()
+{
+    for (QSharedPointer<FileLike> part: parts) {
+        part->close();
+    }
+    current = parts.size();
+}
+
+
+qint64 ChainedFile::size()
+{
+    qint64 total = 0;
+    for (QSharedPointer<FileLike> part: parts) {
+        qint64 partSize = part->size();
+        if (partSize < 0) {
+            return -1;
+        }
+        total += partSize;
+    }
+    return total;
+}
+
+
+QSharedPointer<FileLike> FormData::toFileLike() const
+{
+    QList<QSharedPointer<FileLike>> parts;
+    QByteArray buf;
+    for (QMap<QString, QString>::const_iterator itor = query.constBegin(); itor != query.constEnd(); ++itor) {
+        buf.append(queryPartHeader(boundary, itor.key()));
+        buf.append(itor.value().toUtf8());
+        buf.append("\r\n");
+    }
+    for (QMap<QString, FormDataFile>::const_iterator itor = files.constBegin(); itor != files.constEnd(); ++itor) {
+        buf.append(filePartHeader(boundary, itor.key(), itor.value()));
+        if (itor.value().file.isNull()) {
+            buf.append(itor.value().data);
+        } else {
+            parts.append(FileLike::bytes(buf));
+            parts.append(itor.value().file);
+            buf.clear();
+        }
+        buf.append("\r\n");
+    }
+    buf.append("--");
+    buf.append(boundary);
+    buf.append("--\r\n");
+    parts.append(FileLike::bytes(buf));
+    return QSharedPointer<ChainedFile>::create(parts).dynamicCast<FileLike>();
+}
+
+
+// the pieces of body are made by a function.
+class GeneratedFile: public FileLike
+{
+public:
+    explicit GeneratedFile(const std::function<QByteArray()> &generator)
+        :generator(generator), ended(false) {}
+    virtual qint32 read(char *data, qint32 size) override;
+    virtual qint32 readall(char *data, qint32 size) override;
+    virtual qint32 write(char *, qint32) override { return -1; }
+    virtual qint32 writeall(char *, qint32) override { return -1; }
+    virtual bool atEnd() override { return ended && buf.isEmpty(); }
+    virtual void close() override { ended = true; buf.clear(); }
+    virtual qint64 size() override { return -1; }
+private:
+    std::function<QByteArray()> generator;
+    QByteArray buf;
+    bool ended;
+};
+
+
+qint32 GeneratedFile::read(char *data, qint32 size)
+{
+    if (buf.isEmpty() && !ended) {
+        buf = generator();
+        if (buf.isEmpty()) {
+            ended = true;
+        }
+    }
+    const qint32 readBytes = qMin(size, buf.size());
+    memcpy(data, buf.constData(), static_cast<size_t>(readBytes));
+    buf.remove(0, readBytes);
+    return readBytes;
+}
+
+
+qint32 GeneratedFile::readall(char *data, qint32 size)
+{
+    qint32 total = 0;
+    while (total < size) {
+        qint32 readBytes = read(data + total, size - total);
+        if (readBytes <= 0) {
+            break;
+        }
+        total += readBytes;
+    }
+    return total;
+}
+
 class HttpRequestPrivate: public QSharedData
 {
 public:
@@ -94,11 +269,16 @@ public:
     QMap<QString, QString> query;
     QList<QNetworkCookie> cookies;
     QByteArray body;
+    QSharedPointer<FileLike> bodyFile;
     int maxBodySize;
     int maxRedirects;
     HttpRequest::Priority priority;
     HttpVersion version;
+    HttpRequest::CacheLoadControl cacheLoadControl;
     bool streamResponse;
+    // parsed from url by HttpSessionPrivate::send(), cleared by setUrl().
+    HttpOrigin origin;
+    QByteArray target;
 };
 
 
@@ -108,6 +288,7 @@ HttpRequestPrivate::HttpRequestPrivate()
     , maxRedirects(8)
     , priority(HttpRequest::NormalPriority)
     , version(Http1_1)
+    , cacheLoadControl(HttpRequest::PreferNetwork)
     , streamResponse(false)
 {}
 
@@ -121,11 +302,15 @@ HttpRequestPrivate::HttpRequestPrivate(const HttpRequestPrivate &other)
     , query(other.query)
     , cookies(other.cookies)
     , body(other.body)
+    , bodyFile(other.bodyFile)
     , maxBodySize(other.maxBodySize)
     , maxRedirects(other.maxRedirects)
     , priority(other.priority)
     , version(other.version)
+    , cacheLoadControl(other.cacheLoadControl)
     , streamResponse(other.streamResponse)
+    , origin(other.origin)
+    , target(other.target)
 {
 }
 
@@ -142,20 +327,19 @@ HttpRequest::~HttpRequest()
 
 
 HttpRequest::HttpRequest(const HttpRequest &other)
-    :d(other.d)
+    :HeaderOperationMixin(other), d(other.d)
 {
-    this->headers = other.headers;
 }
 
 HttpRequest::HttpRequest(HttpRequest &&other)
+    :HeaderOperationMixin(std::move(other))
 {
     qSwap(d, other.d);
-    headers = std::move(other.headers);
 }
 
 HttpRequest &HttpRequest::operator=(const HttpRequest &other)
 {
-    this->headers = other.headers;
+    HeaderOperationMixin::operator=(other);
     this->d = other.d;
     return *this;
 }
@@ -179,6 +363,8 @@ QUrl HttpRequest::url() const
 void HttpRequest::setUrl(const QUrl &url)
 {
     d->url = url;
+    d->origin = HttpOrigin();
+    d->target.clear();
 }
 
 QMap<QString, QString> HttpRequest::query() const
@@ -209,6 +395,23 @@ QByteArray HttpRequest::body() const
 void HttpRequest::setBody(const QByteArray &body)
 {
     d->body = body;
+    d->bodyFile.clear();
+}
+
+QSharedPointer<FileLike> HttpRequest::bodyFile() const
+{
+    return d->bodyFile;
+}
+
+void HttpRequest::setBody(QSharedPointer<FileLike> body)
+{
+    d->body.clear();
+    d->bodyFile = body;
+}
+
+void HttpRequest::setBody(const std::function<QByteArray()> &generator)
+{
+    setBody(QSharedPointer<GeneratedFile>::create(generator).dynamicCast<FileLike>());
 }
 
 int HttpRequest::maxBodySize() const
@@ -261,6 +464,16 @@ bool HttpRequest::streamResponse() const
     return d->streamResponse;
 }
 
+HttpRequest::CacheLoadControl HttpRequest::cacheLoadControl() const
+{
+    return d->cacheLoadControl;
+}
+
+void HttpRequest::setCacheLoadControl(CacheLoadControl cacheLoadControl)
+{
+    d->cacheLoadControl = cacheLoadControl;
+}
+
 void HttpRequest::setFormData(const FormData &formData, const QString &method)
 {
     d->method = method;
@@ -270,7 +483,15 @@ void HttpRequest::setFormData(const FormData &formData, const QString &method)
     if(!hasHeader(mimeHeader)) {
         setHeader(mimeHeader, QByteArray("1.0"));
     }
-    d->body = formData.toByteArray();
+    bool streaming = false;
+    for (const FormDataFile &file: formData.files) {
+        streaming = streaming || !file.file.isNull();
+    }
+    if (streaming) {
+        setBody(formData.toFileLike());
+    } else {
+        setBody(formData.toByteArray());
+    }
 }
 
 HttpRequest HttpRequest::fromFormData(const FormData &formData)
@@ -310,6 +531,34 @@ HttpRequest HttpRequest::fromJson(const QJsonDocument &json)
 }
 
 
+HttpRequest HttpRequest::fromMsgPackAsJson(const QByteArray &msgpack)
+{
+    HttpRequest request;
+    request.setContentType("application/json");
+    request.setBody(msgPackToJson(msgpack));
+    request.setMethod("POST");
+    return request;
+}
+
+
+HttpTimings::HttpTimings()
+    :totalNsecs(0), reusedConnection(false)
+{
+    for (int i = 0; i < PhaseCount; ++i) {
+        starts[i] = durations[i] = -1;
+    }
+}
+
+
+HttpTracer::~HttpTracer() {}
+
+
+void HttpTracer::requestStarted(HttpRequest &) {}
+
+
+void HttpTracer::requestFinished(const HttpRequest &, const HttpResponse &) {}
+
+
 class HttpResponsePrivate: public QSharedData
 {
 public:
@@ -323,17 +572,21 @@ public:
     HttpRequest request;
     QByteArray body;
     qint64 elapsed;
+    HttpTimings timings;
     QList<HttpResponse> history;
     QSharedPointer<RequestError> error;
     QSharedPointer<SocketLike> stream;
+    QSharedPointer<ConnectionPool *> pool;  // takes back the connection after the streamed body is read.
+    HttpOrigin origin;                      // of the connection taken back.
     int statusCode;
     HttpVersion version;
     bool consumed;
+    bool fromCache;
 };
 
 
 HttpResponsePrivate::HttpResponsePrivate()
-    : elapsed(0), version(Http1_1), consumed(false)
+    : elapsed(0), version(Http1_1), consumed(false), fromCache(false)
 {}
 
 HttpResponsePrivate::~HttpResponsePrivate() {}
@@ -346,10 +599,14 @@ HttpResponsePrivate::HttpResponsePrivate(const HttpResponsePrivate &other)
     , request(other.request)
     , body(other.body)
     , elapsed(other.elapsed)
+    , timings(other.timings)
     , history(other.history)
+    , pool(other.pool)
+    , origin(other.origin)
     , statusCode(other.statusCode)
     , version(other.version)
     , consumed(other.consumed)
+    , fromCache(other.fromCache)
 {}
 
 HttpResponse::HttpResponse()
@@ -362,23 +619,22 @@ HttpResponse::~HttpResponse()
 
 
 HttpResponse::HttpResponse(const HttpResponse& other)
-    :d(other.d)
+    :HeaderOperationMixin(other), d(other.d)
 {
-    this->headers = other.headers;
 }
 
 
 HttpResponse::HttpResponse(HttpResponse &&other)
+    :HeaderOperationMixin(std::move(other))
 {
     qSwap(d, other.d);
-    headers = std::move(other.headers);
 }
 
 
 HttpResponse &HttpResponse::operator=(const HttpResponse& other)
 {
     d = other.d;
-    headers = other.headers;
+    HeaderOperationMixin::operator=(other);
     return *this;
 }
 
@@ -470,112 +726,344 @@ RequestError *toRequestError(ChunkedBlockReader::Error error)
     }
 }
 
-QByteArray HttpResponse::body()
+static bool decodeContent(const QByteArray &contentEncodingHeader, QByteArray *body)
 {
-    // special cases.
-    if (d->consumed) {
-        return d->body;
+    if (contentEncodingHeader.isEmpty()) {
+        return true;
     }
-    // XXX if not consumed and body is not empty, it must be the from the header splitter.
-    // read it from stream
-    qint32 contentLength = getContentLength();
-    if (contentLength > 0) {
-        if (contentLength > d->request.maxBodySize()) {
-            d->error.reset(new UnrewindableBodyError());
-            d->consumed = true;
-            return QByteArray();
+    ContentDecoder decoder(contentEncodingHeader);
+    if (!decoder.isSupported()) {
+        qWarning() << "unsupported content encoding." << contentEncodingHeader;
+        return true;
+    }
+    QByteArray decoded;
+    if (!decoder.decode(*body, &decoded) || !decoder.finish(&decoded)) {
+        return false;
+    }
+    *body = decoded;
+    return true;
+}
+
+// yields the decoded body of a streamed response, the connection goes back to the pool at the end of body.
+class HttpBodyReader: public FileLike
+{
+public:
+    HttpBodyReader(const HttpResponse &response, QSharedPointer<SocketLike> stream, const QByteArray &buf,
+                   QSharedPointer<ConnectionPool *> pool, const HttpOrigin &origin);
+    virtual ~HttpBodyReader() override;
+public:
+    virtual qint32 read(char *data, qint32 size) override;
+    virtual qint32 readall(char *data, qint32 size) override;
+    virtual qint32 write(char *data, qint32 size) override;
+    virtual qint32 writeall(char *data, qint32 size) override;
+    virtual bool atEnd() override;
+    virtual void close() override;
+    virtual qint64 size() override;
+    // null if the body is read without error so far.
+    QSharedPointer<RequestError> error() const { return failure; }
+private:
+    bool fill();
+    // the connection is recycled if there is no error and the server keeps it alive.
+    void finish(RequestError *error = nullptr);
+private:
+    enum Framing {
+        Empty,
+        ContentLength,
+        Chunked,
+        UntilClosed,
+    };
+    QSharedPointer<SocketLike> stream;
+    QSharedPointer<ConnectionPool *> pool;
+    HttpOrigin origin;
+    QByteArray buf;       // the raw bytes read with headers.
+    QByteArray pending;   // the decoded bytes not yet read.
+    QScopedPointer<ChunkedBlockReader> chunkedReader;
+    QScopedPointer<ContentDecoder> decoder;
+    qint64 contentLength;
+    qint64 leftBytes;
+    Framing framing;
+    QSharedPointer<RequestError> failure;
+    bool keepAlive;
+    bool ended;
+};
+
+
+HttpBodyReader::HttpBodyReader(const HttpResponse &response, QSharedPointer<SocketLike> stream, const QByteArray &buf,
+                               QSharedPointer<ConnectionPool *> pool, const HttpOrigin &origin)
+    :stream(stream), pool(pool), origin(origin), buf(buf), contentLength(-1), leftBytes(0)
+    , framing(UntilClosed), keepAlive(false), ended(false)
+{
+    const QByteArray &contentEncoding = response.header(HttpResponse::ContentEncodingHeader);
+    if (!contentEncoding.isEmpty()) {
+        decoder.reset(new ContentDecoder(contentEncoding));
+        if (!decoder->isSupported()) {
+            qWarning() << "unsupported content encoding." << contentEncoding;
+            decoder.reset();
+        }
+    }
+
+    keepAlive = response.version() == Http1_1;
+    const QByteArray &connectionHeader = response.header(HttpResponse::ConnectionHeader).toLower();
+    if (connectionHeader == "close") {
+        keepAlive = false;
+    } else if (connectionHeader == "keep-alive") {
+        keepAlive = true;
+    }
+    // the server closes it after the response.
+    if (response.request().header(HttpRequest::ConnectionHeader).toLower() == "close") {
+        keepAlive = false;
+    }
+
+    const int statusCode = response.statusCode();
+    bool ok;
+    contentLength = response.header(HttpResponse::ContentLengthHeader).toLongLong(&ok);
+    if (!ok) {
+        contentLength = -1;
+    }
+    if (response.request().method().toUpper() == QStringLiteral("HEAD") || statusCode == 204 || statusCode == 304
+            || (statusCode >= 100 && statusCode < 200)) {
+        framing = Empty;
+    } else if (response.header(HttpResponse::TransferEncodingHeader).toLower() == "chunked") {
+        framing = Chunked;
+        chunkedReader.reset(new ChunkedBlockReader(stream, buf));
+        chunkedReader->debugLevel = 0;
+        this->buf.clear();
+    } else if (contentLength >= 0) {
+        framing = ContentLength;
+        leftBytes = contentLength;
+    } else {
+        framing = UntilClosed;
+        keepAlive = false;
+    }
+    if (framing == Empty || (framing == ContentLength && leftBytes == 0)) {
+        finish();
+    }
+}
+
+
+HttpBodyReader::~HttpBodyReader()
+{
+    // the rest of body is unknown, the connection can not be used again.
+    if (!ended && !stream.isNull()) {
+        stream->close();
+    }
+}
+
+
+void HttpBodyReader::finish(RequestError *error)
+{
+    ended = true;
+    if (error) {
+        failure.reset(error);
+        stream->close();
+        stream.clear();
+        return;
+    }
+    // the framing is right even if the body can not be decoded, the connection is still good.
+    if (decoder && !decoder->finish(&pending)) {
+        failure.reset(new ContentDecodingError());
+    }
+    // the bytes after body belong to nobody, the server misbehaves.
+    const bool extraBytes = !buf.isEmpty() || (chunkedReader && !chunkedReader->buf.isEmpty());
+    if (keepAlive && !extraBytes && !pool.isNull() && *pool) {
+        (*pool)->recycle(origin, stream);
+    } else {
+        stream->close();
+    }
+    stream.clear();
+}
+
+
+bool HttpBodyReader::fill()
+{
+    const qint32 BlockSize = 1024 * 64;
+    QByteArray raw;
+    switch (framing) {
+    case Empty:
+        break;
+    case ContentLength:
+        if (!buf.isEmpty()) {
+            raw = buf.left(static_cast<int>(qMin<qint64>(leftBytes, buf.size())));
+            buf.remove(0, raw.size());
         } else {
-            if (d->body.size() > contentLength) {
-                qWarning() << "got too much bytes.";
-            } else if (d->body.size() < contentLength){
-                if (d->stream.isNull()) {
-                    d->error.reset(new UnrewindableBodyError());
-                    d->consumed = true;
-                    return QByteArray();
-                }
-                qint32 leftBytes = contentLength - d->body.size();
-                const QByteArray &t = d->stream->recvall(leftBytes);
-                if (t.isEmpty()) {
-                    d->error.reset(new ConnectionError());
-                    d->consumed = true;
-                    return QByteArray();
-                }
-                d->body.append(t);
+            raw = recvSized(stream.data(), BlockSize, static_cast<qint32>(qMin<qint64>(leftBytes, INT_MAX)));
+            if (raw.isEmpty()) {
+                finish(new ConnectionError());
+                return false;
             }
         }
-    } else if (contentLength < 0) { // without `Content-Length` header.
-        if (d->stream.isNull()) {
-            d->error.reset(new UnrewindableBodyError());
-            d->consumed = true;
-            return QByteArray();
+        leftBytes -= raw.size();
+        break;
+    case Chunked: {
+        ChunkedBlockReader::Error error;
+        raw = chunkedReader->nextBlock(std::numeric_limits<qint32>::max(), &error);
+        if (error != ChunkedBlockReader::NoError) {
+            finish(toRequestError(error));
+            return false;
         }
-        const QByteArray &transferEncodingHeader = header(QStringLiteral("Transfer-Encoding"));
-        bool readTrunked = (transferEncodingHeader.toLower() == QByteArray("chunked"));
-        if (readTrunked) {
-            ChunkedBlockReader reader(d->stream, d->body);
-            ChunkedBlockReader::Error readerError;
-//            reader.debugLevel = debugLevel;
-            d->body.clear();
-            RequestError *error = nullptr;
-            while (true) {
-                qint64 leftBytes = d->request.maxBodySize() - d->body.size();
-                const QByteArray &block = reader.nextBlock(leftBytes, &readerError);
-                error = toRequestError(readerError);
-                if (error != nullptr) {
-                    d->error.reset(error);
-                    d->consumed = true;
-                    return QByteArray();
-                }
-                if (block.isEmpty()) {
-                    break;
-                }
-                d->body.append(block);
-            }
+        if (raw.isEmpty()) {
+            finish();
+            return failure.isNull();
+        }
+        break;
+    }
+    case UntilClosed:
+        if (!buf.isEmpty()) {
+            raw = buf;
+            buf.clear();
         } else {
-            while (d->body.size() < d->request.maxBodySize()) {
-                const QByteArray &t = d->stream->recv(1024 * 8);
-                if(t.isEmpty()) {
-                    break;
-                }
-                d->body.append(t);
+            raw = recvSized(stream.data(), BlockSize);
+            if (raw.isEmpty()) {
+                finish();
+                return failure.isNull();
             }
         }
-    } else { // nothing to read. empty document.
-        if(!d->body.isEmpty()) {
-            // warning!
-            qWarning() << "the body is not empty but content length is set to 0.";
-        }
-    }
-    const QByteArray &contentEncodingHeader = header("Content-Encoding");
-    if(contentEncodingHeader.toLower() == QByteArray("deflate") && !d->body.isEmpty()) {
-        uchar header[4];
-        qToBigEndian<quint32>(static_cast<quint32>(d->body.size()), header);
-        QByteArray t; t.reserve(d->body.size() + 4);
-        t.append(reinterpret_cast<const char*>(header), 4);
-        qDebug() << t;
-        t.append(d->body);
-        qDebug() << t;
-        d->body = qUncompress(t);
-        if(d->body.isEmpty()) {
-            d->error.reset(new ContentDecodingError());
-            d->consumed = true;
-            return QByteArray();
+        break;
+    }
+    if (decoder) {
+        if (!decoder->decode(raw, &pending)) {
+            finish(new ContentDecodingError());
+            return false;
         }
-//    } else if (contentEncodingHeader.toLower() == QByteArray("gzip") && !d->body.isEmpty()) {
-//        d->body = unzip(d->body);
-//        if(d->body.isEmpty()) {
-//            d->error.reset(new ContentDecodingError());
-//            d->consumed = true;
-//            return QByteArray();
-//        }
-    } else if (!contentEncodingHeader.isEmpty()){
-        qWarning() << "unsupported content encoding." << contentEncodingHeader;
+    } else {
+        pending.append(raw);
+    }
+    if (framing == ContentLength && leftBytes == 0) {
+        finish();
+    }
+    return failure.isNull();
+}
+
+
+qint32 HttpBodyReader::read(char *data, qint32 size)
+{
+    // a compressed block may decode to nothing, read more then.
+    while (pending.isEmpty() && !ended) {
+        if (!fill()) {
+            return -1;
+        }
+    }
+    if (pending.isEmpty()) {
+        return failure.isNull() ? 0 : -1;
+    }
+    const qint32 readBytes = qMin(size, pending.size());
+    memcpy(data, pending.constData(), static_cast<size_t>(readBytes));
+    pending.remove(0, readBytes);
+    return readBytes;
+}
+
+
+qint32 HttpBodyReader::readall(char *data, qint32 size)
+{
+    qint32 total = 0;
+    while (total < size) {
+        qint32 readBytes = read(data + total, size - total);
+        if (readBytes < 0) {
+            return total > 0 ? total : -1;
+        } else if (readBytes == 0) {
+            break;
+        }
+        total += readBytes;
+    }
+    return total;
+}
+
+
+qint32 HttpBodyReader::write(char *, qint32)
+{
+    return -1;
+}
+
+
+qint32 HttpBodyReader::writeall(char *, qint32)
+{
+    return -1;
+}
+
+
+bool HttpBodyReader::atEnd()
+{
+    return ended && pending.isEmpty();
+}
+
+
+void HttpBodyReader::close()
+{
+    if (!ended) {
+        finish(new ConnectionError());
+    }
+    pending.clear();
+}
+
+
+qint64 HttpBodyReader::size()
+{
+    // the size of decoded body is unknown.
+    if (framing == Empty) {
+        return 0;
+    } else if (framing == ContentLength && !decoder) {
+        return contentLength;
+    }
+    return -1;
+}
+
+
+QByteArray HttpResponse::body()
+{
+    if (d->consumed) {
+        return d->body;
     }
     d->consumed = true;
+    if (d->stream.isNull()) {
+        return d->body;
+    }
+    // the bytes after header are read by the header splitter already.
+    HttpBodyReader reader(*this, d->stream, d->body, d->pool, d->origin);
+    d->stream.clear();
+    d->body.clear();
+    const qint32 maxBodySize = d->request.maxBodySize();
+    if (reader.size() > maxBodySize) {
+        reader.close();
+        d->error.reset(new UnrewindableBodyError());
+        return QByteArray();
+    }
+    const qint32 BlockSize = 1024 * 64;
+    QByteArray body;
+    while (true) {
+        if (body.size() > maxBodySize) {
+            reader.close();
+            d->error.reset(new UnrewindableBodyError());
+            return QByteArray();
+        }
+        const int oldSize = body.size();
+        body.resize(oldSize + BlockSize);
+        qint32 readBytes = reader.read(body.data() + oldSize, BlockSize);
+        body.resize(oldSize + qMax(0, readBytes));
+        if (readBytes < 0) {
+            d->error = reader.error();
+            return QByteArray();
+        } else if (readBytes == 0) {
+            break;
+        }
+    }
+    d->body = body;
     return d->body;
 }
 
 
+QSharedPointer<FileLike> HttpResponse::bodyReader()
+{
+    if (d->consumed || d->stream.isNull()) {
+        return FileLike::bytes(body());
+    }
+    QSharedPointer<FileLike> reader(new HttpBodyReader(*this, d->stream, d->body, d->pool, d->origin));
+    d->stream.clear();
+    d->body.clear();
+    d->consumed = true;
+    return reader;
+}
+
+
 void HttpResponse::setBody(const QByteArray &body)
 {
     d->body = body;
@@ -595,6 +1083,12 @@ void HttpResponse::setElapsed(qint64 elapsed)
 }
 
 
+HttpTimings HttpResponse::timings() const
+{
+    return d->timings;
+}
+
+
 QList<HttpResponse> HttpResponse::history() const
 {
     return d->history;
@@ -634,6 +1128,16 @@ QJsonDocument HttpResponse::json()
     }
 }
 
+JsonView HttpResponse::jsonView()
+{
+    return JsonView::parse(body());
+}
+
+QByteArray HttpResponse::jsonAsMsgPack()
+{
+    return jsonToMsgPack(body());
+}
+
 QString HttpResponse::html()
 {
     // TODO detect encoding;
@@ -655,6 +1159,11 @@ bool HttpResponse::hasHttpError() const
     return !d->error.isNull() && d->error.dynamicCast<HTTPError>() != nullptr;
 }
 
+bool HttpResponse::isFromCache() const
+{
+    return d->fromCache;
+}
+
 
 QSharedPointer<RequestError> HttpResponse::error() const
 {
@@ -668,10 +1177,22 @@ void HttpResponse::setError(QSharedPointer<RequestError> error)
 }
 
 
+static bool isIdempotent(const QString &method)
+{
+    return method.compare(QLatin1String("GET"), Qt::CaseInsensitive) == 0
+            || method.compare(QLatin1String("HEAD"), Qt::CaseInsensitive) == 0
+            || method.compare(QLatin1String("OPTIONS"), Qt::CaseInsensitive) == 0
+            || method.compare(QLatin1String("PUT"), Qt::CaseInsensitive) == 0
+            || method.compare(QLatin1String("DELETE"), Qt::CaseInsensitive) == 0;
+}
+
+
 HttpSessionPrivate::HttpSessionPrivate(HttpSession *q_ptr)
-    :defaultVersion(HttpVersion::Http1_1), q_ptr(q_ptr), debugLevel(0)
+    :defaultVersion(HttpVersion::Http1_1), q_ptr(q_ptr), debugLevel(0), pipeliningDepth(1), latencyIndex(0)
+    , retryTokens(10.0f), cookieVersion(0)
 {
     defaultUserAgent = QStringLiteral("Mozilla/5.0 (X11; Linux x86_64; rv:52.0) Gecko/20100101 Firefox/52.0");
+    userAgentLine = "User-Agent: " + defaultUserAgent.toUtf8() + "\r\n";
 }
 
 HttpSessionPrivate::~HttpSessionPrivate()
@@ -680,85 +1201,192 @@ HttpSessionPrivate::~HttpSessionPrivate()
 }
 
 
-static QUrl hostOnly(const QUrl &url)
+HttpOrigin::HttpOrigin(const QUrl &url)
+    :url(url), scheme(InvalidScheme), port(0), explicitPort(false)
 {
-    QUrl h;
-    h.setScheme(url.scheme());
-    h.setHost(url.host());
-    h.setPort(url.port());
-    return h;
+    const QString &schemeName = url.scheme();
+    if (schemeName == QLatin1String("http")) {
+        scheme = HttpScheme;
+    } else if (schemeName == QLatin1String("https")) {
+        scheme = HttpsScheme;
+    } else {
+        return;
+    }
+    host = url.host();
+    const int urlPort = url.port();
+    explicitPort = urlPort != -1;
+    port = explicitPort ? static_cast<quint16>(urlPort) : (scheme == HttpScheme ? 80 : 443);
+    key = schemeName + QLatin1String("://") + host + QLatin1Char(':') + QString::number(urlPort);
+    hostHeader = host.toUtf8();
+    if (explicitPort) {
+        hostHeader.append(':');
+        hostHeader.append(QByteArray::number(urlPort));
+    }
 }
 
-ConnectionPool::ConnectionPool()
-    :maxConnectionsPerServer(10), timeToLive(60 * 5), operations(new CoroutineGroup), proxySwitcher(new SimpleProxySwitcher)
+
+QByteArray HttpOrigin::targetOf(const QUrl &url)
 {
-    operations->spawnWithName("removeUnusedConnections", [this] {removeUnusedConnections();});
+    const QByteArray &target = url.toEncoded(QUrl::RemoveAuthority | QUrl::RemoveFragment | QUrl::RemoveScheme);
+    return target.isEmpty() ? QByteArray("/") : target;
 }
 
-ConnectionPool::~ConnectionPool()
+
+QString ConnectionPool::keyOf(const QUrl &url)
 {
-    delete operations;
+    return url.scheme() + QLatin1String("://") + url.host() + QLatin1Char(':') + QString::number(url.port());
 }
 
-void ConnectionPool::recycle(const QUrl &url, QSharedPointer<SocketLike> connection)
+
+// the new host is checked by the cleaner after its time to live.
+ConnectionPoolItem &ConnectionPool::itemOf(const QString &key)
 {
-    const QUrl &h = hostOnly(url);
-    ConnectionPoolItem &item = items[h];
-    item.lastUsed = QDateTime::currentDateTimeUtc();
-    if(item.semaphore.isNull()) {
-        item.semaphore.reset(new Semaphore(maxConnectionsPerServer));
+    const qint64 now = QElapsedTimer::msecsSinceReference();
+    QHash<QString, ConnectionPoolItem>::iterator itor = items.find(key);
+    if (itor == items.end()) {
+        itor = items.insert(key, ConnectionPoolItem());
+        itor->semaphore.reset(new Semaphore(maxConnectionsPerServer));
+        deadlines.insert(now + static_cast<qint64>(timeToLive) * 1000, key);
     }
-    if(item.connections.size() < maxConnectionsPerServer) {
-        item.connections.append(connection);
+    itor->lastUsed = now;
+    return *itor;
+}
+
+
+ConnectionPool::ConnectionPool()
+    :maxConnectionsPerServer(10), timeToLive(60 * 5), prewarmers(new CoroutineGroup), proxySwitcher(new SimpleProxySwitcher)
+    , self(new ConnectionPool *(this)), createdConnections(0), reusedConnections(0), expiredConnections(0)
+{
+#ifndef QTNG_NO_CRYPTO
+    setSslConfiguration(SslConfiguration());
+#endif
+    // a stackless task is enough, it never blocks. it sleeps until the first deadline, not polling.
+    cleaner = Task::spawn([this] (Task *task) {
+        task->msleep(static_cast<quint32>(removeUnusedConnections()));
+        return true;
+    });
+}
+
+// the idle connections per host, a gauge of all pools.
+static inline void countIdleConnections(const QString &key, qint64 delta)
+{
+    if (delta && Metrics::isEnabled()) {
+        Metrics::adjust("qtng_http_pool_idle_connections", Metrics::label("host", key), delta);
     }
 }
 
-QSharedPointer<SocketLike> ConnectionPool::connectionForUrl(const QUrl &url, RequestError **error)
+
+ConnectionPool::~ConnectionPool()
 {
-    const QUrl &h = hostOnly(url);
-    ConnectionPoolItem &item = items[h];
+    *self = nullptr;
+    cleaner->kill();
+    delete prewarmers;
+    for (QHash<QString, ConnectionPoolItem>::const_iterator itor = items.constBegin(); itor != items.constEnd(); ++itor) {
+        countIdleConnections(itor.key(), -itor->connections.size());
+    }
+}
 
-    item.lastUsed = QDateTime::currentDateTimeUtc();
-    if(item.semaphore.isNull()) {
-        item.semaphore.reset(new Semaphore(maxConnectionsPerServer));
+void ConnectionPool::recycle(const HttpOrigin &origin, QSharedPointer<SocketLike> connection)
+{
+    const QString &key = origin.key;
+    ConnectionPoolItem &item = itemOf(key);
+    if (!shared.isNull() && item.minIdle == 0 && shared->recycle(key, connection)) {
+        return;
     }
-    ScopedLock<Semaphore> lock(item.semaphore);
+    // the oldest one is dropped, the warm ones are kept.
+    if (item.connections.size() >= maxConnectionsPerServer && !item.connections.isEmpty()) {
+        item.connections.removeFirst();
+        countIdleConnections(key, -1);
+    }
+    item.connections.append(IdleConnection(connection, item.lastUsed));
+    countIdleConnections(key, 1);
+}
+
+QSharedPointer<SocketLike> ConnectionPool::connectionForUrl(const HttpOrigin &origin, RequestError **error, bool fastOpen,
+                                                            HttpPhaseTimer *phases)
+{
+    const QString &key = origin.key;
+    QSharedPointer<Semaphore> semaphore = itemOf(key).semaphore;
+    ScopedLock<Semaphore> lock(semaphore);
     if (!lock.isSuccess()) {
         return QSharedPointer<SocketLike>();
     }
+    // the item may be removed by the cleaner while waiting, so it is looked up again.
+    ConnectionPoolItem &item = itemOf(key);
 
     QSharedPointer<SocketLike> connection;
 
     while (!item.connections.isEmpty()) {
-        connection = item.connections.takeFirst();
+        connection = item.connections.takeLast().connection;
+        countIdleConnections(key, -1);
         if (connection->isValid()) {
+            ++reusedConnections;
+            if (phases) {
+                phases->timings->reusedConnection = true;
+            }
+            if (Metrics::isEnabled()) {
+                Metrics::increase("qtng_http_pool_hits_total", Metrics::label("host", key));
+            }
+            if (item.connections.size() < item.minIdle) {
+                refillLater(origin);
+            }
+            return connection;
+        }
+    }
+    bool counted = false;
+    if (!shared.isNull()) {
+        connection = shared->takeConnection(key, &counted);
+        if (!connection.isNull()) {
+            ++reusedConnections;
+            if (phases) {
+                phases->timings->reusedConnection = true;
+            }
+            if (Metrics::isEnabled()) {
+                Metrics::increase("qtng_http_pool_hits_total", Metrics::label("host", key));
+            }
             return connection;
         }
+        if (!counted) {
+            *error = new ConnectionError();
+            return QSharedPointer<SocketLike>();
+        }
+    }
+    if (Metrics::isEnabled()) {
+        Metrics::increase("qtng_http_pool_misses_total", Metrics::label("host", key));
     }
+    return newConnection(origin, error, fastOpen, phases, counted);
+}
+
 
+QSharedPointer<SocketLike> ConnectionPool::newConnection(const HttpOrigin &origin, RequestError **error, bool fastOpen,
+                                                         HttpPhaseTimer *phases, bool counted)
+{
+    ++createdConnections;
+    QSharedPointer<SocketLike> connection;
     QSharedPointer<Socket> rawSocket;
-    quint16 defaultPort = 80;
-    if(url.scheme() == QStringLiteral("http")) {
-    } else{
-#ifndef QTNG_NO_CRYPTO
-        defaultPort = 443;
-#else
+#ifdef QTNG_NO_CRYPTO
+    if (origin.isSecure()) {
+        if (counted) {
+            shared->release(origin.key);
+        }
         *error = new ConnectionError();
         return QSharedPointer<SocketLike>();
-#endif
     }
+#endif
 
-
-
-    QSharedPointer<Socks5Proxy> socks5Proxy = proxySwitcher->selectSocks5Proxy(url);
+    QSharedPointer<Socks5Proxy> socks5Proxy = proxySwitcher->selectSocks5Proxy(origin.url);
     if(socks5Proxy) {
-        rawSocket = socks5Proxy->connect(url.host(), static_cast<quint16>(url.port(defaultPort)));
-        if(url.scheme() == QStringLiteral("http")) {
+        // the socket of proxy is not counted.
+        if (counted) {
+            shared->release(origin.key);
+        }
+        rawSocket = socks5Proxy->connect(origin.host, origin.port);
+        if(!origin.isSecure()) {
             connection = SocketLike::rawSocket(rawSocket);
         } else{
     #ifndef QTNG_NO_CRYPTO
-            QSharedPointer<SslSocket> ssl(new SslSocket(rawSocket));
-            ssl->handshake(false);
+            QSharedPointer<SslSocket> ssl(new SslSocket(rawSocket, sslConfiguration));
+            ssl->handshake(false, origin.host);
             connection = SocketLike::sslSocket(ssl);
     #else
             *error = new ConnectionError();
@@ -766,20 +1394,31 @@ QSharedPointer<SocketLike> ConnectionPool::connectionForUrl(const QUrl &url, Req
     #endif
         }
     } else {
-        rawSocket.reset(new Socket);
+        if (counted) {
+            rawSocket = SharedHttpSessionPrivate::countedSocket(shared, origin.key);
+        } else {
+            rawSocket.reset(new Socket);
+        }
         rawSocket->setDnsCache(dnsCache);
+        if (fastOpen) {
+            // fails silently if the kernel does not support it.
+            rawSocket->setOption(Socket::TcpFastOpenConnectOption, 1);
+        }
 
-        if(url.scheme() == QStringLiteral("http")) {
+        if (phases) {
+            return timedConnect(origin, rawSocket, phases, error);
+        }
+        if(!origin.isSecure()) {
             connection = SocketLike::rawSocket(rawSocket);
         } else{
     #ifndef QTNG_NO_CRYPTO
-            connection = SocketLike::sslSocket(QSharedPointer<SslSocket>::create(rawSocket));
+            connection = SocketLike::sslSocket(QSharedPointer<SslSocket>::create(rawSocket, sslConfiguration));
     #else
             *error = new ConnectionError();
             return QSharedPointer<SocketLike>();
     #endif
         }
-        if(!connection->connect(url.host(), static_cast<quint16>(url.port(defaultPort)))) {
+        if(!connection->connect(origin.host, origin.port)) {
             *error = new ConnectionError();
             return QSharedPointer<SocketLike>();
         }
@@ -789,23 +1428,264 @@ QSharedPointer<SocketLike> ConnectionPool::connectionForUrl(const QUrl &url, Req
 }
 
 
-void ConnectionPool::removeUnusedConnections()
+// resolves by the dns cache first, so the host is found in the cache by Socket::connect() and the dns phase is
+// apart. the tls handshake is made after connecting, as SslSocket::connect() does.
+QSharedPointer<SocketLike> ConnectionPool::timedConnect(const HttpOrigin &origin, QSharedPointer<Socket> rawSocket,
+                                                        HttpPhaseTimer *phases, RequestError **error)
 {
-    while(true) {
-        const QDateTime &now = QDateTime::currentDateTimeUtc();
-        try {
-            Coroutine::sleep(1);
-        } catch (CoroutineException &) {
-            return;
+    const QString &host = origin.host;
+    qint64 since = phases->now();
+    if (!dnsCache.isNull() && QHostAddress(host).isNull()) {
+        const bool found = !dnsCache->resolve(host).isEmpty();
+        phases->record(HttpTimings::DnsPhase, since);
+        if (!found) {
+            *error = new ConnectionError();
+            return QSharedPointer<SocketLike>();
+        }
+        since = phases->now();
+    }
+    if (!rawSocket->connect(host, origin.port)) {
+        *error = new ConnectionError();
+        return QSharedPointer<SocketLike>();
+    }
+    phases->record(HttpTimings::ConnectPhase, since);
+    if (!origin.isSecure()) {
+        return SocketLike::rawSocket(rawSocket);
+    }
+#ifndef QTNG_NO_CRYPTO
+    since = phases->now();
+    QSharedPointer<SslSocket> ssl = QSharedPointer<SslSocket>::create(rawSocket, sslConfiguration);
+    if (!ssl->handshake(false, host)) {
+        *error = new ConnectionError();
+        return QSharedPointer<SocketLike>();
+    }
+    phases->record(HttpTimings::TlsPhase, since);
+    return SocketLike::sslSocket(ssl);
+#else
+    *error = new ConnectionError();
+    return QSharedPointer<SocketLike>();
+#endif
+}
+
+
+QSharedPointer<Http2Connection> ConnectionPool::http2ConnectionForUrl(const HttpOrigin &origin, RequestError **error)
+{
+#ifndef QTNG_NO_CRYPTO
+    const QString &key = origin.key;
+    QSharedPointer<Lock> lock;
+    {
+        // the item may be removed by the cleaner while waiting, so it is looked up again.
+        ConnectionPoolItem &item = itemOf(key);
+        if (item.http2Unsupported) {
+            return QSharedPointer<Http2Connection>();
+        }
+        if (!item.http2.isNull() && item.http2->isValid()) {
+            return item.http2;
+        }
+        if (item.http2Lock.isNull()) {
+            item.http2Lock.reset(new Lock());
+        }
+        lock = item.http2Lock;
+    }
+    ScopedLock<Lock> l(lock);
+    if (!l.isSuccess()) {
+        *error = new ConnectionError();
+        return QSharedPointer<Http2Connection>();
+    }
+    {
+        ConnectionPoolItem &item = itemOf(key);
+        if (item.http2Unsupported) {
+            return QSharedPointer<Http2Connection>();
+        }
+        if (!item.http2.isNull() && item.http2->isValid()) {
+            return item.http2;
+        }
+    }
+
+    const SslConfiguration &config = http2SslConfiguration;
+    const quint16 port = origin.port;
+    QSharedPointer<SslSocket> ssl;
+    QSharedPointer<Socks5Proxy> socks5Proxy = proxySwitcher->selectSocks5Proxy(origin.url);
+    if (socks5Proxy) {
+        QSharedPointer<Socket> rawSocket = socks5Proxy->connect(origin.host, port);
+        if (rawSocket.isNull()) {
+            *error = new ConnectionError();
+            return QSharedPointer<Http2Connection>();
+        }
+        ssl.reset(new SslSocket(rawSocket, config));
+        if (!ssl->handshake(false, origin.host)) {
+            *error = new ConnectionError();
+            return QSharedPointer<Http2Connection>();
+        }
+    } else {
+        QSharedPointer<Socket> rawSocket(new Socket);
+        rawSocket->setDnsCache(dnsCache);
+        ssl.reset(new SslSocket(rawSocket, config));
+        if (!ssl->connect(origin.host, port)) {
+            *error = new ConnectionError();
+            return QSharedPointer<Http2Connection>();
+        }
+    }
+    if (ssl->negotiatedProtocol() != "h2") {
+        itemOf(key).http2Unsupported = true;
+        recycle(origin, SocketLike::sslSocket(ssl));
+        return QSharedPointer<Http2Connection>();
+    }
+    QSharedPointer<Http2Connection> http2(new Http2Connection(SocketLike::sslSocket(ssl)));
+    if (!http2->start()) {
+        *error = new ConnectionError();
+        return QSharedPointer<Http2Connection>();
+    }
+    itemOf(key).http2 = http2;
+    return http2;
+#else
+    Q_UNUSED(origin);
+    Q_UNUSED(error);
+    return QSharedPointer<Http2Connection>();
+#endif
+}
+
+
+QSharedPointer<HttpPipeline> ConnectionPool::pipelineForUrl(const HttpOrigin &origin, int depth, RequestError **error)
+{
+    const QString &key = origin.key;
+    ConnectionPoolItem &item = itemOf(key);
+    for (int i = item.pipelines.size() - 1; i >= 0; --i) {
+        if (!item.pipelines.at(i)->valid) {
+            item.pipelines.removeAt(i);
+        }
+    }
+    for (QSharedPointer<HttpPipeline> pipeline: item.pipelines) {
+        if (pipeline->turns.size() < depth) {
+            return pipeline;
+        }
+    }
+    QSharedPointer<SocketLike> connection = connectionForUrl(origin, error, true);
+    if (connection.isNull()) {
+        return QSharedPointer<HttpPipeline>();
+    }
+    // the item may be removed by the cleaner while connecting.
+    QSharedPointer<HttpPipeline> pipeline(new HttpPipeline(connection));
+    itemOf(key).pipelines.append(pipeline);
+    return pipeline;
+}
+
+
+// the prewarmed connections closed by the server are opened again after it at most.
+static const qint64 PrewarmCheckInterval = 15 * 1000;
+
+
+qint64 ConnectionPool::removeUnusedConnections()
+{
+    const qint64 now = QElapsedTimer::msecsSinceReference();
+    const qint64 ttl = static_cast<qint64>(timeToLive) * 1000;
+    if (!shared.isNull()) {
+        expiredConnections += static_cast<quint64>(shared->removeExpiredConnections(ttl));
+    }
+    while (!deadlines.isEmpty() && deadlines.firstKey() <= now) {
+        const QString key = deadlines.first();
+        deadlines.erase(deadlines.begin());
+        QHash<QString, ConnectionPoolItem>::iterator itor = items.find(key);
+        if (itor == items.end()) {
+            continue;
+        }
+        ConnectionPoolItem &item = *itor;
+        if (item.lastUsed + ttl <= now && item.minIdle == 0) {
+            // the http2 connection and pipelines unused so long go away with the host.
+            expiredConnections += static_cast<quint64>(item.connections.size());
+            countIdleConnections(key, -item.connections.size());
+            items.erase(itor);
+            continue;
         }
-        QMap<QUrl, ConnectionPoolItem> newItems;
-        for (QMap<QUrl, ConnectionPoolItem>::const_iterator itor = items.constBegin(); itor != items.constEnd(); ++itor) {
-            if(itor.value().lastUsed.secsTo(now) < timeToLive) {
-                newItems.insert(itor.key(), itor.value());
+        // the oldest idle connections are at the front, the prewarmed ones are kept until they are closed.
+        while (item.connections.size() > item.minIdle && item.connections.first().idleSince + ttl <= now) {
+            item.connections.removeFirst();
+            countIdleConnections(key, -1);
+            ++expiredConnections;
+        }
+        if (item.minIdle > 0) {
+            for (int i = item.connections.size() - 1; i >= 0; --i) {
+                if (!item.connections.at(i).connection->isValid()) {
+                    item.connections.removeAt(i);
+                    countIdleConnections(key, -1);
+                    ++expiredConnections;
+                }
             }
+            if (item.connections.size() < item.minIdle) {
+                refillLater(item.origin);
+            }
+            deadlines.insert(now + qMin<qint64>(ttl, PrewarmCheckInterval), key);
+            continue;
+        }
+        qint64 next = item.lastUsed;
+        if (!item.connections.isEmpty()) {
+            next = qMin(next, item.connections.first().idleSince);
         }
-        items = newItems;
+        deadlines.insert(next + ttl, key);
+    }
+    if (deadlines.isEmpty()) {
+        return ttl;
+    }
+    return qBound<qint64>(1000, deadlines.firstKey() - now, ttl);
+}
+
+
+int ConnectionPool::prewarm(const HttpOrigin &origin, int count)
+{
+    const QString &key = origin.key;
+    {
+        ConnectionPoolItem &item = itemOf(key);
+        item.minIdle = qBound(0, count, maxConnectionsPerServer);
+        item.origin = origin;
+    }
+    openIdleConnections(origin);
+    return itemOf(key).connections.size();
+}
+
+
+void ConnectionPool::refillLater(const HttpOrigin &origin)
+{
+    const QString &key = origin.key;
+    if (!prewarmers->has(key)) {
+        prewarmers->spawnWithName(key, [this, origin] { openIdleConnections(origin); });
+    }
+}
+
+
+// the connections are made at the same time, so the handshakes take the time of one.
+void ConnectionPool::openIdleConnections(const HttpOrigin &origin)
+{
+    QHash<QString, ConnectionPoolItem>::iterator itor = items.find(origin.key);
+    if (itor == items.end()) {
+        return;
+    }
+    const int missing = itor->minIdle - itor->connections.size();
+    CoroutineGroup operations;
+    for (int i = 0; i < missing; ++i) {
+        operations.spawn([this, origin] {
+            RequestError *error = nullptr;
+            QSharedPointer<SocketLike> connection = newConnection(origin, &error, false, nullptr);
+            delete error;
+            if (!connection.isNull()) {
+                recycle(origin, connection);
+            }
+        });
+    }
+    operations.joinall();
+}
+
+
+HttpConnectionPoolStats ConnectionPool::stats() const
+{
+    HttpConnectionPoolStats s;
+    s.hosts = items.size();
+    for (QHash<QString, ConnectionPoolItem>::const_iterator itor = items.constBegin(); itor != items.constEnd(); ++itor) {
+        s.idleConnections += itor->connections.size();
     }
+    s.createdConnections = createdConnections;
+    s.reusedConnections = reusedConnections;
+    s.expiredConnections = expiredConnections;
+    return s;
 }
 
 
@@ -841,6 +1721,16 @@ void ConnectionPool::setHttpProxy(QSharedPointer<HttpProxy> proxy)
 }
 
 
+#ifndef QTNG_NO_CRYPTO
+void ConnectionPool::setSslConfiguration(const SslConfiguration &config)
+{
+    sslConfiguration = config;
+    http2SslConfiguration = config;
+    http2SslConfiguration.setAllowedNextProtocols(QList<QByteArray>() << "h2" << "http/1.1");
+}
+#endif
+
+
 RequestError *toRequestError(HeaderSplitter::Error error)
 {
     switch (error) {
@@ -865,13 +1755,6 @@ HttpResponse HttpSessionPrivate::send(HttpRequest &request)
     HttpResponse response;
     response.d->url = url;
     response.d->request = request;
-    if(url.scheme() != QStringLiteral("http") && url.scheme() != QStringLiteral("https")) {
-        if (debugLevel > 0) {
-            qDebug() << "invalid scheme" << url.scheme();
-        }
-        response.d->error.reset(new InvalidScheme());
-        return response;
-    }
     if(!request.d->query.isEmpty()) {
         QUrlQuery query(url);
         for (QMap<QString, QString>::const_iterator itor = request.d->query.constBegin(); itor != request.d->query.constEnd(); ++itor) {
@@ -879,21 +1762,56 @@ HttpResponse HttpSessionPrivate::send(HttpRequest &request)
         }
         url.setQuery(query);
         request.d->url = url.toString();
+        request.d->origin = HttpOrigin();
+    }
+    // the retries and hedges of the request send the same target.
+    if (!request.d->origin.isValid()) {
+        request.d->origin = HttpOrigin(url);
+        request.d->target = HttpOrigin::targetOf(url);
+    }
+    const HttpOrigin origin = request.d->origin;
+    if(!origin.isValid()) {
+        if (debugLevel > 0) {
+            qDebug() << "invalid scheme" << url.scheme();
+        }
+        response.d->error.reset(new InvalidScheme());
+        return response;
     }
 
-    mergeCookies(request, url);
-    QList<HttpHeader> allHeaders = makeHeaders(request, url);
+    // h2 is selected by alpn, the servers without it are served by http/1.1.
+    const HttpVersion version = request.d->version == HttpVersion::Unknown ? defaultVersion : request.d->version;
+    // the http/2 requests are sent as a whole, the streamed bodies go by http/1.1.
+    if (version == HttpVersion::Http2_0 && request.d->bodyFile.isNull()) {
+        QSharedPointer<Http2Connection> http2;
+        if (origin.isSecure()) {
+            http2 = http2ConnectionForUrl(origin, &error);
+        }
+        if (error != nullptr) {
+            response.d->error.reset(error);
+            return response;
+        }
+        if (!http2.isNull()) {
+            request.d->version = HttpVersion::Http2_0;
+            return sendHttp2(http2, request, response);
+        }
+        request.d->version = HttpVersion::Http1_1;
+    }
 
-    QSharedPointer<SocketLike> connection = connectionForUrl(url, &error);
-    if (error != nullptr) {
-        response.d->error.reset(error);
-        return response;
+    // no chunked encoding in http/1.0, the body of unknown size is read first.
+    if (version == HttpVersion::Http1_0 && !request.d->bodyFile.isNull() && request.d->bodyFile->size() < 0) {
+        bool ok = true;
+        request.d->body = request.d->bodyFile->readall(&ok);
+        request.d->bodyFile.clear();
+        if (!ok) {
+            response.d->error.reset(new RequestError());
+            return response;
+        }
     }
 
     if(request.d->version == HttpVersion::Unknown) {
         request.d->version = defaultVersion;
     }
-    QByteArray versionBytes;
+    const char *versionBytes;
     if(request.d->version == HttpVersion::Http1_0) {
         versionBytes = "HTTP/1.0";
     } else if(request.d->version == HttpVersion::Http1_1) {
@@ -908,110 +1826,90 @@ HttpResponse HttpSessionPrivate::send(HttpRequest &request)
         return response;
     }
 
-    QByteArrayList lines;
-    QByteArray resourcePath = url.toEncoded(QUrl::RemoveAuthority | QUrl::RemoveFragment | QUrl::RemoveScheme);
-    if (resourcePath.isEmpty()) {
-        resourcePath = "/";
-    }
-    const QByteArray &commandLine = request.d->method.toUpper().toUtf8() + QByteArray(" ") +
-            resourcePath + QByteArray(" ") + versionBytes + QByteArray("\r\n");
-    lines.append(commandLine);
-    for (int i = 0;i < allHeaders.size(); ++i) {
-        const HttpHeader &header = allHeaders.at(i);
-        lines.append(header.name.toUtf8() + QByteArray(": ") + header.value + QByteArray("\r\n"));
-    }
-    lines.append(QByteArray("\r\n"));
+    // the head and a small body go in one buffer, a big body is sent by the same writev() without copying.
+    const int MaxInlineBody = 1024 * 16;
+    const bool inlineBody = !request.d->body.isEmpty() && request.d->body.size() <= MaxInlineBody;
+    writeRequestHead(request, origin, request.d->target, versionBytes, inlineBody ? request.d->body.size() : 0);
     if(debugLevel > 0) {
-        qDebug() << "sending headers:" << lines.join();
+        qDebug() << "sending headers:" << requestBuffer;
     }
-    if (!connection->sendall(lines.join())) {
-        response.d->error.reset(new ConnectionError());
-        return response;
+    if (inlineBody) {
+        requestBuffer.append(request.d->body);
     }
-
-    if(!request.d->body.isEmpty()) {
-        if(debugLevel > 1) {
-            qDebug() << "sending body:" << request.d->body;
-        }
-        if (!connection->sendall(request.d->body)) {
-            response.d->error.reset(new ConnectionError());
-            return response;
-        }
+    if(!request.d->body.isEmpty() && debugLevel > 1) {
+        qDebug() << "sending body:" << request.d->body;
+    }
+    QByteArrayList lines;
+    lines.append(requestBuffer);
+    if (!request.d->body.isEmpty() && !inlineBody) {
+        lines.append(request.d->body);
     }
 
-    HeaderSplitter headerSplitter(connection);
-    HeaderSplitter::Error headerSplitterError;
+    // the SYN carrying data may be replayed by the network, only idempotent requests opt in to fast open.
+    // they are also safe to pipeline, and to send again if the connection drops.
+    bool idempotent = isIdempotent(request.d->method);
+    if (idempotent && pipeliningDepth > 1 && request.d->version == HttpVersion::Http1_1 && !request.streamResponse()
+            && request.d->bodyFile.isNull()) {
+        return sendPipelined(request, response, lines);
+    }
 
-    // parse first line.
-    QByteArray firstLine = headerSplitter.nextLine(&headerSplitterError);
-    error = toRequestError(headerSplitterError);
+    // the phases are counted from here, the time before is small and counted in the total.
+    HttpPhaseTimer phases(&response.d->timings);
+    QSharedPointer<SocketLike> connection = connectionForUrl(origin, &error, idempotent, &phases);
     if (error != nullptr) {
         response.d->error.reset(error);
         return response;
     }
-    QStringList commands = QString::fromLatin1(firstLine).split(QRegExp("\\s+"));
-    if(commands.size() != 3) {
-        response.d->error.reset(new InvalidHeader());
-        return response;
-    }
-    if(commands.at(0) == QStringLiteral("HTTP/1.0")) {
-        response.d->version = Http1_0;
-    } else if(commands.at(0) == QStringLiteral("HTTP/1.1")) {
-        response.d->version = Http1_1;
-    } else {
-        response.d->error.reset(new InvalidHeader());
-        return response;
+
+    // the headers and body are sent by one syscall, without joining them.
+    qint64 since = phases.now();
+    qint32 bytesToSend = 0;
+    for (const QByteArray &line: lines) {
+        bytesToSend += line.size();
     }
-    bool ok;
-    response.d->statusCode = commands.at(1).toInt(&ok);
-    if(!ok) {
-        response.d->error.reset(new InvalidHeader());
+    if (connection->sendallv(lines) != bytesToSend) {
+        response.d->error.reset(new ConnectionError());
         return response;
     }
-    response.d->statusText = commands.at(2);
-
-    // parse headers.
-    const int MaxHeaders = 64;
-    QList<HttpHeader> headers = headerSplitter.headers(MaxHeaders, &headerSplitterError);
-    if (headerSplitterError != HeaderSplitter::NoError) {
-        response.d->error.reset(toRequestError(headerSplitterError));
-        return response;
-    } else {
-        response.setHeaders(headers);
-        if(debugLevel > 0)  {
-            for (const HttpHeader &header: headers) {
-                qDebug() << "receiving header: " << header.name << header.value;
-            }
+    if (!request.d->bodyFile.isNull()) {
+        QSharedPointer<FileLike> bodyFile = request.d->bodyFile;
+        // the body can not be read again.
+        request.d->bodyFile.clear();
+        const bool chunked = bodyFile->size() < 0 && !request.hasHeader(QStringLiteral("Content-Length"));
+        if (!sendBody(connection, bodyFile, chunked)) {
+            connection->close();
+            response.d->error.reset(new ConnectionError());
+            return response;
         }
     }
+    phases.record(HttpTimings::RequestWritePhase, since);
 
-    // merge cookies.
-    if(response.hasHeader(QStringLiteral("Set-Cookie"))) {
-        for (const QByteArray &value: response.multiHeader(QStringLiteral("Set-Cookie"))) {
-            const QList<QNetworkCookie> &cookies = QNetworkCookie::parseCookies(value);
-            if(debugLevel > 0 && !cookies.isEmpty()) {
-                qDebug() << "receiving cookie:" << cookies[0].toRawForm();
-            }
-            response.d->cookies.append(cookies);
-        }
-        cookieJar.setCookiesFromUrl(response.d->cookies, response.d->url);
+    since = phases.now();
+    HeaderSplitter headerSplitter(connection);
+    if (!readResponseHeaders(headerSplitter, response)) {
+        return response;
     }
+    phases.record(HttpTimings::WaitingPhase, since);
+    mergeResponseCookies(response);
+    mergeAlternativeServices(origin, response);
 
     // read body.
     response.d->body = headerSplitter.buf;
     response.d->stream = connection;
+    response.d->pool = self;
+    response.d->origin = origin;
     if (!request.streamResponse()) {
+        since = phases.now();
         const QByteArray &body = response.body();
         if (!response.d->error.isNull()) {
             return response;
         }
+        phases.record(HttpTimings::BodyPhase, since);
         if(debugLevel > 1 && !body.isEmpty()) {
             qDebug() << "receiving body:" << body;
         }
+        // the connection is recycled by body() if the framing allows.
         response.d->stream.clear();
-        if (response.d->statusCode == 200 && response.header(HttpResponse::ConnectionHeader).toLower() == "keep-alive") {
-            recycle(response.d->url, connection);
-        }
     }
 
     // response.d->statusCode < 200 is not error.
@@ -1022,60 +1920,599 @@ HttpResponse HttpSessionPrivate::send(HttpRequest &request)
 }
 
 
-QList<HttpHeader> HttpSessionPrivate::makeHeaders(HttpRequest &request, const QUrl &url)
+bool HttpSessionPrivate::sendBody(QSharedPointer<SocketLike> connection, QSharedPointer<FileLike> body, bool chunked)
 {
-    QList<HttpHeader> allHeaders = request.allHeaders();
-
-    if(!request.hasHeader(QStringLiteral("Connection")) && request.version() == Http1_1) {
-        allHeaders.prepend(HttpHeader(QStringLiteral("Connection"), QByteArray("keep-alive")));
-    }
-    if(!request.hasHeader(QStringLiteral("Content-Length")) && !request.d->body.isEmpty()) {
-        allHeaders.prepend(HttpHeader(QStringLiteral("Content-Length"), QByteArray::number(request.d->body.size())));
-    }
-    if(!request.hasHeader(QStringLiteral("User-Agent"))) {
-        allHeaders.prepend(HttpHeader(QStringLiteral("User-Agent"), defaultUserAgent.toUtf8()));
-    }
-    if(!request.hasHeader(QStringLiteral("Host"))) {
-        QString httpHost = url.host();
-        if(url.port() != -1) {
-            httpHost += QStringLiteral(":") + QString::number(url.port());
+    const qint32 BlockSize = 1024 * 64;
+    const qint64 expected = body->size();
+    qint64 sent = 0;
+    QByteArray buf(BlockSize, Qt::Uninitialized);
+    while (true) {
+        qint32 readBytes = body->read(buf.data(), BlockSize);
+        if (readBytes < 0) {
+            if (debugLevel > 0) {
+                qDebug() << "can not read the request body.";
+            }
+            return false;
+        } else if (readBytes == 0) {
+            break;
         }
-        allHeaders.prepend(HttpHeader(QStringLiteral("Host"), httpHost.toUtf8()));
-    }
-    if(!request.hasHeader(QStringLiteral("Accept"))) {
-        allHeaders.append(HttpHeader(QStringLiteral("Accept"), QByteArray("*/*")));
-    }
-    if(!request.hasHeader(QStringLiteral("Accept-Language"))) {
-        allHeaders.append(HttpHeader(QStringLiteral("Accept-Language"), QByteArray("en-US,en;q=0.5")));
-    }
-//    if(!request.hasHeader(QStringLiteral("Accept-Encoding"))) {
-//        allHeaders.append(HttpHeader(QStringLiteral("Accept-Encoding"), QByteArray("deflate")));
-//    }
-    if(!request.d->cookies.isEmpty() && !request.hasHeader(QStringLiteral("Cookies"))) {
-        QByteArray result;
-        bool first = true;
-        for (const QNetworkCookie &cookie: request.d->cookies) {
-            if (!first)
-                result += "; ";
-            first = false;
-            result += cookie.toRawForm(QNetworkCookie::NameAndValueOnly);
+        sent += readBytes;
+        if (chunked) {
+            QByteArrayList pieces;
+            pieces.append(QByteArray::number(readBytes, 16) + "\r\n");
+            pieces.append(QByteArray::fromRawData(buf.constData(), readBytes));
+            pieces.append(QByteArray("\r\n"));
+            if (connection->sendallv(pieces) != pieces.at(0).size() + readBytes + 2) {
+                return false;
+            }
+        } else if (connection->sendall(buf.constData(), readBytes) != readBytes) {
+            return false;
         }
-        allHeaders.append(HttpHeader(QStringLiteral("Cookie"), result));
     }
-    return allHeaders;
-}
-
-void HttpSessionPrivate::mergeCookies(HttpRequest &request, const QUrl &url)
-{
-    QList<QNetworkCookie> cookies = cookieJar.cookiesForUrl(url);
-    if(cookies.isEmpty()) {
-        return;
+    if (chunked) {
+        return connection->sendall(QByteArray("0\r\n\r\n")) == 5;
     }
-    cookies.append(request.d->cookies);
-    request.d->cookies = cookies;
+    // the file is shorter than the Content-Length sent.
+    return expected < 0 || sent == expected;
 }
 
-void setProxySwitcher(HttpSession *session, QSharedPointer<BaseProxySwitcher> switcher)
+
+bool HttpSessionPrivate::readResponseHeaders(HeaderSplitter &headerSplitter, HttpResponse &response)
+{
+    HeaderSplitter::Error headerSplitterError;
+
+    // parse first line.
+    QByteArray firstLine = headerSplitter.nextLine(&headerSplitterError);
+    RequestError *error = toRequestError(headerSplitterError);
+    if (error != nullptr) {
+        response.d->error.reset(error);
+        return false;
+    }
+    // the reason phrase may contain spaces, or be empty.
+    const QByteArrayList &commands = splitBytes(firstLine, ' ', 2);
+    if(commands.size() < 2) {
+        response.d->error.reset(new InvalidHeader());
+        return false;
+    }
+    if(commands.at(0) == "HTTP/1.0") {
+        response.d->version = Http1_0;
+    } else if(commands.at(0) == "HTTP/1.1") {
+        response.d->version = Http1_1;
+    } else {
+        response.d->error.reset(new InvalidHeader());
+        return false;
+    }
+    bool ok;
+    response.d->statusCode = commands.at(1).toInt(&ok);
+    if(!ok) {
+        response.d->error.reset(new InvalidHeader());
+        return false;
+    }
+    response.d->statusText = commands.size() > 2 ? QString::fromLatin1(commands.at(2)) : QString();
+
+    // parse headers.
+    const int MaxHeaders = 64;
+    QList<HttpHeader> headers = headerSplitter.headers(MaxHeaders, &headerSplitterError);
+    if (headerSplitterError != HeaderSplitter::NoError) {
+        response.d->error.reset(toRequestError(headerSplitterError));
+        return false;
+    } else {
+        response.setHeaders(headers);
+        if(debugLevel > 0)  {
+            for (const HttpHeader &header: headers) {
+                qDebug() << "receiving header: " << header.name << header.value;
+            }
+        }
+    }
+    return true;
+}
+
+
+HttpPipeline::HttpPipeline(QSharedPointer<SocketLike> connection)
+    :connection(connection), writeLock(new Lock()), valid(true)
+{
+}
+
+
+QSharedPointer<Event> HttpPipeline::send(const QByteArrayList &lines)
+{
+    ScopedLock<Lock> l(writeLock);
+    if (!l.isSuccess() || !valid) {
+        return QSharedPointer<Event>();
+    }
+    qint32 bytesToSend = 0;
+    for (const QByteArray &line: lines) {
+        bytesToSend += line.size();
+    }
+    if (connection->sendallv(lines) != bytesToSend) {
+        valid = false;
+        connection->close();
+        return QSharedPointer<Event>();
+    }
+    // the turns are queued in the order of writing, the lock keeps it.
+    QSharedPointer<Event> turn(new Event());
+    if (turns.isEmpty()) {
+        turn->set();
+    }
+    turns.append(turn);
+    return turn;
+}
+
+
+void HttpPipeline::done(QSharedPointer<Event> turn, bool keepAlive)
+{
+    const bool reading = !turns.isEmpty() && turns.first() == turn;
+    turns.removeOne(turn);
+    // the response of a killed request is never read, the responses after it can not be found.
+    if (!keepAlive || !reading) {
+        valid = false;
+    }
+    if (!reading) {
+        return;
+    }
+    if (!valid) {
+        connection->close();
+    }
+    if (!turns.isEmpty()) {
+        turns.first()->set();
+    }
+}
+
+
+// the turn of one request in a pipeline, given up if the coroutine is killed while waiting or reading.
+class HttpPipelineTurn
+{
+public:
+    HttpPipelineTurn(QSharedPointer<HttpPipeline> pipeline, QSharedPointer<Event> event)
+        :pipeline(pipeline), event(event) {}
+    ~HttpPipelineTurn()
+    {
+        if (!event.isNull()) {
+            pipeline->done(event, false);
+        }
+    }
+    void done(bool keepAlive)
+    {
+        pipeline->done(event, keepAlive);
+        event.clear();
+    }
+    QSharedPointer<HttpPipeline> pipeline;
+    QSharedPointer<Event> event;
+};
+
+
+HttpResponse HttpSessionPrivate::sendPipelined(HttpRequest &request, HttpResponse &response, const QByteArrayList &lines)
+{
+    // the request is sent again once if the connection drops before its response is read.
+    for (int tries = 0; tries < 2; ++tries) {
+        RequestError *error = nullptr;
+        QSharedPointer<HttpPipeline> pipeline = pipelineForUrl(request.d->origin, pipeliningDepth, &error);
+        if (error != nullptr) {
+            response.d->error.reset(error);
+            return response;
+        }
+        if (pipeline.isNull()) {
+            response.d->error.reset(new ConnectionError());
+            return response;
+        }
+        HttpPipelineTurn turn(pipeline, pipeline->send(lines));
+        if (turn.event.isNull()) {
+            continue;
+        }
+        turn.event->wait();
+        if (!pipeline->valid) {
+            // the server closes the connection after an earlier response.
+            turn.done(false);
+            continue;
+        }
+        HttpResponse newResponse;
+        newResponse.d->url = response.d->url;
+        newResponse.d->request = response.d->request;
+        const bool keepAlive = readPipelinedResponse(pipeline, request, newResponse);
+        turn.done(keepAlive);
+        if (!newResponse.d->error.isNull() && !newResponse.d->error.dynamicCast<ConnectionError>().isNull()
+                && tries == 0) {
+            continue;
+        }
+        response = newResponse;
+        if (response.d->error.isNull() && response.d->statusCode >= 400) {
+            response.d->error.reset(new HTTPError(response.d->statusCode));
+        }
+        return response;
+    }
+    response.d->error.reset(new ConnectionError());
+    return response;
+}
+
+
+bool HttpSessionPrivate::readPipelinedResponse(QSharedPointer<HttpPipeline> pipeline, HttpRequest &request,
+                                               HttpResponse &response)
+{
+    HeaderSplitter headerSplitter(pipeline->connection, pipeline->buf);
+    pipeline->buf.clear();
+    if (!readResponseHeaders(headerSplitter, response)) {
+        return false;
+    }
+    mergeResponseCookies(response);
+    mergeAlternativeServices(request.d->origin, response);
+
+    // the body must be read exactly, the bytes after it belong to the next response.
+    bool keepAlive = response.d->version == Http1_1;
+    const QByteArray &connectionHeader = response.header(HttpResponse::ConnectionHeader).toLower();
+    if (connectionHeader == "close") {
+        keepAlive = false;
+    } else if (connectionHeader == "keep-alive") {
+        keepAlive = true;
+    }
+    QByteArray body;
+    QByteArray rest = headerSplitter.buf;
+    const int statusCode = response.d->statusCode;
+    const qint32 contentLength = response.getContentLength();
+    const bool chunked = response.header(HttpResponse::TransferEncodingHeader).toLower() == "chunked";
+    if (request.d->method.toUpper() == QStringLiteral("HEAD") || statusCode == 204 || statusCode == 304
+            || (statusCode >= 100 && statusCode < 200)) {
+    } else if (chunked) {
+        ChunkedBlockReader reader(pipeline->connection, rest);
+        reader.debugLevel = debugLevel;
+        while (true) {
+            ChunkedBlockReader::Error readerError;
+            const QByteArray &block = reader.nextBlock(request.maxBodySize() - body.size(), &readerError);
+            RequestError *error = toRequestError(readerError);
+            if (error != nullptr) {
+                response.d->error.reset(error);
+                return false;
+            }
+            if (block.isEmpty()) {
+                break;
+            }
+            body.append(block);
+        }
+        rest = reader.buf;
+    } else if (contentLength >= 0) {
+        if (contentLength > request.maxBodySize()) {
+            response.d->error.reset(new UnrewindableBodyError());
+            return false;
+        }
+        if (rest.size() < contentLength) {
+            const QByteArray &t = pipeline->connection->recvall(contentLength - rest.size());
+            rest.append(t);
+            if (rest.size() < contentLength) {
+                response.d->error.reset(new ConnectionError());
+                return false;
+            }
+        }
+        body = rest.left(contentLength);
+        rest.remove(0, contentLength);
+    } else {
+        // the body ends with the connection.
+        keepAlive = false;
+        body = rest;
+        rest.clear();
+        while (body.size() < request.maxBodySize()) {
+            const QByteArray &t = recvSized(pipeline->connection.data(), 1024 * 8);
+            if (t.isEmpty()) {
+                break;
+            }
+            body.append(t);
+        }
+    }
+    if (!decodeContent(response.header(QStringLiteral("Content-Encoding")), &body)) {
+        response.d->error.reset(new ContentDecodingError());
+        return false;
+    }
+    if (debugLevel > 1 && !body.isEmpty()) {
+        qDebug() << "receiving body:" << body;
+    }
+    response.setBody(body);
+    pipeline->buf = rest;
+    return keepAlive;
+}
+
+
+HttpResponse HttpSessionPrivate::sendHttp2(QSharedPointer<Http2Connection> connection, HttpRequest &request, HttpResponse &response)
+{
+    const HttpOrigin &origin = request.d->origin;
+    QByteArray authority;
+    QList<HttpHeader> headers;
+    for (const HttpHeader &header: makeHeaders(request, origin)) {
+        const QString &name = header.name.toLower();
+        if (name == QStringLiteral("host")) {
+            authority = header.value;
+            continue;
+        }
+        // the connection specific headers are not allowed by http/2.
+        if (name == QStringLiteral("connection") || name == QStringLiteral("keep-alive")
+                || name == QStringLiteral("proxy-connection") || name == QStringLiteral("transfer-encoding")
+                || name == QStringLiteral("upgrade")) {
+            continue;
+        }
+        headers.append(HttpHeader(name, header.value));
+    }
+    headers.prepend(HttpHeader(QStringLiteral(":path"), request.d->target));
+    headers.prepend(HttpHeader(QStringLiteral(":authority"), authority));
+    headers.prepend(HttpHeader(QStringLiteral(":scheme"), origin.isSecure() ? QByteArray("https") : QByteArray("http")));
+    headers.prepend(HttpHeader(QStringLiteral(":method"), request.d->method.toUpper().toUtf8()));
+    if (debugLevel > 0) {
+        for (const HttpHeader &header: headers) {
+            qDebug() << "sending header:" << header.name << header.value;
+        }
+    }
+
+    Http2Response http2Response;
+    Http2Connection::Error http2Error = connection->request(headers, request.d->body, request.maxBodySize(), &http2Response);
+    if (http2Error == Http2Connection::BodyTooLarge) {
+        response.d->error.reset(new UnrewindableBodyError());
+        return response;
+    } else if (http2Error != Http2Connection::NoError) {
+        response.d->error.reset(new ConnectionError());
+        return response;
+    }
+    response.d->version = HttpVersion::Http2_0;
+    response.d->statusCode = http2Response.statusCode;
+    QString shortMessage, longMessage;
+    if (toMessage(static_cast<HttpStatus>(http2Response.statusCode), &shortMessage, &longMessage)) {
+        response.d->statusText = shortMessage;
+    }
+    response.setHeaders(http2Response.headers);
+    response.setBody(http2Response.body);
+    if (debugLevel > 0) {
+        for (const HttpHeader &header: http2Response.headers) {
+            qDebug() << "receiving header: " << header.name << header.value;
+        }
+    }
+    if (debugLevel > 1 && !http2Response.body.isEmpty()) {
+        qDebug() << "receiving body:" << http2Response.body;
+    }
+    mergeResponseCookies(response);
+    mergeAlternativeServices(origin, response);
+    if (response.d->statusCode >= 400) {
+        response.d->error.reset(new HTTPError(response.d->statusCode));
+    }
+    return response;
+}
+
+
+void HttpSessionPrivate::mergeResponseCookies(HttpResponse &response)
+{
+    if(response.hasHeader(QStringLiteral("Set-Cookie"))) {
+        for (const QByteArray &value: response.multiHeader(QStringLiteral("Set-Cookie"))) {
+            const QList<QNetworkCookie> &cookies = QNetworkCookie::parseCookies(value);
+            if(debugLevel > 0 && !cookies.isEmpty()) {
+                qDebug() << "receiving cookie:" << cookies[0].toRawForm();
+            }
+            response.d->cookies.append(cookies);
+        }
+        cookieJar.setCookiesFromUrl(response.d->cookies, response.d->url);
+        if (!shared.isNull()) {
+            // synced already if no other thread changes the cookies meanwhile.
+            const int version = shared->mergeCookies(response.d->cookies, response.d->url);
+            if (version == cookieVersion + 1) {
+                cookieVersion = version;
+            }
+        }
+    }
+}
+
+
+void HttpSessionPrivate::mergeAlternativeServices(const HttpOrigin &origin, const HttpResponse &response)
+{
+    const QByteArray &value = response.header(QStringLiteral("Alt-Svc"));
+    if (value.isEmpty()) {
+        return;
+    }
+    // the new header replaces the services advertised before, as RFC 7838 section 3.
+    const QList<HttpAlternativeService> &services = HttpAlternativeService::parse(value, origin.host,
+                                                                                QElapsedTimer::msecsSinceReference());
+    if (services.isEmpty()) {
+        alternativeServices.remove(origin.key);
+    } else {
+        alternativeServices.insert(origin.key, services);
+    }
+}
+
+
+QList<HttpAlternativeService> HttpAlternativeService::parse(const QByteArray &value, const QString &originHost, qint64 now)
+{
+    QList<HttpAlternativeService> services;
+    if (value.trimmed() == "clear") {
+        return services;
+    }
+    for (const QByteArray &item: splitBytes(value, ',')) {
+        const QList<QByteArray> &params = splitBytes(item, ';');
+        if (params.isEmpty()) {
+            continue;
+        }
+        const QByteArray &alternative = params.first().trimmed();
+        const int eq = alternative.indexOf('=');
+        if (eq <= 0) {
+            continue;
+        }
+        QByteArray authority = alternative.mid(eq + 1).trimmed();
+        if (authority.size() >= 2 && authority.startsWith('"') && authority.endsWith('"')) {
+            authority = authority.mid(1, authority.size() - 2);
+        }
+        const int colon = authority.lastIndexOf(':');
+        bool ok;
+        const int port = colon < 0 ? 0 : authority.mid(colon + 1).toInt(&ok);
+        if (colon < 0 || !ok || port <= 0 || port > 65535) {
+            continue;
+        }
+        HttpAlternativeService service;
+        service.protocol = QByteArray::fromPercentEncoding(alternative.left(eq).trimmed());
+        service.host = colon == 0 ? originHost : QString::fromUtf8(authority.left(colon));
+        service.port = static_cast<quint16>(port);
+        qint64 maxAge = 24 * 3600;
+        for (int i = 1; i < params.size(); ++i) {
+            const QByteArray &param = params.at(i).trimmed();
+            if (param.startsWith("ma=")) {
+                maxAge = param.mid(3).toLongLong(&ok);
+                if (!ok || maxAge < 0) {
+                    maxAge = 0;
+                }
+            }
+        }
+        if (maxAge == 0) {
+            continue;
+        }
+        service.expires = now + maxAge * 1000;
+        services.append(service);
+    }
+    return services;
+}
+
+
+// the header names are tokens, so they are ascii.
+static inline void appendLatin1(QByteArray *buf, const QString &s, bool upper = false)
+{
+    const QChar *p = s.constData();
+    for (int i = 0; i < s.size(); ++i) {
+        char c = static_cast<char>(p[i].unicode());
+        if (upper && c >= 'a' && c <= 'z') {
+            c = static_cast<char>(c - ('a' - 'A'));
+        }
+        buf->append(c);
+    }
+}
+
+
+static inline void appendHeaderLine(QByteArray *buf, const QString &name, const QByteArray &value)
+{
+    appendLatin1(buf, name);
+    buf->append(": ", 2);
+    buf->append(value);
+    buf->append("\r\n", 2);
+}
+
+
+// the same headers as makeHeaders() in the same order, written to requestBuffer without the temporary lists.
+void HttpSessionPrivate::writeRequestHead(HttpRequest &request, const HttpOrigin &origin, const QByteArray &target,
+                                          const char *version, int extra)
+{
+    QByteArray &buf = requestBuffer;
+    // keeps the capacity, unless the buffer is still shared by a request being sent.
+    buf.resize(0);
+    buf.reserve(qMax(buf.capacity(), 512 + target.size() + extra));
+
+    appendLatin1(&buf, request.d->method, true);
+    buf.append(' ');
+    buf.append(target);
+    buf.append(' ');
+    buf.append(version);
+    buf.append("\r\n", 2);
+
+    if(!request.hasHeader(QStringLiteral("Host"))) {
+        buf.append("Host: ");
+        buf.append(origin.hostHeader);
+        buf.append("\r\n", 2);
+    }
+    if(!request.hasHeader(QStringLiteral("User-Agent"))) {
+        buf.append(userAgentLine);
+    }
+    if (!request.d->bodyFile.isNull()) {
+        const qint64 size = request.d->bodyFile->size();
+        if (size >= 0) {
+            if (!request.hasHeader(QStringLiteral("Content-Length"))) {
+                buf.append("Content-Length: ");
+                buf.append(QByteArray::number(size));
+                buf.append("\r\n", 2);
+            }
+        } else if (!request.hasHeader(QStringLiteral("Transfer-Encoding"))) {
+            buf.append("Transfer-Encoding: chunked\r\n");
+        }
+    } else if(!request.hasHeader(QStringLiteral("Content-Length")) && !request.d->body.isEmpty()) {
+        buf.append("Content-Length: ");
+        buf.append(QByteArray::number(request.d->body.size()));
+        buf.append("\r\n", 2);
+    }
+    if(!request.hasHeader(QStringLiteral("Connection")) && request.version() == Http1_1) {
+        buf.append("Connection: keep-alive\r\n");
+    }
+    for (const HttpHeader &header: request.headers) {
+        appendHeaderLine(&buf, header.name, header.value);
+    }
+    if(!request.hasHeader(QStringLiteral("Accept"))) {
+        buf.append("Accept: */*\r\n");
+    }
+    if(!request.hasHeader(QStringLiteral("Accept-Language"))) {
+        buf.append("Accept-Language: en-US,en;q=0.5\r\n");
+    }
+    if(!request.hasHeader(QStringLiteral("Accept-Encoding")) && !request.streamResponse()) {
+        static const QByteArray acceptEncodingLine = "Accept-Encoding: " + ContentDecoder::acceptEncoding() + "\r\n";
+        buf.append(acceptEncodingLine);
+    }
+    if(!request.hasHeader(QStringLiteral("Cookies"))) {
+        const QByteArray &cookies = cookieHeader(request, origin.url);
+        if (!cookies.isEmpty()) {
+            buf.append("Cookie: ");
+            buf.append(cookies);
+            buf.append("\r\n", 2);
+        }
+    }
+    buf.append("\r\n", 2);
+}
+
+
+QList<HttpHeader> HttpSessionPrivate::makeHeaders(HttpRequest &request, const HttpOrigin &origin)
+{
+    QList<HttpHeader> allHeaders = request.allHeaders();
+
+    if(!request.hasHeader(QStringLiteral("Connection")) && request.version() == Http1_1) {
+        allHeaders.prepend(HttpHeader(QStringLiteral("Connection"), QByteArray("keep-alive")));
+    }
+    if (!request.d->bodyFile.isNull()) {
+        const qint64 size = request.d->bodyFile->size();
+        if (size >= 0) {
+            if (!request.hasHeader(QStringLiteral("Content-Length"))) {
+                allHeaders.prepend(HttpHeader(QStringLiteral("Content-Length"), QByteArray::number(size)));
+            }
+        } else if (!request.hasHeader(QStringLiteral("Transfer-Encoding"))) {
+            allHeaders.prepend(HttpHeader(QStringLiteral("Transfer-Encoding"), QByteArray("chunked")));
+        }
+    } else if(!request.hasHeader(QStringLiteral("Content-Length")) && !request.d->body.isEmpty()) {
+        allHeaders.prepend(HttpHeader(QStringLiteral("Content-Length"), QByteArray::number(request.d->body.size())));
+    }
+    if(!request.hasHeader(QStringLiteral("User-Agent"))) {
+        allHeaders.prepend(HttpHeader(QStringLiteral("User-Agent"), defaultUserAgent.toUtf8()));
+    }
+    if(!request.hasHeader(QStringLiteral("Host"))) {
+        allHeaders.prepend(HttpHeader(QStringLiteral("Host"), origin.hostHeader));
+    }
+    if(!request.hasHeader(QStringLiteral("Accept"))) {
+        allHeaders.append(HttpHeader(QStringLiteral("Accept"), QByteArray("*/*")));
+    }
+    if(!request.hasHeader(QStringLiteral("Accept-Language"))) {
+        allHeaders.append(HttpHeader(QStringLiteral("Accept-Language"), QByteArray("en-US,en;q=0.5")));
+    }
+    // the streamed body is read by user, who may not decode it. set the header and use ContentDecoder then.
+    if(!request.hasHeader(QStringLiteral("Accept-Encoding")) && !request.streamResponse()) {
+        allHeaders.append(HttpHeader(QStringLiteral("Accept-Encoding"), ContentDecoder::acceptEncoding()));
+    }
+    if(!request.hasHeader(QStringLiteral("Cookies"))) {
+        const QByteArray &cookies = cookieHeader(request, origin.url);
+        if (!cookies.isEmpty()) {
+            allHeaders.append(HttpHeader(QStringLiteral("Cookie"), cookies));
+        }
+    }
+    return allHeaders;
+}
+
+// the cookies of the jar go first, their header is cached by the jar for the origin.
+QByteArray HttpSessionPrivate::cookieHeader(HttpRequest &request, const QUrl &url)
+{
+    if (!shared.isNull()) {
+        shared->syncCookies(&cookieJar, &cookieVersion);
+    }
+    QByteArray header = cookieJar.cookieHeader(url);
+    for (const QNetworkCookie &cookie: request.d->cookies) {
+        if (!header.isEmpty()) {
+            header.append("; ", 2);
+        }
+        header.append(cookie.toRawForm(QNetworkCookie::NameAndValueOnly));
+    }
+    return header;
+}
+
+void setProxySwitcher(HttpSession *session, QSharedPointer<BaseProxySwitcher> switcher)
 {
     if(!switcher.isNull()) {
         HttpSessionPrivate::getPrivateHelper(session)->proxySwitcher = switcher;
@@ -1229,43 +2666,857 @@ inline bool isRedirect(int httpCode)
     }
 }
 
-HttpResponse HttpSession::send(HttpRequest &request)
+// the coroutine sending a request takes its priority, for the waiters of connections and the resumed coroutines.
+class ScopedRequestPriority
+{
+public:
+    explicit ScopedRequestPriority(HttpRequest::Priority priority)
+        :coroutine(BaseCoroutine::current()), old(coroutine->priority())
+    {
+        if (priority <= HttpRequest::HighPriority) {
+            coroutine->setPriority(BaseCoroutine::HighPriority);
+        } else if (priority >= HttpRequest::LowPriority) {
+            coroutine->setPriority(BaseCoroutine::IdlePriority);
+        }
+    }
+    ~ScopedRequestPriority() { coroutine->setPriority(old); }
+private:
+    BaseCoroutine * const coroutine;
+    const BaseCoroutine::Priority old;
+};
+
+
+HttpResponse HttpSession::send(HttpRequest &request)
+{
+    Q_D(HttpSession);
+    ScopedRequestPriority priority(request.priority());
+    if (!d->cache.isNull()) {
+        return d->sendCached(request);
+    }
+    return d->sendWithRetries(request);
+}
+
+
+HttpResponse HttpSessionPrivate::sendTraced(HttpRequest &request)
+{
+    QElapsedTimer timer;
+    timer.start();
+    if (!tracer.isNull()) {
+        tracer->requestStarted(request);
+    }
+    if (!request.hasHeader(QStringLiteral("traceparent"))) {
+        const TraceContext &context = TraceContext::current();
+        if (context.isValid()) {
+            request.setHeader(QStringLiteral("traceparent"), context.toTraceParent());
+        }
+    }
+#ifdef QTNG_HAVE_USDT
+    const QByteArray &method = request.method().toLatin1();
+    const QByteArray &url = request.url().toEncoded();
+    QTNG_PROBE2(http_request_start, method.constData(), url.constData());
+#endif
+    HttpResponse response = send(request);
+#ifdef QTNG_HAVE_USDT
+    QTNG_PROBE3(http_request_done, method.constData(), url.constData(), response.statusCode());
+#endif
+    response.d->timings.totalNsecs = timer.nsecsElapsed();
+    response.d->elapsed = response.d->timings.totalNsecs / (1000 * 1000);
+    if (!tracer.isNull()) {
+        tracer->requestFinished(request, response);
+    }
+    return response;
+}
+
+
+HttpResponse HttpSessionPrivate::sendFollowing(HttpRequest &request)
+{
+    HttpResponse response = sendTraced(request);
+    QList<HttpResponse> history;
+
+    if(request.maxRedirects() > 0) {
+        int tries = 0;
+        while (isRedirect(response.statusCode())) {
+            if(tries > request.maxRedirects()) {
+                response.setError(new TooManyRedirects());
+                return response;
+            }
+            HttpRequest newRequest;
+            if(response.statusCode() == 303 || response.statusCode() == 307) {
+                newRequest.setMethod(request.method());
+            } else {
+                newRequest.setMethod(QStringLiteral("GET")); // not rfc behavior, but many browser do this.
+            }
+            newRequest.setUrl(request.url().resolved(response.getLocation()));
+            if(!newRequest.url().isValid()) {
+                response.setError(new InvalidURL());
+                return response;
+            }
+            HttpResponse newResponse = sendTraced(newRequest);
+            history.append(response);
+            response = newResponse;
+            ++tries;
+        }
+    }
+    response.setHistory(history);
+    return response;
+}
+
+
+static const int MaxLatencies = 256;
+static const float MaxRetryTokens = 10.0f;
+
+
+static bool isRetriable(const HttpResponse &response)
+{
+    QSharedPointer<RequestError> error = response.error();
+    if (error.isNull()) {
+        int statusCode = response.statusCode();
+        return statusCode == 502 || statusCode == 503 || statusCode == 504;
+    }
+    if (!error.dynamicCast<SSLError>().isNull()) {
+        return false;
+    }
+    return !error.dynamicCast<ConnectionError>().isNull() || !error.dynamicCast<RequestTimeout>().isNull();
+}
+
+
+HttpResponse HttpSessionPrivate::sendWithRetries(HttpRequest &request)
+{
+    // a streamed body can not be read twice, and a streamed response holds the connection of the winner.
+    bool repeatable = isIdempotent(request.method()) && request.d->bodyFile.isNull();
+    if (!repeatable || (retryPolicy.maxRetries <= 0 && !retryPolicy.hedging)) {
+        return sendFollowing(request);
+    }
+    retryTokens = qMin(MaxRetryTokens, retryTokens + retryPolicy.retryBudget);
+
+    qint64 backoff = qMax(1, retryPolicy.backoffMsecs);
+    for (int tries = 0;; ++tries) {
+        HttpResponse response = (retryPolicy.hedging && !request.streamResponse()) ? sendHedged(request)
+                                                                                   : sendMeasured(request);
+        if (!isRetriable(response)) {
+            return response;
+        }
+        if (tries >= retryPolicy.maxRetries) {
+            if (tries > 0 && response.hasNetworkError()) {
+                response.setError(new RetryError(tries + 1, response.error()));
+            }
+            return response;
+        }
+        if (!spendRetryToken()) {
+            return response;
+        }
+        // the full jitter, so the clients failed together do not come back together.
+        Coroutine::msleep(static_cast<quint32>(backoff / 2 + qrand() % (backoff / 2 + 1)));
+        backoff = qMin<qint64>(backoff * 2, qMax(retryPolicy.maxBackoffMsecs, retryPolicy.backoffMsecs));
+    }
+}
+
+
+bool HttpSessionPrivate::spendRetryToken()
+{
+    if (retryTokens < 1.0f) {
+        return false;
+    }
+    retryTokens -= 1.0f;
+    return true;
+}
+
+
+HttpResponse HttpSessionPrivate::sendMeasured(HttpRequest &request)
+{
+    QElapsedTimer timer;
+    timer.start();
+    HttpResponse response = sendFollowing(request);
+    if (!response.hasNetworkError() && !isRetriable(response)) {
+        if (latencies.size() < MaxLatencies) {
+            latencies.append(timer.elapsed());
+        } else {
+            latencies[latencyIndex] = timer.elapsed();
+            latencyIndex = (latencyIndex + 1) % MaxLatencies;
+        }
+    }
+    return response;
+}
+
+
+qint64 HttpSessionPrivate::hedgeDelay() const
+{
+    if (latencies.size() < 20) {
+        return -1;
+    }
+    QVector<qint64> sorted = latencies;
+    int percentile = qBound(1, retryPolicy.hedgePercentile, 100);
+    int n = qMin(sorted.size() - 1, sorted.size() * percentile / 100);
+    std::nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+    return qMax<qint64>(retryPolicy.minHedgeDelayMsecs, sorted.at(n));
+}
+
+
+struct HedgedAttempts
+{
+    HedgedAttempts()
+        :started(0), finished(0), hasResponse(false), done(false) {}
+    Event finishedEvent;
+    HttpResponse response;
+    int started;
+    int finished;
+    bool hasResponse;
+    bool done;
+};
+
+
+HttpResponse HttpSessionPrivate::sendHedged(HttpRequest &request)
+{
+    qint64 delay = hedgeDelay();
+    if (delay < 0) {
+        return sendMeasured(request);
+    }
+
+    // every attempt has its own copy of request, the pool gives the duplicate a second connection.
+    QSharedPointer<HedgedAttempts> attempts(new HedgedAttempts);
+    CoroutineGroup operations;
+    std::function<void()> attempt = [this, attempts, request] {
+        HttpRequest r = request;
+        HttpResponse response = sendMeasured(r);
+        ++attempts->finished;
+        if (attempts->done) {
+            return;
+        }
+        // a failed attempt waits for the other one still running.
+        if (!isRetriable(response) || !attempts->hasResponse) {
+            attempts->response = response;
+            attempts->hasResponse = true;
+        }
+        if (!isRetriable(response) || attempts->finished == attempts->started) {
+            attempts->done = true;
+            attempts->finishedEvent.set();
+        }
+    };
+    ++attempts->started;
+    operations.spawn(attempt);
+    try {
+        Timeout timeout(static_cast<quint32>(delay), 0); Q_UNUSED(timeout);
+        attempts->finishedEvent.wait();
+    } catch (TimeoutException &) {
+    }
+    if (!attempts->done && spendRetryToken()) {
+        ++attempts->started;
+        operations.spawn(attempt);
+    }
+    attempts->finishedEvent.wait();
+    // the loser is killed. its connection is closed with the coroutine instead of going back to the pool,
+    // because the response is read partly.
+    operations.killall();
+    return attempts->response;
+}
+
+
+// the directives of Cache-Control used by a private cache, the seconds are -1 if absent.
+struct HttpCacheControl
+{
+    HttpCacheControl()
+        :maxAge(-1), maxStale(-1), minFresh(-1), noStore(false), noCache(false), mustRevalidate(false)
+        , onlyIfCached(false) {}
+    qint64 maxAge;
+    qint64 maxStale;
+    qint64 minFresh;
+    bool noStore;
+    bool noCache;
+    bool mustRevalidate;
+    bool onlyIfCached;
+};
+
+
+static HttpCacheControl parseCacheControl(const QByteArrayList &values)
+{
+    HttpCacheControl control;
+    for (const QByteArray &value: values) {
+        for (const QByteArray &part: value.split(',')) {
+            const QByteArray &directive = part.trimmed();
+            const int eq = directive.indexOf('=');
+            const QByteArray &name = (eq < 0 ? directive : directive.left(eq)).trimmed().toLower();
+            QByteArray argument = eq < 0 ? QByteArray() : directive.mid(eq + 1).trimmed();
+            if (argument.size() >= 2 && argument.startsWith('"') && argument.endsWith('"')) {
+                argument = argument.mid(1, argument.size() - 2);
+            }
+            bool ok = false;
+            const qint64 secs = argument.toLongLong(&ok);
+            ok = ok && secs >= 0;
+            if (name == "max-age") {
+                control.maxAge = ok ? secs : 0;     // an invalid one makes the response stale.
+            } else if (name == "max-stale") {
+                control.maxStale = ok ? secs : Q_INT64_C(0x7fffffff);   // no value accepts any stale one.
+            } else if (name == "min-fresh") {
+                control.minFresh = ok ? secs : 0;
+            } else if (name == "no-store") {
+                control.noStore = true;
+            } else if (name == "no-cache") {
+                control.noCache = true;     // with or without the field names.
+            } else if (name == "must-revalidate") {
+                control.mustRevalidate = true;
+            } else if (name == "only-if-cached") {
+                control.onlyIfCached = true;
+            }
+        }
+    }
+    return control;
+}
+
+
+static QByteArrayList headerValues(const QList<HttpHeader> &headers, const QString &name)
+{
+    QByteArrayList values;
+    for (const HttpHeader &header: headers) {
+        if (header.name.compare(name, Qt::CaseInsensitive) == 0) {
+            values.append(header.value);
+        }
+    }
+    return values;
+}
+
+
+static QByteArray headerValue(const QList<HttpHeader> &headers, const QString &name)
+{
+    for (const HttpHeader &header: headers) {
+        if (header.name.compare(name, Qt::CaseInsensitive) == 0) {
+            return header.value;
+        }
+    }
+    return QByteArray();
+}
+
+
+static qint64 httpDateMsecs(const QByteArray &value)
+{
+    if (value.isEmpty()) {
+        return -1;
+    }
+    const QDateTime &dt = HeaderOperationMixin::fromHttpDate(value);
+    return dt.isValid() ? dt.toMSecsSinceEpoch() : -1;
+}
+
+
+// RFC 7234 4.2.3, in seconds.
+static qint64 currentAge(const HttpCacheEntry &entry, qint64 now)
+{
+    qint64 date = httpDateMsecs(headerValue(entry.headers, QStringLiteral("Date")));
+    if (date < 0) {
+        date = entry.responseTime;
+    }
+    const qint64 apparentAge = qMax<qint64>(0, entry.responseTime - date);
+    bool ok;
+    qint64 ageValue = headerValue(entry.headers, QStringLiteral("Age")).toLongLong(&ok) * 1000;
+    if (!ok || ageValue < 0) {
+        ageValue = 0;
+    }
+    const qint64 correctedAge = ageValue + (entry.responseTime - entry.requestTime);
+    return (qMax(apparentAge, correctedAge) + (now - entry.responseTime)) / 1000;
+}
+
+
+// RFC 7234 4.2.1 and 4.2.2, in seconds.
+static qint64 freshnessLifetime(const HttpCacheEntry &entry, const HttpCacheControl &control)
+{
+    if (control.maxAge >= 0) {
+        return control.maxAge;
+    }
+    qint64 date = httpDateMsecs(headerValue(entry.headers, QStringLiteral("Date")));
+    if (date < 0) {
+        date = entry.responseTime;
+    }
+    const QByteArray &expires = headerValue(entry.headers, QStringLiteral("Expires"));
+    if (!expires.isEmpty()) {
+        const qint64 t = httpDateMsecs(expires);
+        return t < 0 ? 0 : qMax<qint64>(0, (t - date) / 1000);
+    }
+    // the heuristic of 10% since the last modification, one day at most.
+    const qint64 lastModified = httpDateMsecs(headerValue(entry.headers, QStringLiteral("Last-Modified")));
+    if (lastModified >= 0 && lastModified < date) {
+        return qMin<qint64>((date - lastModified) / 10000, 3600 * 24);
+    }
+    return 0;
+}
+
+
+// the status codes cacheable by default, RFC 7231 6.1
+static bool isCacheableStatus(int statusCode)
+{
+    switch (statusCode) {
+    case 200: case 203: case 204: case 300: case 301: case 404: case 405: case 410: case 414: case 501:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+static bool isSafeMethod(const QString &method)
+{
+    return method.compare(QLatin1String("GET"), Qt::CaseInsensitive) == 0
+            || method.compare(QLatin1String("HEAD"), Qt::CaseInsensitive) == 0
+            || method.compare(QLatin1String("OPTIONS"), Qt::CaseInsensitive) == 0
+            || method.compare(QLatin1String("TRACE"), Qt::CaseInsensitive) == 0;
+}
+
+
+// the url with the query of request, as send() makes it.
+static QString cacheKeyOf(const HttpRequest &request)
+{
+    QUrl url = request.url();
+    const QMap<QString, QString> &query = request.query();
+    if (!query.isEmpty()) {
+        QUrlQuery urlQuery(url);
+        for (QMap<QString, QString>::const_iterator itor = query.constBegin(); itor != query.constEnd(); ++itor) {
+            urlQuery.addQueryItem(itor.key(), itor.value());
+        }
+        url.setQuery(urlQuery);
+    }
+    url.setFragment(QString());
+    return QStringLiteral("GET ") + QString::fromLatin1(url.toEncoded());
+}
+
+
+static bool varyMatches(const HttpCacheEntry &entry, const HttpRequest &request)
+{
+    for (const HttpHeader &header: entry.varyHeaders) {
+        if (request.header(header.name) != header.value) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// the hop-by-hop headers and the ones describing the encoded body are not stored, the body is decoded.
+static bool isStoredHeader(const QString &name)
+{
+    return name.compare(QLatin1String("Content-Length"), Qt::CaseInsensitive) != 0
+            && name.compare(QLatin1String("Content-Encoding"), Qt::CaseInsensitive) != 0
+            && name.compare(QLatin1String("Transfer-Encoding"), Qt::CaseInsensitive) != 0
+            && name.compare(QLatin1String("Connection"), Qt::CaseInsensitive) != 0
+            && name.compare(QLatin1String("Keep-Alive"), Qt::CaseInsensitive) != 0
+            && name.compare(QLatin1String("Age"), Qt::CaseInsensitive) != 0;
+}
+
+
+// unregisters the fetch of a miss even if the coroutine is killed, the waiters look up the cache again.
+struct HttpCacheFetchGuard
+{
+    HttpCacheFetchGuard(QHash<QString, QSharedPointer<Event>> &fetches, const QString &key,
+                        QSharedPointer<Event> event)
+        :fetches(fetches), key(key), event(event) {}
+    ~HttpCacheFetchGuard()
+    {
+        if (event.isNull()) {
+            return;
+        }
+        if (fetches.value(key) == event) {
+            fetches.remove(key);
+        }
+        event->set();
+    }
+    QHash<QString, QSharedPointer<Event>> &fetches;
+    QString key;
+    QSharedPointer<Event> event;
+};
+
+
+HttpResponse HttpSessionPrivate::sendCached(HttpRequest &request)
+{
+    const QString &method = request.method();
+    if (method.compare(QLatin1String("GET"), Qt::CaseInsensitive) != 0) {
+        HttpResponse response = sendWithRetries(request);
+        // RFC 7234 4.4, an unsafe method invalidates the response of url.
+        if (!isSafeMethod(method) && response.error().isNull()) {
+            cache->remove(cacheKeyOf(request));
+        }
+        return response;
+    }
+    const HttpCacheControl &requestControl = parseCacheControl(request.multiHeader(QStringLiteral("Cache-Control")));
+    // the conditional and range requests of the caller are passed as they are.
+    if (requestControl.noStore || request.streamResponse() || request.hasHeader(QStringLiteral("If-None-Match"))
+            || request.hasHeader(QStringLiteral("If-Modified-Since")) || request.hasHeader(QStringLiteral("Range"))) {
+        return sendWithRetries(request);
+    }
+    const QString &key = cacheKeyOf(request);
+    HttpRequest::CacheLoadControl loadControl = requestControl.onlyIfCached ? HttpRequest::AlwaysCache
+                                                                            : request.cacheLoadControl();
+    const bool noCache = requestControl.noCache || (!request.hasHeader(QStringLiteral("Cache-Control"))
+            && request.header(QStringLiteral("Pragma")).toLower().contains("no-cache"));
+
+    HttpCacheEntry entry;
+    bool cached = false;
+    bool waited = false;
+    while (loadControl != HttpRequest::AlwaysNetwork) {
+        cached = cache->load(key, &entry) && varyMatches(entry, request);
+        if (cached) {
+            const qint64 age = currentAge(entry, QDateTime::currentMSecsSinceEpoch());
+            if (loadControl != HttpRequest::PreferNetwork) {
+                return responseFromCache(entry, request, age);
+            }
+            const HttpCacheControl &responseControl =
+                    parseCacheControl(headerValues(entry.headers, QStringLiteral("Cache-Control")));
+            const qint64 lifetime = freshnessLifetime(entry, responseControl);
+            qint64 usable = lifetime;
+            if (requestControl.maxStale >= 0 && !responseControl.mustRevalidate) {
+                usable += requestControl.maxStale;
+            }
+            const bool fresh = !noCache && !responseControl.noCache && age < usable
+                    && (requestControl.maxAge < 0 || age <= requestControl.maxAge)
+                    && (requestControl.minFresh < 0 || lifetime - age >= requestControl.minFresh);
+            if (fresh) {
+                return responseFromCache(entry, request, age);
+            }
+        } else if (loadControl == HttpRequest::AlwaysCache) {
+            // RFC 7234 5.2.1.7, only-if-cached.
+            HttpResponse response;
+            response.d->url = request.url();
+            response.d->request = request;
+            response.d->statusCode = 504;
+            response.d->statusText = QStringLiteral("Gateway Timeout");
+            response.d->error.reset(new HTTPError(504));
+            return response;
+        }
+        // another coroutine is fetching it, take the response it stores. wait once, or the uncacheable ones would
+        // be fetched one by one.
+        QSharedPointer<Event> fetching = cacheFetches.value(key);
+        if (fetching.isNull() || waited) {
+            break;
+        }
+        fetching->wait();
+        waited = true;
+    }
+
+    QSharedPointer<Event> fetched;
+    if (!cacheFetches.contains(key)) {
+        fetched.reset(new Event());
+        cacheFetches.insert(key, fetched);
+    }
+    HttpCacheFetchGuard guard(cacheFetches, key, fetched); Q_UNUSED(guard);
+    const qint64 requestTime = QDateTime::currentMSecsSinceEpoch();
+    if (!cached) {
+        HttpResponse response = sendWithRetries(request);
+        storeResponse(key, request, response, requestTime);
+        return response;
+    }
+
+    // revalidates the stale response by its validators.
+    HttpRequest conditional = request;
+    const QByteArray &etag = headerValue(entry.headers, QStringLiteral("ETag"));
+    const QByteArray &lastModified = headerValue(entry.headers, QStringLiteral("Last-Modified"));
+    if (!etag.isEmpty()) {
+        conditional.setHeader(QStringLiteral("If-None-Match"), etag);
+    }
+    if (!lastModified.isEmpty()) {
+        conditional.setHeader(QStringLiteral("If-Modified-Since"), lastModified);
+    }
+    HttpResponse response = sendWithRetries(conditional);
+    if (response.statusCode() != 304 || !response.error().isNull()) {
+        storeResponse(key, request, response, requestTime);
+        return response;
+    }
+    // RFC 7234 4.3.4, the headers of 304 replace the stored ones.
+    const QList<HttpHeader> &updated = response.allHeaders();
+    QList<HttpHeader> headers;
+    for (const HttpHeader &header: entry.headers) {
+        if (!isStoredHeader(header.name) || headerValues(updated, header.name).isEmpty()) {
+            headers.append(header);
+        }
+    }
+    for (const HttpHeader &header: updated) {
+        if (isStoredHeader(header.name)) {
+            headers.append(header);
+        }
+    }
+    entry.headers = headers;
+    entry.requestTime = requestTime;
+    entry.responseTime = QDateTime::currentMSecsSinceEpoch();
+    cache->store(key, entry);
+    HttpResponse revalidated = responseFromCache(entry, request, currentAge(entry, entry.responseTime));
+    revalidated.d->timings = response.d->timings;
+    revalidated.d->elapsed = response.d->elapsed;
+    return revalidated;
+}
+
+
+HttpResponse HttpSessionPrivate::responseFromCache(const HttpCacheEntry &entry, HttpRequest &request, qint64 age)
+{
+    HttpResponse response;
+    response.d->url = entry.url;
+    response.d->request = request;
+    response.d->statusCode = entry.statusCode;
+    response.d->statusText = entry.statusText;
+    response.setHeaders(entry.headers);
+    response.setHeader(QStringLiteral("Age"), QByteArray::number(age));
+    response.d->body = entry.body;
+    response.d->consumed = true;
+    response.d->fromCache = true;
+    if (entry.statusCode >= 400) {
+        response.d->error.reset(new HTTPError(entry.statusCode));
+    }
+    return response;
+}
+
+
+void HttpSessionPrivate::storeResponse(const QString &key, HttpRequest &request, HttpResponse &response,
+                                       qint64 requestTime)
+{
+    // the redirected responses are not stored, the redirects are not cached.
+    if ((!response.error().isNull() && !response.hasHttpError()) || !isCacheableStatus(response.statusCode())
+            || !response.history().isEmpty()) {
+        return;
+    }
+    const HttpCacheControl &control = parseCacheControl(response.multiHeader(QStringLiteral("Cache-Control")));
+    if (control.noStore) {
+        cache->remove(key);
+        return;
+    }
+    HttpCacheEntry entry;
+    for (const QByteArray &value: response.multiHeader(QStringLiteral("Vary"))) {
+        for (const QByteArray &part: value.split(',')) {
+            const QString &name = QString::fromLatin1(part.trimmed());
+            if (name == QLatin1String("*")) {
+                return;
+            }
+            if (!name.isEmpty()) {
+                entry.varyHeaders.append(HttpHeader(name, request.header(name)));
+            }
+        }
+    }
+    for (const HttpHeader &header: response.allHeaders()) {
+        if (isStoredHeader(header.name)) {
+            entry.headers.append(header);
+        }
+    }
+    entry.requestTime = requestTime;
+    entry.responseTime = QDateTime::currentMSecsSinceEpoch();
+    // useless if it is never fresh and can not be revalidated.
+    if (freshnessLifetime(entry, control) <= 0 && headerValue(entry.headers, QStringLiteral("ETag")).isEmpty()
+            && headerValue(entry.headers, QStringLiteral("Last-Modified")).isEmpty()) {
+        return;
+    }
+    entry.body = response.body();
+    if (!response.error().isNull() && !response.hasHttpError()) {
+        return;
+    }
+    entry.headers.append(HttpHeader(QStringLiteral("Content-Length"), QByteArray::number(entry.body.size())));
+    entry.url = response.url();
+    entry.statusCode = response.statusCode();
+    entry.statusText = response.statusText();
+    cache->store(key, entry);
+}
+
+
+void HttpSession::setCache(QSharedPointer<HttpCacheStore> cache)
+{
+    Q_D(HttpSession);
+    d->cache = cache;
+}
+
+
+QSharedPointer<HttpCacheStore> HttpSession::cache() const
+{
+    Q_D(const HttpSession);
+    return d->cache;
+}
+
+
+void HttpSession::setRetryPolicy(const HttpRetryPolicy &policy)
+{
+    Q_D(HttpSession);
+    d->retryPolicy = policy;
+}
+
+
+HttpRetryPolicy HttpSession::retryPolicy() const
+{
+    Q_D(const HttpSession);
+    return d->retryPolicy;
+}
+
+
+void HttpSession::setTracer(QSharedPointer<HttpTracer> tracer)
+{
+    Q_D(HttpSession);
+    d->tracer = tracer;
+}
+
+
+QSharedPointer<HttpTracer> HttpSession::tracer() const
+{
+    Q_D(const HttpSession);
+    return d->tracer;
+}
+
+
+QSharedPointer<HttpBatch> HttpSession::sendMany(const QList<HttpRequest> &requests, int concurrency,
+                                                int concurrencyPerHost)
+{
+    return QSharedPointer<HttpBatch>(new HttpBatch(this, requests, concurrency, concurrencyPerHost));
+}
+
+
+class HttpBatchPrivate
+{
+public:
+    HttpBatchPrivate(HttpSession *session, const QList<HttpRequest> &requests, int concurrencyPerHost);
+    ~HttpBatchPrivate();
+    void work();
+    // the first pending request whose server has room, or -1.
+    int take();
+public:
+    HttpSession *session;
+    QList<HttpRequest> requests;
+    QVector<HttpResponse> responses;
+    QList<int> pending;            // the requests not started, in order.
+    QHash<QString, int> active;    // the requests being sent to every server.
+    QVector<QString> keys;
+    Queue<int> completed;          // -1 wakes next() after cancel().
+    Condition slotFreed;
+    CoroutineGroup *operations;
+    int concurrencyPerHost;
+    int taken;
+    bool cancelled;
+};
+
+
+HttpBatchPrivate::HttpBatchPrivate(HttpSession *session, const QList<HttpRequest> &requests, int concurrencyPerHost)
+    :session(session), requests(requests), responses(requests.size()), operations(new CoroutineGroup)
+    , concurrencyPerHost(concurrencyPerHost), taken(0), cancelled(false)
+{
+    keys.reserve(requests.size());
+    for (int i = 0; i < requests.size(); ++i) {
+        pending.append(i);
+        keys.append(ConnectionPool::keyOf(requests.at(i).url()));
+    }
+}
+
+
+HttpBatchPrivate::~HttpBatchPrivate()
+{
+    delete operations;
+}
+
+
+int HttpBatchPrivate::take()
+{
+    for (int i = 0; i < pending.size(); ++i) {
+        const int index = pending.at(i);
+        if (concurrencyPerHost <= 0 || active.value(keys.at(index)) < concurrencyPerHost) {
+            pending.removeAt(i);
+            return index;
+        }
+    }
+    return -1;
+}
+
+
+// every worker sends one request after another, so the requests to one server may share its connections.
+void HttpBatchPrivate::work()
+{
+    while (!pending.isEmpty()) {
+        const int index = take();
+        if (index < 0) {
+            slotFreed.wait();
+            continue;
+        }
+        const QString &key = keys.at(index);
+        ++active[key];
+        HttpRequest request = requests.at(index);
+        responses[index] = session->send(request);
+        if (--active[key] == 0) {
+            active.remove(key);
+        }
+        slotFreed.notifyAll();
+        completed.put(index);
+    }
+    // the workers left waiting for a server find nothing to take.
+    slotFreed.notifyAll();
+}
+
+
+HttpBatch::HttpBatch(HttpSession *session, const QList<HttpRequest> &requests, int concurrency, int concurrencyPerHost)
+    :d_ptr(new HttpBatchPrivate(session, requests, concurrencyPerHost))
+{
+    Q_D(HttpBatch);
+    const int workers = qMin(qMax(1, concurrency), requests.size());
+    for (int i = 0; i < workers; ++i) {
+        d->operations->spawn([d] { d->work(); });
+    }
+}
+
+
+HttpBatch::~HttpBatch()
+{
+    Q_D(HttpBatch);
+    d->operations->killall();
+    delete d_ptr;
+}
+
+
+bool HttpBatch::next(int *index, HttpResponse *response)
+{
+    Q_D(HttpBatch);
+    if (d->taken >= d->requests.size() || (d->cancelled && d->completed.isEmpty())) {
+        return false;
+    }
+    const int i = d->completed.get();
+    if (i < 0) {
+        return false;
+    }
+    ++d->taken;
+    if (index) {
+        *index = i;
+    }
+    if (response) {
+        *response = d->responses.at(i);
+    }
+    return true;
+}
+
+
+QList<HttpResponse> HttpBatch::all()
 {
-    Q_D(HttpSession);
-    HttpResponse response = d->send(request);
-    QList<HttpResponse> history;
+    Q_D(HttpBatch);
+    while (next(nullptr, nullptr)) {
+    }
+    return d->responses.toList();
+}
 
-    if(request.maxRedirects() > 0) {
-        int tries = 0;
-        while (isRedirect(response.statusCode())) {
-            if(tries > request.maxRedirects()) {
-                response.setError(new TooManyRedirects());
-                return response;
-            }
-            HttpRequest newRequest;
-            if(response.statusCode() == 303 || response.statusCode() == 307) {
-                newRequest.setMethod(request.method());
-            } else {
-                newRequest.setMethod(QStringLiteral("GET")); // not rfc behavior, but many browser do this.
-            }
-            newRequest.setUrl(request.url().resolved(response.getLocation()));
-            if(!newRequest.url().isValid()) {
-                response.setError(new InvalidURL());
-                return response;
-            }
-            HttpResponse newResponse = d->send(newRequest);
-            history.append(response);
-            response = newResponse;
-            ++tries;
-        }
+
+void HttpBatch::cancel()
+{
+    Q_D(HttpBatch);
+    if (d->cancelled) {
+        return;
     }
-    response.setHistory(history);
-    return response;
+    d->cancelled = true;
+    d->pending.clear();
+    d->operations->killall();
+    d->completed.put(-1);
+}
+
+
+int HttpBatch::size() const
+{
+    Q_D(const HttpBatch);
+    return d->requests.size();
 }
 
-QNetworkCookieJar &HttpSession::cookieJar()
+
+int HttpBatch::remaining() const
+{
+    Q_D(const HttpBatch);
+    return d->requests.size() - d->taken;
+}
+
+
+HttpCookieJar &HttpSession::cookieJar()
 {
     Q_D(HttpSession);
+    if (!d->shared.isNull()) {
+        d->shared->syncCookies(&d->cookieJar, &d->cookieVersion);
+    }
     return d->cookieJar;
 }
 
@@ -1273,8 +3524,10 @@ QNetworkCookieJar &HttpSession::cookieJar()
 QNetworkCookie HttpSession::cookie(const QUrl &url, const QString &name)
 {
     Q_D(HttpSession);
-    const QNetworkCookieJar &jar = d->cookieJar;
-    QList<QNetworkCookie> cookies = jar.cookiesForUrl(url);
+    if (!d->shared.isNull()) {
+        d->shared->syncCookies(&d->cookieJar, &d->cookieVersion);
+    }
+    const QList<QNetworkCookie> &cookies = d->cookieJar.cookiesForUrl(url);
     for (int i = 0; i < cookies.size(); ++i) {
         const QNetworkCookie &cookie = cookies.at(i);
         if(cookie.name() == name) {
@@ -1302,6 +3555,99 @@ int HttpSession::maxConnectionsPerServer()
 }
 
 
+void HttpSession::setPipeliningDepth(int depth)
+{
+    Q_D(HttpSession);
+    d->pipeliningDepth = qMax(1, depth);
+}
+
+
+int HttpSession::pipeliningDepth() const
+{
+    Q_D(const HttpSession);
+    return d->pipeliningDepth;
+}
+
+
+HttpConnectionPoolStats HttpSession::connectionPoolStats() const
+{
+    Q_D(const HttpSession);
+    return d->stats();
+}
+
+
+QList<HttpAlternativeService> HttpSession::alternativeServices(const QUrl &origin) const
+{
+    Q_D(const HttpSession);
+    QList<HttpAlternativeService> services = d->alternativeServices.value(HttpOrigin(origin).key);
+    const qint64 now = QElapsedTimer::msecsSinceReference();
+    for (int i = services.size() - 1; i >= 0; --i) {
+        if (services.at(i).expires <= now) {
+            services.removeAt(i);
+        }
+    }
+    return services;
+}
+
+
+int HttpSession::prewarm(const QUrl &url, int count)
+{
+    Q_D(HttpSession);
+    const HttpOrigin origin(url);
+    if (!origin.isValid()) {
+        return 0;
+    }
+    // one h2 connection serves all requests to the origin.
+    if (d->defaultVersion == HttpVersion::Http2_0 && origin.isSecure()) {
+        RequestError *error = nullptr;
+        QSharedPointer<Http2Connection> http2 = d->http2ConnectionForUrl(origin, &error);
+        delete error;
+        if (!http2.isNull()) {
+            return 1;
+        }
+    }
+    return d->prewarm(origin, count);
+}
+
+
+int HttpSession::prefetchDns(const QStringList &hosts)
+{
+    Q_D(HttpSession);
+    if (d->dnsCache.isNull()) {
+        d->dnsCache.reset(new SocketDnsCache());
+    }
+    QSharedPointer<SocketDnsCache> dnsCache = d->dnsCache;
+    QSharedPointer<int> resolved(new int(0));
+    CoroutineGroup operations;
+    for (const QString &host: hosts) {
+        if (!QHostAddress(host).isNull()) {
+            continue;
+        }
+        operations.spawn([dnsCache, host, resolved] {
+            if (!dnsCache->resolve(host).isEmpty()) {
+                ++*resolved;
+            }
+        });
+    }
+    operations.joinall();
+    return *resolved;
+}
+
+
+void HttpSession::setDnsCache(QSharedPointer<SocketDnsCache> dnsCache)
+{
+    Q_D(HttpSession);
+    d->dnsCache = dnsCache;
+}
+
+
+QSharedPointer<SocketDnsCache> HttpSession::dnsCache() const
+{
+    Q_D(const HttpSession);
+    return d->dnsCache;
+}
+
+
 void HttpSession::setDebugLevel(int level)
 {
     Q_D(HttpSession);
@@ -1324,6 +3670,7 @@ void HttpSession::setDefaultUserAgent(const QString &userAgent)
 {
     Q_D(HttpSession);
     d->defaultUserAgent = userAgent;
+    d->userAgentLine = "User-Agent: " + userAgent.toUtf8() + "\r\n";
 }
 
 HttpVersion HttpSession::defaultVersion() const
@@ -1362,6 +3709,354 @@ void HttpSession::setHttpProxy(QSharedPointer<HttpProxy> proxy)
     d->setHttpProxy(proxy);
 }
 
+#ifndef QTNG_NO_CRYPTO
+SslConfiguration HttpSession::sslConfiguration() const
+{
+    Q_D(const HttpSession);
+    return d->sslConfiguration;
+}
+
+void HttpSession::setSslConfiguration(const SslConfiguration &config)
+{
+    Q_D(HttpSession);
+    d->setSslConfiguration(config);
+}
+#endif
+
+
+SharedHttpSessionPrivate::SharedHttpSessionPrivate()
+    :dnsCache(new SocketDnsCache()), defaultVersion(HttpVersion::Http1_1), maxConnectionsPerServer(10)
+    , pipeliningDepth(1)
+{
+    defaultUserAgent = QStringLiteral("Mozilla/5.0 (X11; Linux x86_64; rv:52.0) Gecko/20100101 Firefox/52.0");
+#ifndef QTNG_NO_CRYPTO
+    http2SslConfiguration.setAllowedNextProtocols(QList<QByteArray>() << "h2" << "http/1.1");
+#endif
+}
+
+
+void SharedHttpSessionPrivate::wakeUp(SharedHostConnections &host)
+{
+    for (const QSharedPointer<ThreadChannelWaiters> &w: host.waiters) {
+        if (w->getting > 0) {
+            ThreadChannelWaiters::wakeUp(w, true);
+        }
+    }
+}
+
+
+QSharedPointer<SocketLike> SharedHttpSessionPrivate::takeConnection(const QString &key, bool *reserved)
+{
+    *reserved = false;
+    QList<IdleConnection> closed;   // deleted after the mutex is unlocked, they release their counts.
+    QMutexLocker locker(&mutex);
+    while (true) {
+        // the other threads may insert hosts while waiting, so it is looked up again.
+        SharedHostConnections &host = hosts[key];
+        while (!host.idle.isEmpty()) {
+            const IdleConnection idle = host.idle.takeLast();
+            if (idle.connection->isValid()) {
+                return idle.connection;
+            }
+            closed.append(idle);
+        }
+        if (host.live < maxConnectionsPerServer) {
+            ++host.live;
+            *reserved = true;
+            return QSharedPointer<SocketLike>();
+        }
+        QSharedPointer<ThreadChannelWaiters> &w = host.waiters[EventLoopCoroutine::get()];
+        if (w.isNull()) {
+            w.reset(new ThreadChannelWaiters(EventLoopCoroutine::get()));
+        }
+        const QSharedPointer<ThreadChannelWaiters> waiters = w;
+        ++waiters->getting;
+        locker.unlock();
+        closed.clear();
+        bool woken;
+        try {
+            woken = waiters->notEmpty.wait();
+        } catch (...) {
+            locker.relock();
+            --waiters->getting;
+            throw;
+        }
+        locker.relock();
+        --waiters->getting;
+        if (!woken) {
+            return QSharedPointer<SocketLike>();
+        }
+    }
+}
+
+
+QSharedPointer<Socket> SharedHttpSessionPrivate::countedSocket(QSharedPointer<SharedHttpSessionPrivate> shared,
+                                                               const QString &key)
+{
+    // the idle connections are kept by the shared session, so a strong reference here would never be released.
+    QWeakPointer<SharedHttpSessionPrivate> weak = shared;
+    return QSharedPointer<Socket>(new Socket(), [weak, key] (Socket *socket) {
+        delete socket;
+        QSharedPointer<SharedHttpSessionPrivate> shared = weak.toStrongRef();
+        if (!shared.isNull()) {
+            shared->release(key);
+        }
+    });
+}
+
+
+void SharedHttpSessionPrivate::release(const QString &key)
+{
+    QMutexLocker locker(&mutex);
+    SharedHostConnections &host = hosts[key];
+    --host.live;
+    wakeUp(host);
+}
+
+
+bool SharedHttpSessionPrivate::recycle(const QString &key, QSharedPointer<SocketLike> connection)
+{
+#ifdef Q_OS_WIN
+    // the socket is bound to the iocp of its thread.
+    Q_UNUSED(key);
+    Q_UNUSED(connection);
+    return false;
+#else
+    IdleConnection dropped;
+    QMutexLocker locker(&mutex);
+    SharedHostConnections &host = hosts[key];
+    // the oldest one is dropped.
+    if (host.idle.size() >= maxConnectionsPerServer && !host.idle.isEmpty()) {
+        dropped = host.idle.takeFirst();
+    }
+    host.idle.append(IdleConnection(connection, QElapsedTimer::msecsSinceReference()));
+    wakeUp(host);
+    return true;
+#endif
+}
+
+
+int SharedHttpSessionPrivate::removeExpiredConnections(qint64 ttl)
+{
+    const qint64 now = QElapsedTimer::msecsSinceReference();
+    QList<IdleConnection> expired;
+    QMutexLocker locker(&mutex);
+    for (QHash<QString, SharedHostConnections>::iterator itor = hosts.begin(); itor != hosts.end(); ++itor) {
+        QList<IdleConnection> &idle = itor->idle;
+        while (!idle.isEmpty() && idle.first().idleSince + ttl <= now) {
+            expired.append(idle.takeFirst());
+        }
+    }
+    return expired.size();
+}
+
+
+void SharedHttpSessionPrivate::syncCookies(HttpCookieJar *jar, int *version)
+{
+    if (cookieVersion.loadAcquire() == *version) {
+        return;
+    }
+    QMutexLocker locker(&mutex);
+    jar->clear();
+    for (const QNetworkCookie &cookie: cookieJar.cookies()) {
+        jar->insertCookie(cookie);
+    }
+    *version = cookieVersion.loadAcquire();
+}
+
+
+int SharedHttpSessionPrivate::mergeCookies(const QList<QNetworkCookie> &cookies, const QUrl &url)
+{
+    QMutexLocker locker(&mutex);
+    cookieJar.setCookiesFromUrl(cookies, url);
+    return cookieVersion.fetchAndAddRelease(1) + 1;
+}
+
+
+SharedHttpSession::SharedHttpSession()
+    :d_ptr(new SharedHttpSessionPrivate()) {}
+
+
+SharedHttpSession::~SharedHttpSession()
+{
+    Q_D(SharedHttpSession);
+    // the sessions made by newSession() may still use it, but nobody would take the idle connections any more.
+    // they are deleted after the mutex is unlocked, for they release their counts.
+    QList<IdleConnection> idle;
+    QMutexLocker locker(&d->mutex);
+    for (QHash<QString, SharedHostConnections>::iterator itor = d->hosts.begin(); itor != d->hosts.end(); ++itor) {
+        idle.append(itor->idle);
+        itor->idle.clear();
+    }
+    locker.unlock();
+    idle.clear();
+}
+
+
+QSharedPointer<HttpSession> SharedHttpSession::newSession()
+{
+    Q_D(SharedHttpSession);
+    QSharedPointer<HttpSession> session(new HttpSession());
+    HttpSessionPrivate *sd = HttpSessionPrivate::getPrivateHelper(session.data());
+    QMutexLocker locker(&d->mutex);
+    sd->shared = d_ptr;
+    sd->maxConnectionsPerServer = d->maxConnectionsPerServer;
+    sd->pipeliningDepth = d->pipeliningDepth;
+    sd->defaultVersion = d->defaultVersion;
+    sd->retryPolicy = d->retryPolicy;
+    sd->dnsCache = d->dnsCache;
+#ifndef QTNG_NO_CRYPTO
+    // copied as they are, so the sessions share the contexts and tls sessions.
+    sd->sslConfiguration = d->sslConfiguration;
+    sd->http2SslConfiguration = d->http2SslConfiguration;
+#endif
+    const QString userAgent = d->defaultUserAgent;
+    locker.unlock();
+    session->setDefaultUserAgent(userAgent);
+    return session;
+}
+
+
+void SharedHttpSession::setMaxConnectionsPerServer(int maxConnectionsPerServer)
+{
+    Q_D(SharedHttpSession);
+    if (maxConnectionsPerServer <= 0) {
+        maxConnectionsPerServer = INT_MAX;
+    }
+    QMutexLocker locker(&d->mutex);
+    d->maxConnectionsPerServer = maxConnectionsPerServer;
+    for (SharedHostConnections &host: d->hosts) {
+        d->wakeUp(host);
+    }
+}
+
+
+int SharedHttpSession::maxConnectionsPerServer() const
+{
+    Q_D(const SharedHttpSession);
+    QMutexLocker locker(&d->mutex);
+    return d->maxConnectionsPerServer;
+}
+
+
+void SharedHttpSession::setPipeliningDepth(int depth)
+{
+    Q_D(SharedHttpSession);
+    QMutexLocker locker(&d->mutex);
+    d->pipeliningDepth = qMax(1, depth);
+}
+
+
+int SharedHttpSession::pipeliningDepth() const
+{
+    Q_D(const SharedHttpSession);
+    QMutexLocker locker(&d->mutex);
+    return d->pipeliningDepth;
+}
+
+
+QString SharedHttpSession::defaultUserAgent() const
+{
+    Q_D(const SharedHttpSession);
+    QMutexLocker locker(&d->mutex);
+    return d->defaultUserAgent;
+}
+
+
+void SharedHttpSession::setDefaultUserAgent(const QString &userAgent)
+{
+    Q_D(SharedHttpSession);
+    QMutexLocker locker(&d->mutex);
+    d->defaultUserAgent = userAgent;
+}
+
+
+HttpVersion SharedHttpSession::defaultVersion() const
+{
+    Q_D(const SharedHttpSession);
+    QMutexLocker locker(&d->mutex);
+    return d->defaultVersion;
+}
+
+
+void SharedHttpSession::setDefaultVersion(HttpVersion defaultVersion)
+{
+    Q_D(SharedHttpSession);
+    QMutexLocker locker(&d->mutex);
+    d->defaultVersion = defaultVersion;
+}
+
+
+HttpRetryPolicy SharedHttpSession::retryPolicy() const
+{
+    Q_D(const SharedHttpSession);
+    QMutexLocker locker(&d->mutex);
+    return d->retryPolicy;
+}
+
+
+void SharedHttpSession::setRetryPolicy(const HttpRetryPolicy &policy)
+{
+    Q_D(SharedHttpSession);
+    QMutexLocker locker(&d->mutex);
+    d->retryPolicy = policy;
+}
+
+
+#ifndef QTNG_NO_CRYPTO
+SslConfiguration SharedHttpSession::sslConfiguration() const
+{
+    Q_D(const SharedHttpSession);
+    QMutexLocker locker(&d->mutex);
+    return d->sslConfiguration;
+}
+
+
+void SharedHttpSession::setSslConfiguration(const SslConfiguration &config)
+{
+    Q_D(SharedHttpSession);
+    SslConfiguration http2Config = config;
+    http2Config.setAllowedNextProtocols(QList<QByteArray>() << "h2" << "http/1.1");
+    QMutexLocker locker(&d->mutex);
+    d->sslConfiguration = config;
+    d->http2SslConfiguration = http2Config;
+}
+#endif
+
+
+QList<QNetworkCookie> SharedHttpSession::cookiesForUrl(const QUrl &url) const
+{
+    Q_D(const SharedHttpSession);
+    QMutexLocker locker(&d->mutex);
+    return d->cookieJar.cookiesForUrl(url);
+}
+
+
+void SharedHttpSession::setCookiesFromUrl(const QList<QNetworkCookie> &cookies, const QUrl &url)
+{
+    Q_D(SharedHttpSession);
+    d->mergeCookies(cookies, url);
+}
+
+
+QSharedPointer<SocketDnsCache> SharedHttpSession::dnsCache() const
+{
+    Q_D(const SharedHttpSession);
+    return d->dnsCache;
+}
+
+
+int SharedHttpSession::idleConnections() const
+{
+    Q_D(const SharedHttpSession);
+    QMutexLocker locker(&d->mutex);
+    int count = 0;
+    for (const SharedHostConnections &host: d->hosts) {
+        count += host.idle.size();
+    }
+    return count;
+}
+
 
 RequestError::~RequestError()
 {}
@@ -1475,6 +4170,9 @@ QString StreamConsumedError::what() const
 
 QString RetryError::what() const
 {
+    if (tries > 0 && !lastError.isNull()) {
+        return QStringLiteral("Failed after %1 tries: %2").arg(tries).arg(lastError->what());
+    }
     return QStringLiteral("Custom retries logic failed");
 }
 
@@ -0,0 +1,1897 @@
+#include <string.h>
+#include <QtCore/qendian.h>
+#include "../include/private/http2_p.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+struct HpackStaticEntry
+{
+    const char *name;
+    const char *value;
+};
+
+
+// rfc 7541 appendix a.
+static const HpackStaticEntry staticTable[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static const quint32 StaticTableSize = sizeof(staticTable) / sizeof(staticTable[0]);
+
+
+struct HuffmanCode
+{
+    quint32 code;
+    quint8 length;
+};
+
+
+// rfc 7541 appendix b, the last one is EOS.
+static const HuffmanCode huffmanCodes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28}, {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+
+// a binary tree of the codes, built at the first use. zero means no child for the root is never a child.
+class HuffmanTree
+{
+public:
+    enum { NodeCount = 257 * 2 - 1 };
+    HuffmanTree();
+    qint16 children[NodeCount][2];
+    qint16 symbols[NodeCount];  // -1 for the inner nodes.
+};
+
+
+HuffmanTree::HuffmanTree()
+{
+    memset(children, 0, sizeof(children));
+    for (int i = 0; i < NodeCount; ++i) {
+        symbols[i] = -1;
+    }
+    qint16 count = 1;
+    for (int symbol = 0; symbol < 257; ++symbol) {
+        const HuffmanCode &h = huffmanCodes[symbol];
+        int node = 0;
+        for (int i = h.length - 1; i >= 0; --i) {
+            const int bit = (h.code >> i) & 1;
+            if (children[node][bit] == 0) {
+                children[node][bit] = count++;
+            }
+            node = children[node][bit];
+        }
+        symbols[node] = static_cast<qint16>(symbol);
+    }
+}
+
+
+static bool huffmanDecode(const uchar *data, int size, QByteArray *out)
+{
+    static const HuffmanTree tree;
+    out->reserve(size * 8 / 5);
+    int node = 0;
+    int depth = 0;
+    bool allOnes = true;
+    for (int i = 0; i < size; ++i) {
+        for (int j = 7; j >= 0; --j) {
+            const int bit = (data[i] >> j) & 1;
+            node = tree.children[node][bit];
+            if (node == 0) {
+                return false;
+            }
+            ++depth;
+            allOnes = allOnes && bit;
+            const qint16 symbol = tree.symbols[node];
+            if (symbol >= 0) {
+                if (symbol == 256) {
+                    return false;
+                }
+                out->append(static_cast<char>(symbol));
+                node = 0;
+                depth = 0;
+                allOnes = true;
+            }
+        }
+    }
+    // the padding is a part of EOS, shorter than one byte.
+    return depth < 8 && allOnes;
+}
+
+
+static int huffmanLength(const QByteArray &s)
+{
+    quint64 bits = 0;
+    for (char c: s) {
+        bits += huffmanCodes[static_cast<uchar>(c)].length;
+    }
+    return static_cast<int>((bits + 7) / 8);
+}
+
+
+static QByteArray huffmanEncode(const QByteArray &s)
+{
+    QByteArray out;
+    out.reserve(huffmanLength(s));
+    quint64 bits = 0;
+    int count = 0;
+    for (char c: s) {
+        const HuffmanCode &h = huffmanCodes[static_cast<uchar>(c)];
+        bits = (bits << h.length) | h.code;
+        count += h.length;
+        while (count >= 8) {
+            count -= 8;
+            out.append(static_cast<char>(bits >> count));
+        }
+        bits &= (static_cast<quint64>(1) << count) - 1;
+    }
+    if (count > 0) {
+        out.append(static_cast<char>((bits << (8 - count)) | (0xff >> count)));
+    }
+    return out;
+}
+
+
+static void encodeInteger(QByteArray *out, uchar flags, int prefix, quint32 value)
+{
+    const quint32 max = (1u << prefix) - 1;
+    if (value < max) {
+        out->append(static_cast<char>(flags | value));
+        return;
+    }
+    out->append(static_cast<char>(flags | max));
+    value -= max;
+    while (value >= 128) {
+        out->append(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out->append(static_cast<char>(value));
+}
+
+
+static bool decodeInteger(const uchar **p, const uchar *end, int prefix, quint32 *value)
+{
+    if (*p >= end) {
+        return false;
+    }
+    const quint32 max = (1u << prefix) - 1;
+    quint64 v = **p & max;
+    ++*p;
+    if (v < max) {
+        *value = static_cast<quint32>(v);
+        return true;
+    }
+    int shift = 0;
+    while (true) {
+        if (*p >= end || shift > 28) {
+            return false;
+        }
+        const uchar b = **p;
+        ++*p;
+        v += static_cast<quint64>(b & 0x7f) << shift;
+        shift += 7;
+        if (v > 0xffffffff) {
+            return false;
+        }
+        if (!(b & 0x80)) {
+            break;
+        }
+    }
+    *value = static_cast<quint32>(v);
+    return true;
+}
+
+
+static void encodeString(QByteArray *out, const QByteArray &s)
+{
+    const int length = huffmanLength(s);
+    if (length < s.size()) {
+        encodeInteger(out, 0x80, 7, static_cast<quint32>(length));
+        out->append(huffmanEncode(s));
+    } else {
+        encodeInteger(out, 0, 7, static_cast<quint32>(s.size()));
+        out->append(s);
+    }
+}
+
+
+static bool decodeString(const uchar **p, const uchar *end, QByteArray *s)
+{
+    if (*p >= end) {
+        return false;
+    }
+    const bool huffman = (**p & 0x80) != 0;
+    quint32 length;
+    if (!decodeInteger(p, end, 7, &length)) {
+        return false;
+    }
+    if (static_cast<quint32>(end - *p) < length) {
+        return false;
+    }
+    bool ok = true;
+    if (huffman) {
+        ok = huffmanDecode(*p, static_cast<int>(length), s);
+    } else {
+        *s = QByteArray(reinterpret_cast<const char *>(*p), static_cast<int>(length));
+    }
+    *p += length;
+    return ok;
+}
+
+
+HpackEncoder::HpackEncoder()
+    :tableSize(0), maxTableSize(4096), smallestTableSize(4096), sizeUpdatePending(false)
+{
+}
+
+
+QByteArray HpackEncoder::encode(const QList<HttpHeader> &headers)
+{
+    QByteArray block;
+    if (sizeUpdatePending) {
+        if (smallestTableSize < maxTableSize) {
+            encodeInteger(&block, 0x20, 5, smallestTableSize);
+        }
+        encodeInteger(&block, 0x20, 5, maxTableSize);
+        sizeUpdatePending = false;
+    }
+    for (const HttpHeader &header: headers) {
+        const QByteArray &name = header.name.toLatin1().toLower();
+        quint32 nameIndex = 0;
+        const quint32 index = find(name, header.value, &nameIndex);
+        if (index != 0) {
+            encodeInteger(&block, 0x80, 7, index);
+            continue;
+        }
+        // the credentials are marked never indexed, so the proxies do not compress them.
+        const bool sensitive = name == "authorization" || name == "proxy-authorization" || name == "cookie"
+                || name == "set-cookie";
+        const HpackField field(name, header.value);
+        // the values changing in every block only push the useful fields out of the table.
+        const bool indexing = !sensitive && field.size() <= maxTableSize / 2 && name != ":path"
+                && name != "content-length" && name != "date" && name != "etag" && name != "last-modified";
+        if (indexing) {
+            encodeInteger(&block, 0x40, 6, nameIndex);
+        } else {
+            encodeInteger(&block, sensitive ? 0x10 : 0x00, 4, nameIndex);
+        }
+        if (nameIndex == 0) {
+            encodeString(&block, name);
+        }
+        encodeString(&block, header.value);
+        if (indexing) {
+            insert(field);
+        }
+    }
+    return block;
+}
+
+
+void HpackEncoder::setMaxTableSize(quint32 size)
+{
+    size = qMin<quint32>(size, 4096);
+    if (size == maxTableSize) {
+        return;
+    }
+    smallestTableSize = sizeUpdatePending ? qMin(smallestTableSize, size) : qMin(maxTableSize, size);
+    sizeUpdatePending = true;
+    maxTableSize = size;
+    evict();
+}
+
+
+quint32 HpackEncoder::find(const QByteArray &name, const QByteArray &value, quint32 *nameIndex) const
+{
+    for (quint32 i = 0; i < StaticTableSize; ++i) {
+        if (name != staticTable[i].name) {
+            continue;
+        }
+        if (value == staticTable[i].value) {
+            return i + 1;
+        }
+        if (*nameIndex == 0) {
+            *nameIndex = i + 1;
+        }
+    }
+    for (int i = 0; i < table.size(); ++i) {
+        const HpackField &field = table.at(i);
+        if (field.name != name) {
+            continue;
+        }
+        const quint32 index = StaticTableSize + 1 + static_cast<quint32>(i);
+        if (field.value == value) {
+            return index;
+        }
+        if (*nameIndex == 0) {
+            *nameIndex = index;
+        }
+    }
+    return 0;
+}
+
+
+void HpackEncoder::insert(const HpackField &field)
+{
+    table.prepend(field);
+    tableSize += field.size();
+    evict();
+}
+
+
+void HpackEncoder::evict()
+{
+    while (tableSize > maxTableSize && !table.isEmpty()) {
+        tableSize -= table.last().size();
+        table.removeLast();
+    }
+}
+
+
+HpackDecoder::HpackDecoder()
+    :tableSize(0), maxTableSize(4096), settingsMaxTableSize(4096)
+{
+}
+
+
+bool HpackDecoder::decode(const QByteArray &block, QList<HttpHeader> *headers, bool *tooLarge)
+{
+    const uchar *p = reinterpret_cast<const uchar *>(block.constData());
+    const uchar *end = p + block.size();
+    bool headerDecoded = false;
+    quint32 listSize = 0;
+    int count = 0;
+    if (tooLarge) {
+        *tooLarge = false;
+    }
+    while (p < end) {
+        const uchar b = *p;
+        HpackField field;
+        if (b & 0x80) {
+            quint32 index;
+            if (!decodeInteger(&p, end, 7, &index) || !lookup(index, &field)) {
+                return false;
+            }
+        } else if (b & 0x40) {
+            if (!decodeLiteral(&p, end, 6, &field)) {
+                return false;
+            }
+            insert(field);
+        } else if (b & 0x20) {
+            // the size updates come before the first header.
+            quint32 size;
+            if (headerDecoded || !decodeInteger(&p, end, 5, &size) || size > settingsMaxTableSize) {
+                return false;
+            }
+            maxTableSize = size;
+            evict();
+            continue;
+        } else {
+            // without indexing, or never indexed.
+            if (!decodeLiteral(&p, end, 4, &field)) {
+                return false;
+            }
+        }
+        headerDecoded = true;
+        listSize += field.size();
+        if (listSize > static_cast<quint32>(MaxHeaderListSize) || ++count > MaxHeaderCount) {
+            if (tooLarge) {
+                *tooLarge = true;
+            }
+            return false;
+        }
+        headers->append(HttpHeader(QString::fromLatin1(field.name), field.value));
+    }
+    return true;
+}
+
+
+bool HpackDecoder::decodeLiteral(const uchar **p, const uchar *end, int prefix, HpackField *field) const
+{
+    quint32 index;
+    if (!decodeInteger(p, end, prefix, &index)) {
+        return false;
+    }
+    if (index == 0) {
+        if (!decodeString(p, end, &field->name)) {
+            return false;
+        }
+    } else if (!lookup(index, field)) {
+        return false;
+    }
+    return decodeString(p, end, &field->value);
+}
+
+
+bool HpackDecoder::lookup(quint32 index, HpackField *field) const
+{
+    if (index == 0) {
+        return false;
+    }
+    if (index <= StaticTableSize) {
+        const HpackStaticEntry &entry = staticTable[index - 1];
+        *field = HpackField(QByteArray(entry.name), QByteArray(entry.value));
+        return true;
+    }
+    index -= StaticTableSize + 1;
+    if (index >= static_cast<quint32>(table.size())) {
+        return false;
+    }
+    *field = table.at(static_cast<int>(index));
+    return true;
+}
+
+
+void HpackDecoder::insert(const HpackField &field)
+{
+    const quint32 size = field.size();
+    if (size > maxTableSize) {
+        // a field bigger than the table empties it.
+        table.clear();
+        tableSize = 0;
+        return;
+    }
+    table.prepend(field);
+    tableSize += size;
+    evict();
+}
+
+
+void HpackDecoder::evict()
+{
+    while (tableSize > maxTableSize && !table.isEmpty()) {
+        tableSize -= table.last().size();
+        table.removeLast();
+    }
+}
+
+
+enum Http2FrameType
+{
+    DataFrame = 0x0,
+    HeadersFrame = 0x1,
+    PriorityFrame = 0x2,
+    RstStreamFrame = 0x3,
+    SettingsFrame = 0x4,
+    PushPromiseFrame = 0x5,
+    PingFrame = 0x6,
+    GoAwayFrame = 0x7,
+    WindowUpdateFrame = 0x8,
+    ContinuationFrame = 0x9,
+};
+
+
+enum Http2FrameFlag
+{
+    EndStreamFlag = 0x1,
+    AckFlag = 0x1,
+    EndHeadersFlag = 0x4,
+    PaddedFlag = 0x8,
+    PriorityFlag = 0x20,
+};
+
+
+enum Http2Setting
+{
+    HeaderTableSizeSetting = 0x1,
+    EnablePushSetting = 0x2,
+    MaxConcurrentStreamsSetting = 0x3,
+    InitialWindowSizeSetting = 0x4,
+    MaxFrameSizeSetting = 0x5,
+    MaxHeaderListSizeSetting = 0x6,
+};
+
+
+enum Http2ErrorCode
+{
+    NoErrorCode = 0x0,
+    ProtocolErrorCode = 0x1,
+    InternalErrorCode = 0x2,
+    FlowControlErrorCode = 0x3,
+    StreamClosedErrorCode = 0x5,
+    FrameSizeErrorCode = 0x6,
+    RefusedStreamErrorCode = 0x7,
+    CancelErrorCode = 0x8,
+    CompressionErrorCode = 0x9,
+    EnhanceYourCalmErrorCode = 0xb,
+};
+
+
+static const char ConnectionPreface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const qint32 ConnectionPrefaceSize = 24;
+static const quint32 DefaultMaxFrameSize = 16384;     // also the biggest frame we accept.
+static const qint64 DefaultWindowSize = 65535;
+static const quint32 StreamWindowSize = 1024 * 1024;  // we announce it by SETTINGS_INITIAL_WINDOW_SIZE.
+static const quint32 ConnectionWindowSize = 16 * 1024 * 1024;
+static const quint32 MaxStreamId = 0x7fffffff;
+static const quint32 ServerMaxConcurrentStreams = 100;
+
+
+Http2Stream::~Http2Stream()
+{
+}
+
+
+class Http2ClientStream: public Http2Stream
+{
+public:
+    Http2ClientStream(quint32 id, qint64 sendWindow, qint32 maxBodySize)
+        :Http2Stream(id, sendWindow), maxBodySize(maxBodySize), error(Http2Connection::NoError)
+        , headersReceived(false) {}
+public:
+    Http2Response response;
+    Event done;
+    const qint32 maxBodySize;
+    Http2Connection::Error error;
+    bool headersReceived;
+};
+
+
+class Http2ServerStream: public Http2Stream
+{
+public:
+    Http2ServerStream(quint32 id, qint64 sendWindow)
+        :Http2Stream(id, sendWindow), remoteClosed(false), headersSent(false), localClosed(false) {}
+public:
+    QByteArray method;
+    QByteArray path;
+    QList<HttpHeader> headers;
+    QByteArray incoming;        // the request body not read by handler yet.
+    Condition incomingChanged;
+    bool remoteClosed;          // END_STREAM is received.
+    bool headersSent;
+    bool localClosed;           // END_STREAM is sent.
+};
+
+
+// the stream is removed when the request returns, or the coroutine is killed while waiting.
+class Http2StreamGuard
+{
+public:
+    explicit Http2StreamGuard(Http2Connection *connection)
+        :connection(connection) {}
+    ~Http2StreamGuard()
+    {
+        if (!stream.isNull()) {
+            connection->releaseStream(stream);
+        }
+    }
+    Http2Connection *connection;
+    QSharedPointer<Http2ClientStream> stream;
+};
+
+
+static QByteArray frameHeader(quint8 type, quint8 flags, quint32 streamId, qint32 length)
+{
+    QByteArray header(9, Qt::Uninitialized);
+    uchar *h = reinterpret_cast<uchar *>(header.data());
+    h[0] = static_cast<uchar>((length >> 16) & 0xff);
+    h[1] = static_cast<uchar>((length >> 8) & 0xff);
+    h[2] = static_cast<uchar>(length & 0xff);
+    h[3] = type;
+    h[4] = flags;
+    qToBigEndian<quint32>(streamId & MaxStreamId, h + 5);
+    return header;
+}
+
+
+static QByteArray uint32Payload(quint32 value)
+{
+    QByteArray payload(4, Qt::Uninitialized);
+    qToBigEndian<quint32>(value, reinterpret_cast<uchar *>(payload.data()));
+    return payload;
+}
+
+
+static void appendSetting(QByteArray *payload, quint16 id, quint32 value)
+{
+    uchar buf[6];
+    qToBigEndian<quint16>(id, buf);
+    qToBigEndian<quint32>(value, buf + 2);
+    payload->append(reinterpret_cast<const char *>(buf), 6);
+}
+
+
+static bool sendAll(QSharedPointer<SocketLike> connection, const QByteArrayList &frames)
+{
+    qint32 total = 0;
+    for (const QByteArray &frame: frames) {
+        total += frame.size();
+    }
+    return connection->sendallv(frames) == total;
+}
+
+
+// http/2 forbids the headers of http/1.1 connection management (rfc 7540 section 8.1.2.2).
+static bool isConnectionSpecific(const QString &name)
+{
+    static const char * const names[] = {
+        "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", "http2-settings", "te",
+    };
+    for (const char *n: names) {
+        if (name.compare(QLatin1String(n), Qt::CaseInsensitive) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+Http2Endpoint::Http2Endpoint(QSharedPointer<SocketLike> connection)
+    :connection(connection), writeLock(new Lock()), operations(new CoroutineGroup), headerBlockStreamId(0)
+    , headerBlockFlags(0), lastPeerStreamId(0), peerMaxConcurrentStreams(100)
+    , peerInitialWindowSize(DefaultWindowSize), peerMaxFrameSize(DefaultMaxFrameSize)
+    , connectionSendWindow(DefaultWindowSize), connectionConsumed(0), valid(true), goingAway(false)
+{
+}
+
+
+Http2Endpoint::~Http2Endpoint()
+{
+    delete operations;
+    connection->close();
+}
+
+
+bool Http2Endpoint::isValid() const
+{
+    return valid && connection->isValid();
+}
+
+
+bool Http2Endpoint::sendSettings(bool withPreface, quint32 maxConcurrentStreams)
+{
+    QByteArrayList frames;
+    if (withPreface) {
+        frames.append(QByteArray(ConnectionPreface, ConnectionPrefaceSize));
+    }
+    QByteArray settings;
+    appendSetting(&settings, EnablePushSetting, 0);
+    if (maxConcurrentStreams > 0) {
+        appendSetting(&settings, MaxConcurrentStreamsSetting, maxConcurrentStreams);
+    }
+    appendSetting(&settings, InitialWindowSizeSetting, StreamWindowSize);
+    appendSetting(&settings, MaxHeaderListSizeSetting, HpackDecoder::MaxHeaderListSize);
+    frames.append(frameHeader(SettingsFrame, 0, 0, settings.size()));
+    frames.append(settings);
+    // the bodies of all streams share the connection window, so it is much bigger than the default.
+    frames.append(frameHeader(WindowUpdateFrame, 0, 0, 4));
+    frames.append(uint32Payload(ConnectionWindowSize - DefaultWindowSize));
+    if (!sendFrames(frames)) {
+        valid = false;
+        return false;
+    }
+    return true;
+}
+
+
+QByteArray Http2Endpoint::recvExactly(qint32 size)
+{
+    if (pending.isEmpty()) {
+        return connection->recvall(size);
+    }
+    if (pending.size() >= size) {
+        const QByteArray data = pending.left(size);
+        pending.remove(0, size);
+        return data;
+    }
+    QByteArray data = pending;
+    pending.clear();
+    data.append(connection->recvall(size - data.size()));
+    return data;
+}
+
+
+void Http2Endpoint::readFrames()
+{
+    while (true) {
+        const QByteArray &header = recvExactly(9);
+        if (header.size() != 9) {
+            break;
+        }
+        const uchar *h = reinterpret_cast<const uchar *>(header.constData());
+        const quint32 length = (static_cast<quint32>(h[0]) << 16) | (static_cast<quint32>(h[1]) << 8) | h[2];
+        const quint8 type = h[3];
+        const quint8 flags = h[4];
+        const quint32 streamId = qFromBigEndian<quint32>(h + 5) & MaxStreamId;
+        if (length > DefaultMaxFrameSize) {
+            goAway(FrameSizeErrorCode);
+            break;
+        }
+        QByteArray payload;
+        if (length > 0) {
+            payload = recvExactly(static_cast<qint32>(length));
+            if (payload.size() != static_cast<int>(length)) {
+                break;
+            }
+        }
+        // nothing comes between the frames of one header block.
+        if (headerBlockStreamId != 0 && type != ContinuationFrame) {
+            goAway(ProtocolErrorCode);
+            break;
+        }
+        if (!handleFrame(type, flags, streamId, payload)) {
+            break;
+        }
+    }
+    abort();
+}
+
+
+bool Http2Endpoint::handleFrame(quint8 type, quint8 flags, quint32 streamId, const QByteArray &payload)
+{
+    switch (type) {
+    case DataFrame:
+        return handleDataFrame(flags, streamId, payload);
+    case HeadersFrame: {
+        int offset = 0;
+        int padding = 0;
+        if (flags & PaddedFlag) {
+            if (payload.isEmpty()) {
+                goAway(FrameSizeErrorCode);
+                return false;
+            }
+            padding = static_cast<uchar>(payload.at(0));
+            offset = 1;
+        }
+        if (flags & PriorityFlag) {
+            offset += 5;
+        }
+        if (streamId == 0 || offset + padding > payload.size()) {
+            goAway(ProtocolErrorCode);
+            return false;
+        }
+        const QByteArray &block = payload.mid(offset, payload.size() - offset - padding);
+        if (!(flags & EndHeadersFlag)) {
+            headerBlock = block;
+            headerBlockStreamId = streamId;
+            headerBlockFlags = flags;
+            return true;
+        }
+        return handleHeaderBlock(flags, streamId, block);
+    }
+    case ContinuationFrame: {
+        if (headerBlockStreamId == 0 || streamId != headerBlockStreamId) {
+            goAway(ProtocolErrorCode);
+            return false;
+        }
+        // the endless CONTINUATION frames would grow the block without bound.
+        if (headerBlock.size() + payload.size() > HpackDecoder::MaxHeaderListSize) {
+            goAway(EnhanceYourCalmErrorCode);
+            return false;
+        }
+        headerBlock.append(payload);
+        if (!(flags & EndHeadersFlag)) {
+            return true;
+        }
+        const QByteArray block = headerBlock;
+        headerBlock.clear();
+        headerBlockStreamId = 0;
+        return handleHeaderBlock(headerBlockFlags, streamId, block);
+    }
+    case PriorityFrame:
+        return true;
+    case RstStreamFrame: {
+        if (streamId == 0) {
+            goAway(ProtocolErrorCode);
+            return false;
+        }
+        if (payload.size() != 4) {
+            goAway(FrameSizeErrorCode);
+            return false;
+        }
+        QSharedPointer<Http2Stream> stream = streams.value(streamId);
+        if (!stream.isNull() && !stream->finished) {
+            handleReset(stream);
+        }
+        return true;
+    }
+    case SettingsFrame:
+        return handleSettingsFrame(flags, streamId, payload);
+    case PushPromiseFrame:
+        // the client disables it by SETTINGS_ENABLE_PUSH, and the server never receives one.
+        goAway(ProtocolErrorCode);
+        return false;
+    case PingFrame: {
+        if (streamId != 0) {
+            goAway(ProtocolErrorCode);
+            return false;
+        }
+        if (payload.size() != 8) {
+            goAway(FrameSizeErrorCode);
+            return false;
+        }
+        if (flags & AckFlag) {
+            return true;
+        }
+        QByteArrayList frames;
+        frames.append(frameHeader(PingFrame, AckFlag, 0, 8));
+        frames.append(payload);
+        return sendFrames(frames);
+    }
+    case GoAwayFrame:
+        return handleGoAwayFrame(payload);
+    case WindowUpdateFrame:
+        return handleWindowUpdate(streamId, payload);
+    default:
+        // the unknown frames are ignored.
+        return true;
+    }
+}
+
+
+bool Http2Endpoint::handleDataFrame(quint8 flags, quint32 streamId, const QByteArray &payload)
+{
+    if (streamId == 0) {
+        goAway(ProtocolErrorCode);
+        return false;
+    }
+    QByteArray data = payload;
+    if (flags & PaddedFlag) {
+        const int padding = payload.isEmpty() ? 0 : static_cast<uchar>(payload.at(0));
+        if (payload.isEmpty() || padding >= payload.size()) {
+            goAway(ProtocolErrorCode);
+            return false;
+        }
+        data = payload.mid(1, payload.size() - 1 - padding);
+    }
+    // the padding counts in the flow control too.
+    connectionConsumed += static_cast<quint32>(payload.size());
+    if (connectionConsumed >= ConnectionWindowSize / 2) {
+        if (!sendWindowUpdate(0, connectionConsumed)) {
+            return false;
+        }
+        connectionConsumed = 0;
+    }
+    QSharedPointer<Http2Stream> stream = streams.value(streamId);
+    if (stream.isNull() || stream->finished) {
+        // reset by us, the frames in flight are dropped.
+        return true;
+    }
+    // the subclass gives back the data only.
+    stream->consumed += static_cast<quint32>(payload.size() - data.size());
+    return handleData(flags, stream, data);
+}
+
+
+bool Http2Endpoint::handleHeaderBlock(quint8 flags, quint32 streamId, const QByteArray &block)
+{
+    // every block is decoded to keep the dynamic table in sync, even if the stream is gone.
+    QList<HttpHeader> headers;
+    bool tooLarge;
+    if (!decoder.decode(block, &headers, &tooLarge)) {
+        goAway(tooLarge ? EnhanceYourCalmErrorCode : CompressionErrorCode);
+        return false;
+    }
+    return handleHeaders(flags, streamId, headers);
+}
+
+
+bool Http2Endpoint::handleSettingsFrame(quint8 flags, quint32 streamId, const QByteArray &payload)
+{
+    if (streamId != 0) {
+        goAway(ProtocolErrorCode);
+        return false;
+    }
+    if (flags & AckFlag) {
+        if (!payload.isEmpty()) {
+            goAway(FrameSizeErrorCode);
+            return false;
+        }
+        return true;
+    }
+    if (!applySettings(payload)) {
+        return false;
+    }
+    handleSettingsChanged();
+    windowChanged.notifyAll();
+    QByteArrayList frames;
+    frames.append(frameHeader(SettingsFrame, AckFlag, 0, 0));
+    return sendFrames(frames);
+}
+
+
+bool Http2Endpoint::applySettings(const QByteArray &payload)
+{
+    if (payload.size() % 6 != 0) {
+        goAway(FrameSizeErrorCode);
+        return false;
+    }
+    const uchar *p = reinterpret_cast<const uchar *>(payload.constData());
+    for (int i = 0; i < payload.size(); i += 6) {
+        const quint16 id = qFromBigEndian<quint16>(p + i);
+        const quint32 value = qFromBigEndian<quint32>(p + i + 2);
+        switch (id) {
+        case HeaderTableSizeSetting:
+            encoder.setMaxTableSize(value);
+            break;
+        case EnablePushSetting:
+            if (value > 1) {
+                goAway(ProtocolErrorCode);
+                return false;
+            }
+            break;
+        case MaxConcurrentStreamsSetting:
+            peerMaxConcurrentStreams = value;
+            break;
+        case InitialWindowSizeSetting: {
+            if (value > MaxStreamId) {
+                goAway(FlowControlErrorCode);
+                return false;
+            }
+            // the windows of open streams change by the difference.
+            const qint64 delta = static_cast<qint64>(value) - peerInitialWindowSize;
+            peerInitialWindowSize = value;
+            for (QSharedPointer<Http2Stream> stream: streams) {
+                stream->sendWindow += delta;
+            }
+            break;
+        }
+        case MaxFrameSizeSetting:
+            if (value < DefaultMaxFrameSize || value > 16777215) {
+                goAway(ProtocolErrorCode);
+                return false;
+            }
+            peerMaxFrameSize = value;
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+
+bool Http2Endpoint::handleGoAwayFrame(const QByteArray &payload)
+{
+    if (payload.size() < 8) {
+        goAway(FrameSizeErrorCode);
+        return false;
+    }
+    const quint32 lastStreamId = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(payload.constData())) & MaxStreamId;
+    goingAway = true;
+    handleGoAway(lastStreamId);
+    return true;
+}
+
+
+bool Http2Endpoint::handleWindowUpdate(quint32 streamId, const QByteArray &payload)
+{
+    if (payload.size() != 4) {
+        goAway(FrameSizeErrorCode);
+        return false;
+    }
+    const quint32 increment = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(payload.constData())) & MaxStreamId;
+    if (streamId == 0) {
+        connectionSendWindow += increment;
+        if (increment == 0 || connectionSendWindow > MaxStreamId) {
+            goAway(increment == 0 ? ProtocolErrorCode : FlowControlErrorCode);
+            return false;
+        }
+    } else {
+        QSharedPointer<Http2Stream> stream = streams.value(streamId);
+        if (stream.isNull() || stream->finished) {
+            return true;
+        }
+        stream->sendWindow += increment;
+        if (increment == 0 || stream->sendWindow > MaxStreamId) {
+            resetStream(streamId, increment == 0 ? ProtocolErrorCode : FlowControlErrorCode);
+            handleReset(stream);
+            return true;
+        }
+    }
+    windowChanged.notifyAll();
+    return true;
+}
+
+
+QByteArrayList Http2Endpoint::headerFrames(quint32 streamId, const QList<HttpHeader> &headers, bool endStream)
+{
+    const QByteArray &block = encoder.encode(headers);
+    QByteArrayList frames;
+    int offset = 0;
+    do {
+        const int n = qMin(block.size() - offset, static_cast<int>(peerMaxFrameSize));
+        quint8 flags = 0;
+        if (offset + n >= block.size()) {
+            flags |= EndHeadersFlag;
+        }
+        if (offset == 0 && endStream) {
+            flags |= EndStreamFlag;
+        }
+        frames.append(frameHeader(offset == 0 ? HeadersFrame : ContinuationFrame, flags, streamId, n));
+        frames.append(block.mid(offset, n));
+        offset += n;
+    } while (offset < block.size());
+    return frames;
+}
+
+
+bool Http2Endpoint::sendHeaders(quint32 streamId, const QList<HttpHeader> &headers, bool endStream)
+{
+    ScopedLock<Lock> l(writeLock);
+    if (!l.isSuccess() || !valid) {
+        return false;
+    }
+    if (!sendAll(connection, headerFrames(streamId, headers, endStream))) {
+        abort();
+        return false;
+    }
+    return true;
+}
+
+
+bool Http2Endpoint::sendData(QSharedPointer<Http2Stream> stream, const QByteArray &data, bool endStream)
+{
+    qint32 offset = 0;
+    while (true) {
+        const qint32 left = data.size() - offset;
+        while (valid && !stream->finished && left > 0 && (connectionSendWindow <= 0 || stream->sendWindow <= 0)) {
+            windowChanged.wait();
+        }
+        if (!valid || stream->finished) {
+            return false;
+        }
+        qint32 n = 0;
+        if (left > 0) {
+            const qint64 window = qMin(connectionSendWindow, stream->sendWindow);
+            n = static_cast<qint32>(qMin<qint64>(qMin<qint64>(left, peerMaxFrameSize), window));
+        }
+        const bool last = offset + n >= data.size();
+        connectionSendWindow -= n;
+        stream->sendWindow -= n;
+        QByteArrayList frames;
+        frames.append(frameHeader(DataFrame, last && endStream ? EndStreamFlag : 0, stream->id, n));
+        if (n > 0) {
+            frames.append(QByteArray::fromRawData(data.constData() + offset, n));
+        }
+        if (!sendFrames(frames)) {
+            abort();
+            return false;
+        }
+        offset += n;
+        if (last) {
+            return true;
+        }
+    }
+}
+
+
+bool Http2Endpoint::sendFrames(const QByteArrayList &frames)
+{
+    ScopedLock<Lock> l(writeLock);
+    if (!l.isSuccess()) {
+        return false;
+    }
+    return sendAll(connection, frames);
+}
+
+
+bool Http2Endpoint::sendWindowUpdate(quint32 streamId, quint32 increment)
+{
+    QByteArrayList frames;
+    frames.append(frameHeader(WindowUpdateFrame, 0, streamId, 4));
+    frames.append(uint32Payload(increment));
+    return sendFrames(frames);
+}
+
+
+bool Http2Endpoint::consume(QSharedPointer<Http2Stream> stream, quint32 size)
+{
+    stream->consumed += size;
+    if (stream->consumed < StreamWindowSize / 2) {
+        return true;
+    }
+    const quint32 increment = stream->consumed;
+    stream->consumed = 0;
+    return sendWindowUpdate(stream->id, increment);
+}
+
+
+void Http2Endpoint::resetStream(quint32 streamId, quint32 errorCode)
+{
+    QByteArrayList frames;
+    frames.append(frameHeader(RstStreamFrame, 0, streamId, 4));
+    frames.append(uint32Payload(errorCode));
+    sendFrames(frames);
+}
+
+
+void Http2Endpoint::goAway(quint32 errorCode)
+{
+    QByteArrayList frames;
+    frames.append(frameHeader(GoAwayFrame, 0, 0, 8));
+    frames.append(uint32Payload(lastPeerStreamId));
+    frames.append(uint32Payload(errorCode));
+    sendFrames(frames);
+    valid = false;
+}
+
+
+void Http2Endpoint::abort()
+{
+    valid = false;
+    windowChanged.notifyAll();
+    connection->close();
+}
+
+
+Http2Connection::Http2Connection(QSharedPointer<SocketLike> connection)
+    :Http2Endpoint(connection), nextStreamId(1)
+{
+}
+
+
+Http2Connection::~Http2Connection()
+{
+    // the coroutines wait on the conditions of this class.
+    operations->killall();
+}
+
+
+bool Http2Connection::start()
+{
+    if (!sendSettings(true, 0)) {
+        return false;
+    }
+    operations->spawnWithName(QStringLiteral("reader"), [this] { readFrames(); });
+    return true;
+}
+
+
+bool Http2Connection::isValid() const
+{
+    return Http2Endpoint::isValid() && !goingAway;
+}
+
+
+Http2Connection::Error Http2Connection::request(const QList<HttpHeader> &headers, const QByteArray &body,
+                                                qint32 maxBodySize, Http2Response *response)
+{
+    Http2StreamGuard guard(this);
+    while (true) {
+        if (!isValid()) {
+            return ConnectionError;
+        }
+        if (static_cast<quint32>(streams.size()) >= peerMaxConcurrentStreams) {
+            streamAvailable.wait();
+            continue;
+        }
+        ScopedLock<Lock> l(writeLock);
+        if (!l.isSuccess()) {
+            return ConnectionError;
+        }
+        // the streams are opened in the order of ids, so the id is taken with the lock held.
+        if (!isValid() || static_cast<quint32>(streams.size()) >= peerMaxConcurrentStreams) {
+            continue;
+        }
+        const quint32 id = nextStreamId;
+        nextStreamId += 2;
+        if (nextStreamId > MaxStreamId) {
+            goingAway = true;
+        }
+        guard.stream.reset(new Http2ClientStream(id, peerInitialWindowSize, maxBodySize));
+        streams.insert(id, guard.stream);
+        if (!sendAll(connection, headerFrames(id, headers, body.isEmpty()))) {
+            abort();
+            return ConnectionError;
+        }
+        break;
+    }
+
+    QSharedPointer<Http2ClientStream> stream = guard.stream;
+    if (!body.isEmpty()) {
+        // the stream is finished with the error if it fails.
+        sendData(stream, body, true);
+    }
+    stream->done.wait();
+    if (stream->error != NoError) {
+        return stream->error;
+    }
+    *response = stream->response;
+    return NoError;
+}
+
+
+bool Http2Connection::handleHeaders(quint8 flags, quint32 streamId, const QList<HttpHeader> &headers)
+{
+    QSharedPointer<Http2Stream> s = streams.value(streamId);
+    if (s.isNull() || s->finished) {
+        return true;
+    }
+    Http2ClientStream *stream = static_cast<Http2ClientStream *>(s.data());
+    if (!stream->headersReceived) {
+        int statusCode = 0;
+        QList<HttpHeader> regularHeaders;
+        for (const HttpHeader &header: headers) {
+            if (header.name == QLatin1String(":status")) {
+                statusCode = header.value.toInt();
+            } else if (!header.name.startsWith(QLatin1Char(':'))) {
+                regularHeaders.append(header);
+            }
+        }
+        if (statusCode < 100 || statusCode > 999 || (statusCode < 200 && (flags & EndStreamFlag))) {
+            resetStream(streamId, ProtocolErrorCode);
+            finish(s, StreamReset);
+            return true;
+        }
+        if (statusCode < 200) {
+            // informational, the final response follows.
+            return true;
+        }
+        stream->response.statusCode = statusCode;
+        stream->response.headers = regularHeaders;
+        stream->headersReceived = true;
+    } else {
+        // the trailers.
+        for (const HttpHeader &header: headers) {
+            if (!header.name.startsWith(QLatin1Char(':'))) {
+                stream->response.headers.append(header);
+            }
+        }
+    }
+    if (flags & EndStreamFlag) {
+        finish(s, NoError);
+    }
+    return true;
+}
+
+
+bool Http2Connection::handleData(quint8 flags, QSharedPointer<Http2Stream> s, const QByteArray &data)
+{
+    Http2ClientStream *stream = static_cast<Http2ClientStream *>(s.data());
+    if (!stream->headersReceived) {
+        resetStream(stream->id, ProtocolErrorCode);
+        finish(s, StreamReset);
+        return true;
+    }
+    if (stream->response.body.size() + data.size() > stream->maxBodySize) {
+        resetStream(stream->id, CancelErrorCode);
+        finish(s, BodyTooLarge);
+        return true;
+    }
+    stream->response.body.append(data);
+    if (flags & EndStreamFlag) {
+        finish(s, NoError);
+        return true;
+    }
+    return consume(s, static_cast<quint32>(data.size()));
+}
+
+
+void Http2Connection::handleReset(QSharedPointer<Http2Stream> stream)
+{
+    finish(stream, StreamReset);
+}
+
+
+void Http2Connection::handleGoAway(quint32 lastStreamId)
+{
+    // the streams after lastStreamId are not processed by the server, it is safe to send them again.
+    for (QSharedPointer<Http2Stream> stream: streams.values()) {
+        if (stream->id > lastStreamId) {
+            finish(stream, ConnectionError);
+        }
+    }
+    streamAvailable.notifyAll();
+}
+
+
+void Http2Connection::handleSettingsChanged()
+{
+    streamAvailable.notifyAll();
+}
+
+
+void Http2Connection::finish(QSharedPointer<Http2Stream> s, Error error)
+{
+    if (s->finished) {
+        return;
+    }
+    Http2ClientStream *stream = static_cast<Http2ClientStream *>(s.data());
+    stream->finished = true;
+    stream->error = error;
+    stream->done.set();
+    windowChanged.notifyAll();
+}
+
+
+void Http2Connection::abort()
+{
+    Http2Endpoint::abort();
+    for (QSharedPointer<Http2Stream> stream: streams.values()) {
+        finish(stream, ConnectionError);
+    }
+    streamAvailable.notifyAll();
+}
+
+
+void Http2Connection::releaseStream(QSharedPointer<Http2Stream> stream)
+{
+    streams.remove(stream->id);
+    streamAvailable.notify();
+    if (!stream->finished) {
+        // the coroutine is killed while waiting for the response.
+        stream->finished = true;
+        if (valid) {
+            const quint32 id = stream->id;
+            operations->spawn([this, id] { resetStream(id, CancelErrorCode); });
+        }
+    }
+}
+
+
+Http2ServerConnection::Http2ServerConnection(QSharedPointer<SocketLike> connection,
+                                             const std::function<void(QSharedPointer<SocketLike>)> &handler)
+    :Http2Endpoint(connection), handler(handler)
+{
+}
+
+
+Http2ServerConnection::~Http2ServerConnection()
+{
+    operations->killall();
+}
+
+
+bool Http2ServerConnection::setUpgradeRequest(const QByteArray &method, const QByteArray &path,
+                                              const QList<HttpHeader> &headers, const QByteArray &settings)
+{
+    if (!applySettings(settings)) {
+        return false;
+    }
+    upgradeStream.reset(new Http2ServerStream(1, peerInitialWindowSize));
+    upgradeStream->method = method;
+    upgradeStream->path = path;
+    for (const HttpHeader &header: headers) {
+        if (!isConnectionSpecific(header.name)) {
+            upgradeStream->headers.append(header);
+        }
+    }
+    // the request of upgrade has no body.
+    upgradeStream->remoteClosed = true;
+    streams.insert(1, upgradeStream);
+    lastPeerStreamId = 1;
+    return true;
+}
+
+
+void Http2ServerConnection::serve(const QByteArray &buf, bool prefaceReceived)
+{
+    pending = buf;
+    if (!prefaceReceived && recvExactly(ConnectionPrefaceSize) != QByteArray(ConnectionPreface, ConnectionPrefaceSize)) {
+        abort();
+        return;
+    }
+    if (!sendSettings(false, ServerMaxConcurrentStreams)) {
+        abort();
+        return;
+    }
+    if (!upgradeStream.isNull()) {
+        spawnStream(upgradeStream);
+        upgradeStream.clear();
+    }
+    readFrames();
+    // the streams are finished by abort(), their handlers return soon.
+    operations->joinall();
+}
+
+
+bool Http2ServerConnection::handleHeaders(quint8 flags, quint32 streamId, const QList<HttpHeader> &headers)
+{
+    if (streamId % 2 == 0) {
+        goAway(ProtocolErrorCode);
+        return false;
+    }
+    QSharedPointer<Http2Stream> existing = streams.value(streamId);
+    if (!existing.isNull()) {
+        Http2ServerStream *stream = static_cast<Http2ServerStream *>(existing.data());
+        if (stream->finished) {
+            return true;
+        }
+        // the trailers of request body must end the stream. they are dropped.
+        if (stream->remoteClosed || !(flags & EndStreamFlag)) {
+            resetStream(streamId, stream->remoteClosed ? StreamClosedErrorCode : ProtocolErrorCode);
+            handleReset(existing);
+            return true;
+        }
+        stream->remoteClosed = true;
+        stream->incomingChanged.notifyAll();
+        return true;
+    }
+    if (streamId <= lastPeerStreamId || goingAway || !valid) {
+        // closed already, or no new stream is accepted.
+        return true;
+    }
+    lastPeerStreamId = streamId;
+    if (static_cast<quint32>(streams.size()) >= ServerMaxConcurrentStreams) {
+        resetStream(streamId, RefusedStreamErrorCode);
+        return true;
+    }
+
+    QSharedPointer<Http2ServerStream> stream(new Http2ServerStream(streamId, peerInitialWindowSize));
+    QByteArray scheme;
+    QByteArray authority;
+    bool hasHost = false;
+    bool malformed = false;
+    for (const HttpHeader &header: headers) {
+        if (!header.name.startsWith(QLatin1Char(':'))) {
+            if (isConnectionSpecific(header.name)) {
+                continue;
+            }
+            hasHost = hasHost || header.name == QLatin1String("host");
+            stream->headers.append(header);
+        } else if (!stream->headers.isEmpty()) {
+            // the pseudo headers come first.
+            malformed = true;
+        } else if (header.name == QLatin1String(":method")) {
+            stream->method = header.value;
+        } else if (header.name == QLatin1String(":path")) {
+            stream->path = header.value;
+        } else if (header.name == QLatin1String(":scheme")) {
+            scheme = header.value;
+        } else if (header.name == QLatin1String(":authority")) {
+            authority = header.value;
+        } else {
+            malformed = true;
+        }
+    }
+    if (malformed || stream->method.isEmpty()
+            || (stream->method != "CONNECT" && (stream->path.isEmpty() || scheme.isEmpty()))) {
+        resetStream(streamId, ProtocolErrorCode);
+        return true;
+    }
+    // the handlers read the host from the headers like http/1.1.
+    if (!hasHost && !authority.isEmpty()) {
+        stream->headers.prepend(HttpHeader(QStringLiteral("Host"), authority));
+    }
+    stream->remoteClosed = flags & EndStreamFlag;
+    streams.insert(streamId, stream);
+    spawnStream(stream);
+    return true;
+}
+
+
+bool Http2ServerConnection::handleData(quint8 flags, QSharedPointer<Http2Stream> s, const QByteArray &data)
+{
+    Http2ServerStream *stream = static_cast<Http2ServerStream *>(s.data());
+    if (stream->remoteClosed) {
+        resetStream(stream->id, StreamClosedErrorCode);
+        handleReset(s);
+        return true;
+    }
+    if (stream->incoming.size() + data.size() > static_cast<int>(StreamWindowSize)) {
+        // the client sends more than the window.
+        resetStream(stream->id, FlowControlErrorCode);
+        handleReset(s);
+        return true;
+    }
+    stream->incoming.append(data);
+    if (flags & EndStreamFlag) {
+        stream->remoteClosed = true;
+    }
+    stream->incomingChanged.notifyAll();
+    return true;
+}
+
+
+void Http2ServerConnection::handleReset(QSharedPointer<Http2Stream> s)
+{
+    // the stream is removed after the handler returns.
+    Http2ServerStream *stream = static_cast<Http2ServerStream *>(s.data());
+    stream->finished = true;
+    stream->incomingChanged.notifyAll();
+    windowChanged.notifyAll();
+}
+
+
+void Http2ServerConnection::handleGoAway(quint32 lastStreamId)
+{
+    // the server does not initiate streams, the client stops opening new ones.
+    Q_UNUSED(lastStreamId);
+}
+
+
+void Http2ServerConnection::abort()
+{
+    Http2Endpoint::abort();
+    for (QSharedPointer<Http2Stream> stream: streams.values()) {
+        handleReset(stream);
+    }
+}
+
+
+void Http2ServerConnection::spawnStream(QSharedPointer<Http2ServerStream> stream)
+{
+    QSharedPointer<Http2StreamSocket> socket(new Http2StreamSocket(this, stream));
+    operations->spawn([this, socket] {
+        handler(socket);
+        // the handler may return without closing the stream.
+        socket->close();
+    });
+}
+
+
+QByteArray Http2ServerConnection::recv(QSharedPointer<Http2ServerStream> stream, qint32 size, bool all)
+{
+    QByteArray data;
+    while (data.size() < size) {
+        while (stream->incoming.isEmpty() && !stream->remoteClosed && !stream->finished) {
+            stream->incomingChanged.wait();
+        }
+        if (stream->incoming.isEmpty()) {
+            break;
+        }
+        const int n = qMin(size - data.size(), stream->incoming.size());
+        data.append(stream->incoming.constData(), n);
+        stream->incoming.remove(0, n);
+        if (!stream->remoteClosed && !stream->finished && !consume(stream, static_cast<quint32>(n))) {
+            break;
+        }
+        if (!all) {
+            break;
+        }
+    }
+    return data;
+}
+
+
+bool Http2ServerConnection::sendResponseHeaders(QSharedPointer<Http2ServerStream> stream, int statusCode,
+                                                const QList<HttpHeader> &headers)
+{
+    if (stream->finished || stream->headersSent) {
+        return false;
+    }
+    QList<HttpHeader> h2headers;
+    h2headers.append(HttpHeader(QStringLiteral(":status"), QByteArray::number(statusCode)));
+    for (const HttpHeader &header: headers) {
+        if (!isConnectionSpecific(header.name)) {
+            h2headers.append(HttpHeader(header.name.toLower(), header.value));
+        }
+    }
+    if (!sendHeaders(stream->id, h2headers, false)) {
+        return false;
+    }
+    stream->headersSent = true;
+    return true;
+}
+
+
+qint32 Http2ServerConnection::send(QSharedPointer<Http2ServerStream> stream, const QByteArray &data)
+{
+    // the DATA frames come after the response headers.
+    if (!stream->headersSent || stream->localClosed) {
+        return -1;
+    }
+    if (!sendData(stream, data, false)) {
+        return -1;
+    }
+    return data.size();
+}
+
+
+void Http2ServerConnection::closeStream(QSharedPointer<Http2ServerStream> stream)
+{
+    if (!stream->finished) {
+        if (!stream->headersSent) {
+            // the handler returns without a response.
+            resetStream(stream->id, InternalErrorCode);
+        } else if (!stream->localClosed) {
+            stream->localClosed = true;
+            if (sendData(stream, QByteArray(), true) && !stream->remoteClosed) {
+                // the request body is not read, the client stops sending it.
+                resetStream(stream->id, NoErrorCode);
+            }
+        }
+        stream->finished = true;
+    }
+    streams.remove(stream->id);
+}
+
+
+Http2StreamSocket::Http2StreamSocket(Http2ServerConnection *connection, QSharedPointer<Http2ServerStream> stream)
+    :connection(connection), stream(stream)
+{
+}
+
+
+QByteArray Http2StreamSocket::method() const
+{
+    return stream->method;
+}
+
+
+QByteArray Http2StreamSocket::path() const
+{
+    return stream->path;
+}
+
+
+QList<HttpHeader> Http2StreamSocket::headers() const
+{
+    return stream->headers;
+}
+
+
+bool Http2StreamSocket::sendHeaders(int statusCode, const QList<HttpHeader> &headers)
+{
+    return connection->sendResponseHeaders(stream, statusCode, headers);
+}
+
+
+Socket::SocketError Http2StreamSocket::error() const
+{
+    return connection->connection->error();
+}
+
+
+QString Http2StreamSocket::errorString() const
+{
+    return connection->connection->errorString();
+}
+
+
+bool Http2StreamSocket::isValid() const
+{
+    return !stream->finished && connection->isValid();
+}
+
+
+QHostAddress Http2StreamSocket::localAddress() const
+{
+    return connection->connection->localAddress();
+}
+
+
+quint16 Http2StreamSocket::localPort() const
+{
+    return connection->connection->localPort();
+}
+
+
+QHostAddress Http2StreamSocket::peerAddress() const
+{
+    return connection->connection->peerAddress();
+}
+
+
+QString Http2StreamSocket::peerName() const
+{
+    return connection->connection->peerName();
+}
+
+
+quint16 Http2StreamSocket::peerPort() const
+{
+    return connection->connection->peerPort();
+}
+
+
+qintptr Http2StreamSocket::fileno() const
+{
+    // the streams share the file descriptor, nobody should wait on it.
+    return -1;
+}
+
+
+Socket::SocketType Http2StreamSocket::type() const
+{
+    return connection->connection->type();
+}
+
+
+Socket::SocketState Http2StreamSocket::state() const
+{
+    return stream->finished ? Socket::UnconnectedState : Socket::ConnectedState;
+}
+
+
+Socket::NetworkLayerProtocol Http2StreamSocket::protocol() const
+{
+    return connection->connection->protocol();
+}
+
+
+Socket *Http2StreamSocket::acceptRaw()
+{
+    return nullptr;
+}
+
+
+QSharedPointer<SocketLike> Http2StreamSocket::accept()
+{
+    return QSharedPointer<SocketLike>();
+}
+
+
+bool Http2StreamSocket::bind(QHostAddress &, quint16, Socket::BindMode)
+{
+    return false;
+}
+
+
+bool Http2StreamSocket::bind(quint16, Socket::BindMode)
+{
+    return false;
+}
+
+
+bool Http2StreamSocket::connect(const QHostAddress &, quint16)
+{
+    return false;
+}
+
+
+bool Http2StreamSocket::connect(const QString &, quint16, Socket::NetworkLayerProtocol)
+{
+    return false;
+}
+
+
+bool Http2StreamSocket::close()
+{
+    connection->closeStream(stream);
+    return true;
+}
+
+
+bool Http2StreamSocket::listen(int)
+{
+    return false;
+}
+
+
+bool Http2StreamSocket::setOption(Socket::SocketOption, const QVariant &)
+{
+    return false;
+}
+
+
+QVariant Http2StreamSocket::option(Socket::SocketOption) const
+{
+    return QVariant();
+}
+
+
+qint32 Http2StreamSocket::recv(char *data, qint32 size)
+{
+    const QByteArray &buf = connection->recv(stream, size, false);
+    memcpy(data, buf.constData(), static_cast<size_t>(buf.size()));
+    return buf.size();
+}
+
+
+qint32 Http2StreamSocket::recvall(char *data, qint32 size)
+{
+    const QByteArray &buf = connection->recv(stream, size, true);
+    memcpy(data, buf.constData(), static_cast<size_t>(buf.size()));
+    return buf.size();
+}
+
+
+qint32 Http2StreamSocket::send(const char *data, qint32 size)
+{
+    return connection->send(stream, QByteArray::fromRawData(data, size));
+}
+
+
+qint32 Http2StreamSocket::sendall(const char *data, qint32 size)
+{
+    return connection->send(stream, QByteArray::fromRawData(data, size));
+}
+
+
+QByteArray Http2StreamSocket::recv(qint32 size)
+{
+    return connection->recv(stream, size, false);
+}
+
+
+QByteArray Http2StreamSocket::recvall(qint32 size)
+{
+    return connection->recv(stream, size, true);
+}
+
+
+qint32 Http2StreamSocket::send(const QByteArray &data)
+{
+    return connection->send(stream, data);
+}
+
+
+qint32 Http2StreamSocket::sendall(const QByteArray &data)
+{
+    return connection->send(stream, data);
+}
+
+QTNETWORKNG_NAMESPACE_END
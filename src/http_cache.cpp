@@ -0,0 +1,289 @@
+#include <limits.h>
+#include <QtCore/qcache.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qdir.h>
+#include <QtCore/qsavefile.h>
+#include <QtCore/qdatastream.h>
+#include <QtCore/qcryptographichash.h>
+#include "../include/http_cache.h"
+#include "../include/coroutine_utils.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+
+qint64 HttpCacheEntry::cost() const
+{
+    qint64 total = body.size() + 256;
+    for (const HttpHeader &header: headers) {
+        total += header.name.size() * 2 + header.value.size();
+    }
+    return total;
+}
+
+
+HttpCacheStore::~HttpCacheStore() {}
+
+
+class MemoryHttpCacheStore: public HttpCacheStore
+{
+public:
+    explicit MemoryHttpCacheStore(qint64 maxBytes)
+        :entries(static_cast<int>(qBound<qint64>(1, maxBytes, INT_MAX))) {}
+public:
+    virtual bool load(const QString &key, HttpCacheEntry *entry) override;
+    virtual void store(const QString &key, const HttpCacheEntry &entry) override;
+    virtual void remove(const QString &key) override;
+    virtual void clear() override;
+private:
+    QCache<QString, HttpCacheEntry> entries;    // QCache drops the least recently used ones by cost.
+    QMutex mutex;
+};
+
+
+bool MemoryHttpCacheStore::load(const QString &key, HttpCacheEntry *entry)
+{
+    QMutexLocker locker(&mutex);
+    HttpCacheEntry *found = entries.object(key);
+    if (!found) {
+        return false;
+    }
+    *entry = *found;
+    return true;
+}
+
+
+void MemoryHttpCacheStore::store(const QString &key, const HttpCacheEntry &entry)
+{
+    QMutexLocker locker(&mutex);
+    // an entry costs more than maxBytes is deleted by QCache at once.
+    entries.insert(key, new HttpCacheEntry(entry), static_cast<int>(qMin<qint64>(entry.cost(), INT_MAX)));
+}
+
+
+void MemoryHttpCacheStore::remove(const QString &key)
+{
+    QMutexLocker locker(&mutex);
+    entries.remove(key);
+}
+
+
+void MemoryHttpCacheStore::clear()
+{
+    QMutexLocker locker(&mutex);
+    entries.clear();
+}
+
+
+// shared with the threads of callInThread(), which may outlive the store if the calling coroutine is killed.
+struct DiskHttpCacheState
+{
+    DiskHttpCacheState(const QString &directory, qint64 maxBytes)
+        :directory(directory), maxBytes(maxBytes), totalBytes(-1) {}
+    QString pathOf(const QString &key) const;
+    bool load(const QString &key, HttpCacheEntry *entry);
+    void store(const QString &key, const HttpCacheEntry &entry);
+    void remove(const QString &key);
+    void clear();
+    // the caller holds the lock.
+    void scanIfNeeded();
+    void shrink();
+    QString directory;
+    qint64 maxBytes;
+    QMutex mutex;
+    qint64 totalBytes;      // -1 if the directory is not scanned yet.
+};
+
+
+static const quint32 DiskCacheMagic = 0x51484331;  // "QHC1"
+
+
+QString DiskHttpCacheState::pathOf(const QString &key) const
+{
+    const QByteArray &hash = QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex();
+    return directory + QLatin1Char('/') + QString::fromLatin1(hash) + QStringLiteral(".cache");
+}
+
+
+void DiskHttpCacheState::scanIfNeeded()
+{
+    if (totalBytes >= 0) {
+        return;
+    }
+    QDir().mkpath(directory);
+    totalBytes = 0;
+    const QFileInfoList &files = QDir(directory).entryInfoList(QStringList() << QStringLiteral("*.cache"), QDir::Files);
+    for (const QFileInfo &info: files) {
+        totalBytes += info.size();
+    }
+}
+
+
+void DiskHttpCacheState::shrink()
+{
+    if (totalBytes <= maxBytes) {
+        return;
+    }
+    // to 90% of the limit, so the next entries do not scan the directory again.
+    const QFileInfoList &files = QDir(directory).entryInfoList(QStringList() << QStringLiteral("*.cache"), QDir::Files,
+                                                               QDir::Time | QDir::Reversed);
+    for (const QFileInfo &info: files) {
+        if (totalBytes <= maxBytes / 10 * 9) {
+            break;
+        }
+        if (QFile::remove(info.filePath())) {
+            totalBytes -= info.size();
+        }
+    }
+}
+
+
+bool DiskHttpCacheState::load(const QString &key, HttpCacheEntry *entry)
+{
+    QFile file(pathOf(key));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QDataStream ds(&file);
+    ds.setVersion(QDataStream::Qt_5_0);
+    quint32 magic;
+    QString storedKey;
+    ds >> magic >> storedKey;
+    if (magic != DiskCacheMagic || storedKey != key) {
+        return false;
+    }
+    qint32 statusCode, headerCount, varyCount;
+    ds >> entry->url >> statusCode >> entry->statusText >> headerCount;
+    entry->statusCode = statusCode;
+    entry->headers.clear();
+    for (qint32 i = 0; i < headerCount && ds.status() == QDataStream::Ok; ++i) {
+        HttpHeader header;
+        ds >> header.name >> header.value;
+        entry->headers.append(header);
+    }
+    ds >> varyCount;
+    entry->varyHeaders.clear();
+    for (qint32 i = 0; i < varyCount && ds.status() == QDataStream::Ok; ++i) {
+        HttpHeader header;
+        ds >> header.name >> header.value;
+        entry->varyHeaders.append(header);
+    }
+    ds >> entry->body >> entry->requestTime >> entry->responseTime;
+    return ds.status() == QDataStream::Ok;
+}
+
+
+void DiskHttpCacheState::store(const QString &key, const HttpCacheEntry &entry)
+{
+    const QString &path = pathOf(key);
+    QMutexLocker locker(&mutex);
+    scanIfNeeded();
+    const qint64 oldSize = QFileInfo(path).size();
+    // QSaveFile renames the whole file at last, so a reader never sees half of it.
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return;
+    }
+    QDataStream ds(&file);
+    ds.setVersion(QDataStream::Qt_5_0);
+    ds << DiskCacheMagic << key << entry.url << static_cast<qint32>(entry.statusCode) << entry.statusText;
+    ds << static_cast<qint32>(entry.headers.size());
+    for (const HttpHeader &header: entry.headers) {
+        ds << header.name << header.value;
+    }
+    ds << static_cast<qint32>(entry.varyHeaders.size());
+    for (const HttpHeader &header: entry.varyHeaders) {
+        ds << header.name << header.value;
+    }
+    ds << entry.body << entry.requestTime << entry.responseTime;
+    if (ds.status() != QDataStream::Ok || !file.commit()) {
+        return;
+    }
+    totalBytes += QFileInfo(path).size() - oldSize;
+    shrink();
+}
+
+
+void DiskHttpCacheState::remove(const QString &key)
+{
+    const QString &path = pathOf(key);
+    QMutexLocker locker(&mutex);
+    scanIfNeeded();
+    const qint64 size = QFileInfo(path).size();
+    if (QFile::remove(path)) {
+        totalBytes -= size;
+    }
+}
+
+
+void DiskHttpCacheState::clear()
+{
+    QMutexLocker locker(&mutex);
+    const QFileInfoList &files = QDir(directory).entryInfoList(QStringList() << QStringLiteral("*.cache"), QDir::Files);
+    for (const QFileInfo &info: files) {
+        QFile::remove(info.filePath());
+    }
+    totalBytes = -1;
+}
+
+
+class DiskHttpCacheStore: public HttpCacheStore
+{
+public:
+    DiskHttpCacheStore(const QString &directory, qint64 maxBytes)
+        :state(new DiskHttpCacheState(directory, maxBytes)) {}
+public:
+    virtual bool load(const QString &key, HttpCacheEntry *entry) override;
+    virtual void store(const QString &key, const HttpCacheEntry &entry) override;
+    virtual void remove(const QString &key) override;
+    virtual void clear() override;
+private:
+    QSharedPointer<DiskHttpCacheState> state;
+};
+
+
+bool DiskHttpCacheStore::load(const QString &key, HttpCacheEntry *entry)
+{
+    QSharedPointer<DiskHttpCacheState> state = this->state;
+    QSharedPointer<HttpCacheEntry> loaded(new HttpCacheEntry());
+    bool found = callInThread<bool>([state, key, loaded] { return state->load(key, loaded.data()); });
+    if (found) {
+        *entry = *loaded;
+    }
+    return found;
+}
+
+
+void DiskHttpCacheStore::store(const QString &key, const HttpCacheEntry &entry)
+{
+    QSharedPointer<DiskHttpCacheState> state = this->state;
+    callInThread([state, key, entry] { state->store(key, entry); });
+}
+
+
+void DiskHttpCacheStore::remove(const QString &key)
+{
+    QSharedPointer<DiskHttpCacheState> state = this->state;
+    callInThread([state, key] { state->remove(key); });
+}
+
+
+void DiskHttpCacheStore::clear()
+{
+    QSharedPointer<DiskHttpCacheState> state = this->state;
+    callInThread([state] { state->clear(); });
+}
+
+
+QSharedPointer<HttpCacheStore> HttpCacheStore::memory(qint64 maxBytes)
+{
+    return QSharedPointer<HttpCacheStore>(new MemoryHttpCacheStore(maxBytes));
+}
+
+
+QSharedPointer<HttpCacheStore> HttpCacheStore::disk(const QString &directory, qint64 maxBytes)
+{
+    return QSharedPointer<HttpCacheStore>(new DiskHttpCacheStore(directory, maxBytes));
+}
+
+
+QTNETWORKNG_NAMESPACE_END
@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <QtCore/qdatetime.h>
+#include <QtCore/qurl.h>
+#include "../include/http_cookie.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+// the origins cached at most, a crawler visits too many hosts to keep them all.
+static const int MaxCachedOrigins = 1024;
+
+
+static inline QString domainKey(const QNetworkCookie &cookie)
+{
+    const QString &domain = cookie.domain();
+    if (domain.startsWith(QLatin1Char('.'))) {
+        return domain.mid(1).toLower();
+    }
+    return domain.toLower();
+}
+
+
+static inline bool sameCookie(const QNetworkCookie &a, const QNetworkCookie &b)
+{
+    return a.name() == b.name() && a.domain() == b.domain() && a.path() == b.path();
+}
+
+
+// RFC 6265 5.1.4
+static inline bool pathMatches(const QString &cookiePath, const QString &path)
+{
+    if (cookiePath.isEmpty() || cookiePath == path) {
+        return true;
+    }
+    if (!path.startsWith(cookiePath)) {
+        return false;
+    }
+    return cookiePath.endsWith(QLatin1Char('/')) || path.at(cookiePath.size()) == QLatin1Char('/');
+}
+
+
+static inline bool longerPath(const QNetworkCookie &a, const QNetworkCookie &b)
+{
+    return a.path().size() > b.path().size();
+}
+
+
+static QByteArray serialize(const QNetworkCookie *begin, const QNetworkCookie *end)
+{
+    QByteArray header;
+    for (const QNetworkCookie *cookie = begin; cookie != end; ++cookie) {
+        if (!header.isEmpty()) {
+            header.append("; ", 2);
+        }
+        header.append(cookie->toRawForm(QNetworkCookie::NameAndValueOnly));
+    }
+    return header;
+}
+
+
+HttpCookieJar::HttpCookieJar(QObject *parent)
+    :QNetworkCookieJar(parent), count(0)
+{
+}
+
+
+bool HttpCookieJar::setCookiesFromUrl(const QList<QNetworkCookie> &cookieList, const QUrl &url)
+{
+    bool added = false;
+    for (QNetworkCookie cookie: cookieList) {
+        cookie.normalize(url);
+        if (validateCookie(cookie, url) && insertCookie(cookie)) {
+            added = true;
+        }
+    }
+    return added;
+}
+
+
+bool HttpCookieJar::insertCookie(const QNetworkCookie &cookie)
+{
+    // an expired cookie deletes the one of the same name, as QNetworkCookieJar does.
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    const bool isDeletion = !cookie.isSessionCookie() && cookie.expirationDate().toMSecsSinceEpoch() <= now;
+    deleteCookie(cookie);
+    if (isDeletion) {
+        return false;
+    }
+    const QString &key = domainKey(cookie);
+    buckets[key].append(cookie);
+    ++count;
+    if (!cookie.isSessionCookie()) {
+        Expiry expiry;
+        expiry.time = cookie.expirationDate().toMSecsSinceEpoch();
+        expiry.domain = key;
+        expiries.append(expiry);
+        std::push_heap(expiries.begin(), expiries.end());
+    }
+    origins.clear();
+    return true;
+}
+
+
+bool HttpCookieJar::updateCookie(const QNetworkCookie &cookie)
+{
+    if (deleteCookie(cookie)) {
+        insertCookie(cookie);
+        return true;
+    }
+    return false;
+}
+
+
+bool HttpCookieJar::deleteCookie(const QNetworkCookie &cookie)
+{
+    QHash<QString, QVector<QNetworkCookie>>::iterator itor = buckets.find(domainKey(cookie));
+    if (itor == buckets.end()) {
+        return false;
+    }
+    QVector<QNetworkCookie> &bucket = itor.value();
+    for (int i = 0; i < bucket.size(); ++i) {
+        if (sameCookie(bucket.at(i), cookie)) {
+            bucket.remove(i);
+            if (bucket.isEmpty()) {
+                buckets.erase(itor);
+            }
+            --count;
+            origins.clear();
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void HttpCookieJar::removeExpired() const
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (expiries.isEmpty() || expiries.first().time > now) {
+        return;
+    }
+    while (!expiries.isEmpty() && expiries.first().time <= now) {
+        std::pop_heap(expiries.begin(), expiries.end());
+        const QString domain = expiries.last().domain;
+        expiries.removeLast();
+        // the entry may be left by a replaced cookie, so the cookies are checked again.
+        QHash<QString, QVector<QNetworkCookie>>::iterator itor = buckets.find(domain);
+        if (itor == buckets.end()) {
+            continue;
+        }
+        QVector<QNetworkCookie> &bucket = itor.value();
+        for (int i = bucket.size() - 1; i >= 0; --i) {
+            const QNetworkCookie &cookie = bucket.at(i);
+            if (!cookie.isSessionCookie() && cookie.expirationDate().toMSecsSinceEpoch() <= now) {
+                bucket.remove(i);
+                --count;
+            }
+        }
+        if (bucket.isEmpty()) {
+            buckets.erase(itor);
+        }
+    }
+    // the entries of the replaced cookies are dropped if they are too many.
+    if (expiries.size() > count * 2 + 64) {
+        expiries.clear();
+        for (QHash<QString, QVector<QNetworkCookie>>::const_iterator itor = buckets.constBegin(); itor != buckets.constEnd(); ++itor) {
+            for (const QNetworkCookie &cookie: itor.value()) {
+                if (!cookie.isSessionCookie()) {
+                    Expiry expiry;
+                    expiry.time = cookie.expirationDate().toMSecsSinceEpoch();
+                    expiry.domain = itor.key();
+                    expiries.append(expiry);
+                }
+            }
+        }
+        std::make_heap(expiries.begin(), expiries.end());
+    }
+    origins.clear();
+}
+
+
+const HttpCookieJar::OriginCookies &HttpCookieJar::originCookies(const QUrl &url) const
+{
+    const bool isEncrypted = url.scheme() == QStringLiteral("https");
+    const QString &host = url.host().toLower();
+    const QString &originKey = (isEncrypted ? QStringLiteral("s:") : QStringLiteral("p:")) + host;
+    QHash<QString, OriginCookies>::const_iterator found = origins.constFind(originKey);
+    if (found != origins.constEnd()) {
+        return found.value();
+    }
+    if (origins.size() >= MaxCachedOrigins) {
+        origins.clear();
+    }
+
+    OriginCookies origin;
+    origin.pathDependent = false;
+    // a.b.com looks up a.b.com, b.com and com. the domain cookies match the subdomains, the host-only ones do not.
+    int pos = 0;
+    while (pos >= 0) {
+        const QString &domain = pos == 0 ? host : host.mid(pos);
+        QHash<QString, QVector<QNetworkCookie>>::const_iterator itor = buckets.constFind(domain);
+        if (itor != buckets.constEnd()) {
+            for (const QNetworkCookie &cookie: itor.value()) {
+                if (cookie.isSecure() && !isEncrypted) {
+                    continue;
+                }
+                if (pos > 0 && !cookie.domain().startsWith(QLatin1Char('.'))) {
+                    continue;
+                }
+                origin.cookies.append(cookie);
+                if (!cookie.path().isEmpty() && cookie.path() != QStringLiteral("/")) {
+                    origin.pathDependent = true;
+                }
+            }
+        }
+        pos = host.indexOf(QLatin1Char('.'), pos);
+        if (pos >= 0) {
+            ++pos;
+        }
+    }
+    std::stable_sort(origin.cookies.begin(), origin.cookies.end(), longerPath);
+    if (!origin.pathDependent) {
+        origin.header = serialize(origin.cookies.constBegin(), origin.cookies.constEnd());
+    }
+    return origins.insert(originKey, origin).value();
+}
+
+
+QVector<QNetworkCookie> HttpCookieJar::matchPath(const OriginCookies &origin, const QUrl &url) const
+{
+    if (!origin.pathDependent) {
+        return origin.cookies;
+    }
+    QString path = url.path();
+    if (path.isEmpty()) {
+        path = QStringLiteral("/");
+    }
+    QVector<QNetworkCookie> matched;
+    for (const QNetworkCookie &cookie: origin.cookies) {
+        if (pathMatches(cookie.path(), path)) {
+            matched.append(cookie);
+        }
+    }
+    return matched;
+}
+
+
+QList<QNetworkCookie> HttpCookieJar::cookiesForUrl(const QUrl &url) const
+{
+    removeExpired();
+    if (buckets.isEmpty()) {
+        return QList<QNetworkCookie>();
+    }
+    return matchPath(originCookies(url), url).toList();
+}
+
+
+QByteArray HttpCookieJar::cookieHeader(const QUrl &url) const
+{
+    removeExpired();
+    if (buckets.isEmpty()) {
+        return QByteArray();
+    }
+    const OriginCookies &origin = originCookies(url);
+    if (!origin.pathDependent) {
+        return origin.header;
+    }
+    const QVector<QNetworkCookie> &matched = matchPath(origin, url);
+    return serialize(matched.constBegin(), matched.constEnd());
+}
+
+
+QList<QNetworkCookie> HttpCookieJar::cookies() const
+{
+    removeExpired();
+    QList<QNetworkCookie> all;
+    for (const QVector<QNetworkCookie> &bucket: buckets) {
+        for (const QNetworkCookie &cookie: bucket) {
+            all.append(cookie);
+        }
+    }
+    return all;
+}
+
+
+void HttpCookieJar::clear()
+{
+    buckets.clear();
+    expiries.clear();
+    origins.clear();
+    count = 0;
+}
+
+
+QTNETWORKNG_NAMESPACE_END
@@ -1,4 +1,11 @@
+#include <limits>
+#include <QtCore/qmutex.h>
+#include <QtCore/qdatetime.h>
+#include <QtCore/qcache.h>
+#include <QtCore/qelapsedtimer.h>
 #include "../include/http_proxy.h"
+#include "../include/socks5_proxy.h"
+#include "../include/coroutine_utils.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
@@ -105,6 +112,295 @@ QSharedPointer<HttpProxy> SimpleProxySwitcher::selectHttpProxy(const QUrl &url)
     return QSharedPointer<HttpProxy>();
 }
 
+struct ProxyDomainNode
+{
+    ProxyDomainNode() : route(-1) {}
+    ~ProxyDomainNode() { qDeleteAll(children); }
+    QHash<QString, ProxyDomainNode *> children;
+    int route;
+};
+
+
+struct ProxyNetworkNode
+{
+    ProxyNetworkNode() : route(-1) { children[0] = children[1] = nullptr; }
+    ~ProxyNetworkNode() { delete children[0]; delete children[1]; }
+    ProxyNetworkNode *children[2];
+    int route;
+};
+
+
+struct ProxyHealth
+{
+    ProxyHealth() : latency(-1), failedAt(0) {}
+    qint64 latency;     // -1 if not measured.
+    qint64 failedAt;
+};
+
+
+#define PROXY_FAILURE_LIFETIME (30 * 1000)
+#define NO_PROXY_ROUTE (-1)
+
+
+class RoutingProxySwitcherPrivate
+{
+public:
+    RoutingProxySwitcherPrivate()
+        : cache(1024 * 16) {}
+public:
+    int addRoute(const QList<QSharedPointer<Socks5Proxy>> &proxies);
+    int findRoute(const QString &host);
+    QSharedPointer<Socks5Proxy> choose(const QList<QSharedPointer<Socks5Proxy>> &proxies);
+public:
+    QMutex lock;
+    QList<QList<QSharedPointer<Socks5Proxy>>> routes;
+    ProxyDomainNode domains;
+    ProxyNetworkNode networks;     // the ipv4 networks are mapped to ipv6.
+    QCache<QString, int> cache;
+    QHash<const Socks5Proxy *, ProxyHealth> health;
+};
+
+
+// the ipv4 addresses are mapped to ::ffff:0:0/96, so one tree has both.
+static Q_IPV6ADDR toIPv6Bits(const QHostAddress &address, int *offset)
+{
+    bool ok;
+    const quint32 ipv4 = address.toIPv4Address(&ok);
+    if (!ok) {
+        *offset = 0;
+        return address.toIPv6Address();
+    }
+    Q_IPV6ADDR bits;
+    memset(bits.c, 0, 10);
+    bits.c[10] = bits.c[11] = 0xff;
+    bits.c[12] = static_cast<quint8>(ipv4 >> 24);
+    bits.c[13] = static_cast<quint8>(ipv4 >> 16);
+    bits.c[14] = static_cast<quint8>(ipv4 >> 8);
+    bits.c[15] = static_cast<quint8>(ipv4);
+    *offset = 96;
+    return bits;
+}
+
+
+static QStringList domainLabels(const QString &domain)
+{
+    QString d = domain.toLower();
+    while (d.startsWith(QLatin1Char('.')) || d.startsWith(QLatin1Char('*'))) {
+        d.remove(0, 1);
+    }
+    while (d.endsWith(QLatin1Char('.'))) {
+        d.chop(1);
+    }
+    return d.split(QLatin1Char('.'), QString::SkipEmptyParts);
+}
+
+
+int RoutingProxySwitcherPrivate::addRoute(const QList<QSharedPointer<Socks5Proxy>> &proxies)
+{
+    routes.append(proxies);
+    cache.clear();
+    return routes.size() - 1;
+}
+
+
+int RoutingProxySwitcherPrivate::findRoute(const QString &host)
+{
+    const int *cached = cache.object(host);
+    if (cached) {
+        return *cached;
+    }
+    int route = NO_PROXY_ROUTE;
+    QHostAddress address;
+    if (address.setAddress(host)) {
+        int offset;
+        const Q_IPV6ADDR bits = toIPv6Bits(address, &offset);
+        const ProxyNetworkNode *node = &networks;
+        route = node->route;
+        for (int i = 0; i < 128 && node; ++i) {
+            node = node->children[(bits.c[i / 8] >> (7 - i % 8)) & 1];
+            if (node && node->route >= 0) {
+                route = node->route;
+            }
+        }
+    } else {
+        const QStringList &labels = domainLabels(host);
+        const ProxyDomainNode *node = &domains;
+        for (int i = labels.size() - 1; i >= 0 && node; --i) {
+            node = node->children.value(labels.at(i));
+            if (node && node->route >= 0) {
+                route = node->route;
+            }
+        }
+    }
+    cache.insert(host, new int(route));
+    return route;
+}
+
+
+// the failed proxies are skipped, and the measured ones are preferred. if all failed, tries the first one.
+QSharedPointer<Socks5Proxy> RoutingProxySwitcherPrivate::choose(const QList<QSharedPointer<Socks5Proxy>> &proxies)
+{
+    if (proxies.isEmpty()) {
+        return QSharedPointer<Socks5Proxy>();
+    }
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QSharedPointer<Socks5Proxy> best;
+    qint64 bestLatency = 0;
+    for (const QSharedPointer<Socks5Proxy> &proxy: proxies) {
+        const ProxyHealth &h = health.value(proxy.data());
+        if (h.failedAt && now - h.failedAt < PROXY_FAILURE_LIFETIME) {
+            continue;
+        }
+        const qint64 latency = h.latency < 0 ? std::numeric_limits<qint64>::max() : h.latency;
+        if (best.isNull() || latency < bestLatency) {
+            best = proxy;
+            bestLatency = latency;
+        }
+    }
+    return best.isNull() ? proxies.first() : best;
+}
+
+
+RoutingProxySwitcher::RoutingProxySwitcher()
+    : d_ptr(new RoutingProxySwitcherPrivate)
+{
+}
+
+
+RoutingProxySwitcher::~RoutingProxySwitcher()
+{
+    delete d_ptr;
+}
+
+
+void RoutingProxySwitcher::addDomainRule(const QString &suffix, const QList<QSharedPointer<Socks5Proxy>> &proxies)
+{
+    Q_D(RoutingProxySwitcher);
+    const QStringList &labels = domainLabels(suffix);
+    QMutexLocker locker(&d->lock);
+    ProxyDomainNode *node = &d->domains;
+    for (int i = labels.size() - 1; i >= 0; --i) {
+        ProxyDomainNode *&child = node->children[labels.at(i)];
+        if (!child) {
+            child = new ProxyDomainNode();
+        }
+        node = child;
+    }
+    node->route = d->addRoute(proxies);
+}
+
+
+void RoutingProxySwitcher::addNetworkRule(const QHostAddress &network, int prefixLength,
+                                          const QList<QSharedPointer<Socks5Proxy>> &proxies)
+{
+    Q_D(RoutingProxySwitcher);
+    int offset;
+    const Q_IPV6ADDR bits = toIPv6Bits(network, &offset);
+    const int length = qBound(0, offset + prefixLength, 128);
+    QMutexLocker locker(&d->lock);
+    ProxyNetworkNode *node = &d->networks;
+    for (int i = 0; i < length; ++i) {
+        ProxyNetworkNode *&child = node->children[(bits.c[i / 8] >> (7 - i % 8)) & 1];
+        if (!child) {
+            child = new ProxyNetworkNode();
+        }
+        node = child;
+    }
+    node->route = d->addRoute(proxies);
+}
+
+
+void RoutingProxySwitcher::clearRules()
+{
+    Q_D(RoutingProxySwitcher);
+    QMutexLocker locker(&d->lock);
+    qDeleteAll(d->domains.children);
+    d->domains.children.clear();
+    delete d->networks.children[0];
+    delete d->networks.children[1];
+    d->networks.children[0] = d->networks.children[1] = nullptr;
+    d->networks.route = -1;
+    d->routes.clear();
+    d->cache.clear();
+}
+
+
+void RoutingProxySwitcher::reportFailure(QSharedPointer<Socks5Proxy> proxy)
+{
+    Q_D(RoutingProxySwitcher);
+    QMutexLocker locker(&d->lock);
+    d->health[proxy.data()].failedAt = QDateTime::currentMSecsSinceEpoch();
+}
+
+
+// an exponential moving average, so one slow connection does not switch the proxy.
+void RoutingProxySwitcher::reportLatency(QSharedPointer<Socks5Proxy> proxy, qint64 msecs)
+{
+    Q_D(RoutingProxySwitcher);
+    QMutexLocker locker(&d->lock);
+    ProxyHealth &h = d->health[proxy.data()];
+    h.latency = h.latency < 0 ? msecs : (h.latency * 7 + msecs) / 8;
+    h.failedAt = 0;
+}
+
+
+void RoutingProxySwitcher::checkProxies(float timeout)
+{
+    Q_D(RoutingProxySwitcher);
+    QList<QSharedPointer<Socks5Proxy>> proxies = socks5Proxies;
+    {
+        QMutexLocker locker(&d->lock);
+        for (const QList<QSharedPointer<Socks5Proxy>> &route: d->routes) {
+            for (const QSharedPointer<Socks5Proxy> &proxy: route) {
+                if (!proxies.contains(proxy)) {
+                    proxies.append(proxy);
+                }
+            }
+        }
+    }
+    CoroutineGroup operations;
+    for (const QSharedPointer<Socks5Proxy> &proxy: proxies) {
+        operations.spawn([this, proxy, timeout] {
+            QElapsedTimer timer;
+            timer.start();
+            Socket s;
+            bool ok;
+            try {
+                Timeout t(timeout); Q_UNUSED(t);
+                ok = s.connect(proxy->hostName(), proxy->port());
+            } catch (TimeoutException &) {
+                ok = false;
+            }
+            if (ok) {
+                reportLatency(proxy, timer.elapsed());
+            } else {
+                reportFailure(proxy);
+            }
+        });
+    }
+    operations.joinall();
+}
+
+
+QSharedPointer<Socks5Proxy> RoutingProxySwitcher::selectSocks5Proxy(const QUrl &url)
+{
+    Q_D(RoutingProxySwitcher);
+    QMutexLocker locker(&d->lock);
+    const int route = d->findRoute(url.host());
+    return d->choose(route == NO_PROXY_ROUTE ? socks5Proxies : d->routes.at(route));
+}
+
+
+QSharedPointer<HttpProxy> RoutingProxySwitcher::selectHttpProxy(const QUrl &url)
+{
+    Q_UNUSED(url);
+    if(httpProxies.size() > 0) {
+        return httpProxies.at(0);
+    }
+    return QSharedPointer<HttpProxy>();
+}
+
+
 //implemented in http.cpp
 void setProxySwitcher(class HttpSession *session, QSharedPointer<BaseProxySwitcher> switcher);
 
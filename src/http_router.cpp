@@ -0,0 +1,235 @@
+#include <algorithm>
+#include "../include/http_router.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+
+QStringRef HttpRouteMatch::param(const QString &name) const
+{
+    for (const Capture &capture: captures) {
+        if (*capture.name == name) {
+            return QStringRef(path, capture.position, capture.size);
+        }
+    }
+    return QStringRef();
+}
+
+
+QStringRef HttpRouteMatch::param(QLatin1String name) const
+{
+    for (const Capture &capture: captures) {
+        if (*capture.name == name) {
+            return QStringRef(path, capture.position, capture.size);
+        }
+    }
+    return QStringRef();
+}
+
+
+HttpRouteTable::HttpRouteTable()
+    :count(0)
+{
+    nodes.append(Node());
+}
+
+
+// returns the node where the text ends, the nodes are split if they share a part of prefix.
+int HttpRouteTable::insertStatic(int node, const QString &text)
+{
+    int consumed = 0;
+    while (consumed < text.size()) {
+        const ushort c = text.at(consumed).unicode();
+        const QVector<ushort> &chars = nodes.at(node).firstChars;
+        const int i = static_cast<int>(std::lower_bound(chars.constBegin(), chars.constEnd(), c) - chars.constBegin());
+        if (i == chars.size() || chars.at(i) != c) {
+            Node child;
+            child.text = text.mid(consumed);
+            nodes.append(child);
+            const int childIndex = nodes.size() - 1;
+            nodes[node].firstChars.insert(i, c);
+            nodes[node].staticChildren.insert(i, childIndex);
+            return childIndex;
+        }
+        const int childIndex = nodes.at(node).staticChildren.at(i);
+        const QString prefix = nodes.at(childIndex).text;
+        int common = 0;
+        while (common < prefix.size() && consumed + common < text.size()
+               && prefix.at(common) == text.at(consumed + common)) {
+            ++common;
+        }
+        if (common < prefix.size()) {
+            // the rest of prefix moves to a new node with all children and routes.
+            Node tail = nodes.at(childIndex);
+            tail.text = prefix.mid(common);
+            nodes.append(tail);
+            const int tailIndex = nodes.size() - 1;
+            Node &head = nodes[childIndex];
+            head.text = prefix.left(common);
+            head.firstChars = QVector<ushort>() << tail.text.at(0).unicode();
+            head.staticChildren = QVector<int>() << tailIndex;
+            head.paramChild = -1;
+            head.wildcardChild = -1;
+            head.routes.clear();
+        }
+        node = childIndex;
+        consumed += common;
+    }
+    return node;
+}
+
+
+// returns -1 if there is a parameter of other name in the same place.
+int HttpRouteTable::insertChild(int node, NodeKind kind, const QString &name)
+{
+    const int existing = kind == ParamNode ? nodes.at(node).paramChild : nodes.at(node).wildcardChild;
+    if (existing >= 0) {
+        return nodes.at(existing).text == name ? existing : -1;
+    }
+    Node child;
+    child.kind = kind;
+    child.text = name;
+    nodes.append(child);
+    const int childIndex = nodes.size() - 1;
+    if (kind == ParamNode) {
+        nodes[node].paramChild = childIndex;
+    } else {
+        nodes[node].wildcardChild = childIndex;
+    }
+    return childIndex;
+}
+
+
+bool HttpRouteTable::addRoute(const QString &method, const QString &pattern, int route)
+{
+    if (!pattern.startsWith(QLatin1Char('/'))) {
+        return false;
+    }
+    int node = 0;
+    int position = 0;
+    while (position < pattern.size()) {
+        // the parameters start a segment, a ':' or '*' in the middle of segment is a plain char.
+        int start = position;
+        while (start < pattern.size()) {
+            const QChar c = pattern.at(start);
+            if ((c == QLatin1Char(':') || c == QLatin1Char('*')) && start > 0 && pattern.at(start - 1) == QLatin1Char('/')) {
+                break;
+            }
+            ++start;
+        }
+        if (start > position) {
+            node = insertStatic(node, pattern.mid(position, start - position));
+        }
+        if (start == pattern.size()) {
+            break;
+        }
+        const bool wildcard = pattern.at(start) == QLatin1Char('*');
+        int end = pattern.indexOf(QLatin1Char('/'), start);
+        if (end < 0) {
+            end = pattern.size();
+        } else if (wildcard) {
+            return false;   // the wildcard must be the last.
+        }
+        const QString &name = pattern.mid(start + 1, end - start - 1);
+        if (name.isEmpty()) {
+            return false;
+        }
+        node = insertChild(node, wildcard ? WildcardNode : ParamNode, name);
+        if (node < 0) {
+            return false;
+        }
+        position = end;
+    }
+    const QString &key = (method.isEmpty() || method == QLatin1String("*")) ? QStringLiteral("*") : method.toUpper();
+    for (const QPair<QString, int> &existing: nodes.at(node).routes) {
+        if (existing.first == key) {
+            return false;
+        }
+    }
+    nodes[node].routes.append(qMakePair(key, route));
+    ++count;
+    return true;
+}
+
+
+bool HttpRouteTable::matchNode(int index, const QString &method, const QChar *path, int position, int end,
+                               HttpRouteMatch *match) const
+{
+    const Node &node = nodes.at(index);
+    const int captured = match->captures.size();
+    if (node.kind == StaticNode) {
+        const int size = node.text.size();
+        if (end - position < size) {
+            return false;
+        }
+        const QChar *text = node.text.constData();
+        for (int i = 0; i < size; ++i) {
+            if (path[position + i] != text[i]) {
+                return false;
+            }
+        }
+        position += size;
+    } else if (node.kind == ParamNode) {
+        int segmentEnd = position;
+        while (segmentEnd < end && path[segmentEnd] != QLatin1Char('/')) {
+            ++segmentEnd;
+        }
+        if (segmentEnd == position) {
+            return false;
+        }
+        HttpRouteMatch::Capture capture = { &node.text, position, segmentEnd - position };
+        match->captures.append(capture);
+        position = segmentEnd;
+    } else {
+        HttpRouteMatch::Capture capture = { &node.text, position, end - position };
+        match->captures.append(capture);
+        position = end;
+    }
+    if (position == end && !node.routes.isEmpty()) {
+        for (const QPair<QString, int> &route: node.routes) {
+            if (route.first == method || route.first == QLatin1String("*")) {
+                match->routeIndex = route.second;
+                return true;
+            }
+        }
+        match->methodNotAllowed = true;
+    }
+    if (position < end) {
+        const ushort c = path[position].unicode();
+        const QVector<ushort>::const_iterator found = std::lower_bound(node.firstChars.constBegin(), node.firstChars.constEnd(), c);
+        if (found != node.firstChars.constEnd() && *found == c) {
+            const int child = node.staticChildren.at(static_cast<int>(found - node.firstChars.constBegin()));
+            if (matchNode(child, method, path, position, end, match)) {
+                return true;
+            }
+        }
+        if (node.paramChild >= 0 && matchNode(node.paramChild, method, path, position, end, match)) {
+            return true;
+        }
+    }
+    if (node.wildcardChild >= 0 && matchNode(node.wildcardChild, method, path, position, end, match)) {
+        return true;
+    }
+    match->captures.resize(captured);
+    return false;
+}
+
+
+bool HttpRouteTable::match(const QString &method, const QString &path, HttpRouteMatch *match) const
+{
+    match->captures.clear();
+    match->path = &path;
+    match->routeIndex = -1;
+    match->methodNotAllowed = false;
+    int end = path.indexOf(QLatin1Char('?'));
+    if (end < 0) {
+        end = path.size();
+    }
+    if (!matchNode(0, method, path.constData(), 0, end, match)) {
+        return false;
+    }
+    match->methodNotAllowed = false;
+    return true;
+}
+
+
+QTNETWORKNG_NAMESPACE_END
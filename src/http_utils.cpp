@@ -1,5 +1,14 @@
+#include <string.h>
 #include <QtCore/qlocale.h>
+#include <QtCore/qendian.h>
+#ifdef QTNG_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef QTNG_HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
 #include "../include/http_utils.h"
+#include "../include/coroutine.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
@@ -411,12 +420,12 @@ void HeaderOperationMixin::setLastModified(const QDateTime &lastModified)
 
 void HeaderOperationMixin::setModifiedSince(const QDateTime &modifiedSince)
 {
-    setHeader(QStringLiteral("Modified-Since"), toHttpDate(modifiedSince));
+    setHeader(QStringLiteral("If-Modified-Since"), toHttpDate(modifiedSince));
 }
 
 QDateTime HeaderOperationMixin::getModifedSince() const
 {
-    const QByteArray &value = header(QStringLiteral("Modified-Since"));
+    const QByteArray &value = header(QStringLiteral("If-Modified-Since"));
     if(value.isEmpty()) {
         return QDateTime();
     }
@@ -424,62 +433,133 @@ QDateTime HeaderOperationMixin::getModifedSince() const
 }
 
 
-static QStringList knownHeaders = {
-    QStringLiteral("Content-Type"),
-    QStringLiteral("Content-Length"),
-    QStringLiteral("Content-Encoding"),
-    QStringLiteral("Transfer-Encoding"),
-    QStringLiteral("Location"),
-    QStringLiteral("Last-Modified"),
-    QStringLiteral("Cookie"),
-    QStringLiteral("Set-Cookie"),
-    QStringLiteral("Content-Disposition"),
-    QStringLiteral("Server"),
-    QStringLiteral("User-Agent"),
-    QStringLiteral("Accept"),
-    QStringLiteral("Accept-Language"),
-    QStringLiteral("Accept-Encoding"),
-    QStringLiteral("DNT"),
-    QStringLiteral("Connection"),
-    QStringLiteral("Pragma"),
-    QStringLiteral("Cache-Control"),
-    QStringLiteral("Date"),
-    QStringLiteral("Allow"),
-    QStringLiteral("Vary"),
-    QStringLiteral("X-Frame-Options"),
-    QStringLiteral("MIME-Version"),
+// in the order of HeaderOperationMixin::KnownHeader, so the id of a known header is the enum value.
+static const char * const knownHeaders[] = {
+    "Content-Type",
+    "Content-Length",
+    "Content-Encoding",
+    "Transfer-Encoding",
+    "Location",
+    "Last-Modified",
+    "Cookie",
+    "Set-Cookie",
+    "Content-Disposition",
+    "Server",
+    "User-Agent",
+    "Accept",
+    "Accept-Language",
+    "Accept-Encoding",
+    "Pragma",
+    "Cache-Control",
+    "Date",
+    "Allow",
+    "Vary",
+    "X-Frame-Options",
+    "MIME-Version",
+    "Connection",
+    "Upgrade",
+    "DNT",
+};
+
+static const int KnownHeaderSlots = 56;
+// a perfect hash of the known headers, see knownHeaderSlot(). -1 for the empty slot.
+static const qint8 knownHeaderIds[KnownHeaderSlots] = {
+    -1, 19, -1, 20,  0,  3, -1, -1,  7, -1, -1, -1, -1, 16,
+     5, -1, -1, 14, -1, 18, 12, -1, -1, -1,  6, -1, 23, -1,
+    -1, 10, 13,  1, -1, -1,  4,  8, -1, 21,  2, -1, -1, 11,
+    -1, -1, -1, 15, -1, -1, 22,  9, 17, -1, -1, -1, -1, -1,
 };
 
+static const quint32 UnknownHeaderKey = 0x80000000u;
+
+static inline ushort lowerAscii(ushort c)
+{
+    return (c >= 'A' && c <= 'Z') ? static_cast<ushort>(c + ('a' - 'A')) : c;
+}
+
+static inline int knownHeaderSlot(const QString &name)
+{
+    const int len = name.size();
+    return static_cast<int>((static_cast<uint>(len) * 6 + lowerAscii(name.at(0).unicode())
+                             + lowerAscii(name.at(len - 1).unicode()) * 5) % KnownHeaderSlots);
+}
+
+// returns -1 if the name is not a known header.
+static int knownHeaderId(const QString &name)
+{
+    if (name.isEmpty()) {
+        return -1;
+    }
+    int id = knownHeaderIds[knownHeaderSlot(name)];
+    if (id < 0 || name.compare(QLatin1String(knownHeaders[id]), Qt::CaseInsensitive) != 0) {
+        return -1;
+    }
+    return id;
+}
+
+// the id of known header, or the FNV-1a hash of lower-cased name with the highest bit set.
+static quint32 headerKey(const QString &name)
+{
+    int id = knownHeaderId(name);
+    if (id >= 0) {
+        return static_cast<quint32>(id);
+    }
+    quint32 hash = 2166136261u;
+    const ushort *p = name.utf16();
+    for (int i = 0; i < name.size(); ++i) {
+        hash ^= lowerAscii(p[i]);
+        hash *= 16777619u;
+    }
+    return hash | UnknownHeaderKey;
+}
+
 QString normalizeHeaderName(const QString &headerName) {
-    for (const QString &goodName: knownHeaders) {
-        if(headerName.compare(goodName, Qt::CaseInsensitive) == 0) {
-            return goodName;
-        }
+    int id = knownHeaderId(headerName);
+    if (id >= 0) {
+        return QString::fromLatin1(knownHeaders[id]);
     }
     return headerName;
 }
 
-bool HeaderOperationMixin::hasHeader(const QString &headerName) const
+void HeaderOperationMixin::syncKeys() const
 {
+    if (keys.size() == headers.size()) {
+        return;
+    }
+    keys.resize(headers.size());
     for (int i = 0; i < headers.size(); ++i) {
-        const HttpHeader &header = headers.at(i);
-        if(header.name.compare(headerName, Qt::CaseInsensitive) == 0) {
-            return true;
+        keys[i] = headerKey(headers.at(i).name);
+    }
+}
+
+// the keys of known headers are never shared, the names of others are compared only if the hashes match.
+int HeaderOperationMixin::indexOf(quint32 key, const QString &name, int from) const
+{
+    syncKeys();
+    const quint32 *p = keys.constData();
+    for (int i = from; i < keys.size(); ++i) {
+        if (p[i] == key && (!(key & UnknownHeaderKey)
+                            || headers.at(i).name.compare(name, Qt::CaseInsensitive) == 0)) {
+            return i;
         }
     }
-    return false;
+    return -1;
+}
+
+bool HeaderOperationMixin::hasHeader(const QString &headerName) const
+{
+    return indexOf(headerKey(headerName), headerName) >= 0;
 }
 
 bool HeaderOperationMixin::removeHeader(const QString &headerName)
 {
-    for (int i = 0; i < headers.size(); ++i) {
-        const HttpHeader &header = headers.at(i);
-        if(header.name.compare(headerName, Qt::CaseInsensitive) == 0) {
-            headers.removeAt(i);
-            return true;
-        }
+    int i = indexOf(headerKey(headerName), headerName);
+    if (i < 0) {
+        return false;
     }
-    return false;
+    headers.removeAt(i);
+    keys.remove(i);
+    return true;
 }
 
 void HeaderOperationMixin::setHeader(const QString &name, const QByteArray &value)
@@ -490,82 +570,42 @@ void HeaderOperationMixin::setHeader(const QString &name, const QByteArray &valu
 
 void HeaderOperationMixin::addHeader(const QString &name, const QByteArray &value)
 {
-    headers.append(HttpHeader(normalizeHeaderName(name), value));
+    syncKeys();
+    int id = knownHeaderId(name);
+    if (id >= 0) {
+        headers.append(HttpHeader(QString::fromLatin1(knownHeaders[id]), value));
+        keys.append(static_cast<quint32>(id));
+    } else {
+        headers.append(HttpHeader(name, value));
+        keys.append(headerKey(name));
+    }
 }
 
 QByteArray HeaderOperationMixin::header(const QString &headerName, const QByteArray &defaultValue) const
 {
-    for (int i = 0; i < headers.size(); ++i) {
-        const HttpHeader &header = headers.at(i);
-        if(header.name.compare(headerName, Qt::CaseInsensitive) == 0) {
-            return header.value;
-        }
+    int i = indexOf(headerKey(headerName), headerName);
+    if (i < 0) {
+        return defaultValue;
     }
-    return defaultValue;
+    return headers.at(i).value;
 }
 
 
 QByteArray HeaderOperationMixin::header(KnownHeader knownHeader, const QByteArray &defaultValue) const
 {
-    switch (knownHeader) {
-    case ContentTypeHeader:
-        return header("Content-Type", defaultValue);
-    case ContentLengthHeader:
-        return header("Content-Length", defaultValue);
-    case ContentEncodingHeader:
-        return header("Content-Encoding", defaultValue);
-    case TransferEncodingHeader:
-        return header("Transfer-Encoding", defaultValue);
-    case LocationHeader:
-        return header("Location", defaultValue);
-    case LastModifiedHeader:
-        return header("Last-Modified", defaultValue);
-    case CookieHeader:
-        return header("Cookie", defaultValue);
-    case SetCookieHeader:
-        return header("Set-Cookie", defaultValue);
-    case ContentDispositionHeader:
-        return header("Content-Disposition", defaultValue);
-    case UserAgentHeader:
-        return header("User-Agent", defaultValue);
-    case AcceptHeader:
-        return header("Accept", defaultValue);
-    case AcceptLanguageHeader:
-        return header("Accept-Language", defaultValue);
-    case AcceptEncodingHeader:
-        return header("Accept-Encoding", defaultValue);
-    case PragmaHeader:
-        return header("Pragma", defaultValue);
-    case CacheControlHeader:
-        return header("Cache-Control");
-    case DateHeader:
-        return header("Date", defaultValue);
-    case AllowHeader:
-        return header("Allow", defaultValue);
-    case VaryHeader:
-        return header("Vary", defaultValue);
-    case FrameOptionsHeader:
-        return header("X-Frame-Options", defaultValue);
-    case MIMEVersionHeader:
-        return header("MIME-Version", defaultValue);
-    case ServerHeader:
-        return header("Server", defaultValue);
-    case ConnectionHeader:
-        return header("Connection", defaultValue);
-    case UpgradeHeader:
-        return header("Upgrade", defaultValue);
+    int i = indexOf(static_cast<quint32>(knownHeader), QString());
+    if (i < 0) {
+        return defaultValue;
     }
-    return QByteArray();
+    return headers.at(i).value;
 }
 
 QByteArrayList HeaderOperationMixin::multiHeader(const QString &headerName) const
 {
     QByteArrayList l;
-    for (int i = 0; i < headers.size(); ++i) {
-        const HttpHeader &header = headers.at(i);
-        if(header.name.compare(headerName, Qt::CaseInsensitive) == 0) {
-            l.append(header.value);
-        }
+    const quint32 key = headerKey(headerName);
+    for (int i = indexOf(key, headerName); i >= 0; i = indexOf(key, headerName, i + 1)) {
+        l.append(headers.at(i).value);
     }
     return l;
 }
@@ -573,135 +613,204 @@ QByteArrayList HeaderOperationMixin::multiHeader(const QString &headerName) cons
 void HeaderOperationMixin::setHeaders(const QMap<QString, QByteArray> headers)
 {
     this->headers.clear();
+    keys.clear();
     for (QMap<QString, QByteArray>::const_iterator itor = headers.constBegin(); itor != headers.constEnd(); ++itor) {
-        this->headers.append(HttpHeader(normalizeHeaderName(itor.key()), itor.value()));
+        addHeader(itor.key(), itor.value());
     }
 }
+}
 
-QByteArray HeaderSplitter::nextLine(HeaderSplitter::Error *error)
+// the lines are found by memchr(), which the c libraries vectorize. the buffer is consumed by moving pos,
+// and the consumed bytes are removed once a call returns.
+bool HeaderSplitterBase::findLine(int *start, int *size, int *searched, Error *error)
 {
     const int MaxLineLength = 1024 * 64;
-    QByteArray line;
-    bool expectingLineBreak = false;
-
-    for (int i = 0; i < MaxLineLength; ++i) {
-        if (buf.isEmpty()) {
-            buf = connection->recv(1024);
-            if (buf.isEmpty()) {
-                *error = HeaderSplitter::ConnectionError;
-                return QByteArray();
-            }
+    const char *p = buf.constData();
+    *searched = qMax(*searched, pos);
+    const char *lf = static_cast<const char *>(memchr(p + *searched, '\n', static_cast<size_t>(buf.size() - *searched)));
+    if (lf) {
+        const int end = static_cast<int>(lf - p);
+        // every line ends with "\r\n", and a bare '\r' is not allowed.
+        if (end == pos || p[end - 1] != '\r' || memchr(p + pos, '\r', static_cast<size_t>(end - 1 - pos))) {
+            *error = EncodingError;
+            return false;
         }
-        int j = 0;
-        for (; j < buf.size() && j < MaxLineLength; ++j) {
-            char c = buf.at(j);
-            if (c == '\n') {
-                if(!expectingLineBreak) {
-                    *error = HeaderSplitter::EncodingError;
-                    return QByteArray();
-                }
-                buf.remove(0, j + 1);
-                if (buf.size() > MaxLineLength) {
-                    *error = HeaderSplitter::LineTooLong;
-                    return QByteArray();
-                } else {
-                    *error = HeaderSplitter::NoError;
-                    return line;
-                }
-            } else if (c == '\r') {
-                if(expectingLineBreak) {
-                    *error = HeaderSplitter::EncodingError;
-                    return QByteArray();
-                }
-                expectingLineBreak = true;
-            } else {
-                if (expectingLineBreak) {
-                    *error = HeaderSplitter::EncodingError;
-                    return QByteArray();
-                }
-                line.append(c);
-            }
+        if (end - pos > MaxLineLength) {
+            *error = LineTooLong;
+            return false;
         }
-        buf.remove(0, j + 1);
+        *start = pos;
+        *size = end - 1 - pos;
+        pos = end + 1;
+        *error = NoError;
+        return true;
     }
-    *error = HeaderSplitter::ExhausedMaxLine;
-    return QByteArray();
+    if (buf.size() - pos > MaxLineLength) {
+        *error = LineTooLong;
+        return false;
+    }
+    *searched = buf.size();
+    *error = NoError;
+    return false;
 }
 
 
-HttpHeader HeaderSplitter::nextHeader(Error *error)
+HttpHeader HeaderSplitterBase::parseHeader(int start, int size, Error *error)
 {
-    const QByteArray &line = nextLine(error);
-    if (*error != HeaderSplitter::NoError) {
+    const char *line = buf.constData() + start;
+    const char *colon = static_cast<const char *>(memchr(line, ':', static_cast<size_t>(size)));
+    if (!colon || colon == line) {
+        *error = EncodingError;
         return HttpHeader();
     }
-    if (line.isEmpty()) {
-        *error = HeaderSplitter::NoError;
+    const char *nameEnd = colon;
+    while (nameEnd > line && (nameEnd[-1] == ' ' || nameEnd[-1] == '\t')) {
+        --nameEnd;
+    }
+    const char *value = colon + 1;
+    const char *valueEnd = line + size;
+    while (value < valueEnd && (*value == ' ' || *value == '\t')) {
+        ++value;
+    }
+    while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) {
+        --valueEnd;
+    }
+    if (nameEnd == line) {
+        *error = EncodingError;
         return HttpHeader();
     }
+    *error = NoError;
+    // the names are tokens of ascii.
+    return HttpHeader(QString::fromLatin1(line, static_cast<int>(nameEnd - line)),
+                      QByteArray(value, static_cast<int>(valueEnd - value)));
+}
 
-    QByteArrayList headerParts = splitBytes(line, ':', 1);
-    if(headerParts.size() != 2) {
-        *error = HeaderSplitter::EncodingError;
-        return HttpHeader();
+
+void HeaderSplitterBase::compact()
+{
+    if (pos > 0) {
+        buf.remove(0, pos);
+        pos = 0;
     }
-    QString headerName = QString::fromUtf8(headerParts[0]).trimmed();
-    QByteArray headerValue = headerParts[1].trimmed();
-    *error = HeaderSplitter::NoError;
-    return HttpHeader(headerName, headerValue);
 }
 
 
-QList<HttpHeader> HeaderSplitter::headers(int maxHeaders, Error *error)
+template class BasicHeaderSplitter<SocketLike>;
+
+
+MonotonicArena::~MonotonicArena()
 {
-    QList<HttpHeader> headers;
-    for (int i = 0; i < maxHeaders; ++i) {
-        const HttpHeader &header = nextHeader(error);
-        if (header.isValid()) {
-            headers.append(header);
-        } else {
-            if (*error != HeaderSplitter::NoError) {
-                return QList<HttpHeader>();
-            } else {
-                return headers;
-            }
+    reset();
+}
+
+
+void *MonotonicArena::allocate(qint32 size, qint32 alignment)
+{
+    if (size <= 0) {
+        size = 1;
+    }
+    while (current < blocks.size()) {
+        QByteArray &block = blocks[current];
+        const quintptr base = reinterpret_cast<quintptr>(block.data());
+        const quintptr aligned = (base + static_cast<quintptr>(offset) + static_cast<quintptr>(alignment) - 1)
+                & ~(static_cast<quintptr>(alignment) - 1);
+        const qint32 start = static_cast<qint32>(aligned - base);
+        if (start + size <= block.size()) {
+            offset = start + size;
+            used += size;
+            return block.data() + start;
         }
+        ++current;
+        offset = 0;
+    }
+    // a large object gets a block of its own, the blocks grow to bound the count of blocks.
+    const qint32 previous = blocks.isEmpty() ? blockSize : blocks.last().size() * 2;
+    blocks.append(QByteArray(qMax(previous, size + alignment), Qt::Uninitialized));
+    current = blocks.size() - 1;
+    offset = 0;
+    return allocate(size, alignment);
+}
+
+
+char *MonotonicArena::copy(const char *data, qint32 size)
+{
+    char *p = static_cast<char *>(allocate(size + 1, 1));
+    memcpy(p, data, static_cast<size_t>(size));
+    p[size] = '\0';
+    return p;
+}
+
+
+QByteArray MonotonicArena::bytes(const QByteArray &data)
+{
+    return QByteArray::fromRawData(copy(data.constData(), data.size()), data.size());
+}
+
+
+void MonotonicArena::addCleanup(void (*destroy)(void *), void *object)
+{
+    Cleanup *cleanup = static_cast<Cleanup *>(allocate(static_cast<qint32>(sizeof(Cleanup)),
+                                                       static_cast<qint32>(alignof(Cleanup))));
+    cleanup->destroy = destroy;
+    cleanup->object = object;
+    cleanup->next = cleanups;
+    cleanups = cleanup;
+}
+
+
+void MonotonicArena::reset()
+{
+    while (cleanups) {
+        Cleanup *cleanup = cleanups;
+        cleanups = cleanup->next;
+        cleanup->destroy(cleanup->object);
+    }
+    // the grown blocks are dropped, a burst of one request does not hold the memory of every handler.
+    if (blocks.size() > 1) {
+        blocks.resize(1);
+    }
+    current = 0;
+    offset = 0;
+    used = 0;
+}
+
+
+qint64 MonotonicArena::capacity() const
+{
+    qint64 total = 0;
+    for (const QByteArray &block: blocks) {
+        total += block.size();
     }
-    *error = HeaderSplitter::ExhausedMaxLine;
-    return QList<HttpHeader>();
+    return total;
 }
 
+
 QList<QByteArray> splitBytes(const QByteArray &bs, char sep, int maxSplit)
 {
     QList<QByteArray> tokens;
-    QByteArray token;
-    for (int i = 0; i < bs.size(); ++i) {
-        char c = bs.at(i);
-        if(c == sep && (maxSplit < 0 || tokens.size() < maxSplit)) {
-            tokens.append(token);
-            token.clear();
-        } else {
-            token.append(c);
+    int start = 0;
+    while (maxSplit < 0 || tokens.size() < maxSplit) {
+        const int i = bs.indexOf(sep, start);
+        if (i < 0) {
+            break;
         }
+        tokens.append(bs.mid(start, i - start));
+        start = i + 1;
     }
-    if(!token.isEmpty()) {
-        tokens.append(token);
+    if (start < bs.size()) {
+        tokens.append(bs.mid(start));
     }
     return tokens;
 }
 
 
-QByteArray ChunkedBlockReader::nextBlock(qint64 leftBytes, ChunkedBlockReader::Error *error)
+bool ChunkedBlockReaderBase::takeSize(qint64 leftBytes, qint32 *bytesToRead, Error *error)
 {
-    const int MaxLineLength = 6; // ffff\r\n
     QByteArray numBytes;
     bool expectingLineBreak = false;
-    while(buf.size() < MaxLineLength && !buf.contains('\n')) {
-        buf.append(connection->recv(1024 * 8)); // most server send the header at one tcp block.
-    }
     if(buf.size() < 3) { // 0\r\n
-        *error = ChunkedBlockReader::ChunkedEncodingError;
-        return QByteArray();
+        *error = ChunkedEncodingError;
+        return false;
     }
 
     bool ok = false;
@@ -713,13 +822,13 @@ QByteArray ChunkedBlockReader::nextBlock(qint64 leftBytes, ChunkedBlockReader::E
                 ok = true;
                 break;
             } else {
-                *error = ChunkedBlockReader::ChunkedEncodingError;
-                return QByteArray();
+                *error = ChunkedEncodingError;
+                return false;
             }
         } else {
             if (c == '\n') {
-                *error = ChunkedBlockReader::ChunkedEncodingError;
-                return QByteArray();
+                *error = ChunkedEncodingError;
+                return false;
             } else if (c == '\r') {
                 expectingLineBreak = true;
             } else {
@@ -728,42 +837,745 @@ QByteArray ChunkedBlockReader::nextBlock(qint64 leftBytes, ChunkedBlockReader::E
         }
     }
     if(!ok) {
-        *error = ChunkedBlockReader::ChunkedEncodingError;
-        return QByteArray();
+        *error = ChunkedEncodingError;
+        return false;
     }
 
-    qint32 bytesToRead = numBytes.toInt(&ok, 16);
+    *bytesToRead = numBytes.toInt(&ok, 16);
     if(!ok) {
         if(debugLevel > 0) {
             qDebug() << "got invalid chunked bytes:" << numBytes;
         }
-        *error = ChunkedBlockReader::ChunkedEncodingError;
-        return QByteArray();
+        *error = ChunkedEncodingError;
+        return false;
     }
 
-    if(bytesToRead > leftBytes || bytesToRead < 0) {
-        *error = ChunkedBlockReader::UnrewindableBodyError;
-        return QByteArray();
+    if(*bytesToRead > leftBytes || *bytesToRead < 0) {
+        *error = UnrewindableBodyError;
+        return false;
     }
+    return true;
+}
 
-    while(buf.size() < bytesToRead + 2) {
-        const QByteArray t = connection->recv(1024 * 8);
-        if(t.isEmpty()) {
-            *error = ChunkedBlockReader::ConnectionError;
-            return QByteArray();
-        }
-        buf.append(t);
-    }
 
+QByteArray ChunkedBlockReaderBase::takeBlock(qint32 bytesToRead)
+{
     const QByteArray &result = buf.mid(0, bytesToRead);
     buf.remove(0, bytesToRead + 2);
 
     if(bytesToRead == 0 && !buf.isEmpty() && debugLevel > 0) {
         qDebug() << "bytesToRead == 0 but some bytes left.";
     }
-
-    *error = ChunkedBlockReader::NoError;
     return result;
 }
 
+
+template class BasicChunkedBlockReader<SocketLike>;
+
+// one coding of Content-Encoding, the codings are undone in the reverse order of being applied.
+class ContentDecodingStage
+{
+public:
+    virtual ~ContentDecodingStage() {}
+    virtual bool decode(const QByteArray &data, QByteArray *out) = 0;
+    virtual bool finish(QByteArray *out) = 0;
+};
+
+
+static const int DecodingBlockSize = 1024 * 16;
+
+
+#ifdef QTNG_HAVE_ZLIB
+class ZlibDecodingStage: public ContentDecodingStage
+{
+public:
+    explicit ZlibDecodingStage(bool gzip);
+    virtual ~ZlibDecodingStage() override;
+    virtual bool decode(const QByteArray &data, QByteArray *out) override;
+    virtual bool finish(QByteArray *out) override;
+private:
+    bool inflateBytes(const uchar *data, uInt size, QByteArray *out);
+private:
+    z_stream stream;
+    const bool gzip;
+    bool started;   // some bytes are decoded, so the format of deflate is known.
+    bool ended;
+};
+
+
+ZlibDecodingStage::ZlibDecodingStage(bool gzip)
+    :gzip(gzip), started(false), ended(false)
+{
+    memset(&stream, 0, sizeof(stream));
+    // 15 + 16 reads the gzip header, 15 reads the zlib header that "deflate" should have.
+    inflateInit2(&stream, gzip ? 15 + 16 : 15);
+}
+
+
+ZlibDecodingStage::~ZlibDecodingStage()
+{
+    inflateEnd(&stream);
+}
+
+
+bool ZlibDecodingStage::inflateBytes(const uchar *data, uInt size, QByteArray *out)
+{
+    stream.next_in = const_cast<Bytef *>(data);
+    stream.avail_in = size;
+    while (stream.avail_in > 0) {
+        if (ended) {
+            // a gzip file may have many members, the bytes after a zlib stream are wrong.
+            if (!gzip || inflateReset(&stream) != Z_OK) {
+                return false;
+            }
+            ended = false;
+        }
+        const int oldSize = out->size();
+        out->resize(oldSize + DecodingBlockSize);
+        stream.next_out = reinterpret_cast<Bytef *>(out->data() + oldSize);
+        stream.avail_out = DecodingBlockSize;
+        int r = inflate(&stream, Z_NO_FLUSH);
+        out->resize(oldSize + DecodingBlockSize - static_cast<int>(stream.avail_out));
+        if (r == Z_STREAM_END) {
+            ended = true;
+        } else if (r != Z_OK) {
+            return false;
+        }
+        started = true;
+    }
+    return true;
+}
+
+
+bool ZlibDecodingStage::decode(const QByteArray &data, QByteArray *out)
+{
+    if (data.isEmpty()) {
+        return true;
+    }
+    const uchar *p = reinterpret_cast<const uchar *>(data.constData());
+    if (started || gzip) {
+        return inflateBytes(p, static_cast<uInt>(data.size()), out);
+    }
+    // some servers send the raw deflate stream without zlib header.
+    const int oldSize = out->size();
+    if (inflateBytes(p, static_cast<uInt>(data.size()), out)) {
+        return true;
+    }
+    out->resize(oldSize);
+    inflateEnd(&stream);
+    memset(&stream, 0, sizeof(stream));
+    inflateInit2(&stream, -15);
+    ended = false;
+    return inflateBytes(p, static_cast<uInt>(data.size()), out);
+}
+
+
+bool ZlibDecodingStage::finish(QByteArray *)
+{
+    return !started || ended;
+}
+
+
+#else
+// only the zlib stream of deflate is supported by qUncompress(), which needs the whole body.
+class ZlibDecodingStage: public ContentDecodingStage
+{
+public:
+    explicit ZlibDecodingStage(bool) {}
+    virtual bool decode(const QByteArray &data, QByteArray *) override { buf.append(data); return true; }
+    virtual bool finish(QByteArray *out) override;
+private:
+    QByteArray buf;
+};
+
+
+bool ZlibDecodingStage::finish(QByteArray *out)
+{
+    if (buf.isEmpty()) {
+        return true;
+    }
+    // qUncompress() wants the size of result ahead, a bigger buffer is tried if it is wrong.
+    uchar header[4];
+    qToBigEndian<quint32>(static_cast<quint32>(buf.size()), header);
+    buf.prepend(reinterpret_cast<const char*>(header), 4);
+    const QByteArray &t = qUncompress(buf);
+    buf.clear();
+    if (t.isEmpty()) {
+        return false;
+    }
+    out->append(t);
+    return true;
+}
+#endif
+
+
+#ifdef QTNG_HAVE_BROTLI
+class BrotliDecodingStage: public ContentDecodingStage
+{
+public:
+    BrotliDecodingStage()
+        :state(BrotliDecoderCreateInstance(nullptr, nullptr, nullptr)), ended(false) {}
+    virtual ~BrotliDecodingStage() override { BrotliDecoderDestroyInstance(state); }
+    virtual bool decode(const QByteArray &data, QByteArray *out) override;
+    virtual bool finish(QByteArray *) override { return ended; }
+private:
+    BrotliDecoderState *state;
+    bool ended;
+};
+
+
+bool BrotliDecodingStage::decode(const QByteArray &data, QByteArray *out)
+{
+    if (data.isEmpty()) {
+        return true;
+    }
+    if (ended || !state) {
+        return false;
+    }
+    size_t availIn = static_cast<size_t>(data.size());
+    const uint8_t *nextIn = reinterpret_cast<const uint8_t *>(data.constData());
+    while (true) {
+        size_t availOut = 0;
+        BrotliDecoderResult r = BrotliDecoderDecompressStream(state, &availIn, &nextIn, &availOut, nullptr, nullptr);
+        // the decoder keeps the output, it is taken without copying into a temporary buffer.
+        while (BrotliDecoderHasMoreOutput(state)) {
+            size_t size = 0;
+            const uint8_t *p = BrotliDecoderTakeOutput(state, &size);
+            out->append(reinterpret_cast<const char *>(p), static_cast<int>(size));
+        }
+        if (r == BROTLI_DECODER_RESULT_SUCCESS) {
+            ended = true;
+            return availIn == 0;
+        } else if (r == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT) {
+            return true;
+        } else if (r == BROTLI_DECODER_RESULT_ERROR) {
+            return false;
+        }
+    }
+}
+#endif
+
+
+class ContentDecoderPrivate
+{
+public:
+    ContentDecoderPrivate()
+        :supported(true), fed(false) {}
+    ~ContentDecoderPrivate() { qDeleteAll(stages); }
+    QList<ContentDecodingStage *> stages;  // in the order of decoding.
+    bool supported;
+    bool fed;
+};
+
+
+ContentDecoder::ContentDecoder(const QByteArray &contentEncoding)
+    :d_ptr(new ContentDecoderPrivate())
+{
+    Q_D(ContentDecoder);
+    for (const QByteArray &part: splitBytes(contentEncoding, ',')) {
+        const QByteArray &coding = part.trimmed().toLower();
+        if (coding.isEmpty() || coding == "identity") {
+            continue;
+        } else if (coding == "gzip" || coding == "x-gzip") {
+#ifdef QTNG_HAVE_ZLIB
+            d->stages.prepend(new ZlibDecodingStage(true));
+#else
+            d->supported = false;
+#endif
+        } else if (coding == "deflate") {
+            d->stages.prepend(new ZlibDecodingStage(false));
+#ifdef QTNG_HAVE_BROTLI
+        } else if (coding == "br") {
+            d->stages.prepend(new BrotliDecodingStage());
+#endif
+        } else {
+            d->supported = false;
+        }
+    }
+}
+
+
+ContentDecoder::~ContentDecoder()
+{
+    delete d_ptr;
+}
+
+
+bool ContentDecoder::isSupported() const
+{
+    Q_D(const ContentDecoder);
+    return d->supported;
+}
+
+
+bool ContentDecoder::decode(const QByteArray &data, QByteArray *out)
+{
+    Q_D(ContentDecoder);
+    if (!d->supported) {
+        return false;
+    }
+    if (data.isEmpty()) {
+        return true;
+    }
+    d->fed = true;
+    QByteArray t = data;
+    for (ContentDecodingStage *stage: d->stages) {
+        QByteArray decoded;
+        if (!stage->decode(t, &decoded)) {
+            return false;
+        }
+        t = decoded;
+    }
+    out->append(t);
+    return true;
+}
+
+
+bool ContentDecoder::finish(QByteArray *out)
+{
+    Q_D(ContentDecoder);
+    if (!d->supported) {
+        return false;
+    }
+    // the body of HEAD and 304 is empty whatever the encoding is.
+    if (!d->fed) {
+        return true;
+    }
+    QByteArray t;
+    for (ContentDecodingStage *stage: d->stages) {
+        QByteArray decoded;
+        // the bytes flushed by a stage go through the next stages.
+        if (!stage->decode(t, &decoded) || !stage->finish(&decoded)) {
+            return false;
+        }
+        t = decoded;
+    }
+    out->append(t);
+    return true;
+}
+
+
+QByteArray ContentDecoder::acceptEncoding()
+{
+#if defined(QTNG_HAVE_ZLIB) && defined(QTNG_HAVE_BROTLI)
+    return QByteArray("gzip, deflate, br");
+#elif defined(QTNG_HAVE_ZLIB)
+    return QByteArray("gzip, deflate");
+#else
+    return QByteArray("deflate");
+#endif
+}
+
+
+bool TraceContext::isValid() const
+{
+    return traceId.size() == 16 && spanId.size() == 8 && traceId.count('\0') != 16 && spanId.count('\0') != 8;
+}
+
+
+QByteArray TraceContext::toTraceParent() const
+{
+    if (!isValid()) {
+        return QByteArray();
+    }
+    return "00-" + traceId.toHex() + '-' + spanId.toHex() + '-' + QByteArray(1, static_cast<char>(flags)).toHex();
+}
+
+
+static inline bool isLowerHex(const QByteArray &bs)
+{
+    for (char c: bs) {
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+TraceContext TraceContext::fromTraceParent(const QByteArray &header)
+{
+    // version-traceid-spanid-flags, the later versions may append more fields.
+    const QByteArrayList &parts = header.trimmed().split('-');
+    if (parts.size() < 4 || parts.at(0).size() != 2 || parts.at(0) == "ff" || (parts.at(0) == "00" && parts.size() != 4)
+            || parts.at(1).size() != 32 || parts.at(2).size() != 16 || parts.at(3).size() != 2) {
+        return TraceContext();
+    }
+    for (const QByteArray &part: parts.mid(0, 4)) {
+        if (!isLowerHex(part)) {
+            return TraceContext();
+        }
+    }
+    TraceContext context(QByteArray::fromHex(parts.at(1)), QByteArray::fromHex(parts.at(2)),
+                         static_cast<quint8>(QByteArray::fromHex(parts.at(3)).at(0)));
+    if (!context.isValid()) {
+        return TraceContext();
+    }
+    return context;
+}
+
+
+Q_GLOBAL_STATIC_WITH_ARGS(CoroutineLocal<TraceContext>, currentTraceContext, (true))
+
+
+TraceContext TraceContext::current()
+{
+    CoroutineLocal<TraceContext> *local = currentTraceContext();
+    if (!local || !local->hasLocalData()) {
+        return TraceContext();
+    }
+    return local->localData();
+}
+
+
+void TraceContext::setCurrent(const TraceContext &context)
+{
+    CoroutineLocal<TraceContext> *local = currentTraceContext();
+    if (!local) {
+        return;
+    }
+    if (context.isValid()) {
+        local->setLocalData(context);
+    } else {
+        local->removeLocalData();
+    }
+}
+
+// 开始实现 MultipartReader
+
+class MultipartReaderPrivate
+{
+public:
+    enum State {
+        Preamble,
+        Headers,        // after a delimiter.
+        Content,
+        Finished,
+        Broken,
+    };
+    MultipartReaderPrivate(QSharedPointer<FileLike> body, const QByteArray &boundary, qint32 bufferSize)
+        :body(body), delimiter("\r\n--" + boundary), bufferSize(qMax(bufferSize, delimiter.size() * 2 + 1024)),
+          start(0), state(boundary.isEmpty() ? Broken : Preamble) { buffer.append("\r\n", 2); }
+    bool fill();
+    int findDelimiter() const;
+    // the content before the delimiter in the buffer, 0 if the delimiter is next, -1 if more bytes are needed.
+    qint32 available() const;
+    bool skipToDelimiter();
+    bool readHeaders();
+    qint32 peek(const char **data);
+    void consume(qint32 size) { start += size; }
+    void setBroken() { state = Broken; }
+public:
+    QSharedPointer<FileLike> body;
+    const QByteArray delimiter;     // the CRLF before the dashes belongs to the delimiter, as RFC 2046.
+    const qint32 bufferSize;
+    QByteArray buffer;
+    qint32 start;                   // of the bytes not consumed.
+    QList<HttpHeader> headers;
+    State state;
+};
+
+
+bool MultipartReaderPrivate::fill()
+{
+    if (start > 0 && start >= buffer.size() / 2) {
+        buffer.remove(0, start);
+        start = 0;
+    }
+    const int old = buffer.size();
+    buffer.resize(old + bufferSize);
+    const qint32 bs = body->read(buffer.data() + old, bufferSize);
+    if (bs <= 0) {
+        buffer.resize(old);
+        return false;
+    }
+    buffer.resize(old + bs);
+    return true;
+}
+
+
+// searches the first byte by memchr(), which is vectorized by libc, and compares the rest.
+int MultipartReaderPrivate::findDelimiter() const
+{
+    const char *data = buffer.constData() + start;
+    const char *end = buffer.constData() + buffer.size();
+    const char first = delimiter.at(0);
+    const int size = delimiter.size();
+    const char *p = data;
+    while (end - p >= size) {
+        p = static_cast<const char *>(memchr(p, first, static_cast<size_t>(end - p - size + 1)));
+        if (!p) {
+            return -1;
+        }
+        if (memcmp(p, delimiter.constData(), static_cast<size_t>(size)) == 0) {
+            return static_cast<int>(p - data);
+        }
+        ++p;
+    }
+    return -1;
+}
+
+
+qint32 MultipartReaderPrivate::available() const
+{
+    const int found = findDelimiter();
+    if (found >= 0) {
+        return found;
+    }
+    // the tail may be the beginning of delimiter.
+    const qint32 safe = buffer.size() - start - (delimiter.size() - 1);
+    return safe > 0 ? safe : -1;
+}
+
+
+qint32 MultipartReaderPrivate::peek(const char **data)
+{
+    while (true) {
+        const qint32 size = available();
+        if (size >= 0) {
+            *data = buffer.constData() + start;
+            return size;
+        }
+        if (!fill()) {
+            setBroken();
+            return -1;
+        }
+    }
+}
+
+
+bool MultipartReaderPrivate::skipToDelimiter()
+{
+    while (true) {
+        const char *data;
+        const qint32 size = peek(&data);
+        if (size < 0) {
+            return false;
+        }
+        if (size == 0) {
+            consume(delimiter.size());
+            state = Headers;
+            return true;
+        }
+        consume(size);
+    }
+}
+
+
+bool MultipartReaderPrivate::readHeaders()
+{
+    headers.clear();
+    const int MaxHeaderSize = 1024 * 16;
+    int end;
+    while (true) {
+        // "--" after the delimiter ends the body.
+        if (buffer.size() - start >= 2 && buffer.at(start) == '-' && buffer.at(start + 1) == '-') {
+            state = Finished;
+            return false;
+        }
+        // a part without headers is followed by CRLF CRLF too.
+        end = buffer.indexOf("\r\n\r\n", start);
+        if (end >= 0) {
+            break;
+        }
+        if (buffer.size() - start > MaxHeaderSize || !fill()) {
+            setBroken();
+            return false;
+        }
+    }
+    // the first line is the rest of delimiter line.
+    const QByteArray &block = buffer.mid(start, end - start);
+    const QList<QByteArray> &lines = block.split('\n');
+    for (int i = 1; i < lines.size(); ++i) {
+        const QByteArray &line = lines.at(i).trimmed();
+        const int colon = line.indexOf(':');
+        if (colon <= 0) {
+            continue;
+        }
+        headers.append(HttpHeader(QString::fromLatin1(line.left(colon).trimmed()), line.mid(colon + 1).trimmed()));
+    }
+    consume(end + 4 - start);
+    state = Content;
+    return true;
+}
+
+
+// the value of parameter in Content-Disposition, such as name="field".
+static QByteArray dispositionParameter(const QByteArray &disposition, const QByteArray &name)
+{
+    for (const QByteArray &item: disposition.split(';')) {
+        const QByteArray &param = item.trimmed();
+        const int eq = param.indexOf('=');
+        if (eq <= 0 || param.left(eq).trimmed().toLower() != name) {
+            continue;
+        }
+        QByteArray value = param.mid(eq + 1).trimmed();
+        if (value.size() >= 2 && value.startsWith('"') && value.endsWith('"')) {
+            value = value.mid(1, value.size() - 2).replace("\\\"", "\"");
+        }
+        return value;
+    }
+    return QByteArray();
+}
+
+
+MultipartReader::MultipartReader(QSharedPointer<FileLike> body, const QByteArray &boundary, qint32 bufferSize)
+    :d_ptr(new MultipartReaderPrivate(body, boundary, bufferSize))
+{
+}
+
+
+MultipartReader::~MultipartReader()
+{
+    delete d_ptr;
+}
+
+
+bool MultipartReader::nextPart()
+{
+    Q_D(MultipartReader);
+    if (d->state == MultipartReaderPrivate::Preamble || d->state == MultipartReaderPrivate::Content) {
+        if (!d->skipToDelimiter()) {
+            return false;
+        }
+    }
+    if (d->state != MultipartReaderPrivate::Headers) {
+        return false;
+    }
+    return d->readHeaders();
+}
+
+
+QList<HttpHeader> MultipartReader::headers() const
+{
+    Q_D(const MultipartReader);
+    return d->headers;
+}
+
+
+QByteArray MultipartReader::header(const QString &name) const
+{
+    Q_D(const MultipartReader);
+    for (const HttpHeader &header: d->headers) {
+        if (header.name.compare(name, Qt::CaseInsensitive) == 0) {
+            return header.value;
+        }
+    }
+    return QByteArray();
+}
+
+
+QString MultipartReader::name() const
+{
+    return QString::fromUtf8(dispositionParameter(header(QStringLiteral("Content-Disposition")), "name"));
+}
+
+
+QString MultipartReader::fileName() const
+{
+    return QString::fromUtf8(dispositionParameter(header(QStringLiteral("Content-Disposition")), "filename"));
+}
+
+
+QByteArray MultipartReader::contentType() const
+{
+    return header(QStringLiteral("Content-Type"));
+}
+
+
+qint32 MultipartReader::read(char *data, qint32 size)
+{
+    Q_D(MultipartReader);
+    if (d->state == MultipartReaderPrivate::Broken) {
+        return -1;
+    }
+    if (d->state != MultipartReaderPrivate::Content || size <= 0) {
+        return 0;
+    }
+    const char *content;
+    const qint32 available = d->peek(&content);
+    if (available < 0) {
+        return -1;
+    }
+    if (available == 0) {
+        d->consume(d->delimiter.size());
+        d->state = MultipartReaderPrivate::Headers;
+        return 0;
+    }
+    const qint32 bs = qMin(available, size);
+    memcpy(data, content, static_cast<size_t>(bs));
+    d->consume(bs);
+    return bs;
+}
+
+
+QByteArray MultipartReader::readAll(qint32 maxSize, bool *ok)
+{
+    QByteArray content;
+    char buf[1024 * 8];
+    while (true) {
+        const qint32 bs = read(buf, sizeof(buf));
+        if (bs <= 0) {
+            if (ok) {
+                *ok = bs == 0;
+            }
+            return content;
+        }
+        if (content.size() + bs > maxSize) {
+            if (ok) {
+                *ok = false;
+            }
+            return content;
+        }
+        content.append(buf, bs);
+    }
+}
+
+
+qint64 MultipartReader::copyTo(QSharedPointer<FileLike> sink, qint64 maxSize)
+{
+    Q_D(MultipartReader);
+    qint64 total = 0;
+    while (d->state == MultipartReaderPrivate::Content) {
+        const char *content;
+        const qint32 available = d->peek(&content);
+        if (available < 0) {
+            return -1;
+        }
+        if (available == 0) {
+            d->consume(d->delimiter.size());
+            d->state = MultipartReaderPrivate::Headers;
+            break;
+        }
+        if (maxSize >= 0 && total + available > maxSize) {
+            return -1;
+        }
+        // written from the buffer without copying.
+        if (sink->writeall(const_cast<char *>(content), available) != available) {
+            return -1;
+        }
+        d->consume(available);
+        total += available;
+    }
+    return d->state == MultipartReaderPrivate::Broken ? -1 : total;
+}
+
+
+bool MultipartReader::hasError() const
+{
+    Q_D(const MultipartReader);
+    return d->state == MultipartReaderPrivate::Broken;
+}
+
+
+QByteArray MultipartReader::boundaryOf(const QByteArray &contentType)
+{
+    const int semicolon = contentType.indexOf(';');
+    if (semicolon < 0 || !contentType.left(semicolon).trimmed().toLower().startsWith("multipart/")) {
+        return QByteArray();
+    }
+    return dispositionParameter(contentType.mid(semicolon + 1), "boundary");
+}
+
+
 QTNETWORKNG_NAMESPACE_END
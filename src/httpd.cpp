@@ -1,11 +1,32 @@
+#include <algorithm>
+#include <limits>
 #include <QMimeDatabase>
 #include <QTemporaryFile>
+#include <QtCore/qthreadstorage.h>
+#include <QtCore/qthread.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qwaitcondition.h>
+#include <QtCore/qcache.h>
+#include <stdio.h>
+#ifdef Q_OS_UNIX
+#include <syslog.h>
+#endif
+#ifdef QTNG_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef QTNG_HAVE_BROTLI_ENCODER
+#include <brotli/encode.h>
+#endif
 #include "../include/httpd.h"
+#include "../include/metrics.h"
+#include "../include/private/http2_p.h"
+#include "../include/private/tracing_p.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
 
-static const QString DEFAULT_ERROR_MESSAGE = "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01//EN\"\n"
+// literals, not QString, so no constructor runs while loading the library.
+static const char DEFAULT_ERROR_MESSAGE[] = "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01//EN\"\n"
                                      "        \"http://www.w3.org/TR/html4/strict.dtd\">\n<html>\n"
                                      "    <head>\n"
                                      "        <meta http-equiv=\"Content-Type\" content=\"text/html;charset=utf-8\">\n"
@@ -18,32 +39,312 @@ static const QString DEFAULT_ERROR_MESSAGE = "<!DOCTYPE HTML PUBLIC \"-//W3C//DT
                                      "        <p>Error code explanation: %1 - %3.</p>\n"
                                      "    </body>\n"
                                      "</html>";
-static const QString DEFAULT_ERROR_CONTENT_TYPE = "text/html;charset=utf-8";
+static const char DEFAULT_ERROR_CONTENT_TYPE[] = "text/html;charset=utf-8";
 
 
 //#define DEBUG_HTTP_PROTOCOL 1
 
 
+// the status lines without the version, sorted by the status code.
+struct StatusLine
+{
+    int status;
+    const char *line;
+    int size;
+};
+
+
+#define QTNG_STATUS_LINE(status, message) {status, " " #status " " message "\r\n", sizeof(" " #status " " message "\r\n") - 1}
+static const StatusLine statusLines[] = {
+    QTNG_STATUS_LINE(100, "Continue"),
+    QTNG_STATUS_LINE(101, "Switching Protocols"),
+    QTNG_STATUS_LINE(102, "Processing"),
+    QTNG_STATUS_LINE(200, "OK"),
+    QTNG_STATUS_LINE(201, "Created"),
+    QTNG_STATUS_LINE(202, "Accepted"),
+    QTNG_STATUS_LINE(203, "Non-Authoritative Information"),
+    QTNG_STATUS_LINE(204, "No Content"),
+    QTNG_STATUS_LINE(205, "Reset Content"),
+    QTNG_STATUS_LINE(206, "Partial Content"),
+    QTNG_STATUS_LINE(207, "Multi-Status"),
+    QTNG_STATUS_LINE(208, "Already Reported"),
+    QTNG_STATUS_LINE(226, "IM Used"),
+    QTNG_STATUS_LINE(300, "Multiple Choices"),
+    QTNG_STATUS_LINE(301, "Moved Permanently"),
+    QTNG_STATUS_LINE(302, "Found"),
+    QTNG_STATUS_LINE(303, "See Other"),
+    QTNG_STATUS_LINE(304, "Not Modified"),
+    QTNG_STATUS_LINE(305, "Use Proxy"),
+    QTNG_STATUS_LINE(307, "Temporary Redirect"),
+    QTNG_STATUS_LINE(308, "Permanent Redirect"),
+    QTNG_STATUS_LINE(400, "Bad Request"),
+    QTNG_STATUS_LINE(401, "Unauthorized"),
+    QTNG_STATUS_LINE(402, "Payment Required"),
+    QTNG_STATUS_LINE(403, "Forbidden"),
+    QTNG_STATUS_LINE(404, "Not Found"),
+    QTNG_STATUS_LINE(405, "Method Not Allowed"),
+    QTNG_STATUS_LINE(406, "Not Acceptable"),
+    QTNG_STATUS_LINE(407, "Proxy Authentication Required"),
+    QTNG_STATUS_LINE(408, "Request Timeout"),
+    QTNG_STATUS_LINE(409, "Conflict"),
+    QTNG_STATUS_LINE(410, "Gone"),
+    QTNG_STATUS_LINE(411, "Length Required"),
+    QTNG_STATUS_LINE(412, "Precondition Failed"),
+    QTNG_STATUS_LINE(413, "Request Entity Too Large"),
+    QTNG_STATUS_LINE(414, "Request-URI Too Long"),
+    QTNG_STATUS_LINE(415, "Unsupported Media Type"),
+    QTNG_STATUS_LINE(416, "Requested Range Not Satisfiable"),
+    QTNG_STATUS_LINE(417, "Expectation Failed"),
+    QTNG_STATUS_LINE(418, "I'm A Teapot"),
+    QTNG_STATUS_LINE(422, "Unprocessable Entity"),
+    QTNG_STATUS_LINE(423, "Locked"),
+    QTNG_STATUS_LINE(424, "Failed Dependency"),
+    QTNG_STATUS_LINE(426, "Upgrade Required"),
+    QTNG_STATUS_LINE(428, "Precondition Required"),
+    QTNG_STATUS_LINE(429, "Too Many Requests"),
+    QTNG_STATUS_LINE(441, "Request Header Fields Too Large"),
+    QTNG_STATUS_LINE(500, "Internal Server Error"),
+    QTNG_STATUS_LINE(501, "Not Implemented"),
+    QTNG_STATUS_LINE(502, "Bad Gateway"),
+    QTNG_STATUS_LINE(503, "Service Unavailable"),
+    QTNG_STATUS_LINE(504, "Gateway Timeout"),
+    QTNG_STATUS_LINE(505, "HTTP Version Not Supported"),
+    QTNG_STATUS_LINE(506, "Variant Also Negotiates"),
+    QTNG_STATUS_LINE(507, "Insufficient Storage"),
+    QTNG_STATUS_LINE(508, "Loop Detected"),
+    QTNG_STATUS_LINE(510, "Not Extended"),
+    QTNG_STATUS_LINE(511, "Network Authentication Required"),
+};
+#undef QTNG_STATUS_LINE
+
+
+static const StatusLine *findStatusLine(int status)
+{
+    int low = 0, high = static_cast<int>(sizeof(statusLines) / sizeof(statusLines[0])) - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (statusLines[middle].status < status) {
+            low = middle + 1;
+        } else if (statusLines[middle].status > status) {
+            high = middle - 1;
+        } else {
+            return &statusLines[middle];
+        }
+    }
+    return nullptr;
+}
+
+
+// the IMF-fixdate of rfc 7231, the names must not be localized.
+static QByteArray formatHttpDate(const QDateTime &dateTime)
+{
+    static const char * const days[] = {"Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun"};
+    static const char * const months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                          "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    const QDateTime &dt = dateTime.toUTC();
+    const QDate &date = dt.date();
+    const QTime &time = dt.time();
+    char buf[32];
+    int size = qsnprintf(buf, sizeof(buf), "%s, %02d %s %04d %02d:%02d:%02d GMT", days[date.dayOfWeek() - 1],
+                         date.day(), months[date.month() - 1], date.year(), time.hour(), time.minute(), time.second());
+    return QByteArray(buf, size);
+}
+
+
+// the Date header changes once a second, every thread formats it once for all its responses.
+struct HttpDateCache
+{
+    HttpDateCache()
+        :second(-1) {}
+    const QByteArray &now();
+    qint64 second;
+    QByteArray value;
+};
+
+
+const QByteArray &HttpDateCache::now()
+{
+    const qint64 msecs = QDateTime::currentMSecsSinceEpoch();
+    if (msecs / 1000 == second) {
+        return value;
+    }
+    second = msecs / 1000;
+    value = formatHttpDate(QDateTime::fromMSecsSinceEpoch(second * 1000, Qt::UTC));
+    return value;
+}
+
+
+Q_GLOBAL_STATIC(QThreadStorage<HttpDateCache*>, httpDateCacheStorage)
+
+
+static QByteArray httpDate()
+{
+    QThreadStorage<HttpDateCache*> *storage = httpDateCacheStorage();
+    if (!storage) {
+        HttpDateCache cache;
+        return cache.now();
+    }
+    if (!storage->hasLocalData()) {
+        storage->setLocalData(new HttpDateCache());
+    }
+    return storage->localData()->now();
+}
+
+
+static inline bool equalsLower(const QByteArray &s, const char *lower, int size)
+{
+    return s.size() == size && qstrnicmp(s.constData(), lower, static_cast<uint>(size)) == 0;
+}
+
+
+// the coding is acceptable unless its q is zero.
+static bool acceptsEncoding(const QByteArray &acceptEncoding, const char *coding)
+{
+    for (const QByteArray &item: acceptEncoding.split(',')) {
+        const QByteArrayList &parts = item.split(';');
+        if (parts.first().trimmed().compare(coding, Qt::CaseInsensitive) != 0) {
+            continue;
+        }
+        for (int i = 1; i < parts.size(); ++i) {
+            const QByteArray &param = parts.at(i).trimmed();
+            if (param.startsWith("q=") && param.mid(2).toFloat() <= 0.0f) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+
 BaseHttpRequestHandler::BaseHttpRequestHandler(QSharedPointer<SocketLike> request, BaseStreamServer *server)
-    :BaseRequestHandler(request, server), version(Http1_1), serverVersion(Http1_1), closeConnection(true)
+    :BaseRequestHandler(request, server), deferredSize(0)
+    , http2Stream(dynamic_cast<Http2StreamSocket *>(request.data())), http2Status(0), idleParkingMsecs(0)
+    , compressionMinSize(1024), compressionLevel(6), responseStatus(0), parked(false)
+    , version(Http1_1), serverVersion(Http1_1), closeConnection(true)
 {
 
 }
 
+// the common methods are literals, they are not allocated for every request.
+static QString methodName(const char *data, int size)
+{
+    switch (size) {
+    case 3:
+        if (memcmp(data, "GET", 3) == 0) {
+            return QStringLiteral("GET");
+        } else if (memcmp(data, "PUT", 3) == 0) {
+            return QStringLiteral("PUT");
+        }
+        break;
+    case 4:
+        if (memcmp(data, "POST", 4) == 0) {
+            return QStringLiteral("POST");
+        } else if (memcmp(data, "HEAD", 4) == 0) {
+            return QStringLiteral("HEAD");
+        }
+        break;
+    case 5:
+        if (memcmp(data, "PATCH", 5) == 0) {
+            return QStringLiteral("PATCH");
+        }
+        break;
+    case 6:
+        if (memcmp(data, "DELETE", 6) == 0) {
+            return QStringLiteral("DELETE");
+        }
+        break;
+    case 7:
+        if (memcmp(data, "OPTIONS", 7) == 0) {
+            return QStringLiteral("OPTIONS");
+        }
+        break;
+    default:
+        break;
+    }
+    return QString::fromLatin1(data, size);
+}
+
+
 void BaseHttpRequestHandler::handle()
 {
+    if (http2Stream) {
+        handleOneRequest();
+        return;
+    }
+#ifndef QTNG_NO_CRYPTO
+    if (http2StreamHandler) {
+        QSharedPointer<SslSocket> sslSocket = convertSocketLikeToSslSocket(request);
+        if (!sslSocket.isNull() && sslSocket->negotiatedProtocol() == "h2") {
+            serveHttp2(QByteArray(), false, nullptr);
+            return;
+        }
+    }
+#endif
     do {
         closeConnection = true;
         handleOneRequest();
+        arena.reset();
+        // nothing of the next request is read, so the connection can wait without this coroutine.
+        if (!closeConnection && idleParkingMsecs > 0 && pendingBytes.isEmpty() && deferredResponses.isEmpty()
+                && server->parkRequest(request, idleParkingMsecs)) {
+            parked = true;
+            return;
+        }
     } while (!closeConnection);
+    flushResponses();
+}
+
+
+void BaseHttpRequestHandler::finish()
+{
+    if (!parked) {
+        BaseRequestHandler::finish();
+    }
 }
 
+
 void BaseHttpRequestHandler::handleOneRequest()
 {
+    requestBodyReader.clear();
     if(!parseRequest()) {
         return;
     }
+    responseStatus = 0;
+    if (Metrics::isEnabled()) {
+        requestTimer.start();
+    } else {
+        requestTimer.invalidate();
+    }
+#ifdef QTNG_HAVE_USDT
+    const QByteArray &probeMethod = method.toLatin1();
+    const QByteArray &probePath = path.toUtf8();
+    QTNG_PROBE2(httpd_request_start, probeMethod.constData(), probePath.constData());
+#endif
     doMethod();
+    if (!responseBodyWriter.isNull()) {
+        if (!responseBodyWriter->close()) {
+            closeConnection = true;
+        }
+        responseBodyWriter.clear();
+    }
+    finishBody();
+#ifdef QTNG_HAVE_USDT
+    QTNG_PROBE3(httpd_request_done, probeMethod.constData(), probePath.constData(), responseStatus);
+#endif
+    countRequest();
+}
+
+
+// the latency is counted until the response is sent or held back for the pipelined requests.
+void BaseHttpRequestHandler::countRequest()
+{
+    if (!requestTimer.isValid() || !responseStatus) {
+        return;
+    }
+    const QByteArray &labels = "status=\"" + QByteArray::number(responseStatus) + '"';
+    Metrics::increase("qtng_httpd_requests_total", labels);
+    Metrics::observe("qtng_httpd_request_seconds", QByteArray(), requestTimer.nsecsElapsed() / 1e9);
 }
 
 class HttpHeaders: public HeaderOperationMixin {};
@@ -51,10 +352,25 @@ class HttpHeaders: public HeaderOperationMixin {};
 
 bool BaseHttpRequestHandler::parseRequest()
 {
-    bool done = false;
-    const QByteArray &buf = tryToHandleMagicCode(&done);
-    if (done) {
-        return false;
+    if (http2Stream) {
+        method = QString::fromLatin1(http2Stream->method());
+        path = QString::fromLatin1(http2Stream->path());
+        version = Http2_0;
+        setHeaders(http2Stream->headers());
+        body.clear();
+        return true;
+    }
+    // the pipelined requests read with the last one go first.
+    QByteArray buf;
+    if (!pendingBytes.isEmpty()) {
+        buf = pendingBytes;
+        pendingBytes.clear();
+    } else {
+        bool done = false;
+        buf = tryToHandleMagicCode(&done);
+        if (done) {
+            return false;
+        }
     }
     HeaderSplitter headerSplitter(request, buf);
     HeaderSplitter::Error headerSpliiterError;
@@ -66,15 +382,18 @@ bool BaseHttpRequestHandler::parseRequest()
     qDebug() << "first line is" << firstLine;
 #endif
 
-    const QString &commandLine = QString::fromLatin1(firstLine);
-    QStringList words = commandLine.split(QRegExp("\\s+"));
-    if (words.isEmpty()) {
-        return false;
+    // the words are found in place, no list of them is made for every request.
+    const int firstSpace = firstLine.indexOf(' ');
+    const int secondSpace = firstSpace < 0 ? -1 : firstLine.indexOf(' ', firstSpace + 1);
+    const int words = firstSpace < 0 ? 1 : (secondSpace < 0 ? 2 : (firstLine.indexOf(' ', secondSpace + 1) < 0 ? 3 : 4));
+    if (words >= 2 && words <= 3) {
+        method = methodName(firstLine.constData(), firstSpace);
+        const int pathEnd = words == 3 ? secondSpace : firstLine.size();
+        path = QString::fromLatin1(firstLine.constData() + firstSpace + 1, pathEnd - firstSpace - 1);
     }
-    if (words.size() == 3) {
-        method = words.at(0);
-        path = words.at(1);
-        const QString &versionStr = words.at(2);
+    if (words == 3) {
+        const QByteArray &versionStr = QByteArray::fromRawData(firstLine.constData() + secondSpace + 1,
+                                                               firstLine.size() - secondSpace - 1);
         if (versionStr == "HTTP/1.0") {
             version = Http1_0;
         } else if(versionStr == "HTTP/1.1") {
@@ -82,18 +401,23 @@ bool BaseHttpRequestHandler::parseRequest()
             if (serverVersion == Http1_1) {
                 closeConnection = false;
             }
+        } else if (versionStr == "HTTP/2.0" && method == "PRI" && path == "*" && http2StreamHandler) {
+            // the client knows we speak http/2 (rfc 7540 section 3.4), the preface ends with "\r\nSM\r\n\r\n".
+            if (!headerSplitter.nextLine(&headerSpliiterError).isEmpty() || headerSpliiterError != HeaderSplitter::NoError
+                    || headerSplitter.nextLine(&headerSpliiterError) != "SM" || headerSpliiterError != HeaderSplitter::NoError
+                    || !headerSplitter.nextLine(&headerSpliiterError).isEmpty() || headerSpliiterError != HeaderSplitter::NoError) {
+                return false;
+            }
+            serveHttp2(headerSplitter.buf, true, nullptr);
+            return false;
         } else {
-            sendError(HttpStatus::BadRequest, QStringLiteral("Bad request version (%1").arg(versionStr));
+            sendError(HttpStatus::BadRequest, QStringLiteral("Bad request version (%1").arg(QString::fromLatin1(versionStr)));
             return false;
         }
-    } else if (words.size() == 2) {
-        method = words.at(0);
-        path = words.at(1);
+    } else if (words == 2) {
         version = Http1_0;
-    } else if (words.isEmpty()) {
-        return false;
     } else {
-        sendError(HttpStatus::BadRequest, QStringLiteral("Bad request syntax (%1)").arg(commandLine));
+        sendError(HttpStatus::BadRequest, QStringLiteral("Bad request syntax (%1)").arg(QString::fromLatin1(firstLine)));
         return false;
     }
 
@@ -126,10 +450,319 @@ bool BaseHttpRequestHandler::parseRequest()
     } else if (connectionType.toLower() == "keep-alive" && version == Http1_1 && serverVersion == Http1_1) {
         closeConnection = false;
     }
+    // switch to http/2 in cleartext (rfc 7540 section 3.2). the requests with body stay in http/1.1.
+    const QByteArray &upgrade = header(UpgradeHeader).toLower();
+    if (http2StreamHandler && version == Http1_1 && !server->isSecure() && upgrade.trimmed() == "h2c"
+            && hasHeader(QStringLiteral("HTTP2-Settings")) && header(ContentLengthHeader, "0").trimmed() == "0"
+            && header(TransferEncodingHeader).isEmpty()) {
+        const QByteArray &settings = QByteArray::fromBase64(header(QStringLiteral("HTTP2-Settings")).trimmed(),
+                                                            QByteArray::Base64UrlEncoding);
+        sendCommandLine(HttpStatus::SwitchProtocol, QStringLiteral("Switching Protocols"));
+        sendHeader("Connection", "Upgrade");
+        sendHeader("Upgrade", "h2c");
+        if (!endHeader()) {
+            return false;
+        }
+        serveHttp2(headerSplitter.buf, false, &settings);
+        return false;
+    }
+    // the bytes after this request belong to the next pipelined one. the chunked body is framed by bodyReader().
     body = headerSplitter.buf;
+    if (!header(TransferEncodingHeader).isEmpty()) {
+        return true;
+    }
+    bool ok;
+    const qint64 contentLength = header(ContentLengthHeader, "0").trimmed().toLongLong(&ok);
+    if (ok && contentLength >= 0 && contentLength < body.size()) {
+        pendingBytes = body.mid(static_cast<int>(contentLength));
+        body.truncate(static_cast<int>(contentLength));
+    }
+    return true;
+}
+
+
+class HttpRequestBodyReader: public FileLike
+{
+public:
+    HttpRequestBodyReader(BaseHttpRequestHandler *handler, const QByteArray &buf, qint64 contentLength,
+                          bool chunked, bool expectContinue, qint64 maxBodySize);
+public:
+    virtual qint32 read(char *data, qint32 size) override;
+    virtual qint32 readall(char *data, qint32 size) override;
+    virtual qint32 write(char *data, qint32 size) override;
+    virtual qint32 writeall(char *data, qint32 size) override;
+    virtual bool atEnd() override;
+    virtual void close() override;
+    virtual qint64 size() override;
+public:
+    // reads and drops the rest of body up to maxBytes. returns false if the connection can not be used again.
+    bool drain(qint64 maxBytes);
+    // the bytes read after the body.
+    QByteArray rest() const { return chunkedReader.isNull() ? buf : chunkedReader->buf; }
+private:
+    bool fill();
+private:
+    BaseHttpRequestHandler * const handler;  // owns this reader.
+    QSharedPointer<SocketLike> request;
+    QByteArray buf;
+    QByteArray pending;
+    QScopedPointer<ChunkedBlockReader> chunkedReader;
+    qint64 contentLength;   // -1 for the chunked body, or the body of http/2 stream ending by the stream.
+    qint64 leftBytes;
+    qint64 receivedBytes;
+    qint64 maxBodySize;
+    bool expectContinue;
+    bool untilClosed;
+    bool ended;
+    bool failed;
+};
+
+
+HttpRequestBodyReader::HttpRequestBodyReader(BaseHttpRequestHandler *handler, const QByteArray &buf,
+                                             qint64 contentLength, bool chunked, bool expectContinue,
+                                             qint64 maxBodySize)
+    :handler(handler), request(handler->request), buf(buf), contentLength(chunked ? -1 : contentLength), leftBytes(contentLength)
+    , receivedBytes(0), maxBodySize(maxBodySize), expectContinue(expectContinue)
+    , untilClosed(!chunked && contentLength < 0), ended(false), failed(false)
+{
+    if (chunked) {
+        chunkedReader.reset(new ChunkedBlockReader(request, buf));
+        chunkedReader->debugLevel = 0;
+        this->buf.clear();
+    } else if (contentLength == 0) {
+        ended = true;
+        this->expectContinue = false;
+    }
+}
+
+
+bool HttpRequestBodyReader::fill()
+{
+    const qint32 BlockSize = 1024 * 64;
+    if (expectContinue) {
+        expectContinue = false;
+        static const QByteArray continueLine = "HTTP/1.1 100 Continue\r\n\r\n";
+        // the responses held back for the earlier pipelined requests go first.
+        if (!handler->flushResponses() || request->sendall(continueLine) != continueLine.size()) {
+            failed = ended = true;
+            return false;
+        }
+    }
+    QByteArray raw;
+    if (chunkedReader) {
+        ChunkedBlockReader::Error error;
+        raw = chunkedReader->nextBlock(std::numeric_limits<qint32>::max(), &error);
+        if (error != ChunkedBlockReader::NoError) {
+            failed = ended = true;
+            return false;
+        }
+        if (raw.isEmpty()) {
+            ended = true;
+            return true;
+        }
+    } else if (untilClosed) {
+        if (!buf.isEmpty()) {
+            raw = buf;
+            buf.clear();
+        } else {
+            raw = recvSized(request.data(), BlockSize);
+            if (raw.isEmpty()) {
+                ended = true;
+                return true;
+            }
+        }
+    } else {
+        if (!buf.isEmpty()) {
+            raw = buf.left(static_cast<int>(qMin<qint64>(leftBytes, buf.size())));
+            buf.remove(0, raw.size());
+        } else {
+            raw = recvSized(request.data(), BlockSize, static_cast<qint32>(qMin<qint64>(leftBytes, INT_MAX)));
+            if (raw.isEmpty()) {
+                failed = ended = true;
+                return false;
+            }
+        }
+        leftBytes -= raw.size();
+        if (leftBytes == 0) {
+            ended = true;
+        }
+    }
+    receivedBytes += raw.size();
+    if (maxBodySize >= 0 && receivedBytes > maxBodySize) {
+        failed = ended = true;
+        return false;
+    }
+    pending.append(raw);
     return true;
 }
 
+
+qint32 HttpRequestBodyReader::read(char *data, qint32 size)
+{
+    while (pending.isEmpty() && !ended) {
+        if (!fill()) {
+            return -1;
+        }
+    }
+    if (pending.isEmpty()) {
+        return failed ? -1 : 0;
+    }
+    const qint32 readBytes = qMin(size, pending.size());
+    memcpy(data, pending.constData(), static_cast<size_t>(readBytes));
+    pending.remove(0, readBytes);
+    return readBytes;
+}
+
+
+qint32 HttpRequestBodyReader::readall(char *data, qint32 size)
+{
+    qint32 total = 0;
+    while (total < size) {
+        qint32 readBytes = read(data + total, size - total);
+        if (readBytes < 0) {
+            return total > 0 ? total : -1;
+        } else if (readBytes == 0) {
+            break;
+        }
+        total += readBytes;
+    }
+    return total;
+}
+
+
+qint32 HttpRequestBodyReader::write(char *, qint32)
+{
+    return -1;
+}
+
+
+qint32 HttpRequestBodyReader::writeall(char *, qint32)
+{
+    return -1;
+}
+
+
+bool HttpRequestBodyReader::atEnd()
+{
+    return ended && pending.isEmpty();
+}
+
+
+void HttpRequestBodyReader::close()
+{
+    if (!ended) {
+        failed = ended = true;
+    }
+    pending.clear();
+}
+
+
+qint64 HttpRequestBodyReader::size()
+{
+    return contentLength;
+}
+
+
+bool HttpRequestBodyReader::drain(qint64 maxBytes)
+{
+    pending.clear();
+    // the client waits for "100 Continue" that is never sent, and it may send the body or not.
+    if (expectContinue || untilClosed || failed) {
+        return false;
+    }
+    expectContinue = false;
+    qint64 drained = 0;
+    while (!ended) {
+        if (!fill()) {
+            return false;
+        }
+        drained += pending.size();
+        pending.clear();
+        if (drained > maxBytes) {
+            return false;
+        }
+    }
+    return !failed;
+}
+
+
+QSharedPointer<FileLike> BaseHttpRequestHandler::bodyReader(qint64 maxBodySize)
+{
+    if (!requestBodyReader.isNull()) {
+        return requestBodyReader;
+    }
+    if (http2Stream) {
+        // the stream ends with the body, END_STREAM is the framing.
+        requestBodyReader.reset(new HttpRequestBodyReader(this, body, -1, false, false, maxBodySize));
+        return requestBodyReader;
+    }
+    const bool chunked = header(TransferEncodingHeader).toLower().contains("chunked");
+    qint64 contentLength = 0;
+    if (!chunked) {
+        bool ok;
+        contentLength = header(ContentLengthHeader, "0").trimmed().toLongLong(&ok);
+        if (!ok || contentLength < 0) {
+            closeConnection = true;
+            sendError(HttpStatus::BadRequest, QStringLiteral("Bad Content-Length"));
+            return QSharedPointer<FileLike>();
+        }
+        if (maxBodySize >= 0 && contentLength > maxBodySize) {
+            // the body is not read, the connection can not be used again.
+            closeConnection = true;
+            sendError(HttpStatus::RequestEntityTooLarge);
+            return QSharedPointer<FileLike>();
+        }
+    }
+    const bool expectContinue = version == Http1_1 && (chunked || contentLength > 0)
+            && header(QStringLiteral("Expect")).trimmed().toLower() == "100-continue";
+    requestBodyReader.reset(new HttpRequestBodyReader(this, body, contentLength, chunked, expectContinue,
+                                                      maxBodySize));
+    return requestBodyReader;
+}
+
+
+QSharedPointer<MultipartReader> BaseHttpRequestHandler::multipartReader(qint64 maxBodySize)
+{
+    const QByteArray &boundary = MultipartReader::boundaryOf(header(ContentTypeHeader));
+    if (boundary.isEmpty()) {
+        sendError(HttpStatus::BadRequest, QStringLiteral("Expect multipart body"));
+        return QSharedPointer<MultipartReader>();
+    }
+    QSharedPointer<FileLike> reader = bodyReader(maxBodySize);
+    if (reader.isNull()) {
+        return QSharedPointer<MultipartReader>();
+    }
+    return QSharedPointer<MultipartReader>::create(reader, boundary);
+}
+
+
+void BaseHttpRequestHandler::finishBody()
+{
+    if (requestBodyReader.isNull() || http2Stream) {
+        return;
+    }
+    // draining a large body costs more than a new connection.
+    const qint64 MaxDrainBytes = 1024 * 64;
+    if (!requestBodyReader->drain(MaxDrainBytes)) {
+        closeConnection = true;
+    } else if (pendingBytes.isEmpty()) {
+        pendingBytes = requestBodyReader->rest();
+    }
+    requestBodyReader.clear();
+}
+
+
+void BaseHttpRequestHandler::serveHttp2(const QByteArray &buf, bool prefaceReceived, const QByteArray *upgradeSettings)
+{
+    closeConnection = true;
+    Http2ServerConnection connection(request, http2StreamHandler);
+    if (upgradeSettings && !connection.setUpgradeRequest(method.toLatin1(), path.toLatin1(), allHeaders(),
+                                                         *upgradeSettings)) {
+        return;
+    }
+    connection.serve(buf, prefaceReceived);
+}
+
 QByteArray BaseHttpRequestHandler::tryToHandleMagicCode(bool *done)
 {
     *done = false;
@@ -169,10 +802,7 @@ void BaseHttpRequestHandler::doGET()
         sendHeader("Content-Type", "text/html");
         sendHeader("Content-Length", QByteArray::number(body.size()));
     }
-    endHeader();
-    if (!body.isEmpty()) {
-        request->sendall(body);
-    }
+    endResponse(body);
 }
 
 void BaseHttpRequestHandler::doPOST()
@@ -227,7 +857,12 @@ bool BaseHttpRequestHandler::sendError(HttpStatus status, const QString &message
         longMessage = message;
     }
     logError(status, shortMessage, longMessage);
-    sendCommandLine(status, shortMessage.toLatin1());
+    responseStatus = static_cast<int>(status);
+    if (ok) {
+        sendCommandLine(status);
+    } else {
+        sendCommandLine(status, shortMessage);
+    }
     sendHeader("Connection", "close");
     QByteArray body;
     if (status >= 200 && status != HttpStatus::NoContent && status != HttpStatus::ResetContent && status != HttpStatus::NotModified) {
@@ -236,274 +871,2251 @@ bool BaseHttpRequestHandler::sendError(HttpStatus status, const QString &message
         sendHeader("Content-Length", QByteArray::number(body.size()));
         sendHeader("Content-Type", errorMessageContentType().toUtf8());
     }
-    if (!endHeader()) {
-        return false;
+    if (method == "HEAD") {
+        body.clear();
     }
-    if (method != "HEAD" && !body.isEmpty()) {
-        return request->sendall(body);
-    }
-    return true;
+    return endResponse(body);
 }
 
 
 bool BaseHttpRequestHandler::sendResponse(HttpStatus status)
 {
-    QString shortMessage, longMessage;
-    bool ok = toMessage(HttpStatus::OK, &shortMessage, &longMessage);
-    if (!ok) {
-        shortMessage = longMessage = "???";
-    }
     logRequest(status, 0);
-    sendCommandLine(status, shortMessage);
-    sendHeader("Server", serverName().toUtf8());
-    sendHeader("Date", dateTimeString().toUtf8());
+    responseStatus = static_cast<int>(status);
+    sendCommandLine(status);
+    if (serverNameLine.isEmpty()) {
+        serverNameLine = serverName().toUtf8();
+    }
+    sendHeader("Server", serverNameLine);
+    sendHeader("Date", httpDate());
     return true;
 }
 
 
-QString BaseHttpRequestHandler::errorMessage(HttpStatus status, const QString &shortMessage, const QString &longMessage)
+bool BaseHttpRequestHandler::sendMetrics()
 {
-    return DEFAULT_ERROR_MESSAGE.arg(static_cast<int>(status)).arg(shortMessage).arg(longMessage);
+    QByteArray body = Metrics::render();
+    sendResponse(HttpStatus::OK);
+    sendHeader("Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+    sendHeader("Content-Length", QByteArray::number(body.size()));
+    if (method == "HEAD") {
+        body.clear();
+    }
+    return endResponse(body);
 }
 
 
-QString BaseHttpRequestHandler::errorMessageContentType()
+bool BaseHttpRequestHandler::sendCoroutineDump()
 {
-    return DEFAULT_ERROR_CONTENT_TYPE;
+    QByteArray body = CoroutineIntrospection::dump();
+    sendResponse(HttpStatus::OK);
+    sendHeader("Content-Type", "text/plain; charset=utf-8");
+    sendHeader("Content-Length", QByteArray::number(body.size()));
+    if (method == "HEAD") {
+        body.clear();
+    }
+    return endResponse(body);
 }
 
 
-void BaseHttpRequestHandler::sendCommandLine(HttpStatus status, const QString &shortMessage)
+QSharedPointer<WebSocket> BaseHttpRequestHandler::upgradeToWebSocket(const WebSocketConfiguration &config)
 {
-    QString versionStr;
-    switch (serverVersion) {
-    case Http1_0:
-        versionStr = "HTTP/1.0";
-        break;
-    case Http1_1:
-        versionStr = "HTTP/1.1";
-        break;
-    default:
-        versionStr = "HTTP/1.1";
-        break;
+    // RFC 8441 for http/2 is not supported.
+    const QByteArray &key = header(QStringLiteral("Sec-WebSocket-Key")).trimmed();
+    if (http2Stream || method != QStringLiteral("GET") || version != Http1_1
+            || header(UpgradeHeader).trimmed().toLower() != "websocket"
+            || !header(ConnectionHeader).toLower().contains("upgrade")
+            || header(QStringLiteral("Sec-WebSocket-Version")).trimmed() != "13"
+            || QByteArray::fromBase64(key).size() != 16) {
+        sendError(HttpStatus::BadRequest, QStringLiteral("Invalid websocket handshake."));
+        return QSharedPointer<WebSocket>();
+    }
+    const QByteArray &extensions = WebSocket::acceptExtensions(
+                multiHeader(QStringLiteral("Sec-WebSocket-Extensions")).join(','), config);
+    sendResponse(HttpStatus::SwitchProtocol);
+    sendHeader("Connection", "Upgrade");
+    sendHeader("Upgrade", "websocket");
+    sendHeader("Sec-WebSocket-Accept", WebSocket::acceptKey(key));
+    if (!extensions.isEmpty()) {
+        sendHeader("Sec-WebSocket-Extensions", extensions);
     }
-    const QString &firstLine = QStringLiteral("%1 %2 %3\r\n").arg(versionStr).arg(static_cast<int>(status)).arg(shortMessage);
-    headerCache.append(firstLine.toUtf8());
+    closeConnection = true;
+    if (!endHeader()) {
+        return QSharedPointer<WebSocket>();
+    }
+    // the frames sent with the handshake are read already.
+    const QByteArray readBytes = pendingBytes;
+    pendingBytes.clear();
+    return QSharedPointer<WebSocket>(new WebSocket(request, true, extensions, config, readBytes));
 }
 
 
-void BaseHttpRequestHandler::sendHeader(const QByteArray &name, const QByteArray &value)
+QString BaseHttpRequestHandler::errorMessage(HttpStatus status, const QString &shortMessage, const QString &longMessage)
 {
-    const QByteArray &line = name.trimmed() + ": " + value.trimmed() + "\r\n";
-    headerCache.append(line);
-    if (name.trimmed().toLower() == "connection") {
-        if (value.trimmed().toLower() == "close") {
-
-        } else if (value.trimmed().toLower() == "keep-alive") {
-            closeConnection = false;
-        }
-    }
+    return QString::fromLatin1(DEFAULT_ERROR_MESSAGE).arg(static_cast<int>(status)).arg(shortMessage).arg(longMessage);
 }
 
-bool BaseHttpRequestHandler::endHeader()
+
+QString BaseHttpRequestHandler::errorMessageContentType()
 {
-    headerCache.append("\r\n");
-    const QByteArray &data = headerCache.join();
-    headerCache.clear();
-    return request->sendall(data);
+    return QString::fromLatin1(DEFAULT_ERROR_CONTENT_TYPE);
 }
 
 
-QString BaseHttpRequestHandler::serverName()
+static inline const char *versionPrefix(HttpVersion version)
 {
-    return "QtNetworkNg";
+    return version == Http1_0 ? "HTTP/1.0" : "HTTP/1.1";
 }
 
 
-QString BaseHttpRequestHandler::dateTimeString()
+// the headers of most responses fit, and the capacity is kept while the buffer is reset.
+static const int HeaderBufferCapacity = 1024;
+
+
+void BaseHttpRequestHandler::sendCommandLine(HttpStatus status)
 {
-    return QDateTime::currentDateTimeUtc().toString(Qt::RFC2822Date);
+    const StatusLine *line = findStatusLine(static_cast<int>(status));
+    if (!line) {
+        sendCommandLine(status, QStringLiteral("???"));
+        return;
+    }
+    if (http2Stream) {
+        http2Status = static_cast<int>(status);
+        http2Headers.clear();
+        return;
+    }
+    if (headerBuffer.capacity() < HeaderBufferCapacity) {
+        headerBuffer.reserve(HeaderBufferCapacity);
+    }
+    headerBuffer.append(versionPrefix(serverVersion), 8);
+    headerBuffer.append(line->line, line->size);
+}
+
+
+void BaseHttpRequestHandler::sendCommandLine(HttpStatus status, const QString &shortMessage)
+{
+    if (http2Stream) {
+        // http/2 has no status line, the status goes with the headers.
+        http2Status = static_cast<int>(status);
+        http2Headers.clear();
+        return;
+    }
+    if (headerBuffer.capacity() < HeaderBufferCapacity) {
+        headerBuffer.reserve(HeaderBufferCapacity);
+    }
+    headerBuffer.append(versionPrefix(serverVersion), 8);
+    headerBuffer.append(' ');
+    headerBuffer.append(QByteArray::number(static_cast<int>(status)));
+    headerBuffer.append(' ');
+    headerBuffer.append(shortMessage.toUtf8());
+    headerBuffer.append("\r\n", 2);
+}
+
+
+void BaseHttpRequestHandler::sendHeader(const QByteArray &name, const QByteArray &value)
+{
+    const QByteArray &n = name.trimmed();
+    const QByteArray &v = value.trimmed();
+    if (http2Stream) {
+        http2Headers.append(HttpHeader(QString::fromLatin1(n), v));
+        return;
+    }
+    headerBuffer.append(n);
+    headerBuffer.append(": ", 2);
+    headerBuffer.append(v);
+    headerBuffer.append("\r\n", 2);
+    if (equalsLower(n, "connection", 10) && equalsLower(v, "keep-alive", 10)) {
+        closeConnection = false;
+    }
+}
+
+bool BaseHttpRequestHandler::endHeader()
+{
+    return endHeader(QByteArray());
+}
+
+
+bool BaseHttpRequestHandler::endHeader(const QByteArray &body)
+{
+    if (http2Stream) {
+        // the stream is ended by finish(), so the handler may send more body after this.
+        bool ok = http2Stream->sendHeaders(http2Status, http2Headers);
+        http2Headers.clear();
+        if (ok && !body.isEmpty()) {
+            ok = http2Stream->sendall(body) == body.size();
+        }
+        return ok;
+    }
+    // the responses waiting for the pipelined requests go first.
+    headerBuffer.append("\r\n", 2);
+    QByteArrayList data;
+    data.swap(deferredResponses);
+    qint32 size = deferredSize;
+    deferredSize = 0;
+    data.append(headerBuffer);
+    size += headerBuffer.size();
+    if (!body.isEmpty()) {
+        data.append(body);
+        size += body.size();
+    }
+    qint32 sentBytes = request->sendallv(data);
+    data.clear();
+    headerBuffer.resize(0);
+    return sentBytes == size;
+}
+
+
+bool BaseHttpRequestHandler::endResponse(const QByteArray &body)
+{
+    // the next request is read already, its response is sent with this one.
+    const qint32 MaxDeferredSize = 1024 * 64;
+    if (http2Stream || closeConnection || !pendingBytes.contains("\r\n\r\n")
+            || deferredSize + headerBuffer.size() + body.size() > MaxDeferredSize) {
+        return endHeader(body);
+    }
+    headerBuffer.append("\r\n", 2);
+    deferredResponses.append(headerBuffer);
+    deferredSize += headerBuffer.size();
+    if (!body.isEmpty()) {
+        deferredResponses.append(body);
+        deferredSize += body.size();
+    }
+    headerBuffer.resize(0);
+    return true;
+}
+
+
+bool BaseHttpRequestHandler::flushResponses()
+{
+    if (deferredResponses.isEmpty()) {
+        return true;
+    }
+    QByteArrayList data;
+    data.swap(deferredResponses);
+    const qint32 size = deferredSize;
+    deferredSize = 0;
+    return request->sendallv(data) == size;
+}
+
+
+// 开始实现 HttpResponseWriter
+
+class HttpBodyEncoder
+{
+public:
+    enum Mode {
+        Process,
+        Flush,      // the output is complete for the input so far.
+        Finish,
+    };
+    virtual ~HttpBodyEncoder() {}
+    virtual bool encode(const QByteArray &data, Mode mode, QByteArray *out) = 0;
+};
+
+
+#ifdef QTNG_HAVE_ZLIB
+class GzipBodyEncoder: public HttpBodyEncoder
+{
+public:
+    explicit GzipBodyEncoder(int level);
+    virtual ~GzipBodyEncoder() override;
+    virtual bool encode(const QByteArray &data, Mode mode, QByteArray *out) override;
+private:
+    z_stream stream;
+    bool ok;
+};
+
+
+GzipBodyEncoder::GzipBodyEncoder(int level)
+{
+    memset(&stream, 0, sizeof(stream));
+    // 15 + 16 writes the gzip header and trailer.
+    ok = deflateInit2(&stream, qBound(1, level, 9), Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+
+GzipBodyEncoder::~GzipBodyEncoder()
+{
+    if (ok) {
+        deflateEnd(&stream);
+    }
+}
+
+
+bool GzipBodyEncoder::encode(const QByteArray &data, Mode mode, QByteArray *out)
+{
+    if (!ok) {
+        return false;
+    }
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.constData()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    const int flush = mode == Process ? Z_NO_FLUSH : (mode == Flush ? Z_SYNC_FLUSH : Z_FINISH);
+    char buf[1024 * 16];
+    while (true) {
+        stream.next_out = reinterpret_cast<Bytef *>(buf);
+        stream.avail_out = sizeof(buf);
+        const int result = deflate(&stream, flush);
+        if (result == Z_STREAM_ERROR) {
+            return false;
+        }
+        out->append(buf, static_cast<int>(sizeof(buf) - stream.avail_out));
+        if (flush == Z_FINISH ? result == Z_STREAM_END : stream.avail_out != 0) {
+            return true;
+        }
+    }
+}
+#endif
+
+
+#ifdef QTNG_HAVE_BROTLI_ENCODER
+class BrotliBodyEncoder: public HttpBodyEncoder
+{
+public:
+    explicit BrotliBodyEncoder(int quality);
+    virtual ~BrotliBodyEncoder() override;
+    virtual bool encode(const QByteArray &data, Mode mode, QByteArray *out) override;
+private:
+    BrotliEncoderState *state;
+};
+
+
+BrotliBodyEncoder::BrotliBodyEncoder(int quality)
+    :state(BrotliEncoderCreateInstance(nullptr, nullptr, nullptr))
+{
+    if (state) {
+        BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, static_cast<quint32>(qBound(0, quality, 11)));
+    }
+}
+
+
+BrotliBodyEncoder::~BrotliBodyEncoder()
+{
+    if (state) {
+        BrotliEncoderDestroyInstance(state);
+    }
+}
+
+
+bool BrotliBodyEncoder::encode(const QByteArray &data, Mode mode, QByteArray *out)
+{
+    if (!state) {
+        return false;
+    }
+    const BrotliEncoderOperation op = mode == Process ? BROTLI_OPERATION_PROCESS
+            : (mode == Flush ? BROTLI_OPERATION_FLUSH : BROTLI_OPERATION_FINISH);
+    size_t availableIn = static_cast<size_t>(data.size());
+    const uint8_t *nextIn = reinterpret_cast<const uint8_t *>(data.constData());
+    uint8_t buf[1024 * 16];
+    do {
+        size_t availableOut = sizeof(buf);
+        uint8_t *nextOut = buf;
+        if (!BrotliEncoderCompressStream(state, op, &availableIn, &nextIn, &availableOut, &nextOut, nullptr)) {
+            return false;
+        }
+        out->append(reinterpret_cast<const char *>(buf), static_cast<int>(sizeof(buf) - availableOut));
+    } while (availableIn > 0 || BrotliEncoderHasMoreOutput(state)
+             || (op == BROTLI_OPERATION_FINISH && !BrotliEncoderIsFinished(state)));
+    return true;
+}
+#endif
+
+
+class HttpResponseWriterPrivate
+{
+public:
+    HttpResponseWriterPrivate(BaseHttpRequestHandler *handler, const QByteArray &contentType, qint32 chunkSize)
+        :handler(handler), contentType(contentType), bodySize(0), chunkSize(qMax(1, chunkSize)), headersSent(false)
+        , chunked(false), headOnly(handler->method == QStringLiteral("HEAD")), closed(false), broken(false) {}
+    void chooseEncoder();
+    // ending is true if the whole body is written.
+    bool sendHeaders(bool ending);
+    bool send(HttpBodyEncoder::Mode mode);
+    bool sendChunk(const QByteArray &data);
+public:
+    BaseHttpRequestHandler * const handler;
+    QScopedPointer<HttpBodyEncoder> encoder;
+    QByteArray contentType;
+    QByteArray contentEncoding;
+    QByteArray buffer;          // written but not encoded yet.
+    qint64 bodySize;
+    const qint32 chunkSize;
+    bool headersSent;
+    bool chunked;
+    const bool headOnly;        // a HEAD request, the writes are counted only.
+    bool closed;
+    bool broken;
+};
+
+
+void HttpResponseWriterPrivate::chooseEncoder()
+{
+    if (headOnly || handler->compressionMinSize < 0 || !handler->isCompressible(contentType)) {
+        return;
+    }
+    const QByteArray &acceptEncoding = handler->header(QStringLiteral("Accept-Encoding"));
+#ifdef QTNG_HAVE_BROTLI_ENCODER
+    if (acceptsEncoding(acceptEncoding, "br")) {
+        encoder.reset(new BrotliBodyEncoder(handler->compressionLevel));
+        contentEncoding = "br";
+        return;
+    }
+#endif
+#ifdef QTNG_HAVE_ZLIB
+    if (acceptsEncoding(acceptEncoding, "gzip")) {
+        encoder.reset(new GzipBodyEncoder(handler->compressionLevel));
+        contentEncoding = "gzip";
+        return;
+    }
+#endif
+    Q_UNUSED(acceptEncoding);
+}
+
+
+bool HttpResponseWriterPrivate::sendHeaders(bool ending)
+{
+    headersSent = true;
+    if (!contentType.isEmpty()) {
+        handler->sendHeader("Content-Type", contentType);
+    }
+    chooseEncoder();
+    if (ending && (encoder.isNull() || bodySize < handler->compressionMinSize)) {
+        // the whole body is known, it goes as a plain response, and may be held back for the pipelined requests.
+        encoder.reset();
+        contentEncoding.clear();
+        handler->sendHeader("Content-Length", QByteArray::number(bodySize));
+        const QByteArray body = buffer;
+        buffer.clear();
+        return handler->endResponse(body);
+    }
+    if (!encoder.isNull()) {
+        handler->sendHeader("Content-Encoding", contentEncoding);
+        handler->sendHeader("Vary", "Accept-Encoding");
+    }
+    if (handler->http2Stream) {
+        chunked = false;
+    } else if (handler->version == Http1_1) {
+        chunked = true;
+        handler->sendHeader("Transfer-Encoding", "chunked");
+    } else {
+        // http/1.0 ends the body of unknown size by closing the connection.
+        handler->closeConnection = true;
+    }
+    return handler->endHeader();
+}
+
+
+bool HttpResponseWriterPrivate::sendChunk(const QByteArray &data)
+{
+    if (!chunked) {
+        return handler->request->sendall(data) == data.size();
+    }
+    QByteArrayList parts;
+    parts.append(QByteArray::number(data.size(), 16) + "\r\n");
+    parts.append(data);
+    parts.append(QByteArray("\r\n", 2));
+    const qint32 size = parts.at(0).size() + data.size() + 2;
+    return handler->request->sendallv(parts) == size;
+}
+
+
+bool HttpResponseWriterPrivate::send(HttpBodyEncoder::Mode mode)
+{
+    if (broken) {
+        return false;
+    }
+    QByteArray data;
+    if (encoder.isNull()) {
+        data.swap(buffer);
+    } else {
+        if (!encoder->encode(buffer, mode, &data)) {
+            broken = true;
+            return false;
+        }
+        buffer.clear();
+    }
+    bool ok = data.isEmpty() || sendChunk(data);
+    if (ok && mode == HttpBodyEncoder::Finish && chunked) {
+        ok = handler->request->sendall("0\r\n\r\n", 5) == 5;
+    }
+    if (!ok) {
+        broken = true;
+    }
+    return ok;
+}
+
+
+HttpResponseWriter::HttpResponseWriter(HttpResponseWriterPrivate *d)
+    :d_ptr(d)
+{
+}
+
+
+HttpResponseWriter::~HttpResponseWriter()
+{
+    delete d_ptr;
+}
+
+
+bool HttpResponseWriter::write(const QByteArray &data)
+{
+    Q_D(HttpResponseWriter);
+    if (d->closed || d->broken) {
+        return false;
+    }
+    d->bodySize += data.size();
+    if (d->headOnly) {
+        return true;
+    }
+    d->buffer.append(data);
+    if (d->buffer.size() < d->chunkSize) {
+        return true;
+    }
+    if (!d->headersSent && !d->sendHeaders(false)) {
+        d->broken = true;
+        return false;
+    }
+    return d->send(HttpBodyEncoder::Process);
+}
+
+
+bool HttpResponseWriter::flush()
+{
+    Q_D(HttpResponseWriter);
+    if (d->closed || d->broken) {
+        return false;
+    }
+    if (!d->headersSent && !d->sendHeaders(false)) {
+        d->broken = true;
+        return false;
+    }
+    if (d->headOnly) {
+        return true;
+    }
+    return d->send(HttpBodyEncoder::Flush);
+}
+
+
+bool HttpResponseWriter::close()
+{
+    Q_D(HttpResponseWriter);
+    if (d->closed) {
+        return !d->broken;
+    }
+    d->closed = true;
+    if (d->broken) {
+        return false;
+    }
+    if (!d->headersSent) {
+        const bool wasEnded = d->sendHeaders(true);
+        if (!wasEnded) {
+            d->broken = true;
+            return false;
+        }
+        if (d->buffer.isEmpty() && d->encoder.isNull() && !d->chunked) {
+            // sent as a whole by sendHeaders(), or nothing is left for http/1.0 and http/2.
+            return true;
+        }
+    }
+    if (d->headOnly) {
+        return true;
+    }
+    return d->send(HttpBodyEncoder::Finish);
+}
+
+
+bool HttpResponseWriter::isClosed() const
+{
+    Q_D(const HttpResponseWriter);
+    return d->closed;
+}
+
+
+QByteArray HttpResponseWriter::contentEncoding() const
+{
+    Q_D(const HttpResponseWriter);
+    return d->contentEncoding;
+}
+
+
+qint64 HttpResponseWriter::bodySize() const
+{
+    Q_D(const HttpResponseWriter);
+    return d->bodySize;
+}
+
+
+QSharedPointer<HttpResponseWriter> BaseHttpRequestHandler::bodyWriter(const QByteArray &contentType, qint32 chunkSize)
+{
+    if (!responseBodyWriter.isNull()) {
+        responseBodyWriter->close();
+    }
+    responseBodyWriter.reset(new HttpResponseWriter(new HttpResponseWriterPrivate(this, contentType, chunkSize)));
+    return responseBodyWriter;
+}
+
+
+bool BaseHttpRequestHandler::isCompressible(const QByteArray &contentType)
+{
+    const QByteArray &type = contentType.split(';').first().trimmed().toLower();
+    return type.startsWith("text/") || type.endsWith("+json") || type.endsWith("+xml")
+            || type == "application/json" || type == "application/javascript" || type == "application/xml"
+            || type == "application/wasm";
+}
+
+
+QString BaseHttpRequestHandler::serverName()
+{
+    return "QtNetworkNg";
+}
+
+
+QString BaseHttpRequestHandler::dateTimeString()
+{
+    return QString::fromLatin1(httpDate());
 }
 
 
 void BaseHttpRequestHandler::logRequest(HttpStatus status, int bodySize)
 {
-    QString msg = QStringLiteral("%1 %2 %3 %4").arg(method).arg(path).arg(static_cast<int>(status)).arg(bodySize);
-    qDebug() << request->peerAddress().toString() << "--" << QDateTime::currentDateTime().toString(Qt::ISODate) << msg;
+    HttpAccessLog *accessLog = HttpAccessLog::installed();
+    if (accessLog) {
+        accessLog->logRequest(method, path, request->peerAddress(), static_cast<int>(status), bodySize);
+        return;
+    }
+    QString msg = QStringLiteral("%1 %2 %3 %4").arg(method).arg(path).arg(static_cast<int>(status)).arg(bodySize);
+    qDebug() << request->peerAddress().toString() << "--" << QDateTime::currentDateTime().toString(Qt::ISODate) << msg;
+}
+
+
+void BaseHttpRequestHandler::logError(HttpStatus status, const QString &shortMessage, const QString &)
+{
+    HttpAccessLog *accessLog = HttpAccessLog::installed();
+    if (accessLog) {
+        accessLog->logError(method, path, request->peerAddress(), static_cast<int>(status), shortMessage);
+        return;
+    }
+    QString msg = QStringLiteral("%1 %2 %3 %4").arg(method).arg(path).arg(static_cast<int>(status)).arg(shortMessage);
+    qDebug() << request->peerAddress().toString() << "--" << QDateTime::currentDateTime().toString(Qt::ISODate) << msg;
+}
+
+
+// copied from the request, so the eventloop does not allocate or format anything for logging.
+struct AccessLogRecord
+{
+    qint64 msecs;
+    qint64 bodySize;
+    qint32 status;
+    quint32 ipv4;
+    quint8 ipv6[16];
+    quint8 protocol;     // 0 for unknown, 4 or 6.
+    bool error;
+    quint8 methodSize;
+    quint8 pathSize;
+    quint8 messageSize;
+    char method[15];
+    char path[160];      // the long paths are truncated.
+    char message[64];
+};
+
+
+static quint8 copyLatin1(const QString &s, char *buf, int size)
+{
+    const int n = qMin(s.size(), size);
+    const QChar *data = s.constData();
+    for (int i = 0; i < n; ++i) {
+        buf[i] = data[i].toLatin1();
+    }
+    return static_cast<quint8>(n);
+}
+
+
+// written by the eventloop of one thread, and read by the writer thread.
+struct AccessLogRing
+{
+    explicit AccessLogRing(int capacity)
+        :records(capacity), head(0), tail(0), counter(0) {}
+    QVector<AccessLogRecord> records;
+    QAtomicInteger<quint32> head;  // the next record to write.
+    QAtomicInteger<quint32> tail;  // the next record to read.
+    quint32 counter;               // the requests seen, for sampling.
+};
+
+
+class AccessLogWriter: public QThread
+{
+public:
+    AccessLogWriter(HttpAccessLogPrivate *parent)
+        :parent(parent) {}
+    virtual void run() override;
+public:
+    HttpAccessLogPrivate * const parent;
+};
+
+
+class HttpAccessLogPrivate
+{
+public:
+    HttpAccessLogPrivate(int capacity);
+    ~HttpAccessLogPrivate();
+    AccessLogRing *ring();
+    AccessLogRecord *take(AccessLogRing *ring);
+    bool push(bool error, const QString &method, const QString &path, const QHostAddress &peer, int status,
+              qint64 bodySize, const QString &message);
+    // the lines of records taken from all rings.
+    QByteArray drain();
+    void write(const QByteArray &lines);
+public:
+    QMutex mutex;               // guards the members below, except the atomics.
+    QWaitCondition wakeup;
+    QList<AccessLogRing*> rings;
+    QFile file;
+    QByteArray ident;
+    AccessLogWriter *writer;
+    quint64 serial;             // the rings of thread are found by it, as the address may be reused.
+    QAtomicInteger<quint64> dropped;
+    QAtomicInt sampling;
+    int flushInterval;
+    int capacity;
+    bool syslog;
+    bool stopping;
+};
+
+
+Q_GLOBAL_STATIC(QThreadStorage<QHash<quint64, AccessLogRing*>>, accessLogRings)
+static QAtomicInteger<quint64> nextAccessLogSerial;
+static QAtomicPointer<HttpAccessLog> installedAccessLog;
+
+
+HttpAccessLogPrivate::HttpAccessLogPrivate(int capacity)
+    :writer(nullptr), serial(nextAccessLogSerial.fetchAndAddRelaxed(1)), dropped(0), sampling(1)
+    , flushInterval(200), capacity(qMax(16, capacity)), syslog(false), stopping(false)
+{
+}
+
+
+HttpAccessLogPrivate::~HttpAccessLogPrivate()
+{
+    {
+        QMutexLocker locker(&mutex);
+        stopping = true;
+        wakeup.wakeAll();
+    }
+    writer->wait();
+    delete writer;
+    qDeleteAll(rings);
+#ifdef Q_OS_UNIX
+    if (syslog) {
+        closelog();
+    }
+#endif
+}
+
+
+AccessLogRing *HttpAccessLogPrivate::ring()
+{
+    QThreadStorage<QHash<quint64, AccessLogRing*>> *storage = accessLogRings();
+    if (!storage) {
+        return nullptr;
+    }
+    QHash<quint64, AccessLogRing*> &local = storage->localData();
+    AccessLogRing *r = local.value(serial);
+    if (!r) {
+        r = new AccessLogRing(capacity);
+        QMutexLocker locker(&mutex);
+        rings.append(r);
+        local.insert(serial, r);
+    }
+    return r;
+}
+
+
+AccessLogRecord *HttpAccessLogPrivate::take(AccessLogRing *r)
+{
+    const quint32 head = r->head.load();
+    if (head - r->tail.loadAcquire() >= static_cast<quint32>(r->records.size())) {
+        return nullptr;
+    }
+    return &r->records[static_cast<int>(head % static_cast<quint32>(r->records.size()))];
+}
+
+
+bool HttpAccessLogPrivate::push(bool error, const QString &method, const QString &path, const QHostAddress &peer,
+                                int status, qint64 bodySize, const QString &message)
+{
+    AccessLogRing *r = ring();
+    if (!r) {
+        return false;
+    }
+    const int n = sampling.load();
+    if (!error && n > 1 && (r->counter++ % static_cast<quint32>(n)) != 0) {
+        return true;
+    }
+    AccessLogRecord *record = take(r);
+    if (!record) {
+        dropped.fetchAndAddRelaxed(1);
+        return false;
+    }
+    record->msecs = QDateTime::currentMSecsSinceEpoch();
+    record->bodySize = bodySize;
+    record->status = status;
+    record->error = error;
+    record->protocol = 0;
+    if (peer.protocol() == QAbstractSocket::IPv4Protocol) {
+        record->protocol = 4;
+        record->ipv4 = peer.toIPv4Address();
+    } else if (peer.protocol() == QAbstractSocket::IPv6Protocol) {
+        record->protocol = 6;
+        const Q_IPV6ADDR &addr = peer.toIPv6Address();
+        memcpy(record->ipv6, addr.c, 16);
+    }
+    record->methodSize = copyLatin1(method, record->method, sizeof(record->method));
+    record->pathSize = copyLatin1(path, record->path, sizeof(record->path));
+    record->messageSize = error ? copyLatin1(message, record->message, sizeof(record->message)) : 0;
+    r->head.storeRelease(r->head.load() + 1);
+    return true;
+}
+
+
+QByteArray HttpAccessLogPrivate::drain()
+{
+    QList<AccessLogRing*> rings;
+    {
+        QMutexLocker locker(&mutex);
+        rings = this->rings;
+    }
+    QByteArray lines;
+    for (AccessLogRing *r: rings) {
+        const quint32 head = r->head.loadAcquire();
+        quint32 tail = r->tail.load();
+        for (; tail != head; ++tail) {
+            const AccessLogRecord &record = r->records.at(static_cast<int>(tail % static_cast<quint32>(r->records.size())));
+            QHostAddress peer;
+            if (record.protocol == 4) {
+                peer.setAddress(record.ipv4);
+            } else if (record.protocol == 6) {
+                peer.setAddress(record.ipv6);
+            }
+            lines.append(peer.toString().toLatin1());
+            lines.append(" -- ");
+            lines.append(QDateTime::fromMSecsSinceEpoch(record.msecs).toString(Qt::ISODate).toLatin1());
+            lines.append(' ');
+            lines.append(record.method, record.methodSize);
+            lines.append(' ');
+            lines.append(record.path, record.pathSize);
+            lines.append(' ');
+            lines.append(QByteArray::number(record.status));
+            lines.append(' ');
+            if (record.error) {
+                lines.append(record.message, record.messageSize);
+            } else {
+                lines.append(QByteArray::number(record.bodySize));
+            }
+            lines.append('\n');
+        }
+        r->tail.storeRelease(tail);
+    }
+    return lines;
+}
+
+
+void HttpAccessLogPrivate::write(const QByteArray &lines)
+{
+    if (lines.isEmpty()) {
+        return;
+    }
+    QMutexLocker locker(&mutex);
+#ifdef Q_OS_UNIX
+    if (syslog) {
+        for (const QByteArray &line: lines.split('\n')) {
+            if (!line.isEmpty()) {
+                ::syslog(LOG_INFO, "%s", line.constData());
+            }
+        }
+        return;
+    }
+#endif
+    if (file.isOpen()) {
+        file.write(lines);
+        file.flush();
+    } else {
+        fwrite(lines.constData(), 1, static_cast<size_t>(lines.size()), stderr);
+        fflush(stderr);
+    }
+}
+
+
+void AccessLogWriter::run()
+{
+    bool stopping = false;
+    while (!stopping) {
+        {
+            QMutexLocker locker(&parent->mutex);
+            if (!parent->stopping) {
+                parent->wakeup.wait(&parent->mutex, static_cast<unsigned long>(parent->flushInterval));
+            }
+            stopping = parent->stopping;
+        }
+        parent->write(parent->drain());
+    }
+}
+
+
+HttpAccessLog::HttpAccessLog(int capacityPerThread)
+    :d_ptr(new HttpAccessLogPrivate(capacityPerThread))
+{
+    Q_D(HttpAccessLog);
+    d->writer = new AccessLogWriter(d);
+    d->writer->start();
+}
+
+
+HttpAccessLog::~HttpAccessLog()
+{
+    installedAccessLog.testAndSetOrdered(this, nullptr);
+    delete d_ptr;
+}
+
+
+bool HttpAccessLog::openFile(const QString &filePath)
+{
+    Q_D(HttpAccessLog);
+    QMutexLocker locker(&d->mutex);
+    d->file.close();
+    d->file.setFileName(filePath);
+    return d->file.open(QIODevice::WriteOnly | QIODevice::Append);
+}
+
+
+void HttpAccessLog::useSyslog(const QByteArray &ident)
+{
+#ifdef Q_OS_UNIX
+    Q_D(HttpAccessLog);
+    QMutexLocker locker(&d->mutex);
+    // openlog() keeps the pointer.
+    d->ident = ident;
+    openlog(d->ident.constData(), LOG_PID, LOG_USER);
+    d->syslog = true;
+#else
+    Q_UNUSED(ident);
+    qWarning("syslog is not supported, the access log goes to stderr or file.");
+#endif
+}
+
+
+void HttpAccessLog::setFlushInterval(int msecs)
+{
+    Q_D(HttpAccessLog);
+    QMutexLocker locker(&d->mutex);
+    d->flushInterval = qMax(1, msecs);
+}
+
+
+void HttpAccessLog::setSampling(int n)
+{
+    Q_D(HttpAccessLog);
+    d->sampling.store(qMax(1, n));
+}
+
+
+bool HttpAccessLog::logRequest(const QString &method, const QString &path, const QHostAddress &peer, int status,
+                               qint64 bodySize)
+{
+    Q_D(HttpAccessLog);
+    return d->push(false, method, path, peer, status, bodySize, QString());
+}
+
+
+bool HttpAccessLog::logError(const QString &method, const QString &path, const QHostAddress &peer, int status,
+                             const QString &message)
+{
+    Q_D(HttpAccessLog);
+    return d->push(true, method, path, peer, status, 0, message);
+}
+
+
+quint64 HttpAccessLog::dropped() const
+{
+    Q_D(const HttpAccessLog);
+    return d->dropped.load();
+}
+
+
+void HttpAccessLog::install(HttpAccessLog *log)
+{
+    installedAccessLog.storeRelease(log);
+}
+
+
+HttpAccessLog *HttpAccessLog::installed()
+{
+    return installedAccessLog.loadAcquire();
+}
+
+
+static QString contentTypeOf(const QFileInfo &fileInfo)
+{
+    QString contentType;
+#ifdef Q_OS_ANDROID
+    const QString &ext = fileInfo.completeSuffix().toLower();
+    if (ext == "txt") {
+        contentType = "text/plain";
+    } else if (ext == "html" || ext == "htm") {
+        contentType = "text/html";
+    } else if (ext == "js") {
+        contentType = "application/javascript";
+    } else if (ext == "css") {
+        contentType = "text/css";
+    } else {
+        contentType = "application/octet-stream";
+    }
+#else
+    QMimeDatabase db;
+    const QMimeType &ctype = db.mimeTypeForFile(fileInfo);
+    if (!ctype.isValid()) {
+        contentType = "application/octet-stream";
+    } else {
+        contentType = ctype.name();
+    }
+#endif
+    return contentType;
+}
+
+
+class StaticFileCachePrivate
+{
+public:
+    StaticFileCachePrivate(qint64 maxBytes, qint64 maxFileSize)
+        :files(static_cast<int>(qBound<qint64>(1, maxBytes, std::numeric_limits<int>::max())))
+        , maxFileSize(maxFileSize), checkInterval(1000) {}
+    QSharedPointer<StaticFile> load(const QFileInfo &fileInfo);
+public:
+    QMutex mutex;   // the acceptor threads share the cache.
+    QCache<QString, QSharedPointer<StaticFile>> files;
+    qint64 maxFileSize;
+    int checkInterval;
+};
+
+
+static QAtomicPointer<StaticFileCache> installedFileCache;
+
+
+static QByteArray strongETag(qint64 size, const QDateTime &lastModified)
+{
+    return "\"" + QByteArray::number(size, 16) + "-" + QByteArray::number(lastModified.toMSecsSinceEpoch(), 16) + "\"";
+}
+
+
+// the file must be replaced by renaming, writing it in place changes the mapped contents being sent.
+static bool mapFile(const QString &filePath, StaticFile *file, QByteArray *content)
+{
+    QSharedPointer<QFile> f(new QFile(filePath));
+    if (!f->open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    const qint64 size = f->size();
+    if (size == 0) {
+        content->clear();
+        return true;
+    }
+    uchar *p = f->map(0, size);
+    if (!p) {
+        *content = f->readAll();
+        return content->size() == size;
+    }
+    *content = QByteArray::fromRawData(reinterpret_cast<const char *>(p), static_cast<int>(size));
+    file->files.append(f);
+    return true;
+}
+
+
+QSharedPointer<StaticFile> StaticFileCachePrivate::load(const QFileInfo &fileInfo)
+{
+    QSharedPointer<StaticFile> file(new StaticFile());
+    const QString &filePath = fileInfo.filePath();
+    if (!mapFile(filePath, file.data(), &file->content)) {
+        return QSharedPointer<StaticFile>();
+    }
+    QFileInfo gzipInfo(filePath + QStringLiteral(".gz"));
+    if (gzipInfo.isFile() && gzipInfo.size() <= maxFileSize) {
+        mapFile(gzipInfo.filePath(), file.data(), &file->gzipContent);
+    }
+    QFileInfo brotliInfo(filePath + QStringLiteral(".br"));
+    if (brotliInfo.isFile() && brotliInfo.size() <= maxFileSize) {
+        mapFile(brotliInfo.filePath(), file.data(), &file->brotliContent);
+    }
+    file->size = file->content.size();
+    file->modified = fileInfo.lastModified();
+    file->checked = QDateTime::currentMSecsSinceEpoch();
+    file->contentType = contentTypeOf(fileInfo).toUtf8();
+    file->lastModified = formatHttpDate(file->modified);
+    file->etag = strongETag(file->size, file->modified);
+    return file;
+}
+
+
+StaticFileCache::StaticFileCache(qint64 maxBytes, qint64 maxFileSize)
+    :d_ptr(new StaticFileCachePrivate(maxBytes, maxFileSize))
+{
+}
+
+
+StaticFileCache::~StaticFileCache()
+{
+    installedFileCache.testAndSetOrdered(this, nullptr);
+    delete d_ptr;
+}
+
+
+void StaticFileCache::setCheckInterval(int msecs)
+{
+    Q_D(StaticFileCache);
+    QMutexLocker locker(&d->mutex);
+    d->checkInterval = msecs;
+}
+
+
+QSharedPointer<StaticFile> StaticFileCache::get(const QString &filePath)
+{
+    Q_D(StaticFileCache);
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QSharedPointer<StaticFile> old;
+    {
+        QMutexLocker locker(&d->mutex);
+        QSharedPointer<StaticFile> *cached = d->files.object(filePath);
+        if (cached) {
+            if (now - (*cached)->checked < d->checkInterval) {
+                return *cached;
+            }
+            old = *cached;
+        }
+    }
+
+    // stat and load without the lock, the other threads are not blocked by the disk.
+    QFileInfo fileInfo(filePath);
+    if (!fileInfo.isFile() || fileInfo.size() > d->maxFileSize) {
+        if (!old.isNull()) {
+            QMutexLocker locker(&d->mutex);
+            d->files.remove(filePath);
+        }
+        return QSharedPointer<StaticFile>();
+    }
+    if (!old.isNull() && old->size == fileInfo.size() && old->modified == fileInfo.lastModified()) {
+        QMutexLocker locker(&d->mutex);
+        old->checked = now;
+        return old;
+    }
+    QSharedPointer<StaticFile> file = d->load(fileInfo);
+    if (file.isNull()) {
+        return file;
+    }
+    const qint64 cost = file->content.size() + file->gzipContent.size() + file->brotliContent.size();
+    QMutexLocker locker(&d->mutex);
+    d->files.insert(filePath, new QSharedPointer<StaticFile>(file), static_cast<int>(qMax<qint64>(1, cost)));
+    return file;
+}
+
+
+void StaticFileCache::clear()
+{
+    Q_D(StaticFileCache);
+    QMutexLocker locker(&d->mutex);
+    d->files.clear();
+}
+
+
+void StaticFileCache::install(StaticFileCache *cache)
+{
+    installedFileCache.storeRelease(cache);
+}
+
+
+StaticFileCache *StaticFileCache::installed()
+{
+    return installedFileCache.loadAcquire();
+}
+
+
+StaticFileCache *SimpleHttpRequestHandler::fileCache()
+{
+    return StaticFileCache::installed();
+}
+
+
+bool SimpleHttpRequestHandler::serveCachedFile(StaticFileCache *cache, const QString &filePath)
+{
+    // the ranges are sent from the file by the uncached path.
+    if (hasHeader(QStringLiteral("Range"))) {
+        return false;
+    }
+    QSharedPointer<StaticFile> file = cache->get(filePath);
+    if (file.isNull()) {
+        return false;
+    }
+    const bool keepAlive = version == Http1_1 && !closeConnection;
+    if (isNotModified(file->etag, file->modified)) {
+        sendResponse(HttpStatus::NotModified);
+        sendHeader("ETag", file->etag);
+        sendHeader("Last-Modified", file->lastModified);
+        if (keepAlive) {
+            sendHeader("Connection", "keep-alive");
+        }
+        endResponse(QByteArray());
+        return true;
+    }
+
+    const QByteArray *content = &file->content;
+    const char *contentEncoding = nullptr;
+    if (!file->gzipContent.isEmpty() || !file->brotliContent.isEmpty()) {
+        const QByteArray &acceptEncoding = header(AcceptEncodingHeader);
+        if (!file->brotliContent.isEmpty() && acceptsEncoding(acceptEncoding, "br")) {
+            content = &file->brotliContent;
+            contentEncoding = "br";
+        } else if (!file->gzipContent.isEmpty() && acceptsEncoding(acceptEncoding, "gzip")) {
+            content = &file->gzipContent;
+            contentEncoding = "gzip";
+        }
+    }
+    sendResponse(HttpStatus::OK);
+    sendHeader("Content-Type", file->contentType);
+    sendHeader("Content-Length", QByteArray::number(content->size()));
+    sendHeader("Last-Modified", file->lastModified);
+    sendHeader("ETag", file->etag);
+    if (!file->gzipContent.isEmpty() || !file->brotliContent.isEmpty()) {
+        sendHeader("Vary", "Accept-Encoding");
+    }
+    if (contentEncoding) {
+        sendHeader("Content-Encoding", contentEncoding);
+    }
+    if (keepAlive) {
+        sendHeader("Connection", "keep-alive");
+    }
+    if (method == "HEAD") {
+        endResponse(QByteArray());
+    } else {
+        endResponse(*content);
+    }
+    return true;
+}
+
+
+void SimpleHttpRequestHandler::doGET()
+{
+    // the header goes with the first segment of file, and the parts of ranges are not sent in small segments.
+    QSharedPointer<Socket> s = convertSocketLikeToSocket(request);
+    if (!s.isNull()) {
+        s->cork();
+    }
+    QSharedPointer<FileLike> f = serveStaticFiles();
+    if (!f.isNull()) {
+        if (!sendFile(f)) {
+            closeConnection = true;
+        }
+        f->close();
+    }
+    if (!s.isNull()) {
+        s->uncork();
+    }
+}
+
+void SimpleHttpRequestHandler::doHEAD()
+{
+    QSharedPointer<FileLike> f = serveStaticFiles();
+    if (!f.isNull()) {
+        f->close();
+    }
+}
+
+QSharedPointer<FileLike> SimpleHttpRequestHandler::serveStaticFiles()
+{
+    QUrl url = QUrl::fromEncoded(path.toLatin1());
+    QFileInfo fileInfo = translatePath(url.path());
+    StaticFileCache *cache = fileCache();
+    if (cache && serveCachedFile(cache, fileInfo.filePath())) {
+        return QSharedPointer<FileLike>();
+    }
+#ifdef DEBUG_HTTP_PROTOCOL
+    qDebug() << "serve path" << url.path() << fileInfo.absoluteFilePath();
+#endif
+    if (!fileInfo.exists()) {
+        sendError(HttpStatus::NotFound, "File not found");
+        return QSharedPointer<FileLike>();
+    }
+
+    if (fileInfo.isDir()) {
+        const QString &p = url.toString(QUrl::RemoveQuery | QUrl::RemoveFragment | QUrl::FullyDecoded);
+        if (!p.endsWith("/")) {
+            url.setPath(p + "/");
+            sendResponse(HttpStatus::MovedPermanently);
+            sendHeader("Location", url.toEncoded(QUrl::FullyEncoded));
+            endHeader();
+            return QSharedPointer<FileLike>();
+        } else {
+            QDir dir(fileInfo.filePath());
+            if (dir.exists("index.html")) {
+                fileInfo = dir.filePath("index.html");
+            } else if (dir.exists("index.htm")) {
+                fileInfo = dir.filePath("index.htm");
+            } else {
+                return listDirectory(dir, p);
+            }
+        }
+    }
+
+    const QString &contentType = contentTypeOf(fileInfo);
+    QSharedPointer<QFile> f(new QFile(fileInfo.filePath()));
+    if (!f->open(QIODevice::ReadOnly)) {
+        sendError(HttpStatus::NotFound, "File not found");
+        return QSharedPointer<FileLike>();
+    }
+    const qint64 size = f->size();
+    const QDateTime &modified = fileInfo.lastModified();
+    const QByteArray &etag = strongETag(size, modified);
+    const QByteArray &lastModified = formatHttpDate(modified);
+    const bool keepAlive = version == Http1_1 && !closeConnection;
+    if (isNotModified(etag, modified)) {
+        sendResponse(HttpStatus::NotModified);
+        sendHeader("ETag", etag);
+        sendHeader("Last-Modified", lastModified);
+        if (keepAlive) {
+            sendHeader("Connection", "keep-alive");
+        }
+        endResponse(QByteArray());
+        return QSharedPointer<FileLike>();
+    }
+    QList<QPair<qint64, qint64>> ranges;
+    if (!parseRanges(size, etag, modified, &ranges)) {
+        sendResponse(HttpStatus::RequestedRangeNotSatisfiable);
+        sendHeader("Content-Range", "bytes */" + QByteArray::number(size));
+        sendHeader("Content-Length", "0");
+        if (keepAlive) {
+            sendHeader("Connection", "keep-alive");
+        }
+        endHeader();
+        return QSharedPointer<FileLike>();
+    }
+    QSharedPointer<FileLike> file = openFile(f);
+    if (!ranges.isEmpty()) {
+        if (!sendRanges(file, size, ranges, contentType.toUtf8(), etag, lastModified)) {
+            // the body is cut, the client can not find the next response.
+            closeConnection = true;
+        }
+        file->close();
+        return QSharedPointer<FileLike>();
+    }
+    sendResponse(HttpStatus::OK);
+    sendHeader("Content-Type", contentType.toUtf8());
+    sendHeader("Content-Length", QByteArray::number(size));
+    sendHeader("Last-Modified", lastModified);
+    sendHeader("ETag", etag);
+    sendHeader("Accept-Ranges", "bytes");
+    if (keepAlive) {
+        sendHeader("Connection", "keep-alive");
+    }
+    endHeader();
+    return file;
+}
+
+QSharedPointer<FileLike> SimpleHttpRequestHandler::listDirectory(const QDir &dir, const QString &displayDir)
+{
+    const QFileInfoList &list = dir.entryInfoList(QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot);
+    const QString &title = QStringLiteral("Directory listing for ") + displayDir;
+    QStringList html;
+    html.append("<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01//EN\" \"http://www.w3.org/TR/html4/strict.dtd\">");
+    html.append("<html>\n<head>");
+    html.append("<meta http-equiv=\"Content-Type\" content=\"text/html; charset=utf-8\">");
+    html.append(QStringLiteral("<title>%1</title>\n</head>").arg(title));
+    html.append(QStringLiteral("<body>\n<h1>%1</h1>").arg(title));
+    html.append("<hr>\n<ul>");
+    for (const QFileInfo &entry: list) {
+        QString name = entry.fileName();
+        QString link = entry.fileName();
+        if (entry.isDir()) {
+            name.append("/");
+            link.append("/");
+        }
+        if (entry.isSymLink()) {
+            name = entry.fileName() + "@";
+            // Note: a link to a directory displays with @ and links with /
+        }
+        const QString &htmlName = name.toHtmlEscaped();
+        const QString &htmlLink = link.toUtf8().toPercentEncoding("/");
+        html.append(QStringLiteral("<li><a href=\"%1\">%2</a></li>").arg(htmlLink).arg(htmlName));
+    }
+    html.append("</ul>\n<hr>\n</body>\n</html>");
+    const QByteArray &data = html.join("\n").toUtf8();
+    sendResponse(HttpStatus::OK);
+    sendHeader("Content-Type", "text/html; charset=utf-8");
+    sendHeader("Content-Length", QByteArray::number(data.size()));
+    endHeader();
+    return FileLike::bytes(data);
+}
+
+QSharedPointer<FileLike> SimpleHttpRequestHandler::openFile(QSharedPointer<QFile> f)
+{
+    return FileLike::rawFile(f);
+}
+
+bool SimpleHttpRequestHandler::sendFile(QSharedPointer<FileLike> f)
+{
+    QSharedPointer<QFile> file = f->file();
+    return sendFileRange(f, file.isNull() ? 0 : file->pos(), -1);
+}
+
+
+bool SimpleHttpRequestHandler::sendFileRange(QSharedPointer<FileLike> f, qint64 offset, qint64 size)
+{
+    QSharedPointer<QFile> file = f->file();
+    if (!file.isNull()) {
+        if (size < 0) {
+            size = file->size() - offset;
+        }
+        if (file->handle() >= 0) {
+            // plain tcp connection, let the kernel send the file.
+            QSharedPointer<Socket> s = convertSocketLikeToSocket(request);
+            if (!s.isNull()) {
+                return s->sendfile(file.data(), offset, size) == size;
+            }
+#ifndef QTNG_NO_CRYPTO
+            // the kernel encrypts and sends the file with kernel tls.
+            QSharedPointer<SslSocket> ss = convertSocketLikeToSslSocket(request);
+            if (!ss.isNull() && ss->isKernelTlsActive()) {
+                return ss->sendfile(file.data(), offset, size) == size;
+            }
+#endif
+        }
+        if (!file->seek(offset)) {
+            return false;
+        }
+    } else if (offset > 0 && !f->seek(offset)) {
+        return false;
+    }
+    QByteArray buf;
+    buf.resize(1024 * 8);
+    while (size != 0 && !f->atEnd()) {
+        const qint32 n = size < 0 ? buf.size() : static_cast<qint32>(qMin<qint64>(buf.size(), size));
+        qint64 bs = f->read(buf.data(), n);
+        if (bs <= 0){
+            break;
+        }
+        if (request->sendall(buf.data(), static_cast<qint32>(bs)) != bs) {
+            return false;
+        }
+        if (size > 0) {
+            size -= bs;
+        }
+    }
+    return size <= 0;
+}
+
+
+bool SimpleHttpRequestHandler::isNotModified(const QByteArray &etag, const QDateTime &lastModified)
+{
+    if (method != "GET" && method != "HEAD") {
+        return false;
+    }
+    const QByteArray &ifNoneMatch = header(QStringLiteral("If-None-Match"));
+    if (!ifNoneMatch.isEmpty()) {
+        // the weak comparison of rfc 7232.
+        for (const QByteArray &item: ifNoneMatch.split(',')) {
+            QByteArray tag = item.trimmed();
+            if (tag == "*") {
+                return true;
+            }
+            if (tag.startsWith("W/")) {
+                tag = tag.mid(2);
+            }
+            if (tag == etag) {
+                return true;
+            }
+        }
+        return false;
+    }
+    const QDateTime &since = getModifedSince();
+    if (!since.isValid()) {
+        return false;
+    }
+    return lastModified.toMSecsSinceEpoch() / 1000 <= since.toMSecsSinceEpoch() / 1000;
+}
+
+
+bool SimpleHttpRequestHandler::parseRanges(qint64 size, const QByteArray &etag, const QDateTime &lastModified,
+                                           QList<QPair<qint64, qint64>> *ranges)
+{
+    ranges->clear();
+    const QByteArray &range = header(QStringLiteral("Range")).trimmed();
+    if (method != "GET" || range.isEmpty()) {
+        return true;
+    }
+    const QByteArray &ifRange = header(QStringLiteral("If-Range")).trimmed();
+    if (!ifRange.isEmpty()) {
+        // the strong comparison, a weak tag never matches.
+        if (ifRange.startsWith('"') || ifRange.startsWith("W/")) {
+            if (ifRange != etag) {
+                return true;
+            }
+        } else {
+            const QDateTime &date = fromHttpDate(ifRange);
+            if (!date.isValid() || date.toMSecsSinceEpoch() / 1000 != lastModified.toMSecsSinceEpoch() / 1000) {
+                return true;
+            }
+        }
+    }
+    if (!range.toLower().startsWith("bytes=")) {
+        return true;
+    }
+    // too many ranges are more expensive than the whole file.
+    const int MaxRanges = 16;
+    const QByteArrayList &specs = range.mid(6).split(',');
+    if (specs.size() > MaxRanges) {
+        return true;
+    }
+    QList<QPair<qint64, qint64>> satisfiable;
+    for (const QByteArray &item: specs) {
+        const QByteArray &spec = item.trimmed();
+        int dash = spec.indexOf('-');
+        if (dash < 0) {
+            return true;
+        }
+        bool ok1 = true, ok2 = true;
+        const QByteArray &firstStr = spec.left(dash).trimmed();
+        const QByteArray &lastStr = spec.mid(dash + 1).trimmed();
+        qint64 first, last;
+        if (firstStr.isEmpty()) {
+            // the suffix range, the last n bytes.
+            qint64 n = lastStr.toLongLong(&ok2);
+            if (!ok2 || n < 0) {
+                return true;
+            }
+            if (n == 0 || size == 0) {
+                continue;
+            }
+            first = qMax<qint64>(0, size - n);
+            last = size - 1;
+        } else {
+            first = firstStr.toLongLong(&ok1);
+            last = lastStr.isEmpty() ? size - 1 : lastStr.toLongLong(&ok2);
+            if (!ok1 || !ok2 || first < 0 || last < first) {
+                return true;
+            }
+            if (first >= size) {
+                continue;
+            }
+            last = qMin(last, size - 1);
+        }
+        satisfiable.append(qMakePair(first, last));
+    }
+    if (satisfiable.isEmpty()) {
+        return false;
+    }
+    std::sort(satisfiable.begin(), satisfiable.end());
+    for (const QPair<qint64, qint64> &r: satisfiable) {
+        if (!ranges->isEmpty() && r.first <= ranges->last().second + 1) {
+            ranges->last().second = qMax(ranges->last().second, r.second);
+        } else {
+            ranges->append(r);
+        }
+    }
+    return true;
+}
+
+
+bool SimpleHttpRequestHandler::sendRanges(QSharedPointer<FileLike> f, qint64 size,
+                                          const QList<QPair<qint64, qint64>> &ranges, const QByteArray &contentType,
+                                          const QByteArray &etag, const QByteArray &lastModified)
+{
+    sendResponse(HttpStatus::PartialContent);
+    sendHeader("Last-Modified", lastModified);
+    sendHeader("ETag", etag);
+    sendHeader("Accept-Ranges", "bytes");
+    if (version == Http1_1 && !closeConnection) {
+        sendHeader("Connection", "keep-alive");
+    }
+    const QByteArray &total = QByteArray::number(size);
+    if (ranges.size() == 1) {
+        const QPair<qint64, qint64> &r = ranges.first();
+        sendHeader("Content-Type", contentType);
+        sendHeader("Content-Range", "bytes " + QByteArray::number(r.first) + "-" + QByteArray::number(r.second)
+                   + "/" + total);
+        sendHeader("Content-Length", QByteArray::number(r.second - r.first + 1));
+        if (!endHeader()) {
+            return false;
+        }
+        return sendFileRange(f, r.first, r.second - r.first + 1);
+    }
+
+    // multipart/byteranges of rfc 7233 appendix a. the part headers are known before sending, so is the length.
+    const QByteArray &boundary = "qtng-" + QByteArray::number(QDateTime::currentMSecsSinceEpoch(), 16)
+            + QByteArray::number(qrand(), 16);
+    QByteArrayList partHeaders;
+    qint64 contentLength = 0;
+    for (const QPair<qint64, qint64> &r: ranges) {
+        const QByteArray &partHeader = "\r\n--" + boundary + "\r\nContent-Type: " + contentType
+                + "\r\nContent-Range: bytes " + QByteArray::number(r.first) + "-" + QByteArray::number(r.second)
+                + "/" + total + "\r\n\r\n";
+        partHeaders.append(partHeader);
+        contentLength += partHeader.size() + r.second - r.first + 1;
+    }
+    const QByteArray &closing = "\r\n--" + boundary + "--\r\n";
+    contentLength += closing.size();
+    sendHeader("Content-Type", "multipart/byteranges; boundary=" + boundary);
+    sendHeader("Content-Length", QByteArray::number(contentLength));
+    if (!endHeader()) {
+        return false;
+    }
+    for (int i = 0; i < ranges.size(); ++i) {
+        const QPair<qint64, qint64> &r = ranges.at(i);
+        const QByteArray &partHeader = partHeaders.at(i);
+        if (request->sendall(partHeader) != partHeader.size() || !sendFileRange(f, r.first, r.second - r.first + 1)) {
+            return false;
+        }
+    }
+    return request->sendall(closing) == closing.size();
+}
+
+
+QFileInfo SimpleHttpRequestHandler::translatePath(const QString &path)
+{
+    // remove '.' && '.."
+    const QStringList &list = path.split("/", QString::SkipEmptyParts);
+    QStringList l;
+    for (const QString &part: list) {
+        if (part == ".") { // if part contains space, it is not dot dir.
+            continue;
+        } else if (part == "..") {
+            if (!l.isEmpty()) {
+                l.removeLast();
+            }
+        } else {
+            l.append(part);
+        }
+    }
+    QString normalPath = l.join("/");
+    return QFileInfo(rootDir, normalPath);
+}
+
+struct IdleUpstreamConnection
+{
+    QSharedPointer<SocketLike> connection;
+    QThread *thread;
+    qint64 idleSince;
+};
+
+
+class ReverseProxyPrivate
+{
+public:
+    ReverseProxyPrivate()
+        :healthChecks(new CoroutineGroup), balancing(ReverseProxy::RoundRobin), next(0), maxIdleConnections(16)
+        , idleTimeout(30000), timeout(10.0f) {}
+    ~ReverseProxyPrivate() { delete healthChecks; }
+    void checkHealth(float intervalSecs);
+public:
+    mutable QMutex mutex;   // the servers of acceptor threads share the proxy.
+    QList<ReverseProxyUpstream> upstreams;
+    QList<QList<IdleUpstreamConnection>> idleConnections;  // the newest last, for every upstream.
+    CoroutineGroup *healthChecks;
+    ReverseProxy::Balancing balancing;
+    int next;
+    int maxIdleConnections;
+    qint64 idleTimeout;
+    float timeout;
+};
+
+
+static QAtomicPointer<ReverseProxy> installedReverseProxy;
+
+
+static QSharedPointer<SocketLike> connectUpstream(const QString &host, quint16 port, float timeout)
+{
+    QSharedPointer<Socket> socket(new Socket());
+    socket->setOption(Socket::LowDelayOption, true);
+    try {
+        Timeout t(timeout); Q_UNUSED(t);
+        if (!socket->connect(host, port)) {
+            return QSharedPointer<SocketLike>();
+        }
+    } catch (TimeoutException &) {
+        return QSharedPointer<SocketLike>();
+    }
+    return SocketLike::rawSocket(socket);
+}
+
+
+void ReverseProxyPrivate::checkHealth(float intervalSecs)
+{
+    while (true) {
+        QList<ReverseProxyUpstream> targets;
+        float t;
+        {
+            QMutexLocker locker(&mutex);
+            targets = upstreams;
+            t = timeout;
+        }
+        for (int i = 0; i < targets.size(); ++i) {
+            QSharedPointer<SocketLike> connection = connectUpstream(targets.at(i).host, targets.at(i).port, t);
+            const bool healthy = !connection.isNull();
+            if (healthy) {
+                connection->close();
+            }
+            QMutexLocker locker(&mutex);
+            if (i < upstreams.size()) {
+                upstreams[i].healthy = healthy;
+            }
+        }
+        Coroutine::sleep(intervalSecs);
+    }
+}
+
+
+ReverseProxy::ReverseProxy()
+    :d_ptr(new ReverseProxyPrivate())
+{
+}
+
+
+ReverseProxy::~ReverseProxy()
+{
+    installedReverseProxy.testAndSetOrdered(this, nullptr);
+    delete d_ptr;
+}
+
+
+void ReverseProxy::addUpstream(const QString &host, quint16 port)
+{
+    Q_D(ReverseProxy);
+    QMutexLocker locker(&d->mutex);
+    d->upstreams.append(ReverseProxyUpstream(host, port));
+    d->idleConnections.append(QList<IdleUpstreamConnection>());
+}
+
+
+QList<ReverseProxyUpstream> ReverseProxy::upstreams() const
+{
+    Q_D(const ReverseProxy);
+    QMutexLocker locker(&d->mutex);
+    return d->upstreams;
+}
+
+
+void ReverseProxy::setBalancing(Balancing balancing)
+{
+    Q_D(ReverseProxy);
+    QMutexLocker locker(&d->mutex);
+    d->balancing = balancing;
+}
+
+
+ReverseProxy::Balancing ReverseProxy::balancing() const
+{
+    Q_D(const ReverseProxy);
+    QMutexLocker locker(&d->mutex);
+    return d->balancing;
+}
+
+
+void ReverseProxy::setMaxIdleConnections(int maxIdleConnections)
+{
+    Q_D(ReverseProxy);
+    QMutexLocker locker(&d->mutex);
+    d->maxIdleConnections = qMax(0, maxIdleConnections);
 }
 
 
-void BaseHttpRequestHandler::logError(HttpStatus status, const QString &shortMessage, const QString &)
+void ReverseProxy::setIdleTimeout(float secs)
 {
-    QString msg = QStringLiteral("%1 %2 %3 %4").arg(method).arg(path).arg(static_cast<int>(status)).arg(shortMessage);
-    qDebug() << request->peerAddress().toString() << "--" << QDateTime::currentDateTime().toString(Qt::ISODate) << msg;
+    Q_D(ReverseProxy);
+    QMutexLocker locker(&d->mutex);
+    d->idleTimeout = static_cast<qint64>(secs * 1000);
 }
 
 
-void SimpleHttpRequestHandler::doGET()
+void ReverseProxy::setTimeout(float secs)
 {
-    QSharedPointer<FileLike> f = serveStaticFiles();
-    if (!f.isNull()) {
-        sendFile(f);
-        f->close();
-    }
+    Q_D(ReverseProxy);
+    QMutexLocker locker(&d->mutex);
+    d->timeout = secs;
 }
 
-void SimpleHttpRequestHandler::doHEAD()
+
+float ReverseProxy::timeout() const
 {
-    QSharedPointer<FileLike> f = serveStaticFiles();
-    if (!f.isNull()) {
-        f->close();
-    }
+    Q_D(const ReverseProxy);
+    QMutexLocker locker(&d->mutex);
+    return d->timeout;
 }
 
-QSharedPointer<FileLike> SimpleHttpRequestHandler::serveStaticFiles()
+
+void ReverseProxy::startHealthChecks(float intervalSecs)
 {
-    QUrl url = QUrl::fromEncoded(path.toLatin1());
-    QFileInfo fileInfo = translatePath(url.path());
-#ifdef DEBUG_HTTP_PROTOCOL
-    qDebug() << "serve path" << url.path() << fileInfo.absoluteFilePath();
-#endif
-    if (!fileInfo.exists()) {
-        sendError(HttpStatus::NotFound, "File not found");
-        return QSharedPointer<FileLike>();
+    Q_D(ReverseProxy);
+    d->healthChecks->spawnWithName(QStringLiteral("health_checks"), [d, intervalSecs] {
+        d->checkHealth(intervalSecs);
+    }, true);
+}
+
+
+void ReverseProxy::stopHealthChecks()
+{
+    Q_D(ReverseProxy);
+    d->healthChecks->killall();
+}
+
+
+void ReverseProxy::install(ReverseProxy *proxy)
+{
+    installedReverseProxy.storeRelease(proxy);
+}
+
+
+ReverseProxy *ReverseProxy::installed()
+{
+    return installedReverseProxy.loadAcquire();
+}
+
+
+int ReverseProxy::pick()
+{
+    Q_D(ReverseProxy);
+    QMutexLocker locker(&d->mutex);
+    const int n = d->upstreams.size();
+    if (n == 0) {
+        return -1;
+    }
+    // all upstreams are tried if none is healthy, the health checks may be wrong.
+    bool anyHealthy = false;
+    for (const ReverseProxyUpstream &upstream: d->upstreams) {
+        anyHealthy = anyHealthy || upstream.healthy;
+    }
+    int index = -1;
+    if (d->balancing == LeastConnections) {
+        for (int i = 0; i < n; ++i) {
+            const ReverseProxyUpstream &upstream = d->upstreams.at(i);
+            if ((upstream.healthy || !anyHealthy) && (index < 0 || upstream.active < d->upstreams.at(index).active)) {
+                index = i;
+            }
+        }
+    } else {
+        for (int i = 0; i < n && index < 0; ++i) {
+            const int candidate = (d->next + i) % n;
+            if (d->upstreams.at(candidate).healthy || !anyHealthy) {
+                index = candidate;
+            }
+        }
+        d->next = (index + 1) % n;
     }
+    ++d->upstreams[index].active;
+    return index;
+}
 
-    if (fileInfo.isDir()) {
-        const QString &p = url.toString(QUrl::RemoveQuery | QUrl::RemoveFragment | QUrl::FullyDecoded);
-        if (!p.endsWith("/")) {
-            url.setPath(p + "/");
-            sendResponse(HttpStatus::MovedPermanently);
-            sendHeader("Location", url.toEncoded(QUrl::FullyEncoded));
-            endHeader();
-            return QSharedPointer<FileLike>();
-        } else {
-            QDir dir(fileInfo.filePath());
-            if (dir.exists("index.html")) {
-                fileInfo = dir.filePath("index.html");
-            } else if (dir.exists("index.htm")) {
-                fileInfo = dir.filePath("index.htm");
-            } else {
-                return listDirectory(dir, p);
+
+QSharedPointer<SocketLike> ReverseProxy::take(int index, bool *reused)
+{
+    Q_D(ReverseProxy);
+    QString host;
+    quint16 port;
+    float timeout;
+    {
+        QMutexLocker locker(&d->mutex);
+        const qint64 now = QDateTime::currentMSecsSinceEpoch();
+        QList<IdleUpstreamConnection> &idle = d->idleConnections[index];
+        for (int i = idle.size() - 1; i >= 0; --i) {
+            if (now - idle.at(i).idleSince > d->idleTimeout) {
+                // closed by the thread made it.
+                if (idle.at(i).thread == QThread::currentThread()) {
+                    idle.at(i).connection->close();
+                    idle.removeAt(i);
+                }
+                continue;
+            }
+            if (idle.at(i).thread == QThread::currentThread()) {
+                QSharedPointer<SocketLike> connection = idle.takeAt(i).connection;
+                *reused = true;
+                return connection;
             }
         }
+        host = d->upstreams.at(index).host;
+        port = d->upstreams.at(index).port;
+        timeout = d->timeout;
     }
+    *reused = false;
+    QSharedPointer<SocketLike> connection = connectUpstream(host, port, timeout);
+    if (connection.isNull()) {
+        QMutexLocker locker(&d->mutex);
+        d->upstreams[index].healthy = false;
+    }
+    return connection;
+}
 
-    QString contentType;
 
-#ifdef Q_OS_ANDROID
-    const QString &ext = fileInfo.completeSuffix().toLower();
-    if (ext == "txt") {
-        contentType = "text/plain";
-    } else if (ext == "html" || ext == "htm") {
-        contentType = "text/html";
-    } else if (ext == "js") {
-        contentType = "application/javascript";
-    } else if (ext == "css") {
-        contentType = "text/css";
-    } else {
-        contentType = "application/octet-stream";
+void ReverseProxy::release(int index, QSharedPointer<SocketLike> connection, bool reusable)
+{
+    Q_D(ReverseProxy);
+    QMutexLocker locker(&d->mutex);
+    --d->upstreams[index].active;
+    if (connection.isNull()) {
+        return;
     }
-#else
-    QMimeDatabase db;
-    const QMimeType &ctype = db.mimeTypeForFile(fileInfo);
-    if (!ctype.isValid()) {
-        contentType = "application/octet-stream";
-    } else {
-        contentType = ctype.name();
+    QList<IdleUpstreamConnection> &idle = d->idleConnections[index];
+    if (!reusable || idle.size() >= d->maxIdleConnections) {
+        connection->close();
+        return;
     }
-#endif
-    QSharedPointer<QFile> f(new QFile(fileInfo.filePath()));
-    if (!f->open(QIODevice::ReadOnly)) {
-        sendError(HttpStatus::NotFound, "File not found");
-        return QSharedPointer<FileLike>();
+    IdleUpstreamConnection item;
+    item.connection = connection;
+    item.thread = QThread::currentThread();
+    item.idleSince = QDateTime::currentMSecsSinceEpoch();
+    idle.append(item);
+}
+
+
+// rfc 7230 section 6.1, and the headers named by Connection.
+static bool isHopByHopHeader(const QString &name, const QByteArrayList &connectionOptions)
+{
+    static const char * const hopByHopHeaders[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate", "Proxy-Authorization", "TE",
+        "Trailer", "Transfer-Encoding", "Upgrade",
+    };
+    for (const char *h: hopByHopHeaders) {
+        if (name.compare(QLatin1String(h), Qt::CaseInsensitive) == 0) {
+            return true;
+        }
     }
-    sendResponse(HttpStatus::OK);
-    sendHeader("Content-Type", contentType.toUtf8());
-    sendHeader("Content-Length", QByteArray::number(f->size()));
-    sendHeader("Last-Modified", fileInfo.lastModified().toString(Qt::RFC2822Date).toUtf8());
-    if (version == Http1_1 && !closeConnection) {
-        sendHeader("Connection", "keep-alive");
+    for (const QByteArray &option: connectionOptions) {
+        if (name.compare(QLatin1String(option), Qt::CaseInsensitive) == 0) {
+            return true;
+        }
     }
-    endHeader();
-    return FileLike::rawFile(f);
+    return false;
 }
 
-QSharedPointer<FileLike> SimpleHttpRequestHandler::listDirectory(const QDir &dir, const QString &displayDir)
+
+static QByteArrayList connectionOptionsOf(const QByteArray &connectionHeader)
 {
-    const QFileInfoList &list = dir.entryInfoList(QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot);
-    const QString &title = QStringLiteral("Directory listing for ") + displayDir;
-    QStringList html;
-    html.append("<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01//EN\" \"http://www.w3.org/TR/html4/strict.dtd\">");
-    html.append("<html>\n<head>");
-    html.append("<meta http-equiv=\"Content-Type\" content=\"text/html; charset=utf-8\">");
-    html.append(QStringLiteral("<title>%1</title>\n</head>").arg(title));
-    html.append(QStringLiteral("<body>\n<h1>%1</h1>").arg(title));
-    html.append("<hr>\n<ul>");
-    for (const QFileInfo &entry: list) {
-        QString name = entry.fileName();
-        QString link = entry.fileName();
-        if (entry.isDir()) {
-            name.append("/");
-            link.append("/");
+    QByteArrayList options;
+    for (const QByteArray &option: connectionHeader.split(',')) {
+        const QByteArray &o = option.trimmed();
+        if (!o.isEmpty()) {
+            options.append(o);
         }
-        if (entry.isSymLink()) {
-            name = entry.fileName() + "@";
-            // Note: a link to a directory displays with @ and links with /
+    }
+    return options;
+}
+
+
+ReverseProxy *ReverseProxyRequestHandler::reverseProxy()
+{
+    return ReverseProxy::installed();
+}
+
+
+QList<HttpHeader> ReverseProxyRequestHandler::upstreamHeaders()
+{
+    const QByteArrayList &options = connectionOptionsOf(header(ConnectionHeader));
+    QList<HttpHeader> headers;
+    QByteArray forwardedFor;
+    for (const HttpHeader &h: allHeaders()) {
+        // the framing is decided again, and "100 Continue" is answered by bodyReader().
+        if (isHopByHopHeader(h.name, options) || h.name.compare(QLatin1String("Content-Length"), Qt::CaseInsensitive) == 0
+                || h.name.compare(QLatin1String("Expect"), Qt::CaseInsensitive) == 0) {
+            continue;
         }
-        const QString &htmlName = name.toHtmlEscaped();
-        const QString &htmlLink = link.toUtf8().toPercentEncoding("/");
-        html.append(QStringLiteral("<li><a href=\"%1\">%2</a></li>").arg(htmlLink).arg(htmlName));
+        if (h.name.compare(QLatin1String("X-Forwarded-For"), Qt::CaseInsensitive) == 0) {
+            forwardedFor = h.value + ", ";
+            continue;
+        }
+        headers.append(h);
     }
-    html.append("</ul>\n<hr>\n</body>\n</html>");
-    const QByteArray &data = html.join("\n").toUtf8();
-    sendResponse(HttpStatus::OK);
-    sendHeader("Content-Type", "text/html; charset=utf-8");
-    sendHeader("Content-Length", QByteArray::number(data.size()));
-    endHeader();
-    return FileLike::bytes(data);
+    forwardedFor.append(request->peerAddress().toString().toLatin1());
+    headers.append(HttpHeader(QStringLiteral("X-Forwarded-For"), forwardedFor));
+    if (!hasHeader(QStringLiteral("X-Forwarded-Proto"))) {
+        headers.append(HttpHeader(QStringLiteral("X-Forwarded-Proto"), server->isSecure() ? "https" : "http"));
+    }
+    return headers;
 }
 
-void SimpleHttpRequestHandler::sendFile(QSharedPointer<FileLike> f)
+
+void ReverseProxyRequestHandler::doMethod()
 {
-    QByteArray buf;
-    buf.resize(1024 * 8);
-    while (!f->atEnd()) {
-        qint64 bs = f->read(buf.data(), buf.size());
-        if (bs <= 0){
+    ReverseProxy *proxy = reverseProxy();
+    const int index = proxy ? proxy->pick() : -1;
+    if (index < 0) {
+        sendError(HttpStatus::BadGateway, QStringLiteral("No upstream server"));
+        return;
+    }
+    // a reused connection may be closed by the upstream just now, try again with a new one.
+    for (int tries = 0; tries < 2; ++tries) {
+        bool reused = false;
+        QSharedPointer<SocketLike> upstream = proxy->take(index, &reused);
+        if (upstream.isNull()) {
             break;
         }
-        bool ok = request->sendall(buf.data(), static_cast<qint32>(bs));
-        if (!ok) {
+        bool retriable = false, reusable = false;
+        bool ok = forward(proxy, upstream, reused, &retriable, &reusable);
+        if (ok || !retriable) {
+            proxy->release(index, ok ? upstream : QSharedPointer<SocketLike>(), ok && reusable);
+            if (!ok) {
+                upstream->close();
+            }
             return;
         }
+        upstream->close();
     }
+    proxy->release(index, QSharedPointer<SocketLike>(), false);
+    sendError(HttpStatus::BadGateway, QStringLiteral("The upstream server is not available"));
 }
 
-QFileInfo SimpleHttpRequestHandler::translatePath(const QString &path)
+
+bool ReverseProxyRequestHandler::forward(ReverseProxy *proxy, QSharedPointer<SocketLike> upstream, bool reused,
+                                         bool *retriable, bool *reusable)
 {
-    // remove '.' && '.."
-    const QStringList &list = path.split("/", QString::SkipEmptyParts);
-    QStringList l;
-    for (const QString &part: list) {
-        if (part == ".") { // if part contains space, it is not dot dir.
-            continue;
-        } else if (part == "..") {
-            if (!l.isEmpty()) {
-                l.removeLast();
+    const bool requestChunked = header(TransferEncodingHeader).toLower().contains("chunked");
+    const qint64 requestLength = requestChunked ? -1 : header(ContentLengthHeader, "0").trimmed().toLongLong();
+    const bool hasBody = requestChunked || requestLength > 0;
+
+    QByteArray head;
+    head.reserve(1024);
+    head.append(method.toLatin1());
+    head.append(' ');
+    head.append(path.toLatin1());
+    head.append(" HTTP/1.1\r\n");
+    for (const HttpHeader &h: upstreamHeaders()) {
+        head.append(h.name.toLatin1());
+        head.append(": ");
+        head.append(h.value);
+        head.append("\r\n");
+    }
+    if (requestChunked) {
+        head.append("Transfer-Encoding: chunked\r\n");
+    } else if (requestLength > 0) {
+        head.append("Content-Length: ");
+        head.append(QByteArray::number(requestLength));
+        head.append("\r\n");
+    }
+    head.append("\r\n");
+    if (upstream->sendall(head) != head.size()) {
+        *retriable = reused && !hasBody;
+        if (!*retriable) {
+            sendError(HttpStatus::BadGateway, QStringLiteral("The upstream server is not available"));
+        }
+        return false;
+    }
+
+    if (hasBody) {
+        QSharedPointer<FileLike> reader = bodyReader();
+        if (reader.isNull()) {
+            // the error is sent already.
+            return false;
+        }
+        QByteArray buf;
+        buf.resize(1024 * 64);
+        while (true) {
+            qint32 readBytes = reader->read(buf.data(), buf.size());
+            if (readBytes < 0) {
+                closeConnection = true;
+                sendError(HttpStatus::BadRequest, QStringLiteral("Bad request body"));
+                return false;
             }
-        } else {
-            l.append(part);
+            if (readBytes == 0) {
+                break;
+            }
+            if (requestChunked) {
+                const QByteArray &size = QByteArray::number(readBytes, 16) + "\r\n";
+                if (upstream->sendall(size) != size.size()) {
+                    break;
+                }
+            }
+            if (upstream->sendall(buf.constData(), readBytes) != readBytes
+                    || (requestChunked && upstream->sendall("\r\n", 2) != 2)) {
+                break;
+            }
+        }
+        if (requestChunked) {
+            upstream->sendall("0\r\n\r\n", 5);
         }
     }
-    QString normalPath = l.join("/");
-    return QFileInfo(rootDir, normalPath);
+
+    HeaderSplitter splitter(upstream);
+    HeaderSplitter::Error error;
+    QByteArray statusLine;
+    QList<HttpHeader> headers;
+    try {
+        Timeout timeout(proxy->timeout()); Q_UNUSED(timeout);
+        while (true) {
+            statusLine = splitter.nextLine(&error);
+            if (statusLine.isEmpty() || error != HeaderSplitter::NoError) {
+                *retriable = reused && !hasBody && splitter.buf.isEmpty();
+                if (!*retriable) {
+                    sendError(HttpStatus::BadGateway, QStringLiteral("Bad response from the upstream server"));
+                }
+                return false;
+            }
+            headers = splitter.headers(64, &error);
+            if (error != HeaderSplitter::NoError) {
+                sendError(HttpStatus::BadGateway, QStringLiteral("Bad response from the upstream server"));
+                return false;
+            }
+            // the interim responses, except 101, are not passed to client.
+            if (!statusLine.startsWith("HTTP/1.1 1") || statusLine.startsWith("HTTP/1.1 101")) {
+                break;
+            }
+        }
+    } catch (TimeoutException &) {
+        sendError(HttpStatus::GatewayTimeout);
+        return false;
+    }
+
+    const QByteArrayList &words = splitBytes(statusLine, ' ', 2);
+    bool ok;
+    const int status = words.size() >= 2 ? words.at(1).toInt(&ok) : 0;
+    if (words.size() < 2 || !ok || status < 100 || status >= 600 || !words.at(0).startsWith("HTTP/1.")) {
+        sendError(HttpStatus::BadGateway, QStringLiteral("Bad response from the upstream server"));
+        return false;
+    }
+    const QString &message = words.size() > 2 ? QString::fromLatin1(words.at(2)) : QString();
+
+    HttpHeaders responseHeaders;
+    responseHeaders.setHeaders(headers);
+    const QByteArray &upstreamConnection = responseHeaders.header(ConnectionHeader).toLower();
+    bool upstreamKeepAlive = words.at(0) == "HTTP/1.1" ? !upstreamConnection.contains("close")
+                                                       : upstreamConnection.contains("keep-alive");
+    const bool responseChunked = responseHeaders.header(TransferEncodingHeader).toLower().contains("chunked");
+    qint64 responseLength = -1;
+    if (!responseChunked) {
+        responseLength = responseHeaders.header(ContentLengthHeader, "-1").trimmed().toLongLong(&ok);
+        if (!ok) {
+            responseLength = -1;
+        }
+    }
+    const bool noBody = method == "HEAD" || status == 204 || status == 304 || status < 200;
+    if (noBody) {
+        responseLength = 0;
+    } else if (responseLength < 0 && !responseChunked) {
+        // the body ends with the connection.
+        upstreamKeepAlive = false;
+        closeConnection = true;
+    }
+    if (responseChunked && version != Http1_1) {
+        closeConnection = true;
+    }
+
+    sendCommandLine(static_cast<HttpStatus>(status), message);
+    const QByteArrayList &options = connectionOptionsOf(responseHeaders.header(ConnectionHeader));
+    for (const HttpHeader &h: headers) {
+        if (!isHopByHopHeader(h.name, options)) {
+            sendHeader(h.name.toLatin1(), h.value);
+        }
+    }
+    if (!noBody && responseChunked && version == Http1_1) {
+        sendHeader("Transfer-Encoding", "chunked");
+    }
+    if (closeConnection) {
+        sendHeader("Connection", "close");
+    } else if (version == Http1_0) {
+        sendHeader("Connection", "keep-alive");
+    }
+    if (!endHeader()) {
+        closeConnection = true;
+        return false;
+    }
+    if (noBody) {
+        *reusable = upstreamKeepAlive && splitter.buf.isEmpty();
+        return true;
+    }
+    if (!forwardResponseBody(splitter, responseLength, responseChunked, reusable)) {
+        closeConnection = true;
+        return false;
+    }
+    *reusable = *reusable && upstreamKeepAlive;
+    return true;
+}
+
+
+bool ReverseProxyRequestHandler::forwardResponseBody(HeaderSplitter &splitter, qint64 contentLength, bool chunked,
+                                                     bool *reusable)
+{
+    const qint32 BlockSize = 1024 * 64;
+    QSharedPointer<SocketLike> upstream = splitter.connection;
+    if (chunked) {
+        ChunkedBlockReader reader(upstream, splitter.buf);
+        reader.debugLevel = 0;
+        const bool rechunk = version == Http1_1;
+        while (true) {
+            ChunkedBlockReader::Error error;
+            const QByteArray &block = reader.nextBlock(std::numeric_limits<qint32>::max(), &error);
+            if (error != ChunkedBlockReader::NoError) {
+                return false;
+            }
+            if (block.isEmpty()) {
+                break;
+            }
+            QByteArrayList data;
+            if (rechunk) {
+                data.append(QByteArray::number(block.size(), 16) + "\r\n");
+            }
+            data.append(block);
+            if (rechunk) {
+                data.append(QByteArray("\r\n"));
+            }
+            qint32 size = 0;
+            for (const QByteArray &d: data) {
+                size += d.size();
+            }
+            if (request->sendallv(data) != size) {
+                return false;
+            }
+        }
+        if (rechunk && request->sendall("0\r\n\r\n", 5) != 5) {
+            return false;
+        }
+        *reusable = reader.buf.isEmpty();
+        return true;
+    }
+
+    QByteArray buf = splitter.buf;
+    qint64 left = contentLength;
+    while (left != 0) {
+        if (buf.isEmpty()) {
+            buf = recvSized(upstream.data(), BlockSize, static_cast<qint32>(left < 0 ? INT_MAX : qMin<qint64>(left, INT_MAX)));
+            if (buf.isEmpty()) {
+                // the end of body if it ends with the connection.
+                return left < 0;
+            }
+        }
+        if (left >= 0 && buf.size() > left) {
+            // the bytes after body, the upstream misbehaves.
+            buf.truncate(static_cast<int>(left));
+            *reusable = false;
+            if (request->sendall(buf) != buf.size()) {
+                return false;
+            }
+            return true;
+        }
+        if (request->sendall(buf) != buf.size()) {
+            return false;
+        }
+        if (left > 0) {
+            left -= buf.size();
+        }
+        buf.clear();
+    }
+    *reusable = true;
+    return true;
+}
+
+
+void SimpleHttpServer::rejectRequest(QSharedPointer<SocketLike> request)
+{
+    // the send buffer of new connection is empty, so this does not block the accepting coroutine.
+    static const QByteArray response = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n"
+                                       "Retry-After: 1\r\nConnection: close\r\n\r\n";
+    request->send(response);
+    request->close();
 }
 
+
 void SimpleHttpServer::processRequest(QSharedPointer<SocketLike> request)
 {
-    SimpleHttpRequestHandler handler(request, this);
-    handler.run();
+    serveHttpRequest<SimpleHttpRequestHandler>(request, this);
 }
 
 
@@ -511,8 +3123,17 @@ void SimpleHttpServer::processRequest(QSharedPointer<SocketLike> request)
 
 void SimpleHttpsServer::processRequest(QSharedPointer<SocketLike> request)
 {
-    SimpleHttpRequestHandler handler(request, this);
-    handler.run();
+    serveHttpRequest<SimpleHttpRequestHandler>(request, this);
+}
+
+
+void SimpleHttpsServer::offerHttp2()
+{
+    SslConfiguration configuration = sslConfiguratino();
+    if (configuration.allowedNextProtocols().isEmpty()) {
+        configuration.setAllowedNextProtocols(QList<QByteArray>() << "h2" << "http/1.1");
+        setSslConfiguration(configuration);
+    }
 }
 
 #endif
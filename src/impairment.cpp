@@ -0,0 +1,347 @@
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qmap.h>
+#include "../include/impairment.h"
+#include "../include/coroutine_utils.h"
+#include "../include/locks.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+
+struct DelayedDatagram
+{
+    QSharedPointer<Socket> socket;
+    QByteArray data;
+    QHostAddress addr;
+    quint16 port;
+};
+
+
+class NetworkImpairerPrivate
+{
+public:
+    NetworkImpairerPrivate(const NetworkImpairment &impairment);
+    ~NetworkImpairerPrivate();
+public:
+    qint64 now() const { return clock.nsecsElapsed() / 1000; }
+    // [0, 1), the same on all platforms for the same seed.
+    double random();
+    // the usecs to the end of sending size bytes by the bandwidth, returns false if the queue is too long.
+    bool reserve(qint32 size, bool queueLimited, qint64 *wait);
+    qint64 latency();
+    void schedule(qint64 due, const DelayedDatagram &datagram);
+    void deliver();
+public:
+    NetworkImpairment impairment;
+    NetworkImpairmentStats stats;
+    QElapsedTimer clock;
+    quint64 state;
+    qint64 linkFreeAt;      // the bandwidth is busy until it, in usecs of clock.
+    QMultiMap<qint64, DelayedDatagram> delayed;
+    QSharedPointer<Event> delayedChanged;
+    CoroutineGroup *operations;
+};
+
+
+NetworkImpairerPrivate::NetworkImpairerPrivate(const NetworkImpairment &impairment)
+    :impairment(impairment), linkFreeAt(0), delayedChanged(new Event()), operations(new CoroutineGroup())
+{
+    clock.start();
+    // splitmix64 spreads the small seeds over the state of xorshift64*.
+    quint64 z = static_cast<quint64>(impairment.seed) + Q_UINT64_C(0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * Q_UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * Q_UINT64_C(0x94d049bb133111eb);
+    state = (z ^ (z >> 31)) | 1;
+}
+
+
+NetworkImpairerPrivate::~NetworkImpairerPrivate()
+{
+    delete operations;
+}
+
+
+double NetworkImpairerPrivate::random()
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return static_cast<double>((state * Q_UINT64_C(0x2545f4914f6cdd1d)) >> 11) / 9007199254740992.0;
+}
+
+
+bool NetworkImpairerPrivate::reserve(qint32 size, bool queueLimited, qint64 *wait)
+{
+    if (impairment.bytesPerSecond <= 0) {
+        *wait = 0;
+        return true;
+    }
+    const qint64 t = now();
+    const qint64 start = qMax(t, linkFreeAt);
+    if (queueLimited && start - t > static_cast<qint64>(impairment.queueMsecs) * 1000) {
+        return false;
+    }
+    linkFreeAt = start + static_cast<qint64>(size) * 1000 * 1000 / impairment.bytesPerSecond;
+    *wait = linkFreeAt - t;
+    return true;
+}
+
+
+qint64 NetworkImpairerPrivate::latency()
+{
+    const double jitter = (random() * 2.0 - 1.0) * impairment.jitterMsecs;
+    return qMax<qint64>(0, static_cast<qint64>((impairment.latencyMsecs + jitter) * 1000));
+}
+
+
+void NetworkImpairerPrivate::schedule(qint64 due, const DelayedDatagram &datagram)
+{
+    ++stats.delayed;
+    delayed.insert(due, datagram);
+    if (!operations->get(QStringLiteral("deliver"))) {
+        operations->spawnWithName(QStringLiteral("deliver"), [this] { deliver(); });
+    }
+    delayedChanged->set();
+}
+
+
+void NetworkImpairerPrivate::deliver()
+{
+    while (true) {
+        delayedChanged->clear();
+        if (delayed.isEmpty()) {
+            delayedChanged->wait();
+            continue;
+        }
+        QMultiMap<qint64, DelayedDatagram>::iterator itor = delayed.begin();
+        const qint64 wait = itor.key() - now();
+        if (wait > 0) {
+            try {
+                Timeout timeout(static_cast<quint32>((wait + 999) / 1000), 0); Q_UNUSED(timeout);
+                delayedChanged->wait();
+            } catch (TimeoutException &) {
+                // continue
+            }
+            continue;
+        }
+        const DelayedDatagram datagram = itor.value();
+        delayed.erase(itor);
+        datagram.socket->sendto(datagram.data, datagram.addr, datagram.port);
+    }
+}
+
+
+NetworkImpairer::NetworkImpairer(const NetworkImpairment &impairment)
+    :d_ptr(new NetworkImpairerPrivate(impairment))
+{
+}
+
+
+NetworkImpairer::~NetworkImpairer()
+{
+    delete d_ptr;
+}
+
+
+NetworkImpairment NetworkImpairer::impairment() const
+{
+    Q_D(const NetworkImpairer);
+    return d->impairment;
+}
+
+
+NetworkImpairmentStats NetworkImpairer::stats() const
+{
+    Q_D(const NetworkImpairer);
+    return d->stats;
+}
+
+
+qint32 NetworkImpairer::sendto(QSharedPointer<Socket> socket, const char *data, qint32 size, const QHostAddress &addr, quint16 port)
+{
+    Q_D(NetworkImpairer);
+    ++d->stats.sent;
+    // the random numbers are drawn in the same order whatever the rates are.
+    const bool lost = d->random() < d->impairment.lossRate;
+    const bool duplicated = d->random() < d->impairment.duplicateRate;
+    if (lost) {
+        ++d->stats.dropped;
+        return size;
+    }
+    if (duplicated) {
+        ++d->stats.duplicated;
+    }
+    for (int copies = duplicated ? 2 : 1; copies > 0; --copies) {
+        qint64 delay;
+        if (!d->reserve(size, true, &delay)) {
+            ++d->stats.dropped;
+            continue;
+        }
+        const qint64 latency = d->latency();
+        if (d->random() < d->impairment.reorderRate) {
+            ++d->stats.reordered;
+        } else {
+            delay += latency;
+        }
+        if (delay <= 0) {
+            if (socket->sendto(data, size, addr, port) != size) {
+                return -1;
+            }
+        } else {
+            DelayedDatagram datagram = { socket, QByteArray(data, size), addr, port };
+            d->schedule(d->now() + delay, datagram);
+        }
+    }
+    return size;
+}
+
+
+// not in an anonymous namespace, NetworkImpairer befriends it.
+class ImpairedSocketLike: public SocketLike
+{
+public:
+    ImpairedSocketLike(QSharedPointer<NetworkImpairer> impairer, QSharedPointer<SocketLike> s);
+    virtual ~ImpairedSocketLike() override;
+public:
+    virtual Socket::SocketError error() const override { return s->error(); }
+    virtual QString errorString() const override { return s->errorString(); }
+    virtual bool isValid() const override { return s->isValid(); }
+    virtual QHostAddress localAddress() const override { return s->localAddress(); }
+    virtual quint16 localPort() const override { return s->localPort(); }
+    virtual QHostAddress peerAddress() const override { return s->peerAddress(); }
+    virtual QString peerName() const override { return s->peerName(); }
+    virtual quint16 peerPort() const override { return s->peerPort(); }
+    virtual qintptr fileno() const override { return s->fileno(); }
+    virtual Socket::SocketType type() const override { return s->type(); }
+    virtual Socket::SocketState state() const override { return s->state(); }
+    virtual Socket::NetworkLayerProtocol protocol() const override { return s->protocol(); }
+
+    virtual Socket *acceptRaw() override { return s->acceptRaw(); }
+    virtual QSharedPointer<SocketLike> accept() override { return s->accept(); }
+    virtual bool bind(QHostAddress &address, quint16 port, Socket::BindMode mode) override { return s->bind(address, port, mode); }
+    virtual bool bind(quint16 port, Socket::BindMode mode) override { return s->bind(port, mode); }
+    virtual bool connect(const QHostAddress &addr, quint16 port) override { return s->connect(addr, port); }
+    virtual bool connect(const QString &hostName, quint16 port, Socket::NetworkLayerProtocol protocol) override
+    { return s->connect(hostName, port, protocol); }
+    virtual bool close() override;
+    virtual bool listen(int backlog) override { return s->listen(backlog); }
+    virtual bool setOption(Socket::SocketOption option, const QVariant &value) override { return s->setOption(option, value); }
+    virtual QVariant option(Socket::SocketOption option) const override { return s->option(option); }
+    virtual SocketIoStats ioStats() const override { return s->ioStats(); }
+    virtual qint32 bufferedBytes() const override { return s->bufferedBytes(); }
+
+    virtual qint32 recv(char *data, qint32 size) override { return s->recv(data, size); }
+    virtual qint32 recvall(char *data, qint32 size) override { return s->recvall(data, size); }
+    virtual qint32 send(const char *data, qint32 size) override { return sendall(data, size); }
+    virtual qint32 sendall(const char *data, qint32 size) override;
+    virtual QByteArray recv(qint32 size) override { return s->recv(size); }
+    virtual QByteArray recvall(qint32 size) override { return s->recvall(size); }
+    virtual qint32 send(const QByteArray &data) override { return sendall(data.constData(), data.size()); }
+    virtual qint32 sendall(const QByteArray &data) override { return sendall(data.constData(), data.size()); }
+private:
+    void deliver();
+private:
+    static const qint64 MaxPendingBytes = 1024 * 1024;
+    QSharedPointer<NetworkImpairer> impairer;
+    QSharedPointer<SocketLike> s;
+    QList<QPair<qint64, QByteArray>> pending;   // by due time, the latency of streams keeps the order.
+    qint64 pendingBytes;
+    qint64 lastDue;
+    QSharedPointer<Event> pendingChanged;
+    QSharedPointer<Event> pendingSent;
+    CoroutineGroup *operations;
+    bool broken;
+};
+
+
+ImpairedSocketLike::ImpairedSocketLike(QSharedPointer<NetworkImpairer> impairer, QSharedPointer<SocketLike> s)
+    :impairer(impairer), s(s), pendingBytes(0), lastDue(0), pendingChanged(new Event()), pendingSent(new Event())
+    , operations(new CoroutineGroup()), broken(false)
+{
+}
+
+
+ImpairedSocketLike::~ImpairedSocketLike()
+{
+    delete operations;
+}
+
+
+qint32 ImpairedSocketLike::sendall(const char *data, qint32 size)
+{
+    if (broken) {
+        return -1;
+    }
+    NetworkImpairerPrivate *d = impairer->d_func();
+    ++d->stats.sent;
+    qint64 wait;
+    d->reserve(size, false, &wait);
+    if (wait > 0) {
+        Coroutine::msleep(static_cast<quint32>((wait + 999) / 1000));
+    }
+    const qint64 now = d->now();
+    const qint64 due = qMax(lastDue, now + d->latency());
+    if (due <= now && pending.isEmpty()) {
+        return s->sendall(data, size);
+    }
+    ++d->stats.delayed;
+    lastDue = due;
+    pending.append(qMakePair(due, QByteArray(data, size)));
+    pendingBytes += size;
+    if (!operations->get(QStringLiteral("deliver"))) {
+        operations->spawnWithName(QStringLiteral("deliver"), [this] { deliver(); });
+    }
+    pendingChanged->set();
+    while (pendingBytes > MaxPendingBytes && !broken) {
+        pendingSent->clear();
+        pendingSent->wait();
+    }
+    return broken ? -1 : size;
+}
+
+
+void ImpairedSocketLike::deliver()
+{
+    NetworkImpairerPrivate *d = impairer->d_func();
+    while (true) {
+        pendingChanged->clear();
+        if (pending.isEmpty()) {
+            pendingChanged->wait();
+            continue;
+        }
+        const qint64 wait = pending.first().first - d->now();
+        if (wait > 0) {
+            Coroutine::msleep(static_cast<quint32>((wait + 999) / 1000));
+        }
+        const QByteArray data = pending.takeFirst().second;
+        pendingBytes -= data.size();
+        if (s->sendall(data) != data.size()) {
+            broken = true;
+            pending.clear();
+            pendingBytes = 0;
+        }
+        pendingSent->set();
+    }
+}
+
+
+bool ImpairedSocketLike::close()
+{
+    while (!pending.isEmpty() && !broken) {
+        pendingSent->clear();
+        pendingSent->wait();
+    }
+    operations->killall();
+    return s->close();
+}
+
+
+QSharedPointer<SocketLike> impaired(QSharedPointer<NetworkImpairer> impairer, QSharedPointer<SocketLike> socket)
+{
+    if (impairer.isNull() || socket.isNull()) {
+        return socket;
+    }
+    return QSharedPointer<SocketLike>(new ImpairedSocketLike(impairer, socket));
+}
+
+
+QTNETWORKNG_NAMESPACE_END
@@ -0,0 +1,278 @@
+#include <string.h>
+#include "../include/iobuf.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+// the smallest block made by reserve() and prepend(), the small writes share it.
+static const qint32 MinimumBlockSize = 1024 * 4;
+
+
+IOBuf::IOBuf(const QByteArray &data)
+{
+    append(data);
+}
+
+
+IOBuf IOBuf::withCapacity(qint32 capacity, qint32 headroom)
+{
+    IOBuf buf;
+    Slice slice;
+    slice.block = QByteArray(qMax(0, headroom) + qMax(0, capacity), Qt::Uninitialized);
+    slice.offset = qMax(0, headroom);
+    buf.slices.append(slice);
+    return buf;
+}
+
+
+qint32 IOBuf::size() const
+{
+    qint32 total = 0;
+    for (const Slice &slice: slices) {
+        total += slice.length;
+    }
+    return total;
+}
+
+
+const char *IOBuf::sliceData(int i) const
+{
+    const Slice &slice = slices.at(i);
+    return slice.block.constData() + slice.offset;
+}
+
+
+qint32 IOBuf::headroom() const
+{
+    if (slices.isEmpty() || !slices.isDetached()) {
+        return 0;
+    }
+    const Slice &slice = slices.first();
+    return slice.isWritable() ? slice.offset : 0;
+}
+
+
+qint32 IOBuf::tailroom() const
+{
+    if (slices.isEmpty() || !slices.isDetached()) {
+        return 0;
+    }
+    const Slice &slice = slices.last();
+    return slice.isWritable() ? slice.block.size() - slice.offset - slice.length : 0;
+}
+
+
+char *IOBuf::prepend(qint32 size)
+{
+    if (size <= 0) {
+        return nullptr;
+    }
+    // the non-const first() detaches the vector, so the blocks shared with the copies are not writable any more.
+    if (!slices.isEmpty()) {
+        Slice &first = slices.first();
+        if (first.isWritable() && first.offset >= size) {
+            first.offset -= size;
+            first.length += size;
+            return first.block.data() + first.offset;
+        }
+    }
+    // the new block keeps its headroom for the next prepend(). it is made in place, data() would copy a block
+    // referred by a temporary slice too.
+    const qint32 capacity = qMax(size, MinimumBlockSize);
+    slices.prepend(Slice());
+    Slice &slice = slices.first();
+    slice.block = QByteArray(capacity, Qt::Uninitialized);
+    slice.offset = capacity - size;
+    slice.length = size;
+    return slice.block.data() + slice.offset;
+}
+
+
+char *IOBuf::reserve(qint32 size)
+{
+    if (!slices.isEmpty()) {
+        Slice &last = slices.last();
+        if (last.isWritable() && last.block.size() - last.offset - last.length >= size) {
+            return last.block.data() + last.offset + last.length;
+        }
+        // an empty block left by an unused reserve() is replaced.
+        if (last.length == 0) {
+            slices.removeLast();
+        }
+    }
+    slices.append(Slice());
+    Slice &slice = slices.last();
+    slice.block = QByteArray(qMax(size, MinimumBlockSize), Qt::Uninitialized);
+    return slice.block.data();
+}
+
+
+void IOBuf::commit(qint32 size)
+{
+    if (size <= 0 || slices.isEmpty()) {
+        return;
+    }
+    Slice &last = slices.last();
+    last.length = qMin(last.length + size, last.block.size() - last.offset);
+}
+
+
+void IOBuf::append(const char *data, qint32 size)
+{
+    if (size <= 0) {
+        return;
+    }
+    memcpy(reserve(size), data, static_cast<size_t>(size));
+    commit(size);
+}
+
+
+void IOBuf::append(const QByteArray &data)
+{
+    if (data.isEmpty()) {
+        return;
+    }
+    if (!slices.isEmpty() && slices.last().length == 0) {
+        slices.removeLast();
+    }
+    Slice slice;
+    slice.block = data;
+    slice.offset = 0;
+    slice.length = data.size();
+    slices.append(slice);
+}
+
+
+void IOBuf::append(const IOBuf &other)
+{
+    if (!slices.isEmpty() && slices.last().length == 0) {
+        slices.removeLast();
+    }
+    for (const Slice &slice: other.slices) {
+        if (slice.length > 0) {
+            slices.append(slice);
+        }
+    }
+}
+
+
+void IOBuf::trimStart(qint32 size)
+{
+    while (size > 0 && !slices.isEmpty()) {
+        Slice &first = slices.first();
+        if (first.length > size) {
+            first.offset += size;
+            first.length -= size;
+            return;
+        }
+        size -= first.length;
+        slices.removeFirst();
+    }
+}
+
+
+void IOBuf::trimEnd(qint32 size)
+{
+    while (size > 0 && !slices.isEmpty()) {
+        Slice &last = slices.last();
+        if (last.length > size) {
+            last.length -= size;
+            return;
+        }
+        size -= last.length;
+        slices.removeLast();
+    }
+}
+
+
+IOBuf IOBuf::split(qint32 size)
+{
+    IOBuf head;
+    while (size > 0 && !slices.isEmpty()) {
+        Slice &first = slices.first();
+        if (first.length > size) {
+            Slice part = first;
+            part.length = size;
+            head.slices.append(part);
+            first.offset += size;
+            first.length -= size;
+            return head;
+        }
+        size -= first.length;
+        head.slices.append(first);
+        slices.removeFirst();
+    }
+    return head;
+}
+
+
+qint32 IOBuf::copyTo(char *data, qint32 size, qint32 offset) const
+{
+    qint32 copied = 0;
+    for (const Slice &slice: slices) {
+        if (copied >= size) {
+            break;
+        }
+        if (offset >= slice.length) {
+            offset -= slice.length;
+            continue;
+        }
+        const qint32 n = qMin(slice.length - offset, size - copied);
+        memcpy(data + copied, slice.block.constData() + slice.offset + offset, static_cast<size_t>(n));
+        copied += n;
+        offset = 0;
+    }
+    return copied;
+}
+
+
+void IOBuf::coalesce()
+{
+    if (slices.size() == 1 && slices.first().offset == 0 && slices.first().length == slices.first().block.size()) {
+        return;
+    }
+    const QByteArray &data = toByteArray();
+    slices.clear();
+    append(data);
+}
+
+
+QByteArray IOBuf::toByteArray() const
+{
+    const Slice *whole = nullptr;
+    int nonEmpty = 0;
+    for (const Slice &slice: slices) {
+        if (slice.length > 0) {
+            whole = &slice;
+            ++nonEmpty;
+        }
+    }
+    if (nonEmpty == 0) {
+        return QByteArray();
+    }
+    if (nonEmpty == 1 && whole->offset == 0 && whole->length == whole->block.size()) {
+        return whole->block;
+    }
+    QByteArray data(size(), Qt::Uninitialized);
+    copyTo(data.data(), data.size());
+    return data;
+}
+
+
+QList<QByteArray> IOBuf::toList() const
+{
+    QList<QByteArray> list;
+    for (const Slice &slice: slices) {
+        if (slice.length <= 0) {
+            continue;
+        }
+        if (slice.offset == 0 && slice.length == slice.block.size()) {
+            list.append(slice.block);
+        } else {
+            list.append(QByteArray::fromRawData(slice.block.constData() + slice.offset, slice.length));
+        }
+    }
+    return list;
+}
+
+
+QTNETWORKNG_NAMESPACE_END
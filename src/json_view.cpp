@@ -0,0 +1,545 @@
+#include <string.h>
+#include <QtCore/qvector.h>
+#include <QtCore/qvarlengtharray.h>
+#include <QtCore/qjsondocument.h>
+#include <QtCore/qjsonarray.h>
+#include <QtCore/qjsonobject.h>
+#include "../include/json_view.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+
+struct JsonIndex
+{
+    char charAt(int s) const { return json.at(positions.at(s)); }
+    QByteArray json;
+    QVector<int> positions;     // of the brackets, colons, commas and the opening quotes of strings.
+    QVector<int> partners;      // the closing bracket of an opening one, or the position of the closing quote.
+};
+
+
+static inline bool isStructural(char c)
+{
+    switch (c) {
+    case '{': case '}': case '[': case ']': case ':': case ',': case '"':
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+
+// the end of a string is found by memchr(), which is vectorized by libc, the escaped quotes are skipped.
+static bool buildIndex(JsonIndex *index)
+{
+    const char *data = index->json.constData();
+    const int size = index->json.size();
+    QVarLengthArray<int, 64> opened;
+    index->positions.reserve(size / 8 + 16);
+    index->partners.reserve(size / 8 + 16);
+    int p = 0;
+    while (true) {
+        while (p < size && !isStructural(data[p])) {
+            ++p;
+        }
+        if (p >= size) {
+            break;
+        }
+        const char c = data[p];
+        if (c == '"') {
+            int q = p + 1;
+            while (true) {
+                const char *quote = static_cast<const char *>(memchr(data + q, '"', static_cast<size_t>(size - q)));
+                if (!quote) {
+                    return false;
+                }
+                q = static_cast<int>(quote - data);
+                int backslashes = 0;
+                while (data[q - 1 - backslashes] == '\\') {
+                    ++backslashes;
+                }
+                if (backslashes % 2 == 0) {
+                    break;
+                }
+                ++q;
+            }
+            index->positions.append(p);
+            index->partners.append(q);
+            p = q + 1;
+            continue;
+        }
+        if (c == '{' || c == '[') {
+            opened.append(index->positions.size());
+        } else if (c == '}' || c == ']') {
+            if (opened.isEmpty() || index->charAt(opened.last()) != (c == '}' ? '{' : '[')) {
+                return false;
+            }
+            index->partners[opened.last()] = index->positions.size();
+            opened.removeLast();
+        }
+        index->positions.append(p);
+        index->partners.append(-1);
+        ++p;
+    }
+    return opened.isEmpty();
+}
+
+
+// the end of a number or literal, before the next structural character and the spaces.
+static int scalarEnd(const JsonIndex &index, int position, int structural)
+{
+    int end = structural < index.positions.size() ? index.positions.at(structural) : index.json.size();
+    while (end > position && isSpace(index.json.at(end - 1))) {
+        --end;
+    }
+    return end;
+}
+
+
+static bool parseHex(const char *p, quint32 *code)
+{
+    *code = 0;
+    for (int i = 0; i < 4; ++i) {
+        const char c = p[i];
+        *code <<= 4;
+        if (c >= '0' && c <= '9') {
+            *code |= static_cast<quint32>(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            *code |= static_cast<quint32>(c - 'a' + 10);
+        } else if (c >= 'A' && c <= 'F') {
+            *code |= static_cast<quint32>(c - 'A' + 10);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static bool unescape(const char *p, const char *end, QByteArray *out)
+{
+    out->reserve(static_cast<int>(end - p));
+    while (p < end) {
+        const char *backslash = static_cast<const char *>(memchr(p, '\\', static_cast<size_t>(end - p)));
+        if (!backslash) {
+            out->append(p, static_cast<int>(end - p));
+            return true;
+        }
+        out->append(p, static_cast<int>(backslash - p));
+        p = backslash + 1;
+        if (p >= end) {
+            return false;
+        }
+        const char c = *p++;
+        switch (c) {
+        case '"': case '\\': case '/': out->append(c); break;
+        case 'b': out->append('\b'); break;
+        case 'f': out->append('\f'); break;
+        case 'n': out->append('\n'); break;
+        case 'r': out->append('\r'); break;
+        case 't': out->append('\t'); break;
+        case 'u': {
+            quint32 code;
+            if (end - p < 4 || !parseHex(p, &code)) {
+                return false;
+            }
+            p += 4;
+            if (code >= 0xd800 && code <= 0xdbff) {
+                quint32 low;
+                if (end - p < 6 || p[0] != '\\' || p[1] != 'u' || !parseHex(p + 2, &low) || low < 0xdc00 || low > 0xdfff) {
+                    return false;
+                }
+                p += 6;
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+            } else if (code >= 0xdc00 && code <= 0xdfff) {
+                return false;
+            }
+            if (code < 0x80) {
+                out->append(static_cast<char>(code));
+            } else if (code < 0x800) {
+                out->append(static_cast<char>(0xc0 | (code >> 6)));
+                out->append(static_cast<char>(0x80 | (code & 0x3f)));
+            } else if (code < 0x10000) {
+                out->append(static_cast<char>(0xe0 | (code >> 12)));
+                out->append(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+                out->append(static_cast<char>(0x80 | (code & 0x3f)));
+            } else {
+                out->append(static_cast<char>(0xf0 | (code >> 18)));
+                out->append(static_cast<char>(0x80 | ((code >> 12) & 0x3f)));
+                out->append(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+                out->append(static_cast<char>(0x80 | (code & 0x3f)));
+            }
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+
+JsonView JsonView::parse(const QByteArray &json)
+{
+    QSharedPointer<JsonIndex> index(new JsonIndex());
+    index->json = json;
+    if (!buildIndex(index.data())) {
+        return JsonView();
+    }
+    JsonView root(index, -1, -1);
+    root = root.valueAfter(-1);
+    // nothing but spaces after the root.
+    if (root.type() == Invalid || root.structuralAfter() < index->positions.size()) {
+        return JsonView();
+    }
+    return root;
+}
+
+
+JsonView JsonView::read(QSharedPointer<FileLike> reader, qint32 maxSize)
+{
+    if (reader.isNull()) {
+        return JsonView();
+    }
+    const qint32 BlockSize = 1024 * 64;
+    QByteArray json;
+    while (true) {
+        const int oldSize = json.size();
+        json.resize(oldSize + BlockSize);
+        const qint32 readBytes = reader->read(json.data() + oldSize, BlockSize);
+        json.resize(oldSize + qMax(0, readBytes));
+        if (readBytes < 0 || json.size() > maxSize) {
+            return JsonView();
+        } else if (readBytes == 0) {
+            break;
+        }
+    }
+    return parse(json);
+}
+
+
+// the value after the colon or comma of separator, or at the beginning if it is -1.
+JsonView JsonView::valueAfter(int separator) const
+{
+    const QByteArray &json = index->json;
+    int p = separator < 0 ? 0 : index->positions.at(separator) + 1;
+    while (p < json.size() && isSpace(json.at(p))) {
+        ++p;
+    }
+    if (p >= json.size()) {
+        return JsonView();
+    }
+    const int next = separator + 1;
+    if (next < index->positions.size() && index->positions.at(next) == p) {
+        const char c = json.at(p);
+        if (c != '"' && c != '{' && c != '[') {
+            return JsonView();
+        }
+    }
+    return JsonView(index, p, next);
+}
+
+
+// the structural character after this value, a comma or a closing bracket.
+int JsonView::structuralAfter() const
+{
+    const char c = index->json.at(position);
+    if (c == '{' || c == '[') {
+        return index->partners.at(structural) + 1;
+    } else if (c == '"') {
+        return structural + 1;
+    }
+    return structural;
+}
+
+
+bool JsonView::next(int *cursor, int *key, JsonView *item) const
+{
+    const int separator = *cursor;
+    *cursor = -1;
+    if (separator < 0) {
+        return false;
+    }
+    const JsonIndex &ix = *index;
+    const int n = ix.positions.size();
+    const bool object = ix.json.at(position) == '{';
+    const char closing = object ? '}' : ']';
+    if (separator == structural) {
+        int p = ix.positions.at(separator) + 1;
+        while (isSpace(ix.json.at(p))) {
+            ++p;
+        }
+        if (p == ix.positions.at(separator + 1) && ix.charAt(separator + 1) == closing) {
+            return false;
+        }
+    }
+    JsonView value;
+    if (object) {
+        const int k = separator + 1;
+        if (k + 1 >= n || ix.charAt(k) != '"' || ix.charAt(k + 1) != ':') {
+            return false;
+        }
+        *key = k;
+        value = valueAfter(k + 1);
+    } else {
+        value = valueAfter(separator);
+    }
+    if (value.type() == Invalid) {
+        return false;
+    }
+    const int after = value.structuralAfter();
+    if (after >= n) {
+        return false;
+    }
+    const char c = ix.charAt(after);
+    if (c == ',') {
+        *cursor = after;
+    } else if (c != closing) {
+        return false;
+    }
+    *item = value;
+    return true;
+}
+
+
+JsonView::Type JsonView::type() const
+{
+    if (index.isNull() || position < 0) {
+        return Invalid;
+    }
+    const char *data = index->json.constData() + position;
+    switch (*data) {
+    case '{':
+        return Object;
+    case '[':
+        return Array;
+    case '"':
+        return String;
+    case 'n':
+    case 't':
+    case 'f': {
+        const int size = scalarEnd(*index, position, structural) - position;
+        if ((size == 4 && memcmp(data, "null", 4) == 0)) {
+            return Null;
+        } else if ((size == 4 && memcmp(data, "true", 4) == 0) || (size == 5 && memcmp(data, "false", 5) == 0)) {
+            return Bool;
+        }
+        return Invalid;
+    }
+    default:
+        return (*data == '-' || (*data >= '0' && *data <= '9')) ? Number : Invalid;
+    }
+}
+
+
+JsonView JsonView::value(const QByteArray &key) const
+{
+    if (type() != Object) {
+        return JsonView();
+    }
+    const QByteArray &json = index->json;
+    int cursor = structural;
+    int k;
+    JsonView item;
+    while (next(&cursor, &k, &item)) {
+        const int start = index->positions.at(k) + 1;
+        const int size = index->partners.at(k) - start;
+        const char *name = json.constData() + start;
+        if (memchr(name, '\\', static_cast<size_t>(size))) {
+            QByteArray unescaped;
+            if (unescape(name, name + size, &unescaped) && unescaped == key) {
+                return item;
+            }
+        } else if (size == key.size() && memcmp(name, key.constData(), static_cast<size_t>(size)) == 0) {
+            return item;
+        }
+    }
+    return JsonView();
+}
+
+
+JsonView JsonView::at(int i) const
+{
+    if (i < 0 || type() != Array) {
+        return JsonView();
+    }
+    int cursor = structural;
+    int k;
+    JsonView item;
+    for (int j = 0; next(&cursor, &k, &item); ++j) {
+        if (j == i) {
+            return item;
+        }
+    }
+    return JsonView();
+}
+
+
+JsonView JsonView::path(const QByteArray &path) const
+{
+    if (path.isEmpty()) {
+        return *this;
+    }
+    JsonView current = *this;
+    int start = 0;
+    while (start <= path.size() && current.position >= 0) {
+        int end = path.indexOf('.', start);
+        if (end < 0) {
+            end = path.size();
+        }
+        const QByteArray &part = QByteArray::fromRawData(path.constData() + start, end - start);
+        if (current.type() == Array) {
+            bool ok;
+            const int i = part.toInt(&ok);
+            current = ok ? current.at(i) : JsonView();
+        } else {
+            current = current.value(part);
+        }
+        start = end + 1;
+    }
+    return current;
+}
+
+
+int JsonView::count() const
+{
+    const Type t = type();
+    if (t != Array && t != Object) {
+        return 0;
+    }
+    int cursor = structural;
+    int k;
+    JsonView item;
+    int n = 0;
+    while (next(&cursor, &k, &item)) {
+        ++n;
+    }
+    return n;
+}
+
+
+QList<QByteArray> JsonView::keys() const
+{
+    QList<QByteArray> keys;
+    if (type() != Object) {
+        return keys;
+    }
+    int cursor = structural;
+    int k;
+    JsonView item;
+    while (next(&cursor, &k, &item)) {
+        const char *name = index->json.constData() + index->positions.at(k) + 1;
+        QByteArray key;
+        unescape(name, index->json.constData() + index->partners.at(k), &key);
+        keys.append(key);
+    }
+    return keys;
+}
+
+
+bool JsonView::toBool(bool defaultValue) const
+{
+    if (type() != Bool) {
+        return defaultValue;
+    }
+    return index->json.at(position) == 't';
+}
+
+
+qint64 JsonView::toInteger(qint64 defaultValue) const
+{
+    if (type() != Number) {
+        return defaultValue;
+    }
+    const QByteArray &text = QByteArray::fromRawData(index->json.constData() + position,
+                                                     scalarEnd(*index, position, structural) - position);
+    bool ok;
+    const qint64 i = text.toLongLong(&ok);
+    if (ok) {
+        return i;
+    }
+    // such as 1e3 and 2.0.
+    const double d = text.toDouble(&ok);
+    return ok ? static_cast<qint64>(d) : defaultValue;
+}
+
+
+double JsonView::toDouble(double defaultValue) const
+{
+    if (type() != Number) {
+        return defaultValue;
+    }
+    bool ok;
+    const double d = QByteArray::fromRawData(index->json.constData() + position,
+                                             scalarEnd(*index, position, structural) - position).toDouble(&ok);
+    return ok ? d : defaultValue;
+}
+
+
+QString JsonView::toString(const QString &defaultValue) const
+{
+    if (type() != String) {
+        return defaultValue;
+    }
+    return QString::fromUtf8(toUtf8());
+}
+
+
+QByteArray JsonView::toUtf8() const
+{
+    if (type() != String) {
+        return QByteArray();
+    }
+    const char *start = index->json.constData() + position + 1;
+    const char *end = index->json.constData() + index->partners.at(structural);
+    if (!memchr(start, '\\', static_cast<size_t>(end - start))) {
+        return QByteArray(start, static_cast<int>(end - start));
+    }
+    QByteArray s;
+    if (!unescape(start, end, &s)) {
+        return QByteArray();
+    }
+    return s;
+}
+
+
+QByteArray JsonView::raw() const
+{
+    switch (type()) {
+    case Invalid:
+        return QByteArray();
+    case Object:
+    case Array:
+        return index->json.mid(position, index->positions.at(index->partners.at(structural)) + 1 - position);
+    case String:
+        return index->json.mid(position, index->partners.at(structural) + 1 - position);
+    default:
+        return index->json.mid(position, scalarEnd(*index, position, structural) - position);
+    }
+}
+
+
+QJsonValue JsonView::toJsonValue() const
+{
+    const Type t = type();
+    if (t == Invalid) {
+        return QJsonValue(QJsonValue::Undefined);
+    }
+    if (t == Object) {
+        return QJsonDocument::fromJson(raw()).object();
+    } else if (t == Array) {
+        return QJsonDocument::fromJson(raw()).array();
+    }
+    // the scalars are parsed in an array, QJsonDocument takes only the containers.
+    const QJsonArray &wrapper = QJsonDocument::fromJson("[" + raw() + "]").array();
+    return wrapper.isEmpty() ? QJsonValue(QJsonValue::Undefined) : wrapper.at(0);
+}
+
+
+QTNETWORKNG_NAMESPACE_END
@@ -2,16 +2,763 @@
 #include <QtCore/qelapsedtimer.h>
 #include <QtCore/qbytearray.h>
 #include <QtCore/qendian.h>
+#include <QtCore/qvector.h>
+#include <QtCore/qmap.h>
+#include <QtCore/qset.h>
+#include <QtCore/qqueue.h>
+#include <QtCore/qscopedpointer.h>
+#include <QtCore/qthread.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qsemaphore.h>
+#include <algorithm>
+#include <string.h>
 #include "../include/kcp.h"
 #include "../include/socket_utils.h"
 #include "../include/coroutine_utils.h"
+#include "../include/metrics.h"
+#include "../include/impairment.h"
+#include "../include/private/eventloop_p.h"
 #include "./kcp/ikcp.h"
+#ifndef QTNG_NO_CRYPTO
+#include "../include/random.h"
+#include "../include/md.h"
+#endif
+#ifdef QTNG_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef QTNG_HAVE_ZSTD
+#include <zstd.h>
+#endif
 QTNETWORKNG_NAMESPACE_BEGIN
 
 const char PACKET_TYPE_UNCOMPRESSED_DATA = 0x01;
 const char PACKET_TYPE_COMPRESSED_DATA = 0x02;
 const char PACKET_TYPE_CLOSE= 0X03;
 const char PACKET_TYPE_KEEPALIVE = 0x04;
+const char PACKET_TYPE_FEC_SHARD = 0x05;
+// followed by the size of packet, the size of uncompressed data, and the compressed data.
+const char PACKET_TYPE_LZ4_DATA = 0x06;
+const char PACKET_TYPE_ZSTD_DATA = 0x07;
+// followed by the salt of sender, the counter, the sealed packet and the tag. the header is authenticated too.
+const char PACKET_TYPE_SEALED = 0x08;
+// followed by the channel, the sequence of channel and the data, sent by KcpSocket::sendDatagram() without kcp.
+const char PACKET_TYPE_DATAGRAM = 0x09;
+
+// type, group id, shard index, data shards and parity shards.
+const int FecHeaderSize = 8;
+// the groups being decoded, the older ones are given up.
+const int FecMaxPendingGroups = 64;
+// type, channel and sequence.
+const int DatagramHeaderSize = 6;
+// the datagrams of all channels not read, the oldest are dropped.
+const int DatagramMaxPending = 256;
+// type, salt and counter of the sealed packets.
+const int SealSaltSize = 16;
+const int SealHeaderSize = 1 + SealSaltSize + 8;
+// the salts of the sessions accepted by a master socket, the packets replayed to open a new session are dropped.
+const int MaxAcceptedSalts = 1024 * 64;
+
+
+#ifndef QTNG_NO_CRYPTO
+// the pre-shared key given to KcpSocket::setEncryption(), shared by the master socket and its slaves. every socket
+// seals by a key derived from it and a random salt of its own, which is sent with the counter in every packet. so
+// the nonces never repeat under one key, however many sessions share the pre-shared key.
+struct KcpPresharedKey
+{
+    KcpPresharedKey(AeadCipher::Algorithm algo, const QByteArray &key)
+        :algo(algo), key(key) {}
+    QSharedPointer<AeadCipher> derive(const QByteArray &salt) const;
+    AeadCipher::Algorithm algo;
+    QByteArray key;
+};
+
+
+// hkdf-sha256 of rfc 5869, one block is enough for the keys of AeadCipher.
+QSharedPointer<AeadCipher> KcpPresharedKey::derive(const QByteArray &salt) const
+{
+    const QByteArray &prk = Hmac::hmac(salt, key, MessageDigest::Sha256);
+    const QByteArray &okm = Hmac::hmac(prk, QByteArray("qtng kcp packet key\x01"), MessageDigest::Sha256);
+    return QSharedPointer<AeadCipher>(new AeadCipher(algo, okm.left(AeadCipher::keySize(algo))));
+}
+#endif
+
+
+// the arithmetic of GF(2^8) with the polynomial 0x11d.
+struct GaloisField
+{
+    GaloisField();
+    inline quint8 mul(quint8 a, quint8 b) const { return (a && b) ? exp[log[a] + log[b]] : 0; }
+    inline quint8 inv(quint8 a) const { return exp[255 - log[a]]; }
+    // dst ^= c * src
+    void mulAdd(uchar *dst, const uchar *src, quint8 c, int size) const;
+    quint8 exp[512];
+    int log[256];
+};
+
+
+GaloisField::GaloisField()
+{
+    int x = 1;
+    for (int i = 0; i < 255; ++i) {
+        exp[i] = static_cast<quint8>(x);
+        log[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= 0x11d;
+        }
+    }
+    for (int i = 255; i < 512; ++i) {
+        exp[i] = exp[i - 255];
+    }
+    log[0] = 0;
+}
+
+
+void GaloisField::mulAdd(uchar *dst, const uchar *src, quint8 c, int size) const
+{
+    if (c == 0) {
+        return;
+    }
+    const int logc = log[c];
+    for (int i = 0; i < size; ++i) {
+        if (src[i]) {
+            dst[i] ^= exp[log[src[i]] + logc];
+        }
+    }
+}
+
+
+static const GaloisField &gf()
+{
+    static const GaloisField field;
+    return field;
+}
+
+
+// the parity rows are a cauchy matrix, so any dataShards rows of the systematic matrix are invertible.
+static inline quint8 fecMatrix(int row, int column, int dataShards)
+{
+    if (row < dataShards) {
+        return row == column ? 1 : 0;
+    }
+    return gf().inv(static_cast<quint8>(row ^ column));  // row >= dataShards > column, so they are not equal.
+}
+
+
+// the packets of one group, padded to the same size. a data shard is prefixed by its size.
+struct FecGroup
+{
+    FecGroup()
+        :dataShards(0), parityShards(0), dataReceived(0), received(0), done(false) {}
+    QVector<QByteArray> shards;
+    int dataShards;
+    int parityShards;
+    int dataReceived;
+    int received;
+    bool done;
+};
+
+
+// rebuilds the missing data shards of group, returns the packets rebuilt.
+static QList<QByteArray> fecRecover(FecGroup *group)
+{
+    const int k = group->dataShards;
+    int shardSize = 0;
+    for (const QByteArray &shard: group->shards) {
+        shardSize = qMax(shardSize, shard.size());
+    }
+    // take k shards, the data shards first.
+    QVector<int> rows;
+    for (int i = 0; i < group->shards.size() && rows.size() < k; ++i) {
+        if (!group->shards.at(i).isNull()) {
+            rows.append(i);
+        }
+    }
+    // invert the rows of matrix by gauss-jordan elimination.
+    QVector<quint8> m(k * k), inverse(k * k, 0);
+    for (int r = 0; r < k; ++r) {
+        for (int c = 0; c < k; ++c) {
+            m[r * k + c] = fecMatrix(rows.at(r), c, k);
+        }
+        inverse[r * k + r] = 1;
+    }
+    const GaloisField &field = gf();
+    for (int c = 0; c < k; ++c) {
+        int pivot = c;
+        while (pivot < k && m[pivot * k + c] == 0) {
+            ++pivot;
+        }
+        if (pivot == k) {
+            return QList<QByteArray>();
+        }
+        if (pivot != c) {
+            for (int i = 0; i < k; ++i) {
+                std::swap(m[pivot * k + i], m[c * k + i]);
+                std::swap(inverse[pivot * k + i], inverse[c * k + i]);
+            }
+        }
+        const quint8 scale = field.inv(m[c * k + c]);
+        for (int i = 0; i < k; ++i) {
+            m[c * k + i] = field.mul(m[c * k + i], scale);
+            inverse[c * k + i] = field.mul(inverse[c * k + i], scale);
+        }
+        for (int r = 0; r < k; ++r) {
+            const quint8 factor = m[r * k + c];
+            if (r == c || factor == 0) {
+                continue;
+            }
+            for (int i = 0; i < k; ++i) {
+                m[r * k + i] ^= field.mul(factor, m[c * k + i]);
+                inverse[r * k + i] ^= field.mul(factor, inverse[c * k + i]);
+            }
+        }
+    }
+    QVector<QByteArray> padded(k);
+    for (int r = 0; r < k; ++r) {
+        padded[r] = group->shards.at(rows.at(r));
+        padded[r].append(QByteArray(shardSize - padded[r].size(), '\0'));
+    }
+    QList<QByteArray> packets;
+    for (int j = 0; j < k; ++j) {
+        if (!group->shards.at(j).isNull()) {
+            continue;
+        }
+        QByteArray shard(shardSize, '\0');
+        uchar *dst = reinterpret_cast<uchar *>(shard.data());
+        for (int r = 0; r < k; ++r) {
+            field.mulAdd(dst, reinterpret_cast<const uchar *>(padded.at(r).constData()), inverse[j * k + r], shardSize);
+        }
+        const int size = (dst[0] << 8) | dst[1];
+        if (size + 2 <= shardSize) {
+            packets.append(shard.mid(2, size));
+        }
+    }
+    return packets;
+}
+
+
+
+// the segments of ikcp are taken from chunks of fixed-size blocks sized to the mtu, and go back to a free list
+// when they are acked. the blocks are freed with the socket only. the bigger segments use malloc() as before.
+class KcpSegmentPool
+{
+public:
+    KcpSegmentPool()
+        :freeList(nullptr), blockSize(0), generation(0) {}
+    ~KcpSegmentPool();
+public:
+    // the blocks of old size are not used again after the mtu is changed.
+    void setMtu(int mtu);
+    void *allocate(int size);
+    void release(void *p);
+    static void *allocateHelper(int size, ikcpcb *, void *user);
+    static void releaseHelper(void *p, ikcpcb *, void *user);
+private:
+    struct Block
+    {
+        Block *next;
+    };
+    // keeps the segment aligned.
+    struct Header
+    {
+        quint32 generation;
+        quint32 pooled;
+        quint64 padding;
+    };
+    enum { BlocksPerChunk = 64 };
+    QVector<void*> chunks;
+    Block *freeList;
+    int blockSize;
+    quint32 generation;
+};
+
+
+KcpSegmentPool::~KcpSegmentPool()
+{
+    for (void *chunk: chunks) {
+        free(chunk);
+    }
+}
+
+
+void KcpSegmentPool::setMtu(int mtu)
+{
+    const int size = static_cast<int>(sizeof(Header) + sizeof(IKCPSEG)) + mtu;
+    if (size == blockSize) {
+        return;
+    }
+    blockSize = size;
+    ++generation;
+    freeList = nullptr;
+}
+
+
+void *KcpSegmentPool::allocate(int size)
+{
+    Header *header;
+    if (blockSize > 0 && size + static_cast<int>(sizeof(Header)) <= blockSize) {
+        if (!freeList) {
+            char *chunk = static_cast<char*>(malloc(static_cast<size_t>(blockSize) * BlocksPerChunk));
+            if (!chunk) {
+                return nullptr;
+            }
+            chunks.append(chunk);
+            for (int i = BlocksPerChunk - 1; i >= 0; --i) {
+                Block *block = reinterpret_cast<Block*>(chunk + i * blockSize);
+                block->next = freeList;
+                freeList = block;
+            }
+        }
+        header = reinterpret_cast<Header*>(freeList);
+        freeList = freeList->next;
+        header->generation = generation;
+        header->pooled = 1;
+    } else {
+        header = static_cast<Header*>(malloc(sizeof(Header) + static_cast<size_t>(size)));
+        if (!header) {
+            return nullptr;
+        }
+        header->pooled = 0;
+    }
+    return header + 1;
+}
+
+
+void KcpSegmentPool::release(void *p)
+{
+    if (!p) {
+        return;
+    }
+    Header *header = static_cast<Header*>(p) - 1;
+    if (!header->pooled) {
+        free(header);
+    } else if (header->generation == generation) {
+        Block *block = reinterpret_cast<Block*>(header);
+        block->next = freeList;
+        freeList = block;
+    }
+}
+
+
+// the congestion controllers are called before every flush of kcp. they may change the send window of kcp, and
+// return the pacing rate in bytes per second, zero for sending the whole window at once.
+class KcpCongestionController
+{
+public:
+    virtual ~KcpCongestionController();
+    virtual quint64 update(ikcpcb *kcp, quint64 now, quint32 maxSendWindow) = 0;
+};
+
+
+KcpCongestionController::~KcpCongestionController() {}
+
+
+// bbr-style: the bottleneck bandwidth is the max delivery rate of the last rounds, and the packets in flight are
+// limited to twice of the bandwidth-delay product. the delivered bytes are counted by the una of kcp.
+class KcpBbrController: public KcpCongestionController
+{
+public:
+    KcpBbrController();
+    virtual quint64 update(ikcpcb *kcp, quint64 now, quint32 maxSendWindow) override;
+private:
+    enum State {
+        Startup,
+        Drain,
+        ProbeBandwidth,
+    };
+    enum { BandwidthRounds = 10, MinRttInterval = 10000 };
+    quint64 bandwidthSamples[BandwidthRounds];
+    quint64 bandwidth;
+    quint64 fullBandwidth;
+    quint64 roundStart;
+    quint64 minRttTimestamp;
+    quint32 minRtt;
+    quint32 roundUna;
+    quint32 rounds;
+    int fullBandwidthRounds;
+    int cycleIndex;
+    State state;
+};
+
+
+KcpBbrController::KcpBbrController()
+    : bandwidth(0), fullBandwidth(0), roundStart(0), minRttTimestamp(0), minRtt(0), roundUna(0), rounds(0)
+    , fullBandwidthRounds(0), cycleIndex(0), state(Startup)
+{
+    memset(bandwidthSamples, 0, sizeof(bandwidthSamples));
+}
+
+
+quint64 KcpBbrController::update(ikcpcb *kcp, quint64 now, quint32 maxSendWindow)
+{
+    static const double cycleGains[8] = {1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+    const quint32 rtt = kcp->rx_srtt > 0 ? static_cast<quint32>(kcp->rx_srtt) : 100;
+    if (minRtt == 0 || rtt <= minRtt || now - minRttTimestamp > MinRttInterval) {
+        minRtt = rtt;
+        minRttTimestamp = now;
+    }
+    if (roundStart == 0) {
+        roundStart = now;
+        roundUna = kcp->snd_una;
+    }
+    const quint64 elapsed = now - roundStart;
+    if (elapsed >= qMax<quint32>(minRtt, 10)) {
+        const quint64 delivered = static_cast<quint64>(kcp->snd_una - roundUna) * kcp->mss;
+        const quint64 sample = delivered * 1000 / elapsed;
+        // the rate is limited by the application if the window is not used up. such samples are too small.
+        const bool appLimited = kcp->nsnd_que == 0 && kcp->nsnd_buf < kcp->snd_wnd / 2;
+        if (!appLimited || sample > bandwidth) {
+            bandwidthSamples[rounds % BandwidthRounds] = sample;
+            ++rounds;
+            bandwidth = 0;
+            for (quint64 s: bandwidthSamples) {
+                bandwidth = qMax(bandwidth, s);
+            }
+        }
+        roundStart = now;
+        roundUna = kcp->snd_una;
+        switch (state) {
+        case Startup:
+            if (bandwidth >= fullBandwidth * 5 / 4) {
+                fullBandwidth = bandwidth;
+                fullBandwidthRounds = 0;
+            } else if (!appLimited && ++fullBandwidthRounds >= 3) {
+                state = Drain;
+            }
+            break;
+        case Drain:
+            if (kcp->nsnd_buf * kcp->mss <= bandwidth * minRtt / 1000) {
+                state = ProbeBandwidth;
+                cycleIndex = 0;
+            }
+            break;
+        case ProbeBandwidth:
+            cycleIndex = (cycleIndex + 1) % 8;
+            break;
+        }
+    }
+
+    double gain;
+    switch (state) {
+    case Startup:
+        gain = 2.89;
+        break;
+    case Drain:
+        gain = 1 / 2.89;
+        break;
+    default:
+        gain = cycleGains[cycleIndex];
+        break;
+    }
+    // sixteen packets in a rtt before the first sample.
+    const quint64 estimated = bandwidth > 0 ? bandwidth : static_cast<quint64>(kcp->mss) * 16 * 1000 / rtt;
+    const quint64 bdp = estimated * minRtt / 1000 / qMax<quint64>(kcp->mss, 1);
+    const quint32 window = static_cast<quint32>(qMin<quint64>(bdp * 2, maxSendWindow));
+    kcp->snd_wnd = qMax<quint32>(window, 4);
+    return qMax<quint64>(static_cast<quint64>(estimated * gain), kcp->mss);
+}
+
+
+// the rest of messages bigger than the buffer of recv(). the storage is reused, and the data is moved to the
+// front only if there is no room after it.
+class KcpReceivingBuffer
+{
+public:
+    KcpReceivingBuffer()
+        :head(0), tail(0) {}
+public:
+    bool isEmpty() const { return head == tail; }
+    // returns the room for size bytes, then commit() what is written.
+    char *reserve(qint32 size);
+    void commit(qint32 size) { tail += size; }
+    qint32 read(char *data, qint32 size);
+private:
+    QByteArray storage;
+    qint32 head;
+    qint32 tail;
+};
+
+
+char *KcpReceivingBuffer::reserve(qint32 size)
+{
+    if (storage.size() - tail < size) {
+        const qint32 used = tail - head;
+        if (head > 0) {
+            memmove(storage.data(), storage.constData() + head, static_cast<size_t>(used));
+            head = 0;
+            tail = used;
+        }
+        if (storage.size() - tail < size) {
+            storage.resize(qMax(used + size, storage.size() * 2));
+        }
+    }
+    return storage.data() + tail;
+}
+
+
+qint32 KcpReceivingBuffer::read(char *data, qint32 size)
+{
+    const qint32 len = qMin(size, tail - head);
+    memcpy(data, storage.constData() + head, static_cast<size_t>(len));
+    head += len;
+    if (head == tail) {
+        head = tail = 0;
+    }
+    return len;
+}
+
+
+// the codec state of one socket, kept between packets. the compressed packets are built in place.
+class KcpCompressor
+{
+public:
+    KcpCompressor();
+    ~KcpCompressor();
+public:
+    bool setCodec(KcpSocket::CompressionCodec codec);
+    void setDictionary(const QByteArray &dictionary);
+    // returns false if the packet should be sent uncompressed.
+    bool compress(const char *data, qint32 size, QByteArray *packet);
+    // returns null if the data is invalid, it points to a buffer reused by the next call.
+    const char *decompress(char type, const char *data, qint32 size, qint32 *decompressedSize);
+public:
+    KcpSocket::CompressionCodec codec;
+    QByteArray dictionary;
+private:
+    void record(bool saved);
+    QByteArray buffer;
+    int skipping;     // the packets left to send uncompressed.
+    int backoff;      // the packets to skip after next failure, doubled every time.
+#ifdef QTNG_HAVE_ZSTD
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+#endif
+    Q_DISABLE_COPY(KcpCompressor)
+};
+
+
+KcpCompressor::KcpCompressor()
+    :codec(KcpSocket::NoCompression), skipping(0), backoff(1)
+#ifdef QTNG_HAVE_ZSTD
+    , cctx(nullptr), dctx(nullptr), cdict(nullptr), ddict(nullptr)
+#endif
+{
+}
+
+
+KcpCompressor::~KcpCompressor()
+{
+#ifdef QTNG_HAVE_ZSTD
+    ZSTD_freeCCtx(cctx);
+    ZSTD_freeDCtx(dctx);
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeDDict(ddict);
+#endif
+}
+
+
+bool KcpCompressor::setCodec(KcpSocket::CompressionCodec codec)
+{
+    switch (codec) {
+    case KcpSocket::NoCompression:
+    case KcpSocket::ZlibCompression:
+        break;
+    case KcpSocket::Lz4Compression:
+#ifndef QTNG_HAVE_LZ4
+        return false;
+#endif
+        break;
+    case KcpSocket::ZstdCompression:
+#ifndef QTNG_HAVE_ZSTD
+        return false;
+#endif
+        break;
+    }
+    this->codec = codec;
+    skipping = 0;
+    backoff = 1;
+    return true;
+}
+
+
+void KcpCompressor::setDictionary(const QByteArray &dictionary)
+{
+    this->dictionary = dictionary;
+#ifdef QTNG_HAVE_ZSTD
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeDDict(ddict);
+    cdict = nullptr;
+    ddict = nullptr;
+    if (!dictionary.isEmpty()) {
+        cdict = ZSTD_createCDict(dictionary.constData(), static_cast<size_t>(dictionary.size()), 1);
+        ddict = ZSTD_createDDict(dictionary.constData(), static_cast<size_t>(dictionary.size()));
+    }
+#endif
+}
+
+
+// the incompressible data, such as encrypted or compressed already, is not tried for each packet.
+void KcpCompressor::record(bool saved)
+{
+    if (saved) {
+        backoff = 1;
+    } else {
+        skipping = backoff;
+        backoff = qMin(backoff * 2, 64);
+    }
+}
+
+
+bool KcpCompressor::compress(const char *data, qint32 size, QByteArray *packet)
+{
+    if (codec == KcpSocket::NoCompression || size < 64) {
+        return false;
+    }
+    if (skipping > 0) {
+        --skipping;
+        return false;
+    }
+    // it is worth only if an eighth is saved.
+    const qint32 limit = size - size / 8;
+    qint32 compressedSize = -1;
+    char type = PACKET_TYPE_COMPRESSED_DATA;
+    switch (codec) {
+    case KcpSocket::NoCompression:
+        return false;
+    case KcpSocket::ZlibCompression: {
+        const QByteArray &compressed = qCompress(reinterpret_cast<const uchar*>(data), size);
+        if (compressed.size() < limit) {
+            packet->resize(3 + compressed.size());
+            memcpy(packet->data() + 3, compressed.constData(), static_cast<size_t>(compressed.size()));
+            compressedSize = compressed.size();
+        }
+        break;
+    }
+    case KcpSocket::Lz4Compression:
+#ifdef QTNG_HAVE_LZ4
+        type = PACKET_TYPE_LZ4_DATA;
+        packet->resize(5 + limit);
+        compressedSize = LZ4_compress_default(data, packet->data() + 5, size, limit);
+        if (compressedSize <= 0) {
+            compressedSize = -1;
+        }
+#endif
+        break;
+    case KcpSocket::ZstdCompression:
+#ifdef QTNG_HAVE_ZSTD
+        type = PACKET_TYPE_ZSTD_DATA;
+        if (!cctx) {
+            cctx = ZSTD_createCCtx();
+        }
+        packet->resize(5 + limit);
+        size_t result;
+        if (cdict) {
+            result = ZSTD_compress_usingCDict(cctx, packet->data() + 5, static_cast<size_t>(limit), data,
+                                              static_cast<size_t>(size), cdict);
+        } else {
+            result = ZSTD_compressCCtx(cctx, packet->data() + 5, static_cast<size_t>(limit), data,
+                                       static_cast<size_t>(size), 1);
+        }
+        compressedSize = ZSTD_isError(result) ? -1 : static_cast<qint32>(result);
+#endif
+        break;
+    }
+    if (compressedSize < 0 || compressedSize >= limit) {
+        record(false);
+        return false;
+    }
+    record(true);
+    uchar *header = reinterpret_cast<uchar *>(packet->data());
+    header[0] = static_cast<uchar>(type);
+    if (type == PACKET_TYPE_COMPRESSED_DATA) {
+        qToBigEndian<quint16>(static_cast<quint16>(compressedSize), header + 1);
+        packet->resize(3 + compressedSize);
+    } else {
+        qToBigEndian<quint16>(static_cast<quint16>(compressedSize + 2), header + 1);
+        qToBigEndian<quint16>(static_cast<quint16>(size), header + 3);
+        packet->resize(5 + compressedSize);
+    }
+    return true;
+}
+
+
+const char *KcpCompressor::decompress(char type, const char *data, qint32 size, qint32 *decompressedSize)
+{
+    if (type == PACKET_TYPE_COMPRESSED_DATA) {
+        buffer = qUncompress(reinterpret_cast<const uchar*>(data), size);
+        *decompressedSize = buffer.size();
+        return buffer.isEmpty() ? nullptr : buffer.constData();
+    }
+    if (size < 2) {
+        return nullptr;
+    }
+    const int expected = qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(data));
+    if (buffer.size() < expected) {
+        buffer.resize(expected);
+    }
+    data += 2;
+    size -= 2;
+    switch (type) {
+    case PACKET_TYPE_LZ4_DATA:
+#ifdef QTNG_HAVE_LZ4
+        if (LZ4_decompress_safe(data, buffer.data(), size, expected) != expected) {
+            return nullptr;
+        }
+        *decompressedSize = expected;
+        return buffer.constData();
+#else
+        qDebug() << "lz4 is not built in, packet is dropped.";
+        return nullptr;
+#endif
+    case PACKET_TYPE_ZSTD_DATA: {
+#ifdef QTNG_HAVE_ZSTD
+        if (!dctx) {
+            dctx = ZSTD_createDCtx();
+        }
+        size_t result;
+        if (ddict) {
+            result = ZSTD_decompress_usingDDict(dctx, buffer.data(), static_cast<size_t>(expected), data,
+                                                static_cast<size_t>(size), ddict);
+        } else {
+            result = ZSTD_decompressDCtx(dctx, buffer.data(), static_cast<size_t>(expected), data,
+                                         static_cast<size_t>(size));
+        }
+        if (ZSTD_isError(result) || result != static_cast<size_t>(expected)) {
+            return nullptr;
+        }
+        *decompressedSize = expected;
+        return buffer.constData();
+#else
+        qDebug() << "zstd is not built in, packet is dropped.";
+        return nullptr;
+#endif
+    }
+    default:
+        return nullptr;
+    }
+}
+
+
+struct KcpDatagramChannel
+{
+    KcpDatagramChannel()
+        :policy(KcpSocket::KeepAllDatagrams), maxAge(0), nextSequence(0), lastSequence(0), received(false) {}
+    KcpSocket::DatagramPolicy policy;
+    quint32 maxAge;          // msecs, zero for no limit.
+    quint32 nextSequence;    // of the sending one.
+    quint32 lastSequence;    // of the newest one received.
+    bool received;
+};
+
+
+struct KcpDatagram
+{
+    QByteArray data;
+    quint64 timestamp;       // when it is received.
+    quint8 channel;
+};
 
 
 class SlaveKcpSocketPrivate;
@@ -47,11 +794,41 @@ public:
     void setMode(KcpSocket::Mode mode);
     qint32 send(const char *data, qint32 size, bool all);
     qint32 recv(char *data, qint32 size, bool all);
-    bool handleDatagram(const QByteArray &buf);
-    void updateKcp();
+    // the data is not copied, it points into the receiving buffer of master socket.
+    bool handleDatagram(const char *buf, qint32 size);
+    bool handlePacket(const char *buf, qint32 size);
+    // seals the packet if encryption is on, returns size if it is sent.
+    qint32 output(const char *data, qint32 size);
+#ifndef QTNG_NO_CRYPTO
+    // a new salt is made for sealing, the salt of peer is taken from its first packet.
+    void setPresharedKey(QSharedPointer<KcpPresharedKey> presharedKey);
+    // returns null if the datagram is forged, or is not sealed. the result is valid until next call.
+    const char *unseal(const char *buf, qint32 size, qint32 *plainSize);
+    const char *open(QSharedPointer<AeadCipher> cipher, const char *buf, qint32 size, qint32 *plainSize);
+#endif
+    // the slaves are updated by the scheduler of master socket, the others by their own coroutines.
+    virtual void updateKcp();
     void doUpdate();
+    // flushes kcp once, and returns false if the socket is closed. interval is the msecs to the next update.
+    bool updateOnce(quint64 now, quint32 *interval);
     virtual qint32 rawSend(const char *data, qint32 size) = 0;
 
+    // queues the packet if pacing is on, returns size if it is queued or sent.
+    qint32 pacedOutput(const char *data, qint32 size);
+    void doPace();
+    void setCongestionControl(KcpSocket::CongestionControl congestionControl, quint64 maxPacingRate);
+    void applyCongestionControl();
+
+    // sends the data packet with the shards of forward error correction.
+    qint32 sendDataPacket(const QByteArray &packet);
+    bool handleFecShard(const char *buf, qint32 size);
+    void handleDataPacket(const char *buf, qint32 size);
+    void setForwardErrorCorrection(int dataShards, int parityShards);
+
+    qint32 sendDatagram(const char *data, qint32 size, quint8 channel);
+    QByteArray recvDatagram(quint8 *channel);
+    void handleDatagramPacket(const char *buf, qint32 size);
+
     QByteArray makeDataPacket(const char *data, qint32 size);
     QByteArray makeShutdownPacket();
     QByteArray makeKeepalivePacket();
@@ -67,9 +844,10 @@ public:
     QSharedPointer<Event> sendingQueueNotFull;
     QSharedPointer<Event> sendingQueueEmpty;
     QSharedPointer<Event> receivingQueueNotEmpty;
+    QSharedPointer<Event> datagramsNotEmpty;
     QSharedPointer<RLock> kcpLock;
     QSharedPointer<Gate> forceToUpdate;
-    QByteArray receivingBuffer;
+    KcpReceivingBuffer receivingBuffer;
 
     const quint64 zeroTimestamp;
     quint64 lastActiveTimestamp;
@@ -80,16 +858,89 @@ public:
 
     QHostAddress remoteAddress;
     quint16 remotePort;
-
+    Endpoint remoteEndpoint;     // the same peer, sendto() takes it without converting QHostAddress.
+
+    QVector<QByteArray> fecPending;   // the data shards of current group to send.
+    QMap<quint32, FecGroup> fecGroups;
+    KcpFecStats fecStats;
+    KcpStats stats;              // only the counters are kept here.
+    quint64 lossTimestamp;
+    quint32 lossSegments;        // seg_xmit of kcp at lossTimestamp.
+    quint32 lossRetransmissions;
+    quint32 fecGroupId;
+    int fecDataShards;
+    int fecParityShards;
+
+    KcpCompressor compressor;
+    KcpSegmentPool segmentPool;
+
+    QMap<quint8, KcpDatagramChannel> datagramChannels;
+    QList<KcpDatagram> datagrams;    // not read, in the order received.
+
+    QScopedPointer<KcpCongestionController> congestion;  // only for bbr.
+    KcpSocket::CongestionControl congestionControl;
+    QList<QByteArray> pacingQueue;
+    quint64 pacingRate;      // bytes per second, zero for no pacing.
+    quint64 maxPacingRate;   // the rate of FixedRateCongestionControl, or the upper limit of the others.
+    quint64 pacingTimestamp;
+    qint64 pacingTokens;     // the bytes may be sent now.
+    quint32 maxSendWindow;   // the send window of kcp, the congestion controllers use smaller windows.
+    int defaultNoCwnd;       // the nocwnd of mode.
+    QSharedPointer<NetworkImpairer> impairer;   // the slaves send by the one of master socket.
+#ifndef QTNG_NO_CRYPTO
+    QSharedPointer<KcpPresharedKey> presharedKey;
+    QSharedPointer<AeadCipher> sealer;   // derived from sealSalt.
+    QSharedPointer<AeadCipher> opener;   // derived from the salt of peer, null until its first packet.
+    QByteArray sealSalt;
+    QByteArray openSalt;
+    QByteArray sealBuffer;
+    QByteArray openBuffer;
+    quint64 sealCounter;
+#endif
     KcpSocket::Mode mode;
-    bool compression;
 };
 
 
-static inline QString concat(const QHostAddress &addr, quint16 port)
+// the slave sockets of a master socket by endpoint. it is probed for every datagram, so it is an open addressing
+// table with linear probing instead of QMap.
+class KcpReceiverTable
 {
-    return addr.toString() + QString::number(port);
-}
+public:
+    KcpReceiverTable()
+        :used(0), deleted(0) {}
+public:
+    QPointer<SlaveKcpSocketPrivate> find(const Endpoint &key) const;
+    void insert(const Endpoint &key, SlaveKcpSocketPrivate *receiver);
+    void remove(const Endpoint &key);
+    QList<QPointer<SlaveKcpSocketPrivate>> values() const;
+    void clear();
+private:
+    enum SlotState { Empty = 0, Used = 1, Deleted = 2 };
+    struct Slot
+    {
+        Slot()
+            :hash(0), state(Empty) {}
+        Endpoint key;
+        QPointer<SlaveKcpSocketPrivate> receiver;
+        quint32 hash;
+        quint8 state;
+    };
+    int lookup(const Endpoint &key, quint32 hash) const;
+    void rehash(int capacity);
+private:
+    QVector<Slot> slots;   // the capacity is a power of two.
+    int used;
+    int deleted;
+};
+
+
+// the next update of a slave socket, the entries are left in heap if the update is rescheduled.
+struct KcpTimer
+{
+    quint64 due;
+    QPointer<SlaveKcpSocketPrivate> socket;
+    bool operator<(const KcpTimer &other) const { return due > other.due; }  // the earliest on the top of heap.
+};
 
 
 class MasterKcpSocketPrivate: public KcpSocketPrivate
@@ -119,14 +970,26 @@ public:
 public:
     virtual qint32 rawSend(const char *data, qint32 size) override;
 public:
-    void removeSlave(const QHostAddress &addr, quint16 port) { receivers.remove(concat(addr, port)); }
+    void removeSlave(const QHostAddress &addr, quint16 port) { receivers.remove(Endpoint(addr, port)); }
     void doReceive();
     void doAccept();
     bool startReceivingCoroutine();
+    // one coroutine updates all slaves in turn of their ikcp_check() times.
+    void schedule(SlaveKcpSocketPrivate *slave, quint64 due);
+    void doSchedule();
+#ifndef QTNG_NO_CRYPTO
+    void rememberSalt(const QByteArray &salt);
+#endif
 public:
-    QMap<QString, QPointer<class SlaveKcpSocketPrivate>> receivers;
+    KcpReceiverTable receivers;
+    QVector<KcpTimer> timers;           // a heap by due time.
+    QSharedPointer<Event> timersChanged;
     QSharedPointer<Socket> rawSocket;
     Queue<QSharedPointer<KcpSocket>> pendingSlaves;
+#ifndef QTNG_NO_CRYPTO
+    QSet<QByteArray> acceptedSalts;     // the replay window of session setup, the oldest are forgotten.
+    QQueue<QByteArray> acceptedSaltOrder;
+#endif
 };
 
 
@@ -154,17 +1017,158 @@ public:
     virtual QVariant option(Socket::SocketOption option) const override;
 public:
     virtual qint32 rawSend(const char *data, qint32 size) override;
+    virtual void updateKcp() override;
 public:
     QPointer<MasterKcpSocketPrivate> parent;
+    quint64 nextUpdate;   // the due time in the scheduler of master socket, zero if not scheduled.
 };
 
 
+int KcpReceiverTable::lookup(const Endpoint &key, quint32 hash) const
+{
+    if (slots.isEmpty()) {
+        return -1;
+    }
+    const int mask = slots.size() - 1;
+    for (int i = static_cast<int>(hash) & mask;; i = (i + 1) & mask) {
+        const Slot &slot = slots.at(i);
+        if (slot.state == Empty) {
+            return -1;
+        }
+        if (slot.state == Used && slot.hash == hash && slot.key == key) {
+            return i;
+        }
+    }
+}
+
+
+QPointer<SlaveKcpSocketPrivate> KcpReceiverTable::find(const Endpoint &key) const
+{
+    int i = lookup(key, qHash(key));
+    if (i < 0) {
+        return QPointer<SlaveKcpSocketPrivate>();
+    }
+    return slots.at(i).receiver;
+}
+
+
+void KcpReceiverTable::insert(const Endpoint &key, SlaveKcpSocketPrivate *receiver)
+{
+    // keep the load factor below 3/4, the deleted slots count because they lengthen the probes.
+    if ((used + deleted + 1) * 4 > slots.size() * 3) {
+        int capacity = qMax(16, slots.size());
+        while ((used + 1) * 2 > capacity) {
+            capacity *= 2;
+        }
+        rehash(capacity);
+    }
+    const quint32 hash = qHash(key);
+    const int mask = slots.size() - 1;
+    int target = -1;
+    for (int i = static_cast<int>(hash) & mask;; i = (i + 1) & mask) {
+        Slot &slot = slots[i];
+        if (slot.state == Used) {
+            if (slot.hash == hash && slot.key == key) {
+                slot.receiver = receiver;
+                return;
+            }
+        } else if (slot.state == Deleted) {
+            if (target < 0) {
+                target = i;
+            }
+        } else {
+            if (target < 0) {
+                target = i;
+            } else {
+                --deleted;
+            }
+            break;
+        }
+    }
+    Slot &slot = slots[target];
+    slot.key = key;
+    slot.receiver = receiver;
+    slot.hash = hash;
+    slot.state = Used;
+    ++used;
+}
+
+
+void KcpReceiverTable::remove(const Endpoint &key)
+{
+    int i = lookup(key, qHash(key));
+    if (i < 0) {
+        return;
+    }
+    Slot &slot = slots[i];
+    slot.receiver.clear();
+    slot.state = Deleted;
+    --used;
+    ++deleted;
+}
+
+
+QList<QPointer<SlaveKcpSocketPrivate>> KcpReceiverTable::values() const
+{
+    QList<QPointer<SlaveKcpSocketPrivate>> result;
+    for (const Slot &slot: slots) {
+        if (slot.state == Used) {
+            result.append(slot.receiver);
+        }
+    }
+    return result;
+}
+
+
+void KcpReceiverTable::clear()
+{
+    slots.clear();
+    used = 0;
+    deleted = 0;
+}
+
+
+void KcpReceiverTable::rehash(int capacity)
+{
+    QVector<Slot> old(capacity);
+    old.swap(slots);
+    used = 0;
+    deleted = 0;
+    const int mask = capacity - 1;
+    for (const Slot &slot: old) {
+        if (slot.state != Used) {
+            continue;
+        }
+        int i = static_cast<int>(slot.hash) & mask;
+        while (slots.at(i).state != Empty) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = slot;
+        ++used;
+    }
+}
+
+
 SlaveKcpSocketPrivate *KcpSocketPrivate::getPrivateHelper(QSharedPointer<KcpSocket> s)
 {
     return static_cast<SlaveKcpSocketPrivate*>(s->d_ptr);
 }
 
 
+void *KcpSegmentPool::allocateHelper(int size, ikcpcb *, void *user)
+{
+    KcpSocketPrivate *p = static_cast<KcpSocketPrivate*>(user);
+    return p->segmentPool.allocate(size);
+}
+
+
+void KcpSegmentPool::releaseHelper(void *p, ikcpcb *, void *user)
+{
+    KcpSocketPrivate *d = static_cast<KcpSocketPrivate*>(user);
+    d->segmentPool.release(p);
+}
+
+
 int kcp_callback(const char *buf, int len, ikcpcb *, void *user)
 {
     KcpSocketPrivate *p = static_cast<KcpSocketPrivate*>(user);
@@ -174,7 +1178,7 @@ int kcp_callback(const char *buf, int len, ikcpcb *, void *user)
     const QByteArray &packet = p->makeDataPacket(buf, len);
     qint32 sentBytes = -1;
     for (int i = 0; i < 1; ++i) {
-        sentBytes = p->rawSend(packet.data(), packet.size());
+        sentBytes = p->sendDataPacket(packet);
         if (sentBytes != packet.size()) {  // but why this happens?
             p->error = Socket::SocketAccessError;
             p->errorString = QStringLiteral("can not send udp packet");
@@ -190,13 +1194,21 @@ int kcp_callback(const char *buf, int len, ikcpcb *, void *user)
 KcpSocketPrivate::KcpSocketPrivate(KcpSocket *q)
     : q_ptr(q), operations(new CoroutineGroup), state(Socket::UnconnectedState), error(Socket::NoError)
     , sendingQueueNotFull(new Event()), sendingQueueEmpty(new Event()), receivingQueueNotEmpty(new Event())
-    , kcpLock(new RLock), forceToUpdate(new Gate)
+    , datagramsNotEmpty(new Event()), kcpLock(new RLock), forceToUpdate(new Gate)
     , zeroTimestamp(static_cast<quint64>(QDateTime::currentMSecsSinceEpoch())), lastActiveTimestamp(zeroTimestamp)
     , lastKeepaliveTimestamp(zeroTimestamp),tearDownTime(1000 * 30), waterLine(1024 * 16), remotePort(0)
-    , mode(KcpSocket::Internet), compression(false)
+    , fecGroupId(0), fecDataShards(0), fecParityShards(0)
+    , lossTimestamp(zeroTimestamp), lossSegments(0), lossRetransmissions(0)
+    , congestionControl(KcpSocket::DefaultCongestionControl), pacingRate(0), maxPacingRate(0), pacingTimestamp(0)
+    , pacingTokens(0), maxSendWindow(0), defaultNoCwnd(0)
+#ifndef QTNG_NO_CRYPTO
+    , sealCounter(0)
+#endif
+    , mode(KcpSocket::Internet)
 {
     kcp = ikcp_create(0, this);
     ikcp_setoutput(kcp, kcp_callback);
+    ikcp_setsegmentallocator(kcp, KcpSegmentPool::allocateHelper, KcpSegmentPool::releaseHelper);
     sendingQueueEmpty->set();
     sendingQueueNotFull->set();
     receivingQueueNotEmpty->clear();
@@ -271,6 +1283,41 @@ void KcpSocketPrivate::setMode(KcpSocket::Mode mode)
         ikcp_wndsize(kcp, 32, 32);
         break;
     }
+    segmentPool.setMtu(static_cast<int>(kcp->mtu));
+    defaultNoCwnd = kcp->nocwnd;
+    maxSendWindow = kcp->snd_wnd;
+    applyCongestionControl();
+}
+
+
+void KcpSocketPrivate::setCongestionControl(KcpSocket::CongestionControl congestionControl, quint64 maxPacingRate)
+{
+    this->congestionControl = congestionControl;
+    this->maxPacingRate = maxPacingRate;
+    applyCongestionControl();
+}
+
+
+void KcpSocketPrivate::applyCongestionControl()
+{
+    congestion.reset();
+    kcp->snd_wnd = maxSendWindow;
+    switch (congestionControl) {
+    case KcpSocket::DefaultCongestionControl:
+        kcp->nocwnd = defaultNoCwnd;
+        break;
+    case KcpSocket::KcpCongestionControl:
+        kcp->nocwnd = 0;
+        break;
+    case KcpSocket::FixedRateCongestionControl:
+        kcp->nocwnd = 1;
+        break;
+    case KcpSocket::BbrCongestionControl:
+        kcp->nocwnd = 1;
+        congestion.reset(new KcpBbrController());
+        break;
+    }
+    pacingRate = maxPacingRate;
 }
 
 
@@ -285,58 +1332,69 @@ qint32 KcpSocketPrivate::send(const char *data, qint32 size, bool all)
         return -1;
     }
 
-    int count = 0;
-    while (count < size) {
-        if (state != Socket::ConnectedState) {
-            error = Socket::SocketAccessError;
-            errorString = QStringLiteral("KcpSocket is not connected.");
-            return -1;
-        }
+    if (state != Socket::ConnectedState) {
+        error = Socket::SocketAccessError;
+        errorString = QStringLiteral("KcpSocket is not connected.");
+        return -1;
+    }
+    // one block only if not all, as before.
+    const qint32 mss = static_cast<qint32>(kcp->mss);
+    const qint32 total = all ? size : qMin(size, mss);
+    qint32 count = 0;
+    {
         ScopedLock<RLock> l(kcpLock); Q_UNUSED(l);
-        qint32 nextBlockSize = qMin<qint32>(static_cast<qint32>(kcp->mss), size - count);
-        int result = ikcp_send(kcp, data + count, nextBlockSize);
-        if (result < 0) {
-            qWarning() << "why this happended?";
-            updateKcp();
-            return count;
-        } else { // result == 0
-            count += nextBlockSize;
-            if (!all) {
-                updateKcp();
-                return count;
+        while (count < total) {
+            qint32 nextBlockSize = qMin<qint32>(mss, total - count);
+            int result = ikcp_send(kcp, data + count, nextBlockSize);
+            if (result < 0) {
+                qWarning() << "why this happended?";
+                break;
             }
+            count += nextBlockSize;
         }
     }
-    Q_ASSERT(all);
     updateKcp();
+    if (count < total) {
+        return count;
+    }
     return isValid() ? count : -1;
 }
 
 
 qint32 KcpSocketPrivate::recv(char *data, qint32 size, bool all)
 {
+    qint32 count = 0;
     while (true) {
         if (state != Socket::ConnectedState) {
             error = Socket::SocketAccessError;
             errorString = QStringLiteral("KcpSocket is not connected.");
             return -1;
         }
-        int peeksize = ikcp_peeksize(kcp);
-        if (peeksize > 0) {
-            QByteArray buf(peeksize, Qt::Uninitialized);
+        count += receivingBuffer.read(data + count, size - count);
+        if (count < size) {
+            // the whole messages go to the buffer of caller, the last one may be kept partly.
             ScopedLock<RLock> l(kcpLock); Q_UNUSED(l);
-            int readBytes = ikcp_recv(kcp, buf.data(), buf.size());
-            Q_ASSERT(readBytes == peeksize);
-            receivingBuffer.append(buf);
-        }
-        if (!receivingBuffer.isEmpty()) {
-            if (!all || receivingBuffer.size() >= size) {
-                qint32 len = qMin(size, receivingBuffer.size());
-                memcpy(data, receivingBuffer.data(), static_cast<size_t>(len));
-                receivingBuffer.remove(0, len);
-                return len;
+            while (count < size) {
+                int peeksize = ikcp_peeksize(kcp);
+                if (peeksize <= 0) {
+                    break;
+                }
+                if (peeksize <= size - count) {
+                    int readBytes = ikcp_recv(kcp, data + count, peeksize);
+                    Q_ASSERT(readBytes == peeksize);
+                    count += readBytes;
+                } else {
+                    char *buf = receivingBuffer.reserve(peeksize);
+                    int readBytes = ikcp_recv(kcp, buf, peeksize);
+                    Q_ASSERT(readBytes == peeksize);
+                    receivingBuffer.commit(readBytes);
+                    count += receivingBuffer.read(data + count, size - count);
+                }
             }
         }
+        if (count > 0 && (!all || count >= size)) {
+            return count;
+        }
         receivingQueueNotEmpty->clear();
         bool ok = receivingQueueNotEmpty->wait();
         if (!ok) {
@@ -347,46 +1405,201 @@ qint32 KcpSocketPrivate::recv(char *data, qint32 size, bool all)
 }
 
 
-bool KcpSocketPrivate::handleDatagram(const QByteArray &buf)
+bool KcpSocketPrivate::handleDatagram(const char *buf, qint32 size)
 {
-    if (buf.isEmpty()) {
-        return true;
+#ifndef QTNG_NO_CRYPTO
+    if (!presharedKey.isNull()) {
+        qint32 plainSize = 0;
+        const char *plain = unseal(buf, size, &plainSize);
+        if (!plain) {
+            return true;  // dropped silently, so a forged packet can not close the socket.
+        }
+        ++stats.packetsReceived;
+        stats.bytesReceived += static_cast<quint64>(size);
+        return handlePacket(plain, plainSize);
+    }
+#endif
+    ++stats.packetsReceived;
+    stats.bytesReceived += static_cast<quint64>(size);
+    return handlePacket(buf, size);
+}
+
+
+qint32 KcpSocketPrivate::output(const char *data, qint32 size)
+{
+#ifndef QTNG_NO_CRYPTO
+    if (!presharedKey.isNull()) {
+        const int headerSize = SealHeaderSize;
+        const qint32 sealedSize = headerSize + size + sealer->tagSize();
+        if (sealBuffer.size() < sealedSize) {
+            sealBuffer.resize(sealedSize);
+        }
+        char *p = sealBuffer.data();
+        p[0] = PACKET_TYPE_SEALED;
+        memcpy(p + 1, sealSalt.constData(), SealSaltSize);
+        qToBigEndian<quint64>(++sealCounter, reinterpret_cast<uchar *>(p + 1 + SealSaltSize));
+        // the counter is the nonce, padded by zeros in front.
+        char nonce[32];
+        const int nonceSize = sealer->nonceSize();
+        memset(nonce, 0, sizeof(nonce));
+        memcpy(nonce + nonceSize - 8, p + 1 + SealSaltSize, 8);
+        memcpy(p + headerSize, data, static_cast<size_t>(size));
+        const int n = sealer->seal(nonce, p + headerSize, size, p, headerSize);
+        if (n < 0) {
+            return -1;
+        }
+        if (rawSend(p, headerSize + n) != headerSize + n) {
+            return -1;
+        }
+        ++stats.packetsSent;
+        stats.bytesSent += static_cast<quint64>(headerSize + n);
+        return size;
+    }
+#endif
+    const qint32 sentBytes = rawSend(data, size);
+    if (sentBytes > 0) {
+        ++stats.packetsSent;
+        stats.bytesSent += static_cast<quint64>(sentBytes);
+    }
+    return sentBytes;
+}
+
+
+#ifndef QTNG_NO_CRYPTO
+void KcpSocketPrivate::setPresharedKey(QSharedPointer<KcpPresharedKey> presharedKey)
+{
+    this->presharedKey = presharedKey;
+    opener.clear();
+    openSalt.clear();
+    sealer.clear();
+    if (!presharedKey.isNull()) {
+        sealSalt = randomBytes(SealSaltSize);
+        sealer = presharedKey->derive(sealSalt);
+        sealCounter = 0;
+    }
+}
+
+
+const char *KcpSocketPrivate::unseal(const char *buf, qint32 size, qint32 *plainSize)
+{
+    if (size < SealHeaderSize || buf[0] != PACKET_TYPE_SEALED) {
+        return nullptr;
+    }
+    const QByteArray &salt = QByteArray::fromRawData(buf + 1, SealSaltSize);
+    if (!opener.isNull()) {
+        // the peer keeps its salt for the whole session.
+        return salt == openSalt ? open(opener, buf, size, plainSize) : nullptr;
+    }
+    // the salt is pinned only if the packet is genuine, so a forged one can not take its place.
+    QSharedPointer<AeadCipher> cipher = presharedKey->derive(salt);
+    const char *plain = open(cipher, buf, size, plainSize);
+    if (plain) {
+        opener = cipher;
+        openSalt = QByteArray(buf + 1, SealSaltSize);
+    }
+    return plain;
+}
+
+
+const char *KcpSocketPrivate::open(QSharedPointer<AeadCipher> cipher, const char *buf, qint32 size, qint32 *plainSize)
+{
+    const int headerSize = SealHeaderSize;
+    if (size < headerSize + cipher->tagSize() || buf[0] != PACKET_TYPE_SEALED) {
+        return nullptr;
+    }
+    if (openBuffer.size() < size) {
+        openBuffer.resize(size);
+    }
+    char *p = openBuffer.data();
+    memcpy(p, buf, static_cast<size_t>(size));
+    char nonce[32];
+    const int nonceSize = cipher->nonceSize();
+    memset(nonce, 0, sizeof(nonce));
+    memcpy(nonce + nonceSize - 8, p + 1 + SealSaltSize, 8);
+    const int n = cipher->open(nonce, p + headerSize, size - headerSize, p, headerSize);
+    if (n < 0) {
+        return nullptr;
+    }
+    *plainSize = n;
+    return p + headerSize;
+}
+#endif
+
+
+static inline bool isDataPacket(const char *buf, qint32 size)
+{
+    if (size <= 0) {
+        return false;
     }
-    int dataSize;
-    switch(buf.at(0)) {
+    switch (buf[0]) {
     case PACKET_TYPE_COMPRESSED_DATA:
     case PACKET_TYPE_UNCOMPRESSED_DATA:
-        if (buf.size() < 3) {
-            qDebug() << "invalid packet. buf.size() < 3, packet is dropped.";
-            return true;
-        }
+    case PACKET_TYPE_LZ4_DATA:
+    case PACKET_TYPE_ZSTD_DATA:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+void KcpSocketPrivate::handleDataPacket(const char *buf, qint32 size)
+{
+    if (size < 3) {
+        qDebug() << "invalid packet. buf.size() < 3, packet is dropped.";
+        return;
+    }
 #if (QT_VERSION >= QT_VERSION_CHECK(5, 7, 0))
-        dataSize = qFromBigEndian<quint16>(buf.constData() + 1);
+    int dataSize = qFromBigEndian<quint16>(buf + 1);
 #else
-        dataSize = qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(buf.constData() + 1));
+    int dataSize = qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(buf + 1));
 #endif
-        if (dataSize != buf.size() - 3) {
-            qDebug() << "invalid packet. dataSize != buf.size() - 3, packet is dropped.";
-            return true;
-        }
+    if (dataSize != size - 3) {
+        qDebug() << "invalid packet. dataSize != buf.size() - 3, packet is dropped.";
+        return;
+    }
 
-        int result;
-        if (buf.at(0) == PACKET_TYPE_UNCOMPRESSED_DATA) {
-            ScopedLock<RLock> l(kcpLock); Q_UNUSED(l);
-            result = ikcp_input(kcp, buf.data() + 3, dataSize);
-        } else {
-            const QByteArray &uncompressed = qUncompress(reinterpret_cast<const uchar*>(buf.data() + 3), dataSize);
-            ScopedLock<RLock> l(kcpLock); Q_UNUSED(l);
-            result = ikcp_input(kcp, uncompressed.constData(), uncompressed.size());
-        }
-        if (result < 0) {
-            // invalid datagram
-            qDebug() << "invalid datagram. kcp returns" << result;
-        } else {
-            lastActiveTimestamp = static_cast<quint64>(QDateTime::currentMSecsSinceEpoch());
-            receivingQueueNotEmpty->set();
-            updateKcp();
+    int result;
+    if (buf[0] == PACKET_TYPE_UNCOMPRESSED_DATA) {
+        ScopedLock<RLock> l(kcpLock); Q_UNUSED(l);
+        result = ikcp_input(kcp, buf + 3, dataSize);
+    } else {
+        qint32 uncompressedSize = 0;
+        const char *uncompressed = compressor.decompress(buf[0], buf + 3, dataSize, &uncompressedSize);
+        if (!uncompressed) {
+            qDebug() << "invalid compressed packet, packet is dropped.";
+            return;
         }
+        ScopedLock<RLock> l(kcpLock); Q_UNUSED(l);
+        result = ikcp_input(kcp, uncompressed, uncompressedSize);
+    }
+    if (result < 0) {
+        // invalid datagram
+        qDebug() << "invalid datagram. kcp returns" << result;
+    } else {
+        lastActiveTimestamp = static_cast<quint64>(QDateTime::currentMSecsSinceEpoch());
+        receivingQueueNotEmpty->set();
+        updateKcp();
+    }
+}
+
+
+bool KcpSocketPrivate::handlePacket(const char *buf, qint32 size)
+{
+    if (size <= 0) {
+        return true;
+    }
+    switch(buf[0]) {
+    case PACKET_TYPE_COMPRESSED_DATA:
+    case PACKET_TYPE_UNCOMPRESSED_DATA:
+    case PACKET_TYPE_LZ4_DATA:
+    case PACKET_TYPE_ZSTD_DATA:
+        handleDataPacket(buf, size);
+        break;
+    case PACKET_TYPE_FEC_SHARD:
+        return handleFecShard(buf, size);
+    case PACKET_TYPE_DATAGRAM:
+        handleDatagramPacket(buf, size);
         break;
     case PACKET_TYPE_CLOSE:
         close(true);
@@ -401,58 +1614,89 @@ bool KcpSocketPrivate::handleDatagram(const QByteArray &buf)
 }
 
 
-void KcpSocketPrivate::doUpdate()
+bool KcpSocketPrivate::updateOnce(quint64 now, quint32 *interval)
 {
     Q_Q(KcpSocket);
     // in close(), state is set to Socket::UnconnectedState but error = NoError.
-    while (state == Socket::ConnectedState || error == Socket::NoError) {
-        quint64 now = static_cast<quint64>(QDateTime::currentMSecsSinceEpoch());
-        if (now - lastActiveTimestamp > tearDownTime) {
-            close(true);
-            return;
-        }
-        quint32 current = static_cast<quint32>(now - zeroTimestamp);  // impossible to overflow.
-        {
-            ScopedLock<RLock> l(kcpLock); Q_UNUSED(l);
-            ikcp_update(kcp, current);   // ikcp_update() call ikcp_flush() and then kcp_callback(), and maybe close(true)
-        }
-        if (state != Socket::ConnectedState && error != Socket::NoError) {
-            return;
+    if (state != Socket::ConnectedState && error != Socket::NoError) {
+        return false;
+    }
+    if (now - lastActiveTimestamp > tearDownTime) {
+        close(true);
+        return false;
+    }
+    quint32 current = static_cast<quint32>(now - zeroTimestamp);  // impossible to overflow.
+    {
+        ScopedLock<RLock> l(kcpLock); Q_UNUSED(l);
+        if (!congestion.isNull()) {
+            pacingRate = congestion->update(kcp, now, maxSendWindow);
+            if (maxPacingRate > 0) {
+                pacingRate = qMin(pacingRate, maxPacingRate);
+            }
         }
+        ikcp_update(kcp, current);   // ikcp_update() call ikcp_flush() and then kcp_callback(), and maybe close(true)
+    }
+    if (state != Socket::ConnectedState && error != Socket::NoError) {
+        return false;
+    }
 
-        quint32 ts = ikcp_check(kcp, current);
-        quint32 interval = ts - current;
+    quint32 ts = ikcp_check(kcp, current);
+    *interval = ts - current;
 
-        if (now - lastKeepaliveTimestamp > 1000 * 5) {
-            const QByteArray &packet = makeKeepalivePacket();
-            if (rawSend(packet.data(), packet.size()) != packet.size()) {
-                close(true);
-                return;
-            }
+    if (now - lossTimestamp >= 1000) {
+        const quint32 segments = kcp->seg_xmit - lossSegments;
+        const quint32 retransmissions = (kcp->xmit + kcp->fast_xmit) - lossRetransmissions;
+        if (segments > 0) {
+            const double loss = static_cast<double>(retransmissions) / segments;
+            stats.lossRate = stats.lossRate * 0.875 + loss * 0.125;
+        }
+        lossTimestamp = now;
+        lossSegments = kcp->seg_xmit;
+        lossRetransmissions = kcp->xmit + kcp->fast_xmit;
+    }
+
+    if (now - lastKeepaliveTimestamp > 1000 * 5) {
+        const QByteArray &packet = makeKeepalivePacket();
+        if (output(packet.data(), packet.size()) != packet.size()) {
+            close(true);
+            return false;
         }
+        lastKeepaliveTimestamp = now;
+    }
 
-        int sendingQueueSize = ikcp_waitsnd(kcp);
-        if (sendingQueueSize <= 0) {
+    int sendingQueueSize = ikcp_waitsnd(kcp);
+    Metrics::observe("qtng_kcp_sending_queue_packets", QByteArray(), qMax(sendingQueueSize, 0), Metrics::DepthBuckets);
+    if (sendingQueueSize <= 0) {
+        sendingQueueNotFull->set();
+        sendingQueueEmpty->set();
+        q->busy.clear();
+        q->notBusy.set();
+    } else {
+        sendingQueueEmpty->clear();
+        if (static_cast<quint32>(sendingQueueSize) > waterLine) {
+            if (static_cast<quint32>(sendingQueueSize) > (waterLine * 1.2)) {
+                sendingQueueNotFull->clear();
+            }
+            q->busy.set();
+            q->notBusy.clear();
+        } else {
             sendingQueueNotFull->set();
-            sendingQueueEmpty->set();
             q->busy.clear();
             q->notBusy.set();
-        } else {
-            sendingQueueEmpty->clear();
-            if (static_cast<quint32>(sendingQueueSize) > waterLine) {
-                if (static_cast<quint32>(sendingQueueSize) > (waterLine * 1.2)) {
-                    sendingQueueNotFull->clear();
-                }
-                q->busy.set();
-                q->notBusy.clear();
-            } else {
-                sendingQueueNotFull->set();
-                q->busy.clear();
-                q->notBusy.set();
-            }
         }
+    }
+    return true;
+}
 
 
+void KcpSocketPrivate::doUpdate()
+{
+    while (true) {
+        quint64 now = static_cast<quint64>(QDateTime::currentMSecsSinceEpoch());
+        quint32 interval;
+        if (!updateOnce(now, &interval)) {
+            return;
+        }
         forceToUpdate->close();
         try {
             Timeout timeout(interval, 0); Q_UNUSED(timeout);
@@ -474,28 +1718,293 @@ void KcpSocketPrivate::updateKcp()
 }
 
 
-QByteArray KcpSocketPrivate::makeDataPacket(const char *data, qint32 size)
+void KcpSocketPrivate::setForwardErrorCorrection(int dataShards, int parityShards)
+{
+    if (dataShards <= 0 || parityShards <= 0 || dataShards + parityShards > 255) {
+        dataShards = parityShards = 0;
+    }
+    fecDataShards = dataShards;
+    fecParityShards = parityShards;
+    fecPending.clear();
+}
+
+
+qint32 KcpSocketPrivate::pacedOutput(const char *data, qint32 size)
+{
+    if (pacingRate == 0 && pacingQueue.isEmpty()) {
+        return output(data, size);
+    }
+    pacingQueue.append(QByteArray(data, size));
+    operations->spawnWithName("pacing", [this] { doPace(); }, false);
+    return size;
+}
+
+
+// a token bucket filled at the pacing rate, holding the bytes of five msecs at most.
+void KcpSocketPrivate::doPace()
+{
+    while (!pacingQueue.isEmpty()) {
+        const quint64 now = static_cast<quint64>(QDateTime::currentMSecsSinceEpoch());
+        if (pacingRate == 0) {
+            pacingTokens = pacingQueue.first().size();
+        } else {
+            const qint64 burst = qMax<qint64>(static_cast<qint64>(pacingRate / 200), 2 * static_cast<qint64>(kcp->mtu));
+            pacingTokens = qMin<qint64>(pacingTokens + static_cast<qint64>((now - pacingTimestamp) * pacingRate / 1000), burst);
+        }
+        pacingTimestamp = now;
+        const QByteArray packet = pacingQueue.first();
+        if (pacingTokens < packet.size()) {
+            const quint64 msecs = static_cast<quint64>(packet.size() - pacingTokens) * 1000 / pacingRate;
+            Coroutine::msleep(static_cast<quint32>(qMax<quint64>(msecs, 1)));
+            continue;
+        }
+        pacingQueue.removeFirst();
+        pacingTokens -= packet.size();
+        if (output(packet.constData(), packet.size()) != packet.size()) {
+            error = Socket::SocketAccessError;
+            errorString = QStringLiteral("can not send udp packet");
+            close(true);
+            return;
+        }
+    }
+}
+
+
+qint32 KcpSocketPrivate::sendDataPacket(const QByteArray &packet)
+{
+    if (fecParityShards <= 0) {
+        return pacedOutput(packet.constData(), packet.size());
+    }
+    QByteArray header(FecHeaderSize, Qt::Uninitialized);
+    header[0] = PACKET_TYPE_FEC_SHARD;
+    qToBigEndian<quint32>(fecGroupId, reinterpret_cast<uchar *>(header.data() + 1));
+    header[5] = static_cast<char>(fecPending.size());
+    header[6] = static_cast<char>(fecDataShards);
+    header[7] = static_cast<char>(fecParityShards);
+    const QByteArray &shard = header + packet;
+    if (pacedOutput(shard.constData(), shard.size()) != shard.size()) {
+        return -1;
+    }
+    QByteArray data(2, Qt::Uninitialized);
+    data[0] = static_cast<char>((packet.size() >> 8) & 0xff);
+    data[1] = static_cast<char>(packet.size() & 0xff);
+    data.append(packet);
+    fecPending.append(data);
+    if (fecPending.size() < fecDataShards) {
+        return packet.size();
+    }
+
+    int shardSize = 0;
+    for (const QByteArray &pending: fecPending) {
+        shardSize = qMax(shardSize, pending.size());
+    }
+    for (QByteArray &pending: fecPending) {
+        pending.append(QByteArray(shardSize - pending.size(), '\0'));
+    }
+    const GaloisField &field = gf();
+    for (int i = 0; i < fecParityShards; ++i) {
+        QByteArray parity(FecHeaderSize + shardSize, '\0');
+        memcpy(parity.data(), header.constData(), FecHeaderSize);
+        parity[5] = static_cast<char>(fecDataShards + i);
+        uchar *dst = reinterpret_cast<uchar *>(parity.data() + FecHeaderSize);
+        for (int j = 0; j < fecDataShards; ++j) {
+            field.mulAdd(dst, reinterpret_cast<const uchar *>(fecPending.at(j).constData()),
+                         fecMatrix(fecDataShards + i, j, fecDataShards), shardSize);
+        }
+        if (pacedOutput(parity.constData(), parity.size()) != parity.size()) {
+            return -1;
+        }
+    }
+    fecPending.clear();
+    ++fecGroupId;
+    return packet.size();
+}
+
+
+bool KcpSocketPrivate::handleFecShard(const char *buf, qint32 size)
+{
+    if (size <= FecHeaderSize) {
+        return true;
+    }
+    const quint32 groupId = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(buf + 1));
+    const int index = static_cast<quint8>(buf[5]);
+    const int dataShards = static_cast<quint8>(buf[6]);
+    const int parityShards = static_cast<quint8>(buf[7]);
+    if (dataShards == 0 || index >= dataShards + parityShards) {
+        return true;
+    }
+    const char *payload = buf + FecHeaderSize;
+    const qint32 payloadSize = size - FecHeaderSize;
+    if (index < dataShards) {
+        // only the data packets are protected by fec. a shard in shard is dropped, or the nested shards of one
+        // forged datagram recurse deep enough to overflow the stack.
+        if (!isDataPacket(payload, payloadSize)) {
+            return true;
+        }
+        ++fecStats.dataShards;
+        // the data shard is handled at once, the group only keeps it for recovering others.
+        handleDataPacket(payload, payloadSize);
+    } else {
+        ++fecStats.parityShards;
+    }
+
+    QMap<quint32, FecGroup>::iterator itor = fecGroups.find(groupId);
+    if (itor == fecGroups.end()) {
+        if (fecGroups.size() >= FecMaxPendingGroups) {
+            QMap<quint32, FecGroup>::iterator oldest = fecGroups.begin();
+            if (!oldest.value().done) {
+                ++fecStats.unrecoverable;
+            }
+            fecGroups.erase(oldest);
+        }
+        FecGroup group;
+        group.dataShards = dataShards;
+        group.parityShards = parityShards;
+        group.shards.resize(dataShards + parityShards);
+        itor = fecGroups.insert(groupId, group);
+    }
+    FecGroup &group = itor.value();
+    if (group.done || group.dataShards != dataShards || group.parityShards != parityShards
+            || !group.shards.at(index).isNull()) {
+        return true;
+    }
+    if (index < dataShards) {
+        QByteArray data(2, Qt::Uninitialized);
+        data[0] = static_cast<char>((payloadSize >> 8) & 0xff);
+        data[1] = static_cast<char>(payloadSize & 0xff);
+        data.append(payload, payloadSize);
+        group.shards[index] = data;
+        ++group.dataReceived;
+    } else {
+        group.shards[index] = QByteArray(payload, payloadSize);
+    }
+    ++group.received;
+    if (group.dataReceived == dataShards) {
+        group.done = true;
+        group.shards.clear();
+        return true;
+    }
+    if (group.received < dataShards) {
+        return true;
+    }
+    const QList<QByteArray> packets = fecRecover(&group);
+    group.done = true;
+    group.shards.clear();
+    for (const QByteArray &packet: packets) {
+        if (!isDataPacket(packet.constData(), packet.size())) {
+            continue;
+        }
+        ++fecStats.recovered;
+        handleDataPacket(packet.constData(), packet.size());
+    }
+    return true;
+}
+
+
+QByteArray KcpSocketPrivate::makeDataPacket(const char *data, qint32 size)
+{
+    QByteArray packet;
+    if (compressor.codec != KcpSocket::NoCompression) {
+        stats.uncompressedBytes += static_cast<quint64>(size);
+    }
+    if (compressor.compress(data, size, &packet)) {
+        stats.compressedBytes += static_cast<quint64>(packet.size() - 3);
+        return packet;
+    }
+    if (compressor.codec != KcpSocket::NoCompression) {
+        stats.compressedBytes += static_cast<quint64>(size);
+    }
+    packet.resize(3 + size);
+    packet[0] = PACKET_TYPE_UNCOMPRESSED_DATA;
+    packet[1] = static_cast<char>((size >> 8) & 0xff);
+    packet[2] = static_cast<char>(size & 0xff);
+    memcpy(packet.data() + 3, data, static_cast<size_t>(size));
+    return packet;
+}
+
+
+// sent at once by output(), so it is not paced, nor protected by fec.
+qint32 KcpSocketPrivate::sendDatagram(const char *data, qint32 size, quint8 channel)
+{
+    if (size <= 0 || size > static_cast<qint32>(kcp->mss) || state != Socket::ConnectedState) {
+        return -1;
+    }
+    KcpDatagramChannel &c = datagramChannels[channel];
+    QByteArray packet(DatagramHeaderSize + size, Qt::Uninitialized);
+    char *p = packet.data();
+    p[0] = PACKET_TYPE_DATAGRAM;
+    p[1] = static_cast<char>(channel);
+    qToBigEndian<quint32>(c.nextSequence++, reinterpret_cast<uchar *>(p + 2));
+    memcpy(p + DatagramHeaderSize, data, static_cast<size_t>(size));
+    if (output(packet.constData(), packet.size()) != packet.size()) {
+        return -1;
+    }
+    ++stats.datagramsSent;
+    return size;
+}
+
+
+QByteArray KcpSocketPrivate::recvDatagram(quint8 *channel)
+{
+    while (state == Socket::ConnectedState) {
+        const quint64 now = static_cast<quint64>(QDateTime::currentMSecsSinceEpoch());
+        while (!datagrams.isEmpty()) {
+            const KcpDatagram datagram = datagrams.takeFirst();
+            const quint32 maxAge = datagramChannels.value(datagram.channel).maxAge;
+            if (maxAge > 0 && now - datagram.timestamp > maxAge) {
+                ++stats.datagramsDropped;
+                continue;
+            }
+            if (channel) {
+                *channel = datagram.channel;
+            }
+            return datagram.data;
+        }
+        datagramsNotEmpty->clear();
+        if (!datagramsNotEmpty->wait()) {
+            break;
+        }
+    }
+    return QByteArray();
+}
+
+
+void KcpSocketPrivate::handleDatagramPacket(const char *buf, qint32 size)
 {
-    QByteArray packet;
-
-    if (compression) {
-        QByteArray compressed = qCompress(reinterpret_cast<const uchar*>(data), size);
-        if (compressed.size() < size) {
-            packet.reserve(3 + compressed.size());
-            packet.append(PACKET_TYPE_COMPRESSED_DATA);
-            packet.append(static_cast<char>((compressed.size() >> 8) & 0xff));
-            packet.append(static_cast<char>(compressed.size() & 0xff));
-            packet.append(compressed);
-            return packet;
+    if (size <= DatagramHeaderSize) {
+        return;
+    }
+    const quint8 channel = static_cast<quint8>(buf[1]);
+    const quint32 sequence = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(buf + 2));
+    const quint64 now = static_cast<quint64>(QDateTime::currentMSecsSinceEpoch());
+    lastActiveTimestamp = now;
+    ++stats.datagramsReceived;
+    KcpDatagramChannel &c = datagramChannels[channel];
+    if (c.policy == KcpSocket::LatestDatagramOnly) {
+        // the sequence wraps, so it is compared by the difference.
+        if (c.received && static_cast<qint32>(sequence - c.lastSequence) <= 0) {
+            ++stats.datagramsDropped;
+            return;
+        }
+        for (int i = datagrams.size() - 1; i >= 0; --i) {
+            if (datagrams.at(i).channel == channel) {
+                datagrams.removeAt(i);
+                ++stats.datagramsDropped;
+            }
         }
     }
-
-    packet.reserve(3 + size);
-    packet.append(PACKET_TYPE_UNCOMPRESSED_DATA);
-    packet.append(static_cast<char>((size >> 8) & 0xff));
-    packet.append(static_cast<char>(size & 0xff));
-    packet.append(data, size);
-    return packet;
+    c.lastSequence = sequence;
+    c.received = true;
+    if (datagrams.size() >= DatagramMaxPending) {
+        datagrams.removeFirst();
+        ++stats.datagramsDropped;
+    }
+    KcpDatagram datagram;
+    datagram.data = QByteArray(buf + DatagramHeaderSize, size - DatagramHeaderSize);
+    datagram.timestamp = now;
+    datagram.channel = channel;
+    datagrams.append(datagram);
+    datagramsNotEmpty->set();
 }
 
 
@@ -516,19 +2025,19 @@ QByteArray KcpSocketPrivate::makeKeepalivePacket()
 
 
 MasterKcpSocketPrivate::MasterKcpSocketPrivate(Socket::NetworkLayerProtocol protocol, KcpSocket *q)
-    : KcpSocketPrivate(q), rawSocket(new Socket(protocol, Socket::UdpSocket))
+    : KcpSocketPrivate(q), rawSocket(new Socket(protocol, Socket::UdpSocket)), timersChanged(new Event())
 {
 }
 
 
 MasterKcpSocketPrivate::MasterKcpSocketPrivate(qintptr socketDescriptor, KcpSocket *q)
-    : KcpSocketPrivate(q), rawSocket(new Socket(socketDescriptor))
+    : KcpSocketPrivate(q), rawSocket(new Socket(socketDescriptor)), timersChanged(new Event())
 {
 }
 
 
 MasterKcpSocketPrivate::MasterKcpSocketPrivate(QSharedPointer<Socket> rawSocket, KcpSocket *q)
-    : KcpSocketPrivate(q), rawSocket(rawSocket)
+    : KcpSocketPrivate(q), rawSocket(rawSocket), timersChanged(new Event())
 {
 }
 
@@ -597,7 +2106,7 @@ bool MasterKcpSocketPrivate::close(bool force)
                 return false;
             }
             const QByteArray &packet = makeShutdownPacket();
-            rawSend(packet.constData(), packet.size());
+            output(packet.constData(), packet.size());
         }
     } else if (state == Socket::ListeningState) {
         state = Socket::UnconnectedState;
@@ -618,8 +2127,11 @@ bool MasterKcpSocketPrivate::close(bool force)
     //connected and listen state would do more cleaning work.
     operations->kill("update_kcp");
     operations->kill("receiving");
+    operations->kill("scheduling");
+    timers.clear();
     // await all pending recv()/send()
     receivingQueueNotEmpty->set();
+    datagramsNotEmpty->set();
     sendingQueueEmpty->set();
     sendingQueueNotFull->set();
     return true;
@@ -637,26 +2149,47 @@ bool MasterKcpSocketPrivate::listen(int backlog)
 }
 
 
+// receive many udp packets in one syscall.
+const int KcpReceiveBatch = 8;
+const int KcpMaxDatagramSize = 1024 * 64;
+
+
 void MasterKcpSocketPrivate::doReceive()
 {
-    QHostAddress addr;
-    quint16 port;
-    QByteArray buf(1024 * 64, Qt::Uninitialized);
+    QByteArray buf(KcpReceiveBatch * KcpMaxDatagramSize, Qt::Uninitialized);
+    SocketDatagram datagrams[KcpReceiveBatch];
+    for (int i = 0; i < KcpReceiveBatch; ++i) {
+        datagrams[i].data = buf.data() + i * KcpMaxDatagramSize;
+        datagrams[i].size = KcpMaxDatagramSize;
+    }
+    // fails silently if the kernel do not support UDP_GRO.
+    rawSocket->setOption(Socket::UdpGroOption, true);
     while (true) {
-        qint32 len = rawSocket->recvfrom(buf.data(), buf.size(), &addr, &port);
-        if (Q_UNLIKELY(len < 0 || addr.isNull() || port == 0)) {
+        qint32 count = rawSocket->recvmany(datagrams, KcpReceiveBatch);
+        if (Q_UNLIKELY(count <= 0)) {
             error = Socket::SocketResourceError;
             errorString = QStringLiteral("KcpSocket can not receive udp packet.");
             MasterKcpSocketPrivate::close(true);
             return;
         }
-//        if (Q_UNLIKELY(addr.toIPv6Address() != remoteAddress.toIPv6Address() || port != remotePort)) {
-//            // not my packet.
-//            qDebug() << "not my packet:" << addr << remoteAddress << port;
-//            continue;
-//        }
-        if (!handleDatagram(QByteArray(buf.constData(), len))) {
-            return;
+        for (qint32 i = 0; i < count; ++i) {
+            const SocketDatagram &datagram = datagrams[i];
+            if (Q_UNLIKELY(datagram.endpoint.isNull() || datagram.endpoint.port == 0)) {
+                error = Socket::SocketResourceError;
+                errorString = QStringLiteral("KcpSocket can not receive udp packet.");
+                MasterKcpSocketPrivate::close(true);
+                return;
+            }
+            // a datagram coalesced by UDP_GRO carries packets of segmentSize bytes, the last one may be shorter.
+            const qint32 step = datagram.segmentSize > 0 ? datagram.segmentSize : datagram.length;
+            qint32 offset = 0;
+            do {
+                qint32 len = qMin(step, datagram.length - offset);
+                if (!handleDatagram(datagram.data + offset, len)) {
+                    return;
+                }
+                offset += len;
+            } while (offset < datagram.length);
         }
     }
 }
@@ -664,38 +2197,114 @@ void MasterKcpSocketPrivate::doReceive()
 
 void MasterKcpSocketPrivate::doAccept()
 {
-    QHostAddress addr;
-    quint16 port;
-    QByteArray buf(1024 * 64, Qt::Uninitialized);
+    QByteArray buf(KcpReceiveBatch * KcpMaxDatagramSize, Qt::Uninitialized);
+    SocketDatagram datagrams[KcpReceiveBatch];
+    for (int i = 0; i < KcpReceiveBatch; ++i) {
+        datagrams[i].data = buf.data() + i * KcpMaxDatagramSize;
+        datagrams[i].size = KcpMaxDatagramSize;
+    }
+    // fails silently if the kernel do not support UDP_GRO.
+    rawSocket->setOption(Socket::UdpGroOption, true);
     while (true) {
-        qint32 len = rawSocket->recvfrom(buf.data(), buf.size(), &addr, &port);
-        if (Q_UNLIKELY(len < 0 || addr.isNull() || port == 0)) {
+        qint32 count = rawSocket->recvmany(datagrams, KcpReceiveBatch);
+        if (Q_UNLIKELY(count <= 0)) {
             error = Socket::SocketResourceError;
             errorString = QStringLiteral("KcpSocket can not receive udp packet.");
             MasterKcpSocketPrivate::close(true);
             return;
         }
-        const QString &key = concat(addr, port);
-        if (receivers.contains(key)) {
-            QPointer<SlaveKcpSocketPrivate> receiver = receivers.value(key);
-            if (!receiver.isNull()) {
-                if (!receiver->handleDatagram(QByteArray(buf.constData(), len))) {
-                    receivers.remove(key);
-                }
+        for (qint32 i = 0; i < count; ++i) {
+            const SocketDatagram &datagram = datagrams[i];
+            const QHostAddress &addr = datagram.address;
+            quint16 port = datagram.port;
+            const Endpoint &key = datagram.endpoint;
+            if (Q_UNLIKELY(key.isNull() || port == 0)) {
+                error = Socket::SocketResourceError;
+                errorString = QStringLiteral("KcpSocket can not receive udp packet.");
+                MasterKcpSocketPrivate::close(true);
+                return;
             }
-        } else {
-            if (pendingSlaves.size() < pendingSlaves.capacity()) {  // not full.
-                QSharedPointer<KcpSocket> slave(KcpSocketPrivate::create(this, addr, port, this->mode));
-                SlaveKcpSocketPrivate *d = KcpSocketPrivate::getPrivateHelper(slave);
-                if (d->handleDatagram(QByteArray(buf.constData(), len))) {
-                    receivers.insert(key, d);
-                    pendingSlaves.put(slave);
+            const qint32 step = datagram.segmentSize > 0 ? datagram.segmentSize : datagram.length;
+            qint32 offset = 0;
+            // the segments of one coalesced datagram come from the same peer, so it is looked up once.
+            QPointer<SlaveKcpSocketPrivate> receiver = receivers.find(key);
+            do {
+                qint32 len = qMin(step, datagram.length - offset);
+                const char *packet = datagram.data + offset;
+                offset += len;
+                if (!receiver.isNull()) {
+                    if (!receiver->handleDatagram(packet, len)) {
+                        receivers.remove(key);
+                        receiver.clear();
+                    }
+                } else {
+#ifndef QTNG_NO_CRYPTO
+                    // no session is made for the forged packets, nor the packets of known sessions replayed
+                    // from another address.
+                    QSharedPointer<AeadCipher> opener;
+                    QByteArray openSalt;
+                    if (!presharedKey.isNull()) {
+                        if (len < SealHeaderSize || packet[0] != PACKET_TYPE_SEALED) {
+                            continue;
+                        }
+                        openSalt = QByteArray(packet + 1, SealSaltSize);
+                        if (acceptedSalts.contains(openSalt)) {
+                            continue;
+                        }
+                        opener = presharedKey->derive(openSalt);
+                        qint32 plainSize;
+                        if (!open(opener, packet, len, &plainSize)) {
+                            continue;
+                        }
+                    }
+#endif
+                    if (pendingSlaves.size() < pendingSlaves.capacity()) {  // not full.
+                        QSharedPointer<KcpSocket> slave(KcpSocketPrivate::create(this, addr, port, this->mode));
+                        SlaveKcpSocketPrivate *d = KcpSocketPrivate::getPrivateHelper(slave);
+                        d->setForwardErrorCorrection(fecDataShards, fecParityShards);
+                        ikcp_wndsize(d->kcp, static_cast<int>(maxSendWindow), static_cast<int>(kcp->rcv_wnd));
+                        ikcp_nodelay(d->kcp, static_cast<int>(kcp->nodelay), static_cast<int>(kcp->interval),
+                                     kcp->fastresend, -1);
+                        d->kcp->rx_minrto = kcp->rx_minrto;
+                        d->maxSendWindow = maxSendWindow;
+                        d->setCongestionControl(congestionControl, maxPacingRate);
+#ifndef QTNG_NO_CRYPTO
+                        d->setPresharedKey(presharedKey);
+                        d->opener = opener;
+                        d->openSalt = openSalt;
+#endif
+                        d->compressor.setCodec(compressor.codec);
+                        if (!compressor.dictionary.isEmpty()) {
+                            d->compressor.setDictionary(compressor.dictionary);
+                        }
+                        if (d->handleDatagram(packet, len)) {
+                            receivers.insert(key, d);
+                            pendingSlaves.put(slave);
+                            receiver = d;
+#ifndef QTNG_NO_CRYPTO
+                            if (!openSalt.isEmpty()) {
+                                rememberSalt(openSalt);
+                            }
+#endif
+                        }
+                    }
                 }
-            }
+            } while (offset < datagram.length);
         }
     }
 }
 
+#ifndef QTNG_NO_CRYPTO
+void MasterKcpSocketPrivate::rememberSalt(const QByteArray &salt)
+{
+    acceptedSalts.insert(salt);
+    acceptedSaltOrder.enqueue(salt);
+    while (acceptedSaltOrder.size() > MaxAcceptedSalts) {
+        acceptedSalts.remove(acceptedSaltOrder.dequeue());
+    }
+}
+#endif
+
 bool MasterKcpSocketPrivate::startReceivingCoroutine()
 {
     if (!operations->get("receiving").isNull()) {
@@ -713,11 +2322,67 @@ bool MasterKcpSocketPrivate::startReceivingCoroutine()
         break;
     case Socket::ListeningState:
         operations->spawnWithName("receiving", [this] { doAccept(); });
+        operations->spawnWithName("scheduling", [this] { doSchedule(); });
         break;
     }
     return true;
 }
 
+
+void MasterKcpSocketPrivate::schedule(SlaveKcpSocketPrivate *slave, quint64 due)
+{
+    if (slave->nextUpdate != 0 && slave->nextUpdate <= due) {
+        return;
+    }
+    slave->nextUpdate = due;
+    KcpTimer timer;
+    timer.due = due;
+    timer.socket = slave;
+    timers.append(timer);
+    std::push_heap(timers.begin(), timers.end());
+    if (timers.first().socket == slave) {
+        timersChanged->set();
+    }
+}
+
+
+void MasterKcpSocketPrivate::doSchedule()
+{
+    while (state == Socket::ListeningState) {
+        const quint64 now = static_cast<quint64>(QDateTime::currentMSecsSinceEpoch());
+        // the due slaves are flushed in one batch, the rescheduled ones are due later than now.
+        while (!timers.isEmpty() && timers.first().due <= now) {
+            std::pop_heap(timers.begin(), timers.end());
+            KcpTimer timer = timers.takeLast();
+            QPointer<SlaveKcpSocketPrivate> slave = timer.socket;
+            if (slave.isNull() || slave->nextUpdate != timer.due) {
+                continue;  // deleted or rescheduled.
+            }
+            slave->nextUpdate = 0;
+            quint32 interval;
+            // rawSend() may block and the slave may be deleted by its user meanwhile.
+            if (slave->updateOnce(now, &interval) && !slave.isNull()) {
+                schedule(slave.data(), now + qMax<quint32>(interval, 1));
+            }
+        }
+        timersChanged->clear();
+        if (timers.isEmpty()) {
+            timersChanged->wait();
+        } else {
+            const quint64 wait = timers.first().due - static_cast<quint64>(QDateTime::currentMSecsSinceEpoch());
+            if (static_cast<qint64>(wait) <= 0) {
+                continue;
+            }
+            try {
+                Timeout timeout(static_cast<quint32>(wait), 0); Q_UNUSED(timeout);
+                timersChanged->wait();
+            } catch (TimeoutException &) {
+                // continue
+            }
+        }
+    }
+}
+
 QSharedPointer<KcpSocket> MasterKcpSocketPrivate::accept()
 {
     if (state != Socket::ListeningState) {
@@ -735,6 +2400,7 @@ bool MasterKcpSocketPrivate::connect(const QHostAddress &addr, quint16 port)
     }
     remoteAddress = addr;
     remotePort = port;
+    remoteEndpoint = Endpoint(addr, port);
     state = Socket::ConnectedState;
     return true;
 }
@@ -748,6 +2414,7 @@ bool MasterKcpSocketPrivate::connect(const QString &hostName, quint16 port, Sock
     if (rawSocket->connect(hostName, port, protocol))  {
         remoteAddress = rawSocket->peerAddress();
         remotePort = port;
+        remoteEndpoint = Endpoint(remoteAddress, port);
         state = Socket::ConnectedState;
         return true;
     } else {
@@ -760,7 +2427,10 @@ qint32 MasterKcpSocketPrivate::rawSend(const char *data, qint32 size)
 {
     lastKeepaliveTimestamp = static_cast<quint64>(QDateTime::currentMSecsSinceEpoch());
     startReceivingCoroutine();
-    qint32 len = rawSocket->sendto(data, size, remoteAddress, remotePort);
+    if (!impairer.isNull()) {
+        return impairer->sendto(rawSocket, data, size, remoteAddress, remotePort);
+    }
+    qint32 len = rawSocket->sendto(data, size, remoteEndpoint);
     return len;
 }
 
@@ -812,10 +2482,11 @@ QVariant MasterKcpSocketPrivate::option(Socket::SocketOption option) const
 
 
 SlaveKcpSocketPrivate::SlaveKcpSocketPrivate(MasterKcpSocketPrivate *parent, const QHostAddress &addr, quint16 port, KcpSocket *q)
-    :KcpSocketPrivate(q), parent(parent)
+    :KcpSocketPrivate(q), parent(parent), nextUpdate(0)
 {
     remoteAddress = addr;
     remotePort = port;
+    remoteEndpoint = Endpoint(addr, port);
     state = Socket::ConnectedState;
 }
 
@@ -901,7 +2572,7 @@ bool SlaveKcpSocketPrivate::close(bool force)
                 return false;
             }
             const QByteArray &packet = makeShutdownPacket();
-            rawSend(packet.constData(), packet.size());
+            output(packet.constData(), packet.size());
         }
     } else {  // there can be no other states.
         state = Socket::UnconnectedState;
@@ -913,6 +2584,7 @@ bool SlaveKcpSocketPrivate::close(bool force)
     }
     // await all pending recv()/send()
     receivingQueueNotEmpty->set();
+    datagramsNotEmpty->set();
     sendingQueueEmpty->set();
     sendingQueueNotFull->set();
 //    q_func()->notBusy.set();
@@ -950,11 +2622,24 @@ qint32 SlaveKcpSocketPrivate::rawSend(const char *data, qint32 size)
         return -1;
     } else {
         lastKeepaliveTimestamp = static_cast<quint64>(QDateTime::currentMSecsSinceEpoch());
-        qint32 len = parent->rawSocket->sendto(data, size, remoteAddress, remotePort);
+        if (!parent->impairer.isNull()) {
+            return parent->impairer->sendto(parent->rawSocket, data, size, remoteAddress, remotePort);
+        }
+        qint32 len = parent->rawSocket->sendto(data, size, remoteEndpoint);
         return len;
     }
 }
 
+void SlaveKcpSocketPrivate::updateKcp()
+{
+    if (parent.isNull() || parent->state != Socket::ListeningState) {
+        KcpSocketPrivate::updateKcp();
+        return;
+    }
+    parent->schedule(this, 1);  // due at once.
+}
+
+
 bool SlaveKcpSocketPrivate::bind(QHostAddress &, quint16, Socket::BindMode)
 {
     return false;
@@ -1032,9 +2717,10 @@ KcpSocket::Mode KcpSocket::mode() const
 
 void KcpSocket::setUdpPacketSize(quint32 udpPacketSize)
 {
-    Q_D(const KcpSocket);
+    Q_D(KcpSocket);
     if (udpPacketSize < 65535) {
         ikcp_setmtu(d->kcp, static_cast<int>(udpPacketSize));
+        d->segmentPool.setMtu(static_cast<int>(d->kcp->mtu));
     }
 }
 
@@ -1049,14 +2735,180 @@ quint32 KcpSocket::udpPacketSize() const
 void KcpSocket::setCompression(bool compression)
 {
     Q_D(KcpSocket);
-    d->compression = compression;
+    d->compressor.setCodec(compression ? ZlibCompression : NoCompression);
 }
 
 
 bool KcpSocket::compression() const
 {
     Q_D(const KcpSocket);
-    return d->compression;
+    return d->compressor.codec != NoCompression;
+}
+
+
+bool KcpSocket::setCompressionCodec(CompressionCodec codec)
+{
+    Q_D(KcpSocket);
+    return d->compressor.setCodec(codec);
+}
+
+
+KcpSocket::CompressionCodec KcpSocket::compressionCodec() const
+{
+    Q_D(const KcpSocket);
+    return d->compressor.codec;
+}
+
+
+void KcpSocket::setCompressionDictionary(const QByteArray &dictionary)
+{
+    Q_D(KcpSocket);
+    d->compressor.setDictionary(dictionary);
+}
+
+
+#ifndef QTNG_NO_CRYPTO
+bool KcpSocket::setEncryption(AeadCipher::Algorithm algo, const QByteArray &key)
+{
+    Q_D(KcpSocket);
+    QSharedPointer<AeadCipher> cipher(new AeadCipher(algo, key));
+    if (!cipher->isValid()) {
+        return false;
+    }
+    d->setPresharedKey(QSharedPointer<KcpPresharedKey>(new KcpPresharedKey(algo, key)));
+    return true;
+}
+#endif
+
+
+void KcpSocket::setForwardErrorCorrection(int dataShards, int parityShards)
+{
+    Q_D(KcpSocket);
+    d->setForwardErrorCorrection(dataShards, parityShards);
+}
+
+
+void KcpSocket::setForwardErrorCorrection(bool enabled)
+{
+    Q_D(KcpSocket);
+    int parityShards = 0;
+    if (enabled) {
+        switch (d->mode) {
+        case LargeDelayInternet:
+            parityShards = 3;
+            break;
+        case Internet:
+        case FastInternet:
+            parityShards = 2;
+            break;
+        case Ethernet:
+        case Loopback:
+            break;
+        }
+    }
+    d->setForwardErrorCorrection(10, parityShards);
+}
+
+
+KcpFecStats KcpSocket::fecStats() const
+{
+    Q_D(const KcpSocket);
+    return d->fecStats;
+}
+
+
+SocketIoStats KcpSocket::ioStats() const
+{
+    Q_D(const KcpSocket);
+    SocketIoStats stats;
+    stats.sendCalls = d->stats.packetsSent;
+    stats.recvCalls = d->stats.packetsReceived;
+    stats.bytesSent = d->stats.bytesSent;
+    stats.bytesReceived = d->stats.bytesReceived;
+    return stats;
+}
+
+
+KcpStats KcpSocket::stats() const
+{
+    Q_D(const KcpSocket);
+    const ikcpcb *kcp = d->kcp;
+    KcpStats stats = d->stats;
+    stats.smoothedRtt = static_cast<quint32>(kcp->rx_srtt);
+    stats.rttVariance = static_cast<quint32>(kcp->rx_rttval);
+    stats.rto = static_cast<quint32>(kcp->rx_rto);
+    stats.congestionWindow = kcp->nocwnd ? 0 : kcp->cwnd;
+    stats.sendWindow = kcp->snd_wnd;
+    stats.remoteWindow = kcp->rmt_wnd;
+    stats.sendQueue = kcp->nsnd_que;
+    stats.sendBuffer = kcp->nsnd_buf;
+    stats.receiveQueue = kcp->nrcv_que;
+    stats.receiveBuffer = kcp->nrcv_buf;
+    stats.segmentsSent = kcp->seg_xmit;
+    stats.retransmissions = kcp->xmit;
+    stats.fastRetransmissions = kcp->fast_xmit;
+    stats.fecRecovered = d->fecStats.recovered;
+    return stats;
+}
+
+
+void KcpSocket::setCongestionControl(CongestionControl congestionControl)
+{
+    Q_D(KcpSocket);
+    d->setCongestionControl(congestionControl, d->maxPacingRate);
+}
+
+
+KcpSocket::CongestionControl KcpSocket::congestionControl() const
+{
+    Q_D(const KcpSocket);
+    return d->congestionControl;
+}
+
+
+void KcpSocket::setPacingRate(quint64 bytesPerSecond)
+{
+    Q_D(KcpSocket);
+    d->maxPacingRate = bytesPerSecond;
+    if (d->congestion.isNull()) {
+        d->pacingRate = bytesPerSecond;
+    }
+}
+
+
+quint64 KcpSocket::pacingRate() const
+{
+    Q_D(const KcpSocket);
+    return d->pacingRate;
+}
+
+
+void KcpSocket::setWindowSize(quint32 sendWindow, quint32 receiveWindow)
+{
+    Q_D(KcpSocket);
+    ikcp_wndsize(d->kcp, static_cast<int>(sendWindow), static_cast<int>(receiveWindow));
+    d->maxSendWindow = d->kcp->snd_wnd;
+}
+
+
+void KcpSocket::setUpdateInterval(quint32 msecs)
+{
+    Q_D(KcpSocket);
+    ikcp_interval(d->kcp, static_cast<int>(qMin<quint32>(msecs, 5000)));
+}
+
+
+void KcpSocket::setFastResend(quint32 acks)
+{
+    Q_D(KcpSocket);
+    ikcp_nodelay(d->kcp, -1, -1, static_cast<int>(qMin<quint32>(acks, 255)), -1);
+}
+
+
+void KcpSocket::setMinRto(quint32 msecs)
+{
+    Q_D(KcpSocket);
+    d->kcp->rx_minrto = static_cast<IINT32>(qBound<quint32>(1, msecs, 60000));
 }
 
 
@@ -1067,6 +2919,13 @@ void KcpSocket::setSendQueueSize(quint32 sendQueueSize)
 }
 
 
+void KcpSocket::setImpairer(QSharedPointer<NetworkImpairer> impairer)
+{
+    Q_D(KcpSocket);
+    d->impairer = impairer;
+}
+
+
 quint32 KcpSocket::sendQueueSize() const
 {
     Q_D(const KcpSocket);
@@ -1081,6 +2940,36 @@ quint32 KcpSocket::payloadSizeHint() const
 }
 
 
+void KcpSocket::setDatagramPolicy(quint8 channel, DatagramPolicy policy, quint32 maxAge)
+{
+    Q_D(KcpSocket);
+    KcpDatagramChannel &c = d->datagramChannels[channel];
+    c.policy = policy;
+    c.maxAge = maxAge;
+}
+
+
+qint32 KcpSocket::sendDatagram(const char *data, qint32 size, quint8 channel)
+{
+    Q_D(KcpSocket);
+    return d->sendDatagram(data, size, channel);
+}
+
+
+qint32 KcpSocket::sendDatagram(const QByteArray &data, quint8 channel)
+{
+    Q_D(KcpSocket);
+    return d->sendDatagram(data.constData(), data.size(), channel);
+}
+
+
+QByteArray KcpSocket::recvDatagram(quint8 *channel)
+{
+    Q_D(KcpSocket);
+    return d->recvDatagram(channel);
+}
+
+
 Socket::SocketError KcpSocket::error() const
 {
     Q_D(const KcpSocket);
@@ -1322,6 +3211,7 @@ public:
     virtual Socket::SocketType type() const override;
     virtual Socket::SocketState state() const override;
     virtual Socket::NetworkLayerProtocol protocol() const override;
+    virtual SocketIoStats ioStats() const override;
 
     virtual Socket *acceptRaw() override;
     virtual QSharedPointer<SocketLike> accept() override;
@@ -1409,6 +3299,11 @@ Socket::NetworkLayerProtocol SocketLikeImpl::protocol() const
     return s->protocol();
 }
 
+SocketIoStats SocketLikeImpl::ioStats() const
+{
+    return s->ioStats();
+}
+
 Socket *SocketLikeImpl::acceptRaw()
 {
     return nullptr;
@@ -1521,5 +3416,197 @@ QSharedPointer<KcpSocket> convertSocketLikeToKcpSocket(QSharedPointer<SocketLike
     }
 }
 
+
+class KcpShardedServerPrivate;
+class KcpShard: public QThread
+{
+public:
+    KcpShard(KcpShardedServerPrivate *parent, quint16 port)
+        :parent(parent), eventloop(nullptr), port(port), listening(false), stopping(false) {}
+    virtual void run() override;
+    void closeSocket();
+public:
+    KcpShardedServerPrivate * const parent;
+    QSharedPointer<KcpSocket> socket;  // created, used and closed in the thread of shard only.
+    QMutex mutex;
+    QSemaphore ready;
+    EventLoopCoroutine *eventloop;     // guarded by mutex, cleared before the eventloop is deleted.
+    quint16 port;
+    bool listening;
+    bool stopping;
+};
+
+
+class KcpShardedServerPrivate
+{
+public:
+    KcpShardedServerPrivate(const QHostAddress &serverAddress, quint16 serverPort, int shards)
+        :serverAddress(serverAddress), serverPort(serverPort), shards(qMax(1, shards)), backlog(1024)
+        , mode(KcpSocket::Internet) {}
+    ~KcpShardedServerPrivate() { stop(); }
+    void stop();
+public:
+    QHostAddress serverAddress;
+    quint16 serverPort;
+    int shards;
+    int backlog;
+    KcpSocket::Mode mode;
+    std::function<void(KcpSocket *)> setup;
+    KcpShardedServer::Handler handler;
+    QList<KcpShard*> workers;
+};
+
+
+void KcpShard::run()
+{
+    {
+        QMutexLocker locker(&mutex);
+        eventloop = EventLoopCoroutine::get();
+    }
+    QSharedPointer<Coroutine> acceptor(Coroutine::spawn([this] {
+        socket.reset(new KcpSocket(parent->serverAddress.protocol() == QAbstractSocket::IPv6Protocol
+                                   ? Socket::IPv6Protocol : Socket::AnyIPProtocol));
+        socket->setMode(parent->mode);
+        if (parent->setup) {
+            parent->setup(socket.data());
+        }
+        QHostAddress address = parent->serverAddress;
+        listening = socket->bind(address, port, Socket::ReuseAddressHint | Socket::ReusePortHint)
+                && socket->listen(parent->backlog);
+        port = socket->localPort();
+        ready.release();
+        if (!listening || stopping) {
+            socket->close();
+            return;
+        }
+        CoroutineGroup operations;
+        while (true) {
+            QSharedPointer<KcpSocket> session = socket->accept();
+            if (session.isNull()) {
+                break;
+            }
+            KcpShardedServer::Handler handler = parent->handler;
+            operations.spawn([handler, session] { handler(session); });
+        }
+        socket->close();
+        operations.killall();
+    }));
+    acceptor->join();
+    socket.clear();
+    QMutexLocker locker(&mutex);
+    eventloop = nullptr;
+}
+
+
+void KcpShard::closeSocket()
+{
+    QMutexLocker locker(&mutex);
+    if (!eventloop) {
+        return;
+    }
+    // the socket must be closed in its own thread to wake up the accept().
+    eventloop->callLaterThreadSafe(0, makeFunctor([this] {
+        stopping = true;
+        if (!socket.isNull()) {
+            socket->close();
+        }
+    }));
+}
+
+
+void KcpShardedServerPrivate::stop()
+{
+    for (KcpShard *worker: workers) {
+        worker->closeSocket();
+    }
+    for (KcpShard *worker: workers) {
+        if (worker->isRunning()) {
+            worker->wait();
+        }
+    }
+    qDeleteAll(workers);
+    workers.clear();
+}
+
+
+KcpShardedServer::KcpShardedServer(const QHostAddress &serverAddress, quint16 serverPort, int shards)
+    :d_ptr(new KcpShardedServerPrivate(serverAddress, serverPort, shards))
+{
+}
+
+
+KcpShardedServer::~KcpShardedServer()
+{
+    delete d_ptr;
+}
+
+
+void KcpShardedServer::setMode(KcpSocket::Mode mode)
+{
+    Q_D(KcpShardedServer);
+    d->mode = mode;
+}
+
+
+void KcpShardedServer::setSetup(const std::function<void(KcpSocket *)> &setup)
+{
+    Q_D(KcpShardedServer);
+    d->setup = setup;
+}
+
+
+void KcpShardedServer::setBacklog(int backlog)
+{
+    Q_D(KcpShardedServer);
+    d->backlog = qMax(1, backlog);
+}
+
+
+int KcpShardedServer::shards() const
+{
+    Q_D(const KcpShardedServer);
+    return d->shards;
+}
+
+
+quint16 KcpShardedServer::serverPort() const
+{
+    Q_D(const KcpShardedServer);
+    return d->serverPort;
+}
+
+
+bool KcpShardedServer::start(const Handler &handler)
+{
+    Q_D(KcpShardedServer);
+    if (!d->workers.isEmpty() || !handler) {
+        return false;
+    }
+    d->handler = handler;
+    // one by one, all shards must use the same port if the port is chosen by system.
+    quint16 port = d->serverPort;
+    for (int i = 0; i < d->shards; ++i) {
+        KcpShard *worker = new KcpShard(d, port);
+        d->workers.append(worker);
+        worker->start();
+        worker->ready.acquire();
+        if (!worker->listening) {
+            qWarning() << "kcp server can not listen to" << d->serverAddress.toString() << ":" << port << "with SO_REUSEPORT";
+            d->stop();
+            return false;
+        }
+        port = worker->port;
+    }
+    d->serverPort = port;
+    return true;
+}
+
+
+void KcpShardedServer::stop()
+{
+    Q_D(KcpShardedServer);
+    d->stop();
+}
+
 QTNETWORKNG_NAMESPACE_END
 
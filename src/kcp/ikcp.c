@@ -171,12 +171,19 @@ void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*))
 // allocate a new kcp segment
 static IKCPSEG* ikcp_segment_new(ikcpcb *kcp, int size)
 {
+    if (kcp->segment_malloc) {
+        return (IKCPSEG*)kcp->segment_malloc((int)sizeof(IKCPSEG) + size, kcp, kcp->user);
+    }
     return (IKCPSEG*)ikcp_malloc(sizeof(IKCPSEG) + size);
 }
 
 // delete a segment
 static void ikcp_segment_delete(ikcpcb *kcp, IKCPSEG *seg)
 {
+    if (kcp->segment_free) {
+        kcp->segment_free(seg, kcp, kcp->user);
+        return;
+    }
     ikcp_free(seg);
 }
 
@@ -285,9 +292,13 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
     kcp->fastresend = 0;
     kcp->nocwnd = 0;
     kcp->xmit = 0;
+    kcp->fast_xmit = 0;
+    kcp->seg_xmit = 0;
     kcp->dead_link = IKCP_DEADLINK;
     kcp->output = NULL;
     kcp->writelog = NULL;
+    kcp->segment_malloc = NULL;
+    kcp->segment_free = NULL;
 
     return kcp;
 }
@@ -350,6 +361,17 @@ void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len,
 }
 
 
+//---------------------------------------------------------------------
+// set segment allocator, must be called before any segment is created
+//---------------------------------------------------------------------
+void ikcp_setsegmentallocator(ikcpcb *kcp, void *(*segment_malloc)(int size, ikcpcb *kcp, void *user),
+    void (*segment_free)(void *ptr, ikcpcb *kcp, void *user))
+{
+    kcp->segment_malloc = segment_malloc;
+    kcp->segment_free = segment_free;
+}
+
+
 //---------------------------------------------------------------------
 // user/upper level recv: returns size, returns below zero for EAGAIN
 //---------------------------------------------------------------------
@@ -1053,10 +1075,12 @@ void ikcp_flush(ikcpcb *kcp)
             segment->fastack = 0;
             segment->resendts = current + segment->rto;
             change++;
+            kcp->fast_xmit++;
         }
 
         if (needsend) {
             int size, need;
+            kcp->seg_xmit++;
             segment->ts = current;
             segment->wnd = seg.wnd;
             segment->una = kcp->rcv_nxt;
@@ -288,6 +288,7 @@ struct IKCPCB
     IUINT32 nodelay, updated;
     IUINT32 ts_probe, probe_wait;
     IUINT32 dead_link, incr;
+    IUINT32 fast_xmit, seg_xmit;
     struct IQUEUEHEAD snd_queue;
     struct IQUEUEHEAD rcv_queue;
     struct IQUEUEHEAD snd_buf;
@@ -302,6 +303,8 @@ struct IKCPCB
     int logmask;
     int (*output)(const char *buf, int len, struct IKCPCB *kcp, void *user);
     void (*writelog)(const char *log, struct IKCPCB *kcp, void *user);
+    void *(*segment_malloc)(int size, struct IKCPCB *kcp, void *user);
+    void (*segment_free)(void *ptr, struct IKCPCB *kcp, void *user);
 };
 
 
@@ -340,6 +343,10 @@ void ikcp_release(ikcpcb *kcp);
 void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len,
     ikcpcb *kcp, void *user));
 
+// set the allocator of segments for this kcp only, instead of ikcp_allocator()
+void ikcp_setsegmentallocator(ikcpcb *kcp, void *(*segment_malloc)(int size, ikcpcb *kcp, void *user),
+    void (*segment_free)(void *ptr, ikcpcb *kcp, void *user));
+
 // user/upper level recv: returns size, returns below zero for EAGAIN
 int ikcp_recv(ikcpcb *kcp, char *buffer, int len);
 
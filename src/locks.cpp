@@ -1,11 +1,141 @@
-#include <QtCore/qpointer.h>
 #include <QtCore/qsharedpointer.h>
-#include "../include/private/eventloop_p.h"
-#include "../include/locks.h"
+#include <QtCore/qscopedpointer.h>
+#include <QtCore/qelapsedtimer.h>
+#include "../include/private/locks_p.h"
+#include "../include/private/coroutine_p.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
-class SemaphorePrivate: public QObject
+struct LockWaiterResumeFunctor: public Functor
+{
+    explicit LockWaiterResumeFunctor(LockWaiterQueue *queue)
+        :queue(queue) {}
+    virtual void operator() () override
+    {
+        // the waiters woken from now on go to a new functor, but the queue still knows this one until it drains.
+        if (queue) {
+            queue->pending = nullptr;
+            queue->running = this;
+        }
+        while (!resuming.isEmpty()) {
+            LockWaiter *waiter = resuming.takeFirst();
+            if (waiter->coroutine) {
+                waiter->coroutine->yield();
+            } else {
+                (*waiter->callback)();
+            }
+        }
+        if (queue) {
+            queue->running = nullptr;
+        }
+    }
+    LockWaiterQueue *queue;
+    LockWaiterList resuming;
+};
+
+
+LockWaiterQueue::~LockWaiterQueue()
+{
+    // the waiters return false later.
+    if (!waiters.isEmpty()) {
+        LockWaiterResumeFunctor *functor = pendingFunctor(waiters.first()->priority);
+        while (!waiters.isEmpty()) {
+            functor->resuming.append(waiters.takeFirst());
+        }
+    }
+    // the waiters woken before are still resumed, but they must not give the wakeup back to this.
+    LockWaiterResumeFunctor *functors[] = { pending, running };
+    for (LockWaiterResumeFunctor *functor: functors) {
+        if (!functor) {
+            continue;
+        }
+        for (LockWaiter *waiter = functor->resuming.first(); waiter; waiter = waiter->next) {
+            waiter->queue = nullptr;
+        }
+        functor->queue = nullptr;
+    }
+}
+
+
+LockWaiterResumeFunctor *LockWaiterQueue::pendingFunctor(BaseCoroutine::Priority priority)
+{
+    if (!pending) {
+        pending = new LockWaiterResumeFunctor(this);
+        EventLoopCoroutine::get()->callSoon(pending, priority);
+    }
+    return pending;
+}
+
+
+bool LockWaiterQueue::wait(quint32 weight)
+{
+    Q_ASSERT_X(EventLoopCoroutine::get() != BaseCoroutine::current(), "LockWaiterQueue",
+               "coroutine locks should not be called from eventloop coroutine.");
+    CancelScope::check();
+    BaseCoroutine *current = BaseCoroutine::current();
+    LockWaiter local(current, this, weight);
+    LockWaiter *waiter = &local;
+    // the waiter is touched by the waking coroutines, which may take the shared stack while this one is out.
+    QScopedPointer<LockWaiter> allocated;
+    if (current->isSharedStack()) {
+        allocated.reset(new LockWaiter(current, this, weight));
+        waiter = allocated.data();
+    }
+    waiters.append(waiter);
+    try {
+        EventLoopCoroutine::get()->yield();
+    } catch (...) {
+        cancel(waiter);
+        throw;
+    }
+    if (waiter->list) {
+        // resumed by some one else, usually caused by locks running in eventloop.
+        Q_ASSERT(false);
+        waiter->list->remove(waiter);
+    }
+    return waiter->granted;
+}
+
+
+void LockWaiterQueue::waitAsync(LockWaiter *waiter)
+{
+    Q_ASSERT(waiter->callback && !waiter->list);
+    waiter->queue = this;
+    waiter->granted = false;
+    waiter->bypassed = 0;
+    waiters.append(waiter);
+}
+
+
+void LockWaiterQueue::cancel(LockWaiter *waiter)
+{
+    if (waiter->list) {
+        waiter->list->remove(waiter);
+    }
+    if (waiter->granted && waiter->queue && waiter->queue->giveBack) {
+        waiter->queue->giveBack(waiter->queue->giveBackData, waiter->weight);
+    } else if (!waiter->granted && waiter->queue && waiter->queue->dequeued) {
+        waiter->queue->dequeued(waiter->queue->giveBackData);
+    }
+    // a killed Task may wait again.
+    waiter->queue = nullptr;
+    waiter->granted = false;
+}
+
+
+bool LockWaiterQueue::wakeOne()
+{
+    if (waiters.isEmpty()) {
+        return false;
+    }
+    LockWaiter *waiter = waiters.takeFirst();
+    waiter->granted = true;
+    pendingFunctor(waiter->priority)->resuming.append(waiter);
+    return true;
+}
+
+
+class SemaphorePrivate
 {
 public:
     SemaphorePrivate(Semaphore *q, int value);
@@ -13,43 +143,46 @@ public:
 public:
     bool acquire(bool blocking);
     void release(int value);
-    void notifyWaiters(bool force);
     void scheduleDelete();
+    static void giveBack(void *data, quint32 weight);
 private:
     Semaphore * const q_ptr;
-    QList<QPointer<BaseCoroutine> > waiters;
+    LockWaiterQueue waiters;
     const int init_value;
     volatile int counter;
-    int notified;
     Q_DECLARE_PUBLIC(Semaphore)
 };
 
 
 SemaphorePrivate::SemaphorePrivate(Semaphore *q, int value)
-    :q_ptr(q), init_value(value), counter(value), notified(0)
+    :q_ptr(q), init_value(value), counter(value)
 {
+    waiters.giveBack = giveBack;
+    waiters.giveBackData = this;
+}
+
+
+void SemaphorePrivate::giveBack(void *data, quint32 weight)
+{
+    static_cast<SemaphorePrivate*>(data)->release(static_cast<int>(weight));
 }
 
 
 SemaphorePrivate::~SemaphorePrivate()
 {
-    Q_ASSERT(waiters.isEmpty());
 }
 
 
+// the waiters are resumed by eventloop and get false, they never touch this again.
 void SemaphorePrivate::scheduleDelete()
 {
-    if(notified) {
-        EventLoopCoroutine::get()->cancelCall(notified);
-        notified = 0;
-    }
-    notifyWaiters(true);
     if(counter != init_value) {
 //        qWarning("Semaphore is deleted but caught by some one.");
     }
-    EventLoopCoroutine::get()->callLater(0, new DeleteLaterFunctor<SemaphorePrivate>(this));
+    delete this;
 }
 
+
 bool SemaphorePrivate::acquire(bool blocking)
 {
     if(counter > 0) {
@@ -58,45 +191,17 @@ bool SemaphorePrivate::acquire(bool blocking)
     }
     if(!blocking)
         return false;
-
-    waiters.append(BaseCoroutine::current());
-    try {
-        Q_ASSERT_X(EventLoopCoroutine::get() != BaseCoroutine::current(), "SemaphorePrivate",
-                   "coroutine locks should not be called from eventloop coroutine.");
-        EventLoopCoroutine::get()->yield();
-        // if there is no exception, the release() has remove the waiter.
-        bool found = waiters.contains(BaseCoroutine::current());
-        Q_ASSERT(!found);  // usually caused by locks running in eventloop.
-    } catch(...) {
-        // if we caught an exception, the release() must not touch me.
-        // the waiter should be remove.
-        bool found = waiters.removeAll(BaseCoroutine::current());
-        Q_ASSERT(found);
-        throw;
-    }
-    return notified != 0;
+    CoroutineWaitScope scope("Semaphore", q_ptr);
+    return waiters.wait();
 }
 
 
-struct SemaphoreNotifyWaitersFunctor: public Functor
-{
-    SemaphoreNotifyWaitersFunctor(SemaphorePrivate *sp)
-        :sp(sp) {}
-    virtual ~SemaphoreNotifyWaitersFunctor() override;
-    QPointer<SemaphorePrivate> sp;
-    virtual void operator() () override
-    {
-        if(sp.isNull()) {
-            qWarning("SemaphorePrivate is deleted while calling notifyWaitersCallback.");
-            return;
-        }
-        sp->notifyWaiters(false);
-    }
-};
-SemaphoreNotifyWaitersFunctor::~SemaphoreNotifyWaitersFunctor() {}
-
+// the count is handed to the first waiter directly, so nobody can take it before the waiter runs.
 void SemaphorePrivate::release(int value)
 {
+    while(value > 0 && waiters.wakeOne()) {
+        --value;
+    }
     if(value <= 0) {
         return;
     }
@@ -106,29 +211,8 @@ void SemaphorePrivate::release(int value)
         counter += value;
     }
     counter = qMin(static_cast<int>(counter), init_value);
-    if(!notified && !waiters.isEmpty()) {
-        notified = EventLoopCoroutine::get()->callLater(0, new SemaphoreNotifyWaitersFunctor(this));
-    }
 }
 
-void SemaphorePrivate::notifyWaiters(bool force)
-{
-    if(notified == 0 && !force) {
-        return;
-    }
-    while(!waiters.isEmpty() && counter > 0) {
-        QPointer<BaseCoroutine> waiter = waiters.takeFirst();
-        if(waiter.isNull()) {
-            qDebug() << "waiter was deleted.";
-            continue;
-        }
-        if (!force) {
-            counter -= 1;
-        }
-        waiter->yield();
-    }
-    notified = 0;
-}
 
 Semaphore::Semaphore(int value)
     :d_ptr(new SemaphorePrivate(this, value))
@@ -299,8 +383,9 @@ public:
 public:
     bool wait();
     void notify(int value);
+    static void giveBack(void *data, quint32 weight);
 private:
-    QList<QSharedPointer<Lock> > waiters;
+    LockWaiterQueue waiters;
     Condition * const q_ptr;
     Q_DECLARE_PUBLIC(Condition)
 };
@@ -308,41 +393,30 @@ private:
 ConditionPrivate::ConditionPrivate(Condition *q)
     :q_ptr(q)
 {
+    waiters.giveBack = giveBack;
+    waiters.giveBackData = this;
 }
 
 ConditionPrivate::~ConditionPrivate()
 {
-    notify(waiters.size());
+}
+
+
+void ConditionPrivate::giveBack(void *data, quint32)
+{
+    static_cast<ConditionPrivate*>(data)->waiters.wakeOne();
 }
 
 
 bool ConditionPrivate::wait()
 {
-    QSharedPointer<Lock> waiter(new Lock());
-    if(!waiter->acquire())
-        return false;
-    waiters.append(waiter);
-    try{
-        if (waiter->acquire()) {
-            waiter->release();
-            waiters.removeOne(waiter);
-            return true;
-        } else {
-            waiters.removeOne(waiter);
-            return false;
-        }
-    } catch (...) {
-        waiter->release();
-        waiters.removeOne(waiter);
-        throw;
-    }
+    CoroutineWaitScope scope("Condition", q_ptr);
+    return waiters.wait();
 }
 
 void ConditionPrivate::notify(int value)
 {
-    for (int i = 0; i < value && !waiters.isEmpty(); ++i) {
-        QSharedPointer<Lock> waiter = waiters.takeFirst();
-        waiter->release();
+    for (int i = 0; i < value && waiters.wakeOne(); ++i) {
     }
 }
 
@@ -374,14 +448,21 @@ void Condition::notify(int value)
 void Condition::notifyAll()
 {
     Q_D(Condition);
-    d->notify(d->waiters.size());
+    d->notify(d->waiters.waiting());
 }
 
 
 quint32 Condition::getting() const
 {
     Q_D(const Condition);
-    return static_cast<quint32>(d->waiters.size());
+    return static_cast<quint32>(d->waiters.waiting());
+}
+
+
+LockWaiterQueue *Condition::waiters()
+{
+    Q_D(Condition);
+    return &d->waiters;
 }
 
 
@@ -406,11 +487,9 @@ EventPrivate::EventPrivate(Event *q)
 {
 }
 
+// the condition wakes up the waiters with false.
 EventPrivate::~EventPrivate()
 {
-    if(!flag && condition.getting() > 0) {
-        condition.notifyAll();
-    }
 }
 
 void EventPrivate::set()
@@ -432,10 +511,11 @@ bool EventPrivate::wait(bool blocking)
     if(!blocking) {
         return flag;
     } else {
+        CoroutineWaitScope scope("Event", q_ptr);
         while(!flag) {
             if (!condition.wait()) {
-                qDebug() << "event is deleted.";
-                break;
+                // the event is deleted, do not touch this.
+                return false;
             }
         }
         return flag;
@@ -482,6 +562,13 @@ quint32 Event::getting() const
     return d->condition.getting();
 }
 
+
+LockWaiterQueue *Event::waiters()
+{
+    Q_D(Event);
+    return d->condition.waiters();
+}
+
 class GatePrivate
 {
 public:
@@ -503,6 +590,7 @@ Gate::~Gate()
 bool Gate::goThrough(bool blocking)
 {
     Q_D(Gate);
+    CoroutineWaitScope scope("Gate", this);
     return d->event.wait(blocking);
 }
 
@@ -524,4 +612,285 @@ void Gate::close()
     d->event.clear();
 }
 
+
+class RWLockPrivate
+{
+public:
+    RWLockPrivate()
+        :readers(0), writing(false)
+    {
+        readWaiters.giveBack = giveBackRead;
+        readWaiters.giveBackData = this;
+        writeWaiters.giveBack = giveBackWrite;
+        writeWaiters.dequeued = writerDequeued;
+        writeWaiters.giveBackData = this;
+    }
+    void releaseRead();
+    void releaseWrite();
+    void wakeReaders();
+    static void writerDequeued(void *data);
+    static void giveBackRead(void *data, quint32) { static_cast<RWLockPrivate*>(data)->releaseRead(); }
+    static void giveBackWrite(void *data, quint32) { static_cast<RWLockPrivate*>(data)->releaseWrite(); }
+public:
+    LockWaiterQueue readWaiters;
+    LockWaiterQueue writeWaiters;
+    int readers;
+    bool writing;
+};
+
+
+void RWLockPrivate::releaseRead()
+{
+    if (readers <= 0) {
+        qWarning("RWLock is released but not acquired for reading.");
+        return;
+    }
+    --readers;
+    if (readers == 0 && writeWaiters.wakeOne()) {
+        writing = true;
+    }
+}
+
+
+// the waiting writers go first, then all waiting readers together.
+void RWLockPrivate::releaseWrite()
+{
+    if (!writing) {
+        qWarning("RWLock is released but not acquired for writing.");
+        return;
+    }
+    if (writeWaiters.wakeOne()) {
+        return;
+    }
+    writing = false;
+    wakeReaders();
+}
+
+
+void RWLockPrivate::wakeReaders()
+{
+    while (readWaiters.wakeOne()) {
+        ++readers;
+    }
+}
+
+
+// the readers waiting for the killed writer can go, if there is no other writer.
+void RWLockPrivate::writerDequeued(void *data)
+{
+    RWLockPrivate *d = static_cast<RWLockPrivate*>(data);
+    if (!d->writing && d->writeWaiters.waiting() == 0) {
+        d->wakeReaders();
+    }
+}
+
+
+RWLock::RWLock()
+    :d_ptr(new RWLockPrivate())
+{
+}
+
+
+RWLock::~RWLock()
+{
+    delete d_ptr;
+}
+
+
+bool RWLock::acquireRead(bool blocking)
+{
+    Q_D(RWLock);
+    // a waiting writer stops new readers, or readers may starve it.
+    if (!d->writing && d->writeWaiters.waiting() == 0) {
+        ++d->readers;
+        return true;
+    }
+    if (!blocking) {
+        return false;
+    }
+    CoroutineWaitScope scope("RWLock", this);
+    return d->readWaiters.wait();
+}
+
+
+void RWLock::releaseRead()
+{
+    Q_D(RWLock);
+    d->releaseRead();
+}
+
+
+bool RWLock::acquireWrite(bool blocking)
+{
+    Q_D(RWLock);
+    if (!d->writing && d->readers == 0) {
+        d->writing = true;
+        return true;
+    }
+    if (!blocking) {
+        return false;
+    }
+    CoroutineWaitScope scope("RWLock", this);
+    return d->writeWaiters.wait();
+}
+
+
+void RWLock::releaseWrite()
+{
+    Q_D(RWLock);
+    d->releaseWrite();
+}
+
+
+int RWLock::readers() const
+{
+    Q_D(const RWLock);
+    return d->readers;
+}
+
+
+bool RWLock::isWriting() const
+{
+    Q_D(const RWLock);
+    return d->writing;
+}
+
+
+class LimiterPrivate
+{
+public:
+    explicit LimiterPrivate(quint32 capacity)
+        :capacity(capacity), available(capacity), acquired(0), totalWaitMsecs(0), longestWaitMsecs(0)
+    {
+        waiters.giveBack = giveBack;
+        waiters.dequeued = dequeued;
+        waiters.giveBackData = this;
+    }
+    void release(quint32 weight);
+    static void giveBack(void *data, quint32 weight) { static_cast<LimiterPrivate*>(data)->release(weight); }
+    // a timed out waiter at the head may block the smaller ones.
+    static void dequeued(void *data) { static_cast<LimiterPrivate*>(data)->release(0); }
+public:
+    LockWaiterQueue waiters;
+    const quint32 capacity;
+    quint32 available;
+    quint64 acquired;
+    qint64 totalWaitMsecs;
+    qint64 longestWaitMsecs;
+};
+
+
+// the units go to the waiters in order, a big request at the head is not passed by small ones.
+void LimiterPrivate::release(quint32 weight)
+{
+    available = qMin(capacity, available + weight);
+    while (waiters.waiting() > 0 && waiters.firstWeight() <= available) {
+        available -= waiters.firstWeight();
+        waiters.wakeOne();
+    }
+}
+
+
+Limiter::Limiter(quint32 capacity)
+    :d_ptr(new LimiterPrivate(capacity))
+{
+}
+
+
+Limiter::~Limiter()
+{
+    delete d_ptr;
+}
+
+
+bool Limiter::acquire(quint32 weight, float secs)
+{
+    Q_D(Limiter);
+    if (weight == 0) {
+        return true;
+    }
+    if (weight > d->capacity) {
+        return false;
+    }
+    if (d->waiters.waiting() == 0 && weight <= d->available) {
+        d->available -= weight;
+        ++d->acquired;
+        return true;
+    }
+    if (secs < 0) {
+        return false;
+    }
+    QElapsedTimer timer;
+    timer.start();
+    CoroutineWaitScope scope("Limiter", this);
+    bool ok;
+    if (secs == 0.0f) {
+        ok = d->waiters.wait(weight);
+    } else {
+        try {
+            Timeout timeout(secs); Q_UNUSED(timeout);
+            ok = d->waiters.wait(weight);
+        } catch (TimeoutException &) {
+            ok = false;
+        }
+    }
+    if (!ok) {
+        return false;
+    }
+    const qint64 waited = timer.elapsed();
+    d->totalWaitMsecs += waited;
+    d->longestWaitMsecs = qMax(d->longestWaitMsecs, waited);
+    ++d->acquired;
+    return true;
+}
+
+
+void Limiter::release(quint32 weight)
+{
+    Q_D(Limiter);
+    d->release(weight);
+}
+
+
+quint32 Limiter::capacity() const
+{
+    Q_D(const Limiter);
+    return d->capacity;
+}
+
+
+quint32 Limiter::available() const
+{
+    Q_D(const Limiter);
+    return d->available;
+}
+
+
+int Limiter::waiting() const
+{
+    Q_D(const Limiter);
+    return d->waiters.waiting();
+}
+
+
+quint64 Limiter::acquired() const
+{
+    Q_D(const Limiter);
+    return d->acquired;
+}
+
+
+qint64 Limiter::totalWaitMsecs() const
+{
+    Q_D(const Limiter);
+    return d->totalWaitMsecs;
+}
+
+
+qint64 Limiter::longestWaitMsecs() const
+{
+    Q_D(const Limiter);
+    return d->longestWaitMsecs;
+}
+
 QTNETWORKNG_NAMESPACE_END
@@ -1,4 +1,12 @@
+#include <climits>
+#include <stdint.h>
+#include <utility>
+#include <QtCore/qendian.h>
+#include <QtCore/qscopedpointer.h>
+#include <QtCore/qthreadstorage.h>
+#include <openssl/hmac.h>
 #include "../include/md.h"
+#include "../include/coroutine_utils.h"
 #include "../include/private/crypto_p.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
@@ -141,6 +149,579 @@ QByteArray MessageDigest::result()
     return d->result();
 }
 
+// the context is initialized again for every blob, it keeps the allocated state if the algorithm is not changed.
+struct ThreadDigestContext
+{
+    ThreadDigestContext() : context(EVP_MD_CTX_new()) {}
+    ~ThreadDigestContext() { if (context) EVP_MD_CTX_free(context); }
+    EVP_MD_CTX *context;
+};
+
+
+Q_GLOBAL_STATIC(QThreadStorage<ThreadDigestContext*>, digestContextStorage)
+
+
+// returns null while the thread storage is destroyed.
+static EVP_MD_CTX *threadDigestContext()
+{
+    QThreadStorage<ThreadDigestContext*> *storage = digestContextStorage();
+    if (!storage) {
+        return nullptr;
+    }
+    if (!storage->hasLocalData()) {
+        storage->setLocalData(new ThreadDigestContext());
+    }
+    return storage->localData()->context;
+}
+
+
+static int digestWith(EVP_MD_CTX *context, const EVP_MD *md, const char *data, int len, char *out)
+{
+    unsigned int size;
+    if (!EVP_DigestInit_ex(context, md, nullptr) || !EVP_DigestUpdate(context, data, static_cast<size_t>(len))
+            || !EVP_DigestFinal_ex(context, reinterpret_cast<unsigned char*>(out), &size)) {
+        return -1;
+    }
+    return static_cast<int>(size);
+}
+
+
+static QList<QByteArray> digestAll(const QList<QByteArray> &data, MessageDigest::Algorithm algo, bool hex)
+{
+    QList<QByteArray> results;
+    initOpenSSL();
+    const EVP_MD *md = getOpenSSL_MD(algo);
+    if (!md) {
+        return results;
+    }
+    QScopedPointer<ThreadDigestContext> local;
+    EVP_MD_CTX *context = threadDigestContext();
+    if (!context) {
+        local.reset(new ThreadDigestContext());
+        context = local->context;
+    }
+    if (!context) {
+        return results;
+    }
+    results.reserve(data.size());
+    unsigned char buf[EVP_MAX_MD_SIZE];
+    for (const QByteArray &blob: data) {
+        int size = digestWith(context, md, blob.constData(), blob.size(), reinterpret_cast<char*>(buf));
+        if (size < 0) {
+            results.append(QByteArray());
+        } else if (hex) {
+            results.append(QByteArray::fromRawData(reinterpret_cast<const char*>(buf), size).toHex());
+        } else {
+            results.append(QByteArray(reinterpret_cast<const char*>(buf), size));
+        }
+    }
+    return results;
+}
+
+
+QList<QByteArray> MessageDigest::hashMany(const QList<QByteArray> &data, Algorithm algo)
+{
+    return digestAll(data, algo, true);
+}
+
+
+QList<QByteArray> MessageDigest::digestMany(const QList<QByteArray> &data, Algorithm algo)
+{
+    return digestAll(data, algo, false);
+}
+
+
+int MessageDigest::digest(const char *data, int len, Algorithm algo, char *out)
+{
+    initOpenSSL();
+    const EVP_MD *md = getOpenSSL_MD(algo);
+    if (!md || len < 0) {
+        return -1;
+    }
+    EVP_MD_CTX *context = threadDigestContext();
+    if (!context) {
+        ThreadDigestContext local;
+        return local.context ? digestWith(local.context, md, data, len, out) : -1;
+    }
+    return digestWith(context, md, data, len, out);
+}
+
+
+int MessageDigest::digestSize(Algorithm algo)
+{
+    initOpenSSL();
+    const EVP_MD *md = getOpenSSL_MD(algo);
+    return md ? EVP_MD_size(md) : -1;
+}
+
+
+class HmacPrivate
+{
+public:
+    HmacPrivate(MessageDigest::Algorithm algo, const QByteArray &key);
+    ~HmacPrivate();
+    HMAC_CTX *context;
+    QByteArray finalData;
+    bool hasError;
+};
+
+
+HmacPrivate::HmacPrivate(MessageDigest::Algorithm algo, const QByteArray &key)
+    :context(nullptr), hasError(false)
+{
+    initOpenSSL();
+    const EVP_MD *md = getOpenSSL_MD(algo);
+    if (md) {
+        context = HMAC_CTX_new();
+    }
+    // the empty key must be a valid pointer, or HMAC_Init_ex() reuses the key of last time.
+    if (!context || !HMAC_Init_ex(context, key.constData(), key.size(), md, nullptr)) {
+        hasError = true;
+    }
+}
+
+
+HmacPrivate::~HmacPrivate()
+{
+    if (context) {
+        HMAC_CTX_free(context);
+    }
+}
+
+
+Hmac::Hmac(MessageDigest::Algorithm algo, const QByteArray &key)
+    :d_ptr(new HmacPrivate(algo, key))
+{
+}
+
+
+Hmac::~Hmac()
+{
+    delete d_ptr;
+}
+
+
+void Hmac::addData(const char *data, int len)
+{
+    Q_D(Hmac);
+    if (d->hasError || !d->finalData.isEmpty() || len < 0) {
+        return;
+    }
+    d->hasError = !HMAC_Update(d->context, reinterpret_cast<const unsigned char*>(data), static_cast<size_t>(len));
+}
+
+
+QByteArray Hmac::result()
+{
+    Q_D(Hmac);
+    if (d->hasError) {
+        return QByteArray();
+    }
+    if (!d->finalData.isEmpty()) {
+        return d->finalData;
+    }
+    unsigned int len;
+    d->finalData.resize(EVP_MAX_MD_SIZE);
+    if (!HMAC_Final(d->context, reinterpret_cast<unsigned char*>(d->finalData.data()), &len)) {
+        d->hasError = true;
+        d->finalData.clear();
+    } else {
+        d->finalData.resize(static_cast<int>(len));
+    }
+    return d->finalData;
+}
+
+
+void Hmac::reset()
+{
+    Q_D(Hmac);
+    if (!d->context) {
+        return;
+    }
+    // the null key and md restart from the pads computed by the constructor.
+    d->hasError = !HMAC_Init_ex(d->context, nullptr, 0, nullptr, nullptr);
+    d->finalData.clear();
+}
+
+
+bool Hmac::verify(const QByteArray &mac)
+{
+    const QByteArray &r = result();
+    return !r.isEmpty() && r.size() == mac.size() && CRYPTO_memcmp(r.constData(), mac.constData(), static_cast<size_t>(r.size())) == 0;
+}
+
+
+QByteArray Hmac::hmac(const QByteArray &key, const QByteArray &data, MessageDigest::Algorithm algo)
+{
+    Hmac h(algo, key);
+    h.addData(data);
+    return h.result();
+}
+
+
+template<typename W>
+struct Blake2Traits;
+
+
+template<>
+struct Blake2Traits<quint64>
+{
+    enum { BlockSize = 128, OutputSize = 64, Rounds = 12, R1 = 32, R2 = 24, R3 = 16, R4 = 63 };
+    static const quint64 iv[8];
+};
+
+
+const quint64 Blake2Traits<quint64>::iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+
+template<>
+struct Blake2Traits<quint32>
+{
+    enum { BlockSize = 64, OutputSize = 32, Rounds = 10, R1 = 16, R2 = 12, R3 = 8, R4 = 7 };
+    static const quint32 iv[8];
+};
+
+
+const quint32 Blake2Traits<quint32>::iv[8] = {
+    0x6a09e667u, 0xbb67ae85u, 0x3c6ef372u, 0xa54ff53au, 0x510e527fu, 0x9b05688cu, 0x1f83d9abu, 0x5be0cd19u,
+};
+
+
+static const quint8 blake2Sigma[12][16] = {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+    { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+    {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+    {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+    {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+    { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+    { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+    {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+    { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+};
+
+
+// BLAKE2b works on 64-bit words, BLAKE2s on 32-bit words. the rest is the same.
+template<typename W>
+struct Blake2State
+{
+    typedef Blake2Traits<W> Traits;
+
+    void init(int outputSize, const char *key, int keyLen)
+    {
+        memcpy(h, Traits::iv, sizeof(h));
+        h[0] ^= 0x01010000u ^ (static_cast<W>(keyLen) << 8) ^ static_cast<W>(outputSize);
+        t[0] = t[1] = 0;
+        bufLen = 0;
+        this->outputSize = outputSize;
+        if (keyLen > 0) {
+            memset(buf, 0, sizeof(buf));
+            memcpy(buf, key, static_cast<size_t>(keyLen));
+            bufLen = Traits::BlockSize;
+        }
+    }
+
+    void update(const uchar *data, size_t len)
+    {
+        while (len > 0) {
+            // the last block is compressed by final(), so a full buffer waits for more data.
+            if (bufLen == Traits::BlockSize) {
+                count(Traits::BlockSize);
+                compress(false);
+                bufLen = 0;
+            }
+            const size_t n = qMin<size_t>(len, static_cast<size_t>(Traits::BlockSize - bufLen));
+            memcpy(buf + bufLen, data, n);
+            bufLen += static_cast<int>(n);
+            data += n;
+            len -= n;
+        }
+    }
+
+    void final(uchar *out)
+    {
+        count(bufLen);
+        memset(buf + bufLen, 0, static_cast<size_t>(Traits::BlockSize - bufLen));
+        compress(true);
+        uchar full[Traits::OutputSize];
+        for (int i = 0; i < 8; ++i) {
+            qToLittleEndian<W>(h[i], full + i * sizeof(W));
+        }
+        memcpy(out, full, static_cast<size_t>(outputSize));
+    }
+
+    static inline W rotr(W x, int n) { return (x >> n) | (x << (sizeof(W) * 8 - n)); }
+
+    static inline void g(W *v, int a, int b, int c, int d, W x, W y)
+    {
+        v[a] = v[a] + v[b] + x;
+        v[d] = rotr(v[d] ^ v[a], Traits::R1);
+        v[c] = v[c] + v[d];
+        v[b] = rotr(v[b] ^ v[c], Traits::R2);
+        v[a] = v[a] + v[b] + y;
+        v[d] = rotr(v[d] ^ v[a], Traits::R3);
+        v[c] = v[c] + v[d];
+        v[b] = rotr(v[b] ^ v[c], Traits::R4);
+    }
+
+    void count(int n)
+    {
+        t[0] += static_cast<W>(n);
+        if (t[0] < static_cast<W>(n)) {
+            ++t[1];
+        }
+    }
+
+    void compress(bool last)
+    {
+        W m[16], v[16];
+        for (int i = 0; i < 16; ++i) {
+            m[i] = qFromLittleEndian<W>(buf + i * sizeof(W));
+        }
+        for (int i = 0; i < 8; ++i) {
+            v[i] = h[i];
+            v[i + 8] = Traits::iv[i];
+        }
+        v[12] ^= t[0];
+        v[13] ^= t[1];
+        if (last) {
+            v[14] = ~v[14];
+        }
+        for (int r = 0; r < Traits::Rounds; ++r) {
+            const quint8 *s = blake2Sigma[r];
+            g(v, 0, 4,  8, 12, m[s[0]], m[s[1]]);
+            g(v, 1, 5,  9, 13, m[s[2]], m[s[3]]);
+            g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+            g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+            g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+            g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+            g(v, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+            g(v, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+        }
+        for (int i = 0; i < 8; ++i) {
+            h[i] ^= v[i] ^ v[i + 8];
+        }
+    }
+
+    W h[8];
+    W t[2];
+    uchar buf[Traits::BlockSize];
+    int bufLen;
+    int outputSize;
+};
+
+
+class Blake2Private
+{
+public:
+    Blake2Private(Blake2::Variant variant, int outputSize, const QByteArray &key);
+    Blake2State<quint64> b;
+    Blake2State<quint32> s;
+    QByteArray finalData;
+    Blake2::Variant variant;
+    bool hasError;
+};
+
+
+Blake2Private::Blake2Private(Blake2::Variant variant, int outputSize, const QByteArray &key)
+    :variant(variant), hasError(false)
+{
+    const int maxSize = variant == Blake2::Blake2b ? static_cast<int>(Blake2Traits<quint64>::OutputSize)
+                                                   : static_cast<int>(Blake2Traits<quint32>::OutputSize);
+    if (outputSize == 0) {
+        outputSize = maxSize;
+    }
+    if (outputSize < 0 || outputSize > maxSize || key.size() > maxSize) {
+        hasError = true;
+        return;
+    }
+    if (variant == Blake2::Blake2b) {
+        b.init(outputSize, key.constData(), key.size());
+    } else {
+        s.init(outputSize, key.constData(), key.size());
+    }
+}
+
+
+Blake2::Blake2(Variant variant, int outputSize, const QByteArray &key)
+    :d_ptr(new Blake2Private(variant, outputSize, key))
+{
+}
+
+
+Blake2::~Blake2()
+{
+    delete d_ptr;
+}
+
+
+void Blake2::addData(const char *data, int len)
+{
+    Q_D(Blake2);
+    if (d->hasError || !d->finalData.isEmpty() || len <= 0) {
+        return;
+    }
+    if (d->variant == Blake2b) {
+        d->b.update(reinterpret_cast<const uchar*>(data), static_cast<size_t>(len));
+    } else {
+        d->s.update(reinterpret_cast<const uchar*>(data), static_cast<size_t>(len));
+    }
+}
+
+
+QByteArray Blake2::result()
+{
+    Q_D(Blake2);
+    if (d->hasError) {
+        return QByteArray();
+    }
+    if (d->finalData.isEmpty()) {
+        if (d->variant == Blake2b) {
+            d->finalData.resize(d->b.outputSize);
+            d->b.final(reinterpret_cast<uchar*>(d->finalData.data()));
+        } else {
+            d->finalData.resize(d->s.outputSize);
+            d->s.final(reinterpret_cast<uchar*>(d->finalData.data()));
+        }
+    }
+    return d->finalData;
+}
+
+
+bool Blake2::isValid() const
+{
+    Q_D(const Blake2);
+    return !d->hasError;
+}
+
+
+QByteArray Blake2::hash(const QByteArray &data, Variant variant, int outputSize, const QByteArray &key)
+{
+    Blake2 b(variant, outputSize, key);
+    b.addData(data);
+    return b.result();
+}
+
+
+static inline quint64 rotl64(quint64 x, int n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+
+static inline void sipRound(quint64 &v0, quint64 &v1, quint64 &v2, quint64 &v3)
+{
+    v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32);
+    v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2;
+    v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0;
+    v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32);
+}
+
+
+quint64 sipHash24(const char *data, qint64 len, quint64 k0, quint64 k1)
+{
+    quint64 v0 = 0x736f6d6570736575ULL ^ k0;
+    quint64 v1 = 0x646f72616e646f6dULL ^ k1;
+    quint64 v2 = 0x6c7967656e657261ULL ^ k0;
+    quint64 v3 = 0x7465646279746573ULL ^ k1;
+    const uchar *p = reinterpret_cast<const uchar*>(data);
+    const uchar *end = p + (len & ~static_cast<qint64>(7));
+    for (; p != end; p += 8) {
+        const quint64 m = qFromLittleEndian<quint64>(p);
+        v3 ^= m;
+        sipRound(v0, v1, v2, v3);
+        sipRound(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    quint64 b = static_cast<quint64>(len) << 56;
+    for (int i = static_cast<int>(len & 7) - 1; i >= 0; --i) {
+        b |= static_cast<quint64>(p[i]) << (8 * i);
+    }
+    v3 ^= b;
+    sipRound(v0, v1, v2, v3);
+    sipRound(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; ++i) {
+        sipRound(v0, v1, v2, v3);
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+static const quint64 XXPrime1 = 0x9e3779b185ebca87ULL;
+static const quint64 XXPrime2 = 0xc2b2ae3d27d4eb4fULL;
+static const quint64 XXPrime3 = 0x165667b19e3779f9ULL;
+static const quint64 XXPrime4 = 0x85ebca77c2b2ae63ULL;
+static const quint64 XXPrime5 = 0x27d4eb2f165667c5ULL;
+
+
+static inline quint64 xxRound(quint64 acc, quint64 input)
+{
+    return rotl64(acc + input * XXPrime2, 31) * XXPrime1;
+}
+
+
+static inline quint64 xxMerge(quint64 acc, quint64 v)
+{
+    return (acc ^ xxRound(0, v)) * XXPrime1 + XXPrime4;
+}
+
+
+quint64 xxHash64(const char *data, qint64 len, quint64 seed)
+{
+    const uchar *p = reinterpret_cast<const uchar*>(data);
+    const uchar *end = p + len;
+    quint64 h;
+    if (len >= 32) {
+        quint64 v1 = seed + XXPrime1 + XXPrime2;
+        quint64 v2 = seed + XXPrime2;
+        quint64 v3 = seed;
+        quint64 v4 = seed - XXPrime1;
+        const uchar *limit = end - 32;
+        do {
+            v1 = xxRound(v1, qFromLittleEndian<quint64>(p));
+            v2 = xxRound(v2, qFromLittleEndian<quint64>(p + 8));
+            v3 = xxRound(v3, qFromLittleEndian<quint64>(p + 16));
+            v4 = xxRound(v4, qFromLittleEndian<quint64>(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxMerge(h, v1);
+        h = xxMerge(h, v2);
+        h = xxMerge(h, v3);
+        h = xxMerge(h, v4);
+    } else {
+        h = seed + XXPrime5;
+    }
+    h += static_cast<quint64>(len);
+    for (; end - p >= 8; p += 8) {
+        h ^= xxRound(0, qFromLittleEndian<quint64>(p));
+        h = rotl64(h, 27) * XXPrime1 + XXPrime4;
+    }
+    if (end - p >= 4) {
+        h ^= static_cast<quint64>(qFromLittleEndian<quint32>(p)) * XXPrime1;
+        h = rotl64(h, 23) * XXPrime2 + XXPrime3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= *p * XXPrime5;
+        h = rotl64(h, 11) * XXPrime1;
+    }
+    h ^= h >> 33;
+    h *= XXPrime2;
+    h ^= h >> 29;
+    h *= XXPrime3;
+    h ^= h >> 32;
+    return h;
+}
+
+
 QByteArray PBKDF2_HMAC(int keylen, const QByteArray &password, const QByteArray &salt,
                        const MessageDigest::Algorithm hashAlgo, int i)
 {
@@ -164,35 +745,132 @@ QByteArray PBKDF2_HMAC(int keylen, const QByteArray &password, const QByteArray
     }
 }
 
-//QByteArray scrypt(const QByteArray &password, int keylen, const QByteArray &salt,
-//                  int n, int r, int p)
-//{
-//    initOpenSSL();
-//    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_SCRYPT, nullptr);
-
-//    if(!pctx || password.isEmpty() || salt.isEmpty()) {
-//        return QByteArray();
-//    }
-
-//    QByteArray key;
-//    key.resize(keylen);
-
-//    int rvalue = EVP_PKEY_derive_init(pctx);
-//    if (rvalue <= 0) {
-//        qDebug() << "can not init scrypt kdf.";
-//        return QByteArray();
-//    }
-//    rvalue = EVP_PKEY_CTX_set1_pbe_pass(pctx, password.data(), password.size());
-//    if (rvalue <= 0) {
-//        qDebug() << "can not set scrypt password.";
-//        return QByteArray();
-//    }
-//    rvalue = EVP_PKEY_CTX_set1_scrypt_salt(pctx, salt.data(), salt.size());
-//    if (rvalue <= 0) {
-//        qDebug() << "can not set scrypt salt.";
-//        return QByteArray();
-//    }
-
-//}
+static inline quint32 rotl32(quint32 x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+
+static void salsa208(quint32 *b)
+{
+    quint32 x[16];
+    memcpy(x, b, sizeof(x));
+    for (int i = 0; i < 8; i += 2) {
+        x[ 4] ^= rotl32(x[ 0] + x[12],  7);  x[ 8] ^= rotl32(x[ 4] + x[ 0],  9);
+        x[12] ^= rotl32(x[ 8] + x[ 4], 13);  x[ 0] ^= rotl32(x[12] + x[ 8], 18);
+        x[ 9] ^= rotl32(x[ 5] + x[ 1],  7);  x[13] ^= rotl32(x[ 9] + x[ 5],  9);
+        x[ 1] ^= rotl32(x[13] + x[ 9], 13);  x[ 5] ^= rotl32(x[ 1] + x[13], 18);
+        x[14] ^= rotl32(x[10] + x[ 6],  7);  x[ 2] ^= rotl32(x[14] + x[10],  9);
+        x[ 6] ^= rotl32(x[ 2] + x[14], 13);  x[10] ^= rotl32(x[ 6] + x[ 2], 18);
+        x[ 3] ^= rotl32(x[15] + x[11],  7);  x[ 7] ^= rotl32(x[ 3] + x[15],  9);
+        x[11] ^= rotl32(x[ 7] + x[ 3], 13);  x[15] ^= rotl32(x[11] + x[ 7], 18);
+        x[ 1] ^= rotl32(x[ 0] + x[ 3],  7);  x[ 2] ^= rotl32(x[ 1] + x[ 0],  9);
+        x[ 3] ^= rotl32(x[ 2] + x[ 1], 13);  x[ 0] ^= rotl32(x[ 3] + x[ 2], 18);
+        x[ 6] ^= rotl32(x[ 5] + x[ 4],  7);  x[ 7] ^= rotl32(x[ 6] + x[ 5],  9);
+        x[ 4] ^= rotl32(x[ 7] + x[ 6], 13);  x[ 5] ^= rotl32(x[ 4] + x[ 7], 18);
+        x[11] ^= rotl32(x[10] + x[ 9],  7);  x[ 8] ^= rotl32(x[11] + x[10],  9);
+        x[ 9] ^= rotl32(x[ 8] + x[11], 13);  x[10] ^= rotl32(x[ 9] + x[ 8], 18);
+        x[12] ^= rotl32(x[15] + x[14],  7);  x[13] ^= rotl32(x[12] + x[15],  9);
+        x[14] ^= rotl32(x[13] + x[12], 13);  x[15] ^= rotl32(x[14] + x[13], 18);
+    }
+    for (int i = 0; i < 16; ++i) {
+        b[i] += x[i];
+    }
+}
+
+
+// the even blocks go to the first half of out, the odd blocks to the second half.
+static void scryptBlockMix(const quint32 *in, quint32 *out, int r)
+{
+    quint32 x[16];
+    memcpy(x, in + (2 * r - 1) * 16, sizeof(x));
+    for (int i = 0; i < 2 * r; ++i) {
+        for (int j = 0; j < 16; ++j) {
+            x[j] ^= in[i * 16 + j];
+        }
+        salsa208(x);
+        memcpy(out + (i / 2 + (i & 1) * r) * 16, x, sizeof(x));
+    }
+}
+
+
+static void scryptROMix(uchar *b, int r, quint64 n, quint32 *v, quint32 *x, quint32 *y)
+{
+    const size_t words = static_cast<size_t>(32 * r);
+    for (size_t i = 0; i < words; ++i) {
+        x[i] = qFromLittleEndian<quint32>(b + i * 4);
+    }
+    for (quint64 i = 0; i < n; ++i) {
+        memcpy(v + i * words, x, words * 4);
+        scryptBlockMix(x, y, r);
+        std::swap(x, y);
+    }
+    for (quint64 i = 0; i < n; ++i) {
+        const quint64 j = x[(2 * r - 1) * 16] & (n - 1);
+        for (size_t k = 0; k < words; ++k) {
+            x[k] ^= v[j * words + k];
+        }
+        scryptBlockMix(x, y, r);
+        std::swap(x, y);
+    }
+    for (size_t i = 0; i < words; ++i) {
+        qToLittleEndian<quint32>(x[i], b + i * 4);
+    }
+}
+
+
+// rfc 7914. the memory of 128 * r * n bytes is allocated for the whole time.
+QByteArray scrypt(int keylen, const QByteArray &password, const QByteArray &salt, int n, int r, int p)
+{
+    if (keylen <= 0 || n < 2 || (n & (n - 1)) != 0 || r <= 0 || p <= 0
+            || static_cast<quint64>(r) * static_cast<quint64>(p) >= (1u << 30)
+            || static_cast<quint64>(r) * 128 * static_cast<quint64>(p) > static_cast<quint64>(INT_MAX)
+            || static_cast<quint64>(r) * 128 * static_cast<quint64>(n) > static_cast<quint64>(SIZE_MAX / 2)) {
+        return QByteArray();
+    }
+    initOpenSSL();
+    const int blockSize = 128 * r;
+    QByteArray b(blockSize * p, Qt::Uninitialized);
+    if (!PKCS5_PBKDF2_HMAC(password.constData(), password.size(), reinterpret_cast<const unsigned char*>(salt.constData()),
+                           salt.size(), 1, EVP_sha256(), b.size(), reinterpret_cast<unsigned char*>(b.data()))) {
+        return QByteArray();
+    }
+    quint32 *v = static_cast<quint32*>(malloc(static_cast<size_t>(blockSize) * static_cast<size_t>(n)));
+    quint32 *xy = static_cast<quint32*>(malloc(static_cast<size_t>(blockSize) * 2));
+    if (!v || !xy) {
+        free(v);
+        free(xy);
+        return QByteArray();
+    }
+    for (int i = 0; i < p; ++i) {
+        scryptROMix(reinterpret_cast<uchar*>(b.data()) + i * blockSize, r, static_cast<quint64>(n), v, xy, xy + 32 * r);
+    }
+    OPENSSL_cleanse(v, static_cast<size_t>(blockSize) * static_cast<size_t>(n));
+    free(v);
+    free(xy);
+    QByteArray key(keylen, Qt::Uninitialized);
+    if (!PKCS5_PBKDF2_HMAC(password.constData(), password.size(), reinterpret_cast<const unsigned char*>(b.constData()),
+                           b.size(), 1, EVP_sha256(), keylen, reinterpret_cast<unsigned char*>(key.data()))) {
+        return QByteArray();
+    }
+    return key;
+}
+
+
+QByteArray offloadPBKDF2_HMAC(int keylen, const QByteArray &password, const QByteArray &salt,
+                              const MessageDigest::Algorithm hashAlgo, int i)
+{
+    return callInThreadPool<QByteArray>([keylen, password, salt, hashAlgo, i] {
+        return PBKDF2_HMAC(keylen, password, salt, hashAlgo, i);
+    });
+}
+
+
+QByteArray offloadScrypt(int keylen, const QByteArray &password, const QByteArray &salt, int n, int r, int p)
+{
+    return callInThreadPool<QByteArray>([keylen, password, salt, n, r, p] {
+        return scrypt(keylen, password, salt, n, r, p);
+    });
+}
 
 QTNETWORKNG_NAMESPACE_END
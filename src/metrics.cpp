@@ -0,0 +1,338 @@
+#include <QtCore/qhash.h>
+#include <QtCore/qmap.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qthreadstorage.h>
+#include <string.h>
+#include <algorithm>
+#include "../include/metrics.h"
+#include "../include/private/coroutine_p.h"
+#include "../include/private/eventloop_p.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+
+enum MetricType {
+    CounterMetric,
+    GaugeMetric,
+    HistogramMetric,
+};
+
+
+static const double latencyBounds[] = { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+static const double depthBounds[] = { 0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+static const int MaxBuckets = 16;
+
+
+static int boundsOf(Metrics::Buckets buckets, const double **bounds)
+{
+    if (buckets == Metrics::DepthBuckets) {
+        *bounds = depthBounds;
+        return static_cast<int>(sizeof(depthBounds) / sizeof(double));
+    }
+    *bounds = latencyBounds;
+    return static_cast<int>(sizeof(latencyBounds) / sizeof(double));
+}
+
+
+struct MetricValue
+{
+    MetricValue()
+        :value(0), sum(0.0)
+    {
+        memset(buckets, 0, sizeof(buckets));
+    }
+    void merge(const MetricValue &other);
+    qint64 value;                   // the counter, the gauge or the count of observations.
+    double sum;
+    quint64 buckets[MaxBuckets];    // not cumulative, the last one counts the values above all bounds.
+};
+
+
+void MetricValue::merge(const MetricValue &other)
+{
+    value += other.value;
+    sum += other.sum;
+    for (int i = 0; i < MaxBuckets; ++i) {
+        buckets[i] += other.buckets[i];
+    }
+}
+
+
+struct MetricFamily
+{
+    MetricFamily()
+        :type(CounterMetric), buckets(Metrics::LatencyBuckets) {}
+    MetricType type;
+    Metrics::Buckets buckets;
+    QHash<QByteArray, MetricValue> values;
+};
+
+
+// the mutex is only contended while render() merges the shards.
+struct MetricsShard
+{
+    void merge(const MetricsShard &other);
+    QMutex mutex;
+    QHash<QByteArray, MetricFamily> families;
+};
+
+
+void MetricsShard::merge(const MetricsShard &other)
+{
+    for (QHash<QByteArray, MetricFamily>::const_iterator itor = other.families.constBegin(); itor != other.families.constEnd(); ++itor) {
+        MetricFamily &family = families[itor.key()];
+        family.type = itor->type;
+        family.buckets = itor->buckets;
+        for (QHash<QByteArray, MetricValue>::const_iterator jtor = itor->values.constBegin(); jtor != itor->values.constEnd(); ++jtor) {
+            family.values[jtor.key()].merge(*jtor);
+        }
+    }
+}
+
+
+struct MetricsRegistry
+{
+    QMutex mutex;
+    QList<MetricsShard*> shards;
+    MetricsShard retired;   // the shards of the exited threads, so the counters never go back.
+};
+
+
+Q_GLOBAL_STATIC(MetricsRegistry, metricsRegistry)
+
+
+// QThreadStorage deletes it while the thread exits.
+struct MetricsShardHolder
+{
+    MetricsShardHolder();
+    ~MetricsShardHolder();
+    MetricsShard shard;
+};
+
+
+MetricsShardHolder::MetricsShardHolder()
+{
+    MetricsRegistry *registry = metricsRegistry();
+    if (registry) {
+        QMutexLocker locker(&registry->mutex);
+        registry->shards.append(&shard);
+    }
+}
+
+
+MetricsShardHolder::~MetricsShardHolder()
+{
+    MetricsRegistry *registry = metricsRegistry();
+    if (registry) {
+        QMutexLocker locker(&registry->mutex);
+        registry->shards.removeOne(&shard);
+        registry->retired.merge(shard);
+    }
+}
+
+
+Q_GLOBAL_STATIC(QThreadStorage<MetricsShardHolder*>, metricsShards)
+
+
+static QBasicAtomicInt metricsEnabled = Q_BASIC_ATOMIC_INITIALIZER(0);
+
+
+static MetricsShard *currentShard()
+{
+    QThreadStorage<MetricsShardHolder*> *storage = metricsShards();
+    if (!storage) {  // the process is exiting.
+        return nullptr;
+    }
+    if (!storage->hasLocalData()) {
+        storage->setLocalData(new MetricsShardHolder());
+    }
+    return &storage->localData()->shard;
+}
+
+
+static void record(const char *name, MetricType type, Metrics::Buckets buckets, const QByteArray &labels, qint64 delta, const double *observed)
+{
+    MetricsShard *shard = currentShard();
+    if (!shard) {
+        return;
+    }
+    QMutexLocker locker(&shard->mutex);
+    MetricFamily &family = shard->families[QByteArray::fromRawData(name, static_cast<int>(strlen(name)))];
+    family.type = type;
+    family.buckets = buckets;
+    MetricValue &value = family.values[labels];
+    value.value += delta;
+    if (observed) {
+        const double *bounds;
+        const int size = boundsOf(buckets, &bounds);
+        int i = 0;
+        while (i < size && *observed > bounds[i]) {
+            ++i;
+        }
+        ++value.buckets[i];
+        value.sum += *observed;
+    }
+}
+
+
+void Metrics::setEnabled(bool enabled)
+{
+    metricsEnabled.store(enabled ? 1 : 0);
+}
+
+
+bool Metrics::isEnabled()
+{
+    return metricsEnabled.load() != 0;
+}
+
+
+void Metrics::increase(const char *name, const QByteArray &labels, qint64 value)
+{
+    if (isEnabled()) {
+        record(name, CounterMetric, LatencyBuckets, labels, value, nullptr);
+    }
+}
+
+
+void Metrics::adjust(const char *name, const QByteArray &labels, qint64 delta)
+{
+    if (isEnabled()) {
+        record(name, GaugeMetric, LatencyBuckets, labels, delta, nullptr);
+    }
+}
+
+
+void Metrics::observe(const char *name, const QByteArray &labels, double value, Buckets buckets)
+{
+    if (isEnabled()) {
+        record(name, HistogramMetric, buckets, labels, 1, &value);
+    }
+}
+
+
+QByteArray Metrics::label(const char *name, const QString &value)
+{
+    QByteArray escaped = value.toUtf8();
+    escaped.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+    return QByteArray(name) + "=\"" + escaped + '"';
+}
+
+
+static QByteArray withLabels(const QByteArray &name, const QByteArray &labels, const QByteArray &extra = QByteArray())
+{
+    if (labels.isEmpty() && extra.isEmpty()) {
+        return name;
+    }
+    QByteArray line = name + '{' + labels;
+    if (!labels.isEmpty() && !extra.isEmpty()) {
+        line += ',';
+    }
+    return line + extra + '}';
+}
+
+
+static void renderFamily(QByteArray &out, const QByteArray &name, const MetricFamily &family)
+{
+    static const char *typeNames[] = { "counter", "gauge", "histogram" };
+    out += "# TYPE " + name + ' ' + typeNames[family.type] + '\n';
+    QList<QByteArray> labels = family.values.keys();
+    std::sort(labels.begin(), labels.end());
+    for (const QByteArray &l: labels) {
+        const MetricValue &value = family.values[l];
+        if (family.type != HistogramMetric) {
+            out += withLabels(name, l) + ' ' + QByteArray::number(value.value) + '\n';
+            continue;
+        }
+        const double *bounds;
+        const int size = boundsOf(family.buckets, &bounds);
+        quint64 cumulative = 0;
+        for (int i = 0; i <= size; ++i) {
+            cumulative += value.buckets[i];
+            const QByteArray &le = i < size ? QByteArray::number(bounds[i], 'g', 6) : QByteArray("+Inf");
+            out += withLabels(name + "_bucket", l, "le=\"" + le + '"') + ' ' + QByteArray::number(cumulative) + '\n';
+        }
+        out += withLabels(name + "_sum", l) + ' ' + QByteArray::number(value.sum, 'g', 9) + '\n';
+        out += withLabels(name + "_count", l) + ' ' + QByteArray::number(value.value) + '\n';
+    }
+}
+
+
+static void renderGauge(QByteArray &out, const char *name, const QByteArray &value)
+{
+    out += QByteArray("# TYPE ") + name + " gauge\n" + name + ' ' + value + '\n';
+}
+
+
+static void renderBuiltins(QByteArray &out)
+{
+    quint64 stackBytes = 0;
+    const quint64 coroutines = coroutineStacksInUse(&stackBytes);
+    renderGauge(out, "qtng_coroutines", QByteArray::number(coroutines));
+    renderGauge(out, "qtng_coroutine_stack_bytes", QByteArray::number(stackBytes));
+    quint64 hugetlbBytes = 0;
+    const quint64 arenaBytes = coroutineStackArenaBytes(&hugetlbBytes);
+    renderGauge(out, "qtng_coroutine_stack_arena_bytes", QByteArray::number(arenaBytes));
+    renderGauge(out, "qtng_coroutine_stack_hugetlb_bytes", QByteArray::number(hugetlbBytes));
+
+    EventLoopCoroutine *loop = EventLoopCoroutine::get();
+    if (!loop) {
+        return;
+    }
+    const EventLoopMetrics &m = loop->metrics();
+    renderGauge(out, "qtng_eventloop_longest_tick_seconds", QByteArray::number(m.longestTickNsecs / 1e9, 'g', 9));
+    renderGauge(out, "qtng_eventloop_busy_seconds", QByteArray::number(m.busyNsecs / 1e9, 'g', 9));
+    renderGauge(out, "qtng_eventloop_poll_seconds", QByteArray::number(m.pollNsecs / 1e9, 'g', 9));
+    renderGauge(out, "qtng_eventloop_pending_calls", QByteArray::number(m.pendingThreadSafeCalls));
+    // the busy time of iterations is the lag of the events arriving meanwhile.
+    out += "# TYPE qtng_eventloop_tick_seconds histogram\n";
+    quint64 cumulative = 0;
+    for (int i = 0; i < EventLoopMetrics::HistogramBuckets; ++i) {
+        cumulative += m.tickHistogram[i];
+        const QByteArray &le = i + 1 < EventLoopMetrics::HistogramBuckets ? QByteArray::number((1 << i) / 1e6, 'g', 6) : QByteArray("+Inf");
+        out += "qtng_eventloop_tick_seconds_bucket{le=\"" + le + "\"} " + QByteArray::number(cumulative) + '\n';
+    }
+    out += "qtng_eventloop_tick_seconds_sum " + QByteArray::number(m.busyNsecs / 1e9, 'g', 9) + '\n';
+    out += "qtng_eventloop_tick_seconds_count " + QByteArray::number(cumulative) + '\n';
+}
+
+
+QByteArray Metrics::render()
+{
+    MetricsShard merged;
+    MetricsRegistry *registry = metricsRegistry();
+    if (registry) {
+        QMutexLocker locker(&registry->mutex);
+        merged.merge(registry->retired);
+        for (MetricsShard *shard: registry->shards) {
+            QMutexLocker shardLocker(&shard->mutex);
+            merged.merge(*shard);
+        }
+    }
+    QList<QByteArray> names = merged.families.keys();
+    std::sort(names.begin(), names.end());
+    QByteArray out;
+    for (const QByteArray &name: names) {
+        renderFamily(out, name, merged.families[name]);
+    }
+    renderBuiltins(out);
+    return out;
+}
+
+
+void Metrics::clear()
+{
+    MetricsRegistry *registry = metricsRegistry();
+    if (!registry) {
+        return;
+    }
+    QMutexLocker locker(&registry->mutex);
+    registry->retired.families.clear();
+    for (MetricsShard *shard: registry->shards) {
+        QMutexLocker shardLocker(&shard->mutex);
+        shard->families.clear();
+    }
+}
+
+
+QTNETWORKNG_NAMESPACE_END
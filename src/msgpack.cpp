@@ -1,12 +1,17 @@
+#include <algorithm>
+#include <limits>
 #include <QBuffer>
+#include <QVector>
+#include <QHash>
 #include <QDebug>
+#include <QtCore/qnumeric.h>
 #include "../include/msgpack.h"
 
 #undef  CHECK_STREAM_PRECOND
 #ifndef QT_NO_DEBUG
 #define CHECK_STREAM_PRECOND(retVal) \
     Q_D(MsgPackStream); \
-    if (!d->dev) { \
+    if (!d->dev && d->mode == MsgPackStreamPrivate::DeviceMode) { \
         qWarning("msgpack::Stream: No device"); \
         return retVal; \
     } \
@@ -17,7 +22,7 @@
 #else
 #define CHECK_STREAM_PRECOND(retVal) \
     Q_D(MsgPackStream); \
-    if (!d->dev) { \
+    if (!d->dev && d->mode == MsgPackStreamPrivate::DeviceMode) { \
         return retVal; \
     } \
     if (d->status != Ok) { \
@@ -27,15 +32,82 @@
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
-static inline QDateTime unpackDatetime(const QByteArray &bs)
+struct MsgPackExtRegistration
 {
-#if QT_VERSION_CHECK(5, 7, 0)
-    quint64 t = qFromBigEndian<quint64>(static_cast<const void*>(bs.constData()));
-#else
-    quint64 t = qFromBigEndian<quint64>(static_cast<const uchar*>(bs.constData()));
-#endif
-    qint64 msecs = (t & 0x00000003ffffffffL) * 1000 + (t >> 34) / 1000;
-    return QDateTime::fromMSecsSinceEpoch(msecs);
+    int metaTypeId;
+    MsgPackExtEncoder encoder;
+    MsgPackExtDecoder decoder;
+};
+
+
+static MsgPackExtRegistration *extRegistry()
+{
+    static MsgPackExtRegistration registry[256] = {};
+    return registry;
+}
+
+
+static QHash<int, quint8> &extTypesByMetaType()
+{
+    static QHash<int, quint8> extTypes;
+    return extTypes;
+}
+
+// the type of value by its first byte. the length is the payload bytes or the items of array and map, it is
+// stored in lengthSize bytes following the first byte if lengthSize is not zero.
+static bool classifyMsgPackByte(quint8 b, MsgPackView::Type *type, int *lengthSize, quint32 *length)
+{
+    *lengthSize = 0;
+    *length = 0;
+    if (b <= FirstByte::POSITIVE_FIXINT || b >= FirstByte::NEGATIVE_FIXINT) {
+        *type = MsgPackView::Integer;
+    } else if (b < FirstByte::FIXARRAY) {
+        *type = MsgPackView::Map;
+        *length = b & 0x0f;
+    } else if (b < FirstByte::FIXSTR) {
+        *type = MsgPackView::Array;
+        *length = b & 0x0f;
+    } else if (b < FirstByte::NIL) {
+        *type = MsgPackView::String;
+        *length = b & 0x1f;
+    } else {
+        switch (b) {
+        case FirstByte::NIL:
+            *type = MsgPackView::Nil;
+            break;
+        case FirstByte::MFALSE:
+        case FirstByte::MTRUE:
+            *type = MsgPackView::Boolean;
+            break;
+        case FirstByte::BIN8: *type = MsgPackView::Binary; *lengthSize = 1; break;
+        case FirstByte::BIN16: *type = MsgPackView::Binary; *lengthSize = 2; break;
+        case FirstByte::BIN32: *type = MsgPackView::Binary; *lengthSize = 4; break;
+        case FirstByte::EXT8: *type = MsgPackView::Extension; *lengthSize = 1; break;
+        case FirstByte::EXT16: *type = MsgPackView::Extension; *lengthSize = 2; break;
+        case FirstByte::EXT32: *type = MsgPackView::Extension; *lengthSize = 4; break;
+        case FirstByte::FLOAT32: *type = MsgPackView::Float; *length = 4; break;
+        case FirstByte::FLOAT64: *type = MsgPackView::Float; *length = 8; break;
+        case FirstByte::UINT8: case FirstByte::INT8: *type = MsgPackView::Integer; *length = 1; break;
+        case FirstByte::UINT16: case FirstByte::INT16: *type = MsgPackView::Integer; *length = 2; break;
+        case FirstByte::UINT32: case FirstByte::INT32: *type = MsgPackView::Integer; *length = 4; break;
+        case FirstByte::UINT64: case FirstByte::INT64: *type = MsgPackView::Integer; *length = 8; break;
+        case FirstByte::FIXEXT1: case FirstByte::FIXEXT2: case FirstByte::FIXEXT4: case FirstByte::FIXEXT8:
+        case FirstByte::FIXEX16:
+            *type = MsgPackView::Extension;
+            *length = 1u << (b - FirstByte::FIXEXT1);
+            break;
+        case FirstByte::STR8: *type = MsgPackView::String; *lengthSize = 1; break;
+        case FirstByte::STR16: *type = MsgPackView::String; *lengthSize = 2; break;
+        case FirstByte::STR32: *type = MsgPackView::String; *lengthSize = 4; break;
+        case FirstByte::ARRAY16: *type = MsgPackView::Array; *lengthSize = 2; break;
+        case FirstByte::ARRAY32: *type = MsgPackView::Array; *lengthSize = 4; break;
+        case FirstByte::MAP16: *type = MsgPackView::Map; *lengthSize = 2; break;
+        case FirstByte::MAP32: *type = MsgPackView::Map; *lengthSize = 4; break;
+        default:
+            return false;  // NEVER_USED
+        }
+    }
+    return true;
 }
 
 class MsgPackStreamPrivate
@@ -47,56 +119,100 @@ public:
     MsgPackStreamPrivate(const QByteArray &a);
     ~MsgPackStreamPrivate();
 
+    // the byte arrays are read and written in place, without the virtual calls of QBuffer.
+    enum Mode {
+        DeviceMode,
+        ReadBufferMode,
+        WriteBufferMode,
+        CountMode,          // writes nothing but counts the bytes.
+    };
+
     QIODevice *dev;
+    QByteArray source;      // keeps the data of ReadBufferMode alive.
+    QByteArray *target;     // of WriteBufferMode.
+    qint64 pos;             // the position in source or target.
+    QVector<qint64> openHeaders;    // the positions of headers written by beginArray() and beginMap().
+    Mode mode;
     MsgPackStream::Status status;
     quint32 limit;
     bool owndev;
     bool flushWrites;
 
+    bool hasDevice() const { return dev || mode != DeviceMode; }
     bool readBytes(char *data, qint64 len);
     inline bool readBytes(quint8 *data, int len);
+    bool readString(QString &s, quint32 len);
+    bool skipBytes(qint64 len);
+    bool skipValue(int firstByte = -1);
+    bool readContainerHeader(quint8 fix, quint8 first16, quint8 first32, quint32 &len);
+    bool writeContainerHeader(quint8 fix, quint8 first16, quint8 first32, quint32 len);
+    bool beginContainer(quint8 first32);
+    bool endContainer(quint8 first32, quint32 len);
     bool readExtHeader(quint32 &len, quint8 &msgpackType);
+    bool readExtPayload(quint32 len, const char *&payload, QByteArray &buffer);
+    bool unpackExt(QVariant &v, quint8 extType, quint32 len);
     bool writeBytes(const char *data, qint64 len);
     inline bool writeBytes(const quint8 *data, int len);
     bool writeExtHeader(quint32 len, quint8 msgpackType);
     bool unpack_longlong(qint64 &i64);
     bool unpack_ulonglong(quint64 &u64);
     bool unpackString(QString &s);
+    bool readStringHeader(quint32 &len);
+    bool writeStringHeader(quint32 len);
+    bool writeAsciiString(const QString &str);
     bool unpack(QVariant &v);
 };
 
 MsgPackStreamPrivate::MsgPackStreamPrivate()
-    :dev(nullptr), status(MsgPackStream::Ok), limit(std::numeric_limits<quint32>::max()), owndev(false), flushWrites(false)
+    :dev(nullptr), target(nullptr), pos(0), mode(DeviceMode), status(MsgPackStream::Ok),
+      limit(std::numeric_limits<quint32>::max()), owndev(false), flushWrites(false)
 {
 }
 
 MsgPackStreamPrivate::MsgPackStreamPrivate(QIODevice *d)
-    :dev(d), status(MsgPackStream::Ok), limit(std::numeric_limits<quint32>::max()), owndev(false), flushWrites(false)
+    :dev(d), target(nullptr), pos(0), mode(DeviceMode), status(MsgPackStream::Ok),
+      limit(std::numeric_limits<quint32>::max()), owndev(false), flushWrites(false)
 {
 }
 
 
 MsgPackStreamPrivate::MsgPackStreamPrivate(QByteArray *a, QIODevice::OpenMode mode)
-    :status(MsgPackStream::Ok), owndev(true), flushWrites(false)
+    :dev(nullptr), target(nullptr), pos(0), mode(DeviceMode), status(MsgPackStream::Ok),
+      limit(std::numeric_limits<quint32>::max()), owndev(false), flushWrites(false)
 {
-    QBuffer *buf = new QBuffer(a);
-    buf->open(mode);
-    dev = buf;
-    if (mode == QIODevice::ReadOnly) {
+    const QIODevice::OpenMode access = mode & QIODevice::ReadWrite;
+    if (!a) {
+        this->mode = CountMode;
+        if (access != QIODevice::WriteOnly) {
+            status = MsgPackStream::ReadPastEnd;
+        }
+    } else if (access == QIODevice::ReadOnly) {
+        source = *a;
+        this->mode = ReadBufferMode;
         limit = a->size();
+    } else if (access == QIODevice::WriteOnly) {
+        // writes from the start like QBuffer, or from the end if appending.
+        target = a;
+        this->mode = WriteBufferMode;
+        if (mode & QIODevice::Truncate) {
+            a->clear();
+        } else if (mode & QIODevice::Append) {
+            pos = a->size();
+        }
     } else {
-        limit = std::numeric_limits<quint32>::max();
+        // reading and writing the same array is rare, QBuffer handles it.
+        QBuffer *buf = new QBuffer(a);
+        buf->open(mode);
+        dev = buf;
+        owndev = true;
     }
 }
 
 
 MsgPackStreamPrivate::MsgPackStreamPrivate(const QByteArray &a)
-    :status(MsgPackStream::Ok), limit(a.size()), owndev(true), flushWrites(false)
+    :dev(nullptr), source(a), target(nullptr), pos(0), mode(ReadBufferMode), status(MsgPackStream::Ok),
+      limit(a.size()), owndev(false), flushWrites(false)
 {
-    QBuffer *buf = new QBuffer();
-    buf->setData(a);
-    buf->open(QIODevice::ReadOnly);
-    dev = buf;
 }
 
 MsgPackStreamPrivate::~MsgPackStreamPrivate()
@@ -111,6 +227,15 @@ bool MsgPackStreamPrivate::readBytes(char *data, qint64 len)
     if (status != MsgPackStream::Ok) {
         return false;
     }
+    if (mode == ReadBufferMode) {
+        if (len > source.size() - pos) {
+            status = MsgPackStream::ReadPastEnd;
+            return false;
+        }
+        memcpy(data, source.constData() + pos, static_cast<size_t>(len));
+        pos += len;
+        return true;
+    }
     if (!dev) {
         status = MsgPackStream::ReadPastEnd;
         return false;
@@ -140,9 +265,183 @@ bool MsgPackStreamPrivate::readBytes(quint8 *data, int len)
     return readBytes(static_cast<char*>(static_cast<void*>(data)), len);
 }
 
+bool MsgPackStreamPrivate::readString(QString &s, quint32 len)
+{
+    if (len == 0) {
+        s = QString::fromUtf8(QByteArray());
+        return true;
+    }
+    if (mode == ReadBufferMode) {
+        // decoded from the source, without copying the bytes first.
+        if (status != MsgPackStream::Ok) {
+            return false;
+        }
+        if (len > source.size() - pos) {
+            status = MsgPackStream::ReadPastEnd;
+            return false;
+        }
+        s = QString::fromUtf8(source.constData() + pos, static_cast<int>(len));
+        pos += len;
+        return true;
+    }
+    QByteArray buf;
+    buf.resize(static_cast<int>(len));
+    if (!readBytes(buf.data(), len)) {
+        return false;
+    }
+    s = QString::fromUtf8(buf);
+    return true;
+}
+
+bool MsgPackStreamPrivate::skipBytes(qint64 len)
+{
+    if (mode == ReadBufferMode) {
+        if (status != MsgPackStream::Ok) {
+            return false;
+        }
+        if (len > source.size() - pos) {
+            status = MsgPackStream::ReadPastEnd;
+            return false;
+        }
+        pos += len;
+        return true;
+    }
+    char buf[1024];
+    while (len > 0) {
+        const qint64 n = qMin<qint64>(len, sizeof(buf));
+        if (!readBytes(buf, n)) {
+            return false;
+        }
+        len -= n;
+    }
+    return true;
+}
+
+// skips the value and its children without decoding, the first byte is given if it is read already.
+bool MsgPackStreamPrivate::skipValue(int firstByte)
+{
+    qint64 remaining = 1;
+    while (remaining > 0) {
+        quint8 p[5];
+        if (firstByte >= 0) {
+            p[0] = static_cast<quint8>(firstByte);
+            firstByte = -1;
+        } else if (!readBytes(p, 1)) {
+            return false;
+        }
+        MsgPackView::Type type;
+        int lengthSize;
+        quint32 length;
+        if (!classifyMsgPackByte(p[0], &type, &lengthSize, &length)) {
+            status = MsgPackStream::ReadCorruptData;
+            return false;
+        }
+        if (lengthSize > 0) {
+            if (!readBytes(p + 1, lengthSize)) {
+                return false;
+            }
+            if (lengthSize == 1) {
+                length = _msgpack_load8(p + 1);
+            } else if (lengthSize == 2) {
+                length = _msgpack_load16(p + 1);
+            } else {
+                length = _msgpack_load32(p + 1);
+            }
+        }
+        if (type == MsgPackView::Array) {
+            remaining += length;
+        } else if (type == MsgPackView::Map) {
+            remaining += 2 * static_cast<qint64>(length);
+        } else if (!skipBytes(static_cast<qint64>(length) + (type == MsgPackView::Extension ? 1 : 0))) {
+            return false;
+        }
+        --remaining;
+    }
+    return true;
+}
+
+bool MsgPackStreamPrivate::readContainerHeader(quint8 fix, quint8 first16, quint8 first32, quint32 &len)
+{
+    quint8 p[5];
+    if (!readBytes(p, 1)) {
+        return false;
+    }
+    if (p[0] >= fix && p[0] <= fix + 0xf) {
+        len = p[0] & 0xf;
+    } else if (p[0] == first16) {
+        if (!readBytes(p + 1, 2)) {
+            return false;
+        }
+        len = _msgpack_load16(p + 1);
+    } else if (p[0] == first32) {
+        if (!readBytes(p + 1, 4)) {
+            return false;
+        }
+        len = _msgpack_load32(p + 1);
+    } else {
+        status = MsgPackStream::ReadCorruptData;
+        return false;
+    }
+    return true;
+}
+
+bool MsgPackStreamPrivate::writeContainerHeader(quint8 fix, quint8 first16, quint8 first32, quint32 len)
+{
+    quint8 p[5];
+    if (len <= 15) {
+        p[0] = fix | static_cast<quint8>(len);
+        return writeBytes(p, 1);
+    } else if (len <= std::numeric_limits<quint16>::max()) {
+        p[0] = first16;
+        _msgpack_store16(p + 1, static_cast<quint16>(len));
+        return writeBytes(p, 3);
+    } else {
+        p[0] = first32;
+        _msgpack_store32(p + 1, len);
+        return writeBytes(p, 5);
+    }
+}
+
+bool MsgPackStreamPrivate::beginContainer(quint8 first32)
+{
+    if (status != MsgPackStream::Ok) {
+        return false;
+    }
+    if (mode != WriteBufferMode && mode != CountMode) {
+        // the devices may not seek back.
+        status = MsgPackStream::WriteFailed;
+        return false;
+    }
+    openHeaders.append(pos);
+    quint8 p[5] = { first32, 0, 0, 0, 0 };
+    return writeBytes(p, 5);
+}
+
+bool MsgPackStreamPrivate::endContainer(quint8 first32, quint32 len)
+{
+    if (status != MsgPackStream::Ok) {
+        return false;
+    }
+    if (openHeaders.isEmpty()) {
+        status = MsgPackStream::WriteFailed;
+        return false;
+    }
+    const qint64 headerPos = openHeaders.takeLast();
+    if (mode == CountMode) {
+        return true;
+    }
+    quint8 *p = static_cast<quint8*>(static_cast<void*>(target->data() + headerPos));
+    if (p[0] != first32) {
+        status = MsgPackStream::WriteFailed;  // endArray() for beginMap(), or the reverse.
+        return false;
+    }
+    _msgpack_store32(p + 1, len);
+    return true;
+}
+
 bool MsgPackStreamPrivate::readExtHeader(quint32 &len, quint8 &msgpackType)
 {
-    if (!dev || status != MsgPackStream::Ok) {
+    if (!hasDevice() || status != MsgPackStream::Ok) {
         return false;
     }
     quint8 p[6];
@@ -184,6 +483,73 @@ bool MsgPackStreamPrivate::readExtHeader(quint32 &len, quint8 &msgpackType)
     return true;
 }
 
+bool MsgPackStreamPrivate::readExtPayload(quint32 len, const char *&payload, QByteArray &buffer)
+{
+    if (static_cast<int>(len) < 0) {
+        status = MsgPackStream::ReadCorruptData;
+        return false;
+    }
+    if (mode == ReadBufferMode) {
+        if (status != MsgPackStream::Ok) {
+            return false;
+        }
+        if (len > source.size() - pos) {
+            status = MsgPackStream::ReadPastEnd;
+            return false;
+        }
+        payload = source.constData() + pos;
+        pos += len;
+        return true;
+    }
+    buffer.resize(static_cast<int>(len));
+    if (len > 0 && !readBytes(buffer.data(), len)) {
+        return false;
+    }
+    payload = buffer.constData();
+    return true;
+}
+
+// the registered types are decoded from the payload in place, the others are copied to MsgPackExtData.
+bool MsgPackStreamPrivate::unpackExt(QVariant &v, quint8 extType, quint32 len)
+{
+    if (len > limit) {
+        qDebug() << "read bytearraty length is too large.";
+        status = MsgPackStream::ReadCorruptData;
+        return false;
+    }
+    const char *payload;
+    QByteArray buffer;
+    if (!readExtPayload(len, payload, buffer)) {
+        return false;
+    }
+    const MsgPackExtRegistration &registration = extRegistry()[extType];
+    if (registration.decoder) {
+        QVariant value(registration.metaTypeId, nullptr);
+        if (!registration.decoder(payload, len, value.data())) {
+            status = MsgPackStream::ReadCorruptData;
+            return false;
+        }
+        v = value;
+        return true;
+    }
+    if (extType == 0xff) {
+        QDateTime dt;
+        if (MsgPackExtCodec<QDateTime>::decode(payload, len, dt)) {
+            v.setValue(dt);
+            return true;
+        }
+    }
+    MsgPackExtData ext;
+    ext.type = extType;
+    if (mode == ReadBufferMode) {
+        ext.payload = QByteArray(payload, static_cast<int>(len));
+    } else {
+        ext.payload = buffer;
+    }
+    v.setValue(ext);
+    return true;
+}
+
 bool MsgPackStreamPrivate::unpack_longlong(qint64 &i64)
 {
     quint8 p[9];
@@ -328,13 +694,22 @@ bool MsgPackStreamPrivate::unpack_ulonglong(quint64 &u64)
 }
 
 bool MsgPackStreamPrivate::unpackString(QString &s)
+{
+    quint32 len;
+    if (!readStringHeader(len)) {
+        return false;
+    }
+    return readString(s, len);
+}
+
+bool MsgPackStreamPrivate::readStringHeader(quint32 &len)
 {
     quint8 p[5];
     if (!readBytes(p, 1)) {
         return false;
     }
 
-    quint32 len = 0;
+    len = 0;
     if (p[0] >= FirstByte::FIXSTR && p[0] <= (FirstByte::FIXSTR + 0x1f)) { // fixstr
         len = p[0] - FirstByte::FIXSTR;
     } else if (p[0] == FirstByte::STR8) {
@@ -365,14 +740,6 @@ bool MsgPackStreamPrivate::unpackString(QString &s)
         status = MsgPackStream::ReadCorruptData;
         return false;
     }
-    QByteArray buf;
-    if (len > 0) {
-        buf.resize(static_cast<int>(len));
-        if (!readBytes(buf.data(), len)) {
-            return false;
-        }
-    }
-    s = QString::fromUtf8(buf);
     return true;
 }
 
@@ -415,14 +782,11 @@ bool MsgPackStreamPrivate::unpack(QVariant &v)
         v = l;
     } else if (FirstByte::FIXSTR <= p[0] && p[0] < FirstByte::NIL) {
         quint32 len = p[0] - FirstByte::FIXSTR;
-        QByteArray bs;
-        if (len > 0) {
-            bs.resize(static_cast<int>(len));
-            if (!readBytes(bs.data(), len)) {
-                return false;
-            }
+        QString str;
+        if (!readString(str, len)) {
+            return false;
         }
-        v = QString::fromUtf8(bs);
+        v = str;
     } else if (p[0] == FirstByte::NIL || p[0] == FirstByte::NEVER_USED) {
         v.clear();
     } else if (p[0] == FirstByte::MFALSE) {
@@ -492,57 +856,25 @@ bool MsgPackStreamPrivate::unpack(QVariant &v)
             return false;
         }
         quint32 len = p[1];
-        MsgPackExtData ext;
-        ext.type = p[2];
-        if (len > 0) {
-            ext.payload.resize(static_cast<int>(len));
-            if (!readBytes(ext.payload.data(), len)) {
-                return false;
-            }
+        if (!unpackExt(v, p[2], len)) {
+            return false;
         }
-        v.setValue(ext);
     } else if (p[0] == FirstByte::EXT16) {
         if (!readBytes(p + 1, 3)) {
             return false;
         }
         quint32 len = _msgpack_load16(p + 1);
-        if (len > limit) {
-            qDebug() << "read bytearraty length is too large.";
-            status = MsgPackStream::ReadCorruptData;
+        if (!unpackExt(v, p[3], len)) {
             return false;
         }
-        MsgPackExtData ext;
-        ext.type = p[3];
-        if (len > 0) {
-            ext.payload.resize(static_cast<int>(len));
-            if (!readBytes(ext.payload.data(), len)) {
-                return false;
-            }
-        }
-        v.setValue(ext);
     } else if (p[0] == FirstByte::EXT32) {
         if (!readBytes(p + 1, 5)) {
             return false;
         }
         quint32 len = _msgpack_load32(p + 1);
-        if (len > limit) {
-            qDebug() << "read bytearraty length is too large.";
-            status = MsgPackStream::ReadCorruptData;
-            return false;
-        }
-        if (static_cast<int>(len) < 0){
-            status = MsgPackStream::ReadCorruptData;
+        if (!unpackExt(v, p[5], len)) {
             return false;
         }
-        MsgPackExtData ext;
-        ext.type = p[5];
-        if (len > 0) {
-            ext.payload.resize(static_cast<int>(len));
-            if (!readBytes(ext.payload.data(), len)) {
-                return false;
-            }
-        }
-        v.setValue(ext);
     } else if (p[0] == FirstByte::FLOAT32) {
         if (!readBytes(p + 1, 4)) {
             return false;
@@ -603,18 +935,9 @@ bool MsgPackStreamPrivate::unpack(QVariant &v)
         if(!readBytes(p + 1, 1)) {
             return false;
         }
-        MsgPackExtData ext;
-        ext.type = p[1];
-        ext.payload.resize(static_cast<int>(len));
-        if (!readBytes(ext.payload.data(), len)) {
+        if (!unpackExt(v, p[1], len)) {
             return false;
         }
-        if (ext.type == 0xff && ext.payload.size() == 8) {
-            const QDateTime &dt = unpackDatetime(ext.payload);
-            v.setValue(dt);
-        } else {
-            v.setValue(ext);
-        }
     } else if (p[0] == FirstByte::STR8) {
         if (!readBytes(p + 1, 1)) {
             return false;
@@ -625,14 +948,11 @@ bool MsgPackStreamPrivate::unpack(QVariant &v)
             status = MsgPackStream::ReadCorruptData;
             return false;
         }
-        QByteArray buf;
-        if (len > 0) {
-            buf.resize(static_cast<int>(len));
-            if (!readBytes(buf.data(), len)) {
-                return false;
-            }
+        QString str;
+        if (!readString(str, len)) {
+            return false;
         }
-        v = QString::fromUtf8(buf);
+        v = str;
     } else if (p[0] == FirstByte::STR16) {
         if (!readBytes(p + 1, 2)) {
             return false;
@@ -643,14 +963,11 @@ bool MsgPackStreamPrivate::unpack(QVariant &v)
             status = MsgPackStream::ReadCorruptData;
             return false;
         }
-        QByteArray buf;
-        if (len > 0) {
-            buf.resize(static_cast<int>(len));
-            if (!readBytes(buf.data(), len)) {
-                return false;
-            }
+        QString str;
+        if (!readString(str, len)) {
+            return false;
         }
-        v = QString::fromUtf8(buf);
+        v = str;
     } else if (p[0] == FirstByte::STR32) {
         if (!readBytes(p + 1, 4)) {
             return false;
@@ -665,14 +982,11 @@ bool MsgPackStreamPrivate::unpack(QVariant &v)
             status = MsgPackStream::ReadCorruptData;
             return false;
         }
-        QByteArray buf;
-        if (len > 0) {
-            buf.resize(static_cast<int>(len));
-            if (!readBytes(buf.data(), len)) {
-                return false;
-            }
+        QString str;
+        if (!readString(str, len)) {
+            return false;
         }
-        v = QString::fromUtf8(buf);
+        v = str;
     } else if (p[0] == FirstByte::ARRAY16) {
         if (!readBytes(p + 1, 2)) {
             return false;
@@ -749,6 +1063,23 @@ bool MsgPackStreamPrivate::writeBytes(const char *data, qint64 len)
     if (status != MsgPackStream::Ok) {
         return false;
     }
+    if (mode == CountMode) {
+        pos += len;
+        return true;
+    }
+    if (mode == WriteBufferMode) {
+        if (pos + len > std::numeric_limits<int>::max()) {
+            status = MsgPackStream::WriteFailed;
+            return false;
+        }
+        // QByteArray grows the capacity by steps, so appending many small values is cheap.
+        if (pos + len > target->size()) {
+            target->resize(static_cast<int>(pos + len));
+        }
+        memcpy(target->data() + pos, data, static_cast<size_t>(len));
+        pos += len;
+        return true;
+    }
     if (!dev) {
         status = MsgPackStream::WriteFailed;
         return false;
@@ -788,7 +1119,7 @@ bool MsgPackStreamPrivate::writeExtHeader(quint32 len, quint8 msgpackType)
     if (status != MsgPackStream::Ok) {
         return false;
     }
-    if (!dev) {
+    if (!hasDevice()) {
         status = MsgPackStream::WriteFailed;
         return false;
     }
@@ -859,6 +1190,11 @@ void MsgPackStream::setDevice(QIODevice *dev)
     }
     d->dev = dev;
     d->owndev = false;
+    d->mode = MsgPackStreamPrivate::DeviceMode;
+    d->source.clear();
+    d->target = nullptr;
+    d->pos = 0;
+    d->openHeaders.clear();
 }
 
 QIODevice *MsgPackStream::device() const
@@ -870,6 +1206,9 @@ QIODevice *MsgPackStream::device() const
 bool MsgPackStream::atEnd() const
 {
     Q_D(const MsgPackStream);
+    if (d->mode == MsgPackStreamPrivate::ReadBufferMode) {
+        return d->pos >= d->source.size();
+    }
     return d->dev ? d->dev->atEnd() : true;
 }
 
@@ -1130,20 +1469,18 @@ MsgPackStream &MsgPackStream::operator>>(QByteArray &array)
 MsgPackStream &MsgPackStream::operator>>(QDateTime &dt)
 {
     CHECK_STREAM_PRECOND(*this);
+    quint8 extType;
+    const char *payload;
     quint32 len;
-    quint8 msgpackType;
-    d->readExtHeader(len, msgpackType);
-    if (len != 8 || msgpackType != 0xff) {
-        d->status = ReadCorruptData;
+    QByteArray buffer;
+    if (!readExt(extType, payload, len, buffer)) {
         dt = QDateTime();
         return *this;
     }
-    quint8 p[8];
-    if (!d->readBytes(p, 8)) {
+    if (extType != 0xff || !MsgPackExtCodec<QDateTime>::decode(payload, len, dt)) {
+        d->status = ReadCorruptData;
         dt = QDateTime();
-        return *this;
     }
-    dt = unpackDatetime(QByteArray(static_cast<char*>(static_cast<void*>(p)), 8));
     return *this;
 }
 
@@ -1355,11 +1692,8 @@ MsgPackStream &MsgPackStream::operator<<(double f)
 }
 
 
-MsgPackStream &MsgPackStream::operator<<(const QString &str)
+bool MsgPackStreamPrivate::writeStringHeader(quint32 len)
 {
-    CHECK_STREAM_PRECOND(*this);
-    const QByteArray &bytes = str.toUtf8();
-    quint32 len = static_cast<quint32>(bytes.size());
     quint8 p[5];
     int sz;
     if (len <= 31) {
@@ -1378,69 +1712,182 @@ MsgPackStream &MsgPackStream::operator<<(const QString &str)
         _msgpack_store32(p + 1, len);
         sz = 5;
     }
-    if (!d->writeBytes(p, sz)) {
-        return *this;
-    }
-    d->writeBytes(bytes.data(), len);
-    return *this;
+    return writeBytes(p, sz);
 }
 
 
-MsgPackStream &MsgPackStream::operator<<(const QByteArray &array)
+// narrows the ascii string into the target, returns false with pos unchanged if a character is not ascii. the
+// bytes written before are overwritten by the longer utf8 then.
+bool MsgPackStreamPrivate::writeAsciiString(const QString &str)
 {
-    CHECK_STREAM_PRECOND(*this);
-    quint8 p[5];
-    quint32 len = static_cast<quint32>(array.length());
-    int sz;
-    if (len <= std::numeric_limits<quint8>::max()) {
-        p[0] = FirstByte::BIN8;
-        _msgpack_store8(p + 1, static_cast<quint8>(len));
-        sz = 2;
-    } else if (len <= std::numeric_limits<quint16>::max()) {
-        p[0] = FirstByte::BIN16;
-        _msgpack_store16(p + 1, static_cast<quint16>(len));
-        sz = 3;
-    } else {
-        p[0] = FirstByte::BIN32;
-        _msgpack_store32(p + 1, len);
-        sz = 5;
+    if (mode != WriteBufferMode || status != MsgPackStream::Ok) {
+        return false;
     }
-    if (!d->writeBytes(p, sz)) {
-        return *this;
+    const int n = str.size();
+    const qint64 start = pos;
+    if (!writeStringHeader(static_cast<quint32>(n))) {
+        return false;
     }
-    d->writeBytes(array.data(), len);
-    return *this;
+    if (pos + n > std::numeric_limits<int>::max()) {
+        status = MsgPackStream::WriteFailed;
+        return false;
+    }
+    if (pos + n > target->size()) {
+        target->resize(static_cast<int>(pos + n));
+    }
+    const ushort *in = str.utf16();
+    char *out = target->data() + pos;
+    int i = 0;
+    // checks four characters at once.
+    for (; i + 4 <= n; i += 4) {
+        quint64 w;
+        memcpy(&w, in + i, sizeof(w));
+        if (w & Q_UINT64_C(0xff80ff80ff80ff80)) {
+            break;
+        }
+        out[i] = static_cast<char>(in[i]);
+        out[i + 1] = static_cast<char>(in[i + 1]);
+        out[i + 2] = static_cast<char>(in[i + 2]);
+        out[i + 3] = static_cast<char>(in[i + 3]);
+    }
+    for (; i < n; ++i) {
+        if (in[i] >= 0x80) {
+            pos = start;
+            return false;
+        }
+        out[i] = static_cast<char>(in[i]);
+    }
+    pos += n;
+    return true;
 }
 
-static QByteArray packDatetime(const QDateTime &dt)
+
+// skips eight ascii bytes at once, and checks the overlong forms, surrogates and code points beyond U+10FFFF.
+bool MsgPackStream::isValidUtf8(const char *data, qint64 size)
 {
-    if(!dt.isValid()) {
-        return QByteArray();
+    const quint8 *p = static_cast<const quint8*>(static_cast<const void*>(data));
+    const quint8 *end = p + size;
+    while (p < end) {
+        if (end - p >= 8) {
+            quint64 w;
+            memcpy(&w, p, sizeof(w));
+            if (!(w & Q_UINT64_C(0x8080808080808080))) {
+                p += 8;
+                continue;
+            }
+        }
+        const quint8 b = *p;
+        if (b < 0x80) {
+            ++p;
+            continue;
+        }
+        int n;
+        quint32 cp, min;
+        if ((b & 0xe0) == 0xc0) {
+            n = 1; cp = b & 0x1f; min = 0x80;
+        } else if ((b & 0xf0) == 0xe0) {
+            n = 2; cp = b & 0x0f; min = 0x800;
+        } else if ((b & 0xf8) == 0xf0) {
+            n = 3; cp = b & 0x07; min = 0x10000;
+        } else {
+            return false;
+        }
+        if (end - p <= n) {
+            return false;
+        }
+        for (int i = 1; i <= n; ++i) {
+            if ((p[i] & 0xc0) != 0x80) {
+                return false;
+            }
+            cp = (cp << 6) | (p[i] & 0x3f);
+        }
+        if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+            return false;
+        }
+        p += n + 1;
     }
-    quint64 msecs = static_cast<quint64>(dt.toMSecsSinceEpoch());
-    quint64 t = ((msecs % 1000) * 1000) << 34 | (msecs / 1000);
-    QByteArray bs;
-    bs.resize(8);
-#if QT_VERSION_CHECK(5, 7, 0)
-    qToBigEndian(t, static_cast<void*>(bs.data()));
-#else
-    qToBigEndian(t, static_cast<uchar*>(bs.data()));
-#endif
-    return bs;
+    return true;
 }
 
-MsgPackStream &MsgPackStream::operator<<(const QDateTime &dt)
+
+MsgPackStream &MsgPackStream::operator<<(const QString &str)
 {
     CHECK_STREAM_PRECOND(*this);
-    const QByteArray &bs = packDatetime(dt);
-    if (bs.isEmpty()) {
-        d->status = WriteFailed;
+    if (d->writeAsciiString(str) || d->status != Ok) {
+        return *this;
+    }
+    const QByteArray &bytes = str.toUtf8();
+    if (!d->writeStringHeader(static_cast<quint32>(bytes.size()))) {
         return *this;
     }
-    if (!d->writeExtHeader(static_cast<quint32>(bs.size()), 0xff)) {
+    d->writeBytes(bytes.constData(), bytes.size());
+    return *this;
+}
+
+
+bool MsgPackStream::readUtf8(QByteArray &utf8)
+{
+    CHECK_STREAM_PRECOND(false);
+    quint32 len;
+    if (!d->readStringHeader(len)) {
+        return false;
+    }
+    utf8.resize(static_cast<int>(len));
+    if (len > 0 && !d->readBytes(utf8.data(), len)) {
+        utf8.clear();
+        return false;
+    }
+    if (!isValidUtf8(utf8.constData(), utf8.size())) {
+        utf8.clear();
+        d->status = ReadCorruptData;
+        return false;
+    }
+    return true;
+}
+
+
+bool MsgPackStream::writeUtf8(const char *data, qint32 size)
+{
+    CHECK_STREAM_PRECOND(false);
+    if (size < 0 || !d->writeStringHeader(static_cast<quint32>(size))) {
+        return false;
+    }
+    return d->writeBytes(data, size);
+}
+
+
+MsgPackStream &MsgPackStream::operator<<(const QByteArray &array)
+{
+    CHECK_STREAM_PRECOND(*this);
+    quint8 p[5];
+    quint32 len = static_cast<quint32>(array.length());
+    int sz;
+    if (len <= std::numeric_limits<quint8>::max()) {
+        p[0] = FirstByte::BIN8;
+        _msgpack_store8(p + 1, static_cast<quint8>(len));
+        sz = 2;
+    } else if (len <= std::numeric_limits<quint16>::max()) {
+        p[0] = FirstByte::BIN16;
+        _msgpack_store16(p + 1, static_cast<quint16>(len));
+        sz = 3;
+    } else {
+        p[0] = FirstByte::BIN32;
+        _msgpack_store32(p + 1, len);
+        sz = 5;
+    }
+    if (!d->writeBytes(p, sz)) {
         return *this;
     }
-    d->writeBytes(bs.data(), bs.size());
+    d->writeBytes(array.data(), len);
+    return *this;
+}
+
+MsgPackStream &MsgPackStream::operator<<(const QDateTime &dt)
+{
+    CHECK_STREAM_PRECOND(*this);
+    if (!MsgPackExtCodec<QDateTime>::encode(*this, 0xff, dt) && d->status == Ok) {
+        d->status = WriteFailed;
+    }
     return *this;
 }
 
@@ -1489,7 +1936,14 @@ MsgPackStream &MsgPackStream::operator<<(const QVariant &v)
     } else if (t == QVariant::DateTime) {
         return *this << v.toDateTime();
     } else {
-        if (v.canConvert<MsgPackExtData>()) {
+        QHash<int, quint8>::const_iterator itor = extTypesByMetaType().constFind(v.userType());
+        if (itor != extTypesByMetaType().constEnd()) {
+            const quint8 extType = itor.value();
+            if (!extRegistry()[extType].encoder(*this, extType, v.constData()) && d->status == Ok) {
+                d->status = WriteFailed;
+            }
+            return *this;
+        } else if (v.canConvert<MsgPackExtData>()) {
             const MsgPackExtData &ext = v.value<MsgPackExtData>();
             return *this << ext;
         } else {
@@ -1514,4 +1968,1780 @@ bool MsgPackStream::writeExtHeader(quint32 len, quint8 msgpackType)
 }
 
 
+bool MsgPackStream::readExt(quint8 &extType, const char *&payload, quint32 &len, QByteArray &buffer)
+{
+    CHECK_STREAM_PRECOND(false)
+    if (!d->readExtHeader(len, extType)) {
+        return false;
+    }
+    return d->readExtPayload(len, payload, buffer);
+}
+
+
+void MsgPackStream::registerExtType(quint8 extType, int metaTypeId, MsgPackExtEncoder encoder, MsgPackExtDecoder decoder)
+{
+    MsgPackExtRegistration &registration = extRegistry()[extType];
+    if (registration.encoder) {
+        extTypesByMetaType().remove(registration.metaTypeId);
+    }
+    registration.metaTypeId = metaTypeId;
+    registration.encoder = encoder;
+    registration.decoder = decoder;
+    if (encoder) {
+        extTypesByMetaType().insert(metaTypeId, extType);
+    }
+}
+
+
+bool MsgPackExtCodec<QDateTime>::encode(MsgPackStream &s, quint8 extType, const QDateTime &v)
+{
+    if (!v.isValid()) {
+        return false;
+    }
+    const quint64 msecs = static_cast<quint64>(v.toMSecsSinceEpoch());
+    const quint64 t = ((msecs % 1000) * 1000) << 34 | (msecs / 1000);
+    quint8 p[8];
+    _msgpack_store64(p, t);
+    return s.writeExtHeader(8, extType) && s.writeBytes(static_cast<const char*>(static_cast<void*>(p)), 8);
+}
+
+
+bool MsgPackExtCodec<QDateTime>::decode(const char *payload, quint32 len, QDateTime &v)
+{
+    quint8 *p = static_cast<quint8*>(static_cast<void*>(const_cast<char*>(payload)));
+    qint64 msecs;
+    if (len == 4) {
+        msecs = static_cast<qint64>(_msgpack_load32(p)) * 1000;
+    } else if (len == 8) {
+        const quint64 t = _msgpack_load64(p);
+        msecs = static_cast<qint64>((t & Q_UINT64_C(0x00000003ffffffff)) * 1000 + (t >> 34) / 1000);
+    } else if (len == 12) {
+        const quint32 nsecs = _msgpack_load32(p);
+        const qint64 secs = static_cast<qint64>(_msgpack_load64(p + 4));
+        msecs = secs * 1000 + nsecs / 1000000;
+    } else {
+        return false;
+    }
+    v = QDateTime::fromMSecsSinceEpoch(msecs);
+    return true;
+}
+
+
+bool MsgPackExtCodec<QUuid>::encode(MsgPackStream &s, quint8 extType, const QUuid &v)
+{
+    quint8 p[16];
+    _msgpack_store32(p, static_cast<quint32>(v.data1));
+    _msgpack_store16(p + 4, static_cast<quint16>(v.data2));
+    _msgpack_store16(p + 6, static_cast<quint16>(v.data3));
+    memcpy(p + 8, v.data4, 8);
+    return s.writeExtHeader(16, extType) && s.writeBytes(static_cast<const char*>(static_cast<void*>(p)), 16);
+}
+
+
+bool MsgPackExtCodec<QUuid>::decode(const char *payload, quint32 len, QUuid &v)
+{
+    if (len != 16) {
+        return false;
+    }
+    quint8 *p = static_cast<quint8*>(static_cast<void*>(const_cast<char*>(payload)));
+    v.data1 = _msgpack_load32(p);
+    v.data2 = _msgpack_load16(p + 4);
+    v.data3 = _msgpack_load16(p + 6);
+    memcpy(v.data4, p + 8, 8);
+    return true;
+}
+
+
+bool MsgPackStream::readArrayHeader(quint32 &len)
+{
+    CHECK_STREAM_PRECOND(false)
+    return d->readContainerHeader(FirstByte::FIXARRAY, FirstByte::ARRAY16, FirstByte::ARRAY32, len);
+}
+
+
+bool MsgPackStream::readMapHeader(quint32 &len)
+{
+    CHECK_STREAM_PRECOND(false)
+    return d->readContainerHeader(FirstByte::FIXMAP, FirstByte::MAP16, FirstByte::MAP32, len);
+}
+
+
+bool MsgPackStream::writeArrayHeader(quint32 len)
+{
+    CHECK_STREAM_PRECOND(false)
+    return d->writeContainerHeader(FirstByte::FIXARRAY, FirstByte::ARRAY16, FirstByte::ARRAY32, len);
+}
+
+
+bool MsgPackStream::beginArray()
+{
+    CHECK_STREAM_PRECOND(false);
+    return d->beginContainer(FirstByte::ARRAY32);
+}
+
+
+bool MsgPackStream::endArray(quint32 len)
+{
+    CHECK_STREAM_PRECOND(false);
+    return d->endContainer(FirstByte::ARRAY32, len);
+}
+
+
+bool MsgPackStream::beginMap()
+{
+    CHECK_STREAM_PRECOND(false);
+    return d->beginContainer(FirstByte::MAP32);
+}
+
+
+bool MsgPackStream::endMap(quint32 len)
+{
+    CHECK_STREAM_PRECOND(false);
+    return d->endContainer(FirstByte::MAP32, len);
+}
+
+
+qint64 MsgPackStream::position() const
+{
+    Q_D(const MsgPackStream);
+    if (d->mode == MsgPackStreamPrivate::DeviceMode) {
+        return d->dev ? d->dev->pos() : 0;
+    }
+    return d->pos;
+}
+
+
+bool MsgPackStream::writeMapHeader(quint32 len)
+{
+    CHECK_STREAM_PRECOND(false)
+    return d->writeContainerHeader(FirstByte::FIXMAP, FirstByte::MAP16, FirstByte::MAP32, len);
+}
+
+
+qint32 MsgPackStream::readKey(char *data, qint32 size)
+{
+    CHECK_STREAM_PRECOND(-1)
+    quint8 p[5];
+    if (!d->readBytes(p, 1)) {
+        return -1;
+    }
+    quint32 len;
+    if (p[0] >= FirstByte::FIXSTR && p[0] <= FirstByte::FIXSTR + 0x1f) {
+        len = p[0] & 0x1f;
+    } else if (p[0] == FirstByte::STR8) {
+        if (!d->readBytes(p + 1, 1)) {
+            return -1;
+        }
+        len = p[1];
+    } else if (p[0] == FirstByte::STR16) {
+        if (!d->readBytes(p + 1, 2)) {
+            return -1;
+        }
+        len = _msgpack_load16(p + 1);
+    } else if (p[0] == FirstByte::STR32) {
+        if (!d->readBytes(p + 1, 4)) {
+            return -1;
+        }
+        len = _msgpack_load32(p + 1);
+    } else {
+        d->skipValue(p[0]);
+        return -1;
+    }
+    if (len > static_cast<quint32>(qMax(size, 0))) {
+        d->skipBytes(len);
+        return -1;
+    }
+    if (!d->readBytes(data, len)) {
+        return -1;
+    }
+    return static_cast<qint32>(len);
+}
+
+
+bool MsgPackStream::skipValue()
+{
+    CHECK_STREAM_PRECOND(false)
+    return d->skipValue();
+}
+
+
+// the header of value at offset, the length is the payload bytes for scalars, or the items of array and map.
+static bool parseMsgPackHeader(const char *data, qint64 size, qint64 offset, MsgPackView::Type *type,
+                               int *headerSize, quint32 *length)
+{
+    if (offset < 0 || offset >= size) {
+        return false;
+    }
+    quint8 *p = static_cast<quint8*>(static_cast<void*>(const_cast<char*>(data + offset)));
+    const qint64 left = size - offset;
+    int lengthSize;
+    if (!classifyMsgPackByte(p[0], type, &lengthSize, length)) {
+        return false;
+    }
+    *headerSize = 1 + lengthSize;
+    if (*type == MsgPackView::Extension) {
+        *headerSize += 1;  // the type of extension.
+    }
+    if (left < *headerSize) {
+        return false;
+    }
+    if (lengthSize == 1) {
+        *length = _msgpack_load8(p + 1);
+    } else if (lengthSize == 2) {
+        *length = _msgpack_load16(p + 1);
+    } else if (lengthSize == 4) {
+        *length = _msgpack_load32(p + 1);
+    }
+    const bool hasPayload = *type != MsgPackView::Array && *type != MsgPackView::Map;
+    if (hasPayload && *length > static_cast<quint64>(left - *headerSize)) {
+        return false;
+    }
+    return true;
+}
+
+
+// the integer of header p, returns true if it is an uint64 beyond qint64 and stored in u64 instead of i64.
+static bool loadMsgPackInteger(quint8 *p, qint64 *i64, quint64 *u64)
+{
+    switch (p[0]) {
+    case FirstByte::UINT8: *i64 = _msgpack_load8(p + 1); break;
+    case FirstByte::INT8: *i64 = static_cast<qint8>(_msgpack_load8(p + 1)); break;
+    case FirstByte::UINT16: *i64 = _msgpack_load16(p + 1); break;
+    case FirstByte::INT16: *i64 = static_cast<qint16>(_msgpack_load16(p + 1)); break;
+    case FirstByte::UINT32: *i64 = _msgpack_load32(p + 1); break;
+    case FirstByte::INT32: *i64 = static_cast<qint32>(_msgpack_load32(p + 1)); break;
+    case FirstByte::UINT64:
+        *u64 = _msgpack_load64(p + 1);
+        if (*u64 > static_cast<quint64>(std::numeric_limits<qint64>::max())) {
+            return true;
+        }
+        *i64 = static_cast<qint64>(*u64);
+        break;
+    case FirstByte::INT64: *i64 = static_cast<qint64>(_msgpack_load64(p + 1)); break;
+    default:
+        *i64 = p[0] <= FirstByte::POSITIVE_FIXINT ? p[0] : static_cast<qint8>(p[0]);
+        break;
+    }
+    return false;
+}
+
+
+MsgPackView::MsgPackView()
+    :_offset(0), headerSize(0), _length(0), _size(-1), _type(Invalid)
+{
+}
+
+
+MsgPackView::MsgPackView(const QByteArray &source, int offset)
+    :source(source), _offset(offset), headerSize(0), _length(0), _size(-1), _type(Invalid)
+{
+    if (!parseMsgPackHeader(source.constData(), source.size(), offset, &_type, &headerSize, &_length)) {
+        _type = Invalid;
+    }
+}
+
+
+int MsgPackView::size() const
+{
+    if (_size >= 0 || _type == Invalid) {
+        return _size;
+    }
+    if (_type != Array && _type != Map) {
+        _size = headerSize + static_cast<int>(_length);
+        return _size;
+    }
+    // skips the children without recursion, every value takes one byte at least.
+    const char *data = source.constData();
+    const qint64 total = source.size();
+    qint64 end = _offset;
+    qint64 remaining = 1;
+    while (remaining > 0) {
+        if (remaining > total - end) {
+            return -1;
+        }
+        Type type;
+        int h;
+        quint32 length;
+        if (!parseMsgPackHeader(data, total, end, &type, &h, &length)) {
+            return -1;
+        }
+        end += h;
+        if (type == Array) {
+            remaining += length;
+        } else if (type == Map) {
+            remaining += 2 * static_cast<qint64>(length);
+        } else {
+            end += length;
+        }
+        --remaining;
+    }
+    _size = static_cast<int>(end - _offset);
+    return _size;
+}
+
+
+MsgPackView MsgPackView::next() const
+{
+    const int s = size();
+    if (s < 0) {
+        return MsgPackView();
+    }
+    return MsgPackView(source, _offset + s);
+}
+
+
+bool MsgPackView::toBool() const
+{
+    return _type == Boolean && static_cast<quint8>(source.at(_offset)) == FirstByte::MTRUE;
+}
+
+
+qint64 MsgPackView::toInteger(bool *ok) const
+{
+    if (ok) {
+        *ok = false;
+    }
+    if (_type != Integer) {
+        return 0;
+    }
+    quint8 *p = static_cast<quint8*>(static_cast<void*>(const_cast<char*>(source.constData() + _offset)));
+    qint64 i64;
+    switch (p[0]) {
+    case FirstByte::UINT8: i64 = _msgpack_load8(p + 1); break;
+    case FirstByte::INT8: i64 = static_cast<qint8>(_msgpack_load8(p + 1)); break;
+    case FirstByte::UINT16: i64 = _msgpack_load16(p + 1); break;
+    case FirstByte::INT16: i64 = static_cast<qint16>(_msgpack_load16(p + 1)); break;
+    case FirstByte::UINT32: i64 = _msgpack_load32(p + 1); break;
+    case FirstByte::INT32: i64 = static_cast<qint32>(_msgpack_load32(p + 1)); break;
+    case FirstByte::UINT64: {
+        const quint64 u64 = _msgpack_load64(p + 1);
+        if (u64 > static_cast<quint64>(std::numeric_limits<qint64>::max())) {
+            return 0;
+        }
+        i64 = static_cast<qint64>(u64);
+        break;
+    }
+    case FirstByte::INT64: i64 = static_cast<qint64>(_msgpack_load64(p + 1)); break;
+    default:
+        i64 = p[0] <= FirstByte::POSITIVE_FIXINT ? p[0] : static_cast<qint8>(p[0]);
+        break;
+    }
+    if (ok) {
+        *ok = true;
+    }
+    return i64;
+}
+
+
+quint64 MsgPackView::toUnsignedInteger(bool *ok) const
+{
+    if (ok) {
+        *ok = false;
+    }
+    if (_type != Integer) {
+        return 0;
+    }
+    quint8 *p = static_cast<quint8*>(static_cast<void*>(const_cast<char*>(source.constData() + _offset)));
+    if (p[0] == FirstByte::UINT64) {
+        if (ok) {
+            *ok = true;
+        }
+        return _msgpack_load64(p + 1);
+    }
+    bool signedOk;
+    const qint64 i64 = toInteger(&signedOk);
+    if (!signedOk || i64 < 0) {
+        return 0;
+    }
+    if (ok) {
+        *ok = true;
+    }
+    return static_cast<quint64>(i64);
+}
+
+
+double MsgPackView::toDouble(bool *ok) const
+{
+    if (_type == Integer) {
+        return static_cast<double>(toInteger(ok));
+    }
+    if (ok) {
+        *ok = _type == Float;
+    }
+    if (_type != Float) {
+        return 0.0;
+    }
+    quint8 *p = static_cast<quint8*>(static_cast<void*>(const_cast<char*>(source.constData() + _offset)));
+    if (p[0] == FirstByte::FLOAT32) {
+        const quint32 u32 = _msgpack_load32(p + 1);
+        float f;
+        memcpy(&f, &u32, sizeof(f));
+        return static_cast<double>(f);
+    } else {
+        const quint64 u64 = _msgpack_load64(p + 1);
+        double d;
+        memcpy(&d, &u64, sizeof(d));
+        return d;
+    }
+}
+
+
+QString MsgPackView::toString() const
+{
+    if (_type != String) {
+        return QString();
+    }
+    return QString::fromUtf8(data(), length());
+}
+
+
+QByteArray MsgPackView::toByteArray() const
+{
+    if (_type != String && _type != Binary && _type != Extension) {
+        return QByteArray();
+    }
+    return QByteArray(data(), length());
+}
+
+
+QVariant MsgPackView::toVariant() const
+{
+    const int s = size();
+    if (s < 0) {
+        return QVariant();
+    }
+    QVariant v;
+    MsgPackStream stream(QByteArray::fromRawData(source.constData() + _offset, s));
+    stream >> v;
+    return v;
+}
+
+
+quint8 MsgPackView::extensionType() const
+{
+    if (_type != Extension) {
+        return 0;
+    }
+    return static_cast<quint8>(source.at(_offset + headerSize - 1));
+}
+
+
+const char *MsgPackView::data() const
+{
+    if (_type == Invalid) {
+        return nullptr;
+    }
+    return source.constData() + _offset + headerSize;
+}
+
+
+int MsgPackView::length() const
+{
+    if (_type != String && _type != Binary && _type != Extension) {
+        return 0;
+    }
+    return static_cast<int>(_length);
+}
+
+
+bool MsgPackView::equals(const QByteArray &bytes) const
+{
+    if (_type != String && _type != Binary) {
+        return false;
+    }
+    return static_cast<int>(_length) == bytes.size() && memcmp(data(), bytes.constData(), _length) == 0;
+}
+
+
+QByteArray MsgPackView::bytes() const
+{
+    if (_type != String && _type != Binary && _type != Extension) {
+        return QByteArray();
+    }
+    return QByteArray::fromRawData(data(), length());
+}
+
+
+QByteArray MsgPackView::encoded() const
+{
+    const int s = size();
+    if (s < 0) {
+        return QByteArray();
+    }
+    return QByteArray::fromRawData(source.constData() + _offset, s);
+}
+
+
+int MsgPackView::count() const
+{
+    if (_type != Array && _type != Map) {
+        return 0;
+    }
+    return static_cast<int>(_length);
+}
+
+
+MsgPackView MsgPackView::at(int i) const
+{
+    if (i < 0 || i >= count()) {
+        return MsgPackView();
+    }
+    const int skipped = _type == Map ? i * 2 : i;
+    MsgPackView item(source, _offset + headerSize);
+    for (int j = 0; j < skipped && item.isValid(); ++j) {
+        item = item.next();
+    }
+    return item;
+}
+
+
+QList<MsgPackView> MsgPackView::items() const
+{
+    QList<MsgPackView> l;
+    const qint64 n = _type == Map ? 2 * static_cast<qint64>(_length) : count();
+    if (n > source.size()) {
+        return l;  // corrupt.
+    }
+    MsgPackView item(source, _offset + headerSize);
+    for (qint64 i = 0; i < n; ++i) {
+        if (!item.isValid()) {
+            return QList<MsgPackView>();
+        }
+        l.append(item);
+        item = item.next();
+    }
+    return l;
+}
+
+
+MsgPackView MsgPackView::value(const QByteArray &key) const
+{
+    if (_type != Map) {
+        return MsgPackView();
+    }
+    MsgPackView k(source, _offset + headerSize);
+    for (quint32 i = 0; i < _length && k.isValid(); ++i) {
+        const MsgPackView &v = k.next();
+        if (k.equals(key)) {
+            return v;
+        }
+        k = v.next();
+    }
+    return MsgPackView();
+}
+
+
+struct MsgPackEntry;
+struct MsgPackNode
+{
+    quint8 type;            // of MsgPackView::Type.
+    quint8 extType;
+    bool big;               // an uint64 beyond qint64.
+    quint32 length;         // the payload bytes, the items of array, or the entries of map.
+    union {
+        qint64 i64;
+        quint64 u64;
+        double f;
+        const char *data;   // the payload in source.
+        MsgPackNode *items;
+        MsgPackEntry *entries;
+    };
+};
+
+
+struct MsgPackEntry
+{
+    MsgPackNode key;
+    MsgPackNode value;
+};
+
+
+// the strings and bytes go first by their bytes, then the integers, and the other keys by type.
+static int compareMsgPackKey(const MsgPackNode &a, const MsgPackNode &b)
+{
+    const bool aBytes = a.type == MsgPackView::String || a.type == MsgPackView::Binary;
+    const bool bBytes = b.type == MsgPackView::String || b.type == MsgPackView::Binary;
+    if (aBytes != bBytes) {
+        return aBytes ? -1 : 1;
+    }
+    if (aBytes) {
+        const int r = memcmp(a.data, b.data, qMin(a.length, b.length));
+        if (r != 0) {
+            return r;
+        }
+        return a.length < b.length ? -1 : (a.length > b.length ? 1 : 0);
+    }
+    if (a.type != b.type) {
+        return a.type < b.type ? -1 : 1;
+    }
+    if (a.type == MsgPackView::Integer && !a.big && !b.big) {
+        return a.i64 < b.i64 ? -1 : (a.i64 > b.i64 ? 1 : 0);
+    }
+    return 0;
+}
+
+
+class MsgPackDocumentPrivate
+{
+public:
+    MsgPackDocumentPrivate()
+        :root(nullptr), current(nullptr), left(0), pos(0), usage(0) {}
+    ~MsgPackDocumentPrivate() { clear(); }
+    void *allocate(qint64 bytes);
+    bool parseNode(MsgPackNode *node, int depth);
+    void clear();
+public:
+    enum { BlockSize = 1024 * 64, MaxDepth = 512 };
+    QByteArray source;
+    QVector<char*> blocks;
+    MsgPackNode *root;
+    char *current;          // the free bytes of last block.
+    qint64 left;
+    qint64 pos;
+    qint64 usage;
+};
+
+
+void *MsgPackDocumentPrivate::allocate(qint64 bytes)
+{
+    bytes = (bytes + 7) & ~static_cast<qint64>(7);
+    if (bytes > left) {
+        // the big arrays take their own blocks, the free bytes of last block are kept for small ones.
+        const qint64 size = qMax<qint64>(bytes, BlockSize);
+        char *block = static_cast<char*>(malloc(static_cast<size_t>(size)));
+        if (!block) {
+            return nullptr;
+        }
+        blocks.append(block);
+        usage += size;
+        if (size == bytes) {
+            return block;
+        }
+        current = block;
+        left = size;
+    }
+    void *p = current;
+    current += bytes;
+    left -= bytes;
+    return p;
+}
+
+
+bool MsgPackDocumentPrivate::parseNode(MsgPackNode *node, int depth)
+{
+    if (depth > MaxDepth) {
+        return false;
+    }
+    MsgPackView::Type type;
+    int headerSize;
+    quint32 length;
+    if (!parseMsgPackHeader(source.constData(), source.size(), pos, &type, &headerSize, &length)) {
+        return false;
+    }
+    quint8 *p = static_cast<quint8*>(static_cast<void*>(const_cast<char*>(source.constData() + pos)));
+    node->type = static_cast<quint8>(type);
+    node->extType = 0;
+    node->big = false;
+    node->length = length;
+    node->u64 = 0;
+    pos += headerSize;
+    switch (type) {
+    case MsgPackView::Nil:
+        break;
+    case MsgPackView::Boolean:
+        node->i64 = p[0] == FirstByte::MTRUE ? 1 : 0;
+        break;
+    case MsgPackView::Integer:
+        node->big = loadMsgPackInteger(p, &node->i64, &node->u64);
+        pos += length;
+        node->length = 0;
+        break;
+    case MsgPackView::Float:
+        if (p[0] == FirstByte::FLOAT32) {
+            const quint32 u32 = _msgpack_load32(p + 1);
+            float f;
+            memcpy(&f, &u32, sizeof(f));
+            node->f = static_cast<double>(f);
+        } else {
+            const quint64 u64 = _msgpack_load64(p + 1);
+            memcpy(&node->f, &u64, sizeof(node->f));
+        }
+        pos += length;
+        node->length = 0;
+        break;
+    case MsgPackView::Extension:
+        node->extType = p[headerSize - 1];
+        node->data = source.constData() + pos;
+        pos += length;
+        break;
+    case MsgPackView::String:
+    case MsgPackView::Binary:
+        node->data = source.constData() + pos;
+        pos += length;
+        break;
+    case MsgPackView::Array: {
+        // every item takes one byte at least, so the corrupt counts are refused before allocating.
+        if (length > source.size() - pos) {
+            return false;
+        }
+        if (length == 0) {
+            node->items = nullptr;
+            break;
+        }
+        node->items = static_cast<MsgPackNode*>(allocate(static_cast<qint64>(length) * sizeof(MsgPackNode)));
+        if (!node->items) {
+            return false;
+        }
+        for (quint32 i = 0; i < length; ++i) {
+            if (!parseNode(node->items + i, depth + 1)) {
+                return false;
+            }
+        }
+        break;
+    }
+    case MsgPackView::Map: {
+        if (2 * static_cast<qint64>(length) > source.size() - pos) {
+            return false;
+        }
+        if (length == 0) {
+            node->entries = nullptr;
+            break;
+        }
+        node->entries = static_cast<MsgPackEntry*>(allocate(static_cast<qint64>(length) * sizeof(MsgPackEntry)));
+        if (!node->entries) {
+            return false;
+        }
+        for (quint32 i = 0; i < length; ++i) {
+            if (!parseNode(&node->entries[i].key, depth + 1) || !parseNode(&node->entries[i].value, depth + 1)) {
+                return false;
+            }
+        }
+        std::sort(node->entries, node->entries + length, [] (const MsgPackEntry &a, const MsgPackEntry &b) {
+            return compareMsgPackKey(a.key, b.key) < 0;
+        });
+        break;
+    }
+    default:
+        return false;
+    }
+    return true;
+}
+
+
+void MsgPackDocumentPrivate::clear()
+{
+    for (char *block: blocks) {
+        free(block);
+    }
+    blocks.clear();
+    source.clear();
+    root = nullptr;
+    current = nullptr;
+    left = 0;
+    usage = 0;
+}
+
+
+MsgPackDocument::MsgPackDocument()
+    :d_ptr(new MsgPackDocumentPrivate())
+{
+}
+
+
+MsgPackDocument::~MsgPackDocument()
+{
+    delete d_ptr;
+}
+
+
+bool MsgPackDocument::parse(const QByteArray &data)
+{
+    Q_D(MsgPackDocument);
+    d->clear();
+    d->source = data;
+    d->pos = 0;
+    MsgPackNode *root = static_cast<MsgPackNode*>(d->allocate(sizeof(MsgPackNode)));
+    if (!root || !d->parseNode(root, 0)) {
+        d->clear();
+        return false;
+    }
+    d->root = root;
+    return true;
+}
+
+
+MsgPackValue MsgPackDocument::root() const
+{
+    Q_D(const MsgPackDocument);
+    return MsgPackValue(d->root);
+}
+
+
+qint64 MsgPackDocument::memoryUsage() const
+{
+    Q_D(const MsgPackDocument);
+    return d->usage;
+}
+
+
+void MsgPackDocument::clear()
+{
+    Q_D(MsgPackDocument);
+    d->clear();
+}
+
+
+MsgPackView::Type MsgPackValue::type() const
+{
+    return node ? static_cast<MsgPackView::Type>(node->type) : MsgPackView::Invalid;
+}
+
+
+bool MsgPackValue::toBool() const
+{
+    return type() == MsgPackView::Boolean && node->i64 != 0;
+}
+
+
+qint64 MsgPackValue::toInteger(bool *ok) const
+{
+    const bool valid = type() == MsgPackView::Integer && !node->big;
+    if (ok) {
+        *ok = valid;
+    }
+    return valid ? node->i64 : 0;
+}
+
+
+quint64 MsgPackValue::toUnsignedInteger(bool *ok) const
+{
+    const bool valid = type() == MsgPackView::Integer && (node->big || node->i64 >= 0);
+    if (ok) {
+        *ok = valid;
+    }
+    return valid ? node->u64 : 0;
+}
+
+
+double MsgPackValue::toDouble(bool *ok) const
+{
+    if (type() == MsgPackView::Integer) {
+        if (ok) {
+            *ok = true;
+        }
+        return node->big ? static_cast<double>(node->u64) : static_cast<double>(node->i64);
+    }
+    const bool valid = type() == MsgPackView::Float;
+    if (ok) {
+        *ok = valid;
+    }
+    return valid ? node->f : 0.0;
+}
+
+
+QString MsgPackValue::toString() const
+{
+    if (type() != MsgPackView::String) {
+        return QString();
+    }
+    return QString::fromUtf8(node->data, static_cast<int>(node->length));
+}
+
+
+QByteArray MsgPackValue::toByteArray() const
+{
+    return QByteArray(data(), length());
+}
+
+
+QVariant MsgPackValue::toVariant() const
+{
+    switch (type()) {
+    case MsgPackView::Boolean:
+        return toBool();
+    case MsgPackView::Integer:
+        if (node->big) {
+            return node->u64;
+        }
+        return node->i64;
+    case MsgPackView::Float:
+        return node->f;
+    case MsgPackView::String:
+        return toString();
+    case MsgPackView::Binary:
+        return toByteArray();
+    case MsgPackView::Array: {
+        QVariantList list;
+        list.reserve(static_cast<int>(node->length));
+        for (quint32 i = 0; i < node->length; ++i) {
+            list.append(MsgPackValue(node->items + i).toVariant());
+        }
+        return list;
+    }
+    case MsgPackView::Map: {
+        QVariantMap map;
+        for (quint32 i = 0; i < node->length; ++i) {
+            const MsgPackEntry &entry = node->entries[i];
+            map.insert(MsgPackValue(&entry.key).toVariant().toString(), MsgPackValue(&entry.value).toVariant());
+        }
+        return map;
+    }
+    case MsgPackView::Extension: {
+        const MsgPackExtRegistration &registration = extRegistry()[node->extType];
+        if (registration.decoder) {
+            QVariant value(registration.metaTypeId, nullptr);
+            if (registration.decoder(node->data, node->length, value.data())) {
+                return value;
+            }
+            return QVariant();
+        }
+        QDateTime dt;
+        if (node->extType == 0xff && MsgPackExtCodec<QDateTime>::decode(node->data, node->length, dt)) {
+            return dt;
+        }
+        MsgPackExtData ext;
+        ext.type = node->extType;
+        ext.payload = toByteArray();
+        return QVariant::fromValue(ext);
+    }
+    default:
+        return QVariant();
+    }
+}
+
+
+quint8 MsgPackValue::extensionType() const
+{
+    return type() == MsgPackView::Extension ? node->extType : 0;
+}
+
+
+const char *MsgPackValue::data() const
+{
+    const MsgPackView::Type t = type();
+    if (t != MsgPackView::String && t != MsgPackView::Binary && t != MsgPackView::Extension) {
+        return nullptr;
+    }
+    return node->data;
+}
+
+
+int MsgPackValue::length() const
+{
+    const MsgPackView::Type t = type();
+    if (t != MsgPackView::String && t != MsgPackView::Binary && t != MsgPackView::Extension) {
+        return 0;
+    }
+    return static_cast<int>(node->length);
+}
+
+
+bool MsgPackValue::equals(const QByteArray &bytes) const
+{
+    const MsgPackView::Type t = type();
+    if (t != MsgPackView::String && t != MsgPackView::Binary) {
+        return false;
+    }
+    return static_cast<int>(node->length) == bytes.size() && memcmp(node->data, bytes.constData(), node->length) == 0;
+}
+
+
+QByteArray MsgPackValue::bytes() const
+{
+    if (!data()) {
+        return QByteArray();
+    }
+    return QByteArray::fromRawData(node->data, length());
+}
+
+
+int MsgPackValue::count() const
+{
+    const MsgPackView::Type t = type();
+    if (t != MsgPackView::Array && t != MsgPackView::Map) {
+        return 0;
+    }
+    return static_cast<int>(node->length);
+}
+
+
+MsgPackValue MsgPackValue::at(int i) const
+{
+    if (i < 0 || i >= count()) {
+        return MsgPackValue();
+    }
+    if (node->type == MsgPackView::Array) {
+        return MsgPackValue(node->items + i);
+    }
+    return MsgPackValue(&node->entries[i].value);
+}
+
+
+MsgPackValue MsgPackValue::keyAt(int i) const
+{
+    if (type() != MsgPackView::Map || i < 0 || i >= count()) {
+        return MsgPackValue();
+    }
+    return MsgPackValue(&node->entries[i].key);
+}
+
+
+MsgPackValue MsgPackValue::value(const QByteArray &key) const
+{
+    if (type() != MsgPackView::Map) {
+        return MsgPackValue();
+    }
+    MsgPackNode k;
+    k.type = MsgPackView::String;
+    k.big = false;
+    k.length = static_cast<quint32>(key.size());
+    k.data = key.constData();
+    const MsgPackEntry *begin = node->entries;
+    const MsgPackEntry *end = node->entries + node->length;
+    const MsgPackEntry *found = std::lower_bound(begin, end, k, [] (const MsgPackEntry &entry, const MsgPackNode &k) {
+        return compareMsgPackKey(entry.key, k) < 0;
+    });
+    if (found == end || compareMsgPackKey(found->key, k) != 0) {
+        return MsgPackValue();
+    }
+    return MsgPackValue(&found->value);
+}
+
+
+// parses json by recursive descent, and writes the msgpack values at once. the arrays and maps are written by
+// beginArray() and beginMap(), so their items are not counted beforehand.
+class JsonToMsgPack
+{
+public:
+    JsonToMsgPack(const char *data, qint64 size, QByteArray *out)
+        :p(data), end(data + size), stream(out, QIODevice::WriteOnly) {}
+    bool parse();
+private:
+    bool parseValue(int depth);
+    bool parseString();
+    bool parseNumber();
+    bool parseLiteral(const char *literal, int len);
+    bool parseHex(quint32 *code);
+    void skipSpaces()
+    {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) {
+            ++p;
+        }
+    }
+public:
+    enum { MaxDepth = 512 };
+    const char *p;
+    const char *end;
+    MsgPackStream stream;
+    QByteArray scratch;     // the string of escapes.
+};
+
+
+bool JsonToMsgPack::parse()
+{
+    if (!parseValue(0)) {
+        return false;
+    }
+    skipSpaces();
+    return p == end && stream.status() == MsgPackStream::Ok;
+}
+
+
+bool JsonToMsgPack::parseValue(int depth)
+{
+    skipSpaces();
+    if (p >= end) {
+        return false;
+    }
+    switch (*p) {
+    case '{': {
+        ++p;
+        skipSpaces();
+        if (p < end && *p == '}') {
+            ++p;
+            return stream.writeMapHeader(0);
+        }
+        if (depth >= MaxDepth || !stream.beginMap()) {
+            return false;
+        }
+        quint32 entries = 0;
+        while (true) {
+            skipSpaces();
+            if (p >= end || *p != '"' || !parseString()) {
+                return false;
+            }
+            skipSpaces();
+            if (p >= end || *p != ':') {
+                return false;
+            }
+            ++p;
+            if (!parseValue(depth + 1)) {
+                return false;
+            }
+            ++entries;
+            skipSpaces();
+            if (p >= end) {
+                return false;
+            } else if (*p == ',') {
+                ++p;
+            } else if (*p == '}') {
+                ++p;
+                return stream.endMap(entries);
+            } else {
+                return false;
+            }
+        }
+    }
+    case '[': {
+        ++p;
+        skipSpaces();
+        if (p < end && *p == ']') {
+            ++p;
+            return stream.writeArrayHeader(0);
+        }
+        if (depth >= MaxDepth || !stream.beginArray()) {
+            return false;
+        }
+        quint32 items = 0;
+        while (true) {
+            if (!parseValue(depth + 1)) {
+                return false;
+            }
+            ++items;
+            skipSpaces();
+            if (p >= end) {
+                return false;
+            } else if (*p == ',') {
+                ++p;
+            } else if (*p == ']') {
+                ++p;
+                return stream.endArray(items);
+            } else {
+                return false;
+            }
+        }
+    }
+    case '"':
+        return parseString();
+    case 't':
+        if (!parseLiteral("true", 4)) {
+            return false;
+        }
+        stream << true;
+        return true;
+    case 'f':
+        if (!parseLiteral("false", 5)) {
+            return false;
+        }
+        stream << false;
+        return true;
+    case 'n': {
+        if (!parseLiteral("null", 4)) {
+            return false;
+        }
+        const char nil = static_cast<char>(FirstByte::NIL);
+        return stream.writeBytes(&nil, 1);
+    }
+    default:
+        return parseNumber();
+    }
+}
+
+
+bool JsonToMsgPack::parseLiteral(const char *literal, int len)
+{
+    if (end - p < len || memcmp(p, literal, static_cast<size_t>(len)) != 0) {
+        return false;
+    }
+    p += len;
+    return true;
+}
+
+
+bool JsonToMsgPack::parseHex(quint32 *code)
+{
+    if (end - p < 4) {
+        return false;
+    }
+    *code = 0;
+    for (int i = 0; i < 4; ++i, ++p) {
+        const char c = *p;
+        *code <<= 4;
+        if (c >= '0' && c <= '9') {
+            *code |= static_cast<quint32>(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            *code |= static_cast<quint32>(c - 'a' + 10);
+        } else if (c >= 'A' && c <= 'F') {
+            *code |= static_cast<quint32>(c - 'A' + 10);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// the strings without escapes are written from the input directly.
+bool JsonToMsgPack::parseString()
+{
+    ++p;
+    const char *start = p;
+    while (p < end && *p != '"' && *p != '\\' && static_cast<quint8>(*p) >= 0x20) {
+        ++p;
+    }
+    if (p >= end || static_cast<quint8>(*p) < 0x20) {
+        return false;
+    }
+    if (*p == '"') {
+        const qint64 len = p - start;
+        ++p;
+        return MsgPackStream::isValidUtf8(start, len) && stream.writeUtf8(start, static_cast<qint32>(len));
+    }
+    scratch.clear();
+    scratch.append(start, static_cast<int>(p - start));
+    while (true) {
+        start = p;
+        while (p < end && *p != '"' && *p != '\\' && static_cast<quint8>(*p) >= 0x20) {
+            ++p;
+        }
+        scratch.append(start, static_cast<int>(p - start));
+        if (p >= end || static_cast<quint8>(*p) < 0x20) {
+            return false;
+        }
+        if (*p == '"') {
+            ++p;
+            break;
+        }
+        ++p;  // the backslash.
+        if (p >= end) {
+            return false;
+        }
+        const char c = *p++;
+        switch (c) {
+        case '"': case '\\': case '/': scratch.append(c); break;
+        case 'b': scratch.append('\b'); break;
+        case 'f': scratch.append('\f'); break;
+        case 'n': scratch.append('\n'); break;
+        case 'r': scratch.append('\r'); break;
+        case 't': scratch.append('\t'); break;
+        case 'u': {
+            quint32 code;
+            if (!parseHex(&code)) {
+                return false;
+            }
+            if (code >= 0xd800 && code <= 0xdbff) {
+                quint32 low;
+                if (end - p < 2 || p[0] != '\\' || p[1] != 'u') {
+                    return false;
+                }
+                p += 2;
+                if (!parseHex(&low) || low < 0xdc00 || low > 0xdfff) {
+                    return false;
+                }
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+            } else if (code >= 0xdc00 && code <= 0xdfff) {
+                return false;
+            }
+            if (code < 0x80) {
+                scratch.append(static_cast<char>(code));
+            } else if (code < 0x800) {
+                scratch.append(static_cast<char>(0xc0 | (code >> 6)));
+                scratch.append(static_cast<char>(0x80 | (code & 0x3f)));
+            } else if (code < 0x10000) {
+                scratch.append(static_cast<char>(0xe0 | (code >> 12)));
+                scratch.append(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+                scratch.append(static_cast<char>(0x80 | (code & 0x3f)));
+            } else {
+                scratch.append(static_cast<char>(0xf0 | (code >> 18)));
+                scratch.append(static_cast<char>(0x80 | ((code >> 12) & 0x3f)));
+                scratch.append(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+                scratch.append(static_cast<char>(0x80 | (code & 0x3f)));
+            }
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return MsgPackStream::isValidUtf8(scratch.constData(), scratch.size())
+            && stream.writeUtf8(scratch.constData(), scratch.size());
+}
+
+
+// the numbers without fraction and exponent are integers, unless they overflow.
+bool JsonToMsgPack::parseNumber()
+{
+    const char *start = p;
+    bool isFloat = false;
+    if (p < end && *p == '-') {
+        ++p;
+    }
+    if (p >= end || *p < '0' || *p > '9') {
+        return false;
+    }
+    if (*p == '0') {
+        ++p;
+    } else {
+        while (p < end && *p >= '0' && *p <= '9') {
+            ++p;
+        }
+    }
+    if (p < end && *p == '.') {
+        isFloat = true;
+        ++p;
+        if (p >= end || *p < '0' || *p > '9') {
+            return false;
+        }
+        while (p < end && *p >= '0' && *p <= '9') {
+            ++p;
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        isFloat = true;
+        ++p;
+        if (p < end && (*p == '+' || *p == '-')) {
+            ++p;
+        }
+        if (p >= end || *p < '0' || *p > '9') {
+            return false;
+        }
+        while (p < end && *p >= '0' && *p <= '9') {
+            ++p;
+        }
+    }
+    const QByteArray &text = QByteArray::fromRawData(start, static_cast<int>(p - start));
+    bool ok;
+    if (!isFloat) {
+        const qint64 i64 = text.toLongLong(&ok);
+        if (ok) {
+            stream << i64;
+            return true;
+        }
+        const quint64 u64 = text.toULongLong(&ok);
+        if (ok) {
+            stream << u64;
+            return true;
+        }
+    }
+    const double d = text.toDouble(&ok);
+    stream << d;
+    return true;
+}
+
+
+// walks the msgpack values by their headers, and writes the json text at once.
+class MsgPackToJson
+{
+public:
+    MsgPackToJson(const char *data, qint64 size, QByteArray *out)
+        :data(data), size(size), pos(0), out(out) {}
+    bool parse() { return writeValue(0, false) && pos == size; }
+private:
+    bool writeValue(int depth, bool asKey);
+    void writeString(const char *s, quint32 len);
+public:
+    enum { MaxDepth = 512 };
+    const char *data;
+    qint64 size;
+    qint64 pos;
+    QByteArray *out;
+};
+
+
+void MsgPackToJson::writeString(const char *s, quint32 len)
+{
+    static const char hex[] = "0123456789abcdef";
+    out->append('"');
+    const char *run = s;
+    const char *end = s + len;
+    for (const char *c = s; c < end; ++c) {
+        const quint8 b = static_cast<quint8>(*c);
+        if (b >= 0x20 && b != '"' && b != '\\') {
+            continue;
+        }
+        out->append(run, static_cast<int>(c - run));
+        run = c + 1;
+        switch (b) {
+        case '"': out->append("\\\"", 2); break;
+        case '\\': out->append("\\\\", 2); break;
+        case '\n': out->append("\\n", 2); break;
+        case '\r': out->append("\\r", 2); break;
+        case '\t': out->append("\\t", 2); break;
+        case '\b': out->append("\\b", 2); break;
+        case '\f': out->append("\\f", 2); break;
+        default: {
+            const char escaped[] = { '\\', 'u', '0', '0', hex[b >> 4], hex[b & 0xf] };
+            out->append(escaped, 6);
+            break;
+        }
+        }
+    }
+    out->append(run, static_cast<int>(end - run));
+    out->append('"');
+}
+
+
+// the keys of map are strings in json, so the other scalar keys are quoted. the binary and extensions are
+// written as base64 strings.
+bool MsgPackToJson::writeValue(int depth, bool asKey)
+{
+    MsgPackView::Type type;
+    int headerSize;
+    quint32 length;
+    if (depth > MaxDepth || !parseMsgPackHeader(data, size, pos, &type, &headerSize, &length)) {
+        return false;
+    }
+    quint8 *p = static_cast<quint8*>(static_cast<void*>(const_cast<char*>(data + pos)));
+    pos += headerSize;
+    switch (type) {
+    case MsgPackView::Nil:
+        if (asKey) {
+            return false;
+        }
+        out->append("null", 4);
+        return true;
+    case MsgPackView::Boolean: {
+        const QByteArray text = p[0] == FirstByte::MTRUE ? QByteArray("true", 4) : QByteArray("false", 5);
+        if (asKey) {
+            writeString(text.constData(), static_cast<quint32>(text.size()));
+        } else {
+            out->append(text);
+        }
+        return true;
+    }
+    case MsgPackView::Integer:
+    case MsgPackView::Float: {
+        QByteArray text;
+        if (type == MsgPackView::Integer) {
+            qint64 i64 = 0;
+            quint64 u64 = 0;
+            text = loadMsgPackInteger(p, &i64, &u64) ? QByteArray::number(u64) : QByteArray::number(i64);
+        } else {
+            double d;
+            if (p[0] == FirstByte::FLOAT32) {
+                const quint32 u32 = _msgpack_load32(p + 1);
+                float f;
+                memcpy(&f, &u32, sizeof(f));
+                d = static_cast<double>(f);
+            } else {
+                const quint64 u64 = _msgpack_load64(p + 1);
+                memcpy(&d, &u64, sizeof(d));
+            }
+            text = qIsFinite(d) ? QByteArray::number(d, 'g', 17) : QByteArray("null", 4);
+        }
+        pos += length;
+        if (asKey) {
+            writeString(text.constData(), static_cast<quint32>(text.size()));
+        } else {
+            out->append(text);
+        }
+        return true;
+    }
+    case MsgPackView::String:
+        if (!MsgPackStream::isValidUtf8(data + pos, length)) {
+            return false;
+        }
+        writeString(data + pos, length);
+        pos += length;
+        return true;
+    case MsgPackView::Binary:
+    case MsgPackView::Extension: {
+        const QByteArray &base64 = QByteArray::fromRawData(data + pos, static_cast<int>(length)).toBase64();
+        out->append('"');
+        out->append(base64);
+        out->append('"');
+        pos += length;
+        return true;
+    }
+    case MsgPackView::Array:
+        if (asKey || length > size - pos) {
+            return false;
+        }
+        out->append('[');
+        for (quint32 i = 0; i < length; ++i) {
+            if (i > 0) {
+                out->append(',');
+            }
+            if (!writeValue(depth + 1, false)) {
+                return false;
+            }
+        }
+        out->append(']');
+        return true;
+    case MsgPackView::Map:
+        if (asKey || 2 * static_cast<qint64>(length) > size - pos) {
+            return false;
+        }
+        out->append('{');
+        for (quint32 i = 0; i < length; ++i) {
+            if (i > 0) {
+                out->append(',');
+            }
+            if (!writeValue(depth + 1, true)) {
+                return false;
+            }
+            out->append(':');
+            if (!writeValue(depth + 1, false)) {
+                return false;
+            }
+        }
+        out->append('}');
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+QByteArray jsonToMsgPack(const char *json, qint64 size)
+{
+    QByteArray msgpack;
+    // msgpack is smaller than json mostly.
+    msgpack.reserve(static_cast<int>(qMin<qint64>(size, std::numeric_limits<int>::max())));
+    JsonToMsgPack transcoder(json, size, &msgpack);
+    if (!transcoder.parse()) {
+        return QByteArray();
+    }
+    return msgpack;
+}
+
+
+QByteArray msgPackToJson(const char *msgpack, qint64 size)
+{
+    QByteArray json;
+    json.reserve(static_cast<int>(qMin<qint64>(size * 2, std::numeric_limits<int>::max())));
+    MsgPackToJson transcoder(msgpack, size, &json);
+    if (!transcoder.parse()) {
+        return QByteArray();
+    }
+    return json;
+}
+
+
+class MsgPackDecoderPrivate
+{
+public:
+    MsgPackDecoderPrivate()
+        :scanned(0), payloadLeft(0), maxSize(1024 * 1024 * 16), maxDepth(64), broken(false) {}
+    bool scan();
+    void finishValue();
+public:
+    QByteArray buffer;          // starts with the incomplete message.
+    QList<QByteArray> messages;
+    QVector<qint64> stack;      // the values left in every open array and map.
+    qint32 scanned;
+    qint64 payloadLeft;         // of the string, binary or extension being scanned.
+    quint32 maxSize;
+    int maxDepth;
+    bool broken;
+};
+
+
+void MsgPackDecoderPrivate::finishValue()
+{
+    while (true) {
+        if (stack.isEmpty()) {
+            messages.append(buffer.left(scanned));
+            buffer.remove(0, scanned);
+            scanned = 0;
+            return;
+        }
+        if (--stack.last() > 0) {
+            return;
+        }
+        stack.removeLast();
+    }
+}
+
+
+bool MsgPackDecoderPrivate::scan()
+{
+    while (true) {
+        if (payloadLeft > 0) {
+            const qint64 bytes = qMin<qint64>(payloadLeft, buffer.size() - scanned);
+            scanned += static_cast<qint32>(bytes);
+            payloadLeft -= bytes;
+            if (payloadLeft > 0) {
+                break;
+            }
+            finishValue();
+            continue;
+        }
+        if (scanned >= buffer.size()) {
+            break;
+        }
+        quint8 *p = static_cast<quint8*>(static_cast<void*>(buffer.data() + scanned));
+        MsgPackView::Type type;
+        int lengthSize;
+        quint32 length;
+        if (!classifyMsgPackByte(p[0], &type, &lengthSize, &length)) {
+            return false;
+        }
+        const int headerSize = 1 + lengthSize + (type == MsgPackView::Extension ? 1 : 0);
+        if (buffer.size() - scanned < headerSize) {
+            break;
+        }
+        if (lengthSize == 1) {
+            length = _msgpack_load8(p + 1);
+        } else if (lengthSize == 2) {
+            length = _msgpack_load16(p + 1);
+        } else if (lengthSize == 4) {
+            length = _msgpack_load32(p + 1);
+        }
+        scanned += headerSize;
+        if (type == MsgPackView::Array || type == MsgPackView::Map) {
+            if (length == 0) {
+                finishValue();
+                continue;
+            }
+            if (stack.size() >= maxDepth) {
+                return false;
+            }
+            // every value takes one byte at least, so the count is checked like the size.
+            const qint64 values = type == MsgPackView::Map ? 2 * static_cast<qint64>(length) : length;
+            if (values > maxSize) {
+                return false;
+            }
+            stack.append(values);
+        } else {
+            if (static_cast<qint64>(scanned) + length > maxSize) {
+                return false;
+            }
+            payloadLeft = length;
+            if (payloadLeft == 0) {
+                finishValue();
+            }
+        }
+        if (static_cast<quint32>(scanned) > maxSize) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+MsgPackDecoder::MsgPackDecoder()
+    :d_ptr(new MsgPackDecoderPrivate())
+{
+}
+
+
+MsgPackDecoder::~MsgPackDecoder()
+{
+    delete d_ptr;
+}
+
+
+void MsgPackDecoder::setMaxDepth(int depth)
+{
+    Q_D(MsgPackDecoder);
+    d->maxDepth = qMax(depth, 1);
+}
+
+
+int MsgPackDecoder::maxDepth() const
+{
+    Q_D(const MsgPackDecoder);
+    return d->maxDepth;
+}
+
+
+void MsgPackDecoder::setMaxSize(quint32 bytes)
+{
+    Q_D(MsgPackDecoder);
+    d->maxSize = qMin<quint32>(qMax<quint32>(bytes, 1), std::numeric_limits<int>::max());
+}
+
+
+quint32 MsgPackDecoder::maxSize() const
+{
+    Q_D(const MsgPackDecoder);
+    return d->maxSize;
+}
+
+
+bool MsgPackDecoder::feed(const QByteArray &data)
+{
+    Q_D(MsgPackDecoder);
+    if (d->broken || data.isEmpty()) {
+        return false;
+    }
+    if (d->buffer.isEmpty()) {
+        d->buffer = data;  // shared, the messages of one chunk are not copied twice.
+    } else {
+        d->buffer.append(data);
+    }
+    if (!d->scan()) {
+        d->broken = true;
+        return false;
+    }
+    return true;
+}
+
+
+bool MsgPackDecoder::feed(const char *data, qint32 size)
+{
+    if (size <= 0) {
+        return false;
+    }
+    return feed(QByteArray(data, size));
+}
+
+
+bool MsgPackDecoder::hasMessage() const
+{
+    Q_D(const MsgPackDecoder);
+    return !d->messages.isEmpty();
+}
+
+
+QByteArray MsgPackDecoder::takeMessage()
+{
+    Q_D(MsgPackDecoder);
+    if (d->messages.isEmpty()) {
+        return QByteArray();
+    }
+    return d->messages.takeFirst();
+}
+
+
+QVariant MsgPackDecoder::takeVariant()
+{
+    const QByteArray &message = takeMessage();
+    if (message.isEmpty()) {
+        return QVariant();
+    }
+    QVariant v;
+    MsgPackStream stream(message);
+    stream >> v;
+    return v;
+}
+
+
+bool MsgPackDecoder::isBroken() const
+{
+    Q_D(const MsgPackDecoder);
+    return d->broken;
+}
+
+
+qint32 MsgPackDecoder::pendingBytes() const
+{
+    Q_D(const MsgPackDecoder);
+    return d->buffer.size();
+}
+
+
+void MsgPackDecoder::reset()
+{
+    Q_D(MsgPackDecoder);
+    d->buffer.clear();
+    d->messages.clear();
+    d->stack.clear();
+    d->scanned = 0;
+    d->payloadLeft = 0;
+    d->broken = false;
+}
+
+
 QTNETWORKNG_NAMESPACE_END
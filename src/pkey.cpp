@@ -1,5 +1,8 @@
 #include <QtCore/qdebug.h>
 #include <QtCore/qfile.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qcache.h>
+#include <openssl/err.h>
 #include <openssl/pem.h>
 #include "../include/pkey.h"
 #include "../include/private/crypto_p.h"
@@ -821,13 +824,42 @@ bool PrivateKey::operator ==(const PrivateKey &other) const
     return comparePublicKey(d, other.d_ptr);
 }
 
+// the keys without password are cached by the loaded bytes, so reloading the configurations does not parse them
+// again. the encrypted keys are not cached, or the cache would keep the passwords.
+struct ParsedPrivateKeys
+{
+    ParsedPrivateKeys()
+        :keys(1024) {}
+    QMutex lock;
+    QCache<QPair<QByteArray, int>, PrivateKey> keys;
+};
+
+
+Q_GLOBAL_STATIC(ParsedPrivateKeys, parsedPrivateKeys)
+
+
 PrivateKey PrivateKey::load(const QByteArray &data, Ssl::EncodingFormat format, const QByteArray &password)
 {
     PrivateKeyReader reader;
     if(!password.isEmpty()) {
         reader.setPassword(password);
+        return reader.setFormat(format).read(data);
+    }
+    ParsedPrivateKeys *cache = parsedPrivateKeys();
+    const QPair<QByteArray, int> key(data, static_cast<int>(format));
+    if (cache) {
+        QMutexLocker locker(&cache->lock);
+        PrivateKey *cached = cache->keys.object(key);
+        if (cached) {
+            return *cached;
+        }
     }
-    return reader.setFormat(format).read(data);
+    const PrivateKey &pkey = reader.setFormat(format).read(data);
+    if (cache && pkey.isValid()) {
+        QMutexLocker locker(&cache->lock);
+        cache->keys.insert(key, new PrivateKey(pkey));
+    }
+    return pkey;
 }
 
 
@@ -1025,4 +1057,204 @@ PublicKey PrivateKeyReader::readPublic(const QString &filePath)
     return d->readPublic(filePath);
 }
 
+// the digest context is initialized again for every message, and the key context is used as it is.
+struct SignatureContext
+{
+    SignatureContext(const PublicKey &key, MessageDigest::Algorithm hashAlgo, bool signing);
+    ~SignatureContext();
+    bool digest(unsigned char *md, unsigned int *mdlen);
+
+    PublicKey key;
+    const EVP_MD *md;
+    EVP_MD_CTX *mdContext;
+    EVP_PKEY_CTX *pkeyContext;
+    bool hasError;
+};
+
+
+SignatureContext::SignatureContext(const PublicKey &key, MessageDigest::Algorithm hashAlgo, bool signing)
+    :key(key), md(nullptr), mdContext(nullptr), pkeyContext(nullptr), hasError(true)
+{
+    initOpenSSL();
+    EVP_PKEY *pkey = static_cast<EVP_PKEY*>(key.handle());
+    md = getOpenSSL_MD(hashAlgo);
+    if (!pkey || !md) {
+        return;
+    }
+    mdContext = EVP_MD_CTX_new();
+    pkeyContext = EVP_PKEY_CTX_new(pkey, nullptr);
+    if (!mdContext || !pkeyContext || !EVP_DigestInit_ex(mdContext, md, nullptr)) {
+        return;
+    }
+    if ((signing ? EVP_PKEY_sign_init(pkeyContext) : EVP_PKEY_verify_init(pkeyContext)) <= 0
+            || EVP_PKEY_CTX_set_signature_md(pkeyContext, md) <= 0) {
+        return;
+    }
+    hasError = false;
+}
+
+
+SignatureContext::~SignatureContext()
+{
+    if (mdContext) {
+        EVP_MD_CTX_free(mdContext);
+    }
+    if (pkeyContext) {
+        EVP_PKEY_CTX_free(pkeyContext);
+    }
+}
+
+
+bool SignatureContext::digest(unsigned char *out, unsigned int *len)
+{
+    const bool ok = EVP_DigestFinal_ex(mdContext, out, len) && EVP_DigestInit_ex(mdContext, md, nullptr);
+    hasError = !ok;
+    return ok;
+}
+
+
+class SignerPrivate: public SignatureContext
+{
+public:
+    SignerPrivate(const PrivateKey &key, MessageDigest::Algorithm hashAlgo)
+        :SignatureContext(key, hashAlgo, true) {}
+};
+
+
+Signer::Signer(const PrivateKey &key, MessageDigest::Algorithm hashAlgo)
+    :d_ptr(new SignerPrivate(key, hashAlgo))
+{
+}
+
+
+Signer::~Signer()
+{
+    delete d_ptr;
+}
+
+
+bool Signer::isValid() const
+{
+    Q_D(const Signer);
+    return !d->hasError;
+}
+
+
+void Signer::update(const char *data, int len)
+{
+    Q_D(Signer);
+    if (!d->hasError && len > 0) {
+        d->hasError = !EVP_DigestUpdate(d->mdContext, data, static_cast<size_t>(len));
+    }
+}
+
+
+int Signer::signatureSize() const
+{
+    Q_D(const Signer);
+    return d->hasError ? -1 : EVP_PKEY_size(static_cast<EVP_PKEY*>(d->key.handle()));
+}
+
+
+int Signer::sign(char *out)
+{
+    Q_D(Signer);
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen;
+    if (d->hasError || !d->digest(md, &mdlen)) {
+        return -1;
+    }
+    size_t siglen = static_cast<size_t>(EVP_PKEY_size(static_cast<EVP_PKEY*>(d->key.handle())));
+    if (EVP_PKEY_sign(d->pkeyContext, reinterpret_cast<unsigned char*>(out), &siglen, md, mdlen) <= 0) {
+        return -1;
+    }
+    return static_cast<int>(siglen);
+}
+
+
+QByteArray Signer::sign()
+{
+    const int size = signatureSize();
+    if (size <= 0) {
+        return QByteArray();
+    }
+    QByteArray result(size, Qt::Uninitialized);
+    const int len = sign(result.data());
+    if (len < 0) {
+        return QByteArray();
+    }
+    result.resize(len);
+    return result;
+}
+
+
+class VerifierPrivate: public SignatureContext
+{
+public:
+    VerifierPrivate(const PublicKey &key, MessageDigest::Algorithm hashAlgo)
+        :SignatureContext(key, hashAlgo, false) {}
+};
+
+
+Verifier::Verifier(const PublicKey &key, MessageDigest::Algorithm hashAlgo)
+    :d_ptr(new VerifierPrivate(key, hashAlgo))
+{
+}
+
+
+Verifier::~Verifier()
+{
+    delete d_ptr;
+}
+
+
+bool Verifier::isValid() const
+{
+    Q_D(const Verifier);
+    return !d->hasError;
+}
+
+
+void Verifier::update(const char *data, int len)
+{
+    Q_D(Verifier);
+    if (!d->hasError && len > 0) {
+        d->hasError = !EVP_DigestUpdate(d->mdContext, data, static_cast<size_t>(len));
+    }
+}
+
+
+bool Verifier::verify(const char *signature, int len)
+{
+    Q_D(Verifier);
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen;
+    if (d->hasError || len < 0 || !d->digest(md, &mdlen)) {
+        return false;
+    }
+    // a bad signature leaves errors in the queue, but does not break the context.
+    const int rvalue = EVP_PKEY_verify(d->pkeyContext, reinterpret_cast<const unsigned char*>(signature),
+                                       static_cast<size_t>(len), md, mdlen);
+    if (rvalue != 1) {
+        ERR_clear_error();
+        return false;
+    }
+    return true;
+}
+
+
+QList<bool> Verifier::verifyMany(const QList<QByteArray> &data, const QList<QByteArray> &signatures)
+{
+    QList<bool> results;
+    if (data.size() != signatures.size()) {
+        return results;
+    }
+    results.reserve(data.size());
+    for (int i = 0; i < data.size(); ++i) {
+        update(data.at(i));
+        results.append(verify(signatures.at(i)));
+    }
+    return results;
+}
+
 QTNETWORKNG_NAMESPACE_END
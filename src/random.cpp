@@ -4,6 +4,8 @@
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
+// RAND_bytes() of libressl is arc4random_buf(), a chacha20 generator buffered in process, reseeded from the os and
+// rekeyed after fork(). so these functions only avoid the allocations.
 QByteArray randomBytes(int i)
 {
     initOpenSSL();
@@ -13,4 +15,42 @@ QByteArray randomBytes(int i)
     return b;
 }
 
+
+bool randomBytes(char *buf, int len)
+{
+    initOpenSSL();
+    return len >= 0 && RAND_bytes(reinterpret_cast<unsigned char*>(buf), len) == 1;
+}
+
+
+quint32 randomUInt32()
+{
+    quint32 r = 0;
+    randomBytes(reinterpret_cast<char*>(&r), sizeof(r));
+    return r;
+}
+
+
+quint64 randomUInt64()
+{
+    quint64 r = 0;
+    randomBytes(reinterpret_cast<char*>(&r), sizeof(r));
+    return r;
+}
+
+
+quint32 randomBounded(quint32 upperBound)
+{
+    if (upperBound < 2) {
+        return 0;
+    }
+    // 2**32 % upperBound, the values below it are skipped so every result has the same chance.
+    const quint32 min = (0u - upperBound) % upperBound;
+    quint32 r;
+    do {
+        r = randomUInt32();
+    } while (r < min);
+    return r % upperBound;
+}
+
 QTNETWORKNG_NAMESPACE_END
@@ -0,0 +1,466 @@
+#include <QtCore/qhash.h>
+#include <QtCore/qset.h>
+#include "../include/rpc.h"
+#include "../include/msgpack.h"
+#include "../include/locks.h"
+#include "../include/coroutine_utils.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+// every frame is one packet of data channel: the type, the id of call, and the fields of type.
+const quint8 REQUEST_FRAME = 1;     // method, arguments.
+const quint8 RESPONSE_FRAME = 2;    // result.
+const quint8 ERROR_FRAME = 3;       // error string.
+const quint8 ITEM_FRAME = 4;        // item of streaming response.
+const quint8 CANCEL_FRAME = 5;
+
+
+// waits in the stack of calling coroutine, so a call allocates nothing but the frame.
+struct RpcPendingCall
+{
+    RpcPendingCall()
+        :finished(false) {}
+    Event done;
+    QList<QByteArray> items;
+    QByteArray result;
+    QString error;
+    bool finished;
+};
+
+
+struct RpcRequest
+{
+    RpcRequest()
+        :id(0) {}
+    RpcRequest(quint32 id, const QString &method, const QByteArray &arguments)
+        :method(method), arguments(arguments), id(id) {}
+    QString method;
+    QByteArray arguments;
+    quint32 id;
+};
+
+
+struct RpcRunningCall
+{
+    RpcCall *call;
+    CancelScope *scope;
+};
+
+
+class RpcPeerPrivate
+{
+public:
+    RpcPeerPrivate(QSharedPointer<DataChannel> channel, RpcPeer *parent);
+    ~RpcPeerPrivate();
+public:
+    QByteArray call(const QString &method, const QByteArray &arguments, const std::function<void(const QByteArray &)> &onItem,
+                    float timeout, QString *error);
+    bool sendFrame(quint8 type, quint32 id, const QByteArray &payload);
+    bool sendErrorFrame(quint32 id, const QString &error);
+    // does not block, it is sent while the calling coroutine is killed.
+    void sendCancelFrame(quint32 id);
+    void close();
+    void doReceive();
+    void doWork();
+    void handleFrame(const QByteArray &packet);
+    void handleRequest(const RpcRequest &request);
+public:
+    QSharedPointer<DataChannel> channel;
+    QHash<QString, RpcHandler> handlers;
+    QHash<quint32, RpcPendingCall*> pendings;
+    QHash<quint32, RpcRunningCall> runnings;
+    QSet<quint32> queued;       // the requests not cancelled and not taken by workers.
+    Queue<RpcRequest> requests;
+    CoroutineGroup *operations;
+    quint32 nextId;
+    quint32 maxConcurrency;
+    quint32 workers;
+    bool broken;
+
+    Q_DECLARE_PUBLIC(RpcPeer)
+    RpcPeer * const q_ptr;
+};
+
+
+RpcPeerPrivate::RpcPeerPrivate(QSharedPointer<DataChannel> channel, RpcPeer *parent)
+    :channel(channel), operations(new CoroutineGroup()), nextId(1), maxConcurrency(64), workers(0),
+      broken(false), q_ptr(parent)
+{
+    operations->spawnWithName(QStringLiteral("receiving"), [this] {
+        doReceive();
+    });
+}
+
+
+RpcPeerPrivate::~RpcPeerPrivate()
+{
+    close();
+    delete operations;
+}
+
+
+QByteArray RpcPeerPrivate::call(const QString &method, const QByteArray &arguments,
+                                const std::function<void(const QByteArray &)> &onItem, float timeout, QString *error)
+{
+    if (broken) {
+        if (error) {
+            *error = QStringLiteral("the peer is gone.");
+        }
+        return QByteArray();
+    }
+    const quint32 id = nextId++;
+    if (nextId == 0) {
+        nextId = 1;
+    }
+    QByteArray frame;
+    frame.reserve(method.size() * 3 + arguments.size() + 21);
+    {
+        MsgPackStream stream(&frame, QIODevice::WriteOnly);
+        stream << REQUEST_FRAME << id << method << arguments;
+    }
+    RpcPendingCall pending;
+    pendings.insert(id, &pending);
+    try {
+        CancelScope scope(timeout);
+        if (!channel->sendPacket(frame)) {
+            pending.finished = true;
+            pending.error = QStringLiteral("can not send the request.");
+        }
+        while (true) {
+            pending.done.clear();
+            while (!pending.items.isEmpty()) {
+                const QByteArray &item = pending.items.takeFirst();
+                if (onItem) {
+                    onItem(item);
+                }
+            }
+            if (pending.finished) {
+                break;
+            }
+            pending.done.wait();
+        }
+    } catch (TimeoutException &) {
+        pendings.remove(id);
+        sendCancelFrame(id);
+        if (timeout <= 0.0f) {
+            throw;  // raised by the outer scopes.
+        }
+        if (error) {
+            *error = QStringLiteral("timeout.");
+        }
+        return QByteArray();
+    } catch (...) {
+        pendings.remove(id);
+        sendCancelFrame(id);
+        throw;
+    }
+    pendings.remove(id);
+    if (!pending.error.isNull()) {
+        if (error) {
+            *error = pending.error;
+        }
+        return QByteArray();
+    }
+    return pending.result;
+}
+
+
+bool RpcPeerPrivate::sendFrame(quint8 type, quint32 id, const QByteArray &payload)
+{
+    QByteArray frame;
+    frame.reserve(payload.size() + 16);  // the type, id and header of payload take 16 bytes at most.
+    {
+        MsgPackStream stream(&frame, QIODevice::WriteOnly);
+        stream << type << id << payload;
+    }
+    return channel->sendPacket(frame);
+}
+
+
+bool RpcPeerPrivate::sendErrorFrame(quint32 id, const QString &error)
+{
+    QByteArray frame;
+    {
+        MsgPackStream stream(&frame, QIODevice::WriteOnly);
+        stream << ERROR_FRAME << id << error;
+    }
+    return channel->sendPacket(frame);
+}
+
+
+void RpcPeerPrivate::sendCancelFrame(quint32 id)
+{
+    if (broken) {
+        return;
+    }
+    QByteArray frame;
+    {
+        MsgPackStream stream(&frame, QIODevice::WriteOnly);
+        stream << CANCEL_FRAME << id;
+    }
+    channel->sendPacketAsync(frame);
+}
+
+
+void RpcPeerPrivate::close()
+{
+    if (broken) {
+        return;
+    }
+    broken = true;
+    channel->close();
+    for (RpcPendingCall *pending: pendings) {
+        pending->finished = true;
+        pending->error = QStringLiteral("the peer is gone.");
+        pending->done.set();
+    }
+    pendings.clear();
+    for (const RpcRunningCall &running: runnings) {
+        running.call->cancelled = true;
+        running.scope->cancel();
+    }
+    queued.clear();
+    // the idle workers exit by the null requests.
+    for (quint32 i = requests.getting(); i > 0; --i) {
+        requests.putForcedly(RpcRequest());
+    }
+}
+
+
+void RpcPeerPrivate::doReceive()
+{
+    while (true) {
+        const QByteArray &packet = channel->recvPacket();
+        if (packet.isEmpty()) {
+            return close();
+        }
+        handleFrame(packet);
+    }
+}
+
+
+void RpcPeerPrivate::handleFrame(const QByteArray &packet)
+{
+    MsgPackStream stream(packet);
+    quint8 type;
+    quint32 id;
+    stream >> type >> id;
+    if (stream.status() != MsgPackStream::Ok) {
+        qWarning() << "invalid rpc frame.";
+        return;
+    }
+    if (type == REQUEST_FRAME) {
+        QString method;
+        QByteArray arguments;
+        stream >> method >> arguments;
+        if (stream.status() != MsgPackStream::Ok) {
+            qWarning() << "invalid rpc request.";
+            return;
+        }
+        queued.insert(id);
+        requests.putForcedly(RpcRequest(id, method, arguments));
+        // the workers are spawned only if the idle ones can not take all requests.
+        if (requests.size() > requests.getting() && workers < maxConcurrency) {
+            ++workers;
+            operations->spawn([this] {
+                doWork();
+            });
+        }
+    } else if (type == CANCEL_FRAME) {
+        if (!queued.remove(id) && runnings.contains(id)) {
+            const RpcRunningCall &running = runnings.value(id);
+            running.call->cancelled = true;
+            running.scope->cancel();
+        }
+    } else {
+        RpcPendingCall *pending = pendings.value(id);
+        if (!pending) {
+            return;  // cancelled or timed out.
+        }
+        if (type == RESPONSE_FRAME) {
+            stream >> pending->result;
+            pending->finished = true;
+        } else if (type == ERROR_FRAME) {
+            stream >> pending->error;
+            if (pending->error.isNull()) {
+                pending->error = QStringLiteral("");
+            }
+            pending->finished = true;
+        } else if (type == ITEM_FRAME) {
+            QByteArray item;
+            stream >> item;
+            pending->items.append(item);
+        } else {
+            qWarning() << "unknown rpc frame.";
+            return;
+        }
+        if (stream.status() != MsgPackStream::Ok) {
+            pending->finished = true;
+            pending->error = QStringLiteral("invalid response.");
+        }
+        pending->done.set();
+    }
+}
+
+
+void RpcPeerPrivate::doWork()
+{
+    while (!broken) {
+        const RpcRequest &request = requests.get();
+        if (request.id == 0) {
+            break;
+        }
+        if (!queued.remove(request.id)) {
+            continue;  // cancelled before handled.
+        }
+        handleRequest(request);
+    }
+    --workers;
+}
+
+
+void RpcPeerPrivate::handleRequest(const RpcRequest &request)
+{
+    const RpcHandler &handler = handlers.value(request.method);
+    if (!handler) {
+        sendErrorFrame(request.id, QStringLiteral("method %1 is not found.").arg(request.method));
+        return;
+    }
+    RpcCall call(this, request.id, request.method, request.arguments);
+    QByteArray result;
+    {
+        CancelScope scope(0.0f);
+        runnings.insert(request.id, RpcRunningCall { &call, &scope });
+        try {
+            result = handler(call);
+        } catch (TimeoutException &) {
+            if (!call.cancelled) {
+                call.setError(QStringLiteral("timeout."));
+            }
+        } catch (CoroutineExitException &) {
+            runnings.remove(request.id);
+            throw;
+        } catch (...) {
+            call.setError(QStringLiteral("the handler raised an exception."));
+        }
+        runnings.remove(request.id);
+    }
+    if (call.cancelled || broken) {
+        return;
+    }
+    if (!call._error.isNull()) {
+        sendErrorFrame(request.id, call._error);
+        return;
+    }
+    if (result.isEmpty()) {
+        MsgPackStream stream(&result, QIODevice::WriteOnly);
+        stream << QVariant();
+    }
+    sendFrame(RESPONSE_FRAME, request.id, result);
+}
+
+
+bool RpcCall::sendItem(const QByteArray &item)
+{
+    if (cancelled || peer->broken) {
+        return false;
+    }
+    return peer->sendFrame(ITEM_FRAME, id, item);
+}
+
+
+bool RpcCall::isCancelled() const
+{
+    return cancelled;
+}
+
+
+RpcPeer::RpcPeer(QSharedPointer<DataChannel> channel)
+    :d_ptr(new RpcPeerPrivate(channel, this))
+{
+}
+
+
+RpcPeer::~RpcPeer()
+{
+    delete d_ptr;
+}
+
+
+void RpcPeer::registerMethod(const QString &method, const RpcHandler &handler)
+{
+    Q_D(RpcPeer);
+    d->handlers.insert(method, handler);
+}
+
+
+void RpcPeer::setMaxConcurrency(quint32 handlers)
+{
+    Q_D(RpcPeer);
+    d->maxConcurrency = qMax<quint32>(handlers, 1);
+}
+
+
+quint32 RpcPeer::maxConcurrency() const
+{
+    Q_D(const RpcPeer);
+    return d->maxConcurrency;
+}
+
+
+QByteArray RpcPeer::call(const QString &method, const QByteArray &arguments, float timeout, QString *error)
+{
+    Q_D(RpcPeer);
+    return d->call(method, arguments, std::function<void(const QByteArray &)>(), timeout, error);
+}
+
+
+QByteArray RpcPeer::call(const QString &method, const QByteArray &arguments, const std::function<void(const QByteArray &)> &onItem,
+                         float timeout, QString *error)
+{
+    Q_D(RpcPeer);
+    return d->call(method, arguments, onItem, timeout, error);
+}
+
+
+QVariant RpcPeer::callVariant(const QString &method, const QVariantList &arguments, float timeout, QString *error)
+{
+    Q_D(RpcPeer);
+    QByteArray encoded;
+    {
+        MsgPackStream stream(&encoded, QIODevice::WriteOnly);
+        stream << QVariant(arguments);
+    }
+    const QByteArray &result = d->call(method, encoded, std::function<void(const QByteArray &)>(), timeout, error);
+    if (result.isNull()) {
+        return QVariant();
+    }
+    QVariant decoded;
+    MsgPackStream stream(result);
+    stream >> decoded;
+    return decoded;
+}
+
+
+QSharedPointer<DataChannel> RpcPeer::channel() const
+{
+    Q_D(const RpcPeer);
+    return d->channel;
+}
+
+
+bool RpcPeer::isBroken() const
+{
+    Q_D(const RpcPeer);
+    return d->broken || d->channel->isBroken();
+}
+
+
+void RpcPeer::close()
+{
+    Q_D(RpcPeer);
+    d->close();
+}
+
+
+QTNETWORKNG_NAMESPACE_END
@@ -0,0 +1,385 @@
+#include <QtCore/qglobal.h>
+#ifdef Q_OS_UNIX
+#include <atomic>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <QtCore/qfile.h>
+#include "../include/data_channel.h"
+#include "../include/private/eventloop_p.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+const quint32 SHARED_MEMORY_MAGIC = 0x51544e47;
+// the bytes of one direction, must be a power of two.
+const quint32 SHARED_RING_SIZE = 1024 * 1024;
+
+
+// a single-producer single-consumer ring. the positions are never wrapped, only the offsets into data are.
+struct SharedRing
+{
+    alignas(64) std::atomic<quint32> head;      // written by reader.
+    alignas(64) std::atomic<quint32> tail;      // written by writer.
+    alignas(64) std::atomic<quint32> readerWaiting;
+    std::atomic<quint32> writerWaiting;
+    char data[SHARED_RING_SIZE];
+};
+
+
+struct SharedSegment
+{
+    quint32 magic;
+    std::atomic<quint32> closed;
+    SharedRing rings[2];    // the first one is sent by positive pole.
+};
+
+
+// the ring doorbells are fifos, so the waiting coroutine sleeps in the eventloop like sockets. the waiting flags
+// are set before the last check, so the doorbells are rung only if the peer sleeps.
+class SharedMemorySocketLike: public SocketLike
+{
+public:
+    SharedMemorySocketLike(const QString &path, DataChannelPole pole);
+    virtual ~SharedMemorySocketLike() override;
+public:
+    virtual Socket::SocketError error() const override { return _error; }
+    virtual QString errorString() const override { return _errorString; }
+    virtual bool isValid() const override;
+    virtual QHostAddress localAddress() const override { return QHostAddress(QHostAddress::LocalHost); }
+    virtual quint16 localPort() const override { return 0; }
+    virtual QHostAddress peerAddress() const override { return QHostAddress(QHostAddress::LocalHost); }
+    virtual QString peerName() const override { return path; }
+    virtual quint16 peerPort() const override { return 0; }
+    virtual qintptr fileno() const override { return -1; }
+    virtual Socket::SocketType type() const override { return Socket::TcpSocket; }
+    virtual Socket::SocketState state() const override;
+    virtual Socket::NetworkLayerProtocol protocol() const override { return Socket::UnknownNetworkLayerProtocol; }
+
+    virtual Socket *acceptRaw() override { return nullptr; }
+    virtual QSharedPointer<SocketLike> accept() override { return QSharedPointer<SocketLike>(); }
+    virtual bool bind(QHostAddress &, quint16, Socket::BindMode) override { return false; }
+    virtual bool bind(quint16, Socket::BindMode) override { return false; }
+    virtual bool connect(const QHostAddress &, quint16) override { return false; }
+    virtual bool connect(const QString &, quint16, Socket::NetworkLayerProtocol) override { return false; }
+    virtual bool close() override;
+    virtual bool listen(int) override { return false; }
+    virtual bool setOption(Socket::SocketOption, const QVariant &) override { return true; }
+    virtual QVariant option(Socket::SocketOption) const override { return QVariant(); }
+
+    virtual qint32 recv(char *data, qint32 size) override;
+    virtual qint32 recvall(char *data, qint32 size) override;
+    virtual qint32 send(const char *data, qint32 size) override;
+    virtual qint32 sendall(const char *data, qint32 size) override;
+    virtual QByteArray recv(qint32 size) override;
+    virtual QByteArray recvall(qint32 size) override;
+    virtual qint32 send(const QByteArray &data) override { return send(data.constData(), data.size()); }
+    virtual qint32 sendall(const QByteArray &data) override { return sendall(data.constData(), data.size()); }
+private:
+    static int openFifo(const QString &path, bool create);
+    void setError(const QString &errorString);
+    void ring(int fd);
+    void waitDoorbell(int fd);
+    bool isClosed() const { return !segment || segment->closed.load() != 0; }
+private:
+    QString path;
+    QString _errorString;
+    Socket::SocketError _error;
+    SharedSegment *segment;
+    SharedRing *in;
+    SharedRing *out;
+    int dataDoorbell;       // rung by peer after it writes.
+    int spaceDoorbell;      // rung by peer after it reads.
+    int peerDataDoorbell;
+    int peerSpaceDoorbell;
+    bool owner;
+};
+
+
+int SharedMemorySocketLike::openFifo(const QString &path, bool create)
+{
+    const QByteArray &name = QFile::encodeName(path);
+    if (create) {
+        ::unlink(name.constData());
+        if (::mkfifo(name.constData(), 0600) < 0) {
+            return -1;
+        }
+    }
+    // opened for reading and writing, so neither side blocks or fails before the peer opens it.
+    return ::open(name.constData(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+}
+
+
+SharedMemorySocketLike::SharedMemorySocketLike(const QString &path, DataChannelPole pole)
+    :path(path), _error(Socket::NoError), segment(nullptr), in(nullptr), out(nullptr), dataDoorbell(-1),
+      spaceDoorbell(-1), peerDataDoorbell(-1), peerSpaceDoorbell(-1), owner(pole == PositivePole)
+{
+    const QByteArray &name = QFile::encodeName(path);
+    int fd;
+    if (owner) {
+        fd = ::open(name.constData(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd >= 0 && ::ftruncate(fd, sizeof(SharedSegment)) < 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    } else {
+        fd = ::open(name.constData(), O_RDWR | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        setError(QStringLiteral("can not open the shared memory segment."));
+        return;
+    }
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && st.st_size == static_cast<off_t>(sizeof(SharedSegment))) {
+        p = ::mmap(nullptr, sizeof(SharedSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        setError(QStringLiteral("can not map the shared memory segment."));
+        return;
+    }
+    segment = static_cast<SharedSegment *>(p);
+    const QString &positive = path + QStringLiteral(".positive");
+    const QString &negative = path + QStringLiteral(".negative");
+    if (owner) {
+        // the file is filled by zero, which is the initial state of atomics.
+        dataDoorbell = openFifo(positive + QStringLiteral("-data"), true);
+        spaceDoorbell = openFifo(positive + QStringLiteral("-space"), true);
+        peerDataDoorbell = openFifo(negative + QStringLiteral("-data"), true);
+        peerSpaceDoorbell = openFifo(negative + QStringLiteral("-space"), true);
+        segment->magic = SHARED_MEMORY_MAGIC;
+        in = &segment->rings[1];
+        out = &segment->rings[0];
+    } else {
+        if (segment->magic != SHARED_MEMORY_MAGIC) {
+            setError(QStringLiteral("the shared memory segment is not ready."));
+            return;
+        }
+        dataDoorbell = openFifo(negative + QStringLiteral("-data"), false);
+        spaceDoorbell = openFifo(negative + QStringLiteral("-space"), false);
+        peerDataDoorbell = openFifo(positive + QStringLiteral("-data"), false);
+        peerSpaceDoorbell = openFifo(positive + QStringLiteral("-space"), false);
+        in = &segment->rings[0];
+        out = &segment->rings[1];
+    }
+    if (dataDoorbell < 0 || spaceDoorbell < 0 || peerDataDoorbell < 0 || peerSpaceDoorbell < 0) {
+        setError(QStringLiteral("can not open the doorbells of shared memory."));
+    }
+}
+
+
+SharedMemorySocketLike::~SharedMemorySocketLike()
+{
+    close();
+    for (int fd: { dataDoorbell, spaceDoorbell, peerDataDoorbell, peerSpaceDoorbell }) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    if (segment) {
+        ::munmap(segment, sizeof(SharedSegment));
+    }
+    if (owner) {
+        for (const QString &suffix: { QStringLiteral(""), QStringLiteral(".positive-data"), QStringLiteral(".positive-space"),
+                                      QStringLiteral(".negative-data"), QStringLiteral(".negative-space") }) {
+            ::unlink(QFile::encodeName(path + suffix).constData());
+        }
+    }
+}
+
+
+void SharedMemorySocketLike::setError(const QString &errorString)
+{
+    _error = Socket::SocketAccessError;
+    _errorString = errorString;
+}
+
+
+bool SharedMemorySocketLike::isValid() const
+{
+    return _error == Socket::NoError && !isClosed();
+}
+
+
+Socket::SocketState SharedMemorySocketLike::state() const
+{
+    return isValid() ? Socket::ConnectedState : Socket::UnconnectedState;
+}
+
+
+bool SharedMemorySocketLike::close()
+{
+    if (!segment || segment->closed.exchange(1) != 0) {
+        return true;
+    }
+    // wakes up the peer waiting for anything.
+    ring(peerDataDoorbell);
+    ring(peerSpaceDoorbell);
+    ring(dataDoorbell);
+    ring(spaceDoorbell);
+    return true;
+}
+
+
+void SharedMemorySocketLike::ring(int fd)
+{
+    if (fd < 0) {
+        return;
+    }
+    const char c = 0;
+    ssize_t r;
+    do {
+        r = ::write(fd, &c, 1);
+    } while (r < 0 && errno == EINTR);
+    // EAGAIN means the fifo is full of rings not handled yet.
+}
+
+
+void SharedMemorySocketLike::waitDoorbell(int fd)
+{
+    ScopedIoWatcher watcher(EventLoopCoroutine::Read, fd);
+    watcher.start();
+    char buf[64];
+    while (::read(fd, buf, sizeof(buf)) > 0) {}
+}
+
+
+qint32 SharedMemorySocketLike::recv(char *data, qint32 size)
+{
+    if (_error != Socket::NoError || size <= 0) {
+        return -1;
+    }
+    while (true) {
+        const quint32 head = in->head.load(std::memory_order_relaxed);
+        const quint32 tail = in->tail.load(std::memory_order_acquire);
+        if (tail != head) {
+            const quint32 n = qMin(static_cast<quint32>(size), tail - head);
+            const quint32 offset = head & (SHARED_RING_SIZE - 1);
+            const quint32 first = qMin(n, SHARED_RING_SIZE - offset);
+            memcpy(data, in->data + offset, first);
+            memcpy(data + first, in->data, n - first);
+            in->head.store(head + n, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (in->writerWaiting.load()) {
+                ring(peerSpaceDoorbell);
+            }
+            return static_cast<qint32>(n);
+        }
+        if (isClosed()) {
+            return 0;
+        }
+        in->readerWaiting.store(1);
+        if (in->tail.load() == head && !isClosed()) {
+            waitDoorbell(dataDoorbell);
+        }
+        in->readerWaiting.store(0);
+    }
+}
+
+
+qint32 SharedMemorySocketLike::send(const char *data, qint32 size)
+{
+    if (_error != Socket::NoError || isClosed()) {
+        return -1;
+    }
+    if (size <= 0) {
+        return 0;
+    }
+    while (true) {
+        const quint32 tail = out->tail.load(std::memory_order_relaxed);
+        const quint32 head = out->head.load(std::memory_order_acquire);
+        const quint32 space = SHARED_RING_SIZE - (tail - head);
+        if (space > 0) {
+            const quint32 n = qMin(static_cast<quint32>(size), space);
+            const quint32 offset = tail & (SHARED_RING_SIZE - 1);
+            const quint32 first = qMin(n, SHARED_RING_SIZE - offset);
+            memcpy(out->data + offset, data, first);
+            memcpy(out->data, data + first, n - first);
+            out->tail.store(tail + n, std::memory_order_release);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (out->readerWaiting.load()) {
+                ring(peerDataDoorbell);
+            }
+            return static_cast<qint32>(n);
+        }
+        out->writerWaiting.store(1);
+        if (out->head.load() == head && !isClosed()) {
+            waitDoorbell(spaceDoorbell);
+        }
+        out->writerWaiting.store(0);
+        if (isClosed()) {
+            return -1;
+        }
+    }
+}
+
+
+qint32 SharedMemorySocketLike::recvall(char *data, qint32 size)
+{
+    qint32 total = 0;
+    while (total < size) {
+        qint32 received = recv(data + total, size - total);
+        if (received <= 0) {
+            return total == 0 ? received : total;
+        }
+        total += received;
+    }
+    return total;
+}
+
+
+qint32 SharedMemorySocketLike::sendall(const char *data, qint32 size)
+{
+    qint32 total = 0;
+    while (total < size) {
+        qint32 sent = send(data + total, size - total);
+        if (sent <= 0) {
+            return total == 0 ? sent : total;
+        }
+        total += sent;
+    }
+    return total;
+}
+
+
+QByteArray SharedMemorySocketLike::recv(qint32 size)
+{
+    QByteArray buf(size, Qt::Uninitialized);
+    qint32 received = recv(buf.data(), size);
+    if (received <= 0) {
+        return QByteArray();
+    }
+    buf.resize(received);
+    return buf;
+}
+
+
+QByteArray SharedMemorySocketLike::recvall(qint32 size)
+{
+    QByteArray buf(size, Qt::Uninitialized);
+    qint32 received = recvall(buf.data(), size);
+    if (received <= 0) {
+        return QByteArray();
+    }
+    buf.resize(received);
+    return buf;
+}
+
+
+static QSharedPointer<SocketLike> openSharedMemory(const QString &path, DataChannelPole pole)
+{
+    return QSharedPointer<SocketLike>(new SharedMemorySocketLike(path, pole));
+}
+
+
+SharedMemoryChannel::SharedMemoryChannel(const QString &path, DataChannelPole pole)
+    :SocketChannel(openSharedMemory(path, pole), pole)
+{
+}
+
+
+QTNETWORKNG_NAMESPACE_END
+
+#endif // Q_OS_UNIX
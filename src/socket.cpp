@@ -1,23 +1,255 @@
 #include <QtCore/qthread.h>
 #include <QtCore/qcoreapplication.h>
 #include <QtCore/qmap.h>
+#include <QtCore/qhash.h>
 #include <QtCore/qcache.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qvector.h>
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qendian.h>
+#include <limits.h>
 #include "../include/private/socket_p.h"
+#include "../include/private/dns_p.h"
+#include "../include/private/eventloop_p.h"
 #include "../include/coroutine_utils.h"
+#include "../include/socket_utils.h"
+#include "../include/metrics.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
+#ifndef QTNG_NO_SOCKET_IO_STATS
+static QAtomicInt ioStatsEnabled(0);
+
+// the totals are updated with every count, so the exporter does not need to find the sockets.
+struct TotalIoStats
+{
+    QAtomicInteger<quint64> bytesSent;
+    QAtomicInteger<quint64> bytesReceived;
+    QAtomicInteger<quint64> sendCalls;
+    QAtomicInteger<quint64> recvCalls;
+    QAtomicInteger<quint64> readWaits;
+    QAtomicInteger<quint64> writeWaits;
+    QAtomicInteger<qint64> readWaitNsecs;
+    QAtomicInteger<qint64> writeWaitNsecs;
+    QAtomicInteger<quint64> connects;
+    QAtomicInteger<qint64> connectNsecs;
+    QAtomicInteger<quint64> handshakes;
+    QAtomicInteger<qint64> handshakeNsecs;
+};
+Q_GLOBAL_STATIC(TotalIoStats, totalIo)
+#endif
+
+
+static SocketIoStats *newIoStats()
+{
+#ifndef QTNG_NO_SOCKET_IO_STATS
+    if (ioStatsEnabled.loadAcquire()) {
+        return new SocketIoStats();
+    }
+#endif
+    return nullptr;
+}
+
+
+Endpoint::Endpoint(const QHostAddress &addr, quint16 port)
+    :port(port)
+{
+    if (addr.protocol() == QAbstractSocket::IPv4Protocol) {
+        memset(address, 0, 10);
+        address[10] = address[11] = 0xff;
+        qToBigEndian<quint32>(addr.toIPv4Address(), address + 12);
+        family = IPv4;
+    } else if (addr.protocol() == QAbstractSocket::IPv6Protocol) {
+        const Q_IPV6ADDR ipv6 = addr.toIPv6Address();
+        memcpy(address, ipv6.c, sizeof(address));
+        family = IPv6;
+    } else {
+        memset(address, 0, sizeof(address));
+        family = Null;
+    }
+}
+
+
+Endpoint Endpoint::fromIPv4(quint32 ipv4, quint16 port)
+{
+    Endpoint endpoint;
+    endpoint.address[10] = endpoint.address[11] = 0xff;
+    qToBigEndian<quint32>(ipv4, endpoint.address + 12);
+    endpoint.port = port;
+    endpoint.family = IPv4;
+    return endpoint;
+}
+
+
+quint32 Endpoint::toIPv4Address() const
+{
+    return qFromBigEndian<quint32>(address + 12);
+}
+
+
+QHostAddress Endpoint::hostAddress() const
+{
+    if (family == IPv4) {
+        return QHostAddress(toIPv4Address());
+    } else if (family == IPv6) {
+        return QHostAddress(address);
+    } else {
+        return QHostAddress();
+    }
+}
+
+
+QString Endpoint::toString() const
+{
+    if (family == IPv6) {
+        return QStringLiteral("[%1]:%2").arg(hostAddress().toString()).arg(port);
+    }
+    return QStringLiteral("%1:%2").arg(hostAddress().toString()).arg(port);
+}
+
+
+uint qHash(const Endpoint &endpoint, uint seed)
+{
+    quint64 a, b;
+    memcpy(&a, endpoint.address, 8);
+    memcpy(&b, endpoint.address + 8, 8);
+    quint64 h = (a * 0x9e3779b97f4a7c15ULL) ^ (b + endpoint.port) ^ seed;
+    // the finalizer of splitmix64.
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return static_cast<uint>(h ^ (h >> 31));
+}
+
+
+SocketIoStats &SocketIoStats::operator+=(const SocketIoStats &other)
+{
+    bytesSent += other.bytesSent;
+    bytesReceived += other.bytesReceived;
+    sendCalls += other.sendCalls;
+    recvCalls += other.recvCalls;
+    readWaits += other.readWaits;
+    writeWaits += other.writeWaits;
+    readWaitNsecs += other.readWaitNsecs;
+    writeWaitNsecs += other.writeWaitNsecs;
+    connects += other.connects;
+    connectNsecs += other.connectNsecs;
+    handshakes += other.handshakes;
+    handshakeNsecs += other.handshakeNsecs;
+    return *this;
+}
+
+
+void SocketPrivate::addIo(bool sending, qint64 result)
+{
+#ifndef QTNG_NO_SOCKET_IO_STATS
+    const quint64 bytes = result > 0 ? static_cast<quint64>(result) : 0;
+    TotalIoStats *total = totalIo();
+    if (sending) {
+        ++ioStats->sendCalls;
+        ioStats->bytesSent += bytes;
+        total->sendCalls.fetchAndAddRelaxed(1);
+        total->bytesSent.fetchAndAddRelaxed(bytes);
+    } else {
+        ++ioStats->recvCalls;
+        ioStats->bytesReceived += bytes;
+        total->recvCalls.fetchAndAddRelaxed(1);
+        total->bytesReceived.fetchAndAddRelaxed(bytes);
+    }
+#else
+    Q_UNUSED(sending);
+    Q_UNUSED(result);
+#endif
+}
+
+
+bool SocketPrivate::countConnect(bool ok, const QElapsedTimer &timer)
+{
+#ifndef QTNG_NO_SOCKET_IO_STATS
+    if (ok && ioStats) {
+        const qint64 nsecs = timer.nsecsElapsed();
+        ioStats->connects = 1;
+        ioStats->connectNsecs = nsecs;
+        totalIo()->connects.fetchAndAddRelaxed(1);
+        totalIo()->connectNsecs.fetchAndAddRelaxed(nsecs);
+    }
+#else
+    Q_UNUSED(timer);
+#endif
+    return ok;
+}
+
+
+void SocketPrivate::waitWatcher(ScopedIoWatcher &watcher)
+{
+#ifndef QTNG_NO_SOCKET_IO_STATS
+    if (ioStats) {
+        QElapsedTimer timer;
+        timer.start();
+        watcher.start();
+        const qint64 nsecs = timer.nsecsElapsed();
+        TotalIoStats *total = totalIo();
+        if (watcher.eventType() == EventLoopCoroutine::Read) {
+            ++ioStats->readWaits;
+            ioStats->readWaitNsecs += nsecs;
+            total->readWaits.fetchAndAddRelaxed(1);
+            total->readWaitNsecs.fetchAndAddRelaxed(nsecs);
+        } else {
+            ++ioStats->writeWaits;
+            ioStats->writeWaitNsecs += nsecs;
+            total->writeWaits.fetchAndAddRelaxed(1);
+            total->writeWaitNsecs.fetchAndAddRelaxed(nsecs);
+        }
+        return;
+    }
+#endif
+    watcher.start();
+}
+
+
+void countSslHandshake(qint64 nsecs)
+{
+#ifndef QTNG_NO_SOCKET_IO_STATS
+    totalIo()->handshakes.fetchAndAddRelaxed(1);
+    totalIo()->handshakeNsecs.fetchAndAddRelaxed(nsecs);
+#else
+    Q_UNUSED(nsecs);
+#endif
+}
+
+
+// the sockets made in the thread of a low-latency eventloop busy poll, see EventLoopCoroutine::setLowLatencyMode().
+static void setBusyPollOf(SocketPrivate *d, Socket::NetworkLayerProtocol protocol)
+{
+    QSharedPointer<EventLoopCoroutine> eventLoop = currentLoop()->get();
+    if (eventLoop.isNull()) {
+        return;
+    }
+    const quint32 usecs = eventLoop->busyPollUsecs();
+    if (usecs > 0 && protocol != Socket::UnixProtocol) {
+        d->setOption(Socket::BusyPollOption, usecs);
+        d->setOption(Socket::PreferBusyPollOption, 1);
+    }
+}
+
+
 SocketPrivate::SocketPrivate(Socket::NetworkLayerProtocol protocol,
         Socket::SocketType type, Socket *parent)
     :q_ptr(parent), protocol(protocol), type(type), error(Socket::NoError),
-      state(Socket::UnconnectedState), readGate(new Gate), writeGate(new Gate)
+      state(Socket::UnconnectedState), readGate(new Gate), writeGate(new Gate), ioStats(newIoStats()), localAddressPending(false)
 {
 #ifdef Q_OS_WIN
     initWinSock();
+#endif
+#ifdef Q_OS_LINUX
+    splicePipe[0] = splicePipe[1] = -1;
+    splicePending = 0;
+    zeroCopyThreshold = 0;
+    zeroCopyNext = 0;
+    zeroCopyReaper = 0;
 #endif
     if(!createSocket())
         return;
-    if(type == Socket::UdpSocket) {
+    if(type == Socket::UdpSocket && protocol != Socket::UnixProtocol) {
         if(!setOption(Socket::BroadcastSocketOption, 1)) {
 //            setError(Socket::UnsupportedSocketOperationError);
 //            close();
@@ -26,14 +258,22 @@ SocketPrivate::SocketPrivate(Socket::NetworkLayerProtocol protocol,
         setOption(Socket::ReceivePacketInformation, 1);
         setOption(Socket::ReceiveHopLimit, 1);
     }
+    setBusyPollOf(this, protocol);
 }
 
 
 SocketPrivate::SocketPrivate(qintptr socketDescriptor, Socket *parent)
-    :q_ptr(parent), error(Socket::NoError), readGate(new Gate), writeGate(new Gate)
+    :q_ptr(parent), error(Socket::NoError), readGate(new Gate), writeGate(new Gate), ioStats(newIoStats()), localAddressPending(false)
 {
 #ifdef Q_OS_WIN
     initWinSock();
+#endif
+#ifdef Q_OS_LINUX
+    splicePipe[0] = splicePipe[1] = -1;
+    splicePending = 0;
+    zeroCopyThreshold = 0;
+    zeroCopyNext = 0;
+    zeroCopyReaper = 0;
 #endif
     fd = static_cast<int>(socketDescriptor);
     setNonblocking();
@@ -50,6 +290,26 @@ SocketPrivate::SocketPrivate(qintptr socketDescriptor, Socket *parent)
 }
 
 
+SocketPrivate::SocketPrivate(qintptr acceptedDescriptor, Socket::NetworkLayerProtocol protocol, Socket *parent)
+    :q_ptr(parent), protocol(protocol), type(Socket::TcpSocket), error(Socket::NoError),
+      state(Socket::ConnectedState), localPort(0), peerPort(0), readGate(new Gate), writeGate(new Gate),
+      ioStats(newIoStats()), localAddressPending(true)
+{
+#ifdef Q_OS_WIN
+    initWinSock();
+#endif
+#ifdef Q_OS_LINUX
+    splicePipe[0] = splicePipe[1] = -1;
+    splicePending = 0;
+    zeroCopyThreshold = 0;
+    zeroCopyNext = 0;
+    zeroCopyReaper = 0;
+#endif
+    fd = static_cast<int>(acceptedDescriptor);
+    setBusyPollOf(this, protocol);
+}
+
+
 SocketPrivate::~SocketPrivate()
 {
     close();
@@ -89,19 +349,29 @@ bool SocketPrivate::connect(const QString &hostName, quint16 port, Socket::Netwo
         setError(Socket::HostNotFoundError, QStringLiteral("Host not found."));
         return false;
     }
-    bool done = true;
     state = oldState;
+    QList<QHostAddress> candidates;
     for (int i = 0; i < addresses.size(); ++i) {
-        QHostAddress addr = addresses.at(i);
+        const QHostAddress &addr = addresses.at(i);
         if(protocol == Socket::IPv4Protocol && addr.protocol() != QAbstractSocket::IPv4Protocol) {
             continue;
         }
         if(protocol == Socket::IPv6Protocol && addr.protocol() != QAbstractSocket::IPv6Protocol) {
             continue;
         }
-        done = connect(addr, port);
-        if(done)
+        candidates.append(addr);
+    }
+    // a bound socket can not be replaced by another one, and an udp connect() never blocks.
+    if (candidates.size() == 1 || state == Socket::BoundState || type != Socket::TcpSocket) {
+        for (const QHostAddress &addr: candidates) {
+            if (connect(addr, port)) {
+                return true;
+            }
+        }
+    } else if (!candidates.isEmpty()) {
+        if (happyEyeballsConnect(candidates, port)) {
             return true;
+        }
     }
     if (error == Socket::NoError) {
         setError(Socket::HostNotFoundError, QStringLiteral("Host not found."));
@@ -111,6 +381,127 @@ bool SocketPrivate::connect(const QString &hostName, quint16 port, Socket::Netwo
 }
 
 
+// rfc 8305 recommends 250ms between two connection attempts.
+const quint32 ConnectionAttemptDelay = 250;   // msecs.
+
+
+static QList<QHostAddress> interleaveAddressFamilies(const QList<QHostAddress> &addresses)
+{
+    QList<QHostAddress> preferred, others;
+    const QAbstractSocket::NetworkLayerProtocol preferredProtocol = addresses.first().protocol();
+    for (const QHostAddress &addr: addresses) {
+        if (addr.protocol() == preferredProtocol) {
+            preferred.append(addr);
+        } else {
+            others.append(addr);
+        }
+    }
+    QList<QHostAddress> result;
+    for (int i = 0; i < preferred.size() || i < others.size(); ++i) {
+        if (i < preferred.size()) {
+            result.append(preferred.at(i));
+        }
+        if (i < others.size()) {
+            result.append(others.at(i));
+        }
+    }
+    return result;
+}
+
+
+// race the addresses as rfc 8305 (happy eyeballs) describes. the first attempt uses this socket, and
+// every later one starts with a new socket after ConnectionAttemptDelay, or at once if an attempt fails.
+// if a later attempt wins, its descriptor replaces ours, the options set before connect() are lost then.
+bool SocketPrivate::happyEyeballsConnect(const QList<QHostAddress> &addresses, quint16 port)
+{
+    const QList<QHostAddress> &candidates = interleaveAddressFamilies(addresses);
+    const int total = candidates.size();
+    QVector<QSharedPointer<Socket>> sockets(total);
+    int winner = -1;
+    int failed = 0;
+    Socket::SocketError lastError = Socket::NoError;
+    QString lastErrorString;
+    Event changed;
+
+    CoroutineGroup operations;
+    for (int i = 0; i < total && winner < 0; ++i) {
+        const QHostAddress &addr = candidates.at(i);
+        if (i > 0) {
+            Socket::NetworkLayerProtocol family = addr.protocol() == QAbstractSocket::IPv6Protocol
+                    ? Socket::IPv6Protocol : Socket::IPv4Protocol;
+            sockets[i].reset(new Socket(family, Socket::TcpSocket));
+        }
+        Socket *s = sockets[i].data();
+        operations.spawn([this, s, addr, port, i, &winner, &failed, &lastError, &lastErrorString, &changed] {
+            bool ok = s ? s->connect(addr, port) : connect(addr, port);
+            if (ok) {
+                if (winner < 0) {
+                    winner = i;
+                }
+            } else {
+                ++failed;
+                lastError = s ? s->error() : error;
+                lastErrorString = s ? s->errorString() : errorString;
+            }
+            changed.set();
+        });
+        if (i == total - 1) {
+            break;
+        }
+        // the delay wakes us by its own flag, not a Timeout, so the Timeout and CancelScope of caller are not
+        // swallowed while staggering.
+        const int failedBefore = failed;
+        bool delayed = false;
+        EventLoopCoroutine *eventLoop = EventLoopCoroutine::get();
+        const qint64 delayId = eventLoop->callLater(ConnectionAttemptDelay, makeFunctor([&delayed, &changed] {
+            delayed = true;
+            changed.set();
+        }));
+        try {
+            while (winner < 0 && failed == failedBefore && !delayed) {
+                changed.clear();
+                changed.wait();
+            }
+        } catch (...) {
+            eventLoop->cancelCall(delayId);
+            throw;
+        }
+        eventLoop->cancelCall(delayId);
+    }
+    while (winner < 0 && failed < total) {
+        changed.clear();
+        changed.wait();
+    }
+    operations.killall();
+
+    if (winner < 0) {
+        setError(lastError, lastErrorString);
+        return false;
+    }
+    if (winner > 0) {
+        takeDescriptor(sockets[winner]->dd_ptr);
+    }
+    return true;
+}
+
+
+void SocketPrivate::takeDescriptor(SocketPrivate *other)
+{
+    close();
+    fd = other->fd;
+    other->fd = -1;
+    protocol = other->protocol;
+    state = other->state;
+    error = Socket::NoError;
+    errorString.clear();
+    localAddress = other->localAddress;
+    localPort = other->localPort;
+    peerAddress = other->peerAddress;
+    peerPort = other->peerPort;
+    other->state = Socket::UnconnectedState;
+}
+
+
 void SocketPrivate::setError(Socket::SocketError error, const QString &errorString)
 {
     this->error = error;
@@ -223,6 +614,31 @@ QString SocketPrivate::getErrorString() const
 }
 
 
+// used if the platform or the file (pipe, /proc, ...) does not support sendfile().
+qint64 SocketPrivate::sendfileByCopy(QFile *file, qint64 offset, qint64 length)
+{
+    if (!file->seek(offset)) {
+        return -1;
+    }
+    QByteArray buf(1024 * 64, Qt::Uninitialized);
+    qint64 sent = 0;
+    while (sent < length) {
+        qint64 bs = file->read(buf.data(), qMin<qint64>(buf.size(), length - sent));
+        if (bs <= 0) {
+            break;
+        }
+        qint32 w = send(buf.constData(), static_cast<qint32>(bs), true);
+        if (w > 0) {
+            sent += w;
+        }
+        if (w < bs) {
+            break;
+        }
+    }
+    return sent > 0 ? sent : -1;
+}
+
+
 Socket::Socket(NetworkLayerProtocol protocol, SocketType type)
     :dd_ptr(new SocketPrivate(protocol, type, this))
 {
@@ -236,12 +652,31 @@ Socket::Socket(qintptr socketDescriptor)
 }
 
 
+Socket::Socket(qintptr acceptedDescriptor, NetworkLayerProtocol protocol)
+    :dd_ptr(new SocketPrivate(acceptedDescriptor, protocol, this))
+{
+}
+
+
 Socket::~Socket()
 {
     delete dd_ptr;
 }
 
 
+Socket *Socket::detach()
+{
+    Q_D(Socket);
+    Socket *socket = new Socket(static_cast<qintptr>(-1), d->protocol);
+    socket->dd_ptr->takeDescriptor(d);
+    socket->dd_ptr->type = d->type;
+    socket->dd_ptr->localAddressPending = d->localAddressPending;
+    socket->dd_ptr->localPath = d->localPath;
+    socket->dd_ptr->peerPath = d->peerPath;
+    return socket;
+}
+
+
 Socket::SocketError Socket::error() const
 {
     Q_D(const Socket);
@@ -266,6 +701,7 @@ bool Socket::isValid() const
 QHostAddress Socket::localAddress() const
 {
     Q_D(const Socket);
+    d->fetchLocalAddressIfNeeded();
     return d->localAddress;
 }
 
@@ -273,6 +709,7 @@ QHostAddress Socket::localAddress() const
 quint16 Socket::localPort() const
 {
     Q_D(const Socket);
+    d->fetchLocalAddressIfNeeded();
     return d->localPort;
 }
 
@@ -321,6 +758,7 @@ Socket::SocketState Socket::state() const
 Socket::NetworkLayerProtocol Socket::protocol() const
 {
     Q_D(const Socket);
+    d->fetchLocalAddressIfNeeded();
     return d->protocol;
 }
 
@@ -364,6 +802,17 @@ Socket *Socket::accept()
 }
 
 
+QList<Socket*> Socket::acceptmany(int maxCount)
+{
+    Q_D(Socket);
+    ScopedGate gate(d->readGate);
+    if (!gate.isSuccess()) {
+        return QList<Socket*>();
+    }
+    return d->acceptmany(maxCount);
+}
+
+
 bool Socket::bind(const QHostAddress &address, quint16 port, Socket::BindMode mode)
 {
     Q_D(Socket);
@@ -385,7 +834,11 @@ bool Socket::connect(const QHostAddress &host, quint16 port)
     if (!gate.isSuccess()) {
         return -1;
     }
-    return d->connect(host, port);
+    QElapsedTimer timer;
+    if (d->ioStats) {
+        timer.start();
+    }
+    return d->countConnect(d->connect(host, port), timer);
 }
 
 
@@ -396,7 +849,26 @@ bool Socket::connect(const QString &hostName, quint16 port, Socket::NetworkLayer
     if (!gate.isSuccess()) {
         return -1;
     }
-    return d->connect(hostName, port, protocol);
+    QElapsedTimer timer;
+    if (d->ioStats) {
+        timer.start();
+    }
+    return d->countConnect(d->connect(hostName, port, protocol), timer);
+}
+
+
+bool Socket::connect(const QHostAddress &host, quint16 port, const QByteArray &initialData)
+{
+    Q_D(Socket);
+    ScopedGate gate(d->writeGate);
+    if (!gate.isSuccess()) {
+        return false;
+    }
+    QElapsedTimer timer;
+    if (d->ioStats) {
+        timer.start();
+    }
+    return d->countConnect(d->connect(host, port, initialData), timer);
 }
 
 
@@ -407,6 +879,13 @@ bool Socket::close()
 }
 
 
+bool Socket::shutdownWrite()
+{
+    Q_D(Socket);
+    return d->shutdownWrite();
+}
+
+
 bool Socket::listen(int backlog)
 {
     Q_D(Socket);
@@ -428,14 +907,70 @@ QVariant Socket::option(Socket::SocketOption option) const
 }
 
 
+bool Socket::bindPath(const QString &path)
+{
+    Q_D(Socket);
+    return d->bindPath(path);
+}
+
+
+bool Socket::connectPath(const QString &path)
+{
+    Q_D(Socket);
+    ScopedGate gate(d->writeGate);
+    if (!gate.isSuccess()) {
+        return false;
+    }
+    return d->connectPath(path);
+}
+
+
+QString Socket::localPath() const
+{
+    Q_D(const Socket);
+    d->fetchLocalAddressIfNeeded();
+    return d->localPath;
+}
+
+
+QString Socket::peerPath() const
+{
+    Q_D(const Socket);
+    return d->peerPath;
+}
+
+
+qint32 Socket::sendDescriptors(const char *data, qint32 size, const QList<qintptr> &fds)
+{
+    Q_D(Socket);
+    ScopedGate gate(d->writeGate);
+    if (!gate.isSuccess()) {
+        return -1;
+    }
+    return d->sendDescriptors(data, size, fds);
+}
+
+
+qint32 Socket::recvDescriptors(char *data, qint32 size, QList<qintptr> *fds)
+{
+    Q_D(Socket);
+    ScopedGate gate(d->readGate);
+    if (!gate.isSuccess()) {
+        return -1;
+    }
+    return d->recvDescriptors(data, size, fds);
+}
+
+
 qint32 Socket::recv(char *data, qint32 size)
 {
     Q_D(Socket);
+    CancelScope::check();
     ScopedGate gate(d->readGate);
     if (!gate.isSuccess()) {
         return -1;
     }
-    return d->recv(data, size, false);
+    return d->countReceived(d->recv(data, size, false));
 }
 
 
@@ -446,7 +981,7 @@ qint32 Socket::recvall(char *data, qint32 size)
     if (!gate.isSuccess()) {
         return -1;
     }
-    return d->recv(data, size, true);
+    return d->countReceived(d->recv(data, size, true));
 }
 
 
@@ -457,7 +992,7 @@ qint32 Socket::send(const char *data, qint32 size)
     if (!gate.isSuccess()) {
         return -1;
     }
-    qint32 bytesSent = d->send(data, size, false);
+    qint32 bytesSent = d->countSent(d->send(data, size, false));
     if(bytesSent == 0 && !d->isValid()) {
         return -1;
     } else {
@@ -473,7 +1008,7 @@ qint32 Socket::sendall(const char *data, qint32 size)
     if (!gate.isSuccess()) {
         return -1;
     }
-    return d->send(data, size, true);
+    return d->countSent(d->send(data, size, true));
 }
 
 
@@ -484,7 +1019,7 @@ qint32 Socket::recvfrom(char *data, qint32 size, QHostAddress *addr, quint16 *po
     if (!gate.isSuccess()) {
         return -1;
     }
-    return d->recvfrom(data, size, addr, port);
+    return d->countReceived(d->recvfrom(data, size, addr, port));
 }
 
 
@@ -495,7 +1030,180 @@ qint32 Socket::sendto(const char *data, qint32 size, const QHostAddress &addr, q
     if (!gate.isSuccess()) {
         return -1;
     }
-    return d->sendto(data, size, addr, port);
+    return d->countSent(d->sendto(data, size, addr, port));
+}
+
+
+qint32 Socket::recvfrom(char *data, qint32 size, Endpoint *endpoint)
+{
+    Q_D(Socket);
+    ScopedGate gate(d->readGate);
+    if (!gate.isSuccess()) {
+        return -1;
+    }
+    return d->countReceived(d->recvfrom(data, size, endpoint));
+}
+
+
+qint32 Socket::sendto(const char *data, qint32 size, const Endpoint &endpoint)
+{
+    Q_D(Socket);
+    ScopedGate gate(d->writeGate);
+    if (!gate.isSuccess()) {
+        return -1;
+    }
+    return d->countSent(d->sendto(data, size, endpoint));
+}
+
+
+qint32 Socket::recvmany(SocketDatagram *datagrams, qint32 count)
+{
+    Q_D(Socket);
+    ScopedGate gate(d->readGate);
+    if (!gate.isSuccess()) {
+        return -1;
+    }
+    const qint32 received = d->recvmany(datagrams, count);
+    if (d->ioStats) {
+        qint64 bytes = 0;
+        for (qint32 i = 0; i < received; ++i) {
+            bytes += datagrams[i].length;
+        }
+        d->addIo(false, bytes);
+    }
+    return received;
+}
+
+
+qint32 Socket::sendmany(SocketDatagram *datagrams, qint32 count)
+{
+    Q_D(Socket);
+    ScopedGate gate(d->writeGate);
+    if (!gate.isSuccess()) {
+        return -1;
+    }
+    const qint32 sent = d->sendmany(datagrams, count);
+    if (d->ioStats) {
+        qint64 bytes = 0;
+        for (qint32 i = 0; i < sent; ++i) {
+            bytes += datagrams[i].length;
+        }
+        d->addIo(true, bytes);
+    }
+    return sent;
+}
+
+
+qint32 Socket::sendv(const QList<QByteArray> &buffers)
+{
+    Q_D(Socket);
+    ScopedGate gate(d->writeGate);
+    if (!gate.isSuccess()) {
+        return -1;
+    }
+    qint32 bytesSent = d->countSent(d->sendv(buffers, false));
+    if(bytesSent == 0 && !d->isValid()) {
+        return -1;
+    } else {
+        return bytesSent;
+    }
+}
+
+
+qint32 Socket::sendallv(const QList<QByteArray> &buffers)
+{
+    Q_D(Socket);
+    ScopedGate gate(d->writeGate);
+    if (!gate.isSuccess()) {
+        return -1;
+    }
+    return d->countSent(d->sendv(buffers, true));
+}
+
+
+qint32 Socket::recvv(SocketBuffer *buffers, qint32 count)
+{
+    Q_D(Socket);
+    ScopedGate gate(d->readGate);
+    if (!gate.isSuccess()) {
+        return -1;
+    }
+    return d->countReceived(d->recvv(buffers, count));
+}
+
+
+qint64 Socket::sendfile(QFile *file, qint64 offset, qint64 length)
+{
+    Q_D(Socket);
+    if (!file || !file->isOpen() || offset < 0) {
+        return -1;
+    }
+    if (length < 0) {
+        length = file->size() - offset;
+    }
+    if (length <= 0) {
+        return 0;
+    }
+    ScopedGate gate(d->writeGate);
+    if (!gate.isSuccess()) {
+        return -1;
+    }
+    return d->countSent(d->sendfile(file, offset, length));
+}
+
+
+qint32 Socket::splice(Socket *target, qint32 size, float writeTimeout)
+{
+    Q_D(Socket);
+    if (!target || target == this || size <= 0) {
+        return -1;
+    }
+    ScopedGate gate(d->readGate);
+    if (!gate.isSuccess()) {
+        return -1;
+    }
+    // wait for the data before taking the gate of target, or a quiet source blocks the writers of target.
+    const qint32 received = d->countReceived(d->spliceIn(target->d_func(), size));
+    if (received <= 0) {
+        return received;
+    }
+    QScopedPointer<Timeout> timeout;
+    if (writeTimeout > 0) {
+        timeout.reset(new Timeout(writeTimeout));
+    }
+    ScopedGate targetGate(target->d_func()->writeGate);
+    if (!targetGate.isSuccess()) {
+        return -1;
+    }
+    return target->d_func()->countSent(d->spliceOut(target->d_func()));
+}
+
+
+bool Socket::isSpliceSupported()
+{
+#ifdef Q_OS_LINUX
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+bool Socket::setZeroCopyThreshold(qint32 bytes)
+{
+    Q_D(Socket);
+    return d->setZeroCopyThreshold(bytes);
+}
+
+
+qint32 Socket::zeroCopyThreshold() const
+{
+#ifdef Q_OS_LINUX
+    Q_D(const Socket);
+    return d->zeroCopyThreshold;
+#else
+    return 0;
+#endif
 }
 
 
@@ -507,7 +1215,7 @@ QByteArray Socket::recv(qint32 size)
         return QByteArray();
     }
     QByteArray bs(size, Qt::Uninitialized);
-    qint32 bytes = d->recv(bs.data(), bs.size(), false);
+    qint32 bytes = d->countReceived(d->recv(bs.data(), bs.size(), false));
     if(bytes > 0) {
         bs.resize(static_cast<int>(bytes));
         return bs;
@@ -524,7 +1232,7 @@ QByteArray Socket::recvall(qint32 size)
         return QByteArray();
     }
     QByteArray bs(size, Qt::Uninitialized);
-    qint32 bytes = d->recv(bs.data(), bs.size(), true);
+    qint32 bytes = d->countReceived(d->recv(bs.data(), bs.size(), true));
     if(bytes > 0) {
         bs.resize(static_cast<int>(bytes));
         return bs;
@@ -540,7 +1248,7 @@ qint32 Socket::send(const QByteArray &data)
     if (!gate.isSuccess()) {
         return -1;
     }
-    qint32 bytesSent = d->send(data.data(), data.size(), false);
+    qint32 bytesSent = d->countSent(d->send(data.data(), data.size(), false));
     if(bytesSent == 0 && !d->isValid()) {
         return -1;
     } else {
@@ -556,7 +1264,12 @@ qint32 Socket::sendall(const QByteArray &data)
     if (!gate.isSuccess()) {
         return -1;
     }
-    return d->send(data.data(), data.size(), true);
+#ifdef Q_OS_LINUX
+    if (d->zeroCopyThreshold > 0 && data.size() >= d->zeroCopyThreshold) {
+        return d->countSent(d->sendZeroCopy(data));
+    }
+#endif
+    return d->countSent(d->send(data.data(), data.size(), true));
 }
 
 
@@ -568,7 +1281,7 @@ QByteArray Socket::recvfrom(qint32 size, QHostAddress *addr, quint16 *port)
         return QByteArray();
     }
     QByteArray bs(size, Qt::Uninitialized);
-    qint32 bytes = d->recvfrom(bs.data(), size, addr, port);
+    qint32 bytes = d->countReceived(d->recvfrom(bs.data(), size, addr, port));
     if(bytes > 0) {
         bs.resize(bytes);
         return bs;
@@ -584,25 +1297,28 @@ qint32 Socket::sendto(const QByteArray &data, const QHostAddress &addr, quint16
     if (!gate.isSuccess()) {
         return -1;
     }
-    return d->sendto(data.data(), data.size(), addr, port);
+    return d->countSent(d->sendto(data.data(), data.size(), addr, port));
 }
 
 
-QList<QHostAddress> Socket::resolve(const QString &hostName)
+// ttl is set to UINT_MAX if it is unknown.
+static QList<QHostAddress> resolveWithTtl(const QString &hostName, quint32 *ttl)
 {
-//    static QMap<QString, QList<QHostAddress>> cache;
-//    if(cache.contains(hostName)) {
-//        return cache.value(hostName);
-//    }
-
+    *ttl = UINT_MAX;
     QHostAddress tmp;
     if(tmp.setAddress(hostName)) {
         QList<QHostAddress> result;
         result.append(tmp);
-//        cache.insert(hostName, result);
         return result;
     }
 
+    // query the nameservers of /etc/resolv.conf by udp socket, without starting a thread for every lookup.
+    QList<QHostAddress> addresses;
+    DnsResolver resolver(DnsResolver::systemConfiguration());
+    if (resolver.resolve(hostName, &addresses, ttl)) {
+        return addresses;
+    }
+
     std::function<QHostInfo()> task = [hostName](){
         const QHostInfo &info = QHostInfo::fromName(hostName);
         return info;
@@ -610,9 +1326,14 @@ QList<QHostAddress> Socket::resolve(const QString &hostName)
 
     QHostInfo hostInfo = callInThread<QHostInfo>(task);
     //QHostInfo hostInfo = QHostInfo::fromName(hostName);
-    const QList<QHostAddress> &result = hostInfo.addresses();
-//    cache.insert(hostName, result);
-    return result;
+    return hostInfo.addresses();
+}
+
+
+QList<QHostAddress> Socket::resolve(const QString &hostName)
+{
+    quint32 ttl;
+    return resolveWithTtl(hostName, &ttl);
 }
 
 
@@ -623,104 +1344,255 @@ void Socket::setDnsCache(QSharedPointer<SocketDnsCache> dnsCache)
 }
 
 
+void Socket::setIoStatsEnabled(bool enabled)
+{
+#ifndef QTNG_NO_SOCKET_IO_STATS
+    ioStatsEnabled.storeRelease(enabled ? 1 : 0);
+#else
+    Q_UNUSED(enabled);
+#endif
+}
+
+
+bool Socket::isIoStatsEnabled()
+{
+#ifndef QTNG_NO_SOCKET_IO_STATS
+    return ioStatsEnabled.loadAcquire() != 0;
+#else
+    return false;
+#endif
+}
+
+
+SocketIoStats Socket::totalIoStats()
+{
+    SocketIoStats stats;
+#ifndef QTNG_NO_SOCKET_IO_STATS
+    TotalIoStats *total = totalIo();
+    stats.bytesSent = total->bytesSent.loadAcquire();
+    stats.bytesReceived = total->bytesReceived.loadAcquire();
+    stats.sendCalls = total->sendCalls.loadAcquire();
+    stats.recvCalls = total->recvCalls.loadAcquire();
+    stats.readWaits = total->readWaits.loadAcquire();
+    stats.writeWaits = total->writeWaits.loadAcquire();
+    stats.readWaitNsecs = total->readWaitNsecs.loadAcquire();
+    stats.writeWaitNsecs = total->writeWaitNsecs.loadAcquire();
+    stats.connects = total->connects.loadAcquire();
+    stats.connectNsecs = total->connectNsecs.loadAcquire();
+    stats.handshakes = total->handshakes.loadAcquire();
+    stats.handshakeNsecs = total->handshakeNsecs.loadAcquire();
+#endif
+    return stats;
+}
+
+
+SocketIoStats Socket::ioStats() const
+{
+    Q_D(const Socket);
+    return d->ioStats.isNull() ? SocketIoStats() : *d->ioStats;
+}
+
+
+struct PollEntry
+{
+    PollEntry()
+        :readWatcher(0), writeWatcher(0), ready(0), queued(false), returned(false) {}
+    QPointer<Socket> socket;
+    QSharedPointer<SocketLike> socketLike;
+    qint64 readWatcher;
+    qint64 writeWatcher;
+    int ready;          // the events fired since the last wait.
+    bool queued;        // in PollPrivate::readyEntries.
+    bool returned;      // the watchers are stopped until the next wait.
+};
+
+
 class PollPrivate
 {
 public:
     PollPrivate();
     ~PollPrivate();
 public:
-    void add(Socket *socket, EventLoopCoroutine::EventType event);
-    void remove(Socket *socket);
+    bool add(const void *key, qintptr fd, EventLoopCoroutine::EventType event, PollEntry *entry);
+    void remove(const void *key);
+    QVector<PollEvent> waitmany(float secs);
     Socket *wait(float secs);
+    void fire(PollEntry *entry, EventLoopCoroutine::EventType event);
 private:
-    QMap<Socket*, int> watchers;
-    QSharedPointer<QSet<Socket*>> events;
-    QSharedPointer<Event> done;
+    void rearm();
+public:
+    QHash<const void*, PollEntry*> entries;
+    QVector<PollEntry*> readyEntries;
+    QVector<PollEntry*> returnedEntries;
+    QVector<PollEvent> pendingEvents;  // the events of waitmany() not taken by wait() yet.
+    Event done;
 };
 
 
 struct PollFunctor: public Functor
 {
-    PollFunctor(QSharedPointer<QSet<Socket*>> events, QSharedPointer<Event> done, Socket *socket);
-    virtual void operator()();
-    QSharedPointer<QSet<Socket*>> events;
-    QSharedPointer<Event> done;
-    QPointer<Socket> socket;
+    PollFunctor(PollPrivate *poll, PollEntry *entry, EventLoopCoroutine::EventType event)
+        :poll(poll), entry(entry), event(event) {}
+    virtual void operator()() override
+    {
+        poll->fire(entry, event);
+    }
+    PollPrivate *poll;
+    PollEntry *entry;
+    EventLoopCoroutine::EventType event;
 };
 
 
-PollFunctor::PollFunctor(QSharedPointer<QSet<Socket*>> events, QSharedPointer<Event> done, Socket *socket)
-    :events(events), done(done), socket(socket)
+PollPrivate::PollPrivate()
 {}
 
 
-void PollFunctor::operator ()()
+PollPrivate::~PollPrivate()
 {
-    if(!socket.isNull()) {
-        events->insert(socket.data());
-        done->set();
+    EventLoopCoroutine *eventLoop = EventLoopCoroutine::get();
+    for (PollEntry *entry: entries) {
+        if (entry->readWatcher) {
+            eventLoop->removeWatcher(entry->readWatcher);
+        }
+        if (entry->writeWatcher) {
+            eventLoop->removeWatcher(entry->writeWatcher);
+        }
+        delete entry;
     }
 }
 
 
-PollPrivate::PollPrivate()
-    :events(new QSet<Socket*>()), done(new Event())
-{}
+bool PollPrivate::add(const void *key, qintptr fd, EventLoopCoroutine::EventType event, PollEntry *entry)
+{
+    remove(key);
+    if (fd < 0) {
+        delete entry;
+        return false;
+    }
+    EventLoopCoroutine *eventLoop = EventLoopCoroutine::get();
+    if (event & EventLoopCoroutine::Read) {
+        entry->readWatcher = eventLoop->createWatcher(EventLoopCoroutine::Read, fd,
+                                                      new PollFunctor(this, entry, EventLoopCoroutine::Read));
+        eventLoop->startWatcher(entry->readWatcher);
+    }
+    if (event & EventLoopCoroutine::Write) {
+        entry->writeWatcher = eventLoop->createWatcher(EventLoopCoroutine::Write, fd,
+                                                       new PollFunctor(this, entry, EventLoopCoroutine::Write));
+        eventLoop->startWatcher(entry->writeWatcher);
+    }
+    entries.insert(key, entry);
+    return true;
+}
 
 
-PollPrivate::~PollPrivate()
+void PollPrivate::remove(const void *key)
 {
-    QMapIterator<Socket*, int> itor(watchers);
-    while(itor.hasNext()) {
-        EventLoopCoroutine::get()->removeWatcher(itor.value());
+    PollEntry *entry = entries.take(key);
+    if (!entry) {
+        return;
+    }
+    EventLoopCoroutine *eventLoop = EventLoopCoroutine::get();
+    if (entry->readWatcher) {
+        eventLoop->removeWatcher(entry->readWatcher);
+    }
+    if (entry->writeWatcher) {
+        eventLoop->removeWatcher(entry->writeWatcher);
+    }
+    if (entry->queued) {
+        readyEntries.removeOne(entry);
     }
+    if (entry->returned) {
+        returnedEntries.removeOne(entry);
+    }
+    delete entry;
 }
 
 
-void PollPrivate::add(Socket *socket, EventLoopCoroutine::EventType event)
+void PollPrivate::fire(PollEntry *entry, EventLoopCoroutine::EventType event)
 {
-    if(watchers.contains(socket)) {
-        remove(socket);
+    // stop the watcher, or the eventloop spins while the socket is readable but nobody waits.
+    EventLoopCoroutine::get()->stopWatcher(event == EventLoopCoroutine::Read ? entry->readWatcher : entry->writeWatcher);
+    entry->ready |= event;
+    if (!entry->queued) {
+        entry->queued = true;
+        readyEntries.append(entry);
+        done.set();
     }
-    PollFunctor *callback = new PollFunctor(events, done, socket);
-    int watcherId = EventLoopCoroutine::get()->createWatcher(event, socket->fileno(), callback);
-    watchers.insert(socket, watcherId);
 }
 
 
-void PollPrivate::remove(Socket *socket)
+// the sockets returned by last wait are watched again, they fire at once if they are still ready.
+void PollPrivate::rearm()
 {
-    int watcherId = watchers.value(socket, 0);
-    if(!watcherId)
-        return;
-    EventLoopCoroutine::get()->removeWatcher(watcherId);
-    watchers.remove(socket);
+    EventLoopCoroutine *eventLoop = EventLoopCoroutine::get();
+    for (PollEntry *entry: returnedEntries) {
+        entry->returned = false;
+        if (entry->readWatcher) {
+            eventLoop->startWatcher(entry->readWatcher);
+        }
+        if (entry->writeWatcher) {
+            eventLoop->startWatcher(entry->writeWatcher);
+        }
+    }
+    returnedEntries.clear();
 }
 
 
-Socket *PollPrivate::wait(float secs)
+QVector<PollEvent> PollPrivate::waitmany(float secs)
 {
-    if(!events->isEmpty()) {
-        QMutableSetIterator<Socket*> itor(*events);
-        Socket *socket = itor.next();
-        itor.remove();
-        return socket;
+    rearm();
+    // a SslSocket may have read the records already, its descriptor is not readable but the data is.
+    for (PollEntry *entry: entries) {
+        if (entry->readWatcher && !entry->socketLike.isNull() && !(entry->ready & EventLoopCoroutine::Read)
+                && entry->socketLike->bufferedBytes() > 0) {
+            fire(entry, EventLoopCoroutine::Read);
+        }
     }
-    try {
-        Timeout timeout(secs); Q_UNUSED(timeout);
-        done->wait();
-    } catch(TimeoutException &) {
-        return nullptr;
+    if (readyEntries.isEmpty()) {
+        try {
+            Timeout timeout(secs); Q_UNUSED(timeout);
+            while (readyEntries.isEmpty()) {
+                done.clear();
+                done.wait();
+            }
+        } catch (TimeoutException &) {
+        }
     }
-    if(!events->isEmpty()) {
-        // is there some one hungry?
-        QMutableSetIterator<Socket*> itor(*events);
-        Socket *socket = itor.next();
-        itor.remove();
-        return socket;
-    } else {
-        return nullptr;
+    QVector<PollEvent> result;
+    result.reserve(readyEntries.size());
+    for (PollEntry *entry: readyEntries) {
+        entry->queued = false;
+        if (entry->socketLike.isNull() && entry->socket.isNull()) {
+            // deleted without remove(), keep it stopped.
+            continue;
+        }
+        entry->returned = true;
+        returnedEntries.append(entry);
+        PollEvent event;
+        event.socket = entry->socket.data();
+        event.socketLike = entry->socketLike;
+        event.events = entry->ready;
+        entry->ready = 0;
+        result.append(event);
+    }
+    readyEntries.clear();
+    return result;
+}
+
+
+Socket *PollPrivate::wait(float secs)
+{
+    if (pendingEvents.isEmpty()) {
+        pendingEvents = waitmany(secs);
+    }
+    // the SocketLike events are skipped, they are reported again after rearm().
+    while (!pendingEvents.isEmpty()) {
+        const PollEvent event = pendingEvents.takeFirst();
+        if (event.socket) {
+            return event.socket;
+        }
     }
+    return nullptr;
 }
 
 
@@ -735,10 +1607,22 @@ Poll::~Poll()
 }
 
 
-void Poll::add(Socket *socket, EventLoopCoroutine::EventType event)
+bool Poll::add(Socket *socket, EventLoopCoroutine::EventType event)
 {
     Q_D(Poll);
-    d->add(socket, event);
+    PollEntry *entry = new PollEntry();
+    entry->socket = socket;
+    return d->add(socket, socket->fileno(), event, entry);
+}
+
+
+bool Poll::add(QSharedPointer<SocketLike> socket, EventLoopCoroutine::EventType event)
+{
+    Q_D(Poll);
+    PollEntry *entry = new PollEntry();
+    entry->socketLike = socket;
+    // KcpSocket has no descriptor to watch.
+    return d->add(socket.data(), socket->fileno(), event, entry);
 }
 
 
@@ -749,6 +1633,27 @@ void Poll::remove(Socket *socket)
 }
 
 
+void Poll::remove(QSharedPointer<SocketLike> socket)
+{
+    Q_D(Poll);
+    d->remove(socket.data());
+}
+
+
+int Poll::size() const
+{
+    Q_D(const Poll);
+    return d->entries.size();
+}
+
+
+QVector<PollEvent> Poll::waitmany(float secs)
+{
+    Q_D(Poll);
+    return d->waitmany(secs);
+}
+
+
 Socket *Poll::wait(float secs)
 {
     Q_D(Poll);
@@ -756,15 +1661,31 @@ Socket *Poll::wait(float secs)
 }
 
 
+struct SocketDnsCacheEntry
+{
+    QList<QHostAddress> addresses;
+    qint64 expireAt;
+};
+
+
 class SocketDnsCachePrivate
 {
 public:
     SocketDnsCachePrivate()
-        :cache(1024)
+        :cache(1024), maxAge(300 * 1000), negativeTtl(5 * 1000)
     {
+        clock.start();
     }
 
-    QCache<QString, QList<QHostAddress>> cache;
+    // the cache is shared by the threads, the ValueEvent is not. the coroutines of one eventloop resolving the same
+    // name wait for the first one, the other eventloops resolve by themselves.
+    typedef QPair<EventLoopCoroutine *, QString> ResolvingKey;
+    mutable QMutex mutex;
+    QCache<QString, SocketDnsCacheEntry> cache;
+    QMap<ResolvingKey, QSharedPointer<ValueEvent<QList<QHostAddress>>>> resolving;
+    QElapsedTimer clock;
+    qint64 maxAge;
+    qint64 negativeTtl;
 };
 
 SocketDnsCache::SocketDnsCache()
@@ -782,18 +1703,121 @@ SocketDnsCache::~SocketDnsCache()
 QList<QHostAddress> SocketDnsCache::resolve(const QString &hostName)
 {
     Q_D(SocketDnsCache);
-    if(d->cache.contains(hostName)) {
-        return *(d->cache.object(hostName));
-    }
-    QList<QHostAddress> *addresses = new QList<QHostAddress>();
-    *addresses = Socket::resolve(hostName);
-    if(addresses->isEmpty()) {
-        delete addresses;
-        return QList<QHostAddress>();
+    const QString &key = hostName.toLower();
+    const SocketDnsCachePrivate::ResolvingKey resolvingKey(EventLoopCoroutine::get(), key);
+    QSharedPointer<ValueEvent<QList<QHostAddress>>> resolving;
+    {
+        QMutexLocker locker(&d->mutex);
+        SocketDnsCacheEntry *entry = d->cache.object(key);
+        if (entry) {
+            if (entry->expireAt > d->clock.elapsed()) {
+                const QList<QHostAddress> addresses = entry->addresses;
+                locker.unlock();
+                Metrics::increase("qtng_dns_cache_hits_total");
+                return addresses;
+            }
+            d->cache.remove(key);
+        }
+        resolving = d->resolving.value(resolvingKey);
+        if (resolving.isNull()) {
+            resolving.reset(new ValueEvent<QList<QHostAddress>>());
+            d->resolving.insert(resolvingKey, resolving);
+        } else {
+            locker.unlock();
+            Metrics::increase("qtng_dns_cache_misses_total");
+            return resolving->wait();
+        }
+    }
+    Metrics::increase("qtng_dns_cache_misses_total");
+
+    quint32 ttl = UINT_MAX;
+    QList<QHostAddress> addresses;
+    try {
+        addresses = resolveWithTtl(hostName, &ttl);
+    } catch (...) {
+        {
+            QMutexLocker locker(&d->mutex);
+            d->resolving.remove(resolvingKey);
+        }
+        resolving->send(QList<QHostAddress>());
+        throw;
+    }
+
+    QMutexLocker locker(&d->mutex);
+    d->resolving.remove(resolvingKey);
+    qint64 age;
+    if (addresses.isEmpty()) {
+        age = d->negativeTtl;
+    } else if (ttl == UINT_MAX) {
+        age = d->maxAge;
     } else {
-        d->cache.insert(hostName, addresses);
-        return *addresses;
+        age = qMin(static_cast<qint64>(ttl) * 1000, d->maxAge);
+    }
+    if (age > 0) {
+        SocketDnsCacheEntry *newEntry = new SocketDnsCacheEntry();
+        newEntry->addresses = addresses;
+        newEntry->expireAt = d->clock.elapsed() + age;
+        d->cache.insert(key, newEntry);
     }
+    locker.unlock();
+    resolving->send(addresses);
+    return addresses;
+}
+
+
+void SocketDnsCache::setMaxAge(float secs)
+{
+    Q_D(SocketDnsCache);
+    QMutexLocker locker(&d->mutex);
+    d->maxAge = static_cast<qint64>(secs * 1000);
+}
+
+
+float SocketDnsCache::maxAge() const
+{
+    Q_D(const SocketDnsCache);
+    QMutexLocker locker(&d->mutex);
+    return static_cast<float>(d->maxAge) / 1000;
+}
+
+
+void SocketDnsCache::setNegativeTtl(float secs)
+{
+    Q_D(SocketDnsCache);
+    QMutexLocker locker(&d->mutex);
+    d->negativeTtl = static_cast<qint64>(secs * 1000);
+}
+
+
+float SocketDnsCache::negativeTtl() const
+{
+    Q_D(const SocketDnsCache);
+    QMutexLocker locker(&d->mutex);
+    return static_cast<float>(d->negativeTtl) / 1000;
+}
+
+
+void SocketDnsCache::setCapacity(int capacity)
+{
+    Q_D(SocketDnsCache);
+    QMutexLocker locker(&d->mutex);
+    d->cache.setMaxCost(qMax(capacity, 1));
+}
+
+
+int SocketDnsCache::capacity() const
+{
+    Q_D(const SocketDnsCache);
+    QMutexLocker locker(&d->mutex);
+    return d->cache.maxCost();
+}
+
+
+void SocketDnsCache::clear()
+{
+    Q_D(SocketDnsCache);
+    QMutexLocker locker(&d->mutex);
+    d->cache.clear();
 }
 
 QTNETWORKNG_NAMESPACE_END
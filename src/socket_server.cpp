@@ -1,10 +1,67 @@
+#include <limits.h>
 #include <QtCore/qloggingcategory.h>
+#include <QtCore/qthread.h>
+#include <QtCore/qsemaphore.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qhash.h>
+#include <QtCore/qthreadstorage.h>
 #include "../include/socket_server.h"
+#include "../include/private/eventloop_p.h"
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <string.h>
+#endif
 
 static Q_LOGGING_CATEGORY(logger, "qtng.socket_server")
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
+class BaseStreamServerPrivate;
+class StreamServerWorker: public QThread
+{
+public:
+    StreamServerWorker(BaseStreamServerPrivate *parent, QSharedPointer<Socket> serverSocket)
+        :parent(parent), serverSocket(serverSocket), eventloop(nullptr) {}
+    virtual void run() override;
+    void closeServerSocket();
+public:
+    BaseStreamServerPrivate * const parent;
+    QSharedPointer<Socket> serverSocket;
+    QList<Socket*> backlog;
+    QMutex mutex;
+    QSemaphore ready;
+    EventLoopCoroutine *eventloop;  // guarded by mutex, cleared before the eventloop is deleted.
+};
+
+
+// serves the requests accepted by another thread, see BaseStreamServer::setDispatchThreads().
+class StreamServerDispatcher: public QThread
+{
+public:
+    explicit StreamServerDispatcher(BaseStreamServerPrivate *parent)
+        :parent(parent), eventloop(nullptr), load(0), stopping(0) {}
+    virtual void run() override;
+    void dispatch(Socket *request);
+    Socket *takeRequest();
+    void wakeup();
+    void stop();
+public:
+    BaseStreamServerPrivate * const parent;
+    QList<Socket*> requests;
+    QMutex mutex;
+    QSemaphore ready;
+    EventLoopCoroutine *eventloop;  // guarded by mutex, cleared before the eventloop is deleted.
+    QSharedPointer<Event> hasRequests;
+    QAtomicInt load;                // the requests queued and served.
+    QAtomicInt stopping;
+};
+
+
 class BaseStreamServerPrivate
 {
 public:
@@ -13,26 +70,108 @@ public:
           serverSocket(new Socket()),
           operations(new CoroutineGroup),
           requestQueueSize(100),
+          acceptorThreads(0),
+          dispatchThreads(0),
+          dispatchPolicy(BaseStreamServer::RoundRobinDispatch),
+          nextDispatcher(0),
+          fastOpenQueueSize(0),
+          maxConnections(0),
+          maxConnectionsPerClient(0),
+          maxPendingHandshakes(0),
+          overloadAction(BaseStreamServer::PauseAccepting),
+          activeConnections(0),
+          pendingHandshakes(0),
+          acceptedConnections(0),
+          rejectedConnections(0),
+          drainMsecs(0),
+          inheritedSocket(-1),
           serverPort(serverPort),
-          allowReuseAddress(true)
+          allowReuseAddress(true),
+          serverPathBound(false)
     {}
 
-    ~BaseStreamServerPrivate() { delete operations; }
+    ~BaseStreamServerPrivate() { stopWorkers(); stopDispatchers(); qDeleteAll(backlog); delete operations; }
     void serveForever();
-    void handleRequest(QSharedPointer<SocketLike> request);
+    void acceptRequests(CoroutineGroup *operations);
+    void dispatchRequests();
+    void serveDispatched(StreamServerDispatcher *dispatcher, CoroutineGroup *operations);
+    void startDispatchers();
+    void stopDispatchers();
+    void handleRequest(QSharedPointer<SocketLike> request, bool prepare);
+    static void drain(CoroutineGroup *operations, quint32 msecs);
+    bool startWorkers();
+    void stopWorkers();
+    Socket *acceptRaw();
+    bool bindPath(QSharedPointer<Socket> socket);
+    void unbindPath();
 private:
     BaseStreamServer * const q_ptr;
     Q_DECLARE_PUBLIC(BaseStreamServer)
 public:
     QHostAddress serverAddress;
+    QString serverPath;     // of unix socket, the address and port are not used if it is set.
     QSharedPointer<Socket> serverSocket;
+    QList<Socket*> backlog;  // accepted by acceptmany() but not yet handed out.
     CoroutineGroup *operations;
+    QList<StreamServerWorker*> workers;
+    QList<StreamServerDispatcher*> dispatchers;
     int requestQueueSize;
+    int acceptorThreads;
+    int dispatchThreads;
+    BaseStreamServer::DispatchPolicy dispatchPolicy;
+    quint32 nextDispatcher;
+    int fastOpenQueueSize;
+    int maxConnections;
+    int maxConnectionsPerClient;
+    int maxPendingHandshakes;
+    BaseStreamServer::OverloadAction overloadAction;
+    QAtomicInt activeConnections;
+    QAtomicInt pendingHandshakes;
+    QAtomicInteger<quint64> acceptedConnections;
+    QAtomicInteger<quint64> rejectedConnections;
+    QAtomicInt drainMsecs;      // read by acceptor threads while stopping.
+    qintptr inheritedSocket;
     quint16 serverPort;
     bool allowReuseAddress;
+    bool serverPathBound;   // the socket file is removed by unbindPath().
 };
 
 
+void StreamServerWorker::run()
+{
+    {
+        QMutexLocker locker(&mutex);
+        eventloop = EventLoopCoroutine::get();
+    }
+    ready.release();
+    QSharedPointer<Coroutine> acceptor(Coroutine::spawn([this] {
+        CoroutineGroup operations;
+        parent->acceptRequests(&operations);
+        serverSocket->close();
+        qDeleteAll(backlog);
+        backlog.clear();
+        BaseStreamServerPrivate::drain(&operations, static_cast<quint32>(parent->drainMsecs.load()));
+    }));
+    acceptor->join();
+    QMutexLocker locker(&mutex);
+    eventloop = nullptr;
+}
+
+
+void StreamServerWorker::closeServerSocket()
+{
+    QMutexLocker locker(&mutex);
+    if (!eventloop) {
+        return;
+    }
+    // the socket must be closed in its own thread to wake up the accept().
+    QSharedPointer<Socket> serverSocket = this->serverSocket;
+    eventloop->callLaterThreadSafe(0, makeFunctor([serverSocket] {
+        serverSocket->close();
+    }));
+}
+
+
 BaseStreamServer::BaseStreamServer(const QHostAddress &serverAddress, quint16 serverPort)
     :started(new Event()), stopped(new Event()), d_ptr(new BaseStreamServerPrivate(this, serverAddress, serverPort))
 {
@@ -41,6 +180,17 @@ BaseStreamServer::BaseStreamServer(const QHostAddress &serverAddress, quint16 se
 }
 
 
+BaseStreamServer::BaseStreamServer(const QString &serverPath)
+    :started(new Event()), stopped(new Event()), d_ptr(new BaseStreamServerPrivate(this, QHostAddress(), 0))
+{
+    Q_D(BaseStreamServer);
+    d->serverPath = serverPath;
+    d->serverSocket.reset(new Socket(Socket::UnixProtocol));
+    started->clear();
+    stopped->set();
+}
+
+
 BaseStreamServer::BaseStreamServer(BaseStreamServerPrivate *d)
     :started(new Event()), stopped(new Event()), d_ptr(d)
 {
@@ -83,9 +233,164 @@ void BaseStreamServer::setRequestQueueSize(int requestQueueSize)
 }
 
 
+int BaseStreamServer::acceptorThreads() const
+{
+    Q_D(const BaseStreamServer);
+    return d->acceptorThreads;
+}
+
+
+void BaseStreamServer::setAcceptorThreads(int threads)
+{
+    Q_D(BaseStreamServer);
+    d->acceptorThreads = threads;
+}
+
+
+int BaseStreamServer::dispatchThreads() const
+{
+    Q_D(const BaseStreamServer);
+    return d->dispatchThreads;
+}
+
+
+void BaseStreamServer::setDispatchThreads(int threads)
+{
+    Q_D(BaseStreamServer);
+    d->dispatchThreads = threads;
+}
+
+
+BaseStreamServer::DispatchPolicy BaseStreamServer::dispatchPolicy() const
+{
+    Q_D(const BaseStreamServer);
+    return d->dispatchPolicy;
+}
+
+
+void BaseStreamServer::setDispatchPolicy(DispatchPolicy policy)
+{
+    Q_D(BaseStreamServer);
+    d->dispatchPolicy = policy;
+}
+
+
+int BaseStreamServer::fastOpenQueueSize() const
+{
+    Q_D(const BaseStreamServer);
+    return d->fastOpenQueueSize;
+}
+
+
+void BaseStreamServer::setFastOpenQueueSize(int fastOpenQueueSize)
+{
+    Q_D(BaseStreamServer);
+    d->fastOpenQueueSize = fastOpenQueueSize;
+}
+
+
+int BaseStreamServer::maxConnections() const
+{
+    Q_D(const BaseStreamServer);
+    return d->maxConnections;
+}
+
+
+void BaseStreamServer::setMaxConnections(int maxConnections)
+{
+    Q_D(BaseStreamServer);
+    d->maxConnections = qMax(0, maxConnections);
+}
+
+
+BaseStreamServer::OverloadAction BaseStreamServer::overloadAction() const
+{
+    Q_D(const BaseStreamServer);
+    return d->overloadAction;
+}
+
+
+void BaseStreamServer::setOverloadAction(OverloadAction action)
+{
+    Q_D(BaseStreamServer);
+    d->overloadAction = action;
+}
+
+
+int BaseStreamServer::maxConnectionsPerClient() const
+{
+    Q_D(const BaseStreamServer);
+    return d->maxConnectionsPerClient;
+}
+
+
+void BaseStreamServer::setMaxConnectionsPerClient(int maxConnectionsPerClient)
+{
+    Q_D(BaseStreamServer);
+    d->maxConnectionsPerClient = qMax(0, maxConnectionsPerClient);
+}
+
+
+int BaseStreamServer::maxPendingHandshakes() const
+{
+    Q_D(const BaseStreamServer);
+    return d->maxPendingHandshakes;
+}
+
+
+void BaseStreamServer::setMaxPendingHandshakes(int maxPendingHandshakes)
+{
+    Q_D(BaseStreamServer);
+    d->maxPendingHandshakes = qMax(0, maxPendingHandshakes);
+}
+
+
+StreamServerStats BaseStreamServer::stats() const
+{
+    Q_D(const BaseStreamServer);
+    StreamServerStats stats;
+    stats.activeConnections = d->activeConnections.load();
+    stats.pendingHandshakes = d->pendingHandshakes.load();
+    stats.acceptedConnections = d->acceptedConnections.load();
+    stats.rejectedConnections = d->rejectedConnections.load();
+    return stats;
+}
+
+
+bool BaseStreamServer::parkRequest(QSharedPointer<SocketLike> request, quint32 idleMsecs)
+{
+    Q_D(BaseStreamServer);
+    QSharedPointer<Socket> socket = convertSocketLikeToSocket(request);
+    if (socket.isNull() || idleMsecs == 0 || !requestParks()->hasLocalData()) {
+        return false;
+    }
+    RequestPark *park = requestParks()->localData().value(d);
+    if (!park) {
+        return false;
+    }
+    return park->park(request, socket->fileno(), idleMsecs);
+}
+
+
 bool BaseStreamServer::serverBind()
 {
     Q_D(BaseStreamServer);
+    if (d->inheritedSocket != -1) {
+        QSharedPointer<Socket> socket(new Socket(d->inheritedSocket));
+        d->inheritedSocket = -1;
+        if (!socket->isValid() || socket->state() != Socket::ListeningState) {
+            qCInfo(logger) << "the inherited socket is not listening.";
+            return false;
+        }
+        d->serverSocket = socket;
+        d->serverAddress = socket->localAddress();
+        d->serverPort = socket->localPort();
+        d->serverPath = socket->localPath();
+        return true;
+    }
+    if (!d->serverPath.isEmpty()) {
+        return d->bindPath(d->serverSocket);
+    }
     Socket::BindMode mode;
     if (d->allowReuseAddress) {
         mode = Socket::ReuseAddressHint;
@@ -103,8 +408,16 @@ bool BaseStreamServer::serverBind()
 bool BaseStreamServer::serverActivate()
 {
     Q_D(BaseStreamServer);
+    if (d->serverSocket->state() == Socket::ListeningState) {
+        return true;  // inherited.
+    }
+    if (d->fastOpenQueueSize > 0 && d->serverPath.isEmpty() && !d->serverSocket->setOption(Socket::TcpFastOpenOption, d->fastOpenQueueSize)) {
+        qCInfo(logger) << "server can not enable tcp fast open.";
+    }
     bool ok = d->serverSocket->listen(d->requestQueueSize);
-    if (!ok) {
+    if (!ok && !d->serverPath.isEmpty()) {
+        qCInfo(logger) << "server can not listen to" << d->serverPath;
+    } else if (!ok) {
         qCInfo(logger) << "server can not listen to" << d->serverAddress.toString() << ":" << d->serverPort;
     }
     return ok;
@@ -115,6 +428,66 @@ void BaseStreamServer::serverClose()
 {
     Q_D(BaseStreamServer);
     d->serverSocket->close();
+    d->unbindPath();
+}
+
+
+#ifdef Q_OS_UNIX
+// true if nobody listens to the socket file, so it is left by a dead server. a live server accepts the connection,
+// or refuses it with EAGAIN if its queue is full, never ECONNREFUSED.
+static bool isStaleSocketFile(const QByteArray &path)
+{
+    struct sockaddr_un addr;
+    if (static_cast<size_t>(path.size()) >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.constData(), static_cast<size_t>(path.size()));
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+    ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int r;
+    do {
+        r = ::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    } while (r < 0 && errno == EINTR);
+    const bool stale = r < 0 && errno == ECONNREFUSED;
+    ::close(fd);
+    return stale;
+}
+#endif
+
+
+bool BaseStreamServerPrivate::bindPath(QSharedPointer<Socket> socket)
+{
+#ifdef Q_OS_UNIX
+    // the file left by a dead server refuses the binding, it is removed like SO_REUSEADDR. the file of a live
+    // server is kept, the binding fails then.
+    const QByteArray &encoded = QFile::encodeName(serverPath);
+    struct stat st;
+    if (allowReuseAddress && !serverPath.startsWith(QLatin1Char('@'))
+            && ::lstat(encoded.constData(), &st) == 0 && S_ISSOCK(st.st_mode) && isStaleSocketFile(encoded)) {
+        ::unlink(encoded.constData());
+    }
+#endif
+    if (!socket->bindPath(serverPath)) {
+        qCInfo(logger) << "server can not bind to" << serverPath;
+        return false;
+    }
+    serverPathBound = !serverPath.startsWith(QLatin1Char('@'));
+    return true;
+}
+
+
+void BaseStreamServerPrivate::unbindPath()
+{
+    if (serverPathBound) {
+        serverPathBound = false;
+        QFile::remove(serverPath);
+    }
 }
 
 
@@ -123,16 +496,265 @@ void BaseStreamServerPrivate::serveForever()
     Q_Q(BaseStreamServer);
     q->started->set();
     q->stopped->clear();
+    if (dispatchThreads > 1) {
+        startDispatchers();
+        dispatchRequests();
+        stopDispatchers();
+    } else {
+        acceptRequests(operations);
+    }
+    q->serverClose();
+    qDeleteAll(backlog);
+    backlog.clear();
+    q->started->clear();
+    q->stopped->set();
+}
+
+
+// the connections served by one acceptor loop, shared with the coroutines of requests.
+struct AcceptorState
+{
+    explicit AcceptorState(int maxConnections)
+        :slots(maxConnections > 0 ? new Semaphore(maxConnections) : nullptr), maxConnections(maxConnections)
+        , active(0) {}
+    QScopedPointer<Semaphore> slots;
+    QHash<QHostAddress, int> clients;
+    const int maxConnections;
+    int active;
+};
+
+
+// the accounting of one connection, given back when the last reference is dropped. a parked connection keeps it.
+struct ConnectionGuard
+{
+    virtual ~ConnectionGuard() {}
+};
+
+
+// gives back the slot of connection while the request returns or is killed.
+struct AcceptorSlotGuard: public ConnectionGuard
+{
+    AcceptorSlotGuard(QSharedPointer<AcceptorState> state, const QHostAddress &peer, QAtomicInt *activeConnections)
+        :state(state), peer(peer), activeConnections(activeConnections) {}
+    virtual ~AcceptorSlotGuard() override
+    {
+        activeConnections->deref();
+        --state->active;
+        if (!peer.isNull()) {
+            QHash<QHostAddress, int>::iterator itor = state->clients.find(peer);
+            if (itor != state->clients.end() && --itor.value() <= 0) {
+                state->clients.erase(itor);
+            }
+        }
+        if (state->slots) {
+            state->slots->release();
+        }
+    }
+    QSharedPointer<AcceptorState> state;
+    QHostAddress peer;
+    QAtomicInt *activeConnections;
+};
+
+
+// the idle connections of one acceptor loop. only an io watcher and a timer are left for every connection, the
+// request is given to processRequest() in a new coroutine of the loop as it becomes readable.
+class RequestPark
+{
+public:
+    RequestPark(BaseStreamServerPrivate *server, CoroutineGroup *operations)
+        :server(server), operations(operations), nextKey(1) {}
+    ~RequestPark();
+public:
+    bool park(QSharedPointer<SocketLike> request, qintptr fd, quint32 idleMsecs);
+    void wake(quint64 key, bool readable);
+    static RequestPark *of(BaseStreamServerPrivate *server);
+public:
+    // the guards of the requests being handled in this loop, park() takes them so the parked connections keep
+    // their slots and the counts of their clients.
+    QHash<SocketLike *, QSharedPointer<ConnectionGuard>> guards;
+private:
+    struct Parked
+    {
+        QSharedPointer<SocketLike> request;
+        QSharedPointer<ConnectionGuard> guard;
+        qint64 watcherId;
+        qint64 timerId;
+    };
+    BaseStreamServerPrivate * const server;
+    CoroutineGroup * const operations;
+    QHash<quint64, Parked> requests;
+    quint64 nextKey;
+};
+
+
+// registers the guard of a request while it is handled.
+struct RequestGuardScope
+{
+    RequestGuardScope(BaseStreamServerPrivate *server, QSharedPointer<SocketLike> request,
+                      QSharedPointer<ConnectionGuard> guard)
+        :server(server), request(request.data())
+    {
+        RequestPark *park = RequestPark::of(server);
+        if (park) {
+            park->guards.insert(this->request, guard);
+        }
+    }
+    ~RequestGuardScope()
+    {
+        // the park may be gone while the requests are drained.
+        RequestPark *park = RequestPark::of(server);
+        if (park) {
+            park->guards.remove(request);
+        }
+    }
+    BaseStreamServerPrivate * const server;
+    SocketLike * const request;
+};
+
+
+// the parks of the acceptor loops running in this thread.
+typedef QHash<BaseStreamServerPrivate *, RequestPark *> RequestParks;
+Q_GLOBAL_STATIC(QThreadStorage<RequestParks>, requestParks)
+
+
+RequestPark *RequestPark::of(BaseStreamServerPrivate *server)
+{
+    if (!requestParks()->hasLocalData()) {
+        return nullptr;
+    }
+    return requestParks()->localData().value(server);
+}
+
+
+RequestPark::~RequestPark()
+{
+    EventLoopCoroutine *eventLoop = EventLoopCoroutine::get();
+    for (const Parked &parked: requests) {
+        eventLoop->removeWatcher(parked.watcherId);
+        eventLoop->cancelCall(parked.timerId);
+        parked.request->close();
+    }
+}
+
+
+bool RequestPark::park(QSharedPointer<SocketLike> request, qintptr fd, quint32 idleMsecs)
+{
+    EventLoopCoroutine *eventLoop = EventLoopCoroutine::get();
+    const quint64 key = nextKey++;
+    Parked parked;
+    parked.request = request;
+    parked.guard = guards.take(request.data());
+    parked.watcherId = eventLoop->createWatcher(EventLoopCoroutine::Read, fd, makeFunctor([this, key] {
+        wake(key, true);
+    }));
+    parked.timerId = eventLoop->callLaterCoarse(idleMsecs, makeFunctor([this, key] {
+        wake(key, false);
+    }));
+    requests.insert(key, parked);
+    eventLoop->startWatcher(parked.watcherId);
+    return true;
+}
+
+
+// called by the eventloop, so it must not block.
+void RequestPark::wake(quint64 key, bool readable)
+{
+    QHash<quint64, Parked>::iterator itor = requests.find(key);
+    if (itor == requests.end()) {
+        return;
+    }
+    const Parked parked = itor.value();
+    requests.erase(itor);
+    EventLoopCoroutine *eventLoop = EventLoopCoroutine::get();
+    if (!readable) {
+        eventLoop->removeWatcher(parked.watcherId);
+        parked.request->close();
+        return;
+    }
+    // the watcher is running its callback now, it is removed later.
+    eventLoop->stopWatcher(parked.watcherId);
+    eventLoop->cancelCall(parked.timerId);
+    const qint64 watcherId = parked.watcherId;
+    eventLoop->callLater(0, makeFunctor([watcherId] {
+        EventLoopCoroutine::get()->removeWatcher(watcherId);
+    }));
+    BaseStreamServerPrivate *server = this->server;
+    QSharedPointer<SocketLike> request = parked.request;
+    QSharedPointer<ConnectionGuard> guard = parked.guard;
+    operations->spawn([server, request, guard] {
+        RequestGuardScope scope(server, request, guard);
+        Q_UNUSED(scope);
+        server->handleRequest(request, false);
+    });
+}
+
+
+struct RequestParkScope
+{
+    RequestParkScope(BaseStreamServerPrivate *server, CoroutineGroup *operations)
+        :server(server)
+    {
+        requestParks()->localData().insert(server, new RequestPark(server, operations));
+    }
+    ~RequestParkScope()
+    {
+        delete requestParks()->localData().take(server);
+    }
+    BaseStreamServerPrivate * const server;
+};
+
+
+void BaseStreamServerPrivate::acceptRequests(CoroutineGroup *operations)
+{
+    Q_Q(BaseStreamServer);
+    int limit = maxConnections;
+    if (limit > 0 && acceptorThreads > 1) {
+        limit = qMax(1, (limit + acceptorThreads - 1) / acceptorThreads);
+    }
+    // the slots are taken before accepting, so the overloaded server leaves the clients in the listen queue.
+    QSharedPointer<AcceptorState> state(new AcceptorState(overloadAction == BaseStreamServer::PauseAccepting ? limit : 0));
+    RequestParkScope parkScope(this, operations);
+    Q_UNUSED(parkScope);
     while (true) {
+        if (state->slots) {
+            state->slots->acquire();
+        }
         QSharedPointer<SocketLike> request = q->getRequest();
         if (request.isNull()) {
+            if (state->slots) {
+                state->slots->release();
+            }
             break;
         }
-        if (q->verifyRequest(request)) {
-            operations->spawn([this, request] {
-                handleRequest(request);
+        acceptedConnections.fetchAndAddRelaxed(1);
+        QHostAddress peer;
+        if (maxConnectionsPerClient > 0) {
+            peer = request->peerAddress();
+        }
+        const bool overloaded = (limit > 0 && !state->slots && state->active >= limit)
+                || (maxConnectionsPerClient > 0 && state->clients.value(peer) >= maxConnectionsPerClient);
+        if (overloaded) {
+            rejectedConnections.fetchAndAddRelaxed(1);
+            if (state->slots) {
+                state->slots->release();
+            }
+            q->rejectRequest(request);
+        } else if (q->verifyRequest(request)) {
+            ++state->active;
+            if (!peer.isNull()) {
+                ++state->clients[peer];
+            }
+            activeConnections.ref();
+            operations->spawn([this, request, state, peer] {
+                QSharedPointer<ConnectionGuard> guard(new AcceptorSlotGuard(state, peer, &activeConnections));
+                RequestGuardScope scope(this, request, guard);
+                Q_UNUSED(scope);
+                handleRequest(request, true);
             });
         } else {
+            if (state->slots) {
+                state->slots->release();
+            }
             q->shutdownRequest(request);
             q->closeRequest(request);
         }
@@ -140,16 +762,322 @@ void BaseStreamServerPrivate::serveForever()
             break;
         }
     }
-    q->serverClose();
-    q->started->clear();
-    q->stopped->set();
 }
 
 
-void BaseStreamServerPrivate::handleRequest(QSharedPointer<SocketLike> request)
+// 开始实现 dispatching
+
+void StreamServerDispatcher::run()
+{
+    {
+        QMutexLocker locker(&mutex);
+        eventloop = EventLoopCoroutine::get();
+        hasRequests.reset(new Event());
+    }
+    ready.release();
+    QSharedPointer<Coroutine> server(Coroutine::spawn([this] {
+        CoroutineGroup operations;
+        {
+            RequestParkScope parkScope(parent, &operations);
+            Q_UNUSED(parkScope);
+            parent->serveDispatched(this, &operations);
+        }
+        BaseStreamServerPrivate::drain(&operations, static_cast<quint32>(parent->drainMsecs.load()));
+    }));
+    server->join();
+    QMutexLocker locker(&mutex);
+    eventloop = nullptr;
+    qDeleteAll(requests);
+    requests.clear();
+}
+
+
+void StreamServerDispatcher::dispatch(Socket *request)
+{
+    load.ref();
+    {
+        QMutexLocker locker(&mutex);
+        requests.append(request);
+    }
+    wakeup();
+}
+
+
+Socket *StreamServerDispatcher::takeRequest()
+{
+    QMutexLocker locker(&mutex);
+    if (requests.isEmpty()) {
+        return nullptr;
+    }
+    return requests.takeFirst();
+}
+
+
+void StreamServerDispatcher::wakeup()
+{
+    QMutexLocker locker(&mutex);
+    if (!eventloop) {
+        return;
+    }
+    QSharedPointer<Event> hasRequests = this->hasRequests;
+    eventloop->callLaterThreadSafe(0, makeFunctor([hasRequests] {
+        hasRequests->set();
+    }));
+}
+
+
+void StreamServerDispatcher::stop()
+{
+    stopping.store(1);
+    wakeup();
+}
+
+
+// decrease the counters of dispatched request while it returns or is killed.
+struct DispatchedGuard: public ConnectionGuard
+{
+    DispatchedGuard(QAtomicInt *load, QAtomicInt *activeConnections)
+        :load(load), activeConnections(activeConnections) {}
+    virtual ~DispatchedGuard() override { load->deref(); activeConnections->deref(); }
+    QAtomicInt *load;
+    QAtomicInt *activeConnections;
+};
+
+
+void BaseStreamServerPrivate::serveDispatched(StreamServerDispatcher *dispatcher, CoroutineGroup *operations)
+{
+    Q_Q(BaseStreamServer);
+    while (!dispatcher->stopping.load()) {
+        Socket *accepted = dispatcher->takeRequest();
+        if (!accepted) {
+            dispatcher->hasRequests->clear();
+            // check again, the wakeup may be consumed before clear().
+            accepted = dispatcher->takeRequest();
+            if (!accepted) {
+                dispatcher->hasRequests->wait();
+                continue;
+            }
+        }
+        // the descriptor is moved to a socket of this thread, so its io watchers belong to this eventloop.
+        QSharedPointer<Socket> socket(accepted->detach());
+        delete accepted;
+        QSharedPointer<SocketLike> request = q->wrapRequest(socket);
+        if (!q->verifyRequest(request)) {
+            q->shutdownRequest(request);
+            q->closeRequest(request);
+            dispatcher->load.deref();
+            activeConnections.deref();
+            continue;
+        }
+        QAtomicInt *load = &dispatcher->load;
+        operations->spawn([this, request, load] {
+            QSharedPointer<ConnectionGuard> guard(new DispatchedGuard(load, &activeConnections));
+            RequestGuardScope scope(this, request, guard);
+            Q_UNUSED(scope);
+            handleRequest(request, true);
+        });
+    }
+}
+
+
+// the limits are checked with the connections of all threads. the connections of one client are not counted.
+void BaseStreamServerPrivate::dispatchRequests()
+{
+    Q_Q(BaseStreamServer);
+    while (true) {
+        while (maxConnections > 0 && overloadAction == BaseStreamServer::PauseAccepting
+               && activeConnections.load() >= maxConnections) {
+            // the requests finish in other threads, so the acceptor polls instead of waiting for a semaphore.
+            Coroutine::msleep(5);
+            if (serverSocket->state() != Socket::ListeningState) {
+                return;
+            }
+        }
+        Socket *accepted = acceptRaw();
+        if (!accepted) {
+            break;
+        }
+        acceptedConnections.fetchAndAddRelaxed(1);
+        if (maxConnections > 0 && activeConnections.load() >= maxConnections) {
+            rejectedConnections.fetchAndAddRelaxed(1);
+            q->rejectRequest(SocketLike::rawSocket(accepted));
+        } else {
+            StreamServerDispatcher *target = nullptr;
+            if (dispatchPolicy == BaseStreamServer::LeastLoadedDispatch) {
+                int minLoad = INT_MAX;
+                for (StreamServerDispatcher *dispatcher: dispatchers) {
+                    const int load = dispatcher->load.load();
+                    if (load < minLoad) {
+                        minLoad = load;
+                        target = dispatcher;
+                    }
+                }
+            } else {
+                target = dispatchers.at(static_cast<int>(nextDispatcher++ % static_cast<quint32>(dispatchers.size())));
+            }
+            activeConnections.ref();
+            target->dispatch(accepted);
+        }
+        if (!q->serviceActions()) {
+            break;
+        }
+    }
+}
+
+
+void BaseStreamServerPrivate::startDispatchers()
+{
+    for (int i = 0; i < dispatchThreads; ++i) {
+        StreamServerDispatcher *dispatcher = new StreamServerDispatcher(this);
+        dispatchers.append(dispatcher);
+        dispatcher->start();
+    }
+    for (StreamServerDispatcher *dispatcher: dispatchers) {
+        dispatcher->ready.acquire();
+    }
+}
+
+
+void BaseStreamServerPrivate::stopDispatchers()
+{
+    if (dispatchers.isEmpty()) {
+        return;
+    }
+    // every thread drains its own requests.
+    for (StreamServerDispatcher *dispatcher: dispatchers) {
+        dispatcher->stop();
+    }
+    for (StreamServerDispatcher *dispatcher: dispatchers) {
+        if (dispatcher->isRunning()) {
+            dispatcher->wait();
+        }
+    }
+    // the requests left in the queue are closed by the threads.
+    for (StreamServerDispatcher *dispatcher: dispatchers) {
+        activeConnections.fetchAndAddRelaxed(-dispatcher->load.load());
+    }
+    qDeleteAll(dispatchers);
+    dispatchers.clear();
+}
+
+
+bool BaseStreamServerPrivate::startWorkers()
+{
+    QList<QSharedPointer<Socket>> sockets;
+#ifdef Q_OS_UNIX
+    if (!serverPath.isEmpty()) {
+        // unix sockets have no SO_REUSEPORT, the threads accept from the duplicates of one listening socket.
+        QSharedPointer<Socket> socket(new Socket(Socket::UnixProtocol));
+        if (!bindPath(socket) || !socket->listen(requestQueueSize)) {
+            socket->close();
+            unbindPath();
+            return false;
+        }
+        sockets.append(socket);
+        for (int i = 1; i < acceptorThreads; ++i) {
+            const int fd = ::fcntl(static_cast<int>(socket->fileno()), F_DUPFD_CLOEXEC, 0);
+            QSharedPointer<Socket> duplicated(new Socket(fd));
+            if (fd < 0 || !duplicated->isValid()) {
+                qCInfo(logger) << "server can not duplicate the listening socket of" << serverPath;
+                for (QSharedPointer<Socket> s: sockets) {
+                    s->close();
+                }
+                unbindPath();
+                return false;
+            }
+            sockets.append(duplicated);
+        }
+    }
+#endif
+    Socket::BindMode mode = Socket::ReusePortHint;
+    if (allowReuseAddress) {
+        mode |= Socket::ReuseAddressHint;
+    }
+    quint16 port = serverPort;
+    for (int i = sockets.size(); i < acceptorThreads; ++i) {
+        QSharedPointer<Socket> socket(new Socket());
+        if (fastOpenQueueSize > 0) {
+            socket->setOption(Socket::TcpFastOpenOption, fastOpenQueueSize);
+        }
+        if (!socket->bind(serverAddress, port, mode) || !socket->listen(requestQueueSize)) {
+            qCInfo(logger) << "server can not listen to" << serverAddress.toString() << ":" << port << "with SO_REUSEPORT";
+            for (QSharedPointer<Socket> s: sockets) {
+                s->close();
+            }
+            socket->close();
+            return false;
+        }
+        // all sockets must use the same port if the port is chosen by system.
+        port = socket->localPort();
+        sockets.append(socket);
+    }
+    for (QSharedPointer<Socket> socket: sockets) {
+        StreamServerWorker *worker = new StreamServerWorker(this, socket);
+        workers.append(worker);
+        worker->start();
+    }
+    for (StreamServerWorker *worker: workers) {
+        worker->ready.acquire();
+    }
+    return true;
+}
+
+
+void BaseStreamServerPrivate::stopWorkers()
+{
+    if (workers.isEmpty()) {
+        return;
+    }
+    for (StreamServerWorker *worker: workers) {
+        worker->closeServerSocket();
+    }
+    for (StreamServerWorker *worker: workers) {
+        if (worker->isRunning()) {
+            worker->wait();
+        }
+    }
+    qDeleteAll(workers);
+    workers.clear();
+    unbindPath();
+}
+
+
+// the connections are accepted in batches, so a storm of reconnecting clients is drained quickly.
+const int AcceptBatchSize = 64;
+
+
+Socket *BaseStreamServerPrivate::acceptRaw()
+{
+    QSharedPointer<Socket> socket = serverSocket;
+    QList<Socket*> *backlog = &this->backlog;
+    if (!workers.isEmpty()) {
+        QThread *current = QThread::currentThread();
+        for (StreamServerWorker *worker: workers) {
+            if (worker == current) {
+                socket = worker->serverSocket;
+                backlog = &worker->backlog;
+                break;
+            }
+        }
+    }
+    if (backlog->isEmpty()) {
+        *backlog = socket->acceptmany(AcceptBatchSize);
+        if (backlog->isEmpty()) {
+            return nullptr;
+        }
+    }
+    return backlog->takeFirst();
+}
+
+
+void BaseStreamServerPrivate::handleRequest(QSharedPointer<SocketLike> request, bool prepare)
 {
     Q_Q(BaseStreamServer);
     try {
+        if (prepare && !q->prepareRequest(request)) {
+            q->closeRequest(request);
+            return;
+        }
         q->processRequest(request); // close request.
     } catch (CoroutineExitException &) {
         q->shutdownRequest(request);
@@ -165,6 +1093,13 @@ void BaseStreamServerPrivate::handleRequest(QSharedPointer<SocketLike> request)
 bool BaseStreamServer::serveForever()
 {
     Q_D(BaseStreamServer);
+    if (d->acceptorThreads > 1) {
+        if (!start()) {
+            return false;
+        }
+        stopped->wait();
+        return true;
+    }
     if (!serverBind()) {
         serverClose();
         return false;
@@ -185,6 +1120,14 @@ bool BaseStreamServer::start()
     if (started->isSet() || d->operations->has("serve")) {
         return true;
     }
+    if (d->acceptorThreads > 1) {
+        if (!d->startWorkers()) {
+            return false;
+        }
+        started->set();
+        stopped->clear();
+        return true;
+    }
     if (!serverBind()) {
         serverClose();
         return false;
@@ -200,7 +1143,97 @@ bool BaseStreamServer::start()
 
 void BaseStreamServer::stop()
 {
+    Q_D(BaseStreamServer);
+    if (!d->workers.isEmpty()) {
+        d->stopWorkers();
+        started->clear();
+        stopped->set();
+        return;
+    }
+    serverClose();
+}
+
+
+void BaseStreamServer::stop(quint32 drainMsecs)
+{
+    Q_D(BaseStreamServer);
+    d->drainMsecs.store(static_cast<int>(qMin<quint32>(drainMsecs, INT_MAX)));
+    if (!d->workers.isEmpty()) {
+        // every acceptor thread drains its own requests.
+        stop();
+        d->drainMsecs.store(0);
+        return;
+    }
     serverClose();
+    // the serving coroutine returns as the server socket is closed, the requests go on.
+    QSharedPointer<Coroutine> serve = d->operations->get("serve");
+    if (!serve.isNull()) {
+        serve->join();
+    }
+    d->drain(d->operations, drainMsecs);
+    d->drainMsecs.store(0);
+}
+
+
+void BaseStreamServerPrivate::drain(CoroutineGroup *operations, quint32 msecs)
+{
+    if (msecs > 0) {
+        try {
+            Timeout timeout(msecs, 0);
+            Q_UNUSED(timeout);
+            operations->joinall();
+        } catch (TimeoutException &) {
+            qCInfo(logger) << "server kills" << operations->size() << "requests after draining.";
+        }
+    }
+    operations->killall();
+}
+
+
+bool BaseStreamServer::useInheritedSocket()
+{
+    Q_D(BaseStreamServer);
+    bool ok = false;
+    int fd = qEnvironmentVariableIntValue("QTNG_LISTEN_FD", &ok);
+#ifdef Q_OS_UNIX
+    if (!ok && qEnvironmentVariableIntValue("LISTEN_FDS") >= 1
+            && qEnvironmentVariableIntValue("LISTEN_PID") == static_cast<int>(::getpid())) {
+        fd = 3;  // SD_LISTEN_FDS_START
+        ok = true;
+    }
+#endif
+    if (!ok || fd < 0) {
+        return false;
+    }
+    d->inheritedSocket = fd;
+    return true;
+}
+
+
+void BaseStreamServer::setInheritedSocket(qintptr fd)
+{
+    Q_D(BaseStreamServer);
+    d->inheritedSocket = fd;
+}
+
+
+qintptr BaseStreamServer::shareListeningSocket()
+{
+    Q_D(BaseStreamServer);
+#ifdef Q_OS_UNIX
+    if (!d->workers.isEmpty() || d->serverSocket->state() != Socket::ListeningState) {
+        return -1;
+    }
+    const int fd = static_cast<int>(d->serverSocket->fileno());
+    const int flags = ::fcntl(fd, F_GETFD);
+    if (flags == -1 || ::fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC) == -1) {
+        return -1;
+    }
+    return fd;
+#else
+    Q_UNUSED(d);
+    return -1;
+#endif
 }
 
 
@@ -224,6 +1257,13 @@ QHostAddress BaseStreamServer::serverAddress() const
 }
 
 
+QString BaseStreamServer::serverPath() const
+{
+    Q_D(const BaseStreamServer);
+    return d->serverPath;
+}
+
+
 bool BaseStreamServer::serviceActions()
 {
     return true;
@@ -236,6 +1276,18 @@ bool BaseStreamServer::verifyRequest(QSharedPointer<SocketLike>)
 }
 
 
+bool BaseStreamServer::prepareRequest(QSharedPointer<SocketLike>)
+{
+    return true;
+}
+
+
+void BaseStreamServer::rejectRequest(QSharedPointer<SocketLike> request)
+{
+    closeRequest(request);
+}
+
+
 void BaseStreamServer::processRequest(QSharedPointer<SocketLike>)
 {
 
@@ -245,15 +1297,21 @@ void BaseStreamServer::processRequest(QSharedPointer<SocketLike>)
 QSharedPointer<SocketLike> BaseStreamServer::getRequest()
 {
     Q_D(BaseStreamServer);
-    Socket *request = d->serverSocket->accept();
+    Socket *request = d->acceptRaw();
     if (request) {
-        return SocketLike::rawSocket(request);
+        return wrapRequest(QSharedPointer<Socket>(request));
     } else {
         return QSharedPointer<SocketLike>();
     }
 }
 
 
+QSharedPointer<SocketLike> BaseStreamServer::wrapRequest(QSharedPointer<Socket> request)
+{
+    return SocketLike::rawSocket(request);
+}
+
+
 void BaseStreamServer::handleError(QSharedPointer<SocketLike>)
 {
 }
@@ -309,21 +1367,97 @@ SslConfiguration BaseSslStreamServer::sslConfiguratino() const
 }
 
 
-QSharedPointer<SocketLike> BaseSslStreamServer::getRequest()
+void BaseSslStreamServer::setSessionTicketKeyLifetime(quint32 secs)
 {
     Q_D(BaseSslStreamServer);
-    while(true) {
-        Socket *request = d->serverSocket->accept();
-        if (request) {
-            QSharedPointer<SslSocket> sslSocket(new SslSocket(QSharedPointer<Socket>(request), d->configuration));
-            if (!sslSocket->handshake(true)) {
-                continue;
-            }
-            return SocketLike::sslSocket(sslSocket);
-        } else {
-            return QSharedPointer<SocketLike>();
+    d->configuration.setSessionTicketKeyLifetime(secs);
+}
+
+
+void BaseSslStreamServer::setSessionCacheSize(quint32 size)
+{
+    Q_D(BaseSslStreamServer);
+    d->configuration.setSessionCacheSize(size);
+}
+
+
+void BaseSslStreamServer::setHandshakeOffloaded(bool offloaded)
+{
+    Q_D(BaseSslStreamServer);
+    d->configuration.setHandshakeOffloaded(offloaded);
+}
+
+
+void BaseSslStreamServer::setServerNames(const SslServerNames &names)
+{
+    Q_D(BaseSslStreamServer);
+    d->configuration.setServerNames(names);
+}
+
+
+void BaseSslStreamServer::setOcspStapling(bool enabled)
+{
+    Q_D(BaseSslStreamServer);
+    if (!enabled) {
+        d->operations->kill(QStringLiteral("ocsp"));
+        d->configuration.setOcspResponse(QByteArray());
+        return;
+    }
+    // the response is shared by the copies of configuration, so the connections see the refreshed one.
+    SslConfiguration configuration = d->configuration;
+    d->operations->spawnWithName(QStringLiteral("ocsp"), [configuration] () mutable {
+        while (true) {
+            const qint64 secs = configuration.refreshOcspResponse();
+            Coroutine::sleep(secs > 0 ? static_cast<float>(secs) : 60.0f);
         }
+    }, true);
+}
+
+
+QSharedPointer<SocketLike> BaseSslStreamServer::getRequest()
+{
+    Q_D(BaseSslStreamServer);
+    Socket *request = d->acceptRaw();
+    if (!request) {
+        return QSharedPointer<SocketLike>();
     }
+    return wrapRequest(QSharedPointer<Socket>(request));
+}
+
+
+QSharedPointer<SocketLike> BaseSslStreamServer::wrapRequest(QSharedPointer<Socket> request)
+{
+    Q_D(BaseSslStreamServer);
+    QSharedPointer<SslSocket> sslSocket(new SslSocket(request, d->configuration));
+    return SocketLike::sslSocket(sslSocket);
+}
+
+
+// decrease the counter of handshakes while the handshake returns or is killed.
+struct HandshakeGuard
+{
+    explicit HandshakeGuard(QAtomicInt *counter)
+        :counter(counter) {}
+    ~HandshakeGuard() { counter->deref(); }
+    QAtomicInt *counter;
+};
+
+
+bool BaseSslStreamServer::prepareRequest(QSharedPointer<SocketLike> request)
+{
+    Q_D(BaseSslStreamServer);
+    QSharedPointer<SslSocket> sslSocket = convertSocketLikeToSslSocket(request);
+    if (sslSocket.isNull()) {
+        return false;
+    }
+    const int pending = d->pendingHandshakes.fetchAndAddRelaxed(1);
+    HandshakeGuard guard(&d->pendingHandshakes);
+    Q_UNUSED(guard);
+    if (d->maxPendingHandshakes > 0 && pending >= d->maxPendingHandshakes) {
+        d->rejectedConnections.fetchAndAddRelaxed(1);
+        return false;
+    }
+    return sslSocket->handshake(true);
 }
 
 
@@ -332,6 +1466,41 @@ bool BaseSslStreamServer::isSecure() const
     return true;
 }
 
+
+void AlpnSslServer::addHandler(const QByteArray &protocol, const HandlerFactory &factory)
+{
+    if (!handlers.contains(protocol)) {
+        SslConfiguration configuration = sslConfiguratino();
+        QList<QByteArray> protocols = configuration.allowedNextProtocols();
+        protocols.append(protocol);
+        configuration.setAllowedNextProtocols(protocols);
+        setSslConfiguration(configuration);
+    }
+    handlers.insert(protocol, factory);
+}
+
+
+void AlpnSslServer::setDefaultHandler(const HandlerFactory &factory)
+{
+    defaultHandler = factory;
+}
+
+
+void AlpnSslServer::processRequest(QSharedPointer<SocketLike> request)
+{
+    QSharedPointer<SslSocket> sslSocket = convertSocketLikeToSslSocket(request);
+    const QByteArray &protocol = sslSocket.isNull() ? QByteArray() : sslSocket->negotiatedProtocol();
+    HandlerFactory factory = handlers.value(protocol);
+    if (!factory) {
+        factory = defaultHandler;
+    }
+    if (!factory) {
+        qCDebug(logger) << "no handler for alpn protocol:" << protocol;
+        return;
+    }
+    factory(request, this);
+}
+
 #endif
 
 
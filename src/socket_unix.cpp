@@ -2,17 +2,68 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <stddef.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <QtCore/qvarlengtharray.h>
 #include "../include/private/socket_p.h"
+#include "../include/coroutine_utils.h"
 
 #ifndef SOCK_NONBLOCK
 # define SOCK_NONBLOCK O_NONBLOCK
 #endif
 
+#if defined(Q_OS_LINUX) || defined(Q_OS_ANDROID)
+#include <sys/sendfile.h>
+#define QTNG_HAVE_LINUX_SENDFILE
+#elif defined(Q_OS_MACOS) || defined(Q_OS_FREEBSD)
+#include <sys/uio.h>
+#define QTNG_HAVE_BSD_SENDFILE
+#endif
+
+#ifdef Q_OS_LINUX
+#include <netinet/udp.h>
+#ifndef SOL_UDP
+# define SOL_UDP 17
+#endif
+// the headers of old glibc do not define them, setsockopt() fails with ENOPROTOOPT on old kernels.
+#ifndef UDP_SEGMENT
+# define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+# define UDP_GRO 104
+#endif
+#ifndef TCP_FASTOPEN_CONNECT
+# define TCP_FASTOPEN_CONNECT 30
+#endif
+#ifndef SO_BUSY_POLL
+# define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+# define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef TCP_NOTSENT_LOWAT
+# define TCP_NOTSENT_LOWAT 25
+#endif
+#include <linux/errqueue.h>
+#ifndef SO_ZEROCOPY
+# define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+# define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+# define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+# define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#endif
+
 #ifdef Q_OS_UNIX
     #ifdef Q_OS_ANDROID
         #include <unistd.h>
@@ -41,6 +92,7 @@ union qt_sockaddr {
     sockaddr a;
     sockaddr_in a4;
     sockaddr_in6 a6;
+    sockaddr_un un;
 };
 
 static void qt_ignore_sigpipe()
@@ -59,15 +111,52 @@ static void qt_ignore_sigpipe()
     }
 }
 
+// the io_uring eventloop runs the operation and resumes the coroutine with its result, so there is no EAGAIN and no
+// readiness to wait. returns false if the eventloop of this thread does not submit socket operations, errno is set
+// if *result is negative. ECANCELED means the socket is closed meanwhile.
+static inline bool qt_socket_submit(EventLoopCoroutine::IoOperation operation, int fd, void *data, size_t size,
+                                    qt_sockaddr *aa, QT_SOCKLEN_T *aaSize, ssize_t *result)
+{
+#ifdef QTNETWOKRNG_USE_IO_URING
+    CancelScope::check();
+    quint32 addressSize = aaSize ? static_cast<quint32>(*aaSize) : 0;
+    qint64 r;
+    do {
+        if (!EventLoopCoroutine::get()->submitIo(operation, fd, data, static_cast<quint32>(size),
+                                                 aa, &addressSize, &r)) {
+            return false;
+        }
+    } while (r == -EINTR);
+    if (aaSize) {
+        *aaSize = static_cast<QT_SOCKLEN_T>(addressSize);
+    }
+    if (r < 0) {
+        errno = static_cast<int>(-r);
+        *result = -1;
+    } else {
+        *result = static_cast<ssize_t>(r);
+    }
+    return true;
+#else
+    Q_UNUSED(operation);
+    Q_UNUSED(fd);
+    Q_UNUSED(data);
+    Q_UNUSED(size);
+    Q_UNUSED(aa);
+    Q_UNUSED(aaSize);
+    Q_UNUSED(result);
+    return false;
+#endif
+}
+
 static inline void qt_socket_getPortAndAddress(const qt_sockaddr *s, quint16 *port, QHostAddress *addr)
 {
     if (s->a.sa_family == AF_INET6) {
         Q_IPV6ADDR tmp;
         memcpy(&tmp, &s->a6.sin6_addr, sizeof(tmp));
         if (addr) {
-            QHostAddress tmpAddress;
-            tmpAddress.setAddress(tmp);
-            *addr = tmpAddress;
+            // set the address in place, a temporary QHostAddress would allocate its private for every datagram.
+            addr->setAddress(tmp);
             if (s->a6.sin6_scope_id) {
                 char scopeid[IFNAMSIZ];
                 if (::if_indextoname(s->a6.sin6_scope_id, scopeid)) {
@@ -81,15 +170,71 @@ static inline void qt_socket_getPortAndAddress(const qt_sockaddr *s, quint16 *po
             *port = ntohs(s->a6.sin6_port);
     } else if(s->a.sa_family == AF_INET) {
         if (addr) {
-            QHostAddress tmpAddress;
-            tmpAddress.setAddress(ntohl(s->a4.sin_addr.s_addr));
-            *addr = tmpAddress;
+            addr->setAddress(ntohl(s->a4.sin_addr.s_addr));
         }
         if (port)
             *port = ntohs(s->a4.sin_port);
+    } else if (s->a.sa_family == AF_UNIX || s->a.sa_family == AF_UNSPEC) {
+        // unix sockets have paths instead, and the unbound peer has nothing.
+        if (addr)
+            addr->clear();
+        if (port)
+            *port = 0;
+    } else {
+        qFatal("qt_socket_getPortAndAddress() can only handle AF_INET6, AF_INET and AF_UNIX.");
+    }
+}
+
+
+// the scope id of ipv6 is dropped, use the QHostAddress version for the link local peers.
+static inline void qt_socket_getEndpoint(const qt_sockaddr *s, Endpoint *endpoint)
+{
+    if (s->a.sa_family == AF_INET6) {
+        memcpy(endpoint->address, &s->a6.sin6_addr, sizeof(endpoint->address));
+        endpoint->port = ntohs(s->a6.sin6_port);
+        endpoint->family = Endpoint::IPv6;
+    } else if (s->a.sa_family == AF_INET) {
+        *endpoint = Endpoint::fromIPv4(ntohl(s->a4.sin_addr.s_addr), ntohs(s->a4.sin_port));
     } else {
-        qFatal("qt_socket_getPortAndAddress() can only handle AF_INET6 and AF_INET.");
+        *endpoint = Endpoint();
+    }
+}
+
+
+// a leading '@' means the abstract namespace of linux, the name is not terminated by zero.
+static bool qt_socket_setPath(const QString &path, qt_sockaddr *aa, QT_SOCKLEN_T *sockAddrSize)
+{
+    const QByteArray &encoded = QFile::encodeName(path);
+    if (encoded.isEmpty() || encoded.size() >= static_cast<int>(sizeof(aa->un.sun_path))) {
+        return false;
+    }
+    memset(&aa->un, 0, sizeof(sockaddr_un));
+    aa->un.sun_family = AF_UNIX;
+    memcpy(aa->un.sun_path, encoded.constData(), static_cast<size_t>(encoded.size()));
+#ifdef Q_OS_LINUX
+    if (encoded.at(0) == '@') {
+        aa->un.sun_path[0] = '\0';
+        *sockAddrSize = static_cast<QT_SOCKLEN_T>(offsetof(sockaddr_un, sun_path) + static_cast<size_t>(encoded.size()));
+        return true;
+    }
+#endif
+    *sockAddrSize = static_cast<QT_SOCKLEN_T>(offsetof(sockaddr_un, sun_path) + static_cast<size_t>(encoded.size()) + 1);
+    return true;
+}
+
+
+static QString qt_socket_getPath(const qt_sockaddr *aa, QT_SOCKLEN_T sockAddrSize)
+{
+    const size_t offset = offsetof(sockaddr_un, sun_path);
+    if (aa->a.sa_family != AF_UNIX || sockAddrSize <= offset) {
+        return QString();  // unnamed.
+    }
+    const size_t size = qMin<size_t>(sockAddrSize - offset, sizeof(aa->un.sun_path));
+    const char *name = aa->un.sun_path;
+    if (name[0] == '\0') {
+        return QLatin1Char('@') + QFile::decodeName(QByteArray(name + 1, static_cast<int>(size - 1)));
     }
+    return QFile::decodeName(QByteArray(name, static_cast<int>(qstrnlen(name, static_cast<uint>(size)))));
 }
 
 bool SocketPrivate::createSocket()
@@ -99,6 +244,8 @@ bool SocketPrivate::createSocket()
     int family = AF_INET;
     if(protocol == Socket::IPv6Protocol || protocol == Socket::AnyIPProtocol) {
         family = AF_INET6;
+    } else if(protocol == Socket::UnixProtocol) {
+        family = AF_UNIX;
     }
     if(type == Socket::TcpSocket)
         flags = SOCK_STREAM | flags;
@@ -181,6 +328,28 @@ void SocketPrivate::setPortAndAddress(quint16 port, const QHostAddress &address,
 }
 
 
+void SocketPrivate::setEndpoint(const Endpoint &endpoint, qt_sockaddr *aa, int *sockAddrSize)
+{
+    if (endpoint.family == Endpoint::IPv6
+        || protocol == Socket::IPv6Protocol
+        || protocol == Socket::AnyIPProtocol) {
+        memset(&aa->a6, 0, sizeof(sockaddr_in6));
+        aa->a6.sin6_family = AF_INET6;
+        aa->a6.sin6_port = htons(endpoint.port);
+        memcpy(&aa->a6.sin6_addr, endpoint.address, sizeof(endpoint.address));
+        *sockAddrSize = sizeof(sockaddr_in6);
+        SetSALen::set(&aa->a, sizeof(sockaddr_in6));
+    } else {
+        memset(&aa->a, 0, sizeof(sockaddr_in));
+        aa->a4.sin_family = AF_INET;
+        aa->a4.sin_port = htons(endpoint.port);
+        memcpy(&aa->a4.sin_addr, endpoint.address + 12, 4);
+        *sockAddrSize = sizeof(sockaddr_in);
+        SetSALen::set(&aa->a, sizeof(sockaddr_in));
+    }
+}
+
+
 bool SocketPrivate::bind(const QHostAddress &address, quint16 port, Socket::BindMode mode)
 {
     if(!isValid())
@@ -196,6 +365,9 @@ bool SocketPrivate::bind(const QHostAddress &address, quint16 port, Socket::Bind
     if(mode & Socket::ReuseAddressHint) {
         setOption(Socket::AddressReusable, true);
     }
+    if(mode & Socket::ReusePortHint) {
+        setOption(Socket::ReusePortOption, true);
+    }
 #ifdef IPV6_V6ONLY
     if (aa.a.sa_family == AF_INET6) {
         int ipv6only = 0;
@@ -250,10 +422,15 @@ bool SocketPrivate::connect(const QHostAddress &address, quint16 port)
     if(state != Socket::UnconnectedState && state != Socket::BoundState && state != Socket::ConnectingState)
         return false;
     qt_sockaddr aa;
-    QT_SOCKLEN_T sockAddrSize;
     int t;
     setPortAndAddress(port, address, &aa, &t);
-    sockAddrSize = static_cast<QT_SOCKLEN_T>(t);
+    return connect(&aa, t);
+}
+
+
+bool SocketPrivate::connect(const qt_sockaddr *aa, int t)
+{
+    const QT_SOCKLEN_T sockAddrSize = static_cast<QT_SOCKLEN_T>(t);
     state = Socket::ConnectingState;
     ScopedIoWatcher watcher(EventLoopCoroutine::Write, fd);
     while(true) {
@@ -262,9 +439,15 @@ bool SocketPrivate::connect(const QHostAddress &address, quint16 port)
         if(state != Socket::ConnectingState)
             return false;
         int result;
-        do {
-            result = ::connect(fd, &aa.a, sockAddrSize);
-        } while(result < 0 && errno == EINTR);
+        QT_SOCKLEN_T submittedSize = sockAddrSize;
+        ssize_t submitted;
+        if(qt_socket_submit(EventLoopCoroutine::Connect, fd, nullptr, 0, const_cast<qt_sockaddr*>(aa), &submittedSize, &submitted)) {
+            result = static_cast<int>(submitted);
+        } else {
+            do {
+                result = ::connect(fd, &aa->a, sockAddrSize);
+            } while(result < 0 && errno == EINTR);
+        }
         if(result >= 0) {
             state = Socket::ConnectedState;
             fetchConnectionParameters();
@@ -278,11 +461,20 @@ bool SocketPrivate::connect(const QHostAddress &address, quint16 port)
             return true;
         case EINPROGRESS:
         case EALREADY:
+            break;
+        case ECANCELED:
+            continue;
         case EAGAIN:
+            if(protocol == Socket::UnixProtocol) {
+                // the listen queue of unix socket is full, and the unconnected socket is always writable.
+                Coroutine::msleep(1);
+                continue;
+            }
             break;
 
         case ECONNREFUSED:
         case EINVAL:
+        case ENOENT:
             setError(Socket::ConnectionRefusedError, ConnectionRefusedErrorString);
             state = Socket::UnconnectedState;
             return false;
@@ -328,7 +520,7 @@ bool SocketPrivate::connect(const QHostAddress &address, quint16 port)
             state = Socket::UnconnectedState;
             return false;
         }
-        watcher.start();
+        waitWatcher(watcher);
     }
 }
 
@@ -336,21 +528,47 @@ bool SocketPrivate::connect(const QHostAddress &address, quint16 port)
 
 bool SocketPrivate::close()
 {
+#ifdef Q_OS_LINUX
+    keepZeroCopyBuffers();
+#endif
     if(fd > 0) {
         ::close(fd);
         EventLoopCoroutine::get()->triggerIoWatchers(fd);
         fd = -1;
     }
+#ifdef Q_OS_LINUX
+    if(splicePipe[0] >= 0) {
+        ::close(splicePipe[0]);
+        ::close(splicePipe[1]);
+        splicePipe[0] = splicePipe[1] = -1;
+    }
+    splicePending = 0;
+    zeroCopyNext = 0;
+#endif
     state = Socket::UnconnectedState;
     localAddress.clear();
     localPort = 0;
     peerAddress.clear();
     peerPort = 0;
+    localPath.clear();
+    peerPath.clear();
     readGate->open();
     writeGate->open();
     return true;
 }
 
+bool SocketPrivate::shutdownWrite()
+{
+    if (!isValid() || state != Socket::ConnectedState) {
+        return false;
+    }
+    if (::shutdown(fd, SHUT_WR) < 0) {
+        setError(Socket::UnknownSocketError, UnknownSocketErrorString);
+        return false;
+    }
+    return true;
+}
+
 bool SocketPrivate::listen(int backlog)
 {
     if(!isValid())
@@ -375,12 +593,80 @@ bool SocketPrivate::listen(int backlog)
 }
 
 
+bool SocketPrivate::bindPath(const QString &path)
+{
+    if(!isValid())
+        return false;
+    if(state != Socket::UnconnectedState)
+        return false;
+    if(protocol != Socket::UnixProtocol) {
+        setError(Socket::UnsupportedSocketOperationError, ProtocolUnsupportedErrorString);
+        return false;
+    }
+    qt_sockaddr aa;
+    QT_SOCKLEN_T sockAddrSize;
+    if(!qt_socket_setPath(path, &aa, &sockAddrSize)) {
+        setError(Socket::SocketAddressNotAvailableError, AddressNotAvailableErrorString);
+        return false;
+    }
+    if(::bind(fd, &aa.a, sockAddrSize) < 0) {
+        switch(errno)
+        {
+        case EADDRINUSE:
+            setError(Socket::AddressInUseError, AddressInuseErrorString);
+            break;
+        case EACCES:
+        case EPERM:
+        case EROFS:
+            setError(Socket::SocketAccessError, AddressProtectedErrorString);
+            break;
+        case ENOENT:
+        case ENOTDIR:
+        case ENAMETOOLONG:
+        case EADDRNOTAVAIL:
+            setError(Socket::SocketAddressNotAvailableError, AddressNotAvailableErrorString);
+            break;
+        default:
+            setError(Socket::UnknownSocketError, UnknownSocketErrorString);
+            break;
+        }
+        return false;
+    }
+    state = Socket::BoundState;
+    localPath = path;
+    return true;
+}
+
+
+bool SocketPrivate::connectPath(const QString &path)
+{
+    if(!isValid())
+        return false;
+    if(state != Socket::UnconnectedState && state != Socket::BoundState && state != Socket::ConnectingState)
+        return false;
+    if(protocol != Socket::UnixProtocol) {
+        setError(Socket::UnsupportedSocketOperationError, ProtocolUnsupportedErrorString);
+        return false;
+    }
+    qt_sockaddr aa;
+    QT_SOCKLEN_T sockAddrSize;
+    if(!qt_socket_setPath(path, &aa, &sockAddrSize)) {
+        setError(Socket::SocketAddressNotAvailableError, AddressNotAvailableErrorString);
+        return false;
+    }
+    return connect(&aa, static_cast<int>(sockAddrSize));
+}
+
+
 bool SocketPrivate::fetchConnectionParameters()
 {
+    localAddressPending = false;
     localPort = 0;
     localAddress.clear();
     peerPort = 0;
     peerAddress.clear();
+    localPath.clear();
+    peerPath.clear();
 
     if (fd == -1)
         return false;
@@ -402,6 +688,10 @@ bool SocketPrivate::fetchConnectionParameters()
         case AF_INET6:
             protocol = Socket::IPv6Protocol;
             break;
+        case AF_UNIX:
+            protocol = Socket::UnixProtocol;
+            localPath = qt_socket_getPath(&sa, sockAddrSize);
+            break;
         default:
             protocol = Socket::UnknownNetworkLayerProtocol;
             break;
@@ -431,8 +721,12 @@ bool SocketPrivate::fetchConnectionParameters()
 #endif
 
     // Determine the remote address
-    if (!::getpeername(fd, &sa.a, &sockAddrSize))
+    sockAddrSize = sizeof(sa);
+    memset(&sa, 0, sizeof(sa));
+    if (!::getpeername(fd, &sa.a, &sockAddrSize)) {
         qt_socket_getPortAndAddress(&sa, &peerPort, &peerAddress);
+        peerPath = qt_socket_getPath(&sa, sockAddrSize);
+    }
 
     // Determine the socket type (UDP/TCP)
     int value = 0;
@@ -440,6 +734,14 @@ bool SocketPrivate::fetchConnectionParameters()
     if (::getsockopt(fd, SOL_SOCKET, SO_TYPE, &value, &valueSize) == 0) {
         if (value == SOCK_STREAM) {
             type = Socket::TcpSocket;
+#ifdef SO_ACCEPTCONN
+            // the listening socket inherited from another process.
+            int listening = 0;
+            socklen_t listeningSize = sizeof(int);
+            if (::getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &listeningSize) == 0 && listening) {
+                state = Socket::ListeningState;
+            }
+#endif
         } else if (value == SOCK_DGRAM) {
             type = Socket::UdpSocket;
             state = Socket::UnconnectedState;
@@ -464,9 +766,11 @@ qint32 SocketPrivate::recv(char *data, qint32 size, bool all)
             return total == 0 ? -1: total;
         }
         ssize_t r = 0;
-        do {
-            r = ::recv(fd, data + total, static_cast<size_t>(size - total), 0);
-        } while(r < 0 && errno == EINTR);
+        if(!qt_socket_submit(EventLoopCoroutine::Recv, fd, data + total, static_cast<size_t>(size - total), nullptr, nullptr, &r)) {
+            do {
+                r = ::recv(fd, data + total, static_cast<size_t>(size - total), 0);
+            } while(r < 0 && errno == EINTR);
+        }
 
         if (r < 0) {
             int e = errno;
@@ -476,6 +780,8 @@ qint32 SocketPrivate::recv(char *data, qint32 size, bool all)
 #endif
             case EAGAIN:
                 break;
+            case ECANCELED:
+                continue;
             case ECONNRESET:
 #if defined(Q_OS_VXWORKS)
             case ESHUTDOWN:
@@ -505,15 +811,48 @@ qint32 SocketPrivate::recv(char *data, qint32 size, bool all)
                 return total;
             }
         }
-        watcher.start();
+        waitWatcher(watcher);
     }
     return total;
 }
 
-// openbsd do not support MSG_MORE?
-#ifndef MSG_MORE
-#define MSG_MORE 0
+bool SocketPrivate::connect(const QHostAddress &address, quint16 port, const QByteArray &initialData)
+{
+    if(!isValid())
+        return false;
+    if(state != Socket::UnconnectedState && state != Socket::BoundState)
+        return false;
+    qint32 sent = 0;
+#ifdef MSG_FASTOPEN
+    if(type == Socket::TcpSocket && !initialData.isEmpty()) {
+        qt_sockaddr aa;
+        int t;
+        setPortAndAddress(port, address, &aa, &t);
+        ssize_t result;
+        do {
+            result = ::sendto(fd, initialData.constData(), static_cast<size_t>(initialData.size()),
+                              MSG_FASTOPEN | MSG_NOSIGNAL, &aa.a, static_cast<QT_SOCKLEN_T>(t));
+        } while(result < 0 && errno == EINTR);
+        // EINPROGRESS means there is no cookie yet, the SYN is sent without data. other errors are
+        // reported by the connect() below.
+        if(result > 0) {
+            sent = static_cast<qint32>(result);
+        }
+        if(result >= 0 || errno == EINPROGRESS) {
+            state = Socket::ConnectingState;
+        }
+    }
 #endif
+    // connect() waits for the handshake which is started by sendto(), or starts it.
+    if(!connect(address, port)) {
+        return false;
+    }
+    if(sent < initialData.size()) {
+        return send(initialData.constData() + sent, initialData.size() - sent, true) == initialData.size() - sent;
+    }
+    return true;
+}
+
 
 qint32 SocketPrivate::send(const char *data, qint32 size, bool all)
 {
@@ -529,9 +868,12 @@ qint32 SocketPrivate::send(const char *data, qint32 size, bool all)
             return sent;
         }
         ssize_t w;
-        do {
-            w = ::send(fd, data + sent, static_cast<size_t>(size - sent), all ? 0 : MSG_MORE);
-        } while(w < 0 && errno == EINTR);
+        if(!qt_socket_submit(EventLoopCoroutine::Send, fd, const_cast<char*>(data + sent), static_cast<size_t>(size - sent),
+                             nullptr, nullptr, &w)) {
+            do {
+                w = ::send(fd, data + sent, static_cast<size_t>(size - sent), 0);
+            } while(w < 0 && errno == EINTR);
+        }
         if(w > 0) {
             if(!all) {
                 return static_cast<qint32>(w);
@@ -550,6 +892,8 @@ qint32 SocketPrivate::send(const char *data, qint32 size, bool all)
                     return sent;
                 }
                 break;
+            case ECANCELED:
+                continue;
             case EACCES:
                 setError(Socket::SocketAccessError, AccessErrorString);
                 close();
@@ -578,172 +922,1156 @@ qint32 SocketPrivate::send(const char *data, qint32 size, bool all)
                 return sent;
             }
         }
-        watcher.start();
+        waitWatcher(watcher);
     }
     return sent;
 }
 
 
-qint32 SocketPrivate::recvfrom(char *data, qint32 maxSize, QHostAddress *addr, quint16 *port)
+bool SocketPrivate::setZeroCopyThreshold(qint32 bytes)
 {
-    if(!isValid()) {
-        return -1;
+#ifdef Q_OS_LINUX
+    if(bytes <= 0) {
+        zeroCopyThreshold = 0;
+        return true;
     }
+    if(!isValid() || type != Socket::TcpSocket) {
+        return false;
+    }
+    int on = 1;
+    if(::setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) {
+        return false;
+    }
+    zeroCopyThreshold = bytes;
+    return true;
+#else
+    Q_UNUSED(bytes);
+    return false;
+#endif
+}
 
-    if(maxSize <= 0)
-        return -1;
-
-    struct msghdr msg;
-    struct iovec vec;
-    qt_sockaddr aa;
-    memset(&msg, 0, sizeof(msg));
-    memset(&aa, 0, sizeof(aa));
-
-    vec.iov_base = data;
-    vec.iov_len = static_cast<size_t>(maxSize);
-    msg.msg_iov = &vec;
-    msg.msg_iovlen = 1;
-    msg.msg_name = &aa;
-    msg.msg_namelen = sizeof(aa);
 
-    ssize_t recvResult = 0;
-    ScopedIoWatcher watcher(EventLoopCoroutine::Read, fd);
-    while(true) {
-        if(!isValid()){
-            setError(Socket::SocketAccessError, AccessErrorString);
-            return -1;
+#ifdef Q_OS_LINUX
+// the data is referenced by zeroCopyPending until reapZeroCopy() gets the completion, so the caller may
+// drop its copy at once. a QByteArray changed by caller is detached, the sending one is never touched.
+qint32 SocketPrivate::sendZeroCopy(const QByteArray &data)
+{
+    if(!isValid()) {
+        return 0;
+    }
+    reapZeroCopy();
+    const char *p = data.constData();
+    const qint32 size = data.size();
+    qint32 sent = 0;
+    ScopedIoWatcher watcher(EventLoopCoroutine::Write, fd);
+    while(sent < size) {
+        if(!isValid()) {
+            return sent;
         }
+        ssize_t w;
         do {
-            recvResult = ::recvmsg(fd, &msg, 0);
-        } while (recvResult == -1 && errno == EINTR);
-
-        if (recvResult < 0) {
-            int e = errno;
-            switch (e) {
-#if EWOULDBLOCK-0 && EWOULDBLOCK != EAGAIN
-            case EWOULDBLOCK:
-#endif
-            case EAGAIN:
-                break;
-            case ECONNRESET:
-            case ECONNREFUSED:
-            case ENOTCONN:
-#if defined(Q_OS_VXWORKS)
-            case ESHUTDOWN:
-#endif
-                if(type == Socket::TcpSocket) {
-                    setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
-                    close();
-                }
-                return -1;
-            case ENOMEM:
-                setError(Socket::SocketResourceError, ResourceErrorString);
-                return -1;
-            case ENOTSOCK:
-            case EBADF:
-            case EINVAL:
-            case EIO:
-            case EFAULT:
-            default:
-                setError(Socket::NetworkError, InvalidSocketErrorString);
-                close();
-                return -1;
-            }
-        } else{
-            qt_socket_getPortAndAddress(&aa, port, addr);
-            //return qint64(maxSize ? recvResult : recvResult == -1 ? -1 : 0);
-            return static_cast<qint32>(recvResult);
+            w = ::send(fd, p + sent, static_cast<size_t>(size - sent), MSG_ZEROCOPY);
+        } while(w < 0 && errno == EINTR);
+        if(w > 0) {
+            zeroCopyPending.insert(zeroCopyNext++, data);
+            startZeroCopyReaper();
+            sent += static_cast<qint32>(w);
+            continue;
         }
-        watcher.start();
+        if(w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            reapZeroCopy();
+            waitWatcher(watcher);
+            continue;
+        }
+        // ENOBUFS means the pinned pages exceed optmem_max. copy the rest, send() reports other errors.
+        break;
+    }
+    if(sent < size && isValid()) {
+        const qint32 rest = send(p + sent, size - sent, true);
+        if(rest < 0) {
+            return sent > 0 ? sent : -1;
+        }
+        return sent + rest;
     }
+    return sent;
 }
 
 
-qint32 SocketPrivate::sendto(const char *data, qint32 size, const QHostAddress &addr, quint16 port)
+// read the completions of MSG_ZEROCOPY from the error queue, it never blocks. returns true if the kernel
+// copied the data anyway.
+static bool reapZeroCopyCompletions(int fd, QMap<quint32, QByteArray> *pending)
 {
-    if(!isValid()) {
-        return -1;
+    bool copied = false;
+    while(!pending->isEmpty()) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t r;
+        do {
+            r = ::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        } while(r < 0 && errno == EINTR);
+        if(r < 0) {
+            return copied;
+        }
+        for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if(!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                    && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            const struct sock_extended_err *serr = reinterpret_cast<const struct sock_extended_err*>(CMSG_DATA(cmsg));
+            if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // the kernel copied the data anyway, such as sending to loopback. pinning pages is useless then.
+            if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                copied = true;
+            }
+            for(quint32 id = serr->ee_info;; ++id) {
+                pending->remove(id);
+                if(id == serr->ee_data) {
+                    break;
+                }
+            }
+        }
+    }
+    return copied;
+}
+
+
+void SocketPrivate::reapZeroCopy()
+{
+    if(fd > 0 && reapZeroCopyCompletions(fd, &zeroCopyPending)) {
+        zeroCopyThreshold = 0;
+    }
+}
+
+
+// the completions arrive as the peer acknowledges the data, so they are polled while any is pending. the error
+// queue only raises POLLERR, which a read watcher of the socket would report together with every readable data.
+static const quint32 ZeroCopyReapInterval = 20;
+// how long a closed socket waits for its completions. the buffers are freed then, the kernel may still send them.
+static const qint64 ZeroCopyDrainTimeout = 1000 * 60;
+
+
+void SocketPrivate::startZeroCopyReaper()
+{
+    if(zeroCopyReaper) {
+        return;
+    }
+    zeroCopyReaper = EventLoopCoroutine::get()->callLater(ZeroCopyReapInterval, makeFunctor([this] {
+        zeroCopyReaper = 0;
+        reapZeroCopy();
+        if(!zeroCopyPending.isEmpty()) {
+            startZeroCopyReaper();
+        }
+    }));
+}
+
+
+// a duplicated descriptor keeps the socket of a closed one, so the completions of its sends still arrive.
+struct ZeroCopyDrain
+{
+    ZeroCopyDrain(int fd, const QMap<quint32, QByteArray> &pending)
+        :fd(fd), pending(pending), deadline(QElapsedTimer::msecsSinceReference() + ZeroCopyDrainTimeout) {}
+    ~ZeroCopyDrain() { ::close(fd); }
+    int fd;
+    QMap<quint32, QByteArray> pending;
+    qint64 deadline;
+};
+
+
+static void drainZeroCopyLater(QSharedPointer<ZeroCopyDrain> drain)
+{
+    EventLoopCoroutine::get()->callLater(ZeroCopyReapInterval, makeFunctor([drain] {
+        reapZeroCopyCompletions(drain->fd, &drain->pending);
+        if(!drain->pending.isEmpty() && QElapsedTimer::msecsSinceReference() < drain->deadline) {
+            drainZeroCopyLater(drain);
+        }
+    }));
+}
+
+
+void SocketPrivate::keepZeroCopyBuffers()
+{
+    if(zeroCopyReaper) {
+        EventLoopCoroutine::get()->cancelCall(zeroCopyReaper);
+        zeroCopyReaper = 0;
+    }
+    reapZeroCopy();
+    if(zeroCopyPending.isEmpty() || fd <= 0) {
+        zeroCopyPending.clear();
+        return;
+    }
+    const int keeper = ::dup(fd);
+    if(keeper >= 0) {
+        // the peer gets the fin after the queued data, as if the socket were closed.
+        ::shutdown(keeper, SHUT_WR);
+        drainZeroCopyLater(QSharedPointer<ZeroCopyDrain>(new ZeroCopyDrain(keeper, zeroCopyPending)));
+    }
+    zeroCopyPending.clear();
+}
+#endif
+
+
+qint32 SocketPrivate::recvfrom(char *data, qint32 maxSize, QHostAddress *addr, quint16 *port)
+{
+    qt_sockaddr aa;
+    qint32 r = recvfrom(data, maxSize, &aa);
+    if (r >= 0) {
+        qt_socket_getPortAndAddress(&aa, port, addr);
     }
+    return r;
+}
+
+
+qint32 SocketPrivate::recvfrom(char *data, qint32 maxSize, Endpoint *endpoint)
+{
+    qt_sockaddr aa;
+    qint32 r = recvfrom(data, maxSize, &aa);
+    if (r >= 0 && endpoint) {
+        qt_socket_getEndpoint(&aa, endpoint);
+    }
+    return r;
+}
+
+
+qint32 SocketPrivate::recvfrom(char *data, qint32 maxSize, qt_sockaddr *aa)
+{
+    if(!isValid()) {
+        return -1;
+    }
+
+    if(maxSize <= 0)
+        return -1;
+
     struct msghdr msg;
     struct iovec vec;
+    memset(&msg, 0, sizeof(msg));
+    memset(aa, 0, sizeof(*aa));
+
+    vec.iov_base = data;
+    vec.iov_len = static_cast<size_t>(maxSize);
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+    msg.msg_name = aa;
+    msg.msg_namelen = sizeof(*aa);
+
+    ssize_t recvResult = 0;
+    ScopedIoWatcher watcher(EventLoopCoroutine::Read, fd);
+    while(true) {
+        if(!isValid()){
+            setError(Socket::SocketAccessError, AccessErrorString);
+            return -1;
+        }
+        do {
+            recvResult = ::recvmsg(fd, &msg, 0);
+        } while (recvResult == -1 && errno == EINTR);
+
+        if (recvResult < 0) {
+            int e = errno;
+            switch (e) {
+#if EWOULDBLOCK-0 && EWOULDBLOCK != EAGAIN
+            case EWOULDBLOCK:
+#endif
+            case EAGAIN:
+                break;
+            case ECONNRESET:
+            case ECONNREFUSED:
+            case ENOTCONN:
+#if defined(Q_OS_VXWORKS)
+            case ESHUTDOWN:
+#endif
+                if(type == Socket::TcpSocket) {
+                    setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
+                    close();
+                }
+                return -1;
+            case ENOMEM:
+                setError(Socket::SocketResourceError, ResourceErrorString);
+                return -1;
+            case ENOTSOCK:
+            case EBADF:
+            case EINVAL:
+            case EIO:
+            case EFAULT:
+            default:
+                setError(Socket::NetworkError, InvalidSocketErrorString);
+                close();
+                return -1;
+            }
+        } else{
+            //return qint64(maxSize ? recvResult : recvResult == -1 ? -1 : 0);
+            return static_cast<qint32>(recvResult);
+        }
+        waitWatcher(watcher);
+    }
+}
+
+
+qint32 SocketPrivate::sendto(const char *data, qint32 size, const QHostAddress &addr, quint16 port)
+{
     qt_sockaddr aa;
-    QT_SOCKLEN_T len;
+    int t;
+    setPortAndAddress(port, addr, &aa, &t);
+    return sendto(data, size, &aa, t);
+}
+
+
+qint32 SocketPrivate::sendto(const char *data, qint32 size, const Endpoint &endpoint)
+{
+    qt_sockaddr aa;
+    int t;
+    setEndpoint(endpoint, &aa, &t);
+    return sendto(data, size, &aa, t);
+}
+
+
+qint32 SocketPrivate::sendto(const char *data, qint32 size, const qt_sockaddr *aa, int sockAddrSize)
+{
+    if(!isValid()) {
+        return -1;
+    }
+    struct msghdr msg;
+    struct iovec vec;
 
     memset(&msg, 0, sizeof(msg));
-    memset(&aa, 0, sizeof(aa));
     vec.iov_base = const_cast<char *>(data);
     vec.iov_len = static_cast<size_t>(size);
     msg.msg_iov = &vec;
     msg.msg_iovlen = 1;
-    msg.msg_name = &aa.a;
+    msg.msg_name = const_cast<sockaddr *>(&aa->a);
+    msg.msg_namelen = static_cast<QT_SOCKLEN_T>(sockAddrSize);
 
-    int t;
-    setPortAndAddress(port, addr, &aa, &t);
-    len = static_cast<QT_SOCKLEN_T>(t);
-    msg.msg_namelen = len;
+    ssize_t sentBytes = 0;
+    ScopedIoWatcher watcher(EventLoopCoroutine::Write, fd);
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+    while(true) {
+        if (!isValid()) {
+            return -1;
+        }
+        do {
+            sentBytes = ::sendmsg(fd, &msg, flags);
+        } while(sentBytes == -1 && error == EINTR);
+
+        if(sentBytes < 0) {
+            int e = errno;
+            switch(e)
+            {
+#if EWOULDBLOCK-0 && EWOULDBLOCK != EAGAIN
+            case EWOULDBLOCK:
+#endif
+            case EAGAIN:
+                break;
+            case EACCES:
+                setError(Socket::SocketAccessError, AccessErrorString);
+                return -1;
+            case EMSGSIZE:
+                setError(Socket::DatagramTooLargeError, DatagramTooLargeErrorString);
+                return -1;
+            case ECONNRESET:
+            case ENOTSOCK:
+                if(type == Socket::TcpSocket) {
+                    setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
+                    close();
+                }
+                return -1;
+            case EDESTADDRREQ: // not happen in sendto()
+            case EISCONN: // happens in udp socket
+            case ENOTCONN: // happens in tcp socket
+                setError(Socket::UnsupportedSocketOperationError,InvalidSocketErrorString);
+                return -1;
+            case ENOBUFS:
+            case ENOMEM:
+                setError(Socket::SocketResourceError, ResourceErrorString);
+                return -1;
+            case EFAULT:
+            case EINVAL:
+            default:
+                setError(Socket::NetworkError, InvalidSocketErrorString);
+                return -1;
+            }
+        } else { // sentBytes == 0 || sentBytes > 0
+            if (type == Socket::UdpSocket && !localPort && localAddress.isNull()) {
+                fetchConnectionParameters();
+            }
+            return static_cast<qint32>(sentBytes);
+        }
+        waitWatcher(watcher);
+    }
+}
+
+
+#ifdef Q_OS_LINUX
+
+qint32 SocketPrivate::recvmany(SocketDatagram *datagrams, qint32 count)
+{
+    if(!isValid()) {
+        return -1;
+    }
+    if(count <= 0) {
+        return -1;
+    }
+    count = qMin(count, 1024);  // UIO_MAXIOV
+    QVarLengthArray<struct mmsghdr, 64> msgs(count);
+    QVarLengthArray<struct iovec, 64> vecs(count);
+    QVarLengthArray<qt_sockaddr, 64> addrs(count);
+    // receives the UDP_GRO segment size if the kernel coalesced datagrams.
+    const size_t controlSize = CMSG_SPACE(sizeof(int));
+    QVarLengthArray<char, 64 * CMSG_SPACE(sizeof(int))> controls(static_cast<int>(controlSize) * count);
+    memset(msgs.data(), 0, sizeof(struct mmsghdr) * static_cast<size_t>(count));
+    memset(addrs.data(), 0, sizeof(qt_sockaddr) * static_cast<size_t>(count));
+    for(qint32 i = 0; i < count; ++i) {
+        vecs[i].iov_base = datagrams[i].data;
+        vecs[i].iov_len = static_cast<size_t>(qMax(datagrams[i].size, 0));
+        msgs[i].msg_hdr.msg_iov = &vecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(qt_sockaddr);
+        msgs[i].msg_hdr.msg_control = controls.data() + controlSize * static_cast<size_t>(i);
+        msgs[i].msg_hdr.msg_controllen = controlSize;
+    }
+
+    ScopedIoWatcher watcher(EventLoopCoroutine::Read, fd);
+    while(true) {
+        if(!isValid()) {
+            setError(Socket::SocketAccessError, AccessErrorString);
+            return -1;
+        }
+        int r;
+        do {
+            r = ::recvmmsg(fd, msgs.data(), static_cast<unsigned int>(count), 0, nullptr);
+        } while(r < 0 && errno == EINTR);
+
+        if(r < 0) {
+            int e = errno;
+            switch (e) {
+#if EWOULDBLOCK-0 && EWOULDBLOCK != EAGAIN
+            case EWOULDBLOCK:
+#endif
+            case EAGAIN:
+                break;
+            case ECONNRESET:
+            case ECONNREFUSED:
+            case ENOTCONN:
+                return -1;
+            case ENOMEM:
+                setError(Socket::SocketResourceError, ResourceErrorString);
+                return -1;
+            default:
+                setError(Socket::NetworkError, InvalidSocketErrorString);
+                close();
+                return -1;
+            }
+        } else {
+            for(int i = 0; i < r; ++i) {
+                datagrams[i].length = static_cast<qint32>(msgs[i].msg_len);
+                datagrams[i].segmentSize = 0;
+                qt_socket_getPortAndAddress(&addrs[i], &datagrams[i].port, &datagrams[i].address);
+                qt_socket_getEndpoint(&addrs[i], &datagrams[i].endpoint);
+                for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+                    if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                        int segmentSize;
+                        memcpy(&segmentSize, CMSG_DATA(cmsg), sizeof(segmentSize));
+                        datagrams[i].segmentSize = segmentSize;
+                    }
+                }
+            }
+            return r;
+        }
+        waitWatcher(watcher);
+    }
+}
+
+
+qint32 SocketPrivate::sendmany(SocketDatagram *datagrams, qint32 count)
+{
+    if(!isValid()) {
+        return -1;
+    }
+    if(count <= 0) {
+        return -1;
+    }
+    count = qMin(count, 1024);  // UIO_MAXIOV
+    QVarLengthArray<struct mmsghdr, 64> msgs(count);
+    QVarLengthArray<struct iovec, 64> vecs(count);
+    QVarLengthArray<qt_sockaddr, 64> addrs(count);
+    const size_t controlSize = CMSG_SPACE(sizeof(quint16));
+    QVarLengthArray<char, 64 * CMSG_SPACE(sizeof(quint16))> controls(static_cast<int>(controlSize) * count);
+    memset(msgs.data(), 0, sizeof(struct mmsghdr) * static_cast<size_t>(count));
+    memset(addrs.data(), 0, sizeof(qt_sockaddr) * static_cast<size_t>(count));
+    memset(controls.data(), 0, static_cast<size_t>(controls.size()));
+    for(qint32 i = 0; i < count; ++i) {
+        if(datagrams[i].segmentSize > 0) {
+            // the kernel splits this buffer into datagrams of segmentSize bytes.
+            msgs[i].msg_hdr.msg_control = controls.data() + controlSize * static_cast<size_t>(i);
+            msgs[i].msg_hdr.msg_controllen = controlSize;
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(quint16));
+            quint16 segmentSize = static_cast<quint16>(datagrams[i].segmentSize);
+            memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(segmentSize));
+        }
+        int t;
+        setPortAndAddress(datagrams[i].port, datagrams[i].address, &addrs[i], &t);
+        vecs[i].iov_base = datagrams[i].data;
+        vecs[i].iov_len = static_cast<size_t>(qMax(datagrams[i].size, 0));
+        msgs[i].msg_hdr.msg_iov = &vecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i].a;
+        msgs[i].msg_hdr.msg_namelen = static_cast<QT_SOCKLEN_T>(t);
+    }
+
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+    ScopedIoWatcher watcher(EventLoopCoroutine::Write, fd);
+    while(true) {
+        if(!isValid()) {
+            return -1;
+        }
+        int r;
+        do {
+            r = ::sendmmsg(fd, msgs.data(), static_cast<unsigned int>(count), flags);
+        } while(r < 0 && errno == EINTR);
+
+        if(r < 0) {
+            int e = errno;
+            switch (e) {
+#if EWOULDBLOCK-0 && EWOULDBLOCK != EAGAIN
+            case EWOULDBLOCK:
+#endif
+            case EAGAIN:
+                break;
+            case EACCES:
+                setError(Socket::SocketAccessError, AccessErrorString);
+                return -1;
+            case EMSGSIZE:
+                setError(Socket::DatagramTooLargeError, DatagramTooLargeErrorString);
+                return -1;
+            case ENOBUFS:
+            case ENOMEM:
+                setError(Socket::SocketResourceError, ResourceErrorString);
+                return -1;
+            default:
+                setError(Socket::NetworkError, InvalidSocketErrorString);
+                return -1;
+            }
+        } else {
+            // datagrams are sent entirely or not at all, and msg_len is not reliable with UDP_SEGMENT.
+            for(int i = 0; i < r; ++i) {
+                datagrams[i].length = datagrams[i].size;
+            }
+            if(type == Socket::UdpSocket && !localPort && localAddress.isNull()) {
+                fetchConnectionParameters();
+            }
+            return r;
+        }
+        waitWatcher(watcher);
+    }
+}
+
+#else
+
+// other unix systems do not have recvmmsg(), take the datagrams already arrived after the first one.
+qint32 SocketPrivate::recvmany(SocketDatagram *datagrams, qint32 count)
+{
+    if(count <= 0) {
+        return -1;
+    }
+    qt_sockaddr first;
+    qint32 len = recvfrom(datagrams[0].data, datagrams[0].size, &first);
+    if(len < 0) {
+        return -1;
+    }
+    datagrams[0].length = len;
+    datagrams[0].segmentSize = 0;
+    qt_socket_getPortAndAddress(&first, &datagrams[0].port, &datagrams[0].address);
+    qt_socket_getEndpoint(&first, &datagrams[0].endpoint);
+    qint32 received = 1;
+    while(received < count && isValid()) {
+        SocketDatagram &datagram = datagrams[received];
+        qt_sockaddr aa;
+        QT_SOCKLEN_T aaSize = sizeof(aa);
+        memset(&aa, 0, sizeof(aa));
+        ssize_t r;
+        do {
+            r = ::recvfrom(fd, datagram.data, static_cast<size_t>(qMax(datagram.size, 0)), 0, &aa.a, &aaSize);
+        } while(r < 0 && errno == EINTR);
+        if(r < 0) {
+            break;
+        }
+        datagram.length = static_cast<qint32>(r);
+        datagram.segmentSize = 0;
+        qt_socket_getPortAndAddress(&aa, &datagram.port, &datagram.address);
+        qt_socket_getEndpoint(&aa, &datagram.endpoint);
+        ++received;
+    }
+    return received;
+}
+
+
+qint32 SocketPrivate::sendmany(SocketDatagram *datagrams, qint32 count)
+{
+    qint32 sent = 0;
+    for(; sent < count; ++sent) {
+        SocketDatagram &datagram = datagrams[sent];
+        // no UDP_SEGMENT here, split the buffer by ourself.
+        const qint32 step = datagram.segmentSize > 0 ? datagram.segmentSize : datagram.size;
+        qint32 offset = 0;
+        do {
+            qint32 len = sendto(datagram.data + offset, qMin(step, datagram.size - offset), datagram.address, datagram.port);
+            if(len < 0) {
+                return sent > 0 ? sent : -1;
+            }
+            offset += len;
+        } while(offset < datagram.size);
+        datagram.length = datagram.size;
+    }
+    return sent;
+}
+
+#endif
+
+
+qint32 SocketPrivate::sendv(const QList<QByteArray> &buffers, bool all)
+{
+    if(!isValid()) {
+        return -1;
+    }
+    QVarLengthArray<struct iovec, 16> vecs;
+    for(const QByteArray &buffer: buffers) {
+        if(buffer.isEmpty()) {
+            continue;
+        }
+        struct iovec vec;
+        vec.iov_base = const_cast<char*>(buffer.constData());
+        vec.iov_len = static_cast<size_t>(buffer.size());
+        vecs.append(vec);
+    }
+    qint32 sent = 0;
+    int first = 0;
+    ScopedIoWatcher watcher(EventLoopCoroutine::Write, fd);
+    while(first < vecs.size()) {
+        if (!isValid()) {
+            setError(Socket::SocketAccessError, AccessErrorString);
+            return sent == 0 ? -1 : sent;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vecs.data() + first;
+        msg.msg_iovlen = static_cast<size_t>(qMin(vecs.size() - first, 1024));  // UIO_MAXIOV
+        ssize_t w;
+        do {
+            w = ::sendmsg(fd, &msg, 0);
+        } while(w < 0 && errno == EINTR);
+        if(w > 0) {
+            sent += static_cast<qint32>(w);
+            // skip the buffers sent completely, and move the start of the partial one.
+            size_t left = static_cast<size_t>(w);
+            while(first < vecs.size() && left >= vecs[first].iov_len) {
+                left -= vecs[first].iov_len;
+                ++first;
+            }
+            if(left > 0) {
+                vecs[first].iov_base = static_cast<char*>(vecs[first].iov_base) + left;
+                vecs[first].iov_len -= left;
+            }
+            if(!all) {
+                return sent;
+            }
+            continue;
+        } else if(w < 0) {
+            int e = errno;
+            switch(e) {
+#if EWOULDBLOCK-0 && EWOULDBLOCK != EAGAIN
+            case EWOULDBLOCK:
+#endif
+            case EAGAIN:
+                break;
+            case EACCES:
+                setError(Socket::SocketAccessError, AccessErrorString);
+                close();
+                return sent == 0 ? -1 : sent;
+            case EBADF:
+            case EFAULT:
+            case EINVAL:
+            case ENOTCONN:
+            case ENOTSOCK:
+                setError(Socket::UnsupportedSocketOperationError, InvalidSocketErrorString);
+                close();
+                return sent == 0 ? -1 : sent;
+            case EMSGSIZE:
+            case ENOBUFS:
+            case ENOMEM:
+                setError(Socket::DatagramTooLargeError, DatagramTooLargeErrorString);
+                return sent == 0 ? -1 : sent;
+            case EPIPE:
+            case ECONNRESET:
+                setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
+                close();
+                return sent == 0 ? -1 : sent;
+            default:
+                setError(Socket::UnknownSocketError, UnknownSocketErrorString);
+                close();
+                return sent == 0 ? -1 : sent;
+            }
+        }
+        waitWatcher(watcher);
+    }
+    return sent;
+}
+
+
+qint32 SocketPrivate::recvv(SocketBuffer *buffers, qint32 count)
+{
+    if(!isValid()) {
+        return -1;
+    }
+    QVarLengthArray<struct iovec, 16> vecs;
+    for(qint32 i = 0; i < count && vecs.size() < 1024; ++i) {  // UIO_MAXIOV
+        if(buffers[i].size <= 0) {
+            continue;
+        }
+        struct iovec vec;
+        vec.iov_base = buffers[i].data;
+        vec.iov_len = static_cast<size_t>(buffers[i].size);
+        vecs.append(vec);
+    }
+    if(vecs.isEmpty()) {
+        return 0;
+    }
+    ScopedIoWatcher watcher(EventLoopCoroutine::Read, fd);
+    while(true) {
+        if(!isValid()) {
+            setError(Socket::SocketAccessError, AccessErrorString);
+            return -1;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vecs.data();
+        msg.msg_iovlen = static_cast<size_t>(vecs.size());
+        ssize_t r;
+        do {
+            r = ::recvmsg(fd, &msg, 0);
+        } while(r < 0 && errno == EINTR);
+        if(r < 0) {
+            int e = errno;
+            switch(e) {
+#if EWOULDBLOCK-0 && EWOULDBLOCK != EAGAIN
+            case EWOULDBLOCK:
+#endif
+            case EAGAIN:
+                break;
+            case ECONNRESET:
+#if defined(Q_OS_VXWORKS)
+            case ESHUTDOWN:
+#endif
+                if(type == Socket::TcpSocket) {
+                    setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
+                    close();
+                }
+                return 0;
+            default:
+                setError(Socket::NetworkError, InvalidSocketErrorString);
+                close();
+                return -1;
+            }
+        } else if(r == 0 && type == Socket::TcpSocket) {
+            setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
+            close();
+            return 0;
+        } else {
+            return static_cast<qint32>(r);
+        }
+        waitWatcher(watcher);
+    }
+}
+
+
+qint32 SocketPrivate::sendDescriptors(const char *data, qint32 size, const QList<qintptr> &fds)
+{
+    if(!isValid()) {
+        return -1;
+    }
+    // the descriptors go with the first byte, linux accepts SCM_MAX_FD of them at most.
+    if(protocol != Socket::UnixProtocol || size <= 0 || fds.size() > 253) {
+        setError(Socket::UnsupportedSocketOperationError, OperationUnsupportedErrorString);
+        return -1;
+    }
+    struct iovec vec;
+    vec.iov_base = const_cast<char*>(data);
+    vec.iov_len = static_cast<size_t>(size);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+    QByteArray control;
+    if(!fds.isEmpty()) {
+        control.fill('\0', static_cast<int>(CMSG_SPACE(sizeof(int) * static_cast<size_t>(fds.size()))));
+        msg.msg_control = control.data();
+        msg.msg_controllen = static_cast<size_t>(control.size());
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * static_cast<size_t>(fds.size()));
+        int *descriptors = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+        for(int i = 0; i < fds.size(); ++i) {
+            descriptors[i] = static_cast<int>(fds.at(i));
+        }
+    }
+    ScopedIoWatcher watcher(EventLoopCoroutine::Write, fd);
+    while(true) {
+        if(!isValid()) {
+            return -1;
+        }
+        ssize_t w;
+        do {
+            w = ::sendmsg(fd, &msg, 0);
+        } while(w < 0 && errno == EINTR);
+        if(w >= 0) {
+            return static_cast<qint32>(w);
+        }
+        int e = errno;
+        switch(e) {
+#if EWOULDBLOCK-0 && EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+        case EAGAIN:
+            break;
+        case EBADF:
+            // one of the passing descriptors is invalid, the socket is fine.
+            setError(Socket::UnsupportedSocketOperationError, InvalidSocketErrorString);
+            return -1;
+#ifdef ETOOMANYREFS
+        case ETOOMANYREFS:
+#endif
+        case ENOBUFS:
+        case ENOMEM:
+            setError(Socket::SocketResourceError, ResourceErrorString);
+            return -1;
+        case EPIPE:
+        case ECONNRESET:
+            setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
+            close();
+            return -1;
+        default:
+            setError(Socket::UnknownSocketError, UnknownSocketErrorString);
+            close();
+            return -1;
+        }
+        waitWatcher(watcher);
+    }
+}
 
-    ssize_t sentBytes = 0;
-    ScopedIoWatcher watcher(EventLoopCoroutine::Write, fd);
-#ifdef MSG_NOSIGNAL
-    int flags = MSG_NOSIGNAL;
-#else
+
+qint32 SocketPrivate::recvDescriptors(char *data, qint32 size, QList<qintptr> *fds)
+{
+    if(!isValid()) {
+        return -1;
+    }
+    if(protocol != Socket::UnixProtocol || size <= 0) {
+        setError(Socket::UnsupportedSocketOperationError, OperationUnsupportedErrorString);
+        return -1;
+    }
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int) * 253)];  // SCM_MAX_FD
+    } control;
+    struct iovec vec;
+    vec.iov_base = data;
+    vec.iov_len = static_cast<size_t>(size);
     int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+    flags |= MSG_CMSG_CLOEXEC;
 #endif
+    ScopedIoWatcher watcher(EventLoopCoroutine::Read, fd);
     while(true) {
-        if (!isValid()) {
+        if(!isValid()) {
+            setError(Socket::SocketAccessError, AccessErrorString);
             return -1;
         }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &vec;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t r;
         do {
-            sentBytes = ::sendmsg(fd, &msg, flags);
-        } while(sentBytes == -1 && error == EINTR);
-
-        if(sentBytes < 0) {
+            r = ::recvmsg(fd, &msg, flags);
+        } while(r < 0 && errno == EINTR);
+        if(r < 0) {
             int e = errno;
-            switch(e)
-            {
+            switch(e) {
 #if EWOULDBLOCK-0 && EWOULDBLOCK != EAGAIN
             case EWOULDBLOCK:
 #endif
             case EAGAIN:
                 break;
-            case EACCES:
-                setError(Socket::SocketAccessError, AccessErrorString);
-                return -1;
-            case EMSGSIZE:
-                setError(Socket::DatagramTooLargeError, DatagramTooLargeErrorString);
-                return -1;
             case ECONNRESET:
-            case ENOTSOCK:
                 if(type == Socket::TcpSocket) {
                     setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
                     close();
                 }
-                return -1;
-            case EDESTADDRREQ: // not happen in sendto()
-            case EISCONN: // happens in udp socket
-            case ENOTCONN: // happens in tcp socket
-                setError(Socket::UnsupportedSocketOperationError,InvalidSocketErrorString);
-                return -1;
-            case ENOBUFS:
-            case ENOMEM:
-                setError(Socket::SocketResourceError, ResourceErrorString);
-                return -1;
-            case EFAULT:
-            case EINVAL:
+                return 0;
             default:
                 setError(Socket::NetworkError, InvalidSocketErrorString);
+                close();
                 return -1;
             }
-        } else { // sentBytes == 0 || sentBytes > 0
-            if (type == Socket::UdpSocket && !localPort && localAddress.isNull()) {
-                fetchConnectionParameters();
+            waitWatcher(watcher);
+            continue;
+        }
+        for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
             }
-            return static_cast<qint32>(sentBytes);
+            const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int *descriptors = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+            for(size_t i = 0; i < count; ++i) {
+                if(fds) {
+                    fds->append(descriptors[i]);
+                } else {
+                    ::close(descriptors[i]);
+                }
+            }
+        }
+        if(r == 0 && type == Socket::TcpSocket) {
+            setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
+            close();
+        }
+        return static_cast<qint32>(r);
+    }
+}
+
+
+qint64 SocketPrivate::sendfile(QFile *file, qint64 offset, qint64 length)
+{
+    if(!isValid()) {
+        return -1;
+    }
+    const int fileFd = file->handle();
+#if defined(QTNG_HAVE_LINUX_SENDFILE) || defined(QTNG_HAVE_BSD_SENDFILE)
+    if(fileFd < 0 || type != Socket::TcpSocket) {
+        return sendfileByCopy(file, offset, length);
+    }
+    // the data buffered in QFile is not flushed to fd yet.
+    file->flush();
+    ScopedIoWatcher watcher(EventLoopCoroutine::Write, fd);
+    qint64 sent = 0;
+    while(sent < length) {
+        if(!isValid()) {
+            return sent > 0 ? sent : -1;
+        }
+        // linux sends 0x7ffff000 bytes at most for one call.
+        const qint64 count = qMin<qint64>(length - sent, 0x7ffff000);
+        qint64 w = 0;
+        int e = 0;
+#ifdef QTNG_HAVE_LINUX_SENDFILE
+        off_t off = static_cast<off_t>(offset + sent);
+        ssize_t r;
+        do {
+            r = ::sendfile(fd, fileFd, &off, static_cast<size_t>(count));
+        } while(r < 0 && errno == EINTR);
+        if(r < 0) {
+            e = errno;
+        } else {
+            w = r;
+        }
+#elif defined(Q_OS_MACOS)
+        off_t len = static_cast<off_t>(count);
+        int r = ::sendfile(fileFd, fd, static_cast<off_t>(offset + sent), &len, nullptr, 0);
+        // bsd reports the bytes sent before EAGAIN/EINTR.
+        w = len;
+        if(r < 0 && !(errno == EINTR && len > 0)) {
+            e = errno;
+        }
+#else
+        off_t len = 0;
+        int r = ::sendfile(fileFd, fd, static_cast<off_t>(offset + sent), static_cast<size_t>(count), nullptr, &len, 0);
+        w = len;
+        if(r < 0 && !(errno == EINTR && len > 0)) {
+            e = errno;
+        }
+#endif
+        if(w > 0) {
+            sent += w;
+            continue;
+        }
+        if(e == 0) {
+            // the file is shorter than expected.
+            break;
+        }
+        switch(e) {
+#if EWOULDBLOCK-0 && EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+        case EAGAIN:
+        case EINTR:
+            break;
+        case EINVAL:
+        case ENOSYS:
+#ifdef EOPNOTSUPP
+        case EOPNOTSUPP:
+#endif
+            // the rest is copied, the bytes sent by the kernel are counted as well.
+            if(sent == 0) {
+                return sendfileByCopy(file, offset, length);
+            } else {
+                const qint64 copied = sendfileByCopy(file, offset + sent, length - sent);
+                return copied > 0 ? sent + copied : sent;
+            }
+        case EPIPE:
+        case ECONNRESET:
+        case ENOTCONN:
+            setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
+            close();
+            return sent > 0 ? sent : -1;
+        default:
+            setError(Socket::UnknownSocketError, UnknownSocketErrorString);
+            close();
+            return sent > 0 ? sent : -1;
+        }
+        waitWatcher(watcher);
+    }
+    return sent > 0 ? sent : -1;
+#else
+    Q_UNUSED(fileFd);
+    return sendfileByCopy(file, offset, length);
+#endif
+}
+
+
+#ifdef Q_OS_LINUX
+
+qint32 SocketPrivate::spliceIn(SocketPrivate *target, qint32 size)
+{
+    if(!isValid() || !target->isValid()) {
+        return -1;
+    }
+    if(type != Socket::TcpSocket || target->type != Socket::TcpSocket) {
+        setError(Socket::UnsupportedSocketOperationError, OperationUnsupportedErrorString);
+        return -1;
+    }
+    // the last spliceOut() was killed or timeout, drop the data left in pipe.
+    if(splicePending > 0 && splicePipe[0] >= 0) {
+        ::close(splicePipe[0]);
+        ::close(splicePipe[1]);
+        splicePipe[0] = splicePipe[1] = -1;
+    }
+    splicePending = 0;
+    if(splicePipe[0] < 0 && ::pipe2(splicePipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        splicePipe[0] = splicePipe[1] = -1;
+        setError(Socket::SocketResourceError, ResourceErrorString);
+        return -1;
+    }
+    // the capacity of pipe is 64k by default, the pipe is always empty here.
+    size = qMin(size, 1024 * 64);
+    ScopedIoWatcher watcher(EventLoopCoroutine::Read, fd);
+    while(true) {
+        if(!isValid()) {
+            return -1;
+        }
+        ssize_t r;
+        do {
+            r = ::splice(fd, nullptr, splicePipe[1], nullptr, static_cast<size_t>(size), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } while(r < 0 && errno == EINTR);
+        if(r > 0) {
+            splicePending = static_cast<qint32>(r);
+            return splicePending;
+        } else if(r == 0) {
+            setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
+            close();
+            return 0;
+        }
+        int e = errno;
+        switch(e) {
+#if EWOULDBLOCK-0 && EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+        case EAGAIN:
+            break;
+        case ECONNRESET:
+            setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
+            close();
+            return 0;
+        default:
+            setError(Socket::NetworkError, ReadErrorString);
+            close();
+            return -1;
+        }
+        waitWatcher(watcher);
+    }
+}
+
+
+qint32 SocketPrivate::spliceOut(SocketPrivate *target)
+{
+    const qint32 total = splicePending;
+    ScopedIoWatcher watcher(EventLoopCoroutine::Write, target->fd);
+    while(splicePending > 0) {
+        if(!target->isValid() || splicePipe[0] < 0) {
+            return -1;
+        }
+        ssize_t w;
+        do {
+            w = ::splice(splicePipe[0], nullptr, target->fd, nullptr, static_cast<size_t>(splicePending), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } while(w < 0 && errno == EINTR);
+        if(w > 0) {
+            splicePending -= static_cast<qint32>(w);
+            continue;
         }
-        watcher.start();
+        int e = w < 0 ? errno : EPIPE;
+        switch(e) {
+#if EWOULDBLOCK-0 && EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+        case EAGAIN:
+            break;
+        case EPIPE:
+        case ECONNRESET:
+            target->setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
+            target->close();
+            return -1;
+        default:
+            target->setError(Socket::NetworkError, WriteErrorString);
+            target->close();
+            return -1;
+        }
+        target->waitWatcher(watcher);
     }
+    return total;
+}
+
+#else
+
+qint32 SocketPrivate::spliceIn(SocketPrivate *target, qint32 size)
+{
+    Q_UNUSED(target);
+    Q_UNUSED(size);
+    setError(Socket::UnsupportedSocketOperationError, OperationUnsupportedErrorString);
+    return -1;
+}
+
+
+qint32 SocketPrivate::spliceOut(SocketPrivate *target)
+{
+    Q_UNUSED(target);
+    setError(Socket::UnsupportedSocketOperationError, OperationUnsupportedErrorString);
+    return -1;
 }
 
+#endif
+
 
 static void convertToLevelAndOption(Socket::SocketOption opt,
                                     Socket::NetworkLayerProtocol socketProtocol, int *level, int *n)
@@ -829,6 +2157,60 @@ static void convertToLevelAndOption(Socket::SocketOption opt,
     case Socket::MaxStreamsSocketOption:
         // FIXME support stcp
         break;
+    case Socket::UdpSegmentOption:
+#ifdef Q_OS_LINUX
+        *level = SOL_UDP;
+        *n = UDP_SEGMENT;
+#endif
+        break;
+    case Socket::UdpGroOption:
+#ifdef Q_OS_LINUX
+        *level = SOL_UDP;
+        *n = UDP_GRO;
+#endif
+        break;
+    case Socket::ReusePortOption:
+#ifdef SO_REUSEPORT
+        *n = SO_REUSEPORT;
+#endif
+        break;
+    case Socket::TcpFastOpenOption:
+#ifdef TCP_FASTOPEN
+        *level = IPPROTO_TCP;
+        *n = TCP_FASTOPEN;
+#endif
+        break;
+    case Socket::TcpFastOpenConnectOption:
+#ifdef Q_OS_LINUX
+        *level = IPPROTO_TCP;
+        *n = TCP_FASTOPEN_CONNECT;
+#endif
+        break;
+    case Socket::BusyPollOption:
+#ifdef Q_OS_LINUX
+        *n = SO_BUSY_POLL;
+#endif
+        break;
+    case Socket::PreferBusyPollOption:
+#ifdef Q_OS_LINUX
+        *n = SO_PREFER_BUSY_POLL;
+#endif
+        break;
+    case Socket::CorkOption:
+#if defined(TCP_CORK)
+        *level = IPPROTO_TCP;
+        *n = TCP_CORK;
+#elif defined(TCP_NOPUSH)
+        *level = IPPROTO_TCP;
+        *n = TCP_NOPUSH;
+#endif
+        break;
+    case Socket::NotSentLowWatermarkOption:
+#ifdef TCP_NOTSENT_LOWAT
+        *level = IPPROTO_TCP;
+        *n = TCP_NOTSENT_LOWAT;
+#endif
+        break;
     case Socket::NonBlockingSocketOption:
     case Socket::BindExclusively:
         Q_UNREACHABLE();
@@ -910,7 +2292,9 @@ static inline int qt_safe_accept(int s, struct sockaddr *addr, socklen_t *addrle
     Q_ASSERT((flags & ~O_NONBLOCK) == 0);
 
     int fd;
-#if defined (QT_UNIX_SUPPORTS_THREADSAFE_CLOEXEC) && defined(SOCK_CLOEXEC) && defined(SOCK_NONBLOCK)
+// SOCK_NONBLOCK may be defined as O_NONBLOCK above, so check the platforms having accept4().
+#if (defined(Q_OS_LINUX) || defined(Q_OS_ANDROID) || defined(Q_OS_FREEBSD) || defined(Q_OS_NETBSD) || defined(Q_OS_OPENBSD)) \
+    && defined(SOCK_CLOEXEC)
     // use accept4
     int sockflags = SOCK_CLOEXEC;
     if (flags & O_NONBLOCK)
@@ -933,6 +2317,83 @@ static inline int qt_safe_accept(int s, struct sockaddr *addr, socklen_t *addrle
     return fd;
 }
 
+// take one pending connection, returns nullptr and sets *again if there is none.
+Socket *SocketPrivate::tryAccept(bool *again, bool blocking)
+{
+    *again = false;
+    qt_sockaddr aa;
+    QT_SOCKLEN_T aaSize = sizeof(aa);
+    memset(&aa, 0, sizeof(aa));
+    // accept4() makes the new socket nonblocking, and the peer address is returned for free.
+    int acceptedDescriptor;
+    ssize_t submitted;
+    if (blocking && qt_socket_submit(EventLoopCoroutine::Accept, fd, nullptr, 0, &aa, &aaSize, &submitted)) {
+        acceptedDescriptor = static_cast<int>(submitted);
+    } else {
+        do {
+            aaSize = sizeof(aa);
+            acceptedDescriptor = qt_safe_accept(fd, &aa.a, &aaSize, O_NONBLOCK);
+        } while (acceptedDescriptor == -1 && errno == EINTR);
+    }
+    if (acceptedDescriptor == -1) {
+        int e = errno;
+        switch (e) {
+        case ECANCELED:
+            // the listener is closed while the accept is submitted.
+            return nullptr;
+        case EBADF:
+        case EOPNOTSUPP:
+            setError(Socket::UnsupportedSocketOperationError, InvalidSocketErrorString);
+            return nullptr;
+        case ECONNABORTED:
+            setError(Socket::NetworkError, RemoteHostClosedErrorString);
+            return nullptr;
+        case EFAULT:
+        case ENOTSOCK:
+            setError(Socket::SocketResourceError, NotSocketErrorString);
+            return nullptr;
+        case EPROTONOSUPPORT:
+        case EPROTO:
+        case EAFNOSUPPORT:
+        case EINVAL:
+            setError(Socket::UnsupportedSocketOperationError, ProtocolUnsupportedErrorString);
+            return nullptr;
+        case ENFILE:
+        case EMFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            setError(Socket::SocketResourceError, ResourceErrorString);
+            return nullptr;
+        case EACCES:
+        case EPERM:
+            setError(Socket::SocketAccessError, AccessErrorString);
+            return nullptr;
+        default:
+            setError(Socket::UnknownSocketError, UnknownSocketErrorString);
+            return nullptr;
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+        case EAGAIN:
+            *again = true;
+            return nullptr;
+        }
+    }
+    Socket::NetworkLayerProtocol acceptedProtocol = protocol;
+    if (aa.a.sa_family == AF_INET) {
+        acceptedProtocol = Socket::IPv4Protocol;
+    } else if (aa.a.sa_family == AF_INET6) {
+        acceptedProtocol = Socket::IPv6Protocol;
+    } else if (aa.a.sa_family == AF_UNIX) {
+        acceptedProtocol = Socket::UnixProtocol;
+    }
+    Socket *conn = new Socket(acceptedDescriptor, acceptedProtocol);
+    qt_socket_getPortAndAddress(&aa, &conn->d_func()->peerPort, &conn->d_func()->peerAddress);
+    conn->d_func()->peerPath = qt_socket_getPath(&aa, aaSize);
+    return conn;
+}
+
+
 Socket *SocketPrivate::accept()
 {
     if(!isValid()) {
@@ -948,53 +2409,35 @@ Socket *SocketPrivate::accept()
         if (!isValid() || state != Socket::ListeningState) {
             return nullptr;
         }
-        int acceptedDescriptor = qt_safe_accept(fd, nullptr, nullptr);
-        if (acceptedDescriptor == -1) {
-            int e = errno;
-            switch (e) {
-            case EBADF:
-            case EOPNOTSUPP:
-                setError(Socket::UnsupportedSocketOperationError, InvalidSocketErrorString);
-                return nullptr;
-            case ECONNABORTED:
-                setError(Socket::NetworkError, RemoteHostClosedErrorString);
-                return nullptr;
-            case EFAULT:
-            case ENOTSOCK:
-                setError(Socket::SocketResourceError, NotSocketErrorString);
-                return nullptr;
-            case EPROTONOSUPPORT:
-            case EPROTO:
-            case EAFNOSUPPORT:
-            case EINVAL:
-                setError(Socket::UnsupportedSocketOperationError, ProtocolUnsupportedErrorString);
-                return nullptr;
-            case ENFILE:
-            case EMFILE:
-            case ENOBUFS:
-            case ENOMEM:
-                setError(Socket::SocketResourceError, ResourceErrorString);
-                return nullptr;
-            case EACCES:
-            case EPERM:
-                setError(Socket::SocketAccessError, AccessErrorString);
-                return nullptr;
-            default:
-                setError(Socket::UnknownSocketError, UnknownSocketErrorString);
-                return nullptr;
-#if EAGAIN != EWOULDBLOCK
-            case EWOULDBLOCK:
-#endif
-            case EAGAIN:
-                break;
-            }
-        } else {
-            Socket *conn = new Socket(acceptedDescriptor);
+        bool again;
+        Socket *conn = tryAccept(&again, true);
+        if (conn || !again) {
             return conn;
         }
-        watcher.start();
+        waitWatcher(watcher);
     }
 }
 
 
+QList<Socket*> SocketPrivate::acceptmany(int maxCount)
+{
+    QList<Socket*> conns;
+    Socket *first = accept();
+    if (!first) {
+        return conns;
+    }
+    conns.append(first);
+    // drain the backlog without waiting, the listener is still readable if there are more.
+    while (conns.size() < maxCount && isValid() && state == Socket::ListeningState) {
+        bool again;
+        Socket *conn = tryAccept(&again);
+        if (!conn) {
+            // a real failure keeps its error, the accepted connections are returned anyway.
+            break;
+        }
+        conns.append(conn);
+    }
+    return conns;
+}
+
 QTNETWORKNG_NAMESPACE_END
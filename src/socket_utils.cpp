@@ -1,4 +1,10 @@
 #include <string.h>
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
+#include <QtCore/qthreadstorage.h>
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qmutex.h>
 #include "../include/coroutine_utils.h"
 #include "../include/socket_utils.h"
 
@@ -8,11 +14,128 @@ StreamLike::StreamLike() {}
 
 StreamLike::~StreamLike() {}
 
+
+qint32 StreamLike::sendv(const QList<QByteArray> &buffers)
+{
+    for (const QByteArray &buffer: buffers) {
+        if (!buffer.isEmpty()) {
+            return send(buffer);
+        }
+    }
+    return 0;
+}
+
+
+qint32 StreamLike::sendallv(const QList<QByteArray> &buffers)
+{
+    qint32 total = 0;
+    for (const QByteArray &buffer: buffers) {
+        if (buffer.isEmpty()) {
+            continue;
+        }
+        qint32 bs = sendall(buffer);
+        if (bs < buffer.size()) {
+            if (bs > 0) {
+                total += bs;
+            }
+            return total > 0 ? total : bs;
+        }
+        total += bs;
+    }
+    return total;
+}
+
+
+qint32 StreamLike::recvv(SocketBuffer *buffers, qint32 count)
+{
+    for (qint32 i = 0; i < count; ++i) {
+        if (buffers[i].size > 0) {
+            return recv(buffers[i].data, buffers[i].size);
+        }
+    }
+    return 0;
+}
+
+
+qint32 StreamLike::recv(IOBuf *buf, qint32 size)
+{
+    qint32 bs = recv(buf->reserve(size), size);
+    if (bs > 0) {
+        buf->commit(bs);
+    }
+    return bs;
+}
+
+
+qint32 StreamLike::recvall(IOBuf *buf, qint32 size)
+{
+    qint32 bs = recvall(buf->reserve(size), size);
+    if (bs > 0) {
+        buf->commit(bs);
+    }
+    return bs;
+}
+
+
+qint32 StreamLike::send(const IOBuf &buf)
+{
+    if (buf.sliceCount() == 1) {
+        return send(buf.sliceData(0), buf.sliceSize(0));
+    }
+    return sendv(buf.toList());
+}
+
+
+qint32 StreamLike::sendall(const IOBuf &buf)
+{
+    if (buf.sliceCount() == 1) {
+        return sendall(buf.sliceData(0), buf.sliceSize(0));
+    }
+    return sendallv(buf.toList());
+}
+
+
 SocketLike::SocketLike() {}
 
 SocketLike::~SocketLike() {}
 
 
+bool SocketLike::bindPath(const QString &)
+{
+    return false;
+}
+
+
+bool SocketLike::connectPath(const QString &)
+{
+    return false;
+}
+
+
+QString SocketLike::localPath() const
+{
+    return QString();
+}
+
+
+QString SocketLike::peerPath() const
+{
+    return QString();
+}
+
+
+SocketIoStats SocketLike::ioStats() const
+{
+    return SocketIoStats();
+}
+
+
+qint32 SocketLike::bufferedBytes() const
+{
+    return 0;
+}
+
+
 namespace {
 class SocketLikeImpl: public SocketLike
 {
@@ -43,6 +166,11 @@ public:
     virtual bool listen(int backlog) override;
     virtual bool setOption(Socket::SocketOption option, const QVariant &value) override;
     virtual QVariant option(Socket::SocketOption option) const override;
+    virtual bool bindPath(const QString &path) override;
+    virtual bool connectPath(const QString &path) override;
+    virtual QString localPath() const override;
+    virtual QString peerPath() const override;
+    virtual SocketIoStats ioStats() const override;
 
     virtual qint32 recv(char *data, qint32 size) override;
     virtual qint32 recvall(char *data, qint32 size) override;
@@ -52,6 +180,9 @@ public:
     virtual QByteArray recvall(qint32 size) override;
     virtual qint32 send(const QByteArray &data) override;
     virtual qint32 sendall(const QByteArray &data) override;
+    virtual qint32 sendv(const QList<QByteArray> &buffers) override;
+    virtual qint32 sendallv(const QList<QByteArray> &buffers) override;
+    virtual qint32 recvv(SocketBuffer *buffers, qint32 count) override;
 public:
     QSharedPointer<Socket> s;
 };
@@ -104,6 +235,35 @@ quint16 SocketLikeImpl::peerPort() const
     return s->peerPort();
 }
 
+
+bool SocketLikeImpl::bindPath(const QString &path)
+{
+    return s->bindPath(path);
+}
+
+
+bool SocketLikeImpl::connectPath(const QString &path)
+{
+    return s->connectPath(path);
+}
+
+
+QString SocketLikeImpl::localPath() const
+{
+    return s->localPath();
+}
+
+
+QString SocketLikeImpl::peerPath() const
+{
+    return s->peerPath();
+}
+
+SocketIoStats SocketLikeImpl::ioStats() const
+{
+    return s->ioStats();
+}
+
 qintptr	SocketLikeImpl::fileno() const
 {
     return s->fileno();
@@ -215,6 +375,21 @@ qint32 SocketLikeImpl::sendall(const QByteArray &data)
     return s->sendall(data);
 }
 
+qint32 SocketLikeImpl::sendv(const QList<QByteArray> &buffers)
+{
+    return s->sendv(buffers);
+}
+
+qint32 SocketLikeImpl::sendallv(const QList<QByteArray> &buffers)
+{
+    return s->sendallv(buffers);
+}
+
+qint32 SocketLikeImpl::recvv(SocketBuffer *buffers, qint32 count)
+{
+    return s->recvv(buffers, count);
+}
+
 } //anonymous namespace
 
 QSharedPointer<SocketLike> SocketLike::rawSocket(QSharedPointer<Socket> s)
@@ -237,6 +412,18 @@ QSharedPointer<Socket> convertSocketLikeToSocket(QSharedPointer<SocketLike> sock
 FileLike::~FileLike() {}
 
 
+QSharedPointer<QFile> FileLike::file()
+{
+    return QSharedPointer<QFile>();
+}
+
+
+bool FileLike::seek(qint64)
+{
+    return false;
+}
+
+
 QByteArray FileLike::readall(bool *ok)
 {
     QByteArray data;
@@ -282,6 +469,8 @@ public:
     virtual bool atEnd() override;
     virtual void close() override;
     virtual qint64 size() override;
+    virtual QSharedPointer<QFile> file() override;
+    virtual bool seek(qint64 pos) override;
 private:
     QSharedPointer<QFile> f;
 };
@@ -325,12 +514,359 @@ qint64 RawFile::size()
     return f->size();
 }
 
+QSharedPointer<QFile> RawFile::file()
+{
+    return f;
+}
+
+bool RawFile::seek(qint64 pos)
+{
+    return f->seek(pos);
+}
+
 QSharedPointer<FileLike> FileLike::rawFile(QSharedPointer<QFile> f)
 {
     return QSharedPointer<RawFile>::create(f).dynamicCast<FileLike>();
 }
 
 
+class AsyncFile: public FileLike
+{
+public:
+    AsyncFile(QSharedPointer<QFile> f, qint32 chunkSize)
+        :f(f), chunkSize(chunkSize), bufPos(0), pos(f->pos()), fileSize(f->size()), eof(false) {}
+    virtual qint32 read(char *data, qint32 size) override;
+    virtual qint32 readall(char *data, qint32 size) override;
+    virtual qint32 write(char *data, qint32 size) override;
+    virtual qint32 writeall(char *data, qint32 size) override;
+    virtual bool atEnd() override;
+    virtual void close() override;
+    virtual qint64 size() override;
+    virtual bool seek(qint64 pos) override;
+private:
+    void startReadAhead();
+    void takeReadAhead();
+    void dropBuffers();
+private:
+    QSharedPointer<QFile> f;
+    const qint32 chunkSize;
+    QByteArray buf;
+    qint32 bufPos;
+    QSharedPointer<Event> reading;      // the read-ahead running in the pool, f must not be touched until it is set.
+    QSharedPointer<QByteArray> ahead;
+    qint64 pos;                         // the position of caller, f is ahead of it by the buffers.
+    qint64 fileSize;                    // QFile::size() is not safe while reading ahead.
+    bool eof;
+};
+
+void AsyncFile::startReadAhead()
+{
+    if (eof || !reading.isNull()) {
+        return;
+    }
+    QSharedPointer<QFile> f = this->f;
+    QSharedPointer<QByteArray> chunk(new QByteArray(chunkSize, Qt::Uninitialized));
+    ahead = chunk;
+    reading = callInThreadAsync([f, chunk] {
+        qint64 len = f->read(chunk->data(), chunk->size());
+        chunk->resize(static_cast<qint32>(qMax<qint64>(0, len)));
+    });
+}
+
+// moves the read-ahead chunk to buf, an empty chunk is the end of file or an error.
+void AsyncFile::takeReadAhead()
+{
+    if (reading.isNull()) {
+        return;
+    }
+    reading->wait();
+    reading.clear();
+    buf = *ahead;
+    ahead.clear();
+    bufPos = 0;
+    if (buf.isEmpty()) {
+        eof = true;
+    }
+}
+
+// waits the read-ahead, and moves f back to the position of caller.
+void AsyncFile::dropBuffers()
+{
+    if (!reading.isNull()) {
+        reading->wait();
+        reading.clear();
+        ahead.clear();
+    }
+    buf.clear();
+    bufPos = 0;
+    eof = false;
+    f->seek(pos);
+}
+
+qint32 AsyncFile::read(char *data, qint32 size)
+{
+    if (size <= 0) {
+        return 0;
+    }
+    if (bufPos >= buf.size()) {
+        if (eof) {
+            return 0;
+        }
+        startReadAhead();
+        takeReadAhead();
+        if (eof) {
+            return 0;
+        }
+        startReadAhead();
+    }
+    qint32 readBytes = qMin(buf.size() - bufPos, size);
+    memcpy(data, buf.constData() + bufPos, static_cast<size_t>(readBytes));
+    bufPos += readBytes;
+    pos += readBytes;
+    return readBytes;
+}
+
+qint32 AsyncFile::readall(char *data, qint32 size)
+{
+    qint32 total = 0;
+    while (total < size) {
+        qint32 readBytes = read(data + total, size - total);
+        if (readBytes <= 0) {
+            break;
+        }
+        total += readBytes;
+    }
+    return total;
+}
+
+qint32 AsyncFile::write(char *data, qint32 size)
+{
+    if (!buf.isEmpty() || !reading.isNull() || eof) {
+        dropBuffers();
+    }
+    // copied, the worker goes on writing if the caller is killed.
+    const QByteArray chunk(data, size);
+    QSharedPointer<QFile> f = this->f;
+    qint64 len = callInThread<qint64>([f, chunk] {
+        qint64 len = f->write(chunk);
+        f->flush();
+        return len;
+    });
+    if (len > 0) {
+        pos += len;
+        fileSize = qMax(fileSize, pos);
+    }
+    return static_cast<qint32>(len);
+}
+
+qint32 AsyncFile::writeall(char *data, qint32 size)
+{
+    qint32 total = 0;
+    while (total < size) {
+        qint32 writtenBytes = write(data + total, size - total);
+        if (writtenBytes <= 0) {
+            break;
+        }
+        total += writtenBytes;
+    }
+    return total;
+}
+
+bool AsyncFile::atEnd()
+{
+    if (bufPos < buf.size()) {
+        return false;
+    }
+    if (!eof) {
+        startReadAhead();
+        takeReadAhead();
+        if (!eof) {
+            startReadAhead();
+        }
+    }
+    return eof;
+}
+
+void AsyncFile::close()
+{
+    if (!reading.isNull()) {
+        reading->wait();
+        reading.clear();
+        ahead.clear();
+    }
+    buf.clear();
+    bufPos = 0;
+    eof = true;
+    QSharedPointer<QFile> f = this->f;
+    callInThread([f] { f->close(); });
+}
+
+qint64 AsyncFile::size()
+{
+    return fileSize;
+}
+
+bool AsyncFile::seek(qint64 pos)
+{
+    if (pos < 0) {
+        return false;
+    }
+    this->pos = pos;
+    dropBuffers();
+    return f->pos() == pos;
+}
+
+QSharedPointer<FileLike> FileLike::asyncFile(QSharedPointer<QFile> f, qint32 chunkSize)
+{
+    return QSharedPointer<AsyncFile>::create(f, qMax(1024, chunkSize)).dynamicCast<FileLike>();
+}
+
+
+
+class MappedFile: public FileLike
+{
+public:
+    MappedFile(QSharedPointer<QFile> f, uchar *data, qint64 mappedSize)
+        :f(f), data(data), mappedSize(mappedSize), pos(0) {}
+    virtual ~MappedFile() override;
+    virtual qint32 read(char *data, qint32 size) override;
+    virtual qint32 readall(char *data, qint32 size) override;
+    virtual qint32 write(char *data, qint32 size) override;
+    virtual qint32 writeall(char *data, qint32 size) override;
+    virtual bool atEnd() override;
+    virtual void close() override;
+    virtual qint64 size() override;
+    virtual QSharedPointer<QFile> file() override;
+    virtual bool seek(qint64 pos) override;
+    virtual QByteArray readall(bool *ok) override;
+private:
+    QSharedPointer<QFile> f;
+    uchar *data;
+    qint64 mappedSize;
+    qint64 pos;
+};
+
+MappedFile::~MappedFile()
+{
+    MappedFile::close();
+}
+
+qint32 MappedFile::read(char *data, qint32 size)
+{
+    const qint32 readBytes = static_cast<qint32>(qMin<qint64>(mappedSize - pos, qMax(0, size)));
+    if (readBytes > 0) {
+        memcpy(data, this->data + pos, static_cast<size_t>(readBytes));
+        pos += readBytes;
+    }
+    return readBytes;
+}
+
+qint32 MappedFile::readall(char *data, qint32 size)
+{
+    return MappedFile::read(data, size);
+}
+
+qint32 MappedFile::write(char *, qint32)
+{
+    return -1;
+}
+
+qint32 MappedFile::writeall(char *, qint32)
+{
+    return -1;
+}
+
+bool MappedFile::atEnd()
+{
+    return pos >= mappedSize;
+}
+
+void MappedFile::close()
+{
+    if (data) {
+        f->unmap(data);
+        data = nullptr;
+    }
+    mappedSize = 0;
+    pos = 0;
+    f->close();
+}
+
+qint64 MappedFile::size()
+{
+    return mappedSize;
+}
+
+QSharedPointer<QFile> MappedFile::file()
+{
+    return f;
+}
+
+bool MappedFile::seek(qint64 pos)
+{
+    if (pos < 0 || pos > mappedSize) {
+        return false;
+    }
+    this->pos = pos;
+    return true;
+}
+
+QByteArray MappedFile::readall(bool *ok)
+{
+    const qint64 leftBytes = mappedSize - pos;
+    if (leftBytes >= static_cast<qint64>(INT32_MAX)) {
+        if (ok) *ok = false;
+        return QByteArray();
+    }
+    if (ok) *ok = true;
+    if (leftBytes <= 0) {
+        return QByteArray();
+    }
+    const QByteArray &view = QByteArray::fromRawData(reinterpret_cast<const char *>(data + pos),
+                                                     static_cast<qint32>(leftBytes));
+    pos = mappedSize;
+    return view;
+}
+
+QSharedPointer<FileLike> FileLike::mapped(const QString &path, MappingHint hint)
+{
+    QSharedPointer<QFile> f(new QFile(path));
+    if (!f->open(QIODevice::ReadOnly)) {
+        return QSharedPointer<FileLike>();
+    }
+    const qint64 size = f->size();
+    if (size <= 0) {
+        // an empty file can not be mapped, and the special files report zero size.
+        return rawFile(f);
+    }
+    uchar *data = f->map(0, size);
+    if (!data) {
+        return rawFile(f);
+    }
+#ifdef Q_OS_UNIX
+    int advice;
+    switch (hint) {
+    case SequentialAccess:
+        advice = POSIX_MADV_SEQUENTIAL;
+        break;
+    case RandomAccess:
+        advice = POSIX_MADV_RANDOM;
+        break;
+    case WillNeedAccess:
+        advice = POSIX_MADV_WILLNEED;
+        break;
+    default:
+        advice = POSIX_MADV_NORMAL;
+        break;
+    }
+    // mapped from offset zero, so data is aligned to the page.
+    posix_madvise(data, static_cast<size_t>(size), advice);
+#else
+    Q_UNUSED(hint);
+#endif
+    return QSharedPointer<MappedFile>::create(f, data, size).dynamicCast<FileLike>();
+}
+
 
 class BytesIO: public FileLike
 {
@@ -344,6 +880,7 @@ public:
     virtual bool atEnd() override;
     virtual void close() override;
     virtual qint64 size() override;
+    virtual bool seek(qint64 pos) override;
 private:
     QByteArray buf;
     qint32 pos;
@@ -393,196 +930,352 @@ qint64 BytesIO::size()
     return buf.size();
 }
 
+bool BytesIO::seek(qint64 pos)
+{
+    if (pos < 0 || pos > buf.size()) {
+        return false;
+    }
+    this->pos = static_cast<qint32>(pos);
+    return true;
+}
+
 QSharedPointer<FileLike> FileLike::bytes(const QByteArray &data)
 {
     return QSharedPointer<BytesIO>::create(data).dynamicCast<FileLike>();
 }
 
+class TokenBucketPrivate
+{
+public:
+    TokenBucketPrivate(qint64 rate, qint64 burst)
+        : rate(rate), burst(burst * 1000), tokens(burst * 1000), updatedAt(QElapsedTimer::msecsSinceReference()) {}
+public:
+    QMutex lock;
+    const qint64 rate;
+    const qint64 burst;     // in millibytes, so a refill of few milliseconds is not rounded off.
+    qint64 tokens;
+    qint64 updatedAt;
+};
+
+
+TokenBucket::TokenBucket() {}
+
+
+TokenBucket::TokenBucket(qint64 bytesPerSecond, qint64 burst)
+    : d(new TokenBucketPrivate(qMax<qint64>(1, bytesPerSecond), burst > 0 ? burst : qMax<qint64>(1, bytesPerSecond)))
+{
+}
+
+
+qint64 TokenBucket::rate() const
+{
+    return d.isNull() ? 0 : d->rate;
+}
+
+
+// the tokens go into debt, and the taker sleeps until it is paid. so the bytes are never split, and the
+// waiting coroutines are served in the order of taking.
+void TokenBucket::take(qint64 bytes)
+{
+    if (d.isNull() || bytes <= 0) {
+        return;
+    }
+    qint64 debt;
+    {
+        QMutexLocker locker(&d->lock);
+        const qint64 now = QElapsedTimer::msecsSinceReference();
+        const qint64 elapsed = now - d->updatedAt;
+        if (elapsed > 0) {
+            if (elapsed >= (d->burst - d->tokens) / d->rate + 1) {
+                d->tokens = d->burst;
+            } else {
+                d->tokens += elapsed * d->rate;
+            }
+            d->updatedAt = now;
+        }
+        d->tokens -= bytes * 1000;
+        debt = -d->tokens;
+    }
+    if (debt > 0) {
+        Coroutine::msleep(static_cast<quint32>(qMin<qint64>(debt / d->rate + 1, 0x7fffffff)));
+    }
+}
+
+
 class ExchangerPrivate
 {
 public:
-    ExchangerPrivate(QSharedPointer<StreamLike> request, QSharedPointer<StreamLike> forward, quint32 maxBufferSize, float timeout);
+    ExchangerPrivate(QSharedPointer<StreamLike> request, QSharedPointer<StreamLike> forward, float timeout);
     ~ExchangerPrivate();
 public:
-    void receiveOutgoing();
-    void receiveIncoming();
-    void sendOutgoing();
-    void sendIncoming();
-    void in2out();
-    void out2in();
+    void relay(QSharedPointer<StreamLike> from, QSharedPointer<StreamLike> to, QSharedPointer<Socket> rawTo,
+               qint64 *sendingSince, qint64 *bytes, TokenBucket *limit);
+    void splice(QSharedPointer<Socket> from, QSharedPointer<Socket> to, qint64 *bytes, TokenBucket *limit);
+    void countFirstByte();
+    bool isStalled() const;
 public:
     QSharedPointer<StreamLike> request;
     QSharedPointer<StreamLike> forward;
     CoroutineGroup *operations;
-    Queue<QByteArray> incoming;
-    Queue<QByteArray> outgoing;
+    TokenBucket outgoingLimit;
+    TokenBucket incomingLimit;
     float timeout;
+    // when the blocking sendall() of each direction started, zero if it is receiving.
+    qint64 outgoingSince;
+    qint64 incomingSince;
+    qint64 outgoingBytes;
+    qint64 incomingBytes;
+    qint64 startedAt;
+    qint64 firstByteAt;
 };
 
-#define EXCHANGER_PACKET_SIZE (1024 * 8)
+#define EXCHANGER_BUFFER_SIZE (1024 * 32)
+#define EXCHANGER_SPLICE_SIZE (1024 * 64)
+#define EXCHANGER_POOLED_BUFFERS 256
 
-ExchangerPrivate::ExchangerPrivate(QSharedPointer<StreamLike> request, QSharedPointer<StreamLike> forward, quint32 maxBufferSize, float timeout)
-    :request(request), forward(forward), operations(new CoroutineGroup), incoming(maxBufferSize / EXCHANGER_PACKET_SIZE), outgoing(maxBufferSize / EXCHANGER_PACKET_SIZE),  timeout(timeout)
-{}
+// the buffers of finished relays are kept for the next ones, so a proxy does not allocate two buffers for
+// every connection. the buffers are refcounted, a buffer is not pooled again if it is still shared.
+struct ExchangerBufferPool
+{
+    QList<QByteArray> buffers;
+};
+Q_GLOBAL_STATIC(QThreadStorage<ExchangerBufferPool *>, exchangerBufferPools)
 
 
-ExchangerPrivate::~ExchangerPrivate()
+class ExchangerBuffer
 {
-    delete operations;
-}
+public:
+    ExchangerBuffer();
+    ~ExchangerBuffer();
+    char *data() { return buf.data(); }
+private:
+    QByteArray buf;
+};
 
 
-void ExchangerPrivate::receiveOutgoing()
+ExchangerBuffer::ExchangerBuffer()
 {
-    QByteArray buf(EXCHANGER_PACKET_SIZE, Qt::Uninitialized);
-    while (true) {
-        qint32 len = forward->recv(buf.data(), buf.size());
-        if (len <= 0) {
-            operations->kill("receive_incoming", false);
-            operations->kill("send_outgoing", false);
-            incoming.put(QByteArray());
-            return;
-        }
-        incoming.put(QByteArray(buf.constData(), len));
+    QThreadStorage<ExchangerBufferPool *> *storage = exchangerBufferPools();
+    if (storage && storage->hasLocalData() && !storage->localData()->buffers.isEmpty()) {
+        buf = storage->localData()->buffers.takeLast();
+    } else {
+        buf = QByteArray(EXCHANGER_BUFFER_SIZE, Qt::Uninitialized);
     }
 }
 
 
-void ExchangerPrivate::receiveIncoming()
+ExchangerBuffer::~ExchangerBuffer()
 {
-    QByteArray buf(EXCHANGER_PACKET_SIZE, Qt::Uninitialized);
-    while (true) {
-        qint32 len = request->recv(buf.data(), buf.size());
-        if (len <= 0) {
-            operations->kill("receive_outgoing", false);
-            operations->kill("sending_incoming", false);
-            outgoing.put(QByteArray());
-            return;
-        }
-        outgoing.put(QByteArray(buf.constData(), len));
+    QThreadStorage<ExchangerBufferPool *> *storage = exchangerBufferPools();
+    if (!storage || !buf.isDetached()) {
+        return;
+    }
+    if (!storage->hasLocalData()) {
+        storage->setLocalData(new ExchangerBufferPool());
     }
+    QList<QByteArray> &buffers = storage->localData()->buffers;
+    if (buffers.size() < EXCHANGER_POOLED_BUFFERS) {
+        buffers.append(buf);
+    }
+}
+
+
+ExchangerPrivate::ExchangerPrivate(QSharedPointer<StreamLike> request, QSharedPointer<StreamLike> forward, float timeout)
+    :request(request), forward(forward), operations(new CoroutineGroup), timeout(timeout), outgoingSince(0), incomingSince(0)
+    , outgoingBytes(0), incomingBytes(0), startedAt(0), firstByteAt(0)
+{}
+
+
+ExchangerPrivate::~ExchangerPrivate()
+{
+    delete operations;
 }
 
-void ExchangerPrivate::sendOutgoing()
+
+// sends straight from the receiving buffer. the eof is passed by half-closing the raw socket, and the other
+// direction keeps relaying until it ends too. other streams can not be half-closed, so the exchange ends.
+void ExchangerPrivate::relay(QSharedPointer<StreamLike> from, QSharedPointer<StreamLike> to, QSharedPointer<Socket> rawTo,
+                             qint64 *sendingSince, qint64 *bytes, TokenBucket *limit)
 {
+    ExchangerBuffer buf;
     while (true) {
-        QByteArray buf = outgoing.get();
-        if (buf.isEmpty()) {
+        qint32 len = from->recv(buf.data(), EXCHANGER_BUFFER_SIZE);
+        if (len == 0 && !rawTo.isNull() && rawTo->shutdownWrite()) {
             return;
-        } else {
-            while (!outgoing.isEmpty()) {
-                buf.append(outgoing.get());
-            }
         }
-        qint32 len;
-        try {
-            Timeout timeout(this->timeout); Q_UNUSED(timeout);
-            len = forward->sendall(buf);
-        } catch (TimeoutException &) {
-            len = -1;
+        if (len <= 0) {
+            operations->killall(false);
+            return;
+        }
+        if (bytes == &incomingBytes && !incomingBytes) {
+            countFirstByte();
+        }
+        *bytes += len;
+        if (!limit->isNull()) {
+            limit->take(len);
         }
-        if (len != buf.size()) {
+        *sendingSince = QElapsedTimer::msecsSinceReference();
+        qint32 sentBytes = to->sendall(buf.data(), len);
+        *sendingSince = 0;
+        if (sentBytes != len) {
             operations->killall(false);
             return;
         }
     }
 }
 
-void ExchangerPrivate::sendIncoming()
+
+void ExchangerPrivate::countFirstByte()
+{
+    firstByteAt = QElapsedTimer::msecsSinceReference();
+}
+
+
+void ExchangerPrivate::splice(QSharedPointer<Socket> from, QSharedPointer<Socket> to, qint64 *bytes, TokenBucket *limit)
 {
     while (true) {
-        QByteArray buf = incoming.get();
-        if (buf.isEmpty()) {
-            return;
-        } else {
-            while (!incoming.isEmpty()) {
-                buf.append(incoming.get());
-            }
-        }
         qint32 len;
         try {
-            Timeout timeout(this->timeout); Q_UNUSED(timeout);
-            len = request->sendall(buf);
+            len = from->splice(to.data(), EXCHANGER_SPLICE_SIZE, timeout);
         } catch (TimeoutException &) {
             len = -1;
         }
-        if (len != buf.size()) {
-            operations->killall(false);
+        if (len == 0 && to->shutdownWrite()) {
             return;
         }
-    }
-}
-
-
-void ExchangerPrivate::in2out()
-{
-    QByteArray buf(EXCHANGER_PACKET_SIZE, Qt::Uninitialized);
-    while (true) {
-        qint32 len = request->recv(buf.data(), buf.size());
         if (len <= 0) {
             operations->killall(false);
             return;
         }
-        qint32 sentBytes = -1;
-        try {
-            Timeout timeout(this->timeout); Q_UNUSED(timeout);
-            sentBytes = forward->sendall(buf.data(), len);
-        } catch (TimeoutException &) {
-            sentBytes = -1;
+        if (bytes == &incomingBytes && !incomingBytes) {
+            countFirstByte();
         }
-        if (sentBytes != len) {
-            operations->killall(false);
-            return;
+        *bytes += len;
+        if (!limit->isNull()) {
+            limit->take(len);
         }
     }
 }
 
-void ExchangerPrivate::out2in()
+
+bool ExchangerPrivate::isStalled() const
+{
+    const qint64 now = QElapsedTimer::msecsSinceReference();
+    const qint64 limit = static_cast<qint64>(timeout * 1000);
+    return (outgoingSince && now - outgoingSince > limit) || (incomingSince && now - incomingSince > limit);
+}
+
+
+Exchanger::Exchanger(QSharedPointer<StreamLike> request, QSharedPointer<StreamLike> forward, quint32 maxBufferSize, float timeout)
+    : d_ptr(new ExchangerPrivate(request, forward, timeout))
+{
+    Q_UNUSED(maxBufferSize);
+}
+
+
+Exchanger::~Exchanger()
+{
+    delete d_ptr;
+}
+
+
+void Exchanger::exchange()
 {
-    QByteArray buf(EXCHANGER_PACKET_SIZE, Qt::Uninitialized);
+    Q_D(Exchanger);
+    d->startedAt = QElapsedTimer::msecsSinceReference();
+    QSharedPointer<Socket> request = convertSocketLikeToSocket(d->request.dynamicCast<SocketLike>());
+    QSharedPointer<Socket> forward = convertSocketLikeToSocket(d->forward.dynamicCast<SocketLike>());
+    if (!request.isNull() && request->type() != Socket::TcpSocket) {
+        request.clear();
+    }
+    if (!forward.isNull() && forward->type() != Socket::TcpSocket) {
+        forward.clear();
+    }
+    // both are raw tcp sockets, relay in kernel without copying the data to userspace.
+    if (Socket::isSpliceSupported() && !request.isNull() && !forward.isNull()) {
+        d->operations->spawn([d, request, forward] {
+            d->splice(request, forward, &d->outgoingBytes, &d->outgoingLimit);
+        });
+        d->operations->spawn([d, request, forward] {
+            d->splice(forward, request, &d->incomingBytes, &d->incomingLimit);
+        });
+        d->operations->joinall();
+        return;
+    }
+    d->operations->spawn([d, forward] {
+        d->relay(d->request, d->forward, forward, &d->outgoingSince, &d->outgoingBytes, &d->outgoingLimit);
+    });
+    d->operations->spawn([d, request] {
+        d->relay(d->forward, d->request, request, &d->incomingSince, &d->incomingBytes, &d->incomingLimit);
+    });
+    if (d->timeout <= 0) {
+        d->operations->joinall();
+        return;
+    }
+    // one timer watches the sending of both directions, instead of a timer for every sendall().
+    const quint32 period = qMax<quint32>(1000, static_cast<quint32>(d->timeout * 500));
     while (true) {
-        qint32 len = forward->recv(buf.data(), buf.size());
-        if (len <= 0) {
-            operations->killall(false);
-            return;
-        }
-        qint32 sentBytes = -1;
         try {
-            Timeout timeout(this->timeout); Q_UNUSED(timeout);
-            sentBytes = request->sendall(buf.data(), len);
+            Timeout timeout(period, 0); Q_UNUSED(timeout);
+            d->operations->joinall();
+            return;
         } catch (TimeoutException &) {
-            sentBytes = -1;
         }
-        if (sentBytes != len) {
-            operations->killall(false);
+        if (d->isStalled()) {
+            d->operations->killall();
             return;
         }
     }
 }
 
-Exchanger::Exchanger(QSharedPointer<StreamLike> request, QSharedPointer<StreamLike> forward, quint32 maxBufferSize, float timeout)
-    : d_ptr(new ExchangerPrivate(request, forward, maxBufferSize, timeout))
+
+qint64 Exchanger::outgoingBytes() const
 {
+    Q_D(const Exchanger);
+    return d->outgoingBytes;
+}
+
 
+qint64 Exchanger::incomingBytes() const
+{
+    Q_D(const Exchanger);
+    return d->incomingBytes;
 }
 
 
-Exchanger::~Exchanger()
+qint64 Exchanger::firstByteMsecs() const
 {
-    delete d_ptr;
+    Q_D(const Exchanger);
+    if (!d->firstByteAt) {
+        return -1;
+    }
+    return d->firstByteAt - d->startedAt;
 }
 
 
-void Exchanger::exchange()
+qint64 Exchanger::stalledMsecs() const
+{
+    Q_D(const Exchanger);
+    const qint64 since = d->outgoingSince && d->incomingSince ? qMin(d->outgoingSince, d->incomingSince)
+                                                               : qMax(d->outgoingSince, d->incomingSince);
+    if (!since) {
+        return 0;
+    }
+    return QElapsedTimer::msecsSinceReference() - since;
+}
+
+
+void Exchanger::setOutgoingLimit(const TokenBucket &bucket)
+{
+    Q_D(Exchanger);
+    d->outgoingLimit = bucket;
+}
+
+
+void Exchanger::setIncomingLimit(const TokenBucket &bucket)
 {
     Q_D(Exchanger);
-//    d->operations->spawnWithName("receive_outgoing", [d] { d->receiveOutgoing(); });
-//    d->operations->spawnWithName("receive_incoming", [d] { d->receiveIncoming(); });
-//    d->operations->spawnWithName("send_outgoing", [d] { d->sendOutgoing(); });
-//    d->operations->spawnWithName("send_incoming", [d] { d->sendIncoming(); });
-    d->operations->spawn([d] { d->in2out(); });
-    d->operations->spawn([d] { d->out2in(); });
-    d->operations->joinall();
+    d->incomingLimit = bucket;
 }
 
 
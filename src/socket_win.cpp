@@ -3,6 +3,7 @@
 #include <ws2tcpip.h>
 #include <mswsock.h>
 #include <QtCore/qsysinfo.h>
+#include <QtCore/qvarlengtharray.h>
 #include <QtNetwork/qnetworkinterface.h>
 #include "../include/private/socket_p.h"
 
@@ -201,11 +202,10 @@ static inline void qt_socket_getPortAndAddress(SOCKET socketDescriptor, const qt
         for (int i = 0; i < 16; ++i)
             tmp.c[i] = sa6->sin6_addr.s6_addr[i];
         if (address) {
-            QHostAddress a;
-            a.setAddress(tmp);
+            // set the address in place, a temporary QHostAddress would allocate its private for every datagram.
+            address->setAddress(tmp);
             if (sa6->sin6_scope_id)
-                a.setScopeId(QString::number(sa6->sin6_scope_id));
-            *address = a;
+                address->setScopeId(QString::number(sa6->sin6_scope_id));
         }
         if (port)
             WSANtohs(socketDescriptor, sa6->sin6_port, port);
@@ -213,10 +213,8 @@ static inline void qt_socket_getPortAndAddress(SOCKET socketDescriptor, const qt
         const sockaddr_in *sa4 = &sa->a4;
         unsigned long addr;
         WSANtohl(socketDescriptor, sa4->sin_addr.s_addr, &addr);
-        QHostAddress a;
-        a.setAddress(addr);
         if (address)
-            *address = a;
+            address->setAddress(addr);
         if (port)
             WSANtohs(socketDescriptor, sa4->sin_port, port);
     } else {
@@ -224,6 +222,21 @@ static inline void qt_socket_getPortAndAddress(SOCKET socketDescriptor, const qt
     }
 }
 
+
+// the scope id of ipv6 is dropped, use the QHostAddress version for the link local peers.
+static inline void qt_socket_getEndpoint(const qt_sockaddr *sa, Endpoint *endpoint)
+{
+    if (sa->a.sa_family == AF_INET6) {
+        memcpy(endpoint->address, &sa->a6.sin6_addr, sizeof(endpoint->address));
+        endpoint->port = ntohs(sa->a6.sin6_port);
+        endpoint->family = Endpoint::IPv6;
+    } else if (sa->a.sa_family == AF_INET) {
+        *endpoint = Endpoint::fromIPv4(ntohl(sa->a4.sin_addr.s_addr), ntohs(sa->a4.sin_port));
+    } else {
+        *endpoint = Endpoint();
+    }
+}
+
 static void convertToLevelAndOption(Socket::SocketOption opt,
                                     Socket::NetworkLayerProtocol socketProtocol, int &level, int &n)
 {
@@ -234,6 +247,15 @@ static void convertToLevelAndOption(Socket::SocketOption opt,
     case Socket::NonBlockingSocketOption:      // WSAIoctl
     case Socket::TypeOfServiceOption:          // not supported
     case Socket::MaxStreamsSocketOption:
+    case Socket::UdpSegmentOption:
+    case Socket::UdpGroOption:
+    case Socket::ReusePortOption:
+    case Socket::TcpFastOpenOption:
+    case Socket::TcpFastOpenConnectOption:
+    case Socket::BusyPollOption:
+    case Socket::PreferBusyPollOption:
+    case Socket::CorkOption:
+    case Socket::NotSentLowWatermarkOption:
         Q_UNREACHABLE();
 
     case Socket::ReceiveBufferSizeSocketOption:
@@ -361,8 +383,33 @@ void SocketPrivate::setPortAndAddress(quint16 port, const QHostAddress &address,
     }
 }
 
+void SocketPrivate::setEndpoint(const Endpoint &endpoint, qt_sockaddr *aa, int *sockAddrSize)
+{
+    if (endpoint.family == Endpoint::IPv6
+        || protocol == Socket::IPv6Protocol
+        || protocol == Socket::AnyIPProtocol) {
+        memset(&aa->a6, 0, sizeof(sockaddr_in6));
+        aa->a6.sin6_family = AF_INET6;
+        aa->a6.sin6_port = htons(endpoint.port);
+        memcpy(&aa->a6.sin6_addr, endpoint.address, sizeof(endpoint.address));
+        *sockAddrSize = sizeof(sockaddr_in6);
+        SetSALen::set(&aa->a, sizeof(sockaddr_in6));
+    } else {
+        memset(&aa->a, 0, sizeof(sockaddr_in));
+        aa->a4.sin_family = AF_INET;
+        aa->a4.sin_port = htons(endpoint.port);
+        memcpy(&aa->a4.sin_addr, endpoint.address + 12, 4);
+        *sockAddrSize = sizeof(sockaddr_in);
+        SetSALen::set(&aa->a, sizeof(sockaddr_in));
+    }
+}
+
 bool SocketPrivate::createSocket()
 {
+    if (this->protocol == Socket::UnixProtocol) {
+        setError(Socket::UnsupportedSocketOperationError, ProtocolUnsupportedErrorString);
+        return false;
+    }
     //Windows XP and 2003 support IPv6 but not dual stack sockets
     int protocol = (this->protocol == Socket::IPv6Protocol
         || (this->protocol == Socket::AnyIPProtocol)) ? AF_INET6 : AF_INET;
@@ -654,7 +701,7 @@ bool SocketPrivate::connect(const QHostAddress &address, quint16 port)
                 setError(Socket::UnknownSocketError, UnknownSocketErrorString);
                 return false;
             }
-            watcher.start();
+            waitWatcher(watcher);
         } else {
             state = Socket::ConnectedState;
             fetchConnectionParameters();
@@ -679,6 +726,18 @@ bool SocketPrivate::close()
     return true;
 }
 
+bool SocketPrivate::shutdownWrite()
+{
+    if (!isValid() || state != Socket::ConnectedState) {
+        return false;
+    }
+    if (::shutdown(static_cast<SOCKET>(fd), SD_SEND) == SOCKET_ERROR) {
+        setError(Socket::UnknownSocketError, UnknownSocketErrorString);
+        return false;
+    }
+    return true;
+}
+
 bool SocketPrivate::listen(int backlog)
 {
     if(!isValid()) {
@@ -721,6 +780,7 @@ bool SocketPrivate::listen(int backlog)
 
 bool SocketPrivate::fetchConnectionParameters()
 {
+    localAddressPending = false;
     localPort = 0;
     localAddress.clear();
     peerPort = 0;
@@ -861,11 +921,31 @@ qint32 SocketPrivate::recv(char *data, qint32 size, bool all)
                 return total;
             }
         }
-        watcher.start();
+        waitWatcher(watcher);
     }
     return total;
 }
 
+// windows supports fast open by ConnectEx() only, send the data after connected.
+bool SocketPrivate::connect(const QHostAddress &address, quint16 port, const QByteArray &initialData)
+{
+    if (!connect(address, port)) {
+        return false;
+    }
+    if (initialData.isEmpty()) {
+        return true;
+    }
+    return send(initialData.constData(), initialData.size(), true) == initialData.size();
+}
+
+
+bool SocketPrivate::setZeroCopyThreshold(qint32 bytes)
+{
+    Q_UNUSED(bytes);
+    return false;
+}
+
+
 qint32 SocketPrivate::send(const char *data, qint32 size, bool all)
 {
     if(!isValid()) {
@@ -962,13 +1042,35 @@ qint32 SocketPrivate::send(const char *data, qint32 size, bool all)
                 return -1;
             }
         }
-        watcher.start();
+        waitWatcher(watcher);
     }
     return ret;
 }
 
 
 qint32 SocketPrivate::recvfrom(char *data, qint32 size, QHostAddress *addr, quint16 *port)
+{
+    qt_sockaddr aa;
+    qint32 r = recvfrom(data, size, &aa);
+    if (r > 0) {
+        qt_socket_getPortAndAddress(static_cast<SOCKET>(fd), &aa, port, addr);
+    }
+    return r;
+}
+
+
+qint32 SocketPrivate::recvfrom(char *data, qint32 size, Endpoint *endpoint)
+{
+    qt_sockaddr aa;
+    qint32 r = recvfrom(data, size, &aa);
+    if (r > 0 && endpoint) {
+        qt_socket_getEndpoint(&aa, endpoint);
+    }
+    return r;
+}
+
+
+qint32 SocketPrivate::recvfrom(char *data, qint32 size, qt_sockaddr *aa)
 {
     if(!isValid() || size < 0) {
         return -1;
@@ -976,18 +1078,17 @@ qint32 SocketPrivate::recvfrom(char *data, qint32 size, QHostAddress *addr, quin
 
     WSAMSG msg;
     WSABUF buf;
-    qt_sockaddr aa;
     char c;
     memset(&msg, 0, sizeof(msg));
-    memset(&aa, 0, sizeof(aa));
+    memset(aa, 0, sizeof(*aa));
 
     // we need to receive at least one byte, even if our user isn't interested in it
     buf.buf = size ? data : &c;
     buf.len = size ? static_cast<quint32>(size) : 1;
     msg.lpBuffers = &buf;
     msg.dwBufferCount = 1;
-    msg.name = reinterpret_cast<LPSOCKADDR>(&aa);
-    msg.namelen = sizeof(aa);
+    msg.name = reinterpret_cast<LPSOCKADDR>(aa);
+    msg.namelen = sizeof(*aa);
 
     DWORD flags = 0;
     DWORD bytesRead = 0;
@@ -1052,22 +1153,36 @@ qint32 SocketPrivate::recvfrom(char *data, qint32 size, QHostAddress *addr, quin
 
         }
         if(ret > 0) {
-            qt_socket_getPortAndAddress(static_cast<SOCKET>(fd), &aa, port, addr);
 #if defined (SOCKET_DEBUG)
-            bool printSender = (ret != -1);
-            qDebug("SocketPrivate::recvfrom(%p \"%s\", %lli, %s, %i) == %lli",
-                   data, qt_prettyDebug(data, qMin<qint64>(ret, 16), ret).data(), size,
-                   printSender ? addr->toString().toLatin1().constData() : "(unknown)",
-                   printSender ? port : 0, ret);
+            qDebug("SocketPrivate::recvfrom(%p \"%s\", %lli) == %lli",
+                   data, qt_prettyDebug(data, qMin<qint64>(ret, 16), ret).data(), size, ret);
 #endif
             return ret;
         } else {
-            watcher.start();
+            waitWatcher(watcher);
         }
     }
 }
 
 qint32 SocketPrivate::sendto(const char *data, qint32 size, const QHostAddress &addr, quint16 port)
+{
+    qt_sockaddr aa;
+    int t;
+    setPortAndAddress(port, addr, &aa, &t);
+    return sendto(data, size, &aa, t);
+}
+
+
+qint32 SocketPrivate::sendto(const char *data, qint32 size, const Endpoint &endpoint)
+{
+    qt_sockaddr aa;
+    int t;
+    setEndpoint(endpoint, &aa, &t);
+    return sendto(data, size, &aa, t);
+}
+
+
+qint32 SocketPrivate::sendto(const char *data, qint32 size, const qt_sockaddr *aa, int sockAddrSize)
 {
     if(!isValid()) {
         return -1;
@@ -1077,13 +1192,11 @@ qint32 SocketPrivate::sendto(const char *data, qint32 size, const QHostAddress &
 
     WSAMSG msg;
     WSABUF buf;
-    qt_sockaddr aa;
     memset(&msg, 0, sizeof(msg));
-    memset(&aa, 0, sizeof(aa));
-    setPortAndAddress(port, addr, &aa, &msg.namelen);
+    msg.namelen = sockAddrSize;
     msg.lpBuffers = &buf;
     msg.dwBufferCount = 1;
-    msg.name = &aa.a;
+    msg.name = const_cast<LPSOCKADDR>(&aa->a);
 
     buf.buf = bytesToSend ? const_cast<char*>(data) : nullptr;
     buf.len = static_cast<u_long>(bytesToSend); // TODO datagram max size!
@@ -1142,8 +1255,235 @@ qint32 SocketPrivate::sendto(const char *data, qint32 size, const QHostAddress &
                 return ret;
             }
         }
-        watcher.start();
+        waitWatcher(watcher);
+    }
+}
+
+
+// windows has no recvmmsg(), receive one datagram, and send them one by one.
+qint32 SocketPrivate::recvmany(SocketDatagram *datagrams, qint32 count)
+{
+    if(count <= 0) {
+        return -1;
+    }
+    qt_sockaddr aa;
+    qint32 len = recvfrom(datagrams[0].data, datagrams[0].size, &aa);
+    if(len < 0) {
+        return -1;
+    }
+    qt_socket_getPortAndAddress(static_cast<SOCKET>(fd), &aa, &datagrams[0].port, &datagrams[0].address);
+    qt_socket_getEndpoint(&aa, &datagrams[0].endpoint);
+    datagrams[0].length = len;
+    datagrams[0].segmentSize = 0;
+    return 1;
+}
+
+
+qint32 SocketPrivate::sendmany(SocketDatagram *datagrams, qint32 count)
+{
+    qint32 sent = 0;
+    for(; sent < count; ++sent) {
+        SocketDatagram &datagram = datagrams[sent];
+        // no UDP_SEGMENT here, split the buffer by ourself.
+        const qint32 step = datagram.segmentSize > 0 ? datagram.segmentSize : datagram.size;
+        qint32 offset = 0;
+        do {
+            qint32 len = sendto(datagram.data + offset, qMin(step, datagram.size - offset), datagram.address, datagram.port);
+            if(len < 0) {
+                return sent > 0 ? sent : -1;
+            }
+            offset += len;
+        } while(offset < datagram.size);
+        datagram.length = datagram.size;
     }
+    return sent;
+}
+
+
+qint32 SocketPrivate::sendv(const QList<QByteArray> &buffers, bool all)
+{
+    if(!isValid()) {
+        return -1;
+    }
+    QVarLengthArray<WSABUF, 16> bufs;
+    for(const QByteArray &buffer: buffers) {
+        if(buffer.isEmpty()) {
+            continue;
+        }
+        WSABUF buf;
+        buf.buf = const_cast<char*>(buffer.constData());
+        buf.len = static_cast<u_long>(buffer.size());
+        bufs.append(buf);
+    }
+    ScopedIoWatcher watcher(EventLoopCoroutine::Write, fd);
+    qint32 sent = 0;
+    int first = 0;
+    while(first < bufs.size()) {
+        if(!isValid()) {
+            setError(Socket::SocketAccessError, AccessErrorString);
+            return sent == 0 ? -1: sent;
+        }
+        DWORD bytesWritten = 0;
+        int socketRet = ::WSASend(static_cast<SOCKET>(fd), bufs.data() + first, static_cast<DWORD>(bufs.size() - first),
+                                  &bytesWritten, 0, nullptr, nullptr);
+        if(bytesWritten > 0) {
+            sent += static_cast<qint32>(bytesWritten);
+            u_long left = bytesWritten;
+            while(first < bufs.size() && left >= bufs[first].len) {
+                left -= bufs[first].len;
+                ++first;
+            }
+            if(left > 0) {
+                bufs[first].buf += left;
+                bufs[first].len -= left;
+            }
+        }
+        if(socketRet != SOCKET_ERROR) {
+            if(!all) {
+                return sent;
+            }
+            continue;
+        }
+        int err = WSAGetLastError();
+        WS_ERROR_DEBUG(err);
+        switch(err) {
+        case WSAEWOULDBLOCK:
+        case WSAEINPROGRESS:
+        case WSAENOBUFS:
+            if(sent > 0 && !all) {
+                return sent;
+            }
+            break;
+        case WSAECONNRESET:
+        case WSAECONNABORTED:
+        case WSAENOTCONN:
+            setError(Socket::NetworkError, WriteErrorString);
+            close();
+            return sent == 0 ? -1 : sent;
+        default:
+            setError(Socket::UnknownSocketError, UnknownSocketErrorString);
+            close();
+            return sent == 0 ? -1 : sent;
+        }
+        waitWatcher(watcher);
+    }
+    return sent;
+}
+
+
+qint32 SocketPrivate::recvv(SocketBuffer *buffers, qint32 count)
+{
+    if(!isValid()) {
+        return -1;
+    }
+    QVarLengthArray<WSABUF, 16> bufs;
+    for(qint32 i = 0; i < count; ++i) {
+        if(buffers[i].size <= 0) {
+            continue;
+        }
+        WSABUF buf;
+        buf.buf = buffers[i].data;
+        buf.len = static_cast<u_long>(buffers[i].size);
+        bufs.append(buf);
+    }
+    if(bufs.isEmpty()) {
+        return 0;
+    }
+    ScopedIoWatcher watcher(EventLoopCoroutine::Read, fd);
+    while(true) {
+        if(!isValid()) {
+            setError(Socket::SocketAccessError, AccessErrorString);
+            return -1;
+        }
+        DWORD flags = 0;
+        DWORD bytesRead = 0;
+        if(::WSARecv(static_cast<SOCKET>(fd), bufs.data(), static_cast<DWORD>(bufs.size()), &bytesRead, &flags, nullptr, nullptr) == SOCKET_ERROR) {
+            int err = WSAGetLastError();
+            WS_ERROR_DEBUG(err);
+            switch(err) {
+            case WSAEWOULDBLOCK:
+                break;
+            case WSAECONNRESET:
+            case WSAECONNABORTED:
+                if(type == Socket::TcpSocket) {
+                    setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
+                    close();
+                }
+                return 0;
+            default:
+                setError(Socket::NetworkError, ConnectionResetErrorString);
+                close();
+                return -1;
+            }
+        } else if(bytesRead == 0 && type == Socket::TcpSocket) {
+            setError(Socket::RemoteHostClosedError, RemoteHostClosedErrorString);
+            close();
+            return 0;
+        } else {
+            return static_cast<qint32>(bytesRead);
+        }
+        waitWatcher(watcher);
+    }
+}
+
+
+// TransmitFile() only works with overlapped io, but the eventloop waits for readiness of nonblocking sockets.
+qint64 SocketPrivate::sendfile(QFile *file, qint64 offset, qint64 length)
+{
+    return sendfileByCopy(file, offset, length);
+}
+
+
+qint32 SocketPrivate::spliceIn(SocketPrivate *target, qint32 size)
+{
+    Q_UNUSED(target);
+    Q_UNUSED(size);
+    setError(Socket::UnsupportedSocketOperationError, OperationUnsupportedErrorString);
+    return -1;
+}
+
+
+qint32 SocketPrivate::spliceOut(SocketPrivate *target)
+{
+    Q_UNUSED(target);
+    setError(Socket::UnsupportedSocketOperationError, OperationUnsupportedErrorString);
+    return -1;
+}
+
+
+bool SocketPrivate::bindPath(const QString &path)
+{
+    Q_UNUSED(path);
+    setError(Socket::UnsupportedSocketOperationError, OperationUnsupportedErrorString);
+    return false;
+}
+
+
+bool SocketPrivate::connectPath(const QString &path)
+{
+    Q_UNUSED(path);
+    setError(Socket::UnsupportedSocketOperationError, OperationUnsupportedErrorString);
+    return false;
+}
+
+
+qint32 SocketPrivate::sendDescriptors(const char *data, qint32 size, const QList<qintptr> &fds)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(size);
+    Q_UNUSED(fds);
+    setError(Socket::UnsupportedSocketOperationError, OperationUnsupportedErrorString);
+    return -1;
+}
+
+
+qint32 SocketPrivate::recvDescriptors(char *data, qint32 size, QList<qintptr> *fds)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(size);
+    Q_UNUSED(fds);
+    setError(Socket::UnsupportedSocketOperationError, OperationUnsupportedErrorString);
+    return -1;
 }
 
 QVariant SocketPrivate::option(Socket::SocketOption option) const
@@ -1157,6 +1497,15 @@ QVariant SocketPrivate::option(Socket::SocketOption option) const
         return QVariant(-1); // TODO return true if nonblocking is implemented.
     case Socket::TypeOfServiceOption:
     case Socket::MaxStreamsSocketOption:
+    case Socket::UdpSegmentOption:
+    case Socket::UdpGroOption:
+    case Socket::ReusePortOption:
+    case Socket::TcpFastOpenOption:
+    case Socket::TcpFastOpenConnectOption:
+    case Socket::BusyPollOption:
+    case Socket::PreferBusyPollOption:
+    case Socket::CorkOption:
+    case Socket::NotSentLowWatermarkOption:
         return -1;
     default:
         break;
@@ -1193,6 +1542,15 @@ bool SocketPrivate::setOption(Socket::SocketOption option, const QVariant &value
         return false;
     case Socket::TypeOfServiceOption:
     case Socket::MaxStreamsSocketOption:
+    case Socket::UdpSegmentOption:
+    case Socket::UdpGroOption:
+    case Socket::ReusePortOption:
+    case Socket::TcpFastOpenOption:
+    case Socket::TcpFastOpenConnectOption:
+    case Socket::BusyPollOption:
+    case Socket::PreferBusyPollOption:
+    case Socket::CorkOption:
+    case Socket::NotSentLowWatermarkOption:
         return false;
 
     default:
@@ -1270,8 +1628,23 @@ Socket *SocketPrivate::accept()
             Socket *conn = new Socket(static_cast<qintptr>(acceptedDescriptor));
             return conn;
         }
-        watcher.start();
+        waitWatcher(watcher);
+    }
+}
+
+
+// windows takes one connection per call.
+QList<Socket*> SocketPrivate::acceptmany(int maxCount)
+{
+    QList<Socket*> conns;
+    if (maxCount <= 0) {
+        return conns;
+    }
+    Socket *conn = accept();
+    if (conn) {
+        conns.append(conn);
     }
+    return conns;
 }
 
 
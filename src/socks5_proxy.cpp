@@ -1,5 +1,9 @@
 #include <QtCore/qurl.h>
 #include <QtCore/qendian.h>
+#include <QtCore/qvector.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qthread.h>
+#include <QtCore/qdatetime.h>
 #include "../include/socks5_proxy.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
@@ -63,99 +67,281 @@ QString Socks5Exception::errorString() const
 }
 
 
+// shared by the copies of a proxy, and reset if the proxy is changed.
+struct Socks5ProxyState
+{
+    Socks5ProxyState()
+        : resolvedAt(0), method(-1) {}
+    QMutex lock;
+    QList<QHostAddress> addresses;
+    qint64 resolvedAt;
+    int method;         // the auth method chosen by the proxy last time, -1 if unknown.
+    QList<QPair<qint64, QSharedPointer<Socket>>> warmSockets;
+};
+
+
+#define S5_ADDRESS_LIFETIME (60 * 1000)
+#define S5_WARM_SOCKET_LIFETIME (10 * 1000)
+
+
 class Socks5ProxyPrivate
 {
 public:
-    Socks5ProxyPrivate() {}
+    Socks5ProxyPrivate()
+        :port(0), state(new Socks5ProxyState) {}
     Socks5ProxyPrivate(const QString &hostName, quint16 port, const QString &user, const QString &password)
-        :hostName(hostName), port(port), user(user), password(password)
+        :hostName(hostName), port(port), user(user), password(password), state(new Socks5ProxyState)
     {
         capabilities |= Socks5Proxy::TunnelingCapability;
+        capabilities |= Socks5Proxy::UdpTunnelingCapability;
         capabilities |= Socks5Proxy:: HostNameLookupCapability;
     }
 public:
+    QSharedPointer<Socket> connectToProxy() const;
+    QByteArray makeGreeting(int method) const;
+    QByteArray makeAuthRequest() const;
+    bool recvGreetingReply(QSharedPointer<Socket> s, int method) const;
     QSharedPointer<Socket> getControlSocket() const;
+    QSharedPointer<Socket> takeWarmSocket() const;
+    QSharedPointer<Socket> sendRequest(const QByteArray &request) const;
     QSharedPointer<Socket> connect(const QString &hostName, quint16 port) const;
     QSharedPointer<Socket> connect(const QHostAddress &host, quint16 port) const;
     QSharedPointer<SocketLike> listen(quint16 port) const;
+    QSharedPointer<Socks5UdpSocket> udpAssociate() const;
+    void warmUp(int count) const;
 public:
     QFlags<Socks5Proxy::Capability> capabilities;
     QString hostName;
     quint16 port;
     QString user;
     QString password;
+    QSharedPointer<Socks5ProxyState> state;
 };
 
-QSharedPointer<Socket> Socks5ProxyPrivate::getControlSocket() const
+
+static void throwConnectError(QSharedPointer<Socket> s)
 {
-    QSharedPointer<Socket> s(new Socket);
-    if(!s->connect(hostName, port)) {
-        if(s->error() == Socket::HostNotFoundError) {
-            throw Socks5Exception(Socks5Exception::ProxyNotFoundError);
-        } else if(s->error() == Socket::RemoteHostClosedError) {
-            throw Socks5Exception(Socks5Exception::ProxyConnectionClosedError);
-        } else if(s->error() == Socket::ConnectionRefusedError) {
-            throw Socks5Exception(Socks5Exception::ProxyConnectionRefusedError);
-        } else if(s->error() == Socket::SocketTimeoutError) {
-            throw Socks5Exception(Socks5Exception::ProxyConnectionTimeoutError);
+    if(s->error() == Socket::HostNotFoundError) {
+        throw Socks5Exception(Socks5Exception::ProxyNotFoundError);
+    } else if(s->error() == Socket::RemoteHostClosedError) {
+        throw Socks5Exception(Socks5Exception::ProxyConnectionClosedError);
+    } else if(s->error() == Socket::ConnectionRefusedError) {
+        throw Socks5Exception(Socks5Exception::ProxyConnectionRefusedError);
+    } else if(s->error() == Socket::SocketTimeoutError) {
+        throw Socks5Exception(Socks5Exception::ProxyConnectionTimeoutError);
+    } else {
+        throw Socks5Exception(Socks5Exception::ProxyProtocolError);
+    }
+}
+
+
+// the address of proxy is resolved once a minute instead of every connection.
+QSharedPointer<Socket> Socks5ProxyPrivate::connectToProxy() const
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QList<QHostAddress> addresses;
+    {
+        QMutexLocker locker(&state->lock);
+        if (now - state->resolvedAt < S5_ADDRESS_LIFETIME) {
+            addresses = state->addresses;
+        }
+    }
+    if (addresses.isEmpty()) {
+        QHostAddress literal;
+        if (literal.setAddress(hostName)) {
+            addresses.append(literal);
         } else {
-            throw Socks5Exception(Socks5Exception::ProxyProtocolError);
+            addresses = Socket::resolve(hostName);
+        }
+        if (addresses.isEmpty()) {
+            throw Socks5Exception(Socks5Exception::ProxyNotFoundError);
         }
+        QMutexLocker locker(&state->lock);
+        state->addresses = addresses;
+        state->resolvedAt = now;
     }
-
-    QByteArray helloRequest;
-    helloRequest.reserve(3);
-    helloRequest.append((char) S5_VERSION_5);
-    helloRequest.append((char) S5_PASSWORDAUTH_VERSION);
-    helloRequest.append((char) S5_AUTHMETHOD_NONE);
-    if(!user.isEmpty() && !password.isEmpty()) {
-        helloRequest.append(S5_AUTHMETHOD_PASSWORD);
+    QSharedPointer<Socket> s;
+    for (const QHostAddress &address: addresses) {
+        s.reset(new Socket);
+        if (s->connect(address, port)) {
+            return s;
+        }
     }
-    qint64 sentBytes = s->sendall(helloRequest);
-    if(sentBytes < helloRequest.size()) {
-        throw Socks5Exception(Socks5Exception::ProxyProtocolError);
+    {
+        QMutexLocker locker(&state->lock);
+        state->resolvedAt = 0;
+    }
+    throwConnectError(s);
+    return s;
+}
+
+
+QByteArray Socks5ProxyPrivate::makeGreeting(int method) const
+{
+    QByteArray greeting;
+    greeting.reserve(4);
+    greeting.append((char) S5_VERSION_5);
+    if (method >= 0) {
+        greeting.append((char) 1);
+        greeting.append((char) method);
+    } else if (!user.isEmpty() && !password.isEmpty()) {
+        greeting.append((char) 2);
+        greeting.append((char) S5_AUTHMETHOD_NONE);
+        greeting.append((char) S5_AUTHMETHOD_PASSWORD);
+    } else {
+        greeting.append((char) 1);
+        greeting.append((char) S5_AUTHMETHOD_NONE);
     }
+    return greeting;
+}
+
+
+QByteArray Socks5ProxyPrivate::makeAuthRequest() const
+{
+    const QByteArray &u = user.toUtf8().left(255);
+    const QByteArray &p = password.toUtf8().left(255);
+    QByteArray authRequest;
+    authRequest.reserve(3 + u.size() + p.size());
+    authRequest.append((char) S5_PASSWORDAUTH_VERSION);
+    authRequest.append((char) u.size());
+    authRequest.append(u);
+    authRequest.append((char) p.size());
+    authRequest.append(p);
+    return authRequest;
+}
+
 
+// returns false if the proxy chooses another method, and the auth request sent with the greeting is wasted.
+bool Socks5ProxyPrivate::recvGreetingReply(QSharedPointer<Socket> s, int method) const
+{
     const QByteArray &helloResponse = s->recvall(2);
-    if(helloResponse.size() != 2) {
+    if(helloResponse.size() != 2 || helloResponse.at(0) != S5_VERSION_5) {
         throw Socks5Exception(Socks5Exception::ProxyProtocolError);
     }
+    if (static_cast<uchar>(helloResponse.at(1)) != method) {
+        return false;
+    }
+    if (method == S5_AUTHMETHOD_PASSWORD) {
+        const QByteArray &authResponse = s->recvall(2);
+        if(authResponse.size() != 2 || authResponse.at(0) != S5_PASSWORDAUTH_VERSION) {
+            throw Socks5Exception(Socks5Exception::ProxyProtocolError);
+        }
+        if(authResponse.at(1) != 0x00) {
+            throw Socks5Exception(Socks5Exception::ProxyAuthenticationRequiredError);
+        }
+    }
+    return true;
+}
 
-    if(helloResponse.at(0) != S5_VERSION_5) {
+
+QSharedPointer<Socket> Socks5ProxyPrivate::getControlSocket() const
+{
+    QSharedPointer<Socket> s = connectToProxy();
+    const QByteArray &helloRequest = makeGreeting(-1);
+    if(s->sendall(helloRequest) < helloRequest.size()) {
         throw Socks5Exception(Socks5Exception::ProxyProtocolError);
     }
-
-    if(helloResponse.at(1) == S5_AUTHMETHOD_PASSWORD) {
+    const QByteArray &helloResponse = s->recvall(2);
+    if(helloResponse.size() != 2 || helloResponse.at(0) != S5_VERSION_5) {
+        throw Socks5Exception(Socks5Exception::ProxyProtocolError);
+    }
+    const uchar method = static_cast<uchar>(helloResponse.at(1));
+    if(method == S5_AUTHMETHOD_PASSWORD) {
         if(user.isEmpty() || password.isEmpty()) {
             throw Socks5Exception(Socks5Exception::ProxyAuthenticationRequiredError);
         }
-        QByteArray authRequest;
-        authRequest.reserve(3 + user.size() + password.size());
-        authRequest.append(S5_PASSWORDAUTH_VERSION);
-        authRequest.append(user.size());
-        authRequest.append(user.toUtf8());
-        authRequest.append(password.size());
-        authRequest.append(password.toUtf8());
-        sentBytes = s->sendall(authRequest);
-        if(sentBytes < authRequest.size()) {
+        const QByteArray &authRequest = makeAuthRequest();
+        if(s->sendall(authRequest) < authRequest.size()) {
             throw Socks5Exception(Socks5Exception::ProxyProtocolError);
         }
-        const QByteArray authResponse = s->recvall(2);
-        if(authResponse.size() != 2) {
+        const QByteArray &authResponse = s->recvall(2);
+        if(authResponse.size() != 2 || authResponse.at(0) != S5_PASSWORDAUTH_VERSION) {
             throw Socks5Exception(Socks5Exception::ProxyProtocolError);
         }
-        if(authResponse.at(0) != S5_PASSWORDAUTH_VERSION) {
+        if(authResponse.at(1) != 0x00) {
+            throw Socks5Exception(Socks5Exception::ProxyAuthenticationRequiredError);
+        }
+    } else if(method != S5_AUTHMETHOD_NONE) {
+        throw Socks5Exception(Socks5Exception::ProxyProtocolError);
+    }
+    QMutexLocker locker(&state->lock);
+    state->method = method;
+    return s;
+}
+
+
+// the warm sockets belong to the thread made them, and the proxy may close them if they idle too long.
+QSharedPointer<Socket> Socks5ProxyPrivate::takeWarmSocket() const
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMutexLocker locker(&state->lock);
+    QList<QPair<qint64, QSharedPointer<Socket>>> &warmSockets = state->warmSockets;
+    for (int i = 0; i < warmSockets.size();) {
+        if (now - warmSockets.at(i).first > S5_WARM_SOCKET_LIFETIME) {
+            warmSockets.removeAt(i);
+        } else if (warmSockets.at(i).second->thread() == QThread::currentThread()) {
+            return warmSockets.takeAt(i).second;
+        } else {
+            ++i;
+        }
+    }
+    return QSharedPointer<Socket>();
+}
+
+
+// if the auth method of proxy is known, the greeting offers it only, and the auth request and the command are
+// sent with it by one write, which saves the round trips of greeting and auth.
+QSharedPointer<Socket> Socks5ProxyPrivate::sendRequest(const QByteArray &request) const
+{
+    QSharedPointer<Socket> s = takeWarmSocket();
+    if (!s.isNull() && s->sendall(request) == request.size()) {
+        return s;
+    }
+    int method;
+    {
+        QMutexLocker locker(&state->lock);
+        method = state->method;
+    }
+    if (method >= 0) {
+        s = connectToProxy();
+        QByteArray pipelined = makeGreeting(method);
+        if (method == S5_AUTHMETHOD_PASSWORD) {
+            pipelined.append(makeAuthRequest());
+        }
+        pipelined.append(request);
+        if (s->sendall(pipelined) < pipelined.size()) {
             throw Socks5Exception(Socks5Exception::ProxyProtocolError);
         }
-        if(authResponse.at(0) != 0x1) {
-            throw Socks5Exception(Socks5Exception::ProxyAuthenticationRequiredError);
+        if (recvGreetingReply(s, method)) {
+            return s;
         }
-    } else if(helloResponse.at(1) == (char) S5_AUTHMETHOD_NOTACCEPTABLE) {
+        s->close();
+        QMutexLocker locker(&state->lock);
+        state->method = -1;
+    }
+    s = getControlSocket();
+    if (s->sendall(request) < request.size()) {
         throw Socks5Exception(Socks5Exception::ProxyProtocolError);
     }
     return s;
 }
 
+
+void Socks5ProxyPrivate::warmUp(int count) const
+{
+    for (int i = 0; i < count; ++i) {
+        QSharedPointer<Socket> s;
+        try {
+            s = getControlSocket();
+        } catch (Socks5Exception &) {
+            return;
+        }
+        QMutexLocker locker(&state->lock);
+        state->warmSockets.append(qMakePair(QDateTime::currentMSecsSinceEpoch(), s));
+    }
+}
+
+
 static QByteArray makeConnectRequest()
 {
     QByteArray connectRequest;
@@ -223,12 +409,9 @@ static bool qt_socks5_set_host_name_and_port(const QString &hostname, quint16 po
 }
 
 
-static QSharedPointer<Socket> sendConnectRequest(QSharedPointer<Socket> s, const QByteArray &connectRequest)
+static QSharedPointer<Socket> recvCommandReply(QSharedPointer<Socket> s, QHostAddress *boundAddress = nullptr,
+                                               quint16 *boundPort = nullptr)
 {
-    qint64 sentBytes = s->sendall(connectRequest);
-    if(sentBytes < connectRequest.size()) {
-        throw Socks5Exception(Socks5Exception::ProxyProtocolError);
-    }
     const QByteArray &connectResponse = s->recvall(2);
     if(connectResponse.size() < 2) {
         throw Socks5Exception(Socks5Exception::ProxyProtocolError);
@@ -274,6 +457,9 @@ static QSharedPointer<Socket> sendConnectRequest(QSharedPointer<Socket> s, const
 #else
         boundIp.setAddress(qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(ipv4.constData())));
 #endif
+        if (boundAddress) {
+            *boundAddress = boundIp;
+        }
     } else if(addressType.at(1) == S5_IP_V6){
         const QByteArray &ipv6 = s->recvall(16);
         if(ipv6.size() < 16) {
@@ -281,6 +467,9 @@ static QSharedPointer<Socket> sendConnectRequest(QSharedPointer<Socket> s, const
         }
         QHostAddress boundIp;
         boundIp.setAddress(reinterpret_cast<const quint8*>(ipv6.constData()));
+        if (boundAddress) {
+            *boundAddress = boundIp;
+        }
     } else if(addressType.at(1) == S5_DOMAINNAME) {
         const QByteArray &len = s->recvall(1);
         if(len.isEmpty()) {
@@ -304,33 +493,32 @@ static QSharedPointer<Socket> sendConnectRequest(QSharedPointer<Socket> s, const
     quint16 port = qFromBigEndian<quint16>(reinterpret_cast<const uchar*>(portBytes.constData()));
 #endif
 
-    Q_UNUSED(port);
-
+    if (boundPort) {
+        *boundPort = port;
+    }
     return s;
 }
 
 QSharedPointer<Socket> Socks5ProxyPrivate::connect(const QString &hostName, quint16 port) const
 {
-    QSharedPointer<Socket> s = getControlSocket();
     QByteArray connectRequest = makeConnectRequest();
 
     if(!qt_socks5_set_host_name_and_port(hostName, port, &connectRequest)) {
         throw Socks5Exception(Socks5Exception::ProxyProtocolError);
     }
 
-    return sendConnectRequest(s, connectRequest);
+    return recvCommandReply(sendRequest(connectRequest));
 }
 
 QSharedPointer<Socket> Socks5ProxyPrivate::connect(const QHostAddress &host, quint16 port) const
 {
-    QSharedPointer<Socket> s = getControlSocket();
     QByteArray connectRequest = makeConnectRequest();
 
     if(!qt_socks5_set_host_address_and_port(host, port, &connectRequest)) {
         throw Socks5Exception(Socks5Exception::ProxyProtocolError);
     }
 
-    return sendConnectRequest(s, connectRequest);
+    return recvCommandReply(sendRequest(connectRequest));
 }
 
 
@@ -342,6 +530,281 @@ QSharedPointer<SocketLike> Socks5ProxyPrivate::listen(quint16 port) const
 }
 
 
+class Socks5UdpSocketPrivate
+{
+public:
+    Socks5UdpSocketPrivate(QSharedPointer<Socket> control, QSharedPointer<Socket> udp,
+                           const QHostAddress &relayAddress, quint16 relayPort)
+        : control(control), udp(udp), relayAddress(relayAddress), relayPort(relayPort) {}
+public:
+    static qint32 writeHeader(char *buf, const QHostAddress &addr, quint16 port);
+    static qint32 parseHeader(const char *buf, qint32 size, QHostAddress *addr, quint16 *port);
+public:
+    QSharedPointer<Socket> control;
+    QSharedPointer<Socket> udp;
+    QHostAddress relayAddress;
+    quint16 relayPort;
+    QByteArray buf;                     // kept for the next call, so the datagrams are not allocated one by one.
+    QVector<SocketDatagram> packed;
+};
+
+
+#define S5_UDP_HEADER_ROOM 22
+
+
+// the udp socket of any protocol receives the ipv4 datagrams as ipv4-mapped ipv6 addresses.
+static bool isSameHost(const QHostAddress &a, const QHostAddress &b)
+{
+    bool ok1, ok2;
+    const quint32 ipv4a = a.toIPv4Address(&ok1);
+    const quint32 ipv4b = b.toIPv4Address(&ok2);
+    if (ok1 || ok2) {
+        return ok1 && ok2 && ipv4a == ipv4b;
+    }
+    return a == b;
+}
+
+
+// RSV(2) FRAG(1) ATYP(1) DST.ADDR DST.PORT(2), returns the size of header or -1.
+qint32 Socks5UdpSocketPrivate::writeHeader(char *buf, const QHostAddress &addr, quint16 port)
+{
+    uchar *p = reinterpret_cast<uchar *>(buf);
+    p[0] = p[1] = p[2] = 0;
+    bool ok;
+    const quint32 ipv4 = addr.toIPv4Address(&ok);
+    if (ok) {
+        p[3] = S5_IP_V4;
+        qToBigEndian<quint32>(ipv4, p + 4);
+        qToBigEndian<quint16>(port, p + 8);
+        return 10;
+    } else if (addr.protocol() == QAbstractSocket::IPv6Protocol) {
+        p[3] = S5_IP_V6;
+        Q_IPV6ADDR ipv6 = addr.toIPv6Address();
+        memcpy(p + 4, ipv6.c, 16);
+        qToBigEndian<quint16>(port, p + 20);
+        return 22;
+    }
+    return -1;
+}
+
+
+qint32 Socks5UdpSocketPrivate::parseHeader(const char *buf, qint32 size, QHostAddress *addr, quint16 *port)
+{
+    const uchar *p = reinterpret_cast<const uchar *>(buf);
+    qint32 headerSize;
+    if (size < 4 || p[2] != 0) {
+        return -1;
+    } else if (p[3] == S5_IP_V4 && size >= 10) {
+        addr->setAddress(qFromBigEndian<quint32>(p + 4));
+        headerSize = 10;
+    } else if (p[3] == S5_IP_V6 && size >= 22) {
+        addr->setAddress(p + 4);
+        headerSize = 22;
+    } else if (p[3] == S5_DOMAINNAME && size >= 7 + p[4]) {
+        addr->clear();
+        headerSize = 7 + p[4];
+    } else {
+        return -1;
+    }
+    *port = qFromBigEndian<quint16>(p + headerSize - 2);
+    return headerSize;
+}
+
+
+Socks5UdpSocket::Socks5UdpSocket(Socks5UdpSocketPrivate *d)
+    : d_ptr(d)
+{
+}
+
+
+Socks5UdpSocket::~Socks5UdpSocket()
+{
+    close();
+    delete d_ptr;
+}
+
+
+qint32 Socks5UdpSocket::sendto(const char *data, qint32 size, const QHostAddress &addr, quint16 port)
+{
+    Q_D(Socks5UdpSocket);
+    if (size < 0 || size > 0xffff) {
+        return -1;
+    }
+    if (d->buf.size() < size + S5_UDP_HEADER_ROOM) {
+        d->buf.resize(size + S5_UDP_HEADER_ROOM);
+    }
+    const qint32 headerSize = Socks5UdpSocketPrivate::writeHeader(d->buf.data(), addr, port);
+    if (headerSize < 0) {
+        return -1;
+    }
+    memcpy(d->buf.data() + headerSize, data, static_cast<size_t>(size));
+    const qint32 sentBytes = d->udp->sendto(d->buf.constData(), headerSize + size, d->relayAddress, d->relayPort);
+    return sentBytes < 0 ? -1 : qMax(0, sentBytes - headerSize);
+}
+
+
+qint32 Socks5UdpSocket::sendto(const char *data, qint32 size, const QString &hostName, quint16 port)
+{
+    Q_D(Socks5UdpSocket);
+    const QByteArray &encodedHostName = QUrl::toAce(hostName);
+    if (size < 0 || size > 0xffff || encodedHostName.isEmpty() || encodedHostName.size() > 255) {
+        return -1;
+    }
+    const qint32 headerSize = 7 + encodedHostName.size();
+    if (d->buf.size() < size + headerSize) {
+        d->buf.resize(size + headerSize);
+    }
+    uchar *p = reinterpret_cast<uchar *>(d->buf.data());
+    p[0] = p[1] = p[2] = 0;
+    p[3] = S5_DOMAINNAME;
+    p[4] = static_cast<uchar>(encodedHostName.size());
+    memcpy(p + 5, encodedHostName.constData(), static_cast<size_t>(encodedHostName.size()));
+    qToBigEndian<quint16>(port, p + headerSize - 2);
+    memcpy(p + headerSize, data, static_cast<size_t>(size));
+    const qint32 sentBytes = d->udp->sendto(d->buf.constData(), headerSize + size, d->relayAddress, d->relayPort);
+    return sentBytes < 0 ? -1 : qMax(0, sentBytes - headerSize);
+}
+
+
+qint32 Socks5UdpSocket::recvfrom(char *data, qint32 size, QHostAddress *addr, quint16 *port)
+{
+    Q_D(Socks5UdpSocket);
+    if (d->buf.size() < 0xffff + S5_UDP_HEADER_ROOM) {
+        d->buf.resize(0xffff + S5_UDP_HEADER_ROOM);
+    }
+    while (true) {
+        QHostAddress from;
+        quint16 fromPort;
+        const qint32 len = d->udp->recvfrom(d->buf.data(), d->buf.size(), &from, &fromPort);
+        if (len < 0) {
+            return -1;
+        }
+        // drops the datagrams not passed by the proxy.
+        if (fromPort != d->relayPort || !isSameHost(from, d->relayAddress)) {
+            continue;
+        }
+        const qint32 headerSize = Socks5UdpSocketPrivate::parseHeader(d->buf.constData(), len, addr, port);
+        if (headerSize < 0) {
+            continue;
+        }
+        const qint32 dataSize = qMin(size, len - headerSize);
+        memcpy(data, d->buf.constData() + headerSize, static_cast<size_t>(dataSize));
+        return dataSize;
+    }
+}
+
+
+qint32 Socks5UdpSocket::sendmany(SocketDatagram *datagrams, qint32 count)
+{
+    Q_D(Socks5UdpSocket);
+    qint32 total = 0;
+    for (qint32 i = 0; i < count; ++i) {
+        if (datagrams[i].size < 0 || datagrams[i].size > 0xffff) {
+            return -1;
+        }
+        total += datagrams[i].size + S5_UDP_HEADER_ROOM;
+    }
+    if (d->buf.size() < total) {
+        d->buf.resize(total);
+    }
+    d->packed.resize(count);
+    char *p = d->buf.data();
+    for (qint32 i = 0; i < count; ++i) {
+        const qint32 headerSize = Socks5UdpSocketPrivate::writeHeader(p, datagrams[i].address, datagrams[i].port);
+        if (headerSize < 0) {
+            return -1;
+        }
+        memcpy(p + headerSize, datagrams[i].data, static_cast<size_t>(datagrams[i].size));
+        SocketDatagram &packed = d->packed[i];
+        packed.data = p;
+        packed.size = headerSize + datagrams[i].size;
+        packed.address = d->relayAddress;
+        packed.port = d->relayPort;
+        p += packed.size;
+    }
+    const qint32 sent = d->udp->sendmany(d->packed.data(), count);
+    for (qint32 i = 0; i < sent; ++i) {
+        datagrams[i].length = datagrams[i].size;
+    }
+    return sent;
+}
+
+
+qint32 Socks5UdpSocket::recvmany(SocketDatagram *datagrams, qint32 count)
+{
+    Q_D(Socks5UdpSocket);
+    while (true) {
+        const qint32 received = d->udp->recvmany(datagrams, count);
+        if (received <= 0) {
+            return received;
+        }
+        qint32 n = 0;
+        for (qint32 i = 0; i < received; ++i) {
+            SocketDatagram &datagram = datagrams[i];
+            if (datagram.port != d->relayPort || !isSameHost(datagram.address, d->relayAddress)) {
+                continue;
+            }
+            QHostAddress addr;
+            quint16 port;
+            const qint32 headerSize = Socks5UdpSocketPrivate::parseHeader(datagram.data, datagram.length, &addr, &port);
+            if (headerSize < 0) {
+                continue;
+            }
+            SocketDatagram &target = datagrams[n];
+            if (n != i) {
+                target.data = datagram.data;
+                target.size = datagram.size;
+            }
+            target.length = datagram.length - headerSize;
+            memmove(target.data, datagram.data + headerSize, static_cast<size_t>(target.length));
+            target.address = addr;
+            target.port = port;
+            target.segmentSize = 0;
+            ++n;
+        }
+        if (n > 0) {
+            return n;
+        }
+    }
+}
+
+
+void Socks5UdpSocket::close()
+{
+    Q_D(Socks5UdpSocket);
+    d->udp->close();
+    d->control->close();
+}
+
+
+QSharedPointer<Socks5UdpSocket> Socks5ProxyPrivate::udpAssociate() const
+{
+    QSharedPointer<Socket> udp(new Socket(Socket::AnyIPProtocol, Socket::UdpSocket));
+    if (!udp->bind()) {
+        throw Socks5Exception(Socks5Exception::SocksFailure);
+    }
+    // the datagrams may be sent through nat, so the source address is not told.
+    QByteArray request;
+    request.append((char) S5_VERSION_5);
+    request.append((char) S5_UDP_ASSOCIATE);
+    request.append((char) 0x00);
+    if (!qt_socks5_set_host_address_and_port(QHostAddress(QHostAddress::AnyIPv4), 0, &request)) {
+        throw Socks5Exception(Socks5Exception::ProxyProtocolError);
+    }
+    QHostAddress relayAddress;
+    quint16 relayPort = 0;
+    QSharedPointer<Socket> s = recvCommandReply(sendRequest(request), &relayAddress, &relayPort);
+    if (relayAddress.isNull() || relayAddress == QHostAddress::AnyIPv4 || relayAddress == QHostAddress::AnyIPv6) {
+        relayAddress = s->peerAddress();
+    }
+    if (relayPort == 0) {
+        throw Socks5Exception(Socks5Exception::ProxyProtocolError);
+    }
+    Socks5UdpSocketPrivate *d = new Socks5UdpSocketPrivate(s, udp, relayAddress, relayPort);
+    return QSharedPointer<Socks5UdpSocket>(new Socks5UdpSocket(d));
+}
+
+
 Socks5Proxy::Socks5Proxy()
     :d_ptr(new Socks5ProxyPrivate)
 {
@@ -356,6 +819,7 @@ Socks5Proxy::Socks5Proxy(const Socks5Proxy &other)
     :d_ptr(new Socks5ProxyPrivate(other.d_ptr->hostName, other.d_ptr->port,
                                 other.d_ptr->user, other.d_ptr->password))
 {
+    d_ptr->state = other.d_ptr->state;
 }
 
 Socks5Proxy::~Socks5Proxy()
@@ -368,6 +832,7 @@ Socks5Proxy &Socks5Proxy::operator=(const Socks5Proxy &other)
 {
     delete d_ptr;
     d_ptr = new Socks5ProxyPrivate(other.hostName(), other.port(), other.user(), other.password());
+    d_ptr->state = other.d_ptr->state;
     return *this;
 }
 
@@ -425,18 +890,28 @@ void Socks5Proxy::setHostName(const QString &hostName)
 {
     Q_D(Socks5Proxy);
     d->hostName = hostName;
+    d->state.reset(new Socks5ProxyState);
+}
+
+void Socks5Proxy::setPort(quint16 port)
+{
+    Q_D(Socks5Proxy);
+    d->port = port;
+    d->state.reset(new Socks5ProxyState);
 }
 
 void Socks5Proxy::setUser(const QString &user)
 {
     Q_D(Socks5Proxy);
     d->user = user;
+    d->state.reset(new Socks5ProxyState);
 }
 
 void Socks5Proxy::setPassword(const QString &password)
 {
     Q_D(Socks5Proxy);
     d->password = password;
+    d->state.reset(new Socks5ProxyState);
 }
 
 QSharedPointer<Socket> Socks5Proxy::connect(const QString &hostName, quint16 port)
@@ -458,4 +933,16 @@ QSharedPointer<SocketLike> Socks5Proxy::listen(quint16 port)
     return d->listen(port);
 }
 
+void Socks5Proxy::warmUp(int count)
+{
+    Q_D(const Socks5Proxy);
+    d->warmUp(count);
+}
+
+QSharedPointer<Socks5UdpSocket> Socks5Proxy::udpAssociate()
+{
+    Q_D(const Socks5Proxy);
+    return d->udpAssociate();
+}
+
 QTNETWORKNG_NAMESPACE_END
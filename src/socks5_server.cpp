@@ -1,6 +1,7 @@
 #include <QtCore/qendian.h>
 #include <QtCore/qdatetime.h>
 #include <QtCore/qurl.h>
+#include <QtCore/qelapsedtimer.h>
 #include "../include/socket_server.h"
 
 
@@ -27,6 +28,12 @@
 
 #define S5_PASSWORDAUTH_VERSION 0x01
 
+// every datagram is received after the room of the longest header (ipv6), so the header of a reply is
+// written in place. the slots are allocated once for an association.
+#define S5_UDP_HEADER_ROOM 22
+#define S5_UDP_SLOT_SIZE (1024 * 8)
+#define S5_UDP_SLOTS 16
+
 QTNETWORKNG_NAMESPACE_BEGIN
 
 class Socks5RequestHandlerPrivate
@@ -38,6 +45,8 @@ public:
     bool handshake();
     bool parseAddress(QString *hostName, QHostAddress *addr, quint16 *port);
     void handleConnectCommand(const QString &hostName, const QHostAddress &addr, quint16 port);
+    void handleUdpAssociateCommand(quint16 port);
+    void relayDatagrams(Socket *relay, quint16 *clientPort, qint64 *activeAt);
 private:
     Socks5RequestHandler * const q_ptr;
     Q_DECLARE_PUBLIC(Socks5RequestHandler)
@@ -81,6 +90,11 @@ void Socks5RequestHandlerPrivate::handleRequest()
     }
     printf("%s\n", qPrintable(message));
 
+    // the address of udp associate is where the client sends datagrams from, mostly zero.
+    if (commandHeader.at(1) == S5_UDP_ASSOCIATE) {
+        q->doUdpAssociate(addr, port);
+        return;
+    }
     if ((hostName.isEmpty() && addr.isNull()) || port == 0) {
         return;
     }
@@ -219,10 +233,164 @@ void Socks5RequestHandlerPrivate::handleConnectCommand(const QString &hostName,
         return;
     }
     Exchanger exchanger(q->request, asStream(forward));
+    q->exchangeStarted(&exchanger, hostName, addr, port);
     exchanger.exchange();
+    q->exchangeFinished(&exchanger);
+}
+
+
+
+// the udp socket of any protocol receives the ipv4 datagrams as ipv4-mapped ipv6 addresses.
+static bool isSameHost(const QHostAddress &a, const QHostAddress &b)
+{
+    bool ok1, ok2;
+    const quint32 ipv4a = a.toIPv4Address(&ok1);
+    const quint32 ipv4b = b.toIPv4Address(&ok2);
+    if (ok1 || ok2) {
+        return ok1 && ok2 && ipv4a == ipv4b;
+    }
+    return a == b;
+}
+
+
+// the datagrams of the client are sent to the targets without the header, and the others are sent back to
+// the client with a header written before them. both directions are sent by one sendmany().
+void Socks5RequestHandlerPrivate::relayDatagrams(Socket *relay, quint16 *clientPort, qint64 *activeAt)
+{
+    Q_Q(Socks5RequestHandler);
+    const QHostAddress clientAddress = q->request->peerAddress();
+    QByteArray buf(S5_UDP_SLOTS * S5_UDP_SLOT_SIZE, Qt::Uninitialized);
+    SocketDatagram received[S5_UDP_SLOTS];
+    SocketDatagram outgoing[S5_UDP_SLOTS];
+    QHash<QString, QHostAddress> names;
+    while (true) {
+        for (int i = 0; i < S5_UDP_SLOTS; ++i) {
+            received[i].data = buf.data() + i * S5_UDP_SLOT_SIZE + S5_UDP_HEADER_ROOM;
+            received[i].size = S5_UDP_SLOT_SIZE - S5_UDP_HEADER_ROOM;
+        }
+        qint32 count = relay->recvmany(received, S5_UDP_SLOTS);
+        if (count <= 0) {
+            return;
+        }
+        *activeAt = QElapsedTimer::msecsSinceReference();
+        qint32 n = 0;
+        for (qint32 i = 0; i < count; ++i) {
+            SocketDatagram &datagram = received[i];
+            uchar *data = reinterpret_cast<uchar *>(datagram.data);
+            if (isSameHost(datagram.address, clientAddress) && (!*clientPort || datagram.port == *clientPort)) {
+                *clientPort = datagram.port;
+                // RSV(2) FRAG(1) ATYP(1) DST.ADDR DST.PORT(2) DATA
+                qint32 headerSize;
+                if (datagram.length < 4 || data[2] != 0) {
+                    continue;
+                } else if (data[3] == S5_IP_V4 && datagram.length >= 10) {
+                    outgoing[n].address.setAddress(qFromBigEndian<quint32>(data + 4));
+                    headerSize = 10;
+                } else if (data[3] == S5_IP_V6 && datagram.length >= 22) {
+                    outgoing[n].address.setAddress(data + 4);
+                    headerSize = 22;
+                } else if (data[3] == S5_DOMAINNAME && datagram.length >= 7 && datagram.length >= 7 + data[4]) {
+                    const QString &hostName = QUrl::fromAce(QByteArray::fromRawData(datagram.data + 5, data[4]));
+                    QHostAddress &address = names[hostName];
+                    if (address.isNull()) {
+                        const QList<QHostAddress> &addresses = Socket::resolve(hostName);
+                        if (addresses.isEmpty()) {
+                            names.remove(hostName);
+                            continue;
+                        }
+                        address = addresses.first();
+                    }
+                    outgoing[n].address = address;
+                    headerSize = 7 + data[4];
+                } else {
+                    continue;
+                }
+                outgoing[n].port = qFromBigEndian<quint16>(data + headerSize - 2);
+                outgoing[n].data = datagram.data + headerSize;
+                outgoing[n].size = datagram.length - headerSize;
+                ++n;
+            } else if (*clientPort) {
+                bool ok;
+                const quint32 ipv4 = datagram.address.toIPv4Address(&ok);
+                qint32 headerSize;
+                if (ok) {
+                    headerSize = 10;
+                    qToBigEndian<quint32>(ipv4, data - 6);
+                    data[-7] = S5_IP_V4;
+                } else {
+                    headerSize = 22;
+                    Q_IPV6ADDR ipv6 = datagram.address.toIPv6Address();
+                    memcpy(data - 18, ipv6.c, 16);
+                    data[-19] = S5_IP_V6;
+                }
+                qToBigEndian<quint16>(datagram.port, data - 2);
+                uchar *header = data - headerSize;
+                header[0] = header[1] = header[2] = 0;
+                outgoing[n].address = clientAddress;
+                outgoing[n].port = *clientPort;
+                outgoing[n].data = reinterpret_cast<char *>(header);
+                outgoing[n].size = datagram.length + headerSize;
+                ++n;
+            }
+        }
+        // the datagrams may be lost anyway, so the ones failed to send are dropped.
+        for (qint32 sent = 0; sent < n;) {
+            qint32 r = relay->sendmany(outgoing + sent, n - sent);
+            if (r <= 0) {
+                break;
+            }
+            sent += r;
+        }
+    }
 }
 
 
+void Socks5RequestHandlerPrivate::handleUdpAssociateCommand(quint16 port)
+{
+    Q_Q(Socks5RequestHandler);
+    QSharedPointer<Socket> relay(new Socket(Socket::AnyIPProtocol, Socket::UdpSocket));
+    if (!relay->bind()) {
+        q->sendFailedReply();
+        return;
+    }
+    if (!q->sendConnectReply(q->request->localAddress(), relay->localPort())) {
+        return;
+    }
+    quint16 clientPort = port;
+    qint64 activeAt = QElapsedTimer::msecsSinceReference();
+    CoroutineGroup operations;
+    operations.spawn([this, relay, &clientPort, &activeAt, &operations] {
+        relayDatagrams(relay.data(), &clientPort, &activeAt);
+        operations.killall(false);
+    });
+    // the association ends with the control connection.
+    operations.spawn([q, &operations] {
+        char c;
+        while (q->request->recv(&c, 1) > 0) {}
+        operations.killall(false);
+    });
+    const qint64 timeout = static_cast<qint64>(q->udpAssociationTimeout() * 1000);
+    if (timeout <= 0) {
+        operations.joinall();
+    } else {
+        // checks the idle time by one timer instead of a timer for every recvmany().
+        const quint32 period = static_cast<quint32>(qBound<qint64>(1000, timeout / 2, 0x7fffffff));
+        while (true) {
+            try {
+                Timeout t(period, 0); Q_UNUSED(t);
+                operations.joinall();
+                break;
+            } catch (TimeoutException &) {
+            }
+            if (QElapsedTimer::msecsSinceReference() - activeAt > timeout) {
+                operations.killall();
+                break;
+            }
+        }
+    }
+    relay->close();
+}
+
 
 Socks5RequestHandler::Socks5RequestHandler(QSharedPointer<SocketLike> request, BaseStreamServer *server)
     :BaseRequestHandler(request, server), d_ptr(new Socks5RequestHandlerPrivate(this))
@@ -241,6 +409,30 @@ void Socks5RequestHandler::doConnect(const QString &hostName, const QHostAddress
 }
 
 
+void Socks5RequestHandler::doUdpAssociate(const QHostAddress &hostAddress, quint16 port)
+{
+    Q_D(Socks5RequestHandler);
+    Q_UNUSED(hostAddress);
+    d->handleUdpAssociateCommand(port);
+}
+
+
+float Socks5RequestHandler::udpAssociationTimeout() const
+{
+    return 120.0f;
+}
+
+
+void Socks5RequestHandler::exchangeStarted(Exchanger *, const QString &, const QHostAddress &, quint16)
+{
+}
+
+
+void Socks5RequestHandler::exchangeFinished(Exchanger *)
+{
+}
+
+
 bool Socks5RequestHandler::sendConnectReply(const QHostAddress &hostAddress, quint16 port)
 {
     bool ok;
@@ -1,11 +1,27 @@
 ﻿#include <QtCore/qfile.h>
 #include <QtCore/qdatetime.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qcache.h>
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qthreadpool.h>
+#include <QtCore/qrunnable.h>
+#include <QtCore/qthreadstorage.h>
+#include <QtCore/qcryptographichash.h>
 #include <openssl/ssl.h>
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+#include <openssl/x509v3.h>
+#include <openssl/ocsp.h>
 #include "../include/locks.h"
 #include "../include/ssl.h"
 #include "../include/socket.h"
 #include "../include/socket_utils.h"
+#include "../include/coroutine_utils.h"
+#include "../include/http.h"
+#include "../include/metrics.h"
 #include "../include/private/crypto_p.h"
+#include "../include/private/socket_p.h"
+#include "../include/private/tracing_p.h"
 
 QTNETWORKNG_NAMESPACE_BEGIN
 
@@ -189,14 +205,200 @@ QDebug operator<<(QDebug debug, const SslCipher &cipher)
     return debug;
 }
 
+// the handshakes of all eventloops share these threads, the default size is QThread::idealThreadCount().
+Q_GLOBAL_STATIC(QThreadPool, handshakeThreadPool)
+
+
+// the keys of session tickets made by a server context. the current key encrypts new tickets, and the
+// previous one still decrypts the tickets made in the last period.
+struct SslTicketKey
+{
+    unsigned char name[16];
+    unsigned char aesKey[32];
+    unsigned char hmacKey[32];
+    qint64 createdAt;
+};
+
+
+class SslTicketKeys
+{
+public:
+    explicit SslTicketKeys(quint32 lifetime)
+        :lifetime(lifetime) {}
+    static int callback(SSL *ssl, unsigned char *keyName, unsigned char *iv, EVP_CIPHER_CTX *cipherCtx,
+                        HMAC_CTX *hmacCtx, int enc);
+private:
+    bool rotate();
+    QMutex lock;
+    QList<SslTicketKey> keys;  // the newest first.
+    const quint32 lifetime;    // in seconds.
+};
+
+
+bool SslTicketKeys::rotate()
+{
+    const qint64 now = QElapsedTimer::msecsSinceReference();
+    if (!keys.isEmpty() && now - keys.first().createdAt < static_cast<qint64>(lifetime) * 1000) {
+        return true;
+    }
+    SslTicketKey key;
+    if (RAND_bytes(key.name, sizeof(key.name)) != 1 || RAND_bytes(key.aesKey, sizeof(key.aesKey)) != 1
+            || RAND_bytes(key.hmacKey, sizeof(key.hmacKey)) != 1) {
+        return !keys.isEmpty();
+    }
+    key.createdAt = now;
+    keys.prepend(key);
+    while (keys.size() > 2) {
+        keys.removeLast();
+    }
+    return true;
+}
+
+
+int SslTicketKeys::callback(SSL *ssl, unsigned char *keyName, unsigned char *iv, EVP_CIPHER_CTX *cipherCtx,
+                            HMAC_CTX *hmacCtx, int enc)
+{
+    SslTicketKeys *d = static_cast<SslTicketKeys *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    if (!d) {
+        return -1;
+    }
+    QMutexLocker locker(&d->lock);
+    if (enc) {
+        if (!d->rotate() || RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) {
+            return -1;
+        }
+        const SslTicketKey &key = d->keys.first();
+        memcpy(keyName, key.name, sizeof(key.name));
+        EVP_EncryptInit_ex(cipherCtx, EVP_aes_256_cbc(), nullptr, key.aesKey, iv);
+        HMAC_Init_ex(hmacCtx, key.hmacKey, sizeof(key.hmacKey), EVP_sha256(), nullptr);
+        return 1;
+    }
+    d->rotate();
+    for (int i = 0; i < d->keys.size(); ++i) {
+        const SslTicketKey &key = d->keys.at(i);
+        if (memcmp(keyName, key.name, sizeof(key.name)) == 0) {
+            HMAC_Init_ex(hmacCtx, key.hmacKey, sizeof(key.hmacKey), EVP_sha256(), nullptr);
+            EVP_DecryptInit_ex(cipherCtx, EVP_aes_256_cbc(), nullptr, key.aesKey, iv);
+            // the ticket made by the previous key is renewed.
+            return i == 0 ? 1 : 2;
+        }
+    }
+    return 0;
+}
+
+
+// a client session to resume, kept by host and port.
+// the chains verified by a context, so the repeated connections to the same peer skip X509_verify_cert().
+// the failed chains are not cached, they are verified again and report the errors.
+class SslVerifyCache
+{
+public:
+    explicit SslVerifyCache(quint32 lifetime)
+        :verified(1024), lifetime(lifetime) {}
+    static int callback(X509_STORE_CTX *storeContext, void *arg);
+private:
+    static QByteArray chainKey(X509_STORE_CTX *storeContext);
+    bool contains(const QByteArray &key);
+    void insert(const QByteArray &key);
+    QMutex lock;               // the handshakes may be offloaded to the thread pool.
+    QCache<QByteArray, qint64> verified;  // the expiry of chain.
+    const quint32 lifetime;    // in seconds.
+};
+
+
+// the digests of all certificates sent by the peer, and the name to verify.
+QByteArray SslVerifyCache::chainKey(X509_STORE_CTX *storeContext)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    X509 *leaf = X509_STORE_CTX_get0_cert(storeContext);
+    if (!leaf) {
+        return QByteArray();
+    }
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    if (!X509_digest(leaf, EVP_sha256(), md, &len)) {
+        return QByteArray();
+    }
+    hash.addData(reinterpret_cast<const char *>(md), static_cast<int>(len));
+    STACK_OF(X509) *untrusted = X509_STORE_CTX_get0_untrusted(storeContext);
+    for (int i = 0; untrusted && i < sk_X509_num(untrusted); ++i) {
+        if (!X509_digest(sk_X509_value(untrusted, i), EVP_sha256(), md, &len)) {
+            return QByteArray();
+        }
+        hash.addData(reinterpret_cast<const char *>(md), static_cast<int>(len));
+    }
+    SSL *ssl = static_cast<SSL *>(X509_STORE_CTX_get_ex_data(storeContext, SSL_get_ex_data_X509_STORE_CTX_idx()));
+    const QString *peerName = ssl ? static_cast<const QString *>(SSL_get_app_data(ssl)) : nullptr;
+    if (peerName) {
+        hash.addData(peerName->toUtf8());
+    }
+    return hash.result();
+#else
+    Q_UNUSED(storeContext);
+    return QByteArray();
+#endif
+}
+
+
+bool SslVerifyCache::contains(const QByteArray &key)
+{
+    QMutexLocker locker(&lock);
+    qint64 *expiry = verified.object(key);
+    if (!expiry) {
+        return false;
+    }
+    if (*expiry < QElapsedTimer::msecsSinceReference()) {
+        verified.remove(key);
+        return false;
+    }
+    return true;
+}
+
+
+void SslVerifyCache::insert(const QByteArray &key)
+{
+    QMutexLocker locker(&lock);
+    verified.insert(key, new qint64(QElapsedTimer::msecsSinceReference() + static_cast<qint64>(lifetime) * 1000));
+}
+
+
+int SslVerifyCache::callback(X509_STORE_CTX *storeContext, void *arg)
+{
+    SslVerifyCache *cache = static_cast<SslVerifyCache *>(arg);
+    const QByteArray &key = chainKey(storeContext);
+    if (!key.isEmpty() && cache->contains(key)) {
+        X509_STORE_CTX_set_error(storeContext, X509_V_OK);
+        return 1;
+    }
+    int ok = X509_verify_cert(storeContext);
+    if (ok == 1 && !key.isEmpty()) {
+        cache->insert(key);
+    }
+    return ok;
+}
+
+
+struct SslSessionEntry
+{
+    QSharedPointer<SSL_SESSION> session;
+};
+
+
 class SslConfigurationPrivate: public QSharedData
 {
 public:
     SslConfigurationPrivate();
-    SslConfigurationPrivate(const SslConfigurationPrivate &) = default;
+    SslConfigurationPrivate(const SslConfigurationPrivate &other);
     bool isNull() const;
     bool operator==(const SslConfigurationPrivate &other) const;
-    static QSharedPointer<SSL_CTX> makeContext(const SslConfiguration &config, bool asServer);
+    static QSharedPointer<SSL_CTX> makeContext(const SslConfiguration &config, bool asServer, bool datagram);
+    // made once and shared by all connections of the configuration, the setters drop it. the datagram contexts
+    // are used by DtlsSocket.
+    static QSharedPointer<SSL_CTX> context(const SslConfiguration &config, bool asServer, bool datagram = false);
+    void clearContexts();
+    static QSharedPointer<SSL_SESSION> session(const SslConfiguration &config, const QString &key);
+    static void saveSession(const SslConfiguration &config, const QString &key, SSL *ssl);
 
     QList<Certificate> caCertificates;
     Certificate localCertificate;
@@ -208,6 +410,21 @@ public:
     QList<SslCipher> ciphers;
     bool onlySecureProtocol;
     bool supportCompression;
+    quint32 sessionTicketKeyLifetime;
+    quint32 sessionCacheSize;
+    bool kernelTlsEnabled;
+    bool handshakeOffloaded;
+    bool bufferReleaseEnabled;
+    quint32 verificationCacheLifetime;
+    QSharedPointer<SslServerNamesPrivate> serverNames;
+    QSharedPointer<SslOcspStaple> ocspStaple;  // shared by the copies, replaced while serving.
+
+    QMutex contextLock;  // the configuration may be shared by the SslServer of many threads.
+    QSharedPointer<SSL_CTX> clientContext;
+    QSharedPointer<SSL_CTX> serverContext;
+    QSharedPointer<SSL_CTX> dtlsClientContext;
+    QSharedPointer<SSL_CTX> dtlsServerContext;
+    QCache<QString, SslSessionEntry> sessions;
 };
 
 bool SslConfigurationPrivate::operator==(const SslConfigurationPrivate &other) const
@@ -221,7 +438,14 @@ bool SslConfigurationPrivate::operator==(const SslConfigurationPrivate &other) c
             peerVerifyName == other.peerVerifyName &&
             ciphers == other.ciphers &&
             onlySecureProtocol == other.onlySecureProtocol &&
-            supportCompression == other.supportCompression;
+            supportCompression == other.supportCompression &&
+            sessionTicketKeyLifetime == other.sessionTicketKeyLifetime &&
+            sessionCacheSize == other.sessionCacheSize &&
+            kernelTlsEnabled == other.kernelTlsEnabled &&
+            handshakeOffloaded == other.handshakeOffloaded &&
+            bufferReleaseEnabled == other.bufferReleaseEnabled &&
+            verificationCacheLifetime == other.verificationCacheLifetime &&
+            serverNames == other.serverNames;
 }
 
 bool SslConfigurationPrivate::isNull() const
@@ -235,21 +459,332 @@ bool SslConfigurationPrivate::isNull() const
             peerVerifyName.isEmpty() &&
             ciphers.isEmpty() &&
             onlySecureProtocol == true &&
-            supportCompression == true;
+            supportCompression == true &&
+            sessionTicketKeyLifetime == 3600 &&
+            sessionCacheSize == SSL_SESSION_CACHE_MAX_SIZE_DEFAULT &&
+            kernelTlsEnabled == false &&
+            handshakeOffloaded == false &&
+            bufferReleaseEnabled == false &&
+            verificationCacheLifetime == 600 &&
+            serverNames.isNull();
 }
 
 SslConfigurationPrivate::SslConfigurationPrivate()
     :peerVerifyMode(Ssl::AutoVerifyPeer), peerVerifyDepth(4), onlySecureProtocol(true), supportCompression(true)
+    , sessionTicketKeyLifetime(3600), sessionCacheSize(SSL_SESSION_CACHE_MAX_SIZE_DEFAULT), kernelTlsEnabled(false), handshakeOffloaded(false)
+    , bufferReleaseEnabled(false), verificationCacheLifetime(600), ocspStaple(new SslOcspStaple()), sessions(256)
+{
+
+}
+
+// a detached copy is going to be changed, so the contexts are not copied.
+SslConfigurationPrivate::SslConfigurationPrivate(const SslConfigurationPrivate &other)
+    :QSharedData(other), caCertificates(other.caCertificates), localCertificate(other.localCertificate)
+    , privateKey(other.privateKey), allowedNextProtocols(other.allowedNextProtocols), peerVerifyMode(other.peerVerifyMode)
+    , peerVerifyDepth(other.peerVerifyDepth), peerVerifyName(other.peerVerifyName), ciphers(other.ciphers)
+    , onlySecureProtocol(other.onlySecureProtocol), supportCompression(other.supportCompression)
+    , sessionTicketKeyLifetime(other.sessionTicketKeyLifetime), sessionCacheSize(other.sessionCacheSize)
+    , kernelTlsEnabled(other.kernelTlsEnabled), handshakeOffloaded(other.handshakeOffloaded)
+    , bufferReleaseEnabled(other.bufferReleaseEnabled)
+    , verificationCacheLifetime(other.verificationCacheLifetime), serverNames(other.serverNames), ocspStaple(other.ocspStaple), sessions(256)
+{
+}
+
+
+QSharedPointer<SSL_CTX> SslConfigurationPrivate::context(const SslConfiguration &config, bool asServer, bool datagram)
+{
+    SslConfigurationPrivate *d = const_cast<SslConfigurationPrivate *>(config.d.constData());
+    QMutexLocker locker(&d->contextLock);
+    QSharedPointer<SSL_CTX> &ctx = datagram ? (asServer ? d->dtlsServerContext : d->dtlsClientContext)
+                                            : (asServer ? d->serverContext : d->clientContext);
+    if (ctx.isNull()) {
+        ctx = makeContext(config, asServer, datagram);
+    }
+    return ctx;
+}
+
+
+void SslConfigurationPrivate::clearContexts()
+{
+    QMutexLocker locker(&contextLock);
+    clientContext.clear();
+    serverContext.clear();
+    dtlsClientContext.clear();
+    dtlsServerContext.clear();
+    sessions.clear();
+}
+
+
+QSharedPointer<SSL_SESSION> SslConfigurationPrivate::session(const SslConfiguration &config, const QString &key)
+{
+    SslConfigurationPrivate *d = const_cast<SslConfigurationPrivate *>(config.d.constData());
+    QMutexLocker locker(&d->contextLock);
+    SslSessionEntry *entry = d->sessions.object(key);
+    if (!entry) {
+        return QSharedPointer<SSL_SESSION>();
+    }
+    return entry->session;
+}
+
+
+void SslConfigurationPrivate::saveSession(const SslConfiguration &config, const QString &key, SSL *ssl)
+{
+    SSL_SESSION *session = SSL_get1_session(ssl);
+    if (!session) {
+        return;
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    // the tickets of tls 1.3 come after the handshake.
+    if (!SSL_SESSION_is_resumable(session)) {
+        SSL_SESSION_free(session);
+        return;
+    }
+#endif
+    SslSessionEntry *entry = new SslSessionEntry();
+    entry->session.reset(session, SSL_SESSION_free);
+    SslConfigurationPrivate *d = const_cast<SslConfigurationPrivate *>(config.d.constData());
+    QMutexLocker locker(&d->contextLock);
+    d->sessions.insert(key, entry);
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+// the protocols are sent as a list of length-prefixed strings.
+static QByteArray alpnWireFormat(const QList<QByteArray> &protocols)
+{
+    QByteArray wire;
+    for (const QByteArray &protocol: protocols) {
+        if (protocol.isEmpty() || protocol.size() > 255) {
+            qWarning() << "invalid alpn protocol:" << protocol;
+            continue;
+        }
+        wire.append(static_cast<char>(protocol.size()));
+        wire.append(protocol);
+    }
+    return wire;
+}
+
+
+// the server picks the first protocol of its own list which the client offers.
+static int alpnSelectCallback(SSL *, const unsigned char **out, unsigned char *outlen,
+                              const unsigned char *in, unsigned int inlen, void *arg)
+{
+    const QByteArray *protocols = static_cast<const QByteArray *>(arg);
+    unsigned char *selected = nullptr;
+    int r = SSL_select_next_proto(&selected, outlen, reinterpret_cast<const unsigned char *>(protocols->constData()),
+                                  static_cast<unsigned int>(protocols->size()), in, inlen);
+    if (r != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+#endif
+
+
+struct SslOcspStaple
+{
+    static int callback(SSL *ssl, void *arg);
+    QMutex lock;
+    QByteArray response;
+};
+
+
+// called only if the client asks for the certificate status. openssl frees the copy.
+int SslOcspStaple::callback(SSL *ssl, void *arg)
+{
+    SslOcspStaple *staple = static_cast<SslOcspStaple *>(arg);
+    QMutexLocker locker(&staple->lock);
+    if (staple->response.isEmpty()) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    unsigned char *copy = static_cast<unsigned char *>(OPENSSL_malloc(static_cast<size_t>(staple->response.size())));
+    if (!copy) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    memcpy(copy, staple->response.constData(), static_cast<size_t>(staple->response.size()));
+    SSL_set_tlsext_status_ocsp_resp(ssl, copy, staple->response.size());
+    return SSL_TLSEXT_ERR_OK;
+}
+
+
+class SslServerNamesPrivate
+{
+public:
+    static int callback(SSL *ssl, int *alert, void *arg);
+    static int contextIndex();
+    static void freeContext(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp);
+    bool find(const QString &serverName, SslConfiguration *configuration);
+
+    QMutex lock;
+    QHash<QString, SslConfiguration> exact;
+    QHash<QString, SslConfiguration> wildcards;  // keyed by the name without "*.".
+};
+
+
+int SslServerNamesPrivate::contextIndex()
+{
+    static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, freeContext);
+    return index;
+}
+
+
+void SslServerNamesPrivate::freeContext(void *, void *ptr, CRYPTO_EX_DATA *, int, long, void *)
+{
+    delete static_cast<QSharedPointer<SSL_CTX> *>(ptr);
+}
+
+
+// switches the connection to the context of server name. the ssl keeps that context, and the connection keeps
+// the objects deleted with it, so the configuration may be removed before the handshake is done.
+int SslServerNamesPrivate::callback(SSL *ssl, int *, void *arg)
+{
+    const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (!name) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    SslServerNamesPrivate *names = static_cast<SslServerNamesPrivate *>(arg);
+    SslConfiguration config;
+    if (!names->find(QString::fromLatin1(name), &config)) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    const QSharedPointer<SSL_CTX> &ctx = SslConfigurationPrivate::context(config, true);
+    const int index = contextIndex();
+    if (ctx.isNull() || index < 0) {
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+    }
+    QSharedPointer<SSL_CTX> *kept = new QSharedPointer<SSL_CTX>(ctx);
+    delete static_cast<QSharedPointer<SSL_CTX> *>(SSL_get_ex_data(ssl, index));
+    if (!SSL_set_ex_data(ssl, index, kept)) {
+        delete kept;
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+    }
+    SSL_set_SSL_CTX(ssl, ctx.data());
+    return SSL_TLSEXT_ERR_OK;
+}
+
+
+SslServerNames::SslServerNames()
+    :d(new SslServerNamesPrivate())
+{
+}
+
+
+void SslServerNames::insert(const QString &name, const SslConfiguration &configuration)
+{
+    const QString &lower = name.toLower();
+    QMutexLocker locker(&d->lock);
+    if (lower.startsWith(QLatin1String("*."))) {
+        d->wildcards.insert(lower.mid(2), configuration);
+    } else {
+        d->exact.insert(lower, configuration);
+    }
+}
+
+
+bool SslServerNames::remove(const QString &name)
+{
+    const QString &lower = name.toLower();
+    QMutexLocker locker(&d->lock);
+    if (lower.startsWith(QLatin1String("*."))) {
+        return d->wildcards.remove(lower.mid(2)) > 0;
+    } else {
+        return d->exact.remove(lower) > 0;
+    }
+}
+
+
+bool SslServerNamesPrivate::find(const QString &serverName, SslConfiguration *configuration)
+{
+    const QString &lower = serverName.toLower();
+    QMutexLocker locker(&lock);
+    QHash<QString, SslConfiguration>::const_iterator itor = exact.constFind(lower);
+    if (itor == exact.constEnd()) {
+        const int dot = lower.indexOf(QLatin1Char('.'));
+        if (dot <= 0) {
+            return false;
+        }
+        itor = wildcards.constFind(lower.mid(dot + 1));
+        if (itor == wildcards.constEnd()) {
+            return false;
+        }
+    }
+    *configuration = itor.value();
+    return true;
+}
+
+
+bool SslServerNames::find(const QString &serverName, SslConfiguration *configuration) const
+{
+    return d->find(serverName, configuration);
+}
+
+
+int SslServerNames::size() const
+{
+    QMutexLocker locker(&d->lock);
+    return d->exact.size() + d->wildcards.size();
+}
+
+
+// the index of the Endpoint of dtls peer set to the ssl, for the cookie callbacks.
+static int dtlsPeerIndex()
+{
+    static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+
+// the cookie is a hmac of the peer address by a secret of this process, so the server answers the hellos of forged
+// addresses with a small HelloVerifyRequest and keeps nothing for them.
+static bool dtlsCookieOf(SSL *ssl, unsigned char *cookie, unsigned int *cookieLength)
+{
+    static unsigned char secret[32];
+    static const bool hasSecret = RAND_bytes(secret, sizeof(secret)) == 1;
+    const Endpoint *peer = static_cast<const Endpoint *>(SSL_get_ex_data(ssl, dtlsPeerIndex()));
+    if (!hasSecret || !peer) {
+        return false;
+    }
+    unsigned char input[sizeof(peer->address) + sizeof(peer->port)];
+    memcpy(input, peer->address, sizeof(peer->address));
+    memcpy(input + sizeof(peer->address), &peer->port, sizeof(peer->port));
+    return HMAC(EVP_sha256(), secret, sizeof(secret), input, sizeof(input), cookie, cookieLength) != nullptr;
+}
+
+
+static int dtlsGenerateCookie(SSL *ssl, unsigned char *cookie, unsigned int *cookieLength)
 {
+    return dtlsCookieOf(ssl, cookie, cookieLength) ? 1 : 0;
+}
 
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static int dtlsVerifyCookie(SSL *ssl, const unsigned char *cookie, unsigned int cookieLength)
+#else
+static int dtlsVerifyCookie(SSL *ssl, unsigned char *cookie, unsigned int cookieLength)
+#endif
+{
+    unsigned char expected[EVP_MAX_MD_SIZE];
+    unsigned int expectedLength = 0;
+    if (!dtlsCookieOf(ssl, expected, &expectedLength) || expectedLength != cookieLength) {
+        return 0;
+    }
+    return CRYPTO_memcmp(expected, cookie, cookieLength) == 0 ? 1 : 0;
 }
 
 
-QSharedPointer<SSL_CTX> SslConfigurationPrivate::makeContext(const SslConfiguration &config, bool asServer)
+QSharedPointer<SSL_CTX> SslConfigurationPrivate::makeContext(const SslConfiguration &config, bool asServer, bool datagram)
 {
     QSharedPointer<SSL_CTX> ctx;
     const SSL_METHOD *method = nullptr;
-    if(asServer) {
+    if (datagram) {
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L && !defined(LIBRESSL_VERSION_NUMBER)
+        method = asServer ? DTLS_server_method() : DTLS_client_method();
+#else
+        // libressl knows dtls 1.0 only.
+        method = asServer ? DTLSv1_server_method() : DTLSv1_client_method();
+#endif
+    } else if(asServer) {
         method = SSLv23_server_method();
     } else {
         method = SSLv23_client_method();
@@ -261,6 +796,10 @@ QSharedPointer<SSL_CTX> SslConfigurationPrivate::makeContext(const SslConfigurat
     if(ctx.isNull()) {
         return ctx;
     }
+    QSharedPointer<SslTicketKeys> keys;
+    QSharedPointer<QByteArray> alpn;
+    QSharedPointer<SslVerifyCache> verifyCache;
+    QSharedPointer<SslOcspStaple> staple;
     SSL_CTX_set_verify_depth(ctx.data(), config.peerVerifyDepth());
     long flags = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1;
     if (config.onlySecureProtocol()) {
@@ -270,6 +809,93 @@ QSharedPointer<SSL_CTX> SslConfigurationPrivate::makeContext(const SslConfigurat
         flags |= SSL_OP_NO_COMPRESSION;
     }
     SSL_CTX_set_options(ctx.data(), flags);
+    if (config.d->bufferReleaseEnabled) {
+        SSL_CTX_set_mode(ctx.data(), SSL_MODE_RELEASE_BUFFERS);
+    }
+    if (asServer) {
+        // the context is shared by all connections now, so the session cache works.
+        static const unsigned char sessionIdContext[] = "qtng";
+        SSL_CTX_set_session_id_context(ctx.data(), sessionIdContext, sizeof(sessionIdContext) - 1);
+        const quint32 cacheSize = config.d->sessionCacheSize;
+        if (cacheSize > 0) {
+            SSL_CTX_set_session_cache_mode(ctx.data(), SSL_SESS_CACHE_SERVER);
+            SSL_CTX_sess_set_cache_size(ctx.data(), static_cast<long>(cacheSize));
+        } else {
+            SSL_CTX_set_session_cache_mode(ctx.data(), SSL_SESS_CACHE_OFF);
+        }
+        const quint32 ticketKeyLifetime = config.d->sessionTicketKeyLifetime;
+        if (ticketKeyLifetime > 0) {
+            keys.reset(new SslTicketKeys(ticketKeyLifetime));
+            SSL_CTX_set_app_data(ctx.data(), keys.data());
+            SSL_CTX_set_tlsext_ticket_key_cb(ctx.data(), SslTicketKeys::callback);
+        } else {
+            SSL_CTX_set_options(ctx.data(), SSL_OP_NO_TICKET);
+        }
+        if (!config.d->serverNames.isNull()) {
+            SSL_CTX_set_tlsext_servername_callback(ctx.data(), SslServerNamesPrivate::callback);
+            SSL_CTX_set_tlsext_servername_arg(ctx.data(), config.d->serverNames.data());
+        }
+        staple = config.d->ocspStaple;
+        SSL_CTX_set_tlsext_status_cb(ctx.data(), SslOcspStaple::callback);
+        SSL_CTX_set_tlsext_status_arg(ctx.data(), staple.data());
+    }
+    if (datagram) {
+        // a memory bio can not tell the path mtu, DtlsSocket sets it.
+        SSL_CTX_set_options(ctx.data(), SSL_OP_NO_QUERY_MTU);
+#if !defined(LIBRESSL_VERSION_NUMBER) && defined(SSL_OP_NO_DTLSv1)
+        if (config.onlySecureProtocol()) {
+            SSL_CTX_set_options(ctx.data(), SSL_OP_NO_DTLSv1);
+        }
+#endif
+        if (asServer) {
+            SSL_CTX_set_cookie_generate_cb(ctx.data(), dtlsGenerateCookie);
+            SSL_CTX_set_cookie_verify_cb(ctx.data(), dtlsVerifyCookie);
+        }
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+    const QByteArray &protocols = alpnWireFormat(config.allowedNextProtocols());
+    if (!protocols.isEmpty()) {
+        if (asServer) {
+            alpn.reset(new QByteArray(protocols));
+            SSL_CTX_set_alpn_select_cb(ctx.data(), alpnSelectCallback, alpn.data());
+        } else {
+            SSL_CTX_set_alpn_protos(ctx.data(), reinterpret_cast<const unsigned char *>(protocols.constData()),
+                                    static_cast<unsigned int>(protocols.size()));
+        }
+    }
+#endif
+    // AutoVerifyPeer keeps the old behavior of not verifying.
+    if (config.peerVerifyMode() == Ssl::VerifyPeer) {
+        int mode = SSL_VERIFY_PEER;
+        if (asServer) {
+            mode |= SSL_VERIFY_FAIL_IF_NO_PEER_CERT;
+        }
+        SSL_CTX_set_verify(ctx.data(), mode, nullptr);
+        const QList<Certificate> &caCertificates = config.caCertificates();
+        if (caCertificates.isEmpty()) {
+            SSL_CTX_set_default_verify_paths(ctx.data());
+        } else {
+            X509_STORE *store = SSL_CTX_get_cert_store(ctx.data());
+            for (const Certificate &caCertificate: caCertificates) {
+                if (caCertificate.isValid()) {
+                    X509_STORE_add_cert(store, static_cast<X509 *>(caCertificate.handle()));
+                }
+            }
+        }
+        const quint32 verificationCacheLifetime = config.d->verificationCacheLifetime;
+        if (verificationCacheLifetime > 0) {
+            verifyCache.reset(new SslVerifyCache(verificationCacheLifetime));
+            SSL_CTX_set_cert_verify_callback(ctx.data(), SslVerifyCache::callback, verifyCache.data());
+        }
+    }
+    const QSharedPointer<SslServerNamesPrivate> serverNames = asServer ? config.d->serverNames
+                                                                       : QSharedPointer<SslServerNamesPrivate>();
+    if (!keys.isNull() || !alpn.isNull() || !verifyCache.isNull() || !serverNames.isNull() || !staple.isNull()) {
+        // the ticket keys, the protocol list, the verified chains, the server names and the ocsp response are
+        // deleted with the context.
+        SSL_CTX *raw = ctx.data();
+        ctx = QSharedPointer<SSL_CTX>(raw, [keys, alpn, verifyCache, serverNames, staple] (SSL_CTX *p) { SSL_CTX_free(p); });
+    }
     const PrivateKey &privateKey = config.privateKey();
     if(privateKey.isValid()) {
         int r = SSL_CTX_use_PrivateKey(ctx.data(), static_cast<EVP_PKEY *>(privateKey.handle()));
@@ -379,39 +1005,100 @@ bool SslConfiguration::supportCompression() const
     return d->supportCompression;
 }
 
+quint32 SslConfiguration::sessionTicketKeyLifetime() const
+{
+    return d->sessionTicketKeyLifetime;
+}
+
+quint32 SslConfiguration::sessionCacheSize() const
+{
+    return d->sessionCacheSize;
+}
+
+bool SslConfiguration::kernelTlsEnabled() const
+{
+    return d->kernelTlsEnabled;
+}
+
+bool SslConfiguration::handshakeOffloaded() const
+{
+    return d->handshakeOffloaded;
+}
+
+bool SslConfiguration::bufferReleaseEnabled() const
+{
+    return d->bufferReleaseEnabled;
+}
+
+quint32 SslConfiguration::verificationCacheLifetime() const
+{
+    return d->verificationCacheLifetime;
+}
+
+SslServerNames SslConfiguration::serverNames() const
+{
+    SslServerNames names;
+    if (!d->serverNames.isNull()) {
+        names.d = d->serverNames;
+    }
+    return names;
+}
+
 void SslConfiguration::addCaCertificate(const Certificate &certificate)
 {
     d->caCertificates.append(certificate);
+    d->clearContexts();
 }
 
 void SslConfiguration::addCaCertificates(const QList<Certificate> &certificates)
 {
     d->caCertificates.append(certificates);
+    d->clearContexts();
+}
+
+bool SslConfiguration::addCaCertificates(const QString &path, Ssl::EncodingFormat format)
+{
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    const QList<Certificate> &certificates = Certificate::loadAll(f.readAll(), format);
+    if (certificates.isEmpty()) {
+        return false;
+    }
+    addCaCertificates(certificates);
+    return true;
 }
 
 void SslConfiguration::setAllowedNextProtocols(const QList<QByteArray> &protocols)
 {
     d->allowedNextProtocols = protocols;
+    d->clearContexts();
 }
 
 void SslConfiguration::setPeerVerifyDepth(int depth)
 {
     d->peerVerifyDepth = depth;
+    d->clearContexts();
 }
 
 void SslConfiguration::setPeerVerifyMode(Ssl::PeerVerifyMode mode)
 {
     d->peerVerifyMode = mode;
+    d->clearContexts();
 }
 
 void SslConfiguration::setPeerVerifyName(const QString &hostName)
 {
     d->peerVerifyName = hostName;
+    d->clearContexts();
 }
 
 void SslConfiguration::setLocalCertificate(const Certificate &certificate)
 {
     d->localCertificate = certificate;
+    d->ocspStaple.reset(new SslOcspStaple());
+    d->clearContexts();
 }
 
 bool SslConfiguration::setLocalCertificate(const QString &path, Ssl::EncodingFormat format)
@@ -420,33 +1107,212 @@ bool SslConfiguration::setLocalCertificate(const QString &path, Ssl::EncodingFor
     if(!f.open(QIODevice::ReadOnly)) {
         return false;
     }
-    const QByteArray &data = f.readAll();
-    const Certificate &cert = Certificate::load(data, format);
-    if(cert.isNull() || cert.isBlacklisted()) {
-        return false;
+    const QByteArray &data = f.readAll();
+    const Certificate &cert = Certificate::load(data, format);
+    if(cert.isNull() || cert.isBlacklisted()) {
+        return false;
+    }
+    setLocalCertificate(cert);
+    return true;
+}
+
+void SslConfiguration::setPrivateKey(const PrivateKey &key)
+{
+    d->privateKey = key;
+    d->clearContexts();
+}
+
+void SslConfiguration::setPrivateKey(const QString &fileName, PrivateKey::Algorithm algorithm,
+                                     Ssl::EncodingFormat format, const QByteArray &passPhrase)
+{
+    Q_UNUSED(algorithm);  // the pem tells.
+    QFile f(fileName);
+    if (!f.open(QIODevice::ReadOnly)) {
+        return;
+    }
+    const PrivateKey &key = PrivateKey::load(f.readAll(), format, passPhrase);
+    if (key.isValid()) {
+        setPrivateKey(key);
+    }
+}
+
+void SslConfiguration::setOnlySecureProtocol(bool onlySecureProtocol)
+{
+    d->onlySecureProtocol = onlySecureProtocol;
+    d->clearContexts();
+}
+
+void SslConfiguration::setSupportCompression(bool supportCompression)
+{
+    d->supportCompression = supportCompression;
+    d->clearContexts();
+}
+
+void SslConfiguration::setSessionTicketKeyLifetime(quint32 secs)
+{
+    d->sessionTicketKeyLifetime = secs;
+    d->clearContexts();
+}
+
+void SslConfiguration::setSessionCacheSize(quint32 size)
+{
+    d->sessionCacheSize = size;
+    d->clearContexts();
+}
+
+void SslConfiguration::setKernelTlsEnabled(bool enabled)
+{
+    d->kernelTlsEnabled = enabled;
+}
+
+void SslConfiguration::setHandshakeOffloaded(bool offloaded)
+{
+    d->handshakeOffloaded = offloaded;
+}
+
+void SslConfiguration::setBufferReleaseEnabled(bool enabled)
+{
+    d->bufferReleaseEnabled = enabled;
+}
+
+void SslConfiguration::setVerificationCacheLifetime(quint32 secs)
+{
+    d->verificationCacheLifetime = secs;
+    d->clearContexts();
+}
+
+void SslConfiguration::setServerNames(const SslServerNames &names)
+{
+    d->serverNames = names.d;
+    d->clearContexts();
+}
+
+QByteArray SslConfiguration::ocspResponse() const
+{
+    SslOcspStaple *staple = d->ocspStaple.data();
+    QMutexLocker locker(&staple->lock);
+    return staple->response;
+}
+
+void SslConfiguration::setOcspResponse(const QByteArray &response)
+{
+    // does not detach, the copies share the response.
+    SslOcspStaple *staple = d.constData()->ocspStaple.data();
+    QMutexLocker locker(&staple->lock);
+    staple->response = response;
+}
+
+// the time of ocsp is a GeneralizedTime, such as 20240101120000Z.
+static QDateTime ocspTime(const ASN1_GENERALIZEDTIME *t)
+{
+    if (!t || t->length < 14) {
+        return QDateTime();
+    }
+    QDateTime dt = QDateTime::fromString(QString::fromLatin1(reinterpret_cast<const char *>(t->data), 14),
+                                         QStringLiteral("yyyyMMddHHmmss"));
+    dt.setTimeSpec(Qt::UTC);
+    return dt;
+}
+
+qint64 SslConfiguration::refreshOcspResponse()
+{
+    X509 *cert = static_cast<X509 *>(d->localCertificate.handle());
+    if (!cert) {
+        return -1;
+    }
+    X509 *issuer = nullptr;
+    for (const Certificate &ca: d->caCertificates) {
+        X509 *x = static_cast<X509 *>(ca.handle());
+        if (x && X509_check_issued(x, cert) == X509_V_OK) {
+            issuer = x;
+            break;
+        }
+    }
+    STACK_OF(OPENSSL_STRING) *urls = X509_get1_ocsp(cert);
+    if (!issuer || !urls || sk_OPENSSL_STRING_num(urls) <= 0) {
+        X509_email_free(urls);
+        return -1;
+    }
+    const QString url = QString::fromLatin1(sk_OPENSSL_STRING_value(urls, 0));
+    X509_email_free(urls);
+
+    QSharedPointer<OCSP_CERTID> id(OCSP_cert_to_id(nullptr, cert, issuer), OCSP_CERTID_free);
+    QSharedPointer<OCSP_REQUEST> request(OCSP_REQUEST_new(), OCSP_REQUEST_free);
+    if (id.isNull() || request.isNull() || !OCSP_request_add0_id(request.data(), OCSP_CERTID_dup(id.data()))) {
+        return -1;
+    }
+    unsigned char *buf = nullptr;
+    const int len = i2d_OCSP_REQUEST(request.data(), &buf);
+    if (len <= 0) {
+        return -1;
+    }
+    const QByteArray body(reinterpret_cast<const char *>(buf), len);
+    OPENSSL_free(buf);
+
+    HttpSession session;
+    QMap<QString, QByteArray> headers;
+    headers.insert(QStringLiteral("Content-Type"), "application/ocsp-request");
+    HttpResponse httpResponse = session.post(url, body, QMap<QString, QString>(), headers);
+    if (!httpResponse.isOk()) {
+        return -1;
+    }
+    const QByteArray &der = httpResponse.body();
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(der.constData());
+    QSharedPointer<OCSP_RESPONSE> response(d2i_OCSP_RESPONSE(nullptr, &p, der.size()), OCSP_RESPONSE_free);
+    if (response.isNull() || OCSP_response_status(response.data()) != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+        return -1;
+    }
+    QSharedPointer<OCSP_BASICRESP> basic(OCSP_response_get1_basic(response.data()), OCSP_BASICRESP_free);
+    int status, reason;
+    ASN1_GENERALIZEDTIME *revokedAt, *thisUpdate, *nextUpdate;
+    if (basic.isNull() || !OCSP_resp_find_status(basic.data(), id.data(), &status, &reason, &revokedAt, &thisUpdate, &nextUpdate)
+            || status != V_OCSP_CERTSTATUS_GOOD || !OCSP_check_validity(thisUpdate, nextUpdate, 300, -1)) {
+        return -1;
     }
-    setLocalCertificate(cert);
-    return true;
+    setOcspResponse(der);
+    // fetches again in the middle of the validity period, so a failure has time to retry.
+    const QDateTime &next = ocspTime(nextUpdate);
+    if (!next.isValid()) {
+        return 3600;
+    }
+    return qMax<qint64>(300, QDateTime::currentDateTimeUtc().secsTo(next) / 2);
 }
 
-void SslConfiguration::setPrivateKey(const PrivateKey &key)
+void SslConfiguration::setHandshakeThreads(int count)
 {
-    d->privateKey = key;
+    handshakeThreadPool()->setMaxThreadCount(qMax(1, count));
 }
 
-void SslConfiguration::setOnlySecureProtocol(bool onlySecureProtocol)
+int SslConfiguration::handshakeThreads()
 {
-    d->onlySecureProtocol = onlySecureProtocol;
+    return handshakeThreadPool()->maxThreadCount();
 }
 
-void SslConfiguration::setSupportCompression(bool supportCompression)
+QList<SslCipher> SslConfiguration::supportedCiphers()
 {
-    d->supportCompression = supportCompression;
+    return QList<SslCipher>();
 }
 
-QList<SslCipher> SslConfiguration::supportedCiphers()
+QList<Certificate> SslConfiguration::systemCaCertificates()
 {
-    return QList<SslCipher>();
+    // debian, fedora, opensuse, alpine and freebsd put the bundle here. loadAll() caches the parsed bundle.
+    static const char * const bundles[] = {
+        "/etc/ssl/certs/ca-certificates.crt",
+        "/etc/pki/tls/certs/ca-bundle.crt",
+        "/etc/ssl/ca-bundle.pem",
+        "/etc/ssl/cert.pem",
+        "/usr/local/share/certs/ca-root-nss.crt",
+    };
+    for (const char *bundle: bundles) {
+        QFile f(QString::fromLatin1(bundle));
+        if (f.open(QIODevice::ReadOnly)) {
+            const QList<Certificate> &certificates = Certificate::loadAll(f.readAll());
+            if (!certificates.isEmpty()) {
+                return certificates;
+            }
+        }
+    }
+    return QList<Certificate>();
 }
 
 SslConfiguration SslConfiguration::testPurpose(const QString &commonName, const QString &countryCode, const QString &organization)
@@ -635,7 +1501,6 @@ QDebug &operator<<(QDebug &debug, const SslError::Error &error)
     return debug;
 }
 
-/*
 static SslError _q_OpenSSL_to_SslError(int errorCode, const Certificate &cert)
 {
     SslError error;
@@ -684,7 +1549,113 @@ static SslError _q_OpenSSL_to_SslError(int errorCode, const Certificate &cert)
     }
     return error;
 }
-*/
+
+class SslHandshakeRunnable: public QRunnable
+{
+public:
+    SslHandshakeRunnable(const std::function<void()> &func, const QPointer<EventLoopCoroutine> &eventLoop,
+                         const QSharedPointer<Event> &done)
+        :func(func), eventLoop(eventLoop), done(done) {}
+    virtual void run() override;
+private:
+    std::function<void()> func;
+    QPointer<EventLoopCoroutine> eventLoop;
+    QSharedPointer<Event> done;
+};
+
+
+void SslHandshakeRunnable::run()
+{
+    func();
+    QSharedPointer<Event> done = this->done;
+    if (!eventLoop.isNull()) {
+        eventLoop->callLaterThreadSafe(0, makeFunctor([done] { done->set(); }));
+    }
+}
+
+
+// runs one step of SSL_accept() or SSL_connect() in the pool while the coroutine waits. the step works
+// on the memory bios only, so it does no io. the error is got in the same thread for the error queue is
+// thread local. the ssl is kept by the worker if the coroutine is killed.
+static int offloadedHandshakeStep(const QSharedPointer<SSL> &ssl, bool asServer, int *err)
+{
+    QSharedPointer<int> result(new int(0));
+    QSharedPointer<int> error(new int(SSL_ERROR_NONE));
+    QSharedPointer<Event> done(new Event());
+    QSharedPointer<SSL> s = ssl;
+    std::function<void()> func = [s, asServer, result, error] {
+        *result = asServer ? SSL_accept(s.data()) : SSL_connect(s.data());
+        if (*result <= 0) {
+            *error = SSL_get_error(s.data(), *result);
+        }
+    };
+    handshakeThreadPool()->start(new SslHandshakeRunnable(func, EventLoopCoroutine::get(), done));
+    done->wait();
+    *err = *error;
+    return *result;
+}
+
+
+#if defined(Q_OS_LINUX) && OPENSSL_VERSION_NUMBER >= 0x30000000L && defined(SSL_OP_ENABLE_KTLS)
+#define QTNG_HAVE_KTLS
+#endif
+
+// kernel tls works on plain tcp sockets only, returns -1 if the connection can not use it.
+static qintptr kernelTlsDescriptor(const SslConfiguration &config, const QSharedPointer<SocketLike> &rawSocket)
+{
+#ifdef QTNG_HAVE_KTLS
+    if (!config.kernelTlsEnabled()) {
+        return -1;
+    }
+    QSharedPointer<Socket> s = convertSocketLikeToSocket(rawSocket);
+    if (s.isNull() || s->type() != Socket::TcpSocket) {
+        return -1;
+    }
+    return s->fileno();
+#else
+    Q_UNUSED(config);
+    Q_UNUSED(rawSocket);
+    return -1;
+#endif
+}
+
+
+// the receiving buffers of the connections releasing their buffers, kept by each thread for the next one.
+Q_GLOBAL_STATIC(QThreadStorage<QList<QByteArray>>, idleIncomingBuffers)
+
+
+static QByteArray takeIncomingBuffer(int size)
+{
+    QList<QByteArray> &buffers = idleIncomingBuffers()->localData();
+    for (int i = buffers.size() - 1; i >= 0; --i) {
+        if (buffers.at(i).size() >= size) {
+            return buffers.takeAt(i);
+        }
+    }
+    return QByteArray(size, Qt::Uninitialized);
+}
+
+
+static void giveIncomingBuffer(const QByteArray &buffer)
+{
+    QList<QByteArray> &buffers = idleIncomingBuffers()->localData();
+    if (buffers.size() < 16) {
+        buffers.append(buffer);
+    }
+}
+
+
+// a drained memory bio keeps the biggest buffer it ever had, so it is worth replacing if that is big.
+static bool isDrainedAndBig(BIO *bio)
+{
+    BUF_MEM *mem = nullptr;
+    if (!bio || BIO_pending(bio) > 0) {
+        return false;
+    }
+    BIO_get_mem_ptr(bio, &mem);
+    return mem && mem->max > 4096;
+}
+
 
 template<typename Socket>
 class SslConnection
@@ -700,6 +1671,10 @@ public:
     qint32 send(const char *data, qint32 size, bool all);
     bool pumpOutgoing();
     bool pumpIncoming();
+    bool pumpWrite();  // sends the pending records, or waits for the socket in kernel tls mode.
+    bool waitIo(EventLoopCoroutine::EventType event);
+    void releaseBuffers();
+    qint64 sendfile(QFile *file, qint64 offset, qint64 length);
     Certificate localCertificate() const;
     QList<Certificate> localCertificateChain() const;
     Certificate peerCertificate() const;
@@ -709,19 +1684,32 @@ public:
     SslSocket::SslMode mode() const;
     Ssl::SslProtocol sslProtocol() const;
 
+    enum {
+        // the biggest tls record is 16k of plain text plus the overhead of cipher and header.
+        RecordBufferSize = 16 * 1024 + 2048 + 5,
+    };
     QSharedPointer<Socket> rawSocket;
+    QByteArray incomingBuffer;  // allocated at the first pumpIncoming() and reused, unless the buffers are released.
+    RecvSizer incomingSizer;    // a record at least, the bigger reads borrow the buffers of thread.
+    QByteArray outgoingBuffer;  // the records taken from the bio by pumpOutgoing(), used under outgoingLock.
+    QSharedPointer<Lock> outgoingLock;
     SslConfiguration config;
     QSharedPointer<SSL_CTX> ctx;
     QSharedPointer<SSL> ssl;
     QString verificationPeerName;
+    QString sessionKey;  // host:port of the client session cache.
     QList<SslError> errors;
     bool asServer;
+    bool directIo;       // openssl reads and writes the socket itself, for kernel tls.
+    bool kernelTlsSend;
+    bool waitBeforeRecv;  // the buffers are released and the raw socket can be waited without one.
 };
 
 
 template<typename Socket>
 SslConnection<Socket>::SslConnection(const SslConfiguration &config)
-    :config(config)
+    :incomingSizer(RecordBufferSize, RecordBufferSize, 1024 * 64), outgoingLock(new Lock()), config(config)
+    , directIo(false), kernelTlsSend(false), waitBeforeRecv(false)
 {
     initOpenSSL();
 }
@@ -729,6 +1717,8 @@ SslConnection<Socket>::SslConnection(const SslConfiguration &config)
 
 template<typename Socket>
 SslConnection<Socket>::SslConnection()
+    :incomingSizer(RecordBufferSize, RecordBufferSize, 1024 * 64), outgoingLock(new Lock()), directIo(false)
+    , kernelTlsSend(false), waitBeforeRecv(false)
 {
     initOpenSSL();
 }
@@ -746,8 +1736,7 @@ bool SslConnection<Socket>::handshake(bool asServer, const QString &verification
         return false;
     }
     this->asServer = asServer;
-    this->verificationPeerName = verificationPeerName;
-    // TODO set verify name.
+    this->verificationPeerName = verificationPeerName.isEmpty() ? config.peerVerifyName() : verificationPeerName;
 
     BIO *incoming = BIO_new(BIO_s_mem());
     if(!incoming) {
@@ -758,13 +1747,75 @@ bool SslConnection<Socket>::handshake(bool asServer, const QString &verification
         return false;
     }
 
-    ctx = SslConfigurationPrivate::makeContext(config, asServer);
+    ctx = SslConfigurationPrivate::context(config, asServer);
     if(!ctx.isNull()) {
         ssl.reset(SSL_new(ctx.data()), SSL_free);
         if(!ssl.isNull()) {
-            // do not free incoming & outgoing
-            SSL_set_bio(ssl.data(), incoming, outgoing);
-            return _handshake();
+            const qintptr fd = kernelTlsDescriptor(config, rawSocket);
+            if (fd >= 0) {
+#ifdef QTNG_HAVE_KTLS
+                // the kernel takes the keys after handshake if the cipher is supported, or openssl works as usual.
+                BIO *bio = BIO_new_socket(static_cast<int>(fd), BIO_NOCLOSE);
+                if (bio) {
+                    BIO_free(incoming);
+                    BIO_free(outgoing);
+                    SSL_set_bio(ssl.data(), bio, bio);
+                    SSL_set_options(ssl.data(), SSL_OP_ENABLE_KTLS);
+                    directIo = true;
+                }
+#endif
+            }
+            if (!directIo) {
+                // do not free incoming & outgoing
+                SSL_set_bio(ssl.data(), incoming, outgoing);
+            }
+            // the name is a part of the key of verified chains, see SslVerifyCache.
+            SSL_set_app_data(ssl.data(), &this->verificationPeerName);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+            if (!asServer && !this->verificationPeerName.isEmpty() && config.peerVerifyMode() == Ssl::VerifyPeer) {
+                SSL_set1_host(ssl.data(), this->verificationPeerName.toUtf8().constData());
+            }
+#endif
+            // the server name (sni) lets a server of many hosts pick the certificate.
+            if (!asServer && !this->verificationPeerName.isEmpty() && QHostAddress(this->verificationPeerName).isNull()) {
+                SSL_set_tlsext_host_name(ssl.data(), this->verificationPeerName.toUtf8().constData());
+            }
+            if (!asServer) {
+                const QString &host = this->verificationPeerName.isEmpty() ? rawSocket->peerAddress().toString() : this->verificationPeerName;
+                sessionKey = host + QLatin1Char(':') + QString::number(rawSocket->peerPort());
+                const QSharedPointer<SSL_SESSION> &session = SslConfigurationPrivate::session(config, sessionKey);
+                if (!session.isNull()) {
+                    SSL_set_session(ssl.data(), session.data());
+                }
+            }
+            QTNG_PROBE2(tls_handshake_start, rawSocket->fileno(), asServer);
+            const bool done = _handshake();
+            QTNG_PROBE3(tls_handshake_done, rawSocket->fileno(), asServer, done);
+            if (!done) {
+                const long verifyResult = SSL_get_verify_result(ssl.data());
+                if (verifyResult != X509_V_OK) {
+                    errors.append(_q_OpenSSL_to_SslError(static_cast<int>(verifyResult), peerCertificate()));
+                }
+                Metrics::increase("qtng_tls_handshakes_total", asServer ? "side=\"server\",result=\"failed\"" : "side=\"client\",result=\"failed\"");
+                return false;
+            }
+            if (Metrics::isEnabled()) {
+                const bool resumed = SSL_session_reused(ssl.data());
+                if (asServer) {
+                    Metrics::increase("qtng_tls_handshakes_total", resumed ? "side=\"server\",result=\"resumed\"" : "side=\"server\",result=\"full\"");
+                } else {
+                    Metrics::increase("qtng_tls_handshakes_total", resumed ? "side=\"client\",result=\"resumed\"" : "side=\"client\",result=\"full\"");
+                }
+            }
+#ifdef QTNG_HAVE_KTLS
+            kernelTlsSend = directIo && BIO_get_ktls_send(SSL_get_wbio(ssl.data()));
+#endif
+            // other socket likes, such as KcpSocket, may block in recv() after their descriptor is readable.
+            waitBeforeRecv = config.bufferReleaseEnabled() && !convertSocketLikeToSocket(rawSocket).isNull();
+            if (!asServer) {
+                SslConfigurationPrivate::saveSession(config, sessionKey, ssl.data());
+            }
+            return true;
         } else {
             ctx.reset();
         }
@@ -780,6 +1831,10 @@ template<typename Socket>
 bool SslConnection<Socket>::close()
 {
     if (!ssl.isNull()) {
+        // a newer session may be got after the handshake.
+        if (!asServer && !sessionKey.isEmpty() && SSL_is_init_finished(ssl.data())) {
+            SslConfigurationPrivate::saveSession(config, sessionKey, ssl.data());
+        }
 //        while(true) {
 //            int result = SSL_shutdown(ssl.data());
 //            bool done = true;
@@ -838,17 +1893,27 @@ bool SslConnection<Socket>::close()
 template<typename Socket>
 bool SslConnection<Socket>::_handshake()
 {
+    // the socket bio of kernel tls does io, so it can not be offloaded.
+    const bool offloaded = config.handshakeOffloaded() && !directIo;
     while(true) {
-        int result = asServer ? SSL_accept(ssl.data()) : SSL_connect(ssl.data());
+        int result;
+        int err = SSL_ERROR_NONE;
+        if (offloaded) {
+            result = offloadedHandshakeStep(ssl, asServer, &err);
+        } else {
+            result = asServer ? SSL_accept(ssl.data()) : SSL_connect(ssl.data());
+            if (result <= 0) {
+                err = SSL_get_error(ssl.data(), result);
+            }
+        }
         if(result <= 0) {
-            int err = SSL_get_error(ssl.data(), result);
             switch(err) {
             case SSL_ERROR_WANT_READ:
                 if(!pumpOutgoing()) return false;
                 if(!pumpIncoming()) return false;
                 break;
             case SSL_ERROR_WANT_WRITE:
-                if(!pumpOutgoing()) return false;
+                if(!pumpWrite()) return false;
                 break;
             case SSL_ERROR_ZERO_RETURN:
             case SSL_ERROR_WANT_CONNECT:
@@ -878,17 +1943,38 @@ bool SslConnection<Socket>::pumpOutgoing()
     if (ssl.isNull()) {
         return false;
     }
-    int pendingBytes;
-    QVarLengthArray<char, 4096> buf;
+    if (directIo) {
+        return true;
+    }
     BIO *outgoing = SSL_get_wbio(ssl.data());
-    while(outgoing && rawSocket->isValid() && (pendingBytes = BIO_pending(outgoing)) > 0) {
-        buf.resize(pendingBytes);
-        qint32 encryptedBytesRead = BIO_read(outgoing, buf.data(), pendingBytes);
-        qint32 actualWritten = rawSocket->sendall(buf.constData(), encryptedBytesRead);
-        if (actualWritten < encryptedBytesRead) {
-            qDebug() << "error sending data.";
-            return false;
-        }
+    if (!outgoing || !rawSocket->isValid()) {
+        return true;
+    }
+    // the reader pumps on WANT_READ while a writer may be blocked in sendall(), so the records are taken out of bio
+    // before sending, or they are sent twice. the bio may be grown by SSL_write() meanwhile, and the lock keeps the
+    // records in order.
+    ScopedLock<Lock> locker(outgoingLock);
+    if (!locker.isSuccess()) {
+        return false;
+    }
+    const int pendingBytes = static_cast<int>(BIO_ctrl_pending(outgoing));
+    if (pendingBytes <= 0) {
+        return true;
+    }
+    if (outgoingBuffer.size() < pendingBytes) {
+        outgoingBuffer.resize(pendingBytes);
+    }
+    const int readBytes = BIO_read(outgoing, outgoingBuffer.data(), pendingBytes);
+    if (readBytes <= 0) {
+        return true;
+    }
+    qint32 actualWritten = rawSocket->sendall(outgoingBuffer.constData(), readBytes);
+    if (config.bufferReleaseEnabled()) {
+        outgoingBuffer.clear();
+    }
+    if (actualWritten < readBytes) {
+        qDebug() << "error sending data.";
+        return false;
     }
     return true;
 }
@@ -900,21 +1986,154 @@ bool SslConnection<Socket>::pumpIncoming()
     if (ssl.isNull()) {
         return false;
     }
-    const QByteArray &buf = rawSocket->recv(1024 * 8);
-    if(buf.isEmpty())
-        return false;
-    int totalWritten = 0;
-    BIO *incoming = SSL_get_rbio(ssl.data());
-    while(incoming && totalWritten < buf.size()) {
-        int writtenToBio = BIO_write(incoming, buf.constData() + totalWritten, buf.size() - totalWritten);
-        if(writtenToBio > 0) {
-            totalWritten += writtenToBio;
-        } else {
-            qDebug() << "Unable to decrypt data";
+    if (directIo) {
+        return waitIo(EventLoopCoroutine::Read);
+    }
+    const qint32 size = incomingSizer.next();
+    QByteArray pooled;
+    char *buffer;
+    if (config.bufferReleaseEnabled()) {
+        // the connection is going to be idle, it waits without any buffer and takes one when the data comes.
+        releaseBuffers();
+        if (waitBeforeRecv && !waitIo(EventLoopCoroutine::Read)) {
             return false;
         }
-    };
-    return true;
+        pooled = takeIncomingBuffer(size);
+        buffer = pooled.data();
+    } else if (size > RecordBufferSize) {
+        // a bulk transfer reads many records at once, the buffer is not kept by the connection while it is idle.
+        pooled = takeIncomingBuffer(size);
+        buffer = pooled.data();
+    } else {
+        if (incomingBuffer.isEmpty()) {
+            incomingBuffer.resize(RecordBufferSize);
+        }
+        buffer = incomingBuffer.data();
+    }
+    bool ok = false;
+    qint32 received = rawSocket->recv(buffer, size);
+    incomingSizer.record(received);
+    if (received > 0) {
+        int totalWritten = 0;
+        BIO *incoming = SSL_get_rbio(ssl.data());
+        ok = true;
+        while(incoming && totalWritten < received) {
+            int writtenToBio = BIO_write(incoming, buffer + totalWritten, received - totalWritten);
+            if(writtenToBio > 0) {
+                totalWritten += writtenToBio;
+            } else {
+                qDebug() << "Unable to decrypt data";
+                ok = false;
+                break;
+            }
+        };
+    }
+    if (!pooled.isNull()) {
+        giveIncomingBuffer(pooled);
+    }
+    return ok;
+}
+
+
+// SSL_MODE_RELEASE_BUFFERS frees the buffers of openssl, and the drained memory bios are replaced by empty ones.
+// the buffering bio of handshake is in the way until it is done.
+template<typename Socket>
+void SslConnection<Socket>::releaseBuffers()
+{
+    if (ssl.isNull() || directIo || !SSL_is_init_finished(ssl.data())) {
+        return;
+    }
+    BIO *incoming = SSL_get_rbio(ssl.data());
+    BIO *outgoing = SSL_get_wbio(ssl.data());
+    const bool renewIncoming = isDrainedAndBig(incoming);
+    const bool renewOutgoing = isDrainedAndBig(outgoing);
+    if (!renewIncoming && !renewOutgoing) {
+        return;
+    }
+    BIO *newIncoming = renewIncoming ? BIO_new(BIO_s_mem()) : incoming;
+    BIO *newOutgoing = renewOutgoing ? BIO_new(BIO_s_mem()) : outgoing;
+    if (!newIncoming || !newOutgoing) {
+        if (renewIncoming) {
+            BIO_free(newIncoming);
+        }
+        if (renewOutgoing) {
+            BIO_free(newOutgoing);
+        }
+        return;
+    }
+    // the old ones are freed.
+    SSL_set_bio(ssl.data(), newIncoming, newOutgoing);
+}
+
+
+template<typename Socket>
+bool SslConnection<Socket>::pumpWrite()
+{
+    if (directIo) {
+        return waitIo(EventLoopCoroutine::Write);
+    }
+    return pumpOutgoing();
+}
+
+
+template<typename Socket>
+bool SslConnection<Socket>::waitIo(EventLoopCoroutine::EventType event)
+{
+    if (!rawSocket->isValid()) {
+        return false;
+    }
+    ScopedIoWatcher watcher(event, rawSocket->fileno());
+    watcher.start();
+    return rawSocket->isValid();
+}
+
+
+// the file is encrypted and sent by kernel if kernel tls is active, or read and sent by SSL_write().
+template<typename Socket>
+qint64 SslConnection<Socket>::sendfile(QFile *file, qint64 offset, qint64 length)
+{
+    if (ssl.isNull() || !file) {
+        return -1;
+    }
+    if (length < 0) {
+        length = file->size() - offset;
+    }
+    qint64 total = 0;
+#ifdef QTNG_HAVE_KTLS
+    if (kernelTlsSend && file->handle() >= 0) {
+        while (total < length) {
+            ossl_ssize_t result = SSL_sendfile(ssl.data(), file->handle(), static_cast<off_t>(offset + total),
+                                               static_cast<size_t>(length - total), 0);
+            if (result > 0) {
+                total += result;
+                continue;
+            }
+            if (SSL_get_error(ssl.data(), static_cast<int>(result)) != SSL_ERROR_WANT_WRITE
+                    || !waitIo(EventLoopCoroutine::Write)) {
+                return total == 0 ? -1 : total;
+            }
+        }
+        return total;
+    }
+#endif
+    if (!file->seek(offset)) {
+        return -1;
+    }
+    QByteArray buf;
+    buf.resize(RecordBufferSize);
+    while (total < length) {
+        qint64 bs = file->read(buf.data(), qMin<qint64>(buf.size(), length - total));
+        if (bs <= 0) {
+            break;
+        }
+        qint32 sent = send(buf.constData(), static_cast<qint32>(bs), true);
+        if (sent < bs) {
+            total += qMax(sent, 0);
+            return total == 0 ? -1 : total;
+        }
+        total += bs;
+    }
+    return total;
 }
 
 
@@ -938,7 +2157,7 @@ qint32 SslConnection<Socket>::recv(char *data, qint32 size, bool all)
                 }
                 break;
             case SSL_ERROR_WANT_WRITE:
-                if(!pumpOutgoing()) {
+                if(!pumpWrite()) {
                     return total == 0 ? -1 : total;
                 }
                 break;
@@ -987,7 +2206,7 @@ qint32 SslConnection<Socket>::send(const char *data, qint32 size, bool all)
                 }
                 break;
             case SSL_ERROR_WANT_WRITE:
-                if(!pumpOutgoing()) {
+                if(!pumpWrite()) {
                     return total == 0 ? -1 : total;
                 }
                 break;
@@ -1153,18 +2372,36 @@ class SslSocketPrivate: public SslConnection<SocketLike>
 public:
     SslSocketPrivate(const SslConfiguration &config);
     bool isValid() const;
+    // times the handshake if Socket::isIoStatsEnabled().
+    bool timedHandshake(bool asServer, const QString &verificationPeerName);
 
     QString errorString;
     Socket::SocketError error;
+    qint64 handshakeNsecs;  // -1 if it is not timed.
 };
 
 
 SslSocketPrivate::SslSocketPrivate(const SslConfiguration &config)
-    :SslConnection<SocketLike>(config), error(Socket::NoError)
+    :SslConnection<SocketLike>(config), error(Socket::NoError), handshakeNsecs(-1)
 {
 
 }
 
+bool SslSocketPrivate::timedHandshake(bool asServer, const QString &verificationPeerName)
+{
+    if (!Socket::isIoStatsEnabled()) {
+        return handshake(asServer, verificationPeerName);
+    }
+    QElapsedTimer timer;
+    timer.start();
+    if (!handshake(asServer, verificationPeerName)) {
+        return false;
+    }
+    handshakeNsecs = timer.nsecsElapsed();
+    countSslHandshake(handshakeNsecs);
+    return true;
+}
+
 bool SslSocketPrivate::isValid() const
 {
     if(error != Socket::NoError) {
@@ -1221,7 +2458,8 @@ bool SslSocket::handshake(bool asServer, const QString &verificationPeerName)
     if(!d->ssl.isNull()) {
         return false;
     }
-    return d->handshake(asServer, verificationPeerName);
+    CancelScope::check();
+    return d->timedHandshake(asServer, verificationPeerName);
 }
 
 
@@ -1288,6 +2526,45 @@ SslCipher SslSocket::cipher() const
 }
 
 
+QByteArray SslSocket::negotiatedProtocol() const
+{
+    Q_D(const SslSocket);
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+    if (d->ssl.isNull()) {
+        return QByteArray();
+    }
+    const unsigned char *data = nullptr;
+    unsigned int len = 0;
+    SSL_get0_alpn_selected(d->ssl.data(), &data, &len);
+    if (!data || len == 0) {
+        return QByteArray();
+    }
+    return QByteArray(reinterpret_cast<const char *>(data), static_cast<int>(len));
+#else
+    return QByteArray();
+#endif
+}
+
+
+QByteArray SslSocket::nextNegotiatedProtocol() const
+{
+    return negotiatedProtocol();
+}
+
+
+SslSocket::NextProtocolNegotiationStatus SslSocket::nextProtocolNegotiationStatus() const
+{
+    Q_D(const SslSocket);
+    if (!negotiatedProtocol().isEmpty()) {
+        return NextProtocolNegotiationNegotiated;
+    }
+    if (d->config.allowedNextProtocols().isEmpty()) {
+        return NextProtocolNegotiationNone;
+    }
+    return NextProtocolNegotiationUnsupported;
+}
+
+
 SslSocket::SslMode SslSocket::mode() const
 {
     Q_D(const SslSocket);
@@ -1323,7 +2600,7 @@ QSharedPointer<SslSocket> SslSocket::accept()
         QSharedPointer<SocketLike> rawSocket = d->rawSocket->accept();
         if(rawSocket) {
             QSharedPointer<SslSocket> s(new SslSocket(rawSocket, d->config));
-            if(s->d_func()->handshake(true, QString())) {
+            if(s->d_func()->timedHandshake(true, QString())) {
                 return s;
             }
         }
@@ -1363,7 +2640,7 @@ bool SslSocket::connect(const QHostAddress &addr, quint16 port)
     if(!d->rawSocket->connect(addr, port)) {
         return false;
     }
-    return d->handshake(false, QString());
+    return d->timedHandshake(false, QString());
 }
 
 
@@ -1373,7 +2650,7 @@ bool SslSocket::connect(const QString &hostName, quint16 port, Socket::NetworkLa
     if(!d->rawSocket->connect(hostName, port, protocol)) {
         return false;
     }
-    return d->handshake(false, hostName);
+    return d->timedHandshake(false, hostName);
 }
 
 
@@ -1525,6 +2802,55 @@ qint32 SslSocket::sendall(const char *data, qint32 size)
 }
 
 
+qint64 SslSocket::sendfile(QFile *file, qint64 offset, qint64 length)
+{
+    Q_D(SslSocket);
+    return d->sendfile(file, offset, length);
+}
+
+
+bool SslSocket::isKernelTlsActive() const
+{
+    Q_D(const SslSocket);
+    return d->kernelTlsSend;
+}
+
+
+bool SslSocket::isResumed() const
+{
+    Q_D(const SslSocket);
+    return !d->ssl.isNull() && SSL_session_reused(d->ssl.data());
+}
+
+
+SocketIoStats SslSocket::ioStats() const
+{
+    Q_D(const SslSocket);
+    SocketIoStats stats = d->rawSocket->ioStats();
+    if (d->handshakeNsecs >= 0) {
+        stats.handshakes = 1;
+        stats.handshakeNsecs = d->handshakeNsecs;
+    }
+    return stats;
+}
+
+
+qint32 SslSocket::bufferedBytes() const
+{
+    Q_D(const SslSocket);
+    if (d->ssl.isNull()) {
+        return 0;
+    }
+    qint32 total = qMax(SSL_pending(d->ssl.data()), 0);
+    // in kernel tls mode the rbio is the socket, nothing is buffered there.
+    BIO *incoming = SSL_get_rbio(d->ssl.data());
+    if (!d->directIo && incoming) {
+        total += static_cast<qint32>(BIO_ctrl_pending(incoming));
+    }
+    return total;
+}
+
+
 QByteArray SslSocket::recv(qint32 size)
 {
     Q_D(SslSocket);
@@ -1574,6 +2900,76 @@ qint32 SslSocket::sendall(const QByteArray &data)
 }
 
 
+// the payload of one tls record is 16k at most.
+const int MaxSslRecordSize = 1024 * 16;
+
+
+qint32 SslSocket::sendv(const QList<QByteArray> &buffers)
+{
+    Q_D(SslSocket);
+    QByteArray chunk;
+    for (const QByteArray &buffer: buffers) {
+        if (buffer.isEmpty()) {
+            continue;
+        }
+        if (!chunk.isEmpty() && chunk.size() + buffer.size() > MaxSslRecordSize) {
+            break;
+        }
+        chunk.append(buffer);
+    }
+    if (chunk.isEmpty()) {
+        return 0;
+    }
+    qint32 bytesSent = d->send(chunk.constData(), chunk.size(), false);
+    if(bytesSent == 0 && !d->isValid()) {
+        return -1;
+    } else {
+        return bytesSent;
+    }
+}
+
+
+qint32 SslSocket::sendallv(const QList<QByteArray> &buffers)
+{
+    Q_D(SslSocket);
+    qint32 total = 0;
+    QByteArray chunk;
+    for (int i = 0; i <= buffers.size(); ++i) {
+        if (i < buffers.size()) {
+            const QByteArray &buffer = buffers.at(i);
+            if (buffer.isEmpty()) {
+                continue;
+            }
+            if (chunk.size() + buffer.size() <= MaxSslRecordSize) {
+                chunk.append(buffer);  // shared, not copied if chunk is empty.
+                continue;
+            }
+        }
+        if (!chunk.isEmpty()) {
+            qint32 bs = d->send(chunk.constData(), chunk.size(), true);
+            if (bs < chunk.size()) {
+                return total > 0 ? total + qMax(bs, 0) : bs;
+            }
+            total += bs;
+        }
+        chunk = i < buffers.size() ? buffers.at(i) : QByteArray();
+    }
+    return total;
+}
+
+
+qint32 SslSocket::recvv(SocketBuffer *buffers, qint32 count)
+{
+    Q_D(SslSocket);
+    for (qint32 i = 0; i < count; ++i) {
+        if (buffers[i].size > 0) {
+            return d->recv(buffers[i].data, buffers[i].size, false);
+        }
+    }
+    return 0;
+}
+
+
 namespace {
 
 class SocketLikeSslImpl: public SocketLike
@@ -1593,6 +2989,8 @@ public:
     virtual Socket::SocketType type() const override;
     virtual Socket::SocketState state() const override;
     virtual Socket::NetworkLayerProtocol protocol() const override;
+    virtual SocketIoStats ioStats() const override;
+    virtual qint32 bufferedBytes() const override;
 
     virtual Socket *acceptRaw() override;
     virtual QSharedPointer<SocketLike> accept() override;
@@ -1613,6 +3011,9 @@ public:
     virtual QByteArray recvall(qint32 size) override;
     virtual qint32 send(const QByteArray &data) override;
     virtual qint32 sendall(const QByteArray &data) override;
+    virtual qint32 sendv(const QList<QByteArray> &buffers) override;
+    virtual qint32 sendallv(const QList<QByteArray> &buffers) override;
+    virtual qint32 recvv(SocketBuffer *buffers, qint32 count) override;
 public:
     QSharedPointer<SslSocket> s;
 };
@@ -1694,6 +3095,18 @@ Socket::NetworkLayerProtocol SocketLikeSslImpl::protocol() const
 }
 
 
+SocketIoStats SocketLikeSslImpl::ioStats() const
+{
+    return s->ioStats();
+}
+
+
+qint32 SocketLikeSslImpl::bufferedBytes() const
+{
+    return s->bufferedBytes();
+}
+
+
 Socket *SocketLikeSslImpl::acceptRaw()
 {
     return s->acceptRaw();
@@ -1802,6 +3215,24 @@ qint32 SocketLikeSslImpl::sendall(const QByteArray &data)
 }
 
 
+qint32 SocketLikeSslImpl::sendv(const QList<QByteArray> &buffers)
+{
+    return s->sendv(buffers);
+}
+
+
+qint32 SocketLikeSslImpl::sendallv(const QList<QByteArray> &buffers)
+{
+    return s->sendallv(buffers);
+}
+
+
+qint32 SocketLikeSslImpl::recvv(SocketBuffer *buffers, qint32 count)
+{
+    return s->recvv(buffers, count);
+}
+
+
 } //anonymous namespace
 
 
@@ -2145,4 +3576,476 @@ QSharedPointer<SocketLike> encrypted(QSharedPointer<Cipher> cipher, QSharedPoint
 }
 
 
+class DtlsSocketPrivate
+{
+public:
+    DtlsSocketPrivate(QSharedPointer<Socket> rawSocket, const SslConfiguration &config);
+    ~DtlsSocketPrivate();
+    bool handshake(bool asServer, const QString &verificationPeerName);
+    bool listen();
+    bool pumpOutgoing();
+    bool pumpIncoming();
+    bool sendDatagram(const char *data, qint32 size);
+    qint32 recvDatagram();
+    void close();
+
+    enum {
+        // the header of record: content type, version, epoch, sequence number and length.
+        RecordHeaderSize = 13,
+        MaxPlainTextSize = 16 * 1024,
+        DatagramBufferSize = 64 * 1024,
+    };
+    QSharedPointer<Socket> rawSocket;
+    SslConfiguration config;
+    QSharedPointer<SSL_CTX> ctx;
+    QSharedPointer<SSL> ssl;
+    QByteArray incomingBuffer;
+    QString verificationPeerName;
+    QString sessionKey;
+    QList<SslError> errors;
+    Endpoint peer;
+    quint16 mtu;
+    bool asServer;
+    bool connected;     // the raw socket is connected to the peer, so it uses send() and recv().
+};
+
+
+DtlsSocketPrivate::DtlsSocketPrivate(QSharedPointer<Socket> rawSocket, const SslConfiguration &config)
+    :rawSocket(rawSocket), config(config), mtu(1200), asServer(false), connected(false)
+{
+    initOpenSSL();
+}
+
+
+DtlsSocketPrivate::~DtlsSocketPrivate()
+{
+    close();
+}
+
+
+bool DtlsSocketPrivate::handshake(bool asServer, const QString &verificationPeerName)
+{
+    this->asServer = asServer;
+    this->verificationPeerName = verificationPeerName.isEmpty() ? config.peerVerifyName() : verificationPeerName;
+    connected = rawSocket->state() == Socket::ConnectedState;
+    if (!asServer) {
+        if (!connected) {
+            return false;
+        }
+        peer = Endpoint(rawSocket->peerAddress(), rawSocket->peerPort());
+    }
+    ctx = SslConfigurationPrivate::context(config, asServer, true);
+    if (ctx.isNull()) {
+        return false;
+    }
+    ssl.reset(SSL_new(ctx.data()), SSL_free);
+    if (ssl.isNull()) {
+        ctx.reset();
+        return false;
+    }
+    BIO *incoming = BIO_new(BIO_s_mem());
+    BIO *outgoing = BIO_new(BIO_s_mem());
+    if (!incoming || !outgoing) {
+        BIO_free(incoming);
+        BIO_free(outgoing);
+        ssl.reset();
+        ctx.reset();
+        return false;
+    }
+    SSL_set_bio(ssl.data(), incoming, outgoing);
+    SSL_set_app_data(ssl.data(), &this->verificationPeerName);
+    SSL_set_ex_data(ssl.data(), dtlsPeerIndex(), &peer);
+    SSL_set_mtu(ssl.data(), mtu);
+    if (incomingBuffer.isEmpty()) {
+        incomingBuffer.resize(DatagramBufferSize);
+    }
+    if (!asServer) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+        if (!this->verificationPeerName.isEmpty() && config.peerVerifyMode() == Ssl::VerifyPeer) {
+            SSL_set1_host(ssl.data(), this->verificationPeerName.toUtf8().constData());
+        }
+#endif
+        if (!this->verificationPeerName.isEmpty() && QHostAddress(this->verificationPeerName).isNull()) {
+            SSL_set_tlsext_host_name(ssl.data(), this->verificationPeerName.toUtf8().constData());
+        }
+        // the sessions of tls and dtls do not mix, so the key is prefixed.
+        const QString &host = this->verificationPeerName.isEmpty() ? rawSocket->peerAddress().toString() : this->verificationPeerName;
+        sessionKey = QStringLiteral("dtls:") + host + QLatin1Char(':') + QString::number(rawSocket->peerPort());
+        const QSharedPointer<SSL_SESSION> &session = SslConfigurationPrivate::session(config, sessionKey);
+        if (!session.isNull()) {
+            SSL_set_session(ssl.data(), session.data());
+        }
+    } else if (!listen()) {
+        ssl.reset();
+        ctx.reset();
+        return false;
+    }
+    bool done = false;
+    while (true) {
+        const int result = asServer ? SSL_accept(ssl.data()) : SSL_connect(ssl.data());
+        if (result > 0) {
+            // the last flight is in the outgoing bio still.
+            done = pumpOutgoing();
+            break;
+        }
+        const int err = SSL_get_error(ssl.data(), result);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+            qDebug() << "dtls handshake error.";
+            break;
+        }
+        if (!pumpOutgoing() || (err == SSL_ERROR_WANT_READ && !pumpIncoming())) {
+            break;
+        }
+    }
+    if (!done) {
+        const long verifyResult = SSL_get_verify_result(ssl.data());
+        if (verifyResult != X509_V_OK) {
+            Certificate cert;
+            if (X509 *x = SSL_get_peer_certificate(ssl.data())) {
+                openssl_setCertificate(&cert, x);
+            }
+            errors.append(_q_OpenSSL_to_SslError(static_cast<int>(verifyResult), cert));
+        }
+        ssl.reset();
+        ctx.reset();
+        return false;
+    }
+    if (!asServer) {
+        SslConfigurationPrivate::saveSession(config, sessionKey, ssl.data());
+    }
+    return true;
+}
+
+
+// answers the hellos without a valid cookie, until one comes with it. the peer is set to its sender.
+bool DtlsSocketPrivate::listen()
+{
+    BIO *incoming = SSL_get_rbio(ssl.data());
+    BIO *outgoing = SSL_get_wbio(ssl.data());
+    while (true) {
+        Endpoint from;
+        const qint32 received = rawSocket->recvfrom(incomingBuffer.data(), incomingBuffer.size(), &from);
+        if (received < 0 || (received == 0 && !rawSocket->isValid())) {
+            return false;
+        }
+        if (received == 0) {
+            continue;
+        }
+        peer = from;
+        (void) BIO_reset(incoming);
+        (void) BIO_reset(outgoing);
+        if (BIO_write(incoming, incomingBuffer.constData(), received) != received) {
+            return false;
+        }
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+        BIO_ADDR *client = BIO_ADDR_new();
+        const int result = DTLSv1_listen(ssl.data(), client);
+        BIO_ADDR_free(client);
+        if (result > 0) {
+            // the hello is peeked by DTLSv1_listen(), which the memory bio can not do, so it is written again.
+            return BIO_write(incoming, incomingBuffer.constData(), received) == received;
+        }
+#else
+        // the memory bio tells no address, the buffer of sockaddr is left zeroed.
+        char client[128];
+        memset(client, 0, sizeof(client));
+        const int result = static_cast<int>(DTLSv1_listen(ssl.data(), client));
+        if (result > 0) {
+            return true;
+        }
+#endif
+        ERR_clear_error();
+        // the sender may be forged, so the HelloVerifyRequest failed to send is ignored.
+        (void) pumpOutgoing();
+    }
+}
+
+
+// the records are packed into datagrams of at most mtu bytes, a record is never split.
+bool DtlsSocketPrivate::pumpOutgoing()
+{
+    BIO *outgoing = SSL_get_wbio(ssl.data());
+    if (!outgoing) {
+        return false;
+    }
+    char *pending = nullptr;
+    const long pendingBytes = BIO_get_mem_data(outgoing, &pending);
+    long start = 0;
+    long end = 0;
+    while (end < pendingBytes) {
+        long recordSize = pendingBytes - end;
+        if (recordSize >= RecordHeaderSize) {
+            const uchar *header = reinterpret_cast<const uchar *>(pending + end);
+            recordSize = qMin<long>(recordSize, RecordHeaderSize + ((header[11] << 8) | header[12]));
+        }
+        if (end > start && end - start + recordSize > mtu) {
+            if (!sendDatagram(pending + start, static_cast<qint32>(end - start))) {
+                return false;
+            }
+            start = end;
+        }
+        end += recordSize;
+    }
+    if (end > start && !sendDatagram(pending + start, static_cast<qint32>(end - start))) {
+        return false;
+    }
+    (void) BIO_reset(outgoing);
+    return true;
+}
+
+
+// receives one datagram into the incoming bio. the timer of dtls runs while waiting, it writes the last flight of
+// handshake to the outgoing bio again if the peer does not answer in time.
+bool DtlsSocketPrivate::pumpIncoming()
+{
+    while (true) {
+        timeval timeout;
+        if (DTLSv1_get_timeout(ssl.data(), &timeout) == 1) {
+            const qint64 msecs = static_cast<qint64>(timeout.tv_sec) * 1000 + (timeout.tv_usec + 999) / 1000;
+            bool readable = false;
+            if (msecs > 0) {
+                Poll poll;
+                poll.add(rawSocket.data(), EventLoopCoroutine::Read);
+                readable = poll.wait(static_cast<float>(msecs) / 1000) != nullptr;
+            }
+            if (!readable) {
+                // fails if the flight is sent too many times.
+                if (DTLSv1_handle_timeout(ssl.data()) < 0 || !pumpOutgoing()) {
+                    return false;
+                }
+                continue;
+            }
+        }
+        const qint32 received = recvDatagram();
+        if (received < 0) {
+            return false;
+        }
+        if (received == 0) {
+            continue;
+        }
+        return BIO_write(SSL_get_rbio(ssl.data()), incomingBuffer.constData(), received) == received;
+    }
+}
+
+
+bool DtlsSocketPrivate::sendDatagram(const char *data, qint32 size)
+{
+    const qint32 sent = connected ? rawSocket->send(data, size) : rawSocket->sendto(data, size, peer);
+    return sent == size;
+}
+
+
+// returns 0 for the empty datagrams and the ones not sent by peer, they are dropped.
+qint32 DtlsSocketPrivate::recvDatagram()
+{
+    qint32 received;
+    if (connected) {
+        received = rawSocket->recv(incomingBuffer.data(), incomingBuffer.size());
+    } else {
+        Endpoint from;
+        received = rawSocket->recvfrom(incomingBuffer.data(), incomingBuffer.size(), &from);
+        if (received > 0 && from != peer) {
+            return 0;
+        }
+    }
+    if (received == 0 && !rawSocket->isValid()) {
+        return -1;
+    }
+    return received;
+}
+
+
+void DtlsSocketPrivate::close()
+{
+    if (!ssl.isNull()) {
+        if (SSL_is_init_finished(ssl.data())) {
+            if (!asServer) {
+                SslConfigurationPrivate::saveSession(config, sessionKey, ssl.data());
+            }
+            // the close_notify is sent once, the peer may not get it.
+            SSL_shutdown(ssl.data());
+            (void) pumpOutgoing();
+        }
+        ssl.reset();
+    }
+    ctx.reset();
+    if (!rawSocket.isNull()) {
+        rawSocket->close();
+    }
+}
+
+
+DtlsSocket::DtlsSocket(QSharedPointer<Socket> rawSocket, const SslConfiguration &config)
+    :d_ptr(new DtlsSocketPrivate(rawSocket, config))
+{
+}
+
+
+DtlsSocket::~DtlsSocket()
+{
+    delete d_ptr;
+}
+
+
+bool DtlsSocket::handshake(bool asServer, const QString &verificationPeerName)
+{
+    Q_D(DtlsSocket);
+    if (!d->ssl.isNull() || d->rawSocket.isNull() || !d->rawSocket->isValid()
+            || d->rawSocket->type() != Socket::UdpSocket) {
+        return false;
+    }
+    return d->handshake(asServer, verificationPeerName);
+}
+
+
+void DtlsSocket::setMtu(quint16 mtu)
+{
+    Q_D(DtlsSocket);
+    d->mtu = mtu;
+}
+
+
+quint16 DtlsSocket::mtu() const
+{
+    Q_D(const DtlsSocket);
+    return d->mtu;
+}
+
+
+qint32 DtlsSocket::send(const char *data, qint32 size)
+{
+    Q_D(DtlsSocket);
+    if (d->ssl.isNull() || size < 0 || size > DtlsSocketPrivate::MaxPlainTextSize) {
+        return -1;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    // the memory bio takes all, so it never blocks.
+    const int result = SSL_write(d->ssl.data(), data, size);
+    if (result <= 0 || !d->pumpOutgoing()) {
+        return -1;
+    }
+    return result;
+}
+
+
+qint32 DtlsSocket::send(const QByteArray &data)
+{
+    return send(data.constData(), data.size());
+}
+
+
+qint32 DtlsSocket::recv(char *data, qint32 size)
+{
+    Q_D(DtlsSocket);
+    if (d->ssl.isNull()) {
+        return -1;
+    }
+    while (true) {
+        const int result = SSL_read(d->ssl.data(), data, size);
+        if (result > 0) {
+            return result;
+        }
+        const int err = SSL_get_error(d->ssl.data(), result);
+        if (err == SSL_ERROR_ZERO_RETURN) {
+            return 0;
+        }
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+            return -1;
+        }
+        // the handshake messages sent again by peer are answered while reading.
+        if (!d->pumpOutgoing() || (err == SSL_ERROR_WANT_READ && !d->pumpIncoming())) {
+            return -1;
+        }
+    }
+}
+
+
+QByteArray DtlsSocket::recv(qint32 size)
+{
+    QByteArray buf(size, Qt::Uninitialized);
+    const qint32 bs = recv(buf.data(), buf.size());
+    if (bs <= 0) {
+        return QByteArray();
+    }
+    buf.resize(bs);
+    return buf;
+}
+
+
+bool DtlsSocket::close()
+{
+    Q_D(DtlsSocket);
+    d->close();
+    return true;
+}
+
+
+bool DtlsSocket::isValid() const
+{
+    Q_D(const DtlsSocket);
+    return !d->ssl.isNull() && d->rawSocket->isValid();
+}
+
+
+bool DtlsSocket::isResumed() const
+{
+    Q_D(const DtlsSocket);
+    return !d->ssl.isNull() && SSL_session_reused(d->ssl.data());
+}
+
+
+QHostAddress DtlsSocket::peerAddress() const
+{
+    Q_D(const DtlsSocket);
+    return d->peer.hostAddress();
+}
+
+
+quint16 DtlsSocket::peerPort() const
+{
+    Q_D(const DtlsSocket);
+    return d->peer.port;
+}
+
+
+Certificate DtlsSocket::peerCertificate() const
+{
+    Q_D(const DtlsSocket);
+    Certificate cert;
+    if (!d->ssl.isNull()) {
+        X509 *x = SSL_get_peer_certificate(d->ssl.data());
+        if (x) {
+            openssl_setCertificate(&cert, x);
+        }
+    }
+    return cert;
+}
+
+
+SslCipher DtlsSocket::cipher() const
+{
+    Q_D(const DtlsSocket);
+    if (d->ssl.isNull()) {
+        return SslCipher();
+    }
+    return SslCipherPrivate::from_SSL_CIPHER(SSL_get_current_cipher(d->ssl.data()));
+}
+
+
+QList<SslError> DtlsSocket::sslErrors() const
+{
+    Q_D(const DtlsSocket);
+    return d->errors;
+}
+
+
+QSharedPointer<Socket> DtlsSocket::rawSocket() const
+{
+    Q_D(const DtlsSocket);
+    return d->rawSocket;
+}
+
+
 QTNETWORKNG_NAMESPACE_END
@@ -0,0 +1,213 @@
+#include "../include/private/timerwheel_p.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+
+TimerWheel::TimerWheel(quint64 now)
+    :current(now), count(0)
+{
+    for (int level = 0; level < Levels; ++level) {
+        for (int i = 0; i < Slots; ++i) {
+            initList(&slots[level][i]);
+        }
+    }
+    initList(&expired);
+}
+
+
+TimerWheel::~TimerWheel()
+{
+    // the nodes are owned by watchers, just detach them.
+    for (int level = 0; level < Levels; ++level) {
+        for (int i = 0; i < Slots; ++i) {
+            while (!isEmptyList(&slots[level][i])) {
+                unlink(slots[level][i].next);
+            }
+        }
+    }
+    while (!isEmptyList(&expired)) {
+        unlink(expired.next);
+    }
+}
+
+
+void TimerWheel::initList(TimerWheelNode *head)
+{
+    head->prev = head;
+    head->next = head;
+    head->expiry = 0;
+}
+
+
+void TimerWheel::append(TimerWheelNode *head, TimerWheelNode *node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+
+void TimerWheel::unlink(TimerWheelNode *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = nullptr;
+    node->next = nullptr;
+}
+
+
+void TimerWheel::place(TimerWheelNode *node)
+{
+    if (node->expiry <= current) {
+        append(&expired, node);
+        return;
+    }
+    quint64 delta = node->expiry - current;
+    for (int level = 0; level < Levels; ++level) {
+        const int shift = SlotBits * (level + 1);
+        if (delta < (static_cast<quint64>(1) << shift)) {
+            int index = static_cast<int>((node->expiry >> (SlotBits * level)) & SlotMask);
+            append(&slots[level][index], node);
+            return;
+        }
+    }
+    // too far away, park it in the last slot of top level, it is placed again after cascading.
+    const int shift = SlotBits * (Levels - 1);
+    quint64 farthest = current + (static_cast<quint64>(1) << (SlotBits * Levels)) - 1;
+    int index = static_cast<int>((farthest >> shift) & SlotMask);
+    append(&slots[Levels - 1][index], node);
+}
+
+
+void TimerWheel::insert(TimerWheelNode *node, quint64 expiry)
+{
+    if (node->isLinked()) {
+        remove(node);
+    }
+    node->expiry = expiry;
+    place(node);
+    ++count;
+}
+
+
+void TimerWheel::remove(TimerWheelNode *node)
+{
+    if (!node->isLinked()) {
+        return;
+    }
+    unlink(node);
+    --count;
+}
+
+
+void TimerWheel::cascade(int level, int index)
+{
+    TimerWheelNode *head = &slots[level][index];
+    if (isEmptyList(head)) {
+        return;
+    }
+    TimerWheelNode list;
+    initList(&list);
+    // move the whole slot out, place() may append nodes to the same slot again.
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    initList(head);
+    while (!isEmptyList(&list)) {
+        TimerWheelNode *node = list.next;
+        unlink(node);
+        place(node);
+    }
+}
+
+
+void TimerWheel::advance(quint64 now)
+{
+    if (count == 0) {
+        if (now > current) {
+            current = now;
+        }
+        return;
+    }
+    while (current < now) {
+        // jump over the empty slots, or a long idle costs a step per tick.
+        const qint64 next = nextOccupied();
+        if (next < 0 || static_cast<quint64>(next) > now) {
+            current = now;
+            break;
+        }
+        current = static_cast<quint64>(next);
+        int index = static_cast<int>(current & SlotMask);
+        if (index == 0) {
+            for (int level = 1; level < Levels; ++level) {
+                int levelIndex = static_cast<int>((current >> (SlotBits * level)) & SlotMask);
+                cascade(level, levelIndex);
+                if (levelIndex != 0) {
+                    break;
+                }
+            }
+        }
+        TimerWheelNode *head = &slots[0][index];
+        while (!isEmptyList(head)) {
+            TimerWheelNode *node = head->next;
+            unlink(node);
+            append(&expired, node);
+        }
+    }
+}
+
+
+TimerWheelNode *TimerWheel::takeExpired()
+{
+    if (isEmptyList(&expired)) {
+        return nullptr;
+    }
+    TimerWheelNode *node = expired.next;
+    unlink(node);
+    --count;
+    return node;
+}
+
+
+qint64 TimerWheel::nextExpiry() const
+{
+    if (count == 0) {
+        return -1;
+    }
+    if (!isEmptyList(&expired)) {
+        return static_cast<qint64>(current);
+    }
+    return nextOccupied();
+}
+
+
+// the tick of the nearest level 0 slot, or the cascading of a higher level slot, which has timers.
+qint64 TimerWheel::nextOccupied() const
+{
+    qint64 nearest = -1;
+    for (quint64 k = 1; k < Slots; ++k) {
+        if (!isEmptyList(&slots[0][(current + k) & SlotMask])) {
+            nearest = static_cast<qint64>(current + k);
+            break;
+        }
+    }
+    // the timers of higher levels are not exact, wake up at the time of cascading and check again.
+    for (int level = 1; level < Levels; ++level) {
+        const int shift = SlotBits * level;
+        quint64 base = current >> shift;
+        for (quint64 k = 1; k <= Slots; ++k) {
+            if (!isEmptyList(&slots[level][(base + k) & SlotMask])) {
+                qint64 t = static_cast<qint64>((base + k) << shift);
+                if (nearest < 0 || t < nearest) {
+                    nearest = t;
+                }
+                break;
+            }
+        }
+    }
+    return nearest;
+}
+
+QTNETWORKNG_NAMESPACE_END
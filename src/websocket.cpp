@@ -0,0 +1,948 @@
+#include <string.h>
+#include <QtCore/qendian.h>
+#include <QtCore/qcryptographichash.h>
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+#include <QtCore/qrandom.h>
+#endif
+#ifdef QTNG_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define QTNG_WEBSOCKET_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define QTNG_WEBSOCKET_NEON
+#endif
+#include "../include/websocket.h"
+#include "../include/http.h"
+#include "../include/locks.h"
+#include "../include/coroutine_utils.h"
+
+QTNETWORKNG_NAMESPACE_BEGIN
+
+static const qint32 ReceivingBufferSize = 1024 * 64;
+static const quint32 SendingBatchSize = 64;
+
+enum Opcode {
+    ContinuationFrame = 0x0,
+    TextFrame = 0x1,
+    BinaryFrame = 0x2,
+    CloseFrame = 0x8,
+    PingFrame = 0x9,
+    PongFrame = 0xa,
+};
+
+
+static quint32 randomMask()
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+    return QRandomGenerator::global()->generate();
+#else
+    return static_cast<quint32>(qrand()) ^ (static_cast<quint32>(qrand()) << 16);
+#endif
+}
+
+
+// xors data with the key, offset is the position of data in the payload. the blocks of 16 bytes are done
+// by SSE2 or NEON, the rest by words.
+static void applyMask(char *data, qint32 size, const uchar *key, qint32 offset = 0)
+{
+    uchar rotated[4];
+    for (int i = 0; i < 4; ++i) {
+        rotated[i] = key[(offset + i) & 3];
+    }
+    quint32 pattern32;
+    memcpy(&pattern32, rotated, 4);
+    qint32 i = 0;
+#if defined(QTNG_WEBSOCKET_SSE2)
+    const __m128i pattern128 = _mm_set1_epi32(static_cast<int>(pattern32));
+    for (; i + 16 <= size; i += 16) {
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(data + i), _mm_xor_si128(block, pattern128));
+    }
+#elif defined(QTNG_WEBSOCKET_NEON)
+    const uint8x16_t pattern128 = vreinterpretq_u8_u32(vdupq_n_u32(pattern32));
+    for (; i + 16 <= size; i += 16) {
+        const uint8x16_t block = vld1q_u8(reinterpret_cast<const uint8_t *>(data + i));
+        vst1q_u8(reinterpret_cast<uint8_t *>(data + i), veorq_u8(block, pattern128));
+    }
+#endif
+    const quint64 pattern64 = (static_cast<quint64>(pattern32) << 32) | pattern32;
+    for (; i + 8 <= size; i += 8) {
+        quint64 word;
+        memcpy(&word, data + i, 8);
+        word ^= pattern64;
+        memcpy(data + i, &word, 8);
+    }
+    for (; i < size; ++i) {
+        data[i] = static_cast<char>(data[i] ^ rotated[i & 3]);
+    }
+}
+
+
+// RFC 3629, the overlong forms and the surrogates are invalid.
+static bool isValidUtf8(const char *data, qint32 size)
+{
+    const uchar *s = reinterpret_cast<const uchar *>(data);
+    qint32 i = 0;
+    while (i < size) {
+        // the ascii goes by words.
+        while (i + 8 <= size) {
+            quint64 word;
+            memcpy(&word, s + i, 8);
+            if (word & Q_UINT64_C(0x8080808080808080)) {
+                break;
+            }
+            i += 8;
+        }
+        if (i >= size) {
+            break;
+        }
+        const uchar c = s[i];
+        if (c < 0x80) {
+            ++i;
+            continue;
+        }
+        int n;
+        uchar low = 0x80, high = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) {
+            n = 1;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            n = 2;
+            if (c == 0xe0) {
+                low = 0xa0;
+            } else if (c == 0xed) {
+                high = 0x9f;
+            }
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            n = 3;
+            if (c == 0xf0) {
+                low = 0x90;
+            } else if (c == 0xf4) {
+                high = 0x8f;
+            }
+        } else {
+            return false;
+        }
+        if (i + n >= size) {
+            return false;
+        }
+        if (s[i + 1] < low || s[i + 1] > high) {
+            return false;
+        }
+        for (int j = 2; j <= n; ++j) {
+            if ((s[i + j] & 0xc0) != 0x80) {
+                return false;
+            }
+        }
+        i += n + 1;
+    }
+    return true;
+}
+
+
+static QByteArray frameHeader(quint8 firstByte, qint32 size, const uchar *key)
+{
+    char header[14];
+    int headerSize = 2;
+    header[0] = static_cast<char>(firstByte);
+    const char maskBit = key ? static_cast<char>(0x80) : 0;
+    if (size < 126) {
+        header[1] = static_cast<char>(maskBit | size);
+    } else if (size <= 0xffff) {
+        header[1] = static_cast<char>(maskBit | 126);
+        qToBigEndian<quint16>(static_cast<quint16>(size), reinterpret_cast<uchar *>(header + 2));
+        headerSize += 2;
+    } else {
+        header[1] = static_cast<char>(maskBit | 127);
+        qToBigEndian<quint64>(static_cast<quint64>(size), reinterpret_cast<uchar *>(header + 2));
+        headerSize += 8;
+    }
+    if (key) {
+        memcpy(header + headerSize, key, 4);
+        headerSize += 4;
+    }
+    return QByteArray(header, headerSize);
+}
+
+
+struct DeflateParameters
+{
+    DeflateParameters()
+        :serverMaxWindowBits(15), clientMaxWindowBits(15), serverNoContextTakeover(false),
+          clientNoContextTakeover(false) {}
+    int serverMaxWindowBits;
+    int clientMaxWindowBits;
+    bool serverNoContextTakeover;
+    bool clientNoContextTakeover;
+};
+
+
+// an offer or the reply of permessage-deflate, such as "permessage-deflate; client_max_window_bits=10".
+static bool parseDeflateParameters(const QByteArray &extension, DeflateParameters *params)
+{
+    const QList<QByteArray> &parts = extension.split(';');
+    if (parts.first().trimmed().toLower() != "permessage-deflate") {
+        return false;
+    }
+    for (int i = 1; i < parts.size(); ++i) {
+        const QByteArray &part = parts.at(i).trimmed();
+        const int eq = part.indexOf('=');
+        const QByteArray &name = (eq < 0 ? part : part.left(eq)).trimmed().toLower();
+        QByteArray value = eq < 0 ? QByteArray() : part.mid(eq + 1).trimmed();
+        if (value.size() >= 2 && value.startsWith('"') && value.endsWith('"')) {
+            value = value.mid(1, value.size() - 2);
+        }
+        if (name == "server_no_context_takeover" && eq < 0) {
+            params->serverNoContextTakeover = true;
+        } else if (name == "client_no_context_takeover" && eq < 0) {
+            params->clientNoContextTakeover = true;
+        } else if (name == "server_max_window_bits" || name == "client_max_window_bits") {
+            int bits = 15;
+            if (eq >= 0) {
+                bool ok;
+                bits = value.toInt(&ok);
+                if (!ok || bits < 8 || bits > 15) {
+                    return false;
+                }
+            } else if (name == "server_max_window_bits") {
+                // only client_max_window_bits may be offered without a value.
+                return false;
+            }
+            if (name == "server_max_window_bits") {
+                params->serverMaxWindowBits = bits;
+            } else {
+                params->clientMaxWindowBits = bits;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+struct WebSocketMessage
+{
+    WebSocketMessage()
+        :type(-1) {}
+    WebSocketMessage(const QByteArray &data, int type)
+        :data(data), type(type) {}
+    QByteArray data;
+    int type;       // -1 ends the receiving.
+};
+
+
+class WebSocketPrivate
+{
+public:
+    WebSocketPrivate(QSharedPointer<SocketLike> connection, bool isServer, const QByteArray &extensions,
+                     const WebSocketConfiguration &config, const QByteArray &readBytes);
+    ~WebSocketPrivate();
+public:
+    void doReceive();
+    void doSend();
+    bool fill(qint32 size);
+    bool readPayload(qint32 size, const uchar *key, QByteArray *payload);
+    bool handleControl(quint8 opcode, const QByteArray &payload);
+    bool sendFrame(quint8 opcode, const QByteArray &payload, bool compressed = false);
+    bool sendClose(int code, const QString &reason);
+    // sends the close frame, then the connection is closed after it is sent.
+    void fail(int code, const QString &reason = QString());
+    void abort();
+    void setupDeflate(const QByteArray &extensions);
+    bool compress(const QByteArray &message, QByteArray *compressed);
+    bool decompress(QByteArray *message);
+public:
+    QSharedPointer<SocketLike> connection;
+    WebSocketConfiguration config;
+    CoroutineGroup *operations;
+    Queue<QByteArray> sendingQueue;             // the frames, a null one closes the connection after sending.
+    Queue<WebSocketMessage> receivingQueue;
+    Event writable;                             // set while the pending bytes are less than maxPendingBytes.
+    Event peerClosed;                           // the close frame of peer is received, or the connection is broken.
+    QByteArray receivingBuffer;                 // the bytes read are in [receivingBegin, receivingEnd).
+    qint32 receivingBegin;
+    qint32 receivingEnd;
+    qint32 pendingBytes;
+    int closeCode;
+    QString closeReason;
+    int ownWindowBits;
+    bool isServer;
+    bool closeSent;
+    bool closeReceived;
+    bool broken;
+    bool compressed;
+    bool ownNoContextTakeover;
+    bool peerNoContextTakeover;
+#ifdef QTNG_HAVE_ZLIB
+    z_stream deflater;
+    z_stream inflater;
+#endif
+};
+
+
+WebSocketPrivate::WebSocketPrivate(QSharedPointer<SocketLike> connection, bool isServer, const QByteArray &extensions,
+                                   const WebSocketConfiguration &config, const QByteArray &readBytes)
+    :connection(connection), config(config), operations(new CoroutineGroup()), receivingQueue(config.receivingQueueSize),
+      receivingBuffer(qMax(ReceivingBufferSize, readBytes.size()), Qt::Uninitialized), receivingBegin(0),
+      receivingEnd(readBytes.size()), pendingBytes(0), closeCode(0), ownWindowBits(15), isServer(isServer),
+      closeSent(false), closeReceived(false), broken(false), compressed(false), ownNoContextTakeover(false),
+      peerNoContextTakeover(false)
+{
+    memcpy(receivingBuffer.data(), readBytes.constData(), static_cast<size_t>(readBytes.size()));
+    writable.set();
+    setupDeflate(extensions);
+    connection->setOption(Socket::LowDelayOption, true);
+    operations->spawnWithName(QStringLiteral("receiving"), [this] {
+        this->doReceive();
+    });
+    operations->spawnWithName(QStringLiteral("sending"), [this] {
+        this->doSend();
+    });
+}
+
+
+WebSocketPrivate::~WebSocketPrivate()
+{
+    abort();
+    delete operations;
+#ifdef QTNG_HAVE_ZLIB
+    if (compressed) {
+        deflateEnd(&deflater);
+        inflateEnd(&inflater);
+    }
+#endif
+}
+
+
+void WebSocketPrivate::setupDeflate(const QByteArray &extensions)
+{
+#ifdef QTNG_HAVE_ZLIB
+    DeflateParameters params;
+    if (extensions.isEmpty() || !config.deflate || !parseDeflateParameters(extensions, &params)) {
+        return;
+    }
+    ownWindowBits = isServer ? params.serverMaxWindowBits : params.clientMaxWindowBits;
+    ownNoContextTakeover = isServer ? params.serverNoContextTakeover : params.clientNoContextTakeover;
+    peerNoContextTakeover = isServer ? params.clientNoContextTakeover : params.serverNoContextTakeover;
+    // the raw deflate of zlib does not take the window of 256 bytes.
+    if (ownWindowBits < 9) {
+        return;
+    }
+    memset(&deflater, 0, sizeof(deflater));
+    memset(&inflater, 0, sizeof(inflater));
+    if (deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -ownWindowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return;
+    }
+    // the window of peer is not larger than 15 bits.
+    if (inflateInit2(&inflater, -15) != Z_OK) {
+        deflateEnd(&deflater);
+        return;
+    }
+    compressed = true;
+#else
+    Q_UNUSED(extensions);
+#endif
+}
+
+
+bool WebSocketPrivate::compress(const QByteArray &message, QByteArray *result)
+{
+#ifdef QTNG_HAVE_ZLIB
+    QByteArray &out = *result;
+    out.resize(message.size() / 2 + 64);
+    qint32 produced = 0;
+    deflater.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(message.constData()));
+    deflater.avail_in = static_cast<uInt>(message.size());
+    do {
+        if (produced == out.size()) {
+            out.resize(out.size() * 2);
+        }
+        deflater.next_out = reinterpret_cast<Bytef *>(out.data() + produced);
+        deflater.avail_out = static_cast<uInt>(out.size() - produced);
+        int rc = ::deflate(&deflater, Z_SYNC_FLUSH);
+        if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            return false;
+        }
+        produced = out.size() - static_cast<qint32>(deflater.avail_out);
+    } while (deflater.avail_out == 0);
+    // the empty stored block of sync flush is removed as RFC 7692 7.2.1
+    if (produced >= 4 && memcmp(out.constData() + produced - 4, "\x00\x00\xff\xff", 4) == 0) {
+        produced -= 4;
+    }
+    out.resize(produced);
+    if (ownNoContextTakeover) {
+        deflateReset(&deflater);
+    }
+    return true;
+#else
+    Q_UNUSED(message);
+    Q_UNUSED(result);
+    return false;
+#endif
+}
+
+
+bool WebSocketPrivate::decompress(QByteArray *message)
+{
+#ifdef QTNG_HAVE_ZLIB
+    message->append("\x00\x00\xff\xff", 4);
+    QByteArray out(qMin(qMax(1024, message->size() * 4), config.maxMessageSize + 1), Qt::Uninitialized);
+    qint32 produced = 0;
+    inflater.next_in = reinterpret_cast<Bytef *>(message->data());
+    inflater.avail_in = static_cast<uInt>(message->size());
+    int rc = Z_OK;
+    while (inflater.avail_in > 0) {
+        if (produced == out.size()) {
+            if (produced > config.maxMessageSize) {
+                fail(WebSocket::MessageTooBig);
+                return false;
+            }
+            out.resize(static_cast<int>(qMin<qint64>(static_cast<qint64>(out.size()) * 2, config.maxMessageSize + 1)));
+        }
+        inflater.next_out = reinterpret_cast<Bytef *>(out.data() + produced);
+        inflater.avail_out = static_cast<uInt>(out.size() - produced);
+        rc = ::inflate(&inflater, Z_SYNC_FLUSH);
+        produced = out.size() - static_cast<qint32>(inflater.avail_out);
+        if (rc == Z_STREAM_END) {
+            break;
+        }
+        if (rc != Z_OK && !(rc == Z_BUF_ERROR && inflater.avail_out == 0)) {
+            fail(WebSocket::InvalidPayload, QStringLiteral("invalid deflate data"));
+            return false;
+        }
+    }
+    if (produced > config.maxMessageSize) {
+        fail(WebSocket::MessageTooBig);
+        return false;
+    }
+    // a final block ends the stream, the next message starts a new one.
+    if (peerNoContextTakeover || rc == Z_STREAM_END) {
+        inflateReset(&inflater);
+    }
+    out.resize(produced);
+    *message = out;
+    return true;
+#else
+    Q_UNUSED(message);
+    return false;
+#endif
+}
+
+
+// makes size bytes available from receivingBegin.
+bool WebSocketPrivate::fill(qint32 size)
+{
+    if (receivingBegin == receivingEnd) {
+        receivingBegin = receivingEnd = 0;
+    }
+    while (receivingEnd - receivingBegin < size) {
+        if (receivingBuffer.size() - receivingBegin < size) {
+            memmove(receivingBuffer.data(), receivingBuffer.constData() + receivingBegin,
+                    static_cast<size_t>(receivingEnd - receivingBegin));
+            receivingEnd -= receivingBegin;
+            receivingBegin = 0;
+        }
+        qint32 bs = connection->recv(receivingBuffer.data() + receivingEnd, receivingBuffer.size() - receivingEnd);
+        if (bs <= 0) {
+            return false;
+        }
+        receivingEnd += bs;
+    }
+    return true;
+}
+
+
+// the payload in the buffer is unmasked in place. the rest of a large one is read into the payload directly.
+bool WebSocketPrivate::readPayload(qint32 size, const uchar *key, QByteArray *payload)
+{
+    const qint32 available = receivingEnd - receivingBegin;
+    if (size <= available) {
+        char *data = receivingBuffer.data() + receivingBegin;
+        if (key) {
+            applyMask(data, size, key);
+        }
+        *payload = QByteArray(data, size);
+        receivingBegin += size;
+        return true;
+    }
+    *payload = QByteArray(size, Qt::Uninitialized);
+    char *data = payload->data();
+    memcpy(data, receivingBuffer.constData() + receivingBegin, static_cast<size_t>(available));
+    receivingBegin = receivingEnd = 0;
+    qint32 got = available;
+    while (got < size) {
+        qint32 bs = connection->recv(data + got, size - got);
+        if (bs <= 0) {
+            return false;
+        }
+        got += bs;
+    }
+    if (key) {
+        applyMask(data, size, key);
+    }
+    return true;
+}
+
+
+void WebSocketPrivate::doReceive()
+{
+    QByteArray message;
+    int messageType = 0;
+    bool messageCompressed = false;
+    while (true) {
+        if (!fill(2)) {
+            return abort();
+        }
+        const uchar *header = reinterpret_cast<const uchar *>(receivingBuffer.constData() + receivingBegin);
+        const bool fin = header[0] & 0x80;
+        const bool rsv1 = header[0] & 0x40;
+        const quint8 opcode = header[0] & 0x0f;
+        const bool masked = header[1] & 0x80;
+        const quint8 shortSize = header[1] & 0x7f;
+        const qint32 headerSize = 2 + (shortSize == 126 ? 2 : (shortSize == 127 ? 8 : 0)) + (masked ? 4 : 0);
+        if ((header[0] & 0x30) || (rsv1 && (!compressed || opcode == ContinuationFrame || opcode >= CloseFrame))) {
+            return fail(WebSocket::ProtocolError, QStringLiteral("reserved bits are set"));
+        }
+        // the client masks every frame, and the server does not.
+        if (masked != isServer) {
+            return fail(WebSocket::ProtocolError, QStringLiteral("wrong masking"));
+        }
+        if (!fill(headerSize)) {
+            return abort();
+        }
+        header = reinterpret_cast<const uchar *>(receivingBuffer.constData() + receivingBegin);
+        quint64 size = shortSize;
+        if (shortSize == 126) {
+            size = qFromBigEndian<quint16>(header + 2);
+        } else if (shortSize == 127) {
+            size = qFromBigEndian<quint64>(header + 2);
+        }
+        uchar key[4];
+        if (masked) {
+            memcpy(key, header + headerSize - 4, 4);
+        }
+        if (opcode >= CloseFrame) {
+            if (opcode > PongFrame || !fin || size > 125) {
+                return fail(WebSocket::ProtocolError, QStringLiteral("invalid control frame"));
+            }
+        } else if (opcode > BinaryFrame) {
+            return fail(WebSocket::ProtocolError, QStringLiteral("unknown opcode"));
+        } else if ((opcode == ContinuationFrame) != (messageType != 0)) {
+            return fail(WebSocket::ProtocolError, QStringLiteral("unexpected continuation"));
+        } else if (size > static_cast<quint64>(config.maxMessageSize - message.size())) {
+            return fail(WebSocket::MessageTooBig);
+        }
+        receivingBegin += headerSize;
+        QByteArray payload;
+        if (!readPayload(static_cast<qint32>(size), masked ? key : nullptr, &payload)) {
+            return abort();
+        }
+        if (opcode >= CloseFrame) {
+            if (!handleControl(opcode, payload)) {
+                return;
+            }
+            continue;
+        }
+        if (opcode != ContinuationFrame) {
+            messageType = opcode;
+            messageCompressed = rsv1;
+        }
+        if (message.isEmpty()) {
+            message = payload;
+        } else {
+            message.append(payload);
+        }
+        if (!fin) {
+            continue;
+        }
+        if (messageCompressed && !decompress(&message)) {
+            return;
+        }
+        if (messageType == TextFrame && !isValidUtf8(message.constData(), message.size())) {
+            return fail(WebSocket::InvalidPayload, QStringLiteral("invalid utf-8 text"));
+        }
+        // waits if the messages are not received, so the connection is not read.
+        receivingQueue.put(WebSocketMessage(message, messageType));
+        message.clear();
+        messageType = 0;
+    }
+}
+
+
+bool WebSocketPrivate::handleControl(quint8 opcode, const QByteArray &payload)
+{
+    if (opcode == PingFrame) {
+        if (!closeSent) {
+            sendFrame(PongFrame, payload);
+        }
+        return true;
+    } else if (opcode == PongFrame) {
+        return true;
+    }
+    // the close frame.
+    int code = WebSocket::NoStatusReceived;
+    QString reason;
+    if (payload.size() == 1) {
+        fail(WebSocket::ProtocolError, QStringLiteral("invalid close frame"));
+        return false;
+    } else if (payload.size() >= 2) {
+        code = qFromBigEndian<quint16>(reinterpret_cast<const uchar *>(payload.constData()));
+        const bool validCode = (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) || (code >= 3000 && code <= 4999);
+        if (!validCode) {
+            fail(WebSocket::ProtocolError, QStringLiteral("invalid close code"));
+            return false;
+        }
+        if (!isValidUtf8(payload.constData() + 2, payload.size() - 2)) {
+            fail(WebSocket::InvalidPayload, QStringLiteral("invalid close reason"));
+            return false;
+        }
+        reason = QString::fromUtf8(payload.constData() + 2, payload.size() - 2);
+    }
+    closeCode = code;
+    closeReason = reason;
+    closeReceived = true;
+    // the close frame of peer is echoed, and the connection is closed after it is sent.
+    if (!closeSent) {
+        sendClose(code == WebSocket::NoStatusReceived ? 0 : code, QString());
+        sendingQueue.put(QByteArray());
+    }
+    peerClosed.set();
+    receivingQueue.putForcedly(WebSocketMessage());
+    return false;
+}
+
+
+bool WebSocketPrivate::sendFrame(quint8 opcode, const QByteArray &payload, bool compressed)
+{
+    if (broken) {
+        return false;
+    }
+    const quint8 firstByte = static_cast<quint8>(0x80 | (compressed ? 0x40 : 0) | opcode);
+    const qint32 size = payload.size();
+    if (isServer) {
+        // the payload is sent as it is, with the header by sendallv().
+        sendingQueue.put(frameHeader(firstByte, size, nullptr));
+        if (size > 0) {
+            sendingQueue.put(payload);
+        }
+    } else {
+        const quint32 mask = randomMask();
+        uchar key[4];
+        memcpy(key, &mask, 4);
+        const QByteArray &header = frameHeader(firstByte, size, key);
+        QByteArray frame(header.size() + size, Qt::Uninitialized);
+        memcpy(frame.data(), header.constData(), static_cast<size_t>(header.size()));
+        memcpy(frame.data() + header.size(), payload.constData(), static_cast<size_t>(size));
+        applyMask(frame.data() + header.size(), size, key);
+        sendingQueue.put(frame);
+    }
+    pendingBytes += size + 14;
+    if (pendingBytes >= config.maxPendingBytes) {
+        writable.clear();
+    }
+    return true;
+}
+
+
+bool WebSocketPrivate::sendClose(int code, const QString &reason)
+{
+    closeSent = true;
+    QByteArray payload;
+    if (code > 0) {
+        payload.resize(2);
+        qToBigEndian<quint16>(static_cast<quint16>(code), reinterpret_cast<uchar *>(payload.data()));
+        // a control frame has 125 bytes at most.
+        payload.append(reason.toUtf8().left(123));
+    }
+    return sendFrame(CloseFrame, payload);
+}
+
+
+void WebSocketPrivate::doSend()
+{
+    while (true) {
+        QList<QByteArray> frames = sendingQueue.getMany(SendingBatchSize);
+        bool closing = false;
+        qint32 size = 0;
+        for (int i = 0; i < frames.size(); ++i) {
+            if (frames.at(i).isNull()) {
+                frames = frames.mid(0, i);
+                closing = true;
+                break;
+            }
+            size += frames.at(i).size();
+        }
+        if (!frames.isEmpty() && connection->sendallv(frames) != size) {
+            return abort();
+        }
+        // the headers are counted as 14 bytes by sendFrame().
+        pendingBytes = sendingQueue.isEmpty() ? 0 : qMax(0, pendingBytes - size);
+        if (pendingBytes < config.maxPendingBytes) {
+            writable.set();
+        }
+        if (closing) {
+            return abort();
+        }
+    }
+}
+
+
+void WebSocketPrivate::fail(int code, const QString &reason)
+{
+    if (!closeSent && !broken) {
+        sendClose(code, reason);
+        sendingQueue.put(QByteArray());
+    }
+    if (!closeReceived) {
+        closeCode = code;
+        closeReason = reason;
+    }
+    peerClosed.set();
+    receivingQueue.putForcedly(WebSocketMessage());
+}
+
+
+void WebSocketPrivate::abort()
+{
+    if (broken) {
+        return;
+    }
+    broken = true;
+    if (closeCode == 0) {
+        closeCode = WebSocket::AbnormalClosure;
+    }
+    connection->close();
+    sendingQueue.clear();
+    pendingBytes = 0;
+    writable.set();
+    peerClosed.set();
+    receivingQueue.putForcedly(WebSocketMessage());
+    Coroutine *current = Coroutine::current();
+    if (operations->get(QStringLiteral("receiving")).data() != current) {
+        operations->kill(QStringLiteral("receiving"));
+    }
+    if (operations->get(QStringLiteral("sending")).data() != current) {
+        operations->kill(QStringLiteral("sending"));
+    }
+}
+
+
+WebSocket::WebSocket(QSharedPointer<SocketLike> connection, bool isServer, const QByteArray &extensions,
+                     const WebSocketConfiguration &config, const QByteArray &readBytes)
+    :d_ptr(new WebSocketPrivate(connection, isServer, extensions, config, readBytes))
+{
+}
+
+
+WebSocket::~WebSocket()
+{
+    delete d_ptr;
+}
+
+
+bool WebSocket::receive(QByteArray *message, MessageType *type)
+{
+    Q_D(WebSocket);
+    const WebSocketMessage &received = d->receivingQueue.get();
+    if (received.type < 0) {
+        // left for the next receive().
+        d->receivingQueue.putForcedly(received);
+        return false;
+    }
+    if (message) {
+        *message = received.data;
+    }
+    if (type) {
+        *type = static_cast<MessageType>(received.type);
+    }
+    return true;
+}
+
+
+bool WebSocket::send(const QByteArray &message, MessageType type)
+{
+    Q_D(WebSocket);
+    if (!isOpen() || !d->writable.wait() || !isOpen()) {
+        return false;
+    }
+    if (d->compressed && message.size() >= d->config.deflateThreshold) {
+        QByteArray compressed;
+        if (!d->compress(message, &compressed)) {
+            d->fail(InternalError);
+            return false;
+        }
+        return d->sendFrame(static_cast<quint8>(type), compressed, true);
+    }
+    return d->sendFrame(static_cast<quint8>(type), message);
+}
+
+
+bool WebSocket::ping(const QByteArray &payload)
+{
+    Q_D(WebSocket);
+    if (!isOpen() || payload.size() > 125) {
+        return false;
+    }
+    return d->sendFrame(PingFrame, payload);
+}
+
+
+void WebSocket::close(CloseCode code, const QString &reason, quint32 timeout)
+{
+    Q_D(WebSocket);
+    if (d->broken) {
+        return;
+    }
+    if (!d->closeSent) {
+        d->sendClose(code, reason);
+    }
+    try {
+        Timeout t(timeout, 0); Q_UNUSED(t);
+        d->peerClosed.wait();
+    } catch (TimeoutException &) {
+    }
+    d->abort();
+}
+
+
+bool WebSocket::isOpen() const
+{
+    Q_D(const WebSocket);
+    return !d->broken && !d->closeSent && !d->closeReceived;
+}
+
+
+int WebSocket::closeCode() const
+{
+    Q_D(const WebSocket);
+    return d->closeCode;
+}
+
+
+QString WebSocket::closeReason() const
+{
+    Q_D(const WebSocket);
+    return d->closeReason;
+}
+
+
+qint32 WebSocket::pendingBytes() const
+{
+    Q_D(const WebSocket);
+    return d->pendingBytes;
+}
+
+
+bool WebSocket::isCompressed() const
+{
+    Q_D(const WebSocket);
+    return d->compressed;
+}
+
+
+QSharedPointer<SocketLike> WebSocket::connection() const
+{
+    Q_D(const WebSocket);
+    return d->connection;
+}
+
+
+QByteArray WebSocket::acceptKey(const QByteArray &key)
+{
+    const QByteArray &data = key.trimmed() + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha1).toBase64();
+}
+
+
+QByteArray WebSocket::acceptExtensions(const QByteArray &offers, const WebSocketConfiguration &config)
+{
+#ifdef QTNG_HAVE_ZLIB
+    if (!config.deflate) {
+        return QByteArray();
+    }
+    for (const QByteArray &offer: offers.split(',')) {
+        DeflateParameters params;
+        // the window of 256 bytes is declined, the raw deflate of zlib does not take it.
+        if (!parseDeflateParameters(offer, &params) || params.serverMaxWindowBits < 9) {
+            continue;
+        }
+        QByteArray reply("permessage-deflate");
+        if (params.serverNoContextTakeover) {
+            reply.append("; server_no_context_takeover");
+        }
+        if (params.clientNoContextTakeover) {
+            reply.append("; client_no_context_takeover");
+        }
+        if (params.serverMaxWindowBits < 15) {
+            reply.append("; server_max_window_bits=" + QByteArray::number(params.serverMaxWindowBits));
+        }
+        return reply;
+    }
+#else
+    Q_UNUSED(offers);
+    Q_UNUSED(config);
+#endif
+    return QByteArray();
+}
+
+
+QSharedPointer<WebSocket> WebSocket::connect(HttpSession *session, const QUrl &url, const WebSocketConfiguration &config,
+                                             HttpResponse *response)
+{
+    QUrl httpUrl(url);
+    if (url.scheme() == QStringLiteral("ws")) {
+        httpUrl.setScheme(QStringLiteral("http"));
+    } else if (url.scheme() == QStringLiteral("wss")) {
+        httpUrl.setScheme(QStringLiteral("https"));
+    }
+    QByteArray nonce(16, Qt::Uninitialized);
+    for (int i = 0; i < 16; i += 4) {
+        const quint32 r = randomMask();
+        memcpy(nonce.data() + i, &r, 4);
+    }
+    const QByteArray &key = nonce.toBase64();
+
+    HttpRequest request;
+    request.setMethod(QStringLiteral("GET"));
+    request.setUrl(httpUrl);
+    request.setVersion(Http1_1);
+    request.setStreamResponse(true);
+    request.setCacheLoadControl(HttpRequest::AlwaysNetwork);
+    request.setHeader(QStringLiteral("Connection"), "Upgrade");
+    request.setHeader(QStringLiteral("Upgrade"), "websocket");
+    request.setHeader(QStringLiteral("Sec-WebSocket-Key"), key);
+    request.setHeader(QStringLiteral("Sec-WebSocket-Version"), "13");
+#ifdef QTNG_HAVE_ZLIB
+    if (config.deflate) {
+        request.setHeader(QStringLiteral("Sec-WebSocket-Extensions"), "permessage-deflate; client_max_window_bits");
+    }
+#endif
+    HttpResponse r = session->send(request);
+    if (response) {
+        *response = r;
+    }
+    if (r.statusCode() != 101 || r.header(QStringLiteral("Upgrade")).trimmed().toLower() != "websocket"
+            || r.header(QStringLiteral("Sec-WebSocket-Accept")).trimmed() != acceptKey(key)) {
+        return QSharedPointer<WebSocket>();
+    }
+    // the server must not accept what is not offered.
+    const QByteArray &extensions = r.header(QStringLiteral("Sec-WebSocket-Extensions")).trimmed();
+    if (!extensions.isEmpty()) {
+        DeflateParameters params;
+        if (!config.deflate || !parseDeflateParameters(extensions, &params) || params.clientMaxWindowBits < 9) {
+            return QSharedPointer<WebSocket>();
+        }
+    }
+    QByteArray readBytes;
+    QSharedPointer<SocketLike> stream = r.takeStream(&readBytes);
+    if (stream.isNull()) {
+        return QSharedPointer<WebSocket>();
+    }
+    return QSharedPointer<WebSocket>(new WebSocket(stream, false, extensions, config, readBytes));
+}
+
+
+QTNETWORKNG_NAMESPACE_END
@@ -0,0 +1,100 @@
+#ifndef QTNG_TESTS_ALLOC_COUNTER_H
+#define QTNG_TESTS_ALLOC_COUNTER_H
+
+#include <QtCore/qglobal.h>
+#include <stdlib.h>
+
+// counts the heap allocations of current thread, by replacing malloc() of glibc. operator new and the Qt containers
+// go through it too. it defines malloc(), so include it once per executable, in the tests and benchmarks only.
+//
+//     AllocationScope scope;
+//     session.get(url);
+//     QCOMPARE(scope.allocations(), 0ULL);
+//
+// without glibc, isAvailable() returns false and the scopes count nothing.
+#if defined(__GLIBC__)
+#define QTNG_COUNT_ALLOCATIONS
+
+struct AllocationCounter
+{
+    unsigned long long allocations;
+    unsigned long long bytes;
+};
+
+// the coroutines of one thread share the counter, the other threads such as the dns resolvers are not counted.
+static thread_local AllocationCounter allocationCounter = { 0, 0 };
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size)
+{
+    ++allocationCounter.allocations;
+    allocationCounter.bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    ++allocationCounter.allocations;
+    allocationCounter.bytes += n * size;
+    return __libc_calloc(n, size);
+}
+
+// the growing of containers is counted as an allocation of the new size.
+void *realloc(void *p, size_t size)
+{
+    ++allocationCounter.allocations;
+    allocationCounter.bytes += size;
+    return __libc_realloc(p, size);
+}
+}
+#endif
+
+
+class AllocationScope
+{
+public:
+    AllocationScope() { restart(); }
+    static bool isAvailable()
+    {
+#ifdef QTNG_COUNT_ALLOCATIONS
+        return true;
+#else
+        return false;
+#endif
+    }
+    void restart()
+    {
+#ifdef QTNG_COUNT_ALLOCATIONS
+        startAllocations = allocationCounter.allocations;
+        startBytes = allocationCounter.bytes;
+#else
+        startAllocations = startBytes = 0;
+#endif
+    }
+    // since the scope was created or restarted.
+    unsigned long long allocations() const
+    {
+#ifdef QTNG_COUNT_ALLOCATIONS
+        return allocationCounter.allocations - startAllocations;
+#else
+        return 0;
+#endif
+    }
+    unsigned long long bytes() const
+    {
+#ifdef QTNG_COUNT_ALLOCATIONS
+        return allocationCounter.bytes - startBytes;
+#else
+        return 0;
+#endif
+    }
+private:
+    unsigned long long startAllocations;
+    unsigned long long startBytes;
+};
+
+#endif // QTNG_TESTS_ALLOC_COUNTER_H
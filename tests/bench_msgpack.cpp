@@ -0,0 +1,227 @@
+#include <QtTest>
+#include <QBuffer>
+#include <QElapsedTimer>
+#include "qtnetworkng.h"
+#include "alloc_counter.h"
+
+using namespace qtng;
+
+struct BenchRequest
+{
+    quint32 id;
+    QString method;
+    QList<qint64> arguments;
+    double timeout;
+};
+QTNG_MSGPACK_FIELDS(BenchRequest, id, method, arguments, timeout)
+
+// the corpora: small rpc maps, large arrays of numbers, strings and nested structures.
+static QVariant makeRpcMap(int i)
+{
+    QVariantMap map;
+    map.insert(QStringLiteral("id"), i);
+    map.insert(QStringLiteral("method"), QStringLiteral("get_user"));
+    map.insert(QStringLiteral("arguments"), QVariantList() << i << QStringLiteral("name"));
+    map.insert(QStringLiteral("timeout"), 1.5);
+    return map;
+}
+
+static QVariant makeCorpus(const QString &name)
+{
+    if (name == QStringLiteral("rpc")) {
+        return makeRpcMap(1);
+    } else if (name == QStringLiteral("ints")) {
+        QVariantList list;
+        for (int i = 0; i < 100000; ++i) {
+            list.append(i * 7919 - 500000);
+        }
+        return list;
+    } else if (name == QStringLiteral("doubles")) {
+        QVariantList list;
+        for (int i = 0; i < 100000; ++i) {
+            list.append(i * 0.37);
+        }
+        return list;
+    } else if (name == QStringLiteral("strings")) {
+        QVariantList list;
+        for (int i = 0; i < 10000; ++i) {
+            list.append(QStringLiteral("the quick brown fox jumps over the lazy dog %1").arg(i));
+            list.append(QString::fromUtf8("\xe4\xb8\xad\xe6\x96\x87\xe5\xad\x97\xe7\xac\xa6 %1").arg(i));
+        }
+        return list;
+    } else {
+        QVariantList list;
+        for (int i = 0; i < 1000; ++i) {
+            QVariantMap child;
+            child.insert(QStringLiteral("rpc"), makeRpcMap(i));
+            child.insert(QStringLiteral("tags"), QStringList() << QStringLiteral("a") << QStringLiteral("b"));
+            list.append(child);
+        }
+        return list;
+    }
+}
+
+static QByteArray encode(const QVariant &v)
+{
+    QByteArray bs;
+    MsgPackStream s(&bs, QIODevice::WriteOnly);
+    s << v;
+    return bs;
+}
+
+// runs f once outside of QBENCHMARK, and prints the throughput and allocations of it.
+template<typename F>
+static void report(qint64 bytes, const F &f)
+{
+    AllocationScope scope;
+    QElapsedTimer timer;
+    timer.start();
+    f();
+    const qint64 nsecs = qMax<qint64>(timer.nsecsElapsed(), 1);
+    const unsigned long long allocations = scope.allocations();
+    const double mbps = bytes / 1024.0 / 1024.0 / (nsecs / 1e9);
+    const char *name = QTest::currentDataTag() ? QTest::currentDataTag() : QTest::currentTestFunction();
+    if (AllocationScope::isAvailable()) {
+        qInfo("%s: %.1f MB/s, %llu allocations", name, mbps, allocations);
+    } else {
+        qInfo("%s: %.1f MB/s", name, mbps);
+    }
+}
+
+class BenchMsgPack: public QObject
+{
+    Q_OBJECT
+private slots:
+    void encodeVariant_data();
+    void encodeVariant();
+    void decodeVariant_data();
+    void decodeVariant();
+    void decodeDocument_data();
+    void decodeDocument();
+    void decodeDevice_data();
+    void decodeDevice();
+    void encodeTyped();
+    void decodeTyped();
+};
+
+static void addCorpora()
+{
+    QTest::addColumn<QString>("corpus");
+    QTest::newRow("rpc") << QStringLiteral("rpc");
+    QTest::newRow("ints") << QStringLiteral("ints");
+    QTest::newRow("doubles") << QStringLiteral("doubles");
+    QTest::newRow("strings") << QStringLiteral("strings");
+    QTest::newRow("nested") << QStringLiteral("nested");
+}
+
+void BenchMsgPack::encodeVariant_data()
+{
+    addCorpora();
+}
+
+void BenchMsgPack::encodeVariant()
+{
+    QFETCH(QString, corpus);
+    const QVariant &v = makeCorpus(corpus);
+    const qint64 size = encode(v).size();
+    report(size, [&v] { encode(v); });
+    QBENCHMARK {
+        encode(v);
+    }
+}
+
+void BenchMsgPack::decodeVariant_data()
+{
+    addCorpora();
+}
+
+void BenchMsgPack::decodeVariant()
+{
+    QFETCH(QString, corpus);
+    const QByteArray &bs = encode(makeCorpus(corpus));
+    auto decode = [&bs] {
+        MsgPackStream s(bs);
+        QVariant v;
+        s >> v;
+    };
+    report(bs.size(), decode);
+    QBENCHMARK {
+        decode();
+    }
+}
+
+void BenchMsgPack::decodeDocument_data()
+{
+    addCorpora();
+}
+
+void BenchMsgPack::decodeDocument()
+{
+    QFETCH(QString, corpus);
+    const QByteArray &bs = encode(makeCorpus(corpus));
+    auto decode = [&bs] {
+        MsgPackDocument doc;
+        doc.parse(bs);
+    };
+    report(bs.size(), decode);
+    QBENCHMARK {
+        decode();
+    }
+}
+
+void BenchMsgPack::decodeDevice_data()
+{
+    addCorpora();
+}
+
+void BenchMsgPack::decodeDevice()
+{
+    QFETCH(QString, corpus);
+    QByteArray bs = encode(makeCorpus(corpus));
+    auto decode = [&bs] {
+        QBuffer buf(&bs);
+        buf.open(QIODevice::ReadOnly);
+        MsgPackStream s(&buf);
+        QVariant v;
+        s >> v;
+    };
+    report(bs.size(), decode);
+    QBENCHMARK {
+        decode();
+    }
+}
+
+void BenchMsgPack::encodeTyped()
+{
+    BenchRequest request { 1, QStringLiteral("get_user"), QList<qint64>() << 1 << 2 << 3, 1.5 };
+    auto encodeRequest = [&request] {
+        QByteArray bs;
+        MsgPackStream s(&bs, QIODevice::WriteOnly);
+        s << request;
+        return bs;
+    };
+    report(encodeRequest().size(), encodeRequest);
+    QBENCHMARK {
+        encodeRequest();
+    }
+}
+
+void BenchMsgPack::decodeTyped()
+{
+    BenchRequest request { 1, QStringLiteral("get_user"), QList<qint64>() << 1 << 2 << 3, 1.5 };
+    QByteArray bs;
+    MsgPackStream os(&bs, QIODevice::WriteOnly);
+    os << request;
+    auto decode = [&bs] {
+        MsgPackStream s(bs);
+        BenchRequest r;
+        s >> r;
+    };
+    report(bs.size(), decode);
+    QBENCHMARK {
+        decode();
+    }
+}
+
+QTEST_MAIN(BenchMsgPack)
+#include "bench_msgpack.moc"
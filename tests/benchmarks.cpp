@@ -0,0 +1,650 @@
+#include <QtCore/qcoreapplication.h>
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qjsonarray.h>
+#include <QtCore/qjsondocument.h>
+#include <QtCore/qjsonobject.h>
+#include <QtCore/qprocess.h>
+#include <QtCore/qsysinfo.h>
+#include <stdio.h>
+#include "qtnetworkng.h"
+#include "alloc_counter.h"
+
+using namespace qtng;
+
+// the standard scenarios of the hot paths. prints one json document, so the numbers of releases can be compared.
+// the heap allocations per operation are counted too, and the paths in allocationBudgets fail the run if they
+// allocate more than their budgets.
+//
+//     qtng_benchmarks [--filter name] [--scale 0.1] [--output result.json]
+//
+// the startup scenarios run the benchmark itself as `qtng_benchmarks --first-request url`, which does one request in
+// a fresh process and exits.
+
+static double scale = 1.0;
+
+static int iterations(int n)
+{
+    return qMax(1, static_cast<int>(n * scale));
+}
+
+static QJsonObject result(const QString &name, double value, const QString &unit, qint64 count, qint64 nsecs,
+                          unsigned long long allocations)
+{
+    QJsonObject o;
+    o.insert(QStringLiteral("name"), name);
+    o.insert(QStringLiteral("value"), value);
+    o.insert(QStringLiteral("unit"), unit);
+    o.insert(QStringLiteral("iterations"), static_cast<double>(count));
+    o.insert(QStringLiteral("msecs"), nsecs / 1e6);
+    if (AllocationScope::isAvailable()) {
+        o.insert(QStringLiteral("allocations_per_op"), static_cast<double>(allocations) / qMax<qint64>(count, 1));
+    }
+    return o;
+}
+
+static QJsonObject rate(const QString &name, qint64 count, qint64 nsecs, unsigned long long allocations)
+{
+    return result(name, count / (qMax<qint64>(nsecs, 1) / 1e9), QStringLiteral("ops/s"), count, nsecs, allocations);
+}
+
+// the most allocations per operation of the paths which should not allocate at all, or not more than they do now.
+// a change making them allocate more is a regression.
+struct AllocationBudget
+{
+    const char *name;
+    double allocationsPerOp;
+};
+
+static const AllocationBudget allocationBudgets[] = {
+    { "coroutine_switch", 0.0 },
+};
+
+// as CMakeLists.txt chooses the implementation of coroutine.
+static QString contextBackend()
+{
+#if defined(Q_OS_WIN)
+    return QStringLiteral("fiber");
+#elif defined(Q_OS_MACOS)
+    return QStringLiteral("ucontext");
+#else
+    return QStringLiteral("fcontext");
+#endif
+}
+
+
+class PingCoroutine: public BaseCoroutine
+{
+public:
+    PingCoroutine(BaseCoroutine *main, int n)
+        :BaseCoroutine(main), main(main), n(n) {}
+    virtual void run() override
+    {
+        for (int i = 0; i < n; ++i) {
+            main->yield();
+        }
+    }
+private:
+    BaseCoroutine *main;
+    int n;
+};
+
+
+static QJsonObject benchCoroutineSwitch()
+{
+    const int n = iterations(1000000);
+    BaseCoroutine *main = BaseCoroutine::current();
+    PingCoroutine ping(main, n);
+    QElapsedTimer timer;
+    AllocationScope allocations;
+    timer.start();
+    // the last yield runs ping to the end, which switches back by itself.
+    for (int i = 0; i <= n; ++i) {
+        ping.yield();
+    }
+    const qint64 nsecs = timer.nsecsElapsed();
+    return result(QStringLiteral("coroutine_switch"), nsecs / (2.0 * n), QStringLiteral("ns"), 2 * n, nsecs, allocations.allocations());
+}
+
+
+static QJsonObject benchSpawnJoin()
+{
+    const int n = iterations(100000);
+    CoroutineGroup operations;
+    QElapsedTimer timer;
+    AllocationScope allocations;
+    timer.start();
+    for (int i = 0; i < n; ++i) {
+        operations.spawn([] {});
+    }
+    operations.joinall();
+    return rate(QStringLiteral("spawn_join"), n, timer.nsecsElapsed(), allocations.allocations());
+}
+
+
+static QJsonObject benchSemaphorePingPong()
+{
+    const int n = iterations(200000);
+    Semaphore ping(0), pong(0);
+    CoroutineGroup operations;
+    operations.spawn([&ping, &pong, n] {
+        for (int i = 0; i < n; ++i) {
+            ping.acquire();
+            pong.release();
+        }
+    });
+    QElapsedTimer timer;
+    AllocationScope allocations;
+    timer.start();
+    for (int i = 0; i < n; ++i) {
+        ping.release();
+        pong.acquire();
+    }
+    const qint64 nsecs = timer.nsecsElapsed();
+    const unsigned long long allocated = allocations.allocations();
+    operations.joinall();
+    return rate(QStringLiteral("semaphore_pingpong"), n, nsecs, allocated);
+}
+
+
+static QJsonObject benchQueuePingPong()
+{
+    const int n = iterations(200000);
+    Queue<int> ping(1), pong(1);
+    CoroutineGroup operations;
+    operations.spawn([&ping, &pong, n] {
+        for (int i = 0; i < n; ++i) {
+            pong.put(ping.get());
+        }
+    });
+    QElapsedTimer timer;
+    AllocationScope allocations;
+    timer.start();
+    for (int i = 0; i < n; ++i) {
+        ping.put(i);
+        pong.get();
+    }
+    const qint64 nsecs = timer.nsecsElapsed();
+    const unsigned long long allocated = allocations.allocations();
+    operations.joinall();
+    return rate(QStringLiteral("queue_pingpong"), n, nsecs, allocated);
+}
+
+
+// a connected pair of tcp sockets over the loopback.
+static bool makeTcpPair(QSharedPointer<Socket> *client, QSharedPointer<Socket> *server)
+{
+    Socket listener;
+    if (!listener.bind(QHostAddress::LocalHost, 0) || !listener.listen(1)) {
+        return false;
+    }
+    client->reset(new Socket());
+    if (!(*client)->connect(QHostAddress::LocalHost, listener.localPort())) {
+        return false;
+    }
+    server->reset(listener.accept());
+    return !server->isNull();
+}
+
+
+static void echo(QSharedPointer<Socket> s)
+{
+    QByteArray buf(1024 * 64, Qt::Uninitialized);
+    while (true) {
+        qint32 bs = s->recv(buf.data(), buf.size());
+        if (bs <= 0 || s->sendall(buf.data(), bs) != bs) {
+            return;
+        }
+    }
+}
+
+
+static QList<QJsonObject> benchTcpEcho()
+{
+    QList<QJsonObject> results;
+    QSharedPointer<Socket> client, server;
+    if (!makeTcpPair(&client, &server)) {
+        return results;
+    }
+    CoroutineGroup operations;
+    operations.spawn([server] { echo(server); });
+
+    const int n = iterations(10000);
+    char c = 'x';
+    QElapsedTimer timer;
+    AllocationScope allocations;
+    timer.start();
+    for (int i = 0; i < n; ++i) {
+        if (client->sendall(&c, 1) != 1 || client->recvall(&c, 1) != 1) {
+            return results;
+        }
+    }
+    qint64 nsecs = timer.nsecsElapsed();
+    results.append(result(QStringLiteral("tcp_echo_latency"), nsecs / 1e3 / n, QStringLiteral("us"), n, nsecs, allocations.allocations()));
+
+    const qint64 total = static_cast<qint64>(iterations(1024)) * 1024 * 64;
+    const QByteArray chunk(1024 * 64, 'x');
+    timer.restart();
+    allocations.restart();
+    operations.spawn([client, chunk, total] {
+        for (qint64 sent = 0; sent < total; sent += chunk.size()) {
+            if (client->sendall(chunk) != chunk.size()) {
+                return;
+            }
+        }
+    });
+    QByteArray buf(1024 * 64, Qt::Uninitialized);
+    qint64 received = 0;
+    while (received < total) {
+        qint32 bs = client->recv(buf.data(), buf.size());
+        if (bs <= 0) {
+            break;
+        }
+        received += bs;
+    }
+    nsecs = timer.nsecsElapsed();
+    // per 64KiB chunk.
+    results.append(result(QStringLiteral("tcp_echo_throughput"), received / 1024.0 / 1024.0 / (nsecs / 1e9),
+                          QStringLiteral("MB/s"), received / chunk.size(), nsecs, allocations.allocations()));
+    client->close();
+    operations.killall();
+    return results;
+}
+
+
+#ifndef QTNG_NO_CRYPTO
+static QJsonObject benchTlsHandshakes()
+{
+    const int n = iterations(500);
+    const SslConfiguration &config = SslConfiguration::testPurpose("Benchmark", "CN", "Example");
+    SslSocket listener(Socket::IPv4Protocol, config);
+    QHostAddress localhost(QHostAddress::LocalHost);
+    if (!listener.bind(localhost, 0) || !listener.listen(100)) {
+        return QJsonObject();
+    }
+    const quint16 port = listener.localPort();
+    CoroutineGroup operations;
+    operations.spawn([&listener] {
+        while (true) {
+            QSharedPointer<SslSocket> request = listener.accept();
+            if (request.isNull()) {
+                return;
+            }
+        }
+    });
+    QElapsedTimer timer;
+    AllocationScope allocations;
+    timer.start();
+    int done = 0;
+    for (; done < n; ++done) {
+        SslSocket client;
+        if (!client.connect(QHostAddress::LocalHost, port)) {
+            break;
+        }
+    }
+    const qint64 nsecs = timer.nsecsElapsed();
+    const unsigned long long allocated = allocations.allocations();
+    operations.killall();
+    return rate(QStringLiteral("tls_handshakes"), done, nsecs, allocated);
+}
+#endif
+
+
+class HelloRequestHandler: public BaseHttpRequestHandler
+{
+public:
+    HelloRequestHandler(QSharedPointer<SocketLike> request, BaseStreamServer *server)
+        :BaseHttpRequestHandler(request, server) {}
+protected:
+    virtual void doGET() override
+    {
+        sendResponse(HttpStatus::OK);
+        sendHeader("Content-Length", "5");
+        endResponse("hello");
+    }
+    virtual void logRequest(HttpStatus, int) override {}
+};
+
+
+static QList<QJsonObject> benchHttp()
+{
+    QList<QJsonObject> results;
+    TcpServer<HelloRequestHandler> server(QHostAddress::LocalHost, 0);
+    if (!server.start()) {
+        return results;
+    }
+    const quint16 port = server.serverPort();
+
+    // the server side, by a keep-alive connection sending the requests one by one.
+    const int n = iterations(20000);
+    Socket client;
+    if (!client.connect(QHostAddress::LocalHost, port)) {
+        return results;
+    }
+    const QByteArray request = "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+    QByteArray buf(1024, Qt::Uninitialized);
+    QElapsedTimer timer;
+    AllocationScope allocations;
+    timer.start();
+    int done = 0;
+    for (; done < n; ++done) {
+        if (client.sendall(request) != request.size()) {
+            break;
+        }
+        QByteArray response;
+        while (!response.endsWith("hello")) {
+            qint32 bs = client.recv(buf.data(), buf.size());
+            if (bs <= 0) {
+                break;
+            }
+            response.append(buf.constData(), bs);
+        }
+        if (!response.endsWith("hello")) {
+            break;
+        }
+    }
+    // the allocations of both the client loop and the request handler, they run in the same thread.
+    results.append(rate(QStringLiteral("httpd_keepalive_requests"), done, timer.nsecsElapsed(), allocations.allocations()));
+    client.close();
+
+    // the client side, HttpSession keeps the connection too.
+    const int m = iterations(10000);
+    HttpSession session;
+    const QString &url = QStringLiteral("http://127.0.0.1:%1/").arg(port);
+    timer.restart();
+    allocations.restart();
+    done = 0;
+    for (; done < m; ++done) {
+        if (!session.get(url).isOk()) {
+            break;
+        }
+    }
+    results.append(rate(QStringLiteral("http_session_requests"), done, timer.nsecsElapsed(), allocations.allocations()));
+    server.stop();
+    return results;
+}
+
+
+// the child of benchStartup(), it prints the allocations of main thread since the process started, including the
+// static initializers of the libraries.
+static int firstRequest(const QString &url)
+{
+    HttpSession session;
+    const bool ok = session.get(url).isOk();
+#ifdef QTNG_COUNT_ALLOCATIONS
+    printf("%llu\n", allocationCounter.allocations);
+#endif
+    return ok ? 0 : 1;
+}
+
+
+// the time from exec() to the end of the first request, the cost of the short-lived tools. the plain http one should
+// not pay for initializing libressl.
+static QList<QJsonObject> benchStartup()
+{
+    QList<QJsonObject> results;
+    TcpServer<HelloRequestHandler> server(QHostAddress::LocalHost, 0);
+    if (!server.start()) {
+        return results;
+    }
+    QList<QPair<QString, QString>> urls;
+    urls.append(qMakePair(QStringLiteral("startup_first_request_http"),
+                          QStringLiteral("http://127.0.0.1:%1/").arg(server.serverPort())));
+#ifndef QTNG_NO_CRYPTO
+    SslServer<HelloRequestHandler> sslServer(QHostAddress::LocalHost, 0,
+                                             SslConfiguration::testPurpose("Benchmark", "CN", "Example"));
+    if (sslServer.start()) {
+        urls.append(qMakePair(QStringLiteral("startup_first_request_https"),
+                              QStringLiteral("https://127.0.0.1:%1/").arg(sslServer.serverPort())));
+    }
+#endif
+    const int n = iterations(20);
+    const QString &program = QCoreApplication::applicationFilePath();
+    for (const QPair<QString, QString> &url: urls) {
+        qint64 nsecs = 0;
+        unsigned long long allocations = 0;
+        int done = 0;
+        for (; done < n; ++done) {
+            // the servers run in this thread, so wait for the child in another one.
+            qint64 spent = -1;
+            QByteArray output;
+            callInThread([&program, &url, &spent, &output] {
+                QProcess child;
+                QElapsedTimer timer;
+                timer.start();
+                child.start(program, QStringList() << QStringLiteral("--first-request") << url.second);
+                if (!child.waitForFinished(30 * 1000) || child.exitStatus() != QProcess::NormalExit
+                        || child.exitCode() != 0) {
+                    child.kill();
+                    child.waitForFinished();
+                    return;
+                }
+                spent = timer.nsecsElapsed();
+                output = child.readAllStandardOutput();
+            });
+            if (spent < 0) {
+                break;
+            }
+            nsecs += spent;
+            allocations += output.trimmed().toULongLong();
+        }
+        if (done > 0) {
+            results.append(result(url.first, nsecs / 1e6 / done, QStringLiteral("ms"), done, nsecs, allocations));
+        }
+    }
+    server.stop();
+#ifndef QTNG_NO_CRYPTO
+    sslServer.stop();
+#endif
+    return results;
+}
+
+
+// every twentieth datagram is dropped by the relay between the kcp peers.
+static QJsonObject benchKcpLossy()
+{
+    QHostAddress localhost(QHostAddress::LocalHost);
+    KcpSocket listener(Socket::IPv4Protocol);
+    listener.setMode(KcpSocket::Internet);
+    if (!listener.bind(localhost, 0) || !listener.listen(10)) {
+        return QJsonObject();
+    }
+    const quint16 serverPort = listener.localPort();
+    QSharedPointer<Socket> relay(new Socket(Socket::IPv4Protocol, Socket::UdpSocket));
+    if (!relay->bind(localhost, 0)) {
+        return QJsonObject();
+    }
+    CoroutineGroup operations;
+    operations.spawn([relay, localhost, serverPort] {
+        QByteArray buf(1024 * 64, Qt::Uninitialized);
+        QHostAddress clientAddress;
+        quint16 clientPort = 0;
+        quint64 count = 0;
+        while (true) {
+            QHostAddress addr;
+            quint16 port;
+            qint32 bs = relay->recvfrom(buf.data(), buf.size(), &addr, &port);
+            if (bs < 0) {
+                return;
+            }
+            if (++count % 20 == 0) {
+                continue;
+            }
+            if (port == serverPort) {
+                if (clientPort) {
+                    relay->sendto(buf.constData(), bs, clientAddress, clientPort);
+                }
+            } else {
+                clientAddress = addr;
+                clientPort = port;
+                relay->sendto(buf.constData(), bs, localhost, serverPort);
+            }
+        }
+    });
+
+    const qint64 total = static_cast<qint64>(iterations(256)) * 1024 * 64;
+    QSharedPointer<qint64> received(new qint64(0));
+    QSharedPointer<Event> done(new Event());
+    operations.spawn([&listener, total, received, done] {
+        QSharedPointer<KcpSocket> request = listener.accept();
+        if (request.isNull()) {
+            done->set();
+            return;
+        }
+        QByteArray buf(1024 * 64, Qt::Uninitialized);
+        while (*received < total) {
+            qint32 bs = request->recv(buf.data(), buf.size());
+            if (bs <= 0) {
+                break;
+            }
+            *received += bs;
+        }
+        done->set();
+    });
+
+    KcpSocket client(Socket::IPv4Protocol);
+    client.setMode(KcpSocket::Internet);
+    if (!client.connect(localhost, relay->localPort())) {
+        operations.killall();
+        return QJsonObject();
+    }
+    const QByteArray chunk(1024 * 64, 'x');
+    QElapsedTimer timer;
+    AllocationScope allocations;
+    timer.start();
+    for (qint64 sent = 0; sent < total; sent += chunk.size()) {
+        if (client.sendall(chunk) != chunk.size()) {
+            break;
+        }
+    }
+    {
+        Timeout timeout(60.0);
+        Q_UNUSED(timeout);
+        try {
+            done->wait();
+        } catch (TimeoutException &) {
+        }
+    }
+    const qint64 nsecs = timer.nsecsElapsed();
+    const unsigned long long allocated = allocations.allocations();
+    client.close();
+    relay->close();
+    operations.killall();
+    // per 64KiB chunk.
+    return result(QStringLiteral("kcp_lossy_throughput"), *received / 1024.0 / 1024.0 / (nsecs / 1e9),
+                  QStringLiteral("MB/s"), *received / chunk.size(), nsecs, allocated);
+}
+
+
+static QJsonObject benchDataChannel()
+{
+    QSharedPointer<Socket> client, server;
+    if (!makeTcpPair(&client, &server)) {
+        return QJsonObject();
+    }
+    const int n = iterations(200000);
+    SocketChannel positive(client, PositivePole);
+    SocketChannel negative(server, NegativePole);
+    const QByteArray packet(256, 'x');
+    CoroutineGroup operations;
+    operations.spawn([&positive, &packet, n] {
+        for (int i = 0; i < n; ++i) {
+            if (!positive.sendPacket(packet)) {
+                return;
+            }
+        }
+    });
+    QElapsedTimer timer;
+    AllocationScope allocations;
+    timer.start();
+    int done = 0;
+    for (; done < n; ++done) {
+        if (negative.recvPacket().isEmpty()) {
+            break;
+        }
+    }
+    const qint64 nsecs = timer.nsecsElapsed();
+    const unsigned long long allocated = allocations.allocations();
+    operations.killall();
+    positive.close();
+    negative.close();
+    return rate(QStringLiteral("data_channel_packets"), done, nsecs, allocated);
+}
+
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QString filter, output;
+    const QStringList &args = app.arguments();
+    if (args.size() == 3 && args.at(1) == QStringLiteral("--first-request")) {
+        return firstRequest(args.at(2));
+    }
+    for (int i = 1; i + 1 < args.size(); i += 2) {
+        if (args.at(i) == QStringLiteral("--filter")) {
+            filter = args.at(i + 1);
+        } else if (args.at(i) == QStringLiteral("--scale")) {
+            scale = qMax(0.001, args.at(i + 1).toDouble());
+        } else if (args.at(i) == QStringLiteral("--output")) {
+            output = args.at(i + 1);
+        }
+    }
+
+    QJsonArray results;
+    bool overBudget = false;
+    auto run = [&results, &filter, &overBudget] (const QString &name, const std::function<QList<QJsonObject>()> &f) {
+        if (!filter.isEmpty() && !name.contains(filter)) {
+            return;
+        }
+        for (const QJsonObject &o: f()) {
+            if (o.isEmpty()) {
+                continue;
+            }
+            results.append(o);
+            const QString &resultName = o.value(QStringLiteral("name")).toString();
+            fprintf(stderr, "%s: %.2f %s\n", qPrintable(resultName), o.value(QStringLiteral("value")).toDouble(),
+                    qPrintable(o.value(QStringLiteral("unit")).toString()));
+            if (!o.contains(QStringLiteral("allocations_per_op"))) {
+                continue;
+            }
+            const double allocations = o.value(QStringLiteral("allocations_per_op")).toDouble();
+            for (const AllocationBudget &budget: allocationBudgets) {
+                if (resultName == QLatin1String(budget.name) && allocations > budget.allocationsPerOp) {
+                    fprintf(stderr, "%s: %.3f allocations per operation, the budget is %.3f\n", budget.name, allocations,
+                            budget.allocationsPerOp);
+                    overBudget = true;
+                }
+            }
+        }
+    };
+    run(QStringLiteral("coroutine_switch"), [] { return QList<QJsonObject>() << benchCoroutineSwitch(); });
+    run(QStringLiteral("spawn_join"), [] { return QList<QJsonObject>() << benchSpawnJoin(); });
+    run(QStringLiteral("semaphore_pingpong"), [] { return QList<QJsonObject>() << benchSemaphorePingPong(); });
+    run(QStringLiteral("queue_pingpong"), [] { return QList<QJsonObject>() << benchQueuePingPong(); });
+    run(QStringLiteral("tcp_echo"), benchTcpEcho);
+#ifndef QTNG_NO_CRYPTO
+    run(QStringLiteral("tls_handshakes"), [] { return QList<QJsonObject>() << benchTlsHandshakes(); });
+#endif
+    run(QStringLiteral("http"), benchHttp);
+    run(QStringLiteral("startup"), benchStartup);
+    run(QStringLiteral("kcp_lossy_throughput"), [] { return QList<QJsonObject>() << benchKcpLossy(); });
+    run(QStringLiteral("data_channel_packets"), [] { return QList<QJsonObject>() << benchDataChannel(); });
+
+    QJsonObject document;
+    document.insert(QStringLiteral("qt"), QString::fromLatin1(qVersion()));
+    document.insert(QStringLiteral("platform"), QSysInfo::prettyProductName());
+    document.insert(QStringLiteral("cpu"), QSysInfo::currentCpuArchitecture());
+    document.insert(QStringLiteral("context"), contextBackend());
+    document.insert(QStringLiteral("scale"), scale);
+    document.insert(QStringLiteral("results"), results);
+    const QByteArray &json = QJsonDocument(document).toJson();
+    if (output.isEmpty()) {
+        fwrite(json.constData(), 1, static_cast<size_t>(json.size()), stdout);
+    } else {
+        QFile f(output);
+        if (!f.open(QIODevice::WriteOnly) || f.write(json) != json.size()) {
+            fprintf(stderr, "can not write %s\n", qPrintable(output));
+            return 1;
+        }
+    }
+    return overBudget ? 2 : 0;
+}
@@ -0,0 +1,446 @@
+#include <QtCore/qcoreapplication.h>
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qfile.h>
+#include <QtCore/qjsondocument.h>
+#include <QtCore/qjsonobject.h>
+#include <QtCore/qthread.h>
+#include <QtCore/qvector.h>
+#include <stdio.h>
+#include "qtnetworkng.h"
+
+using namespace qtng;
+
+// a load generator in the manner of wrk2 and h2load, by the HttpSession, Socket and KcpSocket of this library.
+//
+//     loadgen --mode http --url http://127.0.0.1:8000/ [--threads 4] [--connections 64] [--rate 10000] [--duration 10]
+//     loadgen --mode tcp|kcp --host 127.0.0.1 --port 8001 [--size 64] ...
+//     loadgen --serve 8000
+//
+// every thread runs its own eventloop with connections / threads coroutines. the tcp and kcp modes send a payload of
+// --size bytes and wait for the echo of it. with --rate the requests are sent by a schedule, and the latency is
+// counted from the time a request should be sent, so a stalled server is not hidden by the requests which are not
+// sent meanwhile (the coordinated omission). without --rate every connection sends the next request after the
+// response, and the latency is of the requests only. --serve runs the counterparts: a httpd answering "hello" on
+// the port, and a tcp and a kcp echo servers on the port + 1.
+
+struct Options
+{
+    Options()
+        :mode(QStringLiteral("http")), host(QStringLiteral("127.0.0.1")), port(8001), threads(1), connections(10)
+        , rate(0.0), duration(10.0), timeout(10.0), size(64), serve(0) {}
+    QString mode;
+    QString url;
+    QString host;
+    quint16 port;
+    int threads;
+    int connections;
+    double rate;        // the requests per second of all connections, 0 for sending as fast as possible.
+    double duration;
+    double timeout;
+    int size;
+    QString output;
+    quint16 serve;
+};
+
+
+// a log-linear histogram of microseconds as HdrHistogram does. each power of two is split into 1024 sub-buckets, so
+// the values keep three significant digits. the values larger than one hour are counted as one hour.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+    void record(qint64 usecs);
+    void merge(const LatencyHistogram &other);
+    qint64 percentile(double p) const;
+    qint64 count() const { return total; }
+    qint64 max() const { return maxValue; }
+    double mean() const { return total ? sum / total : 0.0; }
+private:
+    static int indexOf(qint64 value);
+    static qint64 highestEquivalentValue(int index);
+private:
+    enum {
+        SubBucketHalfCountMagnitude = 10,
+        SubBucketHalfCount = 1 << SubBucketHalfCountMagnitude,
+        SubBucketMask = (SubBucketHalfCount << 1) - 1,
+    };
+    static const qint64 HighestTrackableValue = Q_INT64_C(3600) * 1000 * 1000;
+    QVector<qint64> counts;
+    qint64 total;
+    qint64 maxValue;
+    double sum;
+};
+
+
+LatencyHistogram::LatencyHistogram()
+    :counts(indexOf(HighestTrackableValue) + 1, 0), total(0), maxValue(0), sum(0.0)
+{
+}
+
+
+int LatencyHistogram::indexOf(qint64 value)
+{
+    const quint64 v = static_cast<quint64>(value);
+    const int bucket = 64 - static_cast<int>(qCountLeadingZeroBits(v | SubBucketMask)) - (SubBucketHalfCountMagnitude + 1);
+    const int subBucket = static_cast<int>(v >> bucket);
+    return ((bucket + 1) << SubBucketHalfCountMagnitude) + (subBucket - SubBucketHalfCount);
+}
+
+
+qint64 LatencyHistogram::highestEquivalentValue(int index)
+{
+    int bucket = (index >> SubBucketHalfCountMagnitude) - 1;
+    qint64 subBucket = (index & (SubBucketHalfCount - 1)) + SubBucketHalfCount;
+    if (bucket < 0) {
+        subBucket -= SubBucketHalfCount;
+        bucket = 0;
+    }
+    return (subBucket << bucket) + (Q_INT64_C(1) << bucket) - 1;
+}
+
+
+void LatencyHistogram::record(qint64 usecs)
+{
+    usecs = qBound<qint64>(0, usecs, HighestTrackableValue);
+    ++counts[indexOf(usecs)];
+    ++total;
+    sum += usecs;
+    maxValue = qMax(maxValue, usecs);
+}
+
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for (int i = 0; i < counts.size(); ++i) {
+        counts[i] += other.counts.at(i);
+    }
+    total += other.total;
+    sum += other.sum;
+    maxValue = qMax(maxValue, other.maxValue);
+}
+
+
+qint64 LatencyHistogram::percentile(double p) const
+{
+    if (!total) {
+        return 0;
+    }
+    const qint64 wanted = qMax<qint64>(1, static_cast<qint64>(p / 100.0 * total + 0.5));
+    qint64 seen = 0;
+    for (int i = 0; i < counts.size(); ++i) {
+        seen += counts.at(i);
+        if (seen >= wanted) {
+            return qMin(highestEquivalentValue(i), maxValue);
+        }
+    }
+    return maxValue;
+}
+
+
+struct WorkerResult
+{
+    WorkerResult()
+        :requests(0), errors(0), bytes(0) {}
+    LatencyHistogram latencies;
+    qint64 requests;
+    qint64 errors;
+    qint64 bytes;
+};
+
+
+// the clock of all threads, QElapsedTimer::nsecsElapsed() only reads the monotonic clock.
+static QElapsedTimer loadClock;
+
+
+class LoadWorker: public QThread
+{
+public:
+    LoadWorker(const Options &options, int connections)
+        :options(options), connections(connections) {}
+    WorkerResult result;
+protected:
+    virtual void run() override;
+private:
+    void connection(HttpSession *session);
+    bool request(HttpSession *session, QSharedPointer<SocketLike> &stream, const QByteArray &payload);
+    QSharedPointer<SocketLike> connect();
+private:
+    const Options options;
+    const int connections;
+};
+
+
+void LoadWorker::run()
+{
+    HttpSession session;
+    session.setMaxConnectionsPerServer(connections);
+    CoroutineGroup operations;
+    for (int i = 0; i < connections; ++i) {
+        operations.spawn([this, &session] { connection(&session); });
+    }
+    operations.joinall();
+}
+
+
+QSharedPointer<SocketLike> LoadWorker::connect()
+{
+    if (options.mode == QStringLiteral("kcp")) {
+        QSharedPointer<KcpSocket> s(new KcpSocket());
+        s->setMode(KcpSocket::Internet);
+        if (s->connect(options.host, options.port)) {
+            return SocketLike::kcpSocket(s);
+        }
+    } else {
+        QSharedPointer<Socket> s(new Socket());
+        if (s->connect(options.host, options.port)) {
+            return SocketLike::rawSocket(s);
+        }
+    }
+    return QSharedPointer<SocketLike>();
+}
+
+
+// the stream is reconnected by the next request after an error.
+bool LoadWorker::request(HttpSession *session, QSharedPointer<SocketLike> &stream, const QByteArray &payload)
+{
+    if (options.mode == QStringLiteral("http")) {
+        const HttpResponse &response = session->get(options.url);
+        if (!response.isOk()) {
+            return false;
+        }
+        result.bytes += response.body().size();
+        return true;
+    }
+    if (stream.isNull()) {
+        stream = connect();
+        if (stream.isNull()) {
+            return false;
+        }
+    }
+    if (stream->sendall(payload) != payload.size() || stream->recvall(payload.size()).size() != payload.size()) {
+        stream->close();
+        stream.clear();
+        return false;
+    }
+    result.bytes += payload.size() * 2;
+    return true;
+}
+
+
+void LoadWorker::connection(HttpSession *session)
+{
+    const QByteArray payload(options.size, 'x');
+    const qint64 deadline = loadClock.nsecsElapsed() + static_cast<qint64>(options.duration * 1e9);
+    // the interval of this connection, all connections share the rate.
+    const qint64 interval = options.rate > 0 ? static_cast<qint64>(1e9 * options.connections / options.rate) : 0;
+    qint64 scheduled = loadClock.nsecsElapsed();
+    QSharedPointer<SocketLike> stream;
+    while (true) {
+        qint64 now = loadClock.nsecsElapsed();
+        if (interval) {
+            scheduled += interval;
+            if (scheduled > now) {
+                Coroutine::msleep(static_cast<quint32>((scheduled - now) / (1000 * 1000)));
+                now = loadClock.nsecsElapsed();
+            }
+        }
+        if (now >= deadline) {
+            break;
+        }
+        // the latency of a late request includes the time it waited for its turn.
+        const qint64 start = interval ? qMin(scheduled, now) : now;
+        bool ok = false;
+        try {
+            Timeout timeout(static_cast<float>(options.timeout));
+            Q_UNUSED(timeout);
+            ok = request(session, stream, payload);
+        } catch (TimeoutException &) {
+            if (!stream.isNull()) {
+                stream->close();
+                stream.clear();
+            }
+        }
+        if (ok) {
+            ++result.requests;
+            result.latencies.record((loadClock.nsecsElapsed() - start) / 1000);
+        } else {
+            ++result.errors;
+        }
+    }
+}
+
+
+class HelloRequestHandler: public BaseHttpRequestHandler
+{
+public:
+    HelloRequestHandler(QSharedPointer<SocketLike> request, BaseStreamServer *server)
+        :BaseHttpRequestHandler(request, server) {}
+protected:
+    virtual void doGET() override
+    {
+        sendResponse(HttpStatus::OK);
+        sendHeader("Content-Length", "5");
+        endResponse("hello");
+    }
+    virtual void logRequest(HttpStatus, int) override {}
+};
+
+
+template<typename S>
+static void echo(QSharedPointer<S> s)
+{
+    QByteArray buf(1024 * 64, Qt::Uninitialized);
+    while (true) {
+        qint32 bs = s->recv(buf.data(), buf.size());
+        if (bs <= 0 || s->sendall(buf.data(), bs) != bs) {
+            return;
+        }
+    }
+}
+
+
+class EchoRequestHandler: public BaseRequestHandler
+{
+public:
+    EchoRequestHandler(QSharedPointer<SocketLike> request, BaseStreamServer *server)
+        :BaseRequestHandler(request, server) {}
+protected:
+    virtual void handle() override { echo(request); }
+};
+
+
+static int serve(quint16 port)
+{
+    TcpServer<HelloRequestHandler> httpd(QHostAddress::Any, port);
+    TcpServer<EchoRequestHandler> tcp(QHostAddress::Any, port + 1);
+    KcpShardedServer kcp(QHostAddress::Any, port + 1, QThread::idealThreadCount());
+    kcp.setMode(KcpSocket::Internet);
+    if (!httpd.start() || !tcp.start() || !kcp.start(echo<KcpSocket>)) {
+        fprintf(stderr, "can not listen on port %d and %d.\n", port, port + 1);
+        return 1;
+    }
+    fprintf(stderr, "http on %d, tcp and kcp echo on %d.\n", port, port + 1);
+    httpd.stopped->wait();
+    return 0;
+}
+
+
+static QString formatLatency(qint64 usecs)
+{
+    if (usecs < 1000) {
+        return QStringLiteral("%1us").arg(usecs);
+    } else if (usecs < 1000 * 1000) {
+        return QStringLiteral("%1ms").arg(usecs / 1e3, 0, 'f', 2);
+    }
+    return QStringLiteral("%1s").arg(usecs / 1e6, 0, 'f', 2);
+}
+
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    Options options;
+    const QStringList &args = app.arguments();
+    for (int i = 1; i + 1 < args.size(); i += 2) {
+        const QString &name = args.at(i);
+        const QString &value = args.at(i + 1);
+        if (name == QStringLiteral("--mode")) {
+            options.mode = value;
+        } else if (name == QStringLiteral("--url")) {
+            options.url = value;
+        } else if (name == QStringLiteral("--host")) {
+            options.host = value;
+        } else if (name == QStringLiteral("--port")) {
+            options.port = static_cast<quint16>(value.toUInt());
+        } else if (name == QStringLiteral("--threads")) {
+            options.threads = qMax(1, value.toInt());
+        } else if (name == QStringLiteral("--connections")) {
+            options.connections = qMax(1, value.toInt());
+        } else if (name == QStringLiteral("--rate")) {
+            options.rate = qMax(0.0, value.toDouble());
+        } else if (name == QStringLiteral("--duration")) {
+            options.duration = qMax(0.1, value.toDouble());
+        } else if (name == QStringLiteral("--timeout")) {
+            options.timeout = qMax(0.001, value.toDouble());
+        } else if (name == QStringLiteral("--size")) {
+            options.size = qMax(1, value.toInt());
+        } else if (name == QStringLiteral("--output")) {
+            options.output = value;
+        } else if (name == QStringLiteral("--serve")) {
+            options.serve = static_cast<quint16>(value.toUInt());
+        } else {
+            fprintf(stderr, "unknown option %s\n", qPrintable(name));
+            return 1;
+        }
+    }
+    if (options.serve) {
+        return serve(options.serve);
+    }
+    if (options.mode != QStringLiteral("http") && options.mode != QStringLiteral("tcp") && options.mode != QStringLiteral("kcp")) {
+        fprintf(stderr, "the mode is one of http, tcp and kcp.\n");
+        return 1;
+    }
+    if (options.mode == QStringLiteral("http") && options.url.isEmpty()) {
+        fprintf(stderr, "the http mode needs --url.\n");
+        return 1;
+    }
+    options.threads = qMin(options.threads, options.connections);
+
+    loadClock.start();
+    QList<LoadWorker *> workers;
+    for (int i = 0; i < options.threads; ++i) {
+        // spread the remainder of connections over the first threads.
+        const int connections = options.connections / options.threads + (i < options.connections % options.threads ? 1 : 0);
+        workers.append(new LoadWorker(options, connections));
+        workers.last()->start();
+    }
+    WorkerResult total;
+    for (LoadWorker *worker: workers) {
+        worker->wait();
+        total.latencies.merge(worker->result.latencies);
+        total.requests += worker->result.requests;
+        total.errors += worker->result.errors;
+        total.bytes += worker->result.bytes;
+        delete worker;
+    }
+    const double secs = loadClock.nsecsElapsed() / 1e9;
+
+    static const double percentiles[] = { 50, 75, 90, 99, 99.9, 99.99, 100 };
+    printf("%s, %d threads, %d connections, %.1fs", qPrintable(options.mode), options.threads, options.connections, secs);
+    if (options.rate > 0) {
+        printf(", %.0f requests/s scheduled, corrected for coordinated omission\n", options.rate);
+    } else {
+        printf(", closed loop\n");
+    }
+    printf("requests %lld, errors %lld, %.1f requests/s, %.2f MB/s\n", total.requests, total.errors, total.requests / secs,
+           total.bytes / 1024.0 / 1024.0 / secs);
+    printf("latency mean %s, max %s\n", qPrintable(formatLatency(static_cast<qint64>(total.latencies.mean()))),
+           qPrintable(formatLatency(total.latencies.max())));
+    QJsonObject latencies;
+    for (double p: percentiles) {
+        const qint64 usecs = total.latencies.percentile(p);
+        printf("  %7.3f%%  %s\n", p, qPrintable(formatLatency(usecs)));
+        latencies.insert(QString::number(p), static_cast<double>(usecs));
+    }
+
+    if (!options.output.isEmpty()) {
+        QJsonObject document;
+        document.insert(QStringLiteral("mode"), options.mode);
+        document.insert(QStringLiteral("threads"), options.threads);
+        document.insert(QStringLiteral("connections"), options.connections);
+        document.insert(QStringLiteral("rate"), options.rate);
+        document.insert(QStringLiteral("seconds"), secs);
+        document.insert(QStringLiteral("requests"), static_cast<double>(total.requests));
+        document.insert(QStringLiteral("errors"), static_cast<double>(total.errors));
+        document.insert(QStringLiteral("requests_per_second"), total.requests / secs);
+        document.insert(QStringLiteral("bytes"), static_cast<double>(total.bytes));
+        document.insert(QStringLiteral("latency_usecs"), latencies);
+        const QByteArray &json = QJsonDocument(document).toJson();
+        QFile f(options.output);
+        if (!f.open(QIODevice::WriteOnly) || f.write(json) != json.size()) {
+            fprintf(stderr, "can not write %s\n", qPrintable(options.output));
+            return 1;
+        }
+    }
+    return total.requests ? 0 : 1;
+}
@@ -1,5 +1,7 @@
 #include <QtTest>
+#include <stdexcept>
 #include "qtnetworkng.h"
+#include "../include/private/timerwheel_p.h"
 
 using namespace qtng;
 
@@ -13,6 +15,33 @@ private slots:
     void testJoinall();
     void testMap();
     void testeach();
+    void testStackPool();
+    void testStackUsage();
+    void testScheduler();
+    void testRuntime();
+    void testTimers();
+    void testTimerWheel();
+    void testCallLaterThreadSafe();
+    void testMetrics();
+    void testQueue();
+    void testLocks();
+    void testRWLockAndLimiter();
+    void testCoroutineLocal();
+    void testCancelScope();
+    void testTokenBucket();
+    void testCallInThread();
+    void testAsyncFile();
+    void testMappedFile();
+    void testMetricsExporter();
+    void testTraceContext();
+    void testCoroutineIntrospection();
+    void testIOBuf();
+    void testCoroutinePriority();
+    void testSharedStack();
+    void testHugePageStacks();
+    void testMonotonicArena();
+    void testTask();
+    void testThreadChannel();
 };
 
 
@@ -100,6 +129,854 @@ void TestCoroutines::testeach()
 }
 
 
+void TestCoroutines::testStackPool()
+{
+    EventLoopCoroutine::get();  // the eventloop takes a stack of the same size.
+    CoroutineStackPool::clear();
+    QCOMPARE(CoroutineStackPool::prewarm(4), 4u);
+    QCOMPARE(CoroutineStackPool::size(), 4u);
+    QSharedPointer<Coroutine> c(Coroutine::spawn([]{}));
+    QCOMPARE(CoroutineStackPool::size(), 3u);
+    c->join();
+    c.clear();
+    QCOMPARE(CoroutineStackPool::size(), 4u);
+    CoroutineStackPool::clear();
+    QCOMPARE(CoroutineStackPool::size(), 0u);
+}
+
+
+void TestCoroutines::testStackUsage()
+{
+    BaseCoroutine::setStackUsageTracking(true);
+    QSharedPointer<Coroutine> c(Coroutine::spawn([]{
+        // volatile, so the compiler can not drop the buffer.
+        volatile char buf[1024 * 16];
+        for (size_t i = 0; i < sizeof(buf); ++i) {
+            buf[i] = 1;
+        }
+    }));
+    c->join();
+    BaseCoroutine::setStackUsageTracking(false);
+    QVERIFY(c->stackUsage() >= 1024 * 16);
+    QVERIFY(c->stackUsage() <= c->stackSize());
+}
+
+
+void TestCoroutines::testScheduler()
+{
+    CoroutineScheduler scheduler(4);
+    QCOMPARE(scheduler.threadCount(), 4);
+    QSharedPointer<QAtomicInt> counter(new QAtomicInt(0));
+    for (int i = 0; i < 100; ++i) {
+        scheduler.spawn([counter] {
+            counter->ref();
+        });
+    }
+    scheduler.call([counter] {
+        counter->ref();
+    });
+    while (scheduler.pending() > 0 || scheduler.running() > 0) {
+        Coroutine::msleep(10);
+    }
+    QCOMPARE(counter->load(), 101);
+    // a task throwing, or rejected by a stopped scheduler, does not block the caller.
+    scheduler.call([] {
+        throw std::runtime_error("failed");
+    });
+    scheduler.stop();
+    {
+        Timeout _(5.0);
+        scheduler.call([counter] {
+            counter->ref();
+        });
+    }
+    QCOMPARE(counter->load(), 101);
+}
+
+
+void TestCoroutines::testRuntime()
+{
+    CoroutineRuntime runtime(QList<int>(), CoroutineRuntime::LeastLoaded);
+    QVERIFY(runtime.coreCount() > 0);
+    QCOMPARE(runtime.cpus().size(), runtime.coreCount());
+    QCOMPARE(CoroutineRuntime::currentCoreIndex(), -1);
+    QSharedPointer<QAtomicInt> counter(new QAtomicInt(0));
+    for (int i = 0; i < 50; ++i) {
+        runtime.spawn([counter] {
+            counter->ref();
+        });
+    }
+    const int last = runtime.coreCount() - 1;
+    QSharedPointer<int> index(new int(-2));
+    runtime.call(last, [index] {
+        *index = CoroutineRuntime::currentCoreIndex();
+    });
+    QCOMPARE(*index, last);
+    for (int i = 0; i < 100 && counter->load() < 50; ++i) {
+        Coroutine::msleep(10);
+    }
+    QCOMPARE(counter->load(), 50);
+    runtime.stop();
+}
+
+
+void TestCoroutines::testTimers()
+{
+    // the main thread uses qt eventloop, run in a worker thread to test the timers of libev eventloop.
+    CoroutineScheduler scheduler(1);
+    QSharedPointer<QList<int>> order(new QList<int>());
+    QSharedPointer<bool> timedOut(new bool(false));
+    QSharedPointer<QList<int>> cancelled(new QList<int>());
+    scheduler.call([order, timedOut, cancelled] {
+        // the first watcher is cancelled as well, the ids keep their generations.
+        EventLoopCoroutine *eventLoop = EventLoopCoroutine::get();
+        const qint64 later = eventLoop->callLater(10, makeFunctor([cancelled] { cancelled->append(1); }));
+        const qint64 coarse = eventLoop->callLaterCoarse(10, makeFunctor([cancelled] { cancelled->append(2); }));
+        const qint64 repeat = eventLoop->callRepeat(5, makeFunctor([cancelled] { cancelled->append(3); }));
+        eventLoop->cancelCall(later);
+        eventLoop->cancelCall(coarse);
+        eventLoop->cancelCall(repeat);
+        callInEventLoopAsync([order] { order->append(3); }, 30);
+        callInEventLoopAsync([order] { order->append(1); }, 10);
+        callInEventLoopAsync([order] { order->append(2); }, 20);
+        for (int i = 0; i < 10000; ++i) {
+            Timeout timeout(0.5f);
+        }
+        Coroutine::msleep(100);
+        try {
+            Timeout timeout(1.0f);
+            Coroutine::msleep(3000);
+        } catch (TimeoutException &) {
+            *timedOut = true;
+        }
+    });
+    scheduler.stop();
+    QCOMPARE(*order, QList<int>() << 1 << 2 << 3);
+    QVERIFY(*timedOut);
+    QVERIFY(cancelled->isEmpty());
+}
+
+
+// the timers expire at their ticks, however far advance() jumps.
+void TestCoroutines::testTimerWheel()
+{
+    const quint64 start = 1000;
+    TimerWheel wheel(start);
+    const quint64 delays[] = {0, 1, 63, 64, 65, 4095, 4096, 300000, 20000000, 90000000};
+    const int n = static_cast<int>(sizeof(delays) / sizeof(delays[0]));
+    TimerWheelNode nodes[n];
+    for (int i = 0; i < n; ++i) {
+        nodes[i].prev = nodes[i].next = nullptr;
+        wheel.insert(&nodes[i], start + delays[i]);
+    }
+    QCOMPARE(wheel.size(), static_cast<quint32>(n));
+    QCOMPARE(wheel.nextExpiry(), static_cast<qint64>(start));
+
+    int taken = 0;
+    const quint64 steps[] = {0, 1, 60, 64, 66, 5000, 299999, 300000, 20000000, 100000000};
+    for (quint64 step: steps) {
+        wheel.advance(start + step);
+        QCOMPARE(wheel.currentTick(), start + step);
+        while (TimerWheelNode *node = wheel.takeExpired()) {
+            QVERIFY(node->expiry <= start + step);
+            ++taken;
+        }
+        for (int i = 0; i < n; ++i) {
+            QCOMPARE(nodes[i].isLinked(), delays[i] > step);
+        }
+        if (wheel.size() > 0) {
+            QVERIFY(wheel.nextExpiry() > static_cast<qint64>(start + step));
+        }
+    }
+    QCOMPARE(taken, n);
+    QCOMPARE(wheel.size(), 0u);
+    QCOMPARE(wheel.nextExpiry(), static_cast<qint64>(-1));
+}
+
+
+void TestCoroutines::testCallLaterThreadSafe()
+{
+    CoroutineScheduler scheduler(1);
+    QSharedPointer<EventLoopCoroutine*> eventloop(new EventLoopCoroutine*(nullptr));
+    scheduler.call([eventloop] {
+        *eventloop = EventLoopCoroutine::get();
+    });
+    QSharedPointer<QList<int>> order(new QList<int>());
+    QList<Functor*> callbacks;
+    for (int i = 0; i < 100; ++i) {
+        callbacks.append(new LambdaFunctor([order, i] { order->append(i); }));
+    }
+    (*eventloop)->callLaterThreadSafe(0, callbacks);
+    (*eventloop)->callLaterThreadSafe(0, new LambdaFunctor([order] { order->append(100); }));
+    for (int i = 0; i < 100 && order->size() < 101; ++i) {
+        Coroutine::msleep(10);
+    }
+    scheduler.stop();
+    QCOMPARE(order->size(), 101);
+    for (int i = 0; i <= 100; ++i) {
+        QCOMPARE(order->at(i), i);
+    }
+}
+
+
+void TestCoroutines::testMetrics()
+{
+    EventLoopCoroutine *eventloop = EventLoopCoroutine::get();
+    eventloop->resetMetrics();
+    QSharedPointer<qint64> slowTick(new qint64(0));
+    eventloop->setSlowTickCallback(20, [slowTick] (qint64 busyNsecs) {
+        *slowTick = busyNsecs;
+    });
+    callInEventLoopAsync([] { QThread::msleep(50); });
+    Coroutine::msleep(100);
+    EventLoopMetrics metrics = eventloop->metrics();
+    eventloop->setSlowTickCallback(0, nullptr);
+    QVERIFY(metrics.iterations > 0);
+    QVERIFY(metrics.pollNsecs > 0);
+    QVERIFY(metrics.longestTickNsecs >= 50 * 1000 * 1000);
+    QVERIFY(*slowTick >= 50 * 1000 * 1000);
+    QVERIFY(metrics.coroutineSwitches > 0);
+}
+
+
+void TestCoroutines::testQueue()
+{
+    Queue<int> queue(4);
+    QVERIFY(queue.put(1));
+    QVERIFY(queue.returns(0));
+    QVERIFY(queue.putMany(QList<int>() << 2 << 3));
+    QVERIFY(queue.isFull());
+    QCOMPARE(queue.size(), 4u);
+    // fills the queue over the ring buffer boundary while a consumer drains it.
+    CoroutineGroup operations;
+    QSharedPointer<QList<int>> got(new QList<int>());
+    operations.spawn([&queue, got] {
+        while (got->size() < 20) {
+            got->append(queue.getMany(3));
+        }
+    });
+    QList<int> more;
+    for (int i = 4; i < 20; ++i) {
+        more.append(i);
+    }
+    QVERIFY(queue.putMany(more));
+    operations.joinall();
+    QCOMPARE(got->size(), 20);
+    for (int i = 0; i < 20; ++i) {
+        QCOMPARE(got->at(i), i);
+    }
+    QVERIFY(queue.isEmpty());
+    QString s = QStringLiteral("moved");
+    Queue<QString> strings;
+    QVERIFY(strings.put(std::move(s)));
+    QCOMPARE(strings.get(), QStringLiteral("moved"));
+}
+
+
+void TestCoroutines::testLocks()
+{
+    Lock lock;
+    QVERIFY(lock.acquire());
+    CoroutineGroup operations;
+    QSharedPointer<QList<int>> order(new QList<int>());
+    for (int i = 0; i < 3; ++i) {
+        operations.spawnWithName(QString::number(i), [&lock, order, i] {
+            if (lock.acquire()) {
+                order->append(i);
+                lock.release();
+            }
+        });
+    }
+    Coroutine::msleep(10);
+    // the killed waiter must not keep the lock.
+    operations.kill(QStringLiteral("1"));
+    lock.release();
+    // handed to the first waiter, so it can not be taken again before the waiter runs.
+    QVERIFY(!lock.acquire(false));
+    operations.joinall();
+    QCOMPARE(*order, QList<int>() << 0 << 2);
+    QVERIFY(!lock.isLocked());
+
+    Event *event = new Event();
+    QSharedPointer<bool> deleted(new bool(false));
+    operations.spawn([event, deleted] {
+        *deleted = !event->wait();
+    });
+    Coroutine::msleep(10);
+    QCOMPARE(event->getting(), 1u);
+    delete event;
+    operations.joinall();
+    QVERIFY(*deleted);
+
+    // the first resumed waiter deletes the semaphore, the others are resumed in the same round.
+    Semaphore *semaphore = new Semaphore(3);
+    for (int i = 0; i < 3; ++i) {
+        QVERIFY(semaphore->acquire());
+    }
+    order->clear();
+    for (int i = 0; i < 3; ++i) {
+        operations.spawnWithName(QString::number(i), [&semaphore, &operations, order, i] {
+            if (!semaphore->acquire()) {
+                return;
+            }
+            order->append(i);
+            if (i == 0) {
+                delete semaphore;
+                semaphore = nullptr;
+                operations.kill(QStringLiteral("2"), false);
+            }
+        });
+    }
+    Coroutine::msleep(10);
+    semaphore->release();
+    semaphore->release();
+    semaphore->release();
+    operations.joinall();
+    QVERIFY(semaphore == nullptr);
+    QVERIFY(order->size() >= 2);
+    QCOMPARE(order->at(0), 0);
+    QCOMPARE(order->at(1), 1);
+}
+
+
+void TestCoroutines::testRWLockAndLimiter()
+{
+    RWLock rwlock;
+    QVERIFY(rwlock.acquireRead());
+    QVERIFY(rwlock.acquireRead());
+    QVERIFY(!rwlock.acquireWrite(false));
+    CoroutineGroup operations;
+    QSharedPointer<QList<int>> order(new QList<int>());
+    operations.spawn([&rwlock, order] {
+        if (rwlock.acquireWrite()) {
+            order->append(1);
+            rwlock.releaseWrite();
+        }
+    });
+    Coroutine::msleep(10);
+    // the waiting writer stops new readers.
+    QVERIFY(!rwlock.acquireRead(false));
+    operations.spawn([&rwlock, order] {
+        if (rwlock.acquireRead()) {
+            order->append(2);
+            rwlock.releaseRead();
+        }
+    });
+    Coroutine::msleep(10);
+    rwlock.releaseRead();
+    rwlock.releaseRead();
+    operations.joinall();
+    QCOMPARE(*order, QList<int>() << 1 << 2);
+    QCOMPARE(rwlock.readers(), 0);
+    QVERIFY(!rwlock.isWriting());
+
+    Limiter limiter(3);
+    QVERIFY(limiter.acquire(2));
+    QVERIFY(!limiter.acquire(2, -1.0f));
+    QVERIFY(!limiter.acquire(2, 0.01f));
+    QVERIFY(!limiter.acquire(4));
+    order->clear();
+    operations.spawn([&limiter, order] {
+        if (limiter.acquire(3)) {
+            order->append(3);
+            limiter.release(3);
+        }
+    });
+    Coroutine::msleep(10);
+    // the waiter at head is not passed.
+    QVERIFY(!limiter.acquire(1, -1.0f));
+    QCOMPARE(limiter.waiting(), 1);
+    limiter.release(2);
+    operations.joinall();
+    QCOMPARE(*order, QList<int>() << 3);
+    QCOMPARE(limiter.available(), 3u);
+    QCOMPARE(limiter.acquired(), 2ull);
+    QVERIFY(limiter.longestWaitMsecs() >= 5);
+}
+
+
+void TestCoroutines::testCoroutineLocal()
+{
+    CoroutineLocal<QString> traceId(true);
+    CoroutineLocal<int> counter;
+    traceId.setLocalData(QStringLiteral("parent"));
+    counter.setLocalData(1);
+    QSharedPointer<QStringList> seen(new QStringList());
+    QSharedPointer<Coroutine> c(Coroutine::spawn([&traceId, &counter, seen] {
+        seen->append(traceId.localData());
+        seen->append(QString::number(counter.localData()));
+        traceId.setLocalData(QStringLiteral("child"));
+    }));
+    c->join();
+    QCOMPARE(*seen, QStringList() << QStringLiteral("parent") << QStringLiteral("0"));
+    QCOMPARE(traceId.localData(), QStringLiteral("parent"));
+    counter.removeLocalData();
+    QVERIFY(!counter.hasLocalData());
+
+    // the slots are reused, and the new owner does not see the values of the old one.
+    for (int i = 0; i < 1000; ++i) {
+        CoroutineLocal<int> temporary;
+        QVERIFY(!temporary.hasLocalData());
+        temporary.setLocalData(i);
+        QCOMPARE(temporary.localData(), i);
+    }
+    CoroutineLocal<QByteArray> reused;
+    QVERIFY(!reused.hasLocalData());
+    QCOMPARE(reused.localData(), QByteArray());
+}
+
+
+void TestCoroutines::testCancelScope()
+{
+    Lock lock;
+    QVERIFY(lock.acquire());
+    bool timedout = false;
+    try {
+        CancelScope outer(0.05f);
+        {
+            CancelScope inner(1.0f);
+            QVERIFY(inner.remainingMsecs() <= 50);
+        }
+        lock.acquire();
+    } catch (TimeoutException &) {
+        timedout = true;
+    }
+    QVERIFY(timedout);
+    QVERIFY(!CancelScope::current());
+
+    timedout = false;
+    CancelScope scope(0.0f);
+    QCOMPARE(scope.remainingMsecs(), -1ll);
+    scope.cancel();
+    try {
+        lock.acquire();
+    } catch (TimeoutException &) {
+        timedout = true;
+    }
+    QVERIFY(timedout);
+    lock.release();
+
+    // the exception of cancelled scope is swallowed above, the later waits raise it again instead of blocking.
+    Socket listener;
+    QVERIFY(listener.bind(QHostAddress::LocalHost, 0));
+    QVERIFY(listener.listen(1));
+    timedout = false;
+    try {
+        Timeout timeout(5.0f);
+        listener.accept();
+    } catch (TimeoutException &) {
+        timedout = true;
+    }
+    QVERIFY(timedout);
+    timedout = false;
+    try {
+        listener.accept();
+    } catch (TimeoutException &) {
+        timedout = true;
+    }
+    QVERIFY(timedout);
+}
+
+
+void TestCoroutines::testCallInThread()
+{
+    QThread *current = QThread::currentThread();
+    CoroutineGroup operations;
+    QAtomicInt otherThreads;
+    for (int i = 0; i < 8; ++i) {
+        operations.spawn([current, &otherThreads] {
+            const int result = callInThread<int>([current, &otherThreads] {
+                if (QThread::currentThread() != current) {
+                    otherThreads.ref();
+                }
+                return 42;
+            }, 1);
+            QCOMPARE(result, 42);
+        });
+    }
+    operations.joinall();
+    QCOMPARE(otherThreads.load(), 8);
+}
+
+
+void TestCoroutines::testAsyncFile()
+{
+    QByteArray data;
+    for (int i = 0; i < 50000; ++i) {
+        data.append(reinterpret_cast<const char *>(&i), sizeof(i));
+    }
+    QTemporaryFile tmp;
+    QVERIFY(tmp.open());
+    QCOMPARE(tmp.write(data), static_cast<qint64>(data.size()));
+    tmp.close();
+
+    QSharedPointer<QFile> f(new QFile(tmp.fileName()));
+    QVERIFY(f->open(QIODevice::ReadWrite));
+    QSharedPointer<FileLike> file = FileLike::asyncFile(f, 4096);
+    QVERIFY(file->file().isNull());
+    QCOMPARE(file->size(), static_cast<qint64>(data.size()));
+    bool ok = false;
+    QCOMPARE(file->readall(&ok), data);
+    QVERIFY(ok);
+    QVERIFY(file->atEnd());
+
+    QVERIFY(file->seek(10000));
+    char buf[100];
+    QCOMPARE(file->readall(buf, 100), 100);
+    QCOMPARE(QByteArray(buf, 100), data.mid(10000, 100));
+    // the write goes to the position of caller, not the one of read-ahead.
+    QCOMPARE(file->writeall(const_cast<char *>("hello"), 5), 5);
+    QVERIFY(file->seek(10100));
+    QCOMPARE(file->readall(buf, 5), 5);
+    QCOMPARE(QByteArray(buf, 5), QByteArray("hello"));
+    file->close();
+}
+
+
+void TestCoroutines::testMappedFile()
+{
+    QByteArray data(100000, 'x');
+    data.append("tail");
+    QTemporaryFile tmp;
+    QVERIFY(tmp.open());
+    QCOMPARE(tmp.write(data), static_cast<qint64>(data.size()));
+    tmp.flush();
+
+    QSharedPointer<FileLike> file = FileLike::mapped(tmp.fileName());
+    QVERIFY(!file.isNull());
+    QCOMPARE(file->size(), static_cast<qint64>(data.size()));
+    char buf[10];
+    QCOMPARE(file->read(buf, 10), 10);
+    QVERIFY(file->seek(100000));
+    bool ok = false;
+    const QByteArray &view = file->readall(&ok);
+    QVERIFY(ok);
+    QCOMPARE(view, QByteArray("tail"));
+    QVERIFY(file->atEnd());
+    QVERIFY(file->write(buf, 10) < 0);
+    file->close();
+    QVERIFY(FileLike::mapped(tmp.fileName() + ".missing").isNull());
+}
+
+
+void TestCoroutines::testMetricsExporter()
+{
+    Metrics::setEnabled(true);
+    Metrics::clear();
+    Metrics::increase("test_requests_total", Metrics::label("path", "/a\"b"));
+    Metrics::increase("test_requests_total", Metrics::label("path", "/a\"b"), 2);
+    Metrics::observe("test_latency_seconds", QByteArray(), 0.003);
+    // the counters of other threads are merged.
+    callInThread([] {
+        Metrics::increase("test_requests_total", Metrics::label("path", "/a\"b"));
+        Metrics::adjust("test_connections", QByteArray(), 2);
+    });
+    Metrics::setEnabled(false);
+    Metrics::increase("test_requests_total", Metrics::label("path", "/a\"b"));
+
+    const QByteArray &text = Metrics::render();
+    QVERIFY(text.contains("# TYPE test_requests_total counter\ntest_requests_total{path=\"/a\\\"b\"} 4\n"));
+    QVERIFY(text.contains("test_connections 2\n"));
+    QVERIFY(text.contains("test_latency_seconds_bucket{le=\"0.0025\"} 0\n"));
+    QVERIFY(text.contains("test_latency_seconds_bucket{le=\"0.005\"} 1\n"));
+    QVERIFY(text.contains("test_latency_seconds_bucket{le=\"+Inf\"} 1\n"));
+    QVERIFY(text.contains("test_latency_seconds_count 1\n"));
+    QVERIFY(text.contains("# TYPE qtng_coroutines gauge\n"));
+    QVERIFY(text.contains("qtng_eventloop_tick_seconds_count "));
+    Metrics::clear();
+}
+
+
+void TestCoroutines::testTraceContext()
+{
+    const QByteArray header("00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01");
+    const TraceContext &context = TraceContext::fromTraceParent(header);
+    QVERIFY(context.isValid());
+    QVERIFY(context.isSampled());
+    QCOMPARE(context.toTraceParent(), header);
+    QVERIFY(!TraceContext::fromTraceParent("00-00000000000000000000000000000000-00f067aa0ba902b7-01").isValid());
+    QVERIFY(!TraceContext::fromTraceParent("00-4BF92F3577B34DA6A3CE929D0E0E4736-00f067aa0ba902b7-01").isValid());
+
+    // the coroutines spawned later inherit the context.
+    QSharedPointer<Coroutine> c(Coroutine::spawn([] {
+        QCOMPARE(TraceContext::current().toTraceParent(), QByteArray());
+    }));
+    c->join();
+    TraceContext::setCurrent(context);
+    QByteArray inherited;
+    c.reset(Coroutine::spawn([&inherited] {
+        inherited = TraceContext::current().toTraceParent();
+    }));
+    c->join();
+    QCOMPARE(inherited, header);
+    TraceContext::setCurrent(TraceContext());
+    QVERIFY(!TraceContext::current().isValid());
+}
+
+
+void TestCoroutines::testCoroutineIntrospection()
+{
+    if (!CoroutineIntrospection::isAvailable()) {
+        QVERIFY(CoroutineIntrospection::dump().contains("disabled"));
+        return;
+    }
+    Event event;
+    const int before = CoroutineIntrospection::count();
+    CoroutineGroup operations;
+    operations.spawnWithName("stuck", [&event] {
+        event.wait();
+    });
+    Coroutine::msleep(10);
+    QCOMPARE(CoroutineIntrospection::count(), before + 1);
+    const QByteArray &text = CoroutineIntrospection::dump();
+    QVERIFY(text.contains("\"stuck\""));
+    QVERIFY(text.contains("waiting for Event"));
+    event.set();
+    operations.joinall();
+}
+
+
+void TestCoroutines::testIOBuf()
+{
+    IOBuf buf = IOBuf::withCapacity(16, 4);
+    QCOMPARE(buf.headroom(), 4);
+    QCOMPARE(buf.tailroom(), 16);
+    buf.append("hello", 5);
+    memcpy(buf.prepend(4), "abcd", 4);
+    QCOMPARE(buf.sliceCount(), 1);
+    QCOMPARE(buf.toByteArray(), QByteArray("abcdhello"));
+
+    const QByteArray world("world");
+    buf.append(world);
+    QCOMPARE(buf.sliceCount(), 2);
+    QCOMPARE(static_cast<const void *>(buf.sliceData(1)), static_cast<const void *>(world.constData()));  // shared.
+    QCOMPARE(buf.tailroom(), 0);
+
+    IOBuf copy = buf;
+    buf.append("!", 1);
+    QCOMPARE(copy.toByteArray(), QByteArray("abcdhelloworld"));
+    QCOMPARE(buf.toByteArray(), QByteArray("abcdhelloworld!"));
+
+    IOBuf head = buf.split(4);
+    QCOMPARE(head.toByteArray(), QByteArray("abcd"));
+    QCOMPARE(head.tailroom(), 0);                       // the block is shared with buf.
+    buf.trimStart(5);
+    buf.trimEnd(1);
+    QCOMPARE(buf.toByteArray(), world);
+    char out[3];
+    QCOMPARE(buf.copyTo(out, 3, 2), 3);
+    QCOMPARE(QByteArray(out, 3), QByteArray("rld"));
+    buf.coalesce();
+    QCOMPARE(buf.sliceCount(), 1);
+    QCOMPARE(static_cast<const void *>(buf.toByteArray().constData()), static_cast<const void *>(buf.sliceData(0)));
+}
+
+
+void TestCoroutines::testCoroutinePriority()
+{
+    Lock lock;
+    QVERIFY(lock.acquire());
+    CoroutineGroup operations;
+    QSharedPointer<QList<int>> order(new QList<int>());
+    const BaseCoroutine::Priority priorities[] = {BaseCoroutine::IdlePriority, BaseCoroutine::NormalPriority,
+                                                  BaseCoroutine::HighPriority, BaseCoroutine::NormalPriority};
+    for (int i = 0; i < 4; ++i) {
+        const BaseCoroutine::Priority priority = priorities[i];
+        operations.spawn([&lock, order, i, priority] {
+            BaseCoroutine::current()->setPriority(priority);
+            if (lock.acquire()) {
+                order->append(i);
+                lock.release();
+            }
+        });
+        Coroutine::msleep(1);
+    }
+    Coroutine::msleep(10);
+    lock.release();
+    operations.joinall();
+    // the same priority keeps the order of waiting.
+    QCOMPARE(*order, QList<int>() << 2 << 1 << 3 << 0);
+}
+
+
+void TestCoroutines::testSharedStack()
+{
+    Queue<int> queue;
+    QSharedPointer<int> sum(new int(0));
+    QSharedPointer<QList<int>> got(new QList<int>());
+    CoroutineGroup operations;
+    QSharedPointer<Coroutine> consumer = operations.spawn([&queue, sum] {
+        for (int i = 0; i < 20; ++i) {
+            *sum += queue.get();
+        }
+    });
+    if (!consumer->setSharedStack(true)) {
+        QSKIP("the coroutine backend has no shared stack.");
+    }
+    for (int i = 0; i < 20; ++i) {
+        QSharedPointer<Coroutine> producer = operations.spawn([&queue, got, i] {
+            char frame[1024];
+            memset(frame, i, sizeof(frame));
+            Coroutine::msleep(5);
+            queue.put(i);
+            // the frames are copied back after the others ran on the same stack.
+            for (char c: frame) {
+                if (c != static_cast<char>(i)) {
+                    got->append(-1);
+                    return;
+                }
+            }
+            got->append(i);
+        });
+        QVERIFY(producer->setSharedStack(true));
+        QVERIFY(producer->isSharedStack());
+    }
+    operations.joinall();
+    QCOMPARE(got->size(), 20);
+    QVERIFY(!got->contains(-1));
+    QCOMPARE(*sum, 190);
+}
+
+
+void TestCoroutines::testHugePageStacks()
+{
+    CoroutineStackPool::setHugePages(true);
+    if (!CoroutineStackPool::isHugePages()) {
+        QSKIP("no huge page arena out of Linux.");
+    }
+    QSharedPointer<int> sum(new int(0));
+    for (int round = 0; round < 2; ++round) {
+        CoroutineGroup operations;
+        for (int i = 0; i < 16; ++i) {
+            operations.spawn([sum, i] {
+                char frame[4096];
+                memset(frame, i, sizeof(frame));
+                Coroutine::msleep(1);
+                *sum += frame[sizeof(frame) - 1];
+            });
+        }
+        operations.joinall();
+        // the stacks of the first round are reused.
+        CoroutineStackPool::clear();
+    }
+    CoroutineStackPool::setHugePages(false);
+    QCOMPARE(*sum, 240);
+}
+
+
+struct ArenaProbe
+{
+    ArenaProbe(int *destroyed)
+        :destroyed(destroyed) {}
+    ~ArenaProbe() { ++*destroyed; }
+    int *destroyed;
+};
+
+
+
+void TestCoroutines::testMonotonicArena()
+{
+    MonotonicArena arena(256);
+    int destroyed = 0;
+    ArenaProbe *probe = arena.create<ArenaProbe>(&destroyed);
+    QVERIFY(probe);
+    quint64 *number = arena.create<quint64>(42u);
+    QCOMPARE(reinterpret_cast<quintptr>(number) % alignof(quint64), static_cast<quintptr>(0));
+    QCOMPARE(*number, static_cast<quint64>(42));
+    const QByteArray &bytes = arena.bytes(QByteArray("content-type"));
+    QCOMPARE(bytes, QByteArray("content-type"));
+    // a large allocation gets a new block.
+    char *large = static_cast<char *>(arena.allocate(1024));
+    memset(large, 'x', 1024);
+    QVERIFY(arena.capacity() > 256);
+    QCOMPARE(destroyed, 0);
+    arena.reset();
+    QCOMPARE(destroyed, 1);
+    QCOMPARE(arena.bytesUsed(), static_cast<qint64>(0));
+    QCOMPARE(arena.capacity(), static_cast<qint64>(256));
+}
+
+
+void TestCoroutines::testTokenBucket()
+{
+    TokenBucket bucket(10000, 1000);
+    const TokenBucket shared = bucket;
+    QElapsedTimer timer;
+    timer.start();
+    bucket.take(1000);
+    QVERIFY(timer.elapsed() < 50);
+    // the copies share the bucket, so the burst is spent.
+    TokenBucket(shared).take(1000);
+    QVERIFY(timer.elapsed() >= 90);
+    TokenBucket().take(1000000);
+    QCOMPARE(shared.rate(), 10000ll);
+}
+
+
+void TestCoroutines::testTask()
+{
+    QSharedPointer<Queue<int>> queue(new Queue<int>(0));
+    QSharedPointer<QList<int>> got(new QList<int>());
+    QSharedPointer<Task> task = Task::spawn([queue, got] (Task *task) {
+        while (!queue->isEmpty()) {
+            int i = queue->get();
+            if (i < 0) {
+                return false;
+            }
+            got->append(i);
+        }
+        task->waitQueue(queue.data());
+        return true;
+    });
+    Coroutine::msleep(10);
+    QVERIFY(!task->isFinished());
+    queue->put(1);
+    queue->put(2);
+    Coroutine::msleep(10);
+    queue->put(-1);
+    QVERIFY(task->join());
+    QCOMPARE(*got, QList<int>() << 1 << 2);
+
+    int steps = 0;
+    task = Task::spawn([&steps] (Task *task) {
+        ++steps;
+        task->msleep(1000);
+        return true;
+    });
+    Coroutine::msleep(10);
+    task->kill();
+    QVERIFY(task->join());
+    QCOMPARE(steps, 1);
+}
+
+
+void TestCoroutines::testThreadChannel()
+{
+    QSharedPointer<ThreadChannel<int>> channel(new ThreadChannel<int>(4));
+    CoroutineScheduler scheduler(2);
+    for (int j = 0; j < 2; ++j) {
+        scheduler.spawn([channel, j] {
+            for (int i = 0; i < 50; ++i) {
+                channel->put(j * 50 + i);
+            }
+        });
+    }
+    int sum = 0;
+    for (int i = 0; i < 100; ++i) {
+        bool ok;
+        sum += channel->get(&ok);
+        QVERIFY(ok);
+    }
+    QCOMPARE(sum, 99 * 100 / 2);
+    channel->close();
+    bool ok = true;
+    channel->get(&ok);
+    QVERIFY(!ok);
+    QVERIFY(!channel->put(1));
+    scheduler.stop();
+}
+
+
 QTEST_MAIN(TestCoroutines)
 
 #include "test_coroutines.moc"
@@ -15,20 +15,29 @@ private slots:
     void testSha384();
     void testSha512();
     void testRipemd160();
+    void testHashMany();
+    void testHmac();
+    void testFastHashes();
+    void testPasswordHashes();
+    void testRandom();
 //    void testBlake2b512();
 //    void testBlake2s256();
     void testAES128();
     void testAES256();
     void testBlowfish();
     void testDecrypt();
+    void testGCM();
+    void testCipherReset();
     void testGenRSA();
     void testSignRSA();
+    void testSigner();
     void testCryptoRSA();
     void testSaveLoadRsa();
     void testGenDSA();
     void testSignDSA();
 //    void testCryptoDSA();
     void testCertificate();
+    void testCertificateCache();
 };
 
 void TestCrypto::testMd4()
@@ -71,6 +80,77 @@ void TestCrypto::testRipemd160()
     QCOMPARE(MessageDigest::hash("123456", MessageDigest::Ripemd160), QByteArray("d8913df37b24c97f28f840114d05bd110dbb2e44"));
 }
 
+void TestCrypto::testHashMany()
+{
+    const QList<QByteArray> &hashes = MessageDigest::hashMany(QList<QByteArray>() << "123456" << "" << "123456",
+                                                              MessageDigest::Sha256);
+    QCOMPARE(hashes.size(), 3);
+    QCOMPARE(hashes.at(0), QByteArray("8d969eef6ecad3c29a3a629280e686cf0c3f5d5a86aff3ca12020c923adc6c92"));
+    QCOMPARE(hashes.at(1), QByteArray("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"));
+    QCOMPARE(hashes.at(2), hashes.at(0));
+    QCOMPARE(MessageDigest::digestMany(QList<QByteArray>() << "123456", MessageDigest::Md5).at(0).toHex(),
+             QByteArray("e10adc3949ba59abbe56e057f20f883e"));
+
+    char out[64];
+    QCOMPARE(MessageDigest::digestSize(MessageDigest::Sha1), 20);
+    QCOMPARE(MessageDigest::digest("123456", 6, MessageDigest::Sha1, out), 20);
+    QCOMPARE(QByteArray(out, 20).toHex(), QByteArray("7c4a8d09ca3762af61e59520943dc26494f8941b"));
+}
+
+void TestCrypto::testHmac()
+{
+    // rfc 4231, test case 2.
+    const QByteArray &expected = QByteArray::fromHex("5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843");
+    Hmac h(MessageDigest::Sha256, "Jefe");
+    h.addData("what do ya want ");
+    h.addData("for nothing?");
+    QCOMPARE(h.result(), expected);
+    QVERIFY(h.verify(expected));
+    QVERIFY(!h.verify(expected.left(31)));
+    h.reset();
+    h.addData("what do ya want for nothing?");
+    QCOMPARE(h.result(), expected);
+    QCOMPARE(Hmac::hmac("Jefe", "what do ya want for nothing?", MessageDigest::Sha256), expected);
+}
+
+void TestCrypto::testFastHashes()
+{
+    QCOMPARE(Blake2::hash("abc", Blake2::Blake2b).toHex(), QByteArray("ba80a53f981c4d0d6a2797b69f12f6e94c212f14685ac4b74b12bb6fdbffa2d17d87c5392aab792dc252d5de4533cc9518d38aa8dbf1925ab92386edd4009923"));
+    QCOMPARE(Blake2::hash(QByteArray(1000, 'x'), Blake2::Blake2s, 0, "key").toHex(), QByteArray("1d9b04e3480d6969770dd34e61fff7941584db28ef41b8cafd9f0dc5bb85d5a3"));
+    QCOMPARE(Blake2::hash(QByteArray(128, 'x'), Blake2::Blake2b, 20).toHex(), QByteArray("03dfe65b6fd81239f6c25ce933394264efbec2db"));
+    QVERIFY(!Blake2(Blake2::Blake2s, 33).isValid());
+
+    QByteArray message;
+    for (char i = 0; i < 15; ++i) {
+        message.append(i);
+    }
+    QCOMPARE(sipHash24(message, 0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL), Q_UINT64_C(0xa129ca6149be45e5));
+    QCOMPARE(xxHash64(QByteArray()), Q_UINT64_C(0xef46db3751d8e999));
+    QCOMPARE(xxHash64(QByteArray("abc")), Q_UINT64_C(0x44bc2cf5ad770999));
+}
+
+void TestCrypto::testPasswordHashes()
+{
+    // rfc 7914, section 12.
+    QCOMPARE(scrypt(64, "password", "NaCl", 1024, 8, 16).toHex(), QByteArray("fdbabe1c9d3472007856e7190d01e9fe7c6ad7cbc8237830e77376634b3731622eaf30d92e22a3886ff109279d9830dac727afb94a83ee6d8360cbdfa2cc0640"));
+    QCOMPARE(offloadScrypt(64, QByteArray(), QByteArray(), 16, 1, 1).toHex(), QByteArray("77d6576238657b203b19ca42c18a0497f16b4844e3074ae8dfdffa3fede21442fcd0069ded0948f8326a753a0fc81f17e8d3e0fb2e0d3628cf35e20c38d18906"));
+    QVERIFY(scrypt(64, "password", "NaCl", 1000, 8, 1).isEmpty());
+    QCOMPARE(offloadPBKDF2_HMAC(32, "password", "salt", MessageDigest::Sha256, 1000),
+             PBKDF2_HMAC(32, "password", "salt", MessageDigest::Sha256, 1000));
+}
+
+void TestCrypto::testRandom()
+{
+    char buf[32] = {0};
+    QVERIFY(randomBytes(buf, sizeof(buf)));
+    QVERIFY(QByteArray(buf, sizeof(buf)) != QByteArray(sizeof(buf), '\0'));
+    QVERIFY(randomUInt64() != randomUInt64());
+    for (int i = 0; i < 1000; ++i) {
+        QVERIFY(randomBounded(7) < 7);
+    }
+    QCOMPARE(randomBounded(1), 0u);
+}
+
 //void TestSsl::testBlake2b512()
 //{
 //    QCOMPARE(QMessageDigest::hash("123456", QMessageDigest::Blake2b512), QByteArray("ba3253876aed6bc22d4a6ff53d8406c6ad864195ed144ab5c87621b6c233b548baeae6956df346ec8c17f5ea10f35ee3cbc514797ed7ddd3145464e2a0bab413"));
@@ -139,6 +219,61 @@ void TestCrypto::testDecrypt()
 }
 
 
+void TestCrypto::testGCM()
+{
+    const QByteArray key(16, 'k');
+    const QByteArray iv(12, 'n');
+    QByteArray data("fish is here.");
+    Cipher c1(Cipher::AES128, Cipher::GCM, Cipher::Encrypt);
+    QVERIFY(c1.setKey(key));
+    QVERIFY(c1.setInitialVector(iv));
+    QVERIFY(c1.setAad(QByteArray("header")));
+    QCOMPARE(c1.addData(data.constData(), data.size(), data.data()), data.size());    // in place.
+    char rest[32];
+    QCOMPARE(c1.finalData(rest), 0);
+    const QByteArray &tag = c1.tag();
+    QCOMPARE(tag.size(), 16);
+
+    AeadCipher aead(AeadCipher::AES128GCM, key);
+    const QByteArray &sealed = aead.seal(iv, QByteArray("header"), QByteArray("fish is here."));
+    QCOMPARE(sealed, data + tag);
+    QCOMPARE(aead.open(iv, QByteArray("header"), sealed), QByteArray("fish is here."));
+    QVERIFY(aead.open(iv, QByteArray("forged"), sealed).isNull());
+
+    Cipher c2(Cipher::AES128, Cipher::GCM, Cipher::Decrypt);
+    QVERIFY(c2.setKey(key));
+    QVERIFY(c2.setInitialVector(iv));
+    QVERIFY(c2.setAad(QByteArray("header")));
+    QVERIFY(c2.setTag(tag));
+    QCOMPARE(c2.addData(data), QByteArray("fish is here."));
+    QVERIFY(c2.finalData().isEmpty());
+    QVERIFY(c2.isValid());
+}
+
+
+void TestCrypto::testCipherReset()
+{
+    const QByteArray key(16, 'k');
+    AeadCipher aead(AeadCipher::AES128GCM, key);
+    CipherKey prepared(Cipher::AES128, Cipher::GCM, Cipher::Encrypt, key);
+    QVERIFY(prepared.isValid());
+    QScopedPointer<Cipher> cipher(prepared.newCipher(QByteArray(12, '\0')));
+    QVERIFY(!cipher.isNull());
+    for (quint32 i = 0; i < 3; ++i) {
+        QByteArray nonce(12, '\0');
+        qToBigEndian(i, reinterpret_cast<uchar*>(nonce.data()) + 8);
+        QVERIFY(cipher->reset(nonce));
+        QByteArray data("fish is here.");
+        QCOMPARE(cipher->addData(data.constData(), data.size(), data.data()), data.size());
+        char rest[32];
+        QCOMPARE(cipher->finalData(rest), 0);
+        QCOMPARE(data + cipher->tag(), aead.seal(nonce, QByteArray(), QByteArray("fish is here.")));
+    }
+    QVERIFY(!cipher->reset(QByteArray(5, 'n')));
+    QVERIFY(!CipherKey(Cipher::AES128, Cipher::GCM, Cipher::Encrypt, QByteArray(3, 'k')).isValid());
+}
+
+
 void TestCrypto::testGenRSA()
 {
     PrivateKey key1 = PrivateKey::generate(PrivateKey::Rsa, 2048);
@@ -160,6 +295,30 @@ void TestCrypto::testSignRSA()
 }
 
 
+void TestCrypto::testSigner()
+{
+    PrivateKey key = PrivateKey::generate(PrivateKey::Rsa, 2048);
+    Signer signer(key, MessageDigest::Sha256);
+    QVERIFY(signer.isValid());
+    signer.update("123");
+    signer.update("456");
+    const QByteArray &first = signer.sign();
+    QCOMPARE(first.size(), signer.signatureSize());
+    QVERIFY(key.verify("123456", first, MessageDigest::Sha256));
+    signer.update("654321");
+    const QByteArray &second = signer.sign();
+
+    Verifier verifier(key.publicKey(), MessageDigest::Sha256);
+    verifier.update("123456");
+    QVERIFY(verifier.verify(first));
+    verifier.update("123456");
+    QVERIFY(!verifier.verify(second));
+    const QList<bool> &results = verifier.verifyMany(QList<QByteArray>() << "123456" << "654321" << "654321",
+                                                     QList<QByteArray>() << first << second << first);
+    QCOMPARE(results, QList<bool>() << true << true << false);
+}
+
+
 void TestCrypto::testCryptoRSA()
 {
     PrivateKey key = PrivateKey::generate(PrivateKey::Rsa, 2048);
@@ -250,6 +409,29 @@ void TestCrypto::testCertificate()
     QVERIFY(cert == cert2);
 }
 
+void TestCrypto::testCertificateCache()
+{
+    PrivateKey pkey = PrivateKey::generate(PrivateKey::Rsa, 2048);
+    const QDateTime &now = QDateTime::currentDateTime();
+    QMultiMap<Certificate::SubjectInfo, QString> subjectInfoes = {
+        { Certificate::CommonName, QStringLiteral("Goldfish") },
+    };
+    const QByteArray &pem1 = Certificate::generate(pkey, MessageDigest::Sha256, 1, now, now.addYears(1), subjectInfoes).save();
+    const QByteArray &pem2 = Certificate::generate(pkey, MessageDigest::Sha256, 2, now, now.addYears(1), subjectInfoes).save();
+    const Certificate &cert1 = Certificate::load(pem1);
+    QVERIFY(!cert1.isNull());
+    QCOMPARE(Certificate::load(pem1).handle(), cert1.handle());
+
+    const QList<Certificate> &bundle = Certificate::loadAll(pem1 + pem2);
+    QCOMPARE(bundle.size(), 2);
+    QVERIFY(bundle.at(0) == cert1);
+    QCOMPARE(bundle.at(1).serialNumber(), Certificate::load(pem2).serialNumber());
+    QVERIFY(Certificate::loadAll("not a certificate").isEmpty());
+
+    const QByteArray &keyPem = pkey.save();
+    QCOMPARE(PrivateKey::load(keyPem).handle(), PrivateKey::load(keyPem).handle());
+}
+
 QTEST_MAIN(TestCrypto)
 
 #include "test_crypto.moc"
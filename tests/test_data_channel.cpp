@@ -1,90 +1,342 @@
-#include <QCoreApplication>
-#include <QDebug>
+#include <QtTest>
 #include "qtnetworkng.h"
 
+using namespace qtng;
 
-class ServerCoroutine: public qtng::Coroutine
+class TestDataChannel: public QObject
 {
-public:
-    ServerCoroutine()
-    {
-        setObjectName("server");
+    Q_OBJECT
+private slots:
+    void testVirtualChannel();
+    void testNestedChannel();
+    void testCoalescingAndFragments();
+    void testScheduling();
+    void testFlowControl();
+    void testCompression();
+    void testRpc();
+    void testSharedMemoryChannel();
+};
+
+
+// the positive pole is the client of a loopback connection.
+static bool makeChannels(QSharedPointer<SocketChannel> *positive, QSharedPointer<SocketChannel> *negative)
+{
+    Socket listener;
+    if (!listener.bind(QHostAddress::LocalHost, 0) || !listener.listen(1)) {
+        return false;
+    }
+    QSharedPointer<Socket> client(new Socket());
+    if (!client->connect(QHostAddress::LocalHost, listener.localPort())) {
+        return false;
     }
+    QSharedPointer<Socket> request(listener.accept());
+    if (request.isNull()) {
+        return false;
+    }
+    positive->reset(new SocketChannel(client, PositivePole));
+    negative->reset(new SocketChannel(request, NegativePole));
+    return true;
+}
 
-    virtual void run()
-    {
-        qtng::Socket server;
-        bool success = server.bind((quint16)7923, qtng::Socket::ReuseAddressHint);
-        if(!success) {
-            qDebug() << "port is used.";
-            return;
-        }
-        server.listen(5);
-        qtng::Socket *request = server.accept();
-        if(!request) {
-            qDebug() << "bad request.";
-            return;
-        }
-        qtng::SocketChannel channel(QSharedPointer<qtng::Socket>(request), qtng::NegativePole);
-        channel.setName("server_channel");
-        QByteArray t = channel.recvPacket();
-        quint32 channelNumber = t.toUInt();
-        qDebug() << "got subchannel number:" << channelNumber;
-        QSharedPointer<qtng::VirtualChannel> subChannel = channel.getChannel(channelNumber);
-        if(subChannel.isNull()) {
-            return;
-        }
-        while(true) {
-            const QByteArray &packet = subChannel->recvPacket();
-            if(packet.isEmpty()) {
-                break;
-            }
-            qDebug() << packet;
-        }
-        qDebug() << "exit server.";
+
+void TestDataChannel::testVirtualChannel()
+{
+    QSharedPointer<SocketChannel> client, server;
+    QVERIFY(makeChannels(&client, &server));
+    client->setName(QStringLiteral("client_channel"));
+    server->setName(QStringLiteral("server_channel"));
+    QSharedPointer<VirtualChannel> clientChannel = client->makeChannel();
+    QVERIFY(!clientChannel.isNull());
+    QVERIFY(client->sendPacket(QByteArray::number(clientChannel->channelNumber())));
+    for (int i = 0; i < 5; ++i) {
+        QVERIFY(clientChannel->sendPacket(QByteArray::number(i)));
     }
-};
+
+    Timeout _(5.0);
+    const quint32 channelNumber = server->recvPacket().toUInt();
+    QCOMPARE(channelNumber, clientChannel->channelNumber());
+    QSharedPointer<VirtualChannel> serverChannel = server->getChannel(channelNumber);
+    QVERIFY(!serverChannel.isNull());
+    QVERIFY(server->getChannel(channelNumber).isNull());
+    for (int i = 0; i < 5; ++i) {
+        QCOMPARE(serverChannel->recvPacket(), QByteArray::number(i));
+    }
+    QVERIFY(serverChannel->sendPacket("reply"));
+    QCOMPARE(clientChannel->recvPacket(), QByteArray("reply"));
+    // the packets of data channel do not go to the sub channels.
+    QVERIFY(server->sendPacket("direct"));
+    QCOMPARE(client->recvPacket(), QByteArray("direct"));
+
+    client->close();
+    QVERIFY(serverChannel->recvPacket().isEmpty());
+    QVERIFY(server->isBroken());
+}
 
 
-class ClientCoroutine: public qtng::Coroutine
+void TestDataChannel::testNestedChannel()
 {
-public:
-    ClientCoroutine()
-    {
-        setObjectName("client");
+    QSharedPointer<SocketChannel> client, server;
+    QVERIFY(makeChannels(&client, &server));
+    Timeout _(5.0);
+    QSharedPointer<VirtualChannel> outer = client->makeChannel();
+    QSharedPointer<VirtualChannel> peerOuter = server->takeChannel();
+    QVERIFY(!peerOuter.isNull());
+    QCOMPARE(peerOuter->channelNumber(), outer->channelNumber());
+
+    // the headers of the nested channels are prepended in place, the big packets keep their bytes.
+    QSharedPointer<VirtualChannel> inner = outer->makeChannel();
+    QSharedPointer<VirtualChannel> peerInner = peerOuter->takeChannel();
+    QVERIFY(!peerInner.isNull());
+    QVERIFY(inner->maxPacketSize() < outer->maxPacketSize());
+    QByteArray packet(static_cast<int>(inner->payloadSizeHint()), Qt::Uninitialized);
+    for (int i = 0; i < packet.size(); ++i) {
+        packet[i] = static_cast<char>(i % 253);
+    }
+    QVERIFY(inner->sendPacket(packet));
+    QVERIFY(outer->sendPacket("outer"));
+    QCOMPARE(peerInner->recvPacket(), packet);
+    QCOMPARE(peerOuter->recvPacket(), QByteArray("outer"));
+}
+
+
+void TestDataChannel::testCoalescingAndFragments()
+{
+    QSharedPointer<SocketChannel> client, server;
+    QVERIFY(makeChannels(&client, &server));
+    client->setCoalescingDelay(5);
+    QCOMPARE(client->coalescingDelay(), 5u);
+    client->setFragmentSize(1024 * 4);
+    server->setFragmentSize(1024 * 4);
+    QSharedPointer<VirtualChannel> bulk = client->makeChannel();
+
+    Timeout _(5.0);
+    QSharedPointer<VirtualChannel> peerBulk = server->takeChannel();
+    QVERIFY(!peerBulk.isNull());
+    // the small packets are sent in batches, in order.
+    for (int i = 0; i < 100; ++i) {
+        QVERIFY(client->sendPacketAsync(QByteArray::number(i)));
+    }
+    const QByteArray large(1024 * 60, 'x');
+    QVERIFY(bulk->sendPacket(large));
+    for (int i = 0; i < 100; ++i) {
+        QCOMPARE(server->recvPacket(), QByteArray::number(i));
     }
+    // the fragments are joined again.
+    QCOMPARE(peerBulk->recvPacket(), large);
+}
+
 
-    virtual void run()
-    {
-        QSharedPointer<qtng::Socket> client = QSharedPointer<qtng::Socket>::create();
-//        bool success = client->connect(QHostAddress::LocalHost, 7923);
-        bool success = client->connect("127.0.0.1", 7923);
-        if(!success) {
-            return;
+void TestDataChannel::testScheduling()
+{
+    QSharedPointer<SocketChannel> client, server;
+    QVERIFY(makeChannels(&client, &server));
+    QSharedPointer<VirtualChannel> urgent = client->makeChannel();
+    QSharedPointer<VirtualChannel> bulk = client->makeChannel();
+    QVERIFY(urgent->setScheduling(10));
+    QVERIFY(bulk->setScheduling(0, 4));
+    QVERIFY(!urgent->makeChannel()->setScheduling(1));
+
+    Timeout _(5.0);
+    QSharedPointer<VirtualChannel> peerUrgent = server->takeChannel();
+    QSharedPointer<VirtualChannel> peerBulk = server->takeChannel();
+    QVERIFY(!peerUrgent.isNull() && !peerBulk.isNull());
+    QCOMPARE(peerUrgent->channelNumber(), urgent->channelNumber());
+    QCOMPARE(peerBulk->channelNumber(), bulk->channelNumber());
+    CoroutineGroup operations;
+    operations.spawn([bulk] {
+        for (int i = 0; i < 32; ++i) {
+            bulk->sendPacket(QByteArray(1024 * 32, 'b'));
         }
-        qtng::SocketChannel channel(client, qtng::PositivePole);
-        channel.setName("client_channel");
-        QSharedPointer<qtng::VirtualChannel> subChannel = channel.makeChannel();
-        channel.sendPacket(QByteArray::number(subChannel->channelNumber()));
-        for(int i = 0; i < 5; ++i) {
-            success = subChannel->sendPacket(QByteArray::number(i));
-            if(!success) {
-                qDebug() << "exit client.";
+    });
+    QVERIFY(urgent->sendPacket("urgent"));
+    QCOMPARE(peerUrgent->recvPacket(), QByteArray("urgent"));
+    for (int i = 0; i < 32; ++i) {
+        QCOMPARE(peerBulk->recvPacket().size(), 1024 * 32);
+    }
+    operations.joinall();
+}
+
+
+void TestDataChannel::testFlowControl()
+{
+    QSharedPointer<SocketChannel> client, server;
+    QVERIFY(makeChannels(&client, &server));
+    QSharedPointer<VirtualChannel> channel = client->makeChannel();
+    Timeout _(10.0);
+    QSharedPointer<VirtualChannel> peer = server->takeChannel();
+    QVERIFY(!peer.isNull());
+
+    // the sender stops after the window of 1m is used up, until the receiver takes the packets.
+    int sent = 0;
+    CoroutineGroup operations;
+    operations.spawn([channel, &sent] {
+        for (int i = 0; i < 48; ++i) {
+            if (!channel->sendPacket(QByteArray(1024 * 32, static_cast<char>(i)))) {
                 return;
             }
+            ++sent;
         }
-        success = subChannel->sendPacket(QByteArray());
-        qDebug() << "exit client.";
+    });
+    Coroutine::msleep(200);
+    QVERIFY(sent > 0);
+    QVERIFY(sent <= 33);
+    for (int i = 0; i < 48; ++i) {
+        QCOMPARE(peer->recvPacket(), QByteArray(1024 * 32, static_cast<char>(i)));
     }
-};
+    operations.joinall();
+    QCOMPARE(sent, 48);
+}
+
+
+void TestDataChannel::testCompression()
+{
+    QSharedPointer<SocketChannel> client, server;
+    QVERIFY(makeChannels(&client, &server));
+    QVERIFY(client->setCompressionCodec(DataChannel::ZlibCompression));
+    QVERIFY(server->setCompressionCodec(DataChannel::ZlibCompression));
+    QCOMPARE(client->compressionCodec(), DataChannel::ZlibCompression);
+    QSharedPointer<VirtualChannel> channel = client->makeChannel();
+
+    Timeout _(5.0);
+    QSharedPointer<VirtualChannel> peer = server->takeChannel();
+    QVERIFY(!peer.isNull());
+    // the compressible, incompressible and small packets all come back as they are.
+    const QByteArray text(1024 * 48, 'c');
+    QByteArray noise(1024 * 8, Qt::Uninitialized);
+    quint32 seed = 1;
+    for (int i = 0; i < noise.size(); ++i) {
+        seed = seed * 1103515245u + 12345u;
+        noise[i] = static_cast<char>(seed >> 16);
+    }
+    QVERIFY(client->sendPacket(text));
+    QVERIFY(channel->sendPacket(text));
+    QVERIFY(channel->sendPacket(noise));
+    QVERIFY(channel->sendPacket("tiny"));
+    QCOMPARE(server->recvPacket(), text);
+    QCOMPARE(peer->recvPacket(), text);
+    QCOMPARE(peer->recvPacket(), noise);
+    QCOMPARE(peer->recvPacket(), QByteArray("tiny"));
+}
+
 
-int main(int argc, char** argv) //simple_data_channel
+static QVariant decodeArguments(const QByteArray &arguments)
 {
-    QCoreApplication app(argc, argv);
-    Q_UNUSED(app);
-    qtng::CoroutineGroup operations;
-    operations.start(new ServerCoroutine);
-    operations.start(new ClientCoroutine);
+    QVariant decoded;
+    MsgPackStream stream(arguments);
+    stream >> decoded;
+    return decoded;
+}
+
+
+static QByteArray encodeResult(const QVariant &result)
+{
+    QByteArray encoded;
+    MsgPackStream stream(&encoded, QIODevice::WriteOnly);
+    stream << result;
+    return encoded;
+}
+
+
+void TestDataChannel::testRpc()
+{
+    QSharedPointer<SocketChannel> client, server;
+    QVERIFY(makeChannels(&client, &server));
+    RpcPeer caller(client);
+    RpcPeer callee(server);
+    callee.registerMethod(QStringLiteral("add"), [] (RpcCall &call) {
+        const QVariantList &arguments = decodeArguments(call.arguments()).toList();
+        return encodeResult(arguments.value(0).toInt() + arguments.value(1).toInt());
+    });
+    callee.registerMethod(QStringLiteral("count"), [] (RpcCall &call) {
+        const int n = decodeArguments(call.arguments()).toList().value(0).toInt();
+        for (int i = 0; i < n; ++i) {
+            call.sendItem(encodeResult(i));
+        }
+        return encodeResult(n);
+    });
+    callee.registerMethod(QStringLiteral("sleep"), [] (RpcCall &) {
+        Coroutine::msleep(1000);
+        return QByteArray();
+    });
+    callee.registerMethod(QStringLiteral("fail"), [] (RpcCall &call) {
+        call.setError(QStringLiteral("failed."));
+        return QByteArray();
+    });
+
+    Timeout _(5.0);
+    QCOMPARE(caller.callVariant(QStringLiteral("add"), QVariantList() << 1 << 2).toInt(), 3);
+    // the calls of many coroutines are multiplexed by id.
+    QList<int> results;
+    for (int i = 0; i < 8; ++i) {
+        results.append(-1);
+    }
+    CoroutineGroup operations;
+    for (int i = 0; i < 8; ++i) {
+        operations.spawn([&caller, &results, i] {
+            results[i] = caller.callVariant(QStringLiteral("add"), QVariantList() << i << i).toInt();
+        });
+    }
+    operations.joinall();
+    for (int i = 0; i < 8; ++i) {
+        QCOMPARE(results.at(i), i * 2);
+    }
+
+    QList<int> items;
+    QByteArray arguments = encodeResult(QVariantList() << 3);
+    const QByteArray &count = caller.call(QStringLiteral("count"), arguments, [&items] (const QByteArray &item) {
+        items.append(decodeArguments(item).toInt());
+    });
+    QCOMPARE(decodeArguments(count).toInt(), 3);
+    QCOMPARE(items, QList<int>() << 0 << 1 << 2);
+
+    QString error;
+    QVERIFY(caller.call(QStringLiteral("fail"), QByteArray(), 0.0f, &error).isNull());
+    QCOMPARE(error, QStringLiteral("failed."));
+    QVERIFY(caller.call(QStringLiteral("missing"), QByteArray(), 0.0f, &error).isNull());
+    QVERIFY(!error.isEmpty());
+    QVERIFY(caller.call(QStringLiteral("sleep"), QByteArray(), 0.1f, &error).isNull());
+    QVERIFY(!caller.isBroken());
+    QCOMPARE(caller.callVariant(QStringLiteral("add"), QVariantList() << 20 << 22).toInt(), 42);
+}
+
+
+void TestDataChannel::testSharedMemoryChannel()
+{
+#ifndef Q_OS_UNIX
+    QSKIP("the shared memory channel needs unix.");
+#else
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString &path = dir.path() + QStringLiteral("/ring");
+    QSharedPointer<SharedMemoryChannel> positive(new SharedMemoryChannel(path, PositivePole));
+    QSharedPointer<SharedMemoryChannel> negative(new SharedMemoryChannel(path, NegativePole));
+    QVERIFY(!positive->isBroken());
+    QVERIFY(!negative->isBroken());
+
+    Timeout _(5.0);
+    QVERIFY(positive->sendPacket("hello"));
+    QCOMPARE(negative->recvPacket(), QByteArray("hello"));
+    // more than the ring holds at once, the writer waits for the reader.
+    CoroutineGroup operations;
+    operations.spawn([negative] {
+        for (int i = 0; i < 64; ++i) {
+            negative->sendPacket(QByteArray(1024 * 60, static_cast<char>(i)));
+        }
+    });
+    for (int i = 0; i < 64; ++i) {
+        QCOMPARE(positive->recvPacket(), QByteArray(1024 * 60, static_cast<char>(i)));
+    }
     operations.joinall();
-    return 0;
+
+    QSharedPointer<VirtualChannel> channel = positive->makeChannel();
+    QSharedPointer<VirtualChannel> peer = negative->takeChannel();
+    QVERIFY(!peer.isNull());
+    QVERIFY(channel->sendPacket("sub"));
+    QCOMPARE(peer->recvPacket(), QByteArray("sub"));
+#endif
 }
+
+
+QTEST_MAIN(TestDataChannel)
+
+#include "test_data_channel.moc"
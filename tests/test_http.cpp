@@ -0,0 +1,886 @@
+#include <QtTest>
+#include <QtCore/qendian.h>
+#include "qtnetworkng.h"
+#include "../include/private/http2_p.h"
+
+using namespace qtng;
+
+class TestHttp: public QObject
+{
+    Q_OBJECT
+private slots:
+    void testHttpCache();
+    void testHttpCookieJar();
+    void testHttpPrewarm();
+    void testSharedHttpSession();
+    void testDispatchThreads();
+    void testStreamingResponse();
+    void testHttpRouter();
+    void testMultipartReader();
+    void testJsonView();
+    void testBasicHeaderSplitter();
+    void testAlternativeServices();
+    void testWebSocket();
+    void testHpack();
+    void testHttp2();
+    void testContinuationFlood();
+    void testPipelining();
+    void testPipelinedContinue();
+    void testSendMany();
+    void testStreamedBodies();
+};
+
+
+static int cachedRequests = 0;
+
+
+class CachedRequestHandler: public BaseHttpRequestHandler
+{
+public:
+    CachedRequestHandler(QSharedPointer<SocketLike> request, BaseStreamServer *server)
+        :BaseHttpRequestHandler(request, server) {}
+protected:
+    virtual void doGET() override
+    {
+        ++cachedRequests;
+        if (header(QStringLiteral("If-None-Match")) == "\"v1\"") {
+            sendResponse(HttpStatus::NotModified);
+            sendHeader("ETag", "\"v1\"");
+            endResponse(QByteArray());
+            return;
+        }
+        sendResponse(HttpStatus::OK);
+        sendHeader("Cache-Control", "max-age=60");
+        sendHeader("ETag", "\"v1\"");
+        sendHeader("Content-Length", "6");
+        endResponse("cached");
+    }
+    virtual void logRequest(HttpStatus, int) override {}
+};
+
+
+void TestHttp::testHttpCache()
+{
+    TcpServer<CachedRequestHandler> server(QHostAddress::LocalHost, 0);
+    QVERIFY(server.start());
+    const QString &url = QStringLiteral("http://127.0.0.1:%1/config").arg(server.serverPort());
+    HttpSession session;
+    session.setCache(HttpCacheStore::memory());
+    cachedRequests = 0;
+
+    HttpResponse response = session.get(url);
+    QVERIFY(response.isOk());
+    QVERIFY(!response.isFromCache());
+    response = session.get(url);
+    QVERIFY(response.isFromCache());
+    QCOMPARE(response.body(), QByteArray("cached"));
+    QCOMPARE(cachedRequests, 1);
+
+    // no-cache revalidates it by the etag.
+    HttpRequest request(QStringLiteral("GET"), url);
+    request.setHeader(QStringLiteral("Cache-Control"), "no-cache");
+    response = session.send(request);
+    QCOMPARE(cachedRequests, 2);
+    QVERIFY(response.isFromCache());
+    QCOMPARE(response.statusCode(), 200);
+    QCOMPARE(response.body(), QByteArray("cached"));
+
+    HttpRequest network(QStringLiteral("GET"), url);
+    network.setCacheLoadControl(HttpRequest::AlwaysNetwork);
+    QVERIFY(!session.send(network).isFromCache());
+    QCOMPARE(cachedRequests, 3);
+
+    HttpRequest missing(QStringLiteral("GET"), url + QStringLiteral("?missing=1"));
+    missing.setCacheLoadControl(HttpRequest::AlwaysCache);
+    QCOMPARE(session.send(missing).statusCode(), 504);
+    QCOMPARE(cachedRequests, 3);
+}
+
+
+void TestHttp::testHttpCookieJar()
+{
+    HttpCookieJar jar;
+    QList<QNetworkCookie> cookies;
+    QNetworkCookie session("sid", "1");
+    QNetworkCookie domain("lang", "en");
+    domain.setDomain(QStringLiteral("example.com"));
+    QNetworkCookie scoped("token", "2");
+    scoped.setPath(QStringLiteral("/api"));
+    QNetworkCookie secure("secret", "3");
+    secure.setSecure(true);
+    QNetworkCookie expired("old", "4");
+    expired.setExpirationDate(QDateTime::currentDateTimeUtc().addSecs(-60));
+    cookies << session << domain << scoped << secure << expired;
+    QVERIFY(jar.setCookiesFromUrl(cookies, QUrl("https://www.example.com/")));
+    QCOMPARE(jar.size(), 4);
+
+    QCOMPARE(jar.cookieHeader(QUrl("https://www.example.com/api/items")), QByteArray("token=2; sid=1; secret=3; lang=en"));
+    QCOMPARE(jar.cookieHeader(QUrl("http://www.example.com/apix")), QByteArray("sid=1; lang=en"));
+    QCOMPARE(jar.cookieHeader(QUrl("http://static.example.com/")), QByteArray("lang=en"));
+    QVERIFY(jar.cookieHeader(QUrl("http://example.org/")).isEmpty());
+
+    // a newer cookie replaces the old one, and the cached header is dropped.
+    QNetworkCookie updated("sid", "5");
+    jar.setCookiesFromUrl(QList<QNetworkCookie>() << updated, QUrl("https://www.example.com/"));
+    QCOMPARE(jar.size(), 4);
+    QCOMPARE(jar.cookieHeader(QUrl("http://www.example.com/")), QByteArray("sid=5; lang=en"));
+    QNetworkCookie removed("lang", "");
+    removed.setDomain(QStringLiteral("example.com"));
+    removed.setExpirationDate(QDateTime::currentDateTimeUtc().addSecs(-60));
+    jar.setCookiesFromUrl(QList<QNetworkCookie>() << removed, QUrl("https://www.example.com/"));
+    QCOMPARE(jar.cookieHeader(QUrl("http://www.example.com/")), QByteArray("sid=5"));
+    QCOMPARE(jar.cookiesForUrl(QUrl("https://www.example.com/api")).size(), 3);
+}
+
+
+void TestHttp::testHttpPrewarm()
+{
+    TcpServer<CachedRequestHandler> server(QHostAddress::LocalHost, 0);
+    QVERIFY(server.start());
+    const QUrl origin(QStringLiteral("http://127.0.0.1:%1/").arg(server.serverPort()));
+    HttpSession session;
+    QCOMPARE(session.prewarm(origin, 3), 3);
+    QCOMPARE(session.connectionPoolStats().idleConnections, 3);
+    QCOMPARE(session.connectionPoolStats().createdConnections, 3ull);
+
+    QVERIFY(session.get(origin.resolved(QUrl(QStringLiteral("/config")))).isOk());
+    QCOMPARE(session.connectionPoolStats().reusedConnections, 1ull);
+    Coroutine::msleep(100);
+    QVERIFY(session.connectionPoolStats().idleConnections >= 3);
+
+    QVERIFY(session.dnsCache().isNull());
+    QCOMPARE(session.prefetchDns(QStringList() << QStringLiteral("localhost") << QStringLiteral("127.0.0.1")), 1);
+    QVERIFY(!session.dnsCache().isNull());
+}
+
+
+void TestHttp::testSharedHttpSession()
+{
+    TcpServer<CachedRequestHandler> server(QHostAddress::LocalHost, 0);
+    QVERIFY(server.start());
+    const QUrl url(QStringLiteral("http://127.0.0.1:%1/config").arg(server.serverPort()));
+    SharedHttpSession shared;
+    QSharedPointer<HttpSession> first = shared.newSession();
+    QSharedPointer<HttpSession> second = shared.newSession();
+    QCOMPARE(first->dnsCache(), shared.dnsCache());
+
+    QVERIFY(first->get(url).isOk());
+    QCOMPARE(shared.idleConnections(), 1);
+    // the connection recycled by the first session is taken by the second one.
+    QVERIFY(second->get(url).isOk());
+    QCOMPARE(second->connectionPoolStats().reusedConnections, 1ull);
+    QCOMPARE(second->connectionPoolStats().createdConnections, 0ull);
+
+    QNetworkCookie cookie("token", "abc");
+    shared.setCookiesFromUrl(QList<QNetworkCookie>() << cookie, url);
+    QCOMPARE(first->cookie(url, QStringLiteral("token")).value(), QByteArray("abc"));
+    QCOMPARE(second->cookie(url, QStringLiteral("token")).value(), QByteArray("abc"));
+}
+
+
+void TestHttp::testDispatchThreads()
+{
+    TcpServer<CachedRequestHandler> server(QHostAddress::LocalHost, 0);
+    server.setDispatchThreads(2);
+    server.setDispatchPolicy(BaseStreamServer::LeastLoadedDispatch);
+    QVERIFY(server.start());
+    Coroutine::msleep(10);
+    const QString &url = QStringLiteral("http://127.0.0.1:%1/config").arg(server.serverPort());
+    for (int i = 0; i < 4; ++i) {
+        // every session makes a new connection, which is served by one of the threads.
+        HttpSession session;
+        QVERIFY(session.get(url).isOk());
+    }
+    QCOMPARE(server.stats().acceptedConnections, 4ull);
+    server.stop(1000);
+    QCOMPARE(server.stats().activeConnections, 0);
+}
+
+
+class StreamingRequestHandler: public BaseHttpRequestHandler
+{
+public:
+    StreamingRequestHandler(QSharedPointer<SocketLike> request, BaseStreamServer *server)
+        :BaseHttpRequestHandler(request, server) {}
+protected:
+    virtual void doGET() override
+    {
+        sendResponse(HttpStatus::OK);
+        sendHeader("Connection", "keep-alive");
+        QSharedPointer<HttpResponseWriter> writer = bodyWriter("text/plain", 1024);
+        if (path == QStringLiteral("/small")) {
+            writer->write("small");
+            return;
+        }
+        for (int i = 0; i < 1000; ++i) {
+            writer->write("line " + QByteArray::number(i) + "\n");
+            if (i == 10) {
+                writer->flush();
+            }
+        }
+        writer->close();
+    }
+    virtual void logRequest(HttpStatus, int) override {}
+};
+
+
+void TestHttp::testStreamingResponse()
+{
+    TcpServer<StreamingRequestHandler> server(QHostAddress::LocalHost, 0);
+    QVERIFY(server.start());
+    const QString &base = QStringLiteral("http://127.0.0.1:%1").arg(server.serverPort());
+    HttpSession session;
+    HttpResponse response = session.get(base + QStringLiteral("/stream"));
+    QVERIFY(response.isOk());
+    QCOMPARE(response.header(QStringLiteral("Transfer-Encoding")), QByteArray("chunked"));
+    QByteArray expected;
+    for (int i = 0; i < 1000; ++i) {
+        expected.append("line " + QByteArray::number(i) + "\n");
+    }
+    QCOMPARE(response.body(), expected);
+
+    // the small body ended before any chunk goes with Content-Length, on the same connection.
+    response = session.get(base + QStringLiteral("/small"));
+    QVERIFY(response.isOk());
+    QCOMPARE(response.header(QStringLiteral("Content-Length")), QByteArray("5"));
+    QCOMPARE(response.body(), QByteArray("small"));
+    QCOMPARE(session.connectionPoolStats().reusedConnections, 1ull);
+}
+
+
+struct RouteProbe
+{
+    QString route;
+    QString id;
+    QString rest;
+};
+
+
+void TestHttp::testHttpRouter()
+{
+    HttpRouter<RouteProbe> router;
+    QVERIFY(router.add("GET", "/users", [] (RouteProbe *probe, const HttpRouteMatch &) {
+        probe->route = QStringLiteral("users");
+    }));
+    QVERIFY(router.add("GET", "/users/:id", [] (RouteProbe *probe, const HttpRouteMatch &match) {
+        probe->route = QStringLiteral("user");
+        probe->id = match.param(QLatin1String("id")).toString();
+    }));
+    QVERIFY(router.add("GET", "/users/me", [] (RouteProbe *probe, const HttpRouteMatch &) {
+        probe->route = QStringLiteral("me");
+    }));
+    QVERIFY(router.add("POST", "/users/:id/posts", [] (RouteProbe *probe, const HttpRouteMatch &match) {
+        probe->route = QStringLiteral("posts");
+        probe->id = match.value(0).toString();
+    }));
+    QVERIFY(router.add("", "/static/*path", [] (RouteProbe *probe, const HttpRouteMatch &match) {
+        probe->route = QStringLiteral("static");
+        probe->rest = match.param(QLatin1String("path")).toString();
+    }));
+    QVERIFY(!router.add("GET", "/users/:name", [] (RouteProbe *, const HttpRouteMatch &) {}));
+    QVERIFY(!router.add("GET", "/users", [] (RouteProbe *, const HttpRouteMatch &) {}));
+    QCOMPARE(router.routeTable().size(), 5);
+
+    RouteProbe probe;
+    QVERIFY(router.dispatch(&probe, QStringLiteral("GET"), QStringLiteral("/users/me")));
+    QCOMPARE(probe.route, QStringLiteral("me"));
+    QVERIFY(router.dispatch(&probe, QStringLiteral("GET"), QStringLiteral("/users/42?x=1")));
+    QCOMPARE(probe.route, QStringLiteral("user"));
+    QCOMPARE(probe.id, QStringLiteral("42"));
+    QVERIFY(router.dispatch(&probe, QStringLiteral("POST"), QStringLiteral("/users/mem/posts")));
+    QCOMPARE(probe.route, QStringLiteral("posts"));
+    QCOMPARE(probe.id, QStringLiteral("mem"));
+    QVERIFY(router.dispatch(&probe, QStringLiteral("HEAD"), QStringLiteral("/static/css/a.css")));
+    QCOMPARE(probe.rest, QStringLiteral("css/a.css"));
+    QVERIFY(router.dispatch(&probe, QStringLiteral("GET"), QStringLiteral("/users")));
+    QCOMPARE(probe.route, QStringLiteral("users"));
+
+    HttpRouteMatch match;
+    QVERIFY(!router.dispatch(&probe, QStringLiteral("DELETE"), QStringLiteral("/users/42"), &match));
+    QVERIFY(match.isMethodNotAllowed());
+    QVERIFY(!router.dispatch(&probe, QStringLiteral("GET"), QStringLiteral("/users/"), &match));
+    QVERIFY(!match.isMethodNotAllowed());
+    QVERIFY(!router.dispatch(&probe, QStringLiteral("GET"), QStringLiteral("/other"), &match));
+}
+
+
+void TestHttp::testMultipartReader()
+{
+    QByteArray file;
+    for (int i = 0; i < 1024 * 20; ++i) {
+        file.append("0123456789\r\n--x"[i % 16]);
+    }
+    const QByteArray &boundary = MultipartReader::boundaryOf("multipart/form-data; boundary=\"----qtng\"");
+    QCOMPARE(boundary, QByteArray("----qtng"));
+    QVERIFY(MultipartReader::boundaryOf("application/json").isEmpty());
+    const QByteArray &body = "preamble\r\n"
+            "------qtng\r\n"
+            "Content-Disposition: form-data; name=\"title\"\r\n"
+            "\r\n"
+            "hello\r\n"
+            "------qtng\r\n"
+            "Content-Disposition: form-data; name=\"upload\"; filename=\"a.bin\"\r\n"
+            "Content-Type: application/octet-stream\r\n"
+            "\r\n" + file + "\r\n"
+            "------qtng--\r\n";
+
+    MultipartReader reader(FileLike::bytes(body), boundary, 1024);
+    QVERIFY(reader.nextPart());
+    QCOMPARE(reader.name(), QStringLiteral("title"));
+    QVERIFY(reader.fileName().isEmpty());
+    bool ok;
+    QCOMPARE(reader.readAll(1024, &ok), QByteArray("hello"));
+    QVERIFY(ok);
+    QVERIFY(reader.nextPart());
+    QCOMPARE(reader.name(), QStringLiteral("upload"));
+    QCOMPARE(reader.fileName(), QStringLiteral("a.bin"));
+    QCOMPARE(reader.contentType(), QByteArray("application/octet-stream"));
+    QSharedPointer<FileLike> sink = FileLike::bytes(QByteArray());
+    QCOMPARE(reader.copyTo(sink), static_cast<qint64>(file.size()));
+    QVERIFY(sink->seek(0));
+    QCOMPARE(sink->readall(&ok), file);
+    QVERIFY(!reader.nextPart());
+    QVERIFY(!reader.hasError());
+
+    MultipartReader truncated(FileLike::bytes(body.left(body.size() - 100)), boundary, 1024);
+    QVERIFY(truncated.nextPart());
+    QVERIFY(truncated.nextPart());
+    QCOMPARE(truncated.copyTo(FileLike::bytes(QByteArray())), static_cast<qint64>(-1));
+    QVERIFY(truncated.hasError());
+}
+
+
+void TestHttp::testJsonView()
+{
+    const QByteArray &json = "{\"data\": {\"items\": [{\"name\": \"a\\\"b\"}, {\"name\": \"\\u4e2d\", \"tags\": []}],"
+                             " \"total\": 2, \"ratio\": 0.5, \"ok\": true, \"none\": null}, \"k\\u0065y\": \"x\"}";
+    JsonView root = JsonView::parse(json);
+    QCOMPARE(root.type(), JsonView::Object);
+    QCOMPARE(root.count(), 2);
+    QCOMPARE(root.keys(), QList<QByteArray>() << "data" << "key");
+    QCOMPARE(root.value("key").toString(), QStringLiteral("x"));
+    JsonView data = root["data"];
+    QCOMPARE(data.value("total").toInteger(), static_cast<qint64>(2));
+    QCOMPARE(data.value("ratio").toDouble(), 0.5);
+    QVERIFY(data.value("ok").toBool());
+    QVERIFY(data.value("none").isNull());
+    QVERIFY(!data.value("missing").isValid());
+    QCOMPARE(data.value("items").count(), 2);
+    QCOMPARE(root.path("data.items.0.name").toUtf8(), QByteArray("a\"b"));
+    QCOMPARE(root.path("data.items.1.name").toString(), QString(QChar(0x4e2d)));
+    QCOMPARE(root.path("data.items.1.tags").count(), 0);
+    QVERIFY(!root.path("data.items.2").isValid());
+    QCOMPARE(data.value("items").at(0).raw(), QByteArray("{\"name\": \"a\\\"b\"}"));
+    QCOMPARE(data.value("total").toJsonValue().toInt(), 2);
+    QCOMPARE(JsonView::parse("[1, 2, 3]").at(2).toInteger(), static_cast<qint64>(3));
+    QCOMPARE(JsonView::parse(" 42 ").toInteger(), static_cast<qint64>(42));
+    QVERIFY(!JsonView::parse("{\"a\": [1, 2}").isValid());
+    QVERIFY(!JsonView::parse("{\"a\": \"b}").isValid());
+    QCOMPARE(JsonView::read(FileLike::bytes("{\"a\": 1}")).value("a").toInteger(), static_cast<qint64>(1));
+}
+
+
+void TestHttp::testBasicHeaderSplitter()
+{
+    Socket server;
+    QVERIFY(server.bind(QHostAddress::LocalHost, 0));
+    QVERIFY(server.listen(1));
+    QSharedPointer<Socket> client(new Socket());
+    QVERIFY(client->connect(QHostAddress::LocalHost, server.localPort()));
+    QSharedPointer<Socket> request(server.accept());
+    QVERIFY(!request.isNull());
+    CoroutineGroup operations;
+    operations.spawn([client] {
+        client->sendall(QByteArray("POST / HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhel"));
+        Coroutine::msleep(20);
+        client->sendall(QByteArray("lo\r\n0\r\n\r\n"));
+    });
+    // bound to Socket, the bytes are received without SocketLike.
+    BasicHeaderSplitter<Socket> splitter(request);
+    HeaderSplitter::Error error;
+    QCOMPARE(splitter.nextLine(&error), QByteArray("POST / HTTP/1.1"));
+    QCOMPARE(error, HeaderSplitter::NoError);
+    const QList<HttpHeader> &headers = splitter.headers(16, &error);
+    QCOMPARE(error, HeaderSplitter::NoError);
+    QCOMPARE(headers.size(), 2);
+    QCOMPARE(headers.at(1).value, QByteArray("chunked"));
+    BasicChunkedBlockReader<Socket> reader(request, splitter.buf);
+    ChunkedBlockReader::Error chunkedError;
+    QCOMPARE(reader.nextBlock(1024, &chunkedError), QByteArray("hello"));
+    QCOMPARE(chunkedError, ChunkedBlockReader::NoError);
+    QCOMPARE(reader.nextBlock(1024, &chunkedError), QByteArray());
+    QCOMPARE(chunkedError, ChunkedBlockReader::NoError);
+    operations.joinall();
+}
+
+
+void TestHttp::testAlternativeServices()
+{
+    const QList<HttpAlternativeService> &services = HttpAlternativeService::parse(
+                "h3=\":443\"; ma=3600, h3-29=\"alt.example.com:8443\", h2=\":443\"; ma=0", QStringLiteral("example.com"), 1000);
+    QCOMPARE(services.size(), 2);
+    QCOMPARE(services.at(0).protocol, QByteArray("h3"));
+    QCOMPARE(services.at(0).host, QStringLiteral("example.com"));
+    QCOMPARE(services.at(0).port, static_cast<quint16>(443));
+    QCOMPARE(services.at(0).expires, static_cast<qint64>(1000 + 3600 * 1000));
+    QCOMPARE(services.at(1).protocol, QByteArray("h3-29"));
+    QCOMPARE(services.at(1).host, QStringLiteral("alt.example.com"));
+    QCOMPARE(services.at(1).port, static_cast<quint16>(8443));
+    QVERIFY(HttpAlternativeService::parse("clear", QStringLiteral("example.com"), 0).isEmpty());
+}
+
+
+class EchoWebSocketHandler: public BaseHttpRequestHandler
+{
+public:
+    EchoWebSocketHandler(QSharedPointer<SocketLike> request, BaseStreamServer *server)
+        :BaseHttpRequestHandler(request, server) {}
+protected:
+    virtual void doGET() override
+    {
+        QSharedPointer<WebSocket> ws = upgradeToWebSocket();
+        if (ws.isNull()) {
+            return;
+        }
+        QByteArray message;
+        WebSocket::MessageType type;
+        while (ws->receive(&message, &type)) {
+            ws->send(message, type);
+        }
+    }
+};
+
+
+void TestHttp::testWebSocket()
+{
+    TcpServer<EchoWebSocketHandler> server(QHostAddress::LocalHost, 0);
+    QVERIFY(server.start());
+    HttpSession session;
+    const QUrl url(QStringLiteral("ws://127.0.0.1:%1/echo").arg(server.serverPort()));
+    QSharedPointer<WebSocket> ws = WebSocket::connect(&session, url);
+    QVERIFY(!ws.isNull());
+    QVERIFY(ws->sendText(QStringLiteral("hello")));
+    const QByteArray large(1024 * 200, 'x');
+    QVERIFY(ws->send(large));
+    QByteArray message;
+    WebSocket::MessageType type;
+    QVERIFY(ws->receive(&message, &type));
+    QCOMPARE(type, WebSocket::TextMessage);
+    QCOMPARE(message, QByteArray("hello"));
+    QVERIFY(ws->receive(&message, &type));
+    QCOMPARE(type, WebSocket::BinaryMessage);
+    QCOMPARE(message, large);
+    ws->close();
+    QVERIFY(!ws->isOpen());
+    QCOMPARE(ws->closeCode(), static_cast<int>(WebSocket::NormalClosure));
+    QVERIFY(!ws->receive(&message));
+
+    QCOMPARE(WebSocket::acceptKey("dGhlIHNhbXBsZSBub25jZQ=="), QByteArray("s3pPLMBiTxaQ9kWxuDXDRNg8k5o="));
+    QCOMPARE(session.get(url.toString().replace(QStringLiteral("ws:"), QStringLiteral("http:"))).statusCode(), 400);
+}
+
+
+// serves the connections by serveHttpRequest(), so http/2 is spoken by prior knowledge.
+template<typename RequestHandler>
+class HttpServer: public BaseStreamServer
+{
+public:
+    HttpServer(const QHostAddress &serverAddress, quint16 serverPort)
+        :BaseStreamServer(serverAddress, serverPort) {}
+protected:
+    virtual void processRequest(QSharedPointer<SocketLike> request) override
+    {
+        serveHttpRequest<RequestHandler>(request, this);
+    }
+};
+
+
+class EchoHttpRequestHandler: public BaseHttpRequestHandler
+{
+public:
+    EchoHttpRequestHandler(QSharedPointer<SocketLike> request, BaseStreamServer *server)
+        :BaseHttpRequestHandler(request, server) {}
+protected:
+    virtual void doGET() override
+    {
+        if (path == QStringLiteral("/text")) {
+            sendResponse(HttpStatus::OK);
+            QSharedPointer<HttpResponseWriter> writer = bodyWriter("text/plain");
+            writer->write(QByteArray(1024 * 64, 'z'));
+            writer->close();
+            return;
+        }
+        const QByteArray &body = path == QStringLiteral("/large") ? QByteArray(1024 * 200, 'x') : path.toUtf8();
+        sendResponse(HttpStatus::OK);
+        sendHeader("Content-Length", QByteArray::number(body.size()));
+        endResponse(body);
+    }
+    virtual void doPOST() override
+    {
+        QSharedPointer<FileLike> reader = bodyReader(1024 * 1024);
+        if (reader.isNull()) {
+            return;
+        }
+        bool ok;
+        const QByteArray &body = reader->readall(&ok);
+        if (!ok) {
+            sendError(HttpStatus::BadRequest);
+            return;
+        }
+        sendResponse(HttpStatus::OK);
+        sendHeader("Content-Length", QByteArray::number(body.size()));
+        endResponse(body);
+    }
+    virtual void logRequest(HttpStatus, int) override {}
+};
+
+
+static QList<HttpHeader> parseHeaders(const QByteArray &text)
+{
+    QList<HttpHeader> headers;
+    for (const QByteArray &line: text.split('\n')) {
+        const int colon = line.indexOf(": ");
+        if (colon > 0) {
+            headers.append(HttpHeader(QString::fromLatin1(line.left(colon)), line.mid(colon + 2)));
+        }
+    }
+    return headers;
+}
+
+
+static QByteArray formatHeaders(const QList<HttpHeader> &headers)
+{
+    QByteArray text;
+    for (const HttpHeader &header: headers) {
+        text.append(header.name.toLatin1() + ": " + header.value + "\n");
+    }
+    return text;
+}
+
+
+// rfc 7541 appendix c.3 and c.4, the same requests without and with huffman coding.
+static const char * const hpackRequests[3] = {
+    ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n",
+    ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n",
+    ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n",
+};
+
+
+static const char * const hpackRequestBlocks[2][3] = {
+    {
+        "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+        "8286 84be 5808 6e6f 2d63 6163 6865",
+        "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+    }, {
+        "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+        "8286 84be 5886 a8eb 1064 9cbf",
+        "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+    }
+};
+
+
+// rfc 7541 appendix c.5 and c.6, the responses evicting fields from a table of 256 bytes.
+static const char * const hpackResponses[3] = {
+    ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n",
+    ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n",
+    ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\nlocation: https://www.example.com\n"
+    "content-encoding: gzip\nset-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n",
+};
+
+
+// the examples assume the table size set by SETTINGS, here it is the size update 3fe101 before the first block.
+static const char * const hpackResponseBlocks[2][3] = {
+    {
+        "3fe101 4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32"
+        " 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+        "4803 3330 37c1 c0bf",
+        "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 7738"
+        " 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33"
+        " 3630 303b 2076 6572 7369 6f6e 3d31",
+    }, {
+        "3fe101 4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad"
+        " 1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+        "4883 640e ffc1 c0bf",
+        "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7"
+        " b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07",
+    }
+};
+
+
+void TestHttp::testHpack()
+{
+    for (int coding = 0; coding < 2; ++coding) {
+        HpackDecoder requestDecoder;
+        HpackDecoder responseDecoder;
+        for (int i = 0; i < 3; ++i) {
+            QList<HttpHeader> headers;
+            QVERIFY(requestDecoder.decode(QByteArray::fromHex(hpackRequestBlocks[coding][i]), &headers));
+            QCOMPARE(formatHeaders(headers), QByteArray(hpackRequests[i]));
+            headers.clear();
+            QVERIFY(responseDecoder.decode(QByteArray::fromHex(hpackResponseBlocks[coding][i]), &headers));
+            QCOMPARE(formatHeaders(headers), QByteArray(hpackResponses[i]));
+        }
+    }
+
+    // the encoder indexes the same fields as c.4, and uses huffman coding where it is shorter.
+    HpackEncoder encoder;
+    for (int i = 0; i < 3; ++i) {
+        QCOMPARE(encoder.encode(parseHeaders(hpackRequests[i])), QByteArray::fromHex(hpackRequestBlocks[1][i]));
+    }
+
+    // a small block of indexed fields expands beyond the limits.
+    HpackDecoder flooded;
+    QList<HttpHeader> headers;
+    bool tooLarge = false;
+    QVERIFY(!flooded.decode(QByteArray(HpackDecoder::MaxHeaderCount + 1, '\x82'), &headers, &tooLarge));
+    QVERIFY(tooLarge);
+    HpackDecoder empty;
+    QVERIFY(!empty.decode(QByteArray::fromHex("be"), &headers, &tooLarge));
+    QVERIFY(!tooLarge);
+}
+
+
+void TestHttp::testHttp2()
+{
+#ifdef QTNG_NO_CRYPTO
+    QSKIP("h2 is negotiated by the alpn of tls.");
+#else
+    const SslConfiguration &config = SslConfiguration::testPurpose("Goldfish", "CN", "Example");
+    AlpnSslServer server(QHostAddress::LocalHost, 0, config);
+    const AlpnSslServer::HandlerFactory factory = [] (QSharedPointer<SocketLike> request, BaseStreamServer *streamServer) {
+        serveHttpRequest<EchoHttpRequestHandler>(request, streamServer);
+    };
+    server.addHandler("h2", factory);
+    server.addHandler("http/1.1", factory);
+    QVERIFY(server.start());
+    const QString &base = QStringLiteral("https://127.0.0.1:%1").arg(server.serverPort());
+    HttpSession session;
+    session.setDefaultVersion(HttpVersion::Http2_0);
+    HttpResponse response = session.get(base + QStringLiteral("/first"));
+    QVERIFY(response.isOk());
+    QVERIFY(response.version() == HttpVersion::Http2_0);
+    QCOMPARE(response.body(), QByteArray("/first"));
+
+    // the streams run at the same time on one connection, the large body exceeds the initial window.
+    QByteArrayList bodies;
+    for (int i = 0; i < 4; ++i) {
+        bodies.append(QByteArray());
+    }
+    CoroutineGroup operations;
+    for (int i = 0; i < 4; ++i) {
+        operations.spawn([&session, &bodies, base, i] {
+            const QString &path = i == 0 ? QStringLiteral("/large") : QStringLiteral("/stream%1").arg(i);
+            HttpResponse response = session.get(base + path);
+            if (response.isOk() && response.version() == HttpVersion::Http2_0) {
+                bodies[i] = response.body();
+            }
+        });
+    }
+    operations.joinall();
+    QCOMPARE(bodies.at(0), QByteArray(1024 * 200, 'x'));
+    QCOMPARE(bodies.at(3), QByteArray("/stream3"));
+    response = session.post(base + QStringLiteral("/echo"), QByteArray("posted"));
+    QCOMPARE(response.body(), QByteArray("posted"));
+    QCOMPARE(server.stats().acceptedConnections, 1ull);
+#endif
+}
+
+
+static QByteArray http2Frame(quint8 type, quint8 flags, quint32 streamId, const QByteArray &payload)
+{
+    QByteArray frame(9, '\0');
+    frame[0] = static_cast<char>(payload.size() >> 16);
+    frame[1] = static_cast<char>(payload.size() >> 8);
+    frame[2] = static_cast<char>(payload.size());
+    frame[3] = static_cast<char>(type);
+    frame[4] = static_cast<char>(flags);
+    for (int i = 0; i < 4; ++i) {
+        frame[5 + i] = static_cast<char>(streamId >> (24 - i * 8));
+    }
+    return frame + payload;
+}
+
+
+void TestHttp::testContinuationFlood()
+{
+    HttpServer<EchoHttpRequestHandler> server(QHostAddress::LocalHost, 0);
+    QVERIFY(server.start());
+    QSharedPointer<Socket> client(new Socket());
+    QVERIFY(client->connect(QHostAddress::LocalHost, server.serverPort()));
+    // speaks http/2 by prior knowledge, then the header block of stream 1 goes beyond 64k without END_HEADERS.
+    QByteArray data("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+    data.append(http2Frame(0x4, 0, 0, QByteArray()));
+    const QByteArray fragment(1024 * 16, '\0');
+    data.append(http2Frame(0x1, 0, 1, fragment));
+    for (int i = 0; i < 4; ++i) {
+        data.append(http2Frame(0x9, 0, 1, fragment));
+    }
+    QCOMPARE(client->sendall(data), data.size());
+
+    quint32 errorCode = 0;
+    bool goneAway = false;
+    {
+        Timeout _(5.0);
+        while (!goneAway) {
+            const QByteArray &header = client->recvall(9);
+            if (header.size() != 9) {
+                break;
+            }
+            const uchar *h = reinterpret_cast<const uchar *>(header.constData());
+            const int length = (h[0] << 16) | (h[1] << 8) | h[2];
+            const QByteArray &payload = client->recvall(length);
+            if (payload.size() != length) {
+                break;
+            }
+            if (h[3] == 0x7 && length >= 8) {
+                errorCode = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(payload.constData()) + 4);
+                goneAway = true;
+            }
+        }
+    }
+    QVERIFY(goneAway);
+    // ENHANCE_YOUR_CALM
+    QCOMPARE(errorCode, 0xbu);
+}
+
+
+void TestHttp::testPipelining()
+{
+    HttpServer<EchoHttpRequestHandler> server(QHostAddress::LocalHost, 0);
+    QVERIFY(server.start());
+    const QString &base = QStringLiteral("http://127.0.0.1:%1").arg(server.serverPort());
+    HttpSession session;
+    session.setPipeliningDepth(4);
+    QVERIFY(session.get(base + QStringLiteral("/first")).isOk());
+
+    // the requests are written back-to-back on the connection of the first one.
+    QByteArrayList bodies;
+    for (int i = 0; i < 4; ++i) {
+        bodies.append(QByteArray());
+    }
+    CoroutineGroup operations;
+    for (int i = 0; i < 4; ++i) {
+        operations.spawn([&session, &bodies, base, i] {
+            HttpResponse response = session.get(base + QStringLiteral("/p%1").arg(i));
+            if (response.isOk()) {
+                bodies[i] = response.body();
+            }
+        });
+    }
+    operations.joinall();
+    for (int i = 0; i < 4; ++i) {
+        QCOMPARE(bodies.at(i), QByteArray("/p" + QByteArray::number(i)));
+    }
+    QCOMPARE(server.stats().acceptedConnections, 1ull);
+}
+
+
+void TestHttp::testPipelinedContinue()
+{
+    HttpServer<EchoHttpRequestHandler> server(QHostAddress::LocalHost, 0);
+    QVERIFY(server.start());
+    QSharedPointer<Socket> client(new Socket());
+    QVERIFY(client->connect(QHostAddress::LocalHost, server.serverPort()));
+    // the response of GET is held back for the pipelined POST, it must go before the "100 Continue" of POST.
+    const QByteArray requests = "GET /first HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                                "POST /echo HTTP/1.1\r\nHost: localhost\r\nContent-Length: 4\r\n"
+                                "Expect: 100-continue\r\n\r\n";
+    QCOMPARE(client->sendall(requests), requests.size());
+    QByteArray received;
+    {
+        Timeout _(5.0);
+        while (!received.contains("100 Continue\r\n\r\n")) {
+            const QByteArray &data = client->recv(1024 * 4);
+            if (data.isEmpty()) {
+                break;
+            }
+            received.append(data);
+        }
+    }
+    QVERIFY(received.startsWith("HTTP/1.1 200"));
+    const int firstBody = received.indexOf("/first");
+    QVERIFY(firstBody > 0);
+    QVERIFY(firstBody < received.indexOf("HTTP/1.1 100 Continue"));
+
+    QCOMPARE(client->sendall(QByteArray("body")), 4);
+    received.clear();
+    {
+        Timeout _(5.0);
+        while (!received.endsWith("body")) {
+            const QByteArray &data = client->recv(1024 * 4);
+            if (data.isEmpty()) {
+                break;
+            }
+            received.append(data);
+        }
+    }
+    QVERIFY(received.startsWith("HTTP/1.1 200"));
+    QVERIFY(received.endsWith("\r\n\r\nbody"));
+}
+
+
+void TestHttp::testSendMany()
+{
+    HttpServer<EchoHttpRequestHandler> server(QHostAddress::LocalHost, 0);
+    QVERIFY(server.start());
+    const QString &base = QStringLiteral("http://127.0.0.1:%1").arg(server.serverPort());
+    HttpSession session;
+    QList<HttpRequest> requests;
+    for (int i = 0; i < 8; ++i) {
+        requests.append(HttpRequest(QStringLiteral("GET"), base + QStringLiteral("/batch%1").arg(i)));
+    }
+    QSharedPointer<HttpBatch> batch = session.sendMany(requests, 3);
+    QCOMPARE(batch->size(), 8);
+    int index;
+    HttpResponse response;
+    QVERIFY(batch->next(&index, &response));
+    QCOMPARE(response.body(), QByteArray("/batch" + QByteArray::number(index)));
+    QList<HttpResponse> responses = batch->all();
+    QCOMPARE(responses.size(), 8);
+    for (int i = 0; i < 8; ++i) {
+        QCOMPARE(responses[i].body(), QByteArray("/batch" + QByteArray::number(i)));
+    }
+    // at most three connections are open at the same time.
+    QVERIFY(server.stats().acceptedConnections <= 3ull);
+}
+
+
+void TestHttp::testStreamedBodies()
+{
+    HttpServer<EchoHttpRequestHandler> server(QHostAddress::LocalHost, 0);
+    QVERIFY(server.start());
+    const QString &base = QStringLiteral("http://127.0.0.1:%1").arg(server.serverPort());
+    HttpSession session;
+
+    // the generated body is sent chunked, and read by the handler through bodyReader().
+    int pieces = 0;
+    HttpRequest request(QStringLiteral("POST"), base + QStringLiteral("/upload"));
+    request.setBody([&pieces] () -> QByteArray {
+        if (pieces == 100) {
+            return QByteArray();
+        }
+        const char c = static_cast<char>('a' + pieces++ % 26);
+        return QByteArray(1024, c);
+    });
+    request.setStreamResponse(true);
+    HttpResponse response = session.send(request);
+    QVERIFY(response.isOk());
+    QSharedPointer<FileLike> reader = response.bodyReader();
+    QVERIFY(!reader.isNull());
+    bool ok;
+    const QByteArray &body = reader->readall(&ok);
+    QVERIFY(ok);
+    QCOMPARE(body.size(), 1024 * 100);
+    QCOMPARE(body.at(1024 * 27), 'b');
+
+    // the compressed body is decoded as it is read.
+    response = session.get(base + QStringLiteral("/text"));
+    QVERIFY(response.isOk());
+    QVERIFY(!response.header(QStringLiteral("Content-Encoding")).isEmpty());
+    QCOMPARE(response.body(), QByteArray(1024 * 64, 'z'));
+}
+
+
+QTEST_MAIN(TestHttp)
+
+#include "test_http.moc"
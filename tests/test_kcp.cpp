@@ -1,3 +1,4 @@
+#include <QtTest>
 #include <QtCore/qcoreapplication.h>
 #include <QtCore/qfile.h>
 #include <QElapsedTimer>
@@ -6,6 +7,270 @@
 
 using namespace qtng;
 
+class TestKcp: public QObject
+{
+    Q_OBJECT
+private slots:
+    void testSessions();
+    void testEncryption();
+    void testCompressionAndFec();
+    void testNestedFecShard();
+    void testCongestionControl();
+    void testShardedServer();
+};
+
+
+static void echoSession(QSharedPointer<KcpSocket> request)
+{
+    while (true) {
+        const QByteArray &data = request->recv(1024 * 8);
+        if (data.isEmpty() || request->sendall(data) != data.size()) {
+            return;
+        }
+    }
+}
+
+
+// echoes every session accepted by the master socket, the sessions are appended to the list.
+static QSharedPointer<KcpSocket> startEchoServer(CoroutineGroup *operations, QList<QSharedPointer<KcpSocket>> *sessions)
+{
+    QSharedPointer<KcpSocket> server(new KcpSocket(Socket::IPv4Protocol));
+    server->setMode(KcpSocket::Loopback);
+    QHostAddress localHost(QHostAddress::LocalHost);
+    if (!server->bind(localHost, 0) || !server->listen(50)) {
+        return QSharedPointer<KcpSocket>();
+    }
+    operations->spawn([server, operations, sessions] {
+        while (true) {
+            QSharedPointer<KcpSocket> request = server->accept();
+            if (request.isNull()) {
+                return;
+            }
+            sessions->append(request);
+            operations->spawn([request] {
+                echoSession(request);
+            });
+        }
+    });
+    return server;
+}
+
+
+// sends and receives at the same time, so the windows of both sides keep moving.
+static bool echo(KcpSocket *client, const QByteArray &data)
+{
+    CoroutineGroup operations;
+    bool sent = false;
+    operations.spawn([client, data, &sent] {
+        sent = client->sendall(data) == data.size();
+    });
+    const QByteArray &received = client->recvall(data.size());
+    operations.joinall();
+    return sent && received == data;
+}
+
+
+static QByteArray testData(int size)
+{
+    QByteArray data(size, Qt::Uninitialized);
+    for (int i = 0; i < size; ++i) {
+        data[i] = static_cast<char>(i % 251);
+    }
+    return data;
+}
+
+
+void TestKcp::testSessions()
+{
+    CoroutineGroup operations;
+    QList<QSharedPointer<KcpSocket>> sessions;
+    QSharedPointer<KcpSocket> server = startEchoServer(&operations, &sessions);
+    QVERIFY(!server.isNull());
+    // the sessions from many ports of one host are told apart, and updated by the scheduler of master socket.
+    const QByteArray &data = testData(1024 * 256);
+    QList<bool> results;
+    CoroutineGroup clients;
+    for (int i = 0; i < 3; ++i) {
+        results.append(false);
+        clients.spawn([&results, &data, server, i] {
+            KcpSocket client(Socket::IPv4Protocol);
+            client.setMode(KcpSocket::Loopback);
+            if (client.connect(QHostAddress::LocalHost, server->localPort())) {
+                results[i] = echo(&client, data);
+            }
+        });
+    }
+    {
+        Timeout _(10.0);
+        clients.joinall();
+    }
+    QCOMPARE(results, QList<bool>() << true << true << true);
+    QCOMPARE(sessions.size(), 3);
+
+    const KcpStats &stats = sessions.first()->stats();
+    QCOMPARE(stats.bytesReceived, static_cast<quint64>(data.size()));
+    QVERIFY(stats.packetsSent > 0);
+    QVERIFY(stats.segmentsSent > 0);
+    QCOMPARE(stats.receiveQueue, 0u);
+}
+
+
+void TestKcp::testEncryption()
+{
+#ifdef QTNG_NO_CRYPTO
+    QSKIP("no cipher without crypto.");
+#else
+    const QByteArray key(32, 'k');
+    CoroutineGroup operations;
+    QList<QSharedPointer<KcpSocket>> sessions;
+    QSharedPointer<KcpSocket> server = startEchoServer(&operations, &sessions);
+    QVERIFY(!server.isNull());
+    QVERIFY(server->setEncryption(AeadCipher::AES256GCM, key));
+
+    {
+        Timeout _(5.0);
+        KcpSocket client(Socket::IPv4Protocol);
+        client.setMode(KcpSocket::Loopback);
+        QVERIFY(client.setEncryption(AeadCipher::AES256GCM, key));
+        QVERIFY(client.connect(QHostAddress::LocalHost, server->localPort()));
+        QVERIFY(echo(&client, testData(1024 * 64)));
+    }
+
+    // the datagrams sealed by another key are dropped before a session is made for them.
+    bool timedout = false;
+    try {
+        Timeout _(0.5);
+        KcpSocket client(Socket::IPv4Protocol);
+        client.setMode(KcpSocket::Loopback);
+        client.setEncryption(AeadCipher::AES256GCM, QByteArray(32, 'x'));
+        if (client.connect(QHostAddress::LocalHost, server->localPort())) {
+            client.sendall("hello");
+            client.recv(1024);
+        }
+    } catch (TimeoutException &) {
+        timedout = true;
+    }
+    QVERIFY(timedout);
+    QCOMPARE(sessions.size(), 1);
+#endif
+}
+
+
+void TestKcp::testCompressionAndFec()
+{
+    CoroutineGroup operations;
+    QList<QSharedPointer<KcpSocket>> sessions;
+    QSharedPointer<KcpSocket> server = startEchoServer(&operations, &sessions);
+    QVERIFY(!server.isNull());
+    NetworkImpairment impairment;
+    impairment.lossRate = 0.05f;
+
+    Timeout _(10.0);
+    KcpSocket client(Socket::IPv4Protocol);
+    client.setMode(KcpSocket::Loopback);
+    QVERIFY(client.setCompressionCodec(KcpSocket::ZlibCompression));
+    client.setForwardErrorCorrection(4, 2);
+    client.setImpairer(QSharedPointer<NetworkImpairer>(new NetworkImpairer(impairment)));
+    QVERIFY(client.connect(QHostAddress::LocalHost, server->localPort()));
+    const QByteArray data(1024 * 128, 'a');
+    QVERIFY(echo(&client, data));
+
+    const KcpStats &stats = client.stats();
+    QVERIFY(stats.uncompressedBytes >= static_cast<quint64>(data.size()));
+    QVERIFY(stats.compressedBytes < stats.uncompressedBytes);
+    QCOMPARE(sessions.size(), 1);
+    // the parity shards are decoded by the peer without being asked.
+    QVERIFY(sessions.first()->fecStats().parityShards > 0);
+    QVERIFY(sessions.first()->fecStats().dataShards > 0);
+}
+
+
+// a forged datagram of shards in shards is dropped by the first level, instead of recursing for every header.
+void TestKcp::testNestedFecShard()
+{
+    CoroutineGroup operations;
+    QList<QSharedPointer<KcpSocket>> sessions;
+    QSharedPointer<KcpSocket> server = startEchoServer(&operations, &sessions);
+    QVERIFY(!server.isNull());
+
+    Timeout _(10.0);
+    QByteArray forged;
+    while (forged.size() + 8 <= 1024 * 60) {
+        // type, group id, index, data shards, parity shards.
+        forged.append("\x05\x00\x00\x00\x01\x00\x01\x00", 8);
+    }
+    forged.append("\x01\x00\x00", 3);
+    Socket attacker(Socket::IPv4Protocol, Socket::UdpSocket);
+    QCOMPARE(attacker.sendto(forged, QHostAddress::LocalHost, server->localPort()), forged.size());
+    while (sessions.isEmpty()) {
+        Coroutine::msleep(10);
+    }
+    QCOMPARE(sessions.first()->fecStats().dataShards, 0ull);
+
+    // the server is still serving.
+    KcpSocket client(Socket::IPv4Protocol);
+    client.setMode(KcpSocket::Loopback);
+    QVERIFY(client.connect(QHostAddress::LocalHost, server->localPort()));
+    QVERIFY(echo(&client, testData(1024 * 16)));
+}
+
+
+void TestKcp::testCongestionControl()
+{
+    CoroutineGroup operations;
+    QList<QSharedPointer<KcpSocket>> sessions;
+    QSharedPointer<KcpSocket> server = startEchoServer(&operations, &sessions);
+    QVERIFY(!server.isNull());
+
+    Timeout _(10.0);
+    const QByteArray &data = testData(1024 * 128);
+    KcpSocket paced(Socket::IPv4Protocol);
+    paced.setMode(KcpSocket::Loopback);
+    paced.setCongestionControl(KcpSocket::FixedRateCongestionControl);
+    paced.setPacingRate(1024 * 1024);
+    QCOMPARE(paced.congestionControl(), KcpSocket::FixedRateCongestionControl);
+    QCOMPARE(paced.pacingRate(), static_cast<quint64>(1024 * 1024));
+    QVERIFY(paced.connect(QHostAddress::LocalHost, server->localPort()));
+    QElapsedTimer timer;
+    timer.start();
+    QVERIFY(echo(&paced, data));
+    // 128k at 1m/s takes about 125 msecs.
+    QVERIFY(timer.elapsed() >= 80);
+
+    KcpSocket bbr(Socket::IPv4Protocol);
+    bbr.setMode(KcpSocket::Loopback);
+    bbr.setCongestionControl(KcpSocket::BbrCongestionControl);
+    QVERIFY(bbr.connect(QHostAddress::LocalHost, server->localPort()));
+    QVERIFY(echo(&bbr, data));
+    // setMode() keeps the congestion control.
+    bbr.setMode(KcpSocket::Internet);
+    QCOMPARE(bbr.congestionControl(), KcpSocket::BbrCongestionControl);
+}
+
+
+void TestKcp::testShardedServer()
+{
+    KcpShardedServer server(QHostAddress::LocalHost, 0, 2);
+    server.setMode(KcpSocket::Loopback);
+    if (!server.start(echoSession)) {
+        QSKIP("the udp sockets can not share a port without SO_REUSEPORT.");
+    }
+    QCOMPARE(server.shards(), 2);
+    QVERIFY(server.serverPort() != 0);
+    const QByteArray &data = testData(1024 * 64);
+    {
+        Timeout _(10.0);
+        for (int i = 0; i < 4; ++i) {
+            KcpSocket client(Socket::IPv4Protocol);
+            client.setMode(KcpSocket::Loopback);
+            QVERIFY(client.connect(QHostAddress::LocalHost, server.serverPort()));
+            QVERIFY(echo(&client, data));
+        }
+    }
+    server.stop();
+}
+
+
 void kcpWorker(QSharedPointer<KcpSocket> request)
 {
     QByteArray buf(1024 * 8, Qt::Uninitialized);
@@ -93,25 +358,30 @@ void kcpClient(const QString &remoteHost, const QString &filePath)
     qDebug() << message;
 }
 
+// runs the tests without arguments. the file transfer between two hosts is run by hand:
+//     client: test_kcp <remotehost> <filepath>
+//     server: test_kcp server
 int main(int argc, char **argv)
 {
-//    QCoreApplication app(argc, argv); Q_UNUSED(app);
-    QSharedPointer<Coroutine> t;
-    if (argc == 3) {
-        QString hostName = QString::fromLocal8Bit(argv[1]);
-        QString filepath = QString::fromLocal8Bit(argv[2]);
-        t.reset(Coroutine::spawn([hostName, filepath]{
-            kcpClient(hostName, filepath);
-        }));
-    } else if (argc == 1) {
-        t.reset(Coroutine::spawn([]{
-            kcpServer();
-        }));
-    } else {
-        const QString &programName = QString::fromLatin1(argc > 0 ? argv[0] : "kcp_sendfile");
-        const QString usage = QStringLiteral("Usage: \n\t Client: %1 <remotehost> <filepath>\n\tServer: %1\n");
-        printf(usage.toLatin1());
-    }
-    t->join();
-    return 0;
+    if (argc == 3 || (argc == 2 && qstrcmp(argv[1], "server") == 0)) {
+        QSharedPointer<Coroutine> t;
+        if (argc == 3) {
+            QString hostName = QString::fromLocal8Bit(argv[1]);
+            QString filepath = QString::fromLocal8Bit(argv[2]);
+            t.reset(Coroutine::spawn([hostName, filepath]{
+                kcpClient(hostName, filepath);
+            }));
+        } else {
+            t.reset(Coroutine::spawn([]{
+                kcpServer();
+            }));
+        }
+        t->join();
+        return 0;
+    }
+    QCoreApplication app(argc, argv);
+    TestKcp test;
+    return QTest::qExec(&test, argc, argv);
 }
+
+#include "test_kcp.moc"
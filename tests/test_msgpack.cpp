@@ -4,6 +4,23 @@
 
 using namespace qtng;
 
+struct TestPoint
+{
+    qint32 x;
+    qint32 y;
+    QString label;
+};
+QTNG_MSGPACK_FIELDS(TestPoint, x, y, label)
+
+struct TestShape
+{
+    QList<TestPoint> points;
+    quint8 kind;
+};
+QTNG_MSGPACK_FIELDS_AS_ARRAY(TestShape, points, kind)
+
+QTNG_MSGPACK_EXT(QUuid, 7)
+
 class TestMsgPack: public QObject
 {
     Q_OBJECT
@@ -21,6 +38,13 @@ private slots:
     void testString();
     void testByteArray();
     void testDateTime();
+    void testFields();
+    void testDecoder();
+    void testStreamingWriter();
+    void testDocument();
+    void testUtf8();
+    void testExtTypes();
+    void testJson();
 };
 
 
@@ -364,5 +388,234 @@ void TestMsgPack::testDateTime()
     QCOMPARE(dt, t);
 }
 
+void TestMsgPack::testFields()
+{
+    TestShape shape;
+    shape.kind = 3;
+    shape.points.append(TestPoint { 1, -2, QStringLiteral("a") });
+    shape.points.append(TestPoint { 300, 70000, QStringLiteral("b") });
+    QByteArray bs;
+    MsgPackStream os(&bs, QIODevice::WriteOnly);
+    os << shape;
+    QVERIFY(os.status() == MsgPackStream::Ok);
+
+    MsgPackStream is(bs);
+    TestShape t;
+    is >> t;
+    QVERIFY(is.status() == MsgPackStream::Ok);
+    QCOMPARE(t.kind, shape.kind);
+    QCOMPARE(t.points.size(), 2);
+    QCOMPARE(t.points[1].y, 70000);
+    QCOMPARE(t.points[1].label, QStringLiteral("b"));
+
+    // the unknown keys are skipped, and the missing fields are kept.
+    QVariantMap map;
+    map.insert(QStringLiteral("y"), 5);
+    map.insert(QStringLiteral("extra"), QVariantList() << 1 << QStringLiteral("x"));
+    QByteArray mapBytes;
+    MsgPackStream ms(&mapBytes, QIODevice::WriteOnly);
+    ms << QVariant(map);
+    MsgPackStream ps(mapBytes);
+    TestPoint point { 7, 0, QString() };
+    ps >> point;
+    QVERIFY(ps.status() == MsgPackStream::Ok);
+    QCOMPARE(point.x, 7);
+    QCOMPARE(point.y, 5);
+}
+
+void TestMsgPack::testDecoder()
+{
+    QVariantMap map;
+    map.insert(QStringLiteral("name"), QStringLiteral("qtng"));
+    map.insert(QStringLiteral("list"), QVariantList() << 1 << QVariantList() << QByteArray(300, 'x'));
+    QByteArray bytes;
+    MsgPackStream os(&bytes, QIODevice::WriteOnly);
+    os << QVariant(map) << 42 << QString();
+
+    // the chunks are fed byte by byte, the messages are complete only after their last byte.
+    MsgPackDecoder decoder;
+    QList<QVariant> values;
+    for (int i = 0; i < bytes.size(); ++i) {
+        QVERIFY(decoder.feed(bytes.constData() + i, 1));
+        while (decoder.hasMessage()) {
+            values.append(decoder.takeVariant());
+        }
+    }
+    QCOMPARE(values.size(), 3);
+    QCOMPARE(values[0].toMap().value(QStringLiteral("name")).toString(), QStringLiteral("qtng"));
+    QCOMPARE(values[0].toMap().value(QStringLiteral("list")).toList()[2].toByteArray().size(), 300);
+    QCOMPARE(values[1].toInt(), 42);
+    QCOMPARE(decoder.pendingBytes(), 0);
+
+    MsgPackDecoder limited;
+    limited.setMaxDepth(2);
+    QByteArray nested;
+    MsgPackStream ns(&nested, QIODevice::WriteOnly);
+    ns << QVariant(QVariantList() << QVariant(QVariantList() << QVariant(QVariantList() << 1)));
+    QVERIFY(!limited.feed(nested));
+    QVERIFY(limited.isBroken());
+
+    limited.reset();
+    limited.setMaxSize(100);
+    QVERIFY(!limited.feed(bytes));
+}
+
+void TestMsgPack::testStreamingWriter()
+{
+    QVariantMap map;
+    map.insert(QStringLiteral("id"), 1);
+    map.insert(QStringLiteral("tags"), QStringList() << QStringLiteral("a") << QStringLiteral("b"));
+    const QByteArray &encoded = msgPackEncode(QVariant(map));
+    QByteArray expected;
+    MsgPackStream es(&expected, QIODevice::WriteOnly);
+    es << QVariant(map);
+    QCOMPARE(encoded, expected);
+
+    // the headers are patched with the counts after the items are written.
+    QByteArray bs;
+    MsgPackStream os(&bs, QIODevice::WriteOnly);
+    QVERIFY(os.beginMap());
+    quint32 entries = 0;
+    for (int i = 0; i < 20; ++i, ++entries) {
+        os << QString::number(i);
+        QVERIFY(os.beginArray());
+        os << i << (i * 2);
+        QVERIFY(os.endArray(2));
+    }
+    QVERIFY(os.endMap(entries));
+    QVERIFY(!os.endMap(0));
+    QCOMPARE(os.position(), static_cast<qint64>(bs.size()));
+
+    QVariant v;
+    MsgPackStream is(bs);
+    is >> v;
+    QVERIFY(is.status() == MsgPackStream::Ok);
+    QCOMPARE(v.toMap().size(), 20);
+    QCOMPARE(v.toMap().value(QStringLiteral("19")).toList()[1].toInt(), 38);
+}
+
+void TestMsgPack::testDocument()
+{
+    QVariantMap map;
+    map.insert(QStringLiteral("zeta"), QVariantList() << 1 << -2 << 3.5 << QStringLiteral("x"));
+    map.insert(QStringLiteral("alpha"), true);
+    map.insert(QStringLiteral("big"), std::numeric_limits<quint64>::max());
+    QVariantMap child;
+    child.insert(QStringLiteral("name"), QStringLiteral("qtng"));
+    map.insert(QStringLiteral("child"), child);
+    QByteArray bs;
+    MsgPackStream os(&bs, QIODevice::WriteOnly);
+    os << QVariant(map);
+
+    MsgPackDocument doc;
+    QVERIFY(doc.parse(bs));
+    const MsgPackValue &root = doc.root();
+    QCOMPARE(root.type(), MsgPackView::Map);
+    QCOMPARE(root.count(), 4);
+    QVERIFY(root.keyAt(0).equals("alpha"));
+    QVERIFY(root.value("alpha").toBool());
+    QCOMPARE(root.value("zeta").at(1).toInteger(), -2LL);
+    QCOMPARE(root.value("zeta").at(2).toDouble(), 3.5);
+    QCOMPARE(root.value("big").toUnsignedInteger(), std::numeric_limits<quint64>::max());
+    QCOMPARE(root.value("child").value("name").toString(), QStringLiteral("qtng"));
+    QVERIFY(!root.value("missing").isValid());
+    QCOMPARE(root.toVariant().toMap().value(QStringLiteral("zeta")).toList().size(), 4);
+
+    QVERIFY(!doc.parse(bs.left(bs.size() - 1)));
+    QVERIFY(!doc.root().isValid());
+}
+
+void TestMsgPack::testUtf8()
+{
+    // the ascii fast path falls back to utf8 in the middle of string.
+    const QString mixed = QStringLiteral("abcdefgh") + QString::fromUtf8("\xe4\xb8\xad\xf0\x9f\x98\x80");
+    QByteArray bs;
+    MsgPackStream os(&bs, QIODevice::WriteOnly);
+    os << QStringLiteral("ascii only") << mixed;
+    QVERIFY(os.writeUtf8("raw", 3));
+
+    MsgPackStream is(bs);
+    QString ascii;
+    QByteArray utf8, raw;
+    is >> ascii;
+    QVERIFY(is.readUtf8(utf8));
+    QVERIFY(is.readUtf8(raw));
+    QCOMPARE(ascii, QStringLiteral("ascii only"));
+    QCOMPARE(utf8, mixed.toUtf8());
+    QCOMPARE(raw, QByteArray("raw"));
+    QVERIFY(is.atEnd());
+
+    QVERIFY(MsgPackStream::isValidUtf8(utf8.constData(), utf8.size()));
+    QVERIFY(!MsgPackStream::isValidUtf8("\xc0\xaf", 2));           // overlong.
+    QVERIFY(!MsgPackStream::isValidUtf8("\xed\xa0\x80", 3));       // surrogate.
+    QVERIFY(!MsgPackStream::isValidUtf8("abcdefgh\xe4\xb8", 10));   // truncated.
+
+    QByteArray invalid;
+    MsgPackStream ws(&invalid, QIODevice::WriteOnly);
+    ws.writeUtf8("\xff", 1);
+    MsgPackStream rs(invalid);
+    QVERIFY(!rs.readUtf8(utf8));
+    QVERIFY(rs.status() == MsgPackStream::ReadCorruptData);
+}
+
+void TestMsgPack::testExtTypes()
+{
+    MsgPackStream::registerExtType<QUuid>(7);
+    const QUuid uuid = QUuid::createUuid();
+    QByteArray bs;
+    MsgPackStream os(&bs, QIODevice::WriteOnly);
+    os << uuid << QVariant(uuid);
+    QCOMPARE(bs.size(), 2 * 18);
+
+    MsgPackStream is(bs);
+    QUuid typed;
+    QVariant v;
+    is >> typed >> v;
+    QVERIFY(is.status() == MsgPackStream::Ok);
+    QCOMPARE(typed, uuid);
+    QCOMPARE(v.userType(), qMetaTypeId<QUuid>());
+    QCOMPARE(v.value<QUuid>(), uuid);
+
+    // the 32 bits timestamp written by other implementations.
+    const char timestamp32[] = "\xd6\xff\x00\x00\x00\x3c";
+    MsgPackStream ts(QByteArray(timestamp32, 6));
+    QDateTime dt;
+    ts >> dt;
+    QVERIFY(ts.status() == MsgPackStream::Ok);
+    QCOMPARE(dt.toMSecsSinceEpoch(), 60000LL);
+
+    MsgPackStream::registerExtType(7, 0, nullptr, nullptr);
+    MsgPackStream ws(bs);
+    ws >> typed >> v;
+    QVERIFY(v.canConvert<MsgPackExtData>());
+    QCOMPARE(v.value<MsgPackExtData>().payload.size(), 16);
+}
+
+void TestMsgPack::testJson()
+{
+    const QByteArray json = "{\"name\": \"q\\\"t\\u00e9\\ud83d\\ude00\", \"list\": [1, -2, 3.5, 1e3, true, null, [], {}],"
+                            " \"big\": 18446744073709551615}";
+    const QByteArray &msgpack = jsonToMsgPack(json);
+    QVERIFY(!msgpack.isNull());
+    QVariant v;
+    MsgPackStream is(msgpack);
+    is >> v;
+    QVERIFY(is.status() == MsgPackStream::Ok);
+    const QVariantMap &map = v.toMap();
+    QCOMPARE(map.value(QStringLiteral("name")).toString(), QString::fromUtf8("q\"t\xc3\xa9\xf0\x9f\x98\x80"));
+    const QVariantList &list = map.value(QStringLiteral("list")).toList();
+    QCOMPARE(list.size(), 8);
+    QCOMPARE(list[1].toInt(), -2);
+    QCOMPARE(list[3].toDouble(), 1000.0);
+    QVERIFY(!list[5].isValid());
+    QCOMPARE(map.value(QStringLiteral("big")).toULongLong(), std::numeric_limits<quint64>::max());
+
+    QCOMPARE(msgPackToJson(msgpack), QByteArray("{\"name\":\"q\\\"t\xc3\xa9\xf0\x9f\x98\x80\",\"list\":[1,-2,3.5,1000,true,"
+                                                 "null,[],{}],\"big\":18446744073709551615}"));
+    QVERIFY(jsonToMsgPack(QByteArray("[1, 2")).isNull());
+    QVERIFY(jsonToMsgPack(QByteArray("{\"a\": 01}")).isNull());
+    QVERIFY(msgPackToJson(msgpack.left(msgpack.size() - 1)).isNull());
+}
+
 QTEST_MAIN(TestMsgPack)
 #include "test_msgpack.moc"
@@ -1,18 +1,244 @@
-#include <QtCore/qdebug.h>
-#include <QtCore/qcoreapplication.h>
-#include "../qtnetworkng.h"
+#include <QtTest>
+#include "qtnetworkng.h"
 
 using namespace qtng;
 
-int main(int argc, char **argv)
-{
-    SslSocket s;
-    bool ok = s.connect("www.baidu.com", 443);
-    s.sendall("GET / HTTP/1.0\r\nHost: www.baidu.com\r\n\r\n");
-    const QByteArray &data = s.recvall(1024 * 1024);
-    qDebug() << QString::fromUtf8(data);
-    Certificate cert = s.peerCertificate();
-    QList<Certificate> certs = s.peerCertificateChain();
-    qDebug() << cert.digest() << certs.size() << s.cipher().name();
-    return 0;
+class TestSocket: public QObject
+{
+    Q_OBJECT
+private slots:
+    void testSocketIoStats();
+    void testSocketCork();
+    void testNetworkImpairment();
+    void testRecvSizer();
+    void testUnixSocket();
+    void testConnectionLimits();
+};
+
+
+void TestSocket::testSocketIoStats()
+{
+    Socket::setIoStatsEnabled(true);
+    const SocketIoStats &before = Socket::totalIoStats();
+    Socket server;
+    QVERIFY(server.bind(QHostAddress::LocalHost, 0));
+    QVERIFY(server.listen(1));
+    Socket client;
+    QVERIFY(client.connect(QHostAddress::LocalHost, server.localPort()));
+    QScopedPointer<Socket> request(server.accept());
+    QVERIFY(!request.isNull());
+    CoroutineGroup operations;
+    operations.spawn([&client] {
+        Coroutine::msleep(50);
+        client.sendall("hello", 5);
+    });
+    // waits for the data, which is counted as a read wait.
+    QCOMPARE(request->recvall(5), QByteArray("hello"));
+    operations.joinall();
+    Socket::setIoStatsEnabled(false);
+
+    const SocketIoStats &stats = request->ioStats();
+    QCOMPARE(stats.bytesReceived, 5ull);
+    QVERIFY(stats.recvCalls >= 1);
+    QVERIFY(stats.readWaits >= 1);
+    QVERIFY(stats.readWaitNsecs > 0);
+    QCOMPARE(client.ioStats().bytesSent, 5ull);
+    QCOMPARE(client.ioStats().connects, 1ull);
+    QVERIFY(Socket::totalIoStats().bytesSent >= before.bytesSent + 5);
+    // the sockets made after disabling do not count.
+    Socket other;
+    QCOMPARE(other.ioStats().sendCalls, 0ull);
+}
+
+
+void TestSocket::testSocketCork()
+{
+    Socket server;
+    QVERIFY(server.bind(QHostAddress::LocalHost, 0));
+    QVERIFY(server.listen(1));
+    Socket client;
+    QVERIFY(client.connect(QHostAddress::LocalHost, server.localPort()));
+    QScopedPointer<Socket> request(server.accept());
+    QVERIFY(!request.isNull());
+#ifdef Q_OS_LINUX
+    QVERIFY(client.cork());
+    QCOMPARE(client.option(Socket::CorkOption).toInt(), 1);
+    QVERIFY(client.setOption(Socket::NotSentLowWatermarkOption, 1024 * 16));
+    QCOMPARE(client.option(Socket::NotSentLowWatermarkOption).toInt(), 1024 * 16);
+#else
+    client.cork();
+#endif
+    QCOMPARE(client.sendall("hello", 5), 5);
+    QCOMPARE(client.sendall(" world", 6), 6);
+    // the held segment is sent at once, not after 200ms.
+    client.uncork();
+    QElapsedTimer timer;
+    timer.start();
+    QCOMPARE(request->recvall(11), QByteArray("hello world"));
+    QVERIFY(timer.elapsed() < 150);
+}
+
+
+void TestSocket::testNetworkImpairment()
+{
+    NetworkImpairment impairment;
+    impairment.lossRate = 0.3f;
+    impairment.latencyMsecs = 20;
+    QSharedPointer<Socket> receiver(new Socket(Socket::IPv4Protocol, Socket::UdpSocket));
+    QVERIFY(receiver->bind(QHostAddress::LocalHost, 0));
+    QSharedPointer<Socket> sender(new Socket(Socket::IPv4Protocol, Socket::UdpSocket));
+    // the same seed drops the same datagrams.
+    NetworkImpairer first(impairment), second(impairment);
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < 100; ++i) {
+        const QByteArray &datagram = QByteArray::number(i);
+        QCOMPARE(first.sendto(sender, datagram.constData(), datagram.size(), QHostAddress::LocalHost, receiver->localPort()), datagram.size());
+        QCOMPARE(second.sendto(sender, datagram.constData(), datagram.size(), QHostAddress::LocalHost, receiver->localPort()), datagram.size());
+    }
+    const quint64 dropped = first.stats().dropped;
+    QCOMPARE(second.stats().dropped, dropped);
+    QVERIFY(dropped > 10 && dropped < 50);
+    char buf[16];
+    int received = 0;
+    while (received < static_cast<int>(200 - dropped * 2)) {
+        QVERIFY(receiver->recv(buf, sizeof(buf)) > 0);
+        if (received++ == 0) {
+            QVERIFY(timer.elapsed() >= 15);
+        }
+    }
+
+    // the streams are delayed in order.
+    impairment.lossRate = 0.0f;
+    QSharedPointer<NetworkImpairer> impairer(new NetworkImpairer(impairment));
+    Socket listener;
+    QVERIFY(listener.bind(QHostAddress::LocalHost, 0) && listener.listen(1));
+    QSharedPointer<Socket> client(new Socket());
+    QVERIFY(client->connect(QHostAddress::LocalHost, listener.localPort()));
+    QScopedPointer<Socket> server(listener.accept());
+    QVERIFY(!server.isNull());
+    QSharedPointer<SocketLike> stream = impaired(impairer, SocketLike::rawSocket(client));
+    timer.restart();
+    QCOMPARE(stream->sendall("hello"), 5);
+    QCOMPARE(stream->sendall(" world"), 6);
+    QVERIFY(timer.elapsed() < 15);
+    QCOMPARE(server->recvall(11), QByteArray("hello world"));
+    QVERIFY(timer.elapsed() >= 15);
+    QCOMPARE(impairer->stats().delayed, 2ull);
+    stream->close();
+}
+
+
+void TestSocket::testRecvSizer()
+{
+    RecvSizer sizer(1024 * 8, 1024, 1024 * 64);
+    sizer.record(1024 * 8);
+    QCOMPARE(sizer.next(), 1024 * 32);
+    sizer.record(1024 * 32);
+    QCOMPARE(sizer.next(), 1024 * 64);
+    sizer.record(0);
+    QCOMPARE(sizer.next(), 1024 * 64);
+    // shrinks after two small reads in a row only.
+    sizer.record(100);
+    QCOMPARE(sizer.next(), 1024 * 64);
+    sizer.record(1024 * 40);
+    sizer.record(100);
+    QCOMPARE(sizer.next(), 1024 * 64);
+    sizer.record(100);
+    QCOMPARE(sizer.next(), 1024 * 32);
+    for (int i = 0; i < 20; ++i) {
+        sizer.record(10);
+    }
+    QCOMPARE(sizer.next(), 1024);
+
+    QSharedPointer<SocketLike> connection = SocketLike::rawSocket(new Socket());
+    QVERIFY(recvSizerOf(connection.data()) == &connection->recvSizer);
+    Socket raw;
+    QVERIFY(recvSizerOf(&raw) == nullptr);
+}
+
+
+class EchoRequestHandler: public BaseRequestHandler
+{
+public:
+    EchoRequestHandler(QSharedPointer<SocketLike> request, BaseStreamServer *server)
+        :BaseRequestHandler(request, server) {}
+protected:
+    virtual void handle() override
+    {
+        while (true) {
+            const QByteArray &data = request->recv(1024);
+            if (data.isEmpty() || request->sendall(data) != data.size()) {
+                return;
+            }
+        }
+    }
+};
+
+
+void TestSocket::testUnixSocket()
+{
+#ifndef Q_OS_UNIX
+    QSKIP("unix sockets are not supported by windows.");
+#else
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString &path = dir.path() + QStringLiteral("/echo.sock");
+    TcpServer<EchoRequestHandler> server(path);
+    QVERIFY(server.start());
+    QCOMPARE(server.serverPath(), path);
+    // the file of a live server is not removed by another one.
+    TcpServer<EchoRequestHandler> other(path);
+    QVERIFY(!other.start());
+    QVERIFY(QFile::exists(path));
+
+    Socket client(Socket::UnixProtocol);
+    QVERIFY(client.connectPath(path));
+    QCOMPARE(client.peerPath(), path);
+    QCOMPARE(client.sendall("hello", 5), 5);
+    char buf[5];
+    QCOMPARE(client.recvall(buf, 5), 5);
+    QCOMPARE(QByteArray(buf, 5), QByteArray("hello"));
+    client.close();
+    server.stop();
+    QVERIFY(!QFile::exists(path));
+#endif
 }
+
+
+void TestSocket::testConnectionLimits()
+{
+    TcpServer<EchoRequestHandler> server(QHostAddress::LocalHost, 0);
+    server.setMaxConnections(1);
+    server.setOverloadAction(BaseStreamServer::RejectConnections);
+    QVERIFY(server.start());
+    char c;
+    Socket first;
+    QVERIFY(first.connect(QHostAddress::LocalHost, server.serverPort()));
+    QCOMPARE(first.sendall("a", 1), 1);
+    QCOMPARE(first.recvall(&c, 1), 1);
+
+    // the connection over the limit is accepted and closed at once.
+    Socket second;
+    QVERIFY(second.connect(QHostAddress::LocalHost, server.serverPort()));
+    {
+        Timeout _(5.0);
+        QVERIFY(second.recv(&c, 1) <= 0);
+    }
+    QCOMPARE(server.stats().rejectedConnections, 1ull);
+    QCOMPARE(server.stats().activeConnections, 1);
+
+    // the slot is given back after the first one closes.
+    first.close();
+    Coroutine::msleep(50);
+    Socket third;
+    QVERIFY(third.connect(QHostAddress::LocalHost, server.serverPort()));
+    QCOMPARE(third.sendall("b", 1), 1);
+    QCOMPARE(third.recvall(&c, 1), 1);
+    QCOMPARE(c, 'b');
+}
+
+
+QTEST_MAIN(TestSocket)
+
+#include "test_socket.moc"
@@ -12,6 +12,13 @@ private slots:
 //    void testSocks5Proxy();
     void testVersion10();
     void testServer();
+    void testServerNames();
+    void testOcspResponse();
+    void testDtls();
+    void testBufferRelease();
+    void testFullDuplex();
+    void testSessionReuse();
+    void testPollBuffered();
 };
 
 
@@ -95,6 +102,266 @@ void TestSsl::testServer()
     }
     clientCoroutine->join();
 }
+
+
+void TestSsl::testServerNames()
+{
+    SslConfiguration config = SslConfiguration::testPurpose("Goldfish", "CN", "Example");
+    const SslConfiguration &shark = SslConfiguration::testPurpose("Shark", "CN", "Example");
+    SslServerNames names;
+    names.insert("*.example.com", shark);
+    config.setServerNames(names);
+    SslConfiguration unknown;
+    QVERIFY(!names.find("example.com", &unknown));
+    QVERIFY(!names.find("a.b.example.com", &unknown));
+
+    SslSocket server(Socket::AnyIPProtocol, config);
+    QVERIFY(server.bind());
+    server.listen(100);
+    quint16 port = server.localPort();
+    QSharedPointer<Coroutine> clientCoroutine(Coroutine::spawn([port]{
+        SslConfiguration clientConfig;
+        clientConfig.setPeerVerifyName("www.Example.com");
+        SslSocket client(Socket::AnyIPProtocol, clientConfig);
+        if (!client.connect(QHostAddress::LocalHost, port)) {
+            return;
+        }
+        client.sendall("fish is here.");
+        client.close();
+    }));
+    {
+        Timeout _(5.0);
+        QSharedPointer<SslSocket> request = server.accept();
+        QVERIFY(!request.isNull());
+        QCOMPARE(request->localCertificate().digest(MessageDigest::Sha256),
+                 shark.localCertificate().digest(MessageDigest::Sha256));
+        QCOMPARE(request->recv(1024), QByteArray("fish is here."));
+    }
+    clientCoroutine->join();
+}
+
+
+void TestSsl::testOcspResponse()
+{
+    SslConfiguration config = SslConfiguration::testPurpose("Goldfish", "CN", "Example");
+    const SslConfiguration copy = config;
+    config.setOcspResponse("response");
+    QCOMPARE(copy.ocspResponse(), QByteArray("response"));
+    // the self-signed certificate names no responder.
+    QVERIFY(config.refreshOcspResponse() < 0);
+    config.setLocalCertificate(copy.localCertificate());
+    QVERIFY(config.ocspResponse().isEmpty());
+}
+
+
+void TestSsl::testDtls()
+{
+    const SslConfiguration &config = SslConfiguration::testPurpose("Goldfish", "CN", "Example");
+    const SslConfiguration clientConfig;
+    quint16 port = 0;
+    // the second client resumes the session of first one.
+    for (int i = 0; i < 2; ++i) {
+        QSharedPointer<Socket> rawServer(new Socket(Socket::IPv4Protocol, Socket::UdpSocket));
+        QVERIFY(rawServer->bind(QHostAddress::LocalHost, port));
+        port = rawServer->localPort();
+        QSharedPointer<Coroutine> clientCoroutine(Coroutine::spawn([port, clientConfig] {
+            QSharedPointer<Socket> rawClient(new Socket(Socket::IPv4Protocol, Socket::UdpSocket));
+            if (!rawClient->connect(QHostAddress::LocalHost, port)) {
+                return;
+            }
+            DtlsSocket client(rawClient, clientConfig);
+            if (!client.handshake(false)) {
+                return;
+            }
+            client.send("fish is here.");
+            client.recv(1024);
+            client.close();
+        }));
+        {
+            Timeout _(5.0);
+            DtlsSocket server(rawServer, config);
+            QVERIFY(server.handshake(true));
+            QCOMPARE(server.isResumed(), i == 1);
+            QCOMPARE(server.recv(1024), QByteArray("fish is here."));
+            QCOMPARE(server.send("echo"), 4);
+            QVERIFY(server.recv(1024).isEmpty());
+        }
+        clientCoroutine->join();
+    }
+}
+
+
+void TestSsl::testBufferRelease()
+{
+    SslConfiguration config = SslConfiguration::testPurpose("Goldfish", "CN", "Example");
+    config.setBufferReleaseEnabled(true);
+    QVERIFY(config.bufferReleaseEnabled());
+    SslSocket server(Socket::AnyIPProtocol, config);
+    QVERIFY(server.bind());
+    server.listen(100);
+    quint16 port = server.localPort();
+    // the big messages grow the memory bios, which are replaced while the server waits for the next one.
+    QSharedPointer<Coroutine> clientCoroutine(Coroutine::spawn([port]{
+        SslSocket client;
+        if (!client.connect(QHostAddress::LocalHost, port)) {
+            return;
+        }
+        for (int i = 0; i < 3; ++i) {
+            const QByteArray &message = QByteArray(1024 * 32, 'a' + i);
+            client.sendall(message);
+            if (client.recvall(message.size()) != message) {
+                return;
+            }
+        }
+        client.close();
+    }));
+    {
+        Timeout _(5.0);
+        QSharedPointer<SslSocket> request = server.accept();
+        QVERIFY(!request.isNull());
+        for (int i = 0; i < 3; ++i) {
+            const QByteArray &message = request->recvall(1024 * 32);
+            QCOMPARE(message, QByteArray(1024 * 32, 'a' + i));
+            QCOMPARE(request->sendall(message), message.size());
+        }
+    }
+    clientCoroutine->join();
+}
+
+
+// one coroutine sends while the other receives on the same socket, so the reader pumps the records out while the
+// writer is blocked in sending them.
+static bool exchangeFullDuplex(QSharedPointer<SslSocket> socket, char first)
+{
+    const int blocks = 256;
+    const int blockSize = 1024 * 16;
+    CoroutineGroup operations;
+    bool sent = false;
+    operations.spawn([socket, first, &sent] {
+        for (int i = 0; i < blocks; ++i) {
+            const QByteArray &block = QByteArray(blockSize, static_cast<char>(first + i % 16));
+            if (socket->sendall(block) != blockSize) {
+                return;
+            }
+        }
+        sent = true;
+    });
+    const char peerFirst = first == 'a' ? 'A' : 'a';
+    bool received = true;
+    for (int i = 0; i < blocks && received; ++i) {
+        received = socket->recvall(blockSize) == QByteArray(blockSize, static_cast<char>(peerFirst + i % 16));
+    }
+    operations.joinall();
+    return sent && received;
+}
+
+
+void TestSsl::testFullDuplex()
+{
+    SslConfiguration config = SslConfiguration::testPurpose("Goldfish", "CN", "Example");
+    SslSocket server(Socket::AnyIPProtocol, config);
+    QVERIFY(server.bind());
+    server.listen(100);
+    quint16 port = server.localPort();
+    bool clientOk = false;
+    QSharedPointer<Coroutine> clientCoroutine(Coroutine::spawn([port, &clientOk] {
+        QSharedPointer<SslSocket> client(new SslSocket());
+        if (!client->connect(QHostAddress::LocalHost, port)) {
+            return;
+        }
+        clientOk = exchangeFullDuplex(client, 'a');
+    }));
+    {
+        Timeout _(10.0);
+        QSharedPointer<SslSocket> request = server.accept();
+        QVERIFY(!request.isNull());
+        QVERIFY(exchangeFullDuplex(request, 'A'));
+    }
+    clientCoroutine->join();
+    QVERIFY(clientOk);
+}
+
+
+// the connections of one HttpSession share its SslConfiguration, so a reconnection resumes the tls session.
+void TestSsl::testSessionReuse()
+{
+    SslConfiguration config = SslConfiguration::testPurpose("Goldfish", "CN", "Example");
+    SslSocket server(Socket::AnyIPProtocol, config);
+    QVERIFY(server.bind());
+    server.listen(100);
+    quint16 port = server.localPort();
+    QList<bool> resumed;
+    QSharedPointer<Coroutine> serverCoroutine(Coroutine::spawn([&server, &resumed] {
+        for (int i = 0; i < 2; ++i) {
+            QSharedPointer<SslSocket> request = server.accept();
+            if (request.isNull()) {
+                return;
+            }
+            resumed.append(request->isResumed());
+            QByteArray head;
+            while (!head.contains("\r\n\r\n")) {
+                const QByteArray &data = request->recv(1024);
+                if (data.isEmpty()) {
+                    return;
+                }
+                head.append(data);
+            }
+            // closed by the server, so the next request makes a new connection.
+            request->sendall("HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok");
+            request->close();
+        }
+    }));
+    {
+        Timeout _(10.0);
+        HttpSession session;
+        const QString &url = QStringLiteral("https://127.0.0.1:%1/").arg(port);
+        QVERIFY(session.get(url).isOk());
+        QVERIFY(session.get(url).isOk());
+    }
+    serverCoroutine->join();
+    QCOMPARE(resumed.size(), 2);
+    QVERIFY(!resumed.at(0));
+    QVERIFY(resumed.at(1));
+}
+
+
+// the rest of a record is decrypted already, so Poll reports it without the descriptor being readable.
+void TestSsl::testPollBuffered()
+{
+    SslConfiguration config = SslConfiguration::testPurpose("Goldfish", "CN", "Example");
+    SslSocket server(Socket::AnyIPProtocol, config);
+    QVERIFY(server.bind());
+    server.listen(100);
+    quint16 port = server.localPort();
+    Event done;
+    QSharedPointer<Coroutine> serverCoroutine(Coroutine::spawn([&server, &done] {
+        QSharedPointer<SslSocket> request = server.accept();
+        if (request.isNull()) {
+            return;
+        }
+        request->sendall("abcdef");
+        done.wait();
+    }));
+    {
+        Timeout _(10.0);
+        QSharedPointer<SslSocket> client(new SslSocket());
+        QVERIFY(client->connect(QHostAddress::LocalHost, port));
+        QCOMPARE(client->recvall(2), QByteArray("ab"));
+        QVERIFY(client->bufferedBytes() > 0);
+        Poll poll;
+        QSharedPointer<SocketLike> s = SocketLike::sslSocket(client);
+        QVERIFY(poll.add(s, EventLoopCoroutine::Read));
+        const QVector<PollEvent> &events = poll.waitmany(1.0);
+        QCOMPARE(events.size(), 1);
+        QVERIFY(events.first().socketLike == s);
+        QVERIFY(events.first().events & EventLoopCoroutine::Read);
+        QCOMPARE(client->recv(1024), QByteArray("cdef"));
+    }
+    done.set();
+    serverCoroutine->join();
+}
+
+
 QTEST_MAIN(TestSsl)
 
 #include "test_ssl.moc"